@@ -75,6 +75,28 @@ int main(int argc, char** argv) {
             UNSET(HAVE_AVX2 CACHE)
         ENDIF()
     ENDIF()
+    SET(ASM_CODE "vpaddd %zmm0, %zmm0, %zmm0")
+    ASM_OP(HAVE_AVX512 "avx512")
+    IF(HAVE_AVX512)
+        CHECK_C_SOURCE_COMPILES(
+                "
+#pragma GCC push_options
+#pragma GCC target(\"avx512f\")
+#include <immintrin.h>
+static int foo(int a) __attribute__((__target__(\"avx512f\")));
+static int foo(int a)
+{
+	__m512i v = _mm512_rol_epi32(_mm512_set1_epi32(a), 7);
+	return _mm512_cmplt_epu32_mask(v, _mm512_set1_epi32(a));
+}
+int main(int argc, char** argv) {
+	return foo(argc);
+}" HAVE_AVX512_C_COMPILER)
+        IF(NOT HAVE_AVX512_C_COMPILER)
+            MESSAGE(STATUS "Your compiler has broken AVX512 support")
+            UNSET(HAVE_AVX512 CACHE)
+        ENDIF()
+    ENDIF()
     SET(ASM_CODE "vpaddq %xmm0, %xmm0, %xmm0")
     ASM_OP(HAVE_AVX "avx")
     SET(ASM_CODE "pmuludq %xmm0, %xmm0")
@@ -87,6 +109,18 @@ int main(int argc, char** argv) {
     ASM_OP(HAVE_SSE41 "sse41")
     SET(ASM_CODE "crc32 %eax, %eax")
     ASM_OP(HAVE_SSE42 "sse42")
+    SET(ASM_CODE "aesenc %xmm0, %xmm0")
+    ASM_OP(HAVE_AESNI "aesni")
+ENDIF()
+
+# Advanced SIMD is mandatory for aarch64
+IF("${ARCH}" STREQUAL "aarch64")
+    CHECK_C_SOURCE_COMPILES("
+#include <arm_neon.h>
+int main(int argc, char** argv) {
+	uint32x4_t v = vdupq_n_u32(argc);
+	return vgetq_lane_u32(vaddq_u32(v, v), 0);
+}" HAVE_NEON)
 ENDIF()
 
 IF ("${ARCH}" STREQUAL "x86_64")
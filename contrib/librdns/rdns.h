@@ -383,6 +383,28 @@ struct rdns_request* rdns_make_request_full (
 		...
 		);
 
+/**
+ * Make a request that is replied with the specified data without sending
+ * anything to the network (e.g. from some external cache). Reply is delivered
+ * asynchronously just like for fake replies
+ * @param resolver resolver object
+ * @param cb callback to call on resolve completing
+ * @param ud user data for callback
+ * @param name name requested
+ * @param type request type
+ * @param rcode reply code
+ * @param entries reply entries, they are NOT owned by a request
+ * @return opaque request object or NULL
+ */
+struct rdns_request* rdns_make_request_cached (
+		struct rdns_resolver *resolver,
+		dns_callback_type cb,
+		void *cbdata,
+		const char *name,
+		enum rdns_request_type type,
+		enum dns_rcode rcode,
+		struct rdns_reply_entry *entries);
+
 /**
  * Get textual presentation of DNS error code
  */
@@ -857,6 +857,89 @@ rdns_make_request_full (
 	return req;
 }
 
+struct rdns_request*
+rdns_make_request_cached (struct rdns_resolver *resolver,
+		dns_callback_type cb,
+		void *cbdata,
+		const char *name,
+		enum rdns_request_type type,
+		enum dns_rcode rcode,
+		struct rdns_reply_entry *entries)
+{
+	struct rdns_request *req;
+	struct rdns_server *serv;
+	size_t nlen;
+
+	if (resolver == NULL || !resolver->initialized || name == NULL) {
+		return NULL;
+	}
+
+	req = calloc (1, sizeof (struct rdns_request));
+	if (req == NULL) {
+		rdns_err ("failed to allocate memory for request: %s",
+				strerror (errno));
+		return NULL;
+	}
+
+	req->requested_names = calloc (1, sizeof (struct rdns_request_name));
+	if (req->requested_names == NULL) {
+		free (req);
+		rdns_err ("failed to allocate memory for request data: %s",
+				strerror (errno));
+
+		return NULL;
+	}
+
+	req->resolver = resolver;
+	req->func = cb;
+	req->arg = cbdata;
+	req->qcount = 1;
+	req->state = RDNS_REQUEST_NEW;
+	REF_INIT_RETAIN (req, rdns_request_free);
+
+	nlen = strlen (name);
+	req->requested_names[0].name = malloc (nlen + 1);
+
+	if (req->requested_names[0].name == NULL) {
+		REF_RELEASE (req);
+		return NULL;
+	}
+
+	memcpy (req->requested_names[0].name, name, nlen + 1);
+	req->requested_names[0].len = nlen;
+	req->requested_names[0].type = type;
+
+	req->reply = rdns_make_reply (req, rcode);
+
+	if (req->reply == NULL) {
+		REF_RELEASE (req);
+		return NULL;
+	}
+
+	/* Entries are not freed for fake requests */
+	req->reply->entries = entries;
+	req->state = RDNS_REQUEST_FAKE;
+	req->async = resolver->async;
+
+	serv = rdns_select_request_upstream (resolver, req, false, NULL);
+
+	if (serv == NULL) {
+		rdns_warn ("cannot find suitable server for request");
+		REF_RELEASE (req);
+		return NULL;
+	}
+
+	/* Socket is used merely to deliver reply on the next loop iteration */
+	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
+	req->async_event = resolver->async->add_write (resolver->async->data,
+			req->io->sock, req);
+
+	REF_RETAIN (req->io);
+	REF_RETAIN (req->resolver);
+
+	return req;
+}
+
 bool
 rdns_resolver_init (struct rdns_resolver *resolver)
 {
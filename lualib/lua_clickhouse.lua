@@ -24,6 +24,7 @@ local rspamd_logger = require "rspamd_logger"
 local rspamd_http = require "rspamd_http"
 local lua_util = require "lua_util"
 local rspamd_text = require "rspamd_text"
+local rspamd_util = require "rspamd_util"
 
 local exports = {}
 local N = 'clickhouse'
@@ -34,62 +35,9 @@ local function escape_spaces(query)
   return query:gsub('%s', '%%20')
 end
 
-local function ch_number(a)
-  if (a+2^52)-2^52 == a then
-    -- Integer
-    return tostring(math.floor(a))
-  end
-
-  return tostring(a)
-end
-
-local function clickhouse_quote(str)
-  if str then
-    return str:gsub('[\'\\\n\t\r]', {
-      ['\''] = [[\']],
-      ['\\'] = [[\\]],
-      ['\n'] = [[\n]],
-      ['\t'] = [[\t]],
-      ['\r'] = [[\r]],
-    })
-  end
-
-  return ''
-end
-
--- Converts an array to a string suitable for clickhouse
-local function array_to_string(ar)
-  for i,elt in ipairs(ar) do
-    local t = type(elt)
-    if t == 'string' then
-      ar[i] = string.format('\'%s\'', clickhouse_quote(elt))
-    elseif t == 'userdata' then
-      ar[i] = string.format('\'%s\'', clickhouse_quote(tostring(elt)))
-    elseif t == 'number' then
-      ar[i] = ch_number(elt)
-    end
-  end
-
-  return table.concat(ar, ',')
-end
-
 -- Converts a row into TSV, taking extra care about arrays
 local function row_to_tsv(row)
-
-  for i,elt in ipairs(row) do
-    local t = type(elt)
-    if t == 'table' then
-      row[i] = '[' .. array_to_string(elt) .. ']'
-    elseif t == 'number' then
-      row[i] = ch_number(elt)
-    elseif t == 'userdata' then
-      row[i] = clickhouse_quote(tostring(elt))
-    else
-      row[i] = clickhouse_quote(elt)
-    end
-  end
-
-  return rspamd_text.fromtable(row, '\t')
+  return rspamd_util.clickhouse_tsv_row(row)
 end
 
 exports.row_to_tsv = row_to_tsv
@@ -375,6 +323,7 @@ end
 -- @param {upstream} upstream clickhouse server upstream
 -- @param {table} settings global settings table:
 --   * use_gsip: use gzip compression
+--   * use_zstd: use zstd compression (takes precedence over gzip)
 --   * timeout: request timeout
 --   * no_ssl_verify: skip SSL verification
 --   * user: HTTP user
@@ -405,6 +354,14 @@ exports.insert = function (upstream, settings, params, query, rows,
   http_params.body = {rspamd_text.fromtable(rows, '\n'), '\n'}
   http_params.log_obj = params.task or params.config
 
+  if settings.use_zstd then
+    -- Clickhouse decompresses body according to Content-Encoding
+    http_params.body = rspamd_util.zstd_compress(rspamd_text.fromtable(http_params.body))
+    http_params.gzip = false
+    http_params.headers = http_params.headers or {}
+    http_params.headers['Content-Encoding'] = 'zstd'
+  end
+
   if not http_params.url then
     local connect_prefix = "http://"
     if settings.use_https then
@@ -0,0 +1,291 @@
+--[[
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+--[[[
+-- @module lua_ffi/task
+-- This module contains ffi interfaces to the most used task accessors.
+-- Functions that return arrays return cdata array and the number of elements,
+-- so no Lua tables or strings are created unless a caller converts some
+-- fields using `ffi.string`. Strings are owned by the task and must not be
+-- used after the task is destroyed.
+--]]
+
+local ffi = require 'ffi'
+
+ffi.cdef[[
+struct rspamd_task;
+struct rspamd_ffi_str {
+  const char *begin;
+  size_t len;
+};
+enum rspamd_task_ffi_field {
+  RSPAMD_TASK_FFI_SUBJECT = 0,
+  RSPAMD_TASK_FFI_MESSAGE_ID,
+  RSPAMD_TASK_FFI_HELO,
+  RSPAMD_TASK_FFI_HOSTNAME,
+  RSPAMD_TASK_FFI_USER,
+  RSPAMD_TASK_FFI_QUEUE_ID,
+  RSPAMD_TASK_FFI_FROM_IP,
+  RSPAMD_TASK_FFI_DELIVER_TO,
+  RSPAMD_TASK_FFI_PRINCIPAL_RECIPIENT,
+  RSPAMD_TASK_FFI_RAW_MESSAGE,
+  RSPAMD_TASK_FFI_RAW_HEADERS,
+};
+struct rspamd_ffi_header {
+  const char *name;
+  const char *value;
+  const char *decoded;
+  const char *raw;
+  size_t raw_len;
+  unsigned int order;
+  int flags;
+};
+struct rspamd_ffi_email {
+  const char *raw;
+  const char *addr;
+  const char *user;
+  const char *domain;
+  const char *name;
+  unsigned int raw_len;
+  unsigned int addr_len;
+  unsigned int user_len;
+  unsigned int domain_len;
+  unsigned int flags;
+};
+struct rspamd_ffi_url {
+  const char *string;
+  const char *host;
+  const char *tld;
+  unsigned int len;
+  unsigned int hostlen;
+  unsigned int tldlen;
+  unsigned int protocol;
+  unsigned int port;
+  unsigned int flags;
+  unsigned int count;
+};
+struct rspamd_ffi_text_part {
+  const char *content;
+  size_t len;
+  const char *raw;
+  size_t raw_len;
+  const char *language;
+  unsigned int flags;
+  unsigned int nlines;
+  unsigned int nwords;
+  unsigned int non_ascii_chars;
+  unsigned int ascii_chars;
+  unsigned int capital_letters;
+  unsigned int numeric_characters;
+  unsigned int part_number;
+};
+struct rspamd_ffi_mime_part {
+  struct rspamd_ffi_str type;
+  struct rspamd_ffi_str subtype;
+  struct rspamd_ffi_str filename;
+  const char *content;
+  size_t len;
+  const char *raw;
+  size_t raw_len;
+  unsigned int flags;
+  unsigned int part_type;
+  unsigned int part_number;
+  int is_text;
+};
+struct rspamd_ffi_symbol {
+  const char *name;
+  double score;
+  unsigned int nshots;
+  unsigned int nopts;
+  unsigned int flags;
+};
+int rspamd_task_ffi_get_string (struct rspamd_task *task,
+    enum rspamd_task_ffi_field field, struct rspamd_ffi_str *out);
+size_t rspamd_task_ffi_get_size (struct rspamd_task *task);
+unsigned int rspamd_task_ffi_get_headers (struct rspamd_task *task,
+    const char *name, struct rspamd_ffi_header *out, unsigned int max);
+unsigned int rspamd_task_ffi_get_from (struct rspamd_task *task, int mime,
+    struct rspamd_ffi_email *out, unsigned int max);
+unsigned int rspamd_task_ffi_get_recipients (struct rspamd_task *task, int mime,
+    struct rspamd_ffi_email *out, unsigned int max);
+unsigned int rspamd_task_ffi_get_urls (struct rspamd_task *task,
+    struct rspamd_ffi_url *out, unsigned int max);
+unsigned int rspamd_task_ffi_get_text_parts (struct rspamd_task *task,
+    struct rspamd_ffi_text_part *out, unsigned int max);
+unsigned int rspamd_task_ffi_get_parts (struct rspamd_task *task,
+    struct rspamd_ffi_mime_part *out, unsigned int max);
+int rspamd_task_ffi_get_symbol (struct rspamd_task *task, const char *name,
+    struct rspamd_ffi_symbol *out);
+unsigned int rspamd_task_ffi_get_symbols (struct rspamd_task *task,
+    struct rspamd_ffi_symbol *out, unsigned int max);
+double rspamd_task_ffi_get_score (struct rspamd_task *task);
+]]
+
+local C = ffi.C
+local str_buf = ffi.new('struct rspamd_ffi_str')
+local sym_buf = ffi.new('struct rspamd_ffi_symbol')
+
+local fields = {
+  subject = C.RSPAMD_TASK_FFI_SUBJECT,
+  message_id = C.RSPAMD_TASK_FFI_MESSAGE_ID,
+  helo = C.RSPAMD_TASK_FFI_HELO,
+  hostname = C.RSPAMD_TASK_FFI_HOSTNAME,
+  user = C.RSPAMD_TASK_FFI_USER,
+  queue_id = C.RSPAMD_TASK_FFI_QUEUE_ID,
+  from_ip = C.RSPAMD_TASK_FFI_FROM_IP,
+  deliver_to = C.RSPAMD_TASK_FFI_DELIVER_TO,
+  principal_recipient = C.RSPAMD_TASK_FFI_PRINCIPAL_RECIPIENT,
+  raw_message = C.RSPAMD_TASK_FFI_RAW_MESSAGE,
+  raw_headers = C.RSPAMD_TASK_FFI_RAW_HEADERS,
+}
+
+-- Calls a filler function twice: to get the number of elements and to fill
+-- an array of the exact size
+local function get_array(fn, ctype, task)
+  local ptask = task:topointer()
+  local n = fn(ptask, nil, 0)
+
+  if n == 0 then
+    return nil,0
+  end
+
+  local out = ffi.new(ctype, n)
+  fn(ptask, out, n)
+
+  return out,n
+end
+
+--[[[
+-- @function lua_ffi.task.get_string(task, field)
+-- Returns string field of a task: subject, message_id, helo, hostname, user,
+-- queue_id, from_ip, deliver_to, principal_recipient, raw_message or raw_headers
+-- @return {string} field value or nil
+--]]
+local function get_string(task, field)
+  local f = fields[field]
+
+  if not f then
+    return nil
+  end
+
+  if C.rspamd_task_ffi_get_string(task:topointer(), f, str_buf) ~= 0 then
+    return ffi.string(str_buf.begin, str_buf.len)
+  end
+
+  return nil
+end
+
+local function get_size(task)
+  return tonumber(C.rspamd_task_ffi_get_size(task:topointer()))
+end
+
+--[[[
+-- @function lua_ffi.task.get_header(task, name)
+-- Returns decoded value of the first header named `name`
+--]]
+local function get_header(task, name)
+  local hdr = ffi.new('struct rspamd_ffi_header[1]')
+
+  if C.rspamd_task_ffi_get_headers(task:topointer(), name, hdr, 1) > 0 then
+    return ffi.string(hdr[0].decoded)
+  end
+
+  return nil
+end
+
+--[[[
+-- @function lua_ffi.task.get_headers(task, name)
+-- Returns cdata array of `struct rspamd_ffi_header` and number of headers
+--]]
+local function get_headers(task, name)
+  return get_array(function(ptask, out, max)
+    return C.rspamd_task_ffi_get_headers(ptask, name, out, max)
+  end, 'struct rspamd_ffi_header[?]', task)
+end
+
+local function get_from(task, mime)
+  return get_array(function(ptask, out, max)
+    return C.rspamd_task_ffi_get_from(ptask, mime and 1 or 0, out, max)
+  end, 'struct rspamd_ffi_email[?]', task)
+end
+
+local function get_recipients(task, mime)
+  return get_array(function(ptask, out, max)
+    return C.rspamd_task_ffi_get_recipients(ptask, mime and 1 or 0, out, max)
+  end, 'struct rspamd_ffi_email[?]', task)
+end
+
+local function get_urls(task)
+  return get_array(function(ptask, out, max)
+    return C.rspamd_task_ffi_get_urls(ptask, out, max)
+  end, 'struct rspamd_ffi_url[?]', task)
+end
+
+local function get_text_parts(task)
+  return get_array(function(ptask, out, max)
+    return C.rspamd_task_ffi_get_text_parts(ptask, out, max)
+  end, 'struct rspamd_ffi_text_part[?]', task)
+end
+
+local function get_parts(task)
+  return get_array(function(ptask, out, max)
+    return C.rspamd_task_ffi_get_parts(ptask, out, max)
+  end, 'struct rspamd_ffi_mime_part[?]', task)
+end
+
+local function get_symbols(task)
+  return get_array(function(ptask, out, max)
+    return C.rspamd_task_ffi_get_symbols(ptask, out, max)
+  end, 'struct rspamd_ffi_symbol[?]', task)
+end
+
+--[[[
+-- @function lua_ffi.task.has_symbol(task, name)
+-- Returns true if a symbol has been inserted to the default result
+--]]
+local function has_symbol(task, name)
+  return C.rspamd_task_ffi_get_symbol(task:topointer(), name, nil) ~= 0
+end
+
+--[[[
+-- @function lua_ffi.task.get_symbol(task, name)
+-- Returns score, number of options and number of shots of a symbol or nil
+--]]
+local function get_symbol(task, name)
+  if C.rspamd_task_ffi_get_symbol(task:topointer(), name, sym_buf) ~= 0 then
+    return sym_buf.score, sym_buf.nopts, sym_buf.nshots
+  end
+
+  return nil
+end
+
+local function get_score(task)
+  return C.rspamd_task_ffi_get_score(task:topointer())
+end
+
+return {
+  get_string = get_string,
+  get_size = get_size,
+  get_header = get_header,
+  get_headers = get_headers,
+  get_from = get_from,
+  get_recipients = get_recipients,
+  get_urls = get_urls,
+  get_text_parts = get_text_parts,
+  get_parts = get_parts,
+  get_symbols = get_symbols,
+  get_symbol = get_symbol,
+  has_symbol = has_symbol,
+  get_score = get_score,
+}
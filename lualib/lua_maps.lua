@@ -66,6 +66,7 @@ local function maybe_adjust_type(data,mtype)
     {'radix;', 'radix'},
     {'ipnet;', 'radix'},
     {'set;', 'set'},
+    {'suffix;', 'domain_suffix'},
     {'hash;', 'hash'},
     {'plain;', 'hash'},
     {'cdb;', 'cdb'},
@@ -91,7 +92,7 @@ end
 -- Creates a map from static data
 -- Returns true if map was added or nil
 -- @param {string or table} opt data for map (or URL)
--- @param {string} mtype type of map (`set`, `map`, `radix`, `regexp`)
+-- @param {string} mtype type of map (`set`, `map`, `radix`, `regexp`, `domain_suffix`)
 -- @param {string} description human-readable description of map
 -- @return {bool} true on success, or `nil`
 --]]
@@ -103,6 +104,13 @@ local function rspamd_map_add_from_ucl(opt, mtype, description)
         return t.__data:get_key(k)
       end
 
+      return nil
+    end,
+    get_keys_batch = function(t, keys)
+      if t.__data then
+        return t.__data:get_keys_batch(keys)
+      end
+
       return nil
     end
   }
@@ -192,7 +200,7 @@ local function rspamd_map_add_from_ucl(opt, mtype, description)
             return ret
           end
         end
-      elseif mtype == 'regexp' or mtype == 'glob' then
+      elseif mtype == 'regexp' or mtype == 'glob' or mtype == 'domain_suffix' then
         if string.find(opt[1], '^/%a') or string.find(opt[1], '^http') then
           -- Plain table
           local map = rspamd_config:add_map{
@@ -270,6 +278,15 @@ local function rspamd_map_add_from_ucl(opt, mtype, description)
 
               return nil
             end
+            ret.get_keys_batch = function(t, keys)
+              local res = {}
+
+              for i,k in ipairs(keys) do
+                res[i] = t:get_key(k) or false
+              end
+
+              return res
+            end
 
             maps_cache[cache_key] = ret
             return ret
@@ -305,7 +322,7 @@ end
 -- Returns true if map was added or nil
 -- @param {string} mname config section to use
 -- @param {string} optname option name to use
--- @param {string} mtype type of map ('set', 'hash', 'radix', 'regexp', 'glob')
+-- @param {string} mtype type of map ('set', 'hash', 'radix', 'regexp', 'glob', 'domain_suffix')
 -- @param {string} description human-readable description of map
 -- @return {bool} true on success, or `nil`
 --]]
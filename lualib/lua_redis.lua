@@ -36,6 +36,10 @@ local common_schema = ts.shape {
   sentinel_watch_time = (ts.number + ts.string / lutil.parse_time_interval):is_optional(),
   sentinel_masters_pattern = ts.string:is_optional(),
   sentinel_master_maxerrors = (ts.number + ts.string / tonumber):is_optional(),
+  cluster = ts.boolean:is_optional(),
+  cluster_refresh_interval = (ts.number + ts.string / lutil.parse_time_interval):is_optional(),
+  replica_max_lag = (ts.number + ts.string / lutil.parse_time_interval):is_optional(),
+  replica_check_interval = (ts.number + ts.string / lutil.parse_time_interval):is_optional(),
 }
 
 local config_schema =
@@ -316,6 +320,8 @@ end
 local function process_redis_opts(options, redis_params)
   local default_timeout = 1.0
   local default_expand_keys = false
+  local default_cluster_refresh_interval = 10.0
+  local default_replica_check_interval = 5.0
 
   if not redis_params['timeout'] or redis_params['timeout'] == default_timeout then
     if options['timeout'] then
@@ -356,6 +362,26 @@ local function process_redis_opts(options, redis_params)
     redis_params['sentinel_masters_pattern'] = options['sentinel_masters_pattern']
   end
 
+  if type(options['cluster']) == 'boolean' and redis_params['cluster'] == nil then
+    redis_params['cluster'] = options['cluster']
+  end
+
+  if not redis_params['cluster_refresh_interval'] or
+      redis_params['cluster_refresh_interval'] == default_cluster_refresh_interval then
+    redis_params['cluster_refresh_interval'] = tonumber(options['cluster_refresh_interval']) or
+        default_cluster_refresh_interval
+  end
+
+  if options['replica_max_lag'] and not redis_params['replica_max_lag'] then
+    redis_params['replica_max_lag'] = tonumber(options['replica_max_lag'])
+  end
+
+  if not redis_params['replica_check_interval'] or
+      redis_params['replica_check_interval'] == default_replica_check_interval then
+    redis_params['replica_check_interval'] = tonumber(options['replica_check_interval']) or
+        default_replica_check_interval
+  end
+
 end
 
 local function enrich_defaults(rspamd_config, module, redis_params)
@@ -895,6 +921,344 @@ local function get_key_expansion_metadata(task)
 
 end
 
+-- Redis Cluster and replicas support
+
+local cluster_max_redirects = 5
+
+local function redis_cluster_node_name(host, port)
+  if host:find(':', 1, true) and not host:find('^%[') then
+    -- IPv6 address
+    return string.format('[%s]:%s', host, port)
+  end
+
+  return string.format('%s:%s', host, port)
+end
+
+-- Returns an upstream for a cluster node in form `host:port`
+local function redis_cluster_node_upstream(redis_params, node)
+  local nodes = redis_params.cluster_nodes
+
+  if not nodes then
+    nodes = {}
+    redis_params.cluster_nodes = nodes
+  end
+
+  local ups = nodes[node]
+
+  if not ups then
+    local upstream_list = require "rspamd_upstream_list"
+
+    if rspamd_config then
+      ups = upstream_list.create(rspamd_config, node, 6379)
+    else
+      ups = upstream_list.create(node, 6379)
+    end
+
+    if not ups then
+      return nil
+    end
+
+    nodes[node] = ups
+  end
+
+  return ups:get_upstream_round_robin()
+end
+
+-- Reloads the whole slots map from the specified cluster node
+local function redis_cluster_refresh_slots(redis_params, ev_base, cfg, addr)
+  local now = rspamd_util.get_time()
+
+  if not ev_base or not cfg or redis_params.cluster_refresh_pending or
+      (redis_params.cluster_refreshed or 0) +
+          redis_params.cluster_refresh_interval > now then
+    return
+  end
+
+  local function cluster_slots_cb(err, data)
+    redis_params.cluster_refresh_pending = nil
+    redis_params.cluster_refreshed = rspamd_util.get_time()
+
+    if err or type(data) ~= 'table' then
+      logger.infox(cfg, 'cannot refresh redis cluster slots from %s: %s',
+          addr, err)
+      return
+    end
+
+    local slots = {}
+    -- Each element is {first, last, {master_ip, master_port, ...}, replicas...}
+    for _,range in ipairs(data) do
+      local first, last, master = tonumber(range[1]), tonumber(range[2]), range[3]
+
+      if first and last and type(master) == 'table' and master[1] and master[2] then
+        local node = redis_cluster_node_name(tostring(master[1]),
+            tostring(master[2]))
+
+        for slot = first, last do
+          slots[slot] = node
+        end
+      end
+    end
+
+    lutil.debugm(N, cfg, 'refreshed redis cluster slots from %s', addr)
+    redis_params.cluster_slots = slots
+  end
+
+  local rspamd_redis = require "rspamd_redis"
+  local options = {
+    ev_base = ev_base,
+    config = cfg,
+    callback = cluster_slots_cb,
+    host = addr:get_addr(),
+    timeout = redis_params.timeout,
+    cmd = 'CLUSTER',
+    args = {'SLOTS'},
+  }
+
+  if redis_params.password then
+    options.password = redis_params.password
+  end
+
+  if rspamd_redis.make_request(options) then
+    redis_params.cluster_refresh_pending = true
+  end
+end
+
+-- Parses `MOVED <slot> <host>:<port>` and `ASK <slot> <host>:<port>` errors
+local function redis_cluster_parse_redirect(err)
+  if type(err) ~= 'string' then
+    return nil
+  end
+
+  local kind, slot, host, port = err:match('^(%u+) (%d+) (%S+):(%d+)$')
+
+  if kind ~= 'MOVED' and kind ~= 'ASK' then
+    return nil
+  end
+
+  return kind, tonumber(slot), redis_cluster_node_name(host, port)
+end
+
+-- Resends a request described by `options` (as passed to `rspamd_redis.make_request`)
+-- if a cluster node has redirected it somewhere. Returns the upstream of the
+-- new node or nil if the request has not been redirected
+local function redis_cluster_redirect(redis_params, options, err)
+  if not redis_params.cluster then
+    return nil
+  end
+
+  local kind, slot, node = redis_cluster_parse_redirect(err)
+
+  if not kind then
+    return nil
+  end
+
+  options.cluster_redirects = (options.cluster_redirects or 0) + 1
+
+  if options.cluster_redirects > cluster_max_redirects then
+    return nil
+  end
+
+  local addr = redis_cluster_node_upstream(redis_params, node)
+
+  if not addr then
+    return nil
+  end
+
+  local rspamd_redis = require "rspamd_redis"
+  local ret, conn
+  local ev_base, cfg = options.ev_base, options.config
+
+  if options.task then
+    ev_base, cfg = options.task:get_ev_base(), options.task:get_cfg()
+  end
+
+  lutil.debugm(N, cfg, 'redis cluster redirect (%s) of slot %s to %s', kind,
+      slot, node)
+  options.host = addr:get_addr()
+
+  if kind == 'MOVED' then
+    -- Slot has been migrated, so slots map is likely outdated
+    if not redis_params.cluster_slots then
+      redis_params.cluster_slots = {}
+    end
+
+    redis_params.cluster_slots[slot] = node
+    redis_cluster_refresh_slots(redis_params, ev_base, cfg, addr)
+    ret = rspamd_redis.make_request(options)
+  else
+    -- Slot is being migrated: the new node accepts the command only if
+    -- it is preceded by ASKING on the same connection
+    ret, conn = rspamd_redis.connect(options)
+
+    if ret then
+      ret = conn:add_cmd('ASKING', {}) and
+          conn:add_cmd(options.callback, options.cmd, options.args or {})
+    end
+  end
+
+  if not ret then
+    addr:fail()
+    return nil
+  end
+
+  return addr
+end
+
+-- Checks replication status of a read server and returns true if it
+-- is known to lag behind its master for more than `replica_max_lag`
+local function redis_replica_is_stale(redis_params, addr, ev_base, cfg)
+  local states = redis_params.replica_states
+
+  if not states then
+    states = {}
+    redis_params.replica_states = states
+  end
+
+  local name = addr:get_addr():to_string(true)
+  local st = states[name]
+
+  if not st then
+    st = {
+      stale = false,
+      checked = 0,
+    }
+    states[name] = st
+  end
+
+  local now = rspamd_util.get_time()
+
+  if ev_base and cfg and not st.pending and
+      st.checked + redis_params.replica_check_interval < now then
+    local function replication_info_cb(err, data)
+      st.pending = nil
+      st.checked = rspamd_util.get_time()
+
+      if err or type(data) ~= 'string' then
+        -- Keep the previous state
+        return
+      end
+
+      local stale = false
+
+      if data:match('role:slave') then
+        local link = data:match('master_link_status:(%a+)')
+        local last_io = tonumber(data:match('master_last_io_seconds_ago:(%-?%d+)'))
+
+        if link ~= 'up' or not last_io or last_io < 0 or
+            last_io > redis_params.replica_max_lag then
+          stale = true
+        end
+      end
+
+      if stale ~= st.stale then
+        if stale then
+          logger.infox(cfg, 'redis replica %s is stale, route reads to masters',
+              name)
+        else
+          logger.infox(cfg, 'redis replica %s is in sync again', name)
+        end
+      end
+
+      st.stale = stale
+    end
+
+    local rspamd_redis = require "rspamd_redis"
+    local options = {
+      ev_base = ev_base,
+      config = cfg,
+      callback = replication_info_cb,
+      host = addr:get_addr(),
+      timeout = redis_params.timeout,
+      cmd = 'INFO',
+      args = {'replication'},
+    }
+
+    if redis_params.password then
+      options.password = redis_params.password
+    end
+
+    if rspamd_redis.make_request(options) then
+      st.pending = true
+    end
+  end
+
+  return st.stale
+end
+
+local function redis_select_upstream_list(upstreams, key)
+  if key then
+    return upstreams:get_upstream_by_hash(key)
+  end
+
+  return upstreams:get_upstream_round_robin(key)
+end
+
+-- Selects redis server for the request taking cluster slots and replicas
+-- state into account
+local function redis_select_upstream(redis_params, key, is_write, ev_base, cfg)
+  local addr
+
+  if key and redis_params.cluster and redis_params.cluster_slots then
+    local rspamd_redis = require "rspamd_redis"
+    local node = redis_params.cluster_slots[rspamd_redis.key_slot(key)]
+
+    if node then
+      addr = redis_cluster_node_upstream(redis_params, node)
+
+      if addr then
+        return addr
+      end
+    end
+  end
+
+  if is_write then
+    if key then
+      return redis_params['write_servers']:get_upstream_by_hash(key)
+    end
+
+    return redis_params['write_servers']:get_upstream_master_slave(key)
+  end
+
+  addr = redis_select_upstream_list(redis_params['read_servers'], key)
+
+  if addr and redis_params.replica_max_lag and redis_params.write_servers and
+      redis_params.write_servers ~= redis_params.read_servers then
+    if redis_replica_is_stale(redis_params, addr, ev_base, cfg) then
+      addr = redis_select_upstream_list(redis_params['write_servers'], key) or addr
+    end
+  end
+
+  return addr
+end
+
+--[[[
+-- @function lua_redis.shard_key(redis_params, key, is_write)
+-- Returns a string which is the same for all keys served by the same Redis
+-- server, so commands or scripts for such keys could be issued at once.
+-- In cluster mode keys must also share a hash slot to be used in one script
+-- @param {table} redis_params redis configuration in format returned by lua_redis.parse_redis_server()
+-- @param {string} key key to use for sharding
+-- @param {boolean} is_write should be `true` if we are performing a write operating
+-- @return {string} shard identifier or nil if no server is available
+--]]
+local function redis_shard_key(redis_params, key, is_write)
+  if redis_params.cluster then
+    local rspamd_redis = require "rspamd_redis"
+
+    return string.format('slot:%d', rspamd_redis.key_slot(key))
+  end
+
+  local addr = redis_select_upstream(redis_params, key, is_write)
+
+  if addr then
+    return addr:get_addr():to_string(true)
+  end
+
+  return nil
+end
+
+exports.shard_key = redis_shard_key
+
 -- Performs async call to redis hiding all complexity inside function
 -- task - rspamd_task
 -- redis_params - valid params returned by rspamd_parse_redis_server
@@ -906,9 +1270,16 @@ end
 -- extra_opts - table of optional request arguments
 local function rspamd_redis_make_request(task, redis_params, key, is_write,
     callback, command, args, extra_opts)
-  local addr
+  local addr, options
   local function rspamd_redis_make_request_cb(err, data)
     if err then
+      local redirected = redis_cluster_redirect(redis_params, options, err)
+
+      if redirected then
+        addr = redirected
+        return
+      end
+
       addr:fail()
     else
       addr:ok()
@@ -923,19 +1294,8 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
 
   local rspamd_redis = require "rspamd_redis"
 
-  if key then
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_by_hash(key)
-    else
-      addr = redis_params['read_servers']:get_upstream_by_hash(key)
-    end
-  else
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_master_slave(key)
-    else
-      addr = redis_params['read_servers']:get_upstream_round_robin(key)
-    end
-  end
+  addr = redis_select_upstream(redis_params, key, is_write,
+      task:get_ev_base(), task:get_cfg())
 
   if not addr then
     logger.errx(task, 'cannot select server to make redis request')
@@ -950,7 +1310,7 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
   end
 
   local ip_addr = addr:get_addr()
-  local options = {
+  options = {
     task = task,
     callback = rspamd_redis_make_request_cb,
     host = ip_addr,
@@ -1008,9 +1368,16 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
     return false,nil,nil
   end
 
-  local addr
+  local addr, options
   local function rspamd_redis_make_request_cb(err, data)
     if err then
+      local redirected = redis_cluster_redirect(redis_params, options, err)
+
+      if redirected then
+        addr = redirected
+        return
+      end
+
       addr:fail()
     else
       addr:ok()
@@ -1022,25 +1389,13 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
 
   local rspamd_redis = require "rspamd_redis"
 
-  if key then
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_by_hash(key)
-    else
-      addr = redis_params['read_servers']:get_upstream_by_hash(key)
-    end
-  else
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_master_slave(key)
-    else
-      addr = redis_params['read_servers']:get_upstream_round_robin(key)
-    end
-  end
+  addr = redis_select_upstream(redis_params, key, is_write, ev_base, cfg)
 
   if not addr then
     logger.errx(cfg, 'cannot select server to make redis request')
   end
 
-  local options = {
+  options = {
     ev_base = ev_base,
     config = cfg,
     callback = rspamd_redis_make_request_cb,
@@ -1373,21 +1728,7 @@ local function redis_connect_sync(redis_params, is_write, key, cfg, ev_base)
   end
 
   local rspamd_redis = require "rspamd_redis"
-  local addr
-
-  if key then
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_by_hash(key)
-    else
-      addr = redis_params['read_servers']:get_upstream_by_hash(key)
-    end
-  else
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_master_slave(key)
-    else
-      addr = redis_params['read_servers']:get_upstream_round_robin(key)
-    end
-  end
+  local addr = redis_select_upstream(redis_params, key, is_write)
 
   if not addr then
     logger.errx(cfg, 'cannot select server to make redis request')
@@ -1479,6 +1820,13 @@ exports.request = function(redis_params, attrs, req)
     local callback = opts.callback
     local function rspamd_redis_make_request_cb(err, data)
       if err then
+        local redirected = redis_cluster_redirect(redis_params, opts, err)
+
+        if redirected then
+          addr = redirected
+          return
+        end
+
         addr:fail()
       else
         addr:ok()
@@ -1491,20 +1839,14 @@ exports.request = function(redis_params, attrs, req)
   local rspamd_redis = require "rspamd_redis"
   local is_write = opts.is_write
 
-  if opts.key then
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_by_hash(attrs.key)
-    else
-      addr = redis_params['read_servers']:get_upstream_by_hash(attrs.key)
-    end
-  else
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_master_slave(attrs.key)
-    else
-      addr = redis_params['read_servers']:get_upstream_round_robin(attrs.key)
-    end
+  local ev_base, cfg = opts.ev_base, opts.config
+
+  if opts.task then
+    ev_base, cfg = opts.task:get_ev_base(), opts.task:get_cfg()
   end
 
+  addr = redis_select_upstream(redis_params, attrs.key, is_write, ev_base, cfg)
+
   if not addr then
     logger.errx(log_obj, 'cannot select server to make redis request')
   end
@@ -1548,12 +1890,180 @@ exports.request = function(redis_params, attrs, req)
       addr:fail()
     else
       conn:add_cmd(opts.cmd, opts.args)
-      return conn:exec()
+      local ok,data = conn:exec()
+
+      if not ok and redis_params.cluster then
+        -- Follow cluster redirects synchronously
+        for _=1,cluster_max_redirects do
+          local kind, slot, node = redis_cluster_parse_redirect(data)
+
+          if not kind then
+            break
+          end
+
+          addr = redis_cluster_node_upstream(redis_params, node)
+
+          if not addr then
+            break
+          end
+
+          if kind == 'MOVED' then
+            if not redis_params.cluster_slots then
+              redis_params.cluster_slots = {}
+            end
+            redis_params.cluster_slots[slot] = node
+          end
+
+          opts.host = addr:get_addr()
+          ret,conn = rspamd_redis.connect_sync(opts)
+
+          if not ret then
+            addr:fail()
+            return false,nil,addr
+          end
+
+          if kind == 'ASK' then
+            -- Replies are returned in order, so skip ASKING reply
+            conn:add_cmd('ASKING', {})
+            conn:add_cmd(opts.cmd, opts.args)
+            ok,data = select(3, conn:exec())
+          else
+            conn:add_cmd(opts.cmd, opts.args)
+            ok,data = conn:exec()
+          end
+
+          if ok then
+            break
+          end
+        end
+      end
+
+      return ok,data
     end
     return false,nil,addr
   end
 end
 
+--[[[
+-- @function lua_redis.batch(redis_params, attrs, reqs)
+-- Sends independent requests to Redis and returns all replies at once. Requests
+-- for the same server are pipelined. They are sent in a single round trip and
+-- resume the coroutine once. Must be called from a coroutine (e.g. symbol callback)
+-- @param redis_params a table of redis server parameters
+-- @param attrs a table of redis request attributes (e.g. task, or ev_base + cfg + session), `is_write` is applied to all requests
+-- @param reqs an array of requests: each request is a table of a command + command options
+-- @return {table} array of {ok = boolean, data = reply or error} in order of requests
+--]]
+exports.batch = function(redis_params, attrs, reqs)
+  local lua_util = require "lua_util"
+  local rspamd_redis = require "rspamd_redis"
+  local results = {}
+
+  if not attrs or not redis_params or not reqs then
+    logger.errx('invalid arguments for redis batch')
+    return results
+  end
+
+  if not (attrs.task or (attrs.config and attrs.ev_base)) then
+    logger.errx('invalid attributes for redis batch')
+    return results
+  end
+
+  local ev_base, cfg = attrs.ev_base, attrs.config
+
+  if attrs.task then
+    ev_base, cfg = attrs.task:get_ev_base(), attrs.task:get_cfg()
+  end
+
+  local log_obj = attrs.task or cfg
+  -- Requests grouped by server address
+  local groups, groups_order = {}, {}
+
+  for i,req in ipairs(reqs) do
+    local cmd = req[1]
+    local args = {}
+    for j=2,#req do
+      args[j - 1] = req[j]
+    end
+
+    local key = attrs.key
+    if not key then
+      local idx = get_key_indexes(cmd, args)[1]
+      key = idx and args[idx]
+    end
+
+    local addr = redis_select_upstream(redis_params, key, attrs.is_write, ev_base, cfg)
+
+    if not addr then
+      results[i] = {ok = false, data = 'cannot select server to make redis request'}
+    else
+      local name = tostring(addr:get_addr())
+      local group = groups[name]
+
+      if not group then
+        group = {addr = addr, reqs = {}}
+        groups[name] = group
+        groups_order[#groups_order + 1] = group
+      end
+
+      group.reqs[#group.reqs + 1] = {idx = i, cmd = cmd, args = args}
+    end
+  end
+
+  for _,group in ipairs(groups_order) do
+    local opts = lua_util.shallowcopy(attrs)
+    opts.callback = nil
+    opts.host = group.addr:get_addr()
+    opts.timeout = redis_params.timeout
+
+    if redis_params.password then
+      opts.password = redis_params.password
+    end
+
+    if redis_params.db then
+      opts.dbname = redis_params.db
+    end
+
+    lutil.debugm(N, 'perform batch of %s requests to redis server %s',
+        #group.reqs, group.addr)
+
+    local ret,conn = rspamd_redis.connect_sync(opts)
+
+    if not ret then
+      logger.errx(log_obj, 'cannot execute redis batch')
+      group.addr:fail()
+
+      for _,r in ipairs(group.reqs) do
+        results[r.idx] = {ok = false, data = 'cannot connect to redis'}
+      end
+    else
+      for _,r in ipairs(group.reqs) do
+        conn:add_cmd(r.cmd, r.args)
+      end
+
+      -- Replies come as pairs: ok, data
+      local replies = {conn:exec()}
+
+      for j,r in ipairs(group.reqs) do
+        local ok, data = replies[j * 2 - 1], replies[j * 2]
+
+        if not ok and redis_params.cluster and redis_cluster_parse_redirect(data) then
+          -- Slow path: follow cluster redirect for this request only
+          local req = {r.cmd}
+          for k,v in ipairs(r.args) do
+            req[k + 1] = v
+          end
+          ok, data = exports.request(redis_params, opts, req)
+        end
+
+        results[r.idx] = {ok = ok and true or false, data = data}
+      end
+    end
+  end
+
+  return results
+end
+
 --[[[
 -- @function lua_redis.connect(redis_params, attrs)
 -- Connects to Redis synchronously with coroutines or asynchronously using a callback (modern API)
@@ -1598,20 +2108,14 @@ exports.connect = function(redis_params, attrs)
   local rspamd_redis = require "rspamd_redis"
   local is_write = opts.is_write
 
-  if opts.key then
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_by_hash(attrs.key)
-    else
-      addr = redis_params['read_servers']:get_upstream_by_hash(attrs.key)
-    end
-  else
-    if is_write then
-      addr = redis_params['write_servers']:get_upstream_master_slave(attrs.key)
-    else
-      addr = redis_params['read_servers']:get_upstream_round_robin(attrs.key)
-    end
+  local ev_base, cfg = opts.ev_base, opts.config
+
+  if opts.task then
+    ev_base, cfg = opts.task:get_ev_base(), opts.task:get_cfg()
   end
 
+  addr = redis_select_upstream(redis_params, attrs.key, is_write, ev_base, cfg)
+
   if not addr then
     logger.errx(log_obj, 'cannot select server to make redis connect')
   end
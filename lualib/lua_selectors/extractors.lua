@@ -127,6 +127,7 @@ uses any type by default)]],
   },
   -- Get country (ASN module must be executed first)
   ['country'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task)
       local country = task:get_mempool():get_variable('country')
       if not country then
@@ -139,6 +140,7 @@ uses any type by default)]],
   },
   -- Get ASN number
   ['asn'] = {
+    ['volatile'] = true,
     ['type'] = 'string',
     ['get_value'] = function(task)
       local asn = task:get_mempool():get_variable('asn')
@@ -370,6 +372,7 @@ e.g. `get_user`]],
   -- Get specific pool var. The first argument must be variable name,
   -- the second argument is optional and defines the type (string by default)
   ['pool_var'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task, args)
       local type = args[2] or 'string'
       return task:get_mempool():get_variable(args[1], type),(type)
@@ -380,6 +383,7 @@ the second argument is optional and defines the type (string by default)]],
   },
   -- Get value of specific key from task cache
   ['task_cache'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task, args)
       local val = task:cache_get(args[1])
       if not val then
@@ -399,6 +403,7 @@ the key name]],
   },
   -- Get specific HTTP request header. The first argument must be header name.
   ['request_header'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task, args)
       local hdr = task:get_request_header(args[1])
       if hdr then
@@ -413,6 +418,7 @@ The first argument must be header name.]],
   },
   -- Get task date, optionally formatted
   ['time'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task, args)
       local what = args[1] or 'message'
       local dt = task:get_date{format = what, gmt = true}
@@ -493,6 +499,7 @@ The first argument must be header name.]],
   },
   -- Get specific symbol
   ['symbol'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task, args)
       local symbol = task:get_symbol(args[1], args[2])
       if symbol then
@@ -506,6 +513,7 @@ The first argument must be header name.]],
   },
   -- Get full scan result
   ['scan_result'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task, args)
       local res = task:get_metric_result(args[1])
       if res then
@@ -71,6 +71,24 @@ local function implicit_tostring(t, ud_or_table)
   return nil
 end
 
+-- Selectors compiled to the same extractor or the same prefix of a processors
+-- pipeline share both the objects and the cached results
+local compiled_extractors = {}
+local compiled_processors = {}
+local task_cache_key = '__selectors_cache'
+local cache_failure = {}
+
+local function get_selectors_cache(task)
+  local cache = task:cache_get(task_cache_key)
+
+  if not cache then
+    cache = {}
+    task:cache_set(task_cache_key, cache)
+  end
+
+  return cache
+end
+
 local function process_selector(task, sel)
   local function allowed_type(t)
     if t == 'string' or t == 'text' or t == 'string_list' or t == 'text_list' then
@@ -84,61 +102,103 @@ local function process_selector(task, sel)
     return pure_type(t)
   end
 
-  local input,etype = sel.selector.get_value(task, sel.selector.args)
+  local pipe = sel.processor_pipe or E
+  local first_elt = pipe[1]
+  -- Method is applied together with extraction
+  local first_step = (first_elt and first_elt.method) and 1 or 0
+  local keys = sel.cache_keys
+  local cache
+  local input,etype
 
-  if not input then
-    lua_util.debugm(M, task, 'no value extracted for %s', sel.selector.name)
-    return nil
-  end
+  -- Pipeline is processed starting from `pos` element
+  local pos = first_step + 1
 
-  lua_util.debugm(M, task, 'extracted %s, type %s',
-      sel.selector.name, etype)
+  if keys then
+    cache = get_selectors_cache(task)
 
-  local pipe = sel.processor_pipe or E
-  local first_elt = pipe[1]
+    for i = #pipe, first_step, -1 do
+      local cached = cache[keys[i]]
+
+      if cached then
+        if cached[1] == nil then
+          lua_util.debugm(M, task, 'cached failure for %s', keys[i])
+          return nil
+        end
 
-  if first_elt and first_elt.method then
-    -- Explicit conversion
-    local meth = first_elt
+        lua_util.debugm(M, task, 'reuse cached value for %s', keys[i])
+        input,etype = cached[1],cached[2]
+        pos = i + 1
+        break
+      end
+    end
+  end
 
-    if meth.types[etype] then
-      lua_util.debugm(M, task, 'apply method `%s` to %s',
-          meth.name, etype)
-      input,etype = meth.process(input, etype, meth.args)
+  if not input then
+    local cached = cache and cache[keys.raw]
+
+    if cached then
+      input,etype = cached[1],cached[2]
     else
+      input,etype = sel.selector.get_value(task, sel.selector.args)
+
+      if cache then
+        cache[keys.raw] = input and {input, etype} or cache_failure
+      end
+    end
+
+    if not input then
+      lua_util.debugm(M, task, 'no value extracted for %s', sel.selector.name)
+      return nil
+    end
+
+    lua_util.debugm(M, task, 'extracted %s, type %s',
+        sel.selector.name, etype)
+
+    if first_step == 1 then
+      -- Explicit conversion
+      local meth = first_elt
+
+      if meth.types[etype] then
+        lua_util.debugm(M, task, 'apply method `%s` to %s',
+            meth.name, etype)
+        input,etype = meth.process(input, etype, meth.args)
+      else
+        local pt = pure_type(etype)
+
+        if meth.types[pt] then
+          lua_util.debugm(M, task, 'map method `%s` to list of %s',
+              meth.name, pt)
+          -- Map method to a list of inputs, excluding empty elements
+          input = fun.filter(function(map_elt) return map_elt end,
+              fun.map(function(list_elt)
+                local ret, _ = meth.process(list_elt, pt)
+                return ret
+              end, input))
+          etype = 'string_list'
+        end
+      end
+    elseif etype:match('^userdata') or etype:match('^table') then
+      -- Implicit conversion
+
       local pt = pure_type(etype)
 
-      if meth.types[pt] then
-        lua_util.debugm(M, task, 'map method `%s` to list of %s',
-            meth.name, pt)
-        -- Map method to a list of inputs, excluding empty elements
+      if not pt then
+        lua_util.debugm(M, task, 'apply implicit conversion %s->string', etype)
+        input = implicit_tostring(etype, input)
+        etype = 'string'
+      else
+        lua_util.debugm(M, task, 'apply implicit map %s->string', pt)
         input = fun.filter(function(map_elt) return map_elt end,
             fun.map(function(list_elt)
-              local ret, _ = meth.process(list_elt, pt)
+              local ret = implicit_tostring(pt, list_elt)
               return ret
             end, input))
         etype = 'string_list'
       end
     end
-    -- Remove method from the pipeline
-    pipe = fun.drop_n(1, pipe)
-  elseif etype:match('^userdata') or etype:match('^table') then
-    -- Implicit conversion
 
-    local pt = pure_type(etype)
-
-    if not pt then
-      lua_util.debugm(M, task, 'apply implicit conversion %s->string', etype)
-      input = implicit_tostring(etype, input)
-      etype = 'string'
-    else
-      lua_util.debugm(M, task, 'apply implicit map %s->string', pt)
-      input = fun.filter(function(map_elt) return map_elt end,
-          fun.map(function(list_elt)
-            local ret = implicit_tostring(pt, list_elt)
-            return ret
-          end, input))
-      etype = 'string_list'
+    if cache then
+      cache[keys[first_step]] = {input, etype}
     end
   end
 
@@ -182,35 +242,46 @@ local function process_selector(task, sel)
     return {x.process(value, t, x.args)}
   end
 
-  local res = fun.foldl(fold_function,
-      {input, etype},
-      pipe)
+  local res = {input, etype}
+
+  for i = pos, #pipe do
+    res = fold_function(res, pipe[i])
+
+    if cache then
+      cache[keys[i]] = res or cache_failure
+    end
+
+    if not res then break end
+  end
 
   if not res or not res[1] then return nil end -- Pipeline failed
 
-  if not allowed_type(res[2]) then
+  -- Cached results must not be modified
+  local value,t = res[1],res[2]
+
+  if not allowed_type(t) then
 
     -- Search for implicit conversion
-    local pt = pure_type(res[2])
+    local pt = pure_type(t)
 
     if pt then
       lua_util.debugm(M, task, 'apply implicit map %s->string_list', pt)
-      res[1] = fun.map(function(e) return implicit_tostring(pt, e) end, res[1])
-      res[2] = 'string_list'
+      value = fun.map(function(e) return implicit_tostring(pt, e) end, value)
+      t = 'string_list'
     else
-      res[1] = implicit_tostring(res[2], res[1])
-      res[2] = 'string'
+      value = implicit_tostring(t, value)
+      t = 'string'
     end
   end
 
-  if list_type(res[2]) then
+  if list_type(t) then
     -- Convert to table as it might have a functional form
-    res[1] = fun.totable(res[1])
+    value = fun.totable(value)
   end
 
-  lua_util.debugm(M, task, 'final selector type: %s, value: %s', res[2], res[1])
+  lua_util.debugm(M, task, 'final selector type: %s, value: %s', t, value)
 
-  return res[1]
+  return value
 end
 
 local function make_grammar()
@@ -256,6 +327,26 @@ exports.parse_selector = function(cfg, str)
 
   if not parsed or not parsed[1] then return nil end
 
+  -- Canonical representation of a parsed element used for deduplication
+  local function element_key(elt)
+    if type(elt) ~= 'table' then
+      return string.format('%q', tostring(elt))
+    end
+
+    local keys = {}
+    for k,_ in pairs(elt) do
+      table.insert(keys, k)
+    end
+    table.sort(keys, function(a, b) return tostring(a) < tostring(b) end)
+
+    local parts = {}
+    for _,k in ipairs(keys) do
+      table.insert(parts, tostring(k) .. '=' .. element_key(elt[k]))
+    end
+
+    return '{' .. table.concat(parts, ',') .. '}'
+  end
+
   local function check_args(name, schema, args)
     if schema then
       if getmetatable(schema) then
@@ -306,16 +397,29 @@ exports.parse_selector = function(cfg, str)
       return nil
     end
 
-    res.selector = lua_util.shallowcopy(extractors[selector_tbl[1]])
-    res.selector.name = selector_tbl[1]
-    res.selector.args = selector_tbl[2] or E
+    local prefix_key = element_key(selector_tbl)
 
-    if not check_args(res.selector.name,
-        res.selector.args_schema,
-        res.selector.args) then
-      return nil
+    if compiled_extractors[prefix_key] then
+      res.selector = compiled_extractors[prefix_key]
+    else
+      res.selector = lua_util.shallowcopy(extractors[selector_tbl[1]])
+      res.selector.name = selector_tbl[1]
+      res.selector.args = selector_tbl[2] or E
+
+      if not check_args(res.selector.name,
+          res.selector.args_schema,
+          res.selector.args) then
+        return nil
+      end
+
+      compiled_extractors[prefix_key] = res.selector
     end
 
+    local cache_keys = {
+      [0] = prefix_key,
+      raw = prefix_key .. '#raw',
+    }
+
     lua_util.debugm(M, cfg, 'processed selector %s, args: %s',
         res.selector.name, res.selector.args)
 
@@ -324,6 +428,18 @@ exports.parse_selector = function(cfg, str)
     fun.each(function(proc_tbl)
       local proc_name = proc_tbl[1]
 
+      if pipeline_error then
+        return
+      end
+
+      prefix_key = prefix_key .. '.' .. element_key(proc_tbl)
+      cache_keys[#res.processor_pipe + 1] = prefix_key
+
+      if compiled_processors[prefix_key] then
+        table.insert(res.processor_pipe, compiled_processors[prefix_key])
+        return
+      end
+
       if proc_name:match('^__') then
         -- Special case - method
         local method_name = proc_name:match('^__(.*)$')
@@ -367,6 +483,7 @@ exports.parse_selector = function(cfg, str)
         }
         lua_util.debugm(M, cfg, 'attached method %s to selector %s, args: %s',
             proc_name, res.selector.name, processor.args)
+        compiled_processors[prefix_key] = processor
         table.insert(res.processor_pipe, processor)
       else
 
@@ -386,6 +503,7 @@ exports.parse_selector = function(cfg, str)
 
         lua_util.debugm(M, cfg, 'attached processor %s to selector %s, args: %s',
             proc_name, res.selector.name, processor.args)
+        compiled_processors[prefix_key] = processor
         table.insert(res.processor_pipe, processor)
       end
     end, fun.tail(sel))
@@ -395,6 +513,11 @@ exports.parse_selector = function(cfg, str)
       return nil
     end
 
+    if not res.selector.volatile then
+      -- Results of this selector can be shared within a task
+      res.cache_keys = cache_keys
+    end
+
     table.insert(output, res)
   end
 
@@ -403,13 +526,23 @@ end
 
 --[[[
 -- @function lua_selectors.register_extractor(cfg, name, selector)
+-- Registers a custom extractor. Results of extractors are cached per task
+-- and shared between selectors, so an extractor whose value might change during
+-- the task processing must be registered with `volatile = true`. Custom
+-- extractors are considered volatile unless `volatile = false` is set explicitly.
 --]]
 exports.register_extractor = function(cfg, name, selector)
   if selector.get_value then
     if extractors[name] then
       logger.warnx(cfg, 'redefining selector %s', name)
     end
+    if selector.volatile == nil then
+      -- We know nothing about custom extractors, so do not cache their results
+      selector.volatile = true
+    end
     extractors[name] = selector
+    compiled_extractors = {}
+    compiled_processors = {}
 
     return true
   end
@@ -427,6 +560,7 @@ exports.register_transform = function(cfg, name, transform)
       logger.warnx(cfg, 'redefining transform function %s', name)
     end
     transform_function[name] = transform
+    compiled_processors = {}
 
     return true
   end
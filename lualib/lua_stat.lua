@@ -151,9 +151,9 @@ exports.convert_bayes_schema = convert_bayes_schema
 -- reset_previous - if true, then the old database is flushed (slow)
 local function convert_sqlite_to_redis(redis_params,
           sqlite_db_spam, sqlite_db_ham, symbol_spam, symbol_ham,
-          learn_cache_db, expire, reset_previous)
+          learn_cache_db, expire, reset_previous, batch_size)
   local nusers = 0
-  local lim = 1000 -- Update each 1000 tokens
+  local lim = batch_size or 1000 -- Update each 1000 tokens by default
   local users_map = {}
   local converted = 0
 
@@ -240,13 +240,18 @@ end
       if is_spam then
         hash_key = 'S'
       end
+      -- Old data is removed on reset, so there is nothing to increment
+      local cmd = 'HINCRBYFLOAT'
+      if reset_previous then
+        cmd = 'HSET'
+      end
       for _,tok in ipairs(tokens) do
         -- tok schema:
         -- tok[1] = token_id (uint64 represented as a string)
         -- tok[2] = token value (number)
         -- tok[3] = user_map[user_id] or ''
         local rkey = string.format('%s%s_%s', prefix, tok[3], tok[1])
-        conn:add_cmd('HINCRBYFLOAT', {rkey, hash_key, tostring(tok[2])})
+        conn:add_cmd(cmd, {rkey, hash_key, tostring(tok[2])})
 
         if expire and expire ~= 0 then
           conn:add_cmd('EXPIRE', {rkey, tostring(expire)})
@@ -283,9 +288,8 @@ end
 
         num = 0
         tokens = {}
+        io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
       end
-
-      io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
     end
     -- Last batch
     if #tokens > 0 then
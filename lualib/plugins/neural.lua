@@ -40,7 +40,7 @@ local default_options = {
     mse = 0.001,
     autotrain = true,
     train_prob = 1.0,
-    learn_threads = 1,
+    learn_threads = 1, -- number of threads used to train a single ANN
     learn_mode = 'balanced', -- Possible values: balanced, proportional
     learning_rate = 0.01,
     classes_bias = 0.0, -- balanced mode: what difference is allowed between classes (1:1 proportion means 0 bias)
@@ -58,6 +58,8 @@ local default_options = {
   symbol_ham = 'NEURAL_HAM',
   max_inputs = nil, -- when PCA is used
   blacklisted_symbols = {}, -- list of symbols skipped in neural processing
+  batch_timeout = nil, -- when set, evaluate ANN for concurrent tasks in batches waiting up to this time
+  batch_size = 32, -- max number of tasks in a batch
 }
 
 -- Rule structure:
@@ -479,6 +481,7 @@ local function spawn_train(params)
           inputs, outputs, {
             lr = params.rule.train.learning_rate,
             max_epoch = params.rule.train.max_iterations,
+            threads = params.rule.train.learn_threads,
             cb = train_cb,
             pca = pca
           })
@@ -25,7 +25,7 @@ return function (_, res)
   for _,cls in ipairs(sqlite_params) do
     if not stat_tools.convert_sqlite_to_redis(redis_params, cls.db_spam,
         cls.db_ham, cls.symbol_spam, cls.symbol_ham, cls.learn_cache, res.expire,
-        res.reset_previous) then
+        res.reset_previous, res.batch_size) then
       logger.errx('conversion failed')
 
       return false
@@ -61,7 +61,9 @@ static gboolean extended_urls = FALSE;
 static gboolean mime_output = FALSE;
 static gboolean empty_input = FALSE;
 static gboolean compressed = FALSE;
+static gboolean msgpack = FALSE;
 static gboolean profile = FALSE;
+static gboolean resources = FALSE;
 static gboolean skip_images = FALSE;
 static gboolean skip_attachments = FALSE;
 static gchar *key = NULL;
@@ -158,8 +160,12 @@ static GOptionEntry entries[] =
 	   "Enable zstd compression", NULL },
 	{ "profile", '\0', 0, G_OPTION_ARG_NONE, &profile,
 	   "Profile symbols execution time", NULL },
+	{ "resources", '\0', 0, G_OPTION_ARG_NONE, &resources,
+	   "Show resources consumed by scanning of a message", NULL },
 	{ "dictionary", 'D', 0, G_OPTION_ARG_FILENAME, &dictionary,
 	   "Use dictionary to compress data", NULL },
+	{ "msgpack", '\0', 0, G_OPTION_ARG_NONE, &msgpack,
+	   "Ask for binary msgpack reply instead of json", NULL },
 	{ "skip-images", '\0', 0, G_OPTION_ARG_NONE, &skip_images,
 	   "Skip images when learning/unlearning fuzzy", NULL },
 	{ "skip-attachments", '\0', 0, G_OPTION_ARG_NONE, &skip_attachments,
@@ -665,6 +671,10 @@ add_options (GQueue *opts)
 		ADD_CLIENT_FLAG (flagbuf, "profile");
 	}
 
+	if (resources) {
+		ADD_CLIENT_FLAG (flagbuf, "resources");
+	}
+
 	ADD_CLIENT_FLAG (flagbuf, "body_block");
 
 	if (skip_images) {
@@ -675,6 +685,10 @@ add_options (GQueue *opts)
 		ADD_CLIENT_HEADER (opts, "Skip-Attachments", "true");
 	}
 
+	if (msgpack) {
+		ADD_CLIENT_HEADER (opts, "Accept", "application/msgpack");
+	}
+
 	hdr = http_headers;
 
 	while (hdr != NULL && *hdr != NULL) {
@@ -915,6 +929,24 @@ rspamc_symbols_output (FILE *out, ucl_object_t *obj)
 		rspamd_fprintf (out, "Profile data:\n");
 		rspamc_profile_output (out, elt);
 	}
+
+	elt = ucl_object_lookup (obj, "resources");
+
+	if (elt && elt->type == UCL_OBJECT) {
+		rspamd_fprintf (out, "Resources:\n");
+		mit = NULL;
+
+		while ((cmesg = ucl_object_iterate (elt, &mit, true)) != NULL) {
+			if (cmesg->type == UCL_FLOAT) {
+				rspamd_fprintf (out, "\t%s: %.3f\n",
+						ucl_object_key (cmesg), ucl_object_todouble (cmesg));
+			}
+			else {
+				rspamd_fprintf (out, "\t%s: %L\n",
+						ucl_object_key (cmesg), ucl_object_toint (cmesg));
+			}
+		}
+	}
 }
 
 static void
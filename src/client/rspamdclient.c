@@ -53,6 +53,9 @@ struct rspamd_client_request {
 	GString *input;
 	rspamd_client_callback cb;
 	gpointer ud;
+	void *dict;
+	gsize dict_len;
+	guint dict_id;
 };
 
 #define RCLIENT_ERROR rspamd_client_error_quark ()
@@ -73,6 +76,10 @@ rspamd_client_request_free (struct rspamd_client_request *req)
 			g_string_free (req->input, TRUE);
 		}
 
+		if (req->dict) {
+			munmap (req->dict, req->dict_len);
+		}
+
 		g_free (req);
 	}
 }
@@ -112,6 +119,7 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	const gchar *start, *body = NULL;
 	guchar *out = NULL;
 	gsize len, bodylen = 0;
+	enum ucl_parse_type parse_type = UCL_PARSE_UCL;
 
 	c = req->conn;
 
@@ -151,10 +159,32 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 				ZSTD_inBuffer zin;
 				ZSTD_outBuffer zout;
 				gsize outlen, r;
+				gulong dict_id;
+
+				tok = rspamd_http_message_find_header (msg, "Dictionary");
+
+				if (tok != NULL && (req->dict == NULL ||
+						!rspamd_strtoul (tok->begin, tok->len, &dict_id) ||
+						dict_id != req->dict_id)) {
+					err = g_error_new (RCLIENT_ERROR, 500,
+							"Unknown dictionary: %.*s",
+							(gint)tok->len, tok->begin);
+					req->cb (c, msg, c->server_name->str, NULL,
+							req->input, req->ud, c->start_time,
+							c->send_time, body, bodylen, err);
+					g_error_free (err);
+
+					return 0;
+				}
 
 				zstream = ZSTD_createDStream ();
 				ZSTD_initDStream (zstream);
 
+				if (tok != NULL) {
+					/* Reply is compressed with our own request dictionary */
+					ZSTD_DCtx_loadDictionary (zstream, req->dict, req->dict_len);
+				}
+
 				zin.pos = 0;
 				zin.src = msg->body_buf.begin;
 				zin.size = msg->body_buf.len;
@@ -226,8 +256,21 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			}
 		}
 
+		tok = rspamd_http_message_find_header (msg, "Content-Type");
+
+		if (tok) {
+			rspamd_ftok_t t;
+
+			RSPAMD_FTOK_ASSIGN (&t, MSGPACK_CONTENT_TYPE);
+
+			if (rspamd_ftok_casecmp (tok, &t) == 0) {
+				parse_type = UCL_PARSE_MSGPACK;
+			}
+		}
+
 		parser = ucl_parser_new (0);
-		if (!ucl_parser_add_chunk (parser, start, len)) {
+		if (!ucl_parser_add_chunk_full (parser, start, len, 0,
+				UCL_DUPLICATE_APPEND, parse_type)) {
 			err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
 					ucl_parser_get_error (parser));
 			ucl_parser_free (parser);
@@ -390,13 +433,13 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 					return FALSE;
 				}
 
-				dict_id = -1;
+				dict_id = ZSTD_getDictID_fromDict (dict, dict_len);
 
 				if (dict_id == 0) {
-					g_set_error (err, RCLIENT_ERROR, errno,
+					g_set_error (err, RCLIENT_ERROR, EINVAL,
 							"cannot open dictionary %s: %s",
 							comp_dictionary,
-							strerror (errno));
+							"not a trained zstd dictionary");
 					g_free (req);
 					g_string_free (input, TRUE);
 					munmap (dict, dict_len);
@@ -412,8 +455,6 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 					dict, dict_len,
 					1);
 
-			munmap (dict, dict_len);
-
 			if (ZSTD_isError (body->len)) {
 				g_set_error (err, RCLIENT_ERROR, ferror (
 						in), "compression error");
@@ -422,10 +463,18 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 				rspamd_fstring_free (body);
 				ZSTD_freeCCtx (zctx);
 
+				if (dict) {
+					munmap (dict, dict_len);
+				}
+
 				return FALSE;
 			}
 
 			ZSTD_freeCCtx (zctx);
+			/* Keep dictionary to decompress reply */
+			req->dict = dict;
+			req->dict_len = dict_len;
+			req->dict_id = dict_id;
 		}
 
 		rspamd_http_message_set_body_from_fstring_steal (req->msg, body);
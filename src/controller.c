@@ -17,6 +17,8 @@
 #include "libserver/dynamic_cfg.h"
 #include "libserver/cfg_file_private.h"
 #include "libutil/rrd.h"
+#include "libutil/timeseries.h"
+#include "libutil/shm_cache.h"
 #include "libserver/maps/map.h"
 #include "libserver/maps/map_helpers.h"
 #include "libserver/maps/map_private.h"
@@ -37,6 +39,7 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+#define DEFAULT_KEEPALIVE_TIMEOUT 30.0
 
 /* HTTP paths */
 #define PATH_AUTH "/auth"
@@ -59,10 +62,13 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_RE_COUNTERS "/recounters"
+#define PATH_MEMPOOL "/mempool"
 #define PATH_ERRORS "/errors"
 #define PATH_NEIGHBOURS "/neighbours"
 #define PATH_PLUGINS "/plugins"
 #define PATH_PING "/ping"
+#define PATH_METRICS "/metrics"
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
         session->pool->tag.tagname, session->pool->tag.uid, \
@@ -134,6 +140,9 @@ struct rspamd_controller_worker_ctx {
 	ev_tstamp timeout;
 	/* Whether we use ssl for this server */
 	gboolean use_ssl;
+	/* Persistent connections */
+	gboolean keepalive;
+	ev_tstamp keepalive_timeout;
 	/* Webui password */
 	gchar *password;
 	/* Privilleged password */
@@ -172,6 +181,8 @@ struct rspamd_controller_worker_ctx {
 	gpointer key;
 
 	struct rspamd_rrd_file *rrd;
+	/* Time series storage */
+	struct rspamd_timeseries *ts;
 	struct rspamd_lang_detector *lang_det;
 	gdouble task_timeout;
 };
@@ -804,7 +815,7 @@ rspamd_controller_handle_symbols (struct rspamd_http_connection_entry *conn_ent,
 		group_symbols = ucl_object_typed_new (UCL_ARRAY);
 
 		while (g_hash_table_iter_next (&sit, &k, &v)) {
-			gdouble tm = 0.0, freq = 0, freq_dev = 0;
+			gdouble tm = 0.0, freq = 0, freq_dev = 0, p50, p99, p999;
 
 			sym = v;
 			sym_obj = ucl_object_typed_new (UCL_OBJECT);
@@ -833,6 +844,19 @@ rspamd_controller_handle_symbols (struct rspamd_http_connection_entry *conn_ent,
 						"time", 0, false);
 			}
 
+			if (rspamd_symcache_stat_symbol_latency (session->ctx->cfg->cache,
+					sym->name, &p50, &p99, &p999)) {
+				ucl_object_insert_key (sym_obj,
+						ucl_object_fromdouble (p50),
+						"time_p50", 0, false);
+				ucl_object_insert_key (sym_obj,
+						ucl_object_fromdouble (p99),
+						"time_p99", 0, false);
+				ucl_object_insert_key (sym_obj,
+						ucl_object_fromdouble (p999),
+						"time_p999", 0, false);
+			}
+
 			ucl_array_append (group_symbols, sym_obj);
 		}
 
@@ -1197,6 +1221,60 @@ rspamd_controller_graph_point (gulong t, gulong step,
 	}
 }
 
+/*
+ * Time series are stored with the resolution needed for graphs, so points
+ * are sent as they are
+ */
+static void
+rspamd_controller_graph_timeseries (struct rspamd_http_connection_entry *conn_ent,
+		struct rspamd_timeseries *ts,
+		guint res_num)
+{
+	struct rspamd_timeseries_result *ts_res;
+	ucl_object_t *res, *elt, *data_elt;
+	gdouble yval;
+	guint i, j;
+
+	ts_res = rspamd_timeseries_query (ts, res_num);
+
+	if (ts_res == NULL) {
+		rspamd_controller_send_error (conn_ent, 500, "Cannot query time series");
+
+		return;
+	}
+
+	res = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < ts_res->nseries; i ++) {
+		elt = ucl_object_typed_new (UCL_ARRAY);
+
+		for (j = 0; j < ts_res->npoints; j ++) {
+			data_elt = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (data_elt,
+					ucl_object_fromint (ts_res->start + j * ts_res->step),
+					"x", 1, false);
+			yval = ts_res->data[j * ts_res->nseries + i];
+
+			if (isfinite (yval)) {
+				ucl_object_insert_key (data_elt, ucl_object_fromdouble (yval),
+						"y", 1, false);
+			}
+			else {
+				ucl_object_insert_key (data_elt, ucl_object_typed_new (UCL_NULL),
+						"y", 1, false);
+			}
+
+			ucl_array_append (elt, data_elt);
+		}
+
+		ucl_array_append (res, elt);
+	}
+
+	rspamd_timeseries_result_free (ts_res);
+	rspamd_controller_send_ucl (conn_ent, res);
+	ucl_object_unref (res);
+}
+
 /*
  * Graph command handler:
  * request: /graph?type=<day|week|month|year>
@@ -1236,7 +1314,7 @@ rspamd_controller_handle_graph (
 		return 0;
 	}
 
-	if (ctx->rrd == NULL) {
+	if (ctx->rrd == NULL && ctx->ts == NULL) {
 		msg_err_session ("no rrd configured");
 		rspamd_controller_send_error (conn_ent, 404, "No rrd configured for graphs");
 
@@ -1280,6 +1358,13 @@ rspamd_controller_handle_graph (
 		return 0;
 	}
 
+	if (ctx->ts) {
+		/* Graph types match time series resolutions */
+		rspamd_controller_graph_timeseries (conn_ent, ctx->ts, rra_num);
+
+		return 0;
+	}
+
 	rrd_result = rspamd_rrd_query (ctx->rrd, rra_num);
 
 	if (rrd_result == NULL) {
@@ -1447,6 +1532,24 @@ rspamd_controller_handle_legacy_history (
 			ucl_object_insert_key (obj,
 					ucl_object_fromdouble (row->scan_time),
 					"scan_time", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromdouble (row->cpu_time),
+					"cpu_time", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (row->mempool_bytes),
+					"mempool_bytes", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (row->lua_heap),
+					"lua_heap", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (row->re_bytes),
+					"re_bytes", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (row->dns_requests),
+					"dns_requests", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (row->redis_requests),
+					"redis_requests", 0, false);
 
 			if (row->user[0] != '\0') {
 				ucl_object_insert_key (obj, ucl_object_fromstring (row->user),
@@ -1676,7 +1779,7 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
 	struct roll_history_row *row;
-	guint completed_rows, i, t;
+	guint completed_rows, i;
 	lua_State *L;
 
 	ctx = session->ctx;
@@ -1687,21 +1790,19 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 	}
 
 	if (!ctx->srv->history->disabled) {
-		/* Clean from start to the current row */
-		completed_rows = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-		completed_rows = MIN (completed_rows, ctx->srv->history->nrows - 1);
+		/*
+		 * Workers append rows concurrently, so clean all completed rows:
+		 * a row being written now is not completed and is kept
+		 */
+		completed_rows = 0;
 
-		for (i = 0; i <= completed_rows; i ++) {
-			t = g_atomic_int_get (&ctx->srv->history->cur_row);
+		for (i = 0; i < ctx->srv->history->nrows; i ++) {
+			row = &ctx->srv->history->rows[i];
 
-			/* We somehow come to the race condition */
-			if (i > t) {
-				break;
+			if (g_atomic_int_get (&row->completed)) {
+				g_atomic_int_set (&row->completed, FALSE);
+				completed_rows ++;
 			}
-
-			row = &ctx->srv->history->rows[i];
-			memset (row, 0, sizeof (*row));
 		}
 
 		msg_info_session ("<%s> cleared %d entries from history",
@@ -2011,6 +2112,8 @@ rspamd_controller_handle_learn_common (
 	task->fin_arg = conn_ent;
 	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);;
 	task->sock = -1;
+	/* Learning should not delay scans in the controller */
+	task->flags |= RSPAMD_TASK_FLAG_BULK;
 	session->task = task;
 
 	cl_header = rspamd_http_message_find_header (msg, "classifier");
@@ -2558,6 +2661,49 @@ rspamd_controller_stat_cleanup_task (void *ud)
  * headers: Password
  * reply: json data
  */
+/* Per worker type scheduling settings: events backend and cpus */
+static ucl_object_t *
+rspamd_controller_workers_stat (struct rspamd_config *cfg)
+{
+	ucl_object_t *ar, *obj;
+	struct rspamd_worker_conf *cf;
+	GList *cur;
+
+	ar = ucl_object_typed_new (UCL_ARRAY);
+
+	for (cur = cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = (struct rspamd_worker_conf *)cur->data;
+
+		if (!cf->enabled) {
+			continue;
+		}
+
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (g_quark_to_string (cf->type)),
+				"type", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cf->count),
+				"count", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_config_ev_backend_to_string (
+						rspamd_config_worker_ev_backend_get (cfg, cf), NULL)),
+				"events_backend", 0, false);
+
+		if (cf->cpu_affinity) {
+			ucl_object_insert_key (obj,
+					ucl_object_fromstring (cf->cpu_affinity),
+					"cpu_affinity", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_frombool (cf->cpu_affinity_spread),
+					"cpu_affinity_spread", 0, false);
+		}
+
+		ucl_array_append (ar, obj);
+	}
+
+	return ar;
+}
+
 static int
 rspamd_controller_handle_stat_common (
 	struct rspamd_http_connection_entry *conn_ent,
@@ -2646,6 +2792,56 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->url_cache_hits), "url_cache_hits", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->url_cache_misses), "url_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->bayes_cache_hits), "bayes_cache_hits", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->bayes_cache_misses), "bayes_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->stem_cache_hits), "stem_cache_hits", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->stem_cache_misses), "stem_cache_misses", 0,
+		false);
+	if (session->cfg->dns_cache) {
+		guint64 dns_hits, dns_misses, dns_stored;
+
+		rspamd_dns_shared_cache_stat (session->cfg->dns_cache, &dns_hits,
+				&dns_misses, &dns_stored);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (dns_hits), "dns_cache_hits", 0, false);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (dns_misses), "dns_cache_misses", 0, false);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (dns_stored), "dns_cache_stored", 0, false);
+	}
+
+	if (session->cfg->shm_cache) {
+		struct rspamd_shm_cache_stat shm_st;
+
+		rspamd_shm_cache_stat (session->cfg->shm_cache, &shm_st);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (shm_st.hits), "shm_cache_hits", 0, false);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (shm_st.misses), "shm_cache_misses", 0, false);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (shm_st.evicted), "shm_cache_evicted", 0, false);
+	}
+
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->scans_shed), "scans_shed", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->scans_fast_pathed), "scans_fast_pathed", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->scans_host_limited), "scans_host_limited", 0,
+		false);
 
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
@@ -2669,11 +2865,43 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 			ucl_object_fromint (mem_st.fragmented_size), "fragmented", 0, false);
 
+	if (ctx->http_ctx) {
+		ucl_object_insert_key (top,
+				rspamd_http_context_keypairs_stat (ctx->http_ctx),
+				"keypairs_cache", 0, false);
+	}
+
+	ucl_object_insert_key (top, rspamd_controller_workers_stat (ctx->cfg),
+			"workers", 0, false);
+	ucl_object_insert_key (top, rspamd_worker_load_stat_ucl (ctx->srv),
+			"processes", 0, false);
+
+	if (ctx->srv->task_timings) {
+		ucl_object_insert_key (top,
+				rspamd_task_timings_to_ucl (ctx->srv->task_timings),
+				"task_timings", 0, false);
+	}
+
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+		session->ctx->srv->stat->url_cache_hits = 0;
+		session->ctx->srv->stat->url_cache_misses = 0;
+		session->ctx->srv->stat->bayes_cache_hits = 0;
+		session->ctx->srv->stat->bayes_cache_misses = 0;
+		session->ctx->srv->stat->stem_cache_hits = 0;
+		session->ctx->srv->stat->stem_cache_misses = 0;
+		session->ctx->srv->stat->scans_shed = 0;
+		session->ctx->srv->stat->scans_fast_pathed = 0;
+		session->ctx->srv->stat->scans_host_limited = 0;
+
+		if (session->ctx->srv->task_timings) {
+			memset (session->ctx->srv->task_timings, 0,
+					sizeof (*session->ctx->srv->task_timings));
+		}
+
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -2751,6 +2979,82 @@ rspamd_controller_handle_counters (
 	return 0;
 }
 
+/*
+ * Regexp counters command handler:
+ * request: /recounters
+ * headers: Password
+ * reply: json array of regexps execution counters, most costly first
+ */
+static int
+rspamd_controller_handle_re_counters (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+	struct rspamd_re_cache *cache;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->re_cache;
+
+	if (cache != NULL) {
+		top = rspamd_re_cache_counters (cache);
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+	}
+	else {
+		rspamd_controller_send_error (conn_ent, 500, "Invalid cache");
+	}
+
+	return 0;
+}
+
+/*
+ * Memory pool profile command handler:
+ * request: /mempool
+ * headers: Password, Count (optional number of sites, 100 by default)
+ * reply: json array of allocation sites, most allocated bytes first
+ */
+static int
+rspamd_controller_handle_mempool (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	const rspamd_ftok_t *hdr;
+	ucl_object_t *top;
+	gulong count = 100;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	if (session->ctx->cfg->mempool_profile_rate == 0) {
+		rspamd_controller_send_error (conn_ent, 404,
+				"Memory pool profiling is disabled");
+
+		return 0;
+	}
+
+	hdr = rspamd_http_message_find_header (msg, "Count");
+
+	if (hdr != NULL && (!rspamd_strtoul (hdr->begin, hdr->len, &count) ||
+			count == 0)) {
+		rspamd_controller_send_error (conn_ent, 400, "Invalid count");
+
+		return 0;
+	}
+
+	top = rspamd_worker_mempool_profile (MIN (count, 4096));
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -2903,6 +3207,242 @@ rspamd_controller_handle_ping (struct rspamd_http_connection_entry *conn_ent,
 	return 0;
 }
 
+static void
+rspamd_controller_metric_header (GString *out, const gchar *name,
+		const gchar *type, const gchar *help)
+{
+	rspamd_printf_gstring (out, "# HELP rspamd_%s %s\n# TYPE rspamd_%s %s\n",
+			name, help, name, type);
+}
+
+static void
+rspamd_controller_metric_simple (GString *out, const gchar *name,
+		const gchar *type, const gchar *help, guint64 value)
+{
+	rspamd_controller_metric_header (out, name, type, help);
+	rspamd_printf_gstring (out, "rspamd_%s %uL\n", name, value);
+}
+
+static void
+rspamd_controller_metric_label (GString *out, const gchar *value)
+{
+	const gchar *p;
+
+	for (p = value; *p != '\0'; p ++) {
+		switch (*p) {
+		case '\\':
+			g_string_append_len (out, "\\\\", 2);
+			break;
+		case '"':
+			g_string_append_len (out, "\\\"", 2);
+			break;
+		case '\n':
+			g_string_append_len (out, "\\n", 2);
+			break;
+		default:
+			g_string_append_c (out, *p);
+			break;
+		}
+	}
+}
+
+static void
+rspamd_controller_metrics_symbols (GString *out, struct rspamd_symcache *cache)
+{
+	ucl_object_t *top;
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it;
+	static const struct {
+		const gchar *key;
+		const gchar *name;
+		const gchar *type;
+		const gchar *help;
+	} fields[] = {
+		{"hits", "symbol_hits_total", "counter", "Number of symbol hits"},
+		{"time", "symbol_avg_time_ms", "gauge", "Average symbol execution time"},
+		{"frequency", "symbol_avg_frequency", "gauge",
+				"Average symbol hits frequency"},
+	};
+	guint i;
+
+	top = rspamd_symcache_counters (cache);
+
+	for (i = 0; i < G_N_ELEMENTS (fields); i ++) {
+		rspamd_controller_metric_header (out, fields[i].name, fields[i].type,
+				fields[i].help);
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (top, &it, true)) != NULL) {
+			elt = ucl_object_lookup (cur, fields[i].key);
+
+			if (elt == NULL) {
+				continue;
+			}
+
+			rspamd_printf_gstring (out, "rspamd_%s{symbol=\"", fields[i].name);
+			rspamd_controller_metric_label (out,
+					ucl_object_tostring (ucl_object_lookup (cur, "symbol")));
+			rspamd_printf_gstring (out, "\"} %g\n", ucl_object_todouble (elt));
+		}
+	}
+
+	ucl_object_unref (top);
+}
+
+/*
+ * Metrics command handler:
+ * request: /metrics
+ * headers: Password
+ * reply: statistics in Prometheus text exposition format
+ */
+static int
+rspamd_controller_handle_metrics (struct rspamd_http_connection_entry *conn_ent,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_http_message *rep_msg;
+	struct rspamd_stat stat;
+	rspamd_mempool_stat_t mem_st;
+	rspamd_fstring_t *reply;
+	GString *out;
+	gint i;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	/* Everything here lives in shared memory, so no workers are queried */
+	memcpy (&stat, ctx->srv->stat, sizeof (stat));
+	memset (&mem_st, 0, sizeof (mem_st));
+	rspamd_mempool_stat (&mem_st);
+	out = g_string_sized_new (8192);
+
+	rspamd_controller_metric_simple (out, "uptime_seconds", "gauge",
+			"Time since controller start",
+			(guint64)(ev_time () - ctx->start_time));
+	rspamd_controller_metric_simple (out, "scanned_total", "counter",
+			"Number of scanned messages", stat.messages_scanned);
+	rspamd_controller_metric_simple (out, "learned_total", "counter",
+			"Number of learned messages", stat.messages_learned);
+	rspamd_controller_metric_header (out, "actions_total", "counter",
+			"Number of messages per action");
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
+		rspamd_printf_gstring (out, "rspamd_actions_total{action=\"%s\"} %uL\n",
+				rspamd_action_to_str (i), stat.actions_stat[i]);
+	}
+
+	rspamd_controller_metric_simple (out, "connections_total", "counter",
+			"Number of scanner connections", stat.connections_count);
+	rspamd_controller_metric_simple (out, "control_connections_total",
+			"counter", "Number of controller connections",
+			stat.control_connections_count);
+	rspamd_controller_metric_simple (out, "url_cache_hits_total", "counter",
+			"URL cache hits", stat.url_cache_hits);
+	rspamd_controller_metric_simple (out, "url_cache_misses_total", "counter",
+			"URL cache misses", stat.url_cache_misses);
+	rspamd_controller_metric_simple (out, "bayes_cache_hits_total", "counter",
+			"Bayes cache hits", stat.bayes_cache_hits);
+	rspamd_controller_metric_simple (out, "bayes_cache_misses_total", "counter",
+			"Bayes cache misses", stat.bayes_cache_misses);
+	rspamd_controller_metric_simple (out, "stem_cache_hits_total", "counter",
+			"Stemmer cache hits", stat.stem_cache_hits);
+	rspamd_controller_metric_simple (out, "stem_cache_misses_total", "counter",
+			"Stemmer cache misses", stat.stem_cache_misses);
+	rspamd_controller_metric_simple (out, "scans_shed_total", "counter",
+			"Scans rejected due to overload", stat.scans_shed);
+	rspamd_controller_metric_simple (out, "scans_fast_pathed_total", "counter",
+			"Scans finished by fast path", stat.scans_fast_pathed);
+	rspamd_controller_metric_simple (out, "scans_host_limited_total", "counter",
+			"Scans limited per host", stat.scans_host_limited);
+	rspamd_controller_metric_simple (out, "reloads_total", "counter",
+			"Configuration reloads", stat.reloads);
+	rspamd_controller_metric_simple (out, "reloads_ready_timeout_total",
+			"counter", "Reloads when new workers were not ready in time",
+			stat.reloads_ready_timeout);
+	rspamd_controller_metric_simple (out, "last_reload_config_milliseconds",
+			"gauge", "Time to load config and spawn workers on the last reload",
+			stat.reload_config_ms);
+	rspamd_controller_metric_simple (out, "last_reload_ready_milliseconds",
+			"gauge", "Time until new workers were ready on the last reload",
+			stat.reload_ready_ms);
+	rspamd_controller_metric_simple (out, "last_reload_overlap_milliseconds",
+			"gauge", "Time both workers generations served on the last reload",
+			stat.reload_overlap_ms);
+
+	if (session->cfg->dns_cache) {
+		guint64 dns_hits, dns_misses, dns_stored;
+
+		rspamd_dns_shared_cache_stat (session->cfg->dns_cache, &dns_hits,
+				&dns_misses, &dns_stored);
+		rspamd_controller_metric_simple (out, "dns_cache_hits_total", "counter",
+				"Shared DNS cache hits", dns_hits);
+		rspamd_controller_metric_simple (out, "dns_cache_misses_total",
+				"counter", "Shared DNS cache misses", dns_misses);
+		rspamd_controller_metric_simple (out, "dns_cache_stored", "gauge",
+				"Shared DNS cache elements", dns_stored);
+	}
+
+	if (session->cfg->shm_cache) {
+		struct rspamd_shm_cache_stat shm_st;
+
+		rspamd_shm_cache_stat (session->cfg->shm_cache, &shm_st);
+		rspamd_controller_metric_simple (out, "shm_cache_hits_total", "counter",
+				"Shared key value cache hits", shm_st.hits);
+		rspamd_controller_metric_simple (out, "shm_cache_misses_total",
+				"counter", "Shared key value cache misses", shm_st.misses);
+		rspamd_controller_metric_simple (out, "shm_cache_evicted_total",
+				"counter", "Shared key value cache live elements evicted",
+				shm_st.evicted);
+	}
+
+	rspamd_controller_metric_simple (out, "pools_allocated", "gauge",
+			"Memory pools allocated", mem_st.pools_allocated);
+	rspamd_controller_metric_simple (out, "pools_freed", "gauge",
+			"Memory pools freed", mem_st.pools_freed);
+	rspamd_controller_metric_simple (out, "bytes_allocated", "gauge",
+			"Bytes allocated in memory pools", mem_st.bytes_allocated);
+	rspamd_controller_metric_simple (out, "chunks_allocated", "gauge",
+			"Memory pool chunks allocated", mem_st.chunks_allocated);
+	rspamd_controller_metric_simple (out, "shared_chunks_allocated", "gauge",
+			"Shared memory pool chunks allocated",
+			mem_st.shared_chunks_allocated);
+	rspamd_controller_metric_simple (out, "chunks_freed", "gauge",
+			"Memory pool chunks freed", mem_st.chunks_freed);
+	rspamd_controller_metric_simple (out, "chunks_oversized", "gauge",
+			"Oversized memory pool chunks", mem_st.oversized_chunks);
+	rspamd_controller_metric_simple (out, "fragmented_bytes", "gauge",
+			"Memory pools fragmentation", mem_st.fragmented_size);
+
+	if (ctx->cfg->cache) {
+		rspamd_controller_metrics_symbols (out, ctx->cfg->cache);
+	}
+
+	if (ctx->srv->task_timings) {
+		rspamd_task_timings_to_prometheus (ctx->srv->task_timings, "rspamd", out);
+	}
+
+	rep_msg = rspamd_http_new_message (HTTP_RESPONSE);
+	rep_msg->date = time (NULL);
+	rep_msg->code = 200;
+	rep_msg->status = rspamd_fstring_new_init ("OK", 2);
+	reply = rspamd_fstring_new_init (out->str, out->len);
+	g_string_free (out, TRUE);
+	rspamd_http_message_set_body_from_fstring_steal (rep_msg, reply);
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_router_insert_headers (conn_ent->rt, rep_msg);
+	rspamd_http_connection_write_message (conn_ent->conn,
+			rep_msg,
+			NULL,
+			"text/plain; version=0.0.4",
+			conn_ent,
+			conn_ent->rt->timeout);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
 /*
  * Called on unknown methods and is used to deal with CORS as per
  * https://developer.mozilla.org/en-US/docs/Web/HTTP/Access_control_CORS
@@ -3110,6 +3650,41 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 	g_free (session);
 }
 
+static struct rspamd_controller_session *
+rspamd_controller_session_new (struct rspamd_controller_worker_ctx *ctx,
+		struct rspamd_worker *worker, rspamd_inet_addr_t *addr)
+{
+	struct rspamd_controller_session *session;
+
+	session = g_malloc0 (sizeof (struct rspamd_controller_session));
+	session->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"csession", 0);
+	session->ctx = ctx;
+	session->cfg = ctx->cfg;
+	session->lang_det = ctx->lang_det;
+	REF_RETAIN (session->cfg);
+
+	session->from_addr = addr;
+	session->wrk = worker;
+	worker->nconns ++;
+
+	return session;
+}
+
+/* Each request on a persistent connection gets its own session */
+static gpointer
+rspamd_controller_keepalive_handler (struct rspamd_http_connection_entry *conn_ent)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+
+	if (session->wrk->state != rspamd_worker_state_running) {
+		return NULL;
+	}
+
+	return rspamd_controller_session_new (session->ctx, session->wrk,
+			rspamd_inet_address_copy (session->from_addr));
+}
+
 static void
 rspamd_controller_accept_socket (EV_P_ ev_io *w, int revents)
 {
@@ -3132,18 +3707,7 @@ rspamd_controller_accept_socket (EV_P_ ev_io *w, int revents)
 		return;
 	}
 
-	session = g_malloc0 (sizeof (struct rspamd_controller_session));
-	session->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
-			"csession", 0);
-	session->ctx = ctx;
-	session->cfg = ctx->cfg;
-	session->lang_det = ctx->lang_det;
-	REF_RETAIN (session->cfg);
-
-	session->from_addr = addr;
-	session->wrk = worker;
-	worker->nconns ++;
-
+	session = rspamd_controller_session_new (ctx, worker, addr);
 	rspamd_http_router_handle_socket (ctx->http, nfd, session);
 }
 
@@ -3184,6 +3748,7 @@ init_controller_worker (struct rspamd_config *cfg)
 	ctx->magic = rspamd_controller_ctx_magic;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->task_timeout = NAN;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -3240,6 +3805,25 @@ init_controller_worker (struct rspamd_config *cfg)
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Protocol timeout");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx, keepalive),
+			0,
+			"Keep HTTP/1.1 connections open between requests (default: false)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Idle timeout of a persistent connection (default: 30 seconds)");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"secure_ip",
@@ -3584,6 +4168,11 @@ start_controller_worker (struct rspamd_worker *worker)
 			rspamd_controller_finish_handler, ctx->timeout,
 			ctx->static_files_dir, ctx->http_ctx);
 
+	if (ctx->keepalive) {
+		rspamd_http_router_set_keepalive (ctx->http,
+				rspamd_controller_keepalive_handler, ctx->keepalive_timeout);
+	}
+
 	/* Add callbacks for different methods */
 	rspamd_http_router_add_path (ctx->http,
 			PATH_AUTH,
@@ -3645,6 +4234,12 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_RE_COUNTERS,
+			rspamd_controller_handle_re_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_MEMPOOL,
+			rspamd_controller_handle_mempool);
 	rspamd_http_router_add_path (ctx->http,
 			PATH_ERRORS,
 			rspamd_controller_handle_errors);
@@ -3657,6 +4252,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_PING,
 			rspamd_controller_handle_ping);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+			rspamd_controller_handle_metrics);
 	rspamd_controller_register_plugins_paths (ctx);
 
 #if 0
@@ -3706,7 +4304,7 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_symcache_start_refresh (worker->srv->cfg->cache, ctx->event_loop,
 			worker);
 	rspamd_stat_init (worker->srv->cfg, ctx->event_loop);
-	rspamd_worker_init_controller (worker, &ctx->rrd);
+	rspamd_worker_init_controller (worker, &ctx->rrd, &ctx->ts);
 	rspamd_lua_run_postloads (ctx->cfg->lua_state, ctx->cfg, ctx->event_loop, worker);
 
 #ifdef WITH_HYPERSCAN
@@ -3719,7 +4317,7 @@ start_controller_worker (struct rspamd_worker *worker)
 	/* Start event loop */
 	ev_loop (ctx->event_loop, 0);
 	rspamd_worker_block_signals ();
-	rspamd_controller_on_terminate (worker, ctx->rrd);
+	rspamd_controller_on_terminate (worker, ctx->rrd, ctx->ts);
 
 	rspamd_stat_close ();
 	rspamd_http_router_free (ctx->http);
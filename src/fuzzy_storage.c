@@ -29,6 +29,8 @@
 #include "xxhash.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libserver/http/http_router.h"
+#include "libserver/http/http_message.h"
 #include "libcryptobox/cryptobox.h"
 #include "libcryptobox/keypairs_cache.h"
 #include "libcryptobox/keypair.h"
@@ -43,6 +45,8 @@
 /* Resync value in seconds */
 #define DEFAULT_SYNC_TIMEOUT 60.0
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
+#define DEFAULT_BULK_TIMEOUT 60.0
+#define DEFAULT_HOT_CACHE_TTL 2.0
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
 #define COOKIE_SIZE 128
@@ -130,6 +134,29 @@ struct rspamd_leaky_bucket_elt {
 
 static const guint64 rspamd_fuzzy_storage_magic = 0x291a3253eb1b3ea5ULL;
 
+/* Batched commands are the largest datagrams we can receive */
+#define FUZZY_INPUT_BUFLEN RSPAMD_FUZZY_BATCH_MAXLEN
+/* Maximum number of updates sent to the peer in a single datagram */
+#define FUZZY_PEER_BATCH 16
+#ifdef HAVE_RECVMMSG
+#define MSGVEC_LEN 16
+#else
+#define MSGVEC_LEN 1
+#endif
+
+struct fuzzy_session;
+
+#ifdef HAVE_SENDMMSG
+/* Replies to a batch of requests that are sent at once */
+struct fuzzy_replies_batch {
+	gint fd;
+	guint nreplies;
+	struct mmsghdr msg[MSGVEC_LEN];
+	struct iovec iovs[MSGVEC_LEN];
+	struct fuzzy_session *sessions[MSGVEC_LEN];
+};
+#endif
+
 struct rspamd_fuzzy_storage_ctx {
 	guint64 magic;
 	/* Events base */
@@ -154,6 +181,13 @@ struct rspamd_fuzzy_storage_ctx {
 	const ucl_object_t *ratelimit_whitelist_map;
 
 	guint keypair_cache_size;
+	guint keypair_cache_shared_size;
+	/* Bulk import of hashes over HTTP, served by the worker 0 only */
+	const gchar *bulk_bind;
+	const gchar *bulk_password;
+	gdouble bulk_timeout;
+	struct rspamd_http_connection_router *bulk_router;
+	GPtrArray *bulk_listeners;
 	ev_timer stat_ev;
 	ev_io peer_ev;
 
@@ -165,15 +199,26 @@ struct rspamd_fuzzy_storage_ctx {
 	gboolean read_only;
 	gboolean dedicated_update_worker;
 	struct rspamd_keypair_cache *keypair_cache;
+	/* Shared keys computed by all workers, allocated before fork */
+	struct rspamd_keypair_shared_cache *shared_keypair_cache;
 	struct rspamd_http_context *http_ctx;
 	rspamd_lru_hash_t *errors_ips;
 	rspamd_lru_hash_t *ratelimit_buckets;
+	/* Recent check replies of this worker indexed by digest */
+	rspamd_lru_hash_t *hot_cache;
+	guint hot_cache_size;
+	gdouble hot_cache_ttl;
+	guint64 hot_cache_hits;
+	guint64 hot_cache_misses;
 	struct rspamd_fuzzy_backend *backend;
 	GArray *updates_pending;
 	guint updates_failed;
 	guint updates_maxfail;
 	/* Used to send data between workers */
 	gint peer_fd;
+	/* Updates for the peer collected while a batch of requests is processed */
+	GArray *peer_updates;
+	gboolean peer_batching;
 
 	/* Ratelimits */
 	guint leaky_bucket_ttl;
@@ -188,6 +233,10 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_hash_map_helper *skip_hashes;
 	gint lua_pre_handler_cbref;
 	gint lua_post_handler_cbref;
+#ifdef HAVE_SENDMMSG
+	/* Not NULL while received requests are processed */
+	struct fuzzy_replies_batch *replies_batch;
+#endif
 	guchar cookie[COOKIE_SIZE];
 };
 
@@ -215,12 +264,29 @@ struct fuzzy_session {
 	ref_entry_t ref;
 	struct fuzzy_key_stat *key_stat;
 	struct rspamd_fuzzy_cmd_extension *extensions;
+	struct fuzzy_batch_reply *batch; /* If the command is a part of batch */
+	guint batch_idx;
 	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
 };
 
+/* Replies of a batch of commands, sent when all commands are processed */
+struct fuzzy_batch_reply {
+	struct fuzzy_session *session;
+	gboolean encrypted;
+	guint ncmds;
+	guint npending;
+	struct rspamd_fuzzy_reply replies[];
+};
+
+struct fuzzy_hot_key {
+	gchar digest[rspamd_cryptobox_HASHBYTES];
+	guint32 is_shingle;
+};
+
 struct fuzzy_peer_request {
 	ev_io io_ev;
-	struct fuzzy_peer_cmd cmd;
+	guint ncmds;
+	struct fuzzy_peer_cmd cmds[];
 };
 
 struct fuzzy_key {
@@ -236,11 +302,23 @@ struct rspamd_updates_cbdata {
 	gboolean final;
 };
 
+struct fuzzy_bulk_session {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_http_connection_entry *conn_ent;
+	GArray *updates;
+	guint nrecords;
+	gboolean pending; /* Waiting for the backend transaction */
+};
+
 
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
+static void rspamd_fuzzy_batch_reply_done (struct fuzzy_batch_reply *batch);
 static gboolean rspamd_fuzzy_process_updates_queue (
 		struct rspamd_fuzzy_storage_ctx *ctx,
 		const gchar *source, gboolean final);
+static void rspamd_fuzzy_hot_cache_invalidate_updates (
+		struct rspamd_fuzzy_storage_ctx *ctx, GArray *updates);
 
 static gboolean
 rspamd_fuzzy_check_ratelimit (struct fuzzy_session *session)
@@ -466,6 +544,8 @@ rspamd_fuzzy_updates_cb (gboolean success,
 
 	if (success) {
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
+		/* Replies cached while the transaction was running might be stale */
+		rspamd_fuzzy_hot_cache_invalidate_updates (ctx, cbdata->updates_pending);
 
 		msg_info ("successfully updated fuzzy storage %s: %d updates in queue; "
 				  "%d pending currently; "
@@ -568,10 +648,9 @@ rspamd_fuzzy_reply_io (EV_P_ ev_io *w, int revents)
 	REF_RELEASE (session);
 }
 
-static void
-rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+static gconstpointer
+rspamd_fuzzy_reply_data (struct fuzzy_session *session, gsize *plen)
 {
-	gssize r;
 	gsize len;
 	gconstpointer data;
 
@@ -598,6 +677,75 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 		}
 	}
 
+	*plen = len;
+
+	return data;
+}
+
+#ifdef HAVE_SENDMMSG
+static void
+rspamd_fuzzy_flush_replies (struct fuzzy_replies_batch *batch)
+{
+	gint r;
+	guint i;
+
+	if (batch->nreplies == 0) {
+		return;
+	}
+
+	do {
+		r = sendmmsg (batch->fd, batch->msg, batch->nreplies, 0);
+	} while (r == -1 && errno == EINTR);
+
+	if (r == -1) {
+		r = 0;
+	}
+
+	for (i = 0; i < batch->nreplies; i ++) {
+		if (i >= (guint)r) {
+			/* Not sent, so send it separately handling EAGAIN there */
+			rspamd_fuzzy_write_reply (batch->sessions[i]);
+		}
+
+		REF_RELEASE (batch->sessions[i]);
+	}
+
+	batch->nreplies = 0;
+}
+#endif
+
+static void
+rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+{
+	gssize r;
+	gsize len;
+	gconstpointer data;
+
+	data = rspamd_fuzzy_reply_data (session, &len);
+
+#ifdef HAVE_SENDMMSG
+	struct fuzzy_replies_batch *batch = session->ctx->replies_batch;
+
+	if (batch && batch->fd == session->fd && batch->nreplies < MSGVEC_LEN) {
+		struct mmsghdr *msg = &batch->msg[batch->nreplies];
+		socklen_t slen;
+
+		/* Reply is sent with the others after the batch is processed */
+		batch->iovs[batch->nreplies].iov_base = (void *)data;
+		batch->iovs[batch->nreplies].iov_len = len;
+		memset (msg, 0, sizeof (*msg));
+		msg->msg_hdr.msg_name = rspamd_inet_address_get_sa (session->addr,
+				&slen);
+		msg->msg_hdr.msg_namelen = slen;
+		msg->msg_hdr.msg_iov = &batch->iovs[batch->nreplies];
+		msg->msg_hdr.msg_iovlen = 1;
+		REF_RETAIN (session);
+		batch->sessions[batch->nreplies ++] = session;
+
+		return;
+	}
+#endif
+
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -716,6 +864,18 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 			session->reply.rep.v1.value = 0;
 		}
 
+		if (session->batch) {
+			struct fuzzy_batch_reply *batch = session->batch;
+
+			/* Reply is sent with the other replies of the batch */
+			memcpy (&batch->replies[session->batch_idx], &session->reply.rep,
+					sizeof (session->reply.rep));
+			session->batch = NULL;
+			rspamd_fuzzy_batch_reply_done (batch);
+
+			return;
+		}
+
 		if (flags & RSPAMD_FUZZY_REPLY_ENCRYPTED) {
 			/* We need also to encrypt reply */
 			ottery_rand_bytes (session->reply.hdr.nonce,
@@ -745,14 +905,74 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 	rspamd_fuzzy_write_reply (session);
 }
 
+static void
+rspamd_fuzzy_write_batch_reply (struct fuzzy_batch_reply *batch)
+{
+	struct fuzzy_session *session = batch->session;
+	struct rspamd_fuzzy_encrypted_rep_hdr *rep_hdr = NULL;
+	struct rspamd_fuzzy_batch_hdr *hdr;
+	guchar *buf, *p;
+	gsize len, payload_len;
+
+	payload_len = sizeof (*hdr) + sizeof (batch->replies[0]) * batch->ncmds;
+	len = payload_len;
+
+	if (batch->encrypted) {
+		len += sizeof (*rep_hdr);
+	}
+
+	buf = g_alloca (len);
+	p = buf;
+
+	if (batch->encrypted) {
+		rep_hdr = (struct rspamd_fuzzy_encrypted_rep_hdr *)p;
+		p += sizeof (*rep_hdr);
+	}
+
+	hdr = (struct rspamd_fuzzy_batch_hdr *)p;
+	memcpy (hdr->magic, fuzzy_batch_magic, sizeof (hdr->magic));
+	hdr->version = RSPAMD_FUZZY_VERSION;
+	hdr->ncmds = batch->ncmds;
+	hdr->reserved = 0;
+	memcpy (p + sizeof (*hdr), batch->replies,
+			sizeof (batch->replies[0]) * batch->ncmds);
+
+	if (rep_hdr) {
+		/* All replies are encrypted at once */
+		ottery_rand_bytes (rep_hdr->nonce, sizeof (rep_hdr->nonce));
+		rspamd_cryptobox_encrypt_nm_inplace (p, payload_len,
+				rep_hdr->nonce,
+				session->nm,
+				rep_hdr->mac,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	if (rspamd_inet_address_sendto (session->fd, buf, len, 0,
+			session->addr) == -1) {
+		/* Client retransmits the whole batch, so we do not retry here */
+		msg_info ("error while writing batch reply: %s", strerror (errno));
+	}
+}
+
+static void
+rspamd_fuzzy_batch_reply_done (struct fuzzy_batch_reply *batch)
+{
+	if (--batch->npending == 0) {
+		rspamd_fuzzy_write_batch_reply (batch);
+		REF_RELEASE (batch->session);
+		g_free (batch);
+	}
+}
+
 static gboolean
-fuzzy_peer_try_send (gint fd, struct fuzzy_peer_request *up_req)
+fuzzy_peer_try_send (gint fd, const struct fuzzy_peer_cmd *cmds, guint ncmds)
 {
 	gssize r;
 
-	r = write (fd, &up_req->cmd, sizeof (up_req->cmd));
+	/* All commands are sent as a single datagram */
+	r = write (fd, cmds, sizeof (*cmds) * ncmds);
 
-	if (r != sizeof (up_req->cmd)) {
+	if (r != sizeof (*cmds) * ncmds) {
 		return FALSE;
 	}
 
@@ -764,7 +984,7 @@ fuzzy_peer_send_io (EV_P_ ev_io *w, int revents)
 {
 	struct fuzzy_peer_request *up_req = (struct fuzzy_peer_request *)w->data;
 
-	if (!fuzzy_peer_try_send (w->fd, up_req)) {
+	if (!fuzzy_peer_try_send (w->fd, up_req->cmds, up_req->ncmds)) {
 		msg_err ("cannot send update request to the peer: %s", strerror (errno));
 	}
 
@@ -772,6 +992,60 @@ fuzzy_peer_send_io (EV_P_ ev_io *w, int revents)
 	g_free (up_req);
 }
 
+static void
+rspamd_fuzzy_peer_send (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct fuzzy_peer_cmd *cmds, guint ncmds)
+{
+	struct fuzzy_peer_request *up_req;
+
+	if (!fuzzy_peer_try_send (ctx->peer_fd, cmds, ncmds)) {
+		/* Retry when the socket is writable */
+		up_req = g_malloc (sizeof (*up_req) + sizeof (*cmds) * ncmds);
+		up_req->ncmds = ncmds;
+		memcpy (up_req->cmds, cmds, sizeof (*cmds) * ncmds);
+		up_req->io_ev.data = up_req;
+		ev_io_init (&up_req->io_ev, fuzzy_peer_send_io,
+				ctx->peer_fd, EV_WRITE);
+		ev_io_start (ctx->event_loop, &up_req->io_ev);
+	}
+}
+
+static void
+rspamd_fuzzy_peer_flush (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	if (ctx->peer_updates && ctx->peer_updates->len > 0) {
+		rspamd_fuzzy_peer_send (ctx,
+				(const struct fuzzy_peer_cmd *)ctx->peer_updates->data,
+				ctx->peer_updates->len);
+		g_array_set_size (ctx->peer_updates, 0);
+	}
+}
+
+/*
+ * Sends update to the first worker, updates for requests received in one
+ * batch are sent together
+ */
+static void
+rspamd_fuzzy_peer_update (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct fuzzy_peer_cmd *cmd)
+{
+	if (ctx->peer_batching) {
+		if (ctx->peer_updates == NULL) {
+			ctx->peer_updates = g_array_sized_new (FALSE, FALSE,
+					sizeof (struct fuzzy_peer_cmd), FUZZY_PEER_BATCH);
+		}
+
+		g_array_append_val (ctx->peer_updates, *cmd);
+
+		if (ctx->peer_updates->len >= FUZZY_PEER_BATCH) {
+			rspamd_fuzzy_peer_flush (ctx);
+		}
+	}
+	else {
+		rspamd_fuzzy_peer_send (ctx, cmd, 1);
+	}
+}
+
 static void
 rspamd_fuzzy_extensions_tolua (lua_State *L,
 							   struct fuzzy_session *session)
@@ -803,6 +1077,56 @@ rspamd_fuzzy_extensions_tolua (lua_State *L,
 	}
 }
 
+static guint
+fuzzy_hot_key_hash (gconstpointer p)
+{
+	return rspamd_cryptobox_fast_hash (p, sizeof (struct fuzzy_hot_key),
+			rspamd_hash_seed ());
+}
+
+static gboolean
+fuzzy_hot_key_equal (gconstpointer a, gconstpointer b)
+{
+	return (memcmp (a, b, sizeof (struct fuzzy_hot_key)) == 0);
+}
+
+static void
+rspamd_fuzzy_hot_cache_invalidate (struct rspamd_fuzzy_storage_ctx *ctx,
+		const gchar *digest)
+{
+	struct fuzzy_hot_key hk;
+
+	if (ctx->hot_cache == NULL) {
+		return;
+	}
+
+	memset (&hk, 0, sizeof (hk));
+	memcpy (hk.digest, digest, sizeof (hk.digest));
+	rspamd_lru_hash_remove (ctx->hot_cache, &hk);
+	hk.is_shingle = 1;
+	rspamd_lru_hash_remove (ctx->hot_cache, &hk);
+}
+
+static void
+rspamd_fuzzy_hot_cache_invalidate_updates (struct rspamd_fuzzy_storage_ctx *ctx,
+		GArray *updates)
+{
+	struct fuzzy_peer_cmd *up_cmd;
+	guint i;
+
+	if (ctx->hot_cache == NULL) {
+		return;
+	}
+
+	for (i = 0; i < updates->len; i ++) {
+		up_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+		if (up_cmd->cmd.normal.cmd != FUZZY_REFRESH) {
+			rspamd_fuzzy_hot_cache_invalidate (ctx, up_cmd->cmd.normal.digest);
+		}
+	}
+}
+
 static void
 rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 {
@@ -920,50 +1244,27 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 	/* Refresh hash if found with strong confidence */
 	if (result->v1.prob > 0.9 && !session->ctx->read_only) {
 		struct fuzzy_peer_cmd up_cmd;
-		struct fuzzy_peer_request *up_req;
+
+		memset (&up_cmd, 0, sizeof (up_cmd));
+		up_cmd.is_shingle = is_shingle;
+		memcpy (up_cmd.cmd.normal.digest, result->digest,
+				sizeof (up_cmd.cmd.normal.digest));
+		up_cmd.cmd.normal.flag = result->v1.flag;
+		up_cmd.cmd.normal.cmd = FUZZY_REFRESH;
+		up_cmd.cmd.normal.shingles_count = cmd->shingles_count;
+
+		if (is_shingle && shingle) {
+			memcpy (&up_cmd.cmd.shingle.sgl, shingle,
+					sizeof (up_cmd.cmd.shingle.sgl));
+		}
 
 		if (session->worker->index == 0) {
 			/* Just add to the queue */
-			memset (&up_cmd, 0, sizeof (up_cmd));
-			up_cmd.is_shingle = is_shingle;
-			memcpy (up_cmd.cmd.normal.digest, result->digest,
-					sizeof (up_cmd.cmd.normal.digest));
-			up_cmd.cmd.normal.flag = result->v1.flag;
-			up_cmd.cmd.normal.cmd = FUZZY_REFRESH;
-			up_cmd.cmd.normal.shingles_count = cmd->shingles_count;
-
-			if (is_shingle && shingle) {
-				memcpy (&up_cmd.cmd.shingle.sgl, shingle,
-						sizeof (up_cmd.cmd.shingle.sgl));
-			}
-
 			g_array_append_val (session->ctx->updates_pending, up_cmd);
 		}
 		else {
 			/* We need to send request to the peer */
-			up_req = g_malloc0 (sizeof (*up_req));
-			up_req->cmd.is_shingle = is_shingle;
-
-			memcpy (up_req->cmd.cmd.normal.digest, result->digest,
-					sizeof (up_req->cmd.cmd.normal.digest));
-			up_req->cmd.cmd.normal.flag = result->v1.flag;
-			up_req->cmd.cmd.normal.cmd = FUZZY_REFRESH;
-			up_req->cmd.cmd.normal.shingles_count = cmd->shingles_count;
-
-			if (is_shingle && shingle) {
-				memcpy (&up_req->cmd.cmd.shingle.sgl, shingle,
-						sizeof (up_req->cmd.cmd.shingle.sgl));
-			}
-
-			if (!fuzzy_peer_try_send (session->ctx->peer_fd, up_req)) {
-				up_req->io_ev.data = up_req;
-				ev_io_init (&up_req->io_ev, fuzzy_peer_send_io,
-						session->ctx->peer_fd, EV_WRITE);
-				ev_io_start (session->ctx->event_loop, &up_req->io_ev);
-			}
-			else {
-				g_free (up_req);
-			}
+			rspamd_fuzzy_peer_update (session->ctx, &up_cmd);
 		}
 	}
 
@@ -972,6 +1273,67 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 	REF_RELEASE (session);
 }
 
+/*
+ * Called when the backend has replied, so the result can be used for
+ * the subsequent checks of the same digest
+ */
+static void
+rspamd_fuzzy_check_backend_callback (struct rspamd_fuzzy_reply *result,
+		void *ud)
+{
+	struct fuzzy_session *session = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct fuzzy_hot_key *hk;
+	struct rspamd_fuzzy_reply *cached;
+
+	if (ctx->hot_cache) {
+		hk = g_malloc0 (sizeof (*hk));
+		memcpy (hk->digest, session->cmd.basic.digest, sizeof (hk->digest));
+		hk->is_shingle = (session->cmd_type == CMD_SHINGLE ||
+				session->cmd_type == CMD_ENCRYPTED_SHINGLE);
+		cached = g_malloc (sizeof (*cached));
+		memcpy (cached, result, sizeof (*cached));
+		rspamd_lru_hash_insert (ctx->hot_cache, hk, cached,
+				(time_t)ev_now (ctx->event_loop),
+				MAX (1, (guint)ctx->hot_cache_ttl));
+	}
+
+	rspamd_fuzzy_check_callback (result, session);
+}
+
+static gboolean
+rspamd_fuzzy_hot_cache_check (struct fuzzy_session *session,
+		gboolean is_shingle)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct fuzzy_hot_key hk;
+	struct rspamd_fuzzy_reply *cached, result;
+
+	if (ctx->hot_cache == NULL) {
+		return FALSE;
+	}
+
+	memset (&hk, 0, sizeof (hk));
+	memcpy (hk.digest, session->cmd.basic.digest, sizeof (hk.digest));
+	hk.is_shingle = is_shingle;
+	cached = rspamd_lru_hash_lookup (ctx->hot_cache, &hk,
+			(time_t)ev_now (ctx->event_loop));
+
+	if (cached == NULL) {
+		ctx->hot_cache_misses ++;
+
+		return FALSE;
+	}
+
+	ctx->hot_cache_hits ++;
+	/* Reply just like the backend did, post handler and delay still apply */
+	memcpy (&result, cached, sizeof (result));
+	REF_RETAIN (session);
+	rspamd_fuzzy_check_callback (&result, session);
+
+	return TRUE;
+}
+
 static void
 rspamd_fuzzy_process_command (struct fuzzy_session *session)
 {
@@ -979,7 +1341,6 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	struct rspamd_fuzzy_cmd *cmd = NULL;
 	struct rspamd_fuzzy_reply result;
 	struct fuzzy_peer_cmd up_cmd;
-	struct fuzzy_peer_request *up_req;
 	struct fuzzy_key_stat *ip_stat = NULL;
 	gchar hexbuf[rspamd_cryptobox_HASHBYTES * 2 + 1];
 	rspamd_inet_addr_t *naddr;
@@ -1109,9 +1470,11 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 
 	if (cmd->cmd == FUZZY_CHECK) {
 		if (rspamd_fuzzy_check_client (session, FALSE)) {
-			REF_RETAIN (session);
-			rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
-					rspamd_fuzzy_check_callback, session);
+			if (!rspamd_fuzzy_hot_cache_check (session, is_shingle)) {
+				REF_RETAIN (session);
+				rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
+						rspamd_fuzzy_check_backend_callback, session);
+			}
 		}
 		else {
 			result.v1.value = 403;
@@ -1143,33 +1506,21 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 				}
 			}
 
+			memset (&up_cmd, 0, sizeof (up_cmd));
+			up_cmd.is_shingle = is_shingle;
+			ptr = is_shingle ?
+					(gpointer)&up_cmd.cmd.shingle :
+					(gpointer)&up_cmd.cmd.normal;
+			memcpy (ptr, cmd, up_len);
+			rspamd_fuzzy_hot_cache_invalidate (session->ctx, cmd->digest);
+
 			if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
 				/* Just add to the queue */
-				up_cmd.is_shingle = is_shingle;
-				ptr = is_shingle ?
-						(gpointer)&up_cmd.cmd.shingle :
-						(gpointer)&up_cmd.cmd.normal;
-				memcpy (ptr, cmd, up_len);
 				g_array_append_val (session->ctx->updates_pending, up_cmd);
 			}
 			else {
 				/* We need to send request to the peer */
-				up_req = g_malloc0 (sizeof (*up_req));
-				up_req->cmd.is_shingle = is_shingle;
-				ptr = is_shingle ?
-						(gpointer)&up_req->cmd.cmd.shingle :
-						(gpointer)&up_req->cmd.cmd.normal;
-				memcpy (ptr, cmd, up_len);
-
-				if (!fuzzy_peer_try_send (session->ctx->peer_fd, up_req)) {
-					up_req->io_ev.data = up_req;
-					ev_io_init (&up_req->io_ev, fuzzy_peer_send_io,
-							session->ctx->peer_fd, EV_WRITE);
-					ev_io_start (session->ctx->event_loop, &up_req->io_ev);
-				}
-				else {
-					g_free (up_req);
-				}
+				rspamd_fuzzy_peer_update (session->ctx, &up_cmd);
 			}
 
 			result.v1.value = 0;
@@ -1236,6 +1587,75 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 	return ret;
 }
 
+static struct fuzzy_key *
+rspamd_fuzzy_request_key (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct rspamd_fuzzy_encrypted_req_hdr *hdr)
+{
+	struct fuzzy_key *key;
+
+	/* Try to find the desired key */
+	key = g_hash_table_lookup (ctx->keys, hdr->key_id);
+
+	if (key == NULL) {
+		/* Unknown key, assume default one */
+		key = ctx->default_key;
+	}
+
+	return key;
+}
+
+/*
+ * Computes shared keys of all encrypted requests received by a single
+ * recvmmsg, so after restart they are computed by a batch and
+ * rspamd_fuzzy_decrypt_command finds them in the keypairs cache
+ */
+static void
+rspamd_fuzzy_prefetch_nm (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct iovec *iovs, const gsize *lens, guint n)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr hdr;
+	struct rspamd_cryptobox_keypair *lks[MSGVEC_LEN];
+	struct rspamd_cryptobox_pubkey *rks[MSGVEC_LEN];
+	guint i, cnt = 0;
+
+	if (ctx->default_key == NULL || ctx->keypair_cache == NULL || n < 2) {
+		return;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (lens[i] < sizeof (hdr)) {
+			continue;
+		}
+
+		memcpy (&hdr, iovs[i].iov_base, sizeof (hdr));
+
+		if (memcmp (hdr.magic, fuzzy_encrypted_magic,
+				sizeof (fuzzy_encrypted_magic)) != 0 &&
+				memcmp (hdr.magic, fuzzy_encrypted_batch_magic,
+						sizeof (fuzzy_encrypted_batch_magic)) != 0) {
+			continue;
+		}
+
+		rks[cnt] = rspamd_pubkey_from_bin (hdr.pubkey, sizeof (hdr.pubkey),
+				RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
+
+		if (rks[cnt] == NULL) {
+			continue;
+		}
+
+		lks[cnt] = rspamd_fuzzy_request_key (ctx, &hdr)->key;
+		cnt ++;
+	}
+
+	if (cnt > 0) {
+		rspamd_keypair_cache_process_batch (ctx->keypair_cache, lks, rks, cnt);
+
+		for (i = 0; i < cnt; i ++) {
+			rspamd_pubkey_unref (rks[i]);
+		}
+	}
+}
+
 static gboolean
 rspamd_fuzzy_decrypt_command (struct fuzzy_session *s, guchar *buf, gsize buflen)
 {
@@ -1257,13 +1677,7 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s, guchar *buf, gsize buflen
 	buf += sizeof (hdr);
 	buflen -= sizeof (hdr);
 
-	/* Try to find the desired key */
-	key = g_hash_table_lookup (s->ctx->keys, hdr.key_id);
-
-	if (key == NULL) {
-		/* Unknown key, assume default one */
-		key = s->ctx->default_key;
-	}
+	key = rspamd_fuzzy_request_key (s->ctx, &hdr);
 
 	s->key_stat = key->stat;
 
@@ -1525,6 +1939,146 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 	return TRUE;
 }
 
+static gboolean
+rspamd_fuzzy_cmd_is_batch (const guchar *buf, guint buflen)
+{
+	if (buflen < sizeof (fuzzy_batch_magic)) {
+		return FALSE;
+	}
+
+	return memcmp (buf, fuzzy_batch_magic, sizeof (fuzzy_batch_magic)) == 0 ||
+			memcmp (buf, fuzzy_encrypted_batch_magic,
+					sizeof (fuzzy_encrypted_batch_magic)) == 0;
+}
+
+static void fuzzy_session_destroy (gpointer d);
+
+/*
+ * Splits a batch into sessions per command that share the address and the
+ * key of the parent session, replies are aggregated in a single datagram
+ */
+static gboolean
+rspamd_fuzzy_process_batch (guchar *buf, guint buflen,
+		struct fuzzy_session *session)
+{
+	struct rspamd_fuzzy_batch_hdr hdr;
+	struct fuzzy_batch_reply *batch;
+	struct fuzzy_session *sub;
+	gboolean encrypted = FALSE;
+	guchar *p;
+	guint remain, i;
+	guint16 clen;
+
+	if (memcmp (buf, fuzzy_encrypted_batch_magic,
+			sizeof (fuzzy_encrypted_batch_magic)) == 0) {
+		if (buflen < sizeof (struct rspamd_fuzzy_encrypted_req_hdr) +
+				sizeof (hdr)) {
+			msg_debug ("truncated encrypted fuzzy batch of size %d received",
+					buflen);
+			return FALSE;
+		}
+
+		if (!rspamd_fuzzy_decrypt_command (session, buf, buflen)) {
+			return FALSE;
+		}
+
+		buf += sizeof (struct rspamd_fuzzy_encrypted_req_hdr);
+		buflen -= sizeof (struct rspamd_fuzzy_encrypted_req_hdr);
+		encrypted = TRUE;
+	}
+
+	if (buflen < sizeof (hdr)) {
+		msg_debug ("truncated fuzzy batch of size %d received", buflen);
+		return FALSE;
+	}
+
+	memcpy (&hdr, buf, sizeof (hdr));
+
+	if (memcmp (hdr.magic, fuzzy_batch_magic, sizeof (hdr.magic)) != 0 ||
+			hdr.version != RSPAMD_FUZZY_VERSION ||
+			hdr.ncmds == 0 || hdr.ncmds > RSPAMD_FUZZY_BATCH_MAX) {
+		msg_debug ("invalid fuzzy batch header received");
+		return FALSE;
+	}
+
+	buf += sizeof (hdr);
+	buflen -= sizeof (hdr);
+
+	/* Check framing before processing of any command */
+	p = buf;
+	remain = buflen;
+
+	for (i = 0; i < hdr.ncmds; i ++) {
+		if (remain < sizeof (clen)) {
+			msg_debug ("truncated fuzzy batch of size %d received", buflen);
+			return FALSE;
+		}
+
+		memcpy (&clen, p, sizeof (clen));
+		clen = ntohs (clen);
+
+		if (clen > remain - sizeof (clen)) {
+			msg_debug ("truncated fuzzy batch of size %d received", buflen);
+			return FALSE;
+		}
+
+		p += sizeof (clen) + clen;
+		remain -= sizeof (clen) + clen;
+	}
+
+	batch = g_malloc0 (sizeof (*batch) +
+			sizeof (batch->replies[0]) * hdr.ncmds);
+	REF_RETAIN (session);
+	batch->session = session;
+	batch->encrypted = encrypted;
+	batch->ncmds = hdr.ncmds;
+	/* Extra reference to avoid sending before all commands are started */
+	batch->npending = hdr.ncmds + 1;
+	p = buf;
+
+	for (i = 0; i < hdr.ncmds; i ++) {
+		memcpy (&clen, p, sizeof (clen));
+		clen = ntohs (clen);
+		p += sizeof (clen);
+
+		sub = g_malloc0 (sizeof (*sub));
+		REF_INIT_RETAIN (sub, fuzzy_session_destroy);
+		sub->worker = session->worker;
+		sub->fd = session->fd;
+		sub->ctx = session->ctx;
+		sub->time = session->time;
+		sub->addr = rspamd_inet_address_copy (session->addr);
+		sub->key_stat = session->key_stat;
+		memcpy (sub->nm, session->nm, sizeof (sub->nm));
+		sub->worker->nconns++;
+
+		if (rspamd_fuzzy_cmd_from_wire (p, clen, sub) &&
+				(sub->cmd_type == CMD_NORMAL || sub->cmd_type == CMD_SHINGLE)) {
+			if (encrypted) {
+				/* Command is protected by the encryption of the batch */
+				sub->cmd_type = sub->cmd_type == CMD_SHINGLE ?
+						CMD_ENCRYPTED_SHINGLE : CMD_ENCRYPTED_NORMAL;
+			}
+
+			sub->batch = batch;
+			sub->batch_idx = i;
+			rspamd_fuzzy_process_command (sub);
+		}
+		else {
+			/* Leave an empty reply, the client just ignores it */
+			session->ctx->stat.invalid_requests ++;
+			msg_debug ("invalid fuzzy command in batch received");
+			rspamd_fuzzy_batch_reply_done (batch);
+		}
+
+		REF_RELEASE (sub);
+		p += clen;
+	}
+
+	rspamd_fuzzy_batch_reply_done (batch);
+
+	return TRUE;
+}
 
 static void
 fuzzy_session_destroy (gpointer d)
@@ -1546,13 +2100,6 @@ fuzzy_session_destroy (gpointer d)
 	g_free (session);
 }
 
-#define FUZZY_INPUT_BUFLEN 1024
-#ifdef HAVE_RECVMMSG
-#define MSGVEC_LEN 16
-#else
-#define MSGVEC_LEN 1
-#endif
-
 /*
  * Accept new connection and construct task
  */
@@ -1560,9 +2107,11 @@ static void
 accept_fuzzy_socket (EV_P_ ev_io *w, int revents)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)w->data;
+	struct rspamd_fuzzy_storage_ctx *ctx = (struct rspamd_fuzzy_storage_ctx *)worker->ctx;
 	struct fuzzy_session *session;
 	gssize r, msg_len;
 	guint64 *nerrors;
+	gboolean valid;
 	struct iovec iovs[MSGVEC_LEN];
 	guint8 bufs[MSGVEC_LEN][FUZZY_INPUT_BUFLEN];
 	struct sockaddr_storage peer_sa[MSGVEC_LEN];
@@ -1617,6 +2166,25 @@ accept_fuzzy_socket (EV_P_ ev_io *w, int revents)
 			msg_len = r; /* Save real length in bytes here */
 			r = 1; /* Assume that we have received a single message */
 #endif
+#ifdef HAVE_RECVMMSG
+			gsize lens[MSGVEC_LEN];
+
+			for (int i = 0; i < r; i ++) {
+				lens[i] = msg[i].msg_len;
+			}
+
+			rspamd_fuzzy_prefetch_nm (ctx, iovs, lens, r);
+#endif
+			/* Updates of the batch are sent to the peer together */
+			ctx->peer_batching = TRUE;
+#ifdef HAVE_SENDMMSG
+			struct fuzzy_replies_batch batch;
+
+			/* Replies of synchronous backends are sent by one syscall */
+			batch.fd = w->fd;
+			batch.nreplies = 0;
+			ctx->replies_batch = &batch;
+#endif
 
 			for (int i = 0; i < r; i ++) {
 				session = g_malloc0 (sizeof (*session));
@@ -1634,12 +2202,17 @@ accept_fuzzy_socket (EV_P_ ev_io *w, int revents)
 				msg_len = msg[i].msg_len;
 #endif
 
-				if (rspamd_fuzzy_cmd_from_wire (iovs[i].iov_base,
-						msg_len, session)) {
+				if (rspamd_fuzzy_cmd_is_batch (iovs[i].iov_base, msg_len)) {
+					valid = rspamd_fuzzy_process_batch (iovs[i].iov_base,
+							msg_len, session);
+				}
+				else if ((valid = rspamd_fuzzy_cmd_from_wire (iovs[i].iov_base,
+						msg_len, session))) {
 					/* Check shingles count sanity */
 					rspamd_fuzzy_process_command (session);
 				}
-				else {
+
+				if (!valid) {
 					/* Discard input */
 					session->ctx->stat.invalid_requests ++;
 					msg_debug ("invalid fuzzy command of size %z received", r);
@@ -1661,6 +2234,12 @@ accept_fuzzy_socket (EV_P_ ev_io *w, int revents)
 
 				REF_RELEASE (session);
 			}
+			ctx->peer_batching = FALSE;
+			rspamd_fuzzy_peer_flush (ctx);
+#ifdef HAVE_SENDMMSG
+			ctx->replies_batch = NULL;
+			rspamd_fuzzy_flush_replies (&batch);
+#endif
 #ifdef HAVE_RECVMMSG
 			/* Stop reading as we are using recvmmsg instead of recvmsg */
 			break;
@@ -1683,6 +2262,335 @@ rspamd_fuzzy_storage_periodic_callback (void *ud)
 	return FALSE;
 }
 
+static void
+rspamd_fuzzy_bulk_session_free (struct fuzzy_bulk_session *session)
+{
+	if (session->updates) {
+		g_array_free (session->updates, TRUE);
+	}
+
+	rspamd_inet_address_free (session->addr);
+	g_free (session);
+}
+
+static void
+rspamd_fuzzy_bulk_updates_cb (gboolean success,
+		guint nadded,
+		guint ndeleted,
+		guint nextended,
+		guint nignored,
+		void *ud)
+{
+	struct fuzzy_bulk_session *session = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	ucl_object_t *obj;
+
+	session->pending = FALSE;
+
+	if (success) {
+		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
+		rspamd_fuzzy_hot_cache_invalidate_updates (ctx, session->updates);
+		msg_info ("imported %ud records from %s: %d added; %d deleted; "
+				"%d extended; %d duplicates",
+				session->nrecords,
+				rspamd_inet_address_to_string (session->addr),
+				nadded, ndeleted, nextended, nignored);
+	}
+	else {
+		msg_err ("cannot commit bulk import of %ud records from %s",
+				session->nrecords,
+				rspamd_inet_address_to_string (session->addr));
+	}
+
+	g_array_free (session->updates, TRUE);
+	session->updates = NULL;
+
+	if (session->conn_ent == NULL) {
+		/* Connection is already closed */
+		rspamd_fuzzy_bulk_session_free (session);
+		return;
+	}
+
+	if (success) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_frombool (true),
+				"success", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (session->nrecords),
+				"records", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (nadded),
+				"added", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (ndeleted),
+				"deleted", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (nextended),
+				"extended", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (nignored),
+				"duplicates", 0, false);
+		rspamd_controller_send_ucl (session->conn_ent, obj);
+		ucl_object_unref (obj);
+	}
+	else {
+		rspamd_controller_send_error (session->conn_ent, 500,
+				"cannot commit transaction");
+	}
+}
+
+/*
+ * Bulk import handler:
+ * request: /bulk
+ * body: packed commands (rspamd_fuzzy_cmd optionally followed by shingles)
+ * reply: json {"success": true, "records": n, "added": ...}
+ */
+static int
+rspamd_fuzzy_bulk_handler (struct rspamd_http_connection_entry *conn_ent,
+		struct rspamd_http_message *msg)
+{
+	struct fuzzy_bulk_session *session = conn_ent->ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct rspamd_fuzzy_cmd cmd;
+	struct fuzzy_peer_cmd up_cmd;
+	const rspamd_ftok_t *password;
+	const guchar *p, *end;
+	gchar hexbuf[rspamd_cryptobox_HASHBYTES * 2 + 1];
+	gsize len;
+
+	if (session->pending) {
+		rspamd_controller_send_error (conn_ent, 409,
+				"previous import is in progress");
+		return 0;
+	}
+
+	if (ctx->bulk_password) {
+		password = rspamd_http_message_find_header (msg, "Password");
+
+		if (password == NULL || password->len == 0 ||
+				password->len != strlen (ctx->bulk_password) ||
+				!rspamd_constant_memcmp (password->begin, ctx->bulk_password,
+						password->len)) {
+			rspamd_controller_send_error (conn_ent, 403, "unauthorized");
+			return 0;
+		}
+	}
+
+	p = (const guchar *)rspamd_http_message_get_body (msg, &len);
+	end = p + len;
+	session->updates = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct fuzzy_peer_cmd),
+			MAX (len / sizeof (struct rspamd_fuzzy_cmd), 1));
+	session->nrecords = 0;
+
+	while (p < end) {
+		if (end - p < (gssize)sizeof (cmd)) {
+			goto err;
+		}
+
+		memcpy (&cmd, p, sizeof (cmd));
+
+		if (cmd.version != RSPAMD_FUZZY_VERSION ||
+				(cmd.cmd != FUZZY_WRITE && cmd.cmd != FUZZY_DEL) ||
+				(cmd.shingles_count != 0 &&
+				 cmd.shingles_count != RSPAMD_SHINGLE_SIZE)) {
+			goto err;
+		}
+
+		memset (&up_cmd, 0, sizeof (up_cmd));
+
+		if (cmd.shingles_count > 0) {
+			if (end - p < (gssize)sizeof (up_cmd.cmd.shingle)) {
+				goto err;
+			}
+
+			up_cmd.is_shingle = TRUE;
+			memcpy (&up_cmd.cmd.shingle, p, sizeof (up_cmd.cmd.shingle));
+			p += sizeof (up_cmd.cmd.shingle);
+		}
+		else {
+			memcpy (&up_cmd.cmd.normal, p, sizeof (up_cmd.cmd.normal));
+			p += sizeof (up_cmd.cmd.normal);
+		}
+
+		session->nrecords ++;
+
+		if (ctx->skip_hashes && cmd.cmd == FUZZY_WRITE) {
+			rspamd_encode_hex_buf (cmd.digest, sizeof (cmd.digest),
+					hexbuf, sizeof (hexbuf) - 1);
+			hexbuf[sizeof (hexbuf) - 1] = '\0';
+
+			if (rspamd_match_hash_map (ctx->skip_hashes,
+					hexbuf, sizeof (hexbuf) - 1)) {
+				continue;
+			}
+		}
+
+		g_array_append_val (session->updates, up_cmd);
+	}
+
+	if (session->updates->len == 0) {
+		rspamd_fuzzy_bulk_updates_cb (TRUE, 0, 0, 0, 0, session);
+
+		return 0;
+	}
+
+	/* All records are written in a single transaction */
+	session->pending = TRUE;
+	msg_info ("start bulk import of %ud records from %s",
+			session->nrecords, rspamd_inet_address_to_string (session->addr));
+	rspamd_fuzzy_backend_process_updates (ctx->backend, session->updates,
+			local_db_name, rspamd_fuzzy_bulk_updates_cb, session);
+
+	return 0;
+
+err:
+	g_array_free (session->updates, TRUE);
+	session->updates = NULL;
+	rspamd_controller_send_error (conn_ent, 400,
+			"invalid record %ud", session->nrecords);
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_bulk_error_handler (struct rspamd_http_connection_entry *conn_ent,
+		GError *err)
+{
+	struct fuzzy_bulk_session *session = conn_ent->ud;
+
+	msg_info ("abnormally closing bulk import connection from %s: %e",
+			rspamd_inet_address_to_string (session->addr), err);
+}
+
+static void
+rspamd_fuzzy_bulk_finish_handler (struct rspamd_http_connection_entry *conn_ent)
+{
+	struct fuzzy_bulk_session *session = conn_ent->ud;
+
+	if (session->pending) {
+		/* Freed when the transaction is finished */
+		session->conn_ent = NULL;
+	}
+	else {
+		rspamd_fuzzy_bulk_session_free (session);
+	}
+}
+
+static void
+rspamd_fuzzy_bulk_accept (EV_P_ ev_io *w, int revents)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx =
+			(struct rspamd_fuzzy_storage_ctx *)w->data;
+	struct fuzzy_bulk_session *session;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	if ((nfd = rspamd_accept_from_socket (w->fd, &addr, NULL, NULL)) == -1) {
+		msg_warn ("accept failed: %s", strerror (errno));
+		return;
+	}
+
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	/* Updates are allowed from the same addresses as normal updates */
+	if (ctx->read_only || ctx->update_ips == NULL ||
+			rspamd_match_radix_map_addr (ctx->update_ips, addr) == NULL ||
+			(ctx->blocked_ips &&
+			 rspamd_match_radix_map_addr (ctx->blocked_ips, addr) != NULL)) {
+		msg_info ("deny bulk import from %s",
+				rspamd_inet_address_to_string (addr));
+		rspamd_inet_address_free (addr);
+		close (nfd);
+
+		return;
+	}
+
+	session = g_malloc0 (sizeof (*session));
+	session->ctx = ctx;
+	session->addr = addr;
+	rspamd_http_router_handle_socket (ctx->bulk_router, nfd, session);
+	/* Router puts the new connection to the head of its list */
+	session->conn_ent = ctx->bulk_router->conns;
+}
+
+static void
+rspamd_fuzzy_bulk_start (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GPtrArray *addrs = NULL;
+	gchar *name = NULL;
+	rspamd_inet_addr_t *addr;
+	ev_io *ev;
+	guint i;
+	gint fd;
+
+	if (rspamd_parse_host_port_priority (ctx->bulk_bind, &addrs, NULL, &name,
+			11336, TRUE, NULL) == RSPAMD_PARSE_ADDR_FAIL) {
+		msg_err ("cannot parse bulk import address: %s", ctx->bulk_bind);
+		return;
+	}
+
+	ctx->bulk_router = rspamd_http_router_new (rspamd_fuzzy_bulk_error_handler,
+			rspamd_fuzzy_bulk_finish_handler,
+			ctx->bulk_timeout,
+			NULL,
+			ctx->http_ctx);
+
+	if (ctx->default_keypair) {
+		rspamd_http_router_set_key (ctx->bulk_router, ctx->default_keypair);
+	}
+
+	rspamd_http_router_add_path (ctx->bulk_router, "/bulk",
+			rspamd_fuzzy_bulk_handler);
+	ctx->bulk_listeners = g_ptr_array_new ();
+
+	for (i = 0; i < addrs->len; i ++) {
+		addr = g_ptr_array_index (addrs, i);
+		fd = rspamd_inet_address_listen (addr, SOCK_STREAM,
+				RSPAMD_INET_ADDRESS_LISTEN_ASYNC|
+				RSPAMD_INET_ADDRESS_LISTEN_REUSEPORT, -1);
+
+		if (fd == -1) {
+			msg_err ("cannot listen for bulk import on %s: %s",
+					rspamd_inet_address_to_string_pretty (addr),
+					strerror (errno));
+			continue;
+		}
+
+		ev = g_malloc0 (sizeof (*ev));
+		ev->data = ctx;
+		ev_io_init (ev, rspamd_fuzzy_bulk_accept, fd, EV_READ);
+		ev_io_start (ctx->event_loop, ev);
+		g_ptr_array_add (ctx->bulk_listeners, ev);
+		msg_info ("listen for bulk import on %s",
+				rspamd_inet_address_to_string_pretty (addr));
+	}
+
+	g_ptr_array_free (addrs, TRUE);
+	g_free (name);
+}
+
+static void
+rspamd_fuzzy_bulk_stop (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	ev_io *ev;
+	guint i;
+
+	if (ctx->bulk_listeners) {
+		PTR_ARRAY_FOREACH (ctx->bulk_listeners, i, ev) {
+			ev_io_stop (ctx->event_loop, ev);
+			close (ev->fd);
+			g_free (ev);
+		}
+
+		g_ptr_array_free (ctx->bulk_listeners, TRUE);
+		ctx->bulk_listeners = NULL;
+	}
+
+	if (ctx->bulk_router) {
+		rspamd_http_router_free (ctx->bulk_router);
+		ctx->bulk_router = NULL;
+	}
+}
+
 static gboolean
 rspamd_fuzzy_storage_sync (struct rspamd_main *rspamd_main,
 		struct rspamd_worker *worker, gint fd,
@@ -1861,6 +2769,32 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 				false);
 	}
 
+	if (ctx->keypair_cache) {
+		ucl_object_insert_key (obj,
+				rspamd_keypair_cache_stat_to_ucl (ctx->keypair_cache),
+				"keypairs_cache",
+				0,
+				false);
+	}
+
+	if (ctx->hot_cache) {
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt,
+				ucl_object_fromint (ctx->hot_cache_hits),
+				"hits", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromint (ctx->hot_cache_misses),
+				"misses", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromint (rspamd_lru_hash_size (ctx->hot_cache)),
+				"size", 0, false);
+		ucl_object_insert_key (obj, elt, "hot_cache", 0, false);
+	}
+
+	if (ctx->backend && (elt = rspamd_fuzzy_backend_stat (ctx->backend)) != NULL) {
+		ucl_object_insert_key (obj, elt, "backend", 0, false);
+	}
+
 	/* Checked by epoch */
 	elt = ucl_object_typed_new (UCL_ARRAY);
 
@@ -2027,6 +2961,33 @@ rspamd_fuzzy_storage_stat (struct rspamd_main *rspamd_main,
 	return TRUE;
 }
 
+static gboolean
+fuzzy_parse_shared_keypair_cache (rspamd_mempool_t *pool,
+		const ucl_object_t *obj,
+		gpointer ud,
+		struct rspamd_rcl_section *section,
+		GError **err)
+{
+	struct rspamd_rcl_struct_parser *pd = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+
+	ctx = pd->user_struct;
+	pd->offset = G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+			keypair_cache_shared_size);
+
+	if (!rspamd_rcl_parse_struct_integer (pool, obj, pd, section, err)) {
+		return FALSE;
+	}
+
+	if (ctx->keypair_cache_shared_size > 0) {
+		/* Config is parsed in the main process, so workers share this memory */
+		ctx->shared_keypair_cache = rspamd_keypair_shared_cache_new (pool,
+				ctx->keypair_cache_shared_size, RSPAMD_KEYPAIR_SHARED_SHARDS);
+	}
+
+	return TRUE;
+}
+
 static gboolean
 fuzzy_parse_keypair (rspamd_mempool_t *pool,
 		const ucl_object_t *obj,
@@ -2125,6 +3086,8 @@ init_fuzzy (struct rspamd_config *cfg)
 	ctx->magic = rspamd_fuzzy_storage_magic;
 	ctx->sync_timeout = DEFAULT_SYNC_TIMEOUT;
 	ctx->keypair_cache_size = DEFAULT_KEYPAIR_CACHE_SIZE;
+	ctx->bulk_timeout = DEFAULT_BULK_TIMEOUT;
+	ctx->hot_cache_ttl = DEFAULT_HOT_CACHE_TTL;
 	ctx->lua_pre_handler_cbref = -1;
 	ctx->lua_post_handler_cbref = -1;
 	ctx->keys = g_hash_table_new_full (fuzzy_kp_hash, fuzzy_kp_equal,
@@ -2215,6 +3178,34 @@ init_fuzzy (struct rspamd_config *cfg)
 			"Size of keypairs cache, default: "
 					G_STRINGIFY (DEFAULT_KEYPAIR_CACHE_SIZE));
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keypair_cache_shared_size",
+			fuzzy_parse_shared_keypair_cache,
+			ctx,
+			0,
+			RSPAMD_CL_FLAG_UINT,
+			"Size of keypairs cache shared by all workers, default: 0 (disabled)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hot_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, hot_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of recent check replies cached by each worker, default: 0 (disabled)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hot_cache_ttl",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, hot_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to keep cached check replies, default: "
+			G_STRINGIFY (DEFAULT_HOT_CACHE_TTL) " seconds");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"encrypted_only",
@@ -2241,6 +3232,34 @@ init_fuzzy (struct rspamd_config *cfg)
 			0,
 			"Work in read only mode");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"bulk_bind",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, bulk_bind),
+			0,
+			"Listen for HTTP bulk import of hashes on this address (allowed from allow_update addresses)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"bulk_password",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, bulk_password),
+			0,
+			"Require this password in the Password header of bulk import requests");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"bulk_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, bulk_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Timeout for bulk import connections, default: "
+					G_STRINGIFY (DEFAULT_BULK_TIMEOUT));
+
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -2334,26 +3353,30 @@ init_fuzzy (struct rspamd_config *cfg)
 static void
 rspamd_fuzzy_peer_io (EV_P_ ev_io *w, int revents)
 {
-	struct fuzzy_peer_cmd cmd;
+	struct fuzzy_peer_cmd cmds[FUZZY_PEER_BATCH];
 	struct rspamd_fuzzy_storage_ctx *ctx =
 			(struct rspamd_fuzzy_storage_ctx *)w->data;
 	gssize r;
 
 	for (;;) {
-		r = read (w->fd, &cmd, sizeof (cmd));
+		/* Each datagram contains one or more commands */
+		r = read (w->fd, cmds, sizeof (cmds));
 
-		if (r != sizeof (cmd)) {
-			if (errno == EINTR) {
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR) {
 				continue;
 			}
-			if (errno != EAGAIN) {
+			if (r == -1 && errno != EAGAIN) {
 				msg_err ("cannot read command from peers: %s", strerror (errno));
 			}
 
 			break;
 		}
+		else if (r % sizeof (cmds[0]) != 0) {
+			msg_err ("invalid peer command size: %z", r);
+		}
 		else {
-			g_array_append_val (ctx->updates_pending, cmd);
+			g_array_append_vals (ctx->updates_pending, cmds, r / sizeof (cmds[0]));
 		}
 	}
 }
@@ -2452,6 +3475,11 @@ start_fuzzy (struct rspamd_worker *worker)
 	if (ctx->keypair_cache_size > 0) {
 		/* Create keypairs cache */
 		ctx->keypair_cache = rspamd_keypair_cache_new (ctx->keypair_cache_size);
+
+		if (ctx->shared_keypair_cache) {
+			rspamd_keypair_cache_set_shared (ctx->keypair_cache,
+					ctx->shared_keypair_cache);
+		}
 	}
 
 
@@ -2553,6 +3581,12 @@ start_fuzzy (struct rspamd_worker *worker)
 				"fuzzy delayed whitelist");
 	}
 
+	if (ctx->hot_cache_size > 0) {
+		ctx->hot_cache = rspamd_lru_hash_new_full (ctx->hot_cache_size,
+				g_free, g_free,
+				fuzzy_hot_key_hash, fuzzy_hot_key_equal);
+	}
+
 	/* Ratelimits */
 	if (!isnan (ctx->leaky_bucket_rate) && !isnan (ctx->leaky_bucket_burst)) {
 		ctx->ratelimit_buckets = rspamd_lru_hash_new_full (ctx->max_buckets,
@@ -2592,6 +3626,11 @@ start_fuzzy (struct rspamd_worker *worker)
 	rspamd_srv_send_command (worker, ctx->event_loop, &srv_cmd, -1,
 			fuzzy_peer_rep, ctx);
 
+	if (ctx->bulk_bind && worker->index == 0 && !ctx->read_only) {
+		/* Bulk imports are written directly to the backend by this worker */
+		rspamd_fuzzy_bulk_start (ctx);
+	}
+
 	luaL_Reg fuzzy_lua_reg = {
 			.name = "add_fuzzy_pre_handler",
 			.func = lua_fuzzy_add_pre_handler,
@@ -2608,6 +3647,7 @@ start_fuzzy (struct rspamd_worker *worker)
 
 	ev_loop (ctx->event_loop, 0);
 	rspamd_worker_block_signals ();
+	rspamd_fuzzy_bulk_stop (ctx);
 
 	if (ctx->peer_fd != -1) {
 		if (worker->index == 0) {
@@ -2635,6 +3675,10 @@ start_fuzzy (struct rspamd_worker *worker)
 		g_array_free (ctx->updates_pending, TRUE);
 	}
 
+	if (ctx->peer_updates) {
+		g_array_free (ctx->peer_updates, TRUE);
+	}
+
 	if (ctx->keypair_cache) {
 		rspamd_keypair_cache_destroy (ctx->keypair_cache);
 	}
@@ -2643,6 +3687,10 @@ start_fuzzy (struct rspamd_worker *worker)
 		rspamd_lru_hash_destroy (ctx->ratelimit_buckets);
 	}
 
+	if (ctx->hot_cache) {
+		rspamd_lru_hash_destroy (ctx->hot_cache);
+	}
+
 	if (ctx->lua_pre_handler_cbref != -1) {
 		luaL_unref (ctx->cfg->lua_state, LUA_REGISTRYINDEX, ctx->lua_pre_handler_cbref);
 	}
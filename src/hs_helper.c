@@ -19,6 +19,7 @@
 #include "libserver/cfg_rcl.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libserver/maps/map_helpers.h"
 #include "unix-std.h"
 
 #ifdef HAVE_GLOB_H
@@ -57,6 +58,7 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	gdouble max_time;
 	gdouble recompile_time;
+	guint workers;
 	ev_timer recompile_timer;
 };
 
@@ -107,6 +109,15 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, max_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Maximum time to wait for compilation of a single expression");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"compile_workers",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, workers),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of processes to compile classes in parallel "
+			"(0 means number of CPUs)");
 
 	return ctx;
 }
@@ -172,6 +183,43 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 		ret = FALSE;
 	}
 
+	globfree (&globbuf);
+
+	/*
+	 * Deserialized databases shared by workers: `<path>.<hash>.unser`,
+	 * they are useless once the serialized database is removed
+	 */
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.unser");
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			gchar *base = g_strdup (globbuf.gl_pathv[i]), *dot;
+
+			/* Strip `.unser` and then `.<hash>` */
+			dot = strrchr (base, '.');
+			*dot = '\0';
+			dot = strrchr (base, '.');
+
+			if (dot) {
+				*dot = '\0';
+			}
+
+			if (forced || access (base, F_OK) == -1) {
+				if (unlink (globbuf.gl_pathv[i]) == -1) {
+					msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+							strerror (errno));
+					ret = FALSE;
+				}
+			}
+
+			g_free (base);
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		ret = FALSE;
+	}
+
 	globfree (&globbuf);
 	g_free (pattern);
 
@@ -268,7 +316,7 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 
 	hack_global_forced = forced; /* killmeplease */
 	rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
-			ctx->hs_dir, ctx->max_time, !forced,
+			ctx->hs_dir, ctx->max_time, ctx->workers, !forced,
 			ctx->event_loop,
 			rspamd_rs_compile_cb,
 			(void *)worker);
@@ -304,6 +352,46 @@ rspamd_hs_helper_reload (struct rspamd_main *rspamd_main,
 	return TRUE;
 }
 
+static gboolean
+rspamd_hs_helper_compile_map (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *worker, gint fd,
+		gint attached_fd,
+		struct rspamd_control_command *cmd,
+		gpointer ud)
+{
+	struct rspamd_control_reply rep;
+	struct hs_helper_ctx *ctx = ud;
+	struct rspamd_srv_command srv_cmd;
+	GError *err = NULL;
+
+	memset (&rep, 0, sizeof (rep));
+	rep.type = RSPAMD_CONTROL_HYPERSCAN_MAP_COMPILE;
+	rep.reply.hs_map.status = 0;
+
+	/* Reply first, compilation can take long */
+	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
+		msg_err ("cannot write reply to the control socket: %s",
+				strerror (errno));
+	}
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+
+	if (!rspamd_regexp_map_compile_request (ctx->cfg, cmd->cmd.hs_map.path,
+			srv_cmd.cmd.hs_map.path, sizeof (srv_cmd.cmd.hs_map.path), &err)) {
+		/* Workers compile the map by themselves after a timeout */
+		msg_err ("cannot compile regexp map: %e", err);
+		g_error_free (err);
+
+		return TRUE;
+	}
+
+	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_MAP_LOADED;
+	rspamd_srv_send_command (worker,
+			ctx->event_loop, &srv_cmd, -1, NULL, NULL);
+
+	return TRUE;
+}
+
 static void
 rspamd_hs_helper_timer (EV_P_ ev_timer *w, int revents)
 {
@@ -344,6 +432,9 @@ start_hs_helper (struct rspamd_worker *worker)
 
 	rspamd_control_worker_add_cmd_handler (worker, RSPAMD_CONTROL_RECOMPILE,
 			rspamd_hs_helper_reload, ctx);
+	rspamd_control_worker_add_cmd_handler (worker,
+			RSPAMD_CONTROL_HYPERSCAN_MAP_COMPILE,
+			rspamd_hs_helper_compile_map, ctx);
 
 	ctx->recompile_timer.data = worker;
 	tim = rspamd_time_jitter (ctx->recompile_time, 0);
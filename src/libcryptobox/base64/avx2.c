@@ -144,6 +144,26 @@ dec_reshuffle (__m256i in)
 		const __m256i eq_2F       = _mm256_cmpeq_epi8(str, mask_2F); \
 		const __m256i roll        = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2F, hi_nibbles)); \
 		if (!_mm256_testz_si256(lo, hi)) { \
+			/* Line break after full quanta: decode them and skip CR/LF */ \
+			const unsigned valid = (unsigned)_mm256_movemask_epi8( \
+				_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())); \
+			const unsigned first_bad = __builtin_ctz(~valid); \
+			if ((first_bad & 3) == 0 && (c[first_bad] == '\r' || c[first_bad] == '\n')) { \
+				if (first_bad > 0) { \
+					str = _mm256_add_epi8(str, roll); \
+					str = dec_reshuffle(str); \
+					_mm256_storeu_si256((__m256i *)o, str); \
+					c += first_bad; \
+					o += first_bad / 4 * 3; \
+					outl += first_bad / 4 * 3; \
+					inlen -= first_bad; \
+				} \
+				while (inlen > 0 && (*c == '\r' || *c == '\n')) { \
+					c ++; \
+					inlen --; \
+				} \
+				continue; \
+			} \
 			seen_error = true; \
 			break; \
 		} \
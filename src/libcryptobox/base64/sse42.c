@@ -117,9 +117,14 @@ static inline __m128i dec_reshuffle (__m128i in)
 			'0','9', \
 			'A','Z', \
 			'a','z'); \
+		unsigned first_bad = 16; \
 		if (_mm_cmpistrc(range, str, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY)) { \
-			seen_error = true; \
-			break; \
+			/* Line break after full quanta: decode them and skip CR/LF */ \
+			first_bad = _mm_cmpistri(range, str, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY); \
+			if ((first_bad & 3) != 0 || (c[first_bad] != '\r' && c[first_bad] != '\n')) { \
+				seen_error = true; \
+				break; \
+			} \
 		} \
 		__m128i indices = _mm_subs_epu8(str, _mm_set1_epi8(46)); \
 		__m128i mask45 = CMPGT(str, 64); \
@@ -132,10 +137,14 @@ static inline __m128i dec_reshuffle (__m128i in)
 		str = _mm_add_epi8(str, delta); \
 		str = dec_reshuffle(str); \
 		_mm_storeu_si128((__m128i *)o, str); \
-		c += 16; \
-		o += 12; \
-		outl += 12; \
-		inlen -= 16; \
+		c += first_bad; \
+		o += first_bad / 4 * 3; \
+		outl += first_bad / 4 * 3; \
+		inlen -= first_bad; \
+		while (inlen > 0 && (*c == '\r' || *c == '\n')) { \
+			c ++; \
+			inlen --; \
+		} \
 	}
 
 int
@@ -0,0 +1,275 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * AVX-512 chacha: 16 blocks are processed at once, each zmm register holds
+ * the same state word of all 16 blocks. Tails shorter than 16 blocks are
+ * passed to the reference implementation.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "chacha.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+#ifndef __AVX512F__
+#define __AVX512F__
+#endif
+
+#include <immintrin.h>
+
+#define CHACHA_AVX512_BLOCKS 16
+#define CHACHA_AVX512_BYTES (CHACHA_AVX512_BLOCKS * CHACHA_BLOCKBYTES)
+
+void chacha_blocks_ref (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes);
+void hchacha_ref (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds);
+
+#define QUARTER(a, b, c, d) do { \
+	a = _mm512_add_epi32 (a, b); d = _mm512_rol_epi32 (_mm512_xor_si512 (d, a), 16); \
+	c = _mm512_add_epi32 (c, d); b = _mm512_rol_epi32 (_mm512_xor_si512 (b, c), 12); \
+	a = _mm512_add_epi32 (a, b); d = _mm512_rol_epi32 (_mm512_xor_si512 (d, a), 8); \
+	c = _mm512_add_epi32 (c, d); b = _mm512_rol_epi32 (_mm512_xor_si512 (b, c), 7); \
+} while (0)
+
+static inline guint32
+chacha_load32 (const unsigned char *p)
+{
+	guint32 v;
+
+	memcpy (&v, p, sizeof (v));
+
+	return GUINT32_FROM_LE (v);
+}
+
+static inline void
+chacha_store32 (unsigned char *p, guint32 v)
+{
+	v = GUINT32_TO_LE (v);
+	memcpy (p, &v, sizeof (v));
+}
+
+/*
+ * Transposes words 4k..4k+3 of 16 blocks and writes them to the output,
+ * y[j] lane L receives words of block 4L + j
+ */
+static inline void
+chacha_avx512_transpose4 (__m512i a, __m512i b, __m512i c, __m512i d,
+		__m512i y[4]) __attribute__((__target__("avx512f")));
+
+static inline void
+chacha_avx512_transpose4 (__m512i a, __m512i b, __m512i c, __m512i d,
+		__m512i y[4])
+{
+	__m512i t0, t1, t2, t3;
+
+	t0 = _mm512_unpacklo_epi32 (a, b);
+	t1 = _mm512_unpackhi_epi32 (a, b);
+	t2 = _mm512_unpacklo_epi32 (c, d);
+	t3 = _mm512_unpackhi_epi32 (c, d);
+
+	y[0] = _mm512_unpacklo_epi64 (t0, t2);
+	y[1] = _mm512_unpackhi_epi64 (t0, t2);
+	y[2] = _mm512_unpacklo_epi64 (t1, t3);
+	y[3] = _mm512_unpackhi_epi64 (t1, t3);
+}
+
+static inline void
+chacha_avx512_output (const __m512i g[4], const unsigned char *in,
+		unsigned char *out, guint j) __attribute__((__target__("avx512f")));
+
+static inline void
+chacha_avx512_output (const __m512i g[4], const unsigned char *in,
+		unsigned char *out, guint j)
+{
+	__m512i p0, p1, p2, p3, o[4];
+	guint l;
+
+	/* 4x4 transpose of 128 bit lanes */
+	p0 = _mm512_shuffle_i32x4 (g[0], g[1], _MM_SHUFFLE (1, 0, 1, 0));
+	p1 = _mm512_shuffle_i32x4 (g[0], g[1], _MM_SHUFFLE (3, 2, 3, 2));
+	p2 = _mm512_shuffle_i32x4 (g[2], g[3], _MM_SHUFFLE (1, 0, 1, 0));
+	p3 = _mm512_shuffle_i32x4 (g[2], g[3], _MM_SHUFFLE (3, 2, 3, 2));
+
+	o[0] = _mm512_shuffle_i32x4 (p0, p2, _MM_SHUFFLE (2, 0, 2, 0));
+	o[1] = _mm512_shuffle_i32x4 (p0, p2, _MM_SHUFFLE (3, 1, 3, 1));
+	o[2] = _mm512_shuffle_i32x4 (p1, p3, _MM_SHUFFLE (2, 0, 2, 0));
+	o[3] = _mm512_shuffle_i32x4 (p1, p3, _MM_SHUFFLE (3, 1, 3, 1));
+
+	for (l = 0; l < 4; l ++) {
+		gsize off = (l * 4 + j) * CHACHA_BLOCKBYTES;
+
+		if (in) {
+			o[l] = _mm512_xor_si512 (o[l],
+					_mm512_loadu_si512 ((const void *)(in + off)));
+		}
+
+		_mm512_storeu_si512 ((void *)(out + off), o[l]);
+	}
+}
+
+void
+chacha_blocks_avx512 (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes) __attribute__((__target__("avx512f")));
+
+void
+chacha_blocks_avx512 (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes)
+{
+	static const guint32 chacha_constants[4] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+	};
+	guint32 j[12];
+	__m512i s[16], x[16], y[4][4], g[4];
+	__m512i ctr_inc;
+	__mmask16 carry;
+	size_t r;
+	guint i, k;
+
+	if (bytes < CHACHA_AVX512_BYTES) {
+		chacha_blocks_ref (state, in, out, bytes);
+
+		return;
+	}
+
+	for (i = 0; i < 12; i ++) {
+		j[i] = chacha_load32 (state->s + i * 4);
+	}
+
+	for (i = 0; i < 4; i ++) {
+		s[i] = _mm512_set1_epi32 (chacha_constants[i]);
+	}
+
+	for (i = 0; i < 12; i ++) {
+		s[i + 4] = _mm512_set1_epi32 (j[i]);
+	}
+
+	ctr_inc = _mm512_set_epi32 (15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0);
+
+	while (bytes >= CHACHA_AVX512_BYTES) {
+		/* Per block 64 bit counter */
+		s[12] = _mm512_add_epi32 (_mm512_set1_epi32 (j[8]), ctr_inc);
+		carry = _mm512_cmplt_epu32_mask (s[12], _mm512_set1_epi32 (j[8]));
+		s[13] = _mm512_mask_add_epi32 (_mm512_set1_epi32 (j[9]), carry,
+				_mm512_set1_epi32 (j[9]), _mm512_set1_epi32 (1));
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = s[i];
+		}
+
+		for (r = state->rounds; r > 0; r -= 2) {
+			QUARTER (x[0], x[4], x[8], x[12]);
+			QUARTER (x[1], x[5], x[9], x[13]);
+			QUARTER (x[2], x[6], x[10], x[14]);
+			QUARTER (x[3], x[7], x[11], x[15]);
+			QUARTER (x[0], x[5], x[10], x[15]);
+			QUARTER (x[1], x[6], x[11], x[12]);
+			QUARTER (x[2], x[7], x[8], x[13]);
+			QUARTER (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = _mm512_add_epi32 (x[i], s[i]);
+		}
+
+		for (k = 0; k < 4; k ++) {
+			chacha_avx512_transpose4 (x[k * 4], x[k * 4 + 1], x[k * 4 + 2],
+					x[k * 4 + 3], y[k]);
+		}
+
+		for (i = 0; i < 4; i ++) {
+			for (k = 0; k < 4; k ++) {
+				g[k] = y[k][i];
+			}
+
+			chacha_avx512_output (g, in, out, i);
+		}
+
+		j[8] += CHACHA_AVX512_BLOCKS;
+
+		if (j[8] < CHACHA_AVX512_BLOCKS) {
+			j[9] ++;
+		}
+
+		if (in) {
+			in += CHACHA_AVX512_BYTES;
+		}
+
+		out += CHACHA_AVX512_BYTES;
+		bytes -= CHACHA_AVX512_BYTES;
+	}
+
+	/* store the counter back to the state */
+	chacha_store32 (state->s + 32, j[8]);
+	chacha_store32 (state->s + 36, j[9]);
+	rspamd_explicit_memzero (j, sizeof (j));
+
+	chacha_blocks_ref (state, in, out, bytes);
+}
+
+void
+hchacha_avx512 (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds)
+{
+	/* Single block, nothing to vectorize */
+	hchacha_ref (key, iv, out, rounds);
+}
+
+void
+chacha_avx512 (const chacha_key *key, const chacha_iv *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	memcpy (state.s, key->b, 32);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b, 8);
+	state.rounds = rounds;
+	chacha_blocks_avx512 (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+void
+xchacha_avx512 (const chacha_key *key, const chacha_iv24 *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	hchacha_ref (key->b, iv->b, state.s, rounds);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b + 16, 8);
+	state.rounds = rounds;
+	chacha_blocks_avx512 (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+#pragma GCC pop_options
+#endif
@@ -52,6 +52,14 @@ typedef struct chacha_impl_t {
 #define CHACHA_IMPL(cpuflags, desc, ext) \
 		{(cpuflags), desc, chacha_##ext, xchacha_##ext, chacha_blocks_##ext, hchacha_##ext}
 
+#if defined(HAVE_AVX512)
+	CHACHA_DECLARE(avx512)
+	#define CHACHA_AVX512 CHACHA_IMPL(CPUID_AVX512, "avx512", avx512)
+#endif
+#if defined(HAVE_NEON)
+	CHACHA_DECLARE(neon)
+	#define CHACHA_NEON CHACHA_IMPL(CPUID_NEON, "neon", neon)
+#endif
 #if defined(HAVE_AVX2)
 	CHACHA_DECLARE(avx2)
 	#define CHACHA_AVX2 CHACHA_IMPL(CPUID_AVX2, "avx2", avx2)
@@ -70,6 +78,12 @@ CHACHA_DECLARE(ref)
 
 static const chacha_impl_t chacha_list[] = {
 	CHACHA_GENERIC,
+#if defined(CHACHA_AVX512)
+	CHACHA_AVX512,
+#endif
+#if defined(CHACHA_NEON)
+	CHACHA_NEON,
+#endif
 #if defined(CHACHA_AVX2)
 	CHACHA_AVX2,
 #endif
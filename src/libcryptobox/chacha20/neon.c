@@ -0,0 +1,210 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * NEON chacha for aarch64 (little endian): 4 blocks are processed at once,
+ * each q register holds the same state word of 4 blocks. Tails shorter than
+ * 4 blocks are passed to the reference implementation.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "chacha.h"
+
+#include <arm_neon.h>
+
+#define CHACHA_NEON_BLOCKS 4
+#define CHACHA_NEON_BYTES (CHACHA_NEON_BLOCKS * CHACHA_BLOCKBYTES)
+
+void chacha_blocks_ref (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes);
+void hchacha_ref (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds);
+
+#define ROTL(v, n) vsriq_n_u32 (vshlq_n_u32 ((v), (n)), (v), 32 - (n))
+#define ROTL16(v) vreinterpretq_u32_u16 (vrev32q_u16 (vreinterpretq_u16_u32 (v)))
+
+#define QUARTER(a, b, c, d) do { \
+	a = vaddq_u32 (a, b); d = ROTL16 (veorq_u32 (d, a)); \
+	c = vaddq_u32 (c, d); t = veorq_u32 (b, c); b = ROTL (t, 12); \
+	a = vaddq_u32 (a, b); t = veorq_u32 (d, a); d = ROTL (t, 8); \
+	c = vaddq_u32 (c, d); t = veorq_u32 (b, c); b = ROTL (t, 7); \
+} while (0)
+
+static inline guint32
+chacha_load32 (const unsigned char *p)
+{
+	guint32 v;
+
+	memcpy (&v, p, sizeof (v));
+
+	return GUINT32_FROM_LE (v);
+}
+
+static inline void
+chacha_store32 (unsigned char *p, guint32 v)
+{
+	v = GUINT32_TO_LE (v);
+	memcpy (p, &v, sizeof (v));
+}
+
+/* Writes words 4k..4k+3 of 4 blocks */
+static inline void
+chacha_neon_output (uint32x4_t a, uint32x4_t b, uint32x4_t c, uint32x4_t d,
+		const unsigned char *in, unsigned char *out)
+{
+	uint32x4x2_t ab, cd;
+	uint32x4_t o[4];
+	guint l;
+
+	ab = vtrnq_u32 (a, b);
+	cd = vtrnq_u32 (c, d);
+
+	o[0] = vcombine_u32 (vget_low_u32 (ab.val[0]), vget_low_u32 (cd.val[0]));
+	o[1] = vcombine_u32 (vget_low_u32 (ab.val[1]), vget_low_u32 (cd.val[1]));
+	o[2] = vcombine_u32 (vget_high_u32 (ab.val[0]), vget_high_u32 (cd.val[0]));
+	o[3] = vcombine_u32 (vget_high_u32 (ab.val[1]), vget_high_u32 (cd.val[1]));
+
+	for (l = 0; l < 4; l ++) {
+		gsize off = l * CHACHA_BLOCKBYTES;
+
+		if (in) {
+			o[l] = veorq_u32 (o[l], vreinterpretq_u32_u8 (vld1q_u8 (in + off)));
+		}
+
+		vst1q_u8 (out + off, vreinterpretq_u8_u32 (o[l]));
+	}
+}
+
+void
+chacha_blocks_neon (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes)
+{
+	static const guint32 chacha_constants[4] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+	};
+	static const guint32 ctr_inc_words[4] = {0, 1, 2, 3};
+	guint32 j[12];
+	uint32x4_t s[16], x[16], t, ctr_inc, carry;
+	size_t r;
+	guint i, k;
+
+	if (bytes < CHACHA_NEON_BYTES) {
+		chacha_blocks_ref (state, in, out, bytes);
+
+		return;
+	}
+
+	for (i = 0; i < 12; i ++) {
+		j[i] = chacha_load32 (state->s + i * 4);
+	}
+
+	for (i = 0; i < 4; i ++) {
+		s[i] = vdupq_n_u32 (chacha_constants[i]);
+	}
+
+	for (i = 0; i < 12; i ++) {
+		s[i + 4] = vdupq_n_u32 (j[i]);
+	}
+
+	ctr_inc = vld1q_u32 (ctr_inc_words);
+
+	while (bytes >= CHACHA_NEON_BYTES) {
+		/* Per block 64 bit counter, carry is all ones (-1) on overflow */
+		s[12] = vaddq_u32 (vdupq_n_u32 (j[8]), ctr_inc);
+		carry = vcltq_u32 (s[12], vdupq_n_u32 (j[8]));
+		s[13] = vsubq_u32 (vdupq_n_u32 (j[9]), carry);
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = s[i];
+		}
+
+		for (r = state->rounds; r > 0; r -= 2) {
+			QUARTER (x[0], x[4], x[8], x[12]);
+			QUARTER (x[1], x[5], x[9], x[13]);
+			QUARTER (x[2], x[6], x[10], x[14]);
+			QUARTER (x[3], x[7], x[11], x[15]);
+			QUARTER (x[0], x[5], x[10], x[15]);
+			QUARTER (x[1], x[6], x[11], x[12]);
+			QUARTER (x[2], x[7], x[8], x[13]);
+			QUARTER (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = vaddq_u32 (x[i], s[i]);
+		}
+
+		for (k = 0; k < 4; k ++) {
+			chacha_neon_output (x[k * 4], x[k * 4 + 1], x[k * 4 + 2],
+					x[k * 4 + 3], in ? in + k * 16 : NULL, out + k * 16);
+		}
+
+		j[8] += CHACHA_NEON_BLOCKS;
+
+		if (j[8] < CHACHA_NEON_BLOCKS) {
+			j[9] ++;
+		}
+
+		if (in) {
+			in += CHACHA_NEON_BYTES;
+		}
+
+		out += CHACHA_NEON_BYTES;
+		bytes -= CHACHA_NEON_BYTES;
+	}
+
+	/* store the counter back to the state */
+	chacha_store32 (state->s + 32, j[8]);
+	chacha_store32 (state->s + 36, j[9]);
+	rspamd_explicit_memzero (j, sizeof (j));
+
+	chacha_blocks_ref (state, in, out, bytes);
+}
+
+void
+hchacha_neon (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds)
+{
+	/* Single block, nothing to vectorize */
+	hchacha_ref (key, iv, out, rounds);
+}
+
+void
+chacha_neon (const chacha_key *key, const chacha_iv *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	memcpy (state.s, key->b, 32);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b, 8);
+	state.rounds = rounds;
+	chacha_blocks_neon (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+void
+xchacha_neon (const chacha_key *key, const chacha_iv24 *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	hchacha_ref (key->b, iv->b, state.s, rounds);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b + 16, 8);
+	state.rounds = rounds;
+	chacha_blocks_neon (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
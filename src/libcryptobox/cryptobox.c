@@ -27,6 +27,7 @@
 #include "base64/base64.h"
 #include "ottery.h"
 #include "printf.h"
+#include "libutil/str_util.h"
 #include "xxhash.h"
 #define MUM_TARGET_INDEPENDENT_HASH 1 /* For 32/64 bit equal hashes */
 #include "../../contrib/mumhash/mum.h"
@@ -90,6 +91,22 @@ rspamd_cryptobox_cpuid (gint cpu[4], gint info)
 #endif
 }
 
+/* Returns XCR0, must be called only if OSXSAVE is set */
+static guint64
+rspamd_cryptobox_xgetbv (void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	guint32 eax, edx;
+
+	/* Use byte code here for compatibility */
+	__asm__ volatile (".byte 0x0f,0x01,0xd0" : "=a" (eax), "=d" (edx) : "c" (0));
+
+	return ((guint64)edx << 32) | eax;
+#else
+	return 0;
+#endif
+}
+
 static sig_atomic_t ok = 0;
 static jmp_buf j;
 
@@ -163,6 +180,11 @@ rspamd_cryptobox_test_instr (gint instr)
 	case CPUID_AVX2:
 		__asm__ volatile ("vpaddq %ymm0, %ymm0, %ymm0");\
 		break;
+#endif
+#ifdef HAVE_AVX512
+	case CPUID_AVX512:
+		__asm__ volatile ("vpaddd %zmm0, %zmm0, %zmm0");
+		break;
 #endif
 	default:
 		return FALSE;
@@ -185,6 +207,10 @@ rspamd_cryptobox_init (void)
 	const guint32 osxsave_mask = (1 << 27);
 	const guint32 fma_movbe_osxsave_mask = ((1 << 12) | (1 << 22) | (1 << 27));
 	const guint32 avx2_bmi12_mask = (1 << 5) | (1 << 3) | (1 << 8);
+	const guint32 avx512f_mask = (1 << 16);
+	/* SSE, AVX, opmask and both halves of zmm registers are saved by OS */
+	const guint64 xcr0_avx512_mask = (1 << 1) | (1 << 2) | (1 << 5) |
+			(1 << 6) | (1 << 7);
 	gulong bit;
 	static struct rspamd_cryptobox_library_ctx *ctx;
 	GString *buf;
@@ -250,10 +276,23 @@ rspamd_cryptobox_init (void)
 						cpu_config |= CPUID_AVX2;
 					}
 				}
+
+				if ((cpu[1] & avx512f_mask) == avx512f_mask &&
+						(rspamd_cryptobox_xgetbv () & xcr0_avx512_mask) ==
+						xcr0_avx512_mask) {
+					if (rspamd_cryptobox_test_instr (CPUID_AVX512)) {
+						cpu_config |= CPUID_AVX512;
+					}
+				}
 			}
 		}
 	}
 
+#if defined(HAVE_NEON) && defined(__aarch64__)
+	/* Advanced SIMD is mandatory for aarch64 */
+	cpu_config |= CPUID_NEON;
+#endif
+
 	buf = g_string_new ("");
 
 	for (bit = 0x1; bit != 0; bit <<= 1) {
@@ -283,6 +322,12 @@ rspamd_cryptobox_init (void)
 			case CPUID_RDRAND:
 				rspamd_printf_gstring (buf, "rdrand, ");
 				break;
+			case CPUID_AVX512:
+				rspamd_printf_gstring (buf, "avx512, ");
+				break;
+			case CPUID_NEON:
+				rspamd_printf_gstring (buf, "neon, ");
+				break;
 			default:
 				break; /* Silence warning */
 			}
@@ -301,6 +346,7 @@ rspamd_cryptobox_init (void)
 
 	ctx->chacha20_impl = chacha_load ();
 	ctx->base64_impl = base64_load ();
+	ctx->fast_hash_impl = rspamd_cryptobox_fast_hash_impl ();
 #if defined(HAVE_USABLE_OPENSSL) && (OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER))
 	/* Needed for old openssl api, not sure about LibreSSL */
 	ERR_load_EC_strings ();
@@ -460,6 +506,61 @@ rspamd_cryptobox_nm (rspamd_nm_t nm,
 	}
 }
 
+void
+rspamd_cryptobox_nm_batch (guchar * const *nms,
+		const guchar * const *pks,
+		const guchar * const *sks,
+		gsize n,
+		enum rspamd_cryptobox_mode mode)
+{
+	guchar s[32];
+	guchar e[32];
+	const guchar *clamped = NULL;
+	gsize i, j;
+
+	if (mode != RSPAMD_CRYPTOBOX_MODE_25519) {
+		for (i = 0; i < n; i ++) {
+			rspamd_cryptobox_nm (nms[i], pks[i], sks[i], mode);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < n; i ++) {
+		/* Bursts usually come from a few clients that reuse their keys */
+		for (j = 0; j < i; j ++) {
+			if (memcmp (pks[j], pks[i], 32) == 0 &&
+					memcmp (sks[j], sks[i], 32) == 0) {
+				break;
+			}
+		}
+
+		if (j < i) {
+			memcpy (nms[i], nms[j], rspamd_cryptobox_MAX_NMBYTES);
+			continue;
+		}
+
+		/* All pairs normally share the local key */
+		if (clamped == NULL || memcmp (clamped, sks[i], 32) != 0) {
+			memcpy (e, sks[i], 32);
+			e[0] &= 248;
+			e[31] &= 127;
+			e[31] |= 64;
+			clamped = sks[i];
+		}
+
+		if (crypto_scalarmult (s, e, pks[i]) != -1) {
+			hchacha (s, n0, nms[i], 20);
+		}
+		else {
+			memset (nms[i], 0, rspamd_cryptobox_MAX_NMBYTES);
+		}
+	}
+
+	rspamd_explicit_memzero (e, sizeof (e));
+	rspamd_explicit_memzero (s, sizeof (s));
+}
+
 void
 rspamd_cryptobox_sign (guchar *sig, unsigned long long *siglen_p,
 		const guchar *m, gsize mlen,
@@ -1654,11 +1755,74 @@ rspamd_cryptobox_fast_hash_final (rspamd_cryptobox_fast_hash_state_t *st)
 /**
  * One in all function
  */
+#ifdef HAVE_AESNI
+guint64 rspamd_fast_hash_aesni (const void *data, gsize len, guint64 seed)
+		__attribute__((__target__("aes")));
+#endif
+
+typedef guint64 (*rspamd_fast_hash_func_t) (const void *data, gsize len,
+		guint64 seed);
+
+static guint64 rspamd_cryptobox_fast_hash_resolve (const void *data,
+		gsize len, guint64 seed);
+
+static rspamd_fast_hash_func_t fast_hash_func = rspamd_cryptobox_fast_hash_resolve;
+static const gchar *fast_hash_name = "t1ha2";
+
+static guint64
+rspamd_cryptobox_fast_hash_t1ha2 (const void *data, gsize len, guint64 seed)
+{
+	return t1ha2_atonce (data, len, seed);
+}
+
+static void
+rspamd_cryptobox_fast_hash_select (void)
+{
+	/*
+	 * Hash tables could be filled before rspamd_cryptobox_init, so the
+	 * selection is done on the first use and it depends on cpuid only
+	 */
+	fast_hash_func = rspamd_cryptobox_fast_hash_t1ha2;
+	fast_hash_name = "t1ha2";
+#ifdef HAVE_AESNI
+	gint cpu[4];
+
+	rspamd_cryptobox_cpuid (cpu, 0);
+
+	if (cpu[0] >= 1) {
+		rspamd_cryptobox_cpuid (cpu, 1);
+
+		if (cpu[2] & ((guint32)1 << 25)) {
+			fast_hash_func = rspamd_fast_hash_aesni;
+			fast_hash_name = "aesni";
+		}
+	}
+#endif
+}
+
+static guint64
+rspamd_cryptobox_fast_hash_resolve (const void *data, gsize len, guint64 seed)
+{
+	rspamd_cryptobox_fast_hash_select ();
+
+	return fast_hash_func (data, len, seed);
+}
+
+const gchar *
+rspamd_cryptobox_fast_hash_impl (void)
+{
+	if (fast_hash_func == rspamd_cryptobox_fast_hash_resolve) {
+		rspamd_cryptobox_fast_hash_select ();
+	}
+
+	return fast_hash_name;
+}
+
 static inline guint64
 rspamd_cryptobox_fast_hash_machdep (const void *data,
 		gsize len, guint64 seed)
 {
-	return t1ha2_atonce (data, len, seed);
+	return fast_hash_func (data, len, seed);
 }
 
 static inline guint64
@@ -1675,6 +1839,54 @@ rspamd_cryptobox_fast_hash (const void *data,
 	return rspamd_cryptobox_fast_hash_machdep (data, len, seed);
 }
 
+/* Inputs up to this length are lowercased on stack and hashed at once */
+#define RSPAMD_FAST_HASH_LC_BUF 256
+
+static void
+rspamd_cryptobox_copy_lc (guchar *dst, const guchar *src, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len; i ++) {
+		dst[i] = lc_map[src[i]];
+	}
+}
+
+void
+rspamd_cryptobox_fast_hash_update_lc (rspamd_cryptobox_fast_hash_state_t *st,
+		const void *data, gsize len)
+{
+	guchar buf[RSPAMD_FAST_HASH_LC_BUF];
+	const guchar *p = data;
+	gsize chunk;
+
+	while (len > 0) {
+		chunk = MIN (len, sizeof (buf));
+		rspamd_cryptobox_copy_lc (buf, p, chunk);
+		rspamd_cryptobox_fast_hash_update (st, buf, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+}
+
+guint64
+rspamd_cryptobox_fast_hash_lc (const void *data, gsize len, guint64 seed)
+{
+	guchar buf[RSPAMD_FAST_HASH_LC_BUF];
+	rspamd_cryptobox_fast_hash_state_t st;
+
+	if (len <= sizeof (buf)) {
+		rspamd_cryptobox_copy_lc (buf, data, len);
+
+		return rspamd_cryptobox_fast_hash_machdep (buf, len, seed);
+	}
+
+	rspamd_cryptobox_fast_hash_init (&st, seed);
+	rspamd_cryptobox_fast_hash_update_lc (&st, data, len);
+
+	return rspamd_cryptobox_fast_hash_final (&st);
+}
+
 guint64
 rspamd_cryptobox_fast_hash_specific (
 		enum rspamd_cryptobox_fast_hash_type type,
@@ -56,6 +56,8 @@ struct rspamd_cryptobox_segment {
 #define CPUID_SSE41 0x20
 #define CPUID_SSE42 0x40
 #define CPUID_RDRAND 0x80
+#define CPUID_AVX512 0x100
+#define CPUID_NEON 0x200
 
 typedef guchar rspamd_pk_t[rspamd_cryptobox_MAX_PKBYTES];
 typedef guchar rspamd_sk_t[rspamd_cryptobox_MAX_SKBYTES];
@@ -76,6 +78,7 @@ struct rspamd_cryptobox_library_ctx {
 	gchar *cpu_extensions;
 	const gchar *chacha20_impl;
 	const gchar *base64_impl;
+	const gchar *fast_hash_impl;
 	unsigned long cpu_config;
 };
 
@@ -193,6 +196,20 @@ gboolean rspamd_cryptobox_decrypt_nm_inplace (guchar *data, gsize len,
 void rspamd_cryptobox_nm (rspamd_nm_t nm, const rspamd_pk_t pk,
 						  const rspamd_sk_t sk, enum rspamd_cryptobox_mode mode);
 
+/**
+ * Generate shared secrets for n pairs of keys, a pair that occurs more than
+ * once in a batch is computed once
+ * @param nms output shared secrets
+ * @param pks remote pubkeys
+ * @param sks local privkeys
+ * @param n number of pairs
+ */
+void rspamd_cryptobox_nm_batch (guchar * const *nms,
+								const guchar * const *pks,
+								const guchar * const *sks,
+								gsize n,
+								enum rspamd_cryptobox_mode mode);
+
 /**
  * Create digital signature for the specified message and place result in `sig`
  * @param sig signature target
@@ -389,11 +406,30 @@ void rspamd_cryptobox_fast_hash_update (rspamd_cryptobox_fast_hash_state_t *st,
 guint64 rspamd_cryptobox_fast_hash_final (rspamd_cryptobox_fast_hash_state_t *st);
 
 /**
- * One in all function
+ * Update hash with ASCII lowercased data portion
+ */
+void rspamd_cryptobox_fast_hash_update_lc (rspamd_cryptobox_fast_hash_state_t *st,
+										   const void *data, gsize len);
+
+/**
+ * One in all function, the implementation is selected for the CPU on the
+ * first use, so the result must never be stored or sent anywhere: use
+ * RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT for that
  */
 guint64 rspamd_cryptobox_fast_hash (const void *data,
 									gsize len, guint64 seed);
 
+/**
+ * The same as rspamd_cryptobox_fast_hash for ASCII lowercased data
+ */
+guint64 rspamd_cryptobox_fast_hash_lc (const void *data,
+									   gsize len, guint64 seed);
+
+/**
+ * Returns name of the implementation used by rspamd_cryptobox_fast_hash
+ */
+const gchar *rspamd_cryptobox_fast_hash_impl (void);
+
 /**
  * Platform independent version
  */
@@ -0,0 +1,132 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Non crypto hash based on AES rounds: each 16 bytes block is mixed into one
+ * of the independent lanes by a single round, the lanes are folded and the
+ * result passes three more rounds, so every bit of the input affects every
+ * bit of the output. Seed and length are mixed into the initial state.
+ * The hash is machine dependent and must never be stored anywhere.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("aes")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __AES__
+#define __AES__
+#endif
+
+#include <immintrin.h>
+
+#define ROUND(h, p, k) _mm_aesenc_si128 (_mm_xor_si128 ((h), \
+		_mm_loadu_si128 ((const __m128i *)(p))), (k))
+
+guint64
+rspamd_fast_hash_aesni (const void *data, gsize len, guint64 seed)
+		__attribute__((__target__("aes")));
+
+guint64
+rspamd_fast_hash_aesni (const void *data, gsize len, guint64 seed)
+{
+	const guchar *p = data;
+	/* Digits of pi */
+	const __m128i k0 = _mm_set_epi64x (0x243f6a8885a308d3ULL,
+			0x13198a2e03707344ULL);
+	const __m128i k1 = _mm_set_epi64x (0xa4093822299f31d0ULL,
+			0x082efa98ec4e6c89ULL);
+	__m128i h0, h1, h2, h3, b;
+
+	h0 = _mm_xor_si128 (_mm_set_epi64x (seed, seed ^ (guint64)len), k0);
+	h1 = _mm_xor_si128 (_mm_set_epi64x (seed ^ (guint64)len, seed), k1);
+
+	if (len <= 16) {
+		/* Short inputs are read by (possibly overlapping) words */
+		if (len >= 8) {
+			guint64 a, c;
+
+			memcpy (&a, p, sizeof (a));
+			memcpy (&c, p + len - sizeof (c), sizeof (c));
+			b = _mm_set_epi64x (c, a);
+		}
+		else if (len >= 4) {
+			guint32 a, c;
+
+			memcpy (&a, p, sizeof (a));
+			memcpy (&c, p + len - sizeof (c), sizeof (c));
+			b = _mm_cvtsi64_si128 (((guint64)c << 32) | a);
+		}
+		else if (len > 0) {
+			b = _mm_cvtsi64_si128 (((guint64)p[0] << 16) |
+					((guint64)p[len >> 1] << 8) | p[len - 1]);
+		}
+		else {
+			b = _mm_setzero_si128 ();
+		}
+
+		h0 = _mm_aesenc_si128 (_mm_xor_si128 (h0, b), k1);
+	}
+	else {
+		if (len > 64) {
+			h2 = _mm_xor_si128 (h0, k1);
+			h3 = _mm_xor_si128 (h1, k0);
+
+			while (len > 64) {
+				h0 = ROUND (h0, p, k1);
+				h1 = ROUND (h1, p + 16, k0);
+				h2 = ROUND (h2, p + 32, k1);
+				h3 = ROUND (h3, p + 48, k0);
+				p += 64;
+				len -= 64;
+			}
+
+			h0 = _mm_aesenc_si128 (h0, h2);
+			h1 = _mm_aesenc_si128 (h1, h3);
+		}
+
+		while (len > 32) {
+			h0 = ROUND (h0, p, k1);
+			h1 = ROUND (h1, p + 16, k0);
+			p += 32;
+			len -= 32;
+		}
+
+		/*
+		 * 1..32 bytes are left, the last block may overlap the previous
+		 * ones, but it never starts before data as len was larger than 16
+		 */
+		if (len > 16) {
+			h0 = ROUND (h0, p, k1);
+		}
+
+		h1 = ROUND (h1, p + len - 16, k0);
+	}
+
+	h0 = _mm_aesenc_si128 (h0, h1);
+	h0 = _mm_aesenc_si128 (h0, k0);
+	h0 = _mm_aesenc_si128 (h0, k1);
+
+	return (guint64)_mm_cvtsi128_si64 (h0) ^
+			(guint64)_mm_cvtsi128_si64 (_mm_unpackhi_epi64 (h0, h0));
+}
+
+#pragma GCC pop_options
+#endif
@@ -17,15 +17,46 @@
 #include "keypairs_cache.h"
 #include "keypair_private.h"
 #include "libutil/util.h"
+#include "libutil/mem_pool.h"
 #include "hash.h"
 
+/* Number of elements in a bucket of the shared cache */
+#define RSPAMD_KEYPAIR_SHARED_WAYS 4
+
 struct rspamd_keypair_elt {
 	struct rspamd_cryptobox_nm *nm;
 	guchar pair[rspamd_cryptobox_HASHBYTES * 2];
 };
 
+struct rspamd_keypair_shared_elt {
+	guchar pair[rspamd_cryptobox_HASHBYTES * 2];
+	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
+	guint32 last_used; /* 0 for an empty element */
+};
+
+struct rspamd_keypair_shared_shard {
+	rspamd_mempool_mutex_t *lock;
+	struct rspamd_keypair_shared_elt *elts;
+	guint64 hits;
+	guint64 misses;
+};
+
+/*
+ * Set associative table in shared memory, each shard has its own lock, so
+ * concurrent workers are blocked only when they hit the same shard
+ */
+struct rspamd_keypair_shared_cache {
+	guint nshards;
+	guint nbuckets; /* In each shard */
+	struct rspamd_keypair_shared_shard shards[];
+};
+
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	struct rspamd_keypair_shared_cache *shared;
+	guint64 hits;
+	guint64 shared_hits;
+	guint64 misses;
 };
 
 static void
@@ -69,10 +100,141 @@ rspamd_keypair_cache_new (guint max_items)
 	return c;
 }
 
+struct rspamd_keypair_shared_cache *
+rspamd_keypair_shared_cache_new (rspamd_mempool_t *pool, guint max_items,
+		guint nshards)
+{
+	struct rspamd_keypair_shared_cache *sc;
+	guint i, nbuckets;
+
+	g_assert (max_items > 0);
+	g_assert (nshards > 0);
+
+	nbuckets = max_items / (nshards * RSPAMD_KEYPAIR_SHARED_WAYS);
+
+	if (nbuckets == 0) {
+		nbuckets = 1;
+	}
+
+	sc = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*sc) + sizeof (sc->shards[0]) * nshards);
+	sc->nshards = nshards;
+	sc->nbuckets = nbuckets;
+
+	for (i = 0; i < nshards; i ++) {
+		sc->shards[i].lock = rspamd_mempool_get_mutex (pool);
+		sc->shards[i].elts = rspamd_mempool_alloc0_shared (pool,
+				sizeof (struct rspamd_keypair_shared_elt) *
+				nbuckets * RSPAMD_KEYPAIR_SHARED_WAYS);
+	}
+
+	return sc;
+}
+
 void
-rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
+rspamd_keypair_cache_set_shared (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_shared_cache *sc)
+{
+	g_assert (c != NULL);
+
+	c->shared = sc;
+}
+
+static struct rspamd_keypair_shared_elt *
+rspamd_keypair_shared_bucket (struct rspamd_keypair_shared_cache *sc,
+		const guchar *pair, struct rspamd_keypair_shared_shard **pshard)
+{
+	guint64 h1, h2;
+	struct rspamd_keypair_shared_shard *shard;
+
+	/* Key ids are hashes of public keys, so they are used directly */
+	memcpy (&h1, pair, sizeof (h1));
+	memcpy (&h2, pair + rspamd_cryptobox_HASHBYTES, sizeof (h2));
+	h1 ^= h2;
+
+	shard = &sc->shards[h1 % sc->nshards];
+	*pshard = shard;
+
+	return &shard->elts[((h1 >> 32) % sc->nbuckets) *
+			RSPAMD_KEYPAIR_SHARED_WAYS];
+}
+
+static gboolean
+rspamd_keypair_shared_lookup (struct rspamd_keypair_shared_cache *sc,
+		const guchar *pair, guchar *nm)
+{
+	struct rspamd_keypair_shared_shard *shard;
+	struct rspamd_keypair_shared_elt *bucket;
+	gboolean found = FALSE;
+	guint i;
+
+	bucket = rspamd_keypair_shared_bucket (sc, pair, &shard);
+	rspamd_mempool_lock_mutex (shard->lock);
+
+	for (i = 0; i < RSPAMD_KEYPAIR_SHARED_WAYS; i ++) {
+		if (bucket[i].last_used != 0 &&
+				memcmp (bucket[i].pair, pair, sizeof (bucket[i].pair)) == 0) {
+			memcpy (nm, bucket[i].nm, sizeof (bucket[i].nm));
+			bucket[i].last_used = time (NULL);
+			found = TRUE;
+			break;
+		}
+	}
+
+	if (found) {
+		shard->hits ++;
+	}
+	else {
+		shard->misses ++;
+	}
+
+	rspamd_mempool_unlock_mutex (shard->lock);
+
+	return found;
+}
+
+static void
+rspamd_keypair_shared_insert (struct rspamd_keypair_shared_cache *sc,
+		const guchar *pair, const guchar *nm)
+{
+	struct rspamd_keypair_shared_shard *shard;
+	struct rspamd_keypair_shared_elt *bucket, *victim;
+	guint i;
+
+	bucket = rspamd_keypair_shared_bucket (sc, pair, &shard);
+	rspamd_mempool_lock_mutex (shard->lock);
+	victim = &bucket[0];
+
+	/* Replace the least recently used element of the bucket */
+	for (i = 0; i < RSPAMD_KEYPAIR_SHARED_WAYS; i ++) {
+		if (bucket[i].last_used == 0 ||
+				memcmp (bucket[i].pair, pair, sizeof (bucket[i].pair)) == 0) {
+			victim = &bucket[i];
+			break;
+		}
+
+		if (bucket[i].last_used < victim->last_used) {
+			victim = &bucket[i];
+		}
+	}
+
+	memcpy (victim->pair, pair, sizeof (victim->pair));
+	memcpy (victim->nm, nm, sizeof (victim->nm));
+	victim->last_used = time (NULL);
+
+	rspamd_mempool_unlock_mutex (shard->lock);
+}
+
+/*
+ * Finds the element for a pair of keys in the local or the shared cache,
+ * otherwise allocates *pelt which nm must be computed and then inserted by
+ * rspamd_keypair_cache_insert
+ */
+static gboolean
+rspamd_keypair_cache_lookup (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
-		struct rspamd_cryptobox_pubkey *rk)
+		struct rspamd_cryptobox_pubkey *rk,
+		struct rspamd_keypair_elt **pelt)
 {
 	struct rspamd_keypair_elt search, *new;
 
@@ -93,38 +255,79 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		rk->nm = NULL;
 	}
 
-	if (new == NULL) {
-		new = g_malloc0 (sizeof (*new));
-
-		if (posix_memalign ((void **)&new->nm, 32, sizeof (*new->nm)) != 0) {
-			abort ();
-		}
+	if (new != NULL) {
+		c->hits ++;
+		*pelt = new;
 
-		REF_INIT_RETAIN (new->nm, rspamd_cryptobox_nm_dtor);
+		return TRUE;
+	}
 
-		memcpy (new->pair, rk->id, rspamd_cryptobox_HASHBYTES);
-		memcpy (&new->pair[rspamd_cryptobox_HASHBYTES], lk->id,
-				rspamd_cryptobox_HASHBYTES);
-		memcpy (&new->nm->sk_id, lk->id, sizeof (guint64));
+	new = g_malloc0 (sizeof (*new));
 
-		if (rk->alg == RSPAMD_CRYPTOBOX_MODE_25519) {
-			struct rspamd_cryptobox_pubkey_25519 *rk_25519 =
-					RSPAMD_CRYPTOBOX_PUBKEY_25519(rk);
-			struct rspamd_cryptobox_keypair_25519 *sk_25519 =
-					RSPAMD_CRYPTOBOX_KEYPAIR_25519(lk);
+	if (posix_memalign ((void **)&new->nm, 32, sizeof (*new->nm)) != 0) {
+		abort ();
+	}
 
-			rspamd_cryptobox_nm (new->nm->nm, rk_25519->pk, sk_25519->sk, rk->alg);
-		}
-		else {
-			struct rspamd_cryptobox_pubkey_nist *rk_nist =
-					RSPAMD_CRYPTOBOX_PUBKEY_NIST(rk);
-			struct rspamd_cryptobox_keypair_nist *sk_nist =
-					RSPAMD_CRYPTOBOX_KEYPAIR_NIST(lk);
+	REF_INIT_RETAIN (new->nm, rspamd_cryptobox_nm_dtor);
 
-			rspamd_cryptobox_nm (new->nm->nm, rk_nist->pk, sk_nist->sk, rk->alg);
-		}
+	memcpy (new->pair, rk->id, rspamd_cryptobox_HASHBYTES);
+	memcpy (&new->pair[rspamd_cryptobox_HASHBYTES], lk->id,
+			rspamd_cryptobox_HASHBYTES);
+	memcpy (&new->nm->sk_id, lk->id, sizeof (guint64));
+	*pelt = new;
 
+	if (c->shared && rspamd_keypair_shared_lookup (c->shared, new->pair,
+			new->nm->nm)) {
+		/* Computed by another process */
+		c->shared_hits ++;
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_keypair_cache_insert (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_elt *new)
+{
+	c->misses ++;
+
+	if (c->shared) {
+		rspamd_keypair_shared_insert (c->shared, new->pair, new->nm->nm);
+	}
+
+	rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
+}
+
+static void
+rspamd_keypair_cache_get_keys (struct rspamd_cryptobox_keypair *lk,
+		struct rspamd_cryptobox_pubkey *rk,
+		const guchar **pk, const guchar **sk)
+{
+	if (rk->alg == RSPAMD_CRYPTOBOX_MODE_25519) {
+		*pk = RSPAMD_CRYPTOBOX_PUBKEY_25519(rk)->pk;
+		*sk = RSPAMD_CRYPTOBOX_KEYPAIR_25519(lk)->sk;
+	}
+	else {
+		*pk = RSPAMD_CRYPTOBOX_PUBKEY_NIST(rk)->pk;
+		*sk = RSPAMD_CRYPTOBOX_KEYPAIR_NIST(lk)->sk;
+	}
+}
+
+void
+rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
+		struct rspamd_cryptobox_keypair *lk,
+		struct rspamd_cryptobox_pubkey *rk)
+{
+	struct rspamd_keypair_elt *new;
+	const guchar *pk, *sk;
+
+	if (!rspamd_keypair_cache_lookup (c, lk, rk, &new)) {
+		rspamd_keypair_cache_get_keys (lk, rk, &pk, &sk);
+		rspamd_cryptobox_nm (new->nm->nm, pk, sk, rk->alg);
+		rspamd_keypair_cache_insert (c, new);
 	}
 
 	g_assert (new != NULL);
@@ -133,6 +336,127 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	REF_RETAIN (rk->nm);
 }
 
+void
+rspamd_keypair_cache_process_batch (struct rspamd_keypair_cache *c,
+		struct rspamd_cryptobox_keypair **lks,
+		struct rspamd_cryptobox_pubkey **rks,
+		guint n)
+{
+	struct rspamd_keypair_elt *new, **missed;
+	guchar **nms;
+	const guchar **pks, **sks;
+	guint i, nmissed = 0;
+
+	missed = g_alloca (sizeof (*missed) * n);
+	nms = g_alloca (sizeof (*nms) * n);
+	pks = g_alloca (sizeof (*pks) * n);
+	sks = g_alloca (sizeof (*sks) * n);
+
+	for (i = 0; i < n; i ++) {
+		if (!rspamd_keypair_cache_lookup (c, lks[i], rks[i], &new)) {
+			if (rks[i]->alg != RSPAMD_CRYPTOBOX_MODE_25519) {
+				/* Nothing to batch for nistp256 */
+				rspamd_keypair_cache_get_keys (lks[i], rks[i], &pks[0], &sks[0]);
+				rspamd_cryptobox_nm (new->nm->nm, pks[0], sks[0], rks[i]->alg);
+				rspamd_keypair_cache_insert (c, new);
+			}
+			else {
+				/* Duplicates are inserted after computation, so skip them */
+				guint j;
+
+				for (j = 0; j < nmissed; j ++) {
+					if (memcmp (missed[j]->pair, new->pair,
+							sizeof (new->pair)) == 0) {
+						break;
+					}
+				}
+
+				if (j < nmissed) {
+					rspamd_keypair_destroy (new);
+					new = missed[j];
+				}
+				else {
+					missed[nmissed] = new;
+					nms[nmissed] = new->nm->nm;
+					rspamd_keypair_cache_get_keys (lks[i], rks[i],
+							&pks[nmissed], &sks[nmissed]);
+					nmissed ++;
+				}
+			}
+		}
+
+		/* nm of missed elements is filled below */
+		rks[i]->nm = new->nm;
+		REF_RETAIN (rks[i]->nm);
+	}
+
+	if (nmissed > 0) {
+		rspamd_cryptobox_nm_batch (nms, pks, sks, nmissed,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+
+		for (i = 0; i < nmissed; i ++) {
+			rspamd_keypair_cache_insert (c, missed[i]);
+		}
+	}
+}
+
+void
+rspamd_keypair_cache_stat (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_cache_stat *st)
+{
+	guint i;
+
+	g_assert (c != NULL);
+	g_assert (st != NULL);
+
+	memset (st, 0, sizeof (*st));
+	st->hits = c->hits;
+	st->shared_hits = c->shared_hits;
+	st->misses = c->misses;
+	st->size = rspamd_lru_hash_size (c->hash);
+	st->capacity = rspamd_lru_hash_capacity (c->hash);
+
+	if (c->shared) {
+		/* Counters of all processes, read with no lock as it is just stats */
+		for (i = 0; i < c->shared->nshards; i ++) {
+			st->shared_total_hits += c->shared->shards[i].hits;
+			st->shared_total_misses += c->shared->shards[i].misses;
+		}
+
+		st->shared_capacity = c->shared->nshards * c->shared->nbuckets *
+				RSPAMD_KEYPAIR_SHARED_WAYS;
+	}
+}
+
+ucl_object_t *
+rspamd_keypair_cache_stat_to_ucl (struct rspamd_keypair_cache *c)
+{
+	struct rspamd_keypair_cache_stat st;
+	ucl_object_t *obj;
+
+	rspamd_keypair_cache_stat (c, &st);
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	ucl_object_insert_key (obj, ucl_object_fromint (st.hits), "hits", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st.misses), "misses", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st.size), "size", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st.capacity), "capacity",
+			0, false);
+
+	if (st.shared_capacity > 0) {
+		ucl_object_insert_key (obj, ucl_object_fromint (st.shared_hits),
+				"shared_hits", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.shared_total_hits),
+				"shared_total_hits", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.shared_total_misses),
+				"shared_total_misses", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.shared_capacity),
+				"shared_capacity", 0, false);
+	}
+
+	return obj;
+}
+
 void
 rspamd_keypair_cache_destroy (struct rspamd_keypair_cache *c)
 {
@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "keypair.h"
+#include "libutil/mem_pool.h"
 
 
 #ifdef  __cplusplus
@@ -25,6 +26,21 @@ extern "C" {
 #endif
 
 struct rspamd_keypair_cache;
+struct rspamd_keypair_shared_cache;
+
+/* Default number of shards for the shared cache */
+#define RSPAMD_KEYPAIR_SHARED_SHARDS 16
+
+struct rspamd_keypair_cache_stat {
+	guint64 hits; /**< found in the local cache */
+	guint64 shared_hits; /**< found in the shared cache */
+	guint64 misses; /**< shared key has been computed */
+	guint64 shared_total_hits; /**< shared cache hits of all processes */
+	guint64 shared_total_misses; /**< shared cache misses of all processes */
+	guint size;
+	guint capacity;
+	guint shared_capacity;
+};
 
 /**
  * Create new keypair cache of the specified size
@@ -33,6 +49,25 @@ struct rspamd_keypair_cache;
  */
 struct rspamd_keypair_cache *rspamd_keypair_cache_new (guint max_items);
 
+/**
+ * Create cache of shared keys in the shared memory of the pool, it must be
+ * created before forking of the processes that use it
+ * @param pool memory pool
+ * @param max_items maximum count of elements in all shards
+ * @param nshards number of independently locked shards
+ * @return new shared cache
+ */
+struct rspamd_keypair_shared_cache *rspamd_keypair_shared_cache_new (
+		rspamd_mempool_t *pool, guint max_items, guint nshards);
+
+/**
+ * Use shared cache when a key is not found in the local cache
+ * @param c cache of keypairs
+ * @param sc shared cache
+ */
+void rspamd_keypair_cache_set_shared (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_shared_cache *sc);
+
 
 /**
  * Process local and remote keypair setting beforenm value as appropriate
@@ -44,6 +79,34 @@ void rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 								   struct rspamd_cryptobox_keypair *lk,
 								   struct rspamd_cryptobox_pubkey *rk);
 
+/**
+ * Process n pairs of keys at once, shared keys missing in both local and
+ * shared caches are computed by a single batch
+ * @param c cache of keypairs
+ * @param lks local keys
+ * @param rks remote keys
+ * @param n number of pairs
+ */
+void rspamd_keypair_cache_process_batch (struct rspamd_keypair_cache *c,
+										 struct rspamd_cryptobox_keypair **lks,
+										 struct rspamd_cryptobox_pubkey **rks,
+										 guint n);
+
+/**
+ * Get statistics of the cache
+ * @param c cache of keypairs
+ * @param st output statistics
+ */
+void rspamd_keypair_cache_stat (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_cache_stat *st);
+
+/**
+ * Get statistics of the cache as UCL object
+ * @param c cache of keypairs
+ * @return new UCL object
+ */
+ucl_object_t *rspamd_keypair_cache_stat_to_ucl (struct rspamd_keypair_cache *c);
+
 /**
  * Destroy old keypair cache
  * @param c cache object
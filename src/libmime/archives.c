@@ -19,10 +19,12 @@
 #include "task.h"
 #include "archives.h"
 #include "libmime/mime_encoding.h"
+#include "libserver/cfg_file.h"
 #include <unicode/uchar.h>
 #include <unicode/utf8.h>
 #include <unicode/utf16.h>
 #include <unicode/ucnv.h>
+#include <zlib.h>
 
 #define msg_debug_archive(...)  rspamd_conditional_debug_fast (NULL, NULL, \
         rspamd_archive_log_id, "archive", task->task_pool->tag.uid, \
@@ -130,22 +132,131 @@ rspamd_archive_file_try_utf (struct rspamd_task *task,
 	return res;
 }
 
-static void
-rspamd_archive_process_zip (struct rspamd_task *task,
-		struct rspamd_mime_part *part)
+/*
+ * Extracts a stored or deflated file from zip archive using its central
+ * directory record, returns NULL if the file cannot be extracted within
+ * the budget
+ */
+static guchar *
+rspamd_archive_zip_extract (struct rspamd_task *task,
+		const guchar *start, gsize len, const guchar *cd,
+		gsize *budget, gsize *outlen)
+{
+	const guchar lh_magic[] = {0x50, 0x4b, 0x03, 0x04};
+	const guint32 lh_basic_len = 30;
+	guint16 method, lh_fname_len, lh_extra_len;
+	guint32 lh_offset, comp_size, uncomp_size;
+	const guchar *data;
+	guchar *out;
+	z_stream strm;
+	gint rc;
+
+	memcpy (&method, cd + 10, sizeof (method));
+	method = GUINT16_FROM_LE (method);
+	memcpy (&comp_size, cd + 20, sizeof (comp_size));
+	comp_size = GUINT32_FROM_LE (comp_size);
+	memcpy (&uncomp_size, cd + 24, sizeof (uncomp_size));
+	uncomp_size = GUINT32_FROM_LE (uncomp_size);
+	memcpy (&lh_offset, cd + 42, sizeof (lh_offset));
+	lh_offset = GUINT32_FROM_LE (lh_offset);
+
+	if (uncomp_size == 0 || uncomp_size > *budget) {
+		return NULL;
+	}
+
+	if ((gsize)lh_offset + lh_basic_len > len ||
+			memcmp (start + lh_offset, lh_magic, sizeof (lh_magic)) != 0) {
+		msg_debug_archive ("cannot extract nested archive: bad local header");
+
+		return NULL;
+	}
+
+	memcpy (&lh_fname_len, start + lh_offset + 26, sizeof (lh_fname_len));
+	lh_fname_len = GUINT16_FROM_LE (lh_fname_len);
+	memcpy (&lh_extra_len, start + lh_offset + 28, sizeof (lh_extra_len));
+	lh_extra_len = GUINT16_FROM_LE (lh_extra_len);
+
+	if ((gsize)lh_offset + lh_basic_len + lh_fname_len + lh_extra_len +
+			comp_size > len) {
+		msg_debug_archive ("cannot extract nested archive: bad compressed size");
+
+		return NULL;
+	}
+
+	data = start + lh_offset + lh_basic_len + lh_fname_len + lh_extra_len;
+
+	if (method == 0) {
+		/* Stored */
+		if (comp_size != uncomp_size) {
+			return NULL;
+		}
+
+		out = g_malloc (uncomp_size);
+		memcpy (out, data, uncomp_size);
+		*outlen = uncomp_size;
+	}
+	else if (method == 8) {
+		/* Deflate, output is limited by the declared size */
+		memset (&strm, 0, sizeof (strm));
+
+		if (inflateInit2 (&strm, -MAX_WBITS) != Z_OK) {
+			return NULL;
+		}
+
+		out = g_malloc (uncomp_size);
+		strm.next_in = (Bytef *)data;
+		strm.avail_in = comp_size;
+		strm.next_out = out;
+		strm.avail_out = uncomp_size;
+		rc = inflate (&strm, Z_FINISH);
+		*outlen = strm.total_out;
+		inflateEnd (&strm);
+
+		if (rc != Z_STREAM_END) {
+			msg_debug_archive ("cannot extract nested archive: inflate error %d",
+					rc);
+			g_free (out);
+
+			return NULL;
+		}
+	}
+	else {
+		return NULL;
+	}
+
+	*budget -= uncomp_size;
+
+	return out;
+}
+
+/*
+ * Reads files from zip central directory, if budget is not NULL then
+ * nested zip archives are extracted and their files are added to the same
+ * archive (with the name of nested archive as prefix)
+ */
+static gboolean
+rspamd_archive_zip_parse (struct rspamd_task *task,
+		const guchar *start, gsize len,
+		struct rspamd_archive *arch,
+		const GString *prefix,
+		gsize *budget)
 {
-	const guchar *p, *start, *end, *eocd = NULL, *cd;
+	const guchar *p, *end, *eocd = NULL, *cd;
 	const guint32 eocd_magic = 0x06054b50, cd_basic_len = 46;
 	const guchar cd_magic[] = {0x50, 0x4b, 0x01, 0x02};
 	const guint max_processed = 1024;
 	guint32 cd_offset, cd_size, comp_size, uncomp_size, processed = 0;
 	guint16 extra_len, fname_len, comment_len;
-	struct rspamd_archive *arch;
 	struct rspamd_archive_file *f;
 
+	if (len < 22) {
+		msg_info_task ("zip archive is invalid (too short)");
+
+		return FALSE;
+	}
+
 	/* Zip files have interesting data at the end of archive */
-	p = part->parsed_data.begin + part->parsed_data.len - 1;
-	start = part->parsed_data.begin;
+	p = start + len - 1;
 	end = p;
 
 	/* Search for EOCD:
@@ -178,13 +289,13 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		/* Not a zip file */
 		msg_info_task ("zip archive is invalid (no EOCD)");
 
-		return;
+		return FALSE;
 	}
 
 	if (end - eocd < 21) {
 		msg_info_task ("zip archive is invalid (short EOCD)");
 
-		return;
+		return FALSE;
 	}
 
 
@@ -197,17 +308,11 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 	if (cd_offset + cd_size > (guint)(eocd - start)) {
 		msg_info_task ("zip archive is invalid (bad size/offset for CD)");
 
-		return;
+		return FALSE;
 	}
 
 	cd = start + cd_offset;
 
-	arch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*arch));
-	arch->files = g_ptr_array_new ();
-	arch->type = RSPAMD_ARCHIVE_ZIP;
-	rspamd_mempool_add_destructor (task->task_pool, rspamd_archive_dtor,
-			arch);
-
 	while (cd < start + cd_offset + cd_size) {
 		guint16 flags;
 
@@ -216,7 +321,7 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 				memcmp (cd, cd_magic, sizeof (cd_magic)) != 0) {
 			msg_info_task ("zip archive is invalid (bad cd record)");
 
-			return;
+			return FALSE;
 		}
 
 		memcpy (&flags, cd + 8, sizeof (guint16));
@@ -235,7 +340,7 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		if (cd + fname_len + comment_len + extra_len + cd_basic_len > eocd) {
 			msg_info_task ("zip archive is invalid (too large cd record)");
 
-			return;
+			return FALSE;
 		}
 
 		f = g_malloc0 (sizeof (*f));
@@ -249,11 +354,18 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		}
 
 		if (f->fname) {
+			if (prefix) {
+				g_string_prepend_c (f->fname, '/');
+				g_string_prepend_len (f->fname, prefix->str, prefix->len);
+				f->flags |= RSPAMD_ARCHIVE_FILE_NESTED;
+			}
+
 			g_ptr_array_add (arch->files, f);
 			msg_debug_archive ("found file in zip archive: %v", f->fname);
 		}
 		else {
 			g_free (f);
+			f = NULL;
 		}
 
 		/* Process extra fields */
@@ -268,16 +380,61 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 			memcpy (&hlen, p + sizeof (guint16), sizeof (guint16));
 			hlen = GUINT16_FROM_LE (hlen);
 
-			if (hid == 0x0017) {
+			if (hid == 0x0017 && f) {
 				f->flags |= RSPAMD_ARCHIVE_FILE_ENCRYPTED;
 			}
 
 			p += hlen + sizeof (guint16) * 2;
 		}
 
+		if (budget && *budget > 0 && f &&
+				!(f->flags & RSPAMD_ARCHIVE_FILE_ENCRYPTED) &&
+				f->fname->len > sizeof (".zip") - 1 &&
+				rspamd_lc_cmp (f->fname->str + f->fname->len -
+						(sizeof (".zip") - 1), ".zip", sizeof (".zip") - 1) == 0) {
+			guchar *nested;
+			gsize nested_len;
+
+			nested = rspamd_archive_zip_extract (task, start, len, cd,
+					budget, &nested_len);
+
+			if (nested) {
+				msg_debug_archive ("process nested zip archive %v", f->fname);
+				/* Only one level of nesting */
+				rspamd_archive_zip_parse (task, nested, nested_len, arch,
+						f->fname, NULL);
+				g_free (nested);
+			}
+		}
+
 		cd += fname_len + comment_len + extra_len + cd_basic_len;
 	}
 
+	return TRUE;
+}
+
+static void
+rspamd_archive_process_zip (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	struct rspamd_archive *arch;
+	gsize budget = 0;
+
+	arch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*arch));
+	arch->files = g_ptr_array_new ();
+	arch->type = RSPAMD_ARCHIVE_ZIP;
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_archive_dtor,
+			arch);
+
+	if (task->cfg) {
+		budget = task->cfg->archive_nested_limit;
+	}
+
+	if (!rspamd_archive_zip_parse (task, part->parsed_data.begin,
+			part->parsed_data.len, arch, NULL, budget > 0 ? &budget : NULL)) {
+		return;
+	}
+
 	part->part_type = RSPAMD_MIME_PART_ARCHIVE;
 	part->specific.arch = arch;
 
@@ -36,6 +36,7 @@ enum rspamd_archive_flags {
 
 enum rspamd_archive_file_flags {
 	RSPAMD_ARCHIVE_FILE_ENCRYPTED = (1u << 0u),
+	RSPAMD_ARCHIVE_FILE_NESTED = (1u << 1u), /* File is inside of a nested archive */
 };
 
 struct rspamd_archive_file {
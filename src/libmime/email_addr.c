@@ -280,6 +280,12 @@ rspamd_email_address_from_mime (rspamd_mempool_t *pool, const gchar *hdr,
 	obraces = 0;
 	ebraces = 0;
 
+	if (memchr (hdr, '(', len) == NULL) {
+		/* No comments, so the loop below would copy header as is */
+		g_string_append_len (cpy, hdr, len);
+		p = end;
+	}
+
 	while (p < end) {
 		if (state == parse_name) {
 			if (*p == '\\') {
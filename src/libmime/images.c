@@ -388,6 +388,71 @@ rspamd_image_dct_equal (gconstpointer a, gconstpointer b)
 	return memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0;
 }
 
+/*
+ * Cache shared by all workers: direct mapped table, where each entry is
+ * protected by a sequence counter (odd while an entry is being written)
+ */
+struct rspamd_image_shared_entry {
+	guint32 seq;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	guchar dct[RSPAMD_DCT_LEN / NBBY];
+};
+
+static struct rspamd_image_shared_entry *images_shared = NULL;
+static guint images_shared_size = 0;
+
+static inline struct rspamd_image_shared_entry *
+rspamd_image_shared_entry (const guchar *digest)
+{
+	guint64 h;
+
+	/* Digest is a cryptographic hash, so its prefix is good enough */
+	memcpy (&h, digest, sizeof (h));
+
+	return &images_shared[h % images_shared_size];
+}
+
+static gboolean
+rspamd_image_shared_lookup (const guchar *digest, guchar *dct)
+{
+	struct rspamd_image_shared_entry *entry;
+	guint32 seq;
+
+	entry = rspamd_image_shared_entry (digest);
+	seq = __atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE);
+
+	if (seq == 0 || (seq & 1) ||
+			memcmp (entry->digest, digest, sizeof (entry->digest)) != 0) {
+		return FALSE;
+	}
+
+	memcpy (dct, entry->dct, sizeof (entry->dct));
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	/* Entry has not been overwritten while we were copying it */
+	return __atomic_load_n (&entry->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static void
+rspamd_image_shared_insert (const guchar *digest, const guchar *dct)
+{
+	struct rspamd_image_shared_entry *entry;
+	guint32 seq;
+
+	entry = rspamd_image_shared_entry (digest);
+	seq = __atomic_load_n (&entry->seq, __ATOMIC_RELAXED);
+
+	if ((seq & 1) || !__atomic_compare_exchange_n (&entry->seq, &seq, seq + 1,
+			FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		/* Somebody else is writing this entry */
+		return;
+	}
+
+	memcpy (entry->digest, digest, sizeof (entry->digest));
+	memcpy (entry->dct, dct, sizeof (entry->dct));
+	__atomic_store_n (&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 static void
 rspamd_image_create_cache (struct rspamd_config *cfg)
 {
@@ -401,6 +466,22 @@ rspamd_image_check_hash (struct rspamd_task *task, struct rspamd_image *img)
 {
 	struct rspamd_image_cache_entry *found;
 
+	if (images_shared) {
+		guchar dct[RSPAMD_DCT_LEN / NBBY];
+
+		if (rspamd_image_shared_lookup (img->parent->digest, dct)) {
+			img->dct = g_malloc (RSPAMD_DCT_LEN / NBBY);
+			rspamd_mempool_add_destructor (task->task_pool, g_free,
+					img->dct);
+			memcpy (img->dct, dct, RSPAMD_DCT_LEN / NBBY);
+			img->is_normalized = TRUE;
+
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
 	if (images_hash == NULL) {
 		rspamd_image_create_cache (task->cfg);
 	}
@@ -428,7 +509,10 @@ rspamd_image_save_hash (struct rspamd_task *task, struct rspamd_image *img)
 {
 	struct rspamd_image_cache_entry *found;
 
-	if (img->is_normalized) {
+	if (img->is_normalized && images_shared) {
+		rspamd_image_shared_insert (img->parent->digest, img->dct);
+	}
+	else if (img->is_normalized) {
 		found = rspamd_lru_hash_lookup (images_hash, img->parent->digest,
 				task->tv.tv_sec);
 
@@ -445,6 +529,21 @@ rspamd_image_save_hash (struct rspamd_task *task, struct rspamd_image *img)
 
 #endif
 
+void
+rspamd_images_shared_cache_init (struct rspamd_config *cfg)
+{
+#ifdef USABLE_GD
+	if (cfg->images_cache_size > 0) {
+		images_shared_size = cfg->images_cache_size;
+		images_shared = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+				sizeof (*images_shared) * images_shared_size);
+	}
+	else {
+		images_shared = NULL;
+	}
+#endif
+}
+
 void
 rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img)
 {
@@ -10,6 +10,7 @@ extern "C" {
 
 struct html_image;
 struct rspamd_task;
+struct rspamd_config;
 struct rspamd_mime_part;
 
 #define RSPAMD_DCT_LEN (64 * 64)
@@ -48,6 +49,11 @@ void rspamd_images_process (struct rspamd_task *task);
 bool rspamd_images_process_mime_part_maybe (struct rspamd_task *task,
 		struct rspamd_mime_part *part);
 
+/*
+ * Create DCT cache shared by all workers (must be called before fork)
+ */
+void rspamd_images_shared_cache_init (struct rspamd_config *cfg);
+
 /*
  * Link embedded images to the HTML parts
  */
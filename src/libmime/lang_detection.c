@@ -18,6 +18,7 @@
 #include "libserver/logger.h"
 #include "libcryptobox/cryptobox.h"
 #include "libutil/multipattern.h"
+#include "libutil/hash.h"
 #include "ucl.h"
 #include "khash.h"
 #include "libstemmer.h"
@@ -32,6 +33,11 @@
 
 static const gsize default_short_text_limit = 10;
 static const gsize default_words = 80;
+static const guint default_cache_size = 1024;
+static const gdouble default_early_exit_ratio = 8.0;
+/* Words to check before the early exit is considered and the step after */
+static const guint early_exit_words = 20;
+static const guint early_exit_step = 10;
 static const gdouble update_prob = 0.6;
 static const gchar *default_languages_path = RSPAMD_SHAREDIR "/languages";
 
@@ -87,6 +93,7 @@ struct rspamd_language_elt {
 	gdouble mean;
 	gdouble std;
 	guint occurencies; /* total number of parts with this language */
+	guint id; /* index in detector's languages */
 };
 
 struct rspamd_ngramm_elt {
@@ -101,6 +108,37 @@ struct rspamd_ngramm_chain {
 	gchar *utf;
 };
 
+/*
+ * Compact trigramms model of a category that is built from chains once all
+ * languages are loaded: an open addressing table with inline keys, each slot
+ * refers to a run of language ids and probabilities in flat arrays
+ */
+struct rspamd_trigram_model_slot {
+	UChar32 gram[3];
+	guint32 off;
+	guint32 nlangs; /* zero for an empty slot */
+};
+
+struct rspamd_trigram_model {
+	struct rspamd_trigram_model_slot *slots;
+	guint16 *ids;
+	gfloat *probs;
+	guint32 mask;
+};
+
+/*
+ * Result of detection for some text part, so the same texts, e.g. in
+ * campaigns, are not detected again by the same worker
+ */
+struct rspamd_lang_detector_cache_elt {
+	gsize len;
+	guint unicode_scripts;
+	gboolean ret;
+	gboolean counted; /* the first language's occurencies have been updated */
+	guint nlangs;
+	struct rspamd_lang_detector_res langs[];
+};
+
 struct rspamd_stop_word_range {
 	guint start;
 	guint stop;
@@ -175,11 +213,15 @@ KHASH_INIT (rspamd_stopwords_hash, rspamd_ftok_t *,
 
 struct rspamd_lang_detector {
 	GPtrArray *languages;
-	khash_t(rspamd_trigram_hash) *trigramms[RSPAMD_LANGUAGE_MAX]; /* trigramms frequencies */
+	khash_t(rspamd_trigram_hash) *trigramms[RSPAMD_LANGUAGE_MAX]; /* trigramms frequencies, used on load only */
+	struct rspamd_trigram_model models[RSPAMD_LANGUAGE_MAX];
 	struct rspamd_stop_word_elt stop_words[RSPAMD_LANGUAGE_MAX];
 	khash_t(rspamd_stopwords_hash) *stop_words_norm;
 	UConverter *uchar_converter;
 	gsize short_text_limit;
+	gdouble early_exit_ratio; /* stop trigramms scoring if the best is that much better */
+	guint cache_size;
+	rspamd_lru_hash_t *cache; /* digest of a text part -> rspamd_lang_detector_cache_elt */
 	gsize total_occurencies; /* number of all languages found */
 	ref_entry_t ref;
 };
@@ -751,12 +793,111 @@ rspamd_language_detector_process_chain (struct rspamd_config *cfg,
 	}
 }
 
+static void
+rspamd_language_detector_build_model (struct rspamd_config *cfg,
+		khash_t(rspamd_trigram_hash) *htb,
+		struct rspamd_trigram_model *m)
+{
+	struct rspamd_ngramm_chain *chain;
+	struct rspamd_ngramm_elt *elt;
+	struct rspamd_trigram_model_slot *slot;
+	const UChar32 *gram;
+	guint32 nslots = 16, pos, off = 0, nelts = 0, i;
+
+	kh_foreach_value_ptr (htb, chain, {
+		nelts += chain->languages->len;
+	});
+
+	/* Load factor is at most 0.5, so there is always an empty slot */
+	while (nslots < kh_size (htb) * 2) {
+		nslots <<= 1;
+	}
+
+	m->slots = g_malloc0 (sizeof (*m->slots) * nslots);
+	m->ids = g_malloc (sizeof (*m->ids) * MAX (nelts, 1));
+	m->probs = g_malloc (sizeof (*m->probs) * MAX (nelts, 1));
+	m->mask = nslots - 1;
+
+	for (khiter_t k = kh_begin (htb); k != kh_end (htb); k ++) {
+		guint32 nlangs = 0;
+
+		if (!kh_exist (htb, k)) {
+			continue;
+		}
+
+		gram = kh_key (htb, k);
+		chain = &kh_value (htb, k);
+
+		/* Keep the order of chain, so sums are the same as before */
+		PTR_ARRAY_FOREACH (chain->languages, i, elt) {
+			if (elt->prob < chain->mean) {
+				continue;
+			}
+
+			m->ids[off + nlangs] = elt->elt->id;
+			m->probs[off + nlangs] = elt->prob;
+			nlangs ++;
+		}
+
+		if (nlangs == 0) {
+			continue;
+		}
+
+		pos = rspamd_trigram_hash_func (gram) & m->mask;
+
+		while (m->slots[pos].nlangs != 0) {
+			pos = (pos + 1) & m->mask;
+		}
+
+		slot = &m->slots[pos];
+		memcpy (slot->gram, gram, sizeof (slot->gram));
+		slot->off = off;
+		slot->nlangs = nlangs;
+		off += nlangs;
+	}
+
+	msg_debug_config ("built trigramms model: %ud slots, %ud languages refs",
+			nslots, off);
+}
+
+static inline const struct rspamd_trigram_model_slot *
+rspamd_language_detector_model_lookup (const struct rspamd_trigram_model *m,
+		const UChar32 *gram)
+{
+	const struct rspamd_trigram_model_slot *slot;
+	guint32 pos;
+
+	if (m->slots == NULL) {
+		return NULL;
+	}
+
+	pos = rspamd_trigram_hash_func (gram) & m->mask;
+
+	for (;;) {
+		slot = &m->slots[pos];
+
+		if (slot->nlangs == 0) {
+			return NULL;
+		}
+
+		if (slot->gram[0] == gram[0] && slot->gram[1] == gram[1] &&
+				slot->gram[2] == gram[2]) {
+			return slot;
+		}
+
+		pos = (pos + 1) & m->mask;
+	}
+}
+
 static void
 rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 {
 	if (d) {
 		for (guint i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 			kh_destroy (rspamd_trigram_hash, d->trigramms[i]);
+			g_free (d->models[i].slots);
+			g_free (d->models[i].ids);
+			g_free (d->models[i].probs);
 			rspamd_multipattern_destroy (d->stop_words[i].mp);
 			g_array_free (d->stop_words[i].ranges, TRUE);
 		}
@@ -766,6 +907,10 @@ rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 		}
 
 		kh_destroy (rspamd_stopwords_hash, d->stop_words_norm);
+
+		if (d->cache) {
+			rspamd_lru_hash_destroy (d->cache);
+		}
 	}
 }
 
@@ -776,7 +921,9 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			*languages_disable = NULL;
 	const gchar *languages_path = default_languages_path;
 	glob_t gl;
-	size_t i, short_text_limit = default_short_text_limit, total = 0;
+	size_t i, short_text_limit = default_short_text_limit, total = 0,
+			cache_size = default_cache_size;
+	gdouble early_exit_ratio = default_early_exit_ratio;
 	UErrorCode uc_err = U_ZERO_ERROR;
 	GString *languages_pattern;
 	struct rspamd_ngramm_chain *chain, schain;
@@ -800,6 +947,18 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			short_text_limit = ucl_object_toint (elt);
 		}
 
+		elt = ucl_object_lookup (section, "cache_size");
+
+		if (elt) {
+			cache_size = ucl_object_toint (elt);
+		}
+
+		elt = ucl_object_lookup (section, "early_exit_ratio");
+
+		if (elt) {
+			early_exit_ratio = ucl_object_todouble (elt);
+		}
+
 		languages_enable = ucl_object_lookup (section, "languages_enable");
 		languages_disable = ucl_object_lookup (section, "languages_disable");
 	}
@@ -833,6 +992,13 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 	ret->languages = g_ptr_array_sized_new (gl.gl_pathc);
 	ret->uchar_converter = rspamd_get_utf8_converter ();
 	ret->short_text_limit = short_text_limit;
+	ret->early_exit_ratio = early_exit_ratio;
+	ret->cache_size = cache_size;
+
+	if (cache_size > 0) {
+		ret->cache = rspamd_lru_hash_new_full (cache_size, g_free, g_free,
+				g_int64_hash, g_int64_equal);
+	}
 	ret->stop_words_norm = kh_init (rspamd_stopwords_hash);
 
 	/* Map from ngramm in ucs32 to GPtrArray of rspamd_language_elt */
@@ -869,6 +1035,12 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 		g_free (fname);
 	}
 
+	for (i = 0; i < ret->languages->len; i ++) {
+		struct rspamd_language_elt *lelt = g_ptr_array_index (ret->languages, i);
+
+		lelt->id = i;
+	}
+
 	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 		GError *err = NULL;
 
@@ -877,6 +1049,9 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			rspamd_language_detector_process_chain (cfg, chain);
 		});
 
+		rspamd_language_detector_build_model (cfg, ret->trigramms[i],
+				&ret->models[i]);
+
 		if (!rspamd_multipattern_compile (ret->stop_words[i].mp, &err)) {
 			msg_err_config ("cannot compile stop words for %z language group: %e",
 					i, err);
@@ -884,6 +1059,9 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 		}
 
 		total += kh_size (ret->trigramms[i]);
+		/* Chains are not needed after the model is built */
+		kh_destroy (rspamd_trigram_hash, ret->trigramms[i]);
+		ret->trigramms[i] = NULL;
 	}
 
 	msg_info_config ("loaded %d languages, "
@@ -1046,61 +1224,27 @@ rspamd_language_detector_next_ngramm (rspamd_stat_token_t *tok, UChar32 *window,
 }
 
 /*
- * Do full guess for a specific ngramm, checking all languages defined
+ * Do full guess for a specific ngramm, checking all languages defined:
+ * probabilities are accumulated to the per language scores
  */
-static void
-rspamd_language_detector_process_ngramm_full (struct rspamd_task *task,
-											  struct rspamd_lang_detector *d,
-											  UChar32 *window,
-											  khash_t(rspamd_candidates_hash) *candidates,
-											  khash_t(rspamd_trigram_hash) *trigramms)
+static inline void
+rspamd_language_detector_process_ngramm_full (const struct rspamd_trigram_model *m,
+											  const UChar32 *window,
+											  gdouble *scores)
 {
-	guint i;
-	gint ret;
-	struct rspamd_ngramm_chain *chain = NULL;
-	struct rspamd_ngramm_elt *elt;
-	struct rspamd_lang_detector_res *cand;
-	khiter_t k;
-	gdouble prob;
-
-	k = kh_get (rspamd_trigram_hash, trigramms, window);
-	if (k != kh_end (trigramms)) {
-		chain = &kh_value (trigramms, k);
-	}
-
-	if (chain) {
-		PTR_ARRAY_FOREACH (chain->languages, i, elt) {
-			prob = elt->prob;
+	const struct rspamd_trigram_model_slot *slot;
+	const guint16 *ids;
+	const gfloat *probs;
+	guint32 i;
 
-			if (prob < chain->mean) {
-				continue;
-			}
+	slot = rspamd_language_detector_model_lookup (m, window);
 
-			k = kh_get (rspamd_candidates_hash, candidates, elt->elt->name);
-			if (k != kh_end (candidates)) {
-				cand = kh_value (candidates, k);
-			}
-			else {
-				cand = NULL;
-			}
+	if (slot) {
+		ids = m->ids + slot->off;
+		probs = m->probs + slot->off;
 
-#ifdef NGRAMMS_DEBUG
-			msg_err ("gramm: %s, lang: %s, prob: %.3f", chain->utf,
-					elt->elt->name, log2 (elt->prob));
-#endif
-			if (cand == NULL) {
-				cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
-				cand->elt = elt->elt;
-				cand->lang = elt->elt->name;
-				cand->prob = prob;
-
-				k = kh_put (rspamd_candidates_hash, candidates, elt->elt->name,
-						&ret);
-				kh_value (candidates, k) = cand;
-			} else {
-				/* Update guess */
-				cand->prob += prob;
-			}
+		for (i = 0; i < slot->nlangs; i ++) {
+			scores[ids[i]] += probs[i];
 		}
 	}
 }
@@ -1109,8 +1253,8 @@ static void
 rspamd_language_detector_detect_word (struct rspamd_task *task,
 									  struct rspamd_lang_detector *d,
 									  rspamd_stat_token_t *tok,
-									  khash_t(rspamd_candidates_hash) *candidates,
-									  khash_t(rspamd_trigram_hash) *trigramms)
+									  gdouble *scores,
+									  const struct rspamd_trigram_model *m)
 {
 	const guint wlen = 3;
 	UChar32 window[3];
@@ -1119,8 +1263,70 @@ rspamd_language_detector_detect_word (struct rspamd_task *task,
 	/* Split words */
 	while ((cur = rspamd_language_detector_next_ngramm (tok, window, wlen, cur))
 			!= -1) {
-		rspamd_language_detector_process_ngramm_full (task,
-				d, window, candidates, trigramms);
+		rspamd_language_detector_process_ngramm_full (m, window, scores);
+	}
+}
+
+/*
+ * Returns TRUE if the best language is at least `early_exit_ratio` times
+ * better than the next one, so checking more words is unlikely to change
+ * the result
+ */
+static gboolean
+rspamd_language_detector_scores_confident (struct rspamd_lang_detector *d,
+		const gdouble *scores)
+{
+	gdouble best = 0, second = 0;
+	guint i;
+
+	for (i = 0; i < d->languages->len; i ++) {
+		if (scores[i] > best) {
+			second = best;
+			best = scores[i];
+		}
+		else if (scores[i] > second) {
+			second = scores[i];
+		}
+	}
+
+	return best > 0 && best >= second * d->early_exit_ratio;
+}
+
+/*
+ * Moves non zero scores to the candidates
+ */
+static void
+rspamd_language_detector_scores_to_candidates (struct rspamd_task *task,
+		struct rspamd_lang_detector *d,
+		const gdouble *scores,
+		khash_t(rspamd_candidates_hash) *candidates)
+{
+	struct rspamd_language_elt *elt;
+	struct rspamd_lang_detector_res *cand;
+	khiter_t k;
+	guint i;
+	gint ret;
+
+	for (i = 0; i < d->languages->len; i ++) {
+		if (scores[i] == 0) {
+			continue;
+		}
+
+		elt = g_ptr_array_index (d->languages, i);
+		k = kh_put (rspamd_candidates_hash, candidates, elt->name, &ret);
+
+		if (ret == 0) {
+			/* Update guess */
+			cand = kh_value (candidates, k);
+			cand->prob += scores[i];
+		}
+		else {
+			cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
+			cand->elt = elt;
+			cand->lang = elt->name;
+			cand->prob = scores[i];
+			kh_value (candidates, k) = cand;
+		}
 	}
 }
 
@@ -1203,9 +1409,11 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 	guint nparts = MIN (words->len, nwords);
 	goffset *selected_words;
 	rspamd_stat_token_t *tok;
+	gdouble *scores;
 	guint i;
 
 	selected_words = g_new0 (goffset, nparts);
+	scores = g_new0 (gdouble, d->languages->len);
 	rspamd_language_detector_random_select (words, nparts, selected_words);
 	msg_debug_lang_det ("randomly selected %d words", nparts);
 
@@ -1214,11 +1422,23 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 				selected_words[i]);
 
 		if (tok->unicode.len >= 3) {
-			rspamd_language_detector_detect_word (task, d, tok, candidates,
-					d->trigramms[cat]);
+			rspamd_language_detector_detect_word (task, d, tok, scores,
+					&d->models[cat]);
+		}
+
+		if (d->early_exit_ratio > 0 && i + 1 < nparts &&
+				i + 1 >= early_exit_words &&
+				(i + 1 - early_exit_words) % early_exit_step == 0 &&
+				rspamd_language_detector_scores_confident (d, scores)) {
+			msg_debug_lang_det ("stop after checking %d words of %d: "
+					"confident enough", i + 1, nparts);
+			break;
 		}
 	}
 
+	rspamd_language_detector_scores_to_candidates (task, d, scores, candidates);
+	g_free (scores);
+
 	/* Filter negligible candidates */
 	rspamd_language_detector_filter_negligible (task, candidates);
 	g_free (selected_words);
@@ -1753,6 +1973,87 @@ rspamd_language_detector_try_stop_words (struct rspamd_task *task,
 	return ret;
 }
 
+static gboolean
+rspamd_language_detector_cache_lookup (struct rspamd_task *task,
+		struct rspamd_lang_detector *d,
+		struct rspamd_mime_text_part *part,
+		guint64 digest,
+		gboolean *pret)
+{
+	struct rspamd_lang_detector_cache_elt *celt;
+	struct rspamd_lang_detector_res *cand;
+	guint i;
+
+	celt = rspamd_lru_hash_lookup (d->cache, &digest,
+			(time_t)task->task_timestamp);
+
+	if (celt == NULL || celt->len != part->utf_stripped_content->len) {
+		return FALSE;
+	}
+
+	part->unicode_scripts |= celt->unicode_scripts;
+
+	if (celt->nlangs > 0) {
+		if (part->languages != NULL) {
+			g_ptr_array_unref (part->languages);
+		}
+
+		part->languages = g_ptr_array_sized_new (celt->nlangs);
+
+		for (i = 0; i < celt->nlangs; i ++) {
+			cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
+			memcpy (cand, &celt->langs[i], sizeof (*cand));
+			g_ptr_array_add (part->languages, cand);
+		}
+
+		cand = g_ptr_array_index (part->languages, 0);
+		part->language = cand->lang;
+
+		if (celt->counted) {
+			cand->elt->occurencies++;
+			d->total_occurencies++;
+		}
+	}
+
+	msg_debug_lang_det ("reuse cached detection result for %z bytes of text",
+			celt->len);
+	*pret = celt->ret;
+
+	return TRUE;
+}
+
+static void
+rspamd_language_detector_cache_insert (struct rspamd_task *task,
+		struct rspamd_lang_detector *d,
+		struct rspamd_mime_text_part *part,
+		guint64 digest,
+		gboolean ret,
+		gboolean counted)
+{
+	struct rspamd_lang_detector_cache_elt *celt;
+	struct rspamd_lang_detector_res *cand;
+	guint64 *key;
+	guint i, nlangs;
+
+	nlangs = part->languages ? part->languages->len : 0;
+	celt = g_malloc (sizeof (*celt) + sizeof (celt->langs[0]) * nlangs);
+	celt->len = part->utf_stripped_content->len;
+	celt->unicode_scripts = part->unicode_scripts;
+	celt->ret = ret;
+	celt->counted = counted;
+	celt->nlangs = nlangs;
+
+	for (i = 0; i < nlangs; i ++) {
+		cand = g_ptr_array_index (part->languages, i);
+		memcpy (&celt->langs[i], cand, sizeof (*cand));
+	}
+
+	key = g_malloc (sizeof (*key));
+	*key = digest;
+	rspamd_lru_hash_insert (d->cache, key, celt,
+			(time_t)task->task_timestamp, 0);
+}
+
 gboolean
 rspamd_language_detector_detect (struct rspamd_task *task,
 								 struct rspamd_lang_detector *d,
@@ -1767,7 +2068,8 @@ rspamd_language_detector_detect (struct rspamd_task *task,
 	enum rspamd_language_detected_type r;
 	struct rspamd_frequency_sort_cbdata cbd;
 	/* Check if we have sorted candidates based on frequency */
-	gboolean frequency_heuristic_applied = FALSE, ret = FALSE;
+	gboolean frequency_heuristic_applied = FALSE, ret = FALSE, counted = FALSE;
+	guint64 digest = 0;
 
 	if (!part->utf_stripped_content) {
 		return FALSE;
@@ -1775,6 +2077,15 @@ rspamd_language_detector_detect (struct rspamd_task *task,
 
 	start_ticks = rspamd_get_ticks (TRUE);
 
+	if (d->cache) {
+		digest = rspamd_cryptobox_fast_hash (part->utf_stripped_content->data,
+				part->utf_stripped_content->len, rspamd_hash_seed ());
+
+		if (rspamd_language_detector_cache_lookup (task, d, part, digest, &ret)) {
+			return ret;
+		}
+	}
+
 	guint nchinese = 0, nspecial = 0;
 	rspamd_language_detector_unicode_scripts (task, part, &nchinese, &nspecial);
 	/* Apply unicode scripts heuristic */
@@ -1900,6 +2211,7 @@ rspamd_language_detector_detect (struct rspamd_task *task,
 				cand = g_ptr_array_index (result, 0);
 				cand->elt->occurencies++;
 				d->total_occurencies++;
+				counted = TRUE;
 			}
 
 			if (part->languages != NULL) {
@@ -1916,6 +2228,11 @@ rspamd_language_detector_detect (struct rspamd_task *task,
 		kh_destroy (rspamd_candidates_hash, candidates);
 	}
 
+	if (d->cache) {
+		rspamd_language_detector_cache_insert (task, d, part, digest, ret,
+				counted);
+	}
+
 	end_ticks = rspamd_get_ticks (TRUE);
 	msg_debug_lang_det ("detected languages in %.0f ticks",
 			(end_ticks - start_ticks));
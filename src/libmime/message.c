@@ -240,7 +240,11 @@ rspamd_strip_newlines_parse (struct rspamd_task *task,
 	} state = normal_char;
 
 	while (p < pe) {
-		if (IS_TEXT_PART_UTF (part)) {
+		/*
+		 * Zero width spaces are never ASCII, so we do not decode utf8
+		 * characters for pure ASCII bytes that are the most common case
+		 */
+		if (IS_TEXT_PART_UTF (part) && G_UNLIKELY (*p & 0x80)) {
 			gint32 off = p - begin;
 			U8_NEXT (begin, off, pe - begin, uc);
 
@@ -746,6 +750,8 @@ static gboolean
 rspamd_message_process_html_text_part (struct rspamd_task *task,
 										struct rspamd_mime_text_part *text_part)
 {
+	struct rspamd_html_limits limits;
+
 	text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_HTML;
 
 	if (text_part->parsed.len == 0) {
@@ -763,13 +769,17 @@ rspamd_message_process_html_text_part (struct rspamd_task *task,
 	text_part->html = rspamd_mempool_alloc0 (task->task_pool,
 			sizeof (*text_part->html));
 	text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_BALANCED;
+	limits.max_tags = task->cfg->html_max_tags;
+	limits.max_depth = task->cfg->html_max_depth;
+	limits.max_time = task->cfg->html_max_time;
 	text_part->utf_content = rspamd_html_process_part_full (
 			task->task_pool,
 			text_part->html,
 			text_part->utf_raw_content,
 			&text_part->exceptions,
 			MESSAGE_FIELD (task, urls),
-			text_part->mime_part->urls);
+			text_part->mime_part->urls,
+			&limits);
 
 	if (text_part->utf_content->len == 0) {
 		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
@@ -1329,6 +1339,8 @@ rspamd_message_parse (struct rspamd_task *task)
 	}
 
 	memcpy (MESSAGE_FIELD (task, digest), n, sizeof (n));
+	/* Identical bodies have the same digest regardless of headers */
+	memcpy (MESSAGE_FIELD (task, body_digest), n, sizeof (n));
 
 	if (MESSAGE_FIELD (task, subject)) {
 		p = MESSAGE_FIELD (task, subject);
@@ -185,6 +185,7 @@ struct rspamd_message {
 	GPtrArray *rcpt_mime;
 	GPtrArray *from_mime;
 	guchar digest[16];
+	guchar body_digest[16];						/**< digest of mime parts only (no headers)			*/
 	enum rspamd_newlines_type nlines_type; 		/**< type of newlines (detected on most of headers 	*/
 	ref_entry_t ref;
 };
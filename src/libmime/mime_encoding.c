@@ -25,6 +25,7 @@
 #include "contrib/fastutf8/fastutf8.h"
 #include "contrib/google-ced/ced_c.h"
 #include <unicode/ucnv.h>
+#include <unicode/utf8.h>
 #if U_ICU_VERSION_MAJOR_NUM >= 44
 #include <unicode/unorm2.h>
 #endif
@@ -79,6 +80,7 @@ struct rspamd_charset_converter {
 		const UChar *cnv_table;
 	} d;
 	gboolean is_internal;
+	gboolean free_table; /* Table is built from ICU converter */
 };
 
 static GQuark
@@ -95,6 +97,9 @@ rspamd_converter_dtor (gpointer p)
 	if (!c->is_internal) {
 		ucnv_close (c->d.conv);
 	}
+	else if (c->free_table) {
+		g_free ((gpointer)c->d.cnv_table);
+	}
 
 	g_free (c->canon_name);
 	g_free (c);
@@ -134,6 +139,76 @@ rspamd_converter_to_uchars (struct rspamd_charset_converter *cnv,
 }
 
 
+/*
+ * Single byte charsets that are compatible with ASCII are converted by tables
+ * built once from ICU converter: it avoids ICU calls and UTF16 round trip
+ */
+static UChar *
+rspamd_converter_build_table (UConverter *cnv)
+{
+	UChar *tbl, uc[2];
+	UErrorCode uc_err;
+	UConverterType type;
+	gchar c;
+	gint i;
+	int32_t r;
+
+	type = ucnv_getType (cnv);
+
+	if (type != UCNV_SBCS && type != UCNV_LATIN_1) {
+		return NULL;
+	}
+
+	tbl = g_new (UChar, 128);
+
+	for (i = 1; i < 256; i ++) {
+		c = (gchar)i;
+		uc_err = U_ZERO_ERROR;
+		ucnv_resetToUnicode (cnv);
+		r = ucnv_toUChars (cnv, uc, G_N_ELEMENTS (uc), &c, 1, &uc_err);
+
+		if (!U_SUCCESS (uc_err) || r != 1 || (i < 128 && uc[0] != i)) {
+			/* Not ASCII compatible or not a trivial mapping */
+			g_free (tbl);
+
+			return NULL;
+		}
+
+		if (i >= 128) {
+			tbl[i - 128] = uc[0];
+		}
+	}
+
+	ucnv_resetToUnicode (cnv);
+
+	return tbl;
+}
+
+/*
+ * Converts data using internal table directly to utf8,
+ * dest must have at least 3 * srclen bytes
+ */
+static gint32
+rspamd_converter_table_to_utf8 (struct rspamd_charset_converter *cnv,
+		guchar *dest, const guchar *src, gint32 srclen)
+{
+	const guchar *p = src, *end = src + srclen;
+	gint32 i = 0;
+
+	while (p < end) {
+		if (*p <= 127) {
+			dest[i++] = *p;
+		}
+		else {
+			U8_APPEND_UNSAFE (dest, i, cnv->d.cnv_table[*p - 128]);
+		}
+
+		p ++;
+	}
+
+	return i;
+}
+
 struct rspamd_charset_converter *
 rspamd_mime_get_converter_cached (const gchar *enc,
 								  rspamd_mempool_t *pool,
@@ -179,12 +254,22 @@ rspamd_mime_get_converter_cached (const gchar *enc,
 			conv->canon_name = g_strdup (canon_name);
 
 			if (conv->d.conv != NULL) {
+				UChar *tbl;
+
 				ucnv_setToUCallBack (conv->d.conv,
 						UCNV_TO_U_CALLBACK_SUBSTITUTE,
 						NULL,
 						NULL,
 						NULL,
 						err);
+
+				if ((tbl = rspamd_converter_build_table (conv->d.conv)) != NULL) {
+					ucnv_close (conv->d.conv);
+					conv->is_internal = TRUE;
+					conv->free_table = TRUE;
+					conv->d.cnv_table = tbl;
+				}
+
 				rspamd_lru_hash_insert (cache, conv->canon_name, conv, 0, 0);
 			}
 			else {
@@ -361,6 +446,18 @@ rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
+	if (conv->is_internal) {
+		d = rspamd_mempool_alloc (pool, len * 3 + 1);
+		r = rspamd_converter_table_to_utf8 (conv, (guchar *)d,
+				(const guchar *)input, len);
+
+		if (olen) {
+			*olen = r;
+		}
+
+		return d;
+	}
+
 	tmp_buf = g_new (UChar, len + 1);
 	uc_err = U_ZERO_ERROR;
 	r = rspamd_converter_to_uchars (conv, tmp_buf, len + 1, input, len, &uc_err);
@@ -400,6 +497,24 @@ rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
 	return d;
 }
 
+/*
+ * Returns a read only byte array that points to the existing data of the
+ * same lifetime as pool. It must not be resized or freed, as it is not
+ * a real GByteArray (however, it has space for its private fields)
+ */
+static GByteArray *
+rspamd_mime_byte_array_view (rspamd_mempool_t *pool, const gchar *data,
+		gsize len)
+{
+	GByteArray *view;
+
+	view = rspamd_mempool_alloc (pool, sizeof (*view) + sizeof (gpointer) * 4);
+	view->data = (guint8 *)data;
+	view->len = len;
+
+	return view;
+}
+
 static gboolean
 rspamd_mime_text_part_utf8_convert (struct rspamd_task *task,
 									struct rspamd_mime_text_part *text_part,
@@ -426,38 +541,48 @@ rspamd_mime_text_part_utf8_convert (struct rspamd_task *task,
 		return FALSE;
 	}
 
-	tmp_buf = g_new (UChar, input->len + 1);
-	uc_err = U_ZERO_ERROR;
-	uc_len = rspamd_converter_to_uchars (conv,
-			tmp_buf,
-			input->len + 1,
-			input->data,
-			input->len,
-			&uc_err);
-
-	if (!U_SUCCESS (uc_err)) {
-		g_set_error (err, rspamd_iconv_error_quark (), EINVAL,
-				"cannot convert data to unicode from %s: %s",
-				charset, u_errorName (uc_err));
-		g_free (tmp_buf);
-
-		return FALSE;
+	if (conv->is_internal) {
+		/* Single byte charset, no need to convert to UTF16 */
+		d = rspamd_mempool_alloc (task->task_pool, input->len * 3 + 1);
+		r = rspamd_converter_table_to_utf8 (conv, (guchar *)d,
+				input->data, input->len);
+		uc_len = input->len;
+		tmp_buf = NULL;
 	}
+	else {
+		tmp_buf = g_new (UChar, input->len + 1);
+		uc_err = U_ZERO_ERROR;
+		uc_len = rspamd_converter_to_uchars (conv,
+				tmp_buf,
+				input->len + 1,
+				input->data,
+				input->len,
+				&uc_err);
+
+		if (!U_SUCCESS (uc_err)) {
+			g_set_error (err, rspamd_iconv_error_quark (), EINVAL,
+					"cannot convert data to unicode from %s: %s",
+					charset, u_errorName (uc_err));
+			g_free (tmp_buf);
 
-	/* Now, convert to utf8 */
-	clen = ucnv_getMaxCharSize (utf8_converter);
-	dlen = UCNV_GET_MAX_BYTES_FOR_STRING (uc_len, clen);
-	d = rspamd_mempool_alloc (task->task_pool, dlen);
-	r = ucnv_fromUChars (utf8_converter, d, dlen,
-			tmp_buf, uc_len, &uc_err);
+			return FALSE;
+		}
 
-	if (!U_SUCCESS (uc_err)) {
-		g_set_error (err, rspamd_iconv_error_quark (), EINVAL,
-				"cannot convert data from unicode from %s: %s",
-				charset, u_errorName (uc_err));
-		g_free (tmp_buf);
+		/* Now, convert to utf8 */
+		clen = ucnv_getMaxCharSize (utf8_converter);
+		dlen = UCNV_GET_MAX_BYTES_FOR_STRING (uc_len, clen);
+		d = rspamd_mempool_alloc (task->task_pool, dlen);
+		r = ucnv_fromUChars (utf8_converter, d, dlen,
+				tmp_buf, uc_len, &uc_err);
 
-		return FALSE;
+		if (!U_SUCCESS (uc_err)) {
+			g_set_error (err, rspamd_iconv_error_quark (), EINVAL,
+					"cannot convert data from unicode from %s: %s",
+					charset, u_errorName (uc_err));
+			g_free (tmp_buf);
+
+			return FALSE;
+		}
 	}
 
 	if (text_part->mime_part && text_part->mime_part->ct) {
@@ -470,10 +595,8 @@ rspamd_mime_text_part_utf8_convert (struct rspamd_task *task,
 				charset, input->len, r, uc_len);
 	}
 
-	text_part->utf_raw_content = rspamd_mempool_alloc (task->task_pool,
-			sizeof (*text_part->utf_raw_content) + sizeof (gpointer) * 4);
-	text_part->utf_raw_content->data = d;
-	text_part->utf_raw_content->len = r;
+	text_part->utf_raw_content = rspamd_mime_byte_array_view (task->task_pool,
+			d, r);
 	g_free (tmp_buf);
 
 	return TRUE;
@@ -527,6 +650,14 @@ rspamd_mime_to_utf8_byte_array (GByteArray *in,
 		return FALSE;
 	}
 
+	if (conv->is_internal) {
+		g_byte_array_set_size (out, in->len * 3 + 1);
+		out->len = rspamd_converter_table_to_utf8 (conv, out->data,
+				in->data, in->len);
+
+		return TRUE;
+	}
+
 	tmp_buf = g_new (UChar, in->len + 1);
 	uc_err = U_ZERO_ERROR;
 	r = rspamd_converter_to_uchars (conv,
@@ -742,14 +873,12 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_8BIT_RAW;
 	}
 
-	/* Allocate copy storage */
-	part_content = g_byte_array_sized_new (text_part->parsed.len);
-	memcpy (part_content->data, text_part->parsed.begin, text_part->parsed.len);
-	part_content->len = text_part->parsed.len;
-	rspamd_mempool_notify_alloc (task->task_pool,
-			part_content->len);
-	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t)g_byte_array_unref, part_content);
+	/*
+	 * Decoded content lives as long as the task, so we can avoid copying it
+	 * unless we need to modify it (see below)
+	 */
+	part_content = rspamd_mime_byte_array_view (task->task_pool,
+			text_part->parsed.begin, text_part->parsed.len);
 
 	if (rspamd_str_has_8bit (text_part->parsed.begin, text_part->parsed.len)) {
 		if (rspamd_fast_utf8_validate (text_part->parsed.begin, text_part->parsed.len) == 0) {
@@ -810,11 +939,28 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 			text_part->real_charset = charset;
 
 			if (strcmp (charset, UTF8_CHARSET) != 0) {
-				/*
-				 * We have detected some charset, but we don't know which one,
-				 * so we need to reset valid utf8 flag and enforce it later
-				 */
-				valid_utf8 = FALSE;
+				UErrorCode uc_err = U_ZERO_ERROR;
+				struct rspamd_charset_converter *conv;
+
+				conv = rspamd_mime_get_converter_cached (charset,
+						task->task_pool, TRUE, &uc_err);
+
+				if (valid_utf8 &&
+						!(text_part->flags & RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED) &&
+						conv != NULL && conv->is_internal) {
+					/*
+					 * 7bit content in a single byte ASCII compatible charset
+					 * is the same in utf8, so no conversion is needed
+					 */
+				}
+				else {
+					/*
+					 * We have detected some charset, but we don't know which
+					 * one, so we need to reset valid utf8 flag and enforce
+					 * it later
+					 */
+					valid_utf8 = FALSE;
+				}
 			}
 		}
 	}
@@ -832,6 +978,21 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 	RSPAMD_FTOK_FROM_STR (&charset_tok, charset);
 
 	if (!valid_utf8) {
+		if (!checked) {
+			/*
+			 * Content check can replace invalid utf8 sequences in place and
+			 * parsed data might be a part of the read only message, so copy it
+			 */
+			part_content = g_byte_array_sized_new (text_part->parsed.len);
+			memcpy (part_content->data, text_part->parsed.begin,
+					text_part->parsed.len);
+			part_content->len = text_part->parsed.len;
+			rspamd_mempool_notify_alloc (task->task_pool,
+					part_content->len);
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)g_byte_array_unref, part_content);
+		}
+
 		if (rspamd_mime_charset_utf_check (&charset_tok, part_content->data,
 				part_content->len, !checked)) {
 			SET_PART_UTF (text_part);
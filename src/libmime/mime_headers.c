@@ -24,9 +24,149 @@
 #include "libutil/util.h"
 #include <unicode/utf8.h>
 
+/*
+ * Interned names of common headers: they are shared by all tasks and are never
+ * modified, so headers with such names do not copy their names and the
+ * hashes of these names are computed just once
+ */
+static const gchar *rspamd_mime_header_atoms_list[] = {
+	"Received",
+	"From",
+	"To",
+	"Cc",
+	"Bcc",
+	"Subject",
+	"Date",
+	"Message-ID",
+	"Message-Id",
+	"Reply-To",
+	"In-Reply-To",
+	"References",
+	"Sender",
+	"Return-Path",
+	"Delivered-To",
+	"MIME-Version",
+	"Mime-Version",
+	"Content-Type",
+	"Content-Transfer-Encoding",
+	"Content-Disposition",
+	"Content-Language",
+	"Content-ID",
+	"DKIM-Signature",
+	"ARC-Seal",
+	"ARC-Message-Signature",
+	"ARC-Authentication-Results",
+	"Authentication-Results",
+	"Received-SPF",
+	"List-Id",
+	"List-Unsubscribe",
+	"List-Unsubscribe-Post",
+	"Precedence",
+	"Errors-To",
+	"Organization",
+	"User-Agent",
+	"X-Mailer",
+	"X-Priority",
+	"Importance",
+	"Thread-Index",
+	"Thread-Topic",
+	"Feedback-ID",
+	"X-Originating-IP",
+	"X-MS-Exchange-Organization-SCL",
+	"X-Spam-Status",
+	"X-Spam-Flag",
+};
+
+#define RSPAMD_MIME_HEADER_ATOMS_NUM G_N_ELEMENTS (rspamd_mime_header_atoms_list)
+#define RSPAMD_MIME_HEADER_ATOM_LEN 32
+
+static gchar rspamd_mime_header_atoms[RSPAMD_MIME_HEADER_ATOMS_NUM][RSPAMD_MIME_HEADER_ATOM_LEN];
+static guint rspamd_mime_header_atoms_hash[RSPAMD_MIME_HEADER_ATOMS_NUM];
+static guint64 rspamd_mime_header_atoms_special[RSPAMD_MIME_HEADER_ATOMS_NUM];
+/* Atoms with the same length are chained starting from atoms_by_len */
+static gint rspamd_mime_header_atoms_by_len[RSPAMD_MIME_HEADER_ATOM_LEN];
+static gint rspamd_mime_header_atoms_next[RSPAMD_MIME_HEADER_ATOMS_NUM];
+
+RSPAMD_CONSTRUCTOR (rspamd_mime_header_atoms_ctor)
+{
+	guint i, len;
+
+	for (i = 0; i < RSPAMD_MIME_HEADER_ATOM_LEN; i ++) {
+		rspamd_mime_header_atoms_by_len[i] = -1;
+	}
+
+	for (i = 0; i < RSPAMD_MIME_HEADER_ATOMS_NUM; i ++) {
+		len = strlen (rspamd_mime_header_atoms_list[i]);
+		g_assert (len < RSPAMD_MIME_HEADER_ATOM_LEN);
+		memcpy (rspamd_mime_header_atoms[i], rspamd_mime_header_atoms_list[i],
+				len + 1);
+		rspamd_mime_header_atoms_hash[i] = rspamd_strcase_hash (
+				rspamd_mime_header_atoms[i]);
+		rspamd_mime_header_atoms_special[i] = rspamd_icase_hash (
+				rspamd_mime_header_atoms[i], len, 0xdeadbabe);
+		rspamd_mime_header_atoms_next[i] = rspamd_mime_header_atoms_by_len[len];
+		rspamd_mime_header_atoms_by_len[len] = i;
+	}
+}
+
+/* Returns index of an interned name or -1 if a name is not interned */
+static inline gint
+rspamd_mime_header_atom_idx (const gchar *name)
+{
+	uintptr_t p = (uintptr_t)name, start = (uintptr_t)rspamd_mime_header_atoms;
+
+	if (p >= start && p < start + sizeof (rspamd_mime_header_atoms)) {
+		return (p - start) / RSPAMD_MIME_HEADER_ATOM_LEN;
+	}
+
+	return -1;
+}
+
+/* Returns interned name for exactly the same name or NULL */
+static gchar *
+rspamd_mime_header_atom_find (const gchar *name, gsize len)
+{
+	gint i;
+
+	if (len >= RSPAMD_MIME_HEADER_ATOM_LEN) {
+		return NULL;
+	}
+
+	for (i = rspamd_mime_header_atoms_by_len[len]; i != -1;
+			i = rspamd_mime_header_atoms_next[i]) {
+		if (memcmp (rspamd_mime_header_atoms[i], name, len) == 0) {
+			return rspamd_mime_header_atoms[i];
+		}
+	}
+
+	return NULL;
+}
+
+static inline guint
+rspamd_mime_header_name_hash (const gchar *name)
+{
+	gint idx = rspamd_mime_header_atom_idx (name);
+
+	if (idx != -1) {
+		return rspamd_mime_header_atoms_hash[idx];
+	}
+
+	return rspamd_strcase_hash (name);
+}
+
+static inline gboolean
+rspamd_mime_header_name_equal (const gchar *a, const gchar *b)
+{
+	if (a == b) {
+		return TRUE;
+	}
+
+	return rspamd_strcase_equal (a, b);
+}
+
 KHASH_INIT (rspamd_mime_headers_htb, gchar *,
 		struct rspamd_mime_header *, 1,
-		rspamd_strcase_hash, rspamd_strcase_equal);
+		rspamd_mime_header_name_hash, rspamd_mime_header_name_equal);
 
 struct rspamd_mime_headers_table {
 	khash_t(rspamd_mime_headers_htb) htb;
@@ -44,13 +184,20 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 	struct rspamd_received_header *recv;
 	const gchar *p, *end;
 	gchar *id;
-	gint max_recipients = -1;
+	gint max_recipients = -1, atom_idx;
 
 	if (task->cfg) {
 		max_recipients = task->cfg->max_recipients;
 	}
 
-	h = rspamd_icase_hash (rh->name, strlen (rh->name), 0xdeadbabe);
+	atom_idx = rspamd_mime_header_atom_idx (rh->name);
+
+	if (atom_idx != -1) {
+		h = rspamd_mime_header_atoms_special[atom_idx];
+	}
+	else {
+		h = rspamd_icase_hash (rh->name, strlen (rh->name), 0xdeadbabe);
+	}
 
 	switch (h) {
 	case 0x88705DC4D9D61ABULL:	/* received */
@@ -189,6 +336,30 @@ rspamd_mime_header_add (struct rspamd_task *task,
 }
 
 
+/*
+ * Returns TRUE if a header value has neither encoded words nor characters
+ * that are changed by decoding (8 bit, controls and spaces except space)
+ */
+static inline gboolean
+rspamd_mime_header_is_plain (const gchar *in, gsize len)
+{
+	const guchar *p = (const guchar *)in, *end = p + len;
+
+	while (p < end) {
+		if (*p < 0x20 || *p > 0x7e) {
+			return FALSE;
+		}
+
+		if (*p == '=' && p + 1 < end && p[1] == '?') {
+			return FALSE;
+		}
+
+		p ++;
+	}
+
+	return TRUE;
+}
+
 /* Convert raw headers to a list of struct raw_header * */
 void
 rspamd_mime_headers_process (struct rspamd_task *task,
@@ -232,8 +403,13 @@ rspamd_mime_headers_process (struct rspamd_task *task,
 				nh = rspamd_mempool_alloc0 (task->task_pool,
 						sizeof (struct rspamd_mime_header));
 				l = p - c;
-				tmp = rspamd_mempool_alloc (task->task_pool, l + 1);
-				rspamd_null_safe_copy (c, l, tmp, l + 1);
+				tmp = rspamd_mime_header_atom_find (c, l);
+
+				if (tmp == NULL) {
+					tmp = rspamd_mempool_alloc (task->task_pool, l + 1);
+					rspamd_null_safe_copy (c, l, tmp, l + 1);
+				}
+
 				nh->name = tmp;
 				nh->flags |= RSPAMD_HEADER_EMPTY_SEPARATOR;
 				nh->raw_value = c;
@@ -392,20 +568,27 @@ rspamd_mime_headers_process (struct rspamd_task *task,
 			nh->value = tmp;
 
 			gboolean broken_utf = FALSE;
+			gsize vlen = tp - tmp;
 
-			nh->decoded = rspamd_mime_header_decode (task->task_pool,
-					nh->value, strlen (tmp), &broken_utf);
-
-			if (broken_utf) {
-				task->flags |= RSPAMD_TASK_FLAG_BAD_UNICODE;
+			if (rspamd_mime_header_is_plain (tmp, vlen)) {
+				/* Decoding would produce the same string */
+				nh->decoded = tmp;
 			}
+			else {
+				nh->decoded = rspamd_mime_header_decode (task->task_pool,
+						nh->value, vlen, &broken_utf);
 
-			if (nh->decoded == NULL) {
-				nh->decoded = "";
-			}
+				if (broken_utf) {
+					task->flags |= RSPAMD_TASK_FLAG_BAD_UNICODE;
+				}
+
+				if (nh->decoded == NULL) {
+					nh->decoded = "";
+				}
 
-			/* We also validate utf8 and replace all non-valid utf8 chars */
-			rspamd_mime_charset_utf_enforce (nh->decoded, strlen (nh->decoded));
+				/* We also validate utf8 and replace all non-valid utf8 chars */
+				rspamd_mime_charset_utf_enforce (nh->decoded, strlen (nh->decoded));
+			}
 			nh->order = norder ++;
 			rspamd_mime_header_add (task, &target->htb, order_ptr, nh, check_newlines);
 			nh = NULL;
@@ -610,6 +793,15 @@ rspamd_mime_header_decode (rspamd_mempool_t *pool, const gchar *in,
 
 	g_assert (in != NULL);
 
+	if (rspamd_mime_header_is_plain (in, inlen)) {
+		/* Nothing to decode */
+		ret = rspamd_mempool_alloc (pool, inlen + 1);
+		memcpy (ret, in, inlen);
+		ret[inlen] = '\0';
+
+		return ret;
+	}
+
 	c = in;
 	p = in;
 	end = in + inlen;
@@ -1761,7 +1953,12 @@ rspamd_message_set_modified_header (struct rspamd_task *task,
 			hdr_elt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*hdr_elt));
 
 			hdr_elt->flags |= RSPAMD_HEADER_MODIFIED|RSPAMD_HEADER_NON_EXISTING;
-			hdr_elt->name = rspamd_mempool_strdup (task->task_pool, hdr_name);
+			hdr_elt->name = rspamd_mime_header_atom_find (hdr_name,
+					strlen (hdr_name));
+
+			if (hdr_elt->name == NULL) {
+				hdr_elt->name = rspamd_mempool_strdup (task->task_pool, hdr_name);
+			}
 
 			int r;
 			k = kh_put (rspamd_mime_headers_htb, htb, hdr_elt->name, &r);
@@ -20,7 +20,6 @@
 #include "mime_parser.h"
 #include "mime_headers.h"
 #include "message.h"
-#include "multipattern.h"
 #include "contrib/libottery/ottery.h"
 #include "contrib/uthash/utlist.h"
 #include <openssl/cms.h>
@@ -28,7 +27,6 @@
 #include "contrib/fastutf8/fastutf8.h"
 
 struct rspamd_mime_parser_lib_ctx {
-	struct rspamd_multipattern *mp_boundary;
 	guchar hkey[rspamd_cryptobox_SIPKEYBYTES]; /* Key for hashing */
 	guint key_usages;
 };
@@ -163,11 +161,6 @@ static void
 rspamd_mime_parser_init_lib (void)
 {
 	lib_ctx = g_malloc0 (sizeof (*lib_ctx));
-	lib_ctx->mp_boundary = rspamd_multipattern_create (RSPAMD_MULTIPATTERN_DEFAULT);
-	g_assert (lib_ctx->mp_boundary != NULL);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\r--", 0);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\n--", 0);
-	g_assert (rspamd_multipattern_compile (lib_ctx->mp_boundary, NULL));
 	ottery_rand_bytes (lib_ctx->hkey, sizeof (lib_ctx->hkey));
 }
 
@@ -1138,22 +1131,21 @@ rspamd_mime_parse_multipart_part (struct rspamd_task *task,
 	return ret;
 }
 
-/* Process boundary like structures in a message */
-static gint
-rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
+/*
+ * Process boundary like structure in a message, match_pos points right
+ * after `\n--` or `\r--`
+ */
+static void
+rspamd_mime_preprocess_boundary (struct rspamd_mime_parser_ctx *st,
 		const gchar *text,
 		gsize len,
-		void *context)
+		gsize match_pos)
 {
 	const gchar *end = text + len, *p = text + match_pos, *bend;
-	gchar *lc_copy;
+	gchar *lc_copy, lc_buf[128];
 	gsize blen;
 	gboolean closing = FALSE;
 	struct rspamd_mime_boundary b;
-	struct rspamd_mime_parser_ctx *st = context;
 	struct rspamd_task *task;
 
 	task = st->task;
@@ -1221,13 +1213,19 @@ rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
 			b.boundary = p - st->start - 2;
 			b.start = bend - st->start;
 
-			if (closing) {
+			/* Normal boundaries are at most 70 characters long */
+			if (blen + 2 <= sizeof (lc_buf)) {
+				lc_copy = lc_buf;
+			}
+			else {
 				lc_copy = g_malloc (blen + 2);
+			}
+
+			if (closing) {
 				memcpy (lc_copy, p, blen + 2);
 				rspamd_str_lc (lc_copy, blen + 2);
 			}
 			else {
-				lc_copy = g_malloc (blen);
 				memcpy (lc_copy, p, blen);
 				rspamd_str_lc (lc_copy, blen);
 			}
@@ -1252,12 +1250,46 @@ rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
 				b.closed_hash = 0;
 			}
 
-			g_free (lc_copy);
+			if (lc_copy != lc_buf) {
+				g_free (lc_copy);
+			}
+
 			g_array_append_val (st->boundaries, b);
 		}
 	}
+}
+
+/*
+ * Finds all `\n--` and `\r--` sequences in a single pass: we look for `-`
+ * characters using memchr (vectorized in libc) and check the neighbours,
+ * `-` cannot occur in base64 and it is rare in other encoded content, so
+ * large attachments are skipped almost at the memory bandwidth speed
+ */
+static void
+rspamd_mime_boundaries_scan (struct rspamd_mime_parser_ctx *st,
+		const gchar *text, gsize len)
+{
+	const gchar *p = text + 1, *end = text + len;
+
+	if (len < 3) {
+		return;
+	}
 
-	return 0;
+	while (p < end - 1) {
+		p = memchr (p, '-', end - p - 1);
+
+		if (p == NULL) {
+			break;
+		}
+
+		if (p[1] == '-' && (p[-1] == '\n' || p[-1] == '\r')) {
+			rspamd_mime_preprocess_boundary (st, text, len, p + 2 - text);
+			p += 2;
+		}
+		else {
+			p ++;
+		}
+	}
 }
 
 static goffset
@@ -1333,16 +1365,14 @@ rspamd_mime_preprocess_message (struct rspamd_task *task,
 {
 
 	if (top->raw_data.begin >= st->pos) {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
+		rspamd_mime_boundaries_scan (st,
 				top->raw_data.begin - 1,
-				top->raw_data.len + 1,
-				rspamd_mime_preprocess_cb, st, NULL);
+				top->raw_data.len + 1);
 	}
 	else {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
+		rspamd_mime_boundaries_scan (st,
 				st->pos,
-				st->end - st->pos,
-				rspamd_mime_preprocess_cb, st, NULL);
+				st->end - st->pos);
 	}
 }
 
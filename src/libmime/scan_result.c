@@ -553,6 +553,8 @@ rspamd_task_insert_result_full (struct rspamd_task *task,
 				if (s && task->cfg->cache && s->sym) {
 					rspamd_symcache_inc_frequency (task->cfg->cache,
 							s->sym->cache_item);
+					rspamd_symcache_item_set_result (task,
+							s->sym->cache_item, TRUE);
 				}
 			}
 			else if (new_symbol) {
@@ -577,6 +579,8 @@ rspamd_task_insert_result_full (struct rspamd_task *task,
 			if (s && task->cfg->cache && s->sym) {
 				rspamd_symcache_inc_frequency (task->cfg->cache,
 						s->sym->cache_item);
+				rspamd_symcache_item_set_result (task,
+						s->sym->cache_item, TRUE);
 			}
 		}
 	}
@@ -967,6 +971,10 @@ struct rspamd_symbol_result* rspamd_task_remove_symbol_result (
 		}
 
 		kh_del (rspamd_symbols_hash, result->symbols, k);
+
+		if (result->name == NULL && res->sym && task->cfg->cache) {
+			rspamd_symcache_item_set_result (task, res->sym->cache_item, FALSE);
+		}
 	}
 	else {
 		return NULL;
@@ -225,6 +225,14 @@ struct rspamd_worker_conf {
 	GList *listen_socks;                            /**< listening sockets descriptors						*/
 	guint64 rlimit_nofile;                          /**< max files limit									*/
 	guint64 rlimit_maxcore;                         /**< maximum core file size								*/
+	gchar *cpu_affinity;                            /**< cpus list or "numa" to pin workers to			*/
+	gboolean cpu_affinity_spread;                   /**< pin each worker to a single cpu from the list		*/
+	gchar *events_backend;                          /**< events backend for this worker type				*/
+	gchar *lua_gc_mode;                             /**< lua gc mode for this worker type					*/
+	guint lua_gc_task_step;                         /**< lua gc step after each task for this worker type	*/
+	gboolean reuseport;                             /**< per worker SO_REUSEPORT tcp sockets				*/
+	gboolean reuseport_cpu;                         /**< steer connections to workers by cpu				*/
+	GArray *reuseport_fds;                          /**< per worker fds, count * listen_socks				*/
 	GHashTable *params;                             /**< params for worker									*/
 	GQueue *active_workers;                         /**< linked list of spawned workers						*/
 	gpointer *ctx;                                  /**< worker's context									*/
@@ -263,6 +271,11 @@ enum rspamd_log_format_type {
 	RSPAMD_LOG_PUBLIC_GROUPS,
 	RSPAMD_LOG_MEMPOOL_SIZE,
 	RSPAMD_LOG_MEMPOOL_WASTE,
+	RSPAMD_LOG_CPU_TIME,
+	RSPAMD_LOG_LUA_HEAP,
+	RSPAMD_LOG_REDIS_REQ,
+	RSPAMD_LOG_REDIS_BYTES,
+	RSPAMD_LOG_RE_BYTES,
 };
 
 enum rspamd_log_format_flags {
@@ -322,6 +335,7 @@ struct rspamd_config_post_init_script {
 };
 
 struct rspamd_lang_detector;
+struct rspamd_composites_index;
 
 enum rspamd_config_settings_policy {
 	RSPAMD_SETTINGS_POLICY_DEFAULT = 0,
@@ -368,6 +382,7 @@ struct rspamd_config {
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean merged_hyperscan_headers;              /**< compile all header classes into a single database	*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 	gboolean enable_sessions_cache;                 /**< Enable session cache for debug						*/
@@ -384,10 +399,23 @@ struct rspamd_config {
 	gsize max_message;                              /**< maximum size for messages							*/
 	gsize max_pic_size;                             /**< maximum size for a picture to process				*/
 	gsize images_cache_size;                        /**< size of LRU cache for DCT data from images			*/
+	gsize archive_nested_limit;                     /**< bytes to extract from nested zip archives (0 to disable) */
+	guint url_cache_size;                           /**< size of LRU cache for parsed urls per worker (0 to disable) */
+	guint stem_cache_size;                          /**< size of LRU cache for stemmed words per worker (0 to disable) */
+	guint html_max_tags;                            /**< maximum tags added to a html tree					*/
+	guint html_max_depth;                           /**< maximum tags nesting in html (0 to disable)		*/
+	gdouble html_max_time;                          /**< maximum time of html parsing (0 to disable)		*/
 	gdouble task_timeout;                           /**< maximum message processing time					*/
+	gdouble regexp_time_budget;                     /**< pcre time per task before skipping expensive regexps */
+	guint mempool_profile_rate;                     /**< sample one of N pool allocations per site (0 to disable) */
+	gsize mempool_huge_chain_size;                  /**< minimum pool chain size backed by huge pages (0 to disable) */
 	gint default_max_shots;                         /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 	gint32 heartbeats_loss_max;                     /**< number of heartbeats lost to consider worker's termination */
 	gdouble heartbeat_interval;                     /**< interval for heartbeats for workers				*/
+	gdouble reload_ready_timeout;                   /**< time to wait for new workers to be ready on reload	*/
+	gdouble reload_overlap;                         /**< time old workers keep serving after new are ready	*/
+	gchar *net_replay_mode;                         /**< off, record or replay network replies				*/
+	gchar *net_replay_file;                         /**< file to record network replies to or replay from	*/
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
 	gint log_facility;                              /**< log facility in case of syslog						*/
@@ -396,6 +424,10 @@ struct rspamd_config {
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	gboolean log_silent_workers;                    /**< silence info messages from workers					*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	guint32 log_async_size;                         /**< size of per worker async log ring (0 to disable)	*/
+	gchar *log_structured_file;                     /**< path to msgpack task log or NULL					*/
+	guint32 log_structured_batch;                   /**< size of structured log batch in bytes				*/
+	gdouble log_structured_flush_time;              /**< maximum age of structured log batch				*/
 	const ucl_object_t *debug_ip_map;               /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GHashTable *debug_modules;                      /**< logging modules to debug							*/
@@ -418,6 +450,7 @@ struct rspamd_config {
 	ucl_object_t *doc_strings;                      /**< documentation strings for config options			*/
 	GPtrArray *c_modules;                           /**< list of C modules			*/
 	GHashTable *composite_symbols;                 /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< composites indexed by their symbols, built on the first task */
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -430,6 +463,8 @@ struct rspamd_config {
 	gdouble map_timeout;                            /**< maps watch timeout									*/
 	gdouble map_file_watch_multiplier;              /**< multiplier for watch timeout when maps are files	*/
 	gchar *maps_cache_dir;                          /**< where to save HTTP cached data						*/
+	gboolean maps_shared_images;                    /**< share compiled images of hash maps with workers	*/
+	guint maps_freeze_elts;                         /**< compile hash maps larger than this to cdb			*/
 
 	gdouble monitored_interval;                     /**< interval between monitored checks					*/
 	gboolean disable_monitored;                     /**< disable monitoring completely						*/
@@ -438,15 +473,22 @@ struct rspamd_config {
 	struct rspamd_symcache *cache;                    /**< symbols cache object								*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
 	gdouble cache_reload_time;                      /**< how often cache reload should be performed			*/
+	gboolean cache_cost_order;                      /**< order filters by expected benefit per time unit	*/
+	gboolean cache_score_bound_stop;                /**< stop filters when action cannot be changed			*/
+	guint cache_cpu_threads;                        /**< number of threads for cpu parallel symbols			*/
+	guint cache_trace_sample;                       /**< trace symbols of each N-th task (0 to disable)		*/
+	guint cache_trace_events;                       /**< size of the per worker trace events ring			*/
 	gchar *checksum;                               /**< real checksum of config file						*/
 	gpointer lua_state;                             /**< pointer to lua state								*/
 	gpointer lua_thread_pool;                       /**< pointer to lua thread (coroutine) pool				*/
 
 	gchar *rrd_file;                               /**< rrd file to store statistics						*/
+	gchar *timeseries_file;                        /**< time series file to store statistics				*/
 	gchar *history_file;                           /**< file to save rolling history						*/
 	gchar *stats_file;                           /**< file to save stats 						*/
 	gchar *tld_file;                               /**< file to load effective tld list from				*/
 	gchar *hs_cache_dir;                           /**< directory to save hyperscan databases				*/
+	gboolean lua_bytecode_cache;                   /**< cache compiled lua code in hs_cache_dir			*/
 	gchar *events_backend;                         /**< string representation of the events backend used	*/
 
 	gdouble dns_timeout;                            /**< timeout in milliseconds for waiting for dns reply	*/
@@ -455,6 +497,15 @@ struct rspamd_config {
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
 	gboolean enable_dnssec;                         /**< enable dnssec stub resolver						*/
+	guint32 dns_cache_size;                         /**< answers in the shared DNS cache, 0 to disable		*/
+	gdouble dns_cache_max_ttl;                      /**< maximum time to keep answers in the DNS cache		*/
+	gdouble dns_cache_negative_ttl;                 /**< time to keep NXDOMAIN and NODATA answers			*/
+	gdouble dns_cache_fail_ttl;                     /**< time to keep SERVFAIL answers						*/
+	struct rspamd_dns_shared_cache *dns_cache;      /**< DNS cache shared between processes					*/
+	guint32 shm_cache_size;                         /**< elements in the shared key value cache, 0 to disable	*/
+	struct rspamd_shm_cache *shm_cache;             /**< key value cache shared between processes			*/
+	guint32 bulk_yield_items;                       /**< filters started by a bulk task before it yields, 0 to disable */
+	GHashTable *bulk_settings_ids;                  /**< settings ids that make a task bulk					*/
 
 	guint upstream_max_errors;                        /**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;                    /**< rate of upstream errors							*/
@@ -471,6 +522,10 @@ struct rspamd_config {
 	guint lua_gc_step;                                /**< lua gc step 										*/
 	guint lua_gc_pause;                                /**< lua gc pause										*/
 	guint full_gc_iters;                            /**< iterations between full gc cycle					*/
+	guint lua_gc_task_step;                         /**< incremental gc step after each task (KB)			*/
+	gchar *lua_gc_mode;                             /**< lua gc mode: incremental or generational			*/
+	guint lua_threads_max;                          /**< maximum number of cached lua threads				*/
+	guint lua_profile_rate;                         /**< sample lua stacks each N instructions (0 to disable) */
 	guint max_lua_urls;                             /**< maximum number of urls to be passed to Lua			*/
 	guint max_urls;                                 /**< maximum number of urls to be processed in general	*/
 	gint max_recipients;                           /**< maximum number of recipients to be processed	*/
@@ -485,6 +540,7 @@ struct rspamd_config {
 	struct rspamd_external_libs_ctx *libs_ctx;        /**< context for external libraries						*/
 	struct rspamd_monitored_ctx *monitored_ctx;        /**< context for monitored resources					*/
 	struct rspamd_redis_pool *redis_pool;            /**< redis connectiosn pool								*/
+	guint redis_pool_shared_conns;                  /**< shared redis connections per server			*/
 
 	struct rspamd_re_cache *re_cache;                /**< static regexp cache								*/
 
@@ -497,8 +553,10 @@ struct rspamd_config {
 
 	gchar *ssl_ca_path;                                /**< path to CA certs									*/
 	gchar *ssl_ciphers;                                /**< set of preferred ciphers							*/
+	gboolean ssl_ktls;                                 /**< offload TLS records encryption to the kernel		*/
 	gchar *zstd_input_dictionary;                    /**< path to zstd input dictionary						*/
 	gchar *zstd_output_dictionary;                    /**< path to zstd output dictionary						*/
+	ucl_object_t *zstd_dictionary_map;              /**< map with the trained zstd dictionary				*/
 	ucl_object_t *neighbours;                        /**< other servers in the cluster						*/
 
 	struct rspamd_config_settings_elt *setting_ids;    /**< preprocessed settings ids							*/
@@ -820,9 +878,16 @@ struct rspamd_action *rspamd_config_get_action_by_type (struct rspamd_config *cf
 														enum rspamd_action_type type);
 
 int rspamd_config_ev_backend_get (struct rspamd_config *cfg);
+/**
+ * Returns events backend for the specific worker type, falling back to the
+ * global `events_backend` option
+ */
+int rspamd_config_worker_ev_backend_get (struct rspamd_config *cfg,
+										  struct rspamd_worker_conf *cf);
 const gchar * rspamd_config_ev_backend_to_string (int ev_backend, gboolean *effective);
 
 struct rspamd_external_libs_ctx;
+struct zstd_dictionary;
 
 /**
  * Initialize rspamd libraries
@@ -832,14 +897,36 @@ struct rspamd_external_libs_ctx *rspamd_init_libs (void);
 /**
  * Reset and initialize decompressor
  * @param ctx
+ * @param dict dictionary to use for the next stream (or NULL)
  */
-gboolean rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx);
+gboolean rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx,
+		struct zstd_dictionary *dict);
 
 /**
  * Reset and initialize compressor
  * @param ctx
+ * @param dict dictionary to use for the next stream (or NULL)
+ */
+gboolean rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx,
+		struct zstd_dictionary *dict);
+
+/**
+ * Find a known zstd dictionary by its id
+ * @param ctx
+ * @param id
+ * @return dictionary or NULL if it is not loaded locally
+ */
+struct zstd_dictionary *rspamd_libs_find_zstd_dictionary (
+		struct rspamd_external_libs_ctx *ctx, guint id);
+
+/**
+ * Returns dictionary to compress outbound scan requests: the newest one from
+ * `zstd_dictionary_map` or the input dictionary
+ * @param ctx
+ * @return dictionary or NULL if no dictionaries are configured
  */
-gboolean rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx);
+struct zstd_dictionary *rspamd_libs_request_zstd_dictionary (
+		struct rspamd_external_libs_ctx *ctx);
 
 /**
  * Destroy external libraries context
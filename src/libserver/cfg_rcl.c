@@ -308,6 +308,11 @@ rspamd_rcl_options_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 		/* We need to init this early */
 		rspamd_multipattern_library_init (cfg->hs_cache_dir);
 
+		if (cfg->lua_bytecode_cache && cfg->hs_cache_dir) {
+			/* Must be enabled before lua section loads any modules */
+			rspamd_lua_enable_bytecode_cache (cfg->lua_state, cfg->hs_cache_dir);
+		}
+
 		return TRUE;
 	}
 
@@ -1723,6 +1728,35 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 				RSPAMD_CL_FLAG_INT_32,
 				"Size of log buffer in bytes (for file logging)");
+		rspamd_rcl_add_default_handler (sub,
+				"async_buffer",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, log_async_size),
+				RSPAMD_CL_FLAG_INT_32,
+				"Size of per worker ring in bytes for asynchronous logging: "
+				"workers pass log lines to the main process that writes them "
+				"(0 to disable, default)");
+		rspamd_rcl_add_default_handler (sub,
+				"structured_log",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, log_structured_file),
+				RSPAMD_CL_FLAG_STRING_PATH,
+				"Write a msgpack record with symbols, scores, addresses and "
+				"timings for each scanned message to this file");
+		rspamd_rcl_add_default_handler (sub,
+				"structured_log_batch",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, log_structured_batch),
+				RSPAMD_CL_FLAG_INT_32,
+				"Write structured log records in batches of this size in bytes "
+				"(64k by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"structured_log_flush",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, log_structured_flush_time),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Write a structured log batch if it is older than this time "
+				"(1s by default)");
 		rspamd_rcl_add_default_handler (sub,
 				"log_urls",
 				rspamd_rcl_parse_struct_boolean,
@@ -1830,6 +1864,39 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, cache_reload_time),
 				RSPAMD_CL_FLAG_TIME_FLOAT,
 				"How often cache reload should be performed");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_cost_order",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_cost_order),
+				0,
+				"Order independent filters by hit rate multiplied by weight and "
+				"divided by the execution time");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_score_bound_stop",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_score_bound_stop),
+				0,
+				"Stop checking filters when the remaining symbols cannot change "
+				"the action (assuming each symbol is inserted once)");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_cpu_threads",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_cpu_threads),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of threads per worker used to run thread safe CPU bound "
+				"symbols (0 to run them in the event loop)");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_trace_sample",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_trace_sample),
+				RSPAMD_CL_FLAG_UINT,
+				"Record symbols execution timeline for each N-th task (0 to disable)");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_trace_events",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_trace_events),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of trace events kept by each worker (65536 by default)");
 		/* Old DNS configuration */
 		rspamd_rcl_add_default_handler (sub,
 				"dns_nameserver",
@@ -1939,6 +2006,18 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, maps_cache_dir),
 				0,
 				"Directory to save maps cached data (default: $DBDIR)");
+		rspamd_rcl_add_default_handler (sub,
+				"maps_shared_images",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, maps_shared_images),
+				0,
+				"Parse HTTP hash maps once and share compiled images with other workers");
+		rspamd_rcl_add_default_handler (sub,
+				"maps_freeze_elts",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, maps_freeze_elts),
+				RSPAMD_CL_FLAG_INT_32,
+				"Store hash maps with at least this number of elements in a compact read only format (default: 0 - disabled)");
 		rspamd_rcl_add_default_handler (sub,
 				"monitoring_watch_interval",
 				rspamd_rcl_parse_struct_time,
@@ -1969,6 +2048,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, rrd_file),
 				RSPAMD_CL_FLAG_STRING_PATH,
 				"Path to RRD file");
+		rspamd_rcl_add_default_handler (sub,
+				"timeseries",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, timeseries_file),
+				RSPAMD_CL_FLAG_STRING_PATH,
+				"Path to time series file used for graphs instead of RRD");
 		rspamd_rcl_add_default_handler (sub,
 				"stats_file",
 				rspamd_rcl_parse_struct_string,
@@ -2047,6 +2132,30 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, hs_cache_dir),
 				RSPAMD_CL_FLAG_STRING_PATH,
 				"Path directory where rspamd would save hyperscan cache");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_bytecode_cache",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_bytecode_cache),
+				0,
+				"Store compiled Lua modules and plugins in hs_cache_dir");
+		rspamd_rcl_add_default_handler (sub,
+				"shm_cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, shm_cache_size),
+				RSPAMD_CL_FLAG_INT_32,
+				"Number of elements in the key value cache shared by all workers (0 to disable)");
+		rspamd_rcl_add_default_handler (sub,
+				"bulk_yield_items",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, bulk_yield_items),
+				RSPAMD_CL_FLAG_INT_32,
+				"Number of filters a bulk task starts before it lets other tasks of a worker run (0 to disable)");
+		rspamd_rcl_add_default_handler (sub,
+				"bulk_settings_ids",
+				rspamd_rcl_parse_struct_string_list,
+				G_STRUCT_OFFSET (struct rspamd_config, bulk_settings_ids),
+				RSPAMD_CL_FLAG_STRING_LIST_HASH,
+				"Settings ids that mark tasks as bulk ones (processed with the lower priority)");
 		rspamd_rcl_add_default_handler (sub,
 				"history_rows",
 				rspamd_rcl_parse_struct_integer,
@@ -2065,6 +2174,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 				0,
 				"Use hyperscan in vectorized mode (experimental)");
+		rspamd_rcl_add_default_handler (sub,
+				"merged_hyperscan_headers",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, merged_hyperscan_headers),
+				0,
+				"Compile all header regexps into a single hyperscan database "
+				"scanning each header once (experimental)");
 		rspamd_rcl_add_default_handler (sub,
 				"cores_dir",
 				rspamd_rcl_parse_struct_string,
@@ -2125,6 +2241,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, ssl_ciphers),
 				0,
 				"List of ssl ciphers (e.g. HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4)");
+		rspamd_rcl_add_default_handler (sub,
+				"ssl_ktls",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, ssl_ktls),
+				0,
+				"Use kernel TLS offload for outbound connections if supported "
+				"by OpenSSL and kernel (default: false)");
 		rspamd_rcl_add_default_handler (sub,
 				"max_message",
 				rspamd_rcl_parse_struct_integer,
@@ -2155,6 +2278,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, zstd_output_dictionary),
 				RSPAMD_CL_FLAG_STRING_PATH,
 				"Dictionary for outbound zstd compression");
+		rspamd_rcl_add_default_handler (sub,
+				"zstd_dictionary_map",
+				rspamd_rcl_parse_struct_ucl,
+				G_STRUCT_OFFSET (struct rspamd_config, zstd_dictionary_map),
+				0,
+				"Map with a trained zstd dictionary for protocol compression, "
+				"negotiated by its id");
 		rspamd_rcl_add_default_handler (sub,
 				"compat_messages",
 				rspamd_rcl_parse_struct_boolean,
@@ -2179,6 +2309,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_sessions_cache),
 				0,
 				"Maximum number of sessions in cache before warning (default: 100)");
+		rspamd_rcl_add_default_handler (sub,
+				"redis_pool_shared_conns",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, redis_pool_shared_conns),
+				RSPAMD_CL_FLAG_UINT,
+				"Share up to this number of connections per redis server between "
+				"requests, commands are pipelined (0 to use a connection per request)");
 		rspamd_rcl_add_default_handler (sub,
 				"task_timeout",
 				rspamd_rcl_parse_struct_time,
@@ -2197,6 +2334,34 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, task_timeout),
 				RSPAMD_CL_FLAG_TIME_FLOAT,
 				"Maximum time for checking a message (alias for task_timeout)");
+		rspamd_rcl_add_default_handler (sub,
+				"regexp_time_budget",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, regexp_time_budget),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time spent in PCRE per message before expensive regexps are "
+				"skipped (default: 0, disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"archive_nested_limit",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, archive_nested_limit),
+				RSPAMD_CL_FLAG_INT_SIZE,
+				"Maximum number of bytes to decompress per zip archive to list "
+				"files of nested zip archives (default: 0, disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"mempool_profile_rate",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, mempool_profile_rate),
+				RSPAMD_CL_FLAG_UINT,
+				"Account one of N memory pool allocations per allocation site, "
+				"see `rspamadm control mempool` (default: 0, disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"mempool_huge_chain_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, mempool_huge_chain_size),
+				RSPAMD_CL_FLAG_INT_SIZE,
+				"Allocate memory pool chains of this size or larger from huge "
+				"pages (default: 0, disabled)");
 		rspamd_rcl_add_default_handler (sub,
 				"lua_gc_step",
 				rspamd_rcl_parse_struct_integer,
@@ -2215,12 +2380,67 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, full_gc_iters),
 				RSPAMD_CL_FLAG_UINT,
 				"Task scanned before memory gc is performed (default: 0 - disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_gc_task_step",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_gc_task_step),
+				RSPAMD_CL_FLAG_UINT,
+				"Perform incremental Lua gc step of this size (in KB) after each task "
+				"(default: 0 - disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_gc_mode",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_gc_mode),
+				0,
+				"Lua garbage-collector mode: incremental or generational "
+				"(Lua 5.4 only, default: incremental)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_threads_max",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_threads_max),
+				RSPAMD_CL_FLAG_UINT,
+				"Maximum number of Lua threads cached by a worker (default: 1024)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_profile_rate",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_profile_rate),
+				RSPAMD_CL_FLAG_UINT,
+				"Sample Lua stacks of scanners each N Lua instructions, "
+				"see `rspamadm control lua_profile` (default: 0 - disabled)");
 		rspamd_rcl_add_default_handler (sub,
 				"heartbeat_interval",
 				rspamd_rcl_parse_struct_time,
 				G_STRUCT_OFFSET (struct rspamd_config, heartbeat_interval),
 				RSPAMD_CL_FLAG_TIME_FLOAT,
 				"Time between workers heartbeats");
+		rspamd_rcl_add_default_handler (sub,
+				"reload_ready_timeout",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, reload_ready_timeout),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time to wait on reload for new workers to report they are ready "
+				"before terminating old ones (default: 30s, 0 - do not wait)");
+		rspamd_rcl_add_default_handler (sub,
+				"reload_overlap",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, reload_overlap),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time old workers keep serving on reload after new workers are "
+				"ready (default: 0)");
+		rspamd_rcl_add_default_handler (sub,
+				"net_replay_mode",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, net_replay_mode),
+				0,
+				"Record network replies (DNS, Redis, HTTP, fuzzy) to "
+				"`net_replay_file` or replay them without network: off, record "
+				"or replay (default: off)");
+		rspamd_rcl_add_default_handler (sub,
+				"net_replay_file",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, net_replay_file),
+				RSPAMD_CL_FLAG_STRING_PATH,
+				"File used by `net_replay_mode`");
 		rspamd_rcl_add_default_handler (sub,
 				"heartbeats_loss_max",
 				rspamd_rcl_parse_struct_integer,
@@ -2240,6 +2460,36 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_urls),
 				RSPAMD_CL_FLAG_INT_32,
 				"Maximum count of URLs to process to avoid DoS (default: 10240)");
+		rspamd_rcl_add_default_handler (sub,
+				"url_cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, url_cache_size),
+				RSPAMD_CL_FLAG_UINT,
+				"Count of parsed URLs cached by each worker (default: 1024, 0 - disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"stem_cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, stem_cache_size),
+				RSPAMD_CL_FLAG_UINT,
+				"Count of stemmed words cached by each worker (default: 16384, 0 - disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"html_max_tags",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, html_max_tags),
+				RSPAMD_CL_FLAG_UINT,
+				"Maximum count of tags added to a HTML part tree (default: 8192)");
+		rspamd_rcl_add_default_handler (sub,
+				"html_max_depth",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, html_max_depth),
+				RSPAMD_CL_FLAG_UINT,
+				"Stop parsing of a HTML part when tags are nested deeper (default: 0, disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"html_max_time",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, html_max_time),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Stop parsing of a HTML part when it takes longer (default: 0, disabled)");
 		rspamd_rcl_add_default_handler (sub,
 				"max_recipients",
 				rspamd_rcl_parse_struct_integer,
@@ -2319,6 +2569,30 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, enable_dnssec),
 				0,
 				"Enable DNSSEC support in Rspamd");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+				RSPAMD_CL_FLAG_INT_32,
+				"Number of answers in the DNS cache shared by all workers (0 to disable)");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_max_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Maximum time to keep answers in the shared DNS cache");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_negative_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time to keep NXDOMAIN and empty answers in the shared DNS cache");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_fail_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_fail_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time to keep SERVFAIL answers in the shared DNS cache (0 to disable)");
 
 
 		/* New upstreams configuration */
@@ -2440,6 +2714,55 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_worker_conf, rlimit_maxcore),
 				RSPAMD_CL_FLAG_INT_64,
 				"Max size of core file in bytes");
+		rspamd_rcl_add_default_handler (sub,
+				"cpu_affinity",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, cpu_affinity),
+				0,
+				"Pin workers to the list of CPUs (e.g. `0-3,8`) or spread them "
+				"over NUMA nodes if set to `numa`");
+		rspamd_rcl_add_default_handler (sub,
+				"cpu_affinity_spread",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, cpu_affinity_spread),
+				0,
+				"Pin worker N to the N-th CPU of `cpu_affinity` list instead of "
+				"the whole list");
+		rspamd_rcl_add_default_handler (sub,
+				"events_backend",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, events_backend),
+				0,
+				"Events backend for this worker type: kqueue, epoll, iouring, "
+				"select, poll or auto (default: global `events_backend`)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_gc_mode",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, lua_gc_mode),
+				0,
+				"Lua garbage-collector mode for this worker type "
+				"(default: global `lua_gc_mode`)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_gc_task_step",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, lua_gc_task_step),
+				RSPAMD_CL_FLAG_UINT,
+				"Lua gc step (in KB) after each task for this worker type "
+				"(default: global `lua_gc_task_step`)");
+		rspamd_rcl_add_default_handler (sub,
+				"reuseport",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, reuseport),
+				0,
+				"Give each worker its own SO_REUSEPORT TCP listen socket, so the "
+				"kernel balances connections between workers (Linux only)");
+		rspamd_rcl_add_default_handler (sub,
+				"reuseport_cpu",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, reuseport_cpu),
+				0,
+				"With `reuseport`, pass connections to the worker with the index "
+				"equal to the receiving CPU modulo `count` (use with `cpu_affinity`)");
 		rspamd_rcl_add_default_handler (sub,
 				"enabled",
 				rspamd_rcl_parse_struct_boolean,
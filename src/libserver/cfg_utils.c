@@ -30,6 +30,9 @@
 #include "unix-std.h"
 #include "libutil/multipattern.h"
 #include "monitored.h"
+#include "dns.h"
+#include "libutil/shm_cache.h"
+#include "worker_util.h"
 #include "ref.h"
 #include "cryptobox.h"
 #include "ssl_util.h"
@@ -166,6 +169,9 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->dns_retransmits = 5;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	cfg->dns_cache_max_ttl = 3600.0;
+	cfg->dns_cache_negative_ttl = 60.0;
+	cfg->dns_cache_fail_ttl = 10.0;
 
 	/* Add all internal actions to keep compatibility */
 	for (int i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
@@ -217,9 +223,13 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 
 	cfg->dns_max_requests = 64;
 	cfg->history_rows = 200;
+	cfg->bulk_yield_items = 16;
 	cfg->log_error_elts = 10;
 	cfg->log_error_elt_maxlen = 1000;
+	cfg->log_structured_batch = 64 * 1024;
+	cfg->log_structured_flush_time = 1.0;
 	cfg->cache_reload_time = 30.0;
+	cfg->cache_trace_events = 65536;
 	cfg->max_lua_urls = 1024;
 	cfg->max_urls = cfg->max_lua_urls * 10;
 	cfg->max_recipients = 1024;
@@ -263,6 +273,9 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
 	cfg->max_pic_size = DEFAULT_MAX_PIC;
 	cfg->images_cache_size = 256;
+	cfg->url_cache_size = 1024;
+	cfg->stem_cache_size = 16384;
+	cfg->html_max_tags = 8192;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init ();
 	cfg->neighbours = ucl_object_typed_new (UCL_OBJECT);
 #ifdef WITH_HIREDIS
@@ -273,6 +286,7 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->maps_cache_dir = rspamd_mempool_strdup (cfg->cfg_pool, RSPAMD_DBDIR);
 	cfg->c_modules = g_ptr_array_new ();
 	cfg->heartbeat_interval = 10.0;
+	cfg->reload_ready_timeout = 30.0;
 
 	REF_INIT_RETAIN (cfg, rspamd_config_free);
 
@@ -552,6 +566,21 @@ rspamd_config_process_var (struct rspamd_config *cfg, const rspamd_ftok_t *var,
 	else if (rspamd_ftok_cstr_equal (&tok, "mempool_waste", TRUE)) {
 		type = RSPAMD_LOG_MEMPOOL_WASTE;
 	}
+	else if (rspamd_ftok_cstr_equal (&tok, "cpu_time", TRUE)) {
+		type = RSPAMD_LOG_CPU_TIME;
+	}
+	else if (rspamd_ftok_cstr_equal (&tok, "lua_heap", TRUE)) {
+		type = RSPAMD_LOG_LUA_HEAP;
+	}
+	else if (rspamd_ftok_cstr_equal (&tok, "redis_req", TRUE)) {
+		type = RSPAMD_LOG_REDIS_REQ;
+	}
+	else if (rspamd_ftok_cstr_equal (&tok, "redis_bytes", TRUE)) {
+		type = RSPAMD_LOG_REDIS_BYTES;
+	}
+	else if (rspamd_ftok_cstr_equal (&tok, "re_bytes", TRUE)) {
+		type = RSPAMD_LOG_RE_BYTES;
+	}
 	else {
 		msg_err_config ("unknown log variable: %T", &tok);
 		return FALSE;
@@ -868,7 +897,8 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 			rspamd_url_init (NULL);
 		}
 		else {
-			rspamd_url_init (cfg->tld_file);
+			/* Compile suffixes while the rest of config is initialised */
+			rspamd_url_init_async (cfg->tld_file);
 		}
 
 		rspamd_mempool_add_destructor (cfg->cfg_pool, rspamd_urls_config_dtor,
@@ -900,6 +930,15 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 	if (opts & RSPAMD_CONFIG_INIT_LIBS) {
 		/* Config other libraries */
 		rspamd_config_libs (cfg->libs_ctx, cfg);
+		/* Workers inherit the shared DNS cache */
+		cfg->dns_cache = rspamd_dns_shared_cache_new (cfg);
+
+		if (cfg->shm_cache_size > 0) {
+			cfg->shm_cache = rspamd_shm_cache_new (cfg->cfg_pool,
+					cfg->shm_cache_size);
+			msg_info_config ("created shared key value cache for %ud elements",
+					cfg->shm_cache_size);
+		}
 	}
 
 	/* Validate cache */
@@ -938,6 +977,11 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 		rspamd_map_preload (cfg);
 	}
 
+	if (opts & RSPAMD_CONFIG_INIT_URL) {
+		/* Workers are forked after this function, so no threads are left */
+		rspamd_url_init_wait ();
+	}
+
 	return ret;
 }
 
@@ -1121,6 +1165,11 @@ rspamd_worker_conf_dtor (struct rspamd_worker_conf *wcf)
 			g_free (cnf);
 		}
 
+		if (wcf->reuseport_fds) {
+			rspamd_worker_close_reuseport_socks (wcf);
+			g_array_free (wcf->reuseport_fds, TRUE);
+		}
+
 		ucl_object_unref (wcf->options);
 		g_queue_free (wcf->active_workers);
 		g_hash_table_unref (wcf->params);
@@ -2575,61 +2624,80 @@ rspamd_config_register_settings_id (struct rspamd_config *cfg,
 	}
 }
 
-int
-rspamd_config_ev_backend_get (struct rspamd_config *cfg)
+static int
+rspamd_config_ev_backend_parse (struct rspamd_config *cfg,
+		const gchar *backend)
 {
 #define AUTO_BACKEND (ev_supported_backends () & ~EVBACKEND_IOURING)
-	if (cfg == NULL || cfg->events_backend == NULL) {
+	if (backend == NULL) {
 		return AUTO_BACKEND;
 	}
 
-	if (strcmp (cfg->events_backend, "auto") == 0) {
+	if (strcmp (backend, "auto") == 0) {
 		return AUTO_BACKEND;
 	}
-	else if (strcmp (cfg->events_backend, "epoll") == 0) {
+	else if (strcmp (backend, "epoll") == 0) {
 		if (ev_supported_backends () & EVBACKEND_EPOLL) {
 			return EVBACKEND_EPOLL;
 		}
 		else {
 			msg_warn_config ("unsupported events_backend: %s; defaulting to auto",
-					cfg->events_backend);
+					backend);
 			return AUTO_BACKEND;
 		}
 	}
-	else if (strcmp (cfg->events_backend, "iouring") == 0) {
+	else if (strcmp (backend, "iouring") == 0) {
 		if (ev_supported_backends () & EVBACKEND_IOURING) {
 			return EVBACKEND_IOURING;
 		}
 		else {
 			msg_warn_config ("unsupported events_backend: %s; defaulting to auto",
-					cfg->events_backend);
+					backend);
 			return AUTO_BACKEND;
 		}
 	}
-	else if (strcmp (cfg->events_backend, "kqueue") == 0) {
+	else if (strcmp (backend, "kqueue") == 0) {
 		if (ev_supported_backends () & EVBACKEND_KQUEUE) {
 			return EVBACKEND_KQUEUE;
 		}
 		else {
 			msg_warn_config ("unsupported events_backend: %s; defaulting to auto",
-					cfg->events_backend);
+					backend);
 			return AUTO_BACKEND;
 		}
 	}
-	else if (strcmp (cfg->events_backend, "poll") == 0) {
+	else if (strcmp (backend, "poll") == 0) {
 		return EVBACKEND_POLL;
 	}
-	else if (strcmp (cfg->events_backend, "select") == 0) {
+	else if (strcmp (backend, "select") == 0) {
 		return EVBACKEND_SELECT;
 	}
 	else {
 		msg_warn_config ("unknown events_backend: %s; defaulting to auto",
-				cfg->events_backend);
+				backend);
 	}
 
 	return AUTO_BACKEND;
 }
 
+int
+rspamd_config_ev_backend_get (struct rspamd_config *cfg)
+{
+	return rspamd_config_ev_backend_parse (cfg,
+			cfg ? cfg->events_backend : NULL);
+}
+
+int
+rspamd_config_worker_ev_backend_get (struct rspamd_config *cfg,
+		struct rspamd_worker_conf *cf)
+{
+	if (cf && cf->events_backend) {
+		return rspamd_config_ev_backend_parse (cfg, cf->events_backend);
+	}
+
+	return rspamd_config_ev_backend_get (cfg);
+}
+
 const gchar *
 rspamd_config_ev_backend_to_string (int ev_backend, gboolean *effective)
 {
@@ -2686,6 +2754,7 @@ rspamd_init_libs (void)
 
 	ctx = g_malloc0 (sizeof (*ctx));
 	ctx->crypto_ctx = rspamd_cryptobox_init ();
+	ctx->map_dicts = g_queue_new ();
 	ottery_cfg = g_malloc0 (ottery_get_sizeof_config ());
 	ottery_config_init (ottery_cfg);
 	ctx->ottery_cfg = ottery_cfg;
@@ -2746,6 +2815,48 @@ rspamd_init_libs (void)
 	return ctx;
 }
 
+/* Number of dictionaries from map to keep for peers that are not updated yet */
+#define RSPAMD_ZSTD_MAP_DICTS_MAX 4
+
+static void
+rspamd_free_zstd_dictionary (struct zstd_dictionary *dict)
+{
+	if (dict) {
+		if (dict->ddict) {
+			ZSTD_freeDDict (dict->ddict);
+		}
+
+		if (dict->cdict) {
+			ZSTD_freeCDict (dict->cdict);
+		}
+
+		if (dict->mapped) {
+			munmap (dict->dict, dict->size);
+		}
+		else {
+			g_free (dict->dict);
+		}
+
+		g_free (dict);
+	}
+}
+
+static gboolean
+rspamd_prepare_zstd_dictionary (struct zstd_dictionary *dict)
+{
+	/* Raw content dictionaries have no id, so they cannot be negotiated */
+	dict->id = ZSTD_getDictID_fromDict (dict->dict, dict->size);
+
+	if (dict->id == 0) {
+		return FALSE;
+	}
+
+	dict->ddict = ZSTD_createDDict (dict->dict, dict->size);
+	dict->cdict = ZSTD_createCDict (dict->dict, dict->size, 1);
+
+	return dict->ddict != NULL && dict->cdict != NULL;
+}
+
 static struct zstd_dictionary *
 rspamd_open_zstd_dictionary (const char *path)
 {
@@ -2760,10 +2871,10 @@ rspamd_open_zstd_dictionary (const char *path)
 		return NULL;
 	}
 
-	dict->id = -1;
+	dict->mapped = TRUE;
 
-	if (dict->id == 0) {
-		g_free (dict);
+	if (!rspamd_prepare_zstd_dictionary (dict)) {
+		rspamd_free_zstd_dictionary (dict);
 
 		return NULL;
 	}
@@ -2771,13 +2882,132 @@ rspamd_open_zstd_dictionary (const char *path)
 	return dict;
 }
 
+struct rspamd_zstd_dict_map_data {
+	struct rspamd_external_libs_ctx *ctx;
+	rspamd_fstring_t *buf;
+};
+
+static gchar *
+rspamd_zstd_dict_map_read (gchar *chunk, gint len,
+		struct map_cb_data *data,
+		gboolean final)
+{
+	struct rspamd_zstd_dict_map_data *md;
+
+	if (data->cur_data == NULL) {
+		/* The same structure is reused between map updates */
+		data->cur_data = data->prev_data;
+		data->prev_data = NULL;
+	}
+
+	md = (struct rspamd_zstd_dict_map_data *)data->cur_data;
+
+	if (md->buf == NULL) {
+		md->buf = rspamd_fstring_new_init (chunk, len);
+	}
+	else {
+		md->buf = rspamd_fstring_append (md->buf, chunk, len);
+	}
+
+	return NULL;
+}
+
 static void
-rspamd_free_zstd_dictionary (struct zstd_dictionary *dict)
+rspamd_zstd_dict_map_fin (struct map_cb_data *data, void **target)
 {
-	if (dict) {
-		munmap (dict->dict, dict->size);
-		g_free (dict);
+	struct rspamd_zstd_dict_map_data *md;
+	struct zstd_dictionary *dict;
+	struct rspamd_map *map = data->map;
+
+	if (data->cur_data == NULL) {
+		msg_err_map ("no data read for map");
+		return;
+	}
+
+	md = (struct rspamd_zstd_dict_map_data *)data->cur_data;
+
+	if (md->buf != NULL && md->buf->len > 0) {
+		dict = g_malloc0 (sizeof (*dict));
+		dict->size = md->buf->len;
+		dict->dict = g_malloc (dict->size);
+		memcpy (dict->dict, md->buf->str, dict->size);
+
+		if (!rspamd_prepare_zstd_dictionary (dict)) {
+			msg_err_map ("cannot load zstd dictionary of %z bytes", dict->size);
+			rspamd_free_zstd_dictionary (dict);
+		}
+		else if (rspamd_libs_find_zstd_dictionary (md->ctx, dict->id) != NULL) {
+			msg_info_map ("zstd dictionary %ud is already loaded", dict->id);
+			rspamd_free_zstd_dictionary (dict);
+		}
+		else {
+			msg_info_map ("loaded zstd dictionary %ud of %z bytes",
+					dict->id, dict->size);
+			g_queue_push_head (md->ctx->map_dicts, dict);
+
+			while (md->ctx->map_dicts->length > RSPAMD_ZSTD_MAP_DICTS_MAX) {
+				rspamd_free_zstd_dictionary (
+						g_queue_pop_tail (md->ctx->map_dicts));
+			}
+		}
+
+		md->buf = rspamd_fstring_assign (md->buf, "", 0);
+	}
+
+	if (target) {
+		*target = data->cur_data;
+	}
+}
+
+static void
+rspamd_zstd_dict_map_dtor (struct map_cb_data *data)
+{
+	struct rspamd_zstd_dict_map_data *md;
+
+	if (data->cur_data) {
+		md = (struct rspamd_zstd_dict_map_data *)data->cur_data;
+
+		if (md->buf) {
+			rspamd_fstring_free (md->buf);
+			md->buf = NULL;
+		}
+	}
+}
+
+struct zstd_dictionary *
+rspamd_libs_find_zstd_dictionary (struct rspamd_external_libs_ctx *ctx,
+		guint id)
+{
+	struct zstd_dictionary *dict;
+	GList *cur;
+
+	if (ctx->in_dict && ctx->in_dict->id == id) {
+		return ctx->in_dict;
+	}
+
+	if (ctx->out_dict && ctx->out_dict->id == id) {
+		return ctx->out_dict;
+	}
+
+	for (cur = ctx->map_dicts->head; cur != NULL; cur = g_list_next (cur)) {
+		dict = (struct zstd_dictionary *)cur->data;
+
+		if (dict->id == id) {
+			return dict;
+		}
+	}
+
+	return NULL;
+}
+
+struct zstd_dictionary *
+rspamd_libs_request_zstd_dictionary (struct rspamd_external_libs_ctx *ctx)
+{
+	if (ctx->map_dicts->head) {
+		return (struct zstd_dictionary *)ctx->map_dicts->head->data;
 	}
+
+	return ctx->in_dict;
 }
 
 #ifdef HAVE_OPENBLAS_SET_NUM_THREADS
@@ -2805,9 +3035,6 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 					NULL, "local addresses");
 		}
 
-		rspamd_free_zstd_dictionary (ctx->in_dict);
-		rspamd_free_zstd_dictionary (ctx->out_dict);
-
 		if (ctx->out_zstream) {
 			ZSTD_freeCStream (ctx->out_zstream);
 			ctx->out_zstream = NULL;
@@ -2818,6 +3045,11 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 			ctx->in_zstream = NULL;
 		}
 
+		rspamd_free_zstd_dictionary (ctx->in_dict);
+		rspamd_free_zstd_dictionary (ctx->out_dict);
+		ctx->in_dict = NULL;
+		ctx->out_dict = NULL;
+
 		if (cfg->zstd_input_dictionary) {
 			ctx->in_dict = rspamd_open_zstd_dictionary (
 					cfg->zstd_input_dictionary);
@@ -2837,6 +3069,26 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 			}
 		}
 
+		if (cfg->zstd_dictionary_map) {
+			struct rspamd_zstd_dict_map_data *md, **pmd;
+
+			md = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*md));
+			md->ctx = ctx;
+			pmd = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*pmd));
+			*pmd = md;
+
+			if (!rspamd_map_add_from_ucl (cfg, cfg->zstd_dictionary_map,
+					"zstd dictionary",
+					rspamd_zstd_dict_map_read,
+					rspamd_zstd_dict_map_fin,
+					rspamd_zstd_dict_map_dtor,
+					(void **)pmd,
+					NULL, RSPAMD_MAP_DEFAULT)) {
+				msg_err_config ("cannot load zstd dictionary map from %s",
+						ucl_object_tostring_forced (cfg->zstd_dictionary_map));
+			}
+		}
+
 		if (cfg->fips_mode) {
 #ifdef HAVE_FIPS_MODE
 			int mode = FIPS_mode ();
@@ -2902,7 +3154,8 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 }
 
 gboolean
-rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
+rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx,
+		struct zstd_dictionary *dict)
 {
 	gsize r;
 
@@ -2912,6 +3165,12 @@ rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
 	else {
 		r = ZSTD_resetDStream (ctx->in_zstream);
 
+		if (!ZSTD_isError (r)) {
+			/* Dictionary reference survives resets, so it is always replaced */
+			r = ZSTD_DCtx_refDDict (ctx->in_zstream,
+					dict ? dict->ddict : NULL);
+		}
+
 		if (ZSTD_isError (r)) {
 			msg_err ("cannot init decompression stream: %s",
 					ZSTD_getErrorName (r));
@@ -2926,7 +3185,8 @@ rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
 }
 
 gboolean
-rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx)
+rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx,
+		struct zstd_dictionary *dict)
 {
 	gsize r;
 
@@ -2934,9 +3194,14 @@ rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx)
 		return FALSE;
 	}
 	else {
-		/* Dictionary will be reused automatically if specified */
+		/* Dictionary reference survives resets, so it is always replaced */
 		r = ZSTD_resetCStream (ctx->out_zstream, 0);
 
+		if (!ZSTD_isError (r)) {
+			r = ZSTD_CCtx_refCDict (ctx->out_zstream,
+					dict ? dict->cdict : NULL);
+		}
+
 		if (ZSTD_isError (r)) {
 			msg_err ("cannot init compression stream: %s",
 					ZSTD_getErrorName (r));
@@ -2963,9 +3228,6 @@ rspamd_deinit_libs (struct rspamd_external_libs_ctx *ctx)
 		rspamd_ssl_ctx_free (ctx->ssl_ctx_noverify);
 #endif
 		rspamd_inet_library_destroy ();
-		rspamd_free_zstd_dictionary (ctx->in_dict);
-		rspamd_free_zstd_dictionary (ctx->out_dict);
-
 		if (ctx->out_zstream) {
 			ZSTD_freeCStream (ctx->out_zstream);
 		}
@@ -2974,6 +3236,11 @@ rspamd_deinit_libs (struct rspamd_external_libs_ctx *ctx)
 			ZSTD_freeDStream (ctx->in_zstream);
 		}
 
+		rspamd_free_zstd_dictionary (ctx->in_dict);
+		rspamd_free_zstd_dictionary (ctx->out_dict);
+		g_queue_free_full (ctx->map_dicts,
+				(GDestroyNotify)rspamd_free_zstd_dictionary);
+
 		rspamd_cryptobox_deinit (ctx->crypto_ctx);
 
 		g_free (ctx);
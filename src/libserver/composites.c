@@ -49,6 +49,7 @@ struct composites_data {
 	struct rspamd_scan_result *metric_res;
 	GHashTable *symbols_to_remove;
 	guint8 *checked;
+	guint8 *relevant; /* composites that refer to some of the task's symbols */
 	struct composites_data *next;
 };
 
@@ -84,6 +85,17 @@ enum rspamd_composite_action {
 	RSPAMD_COMPOSITE_REMOVE_FORCED = (1 << 2)
 };
 
+/*
+ * Composites indexed by the symbols they refer to: a composite that is false
+ * when none of its symbols are found is not evaluated unless some of these
+ * symbols are in a result
+ */
+struct rspamd_composites_index {
+	GHashTable *by_symbol; /* symbol name -> GArray of composite ids */
+	guint8 *always; /* composites that should be evaluated for each task */
+	guint ncomposites;
+};
+
 struct symbol_remove_data {
 	const gchar *sym;
 	struct rspamd_composite *comp;
@@ -809,6 +821,16 @@ composites_foreach_callback (gpointer key, gpointer value, void *data)
 				return;
 			}
 
+			if (isclr (cd->relevant, comp->id)) {
+				/* None of its symbols are found, so it cannot be true */
+				msg_debug_composites ("composite %s refers to no symbols "
+						"of the result, skip it", cd->composite->sym);
+				setbit (cd->checked, comp->id * 2);
+				clrbit (cd->checked, comp->id * 2 + 1);
+
+				return;
+			}
+
 			rc = rspamd_process_expression (comp->expr, RSPAMD_EXPRESSION_FLAG_NOOPT,
 					cd);
 
@@ -915,6 +937,10 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 
 		if (want_remove_symbol || want_forced) {
 			ms->flags |= RSPAMD_SYMBOL_RESULT_IGNORED;
+
+			if (cd->metric_res->name == NULL && ms->sym) {
+				rspamd_symcache_item_set_result (task, ms->sym->cache_item, FALSE);
+			}
 			msg_debug_composites ("%s: %s remove symbol %s (score %.2f), "
 								  "score removal affected by %s, symbol removal affected by %s",
 					cd->metric_res->name,
@@ -924,11 +950,163 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 	}
 }
 
+struct composites_index_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composites_index *idx;
+	struct rspamd_composite *comp;
+};
+
+static gdouble
+composites_index_zero_atom (gpointer ud, rspamd_expression_atom_t *atom)
+{
+	return 0;
+}
+
+static void
+composites_index_add_symbol (struct composites_index_cbdata *cbd,
+		const gchar *sym)
+{
+	GArray *ids;
+	gint id = cbd->comp->id;
+
+	if (g_hash_table_lookup (cbd->cfg->composite_symbols, sym) != NULL) {
+		/* Dependencies are inserted while composites are processed */
+		setbit (cbd->idx->always, id);
+
+		return;
+	}
+
+	ids = g_hash_table_lookup (cbd->idx->by_symbol, sym);
+
+	if (ids == NULL) {
+		ids = g_array_sized_new (FALSE, FALSE, sizeof (gint), 2);
+		g_hash_table_insert (cbd->idx->by_symbol,
+				rspamd_mempool_strdup (cbd->cfg->cfg_pool, sym), ids);
+	}
+	else if (ids->len > 0 && g_array_index (ids, gint, ids->len - 1) == id) {
+		return;
+	}
+
+	g_array_append_val (ids, id);
+}
+
+static void
+composites_index_atom_cb (const rspamd_ftok_t *atom, gpointer ud)
+{
+	struct composites_index_cbdata *cbd = ud;
+	struct rspamd_symbols_group *gr = NULL;
+	struct rspamd_symbol *sdef;
+	const gchar *p = atom->begin, *end = atom->begin + atom->len;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar *sym;
+
+	/* Skip policy prefixes, e.g. `~SYMBOL`, and options */
+	while (p < end && !g_ascii_isalnum (*p)) {
+		p ++;
+	}
+
+	sym = g_strndup (p, rspamd_memcspn (p, "[", end - p));
+
+	if (strncmp (sym, "g:", 2) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 2);
+	}
+	else if (strncmp (sym, "g+:", 3) == 0 || strncmp (sym, "g-:", 3) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 3);
+	}
+	else {
+		composites_index_add_symbol (cbd, sym);
+	}
+
+	if (gr != NULL) {
+		g_hash_table_iter_init (&it, gr->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+			composites_index_add_symbol (cbd, sdef->name);
+		}
+	}
+
+	g_free (sym);
+}
+
+static struct rspamd_composites_index *
+composites_index_build (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct composites_index_cbdata cbd;
+	GHashTableIter it;
+	gpointer k, v;
+	guint nalways = 0;
+
+	idx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*idx));
+	idx->ncomposites = g_hash_table_size (cfg->composite_symbols);
+	idx->always = rspamd_mempool_alloc0 (cfg->cfg_pool,
+			NBYTES (idx->ncomposites));
+	idx->by_symbol = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, rspamd_array_free_hard);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, idx->by_symbol);
+
+	cbd.cfg = cfg;
+	cbd.idx = idx;
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		cbd.comp = v;
+
+		/* E.g. `!A` or `A + B < 1` are true when nothing is found */
+		if (rspamd_process_expression_closure (cbd.comp->expr,
+				composites_index_zero_atom, RSPAMD_EXPRESSION_FLAG_NOOPT,
+				NULL, NULL) != 0) {
+			setbit (idx->always, cbd.comp->id);
+		}
+		else {
+			rspamd_expression_atom_foreach (cbd.comp->expr,
+					composites_index_atom_cb, &cbd);
+		}
+
+		if (isset (idx->always, cbd.comp->id)) {
+			nalways ++;
+		}
+	}
+
+	msg_info_config ("indexed %ud composites by %ud symbols, "
+			"%ud composites are checked for each task",
+			idx->ncomposites, g_hash_table_size (idx->by_symbol), nalways);
+
+	return idx;
+}
+
+static void
+composites_mark_relevant (gpointer key, gpointer value, gpointer ud)
+{
+	struct composites_data *cd = ud;
+	struct rspamd_composites_index *idx = cd->task->cfg->composites_index;
+	GArray *ids;
+	guint i;
+
+	ids = g_hash_table_lookup (idx->by_symbol, key);
+
+	if (ids) {
+		for (i = 0; i < ids->len; i ++) {
+			setbit (cd->relevant, g_array_index (ids, gint, i));
+		}
+	}
+}
+
 static void
 composites_metric_callback (struct rspamd_task *task)
 {
 	struct composites_data *cd, *first_cd = NULL;
 	struct rspamd_scan_result *mres;
+	struct rspamd_composites_index *idx;
+
+	if (task->cfg->composites_index == NULL) {
+		task->cfg->composites_index = composites_index_build (task->cfg);
+	}
+
+	idx = task->cfg->composites_index;
 
 	DL_FOREACH (task->result, mres) {
 		cd = rspamd_mempool_alloc (task->task_pool, sizeof (struct composites_data));
@@ -938,6 +1116,11 @@ composites_metric_callback (struct rspamd_task *task)
 		cd->checked =
 				rspamd_mempool_alloc0 (task->task_pool,
 						NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
+		cd->relevant = rspamd_mempool_alloc (task->task_pool,
+				NBYTES (idx->ncomposites));
+		memcpy (cd->relevant, idx->always, NBYTES (idx->ncomposites));
+		rspamd_task_symbol_result_foreach (task, mres, composites_mark_relevant,
+				cd);
 
 		/* Process hash table */
 		rspamd_symcache_composites_foreach (task,
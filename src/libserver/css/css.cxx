@@ -24,12 +24,23 @@
 
 rspamd_css
 rspamd_css_parse_style (rspamd_mempool_t *pool, const guchar *begin, gsize len,
+						rspamd_css existing,
 						GError **err)
 {
-	auto parse_res = rspamd::css::parse_css(pool, {(const char* )begin, len});
+	auto *existing_sheet = reinterpret_cast<rspamd::css::css_style_sheet *>(existing);
+	auto parse_res = rspamd::css::parse_css(pool, {(const char* )begin, len},
+			std::unique_ptr<rspamd::css::css_style_sheet>(existing_sheet));
 
 	if (parse_res.has_value()) {
-		return reinterpret_cast<rspamd_css>(parse_res.value().release());
+		auto *sheet = parse_res.value().release();
+
+		if (sheet != existing_sheet) {
+			rspamd_mempool_add_destructor (pool, [](void *p) {
+				delete reinterpret_cast<rspamd::css::css_style_sheet *>(p);
+			}, sheet);
+		}
+
+		return reinterpret_cast<rspamd_css>(sheet);
 	}
 	else {
 		g_set_error(err, g_quark_from_static_string("css"),
@@ -25,9 +25,15 @@ extern "C" {
 #endif
 typedef void * rspamd_css;
 
+/*
+ * Parses css style sheet adding its rules to `existing` (if not NULL).
+ * Returned style sheet is owned by the pool
+ */
 rspamd_css rspamd_css_parse_style (rspamd_mempool_t *pool,
 								   const guchar *begin,
-								   gsize len, GError **err);
+								   gsize len,
+								   rspamd_css existing,
+								   GError **err);
 
 /*
  * Unescape css
@@ -147,6 +147,9 @@ class css_parser {
 public:
 	css_parser(void) = delete; /* Require mempool to be set for logging */
 	explicit css_parser(rspamd_mempool_t *pool) : pool (pool) {}
+	/* Rules are appended to an existing style sheet */
+	css_parser(std::unique_ptr<css_style_sheet> &&existing,
+			   rspamd_mempool_t *pool) : style_object(std::move(existing)), pool (pool) {}
 
 	std::unique_ptr<css_consumed_block> consume_css_blocks(const std::string_view &sv);
 	bool consume_input(const std::string_view &sv);
@@ -559,7 +562,9 @@ bool css_parser::consume_input(const std::string_view &sv)
 		return false;
 	}
 
-	style_object = std::make_unique<css_style_sheet>(pool);
+	if (!style_object) {
+		style_object = std::make_unique<css_style_sheet>(pool);
+	}
 
 	for (auto &&rule : rules) {
 		/*
@@ -680,14 +685,23 @@ get_selectors_parser_functor(rspamd_mempool_t *pool,
 /*
  * Wrapper for the parser
  */
-auto parse_css(rspamd_mempool_t *pool, const std::string_view &st) ->
+auto parse_css(rspamd_mempool_t *pool, const std::string_view &st,
+			   std::unique_ptr<css_style_sheet> other) ->
 		tl::expected<std::unique_ptr<css_style_sheet>, css_parse_error>
 {
-	css_parser parser(pool);
+	css_parser parser(std::move(other), pool);
 
 	if (parser.consume_input(st)) {
 		return parser.get_object_maybe();
 	}
+	else {
+		/* Existing style sheet is returned untouched */
+		auto maybe_existing = parser.get_object_maybe();
+
+		if (maybe_existing.has_value()) {
+			return maybe_existing;
+		}
+	}
 
 	return tl::make_unexpected(css_parse_error{css_parse_error_type::PARSE_ERROR_INVALID_SYNTAX,
 											"cannot parse input"});
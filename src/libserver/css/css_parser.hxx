@@ -184,7 +184,11 @@ extern const css_consumed_block css_parser_eof_block;
 using blocks_gen_functor = std::function<const css_consumed_block &(void)>;
 
 class css_style_sheet;
-auto parse_css(rspamd_mempool_t *pool, const std::string_view &st) ->
+/*
+ * Parses css from `st`, if `other` is specified, then rules are added to it
+ */
+auto parse_css(rspamd_mempool_t *pool, const std::string_view &st,
+			   std::unique_ptr<css_style_sheet> other = nullptr) ->
 	tl::expected<std::unique_ptr<css_style_sheet>, css_parse_error>;
 
 auto get_selectors_parser_functor(rspamd_mempool_t *pool,
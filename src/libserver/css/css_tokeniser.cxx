@@ -364,8 +364,20 @@ auto css_tokeniser::consume_number() -> struct css_parser_token
 
 		/* I wish it was supported properly */
 		//auto conv_res = std::from_chars(&input[offset], &input[i], num);
-		std::string numbuf{&input[offset], (i - offset)};
-		num = std::stod(numbuf);
+		/*
+		 * Numbers are converted from a stack copy: it is allocations free
+		 * and, unlike std::stod, it neither depends on locale nor throws
+		 */
+		char numbuf[128];
+		auto numlen = i - offset;
+
+		if (numlen >= sizeof(numbuf)) {
+			numlen = sizeof(numbuf) - 1;
+		}
+
+		memcpy(numbuf, &input[offset], numlen);
+		numbuf[numlen] = '\0';
+		num = g_ascii_strtod(numbuf, nullptr);
 		offset = i;
 
 		auto ret = make_token<css_parser_token::token_type::number_token>(num);
@@ -26,6 +26,10 @@
 #include <openssl/rsa.h>
 #include <openssl/engine.h>
 
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
 /* special DNS tokens */
 #define DKIM_DNSKEYNAME     "_domainkey"
 
@@ -145,6 +149,15 @@ struct rspamd_dkim_context_s {
 	gchar *dns_key;
 	enum rspamd_arc_seal_cv cv;
 	const gchar *dkim_header;
+	/* Public key verification, might be done in another thread */
+	rspamd_dkim_key_t *verify_key;
+	struct rspamd_dkim_verify_cache *vcache;
+	guint64 vhash[2];
+	gsize verify_dlen;
+	gint verify_nid;
+	gboolean verify_pending;
+	gboolean verify_failed;
+	guchar verify_digest[EVP_MAX_MD_SIZE];
 };
 
 #define RSPAMD_DKIM_KEY_ID_LEN 16
@@ -170,6 +183,13 @@ struct rspamd_dkim_key_s {
 struct rspamd_dkim_sign_context_s {
 	struct rspamd_dkim_common_ctx common;
 	rspamd_dkim_sign_key_t *key;
+	/* Private key operation, might be done in another thread */
+	guchar *sig_buf;
+	guint sig_len;
+	gsize sign_dlen;
+	gboolean sign_failed;
+	gulong sign_error;
+	guchar sign_digest[EVP_MAX_MD_SIZE];
 };
 
 struct rspamd_dkim_header {
@@ -1692,95 +1712,179 @@ rspamd_get_dkim_key (rspamd_dkim_context_t *ctx,
 			ctx->dns_key);
 }
 
-static gboolean
-rspamd_dkim_relaxed_body_step (struct rspamd_dkim_common_ctx *ctx, EVP_MD_CTX *ck,
-		const gchar **start, guint size,
+/* Size of the buffer used to feed hash with the canonicalised body */
+#define RSPAMD_DKIM_BODY_BUF_SIZE 16384
+
+struct rspamd_dkim_body_buf {
+	gsize len;
+	gsize total;
+	gssize remain;
+	gchar data[RSPAMD_DKIM_BODY_BUF_SIZE];
+};
+
+/*
+ * Returns the length of the prefix that has no bytes that are special for
+ * the relaxed canonicalisation, namely whitespaces and line endings; all of
+ * them are not greater than 0x20
+ */
+static inline gsize
+rspamd_dkim_relaxed_plain_span (const guchar *p, gsize len)
+{
+	const guchar *s = p;
+
+#if defined(__x86_64__)
+	const __m128i sp = _mm_set1_epi8 (0x20);
+
+	while (len >= 16) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)p);
+		/* Unsigned v <= 0x20 */
+		guint mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_min_epu8 (v, sp), v));
+
+		if (mask) {
+			return (p - s) + __builtin_ctz (mask);
+		}
+
+		p += 16;
+		len -= 16;
+	}
+#else
+	while (len >= 8) {
+		guint64 v;
+
+		memcpy (&v, p, sizeof (v));
+
+		/* Has any byte less than 0x21 */
+		if ((v - 0x2121212121212121ULL) & ~v & 0x8080808080808080ULL) {
+			break;
+		}
+
+		p += 8;
+		len -= 8;
+	}
+#endif
+
+	while (len > 0 && *p > 0x20) {
+		p ++;
+		len --;
+	}
+
+	return p - s;
+}
+
+static void
+rspamd_dkim_body_buf_flush (struct rspamd_dkim_common_ctx *ctx, EVP_MD_CTX *ck,
+		struct rspamd_dkim_body_buf *buf)
+{
+	if (buf->len > 0) {
+		EVP_DigestUpdate (ck, buf->data, buf->len);
+		ctx->body_canonicalised += buf->len;
+		buf->total += buf->len;
+		buf->len = 0;
+	}
+}
+
+/*
+ * Appends canonicalised data, output is limited by `l` tag of the signature
+ */
+static inline void
+rspamd_dkim_body_buf_append (struct rspamd_dkim_common_ctx *ctx, EVP_MD_CTX *ck,
+		struct rspamd_dkim_body_buf *buf, const gchar *data, gsize len)
+{
+	if (buf->remain >= 0) {
+		len = MIN (len, (gsize)buf->remain);
+		buf->remain -= len;
+	}
+
+	if (buf->len + len > sizeof (buf->data)) {
+		rspamd_dkim_body_buf_flush (ctx, ck, buf);
+
+		if (len > sizeof (buf->data)) {
+			EVP_DigestUpdate (ck, data, len);
+			ctx->body_canonicalised += len;
+			buf->total += len;
+
+			return;
+		}
+	}
+
+	memcpy (buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+/*
+ * Relaxed body canonicalisation (RFC 6376, 3.4.4): sequences of whitespaces
+ * are reduced to a single space, whitespaces at the end of lines are ignored
+ * and all line endings are converted to CRLF. Runs of other characters are
+ * copied as is, so the hash is updated with large blocks.
+ */
+static void
+rspamd_dkim_relaxed_body_canon (struct rspamd_dkim_common_ctx *ctx,
+		EVP_MD_CTX *ck, const gchar *start, gsize size,
 		gssize *remain)
 {
-	const gchar *h;
-	gchar *t;
-	guint len, inlen;
-	gssize octets_remain;
-	gboolean got_sp;
-	gchar buf[1024];
+	const guchar *h = (const guchar *)start, *end = h + size;
+	struct rspamd_dkim_body_buf buf;
+	gboolean got_sp = FALSE;
+	gsize plain;
 
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = buf;
-	got_sp = FALSE;
-	octets_remain = *remain;
+	if (*remain == 0) {
+		return;
+	}
 
-	while (len > 0 && inlen > 0 && (octets_remain != 0)) {
+	buf.len = 0;
+	buf.total = 0;
+	buf.remain = *remain;
 
-		if (*h == '\r' || *h == '\n') {
+	while (h < end && buf.remain != 0) {
+		plain = rspamd_dkim_relaxed_plain_span (h, end - h);
+
+		if (plain > 0) {
 			if (got_sp) {
-				/* Ignore spaces at the end of line */
-				t --;
+				rspamd_dkim_body_buf_append (ctx, ck, &buf, " ", 1);
+				got_sp = FALSE;
 			}
-			*t++ = '\r';
-			*t++ = '\n';
 
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
+			rspamd_dkim_body_buf_append (ctx, ck, &buf, (const gchar *)h, plain);
+			h += plain;
+		}
+		else if (*h == '\r' || *h == '\n') {
+			/* Ignore spaces at the end of line */
+			got_sp = FALSE;
+			rspamd_dkim_body_buf_append (ctx, ck, &buf, CRLF, sizeof (CRLF) - 1);
+
+			if (*h == '\r' && h + 1 < end && h[1] == '\n') {
 				h += 2;
-				len -= 2;
-				octets_remain -= 2;
 			}
 			else {
 				h ++;
-				len --;
-				if (octets_remain >= 2) {
-					octets_remain -= 2; /* Input has just \n or \r so we actually add more octets */
-				}
-				else {
-					octets_remain --;
-					break;
-				}
 			}
-			break;
 		}
 		else if (g_ascii_isspace (*h)) {
-			if (got_sp) {
-				/* Ignore multiply spaces */
-				h++;
-				len--;
-				continue;
-			}
-			else {
-				*t++ = ' ';
-				h++;
-				inlen--;
-				len--;
-				octets_remain --;
-				got_sp = TRUE;
-				continue;
-			}
+			got_sp = TRUE;
+			h ++;
 		}
 		else {
-			got_sp = FALSE;
-		}
+			/* Other control characters */
+			if (got_sp) {
+				rspamd_dkim_body_buf_append (ctx, ck, &buf, " ", 1);
+				got_sp = FALSE;
+			}
 
-		*t++ = *h++;
-		inlen--;
-		len--;
-		octets_remain --;
+			rspamd_dkim_body_buf_append (ctx, ck, &buf, (const gchar *)h, 1);
+			h ++;
+		}
 	}
 
-	*start = h;
-
-	if (t - buf > 0) {
-		gsize cklen = t - buf;
-
-		EVP_DigestUpdate (ck, buf, cklen);
-		ctx->body_canonicalised += cklen;
-		msg_debug_dkim ("relaxed update signature with body buffer "
-				"(%z size, %z -> %z remain)",
-						cklen, *remain, octets_remain);
-		*remain = octets_remain;
-
+	if (got_sp && buf.remain != 0) {
+		/* Spaces at the end of body without line ending */
+		rspamd_dkim_body_buf_append (ctx, ck, &buf, " ", 1);
 	}
 
-	return ((len != 0) && (octets_remain != 0));
+	rspamd_dkim_body_buf_flush (ctx, ck, &buf);
+	msg_debug_dkim ("relaxed update signature with body buffer "
+			"(%z size, %z canonicalised, %z -> %z remain)",
+			size, buf.total, *remain, buf.remain);
+	*remain = buf.remain;
 }
 
 static gboolean
@@ -2095,14 +2199,12 @@ rspamd_dkim_canonize_body (struct rspamd_dkim_common_ctx *ctx,
 				}
 			}
 			else {
-				while (rspamd_dkim_relaxed_body_step (ctx, ctx->body_hash,
-						&start, end - start, &remain)) ;
+				rspamd_dkim_relaxed_body_canon (ctx, ctx->body_hash,
+						start, end - start, &remain);
+
 				if (need_crlf) {
-					start = "\r\n";
-					end = start + 2;
-					remain = 2;
-					rspamd_dkim_relaxed_body_step (ctx, ctx->body_hash,
-							&start, end - start, &remain);
+					rspamd_dkim_relaxed_body_canon (ctx, ctx->body_hash,
+							CRLF, sizeof (CRLF) - 1, &remain);
 				}
 			}
 		}
@@ -2498,6 +2600,118 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 	return TRUE;
 }
 
+/*
+ * Results of signatures verification, allocated in the shared memory by the
+ * main process. Slots are written under sequence counters, so readers never
+ * block and merely miss if a slot is being modified.
+ */
+struct rspamd_dkim_verify_elt {
+	guint seq;
+	guint verified;
+	guint64 hash[2];
+};
+
+struct rspamd_dkim_verify_cache {
+	guint nelts;
+	guint64 hits;
+	guint64 misses;
+	struct rspamd_dkim_verify_elt elts[];
+};
+
+struct rspamd_dkim_verify_cache *
+rspamd_dkim_verify_cache_new (rspamd_mempool_t *pool, guint nelts)
+{
+	struct rspamd_dkim_verify_cache *cache;
+
+	g_assert (nelts > 0);
+	cache = rspamd_mempool_alloc0_shared (pool, sizeof (*cache) +
+			sizeof (struct rspamd_dkim_verify_elt) * nelts);
+	cache->nelts = nelts;
+
+	return cache;
+}
+
+void
+rspamd_dkim_verify_cache_stat (struct rspamd_dkim_verify_cache *cache,
+		guint64 *hits, guint64 *misses)
+{
+	*hits = __atomic_load_n (&cache->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n (&cache->misses, __ATOMIC_RELAXED);
+}
+
+/*
+ * Verification result depends merely on the key, the digest of the
+ * canonicalised headers (which includes `bh` of the signature header) and
+ * the signature itself
+ */
+static void
+rspamd_dkim_verify_cache_hash (rspamd_dkim_key_t *key, gint nid,
+		const guchar *digest, gsize dlen,
+		const gint8 *b, gsize blen, guint64 *hash)
+{
+	rspamd_cryptobox_hash_state_t st;
+	guchar out[rspamd_cryptobox_HASHBYTES];
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, key->key_id, sizeof (key->key_id));
+	rspamd_cryptobox_hash_update (&st, (const guchar *)&nid, sizeof (nid));
+	rspamd_cryptobox_hash_update (&st, digest, dlen);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)b, blen);
+	rspamd_cryptobox_hash_final (&st, out);
+	memcpy (hash, out, sizeof (guint64) * 2);
+}
+
+static gboolean
+rspamd_dkim_verify_cache_lookup (struct rspamd_dkim_verify_cache *cache,
+		const guint64 *hash, gboolean *verified)
+{
+	struct rspamd_dkim_verify_elt *elt, copy;
+	guint seq;
+
+	elt = &cache->elts[hash[0] % cache->nelts];
+	seq = __atomic_load_n (&elt->seq, __ATOMIC_ACQUIRE);
+
+	if (!(seq & 1) && seq != 0) {
+		memcpy (&copy, elt, sizeof (copy));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&elt->seq, __ATOMIC_RELAXED) == seq &&
+				copy.hash[0] == hash[0] && copy.hash[1] == hash[1]) {
+			*verified = copy.verified;
+			__atomic_add_fetch (&cache->hits, 1, __ATOMIC_RELAXED);
+
+			return TRUE;
+		}
+	}
+
+	__atomic_add_fetch (&cache->misses, 1, __ATOMIC_RELAXED);
+
+	return FALSE;
+}
+
+static void
+rspamd_dkim_verify_cache_store (struct rspamd_dkim_verify_cache *cache,
+		const guint64 *hash, gboolean verified)
+{
+	struct rspamd_dkim_verify_elt *elt;
+	guint seq;
+
+	elt = &cache->elts[hash[0] % cache->nelts];
+	seq = __atomic_load_n (&elt->seq, __ATOMIC_ACQUIRE);
+
+	if ((seq & 1) || !__atomic_compare_exchange_n (&elt->seq, &seq, seq + 1,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		/* Another process is writing this slot */
+		return;
+	}
+
+	elt->hash[0] = hash[0];
+	elt->hash[1] = hash[1];
+	elt->verified = verified;
+
+	__atomic_store_n (&elt->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 struct rspamd_dkim_cached_hash {
 	guchar *digest_normal;
 	guchar *digest_cr;
@@ -2512,9 +2726,14 @@ rspamd_dkim_check_bh_cached (struct rspamd_dkim_common_ctx *ctx,
 	gchar typebuf[64];
 	struct rspamd_dkim_cached_hash *res;
 
+	/*
+	 * Body hash depends on canonicalisation, `l` tag and digest algorithm
+	 * only, so it is shared between all DKIM and ARC signatures of a task
+	 */
 	rspamd_snprintf (typebuf, sizeof (typebuf),
-			RSPAMD_MEMPOOL_DKIM_BH_CACHE "%z_%s_%d_%z",
+			RSPAMD_MEMPOOL_DKIM_BH_CACHE "%z_%d_%s_%d_%z",
 			bhlen,
+			EVP_MD_type (EVP_MD_CTX_md (ctx->body_hash)),
 			ctx->body_canon_type == DKIM_CANON_RELAXED ? "1" : "0",
 			!!is_sign,
 			ctx->len);
@@ -2547,17 +2766,11 @@ rspamd_dkim_type_to_string (enum rspamd_dkim_type t)
 	}
 }
 
-/**
- * Check task for dkim context using dkim key
- * @param ctx dkim verify context
- * @param key dkim key (from cache or from dns request)
- * @param task task to check
- * @return
- */
 struct rspamd_dkim_check_result *
-rspamd_dkim_check (rspamd_dkim_context_t *ctx,
+rspamd_dkim_check_start (rspamd_dkim_context_t *ctx,
 	rspamd_dkim_key_t *key,
-	struct rspamd_task *task)
+	struct rspamd_task *task,
+	struct rspamd_dkim_verify_cache *vcache)
 {
 	const gchar *body_end, *body_start;
 	guchar raw_digest[EVP_MAX_MD_SIZE];
@@ -2568,6 +2781,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	guint i;
 	struct rspamd_dkim_header *dh;
 	gint nid;
+	gboolean verified;
 
 	g_return_val_if_fail (ctx != NULL,		 NULL);
 	g_return_val_if_fail (key != NULL,		 NULL);
@@ -2749,7 +2963,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	}
 
 	dlen = EVP_MD_CTX_size (ctx->common.headers_hash);
-	EVP_DigestFinal_ex (ctx->common.headers_hash, raw_digest, NULL);
+	EVP_DigestFinal_ex (ctx->common.headers_hash, ctx->verify_digest, NULL);
 	/* Check headers signature */
 
 	if (ctx->sig_alg == DKIM_SIGN_RSASHA1) {
@@ -2769,62 +2983,121 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		nid = NID_sha1;
 	}
 
-	switch (key->type) {
-	case RSPAMD_DKIM_KEY_RSA:
-		if (RSA_verify (nid, raw_digest, dlen, ctx->b, ctx->blen,
-				key->key.key_rsa) != 1) {
-			msg_debug_dkim ("headers rsa verify failed");
-			res->rcode = DKIM_REJECT;
-			res->fail_reason = "headers rsa verify failed";
+	if (vcache) {
+		rspamd_dkim_verify_cache_hash (key, nid, ctx->verify_digest, dlen,
+				ctx->b, ctx->blen, ctx->vhash);
 
-			msg_info_dkim (
-					"%s: headers RSA verification failure; "
-					"body length %d->%d; headers length %d; d=%s; s=%s; key_md5=%*xs; orig header: %s",
-					rspamd_dkim_type_to_string (ctx->common.type),
-					(gint)(body_end - body_start), ctx->common.body_canonicalised,
-					ctx->common.headers_canonicalised,
+		if (rspamd_dkim_verify_cache_lookup (vcache, ctx->vhash, &verified)) {
+			msg_debug_dkim ("use cached verification result for d=%s; s=%s: %s",
 					ctx->domain, ctx->selector,
-					RSPAMD_DKIM_KEY_ID_LEN, rspamd_dkim_key_id (key),
-					ctx->dkim_header);
+					verified ? "verified" : "failed");
+
+			if (!verified) {
+				res->rcode = DKIM_REJECT;
+				res->fail_reason = "headers verify failed (cached)";
+			}
+
+			return res;
 		}
+	}
+
+	ctx->verify_key = key;
+	ctx->vcache = vcache;
+	ctx->verify_dlen = dlen;
+	ctx->verify_nid = nid;
+	ctx->verify_failed = FALSE;
+	ctx->verify_pending = TRUE;
+
+	return res;
+}
+
+gboolean
+rspamd_dkim_check_pending (struct rspamd_dkim_check_result *res)
+{
+	return res->ctx->verify_pending;
+}
+
+void
+rspamd_dkim_check_verify (struct rspamd_dkim_check_result *res)
+{
+	rspamd_dkim_context_t *ctx = res->ctx;
+	rspamd_dkim_key_t *key = ctx->verify_key;
+	gboolean failed = FALSE;
+
+	if (!ctx->verify_pending) {
+		return;
+	}
+
+	switch (key->type) {
+	case RSPAMD_DKIM_KEY_RSA:
+		failed = RSA_verify (ctx->verify_nid, ctx->verify_digest,
+				ctx->verify_dlen, ctx->b, ctx->blen,
+				key->key.key_rsa) != 1;
 		break;
 	case RSPAMD_DKIM_KEY_ECDSA:
-		if (ECDSA_verify (nid, raw_digest, dlen, ctx->b, ctx->blen,
-				key->key.key_ecdsa) != 1) {
-			msg_info_dkim (
-					"%s: headers ECDSA verification failure; "
-					"body length %d->%d; headers length %d; d=%s; s=%s; key_md5=%*xs; orig header: %s",
-					rspamd_dkim_type_to_string (ctx->common.type),
-					(gint)(body_end - body_start), ctx->common.body_canonicalised,
-					ctx->common.headers_canonicalised,
-					ctx->domain, ctx->selector,
-					RSPAMD_DKIM_KEY_ID_LEN, rspamd_dkim_key_id (key),
-					ctx->dkim_header);
-			msg_debug_dkim ("headers ecdsa verify failed");
-			res->rcode = DKIM_REJECT;
-			res->fail_reason = "headers ecdsa verify failed";
-		}
+		failed = ECDSA_verify (ctx->verify_nid, ctx->verify_digest,
+				ctx->verify_dlen, ctx->b, ctx->blen,
+				key->key.key_ecdsa) != 1;
 		break;
 	case RSPAMD_DKIM_KEY_EDDSA:
-		if (!rspamd_cryptobox_verify (ctx->b, ctx->blen, raw_digest, dlen,
-				key->key.key_eddsa, RSPAMD_CRYPTOBOX_MODE_25519)) {
+		failed = !rspamd_cryptobox_verify (ctx->b, ctx->blen,
+				ctx->verify_digest, ctx->verify_dlen,
+				key->key.key_eddsa, RSPAMD_CRYPTOBOX_MODE_25519);
+		break;
+	}
+
+	ctx->verify_failed = failed;
+
+	if (ctx->vcache) {
+		rspamd_dkim_verify_cache_store (ctx->vcache, ctx->vhash, !failed);
+	}
+}
+
+void
+rspamd_dkim_check_finish (struct rspamd_dkim_check_result *res,
+		struct rspamd_task *task)
+{
+	rspamd_dkim_context_t *ctx = res->ctx;
+	rspamd_dkim_key_t *key = ctx->verify_key;
+	const gchar *body_end, *body_start;
+
+	if (ctx->verify_pending) {
+		ctx->verify_pending = FALSE;
+
+		if (ctx->verify_failed) {
+			body_end = task->msg.begin + task->msg.len;
+			body_start = MESSAGE_FIELD (task, raw_headers_content).body_start;
+			res->rcode = DKIM_REJECT;
+
+			switch (key->type) {
+			case RSPAMD_DKIM_KEY_RSA:
+				msg_debug_dkim ("headers rsa verify failed");
+				res->fail_reason = "headers rsa verify failed";
+				break;
+			case RSPAMD_DKIM_KEY_ECDSA:
+				msg_debug_dkim ("headers ecdsa verify failed");
+				res->fail_reason = "headers ecdsa verify failed";
+				break;
+			case RSPAMD_DKIM_KEY_EDDSA:
+				msg_debug_dkim ("headers eddsa verify failed");
+				res->fail_reason = "headers eddsa verify failed";
+				break;
+			}
+
 			msg_info_dkim (
-					"%s: headers EDDSA verification failure; "
+					"%s: headers %s verification failure; "
 					"body length %d->%d; headers length %d; d=%s; s=%s; key_md5=%*xs; orig header: %s",
 					rspamd_dkim_type_to_string (ctx->common.type),
+					key->type == RSPAMD_DKIM_KEY_RSA ? "RSA" :
+					(key->type == RSPAMD_DKIM_KEY_ECDSA ? "ECDSA" : "EDDSA"),
 					(gint)(body_end - body_start), ctx->common.body_canonicalised,
 					ctx->common.headers_canonicalised,
 					ctx->domain, ctx->selector,
 					RSPAMD_DKIM_KEY_ID_LEN, rspamd_dkim_key_id (key),
 					ctx->dkim_header);
-			msg_debug_dkim ("headers eddsa verify failed");
-			res->rcode = DKIM_REJECT;
-			res->fail_reason = "headers eddsa verify failed";
 		}
-		break;
 	}
 
-
 	if (ctx->common.type == RSPAMD_DKIM_ARC_SEAL && res->rcode == DKIM_CONTINUE) {
 		switch (ctx->cv) {
 		case RSPAMD_ARC_INVALID:
@@ -2841,6 +3114,25 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 			break;
 		}
 	}
+}
+
+struct rspamd_dkim_check_result *
+rspamd_dkim_check (rspamd_dkim_context_t *ctx,
+	rspamd_dkim_key_t *key,
+	struct rspamd_task *task,
+	struct rspamd_dkim_verify_cache *vcache)
+{
+	struct rspamd_dkim_check_result *res;
+
+	res = rspamd_dkim_check_start (ctx, key, task, vcache);
+
+	if (res && rspamd_dkim_check_pending (res)) {
+		rspamd_dkim_check_verify (res);
+	}
+
+	if (res) {
+		rspamd_dkim_check_finish (res, task);
+	}
 
 	return res;
 }
@@ -3183,7 +3475,7 @@ rspamd_create_dkim_sign_context (struct rspamd_task *task,
 
 
 GString *
-rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
+rspamd_dkim_sign_start (struct rspamd_task *task, const gchar *selector,
 		const gchar *domain, time_t expire, gsize len, guint idx,
 		const gchar *arc_cv, rspamd_dkim_sign_context_t *ctx)
 {
@@ -3195,8 +3487,6 @@ rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
 	gsize dlen = 0;
 	guint i, j;
 	gchar *b64_data;
-	guchar *sig_buf;
-	guint sig_len;
 	guint headers_len = 0, cur_len = 0;
 	union rspamd_dkim_header_stat hstat;
 
@@ -3397,40 +3687,68 @@ rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
 				(gint)hdr->len, hdr->str);
 	}
 
-	dlen = EVP_MD_CTX_size (ctx->common.headers_hash);
-	EVP_DigestFinal_ex (ctx->common.headers_hash, raw_digest, NULL);
+	ctx->sign_dlen = EVP_MD_CTX_size (ctx->common.headers_hash);
+	EVP_DigestFinal_ex (ctx->common.headers_hash, ctx->sign_digest, NULL);
+
 	if (ctx->key->type == RSPAMD_DKIM_KEY_RSA) {
-		sig_len = RSA_size (ctx->key->key.key_rsa);
-		sig_buf = g_alloca (sig_len);
+		ctx->sig_len = RSA_size (ctx->key->key.key_rsa);
+	}
+	else if (ctx->key->type == RSPAMD_DKIM_KEY_EDDSA) {
+		ctx->sig_len = rspamd_cryptobox_signature_bytes (
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+	else {
+		g_string_free (hdr, TRUE);
+		msg_err_task ("unsupported key type for signing");
 
-		if (RSA_sign (NID_sha256, raw_digest, dlen, sig_buf, &sig_len,
-				ctx->key->key.key_rsa) != 1) {
-			g_string_free (hdr, TRUE);
-			msg_err_task ("rsa sign error: %s",
-					ERR_error_string (ERR_get_error (), NULL));
+		return NULL;
+	}
 
-			return NULL;
-		}
-	} else if (ctx->key->type == RSPAMD_DKIM_KEY_EDDSA) {
-		sig_len = rspamd_cryptobox_signature_bytes (RSPAMD_CRYPTOBOX_MODE_25519);
-		sig_buf = g_alloca (sig_len);
+	ctx->sig_buf = rspamd_mempool_alloc (task->task_pool, ctx->sig_len);
+	ctx->sign_failed = FALSE;
 
-		rspamd_cryptobox_sign (sig_buf, NULL, raw_digest, dlen,
+	return hdr;
+}
+
+void
+rspamd_dkim_sign_compute (rspamd_dkim_sign_context_t *ctx)
+{
+	if (ctx->key->type == RSPAMD_DKIM_KEY_RSA) {
+		if (RSA_sign (NID_sha256, ctx->sign_digest, ctx->sign_dlen,
+				ctx->sig_buf, &ctx->sig_len,
+				ctx->key->key.key_rsa) != 1) {
+			ctx->sign_failed = TRUE;
+			ctx->sign_error = ERR_get_error ();
+		}
+	}
+	else {
+		rspamd_cryptobox_sign (ctx->sig_buf, NULL, ctx->sign_digest,
+				ctx->sign_dlen,
 				ctx->key->key.key_eddsa, RSPAMD_CRYPTOBOX_MODE_25519);
-	} else {
+	}
+}
+
+GString *
+rspamd_dkim_sign_finish (struct rspamd_task *task, GString *hdr,
+		rspamd_dkim_sign_context_t *ctx)
+{
+	gchar *b64_data;
+
+	if (ctx->sign_failed) {
 		g_string_free (hdr, TRUE);
-		msg_err_task ("unsupported key type for signing");
+		msg_err_task ("rsa sign error: %s",
+				ERR_error_string (ctx->sign_error, NULL));
 
 		return NULL;
 	}
 
 	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER) {
-		b64_data = rspamd_encode_base64_fold (sig_buf, sig_len, 70, NULL,
-				RSPAMD_TASK_NEWLINES_LF);
+		b64_data = rspamd_encode_base64_fold (ctx->sig_buf, ctx->sig_len, 70,
+				NULL, RSPAMD_TASK_NEWLINES_LF);
 	}
 	else {
-		b64_data = rspamd_encode_base64_fold (sig_buf, sig_len, 70, NULL,
-				MESSAGE_FIELD (task, nlines_type));
+		b64_data = rspamd_encode_base64_fold (ctx->sig_buf, ctx->sig_len, 70,
+				NULL, MESSAGE_FIELD (task, nlines_type));
 	}
 
 	rspamd_printf_gstring (hdr, "%s", b64_data);
@@ -3439,6 +3757,25 @@ rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
 	return hdr;
 }
 
+GString *
+rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
+		const gchar *domain, time_t expire, gsize len, guint idx,
+		const gchar *arc_cv, rspamd_dkim_sign_context_t *ctx)
+{
+	GString *hdr;
+
+	hdr = rspamd_dkim_sign_start (task, selector, domain, expire, len, idx,
+			arc_cv, ctx);
+
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	rspamd_dkim_sign_compute (ctx);
+
+	return rspamd_dkim_sign_finish (task, hdr, ctx);
+}
+
 gboolean
 rspamd_dkim_match_keys (rspamd_dkim_key_t *pk,
 								 rspamd_dkim_sign_key_t *sk,
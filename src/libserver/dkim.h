@@ -216,16 +216,70 @@ gboolean rspamd_get_dkim_key (rspamd_dkim_context_t *ctx,
 							  dkim_key_handler_f handler,
 							  gpointer ud);
 
+struct rspamd_dkim_verify_cache;
+
+/**
+ * Creates cache of signatures verification results in the shared memory, so
+ * it is used by all processes forked afterwards
+ * @param pool pool to allocate cache in
+ * @param nelts number of results stored
+ * @return
+ */
+struct rspamd_dkim_verify_cache *rspamd_dkim_verify_cache_new (
+		rspamd_mempool_t *pool, guint nelts);
+
+/**
+ * Returns hits and misses of the verification cache
+ */
+void rspamd_dkim_verify_cache_stat (struct rspamd_dkim_verify_cache *cache,
+									guint64 *hits, guint64 *misses);
+
 /**
  * Check task for dkim context using dkim key
  * @param ctx dkim verify context
  * @param key dkim key (from cache or from dns request)
  * @param task task to check
+ * @param vcache optional cache of verification results
  * @return
  */
 struct rspamd_dkim_check_result *rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 													rspamd_dkim_key_t *key,
-													struct rspamd_task *task);
+													struct rspamd_task *task,
+													struct rspamd_dkim_verify_cache *vcache);
+
+/**
+ * Starts check of task for dkim context: performs canonicalisation and body
+ * hash check. If `rspamd_dkim_check_pending` returns TRUE afterwards, the
+ * public key verification must be done by `rspamd_dkim_check_verify`, and
+ * the result is ready after `rspamd_dkim_check_finish` is called in any case
+ * @param ctx dkim verify context
+ * @param key dkim key (from cache or from dns request)
+ * @param task task to check
+ * @param vcache optional cache of verification results
+ * @return
+ */
+struct rspamd_dkim_check_result *rspamd_dkim_check_start (rspamd_dkim_context_t *ctx,
+														  rspamd_dkim_key_t *key,
+														  struct rspamd_task *task,
+														  struct rspamd_dkim_verify_cache *vcache);
+
+/**
+ * Returns TRUE if public key verification is required for the started check
+ */
+gboolean rspamd_dkim_check_pending (struct rspamd_dkim_check_result *res);
+
+/**
+ * Verifies signature using public key, this function does not touch task,
+ * memory pools or logger, so it can be called from another thread
+ * (key must be kept referenced meanwhile)
+ */
+void rspamd_dkim_check_verify (struct rspamd_dkim_check_result *res);
+
+/**
+ * Finishes check started by `rspamd_dkim_check_start`
+ */
+void rspamd_dkim_check_finish (struct rspamd_dkim_check_result *res,
+							   struct rspamd_task *task);
 
 struct rspamd_dkim_check_result *
 rspamd_dkim_create_result (rspamd_dkim_context_t *ctx,
@@ -241,6 +295,34 @@ GString *rspamd_dkim_sign (struct rspamd_task *task,
 						   const gchar *arc_cv,
 						   rspamd_dkim_sign_context_t *ctx);
 
+/**
+ * Starts signing: canonicalises message and builds signature header without
+ * `b` value that is added by `rspamd_dkim_sign_finish` after
+ * `rspamd_dkim_sign_compute` is called
+ */
+GString *rspamd_dkim_sign_start (struct rspamd_task *task,
+								 const gchar *selector,
+								 const gchar *domain,
+								 time_t expire,
+								 gsize len,
+								 guint idx,
+								 const gchar *arc_cv,
+								 rspamd_dkim_sign_context_t *ctx);
+
+/**
+ * Performs private key operation, this function does not touch task,
+ * memory pools or logger, so it can be called from another thread
+ */
+void rspamd_dkim_sign_compute (rspamd_dkim_sign_context_t *ctx);
+
+/**
+ * Appends signature to the header returned by `rspamd_dkim_sign_start`
+ * @return header or NULL if signing has failed (header is freed then)
+ */
+GString *rspamd_dkim_sign_finish (struct rspamd_task *task,
+								  GString *hdr,
+								  rspamd_dkim_sign_context_t *ctx);
+
 rspamd_dkim_key_t *rspamd_dkim_key_ref (rspamd_dkim_key_t *k);
 
 void rspamd_dkim_key_unref (rspamd_dkim_key_t *k);
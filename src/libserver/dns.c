@@ -24,6 +24,8 @@
 #include "contrib/librdns/dns_private.h"
 #include "contrib/librdns/rdns_ev.h"
 #include "unix-std.h"
+#include "net_replay.h"
+#include "libutil/probes.h"
 
 #include <unicode/uidna.h>
 
@@ -52,6 +54,7 @@ static struct rdns_upstream_context rspamd_ups_ctx = {
 };
 
 struct rspamd_dns_request_ud {
+	struct rspamd_dns_resolver *resolver;
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
@@ -60,6 +63,8 @@ struct rspamd_dns_request_ud {
 	struct rspamd_symcache_item *item;
 	struct rdns_request *req;
 	struct rdns_reply *reply;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_request_ud *prev, *next;
 };
 
 struct rspamd_dns_fail_cache_entry {
@@ -68,6 +73,52 @@ struct rspamd_dns_fail_cache_entry {
 	enum rdns_request_type type;
 };
 
+/*
+ * Request in flight, identical requests made before it is replied are
+ * attached to it as waiters instead of being sent once again
+ */
+struct rspamd_dns_inflight {
+	struct rspamd_dns_fail_cache_entry key; /* the same key as for fails cache */
+	struct rspamd_dns_resolver *resolver;
+	struct rdns_request *req;
+	struct rspamd_dns_request_ud *waiters;
+	gboolean replied;
+};
+
+/*
+ * Shared cache is a set associative table of fixed size slots allocated in
+ * the shared memory by the main process. Slots are protected by sequence
+ * counters, so readers never block: a slot being modified has an odd counter,
+ * and readers retry with another slot (or miss) if the counter has changed
+ * while they were copying a slot.
+ */
+#define RSPAMD_DNS_CACHE_WAYS 4
+#define RSPAMD_DNS_CACHE_DATA_LEN 448
+
+struct rspamd_dns_cache_slot {
+	guint seq;
+	guint16 type;
+	guint16 rcode;
+	guint64 hash;
+	ev_tstamp expire;
+	guint16 namelen;
+	guint16 datalen;
+	guint16 nentries;
+	guint8 authenticated;
+	guchar data[RSPAMD_DNS_CACHE_DATA_LEN]; /* name followed by serialised entries */
+};
+
+struct rspamd_dns_shared_cache {
+	guint nsets;
+	ev_tstamp max_ttl;
+	ev_tstamp negative_ttl;
+	ev_tstamp fail_ttl;
+	guint64 hits;
+	guint64 misses;
+	guint64 stored;
+	struct rspamd_dns_cache_slot slots[];
+};
+
 static const gint8 ascii_dns_table[128]={
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -108,15 +159,502 @@ rspamd_dns_fail_equal (gconstpointer p1, gconstpointer p2)
 	return FALSE;
 }
 
+static inline guint64
+rspamd_dns_cache_hash (const gchar *name, gsize namelen,
+		enum rdns_request_type type)
+{
+	/* Seed must be the same in all processes */
+	return rspamd_icase_hash (name, namelen, (guint64)type);
+}
+
+static inline gboolean
+rspamd_dns_cache_put (guchar **pos, const guchar *end,
+		gconstpointer data, gsize len)
+{
+	if (end - *pos < (gssize)len) {
+		return FALSE;
+	}
+
+	memcpy (*pos, data, len);
+	*pos += len;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_dns_cache_put_str (guchar **pos, const guchar *end,
+		const gchar *str)
+{
+	gsize slen = str ? strlen (str) : 0;
+	guint16 len = slen;
+
+	if (slen > G_MAXUINT16) {
+		return FALSE;
+	}
+
+	return rspamd_dns_cache_put (pos, end, &len, sizeof (len)) &&
+			rspamd_dns_cache_put (pos, end, str, len);
+}
+
+static inline gboolean
+rspamd_dns_cache_get (const guchar **pos, const guchar *end,
+		gpointer data, gsize len)
+{
+	if (end - *pos < (gssize)len) {
+		return FALSE;
+	}
+
+	memcpy (data, *pos, len);
+	*pos += len;
+
+	return TRUE;
+}
+
+static gchar *
+rspamd_dns_cache_get_str (const guchar **pos, const guchar *end,
+		rspamd_mempool_t *pool)
+{
+	guint16 len;
+	gchar *str;
+
+	if (!rspamd_dns_cache_get (pos, end, &len, sizeof (len)) ||
+			end - *pos < len) {
+		return NULL;
+	}
+
+	str = rspamd_mempool_alloc (pool, len + 1);
+	memcpy (str, *pos, len);
+	str[len] = '\0';
+	*pos += len;
+
+	return str;
+}
+
+/*
+ * Returns number of serialised entries or -1 if they do not fit
+ */
+static gint
+rspamd_dns_cache_serialise (struct rdns_reply_entry *entries,
+		guchar **pos, const guchar *end, gint32 *min_ttl)
+{
+	struct rdns_reply_entry *elt;
+	guint16 type;
+	gint nentries = 0;
+	gboolean ok;
+
+	LL_FOREACH (entries, elt) {
+		type = elt->type;
+
+		if (!rspamd_dns_cache_put (pos, end, &type, sizeof (type)) ||
+				!rspamd_dns_cache_put (pos, end, &elt->ttl, sizeof (elt->ttl))) {
+			return -1;
+		}
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+			ok = rspamd_dns_cache_put (pos, end, &elt->content.a.addr,
+					sizeof (elt->content.a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			ok = rspamd_dns_cache_put (pos, end, &elt->content.aaa.addr,
+					sizeof (elt->content.aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+			ok = rspamd_dns_cache_put_str (pos, end, elt->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			ok = rspamd_dns_cache_put_str (pos, end, elt->content.ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			ok = rspamd_dns_cache_put (pos, end, &elt->content.mx.priority,
+					sizeof (elt->content.mx.priority)) &&
+				rspamd_dns_cache_put_str (pos, end, elt->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			ok = rspamd_dns_cache_put_str (pos, end, elt->content.txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			ok = rspamd_dns_cache_put (pos, end, &elt->content.srv.priority,
+					sizeof (elt->content.srv.priority)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.srv.weight,
+					sizeof (elt->content.srv.weight)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.srv.port,
+					sizeof (elt->content.srv.port)) &&
+				rspamd_dns_cache_put_str (pos, end, elt->content.srv.target);
+			break;
+		case RDNS_REQUEST_SOA:
+			ok = rspamd_dns_cache_put_str (pos, end, elt->content.soa.mname) &&
+				rspamd_dns_cache_put_str (pos, end, elt->content.soa.admin) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.soa.serial,
+					sizeof (elt->content.soa.serial)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.soa.refresh,
+					sizeof (elt->content.soa.refresh)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.soa.retry,
+					sizeof (elt->content.soa.retry)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.soa.expire,
+					sizeof (elt->content.soa.expire)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.soa.minimum,
+					sizeof (elt->content.soa.minimum));
+			break;
+		case RDNS_REQUEST_TLSA:
+			ok = rspamd_dns_cache_put (pos, end, &elt->content.tlsa.usage,
+					sizeof (elt->content.tlsa.usage)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.tlsa.selector,
+					sizeof (elt->content.tlsa.selector)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.tlsa.match_type,
+					sizeof (elt->content.tlsa.match_type)) &&
+				rspamd_dns_cache_put (pos, end, &elt->content.tlsa.datalen,
+					sizeof (elt->content.tlsa.datalen)) &&
+				rspamd_dns_cache_put (pos, end, elt->content.tlsa.data,
+					elt->content.tlsa.datalen);
+			break;
+		default:
+			ok = FALSE;
+			break;
+		}
+
+		if (!ok) {
+			return -1;
+		}
+
+		if (elt->ttl < *min_ttl) {
+			*min_ttl = elt->ttl;
+		}
+
+		nentries ++;
+	}
+
+	return nentries;
+}
+
+static struct rdns_reply_entry *
+rspamd_dns_cache_deserialise (const guchar *pos, const guchar *end,
+		guint nentries, gint32 max_ttl, rspamd_mempool_t *pool,
+		gboolean *ok)
+{
+	struct rdns_reply_entry *entries = NULL, *elt;
+	guint16 type;
+	guint i;
+
+	*ok = FALSE;
+
+	for (i = 0; i < nentries; i ++) {
+		elt = rspamd_mempool_alloc0 (pool, sizeof (*elt));
+
+		if (!rspamd_dns_cache_get (&pos, end, &type, sizeof (type)) ||
+				!rspamd_dns_cache_get (&pos, end, &elt->ttl, sizeof (elt->ttl))) {
+			return NULL;
+		}
+
+		elt->type = type;
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+			if (!rspamd_dns_cache_get (&pos, end, &elt->content.a.addr,
+					sizeof (elt->content.a.addr))) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_AAAA:
+			if (!rspamd_dns_cache_get (&pos, end, &elt->content.aaa.addr,
+					sizeof (elt->content.aaa.addr))) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_PTR:
+			if ((elt->content.ptr.name = rspamd_dns_cache_get_str (&pos, end,
+					pool)) == NULL) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_NS:
+			if ((elt->content.ns.name = rspamd_dns_cache_get_str (&pos, end,
+					pool)) == NULL) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_MX:
+			if (!rspamd_dns_cache_get (&pos, end, &elt->content.mx.priority,
+					sizeof (elt->content.mx.priority)) ||
+					(elt->content.mx.name = rspamd_dns_cache_get_str (&pos, end,
+							pool)) == NULL) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			if ((elt->content.txt.data = rspamd_dns_cache_get_str (&pos, end,
+					pool)) == NULL) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_SRV:
+			if (!rspamd_dns_cache_get (&pos, end, &elt->content.srv.priority,
+					sizeof (elt->content.srv.priority)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.srv.weight,
+							sizeof (elt->content.srv.weight)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.srv.port,
+							sizeof (elt->content.srv.port)) ||
+					(elt->content.srv.target = rspamd_dns_cache_get_str (&pos,
+							end, pool)) == NULL) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_SOA:
+			if ((elt->content.soa.mname = rspamd_dns_cache_get_str (&pos, end,
+					pool)) == NULL ||
+					(elt->content.soa.admin = rspamd_dns_cache_get_str (&pos,
+							end, pool)) == NULL ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.soa.serial,
+							sizeof (elt->content.soa.serial)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.soa.refresh,
+							sizeof (elt->content.soa.refresh)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.soa.retry,
+							sizeof (elt->content.soa.retry)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.soa.expire,
+							sizeof (elt->content.soa.expire)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.soa.minimum,
+							sizeof (elt->content.soa.minimum))) {
+				return NULL;
+			}
+			break;
+		case RDNS_REQUEST_TLSA:
+			if (!rspamd_dns_cache_get (&pos, end, &elt->content.tlsa.usage,
+					sizeof (elt->content.tlsa.usage)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.tlsa.selector,
+							sizeof (elt->content.tlsa.selector)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.tlsa.match_type,
+							sizeof (elt->content.tlsa.match_type)) ||
+					!rspamd_dns_cache_get (&pos, end, &elt->content.tlsa.datalen,
+							sizeof (elt->content.tlsa.datalen))) {
+				return NULL;
+			}
+
+			elt->content.tlsa.data = rspamd_mempool_alloc (pool,
+					elt->content.tlsa.datalen + 1);
+
+			if (!rspamd_dns_cache_get (&pos, end, elt->content.tlsa.data,
+					elt->content.tlsa.datalen)) {
+				return NULL;
+			}
+			break;
+		default:
+			return NULL;
+		}
+
+		/* Reply with the remaining TTL */
+		if (elt->ttl > max_ttl) {
+			elt->ttl = max_ttl;
+		}
+
+		DL_APPEND (entries, elt);
+	}
+
+	*ok = TRUE;
+
+	return entries;
+}
+
+static gboolean
+rspamd_dns_cache_lookup (struct rspamd_dns_shared_cache *cache,
+		rspamd_mempool_t *pool,
+		const gchar *name, gsize namelen,
+		enum rdns_request_type type,
+		ev_tstamp now,
+		enum dns_rcode *rcode,
+		struct rdns_reply_entry **entries,
+		gboolean *authenticated)
+{
+	struct rspamd_dns_cache_slot *set, *slot, copy;
+	guint64 h;
+	guint seq, i;
+	gboolean ok;
+
+	h = rspamd_dns_cache_hash (name, namelen, type);
+	set = &cache->slots[(h % cache->nsets) * RSPAMD_DNS_CACHE_WAYS];
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_WAYS; i ++) {
+		slot = &set[i];
+		seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+
+		if ((seq & 1) || slot->hash != h) {
+			continue;
+		}
+
+		memcpy (&copy, slot, sizeof (copy));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq) {
+			/* Slot has been modified concurrently */
+			continue;
+		}
+
+		if (copy.hash != h || copy.type != type || copy.namelen != namelen ||
+				copy.expire <= now ||
+				copy.namelen + copy.datalen > sizeof (copy.data) ||
+				g_ascii_strncasecmp ((const gchar *)copy.data, name, namelen) != 0) {
+			continue;
+		}
+
+		*entries = rspamd_dns_cache_deserialise (copy.data + copy.namelen,
+				copy.data + copy.namelen + copy.datalen, copy.nentries,
+				(gint32)(copy.expire - now), pool, &ok);
+
+		if (!ok) {
+			continue;
+		}
+
+		*rcode = copy.rcode;
+		*authenticated = copy.authenticated;
+		__atomic_add_fetch (&cache->hits, 1, __ATOMIC_RELAXED);
+
+		return TRUE;
+	}
+
+	__atomic_add_fetch (&cache->misses, 1, __ATOMIC_RELAXED);
+
+	return FALSE;
+}
+
+static void
+rspamd_dns_cache_store (struct rspamd_dns_shared_cache *cache,
+		struct rdns_reply *reply,
+		ev_tstamp now)
+{
+	struct rspamd_dns_cache_slot *set, *slot = NULL, *cur;
+	const struct rdns_request_name *rn;
+	guchar buf[RSPAMD_DNS_CACHE_DATA_LEN], *pos = buf;
+	const guchar *end = buf + sizeof (buf);
+	gint32 min_ttl = G_MAXINT32;
+	gint nentries = 0;
+	ev_tstamp ttl;
+	guint64 h;
+	guint seq, i;
+
+	rn = &reply->request->requested_names[0];
+
+	if (reply->request->qcount != 1 || rn->name == NULL ||
+			!rspamd_dns_cache_put (&pos, end, rn->name, rn->len)) {
+		return;
+	}
+
+	switch (reply->code) {
+	case RDNS_RC_NOERROR:
+		nentries = rspamd_dns_cache_serialise (reply->entries, &pos, end,
+				&min_ttl);
+
+		if (nentries <= 0 || min_ttl <= 0) {
+			return;
+		}
+
+		ttl = MIN (min_ttl, cache->max_ttl);
+		break;
+	case RDNS_RC_NXDOMAIN:
+	case RDNS_RC_NOREC:
+		/* RFC 2308: negative answers are cached for a limited period */
+		ttl = MIN (cache->negative_ttl, cache->max_ttl);
+		break;
+	case RDNS_RC_SERVFAIL:
+		/* RFC 2308, section 7.1: server failures must not be cached too long */
+		ttl = MIN (cache->fail_ttl, 300.0);
+		break;
+	default:
+		return;
+	}
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	h = rspamd_dns_cache_hash (rn->name, rn->len, rn->type);
+	set = &cache->slots[(h % cache->nsets) * RSPAMD_DNS_CACHE_WAYS];
+
+	/* Prefer the same element, then an expired one, then the oldest one */
+	for (i = 0; i < RSPAMD_DNS_CACHE_WAYS; i ++) {
+		cur = &set[i];
+
+		if (cur->hash == h && cur->type == rn->type) {
+			slot = cur;
+			break;
+		}
+
+		if (slot == NULL || cur->expire < slot->expire) {
+			slot = cur;
+		}
+	}
+
+	seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+
+	if ((seq & 1) || !__atomic_compare_exchange_n (&slot->seq, &seq, seq + 1,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		/* Another process is writing this slot, do nothing */
+		return;
+	}
+
+	slot->hash = h;
+	slot->type = rn->type;
+	slot->rcode = reply->code;
+	slot->expire = now + ttl;
+	slot->namelen = rn->len;
+	slot->datalen = (pos - buf) - rn->len;
+	slot->nentries = nentries;
+	slot->authenticated = reply->authenticated;
+	memcpy (slot->data, buf, pos - buf);
+
+	__atomic_store_n (&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_add_fetch (&cache->stored, 1, __ATOMIC_RELAXED);
+}
+
+struct rspamd_dns_shared_cache *
+rspamd_dns_shared_cache_new (struct rspamd_config *cfg)
+{
+	struct rspamd_dns_shared_cache *cache;
+	guint nsets;
+	gsize size;
+
+	if (cfg->dns_cache_size == 0) {
+		return NULL;
+	}
+
+	nsets = MAX (1, cfg->dns_cache_size / RSPAMD_DNS_CACHE_WAYS);
+	size = sizeof (*cache) +
+			sizeof (struct rspamd_dns_cache_slot) * nsets * RSPAMD_DNS_CACHE_WAYS;
+	cache = rspamd_mempool_alloc0_shared (cfg->cfg_pool, size);
+	cache->nsets = nsets;
+	cache->max_ttl = cfg->dns_cache_max_ttl;
+	cache->negative_ttl = cfg->dns_cache_negative_ttl;
+	cache->fail_ttl = cfg->dns_cache_fail_ttl;
+
+	msg_info_config ("created shared DNS cache for %ud answers, %z bytes",
+			nsets * RSPAMD_DNS_CACHE_WAYS, size);
+
+	return cache;
+}
+
+void
+rspamd_dns_shared_cache_stat (struct rspamd_dns_shared_cache *cache,
+		guint64 *hits, guint64 *misses, guint64 *stored)
+{
+	*hits = __atomic_load_n (&cache->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n (&cache->misses, __ATOMIC_RELAXED);
+	*stored = __atomic_load_n (&cache->stored, __ATOMIC_RELAXED);
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	gdouble cpu_start = 0;
 
 	if (reqdata->item) {
 		rspamd_symcache_set_cur_item (reqdata->task, reqdata->item);
 	}
 
+	if (reqdata->task) {
+		cpu_start = rspamd_task_cpu_enter (reqdata->task);
+	}
+
 	if (reqdata->reply) {
 		reqdata->cb (reqdata->reply, reqdata->ud);
 	}
@@ -132,6 +670,24 @@ rspamd_dns_fin_cb (gpointer arg)
 		reqdata->cb (&fake_reply, reqdata->ud);
 	}
 
+	if (reqdata->task) {
+		rspamd_task_cpu_leave (reqdata->task, cpu_start);
+	}
+
+	if (reqdata->inflight) {
+		struct rspamd_dns_inflight *inflight = reqdata->inflight;
+
+		DL_DELETE (inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+
+		if (inflight->waiters == NULL && !inflight->replied) {
+			/* Nobody waits for this request any longer, so cancel it */
+			g_hash_table_remove (inflight->resolver->inflight, &inflight->key);
+			rdns_request_release (inflight->req);
+			g_free (inflight);
+		}
+	}
+
 	rdns_request_release (reqdata->req);
 
 	if (reqdata->item) {
@@ -144,56 +700,189 @@ rspamd_dns_fin_cb (gpointer arg)
 	}
 }
 
+/*
+ * Replay records are keyed by `type:name` and hold rcode, authenticated flag,
+ * number of entries followed by entries serialised as in the shared cache
+ */
+static gsize
+rspamd_dns_replay_key (gchar *buf, gsize buflen, enum rdns_request_type type,
+		const gchar *name, gsize namelen)
+{
+	gsize r;
+
+	r = rspamd_snprintf (buf, buflen, "%d:%*s", (gint)type, (gint)namelen, name);
+	rspamd_str_lc (buf, r);
+
+	return r;
+}
+
+static void
+rspamd_dns_replay_record (struct rdns_reply *reply)
+{
+	const struct rdns_request_name *rn;
+	gchar key[DNS_D_MAXNAME + 16];
+	guchar buf[8192], *pos = buf;
+	const guchar *end = buf + sizeof (buf);
+	guint16 rcode = reply->code, nentries = 0;
+	guint8 authenticated = reply->authenticated;
+	gint32 min_ttl = G_MAXINT32;
+	gint ret;
+	gsize keylen;
+
+	rn = &reply->request->requested_names[0];
+
+	if (reply->request->qcount != 1 || rn->name == NULL) {
+		return;
+	}
+
+	keylen = rspamd_dns_replay_key (key, sizeof (key), rn->type,
+			rn->name, rn->len);
+	pos += sizeof (rcode) + sizeof (authenticated) + sizeof (nentries);
+
+	if (reply->code == RDNS_RC_NOERROR) {
+		ret = rspamd_dns_cache_serialise (reply->entries, &pos, end, &min_ttl);
+
+		if (ret < 0) {
+			return;
+		}
+
+		nentries = ret;
+	}
+
+	memcpy (buf, &rcode, sizeof (rcode));
+	memcpy (buf + sizeof (rcode), &authenticated, sizeof (authenticated));
+	memcpy (buf + sizeof (rcode) + sizeof (authenticated), &nentries,
+			sizeof (nentries));
+	rspamd_net_replay_record (RSPAMD_NET_REPLAY_DNS, key, keylen,
+			buf, pos - buf);
+}
+
+static gboolean
+rspamd_dns_replay_lookup (rspamd_mempool_t *pool,
+		const gchar *name, gsize namelen,
+		enum rdns_request_type type,
+		enum dns_rcode *rcode,
+		struct rdns_reply_entry **entries,
+		gboolean *authenticated)
+{
+	gchar key[DNS_D_MAXNAME + 16];
+	const guchar *data;
+	gsize keylen, datalen;
+	guint16 rc, nentries;
+	guint8 auth;
+	gboolean ok = TRUE;
+
+	keylen = rspamd_dns_replay_key (key, sizeof (key), type, name, namelen);
+	data = rspamd_net_replay_lookup (RSPAMD_NET_REPLAY_DNS, key, keylen,
+			&datalen);
+
+	if (data == NULL ||
+			datalen < sizeof (rc) + sizeof (auth) + sizeof (nentries)) {
+		/* Not recorded requests are never sent */
+		*rcode = RDNS_RC_TIMEOUT;
+		*entries = NULL;
+		*authenticated = FALSE;
+
+		return TRUE;
+	}
+
+	memcpy (&rc, data, sizeof (rc));
+	memcpy (&auth, data + sizeof (rc), sizeof (auth));
+	memcpy (&nentries, data + sizeof (rc) + sizeof (auth), sizeof (nentries));
+	*entries = NULL;
+
+	if (nentries > 0) {
+		*entries = rspamd_dns_cache_deserialise (
+				data + sizeof (rc) + sizeof (auth) + sizeof (nentries),
+				data + datalen, nentries, G_MAXINT32, pool, &ok);
+	}
+
+	if (!ok) {
+		*rcode = RDNS_RC_TIMEOUT;
+		*entries = NULL;
+	}
+	else {
+		*rcode = rc;
+	}
+
+	*authenticated = auth;
+
+	return TRUE;
+}
+
 static void
 rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_dns_inflight *inflight = ud;
+	struct rspamd_dns_resolver *resolver = inflight->resolver;
+	struct rspamd_dns_request_ud *reqdata;
 
-	reqdata->reply = reply;
+	/* Requests made since now are not attached to this one */
+	g_hash_table_remove (resolver->inflight, &inflight->key);
+	inflight->replied = TRUE;
+	RSPAMD_PROBE3 (dns__finish, inflight, inflight->key.name, reply->code);
 
+	/* Replies from caches and fake replies are never cached again */
+	if (reply->request->state != RDNS_REQUEST_FAKE) {
+		if (rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_RECORD) {
+			rspamd_dns_replay_record (reply);
+		}
 
-	if (reqdata->session) {
-		if (reply->code == RDNS_RC_SERVFAIL &&
-			reqdata->task &&
-			reqdata->task->resolver->fails_cache) {
+		if (resolver->cache) {
+			rspamd_dns_cache_store (resolver->cache, reply,
+					ev_now (resolver->event_loop));
+		}
 
+		if (reply->code == RDNS_RC_SERVFAIL && resolver->fails_cache) {
 			/* Add to cache... */
-			const gchar *name = reqdata->req->requested_names[0].name;
+			const gchar *name = reply->request->requested_names[0].name;
 			gchar *target;
 			gsize namelen;
 			struct rspamd_dns_fail_cache_entry *nentry;
 
 			/* Allocate in a single entry to allow further free in a single call */
 			namelen = strlen (name);
-			nentry = g_malloc (sizeof (nentry) + namelen + 1);
-			target = ((gchar *)nentry) + sizeof (nentry);
+			nentry = g_malloc (sizeof (*nentry) + namelen + 1);
+			target = ((gchar *)nentry) + sizeof (*nentry);
 			rspamd_strlcpy (target, name, namelen + 1);
-			nentry->type = reqdata->req->requested_names[0].type;
+			nentry->type = reply->request->requested_names[0].type;
 			nentry->name = target;
 			nentry->namelen = namelen;
 
 			/* Rdns request is retained there */
-			rspamd_lru_hash_insert (reqdata->task->resolver->fails_cache,
+			rspamd_lru_hash_insert (resolver->fails_cache,
 					nentry, rdns_request_retain (reply->request),
-					reqdata->task->task_timestamp,
-					reqdata->task->resolver->fails_cache_time);
+					ev_now (resolver->event_loop),
+					resolver->fails_cache_time);
 		}
-
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
-		rspamd_session_remove_event (reqdata->session,
-				rspamd_dns_fin_cb, reqdata);
 	}
-	else {
-		reqdata->cb (reply, reqdata->ud);
 
-		if (reqdata->pool == NULL) {
-			g_free (reqdata);
+	/*
+	 * Callbacks may cancel other waiters (e.g. by destroying their sessions),
+	 * so we always take the head of the list
+	 */
+	while ((reqdata = inflight->waiters) != NULL) {
+		DL_DELETE (inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+		reqdata->reply = reply;
+
+		if (reqdata->session) {
+			/* Waiter's reference is released by the event finalizer */
+			rspamd_session_remove_event (reqdata->session,
+					rspamd_dns_fin_cb, reqdata);
+		}
+		else {
+			reqdata->cb (reply, reqdata->ud);
+			rdns_request_release (reqdata->req);
+
+			if (reqdata->pool == NULL) {
+				g_free (reqdata);
+			}
 		}
 	}
+
+	/* Request itself is released by rdns */
+	g_free (inflight);
 }
 
 struct rspamd_dns_request_ud *
@@ -205,10 +894,17 @@ rspamd_dns_resolver_request (struct rspamd_dns_resolver *resolver,
 							 enum rdns_request_type type,
 							 const char *name)
 {
-	struct rdns_request *req;
+	struct rdns_request *req = NULL;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	struct rdns_reply_entry *cached_entries = NULL;
+	enum dns_rcode cached_rcode = RDNS_RC_NOERROR;
+	gboolean cached = FALSE, authenticated = FALSE;
 	guint nlen = strlen (name);
 	gchar *real_name = NULL;
+	const gchar *key;
+	gsize keylen;
+	struct rspamd_dns_fail_cache_entry search;
+	struct rspamd_dns_inflight *inflight;
 
 	g_assert (resolver != NULL);
 
@@ -257,26 +953,26 @@ rspamd_dns_resolver_request (struct rspamd_dns_resolver *resolver,
 		reqdata = g_malloc0 (sizeof (struct rspamd_dns_request_ud));
 	}
 
+	reqdata->resolver = resolver;
 	reqdata->pool = pool;
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
+	/* Caches are keyed by names without leading and trailing dots as rdns does */
+	key = name;
+	keylen = nlen;
 
-	if (session) {
-		if (req != NULL) {
-			rspamd_session_add_event (session,
-					(event_finalizer_t) rspamd_dns_fin_cb,
-					reqdata,
-					M);
-		}
+	while (keylen > 0 && *key == '.') {
+		key ++;
+		keylen --;
+	}
+
+	while (keylen > 0 && key[keylen - 1] == '.') {
+		keylen --;
 	}
 
-	if (req == NULL) {
+	if (keylen == 0) {
 		if (pool == NULL) {
 			g_free (reqdata);
 			g_free (real_name);
@@ -285,6 +981,82 @@ rspamd_dns_resolver_request (struct rspamd_dns_resolver *resolver,
 		return NULL;
 	}
 
+	search.name = key;
+	search.namelen = keylen;
+	search.type = type;
+	inflight = g_hash_table_lookup (resolver->inflight, &search);
+
+	if (inflight == NULL) {
+		if (pool && rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_REPLAY) {
+			cached = rspamd_dns_replay_lookup (pool, key, keylen, type,
+					&cached_rcode, &cached_entries, &authenticated);
+		}
+
+		if (!cached && resolver->fails_cache &&
+				rspamd_lru_hash_lookup (resolver->fails_cache,
+						&search, ev_now (resolver->event_loop)) != NULL) {
+			cached = TRUE;
+			cached_rcode = RDNS_RC_SERVFAIL;
+		}
+
+		if (!cached && resolver->cache && pool) {
+			cached = rspamd_dns_cache_lookup (resolver->cache, pool, key, keylen,
+					type, ev_now (resolver->event_loop), &cached_rcode,
+					&cached_entries, &authenticated);
+		}
+
+		/* Key name is owned by the inflight structure */
+		inflight = g_malloc0 (sizeof (*inflight) + keylen + 1);
+		inflight->key.name = ((gchar *)inflight) + sizeof (*inflight);
+		memcpy ((gchar *)inflight->key.name, key, keylen);
+		inflight->key.namelen = keylen;
+		inflight->key.type = type;
+		inflight->resolver = resolver;
+
+		if (cached) {
+			/* Reply is delivered asynchronously just like a normal one */
+			req = rdns_make_request_cached (resolver->r, rspamd_dns_callback,
+					inflight, name, type, cached_rcode, cached_entries);
+
+			if (req != NULL) {
+				req->reply->authenticated = authenticated;
+			}
+		}
+
+		if (req == NULL) {
+			req = rdns_make_request_full (resolver->r, rspamd_dns_callback,
+					inflight, resolver->request_timeout,
+					resolver->max_retransmits, 1, name, type);
+		}
+
+		if (req == NULL) {
+			g_free (inflight);
+
+			if (pool == NULL) {
+				g_free (reqdata);
+				g_free (real_name);
+			}
+
+			return NULL;
+		}
+
+		inflight->req = req;
+		g_hash_table_insert (resolver->inflight, &inflight->key, inflight);
+		RSPAMD_PROBE3 (dns__start, inflight, inflight->key.name, type);
+	}
+
+	/* Each waiter holds its own reference to the request */
+	reqdata->inflight = inflight;
+	reqdata->req = rdns_request_retain (inflight->req);
+	DL_APPEND (inflight->waiters, reqdata);
+
+	if (session) {
+		rspamd_session_add_event (session,
+				(event_finalizer_t) rspamd_dns_fin_cb,
+				reqdata,
+				M);
+	}
+
 	if (real_name && pool == NULL) {
 		g_free (real_name);
 	}
@@ -292,31 +1064,6 @@ rspamd_dns_resolver_request (struct rspamd_dns_resolver *resolver,
 	return reqdata;
 }
 
-struct rspamd_dns_cached_delayed_cbdata {
-	struct rspamd_task *task;
-	dns_callback_type cb;
-	gpointer ud;
-	ev_timer tm;
-	struct rdns_request *req;
-};
-
-static void
-rspamd_fail_cache_cb (EV_P_ ev_timer *w, int revents)
-{
-	struct rspamd_dns_cached_delayed_cbdata *cbd =
-			(struct rspamd_dns_cached_delayed_cbdata *)w->data;
-	struct rdns_reply fake_reply;
-
-	ev_timer_stop (EV_A_ w);
-	memset (&fake_reply, 0, sizeof (fake_reply));
-	fake_reply.code = RDNS_RC_SERVFAIL;
-	fake_reply.request = cbd->req;
-	fake_reply.resolver = cbd->req->resolver;
-	fake_reply.requested_name = cbd->req->requested_names[0].name;
-	cbd->cb (&fake_reply, cbd->ud);
-	rdns_request_release (cbd->req);
-}
-
 static gboolean
 make_dns_request_task_common (struct rspamd_task *task,
 							  dns_callback_type cb,
@@ -331,35 +1078,6 @@ make_dns_request_task_common (struct rspamd_task *task,
 		return FALSE;
 	}
 
-	if (task->resolver->fails_cache) {
-		/* Search in failures cache */
-		struct rspamd_dns_fail_cache_entry search;
-		struct rdns_request *req;
-
-		search.name = name;
-		search.namelen = strlen (name);
-		search.type = type;
-
-		if ((req = rspamd_lru_hash_lookup (task->resolver->fails_cache,
-				&search, task->task_timestamp)) != NULL) {
-			/*
-			 * We need to reply with SERVFAIL again to the API, so add a special
-			 * timer, uh-oh, and fire it
-			 */
-			struct rspamd_dns_cached_delayed_cbdata *cbd =
-					rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbd));
-
-			ev_timer_init (&cbd->tm, rspamd_fail_cache_cb, 0.0, 0.0);
-			cbd->task = task;
-			cbd->cb = cb;
-			cbd->ud = ud;
-			cbd->req = rdns_request_retain (req);
-			cbd->tm.data = cbd;
-
-			return TRUE;
-		}
-	}
-
 	reqdata = rspamd_dns_resolver_request (
 			task->resolver, task->s, task->task_pool, cb, ud,
 			type, name);
@@ -878,6 +1596,8 @@ rspamd_dns_resolver_init (rspamd_logger_t *logger,
 
 	dns_resolver = g_malloc0 (sizeof (struct rspamd_dns_resolver));
 	dns_resolver->event_loop = ev_base;
+	dns_resolver->inflight = g_hash_table_new (rspamd_dns_fail_hash,
+			rspamd_dns_fail_equal);
 
 	if (cfg != NULL) {
 		dns_resolver->request_timeout = cfg->dns_timeout;
@@ -943,6 +1663,8 @@ rspamd_dns_resolver_init (rspamd_logger_t *logger,
 
 		rspamd_upstreams_foreach (dns_resolver->ups, rspamd_dns_server_init,
 				dns_resolver);
+		/* Shared cache is created by the main process before forking workers */
+		dns_resolver->cache = cfg->dns_cache;
 		rdns_resolver_set_upstream_lib (dns_resolver->r, &rspamd_ups_ctx,
 				dns_resolver->ups);
 		cfg->dns_resolver = dns_resolver;
@@ -990,6 +1712,7 @@ rspamd_dns_resolver_deinit (struct rspamd_dns_resolver *resolver)
 		}
 
 		uidna_close (resolver->uidna);
+		g_hash_table_unref (resolver->inflight);
 
 		g_free (resolver);
 	}
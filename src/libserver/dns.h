@@ -31,11 +31,14 @@ extern "C" {
 
 struct rspamd_config;
 struct rspamd_task;
+struct rspamd_dns_shared_cache;
 
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct ev_loop *event_loop;
 	rspamd_lru_hash_t *fails_cache;
+	struct rspamd_dns_shared_cache *cache;
+	GHashTable *inflight;
 	void *uidna;
 	ev_tstamp fails_cache_time;
 	struct upstream_list *ups;
@@ -55,6 +58,22 @@ struct rspamd_dns_resolver *rspamd_dns_resolver_init (rspamd_logger_t *logger,
 
 void rspamd_dns_resolver_deinit (struct rspamd_dns_resolver *resolver);
 
+/**
+ * Creates DNS answers cache shared between all processes forked after this
+ * call (allocated in the config pool)
+ * @param cfg config
+ * @return cache or NULL if it is disabled
+ */
+struct rspamd_dns_shared_cache *rspamd_dns_shared_cache_new (struct rspamd_config *cfg);
+
+/**
+ * Returns statistics of the shared DNS cache
+ */
+void rspamd_dns_shared_cache_stat (struct rspamd_dns_shared_cache *cache,
+								   guint64 *hits,
+								   guint64 *misses,
+								   guint64 *stored);
+
 struct rspamd_dns_request_ud;
 
 /**
@@ -18,6 +18,7 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_memory.h"
 #include "cfg_file.h"
 #include "fuzzy_wire.h"
 
@@ -26,6 +27,7 @@
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MEMORY = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -51,6 +53,8 @@ static void rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 static void rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
+static ucl_object_t* rspamd_fuzzy_backend_stat_sqlite (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
 
 struct rspamd_fuzzy_backend_subr {
 	void* (*init) (struct rspamd_fuzzy_backend *bk, const ucl_object_t *obj,
@@ -74,6 +78,7 @@ struct rspamd_fuzzy_backend_subr {
 	const gchar* (*id) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 	void (*periodic) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 	void (*close) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
+	ucl_object_t* (*stat) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 };
 
 static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
@@ -86,6 +91,7 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.id = rspamd_fuzzy_backend_id_sqlite,
 		.periodic = rspamd_fuzzy_backend_expire_sqlite,
 		.close = rspamd_fuzzy_backend_close_sqlite,
+		.stat = rspamd_fuzzy_backend_stat_sqlite,
 	},
 #ifdef WITH_HIREDIS
 	[RSPAMD_FUZZY_BACKEND_REDIS] = {
@@ -97,8 +103,18 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
-	}
+	},
 #endif
+	[RSPAMD_FUZZY_BACKEND_MEMORY] = {
+		.init = rspamd_fuzzy_backend_init_memory,
+		.check = rspamd_fuzzy_backend_check_memory,
+		.update = rspamd_fuzzy_backend_update_memory,
+		.count = rspamd_fuzzy_backend_count_memory,
+		.version = rspamd_fuzzy_backend_version_memory,
+		.id = rspamd_fuzzy_backend_id_memory,
+		.periodic = rspamd_fuzzy_backend_expire_memory,
+		.close = rspamd_fuzzy_backend_close_memory,
+	},
 };
 
 struct rspamd_fuzzy_backend {
@@ -269,6 +285,15 @@ rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 	rspamd_fuzzy_backend_sqlite_close (sq);
 }
 
+static ucl_object_t*
+rspamd_fuzzy_backend_stat_sqlite (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+
+	return rspamd_fuzzy_backend_sqlite_stat (sq);
+}
+
 
 struct rspamd_fuzzy_backend *
 rspamd_fuzzy_backend_create (struct ev_loop *ev_base,
@@ -291,6 +316,9 @@ rspamd_fuzzy_backend_create (struct ev_loop *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "memory") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MEMORY;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
@@ -567,3 +595,15 @@ rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend)
 {
 	return backend->expire;
 }
+
+ucl_object_t *
+rspamd_fuzzy_backend_stat (struct rspamd_fuzzy_backend *backend)
+{
+	g_assert (backend != NULL);
+
+	if (backend->subr->stat) {
+		return backend->subr->stat (backend, backend->subr_ud);
+	}
+
+	return NULL;
+}
@@ -19,6 +19,7 @@
 #include "config.h"
 #include "contrib/libev/ev.h"
 #include "fuzzy_wire.h"
+#include "ucl.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -118,6 +119,13 @@ struct ev_loop *rspamd_fuzzy_backend_event_base (struct rspamd_fuzzy_backend *ba
 
 gdouble rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Returns backend specific statistics
+ * @param backend
+ * @return new ucl object or NULL if backend has no statistics
+ */
+ucl_object_t *rspamd_fuzzy_backend_stat (struct rspamd_fuzzy_backend *backend);
+
 /**
  * Closes backend
  * @param backend
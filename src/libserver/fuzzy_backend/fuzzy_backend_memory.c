@@ -0,0 +1,1186 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Memory fuzzy backend
+ *
+ * Hashes are stored in two open addressing tables placed in a memory mapped
+ * file shared by all fuzzy workers: one for digests and one for shingles,
+ * where each shingle refers to a digest slot. Only the first fuzzy worker
+ * modifies tables (as updates are always processed there), so readers do not
+ * take any locks and use per slot sequence counters to skip entries that
+ * are being modified concurrently. The file itself serves as a snapshot of
+ * the storage and it is synced to disk on each periodic run.
+ *
+ * Deleted slots are kept as tombstones, so probing does not stop on them.
+ * Tombstones are counted towards the load factor and the periodic run
+ * compacts clusters of slots that contain them.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_memory.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "unix-std.h"
+
+#include <sys/mman.h>
+
+#define msg_err_fuzzy_memory(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_memory(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_memory(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_memory(...)  rspamd_conditional_debug_fast (NULL, NULL, \
+        rspamd_fuzzy_memory_log_id, "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+INIT_LOG_MODULE(fuzzy_memory)
+
+#define FUZZY_MEMORY_DEFAULT_SIZE (1u << 16)
+#define FUZZY_MEMORY_MAX_SOURCES 32
+#define FUZZY_MEMORY_HEADER_SIZE 4096
+/* Number of attempts to read a slot that is being modified */
+#define FUZZY_MEMORY_READ_ATTEMPTS 16
+/* Tables are compacted when tombstones take more than 1/N of slots */
+#define FUZZY_MEMORY_COMPACT_RATIO 16
+
+static const gchar fuzzy_memory_magic[8] = {'r', 's', 'f', 'u', 'z', 'm', '0', '2'};
+
+enum rspamd_fuzzy_memory_slot_state {
+	FUZZY_MEMORY_SLOT_EMPTY = 0,
+	FUZZY_MEMORY_SLOT_USED,
+	FUZZY_MEMORY_SLOT_DELETED,
+};
+
+struct rspamd_fuzzy_memory_source {
+	guint64 version;
+	gchar name[56];
+};
+
+struct rspamd_fuzzy_memory_header {
+	gchar magic[8];
+	guint64 digests_size;
+	guint64 shingles_size;
+	guint64 seed;
+	guint64 count;
+	guint64 digests_deleted; /* Number of tombstones in the digests table */
+	guint64 shingles_deleted;
+	guint64 last_sync;
+	guint32 last_id;
+	guint32 reserved;
+	struct rspamd_fuzzy_memory_source sources[FUZZY_MEMORY_MAX_SOURCES];
+};
+
+G_STATIC_ASSERT (sizeof (struct rspamd_fuzzy_memory_header) <=
+		FUZZY_MEMORY_HEADER_SIZE);
+
+struct rspamd_fuzzy_memory_digest {
+	guint32 seq; /* Odd while the slot is being modified */
+	guint32 state;
+	guint32 id; /* Unique id of the digest, referred by shingles */
+	gint32 value;
+	guint32 flag;
+	guint32 reserved;
+	guint64 time;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+};
+
+struct rspamd_fuzzy_memory_shingle {
+	guint32 seq;
+	guint16 state;
+	guint16 number;
+	guint64 hash;
+	guint32 digest_slot;
+	guint32 digest_id;
+};
+
+struct rspamd_fuzzy_backend_memory {
+	gchar *path;
+	gchar id[MEMPOOL_UID_LEN];
+	gint fd;
+	gsize len;
+	gpointer map;
+	struct rspamd_fuzzy_memory_header *hdr;
+	struct rspamd_fuzzy_memory_digest *digests;
+	struct rspamd_fuzzy_memory_shingle *shingles;
+	guint64 digests_mask;
+	guint64 shingles_mask;
+};
+
+static GQuark
+rspamd_fuzzy_backend_memory_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-memory");
+}
+
+static inline void
+rspamd_fuzzy_memory_write_start (guint32 *seq)
+{
+	*(volatile guint32 *)seq = *seq + 1;
+	__sync_synchronize ();
+}
+
+static inline void
+rspamd_fuzzy_memory_write_end (guint32 *seq)
+{
+	__sync_synchronize ();
+	*(volatile guint32 *)seq = *seq + 1;
+}
+
+static inline guint32
+rspamd_fuzzy_memory_read_start (const guint32 *seq)
+{
+	guint32 s = *(const volatile guint32 *)seq;
+
+	__sync_synchronize ();
+
+	return s;
+}
+
+static inline gboolean
+rspamd_fuzzy_memory_read_valid (const guint32 *seq, guint32 s)
+{
+	__sync_synchronize ();
+
+	return !(s & 1) && *(const volatile guint32 *)seq == s;
+}
+
+/*
+ * Copies digest slot to `out` ensuring that it has not been modified
+ * while copying
+ */
+static gboolean
+rspamd_fuzzy_memory_read_digest (struct rspamd_fuzzy_memory_digest *slot,
+		struct rspamd_fuzzy_memory_digest *out)
+{
+	guint32 s;
+
+	for (guint i = 0; i < FUZZY_MEMORY_READ_ATTEMPTS; i ++) {
+		s = rspamd_fuzzy_memory_read_start (&slot->seq);
+		memcpy (out, slot, sizeof (*out));
+
+		if (rspamd_fuzzy_memory_read_valid (&slot->seq, s)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_fuzzy_memory_read_shingle (struct rspamd_fuzzy_memory_shingle *slot,
+		struct rspamd_fuzzy_memory_shingle *out)
+{
+	guint32 s;
+
+	for (guint i = 0; i < FUZZY_MEMORY_READ_ATTEMPTS; i ++) {
+		s = rspamd_fuzzy_memory_read_start (&slot->seq);
+		memcpy (out, slot, sizeof (*out));
+
+		if (rspamd_fuzzy_memory_read_valid (&slot->seq, s)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static guint64
+rspamd_fuzzy_memory_round_pow2 (guint64 n)
+{
+	guint64 ret = 1;
+
+	while (ret < n) {
+		ret <<= 1;
+	}
+
+	return ret;
+}
+
+static inline guint64
+rspamd_fuzzy_memory_digest_hash (const gchar *digest)
+{
+	guint64 h;
+
+	/* Distributed uniformly already */
+	memcpy (&h, digest, sizeof (h));
+
+	return h;
+}
+
+static inline guint64
+rspamd_fuzzy_memory_shingle_hash (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 hash, guint number)
+{
+	guint64 key[2];
+
+	key[0] = hash;
+	key[1] = number;
+
+	/* Slots are stored in the file, so the hash must not depend on CPU */
+	return rspamd_cryptobox_fast_hash_specific (
+			RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+			key, sizeof (key), backend->hdr->seed);
+}
+
+/*
+ * Finds slot of the digest: returns TRUE if the digest has been found,
+ * otherwise `pslot` is set to the slot where the digest could be inserted
+ * or to -1 if there are no free slots
+ */
+static gboolean
+rspamd_fuzzy_memory_find_digest (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *digest,
+		struct rspamd_fuzzy_memory_digest *found,
+		gint64 *pslot)
+{
+	struct rspamd_fuzzy_memory_digest cur;
+	guint64 idx, i;
+	gint64 free_slot = -1;
+
+	idx = rspamd_fuzzy_memory_digest_hash (digest) & backend->digests_mask;
+
+	for (i = 0; i <= backend->digests_mask; i ++) {
+		if (!rspamd_fuzzy_memory_read_digest (&backend->digests[idx], &cur)) {
+			/* Slot is being modified for too long, skip it */
+			idx = (idx + 1) & backend->digests_mask;
+			continue;
+		}
+
+		if (cur.state == FUZZY_MEMORY_SLOT_EMPTY) {
+			if (free_slot == -1) {
+				free_slot = idx;
+			}
+
+			break;
+		}
+		else if (cur.state == FUZZY_MEMORY_SLOT_DELETED) {
+			if (free_slot == -1) {
+				free_slot = idx;
+			}
+		}
+		else if (memcmp (cur.digest, digest, sizeof (cur.digest)) == 0) {
+			if (found) {
+				memcpy (found, &cur, sizeof (cur));
+			}
+
+			*pslot = idx;
+
+			return TRUE;
+		}
+
+		idx = (idx + 1) & backend->digests_mask;
+	}
+
+	*pslot = free_slot;
+
+	return FALSE;
+}
+
+/*
+ * Returns digest slot for the specified shingle or -1 if it is not found
+ */
+static gint64
+rspamd_fuzzy_memory_find_shingle (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 hash, guint number)
+{
+	struct rspamd_fuzzy_memory_shingle cur;
+	struct rspamd_fuzzy_memory_digest dig;
+	guint64 idx, i;
+
+	idx = rspamd_fuzzy_memory_shingle_hash (backend, hash, number) &
+			backend->shingles_mask;
+
+	for (i = 0; i <= backend->shingles_mask; i ++) {
+		if (rspamd_fuzzy_memory_read_shingle (&backend->shingles[idx], &cur)) {
+			if (cur.state == FUZZY_MEMORY_SLOT_EMPTY) {
+				break;
+			}
+			else if (cur.state == FUZZY_MEMORY_SLOT_USED &&
+					cur.hash == hash && cur.number == number) {
+				/* Check that the digest has not been deleted or replaced */
+				if (rspamd_fuzzy_memory_read_digest (
+						&backend->digests[cur.digest_slot], &dig) &&
+						dig.state == FUZZY_MEMORY_SLOT_USED &&
+						dig.id == cur.digest_id) {
+					return cur.digest_slot;
+				}
+			}
+		}
+
+		idx = (idx + 1) & backend->shingles_mask;
+	}
+
+	return -1;
+}
+
+static void
+rspamd_fuzzy_memory_add_shingle (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 hash, guint number,
+		guint64 digest_slot, guint32 digest_id)
+{
+	struct rspamd_fuzzy_memory_shingle *cur, *free_slot = NULL;
+	guint64 idx, i;
+
+	idx = rspamd_fuzzy_memory_shingle_hash (backend, hash, number) &
+			backend->shingles_mask;
+
+	/* We are the only writer, so slots are read with no sequence checks */
+	for (i = 0; i <= backend->shingles_mask; i ++) {
+		cur = &backend->shingles[idx];
+
+		if (cur->state == FUZZY_MEMORY_SLOT_EMPTY) {
+			if (free_slot == NULL) {
+				free_slot = cur;
+			}
+
+			break;
+		}
+		else if (cur->state == FUZZY_MEMORY_SLOT_DELETED) {
+			if (free_slot == NULL) {
+				free_slot = cur;
+			}
+		}
+		else if (cur->hash == hash && cur->number == number) {
+			/* Replace the previous digest for this shingle */
+			free_slot = cur;
+			break;
+		}
+
+		idx = (idx + 1) & backend->shingles_mask;
+	}
+
+	if (free_slot == NULL) {
+		msg_warn_fuzzy_memory ("no free slots for shingle %d -> %L",
+				number, hash);
+		return;
+	}
+
+	if (free_slot->state == FUZZY_MEMORY_SLOT_DELETED &&
+			backend->hdr->shingles_deleted > 0) {
+		backend->hdr->shingles_deleted --;
+	}
+
+	rspamd_fuzzy_memory_write_start (&free_slot->seq);
+	free_slot->hash = hash;
+	free_slot->number = number;
+	free_slot->digest_slot = digest_slot;
+	free_slot->digest_id = digest_id;
+	free_slot->state = FUZZY_MEMORY_SLOT_USED;
+	rspamd_fuzzy_memory_write_end (&free_slot->seq);
+}
+
+static void
+rspamd_fuzzy_memory_add (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_memory_digest *dig;
+	gint64 slot;
+	guint64 limit;
+	guint i;
+
+	if (rspamd_fuzzy_memory_find_digest (backend, cmd->digest, NULL, &slot)) {
+		dig = &backend->digests[slot];
+
+		rspamd_fuzzy_memory_write_start (&dig->seq);
+
+		if (dig->flag == cmd->flag) {
+			/* We need to increase weight */
+			dig->value += cmd->value;
+		}
+		else {
+			/* We need to relearn actually */
+			dig->value = cmd->value;
+			dig->flag = cmd->flag;
+		}
+
+		dig->time = time (NULL);
+		rspamd_fuzzy_memory_write_end (&dig->seq);
+
+		return;
+	}
+
+	limit = backend->digests_mask - backend->digests_mask / 4;
+
+	if (slot == -1 || backend->hdr->count >= limit ||
+			(backend->digests[slot].state == FUZZY_MEMORY_SLOT_EMPTY &&
+			backend->hdr->count + backend->hdr->digests_deleted >= limit)) {
+		msg_warn_fuzzy_memory ("cannot add hash to %d -> "
+				"%*xs: storage is full", (gint)cmd->flag,
+				(gint)sizeof (cmd->digest), cmd->digest);
+		return;
+	}
+
+	if (++backend->hdr->last_id == 0) {
+		/* Zero id is never used */
+		backend->hdr->last_id = 1;
+	}
+
+	dig = &backend->digests[slot];
+
+	if (dig->state == FUZZY_MEMORY_SLOT_DELETED &&
+			backend->hdr->digests_deleted > 0) {
+		backend->hdr->digests_deleted --;
+	}
+
+	rspamd_fuzzy_memory_write_start (&dig->seq);
+	memcpy (dig->digest, cmd->digest, sizeof (dig->digest));
+	dig->id = backend->hdr->last_id;
+	dig->value = cmd->value;
+	dig->flag = cmd->flag;
+	dig->time = time (NULL);
+	dig->state = FUZZY_MEMORY_SLOT_USED;
+	rspamd_fuzzy_memory_write_end (&dig->seq);
+	backend->hdr->count ++;
+
+	if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			rspamd_fuzzy_memory_add_shingle (backend, shcmd->sgl.hashes[i], i,
+					slot, dig->id);
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_memory_del_slot (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 slot)
+{
+	struct rspamd_fuzzy_memory_digest *dig = &backend->digests[slot];
+
+	/* Shingles of the deleted digest are invalidated by the id check */
+	rspamd_fuzzy_memory_write_start (&dig->seq);
+	dig->state = FUZZY_MEMORY_SLOT_DELETED;
+	rspamd_fuzzy_memory_write_end (&dig->seq);
+	backend->hdr->digests_deleted ++;
+
+	if (backend->hdr->count > 0) {
+		backend->hdr->count --;
+	}
+}
+
+/*
+ * Removes tombstones from the digests table: each cluster of slots (a run
+ * between two empty slots) that contains tombstones is cleared and its live
+ * digests are inserted again in the order of their slots. Every digest in a
+ * cluster has its probe start within the same cluster, so it is placed at
+ * or before its previous slot and never moves outside of the cluster.
+ * Readers can miss digests of a cluster while it is being rebuilt, which is
+ * equal to a missing hash for a single check.
+ * Ids of the inserted digests are added to `moved` with their new slots.
+ */
+static void
+rspamd_fuzzy_memory_compact_digests (struct rspamd_fuzzy_backend_memory *backend,
+		GHashTable *moved)
+{
+	struct rspamd_fuzzy_memory_digest *dig, *dst;
+	GArray *live;
+	gint64 start = -1;
+	guint64 pos, end, idx, i, j, cluster_len;
+	gboolean has_deleted;
+
+	/* Start from an empty slot, so the first cluster is not split */
+	for (i = 0; i <= backend->digests_mask; i ++) {
+		if (backend->digests[i].state == FUZZY_MEMORY_SLOT_EMPTY) {
+			start = i;
+			break;
+		}
+	}
+
+	if (start == -1) {
+		return;
+	}
+
+	live = g_array_new (FALSE, FALSE, sizeof (struct rspamd_fuzzy_memory_digest));
+	i = 1;
+
+	while (i <= backend->digests_mask) {
+		pos = (start + i) & backend->digests_mask;
+
+		if (backend->digests[pos].state == FUZZY_MEMORY_SLOT_EMPTY) {
+			i ++;
+			continue;
+		}
+
+		/* Find the end of the cluster */
+		has_deleted = FALSE;
+		cluster_len = 0;
+		end = pos;
+
+		while (backend->digests[end].state != FUZZY_MEMORY_SLOT_EMPTY) {
+			if (backend->digests[end].state == FUZZY_MEMORY_SLOT_DELETED) {
+				has_deleted = TRUE;
+			}
+
+			cluster_len ++;
+			end = (end + 1) & backend->digests_mask;
+		}
+
+		i += cluster_len;
+
+		if (!has_deleted) {
+			continue;
+		}
+
+		g_array_set_size (live, 0);
+
+		for (j = 0; j < cluster_len; j ++) {
+			dig = &backend->digests[(pos + j) & backend->digests_mask];
+
+			if (dig->state == FUZZY_MEMORY_SLOT_USED) {
+				g_array_append_val (live, *dig);
+			}
+
+			rspamd_fuzzy_memory_write_start (&dig->seq);
+			dig->state = FUZZY_MEMORY_SLOT_EMPTY;
+			rspamd_fuzzy_memory_write_end (&dig->seq);
+		}
+
+		for (j = 0; j < live->len; j ++) {
+			dig = &g_array_index (live, struct rspamd_fuzzy_memory_digest, j);
+			idx = rspamd_fuzzy_memory_digest_hash ((const gchar *)dig->digest) &
+					backend->digests_mask;
+
+			while (backend->digests[idx].state != FUZZY_MEMORY_SLOT_EMPTY) {
+				idx = (idx + 1) & backend->digests_mask;
+			}
+
+			dst = &backend->digests[idx];
+			rspamd_fuzzy_memory_write_start (&dst->seq);
+			/* Sequence counter is the first field and it is preserved */
+			memcpy ((guchar *)dst + sizeof (dst->seq),
+					(guchar *)dig + sizeof (dig->seq),
+					sizeof (*dst) - sizeof (dst->seq));
+			rspamd_fuzzy_memory_write_end (&dst->seq);
+			g_hash_table_insert (moved, GUINT_TO_POINTER (dig->id),
+					GSIZE_TO_POINTER (idx));
+		}
+	}
+
+	g_array_free (live, TRUE);
+	backend->hdr->digests_deleted = 0;
+}
+
+/*
+ * The same for shingles, nothing refers to shingle slots
+ */
+static void
+rspamd_fuzzy_memory_compact_shingles (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct rspamd_fuzzy_memory_shingle *sh, *dst;
+	GArray *live;
+	gint64 start = -1;
+	guint64 pos, end, idx, i, j, cluster_len;
+	gboolean has_deleted;
+
+	for (i = 0; i <= backend->shingles_mask; i ++) {
+		if (backend->shingles[i].state == FUZZY_MEMORY_SLOT_EMPTY) {
+			start = i;
+			break;
+		}
+	}
+
+	if (start == -1) {
+		return;
+	}
+
+	live = g_array_new (FALSE, FALSE, sizeof (struct rspamd_fuzzy_memory_shingle));
+	i = 1;
+
+	while (i <= backend->shingles_mask) {
+		pos = (start + i) & backend->shingles_mask;
+
+		if (backend->shingles[pos].state == FUZZY_MEMORY_SLOT_EMPTY) {
+			i ++;
+			continue;
+		}
+
+		has_deleted = FALSE;
+		cluster_len = 0;
+		end = pos;
+
+		while (backend->shingles[end].state != FUZZY_MEMORY_SLOT_EMPTY) {
+			if (backend->shingles[end].state == FUZZY_MEMORY_SLOT_DELETED) {
+				has_deleted = TRUE;
+			}
+
+			cluster_len ++;
+			end = (end + 1) & backend->shingles_mask;
+		}
+
+		i += cluster_len;
+
+		if (!has_deleted) {
+			continue;
+		}
+
+		g_array_set_size (live, 0);
+
+		for (j = 0; j < cluster_len; j ++) {
+			sh = &backend->shingles[(pos + j) & backend->shingles_mask];
+
+			if (sh->state == FUZZY_MEMORY_SLOT_USED) {
+				g_array_append_val (live, *sh);
+			}
+
+			rspamd_fuzzy_memory_write_start (&sh->seq);
+			sh->state = FUZZY_MEMORY_SLOT_EMPTY;
+			rspamd_fuzzy_memory_write_end (&sh->seq);
+		}
+
+		for (j = 0; j < live->len; j ++) {
+			sh = &g_array_index (live, struct rspamd_fuzzy_memory_shingle, j);
+			idx = rspamd_fuzzy_memory_shingle_hash (backend, sh->hash,
+					sh->number) & backend->shingles_mask;
+
+			while (backend->shingles[idx].state != FUZZY_MEMORY_SLOT_EMPTY) {
+				idx = (idx + 1) & backend->shingles_mask;
+			}
+
+			dst = &backend->shingles[idx];
+			rspamd_fuzzy_memory_write_start (&dst->seq);
+			dst->hash = sh->hash;
+			dst->number = sh->number;
+			dst->digest_slot = sh->digest_slot;
+			dst->digest_id = sh->digest_id;
+			dst->state = FUZZY_MEMORY_SLOT_USED;
+			rspamd_fuzzy_memory_write_end (&dst->seq);
+		}
+	}
+
+	g_array_free (live, TRUE);
+	backend->hdr->shingles_deleted = 0;
+}
+
+static void
+rspamd_fuzzy_memory_refresh (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_memory_digest *dig;
+	gint64 slot;
+
+	if (rspamd_fuzzy_memory_find_digest (backend, cmd->digest, NULL, &slot)) {
+		dig = &backend->digests[slot];
+		rspamd_fuzzy_memory_write_start (&dig->seq);
+		dig->time = time (NULL);
+		rspamd_fuzzy_memory_write_end (&dig->seq);
+	}
+}
+
+static struct rspamd_fuzzy_memory_source *
+rspamd_fuzzy_memory_get_source (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *src, gboolean create)
+{
+	struct rspamd_fuzzy_memory_source *source;
+	guint i;
+
+	for (i = 0; i < FUZZY_MEMORY_MAX_SOURCES; i ++) {
+		source = &backend->hdr->sources[i];
+
+		if (source->name[0] == '\0') {
+			if (create) {
+				rspamd_strlcpy (source->name, src, sizeof (source->name));
+
+				return source;
+			}
+
+			break;
+		}
+
+		if (strncmp (source->name, src, sizeof (source->name) - 1) == 0) {
+			return source;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_backend_memory_free (struct rspamd_fuzzy_backend_memory *backend)
+{
+	if (backend->map) {
+		munmap (backend->map, backend->len);
+	}
+
+	if (backend->fd != -1) {
+		close (backend->fd);
+	}
+
+	g_free (backend->path);
+	g_free (backend);
+}
+
+static gboolean
+rspamd_fuzzy_backend_memory_map (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 digests_size, guint64 shingles_size, GError **err)
+{
+	struct rspamd_fuzzy_memory_header hdr;
+	struct stat st;
+	gsize len;
+
+	len = FUZZY_MEMORY_HEADER_SIZE +
+			digests_size * sizeof (struct rspamd_fuzzy_memory_digest) +
+			shingles_size * sizeof (struct rspamd_fuzzy_memory_shingle);
+
+	if (fstat (backend->fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+				errno, "cannot stat %s: %s", backend->path, strerror (errno));
+		return FALSE;
+	}
+
+	if (st.st_size == 0) {
+		/* New storage, all slots are empty as the file is zero filled */
+		memset (&hdr, 0, sizeof (hdr));
+		memcpy (hdr.magic, fuzzy_memory_magic, sizeof (hdr.magic));
+		hdr.digests_size = digests_size;
+		hdr.shingles_size = shingles_size;
+		hdr.seed = rspamd_random_uint64_fast ();
+
+		if (ftruncate (backend->fd, len) == -1 ||
+				write (backend->fd, &hdr, sizeof (hdr)) != sizeof (hdr)) {
+			g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+					errno, "cannot create %s: %s", backend->path,
+					strerror (errno));
+			return FALSE;
+		}
+	}
+	else {
+		if (pread (backend->fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+				memcmp (hdr.magic, fuzzy_memory_magic, sizeof (hdr.magic)) != 0) {
+			g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+					EINVAL, "%s is not a fuzzy memory storage", backend->path);
+			return FALSE;
+		}
+
+		if (hdr.digests_size != digests_size ||
+				hdr.shingles_size != shingles_size ||
+				(gsize)st.st_size != len) {
+			g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+					EINVAL, "%s has been created with different sizes: "
+					"%L digests and %L shingles",
+					backend->path, (gint64)hdr.digests_size,
+					(gint64)hdr.shingles_size);
+			return FALSE;
+		}
+	}
+
+	backend->map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			backend->fd, 0);
+
+	if (backend->map == MAP_FAILED) {
+		backend->map = NULL;
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+				errno, "cannot mmap %s: %s", backend->path, strerror (errno));
+		return FALSE;
+	}
+
+	backend->len = len;
+	backend->hdr = backend->map;
+	backend->digests = (struct rspamd_fuzzy_memory_digest *)
+			((guchar *)backend->map + FUZZY_MEMORY_HEADER_SIZE);
+	backend->shingles = (struct rspamd_fuzzy_memory_shingle *)
+			(backend->digests + digests_size);
+	backend->digests_mask = digests_size - 1;
+	backend->shingles_mask = shingles_size - 1;
+
+	return TRUE;
+}
+
+void*
+rspamd_fuzzy_backend_init_memory (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	struct rspamd_fuzzy_backend_memory *backend;
+	const ucl_object_t *elt;
+	guint64 digests_size = FUZZY_MEMORY_DEFAULT_SIZE, shingles_size = 0;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	gboolean ret;
+
+	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
+			"path", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+				EINVAL, "missing memory storage path");
+		return NULL;
+	}
+
+	backend = g_malloc0 (sizeof (*backend));
+	backend->path = g_strdup (ucl_object_tostring (elt));
+	backend->fd = -1;
+
+	/* Set id for the backend */
+	rspamd_cryptobox_hash (hash_out, (const guchar *)backend->path, strlen (backend->path),
+			NULL, 0);
+	rspamd_snprintf (backend->id, sizeof (backend->id), "%xs", hash_out);
+
+	elt = ucl_object_lookup_any (obj, "size", "max_hashes", NULL);
+
+	if (elt != NULL && ucl_object_toint (elt) > 0) {
+		digests_size = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "shingles_size");
+
+	if (elt != NULL && ucl_object_toint (elt) > 0) {
+		shingles_size = ucl_object_toint (elt);
+	}
+	else {
+		shingles_size = digests_size * RSPAMD_SHINGLE_SIZE;
+	}
+
+	/* Masks are used for probing */
+	digests_size = rspamd_fuzzy_memory_round_pow2 (digests_size);
+	shingles_size = rspamd_fuzzy_memory_round_pow2 (shingles_size);
+
+	backend->fd = rspamd_file_xopen (backend->path, O_RDWR | O_CREAT, 00644,
+			FALSE);
+
+	if (backend->fd == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+				errno, "cannot open %s: %s", backend->path, strerror (errno));
+		rspamd_fuzzy_backend_memory_free (backend);
+
+		return NULL;
+	}
+
+	/* All fuzzy workers open storage at the same time */
+	rspamd_file_lock (backend->fd, FALSE);
+	ret = rspamd_fuzzy_backend_memory_map (backend, digests_size,
+			shingles_size, err);
+	rspamd_file_unlock (backend->fd, FALSE);
+
+	if (!ret) {
+		rspamd_fuzzy_backend_memory_free (backend);
+
+		return NULL;
+	}
+
+	msg_info_fuzzy_memory ("opened memory storage %s: %L hashes stored, "
+			"%L digest slots, %L shingle slots", backend->path,
+			(gint64)backend->hdr->count, (gint64)digests_size,
+			(gint64)shingles_size);
+
+	return backend;
+}
+
+void
+rspamd_fuzzy_backend_check_memory (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_memory_digest dig;
+	struct rspamd_fuzzy_reply rep;
+	gint64 slot, shingle_slots[RSPAMD_SHINGLE_SIZE], sel_slot = -1;
+	gint64 now = time (NULL);
+	guint i, j, cnt, max_cnt = 0;
+	gdouble expire = rspamd_fuzzy_backend_get_expire (bk);
+
+	memset (&rep, 0, sizeof (rep));
+	memcpy (rep.digest, cmd->digest, sizeof (rep.digest));
+
+	if (rspamd_fuzzy_memory_find_digest (backend, cmd->digest, &dig, &slot)) {
+		if (now - (gint64)dig.time > expire) {
+			msg_debug_fuzzy_memory ("requested hash has been expired");
+		}
+		else {
+			rep.v1.value = dig.value;
+			rep.v1.prob = 1.0;
+			rep.v1.flag = dig.flag;
+			rep.ts = dig.time;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		/* Fuzzy match */
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			shingle_slots[i] = rspamd_fuzzy_memory_find_shingle (backend,
+					shcmd->sgl.hashes[i], i);
+		}
+
+		/* Select the most common digest */
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (shingle_slots[i] == -1) {
+				continue;
+			}
+
+			cnt = 0;
+
+			for (j = i; j < RSPAMD_SHINGLE_SIZE; j ++) {
+				if (shingle_slots[j] == shingle_slots[i]) {
+					cnt ++;
+				}
+			}
+
+			if (cnt > max_cnt) {
+				max_cnt = cnt;
+				sel_slot = shingle_slots[i];
+			}
+		}
+
+		if (sel_slot != -1) {
+			rep.v1.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
+
+			if (rep.v1.prob > 0.5 &&
+					rspamd_fuzzy_memory_read_digest (&backend->digests[sel_slot],
+							&dig) &&
+					dig.state == FUZZY_MEMORY_SLOT_USED) {
+				msg_debug_fuzzy_memory (
+						"found fuzzy hash with probability %.2f",
+						rep.v1.prob);
+
+				if (now - (gint64)dig.time > expire) {
+					msg_debug_fuzzy_memory ("requested hash has been expired");
+					rep.v1.prob = 0.0;
+				}
+				else {
+					rep.ts = dig.time;
+					memcpy (rep.digest, dig.digest, sizeof (rep.digest));
+					rep.v1.value = dig.value;
+					rep.v1.flag = dig.flag;
+				}
+			}
+			else {
+				rep.v1.prob = 0.0;
+			}
+		}
+	}
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_update_memory (struct rspamd_fuzzy_backend *bk,
+		GArray *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_memory_source *source;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	gint64 slot;
+	guint i;
+	guint nupdates = 0, nadded = 0, ndeleted = 0, nextended = 0, nignored = 0;
+
+	for (i = 0; i < updates->len; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+		}
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			rspamd_fuzzy_memory_add (backend, cmd);
+			nadded ++;
+			nupdates ++;
+		}
+		else if (cmd->cmd == FUZZY_DEL) {
+			if (rspamd_fuzzy_memory_find_digest (backend, cmd->digest, NULL,
+					&slot)) {
+				rspamd_fuzzy_memory_del_slot (backend, slot);
+			}
+
+			ndeleted ++;
+			nupdates ++;
+		}
+		else if (cmd->cmd == FUZZY_REFRESH) {
+			rspamd_fuzzy_memory_refresh (backend, cmd);
+			nextended ++;
+		}
+		else {
+			nignored ++;
+		}
+	}
+
+	if (nupdates > 0) {
+		source = rspamd_fuzzy_memory_get_source (backend, src, TRUE);
+
+		if (source) {
+			source->version ++;
+		}
+		else {
+			msg_warn_fuzzy_memory ("too many update sources, cannot store "
+					"version for %s", src);
+		}
+	}
+
+	if (cb) {
+		cb (TRUE, nadded, ndeleted, nextended, nignored, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_count_memory (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	if (cb) {
+		cb (*(volatile guint64 *)&backend->hdr->count, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_version_memory (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_memory_source *source;
+	guint64 rev = 0;
+
+	source = rspamd_fuzzy_memory_get_source (backend, src, FALSE);
+
+	if (source) {
+		rev = source->version;
+	}
+
+	if (cb) {
+		cb (rev, ud);
+	}
+}
+
+const gchar*
+rspamd_fuzzy_backend_id_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	return backend->id;
+}
+
+void
+rspamd_fuzzy_backend_expire_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_memory_digest *dig;
+	struct rspamd_fuzzy_memory_shingle *sh;
+	GHashTable *moved;
+	gpointer new_slot;
+	guint64 i, nexpired = 0, nshingles = 0;
+	gint64 now = time (NULL);
+	gdouble expire = rspamd_fuzzy_backend_get_expire (bk);
+
+	/* Periodic callback is only called in the worker that writes storage */
+	for (i = 0; i <= backend->digests_mask; i ++) {
+		dig = &backend->digests[i];
+
+		if (dig->state == FUZZY_MEMORY_SLOT_USED &&
+				now - (gint64)dig->time > expire) {
+			rspamd_fuzzy_memory_del_slot (backend, i);
+			nexpired ++;
+		}
+	}
+
+	/* Free shingles that refer to deleted digests */
+	for (i = 0; i <= backend->shingles_mask; i ++) {
+		sh = &backend->shingles[i];
+
+		if (sh->state == FUZZY_MEMORY_SLOT_USED) {
+			dig = &backend->digests[sh->digest_slot];
+
+			if (dig->state != FUZZY_MEMORY_SLOT_USED ||
+					dig->id != sh->digest_id) {
+				rspamd_fuzzy_memory_write_start (&sh->seq);
+				sh->state = FUZZY_MEMORY_SLOT_DELETED;
+				rspamd_fuzzy_memory_write_end (&sh->seq);
+				backend->hdr->shingles_deleted ++;
+				nshingles ++;
+			}
+		}
+	}
+
+	if (backend->hdr->digests_deleted * FUZZY_MEMORY_COMPACT_RATIO >
+			backend->digests_mask) {
+		moved = g_hash_table_new (g_direct_hash, g_direct_equal);
+		rspamd_fuzzy_memory_compact_digests (backend, moved);
+
+		/* Shingles refer to digests by slot, so fix slots of moved ones */
+		for (i = 0; i <= backend->shingles_mask; i ++) {
+			sh = &backend->shingles[i];
+
+			if (sh->state == FUZZY_MEMORY_SLOT_USED &&
+					g_hash_table_lookup_extended (moved,
+							GUINT_TO_POINTER (sh->digest_id), NULL, &new_slot) &&
+					sh->digest_slot != GPOINTER_TO_SIZE (new_slot)) {
+				rspamd_fuzzy_memory_write_start (&sh->seq);
+				sh->digest_slot = GPOINTER_TO_SIZE (new_slot);
+				rspamd_fuzzy_memory_write_end (&sh->seq);
+			}
+		}
+
+		msg_info_fuzzy_memory ("compacted digests table, %ud digests moved",
+				g_hash_table_size (moved));
+		g_hash_table_unref (moved);
+	}
+
+	if (backend->hdr->shingles_deleted * FUZZY_MEMORY_COMPACT_RATIO >
+			backend->shingles_mask) {
+		rspamd_fuzzy_memory_compact_shingles (backend);
+		msg_info_fuzzy_memory ("compacted shingles table");
+	}
+
+	backend->hdr->last_sync = now;
+
+	if (msync (backend->map, backend->len, MS_ASYNC) == -1) {
+		msg_err_fuzzy_memory ("cannot sync %s: %s", backend->path,
+				strerror (errno));
+	}
+
+	if (nexpired > 0 || nshingles > 0) {
+		msg_info_fuzzy_memory ("expired %L hashes and %L shingles",
+				(gint64)nexpired, (gint64)nshingles);
+	}
+}
+
+void
+rspamd_fuzzy_backend_close_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	if (msync (backend->map, backend->len, MS_SYNC) == -1) {
+		msg_err_fuzzy_memory ("cannot sync %s: %s", backend->path,
+				strerror (errno));
+	}
+
+	rspamd_fuzzy_backend_memory_free (backend);
+}
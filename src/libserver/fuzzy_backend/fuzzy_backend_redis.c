@@ -29,6 +29,8 @@
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "fuzzy"
 #define REDIS_DEFAULT_TIMEOUT 2.0
+#define REDIS_DEFAULT_CHECK_BATCH 32
+#define REDIS_DEFAULT_CHECK_BATCH_LATENCY 0.0
 
 #define msg_err_redis_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "fuzzy_redis", session->backend->id, \
@@ -58,6 +60,21 @@ struct rspamd_fuzzy_backend_redis {
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
 	gint conf_ref;
+	guint shingle_bands;
+	/* Check commands are coalesced and pipelined over a single connection */
+	guint check_batch;
+	gdouble check_batch_latency;
+	GQueue *pending_checks;
+	struct ev_loop *event_loop;
+	ev_timer batch_timer;
+	ref_entry_t ref;
+};
+
+/* Connection shared by the sessions of the same checks batch */
+struct rspamd_fuzzy_redis_batch {
+	struct rspamd_fuzzy_backend_redis *backend;
+	redisAsyncContext *ctx;
+	gboolean fatal;
 	ref_entry_t ref;
 };
 
@@ -70,6 +87,7 @@ enum rspamd_fuzzy_redis_command {
 
 struct rspamd_fuzzy_redis_session {
 	struct rspamd_fuzzy_backend_redis *backend;
+	struct rspamd_fuzzy_redis_batch *batch;
 	redisAsyncContext *ctx;
 	ev_timer timeout;
 	const struct rspamd_fuzzy_cmd *cmd;
@@ -151,7 +169,17 @@ rspamd_fuzzy_redis_session_dtor (struct rspamd_fuzzy_redis_session *session,
 	redisAsyncContext *ac;
 
 
-	if (session->ctx) {
+	if (session->batch) {
+		/* Connection is released when all sessions of the batch are done */
+		session->ctx = NULL;
+
+		if (is_fatal) {
+			session->batch->fatal = TRUE;
+		}
+
+		REF_RELEASE (session->batch);
+	}
+	else if (session->ctx) {
 		ac = session->ctx;
 		session->ctx = NULL;
 		rspamd_redis_pool_release_connection (session->backend->pool,
@@ -166,11 +194,28 @@ rspamd_fuzzy_redis_session_dtor (struct rspamd_fuzzy_redis_session *session,
 	g_free (session);
 }
 
+static void
+rspamd_fuzzy_redis_batch_dtor (struct rspamd_fuzzy_redis_batch *batch)
+{
+	if (batch->ctx) {
+		rspamd_redis_pool_release_connection (batch->backend->pool,
+				batch->ctx,
+				batch->fatal ? RSPAMD_REDIS_RELEASE_FATAL : RSPAMD_REDIS_RELEASE_DEFAULT);
+	}
+
+	REF_RELEASE (batch->backend);
+	g_free (batch);
+}
+
 static void
 rspamd_fuzzy_backend_redis_dtor (struct rspamd_fuzzy_backend_redis *backend)
 {
 	lua_State *L = backend->L;
 
+	if (backend->pending_checks) {
+		g_queue_free (backend->pending_checks);
+	}
+
 	if (backend->conf_ref) {
 		luaL_unref (L, LUA_REGISTRYINDEX, backend->conf_ref);
 	}
@@ -197,6 +242,8 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 	backend = g_malloc0 (sizeof (*backend));
 
 	backend->timeout = REDIS_DEFAULT_TIMEOUT;
+	backend->check_batch = REDIS_DEFAULT_CHECK_BATCH;
+	backend->check_batch_latency = REDIS_DEFAULT_CHECK_BATCH_LATENCY;
 	backend->redis_object = REDIS_DEFAULT_OBJECT;
 	backend->L = L;
 
@@ -236,6 +283,30 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 		backend->redis_object = ucl_object_tostring (elt);
 	}
 
+	elt = ucl_object_lookup (obj, "shingle_bands");
+	if (elt != NULL) {
+		gint64 nbands = ucl_object_toint (elt);
+
+		if (nbands > 0 && nbands <= RSPAMD_SHINGLE_SIZE &&
+				RSPAMD_SHINGLE_SIZE % nbands == 0) {
+			backend->shingle_bands = nbands;
+		}
+		else {
+			msg_err_config ("invalid shingle_bands: %L, it must be a divisor "
+					"of %d; bands are disabled", nbands, RSPAMD_SHINGLE_SIZE);
+		}
+	}
+
+	elt = ucl_object_lookup (obj, "check_batch");
+	if (elt != NULL) {
+		backend->check_batch = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "check_batch_latency");
+	if (elt != NULL) {
+		backend->check_batch_latency = ucl_object_todouble (elt);
+	}
+
 	backend->conf_ref = conf_ref;
 
 	/* Check some common table values */
@@ -268,6 +339,7 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 
 	REF_INIT_RETAIN (backend, rspamd_fuzzy_backend_redis_dtor);
 	backend->pool = cfg->redis_pool;
+	backend->pending_checks = g_queue_new ();
 	rspamd_cryptobox_hash_init (&st, NULL, 0);
 	rspamd_cryptobox_hash_update (&st, backend->redis_object,
 			strlen (backend->redis_object));
@@ -296,7 +368,22 @@ rspamd_fuzzy_redis_timeout (EV_P_ ev_timer *w, int revents)
 	redisAsyncContext *ac;
 	static char errstr[128];
 
-	if (session->ctx) {
+	if (session->batch && session->batch->ctx) {
+		/*
+		 * Connection is shared, so all pending sessions of the batch fail,
+		 * as their replies are queued after the timed out one anyway
+		 */
+		ac = session->batch->ctx;
+		session->batch->ctx = NULL;
+		session->ctx = NULL;
+		ac->err = REDIS_ERR_IO;
+		rspamd_snprintf (errstr, sizeof (errstr), "%s", strerror (ETIMEDOUT));
+		ac->errstr = errstr;
+
+		rspamd_redis_pool_release_connection (session->backend->pool,
+				ac, RSPAMD_REDIS_RELEASE_FATAL);
+	}
+	else if (session->ctx && !session->batch) {
 		ac = session->ctx;
 		session->ctx = NULL;
 		ac->err = REDIS_ERR_IO;
@@ -313,6 +400,45 @@ rspamd_fuzzy_redis_timeout (EV_P_ ev_timer *w, int revents)
 static void rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv);
 
+static inline guint
+rspamd_fuzzy_redis_shingle_keys (struct rspamd_fuzzy_backend_redis *backend)
+{
+	return backend->shingle_bands > 0 ? backend->shingle_bands :
+			RSPAMD_SHINGLE_SIZE;
+}
+
+/*
+ * Returns key for the shingle number `i` or, if banding is enabled, for the
+ * band number `i`: each band combines RSPAMD_SHINGLE_SIZE / bands subsequent
+ * shingles, so similar messages are likely to share some band while lookups
+ * require just `bands` keys instead of one key per shingle
+ */
+static GString *
+rspamd_fuzzy_redis_shingle_key (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_shingle *sgl, guint i)
+{
+	GString *key;
+	guint width;
+	guint64 h;
+
+	key = g_string_sized_new (strlen (backend->redis_object) + 2 + 3 +
+			sizeof ("18446744073709551616"));
+
+	if (backend->shingle_bands > 0) {
+		width = RSPAMD_SHINGLE_SIZE / backend->shingle_bands;
+		h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+				&sgl->hashes[i * width], width * sizeof (guint64), i);
+		rspamd_printf_gstring (key, "%s_b%d_%uL", backend->redis_object,
+				i, h);
+	}
+	else {
+		rspamd_printf_gstring (key, "%s_%d_%uL", backend->redis_object,
+				i, sgl->hashes[i]);
+	}
+
+	return key;
+}
+
 struct _rspamd_fuzzy_shingles_helper {
 	guchar digest[64];
 	guint found;
@@ -327,6 +453,70 @@ rspamd_fuzzy_backend_redis_shingles_cmp (const void *a, const void *b)
 	return memcmp (sha->digest, shb->digest, sizeof (sha->digest));
 }
 
+/*
+ * Requests hash data for the digest found by shingles
+ */
+static void
+rspamd_fuzzy_redis_check_candidate (struct rspamd_fuzzy_redis_session *session,
+		const guchar *digest)
+{
+	struct rspamd_fuzzy_reply rep;
+	GString *key;
+
+	/* Prepare new check command */
+	rspamd_fuzzy_redis_session_free_args (session);
+	/* With bands we also need shingles to compare them with the candidate */
+	session->nargs = session->backend->shingle_bands > 0 ? 6 : 5;
+	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+
+	key = g_string_new (session->backend->redis_object);
+	g_string_append_len (key, (const gchar *)digest,
+			sizeof (session->cmd->digest));
+	session->argv[0] = g_strdup ("HMGET");
+	session->argv_lens[0] = 5;
+	session->argv[1] = key->str;
+	session->argv_lens[1] = key->len;
+	session->argv[2] = g_strdup ("V");
+	session->argv_lens[2] = 1;
+	session->argv[3] = g_strdup ("F");
+	session->argv_lens[3] = 1;
+	session->argv[4] = g_strdup ("C");
+	session->argv_lens[4] = 1;
+
+	if (session->nargs > 5) {
+		session->argv[5] = g_strdup ("S");
+		session->argv_lens[5] = 1;
+	}
+
+	g_string_free (key, FALSE); /* Do not free underlying array */
+	memcpy (session->found_digest, digest, sizeof (session->cmd->digest));
+
+	g_assert (session->ctx != NULL);
+	if (redisAsyncCommandArgv (session->ctx,
+			rspamd_fuzzy_redis_check_callback,
+			session, session->nargs,
+			(const gchar **)session->argv,
+			session->argv_lens) != REDIS_OK) {
+
+		if (session->callback.cb_check) {
+			memset (&rep, 0, sizeof (rep));
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+	else {
+		/* Add timeout */
+		session->timeout.data = session;
+		ev_now_update_if_cheap ((struct ev_loop *)session->event_loop);
+		ev_timer_init (&session->timeout,
+				rspamd_fuzzy_redis_timeout,
+				session->backend->timeout, 0.0);
+		ev_timer_start (session->event_loop, &session->timeout);
+	}
+}
+
 static void
 rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
@@ -334,22 +524,22 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	struct rspamd_fuzzy_redis_session *session = priv;
 	redisReply *reply = r, *cur;
 	struct rspamd_fuzzy_reply rep;
-	GString *key;
 	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
-	guint i, found = 0, max_found = 0, cur_found = 0;
+	guint i, found = 0, max_found = 0, cur_found = 0, nkeys;
 
 	ev_timer_stop (session->event_loop, &session->timeout);
 	memset (&rep, 0, sizeof (rep));
+	nkeys = rspamd_fuzzy_redis_shingle_keys (session->backend);
 
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
 		if (reply->type == REDIS_REPLY_ARRAY &&
-				reply->elements == RSPAMD_SHINGLE_SIZE) {
+				reply->elements == nkeys) {
 			shingles = g_alloca (sizeof (struct _rspamd_fuzzy_shingles_helper) *
-					RSPAMD_SHINGLE_SIZE);
+					nkeys);
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			for (i = 0; i < nkeys; i ++) {
 				cur = reply->element[i];
 
 				if (cur->type == REDIS_REPLY_STRING) {
@@ -363,7 +553,40 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 				}
 			}
 
-			if (found > RSPAMD_SHINGLE_SIZE / 2) {
+			if (session->backend->shingle_bands > 0) {
+				if (found > 0) {
+					qsort (shingles, nkeys,
+							sizeof (struct _rspamd_fuzzy_shingles_helper),
+							rspamd_fuzzy_backend_redis_shingles_cmp);
+
+					/* Select the candidate that has the most bands matched */
+					for (i = 0; i < nkeys; i ++) {
+						if (!shingles[i].found) {
+							continue;
+						}
+
+						if (prev == NULL ||
+								memcmp (shingles[i].digest, prev->digest, 64) != 0) {
+							cur_found = 1;
+							prev = &shingles[i];
+						}
+						else {
+							cur_found ++;
+						}
+
+						if (cur_found > max_found) {
+							max_found = cur_found;
+							sel = prev;
+						}
+					}
+
+					/* Probability is set when candidate's shingles are compared */
+					rspamd_fuzzy_redis_check_candidate (session, sel->digest);
+
+					return;
+				}
+			}
+			else if (found > RSPAMD_SHINGLE_SIZE / 2) {
 				/* Now sort to find the most frequent element */
 				qsort (shingles, RSPAMD_SHINGLE_SIZE,
 						sizeof (struct _rspamd_fuzzy_shingles_helper),
@@ -392,55 +615,9 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 
 				if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
 					session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
-					rep.v1.prob = session->prob;
 
 					g_assert (sel != NULL);
-
-					/* Prepare new check command */
-					rspamd_fuzzy_redis_session_free_args (session);
-					session->nargs = 5;
-					session->argv = g_malloc (sizeof (gchar *) * session->nargs);
-					session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
-
-					key = g_string_new (session->backend->redis_object);
-					g_string_append_len (key, sel->digest, sizeof (sel->digest));
-					session->argv[0] = g_strdup ("HMGET");
-					session->argv_lens[0] = 5;
-					session->argv[1] = key->str;
-					session->argv_lens[1] = key->len;
-					session->argv[2] = g_strdup ("V");
-					session->argv_lens[2] = 1;
-					session->argv[3] = g_strdup ("F");
-					session->argv_lens[3] = 1;
-					session->argv[4] = g_strdup ("C");
-					session->argv_lens[4] = 1;
-					g_string_free (key, FALSE); /* Do not free underlying array */
-					memcpy (session->found_digest, sel->digest,
-							sizeof (session->cmd->digest));
-
-					g_assert (session->ctx != NULL);
-					if (redisAsyncCommandArgv (session->ctx,
-							rspamd_fuzzy_redis_check_callback,
-							session, session->nargs,
-							(const gchar **)session->argv,
-							session->argv_lens) != REDIS_OK) {
-
-						if (session->callback.cb_check) {
-							memset (&rep, 0, sizeof (rep));
-							session->callback.cb_check (&rep, session->cbdata);
-						}
-
-						rspamd_fuzzy_redis_session_dtor (session, TRUE);
-					}
-					else {
-						/* Add timeout */
-						session->timeout.data = session;
-						ev_now_update_if_cheap ((struct ev_loop *)session->event_loop);
-						ev_timer_init (&session->timeout,
-								rspamd_fuzzy_redis_timeout,
-								session->backend->timeout, 0.0);
-						ev_timer_start (session->event_loop, &session->timeout);
-					}
+					rspamd_fuzzy_redis_check_candidate (session, sel->digest);
 
 					return;
 				}
@@ -470,26 +647,25 @@ static void
 rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 {
 	struct rspamd_fuzzy_reply rep;
-	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_shingle sgl;
 	GString *key;
-	guint i, init_len;
+	guint i, nkeys;
 
 	rspamd_fuzzy_redis_session_free_args (session);
 	/* First of all check digest */
-	session->nargs = RSPAMD_SHINGLE_SIZE + 1;
+	nkeys = rspamd_fuzzy_redis_shingle_keys (session->backend);
+	session->nargs = nkeys + 1;
 	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
 	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
-	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+	/* Shingle command is packed, so shingles might be unaligned */
+	memcpy (&sgl, &((const struct rspamd_fuzzy_shingle_cmd *)session->cmd)->sgl,
+			sizeof (sgl));
 
 	session->argv[0] = g_strdup ("MGET");
 	session->argv_lens[0] = 4;
-	init_len = strlen (session->backend->redis_object);
-
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
 
-		key = g_string_sized_new (init_len + 2 + 2 + sizeof ("18446744073709551616"));
-		rspamd_printf_gstring (key, "%s_%d_%uL", session->backend->redis_object,
-				i, shcmd->sgl.hashes[i]);
+	for (i = 0; i < nkeys; i ++) {
+		key = rspamd_fuzzy_redis_shingle_key (session->backend, &sgl, i);
 		session->argv[i + 1] = key->str;
 		session->argv_lens[i + 1] = key->len;
 		g_string_free (key, FALSE); /* Do not free underlying array */
@@ -531,6 +707,7 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	struct rspamd_fuzzy_redis_session *session = priv;
 	redisReply *reply = r, *cur;
 	struct rspamd_fuzzy_reply rep;
+	struct rspamd_shingle sgl, cmd_sgl;
 	gulong value;
 	guint found_elts = 0;
 
@@ -557,6 +734,30 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 				found_elts ++;
 			}
 
+			if (found_elts >= 2 && session->shingles_checked &&
+					session->backend->shingle_bands > 0) {
+				/* Candidate has been found by bands, so compare shingles */
+				session->prob = 0.0;
+
+				if (reply->elements > 3) {
+					cur = reply->element[3];
+
+					if (cur->type == REDIS_REPLY_STRING &&
+							cur->len == sizeof (sgl)) {
+						memcpy (&sgl, cur->str, sizeof (sgl));
+						memcpy (&cmd_sgl, &((const struct rspamd_fuzzy_shingle_cmd *)
+								session->cmd)->sgl, sizeof (cmd_sgl));
+						session->prob = rspamd_shingles_compare (&cmd_sgl, &sgl);
+					}
+				}
+
+				if (session->prob <= 0.5) {
+					rep.v1.value = 0;
+					rep.v1.flag = 0;
+					found_elts = 0;
+				}
+			}
+
 			if (found_elts >= 2) {
 				rep.v1.prob = session->prob;
 				memcpy (rep.digest, session->found_digest, sizeof (rep.digest));
@@ -609,6 +810,113 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
+static void
+rspamd_fuzzy_redis_send_check (struct rspamd_fuzzy_redis_session *session)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_check_callback,
+			session, session->nargs,
+			(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
+		if (session->callback.cb_check) {
+			memset (&rep, 0, sizeof (rep));
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+	else {
+		/* Add timeout */
+		session->timeout.data = session;
+		ev_now_update_if_cheap ((struct ev_loop *)session->event_loop);
+		ev_timer_init (&session->timeout,
+				rspamd_fuzzy_redis_timeout,
+				session->backend->timeout, 0.0);
+		ev_timer_start (session->event_loop, &session->timeout);
+	}
+}
+
+/*
+ * Sends all pending check commands pipelined over a single connection,
+ * replies are dispatched to sessions by hiredis callbacks
+ */
+static void
+rspamd_fuzzy_redis_flush_checks (struct rspamd_fuzzy_backend_redis *backend)
+{
+	struct rspamd_fuzzy_redis_session *session;
+	struct rspamd_fuzzy_redis_batch *batch;
+	struct upstream_list *ups;
+	struct upstream *up = NULL;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_fuzzy_reply rep;
+	redisAsyncContext *ctx = NULL;
+
+	if (backend->event_loop) {
+		ev_timer_stop (backend->event_loop, &backend->batch_timer);
+	}
+
+	if (g_queue_get_length (backend->pending_checks) == 0) {
+		return;
+	}
+
+	ups = rspamd_redis_get_servers (backend, "read_servers");
+
+	if (ups) {
+		up = rspamd_upstream_get (ups,
+				RSPAMD_UPSTREAM_ROUND_ROBIN,
+				NULL,
+				0);
+		addr = rspamd_upstream_addr_next (up);
+		g_assert (addr != NULL);
+		ctx = rspamd_redis_pool_connect (backend->pool,
+				backend->dbname, backend->password,
+				rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+
+		if (ctx == NULL) {
+			rspamd_upstream_fail (up, TRUE, strerror (errno));
+		}
+	}
+
+	if (ctx == NULL) {
+		while ((session = g_queue_pop_head (backend->pending_checks)) != NULL) {
+			if (session->callback.cb_check) {
+				memset (&rep, 0, sizeof (rep));
+				session->callback.cb_check (&rep, session->cbdata);
+			}
+
+			rspamd_fuzzy_redis_session_dtor (session, TRUE);
+		}
+
+		return;
+	}
+
+	batch = g_malloc0 (sizeof (*batch));
+	batch->backend = backend;
+	REF_RETAIN (backend);
+	batch->ctx = ctx;
+	REF_INIT_RETAIN (batch, rspamd_fuzzy_redis_batch_dtor);
+
+	while ((session = g_queue_pop_head (backend->pending_checks)) != NULL) {
+		session->up = up;
+		session->ctx = ctx;
+		session->batch = batch;
+		REF_RETAIN (batch);
+		rspamd_fuzzy_redis_send_check (session);
+	}
+
+	REF_RELEASE (batch);
+}
+
+static void
+rspamd_fuzzy_redis_batch_timer (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_backend_redis *backend =
+			(struct rspamd_fuzzy_backend_redis *)w->data;
+
+	rspamd_fuzzy_redis_flush_checks (backend);
+}
+
 void
 rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
@@ -667,6 +975,25 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	session->argv_lens[4] = 1;
 	g_string_free (key, FALSE); /* Do not free underlying array */
 
+	if (backend->check_batch > 1) {
+		/* Send it with other checks arrived in the same loop iteration */
+		g_queue_push_tail (backend->pending_checks, session);
+
+		if (g_queue_get_length (backend->pending_checks) >= backend->check_batch) {
+			rspamd_fuzzy_redis_flush_checks (backend);
+		}
+		else if (g_queue_get_length (backend->pending_checks) == 1) {
+			backend->event_loop = session->event_loop;
+			backend->batch_timer.data = backend;
+			ev_timer_init (&backend->batch_timer,
+					rspamd_fuzzy_redis_batch_timer,
+					backend->check_batch_latency, 0.0);
+			ev_timer_start (backend->event_loop, &backend->batch_timer);
+		}
+
+		return;
+	}
+
 	up = rspamd_upstream_get (ups,
 			RSPAMD_UPSTREAM_ROUND_ROBIN,
 			NULL,
@@ -690,25 +1017,7 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		}
 	}
 	else {
-		if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_check_callback,
-				session, session->nargs,
-				(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
-			rspamd_fuzzy_redis_session_dtor (session, TRUE);
-
-			if (cb) {
-				memset (&rep, 0, sizeof (rep));
-				cb (&rep, ud);
-			}
-		}
-		else {
-			/* Add timeout */
-			session->timeout.data = session;
-			ev_now_update_if_cheap ((struct ev_loop *)session->event_loop);
-			ev_timer_init (&session->timeout,
-					rspamd_fuzzy_redis_timeout,
-					session->backend->timeout, 0.0);
-			ev_timer_start (session->event_loop, &session->timeout);
-		}
+		rspamd_fuzzy_redis_send_check (session);
 	}
 }
 
@@ -1007,11 +1316,14 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 {
 	GString *key, *value;
 	guint cur_shift = *shift;
-	guint i, klen;
+	guint i, klen, nkeys;
 	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_shingle sgl;
 
 	if (io_cmd->is_shingle) {
 		cmd = &io_cmd->cmd.shingle.basic;
+		/* Shingle command is packed, so shingles might be unaligned */
+		memcpy (&sgl, &io_cmd->cmd.shingle.sgl, sizeof (sgl));
 	}
 	else {
 		cmd = &io_cmd->cmd.normal;
@@ -1232,22 +1544,19 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 
 	if (io_cmd->is_shingle) {
 		if (cmd->cmd == FUZZY_WRITE) {
-			klen = strlen (session->backend->redis_object) +
-							64 + 1;
+			nkeys = rspamd_fuzzy_redis_shingle_keys (session->backend);
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			for (i = 0; i < nkeys; i ++) {
 				guchar *hval;
 				/*
-				 * For each command with shingles we additionally emit 32 commands:
+				 * For each command with shingles we additionally emit 32 commands
+				 * (or a command per band):
 				 * SETEX <prefix>_<number>_<value> <expire> <digest>
 				 */
 
 				/* SETEX */
-				key = g_string_sized_new (klen);
-				rspamd_printf_gstring (key, "%s_%d_%uL",
-						session->backend->redis_object,
-						i,
-						io_cmd->cmd.shingle.sgl.hashes[i]);
+				key = rspamd_fuzzy_redis_shingle_key (session->backend,
+						&sgl, i);
 				value = g_string_sized_new (sizeof ("4294967296"));
 				rspamd_printf_gstring (value, "%d",
 						(gint)rspamd_fuzzy_backend_get_expire (bk));
@@ -1273,17 +1582,44 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 					return FALSE;
 				}
 			}
+
+			if (session->backend->shingle_bands > 0) {
+				/*
+				 * Shingles are stored along with the hash to compare them
+				 * with candidates found by bands:
+				 * HSET <key> S <shingles>
+				 */
+				klen = strlen (session->backend->redis_object) +
+						sizeof (cmd->digest) + 1;
+				key = g_string_sized_new (klen);
+				g_string_append (key, session->backend->redis_object);
+				g_string_append_len (key, cmd->digest, sizeof (cmd->digest));
+				session->argv[cur_shift] = g_strdup ("HSET");
+				session->argv_lens[cur_shift++] = sizeof ("HSET") - 1;
+				session->argv[cur_shift] = key->str;
+				session->argv_lens[cur_shift++] = key->len;
+				session->argv[cur_shift] = g_strdup ("S");
+				session->argv_lens[cur_shift++] = sizeof ("S") - 1;
+				session->argv[cur_shift] = g_malloc (sizeof (sgl));
+				memcpy (session->argv[cur_shift], &sgl, sizeof (sgl));
+				session->argv_lens[cur_shift++] = sizeof (sgl);
+				g_string_free (key, FALSE);
+
+				if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+						4,
+						(const gchar **)&session->argv[cur_shift - 4],
+						&session->argv_lens[cur_shift - 4]) != REDIS_OK) {
+
+					return FALSE;
+				}
+			}
 		}
 		else if (cmd->cmd == FUZZY_DEL) {
-			klen = strlen (session->backend->redis_object) +
-					64 + 1;
+			nkeys = rspamd_fuzzy_redis_shingle_keys (session->backend);
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-				key = g_string_sized_new (klen);
-				rspamd_printf_gstring (key, "%s_%d_%uL",
-						session->backend->redis_object,
-						i,
-						io_cmd->cmd.shingle.sgl.hashes[i]);
+			for (i = 0; i < nkeys; i ++) {
+				key = rspamd_fuzzy_redis_shingle_key (session->backend,
+						&sgl, i);
 				session->argv[cur_shift] = g_strdup ("DEL");
 				session->argv_lens[cur_shift++] = sizeof ("DEL") - 1;
 				session->argv[cur_shift] = key->str;
@@ -1300,21 +1636,18 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 			}
 		}
 		else if (cmd->cmd == FUZZY_REFRESH) {
-			klen = strlen (session->backend->redis_object) +
-				   64 + 1;
+			nkeys = rspamd_fuzzy_redis_shingle_keys (session->backend);
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			for (i = 0; i < nkeys; i ++) {
 				/*
-				 * For each command with shingles we additionally emit 32 commands:
+				 * For each command with shingles we additionally emit 32 commands
+				 * (or a command per band):
 				 * EXPIRE <prefix>_<number>_<value> <expire>
 				 */
 
 				/* Expire */
-				key = g_string_sized_new (klen);
-				rspamd_printf_gstring (key, "%s_%d_%uL",
-						session->backend->redis_object,
-						i,
-						io_cmd->cmd.shingle.sgl.hashes[i]);
+				key = rspamd_fuzzy_redis_shingle_key (session->backend,
+						&sgl, i);
 				value = g_string_sized_new (sizeof ("18446744073709551616"));
 				rspamd_printf_gstring (value, "%d",
 						(gint)rspamd_fuzzy_backend_get_expire (bk));
@@ -1410,7 +1743,7 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 	GString *key;
 	struct fuzzy_peer_cmd *io_cmd;
 	struct rspamd_fuzzy_cmd *cmd = NULL;
-	guint nargs, ncommands, cur_shift;
+	guint nargs, ncommands, cur_shift, nkeys;
 
 	g_assert (backend != NULL);
 
@@ -1449,6 +1782,7 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 
 	ncommands = 3; /* For MULTI + EXEC + INCR <src> */
 	nargs = 4;
+	nkeys = rspamd_fuzzy_redis_shingle_keys (backend);
 
 	for (i = 0; i < updates->len; i ++) {
 		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
@@ -1466,8 +1800,14 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			session->nadded ++;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 4;
+				ncommands += nkeys;
+				nargs += nkeys * 4;
+
+				if (backend->shingle_bands > 0) {
+					/* HSET <key> S <shingles> */
+					ncommands += 1;
+					nargs += 4;
+				}
 			}
 
 		}
@@ -1477,8 +1817,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			session->ndeleted ++;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 2;
+				ncommands += nkeys;
+				nargs += nkeys * 2;
 			}
 		}
 		else if (cmd->cmd == FUZZY_REFRESH) {
@@ -1487,8 +1827,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			session->nextended ++;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 3;
+				ncommands += nkeys;
+				nargs += nkeys * 3;
 			}
 		}
 		else {
@@ -1624,5 +1964,7 @@ rspamd_fuzzy_backend_close_redis (struct rspamd_fuzzy_backend *bk,
 
 	g_assert (backend != NULL);
 
+	/* Pending checks hold references to the backend */
+	rspamd_fuzzy_redis_flush_checks (backend);
 	REF_RELEASE (backend);
 }
@@ -22,6 +22,23 @@
 #include <sqlite3.h>
 #include "libutil/sqlite_utils.h"
 
+/*
+ * Expiry and cleanup job, that is executed by a separate thread using its
+ * own connection, so lookups are not blocked on the main connection
+ */
+struct rspamd_fuzzy_sqlite_maint {
+	gchar *path;
+	gint64 expire_lim;
+	gboolean clean_orphaned;
+	/* Filled by the thread */
+	gint64 expired;
+	gint64 orphaned;
+	gdouble duration;
+	gchar *error;
+	gint done;
+	gint stop;
+};
+
 struct rspamd_fuzzy_backend_sqlite {
 	sqlite3 *db;
 	char *path;
@@ -29,10 +46,18 @@ struct rspamd_fuzzy_backend_sqlite {
 	gsize count;
 	gsize expired;
 	rspamd_mempool_t *pool;
+	GThread *maint_thread;
+	struct rspamd_fuzzy_sqlite_maint *maint;
+	guint64 maint_runs;
+	gsize orphaned;
+	gdouble maint_last_duration;
+	gdouble maint_total_duration;
 };
 
 static const gdouble sql_sleep_time = 0.1;
 static const guint max_retries = 10;
+/* Maintenance thread waits for the main connection writes up to this time */
+static const gint maint_busy_timeout = 5000;
 
 #define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         backend->pool->tag.tagname, backend->pool->tag.uid, \
@@ -845,8 +870,8 @@ rspamd_fuzzy_backend_sqlite_del (struct rspamd_fuzzy_backend_sqlite *backend,
 	return (rc == SQLITE_OK);
 }
 
-gboolean
-rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *backend,
+static gboolean
+rspamd_fuzzy_backend_sqlite_sync_inline (struct rspamd_fuzzy_backend_sqlite *backend,
 		gint64 expire,
 		gboolean clean_orphaned)
 {
@@ -992,11 +1017,271 @@ rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *backend,
 	return ret;
 }
 
+/*
+ * Runs a deletion statement by small transactions until it deletes less
+ * than a limit, so writers on the main connection are not locked out
+ */
+static gboolean
+rspamd_fuzzy_sqlite_maint_run (sqlite3 *db, sqlite3_stmt *stmt,
+		struct rspamd_fuzzy_sqlite_maint *maint, gint64 max_changes,
+		gint64 *total)
+{
+	struct timespec ts;
+	gint64 changes;
+	gint rc;
+
+	double_to_ts (sql_sleep_time / 10.0, &ts);
+
+	while (!g_atomic_int_get (&maint->stop)) {
+		if (sqlite3_exec (db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+			return FALSE;
+		}
+
+		rc = sqlite3_step (stmt);
+		changes = sqlite3_changes (db);
+		sqlite3_reset (stmt);
+
+		if (rc != SQLITE_DONE) {
+			sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+
+			return FALSE;
+		}
+
+		if (sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+			sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+
+			return FALSE;
+		}
+
+		*total += changes;
+
+		if (changes < max_changes) {
+			break;
+		}
+
+		/* Let the main connection commit its updates */
+		nanosleep (&ts, NULL);
+	}
+
+	return TRUE;
+}
+
+static gpointer
+rspamd_fuzzy_sqlite_maint_thread (gpointer ud)
+{
+	struct rspamd_fuzzy_sqlite_maint *maint = ud;
+	const gint64 max_changes = 5000;
+	static const gchar maint_pragmas[] = "PRAGMA journal_mode=\"wal\";"
+			"PRAGMA synchronous=\"NORMAL\";"
+			"PRAGMA foreign_keys=\"ON\";",
+		expire_sql[] = "DELETE FROM digests WHERE id IN "
+			"(SELECT id FROM digests WHERE time < ?1 LIMIT ?2);",
+		orphaned_sql[] = "DELETE FROM shingles WHERE rowid IN "
+			"(SELECT shingles.rowid FROM shingles "
+			"LEFT JOIN digests ON shingles.digest_id=digests.id "
+			"WHERE digests.id IS NULL LIMIT ?1);";
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stmt;
+	gdouble start;
+	gint flags;
+
+	start = rspamd_get_ticks (FALSE);
+	flags = SQLITE_OPEN_READWRITE;
+#ifdef SQLITE_OPEN_PRIVATECACHE
+	/* Shared cache would lock tables for the main connection */
+	flags |= SQLITE_OPEN_PRIVATECACHE;
+#endif
+
+	if (sqlite3_open_v2 (maint->path, &db, flags, NULL) != SQLITE_OK) {
+		maint->error = g_strdup_printf ("cannot open db: %s",
+				db ? sqlite3_errmsg (db) : "no memory");
+		goto end;
+	}
+
+	sqlite3_busy_timeout (db, maint_busy_timeout);
+
+	if (sqlite3_exec (db, maint_pragmas, NULL, NULL, NULL) != SQLITE_OK) {
+		maint->error = g_strdup_printf ("cannot set pragmas: %s",
+				sqlite3_errmsg (db));
+		goto end;
+	}
+
+	if (maint->expire_lim > 0) {
+		if (sqlite3_prepare_v2 (db, expire_sql, -1, &stmt, NULL) != SQLITE_OK) {
+			maint->error = g_strdup_printf ("cannot prepare expire: %s",
+					sqlite3_errmsg (db));
+			goto end;
+		}
+
+		sqlite3_bind_int64 (stmt, 1, maint->expire_lim);
+		sqlite3_bind_int64 (stmt, 2, max_changes);
+
+		if (!rspamd_fuzzy_sqlite_maint_run (db, stmt, maint, max_changes,
+				&maint->expired)) {
+			maint->error = g_strdup_printf ("cannot expire hashes: %s",
+					sqlite3_errmsg (db));
+		}
+
+		sqlite3_finalize (stmt);
+	}
+
+	if (maint->clean_orphaned && maint->error == NULL) {
+		if (sqlite3_prepare_v2 (db, orphaned_sql, -1, &stmt, NULL) != SQLITE_OK) {
+			maint->error = g_strdup_printf ("cannot prepare cleanup: %s",
+					sqlite3_errmsg (db));
+			goto end;
+		}
+
+		sqlite3_bind_int64 (stmt, 1, max_changes);
+
+		if (!rspamd_fuzzy_sqlite_maint_run (db, stmt, maint, max_changes,
+				&maint->orphaned)) {
+			maint->error = g_strdup_printf ("cannot cleanup shingles: %s",
+					sqlite3_errmsg (db));
+		}
+
+		sqlite3_finalize (stmt);
+	}
+
+end:
+	if (db) {
+		sqlite3_close (db);
+	}
+
+	maint->duration = rspamd_get_ticks (FALSE) - start;
+	g_atomic_int_set (&maint->done, 1);
+
+	return NULL;
+}
+
+/* Collects results of the finished maintenance thread */
+static void
+rspamd_fuzzy_sqlite_maint_finish (struct rspamd_fuzzy_backend_sqlite *backend)
+{
+	struct rspamd_fuzzy_sqlite_maint *maint = backend->maint;
+
+	g_thread_join (backend->maint_thread);
+	backend->maint_thread = NULL;
+	backend->maint = NULL;
+
+	backend->maint_runs ++;
+	backend->expired += maint->expired;
+	backend->orphaned += maint->orphaned;
+	backend->maint_last_duration = maint->duration;
+	backend->maint_total_duration += maint->duration;
+
+	if (maint->error) {
+		msg_warn_fuzzy_backend ("background maintenance failed: %s",
+				maint->error);
+	}
+
+	if (maint->expired > 0 || maint->orphaned > 0) {
+		msg_info_fuzzy_backend ("expired %L hashes and deleted %L orphaned "
+				"shingles in %.3f seconds",
+				maint->expired, maint->orphaned, maint->duration);
+	}
+
+	g_free (maint->error);
+	g_free (maint->path);
+	g_free (maint);
+}
+
+gboolean
+rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *backend,
+		gint64 expire,
+		gboolean clean_orphaned)
+{
+	struct rspamd_fuzzy_sqlite_maint *maint;
+	GError *err = NULL;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	if (backend->maint_thread != NULL) {
+		if (!g_atomic_int_get (&backend->maint->done)) {
+			msg_debug_fuzzy_backend ("previous maintenance is still running");
+
+			return TRUE;
+		}
+
+		rspamd_fuzzy_sqlite_maint_finish (backend);
+	}
+
+	if (expire <= 0 && !clean_orphaned) {
+		return TRUE;
+	}
+
+	maint = g_malloc0 (sizeof (*maint));
+	maint->path = g_strdup (backend->path);
+	maint->expire_lim = expire > 0 ? time (NULL) - expire : 0;
+	maint->clean_orphaned = clean_orphaned;
+	backend->maint_thread = g_thread_try_new ("fuzzy_sqlite",
+			rspamd_fuzzy_sqlite_maint_thread, maint, &err);
+
+	if (backend->maint_thread == NULL) {
+		msg_warn_fuzzy_backend ("cannot start maintenance thread: %e, "
+				"expire hashes synchronously", err);
+		g_error_free (err);
+		g_free (maint->path);
+		g_free (maint);
+
+		return rspamd_fuzzy_backend_sqlite_sync_inline (backend, expire,
+				clean_orphaned);
+	}
+
+	backend->maint = maint;
+
+	return TRUE;
+}
+
+ucl_object_t *
+rspamd_fuzzy_backend_sqlite_stat (struct rspamd_fuzzy_backend_sqlite *backend)
+{
+	ucl_object_t *obj;
+
+	if (backend == NULL) {
+		return NULL;
+	}
+
+	if (backend->maint_thread != NULL &&
+			g_atomic_int_get (&backend->maint->done)) {
+		rspamd_fuzzy_sqlite_maint_finish (backend);
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (backend->maint_runs),
+			"maintenance_runs", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_frombool (backend->maint_thread != NULL),
+			"maintenance_running", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (backend->expired),
+			"expired", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (backend->orphaned),
+			"orphaned", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (backend->maint_last_duration),
+			"last_duration", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (backend->maint_total_duration),
+			"total_duration", 0, false);
+
+	return obj;
+}
 
 void
 rspamd_fuzzy_backend_sqlite_close (struct rspamd_fuzzy_backend_sqlite *backend)
 {
 	if (backend != NULL) {
+		if (backend->maint_thread != NULL) {
+			/* Stop after the current step */
+			g_atomic_int_set (&backend->maint->stop, 1);
+			rspamd_fuzzy_sqlite_maint_finish (backend);
+		}
+
 		if (backend->db != NULL) {
 			rspamd_fuzzy_backend_sqlite_close_stmts (backend);
 			sqlite3_close (backend->db);
@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "fuzzy_wire.h"
+#include "ucl.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -98,6 +99,13 @@ gint rspamd_fuzzy_backend_sqlite_version (struct rspamd_fuzzy_backend_sqlite *ba
 
 gsize rspamd_fuzzy_backend_sqlite_expired (struct rspamd_fuzzy_backend_sqlite *backend);
 
+/**
+ * Returns statistics of the background expiry and cleanup
+ * @param backend
+ * @return new ucl object
+ */
+ucl_object_t *rspamd_fuzzy_backend_sqlite_stat (struct rspamd_fuzzy_backend_sqlite *backend);
+
 const gchar *rspamd_fuzzy_sqlite_backend_id (struct rspamd_fuzzy_backend_sqlite *backend);
 
 #ifdef  __cplusplus
@@ -94,6 +94,28 @@ RSPAMD_PACKED(rspamd_fuzzy_encrypted_reply) {
 
 static const guchar fuzzy_encrypted_magic[4] = {'r', 's', 'f', 'e'};
 
+/* Maximum number of commands and the maximum size of a batch datagram */
+#define RSPAMD_FUZZY_BATCH_MAX 32
+#define RSPAMD_FUZZY_BATCH_MAXLEN 4096
+
+/*
+ * Batch of commands: the header is followed by `ncmds` commands, each one
+ * is prefixed by its length (guint16 in network byte order) and may include
+ * extensions. The reply is the same header followed by `ncmds` extended
+ * replies. Encrypted batches are prefixed by rspamd_fuzzy_encrypted_req_hdr
+ * with fuzzy_encrypted_batch_magic (or rspamd_fuzzy_encrypted_rep_hdr for
+ * replies) and everything after that header is encrypted at once.
+ */
+RSPAMD_PACKED(rspamd_fuzzy_batch_hdr) {
+	guchar magic[4];
+	guint8 version;
+	guint8 ncmds;
+	guint16 reserved;
+};
+
+static const guchar fuzzy_batch_magic[4] = {'r', 's', 'f', 'b'};
+static const guchar fuzzy_encrypted_batch_magic[4] = {'r', 's', 'f', 'B'};
+
 enum rspamd_fuzzy_extension_type {
 	RSPAMD_FUZZY_EXT_SOURCE_DOMAIN = 'd',
 	RSPAMD_FUZZY_EXT_SOURCE_IP4 = '4',
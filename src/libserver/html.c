@@ -22,6 +22,10 @@
 #include "html_colors.h"
 #include "html_entities.h"
 #include "url.h"
+#include "libserver/css/css.h"
+#include "cryptobox.h"
+#include "ref.h"
+#include "hash.h"
 #include "contrib/libucl/khash.h"
 #include "libmime/images.h"
 
@@ -33,7 +37,8 @@
 
 static sig_atomic_t tags_sorted = 0;
 static sig_atomic_t entities_sorted = 0;
-static const guint max_tags = 8192; /* Ignore tags if this maximum is reached */
+static const guint default_max_tags = 8192; /* Ignore tags if this maximum is reached */
+static const guint max_css_cache = 128; /* Parsed style sheets cached per process */
 
 struct html_tag_def {
 	const gchar *name;
@@ -179,14 +184,14 @@ static struct html_tag_def tag_defs[] = {
 KHASH_MAP_INIT_INT (entity_by_number, const char *);
 KHASH_MAP_INIT_STR (entity_by_name, const char *);
 KHASH_MAP_INIT_STR (tag_by_name, struct html_tag_def);
-KHASH_MAP_INIT_INT (tag_by_id, struct html_tag_def);
 KHASH_INIT (color_by_name, const rspamd_ftok_t *, struct html_color, true,
 		rspamd_ftok_icase_hash, rspamd_ftok_icase_equal);
 
 khash_t(entity_by_number) *html_entity_by_number;
 khash_t(entity_by_name) *html_entity_by_name;
 khash_t(tag_by_name) *html_tag_by_name;
-khash_t(tag_by_id) *html_tag_by_id;
+/* Tag ids are dense, so we can use them as indexes directly */
+static const struct html_tag_def *html_tag_by_id[N_TAGS];
 khash_t(color_by_name) *html_color_by_name;
 
 static struct rspamd_url *rspamd_html_process_url (rspamd_mempool_t *pool,
@@ -201,22 +206,21 @@ rspamd_html_library_init (void)
 	gint rc;
 
 	if (!tags_sorted) {
-		html_tag_by_id = kh_init (tag_by_id);
 		html_tag_by_name = kh_init (tag_by_name);
-		kh_resize (tag_by_id, html_tag_by_id, G_N_ELEMENTS (tag_defs));
 		kh_resize (tag_by_name, html_tag_by_name, G_N_ELEMENTS (tag_defs));
 
 		for (i = 0; i < G_N_ELEMENTS (tag_defs); i++) {
-			k = kh_put (tag_by_id, html_tag_by_id, tag_defs[i].id, &rc);
+			g_assert (tag_defs[i].id >= 0 && tag_defs[i].id < N_TAGS);
 
-			if (rc == 0) {
+			if (html_tag_by_id[tag_defs[i].id] != NULL) {
 				/* Collision by id */
 				msg_err ("collision in html tag id: %d (%s) vs %d (%s)",
 						(int)tag_defs[i].id, tag_defs[i].name,
-						(int)kh_val (html_tag_by_id, k).id, kh_val (html_tag_by_id, k).name);
+						(int)html_tag_by_id[tag_defs[i].id]->id,
+						html_tag_by_id[tag_defs[i].id]->name);
 			}
 
-			kh_val (html_tag_by_id, k) = tag_defs[i];
+			html_tag_by_id[tag_defs[i].id] = &tag_defs[i];
 
 			k = kh_put (tag_by_name, html_tag_by_name, tag_defs[i].name, &rc);
 
@@ -224,7 +228,8 @@ rspamd_html_library_init (void)
 				/* Collision by name */
 				msg_err ("collision in html tag name: %d (%s) vs %d (%s)",
 						(int)tag_defs[i].id, tag_defs[i].name,
-						(int)kh_val (html_tag_by_id, k).id, kh_val (html_tag_by_id, k).name);
+						(int)kh_val (html_tag_by_name, k).id,
+						kh_val (html_tag_by_name, k).name);
 			}
 
 			kh_val (html_tag_by_name, k) = tag_defs[i];
@@ -387,12 +392,8 @@ rspamd_html_tag_seen (struct html_content *hc, const gchar *tagname)
 const gchar *
 rspamd_html_tag_by_id (gint id)
 {
-	khiter_t k;
-
-	k = kh_get (tag_by_id, html_tag_by_id, id);
-
-	if (k != kh_end (html_tag_by_id)) {
-		return kh_val (html_tag_by_id, k).name;
+	if (id >= 0 && id < N_TAGS && html_tag_by_id[id] != NULL) {
+		return html_tag_by_id[id]->name;
 	}
 
 	return NULL;
@@ -857,7 +858,8 @@ rspamd_html_url_is_phished (rspamd_mempool_t *pool,
 
 static gboolean
 rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
-		struct html_tag *tag, GNode **cur_level, gboolean *balanced)
+		struct html_tag *tag, GNode **cur_level, gboolean *balanced,
+		guint max_tags)
 {
 	GNode *nnode;
 	struct html_tag *parent;
@@ -869,6 +871,10 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 		rspamd_mempool_add_destructor (pool,
 				(rspamd_mempool_destruct_t) g_node_destroy,
 				nnode);
+		hc->all_tags = g_ptr_array_sized_new (128);
+		rspamd_mempool_notify_alloc (pool, 128 * sizeof (gpointer) + sizeof (GPtrArray));
+		rspamd_mempool_add_destructor (pool, rspamd_ptr_array_free_hard,
+				hc->all_tags);
 	}
 
 	if (hc->total_tags > max_tags) {
@@ -882,6 +888,8 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	}
 
 	tag->parent = *cur_level;
+	parent = *cur_level ? (*cur_level)->data : NULL;
+	tag->depth = parent ? parent->depth + 1 : 1;
 
 	if (!(tag->flags & (CM_INLINE|CM_EMPTY))) {
 		/* Block tag */
@@ -893,6 +901,7 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 
 			if (hc->total_tags < max_tags) {
 				nnode = g_node_new (tag);
+				g_ptr_array_add (hc->all_tags, tag);
 				g_node_append (*cur_level, nnode);
 
 				if (!rspamd_html_check_balance (nnode, cur_level)) {
@@ -923,9 +932,11 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 						hc->flags |= RSPAMD_HTML_FLAG_UNBALANCED;
 						*balanced = FALSE;
 						tag->parent = parent->parent;
+						tag->depth = parent->depth;
 
 						if (hc->total_tags < max_tags) {
 							nnode = g_node_new (tag);
+							g_ptr_array_add (hc->all_tags, tag);
 							g_node_append (parent->parent, nnode);
 							*cur_level = nnode;
 							hc->total_tags ++;
@@ -938,6 +949,7 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 
 			if (hc->total_tags < max_tags) {
 				nnode = g_node_new (tag);
+				g_ptr_array_add (hc->all_tags, tag);
 				g_node_append (*cur_level, nnode);
 
 				if ((tag->flags & FL_CLOSED) == 0) {
@@ -962,6 +974,7 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 		if (parent) {
 			if (hc->total_tags < max_tags) {
 				nnode = g_node_new (tag);
+				g_ptr_array_add (hc->all_tags, tag);
 				g_node_append (*cur_level, nnode);
 
 				hc->total_tags ++;
@@ -2677,24 +2690,26 @@ rspamd_html_check_displayed_url (rspamd_mempool_t *pool,
 	}
 }
 
-static gboolean
-rspamd_html_propagate_lengths (GNode *node, gpointer _unused)
+/*
+ * Tags are stored in `all_tags` in the order of their insertion to the tree,
+ * so all descendants of a tag follow it in this array. Hence, a single
+ * backward sweep summarizes content length from all children without
+ * traversing the tree itself.
+ */
+static void
+rspamd_html_propagate_lengths (struct html_content *hc)
 {
-	GNode *child;
-	struct html_tag *tag = node->data, *cld_tag;
+	struct html_tag *tag, *parent_tag;
+	guint i;
 
-	if (tag) {
-		child = node->children;
+	for (i = hc->all_tags->len; i > 0; i --) {
+		tag = g_ptr_array_index (hc->all_tags, i - 1);
 
-		/* Summarize content length from children */
-		while (child) {
-			cld_tag = child->data;
-			tag->content_length += cld_tag->content_length;
-			child = child->next;
+		if (tag->parent && tag->parent->data) {
+			parent_tag = tag->parent->data;
+			parent_tag->content_length += tag->content_length;
 		}
 	}
-
-	return FALSE;
 }
 
 static void
@@ -2775,13 +2790,165 @@ rspamd_html_propagate_style (struct html_content *hc,
 	}
 }
 
+/*
+ * Parsed style sheets are shared between tasks as the same <style> blocks
+ * are used in many messages (e.g. newsletters)
+ */
+struct rspamd_html_css_entry {
+	guint64 hash;
+	gsize len;
+	const gchar *text;
+	rspamd_css css;
+	rspamd_mempool_t *pool; /* Owns the entry, text and css */
+	ref_entry_t ref;
+};
+
+static rspamd_lru_hash_t *html_css_cache = NULL;
+
+static void
+rspamd_html_css_entry_dtor (struct rspamd_html_css_entry *entry)
+{
+	rspamd_mempool_delete (entry->pool);
+}
+
+static void
+rspamd_html_css_entry_unref (gpointer p)
+{
+	struct rspamd_html_css_entry *entry = (struct rspamd_html_css_entry *)p;
+
+	REF_RELEASE (entry);
+}
+
+/*
+ * Appends content of a <style> block that starts at `p` to `styles`
+ */
+static void
+rspamd_html_process_style_block (GString **styles,
+		const guchar *p, const guchar *end)
+{
+	goffset style_len;
+
+	style_len = rspamd_substring_search_caseless (p, end - p,
+			"</style", sizeof ("</style") - 1);
+
+	if (style_len == -1) {
+		/* Unclosed style */
+		style_len = end - p;
+	}
+
+	if (style_len > 0) {
+		if (*styles == NULL) {
+			*styles = g_string_sized_new (style_len + 1);
+		}
+
+		g_string_append_len (*styles, (const gchar *)p, style_len);
+		g_string_append_c (*styles, '\n');
+	}
+}
+
+/*
+ * Sets html style sheet from all <style> blocks of a part, parsing them
+ * only if the same blocks have not been seen recently
+ */
+static void
+rspamd_html_process_styles (rspamd_mempool_t *pool,
+		struct html_content *hc,
+		GString *styles)
+{
+	struct rspamd_html_css_entry *entry;
+	rspamd_mempool_t *css_pool;
+	GError *err = NULL;
+	guint64 hash;
+	time_t now = time (NULL);
+
+	if (html_css_cache == NULL) {
+		html_css_cache = rspamd_lru_hash_new_full (max_css_cache, NULL,
+				rspamd_html_css_entry_unref, g_int64_hash, g_int64_equal);
+	}
+
+	hash = rspamd_cryptobox_fast_hash (styles->str, styles->len,
+			0xb32ad7c55eb2e647ULL);
+	entry = rspamd_lru_hash_lookup (html_css_cache, &hash, now);
+
+	if (entry == NULL || entry->len != styles->len ||
+			memcmp (entry->text, styles->str, styles->len) != 0) {
+		/*
+		 * Style sheet refers to its text, so both of them live in
+		 * a separate pool
+		 */
+		css_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				"css", 0);
+		entry = rspamd_mempool_alloc0 (css_pool, sizeof (*entry));
+		entry->pool = css_pool;
+		entry->hash = hash;
+		entry->len = styles->len;
+		entry->text = rspamd_mempool_alloc (css_pool, styles->len);
+		memcpy ((gchar *)entry->text, styles->str, styles->len);
+		entry->css = rspamd_css_parse_style (css_pool,
+				(const guchar *)entry->text, entry->len, NULL, &err);
+
+		if (entry->css == NULL) {
+			msg_debug_html ("cannot parse css: %e", err);
+
+			if (err) {
+				g_error_free (err);
+			}
+		}
+
+		/* Unparseable styles are cached as well to avoid parsing them again */
+		REF_INIT_RETAIN (entry, rspamd_html_css_entry_dtor);
+		rspamd_lru_hash_insert (html_css_cache, &entry->hash, entry, now, 0);
+	}
+
+	if (entry->css) {
+		REF_RETAIN (entry);
+		rspamd_mempool_add_destructor (pool, rspamd_html_css_entry_unref,
+				entry);
+		hc->css_style = entry->css;
+	}
+}
+
+/*
+ * Returns the first character starting from `p` that is significant for
+ * the content states: `<`, `&`, or any space or control character.
+ * Text runs are checked by 8 bytes using the well known `haszero` trick.
+ */
+static inline const guchar *
+rspamd_html_skip_text_run (const guchar *p, const guchar *end)
+{
+	static const guint64 ones = 0x0101010101010101ULL,
+			highs = 0x8080808080808080ULL;
+	guint64 v, lt, amp;
+
+	while (end - p >= (goffset)sizeof (v)) {
+		memcpy (&v, p, sizeof (v));
+		lt = v ^ (ones * '<');
+		amp = v ^ (ones * '&');
+
+		if (((lt - ones) & ~lt & highs) ||
+				((amp - ones) & ~amp & highs) ||
+				((v - ones * 0x21) & ~v & highs)) {
+			break;
+		}
+
+		p += sizeof (v);
+	}
+
+	while (p < end && *p != '<' && *p != '&' && *p > ' ') {
+		p ++;
+	}
+
+	return p;
+}
+
 GByteArray*
 rspamd_html_process_part_full (rspamd_mempool_t *pool,
 							   struct html_content *hc,
 							   GByteArray *in,
 							   GList **exceptions,
 							   khash_t (rspamd_url_hash) *url_set,
-							   GPtrArray *part_urls)
+							   GPtrArray *part_urls,
+							   const struct rspamd_html_limits *limits)
 {
 	const guchar *p, *c, *end, *savep = NULL;
 	guchar t;
@@ -2794,6 +2961,9 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool,
 	struct html_tag *cur_tag = NULL, *content_tag = NULL;
 	struct rspamd_url *url = NULL;
 	GQueue *styles_blocks;
+	GString *styles = NULL;
+	guint max_tags = default_max_tags, max_depth = 0, ntags = 0;
+	gdouble max_time = 0, start_time = 0;
 
 	enum {
 		parse_start = 0,
@@ -2816,6 +2986,19 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool,
 	g_assert (hc != NULL);
 	g_assert (pool != NULL);
 
+	if (limits) {
+		if (limits->max_tags > 0) {
+			max_tags = limits->max_tags;
+		}
+
+		max_depth = limits->max_depth;
+		max_time = limits->max_time;
+
+		if (max_time > 0) {
+			start_time = rspamd_get_ticks (FALSE);
+		}
+	}
+
 	rspamd_html_library_init ();
 	hc->tags_seen = rspamd_mempool_alloc0 (pool, NBYTES (N_TAGS));
 
@@ -2992,7 +3175,11 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool,
 
 		case content_ignore:
 			if (t != '<') {
-				p ++;
+				p = memchr (p, '<', end - p);
+
+				if (p == NULL) {
+					p = end;
+				}
 			}
 			else {
 				state = tag_begin;
@@ -3070,6 +3257,10 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool,
 						}
 						save_space = FALSE;
 					}
+
+					/* Nothing to do with the rest of plain text run */
+					p = rspamd_html_skip_text_run (p + 1, end);
+					continue;
 				}
 			}
 			else {
@@ -3168,7 +3359,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool,
 				balanced = TRUE;
 
 				if (rspamd_html_process_tag (pool, hc, cur_tag, &cur_level,
-						&balanced)) {
+						&balanced, max_tags)) {
 					state = content_write;
 					need_decode = FALSE;
 				}
@@ -3186,6 +3377,26 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool,
 					setbit (hc->tags_seen, cur_tag->id);
 				}
 
+				if (cur_tag->id == Tag_STYLE &&
+						!(cur_tag->flags & (FL_CLOSED|FL_CLOSING))) {
+					rspamd_html_process_style_block (&styles, p + 1, end);
+				}
+
+				/*
+				 * Stop parsing on limits, keeping everything parsed so far;
+				 * time is checked once per 64 tags as it is not free
+				 */
+				if ((max_depth > 0 && cur_tag->depth > max_depth) ||
+						(max_time > 0 && (++ntags & 63) == 0 &&
+						rspamd_get_ticks (FALSE) - start_time > max_time)) {
+					msg_info_pool_check ("truncate html part after %ud tags: "
+							"depth or time limit is reached",
+							hc->total_tags);
+					hc->flags |= RSPAMD_HTML_FLAG_TRUNCATED;
+					p = end;
+					continue;
+				}
+
 				if (!(cur_tag->flags & (FL_CLOSED|FL_CLOSING))) {
 					content_tag = cur_tag;
 				}
@@ -3372,8 +3583,12 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool,
 	}
 
 	if (hc->html_tags) {
-		g_node_traverse (hc->html_tags, G_POST_ORDER, G_TRAVERSE_ALL, -1,
-				rspamd_html_propagate_lengths, NULL);
+		rspamd_html_propagate_lengths (hc);
+	}
+
+	if (styles) {
+		rspamd_html_process_styles (pool, hc, styles);
+		g_string_free (styles, TRUE);
 	}
 
 	g_queue_free (styles_blocks);
@@ -3387,5 +3602,5 @@ rspamd_html_process_part (rspamd_mempool_t *pool,
 		struct html_content *hc,
 		GByteArray *in)
 {
-	return rspamd_html_process_part_full (pool, hc, in, NULL, NULL, NULL);
+	return rspamd_html_process_part_full (pool, hc, in, NULL, NULL, NULL, NULL);
 }
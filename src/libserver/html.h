@@ -24,6 +24,7 @@ extern "C" {
 #define RSPAMD_HTML_FLAG_DUPLICATE_ELEMENTS (1 << 5)
 #define RSPAMD_HTML_FLAG_TOO_MANY_TAGS (1 << 6)
 #define RSPAMD_HTML_FLAG_HAS_DATA_URLS (1 << 7)
+#define RSPAMD_HTML_FLAG_TRUNCATED (1 << 8)
 
 /*
  * Image flags
@@ -111,6 +112,7 @@ struct html_block {
 struct html_tag {
 	gint id;
 	gint flags;
+	guint depth;
 	struct html_tag_component name;
 	guint content_length;
 	goffset content_offset;
@@ -125,6 +127,8 @@ struct rspamd_task;
 struct html_content {
 	struct rspamd_url *base_url;
 	GNode *html_tags;
+	GPtrArray *all_tags; /**< tags inserted to `html_tags` in document order */
+	void *css_style; /**< rules from <style> blocks (rspamd_css), read only as shared between tasks */
 	gint flags;
 	guint total_tags;
 	struct html_color bgcolor;
@@ -143,11 +147,21 @@ GByteArray *rspamd_html_process_part (rspamd_mempool_t *pool,
 									  struct html_content *hc,
 									  GByteArray *in);
 
+/*
+ * Limits for html parsing, zero values stand for defaults (tags) or no limit
+ */
+struct rspamd_html_limits {
+	guint max_tags; /**< tags after this number are not added to the tree */
+	guint max_depth; /**< parsing stops when tags are nested deeper */
+	gdouble max_time; /**< parsing stops when it takes longer (seconds) */
+};
+
 GByteArray *rspamd_html_process_part_full (rspamd_mempool_t *pool,
 										   struct html_content *hc,
 										   GByteArray *in, GList **exceptions,
 										   khash_t (rspamd_url_hash) *url_set,
-										   GPtrArray *part_urls);
+										   GPtrArray *part_urls,
+										   const struct rspamd_html_limits *limits);
 
 /*
  * Returns true if a specified tag has been seen in a part
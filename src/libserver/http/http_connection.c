@@ -53,6 +53,8 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_PROXY = 1u << 5u,
 	RSPAMD_HTTP_CONN_FLAG_PROXY_REQUEST = 1u << 6u,
 	RSPAMD_HTTP_CONN_OWN_SOCKET = 1u << 7u,
+	RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE = 1u << 8u,
+	RSPAMD_HTTP_CONN_FLAG_IDLE = 1u << 9u,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
@@ -76,6 +78,7 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	rspamd_fstring_t *pipelined; /* data of the next request on server keepalive */
 };
 
 static const rspamd_ftok_t key_header = {
@@ -449,8 +452,14 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 			return -1;
 		}
 
-		/* We might have some leftover in our private buffer */
-		if (pbuf->data->len == length) {
+		/*
+		 * If this chunk ends our private buffer, then all the following data
+		 * belongs to the body (which is preallocated from Content-Length), so
+		 * we can read it directly to the body, even if this buffer has also
+		 * contained headers. Otherwise, we might have some leftover in our
+		 * private buffer.
+		 */
+		if (at + length == pbuf->data->str + pbuf->data->len) {
 			/* Switch to zero-copy mode */
 			rspamd_http_switch_zc (pbuf, msg);
 		}
@@ -693,6 +702,19 @@ rspamd_http_on_message_complete (http_parser * parser)
 
 	if (ret == 0) {
 		rspamd_ev_watcher_stop (priv->ctx->event_loop, &priv->ev);
+
+		if (conn->type == RSPAMD_HTTP_SERVER &&
+				(conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE) &&
+				!(priv->msg->flags & RSPAMD_HTTP_FLAG_SPAMC) &&
+				http_should_keep_alive (parser)) {
+			priv->flags |= RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+			/* Stop parsing here, the rest belongs to the next request */
+			http_parser_pause (parser, 1);
+		}
+		else {
+			priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+		}
+
 		rspamd_http_connection_ref (conn);
 		ret = conn->finish_handler (conn, priv->msg);
 
@@ -894,7 +916,19 @@ rspamd_http_try_read (gint fd,
 		}
 	}
 
-	if (priv->ssl) {
+	if (priv->pipelined && priv->pipelined->len > 0) {
+		r = MIN (len, priv->pipelined->len);
+		memcpy (data, priv->pipelined->str, r);
+		memmove (priv->pipelined->str, priv->pipelined->str + r,
+				priv->pipelined->len - r);
+		priv->pipelined->len -= r;
+
+		if (priv->pipelined->len > 0) {
+			/* Process the rest on the next loop iteration */
+			ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+		}
+	}
+	else if (priv->ssl) {
 		r = rspamd_ssl_read (priv->ssl, data, len);
 	}
 	else {
@@ -904,14 +938,15 @@ rspamd_http_try_read (gint fd,
 	if (r <= 0) {
 		return r;
 	}
+
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_IDLE;
+
+	if (pbuf->zc_buf == NULL) {
+		priv->buf->data->len = r;
+	}
 	else {
-		if (pbuf->zc_buf == NULL) {
-			priv->buf->data->len = r;
-		}
-		else {
-			pbuf->zc_remain -= r;
-			pbuf->zc_buf += r;
-		}
+		pbuf->zc_remain -= r;
+		pbuf->zc_buf += r;
 	}
 
 	if (buf_ptr) {
@@ -921,6 +956,28 @@ rspamd_http_try_read (gint fd,
 	return r;
 }
 
+static void
+rspamd_http_connection_save_pipelined (struct rspamd_http_connection_private *priv,
+		const gchar *data, gsize len)
+{
+	rspamd_fstring_t *npipelined;
+
+	if (len == 0) {
+		return;
+	}
+
+	npipelined = rspamd_fstring_new_init (data, len);
+
+	if (priv->pipelined) {
+		/* Data that has not been consumed yet goes after */
+		npipelined = rspamd_fstring_append (npipelined, priv->pipelined->str,
+				priv->pipelined->len);
+		rspamd_fstring_free (priv->pipelined);
+	}
+
+	priv->pipelined = npipelined;
+}
+
 static void
 rspamd_http_ssl_err_handler (gpointer ud, GError *err)
 {
@@ -939,6 +996,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct _rspamd_http_privbuf *pbuf;
 	const gchar *d;
 	gssize r;
+	gsize nparsed;
 	GError *err;
 
 	priv = conn->priv;
@@ -950,8 +1008,14 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb, d, r);
+
+			if (priv->parser.http_errno == HPE_PAUSED) {
+				/* Keepalive request is finished, save pipelined data */
+				rspamd_http_connection_save_pipelined (priv, d + nparsed,
+						r - nparsed);
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
 				if (priv->flags & RSPAMD_HTTP_CONN_FLAG_TOO_LARGE) {
 					err = g_error_new (HTTP_ERROR, 413,
 							"Request entity too large: %zu",
@@ -1034,8 +1098,13 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb, d, r);
+
+			if (priv->parser.http_errno == HPE_PAUSED) {
+				rspamd_http_connection_save_pipelined (priv, d + nparsed,
+						r - nparsed);
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
 				err = g_error_new (HTTP_ERROR, 400,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -1245,7 +1314,8 @@ rspamd_http_connection_new_keepalive (struct rspamd_http_context *ctx,
 									  rspamd_http_error_handler_t error_handler,
 									  rspamd_http_finish_handler_t finish_handler,
 									  rspamd_inet_addr_t *addr,
-									  const gchar *host)
+									  const gchar *host,
+									  gboolean is_ssl)
 {
 	struct rspamd_http_connection *conn;
 
@@ -1253,7 +1323,7 @@ rspamd_http_connection_new_keepalive (struct rspamd_http_context *ctx,
 		ctx = rspamd_http_context_default ();
 	}
 
-	conn = rspamd_http_context_check_keepalive (ctx, addr, host);
+	conn = rspamd_http_context_check_keepalive (ctx, addr, host, is_ssl);
 
 	if (conn) {
 		return conn;
@@ -1265,7 +1335,7 @@ rspamd_http_connection_new_keepalive (struct rspamd_http_context *ctx,
 			addr);
 
 	if (conn) {
-		rspamd_http_context_prepare_keepalive (ctx, conn, addr, host);
+		rspamd_http_context_prepare_keepalive (ctx, conn, addr, host, is_ssl);
 	}
 
 	return conn;
@@ -1485,6 +1555,10 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			rspamd_pubkey_unref (priv->peer_key);
 		}
 
+		if (priv->pipelined) {
+			rspamd_fstring_free (priv->pipelined);
+		}
+
 		if (priv->flags & RSPAMD_HTTP_CONN_OWN_SOCKET) {
 			/* Fd is owned by a connection */
 			close (conn->fd);
@@ -1549,6 +1623,49 @@ rspamd_http_connection_read_message_shared (struct rspamd_http_connection *conn,
 			RSPAMD_HTTP_FLAG_SHMEM);
 }
 
+gboolean
+rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn)
+{
+	return (conn->priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE) != 0;
+}
+
+void
+rspamd_http_connection_disable_keepalive (struct rspamd_http_connection *conn)
+{
+	conn->priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+}
+
+gboolean
+rspamd_http_connection_is_idle (struct rspamd_http_connection *conn)
+{
+	return (conn->priv->flags & RSPAMD_HTTP_CONN_FLAG_IDLE) != 0;
+}
+
+void
+rspamd_http_connection_read_next_message (struct rspamd_http_connection *conn,
+		gpointer ud, ev_tstamp timeout)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	rspamd_http_connection_reset (conn);
+	/* Each request carries its own key */
+	if (priv->peer_key) {
+		rspamd_pubkey_unref (priv->peer_key);
+		priv->peer_key = NULL;
+	}
+
+	priv->flags &= ~(RSPAMD_HTTP_CONN_FLAG_ENCRYPTED|
+			RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE);
+	priv->flags |= RSPAMD_HTTP_CONN_FLAG_IDLE;
+	/* Parser might have been paused after the previous request */
+	rspamd_http_parser_reset (conn);
+	rspamd_http_connection_read_message_common (conn, ud, timeout, 0);
+
+	if (priv->pipelined && priv->pipelined->len > 0) {
+		ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+	}
+}
+
 static void
 rspamd_http_connection_encrypt_message (
 		struct rspamd_http_connection *conn,
@@ -1663,6 +1780,20 @@ rspamd_http_detach_shared (struct rspamd_http_message *msg)
 	rspamd_http_message_set_body_from_fstring_steal (msg, cpy_str);
 }
 
+static void
+rspamd_http_merge_body_tail (struct rspamd_http_message *msg)
+{
+	rspamd_fstring_t *cpy_str;
+
+	cpy_str = rspamd_fstring_sized_new (msg->body_buf.len + msg->body_tail.len);
+	cpy_str = rspamd_fstring_append (cpy_str, msg->body_buf.begin,
+			msg->body_buf.len);
+	cpy_str = rspamd_fstring_append (cpy_str, msg->body_tail.begin,
+			msg->body_tail.len);
+	rspamd_http_message_set_body_from_fstring_steal (msg, cpy_str);
+	rspamd_http_message_set_body_tail (msg, NULL, 0);
+}
+
 gint
 rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 		gchar *repbuf, gsize replen, gsize bodylen, gsize enclen, const gchar* host,
@@ -1676,6 +1807,10 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 	const gchar *conn_type = "close";
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
+		if (priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE) {
+			conn_type = "keep-alive";
+		}
+
 		/* Format reply */
 		if (msg->method < HTTP_SYMBOLS) {
 			rspamd_ftok_t status;
@@ -1715,12 +1850,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s", /* NO \r\n at the end ! */
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1728,11 +1864,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z", /* NO \r\n at the end ! */
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen);
 				}
@@ -1740,11 +1877,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
+						conn_type,
 						priv->ctx->config.server_hdr,
 						datebuf, enclen);
 			}
@@ -1753,12 +1891,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1766,17 +1905,21 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen);
 				}
 			}
 		}
 		else {
+			/* Legacy protocols have no persistent connections */
+			priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+
 			/* Legacy spamd reply */
 			if (msg->flags & RSPAMD_HTTP_FLAG_SPAMC) {
 				gsize real_bodylen;
@@ -1978,6 +2121,15 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 		}
 	}
 
+	if (msg->body_tail.len > 0 && (encrypted || msg->method >= HTTP_SYMBOLS ||
+			(msg->flags & (RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE|RSPAMD_HTTP_FLAG_SHMEM)))) {
+		/*
+		 * Tail is not ours to encrypt in place, and legacy and shared bodies
+		 * are written as a single piece
+		 */
+		rspamd_http_merge_body_tail (msg);
+	}
+
 	if (encrypted && (msg->flags &
 			(RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE|RSPAMD_HTTP_FLAG_SHMEM))) {
 		/* We cannot use immutable body to encrypt message in place */
@@ -2114,7 +2266,8 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 	}
 	else {
 		if (msg->method < HTTP_SYMBOLS) {
-			if (msg->body_buf.len == 0 || allow_shared) {
+			if ((msg->body_buf.len == 0 && msg->body_tail.len == 0) ||
+					allow_shared) {
 				pbody = NULL;
 				bodylen = 0;
 				priv->outlen = 2;
@@ -2125,8 +2278,9 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			}
 			else {
 				pbody = (gchar *)msg->body_buf.begin;
-				bodylen = msg->body_buf.len;
-				priv->outlen = 3;
+				/* Content-Length covers the tail segment as well */
+				bodylen = msg->body_buf.len + msg->body_tail.len;
+				priv->outlen = msg->body_tail.len > 0 ? 4 : 3;
 
 				if (msg->method == HTTP_INVALID) {
 					msg->method = HTTP_POST;
@@ -2247,7 +2401,12 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 
 		if (pbody != NULL) {
 			priv->out[i].iov_base = pbody;
-			priv->out[i++].iov_len = bodylen;
+			priv->out[i++].iov_len = msg->body_buf.len;
+
+			if (msg->body_tail.len > 0) {
+				priv->out[i].iov_base = (void *)msg->body_tail.begin;
+				priv->out[i++].iov_len = msg->body_tail.len;
+			}
 		}
 	}
 
@@ -2273,6 +2432,13 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			g_error_free (err);
 			return FALSE;
 		}
+		else if (priv->ssl && (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) &&
+				rspamd_ssl_connection_restore_handlers (priv->ssl,
+						rspamd_http_event_handler,
+						rspamd_http_ssl_err_handler, conn,
+						priv->timeout, EV_WRITE)) {
+			/* Reused keepalive connection, session is already established */
+		}
 		else {
 			if (priv->ssl) {
 				/* Cleanup the existing connection */
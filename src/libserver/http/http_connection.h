@@ -89,6 +89,7 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SHARED = 1u << 3, /**< Store reply in shared memory */
 	RSPAMD_HTTP_REQUIRE_ENCRYPTION = 1u << 4,
 	RSPAMD_HTTP_CLIENT_KEEP_ALIVE = 1u << 5,
+	RSPAMD_HTTP_SERVER_KEEP_ALIVE = 1u << 6, /**< Allow persistent connections for server */
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -141,13 +142,15 @@ struct rspamd_http_connection *rspamd_http_connection_new_server (
 		unsigned opts);
 
 /**
- * Creates or reuses a new keepalive client connection identified by hostname and inet_addr
+ * Creates or reuses a new keepalive client connection identified by hostname,
+ * inet_addr and ssl flag (TLS sessions of reused connections are preserved)
  * @param ctx
  * @param body_handler
  * @param error_handler
  * @param finish_handler
  * @param addr
  * @param host
+ * @param is_ssl
  * @return
  */
 struct rspamd_http_connection *rspamd_http_connection_new_keepalive (
@@ -156,7 +159,8 @@ struct rspamd_http_connection *rspamd_http_connection_new_keepalive (
 		rspamd_http_error_handler_t error_handler,
 		rspamd_http_finish_handler_t finish_handler,
 		rspamd_inet_addr_t *addr,
-		const gchar *host);
+		const gchar *host,
+		gboolean is_ssl);
 
 /**
  * Creates an ordinary connection using the address specified (if proxy is not set)
@@ -296,6 +300,37 @@ rspamd_http_connection_unref (struct rspamd_http_connection *conn) {
  */
 void rspamd_http_connection_reset (struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if the current request on a server connection allows to keep
+ * the connection open after the reply (requires RSPAMD_HTTP_SERVER_KEEP_ALIVE)
+ * @param conn
+ */
+gboolean rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn);
+
+/**
+ * Makes server to reply with `Connection: close` and to close connection
+ * after the current reply
+ * @param conn
+ */
+void rspamd_http_connection_disable_keepalive (struct rspamd_http_connection *conn);
+
+/**
+ * Returns TRUE if a keepalive connection is waiting for the next request and
+ * has not received any data of it yet, so an error means a normal close
+ * @param conn
+ */
+gboolean rspamd_http_connection_is_idle (struct rspamd_http_connection *conn);
+
+/**
+ * Resets a server keepalive connection and starts reading of the next
+ * request; pipelined data received with the previous request is processed first
+ * @param conn
+ * @param ud
+ * @param timeout
+ */
+void rspamd_http_connection_read_next_message (struct rspamd_http_connection *conn,
+		gpointer ud, ev_tstamp timeout);
+
 /**
  * Sets global maximum size for HTTP message being processed
  * @param sz
@@ -292,6 +292,55 @@ rspamd_http_context_create (struct rspamd_config *cfg,
 }
 
 
+ucl_object_t *
+rspamd_http_context_keypairs_stat (struct rspamd_http_context *ctx)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	if (ctx->client_kp_cache) {
+		ucl_object_insert_key (obj,
+				rspamd_keypair_cache_stat_to_ucl (ctx->client_kp_cache),
+				"client", 0, false);
+	}
+
+	if (ctx->server_kp_cache) {
+		ucl_object_insert_key (obj,
+				rspamd_keypair_cache_stat_to_ucl (ctx->server_kp_cache),
+				"server", 0, false);
+	}
+
+	return obj;
+}
+
+ucl_object_t *
+rspamd_http_context_keepalive_stat (struct rspamd_http_context *ctx)
+{
+	struct rspamd_keepalive_hash_key *hk;
+	ucl_object_t *obj;
+	guint64 idle = 0;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	kh_foreach_key (ctx->keep_alive_hash, hk, {
+		idle += hk->conns.length;
+	});
+
+	ucl_object_insert_key (obj, ucl_object_fromint (ctx->keepalive_stat.reused),
+			"reused", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (ctx->keepalive_stat.missed),
+			"missed", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (ctx->keepalive_stat.pooled),
+			"pooled", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (ctx->keepalive_stat.expired),
+			"expired", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (idle),
+			"idle", 0, false);
+
+	return obj;
+}
+
 void
 rspamd_http_context_free (struct rspamd_http_context *ctx)
 {
@@ -368,6 +417,7 @@ rspamd_keep_alive_key_hash (struct rspamd_keepalive_hash_key *k)
 	gint32 h;
 
 	h = rspamd_inet_address_port_hash (k->addr);
+	h ^= k->is_ssl;
 
 	if (k->host) {
 		h = rspamd_cryptobox_fast_hash (k->host, strlen (k->host), h);
@@ -380,6 +430,10 @@ bool
 rspamd_keep_alive_key_equal (struct rspamd_keepalive_hash_key *k1,
 								  struct rspamd_keepalive_hash_key *k2)
 {
+	if (k1->is_ssl != k2->is_ssl) {
+		return false;
+	}
+
 	if (k1->host && k2->host) {
 		if (rspamd_inet_address_port_equal (k1->addr, k2->addr)) {
 			return strcmp (k1->host, k2->host) == 0;
@@ -396,13 +450,15 @@ rspamd_keep_alive_key_equal (struct rspamd_keepalive_hash_key *k1,
 struct rspamd_http_connection*
 rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 		const rspamd_inet_addr_t *addr,
-		const gchar *host)
+		const gchar *host,
+		gboolean is_ssl)
 {
 	struct rspamd_keepalive_hash_key hk, *phk;
 	khiter_t k;
 
 	hk.addr = (rspamd_inet_addr_t *)addr;
 	hk.host = (gchar *)host;
+	hk.is_ssl = is_ssl;
 
 	k = kh_get (rspamd_keep_alive_hash, ctx->keep_alive_hash, &hk);
 
@@ -429,6 +485,8 @@ rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 
 			if (err != 0) {
 				rspamd_http_connection_unref (conn);
+				ctx->keepalive_stat.expired ++;
+				ctx->keepalive_stat.missed ++;
 
 				msg_debug_http_context ("invalid reused keepalive element %s (%s); "
 							"%s error; "
@@ -445,6 +503,8 @@ rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 					rspamd_inet_address_to_string_pretty (phk->addr),
 					phk->host, conns->length);
 
+			ctx->keepalive_stat.reused ++;
+
 			/* We transfer refcount here! */
 			return conn;
 		}
@@ -455,6 +515,8 @@ rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 		}
 	}
 
+	ctx->keepalive_stat.missed ++;
+
 	return NULL;
 }
 
@@ -462,13 +524,15 @@ void
 rspamd_http_context_prepare_keepalive (struct rspamd_http_context *ctx,
 											struct rspamd_http_connection *conn,
 											const rspamd_inet_addr_t *addr,
-											const gchar *host)
+											const gchar *host,
+											gboolean is_ssl)
 {
 	struct rspamd_keepalive_hash_key hk, *phk;
 	khiter_t k;
 
 	hk.addr = (rspamd_inet_addr_t *)addr;
 	hk.host = (gchar *)host;
+	hk.is_ssl = is_ssl;
 
 	k = kh_get (rspamd_keep_alive_hash, ctx->keep_alive_hash, &hk);
 
@@ -488,6 +552,7 @@ rspamd_http_context_prepare_keepalive (struct rspamd_http_context *ctx,
 		phk->conns = empty_init;
 		phk->host = g_strdup (host);
 		phk->addr = rspamd_inet_address_copy (addr);
+		phk->is_ssl = is_ssl;
 
 		kh_put (rspamd_keep_alive_hash, ctx->keep_alive_hash, phk, &r);
 		conn->keepalive_hash_key = phk;
@@ -515,6 +580,7 @@ rspamd_http_keepalive_handler (gint fd, short what, gpointer ud)
 	/* unref call closes fd, so we need to remove ev watcher first! */
 	rspamd_ev_watcher_stop (cbdata->ctx->event_loop, &cbdata->ev);
 	rspamd_http_connection_unref (cbdata->conn);
+	cbdata->ctx->keepalive_stat.expired ++;
 	g_free (cbdata);
 }
 
@@ -595,6 +661,7 @@ rspamd_http_context_push_keepalive (struct rspamd_http_context *ctx,
 	cbdata->queue = &conn->keepalive_hash_key->conns;
 	cbdata->ctx = ctx;
 	conn->finished = FALSE;
+	ctx->keepalive_stat.pooled ++;
 
 	rspamd_ev_watcher_init (&cbdata->ev, conn->fd, EV_READ,
 			rspamd_http_keepalive_handler,
@@ -66,17 +66,32 @@ void rspamd_http_context_free (struct rspamd_http_context *ctx);
 
 struct rspamd_http_context *rspamd_http_context_default (void);
 
+/**
+ * Returns statistics of the client and server keypairs caches
+ * @param ctx
+ * @return new UCL object
+ */
+ucl_object_t *rspamd_http_context_keypairs_stat (struct rspamd_http_context *ctx);
+
+/**
+ * Returns statistics of the client keepalive pool
+ * @param ctx
+ * @return new UCL object
+ */
+ucl_object_t *rspamd_http_context_keepalive_stat (struct rspamd_http_context *ctx);
+
 /**
  * Returns preserved keepalive connection if it's available.
  * Refcount is transferred to caller!
  * @param ctx
  * @param addr
  * @param host
+ * @param is_ssl
  * @return
  */
 struct rspamd_http_connection *rspamd_http_context_check_keepalive (
 		struct rspamd_http_context *ctx, const rspamd_inet_addr_t *addr,
-		const gchar *host);
+		const gchar *host, gboolean is_ssl);
 
 /**
  * Prepares keepalive key for a connection by creating a new entry or by reusing existent
@@ -85,11 +100,13 @@ struct rspamd_http_connection *rspamd_http_context_check_keepalive (
  * @param conn
  * @param addr
  * @param host
+ * @param is_ssl
  */
 void rspamd_http_context_prepare_keepalive (struct rspamd_http_context *ctx,
 											struct rspamd_http_connection *conn,
 											const rspamd_inet_addr_t *addr,
-											const gchar *host);
+											const gchar *host,
+											gboolean is_ssl);
 
 /**
  * Pushes a connection to keepalive pool after client request is finished,
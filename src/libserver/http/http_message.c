@@ -429,6 +429,14 @@ rspamd_http_message_append_body (struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+void
+rspamd_http_message_set_body_tail (struct rspamd_http_message *msg,
+								   const gchar *data, gsize len)
+{
+	msg->body_tail.begin = data;
+	msg->body_tail.len = len;
+}
+
 void
 rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg)
 {
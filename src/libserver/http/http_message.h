@@ -148,6 +148,16 @@ gboolean rspamd_http_message_set_body_from_fstring_copy (struct rspamd_http_mess
 gboolean rspamd_http_message_append_body (struct rspamd_http_message *msg,
 										  const gchar *data, gsize len);
 
+/**
+ * Sets data that is written right after message's body without copying,
+ * data must be valid until the message is written
+ * @param msg
+ * @param data
+ * @param len
+ */
+void rspamd_http_message_set_body_tail (struct rspamd_http_message *msg,
+										const gchar *data, gsize len);
+
 /**
  * Append a header to http message
  * @param rep
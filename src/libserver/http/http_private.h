@@ -72,6 +72,12 @@ struct rspamd_http_message {
 		} c;
 	} body_buf;
 
+	/* Written after the body as a separate segment, not owned by message */
+	struct _rspamd_body_tail_s {
+		const gchar *begin;
+		gsize len;
+	} body_tail;
+
 	struct rspamd_cryptobox_pubkey *peer_key;
 	time_t date;
 	time_t last_modified;
@@ -86,9 +92,17 @@ struct rspamd_http_message {
 struct rspamd_keepalive_hash_key {
 	rspamd_inet_addr_t *addr;
 	gchar *host;
+	gboolean is_ssl;
 	GQueue conns;
 };
 
+struct rspamd_http_keepalive_stat {
+	guint64 reused;
+	guint64 missed;
+	guint64 pooled;
+	guint64 expired;
+};
+
 gint32 rspamd_keep_alive_key_hash (struct rspamd_keepalive_hash_key *k);
 
 bool rspamd_keep_alive_key_equal (struct rspamd_keepalive_hash_key *k1,
@@ -109,6 +123,7 @@ struct rspamd_http_context {
 	struct ev_loop *event_loop;
 	ev_timer client_rotate_ev;
 	khash_t (rspamd_keep_alive_hash) *keep_alive_hash;
+	struct rspamd_http_keepalive_stat keepalive_stat;
 };
 
 #define HTTP_ERROR http_error_quark ()
@@ -63,6 +63,35 @@ rspamd_http_entry_free (struct rspamd_http_connection_entry *entry)
 	}
 }
 
+static gboolean
+rspamd_http_entry_keepalive (struct rspamd_http_connection_entry *entry)
+{
+	gpointer nud;
+
+	if (entry->rt->keepalive_handler == NULL ||
+			!rspamd_http_connection_is_keepalive (entry->conn)) {
+		return FALSE;
+	}
+
+	nud = entry->rt->keepalive_handler (entry);
+
+	if (nud == NULL) {
+		return FALSE;
+	}
+
+	if (entry->rt->finish_handler) {
+		entry->rt->finish_handler (entry);
+	}
+
+	entry->ud = nud;
+	entry->is_reply = FALSE;
+	entry->support_gzip = FALSE;
+	rspamd_http_connection_read_next_message (entry->conn, entry,
+			entry->rt->keepalive_timeout);
+
+	return TRUE;
+}
+
 static void
 rspamd_http_router_error_handler (struct rspamd_http_connection *conn,
 								  GError *err)
@@ -70,6 +99,13 @@ rspamd_http_router_error_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_connection_entry *entry = conn->ud;
 	struct rspamd_http_message *msg;
 
+	if (!entry->is_reply && rspamd_http_connection_is_idle (conn)) {
+		/* Client has closed a persistent connection */
+		rspamd_http_entry_free (entry);
+
+		return;
+	}
+
 	if (entry->is_reply) {
 		/* At this point we need to finish this session and close owned socket */
 		if (entry->rt->error_handler != NULL) {
@@ -264,7 +300,9 @@ rspamd_http_router_finish_handler (struct rspamd_http_connection *conn,
 
 	if (entry->is_reply) {
 		/* Request is finished, it is safe to free a connection */
-		rspamd_http_entry_free (entry);
+		if (!rspamd_http_entry_keepalive (entry)) {
+			rspamd_http_entry_free (entry);
+		}
 	}
 	else {
 		if (G_UNLIKELY (msg->method != HTTP_GET && msg->method != HTTP_POST)) {
@@ -434,6 +472,15 @@ rspamd_http_router_set_key (struct rspamd_http_connection_router *router,
 	router->key = rspamd_keypair_ref (key);
 }
 
+void
+rspamd_http_router_set_keepalive (struct rspamd_http_connection_router *router,
+								  rspamd_http_router_keepalive_handler_t handler,
+								  ev_tstamp timeout)
+{
+	router->keepalive_handler = handler;
+	router->keepalive_timeout = timeout;
+}
+
 void
 rspamd_http_router_add_path (struct rspamd_http_connection_router *router,
 							 const gchar *path, rspamd_http_router_handler_t handler)
@@ -520,7 +567,7 @@ rspamd_http_router_handle_socket (struct rspamd_http_connection_router *router,
 			NULL,
 			rspamd_http_router_error_handler,
 			rspamd_http_router_finish_handler,
-			0);
+			router->keepalive_handler ? RSPAMD_HTTP_SERVER_KEEP_ALIVE : 0);
 
 	if (router->key) {
 		rspamd_http_connection_set_key (conn->conn, router->key);
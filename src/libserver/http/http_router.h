@@ -35,6 +35,8 @@ typedef void (*rspamd_http_router_error_handler_t) (struct rspamd_http_connectio
 
 typedef void (*rspamd_http_router_finish_handler_t) (struct rspamd_http_connection_entry *conn_ent);
 
+typedef gpointer (*rspamd_http_router_keepalive_handler_t) (struct rspamd_http_connection_entry *conn_ent);
+
 
 struct rspamd_http_connection_entry {
 	struct rspamd_http_connection_router *rt;
@@ -58,6 +60,8 @@ struct rspamd_http_connection_router {
 	struct rspamd_cryptobox_keypair *key;
 	rspamd_http_router_error_handler_t error_handler;
 	rspamd_http_router_finish_handler_t finish_handler;
+	rspamd_http_router_keepalive_handler_t keepalive_handler;
+	ev_tstamp keepalive_timeout;
 };
 
 /**
@@ -83,6 +87,18 @@ struct rspamd_http_connection_router *rspamd_http_router_new (
 void rspamd_http_router_set_key (struct rspamd_http_connection_router *router,
 								 struct rspamd_cryptobox_keypair *key);
 
+/**
+ * Keep client connections open between requests; the handler is called after
+ * a reply and returns user data for the next request or NULL to close
+ * the connection. Finish handler is called for the previous user data then.
+ * @param router router structure
+ * @param handler keepalive handler
+ * @param timeout idle timeout
+ */
+void rspamd_http_router_set_keepalive (struct rspamd_http_connection_router *router,
+									   rspamd_http_router_keepalive_handler_t handler,
+									   ev_tstamp timeout);
+
 /**
  * Add new path to the router
  */
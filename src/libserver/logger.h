@@ -118,6 +118,43 @@ bool rspamd_log_reopen (rspamd_logger_t *logger, struct rspamd_config *cfg,
 void rspamd_log_on_fork (GQuark ptype, struct rspamd_config *cfg,
 						 rspamd_logger_t *logger);
 
+struct rspamd_log_ring;
+
+/**
+ * Creates a ring for asynchronous logging in shared memory, must be called
+ * before fork
+ * @param size size of the ring in bytes (rounded up to a power of two)
+ * @return new ring or NULL if shared memory cannot be allocated
+ */
+struct rspamd_log_ring * rspamd_log_ring_new (gsize size);
+
+/**
+ * Unmaps an async logging ring
+ */
+void rspamd_log_ring_destroy (struct rspamd_log_ring *ring);
+
+/**
+ * Makes logger push all records to the ring (used in a worker after fork).
+ * Records are written by main process with `rspamd_log_ring_drain`
+ */
+void rspamd_log_set_ring (rspamd_logger_t *logger, struct rspamd_log_ring *ring);
+
+/**
+ * Writes all records pending in a ring using the specified logger
+ * @param pid pid of the process that owns the ring
+ * @param ptype process type of the process that owns the ring
+ * @return number of records written
+ */
+gsize rspamd_log_ring_drain (rspamd_logger_t *logger,
+							 struct rspamd_log_ring *ring,
+							 pid_t pid, GQuark ptype);
+
+/**
+ * Returns number of records that were written directly by a producer as
+ * the ring was full
+ */
+guint64 rspamd_log_ring_fallbacks (struct rspamd_log_ring *ring);
+
 /**
  * Log function that is compatible for glib messages
  */
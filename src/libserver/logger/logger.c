@@ -285,6 +285,8 @@ rspamd_log_on_fork (GQuark ptype, struct rspamd_config *cfg,
 {
 	logger->pid = getpid ();
 	logger->process_type = g_quark_to_string (ptype);
+	/* A ring has a single producer, so it is set explicitly for a worker */
+	logger->async_ring = NULL;
 
 	if (logger->ops.on_fork) {
 		GError *err = NULL;
@@ -411,6 +413,29 @@ rspamd_log_write_ringbuffer (rspamd_logger_t *rspamd_log,
 	g_atomic_int_set (&elt->completed, 1);
 }
 
+static inline bool
+rspamd_log_emit (rspamd_logger_t *rspamd_log,
+		const gchar *module, const gchar *id,
+		const gchar *function,
+		gint level_flags,
+		const gchar *message,
+		gsize mlen)
+{
+	if (rspamd_log->async_ring &&
+			rspamd_log_ring_push (rspamd_log, module, id, function, level_flags,
+					message, mlen)) {
+		return true;
+	}
+
+	return rspamd_log->ops.log (module, id,
+			function,
+			level_flags,
+			message,
+			mlen,
+			rspamd_log,
+			rspamd_log->ops.specific);
+}
+
 bool
 rspamd_common_logv (rspamd_logger_t *rspamd_log, gint level_flags,
 		const gchar *module, const gchar *id, const gchar *function,
@@ -476,23 +501,19 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log, gint level_flags,
 
 				encrypted = rspamd_log_encrypt_message (log_line, end, &enc_len,
 						rspamd_log);
-				ret = rspamd_log->ops.log (module, id,
+				ret = rspamd_log_emit (rspamd_log, module, id,
 						function,
 						level_flags,
 						encrypted,
-						enc_len,
-						rspamd_log,
-						rspamd_log->ops.specific);
+						enc_len);
 				g_free (encrypted);
 			}
 			else {
-				ret = rspamd_log->ops.log (module, id,
+				ret = rspamd_log_emit (rspamd_log, module, id,
 						function,
 						level_flags,
 						log_line,
-						end - log_line,
-						rspamd_log,
-						rspamd_log->ops.specific);
+						end - log_line);
 			}
 
 			switch (level) {
@@ -598,13 +619,11 @@ rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
 		va_end (vp);
-		return rspamd_log->ops.log (module, id,
+		return rspamd_log_emit (rspamd_log, module, id,
 				function,
 				G_LOG_LEVEL_DEBUG | RSPAMD_LOG_FORCED,
 				logbuf,
-				end - logbuf,
-				rspamd_log,
-				rspamd_log->ops.specific);
+				end - logbuf);
 	}
 
 	return false;
@@ -637,13 +656,11 @@ rspamd_conditional_debug_fast (rspamd_logger_t *rspamd_log,
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
 		va_end (vp);
-		return rspamd_log->ops.log (module, id,
+		return rspamd_log_emit (rspamd_log, module, id,
 				function,
 				G_LOG_LEVEL_DEBUG | RSPAMD_LOG_FORCED,
 				logbuf,
-				end - logbuf,
-				rspamd_log,
-				rspamd_log->ops.specific);
+				end - logbuf);
 	}
 
 	return false;
@@ -677,13 +694,11 @@ rspamd_conditional_debug_fast_num_id (rspamd_logger_t *rspamd_log,
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
 		va_end (vp);
-		return rspamd_log->ops.log (module, idbuf,
+		return rspamd_log_emit (rspamd_log, module, idbuf,
 				function,
 				G_LOG_LEVEL_DEBUG | RSPAMD_LOG_FORCED,
 				logbuf,
-				end - logbuf,
-				rspamd_log,
-				rspamd_log->ops.specific);
+				end - logbuf);
 	}
 
 	return false;
@@ -0,0 +1,301 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Asynchronous logging: each worker owns a single producer/single consumer
+ * ring placed in a shared anonymous mapping. A worker pushes preformatted
+ * records to its ring and the main process drains all rings periodically
+ * writing records by means of the configured logger. So workers never wait
+ * for a slow disk or syslog unless their ring is full.
+ */
+
+#include "config.h"
+#include "logger.h"
+#include "unix-std.h"
+
+#include "logger_private.h"
+
+#include <sys/mman.h>
+
+#define RSPAMD_LOG_RING_MIN_SIZE (64 * 1024)
+#define RSPAMD_LOG_RING_ALIGN 8
+
+struct rspamd_log_ring_rec {
+	guint32 len;      /* Total length of a record including this header */
+	gint32 level_flags;
+	gdouble ts;
+	guint32 mlen;
+	guint8 id_len;
+	guint8 module_len;
+	guint8 func_len;
+	guint8 flags;
+	/* id, module, function and message follow */
+};
+
+/* Distinguish NULL from empty strings */
+#define RSPAMD_LOG_RING_REC_NO_FUNC (1u << 0)
+#define RSPAMD_LOG_RING_REC_NO_MODULE (1u << 1)
+#define RSPAMD_LOG_RING_REC_NO_ID (1u << 2)
+
+struct rspamd_log_ring {
+	/* Written by producer only */
+	guint64 head;
+	guint64 fallbacks;
+	/* Avoid false cache sharing */
+	guchar __padding1[64 - sizeof (guint64) * 2];
+	/* Written by consumer only */
+	guint64 tail;
+	guchar __padding2[64 - sizeof (guint64)];
+	/* Immutable */
+	guint64 size;
+	gsize mapped;
+	guchar data[];
+};
+
+struct rspamd_log_ring *
+rspamd_log_ring_new (gsize size)
+{
+	struct rspamd_log_ring *ring;
+	gsize real_size = RSPAMD_LOG_RING_MIN_SIZE, mapped;
+	gpointer map;
+
+	/* Power of two to use mask instead of modulo */
+	while (real_size < size) {
+		real_size <<= 1;
+	}
+
+	mapped = sizeof (*ring) + real_size;
+	map = mmap (NULL, mapped, PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_SHARED, -1, 0);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	ring = (struct rspamd_log_ring *)map;
+	ring->size = real_size;
+	ring->mapped = mapped;
+
+	return ring;
+}
+
+void
+rspamd_log_ring_destroy (struct rspamd_log_ring *ring)
+{
+	if (ring) {
+		munmap (ring, ring->mapped);
+	}
+}
+
+static inline void
+rspamd_log_ring_copy_in (struct rspamd_log_ring *ring, guint64 pos,
+		const void *src, gsize len)
+{
+	gsize off = pos & (ring->size - 1), part;
+
+	part = MIN (len, ring->size - off);
+	memcpy (ring->data + off, src, part);
+
+	if (part < len) {
+		memcpy (ring->data, ((const guchar *)src) + part, len - part);
+	}
+}
+
+static inline void
+rspamd_log_ring_copy_out (struct rspamd_log_ring *ring, guint64 pos,
+		void *dst, gsize len)
+{
+	gsize off = pos & (ring->size - 1), part;
+
+	part = MIN (len, ring->size - off);
+	memcpy (dst, ring->data + off, part);
+
+	if (part < len) {
+		memcpy (((guchar *)dst) + part, ring->data, len - part);
+	}
+}
+
+bool
+rspamd_log_ring_push (rspamd_logger_t *rspamd_log,
+		const gchar *module, const gchar *id,
+		const gchar *function,
+		gint level_flags,
+		const gchar *message,
+		gsize mlen)
+{
+	struct rspamd_log_ring *ring = rspamd_log->async_ring;
+	struct rspamd_log_ring_rec rec;
+	guint64 head, tail, pos;
+	gsize total;
+
+	memset (&rec, 0, sizeof (rec));
+
+	if (id) {
+		rec.id_len = MIN (strlen (id), RSPAMD_LOG_ID_LEN);
+	}
+	else {
+		rec.flags |= RSPAMD_LOG_RING_REC_NO_ID;
+	}
+
+	if (module) {
+		rec.module_len = MIN (strlen (module), G_MAXUINT8);
+	}
+	else {
+		rec.flags |= RSPAMD_LOG_RING_REC_NO_MODULE;
+	}
+
+	if (function) {
+		rec.func_len = MIN (strlen (function), G_MAXUINT8);
+	}
+	else {
+		rec.flags |= RSPAMD_LOG_RING_REC_NO_FUNC;
+	}
+
+	total = sizeof (rec) + rec.id_len + rec.module_len + rec.func_len + mlen;
+	total = (total + RSPAMD_LOG_RING_ALIGN - 1) & ~(RSPAMD_LOG_RING_ALIGN - 1);
+
+	if (total > ring->size / 2 || total > G_MAXUINT32) {
+		/* Too large, write it directly */
+		ring->fallbacks ++;
+
+		return false;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->size - (head - tail) < total) {
+		/* Consumer is too slow, write it directly */
+		ring->fallbacks ++;
+
+		return false;
+	}
+
+	rec.len = total;
+	rec.level_flags = level_flags;
+	rec.ts = rspamd_get_calendar_ticks ();
+	rec.mlen = mlen;
+
+	pos = head;
+	rspamd_log_ring_copy_in (ring, pos, &rec, sizeof (rec));
+	pos += sizeof (rec);
+	rspamd_log_ring_copy_in (ring, pos, id, rec.id_len);
+	pos += rec.id_len;
+	rspamd_log_ring_copy_in (ring, pos, module, rec.module_len);
+	pos += rec.module_len;
+	rspamd_log_ring_copy_in (ring, pos, function, rec.func_len);
+	pos += rec.func_len;
+	rspamd_log_ring_copy_in (ring, pos, message, mlen);
+
+	/* Publish record */
+	__atomic_store_n (&ring->head, head + total, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void
+rspamd_log_set_ring (rspamd_logger_t *logger, struct rspamd_log_ring *ring)
+{
+	logger->async_ring = ring;
+}
+
+gsize
+rspamd_log_ring_drain (rspamd_logger_t *logger, struct rspamd_log_ring *ring,
+		pid_t pid, GQuark ptype)
+{
+	struct rspamd_log_ring_rec rec;
+	guint64 head, tail;
+	gchar *buf = NULL, *msg;
+	gchar idbuf[RSPAMD_LOG_ID_LEN + 1], modbuf[G_MAXUINT8 + 1],
+			funcbuf[G_MAXUINT8 + 1];
+	gsize buflen = 0, nrecs = 0;
+	gint64 lost = 0;
+	pid_t saved_pid;
+	const gchar *saved_ptype;
+
+	head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+
+	if (head == tail) {
+		return 0;
+	}
+
+	saved_pid = logger->pid;
+	saved_ptype = logger->process_type;
+	logger->pid = pid;
+	logger->process_type = g_quark_to_string (ptype);
+
+	while (tail < head) {
+		rspamd_log_ring_copy_out (ring, tail, &rec, sizeof (rec));
+
+		if (rec.len < sizeof (rec) || rec.len > head - tail) {
+			/* Broken ring, should not happen, skip everything */
+			lost = head - tail;
+			tail = head;
+			break;
+		}
+
+		if (buflen < rec.len) {
+			buflen = MAX (rec.len, RSPAMD_LOGBUF_SIZE);
+			g_free (buf);
+			buf = g_malloc (buflen);
+		}
+
+		rspamd_log_ring_copy_out (ring, tail + sizeof (rec), buf,
+				rec.len - sizeof (rec));
+		/* Backends expect zero terminated id, module and function */
+		msg = buf;
+		rspamd_strlcpy (idbuf, msg, rec.id_len + 1);
+		msg += rec.id_len;
+		rspamd_strlcpy (modbuf, msg, rec.module_len + 1);
+		msg += rec.module_len;
+		rspamd_strlcpy (funcbuf, msg, rec.func_len + 1);
+		msg += rec.func_len;
+
+		logger->async_ts = rec.ts;
+		logger->ops.log (
+				(rec.flags & RSPAMD_LOG_RING_REC_NO_MODULE) ? NULL : modbuf,
+				(rec.flags & RSPAMD_LOG_RING_REC_NO_ID) ? NULL : idbuf,
+				(rec.flags & RSPAMD_LOG_RING_REC_NO_FUNC) ? NULL : funcbuf,
+				rec.level_flags,
+				msg,
+				rec.mlen,
+				logger,
+				logger->ops.specific);
+
+		tail += rec.len;
+		nrecs ++;
+	}
+
+	logger->async_ts = 0;
+	logger->pid = saved_pid;
+	logger->process_type = saved_ptype;
+
+	/* Release space for producer */
+	__atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+	g_free (buf);
+
+	if (lost > 0) {
+		msg_err ("broken async log ring of process %P, %L bytes lost",
+				pid, lost);
+	}
+
+	return nrecs;
+}
+
+guint64
+rspamd_log_ring_fallbacks (struct rspamd_log_ring *ring)
+{
+	return __atomic_load_n (&ring->fallbacks, __ATOMIC_RELAXED);
+}
@@ -180,7 +180,7 @@ rspamd_log_console_log (const gchar *module, const gchar *id,
 #endif
 
 	if (!(rspamd_log->flags & RSPAMD_LOG_FLAG_SYSTEMD)) {
-		log_time (rspamd_get_calendar_ticks (),
+		log_time (rspamd_log_now (rspamd_log),
 				rspamd_log, timebuf, sizeof (timebuf));
 	}
 
@@ -204,7 +204,7 @@ rspamd_log_console_log (const gchar *module, const gchar *id,
 
 	if (priv->log_rspamadm) {
 		if (rspamd_log->log_level == G_LOG_LEVEL_DEBUG) {
-			log_time (rspamd_get_calendar_ticks (),
+			log_time (rspamd_log_now (rspamd_log),
 					rspamd_log, timebuf, sizeof (timebuf));
 			iov[niov].iov_base = (void *) timebuf;
 			iov[niov++].iov_len = strlen (timebuf);
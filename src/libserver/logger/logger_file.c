@@ -494,7 +494,7 @@ rspamd_log_file_log (const gchar *module, const gchar *id,
 		}
 	}
 	if (!got_time) {
-		now = rspamd_get_calendar_ticks ();
+		now = rspamd_log_now (rspamd_log);
 	}
 
 	/* Format time */
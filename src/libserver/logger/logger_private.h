@@ -79,8 +79,37 @@ struct rspamd_logger_s {
 	rspamd_mempool_mutex_t *mtx;
 	rspamd_mempool_t *pool;
 	guint64 log_cnt[4];
+	/* Set in workers when async logging is enabled */
+	struct rspamd_log_ring *async_ring;
+	/* Original time of a record replayed from an async ring */
+	gdouble async_ts;
 };
 
+/**
+ * Returns time for a log line being written
+ */
+static inline gdouble
+rspamd_log_now (rspamd_logger_t *rspamd_log)
+{
+	if (rspamd_log->async_ts > 0) {
+		return rspamd_log->async_ts;
+	}
+
+	return rspamd_get_calendar_ticks ();
+}
+
+/**
+ * Pushes a preformatted record to the async ring of a logger
+ * @return false if there is no space in the ring, so a caller must log
+ * the record directly
+ */
+bool rspamd_log_ring_push (rspamd_logger_t *rspamd_log,
+						   const gchar *module, const gchar *id,
+						   const gchar *function,
+						   gint level_flags,
+						   const gchar *message,
+						   gsize mlen);
+
 /*
  * Common logging prototypes
  */
@@ -20,12 +20,14 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_helpers.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "rspamd.h"
 #include "contrib/zstd/zstd.h"
 #include "contrib/libev/ev.h"
 #include "contrib/uthash/utlist.h"
+#include "libutil/probes.h"
 
 #undef MAP_DEBUG_REFS
 #ifdef MAP_DEBUG_REFS
@@ -79,6 +81,50 @@ RSPAMD_CONSTRUCTOR(rspamd_map_log_init)
 /**
  * Write HTTP request
  */
+/*
+ * Delta updates are requested only if this process holds the data matching
+ * its etag and other processes can get the updated data from a shared image
+ */
+static gboolean
+rspamd_map_delta_usable (struct rspamd_map *map, struct http_map_data *data)
+{
+	return map->delta_callback != NULL && map->image_dump != NULL &&
+		   map->backends->len == 1 && !data->no_delta &&
+		   data->etag != NULL && data->etag_current &&
+		   map->user_data != NULL && *map->user_data != NULL;
+}
+
+static gboolean
+rspamd_map_http_process_data (struct rspamd_map *map,
+		struct http_callback_data *cbd, gchar *in, gsize len,
+		gboolean is_delta)
+{
+	if (is_delta) {
+		if (!map->delta_callback (in, len, &cbd->periodic->cbdata)) {
+			msg_err_map ("%s: cannot apply map delta, request the full map",
+					cbd->bk->uri);
+			/* Force full reload on the next check */
+			cbd->data->no_delta = TRUE;
+			cbd->data->etag_current = FALSE;
+			cbd->data->last_modified = 0;
+
+			if (cbd->data->etag) {
+				rspamd_fstring_free (cbd->data->etag);
+				cbd->data->etag = NULL;
+			}
+
+			return FALSE;
+		}
+	}
+	else {
+		map->read_callback (in, len, &cbd->periodic->cbdata, TRUE);
+	}
+
+	cbd->data->etag_current = TRUE;
+
+	return TRUE;
+}
+
 static void
 write_http_request (struct http_callback_data *cbd)
 {
@@ -110,6 +156,12 @@ write_http_request (struct http_callback_data *cbd)
 					cbd->data->etag->str, cbd->data->etag->len);
 		}
 	}
+	else if (rspamd_map_delta_usable (cbd->map, cbd->data)) {
+		/* Ask for changes since our etag (RFC 3229 delta encoding) */
+		rspamd_http_message_add_header (msg, "A-IM", RSPAMD_MAP_DELTA_IM);
+		rspamd_http_message_add_header_len (msg, "If-None-Match",
+				cbd->data->etag->str, cbd->data->etag->len);
+	}
 
 	msg->url = rspamd_fstring_append (msg->url, cbd->data->rest,
 			strlen (cbd->data->rest));
@@ -226,6 +278,85 @@ http_map_error (struct rspamd_http_connection *conn,
 	MAP_RELEASE (cbd, "http_callback_data");
 }
 
+static void
+rspamd_map_image_unlink (struct rspamd_map_cachepoint *cache)
+{
+	if (g_atomic_int_compare_and_exchange (&cache->image_available, 1, 0)) {
+		rspamd_map_image_remove (cache->image_name);
+	}
+}
+
+/*
+ * Compiles the freshly parsed data of a single backend HTTP map to a shared
+ * image, so other processes can load it instead of parsing the cached data
+ */
+static void
+rspamd_map_image_save (struct rspamd_map *map, struct map_cb_data *cbdata)
+{
+	struct rspamd_map_backend *bk;
+	struct http_map_data *data;
+	gchar name[sizeof (data->cache->image_name)];
+	gint fd;
+
+	bk = g_ptr_array_index (map->backends, 0);
+	data = bk->data.hd;
+
+	fd = rspamd_map_image_create (name, sizeof (name));
+
+	if (fd == -1) {
+		msg_err_map ("cannot create shared image for %s: %s", map->name,
+				strerror (errno));
+		return;
+	}
+
+	if (!map->image_dump (cbdata, fd)) {
+		close (fd);
+		rspamd_map_image_remove (name);
+
+		return;
+	}
+
+	close (fd);
+	rspamd_strlcpy (data->cache->image_name, name,
+			sizeof (data->cache->image_name));
+	data->cache->image_last_modified = data->cache->last_modified;
+	g_atomic_int_set (&data->cache->image_available, 1);
+	msg_info_map ("%s: saved shared image to %s", bk->uri, name);
+}
+
+static gboolean
+rspamd_map_image_load (struct rspamd_map *map, struct rspamd_map_backend *bk,
+		struct map_periodic_cbdata *periodic)
+{
+	struct http_map_data *data;
+	gchar name[sizeof (data->cache->image_name)];
+	gint fd;
+
+	data = bk->data.hd;
+	rspamd_strlcpy (name, data->cache->image_name, sizeof (name));
+
+#ifdef HAVE_SANE_SHMEM
+	fd = shm_open (name, O_RDONLY, 0);
+#else
+	fd = open (name, O_RDONLY, 0);
+#endif
+
+	if (fd == -1) {
+		msg_info_map ("cannot open shared image from %s: %s, parse cached data",
+				name, strerror (errno));
+		return FALSE;
+	}
+
+	if (!map->image_load (&periodic->cbdata, fd)) {
+		close (fd);
+		return FALSE;
+	}
+
+	msg_info_map ("%s: loaded shared image from %s", bk->uri, name);
+
+	return TRUE;
+}
+
 static void
 rspamd_map_cache_cb (struct ev_loop *loop, ev_timer *w, int revents)
 {
@@ -278,6 +409,7 @@ rspamd_map_cache_cb (struct ev_loop *loop, ev_timer *w, int revents)
 	else {
 		data->cur_cache_cbd = NULL;
 		g_atomic_int_set (&data->cache->available, 0);
+		rspamd_map_image_unlink (data->cache);
 		MAP_RELEASE (cache_cbd->shm, "rspamd_http_map_cached_cbdata");
 		msg_info_map ("cached data is now expired for %s", map->name);
 		ev_timer_stop (loop, &cache_cbd->timeout);
@@ -303,7 +435,25 @@ http_map_finish (struct rspamd_http_connection *conn,
 	bk = cbd->bk;
 	data = bk->data.hd;
 
-	if (msg->code == 200) {
+	if (msg->code == 200 || msg->code == 226) {
+		gboolean is_delta = FALSE;
+
+		if (msg->code == 226) {
+			const rspamd_ftok_t *im_hdr;
+
+			im_hdr = rspamd_http_message_find_header (msg, "IM");
+
+			if (cbd->check || im_hdr == NULL ||
+					!rspamd_ftok_cstr_equal (im_hdr, RSPAMD_MAP_DELTA_IM, TRUE) ||
+					!rspamd_map_delta_usable (map, data)) {
+				msg_err_map ("%s(%s): unexpected delta reply",
+						cbd->bk->uri,
+						rspamd_inet_address_to_string_pretty (cbd->addr));
+				goto err;
+			}
+
+			is_delta = TRUE;
+		}
 
 		if (cbd->check) {
 			msg_info_map ("need to reread map from %s", cbd->bk->uri);
@@ -393,7 +543,12 @@ http_map_finish (struct rspamd_http_connection *conn,
 		/*
 		 * We know that a map is in the locked state
 		 */
+		g_atomic_int_set (&data->cache->image_only, is_delta);
 		g_atomic_int_set (&data->cache->available, 1);
+		/* Image of the previous data is obsolete now */
+		rspamd_map_image_unlink (data->cache);
+		cbd->periodic->need_image = (map->image_dump != NULL &&
+				map->backends->len == 1);
 		/* Store cached data */
 		rspamd_strlcpy (data->cache->shmem_name, cbd->shmem_data->shm_name,
 				sizeof (data->cache->shmem_name));
@@ -471,22 +626,44 @@ http_map_finish (struct rspamd_http_connection *conn,
 			}
 
 			ZSTD_freeDStream (zstream);
-			msg_info_map ("%s(%s): read map data %z bytes compressed, "
+			msg_info_map ("%s(%s): read map %s %z bytes compressed, "
 					"%z uncompressed, next check at %s",
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
+					is_delta ? "delta" : "data",
 					dlen, zout.pos, next_check_date);
-			map->read_callback (out, zout.pos, &cbd->periodic->cbdata, TRUE);
-			rspamd_map_save_http_cached_file (map, bk, cbd->data, out, zout.pos);
+
+			if (!rspamd_map_http_process_data (map, cbd, out, zout.pos,
+					is_delta)) {
+				g_free (out);
+				MAP_RELEASE (cbd->shmem_data, "shmem_data");
+				goto err;
+			}
+
+			if (!is_delta) {
+				rspamd_map_save_http_cached_file (map, bk, cbd->data, out,
+						zout.pos);
+			}
+
 			g_free (out);
 		}
 		else {
-			msg_info_map ("%s(%s): read map data %z bytes, next check at %s",
+			msg_info_map ("%s(%s): read map %s %z bytes, next check at %s",
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
+					is_delta ? "delta" : "data",
 					dlen, next_check_date);
-			rspamd_map_save_http_cached_file (map, bk, cbd->data, in, cbd->data_len);
-			map->read_callback (in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
+
+			if (!is_delta) {
+				rspamd_map_save_http_cached_file (map, bk, cbd->data, in,
+						cbd->data_len);
+			}
+
+			if (!rspamd_map_http_process_data (map, cbd, in, cbd->data_len,
+					is_delta)) {
+				MAP_RELEASE (cbd->shmem_data, "shmem_data");
+				goto err;
+			}
 		}
 
 		MAP_RELEASE (cbd->shmem_data, "shmem_data");
@@ -586,6 +763,11 @@ read_map_file_chunks (struct rspamd_map *map, struct map_cb_data *cbdata,
 		return FALSE;
 	}
 
+#ifdef HAVE_FADVISE
+	/* Map is read once from start to end, so let kernel read ahead */
+	(void)posix_fadvise (fd, off, len, POSIX_FADV_SEQUENTIAL);
+#endif
+
 	buflen = MIN (len, buflen);
 	bytes = g_malloc (buflen);
 	avail = buflen;
@@ -975,7 +1157,13 @@ rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 
 	if (periodic->need_modify) {
 		/* We are done */
+		RSPAMD_PROBE1 (map__reload__start, periodic->map->name);
 		periodic->map->fin_callback (&periodic->cbdata, periodic->map->user_data);
+		RSPAMD_PROBE1 (map__reload__finish, periodic->map->name);
+
+		if (periodic->need_image && !periodic->errored) {
+			rspamd_map_image_save (periodic->map, &periodic->cbdata);
+		}
 	}
 	else {
 		/* Not modified */
@@ -1302,6 +1490,21 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 
 	data = bk->data.hd;
 
+	if (map->image_load && map->backends->len == 1 &&
+			g_atomic_int_get (&data->cache->image_available) &&
+			data->cache->image_last_modified == data->cache->last_modified &&
+			rspamd_map_image_load (map, bk, periodic)) {
+		data->etag_current = FALSE;
+
+		return TRUE;
+	}
+
+	if (g_atomic_int_get (&data->cache->image_only)) {
+		msg_info_map ("%s: cached data is a delta and there is no shared image",
+				bk->uri);
+		return FALSE;
+	}
+
 	in = rspamd_shmem_xmap (data->cache->shmem_name, PROT_READ, &len);
 
 	if (in == NULL) {
@@ -1378,6 +1581,7 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 	}
 
 	munmap (in, len);
+	data->etag_current = FALSE;
 
 	return TRUE;
 }
@@ -2486,6 +2690,7 @@ rspamd_map_backend_dtor (struct rspamd_map_backend *bk)
 				}
 
 				unlink (data->cache->shmem_name);
+				rspamd_map_image_unlink (data->cache);
 			}
 
 			g_free (bk->data.hd);
@@ -2689,6 +2894,17 @@ rspamd_map_add_static_string (struct rspamd_config *cfg,
 	return TRUE;
 }
 
+static void
+rspamd_map_setup_image (struct rspamd_map *map)
+{
+	if (map->cfg->maps_shared_images &&
+			map->read_callback == rspamd_kv_list_read) {
+		map->image_dump = rspamd_kv_list_image_dump;
+		map->image_load = rspamd_kv_list_image_load;
+		map->delta_callback = rspamd_kv_list_delta;
+	}
+}
+
 struct rspamd_map *
 rspamd_map_add (struct rspamd_config *cfg,
 				const gchar *map_line,
@@ -2745,6 +2961,7 @@ rspamd_map_add (struct rspamd_config *cfg,
 	rspamd_map_calculate_hash (map);
 	msg_info_map ("added map %s", bk->uri);
 
+	rspamd_map_setup_image (map);
 	cfg->maps = g_list_prepend (cfg->maps, map);
 
 	return map;
@@ -2999,6 +3216,7 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	rspamd_map_calculate_hash (map);
 	msg_debug_map ("added map from ucl");
 
+	rspamd_map_setup_image (map);
 	cfg->maps = g_list_prepend (cfg->maps, map);
 
 	return map;
@@ -31,6 +31,21 @@ typedef void (*map_fin_cb_t) (struct map_cb_data *data, void **target);
 
 typedef void (*map_dtor_t) (struct map_cb_data *data);
 
+/*
+ * Image callbacks: dump parsed map data to `fd` as a position independent
+ * image and load map data from such an image without parsing
+ */
+typedef gboolean (*map_image_dump_cb_t) (struct map_cb_data *data, gint fd);
+
+typedef gboolean (*map_image_load_cb_t) (struct map_cb_data *data, gint fd);
+
+/*
+ * Delta callback: applies changes to the previous map data instead of
+ * building it from scratch, returns FALSE if it is not possible
+ */
+typedef gboolean (*map_delta_cb_t) (gchar *chunk, gsize len,
+									struct map_cb_data *data);
+
 typedef gboolean (*rspamd_map_traverse_cb) (gconstpointer key,
 											gconstpointer value, gsize hits, gpointer ud);
 
@@ -21,6 +21,7 @@
 #include "rspamd.h"
 #include "cryptobox.h"
 #include "mempool_vars_internal.h"
+#include "libserver/rspamd_control.h"
 #include "contrib/fastutf8/fastutf8.h"
 #include "contrib/cdb/cdb.h"
 
@@ -62,6 +63,9 @@ struct rspamd_hash_map_helper {
 	rspamd_mempool_t *pool;
 	khash_t(rspamd_map_hash) *htb;
 	struct rspamd_map *map;
+	/* Shared compiled image used instead of htb if loaded */
+	struct cdb *image;
+	gsize image_nelts;
 	rspamd_cryptobox_fast_hash_state_t hst;
 };
 
@@ -87,9 +91,20 @@ struct rspamd_regexp_map_helper {
 	gchar **patterns;
 	gint *flags;
 	gint *ids;
+	/* Database is being compiled by hs_helper, PCRE is used meanwhile */
+	gboolean hs_pending;
+	ev_timer hs_pending_timeout;
 #endif
 };
 
+#ifdef WITH_HYPERSCAN
+/* Regexp maps of this process waiting for hs_helper to compile them */
+static GList *pending_re_maps = NULL;
+/* Compile locally if hs_helper has not replied within this time */
+static const ev_tstamp rspamd_re_map_compile_timeout = 60.0;
+#define RSPAMD_RE_MAP_REQUEST_MAGIC "rshsmp01"
+#endif
+
 /**
  * FSM for parsing lists
  */
@@ -759,6 +774,12 @@ rspamd_map_helper_destroy_hash (struct rspamd_hash_map_helper *r)
 
 	rspamd_mempool_t *pool = r->pool;
 	kh_destroy (rspamd_map_hash, r->htb);
+
+	if (r->image) {
+		cdb_free (r->image);
+		close (r->image->cdb_fd);
+	}
+
 	memset (r, 0, sizeof (*r));
 	rspamd_mempool_delete (pool);
 }
@@ -773,6 +794,22 @@ rspamd_map_helper_traverse_hash (void *data,
 	struct rspamd_map_helper_value *val;
 	struct rspamd_hash_map_helper *ht = data;
 
+	if (ht->image) {
+		unsigned pos;
+
+		/* Keys and values are stored null terminated, hits are not shared */
+		cdb_seqinit (&pos, ht->image);
+
+		while (cdb_seqnext (&pos, ht->image) > 0) {
+			if (!cb (cdb_getkey (ht->image), cdb_getdata (ht->image), 0,
+					cbdata)) {
+				break;
+			}
+		}
+
+		return;
+	}
+
 	kh_foreach (ht->htb, tok, val, {
 		if (!cb (tok.begin, val->value, val->hits, cbdata)) {
 			break;
@@ -879,6 +916,10 @@ rspamd_map_helper_destroy_regexp (struct rspamd_regexp_map_helper *re_map)
 	}
 
 #ifdef WITH_HYPERSCAN
+	if (re_map->hs_pending) {
+		ev_timer_stop (re_map->map->event_loop, &re_map->hs_pending_timeout);
+		pending_re_maps = g_list_remove (pending_re_maps, re_map);
+	}
 	if (re_map->hs_scratch) {
 		hs_free_scratch (re_map->hs_scratch);
 	}
@@ -914,6 +955,83 @@ rspamd_map_helper_destroy_regexp (struct rspamd_regexp_map_helper *re_map)
 	rspamd_mempool_delete (pool);
 }
 
+gint
+rspamd_map_image_create (gchar *name, gsize namelen)
+{
+#ifdef HAVE_SANE_SHMEM
+#if defined(__DragonFly__)
+	rspamd_strlcpy (name, "/tmp/rmi.XXXXXXXXXXXXXXXXXXXX", namelen);
+#else
+	rspamd_strlcpy (name, "/rmi.XXXXXXXXXXXXXXXXXXXX", namelen);
+#endif
+	return rspamd_shmem_mkstemp (name);
+#else
+	rspamd_strlcpy (name, "/tmp/rmi.XXXXXXXXXXXXXXXXXXXX", namelen);
+	return mkstemp (name);
+#endif
+}
+
+void
+rspamd_map_image_remove (const gchar *name)
+{
+#ifdef HAVE_SANE_SHMEM
+	shm_unlink (name);
+#else
+	unlink (name);
+#endif
+}
+
+/*
+ * Replaces a parsed hash with its compiled cdb image: a static hash table
+ * over a packed arena of keys and values with much lower per element
+ * overhead than khash entries allocated in a pool
+ */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_freeze_hash (struct rspamd_hash_map_helper *htb)
+{
+	struct rspamd_map *map = htb->map;
+	struct map_cb_data tmp;
+	gchar name[256];
+	gint fd;
+
+	fd = rspamd_map_image_create (name, sizeof (name));
+
+	if (fd == -1) {
+		msg_err_map ("cannot create hash image for %s: %s", map->name,
+				strerror (errno));
+
+		return htb;
+	}
+
+	memset (&tmp, 0, sizeof (tmp));
+	tmp.map = map;
+	tmp.cur_data = htb;
+
+	if (!rspamd_kv_list_image_dump (&tmp, fd)) {
+		close (fd);
+		rspamd_map_image_remove (name);
+
+		return htb;
+	}
+
+	/* Image is anonymous from now on */
+	rspamd_map_image_remove (name);
+	tmp.cur_data = NULL;
+
+	if (!rspamd_kv_list_image_load (&tmp, fd)) {
+		close (fd);
+
+		return htb;
+	}
+
+	/* Preserve digest of the parsed data */
+	memcpy (&((struct rspamd_hash_map_helper *)tmp.cur_data)->hst, &htb->hst,
+			sizeof (htb->hst));
+	rspamd_map_helper_destroy_hash (htb);
+
+	return tmp.cur_data;
+}
+
 gchar *
 rspamd_kv_list_read (
 		gchar * chunk,
@@ -942,10 +1060,25 @@ rspamd_kv_list_fin (struct map_cb_data *data, void **target)
 
 	if (data->cur_data) {
 		htb = (struct rspamd_hash_map_helper *)data->cur_data;
-		msg_info_map ("read hash of %d elements from %s", kh_size (htb->htb),
-				map->name);
+
+		if (htb->image == NULL && map->cfg && map->cfg->maps_freeze_elts > 0 &&
+				kh_size (htb->htb) >= map->cfg->maps_freeze_elts) {
+			htb = rspamd_map_helper_freeze_hash (htb);
+			data->cur_data = htb;
+		}
+
+		if (htb->image) {
+			msg_info_map ("loaded hash image of %z elements from %s",
+					htb->image_nelts, map->name);
+			data->map->nelts = htb->image_nelts;
+		}
+		else {
+			msg_info_map ("read hash of %d elements from %s", kh_size (htb->htb),
+					map->name);
+			data->map->nelts = kh_size (htb->htb);
+		}
+
 		data->map->traverse_function = rspamd_map_helper_traverse_hash;
-		data->map->nelts = kh_size (htb->htb);
 		data->map->digest = rspamd_cryptobox_fast_hash_final (&htb->hst);
 	}
 
@@ -970,6 +1103,216 @@ rspamd_kv_list_dtor (struct map_cb_data *data)
 	}
 }
 
+static void
+rspamd_map_helper_update_hash (struct rspamd_hash_map_helper *ht,
+		const gchar *key, gsize klen, const gchar *value, gsize vlen)
+{
+	struct rspamd_map_helper_value *val;
+	khiter_t k;
+	gchar *nk;
+	gint r;
+	rspamd_ftok_t tok;
+
+	tok.begin = key;
+	tok.len = klen;
+
+	k = kh_get (rspamd_map_hash, ht->htb, tok);
+
+	if (k == kh_end (ht->htb)) {
+		nk = rspamd_mempool_alloc (ht->pool, klen + 1);
+		rspamd_strlcpy (nk, key, klen + 1);
+		tok.begin = nk;
+		k = kh_put (rspamd_map_hash, ht->htb, tok, &r);
+	}
+
+	/* Old value is kept in the pool as it might be used by someone */
+	val = rspamd_mempool_alloc0 (ht->pool, sizeof (*val) + vlen + 1);
+	memcpy (val->value, value, vlen);
+	val->key = kh_key (ht->htb, k).begin;
+	kh_value (ht->htb, k) = val;
+
+	rspamd_cryptobox_fast_hash_update (&ht->hst, key, klen);
+}
+
+gboolean
+rspamd_kv_list_delta (gchar *chunk, gsize len, struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *htb;
+	const gchar *p = chunk, *end = chunk + len, *eol, *key, *value;
+	gsize klen, vlen;
+	guint added = 0, removed = 0;
+	khiter_t k;
+	rspamd_ftok_t tok;
+
+	htb = (struct rspamd_hash_map_helper *)data->prev_data;
+
+	if (data->cur_data != NULL || htb == NULL || htb->image != NULL) {
+		/* Nothing to update or compiled image that cannot be modified */
+		return FALSE;
+	}
+
+	/* Take over the current data and update it in place */
+	data->cur_data = htb;
+	data->prev_data = NULL;
+
+	while (p < end) {
+		eol = memchr (p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		/* Delta line is either `+key [value]` or `-key` */
+		if (eol - p > 1 && (*p == '+' || *p == '-')) {
+			key = p + 1;
+			klen = rspamd_memcspn (key, " \t\r", eol - key);
+			value = key + klen;
+			value += rspamd_memspn (value, " \t", eol - value);
+			vlen = eol - value;
+
+			while (vlen > 0 && g_ascii_isspace (value[vlen - 1])) {
+				vlen --;
+			}
+
+			if (klen == 0) {
+				msg_warn_map ("%s: bad delta line: '%*s'", map->name,
+						(gint)(eol - p), p);
+			}
+			else if (*p == '+') {
+				rspamd_map_helper_update_hash (htb, key, klen, value, vlen);
+				added ++;
+			}
+			else {
+				tok.begin = key;
+				tok.len = klen;
+				k = kh_get (rspamd_map_hash, htb->htb, tok);
+
+				if (k != kh_end (htb->htb)) {
+					kh_del (rspamd_map_hash, htb->htb, k);
+					removed ++;
+				}
+			}
+		}
+		else if (eol > p && *p != '#' && *p != '\r') {
+			msg_warn_map ("%s: bad delta line: '%*s'", map->name,
+					(gint)(eol - p), p);
+		}
+
+		p = eol + 1;
+	}
+
+	msg_info_map ("applied delta to %s: %ud elements added or changed, "
+			"%ud removed", map->name, added, removed);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_kv_list_image_dump (struct map_cb_data *data, gint fd)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *htb;
+	struct rspamd_map_helper_value *val;
+	struct cdb_make cdbm;
+	rspamd_ftok_t tok;
+	gchar *key;
+	gboolean ret = TRUE;
+
+	htb = (struct rspamd_hash_map_helper *)data->cur_data;
+
+	if (htb == NULL) {
+		return FALSE;
+	}
+
+	if (htb->image != NULL) {
+		/* Already compiled, just copy it */
+		if (write (fd, htb->image->cdb_mem, htb->image->cdb_fsize) !=
+				(gssize)htb->image->cdb_fsize) {
+			msg_err_map ("cannot write hash image for %s: %s", map->name,
+					strerror (errno));
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	cdb_make_start (&cdbm, fd);
+
+	/*
+	 * Keys are lowercased to preserve case insensitive lookups; both keys
+	 * and values are null terminated to be used directly from the image
+	 */
+	kh_foreach (htb->htb, tok, val, {
+		key = g_malloc (tok.len + 1);
+		memcpy (key, tok.begin, tok.len);
+		key[tok.len] = '\0';
+		rspamd_str_lc (key, tok.len);
+
+		if (cdb_make_add (&cdbm, key, tok.len + 1, val->value,
+				strlen (val->value) + 1) == -1) {
+			ret = FALSE;
+		}
+
+		g_free (key);
+
+		if (!ret) {
+			break;
+		}
+	});
+
+	if (cdb_make_finish (&cdbm) == -1) {
+		ret = FALSE;
+	}
+
+	if (!ret) {
+		msg_err_map ("cannot write hash image for %s: %s", map->name,
+				strerror (errno));
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_kv_list_image_load (struct map_cb_data *data, gint fd)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *htb;
+	struct cdb *cdb;
+	unsigned pos;
+
+	if (data->cur_data != NULL) {
+		/* Image covers the whole map, so it cannot be merged */
+		return FALSE;
+	}
+
+	htb = rspamd_map_helper_new_hash (map);
+	cdb = rspamd_mempool_alloc0 (htb->pool, sizeof (*cdb));
+
+	if (cdb_init (cdb, fd) == -1) {
+		msg_err_map ("cannot init hash image for %s: %s", map->name,
+				strerror (errno));
+		rspamd_map_helper_destroy_hash (htb);
+
+		return FALSE;
+	}
+
+	htb->image = cdb;
+	rspamd_cryptobox_fast_hash_update (&htb->hst, htb->image->cdb_mem,
+			htb->image->cdb_fsize);
+
+	cdb_seqinit (&pos, htb->image);
+
+	while (cdb_seqnext (&pos, htb->image) > 0) {
+		htb->image_nelts ++;
+	}
+
+	data->cur_data = htb;
+
+	return TRUE;
+}
+
 gchar *
 rspamd_radix_read (
 		gchar * chunk,
@@ -1002,6 +1345,7 @@ rspamd_radix_fin (struct map_cb_data *data, void **target)
 
 	if (data->cur_data) {
 		r = (struct rspamd_radix_map_helper *)data->cur_data;
+		radix_compile_compressed (r->trie);
 		msg_info_map ("read radix trie of %z elements: %s",
 				radix_get_size (r->trie), radix_get_info (r->trie));
 		data->map->traverse_function = rspamd_map_helper_traverse_radix;
@@ -1169,28 +1513,21 @@ rspamd_try_load_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 }
 
 static gboolean
-rspamd_try_save_re_map_cache (struct rspamd_regexp_map_helper *re_map)
+rspamd_re_map_save_db (struct rspamd_config *cfg, const gchar *np,
+		hs_database_t *db, const gchar *name)
 {
-	gchar fp[PATH_MAX], np[PATH_MAX];
+	gchar fp[PATH_MAX];
 	gsize len;
 	gint fd;
 	char *bytes = NULL;
-	struct rspamd_map *map;
-
-	map = re_map->map;
-
-	if (!map->cfg->hs_cache_dir) {
-		return FALSE;
-	}
+	gboolean ret = FALSE;
 
-	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmc.tmp",
-			re_map->map->cfg->hs_cache_dir,
-			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
+	rspamd_snprintf (fp, sizeof (fp), "%s.tmp", np);
 
 	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) != -1) {
-		if (hs_serialize_database (re_map->hs_db, &bytes, &len) == HS_SUCCESS) {
+		if (hs_serialize_database (db, &bytes, &len) == HS_SUCCESS) {
 			if (write (fd, bytes, len) == -1) {
-				msg_warn_map ("cannot write hyperscan cache to %s: %s",
+				msg_warn_config ("cannot write hyperscan cache to %s: %s",
 						fp, strerror (errno));
 				unlink (fp);
 				free (bytes);
@@ -1199,25 +1536,22 @@ rspamd_try_save_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 				free (bytes);
 				fsync (fd);
 
-				rspamd_snprintf (np, sizeof (np), "%s/%*xs.hsmc",
-						re_map->map->cfg->hs_cache_dir,
-						(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
-
 				if (rename (fp, np) == -1) {
-					msg_warn_map ("cannot rename hyperscan cache from %s to %s: %s",
+					msg_warn_config ("cannot rename hyperscan cache from %s to %s: %s",
 							fp, np, strerror (errno));
 					unlink (fp);
 				}
 				else {
-					msg_info_map ("written cached hyperscan data for %s to %s (%Hz length)",
-							map->name, np, len);
+					msg_info_config ("written cached hyperscan data for %s to %s (%Hz length)",
+							name, np, len);
 
-					rspamd_re_map_cache_update (np, map->cfg);
+					rspamd_re_map_cache_update (np, cfg);
+					ret = TRUE;
 				}
 			}
 		}
 		else {
-			msg_warn_map ("cannot serialize hyperscan cache to %s: %s",
+			msg_warn_config ("cannot serialize hyperscan cache to %s: %s",
 					fp, strerror (errno));
 			unlink (fp);
 		}
@@ -1226,7 +1560,26 @@ rspamd_try_save_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 		close (fd);
 	}
 
-	return FALSE;
+	return ret;
+}
+
+static gboolean
+rspamd_try_save_re_map_cache (struct rspamd_regexp_map_helper *re_map)
+{
+	gchar np[PATH_MAX];
+	struct rspamd_map *map;
+
+	map = re_map->map;
+
+	if (!map->cfg->hs_cache_dir) {
+		return FALSE;
+	}
+
+	rspamd_snprintf (np, sizeof (np), "%s/%*xs.hsmc",
+			map->cfg->hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
+
+	return rspamd_re_map_save_db (map->cfg, np, re_map->hs_db, map->name);
 }
 
 static gboolean
@@ -1265,68 +1618,435 @@ rspamd_re_map_cache_cleanup_old (struct rspamd_regexp_map_helper *old_re_map)
 	return TRUE;
 }
 
-#endif
+static GQuark
+rspamd_re_map_quark (void)
+{
+	return g_quark_from_static_string ("re_map");
+}
 
-static void
-rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
+static hs_database_t *
+rspamd_re_map_compile_db (const gchar **patterns, const gint *flags,
+		const gint *ids, guint count, GError **err)
 {
-#ifdef WITH_HYPERSCAN
-	guint i;
 	hs_platform_info_t plt;
-	hs_compile_error_t *err;
-	struct rspamd_map *map;
-	rspamd_regexp_t *re;
-	gint pcre_flags;
+	hs_compile_error_t *hs_errors;
+	hs_database_t *db = NULL;
 
-	map = re_map->map;
+	if (hs_populate_platform (&plt) != HS_SUCCESS) {
+		g_set_error (err, rspamd_re_map_quark (), EINVAL,
+				"cannot populate hyperscan platform");
 
-#ifndef __aarch64__
-	if (!(map->cfg->libs_ctx->crypto_ctx->cpu_config & CPUID_SSSE3)) {
-		msg_info_map ("disable hyperscan for map %s, ssse3 instructons are not supported by CPU",
-				map->name);
-		return;
+		return NULL;
 	}
-#endif
 
-	if (hs_populate_platform (&plt) != HS_SUCCESS) {
-		msg_err_map ("cannot populate hyperscan platform");
-		return;
+	if (hs_compile_multi (patterns,
+			(const guint *)flags,
+			(const guint *)ids,
+			count,
+			HS_MODE_BLOCK,
+			&plt,
+			&db,
+			&hs_errors) != HS_SUCCESS) {
+		g_set_error (err, rspamd_re_map_quark (), EINVAL,
+				"cannot create tree of regexp when processing '%s': %s",
+				hs_errors->expression >= 0 ?
+				patterns[hs_errors->expression] :
+				"unknown regexp", hs_errors->message);
+		hs_free_compile_error (hs_errors);
+
+		return NULL;
 	}
 
-	re_map->patterns = g_new (gchar *, re_map->regexps->len);
-	re_map->flags = g_new (gint, re_map->regexps->len);
-	re_map->ids = g_new (gint, re_map->regexps->len);
+	return db;
+}
 
-	for (i = 0; i < re_map->regexps->len; i ++) {
-		const gchar *pat;
-		gchar *escaped;
-		gint pat_flags;
+static gboolean
+rspamd_re_map_alloc_scratch (struct rspamd_regexp_map_helper *re_map)
+{
+	struct rspamd_map *map;
 
-		re = g_ptr_array_index (re_map->regexps, i);
-		pcre_flags = rspamd_regexp_get_pcre_flags (re);
-		pat = rspamd_regexp_get_pattern (re);
-		pat_flags = rspamd_regexp_get_flags (re);
+	map = re_map->map;
 
-		if (pat_flags & RSPAMD_REGEXP_FLAG_UTF) {
-			escaped = rspamd_str_regexp_escape (pat, strlen (pat), NULL,
-					RSPAMD_REGEXP_ESCAPE_RE|RSPAMD_REGEXP_ESCAPE_UTF);
-			re_map->flags[i] |= HS_FLAG_UTF8;
-		}
-		else {
-			escaped = rspamd_str_regexp_escape (pat, strlen (pat), NULL,
-					RSPAMD_REGEXP_ESCAPE_RE);
-		}
+	if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
+		msg_err_map ("cannot allocate scratch space for hyperscan");
+		hs_free_database (re_map->hs_db);
+		re_map->hs_db = NULL;
 
-		re_map->patterns[i] = escaped;
-		re_map->flags[i] = HS_FLAG_SINGLEMATCH;
+		return FALSE;
+	}
 
-#ifndef WITH_PCRE2
-		if (pcre_flags & PCRE_FLAG(UTF8)) {
-			re_map->flags[i] |= HS_FLAG_UTF8;
-		}
-#else
-		if (pcre_flags & PCRE_FLAG(UTF)) {
-			re_map->flags[i] |= HS_FLAG_UTF8;
+	return TRUE;
+}
+
+static void
+rspamd_re_map_compile (struct rspamd_regexp_map_helper *re_map)
+{
+	struct rspamd_map *map;
+	GError *err = NULL;
+	gdouble ts1;
+
+	map = re_map->map;
+	ts1 = rspamd_get_ticks (FALSE);
+	re_map->hs_db = rspamd_re_map_compile_db ((const gchar **)re_map->patterns,
+			re_map->flags, re_map->ids, re_map->regexps->len, &err);
+
+	if (re_map->hs_db == NULL) {
+		msg_err_map ("%e", err);
+		g_error_free (err);
+
+		return;
+	}
+
+	ts1 = (rspamd_get_ticks (FALSE) - ts1) * 1000.0;
+	msg_info_map ("hyperscan compiled %d regular expressions from %s in %.1f ms",
+			re_map->regexps->len, re_map->map->name, ts1);
+	rspamd_try_save_re_map_cache (re_map);
+	rspamd_re_map_alloc_scratch (re_map);
+}
+
+static void
+rspamd_re_map_compile_timeout_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_regexp_map_helper *re_map =
+			(struct rspamd_regexp_map_helper *)w->data;
+	struct rspamd_map *map;
+
+	map = re_map->map;
+	msg_warn_map ("hyperscan database for %s has not been compiled by hs_helper "
+			"in %.0f seconds, compile it locally",
+			map->name, rspamd_re_map_compile_timeout);
+	ev_timer_stop (EV_A_ w);
+	re_map->hs_pending = FALSE;
+	pending_re_maps = g_list_remove (pending_re_maps, re_map);
+
+	if (rspamd_try_load_re_map_cache (re_map)) {
+		rspamd_re_map_alloc_scratch (re_map);
+	}
+	else {
+		rspamd_re_map_compile (re_map);
+	}
+}
+
+/*
+ * Writes patterns to the cache dir and asks hs_helper to compile them,
+ * so a map update does not block the event loop of every worker
+ */
+static gboolean
+rspamd_re_map_request_compile (struct rspamd_regexp_map_helper *re_map)
+{
+	struct rspamd_map *map;
+	struct rspamd_worker *worker;
+	struct rspamd_srv_command srv_cmd;
+	gchar fp[PATH_MAX], np[PATH_MAX];
+	GByteArray *buf;
+	guint32 n, len;
+	gint32 fl;
+	gint fd;
+	guint i;
+
+	map = re_map->map;
+	worker = map->cfg->cur_worker;
+
+	if (worker == NULL || map->event_loop == NULL || !map->cfg->hs_cache_dir) {
+		/* Main process or a tool without hs_helper */
+		return FALSE;
+	}
+
+	rspamd_snprintf (np, sizeof (np), "%s/%*xs.hsmp",
+			map->cfg->hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
+	rspamd_snprintf (fp, sizeof (fp), "%s.tmp", np);
+
+	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) != -1) {
+		buf = g_byte_array_sized_new (re_map->regexps->len * 64);
+		n = re_map->regexps->len;
+		g_byte_array_append (buf, (const guint8 *)RSPAMD_RE_MAP_REQUEST_MAGIC,
+				sizeof (RSPAMD_RE_MAP_REQUEST_MAGIC) - 1);
+		g_byte_array_append (buf, (const guint8 *)&n, sizeof (n));
+
+		for (i = 0; i < n; i ++) {
+			fl = re_map->flags[i];
+			len = strlen (re_map->patterns[i]);
+			g_byte_array_append (buf, (const guint8 *)&fl, sizeof (fl));
+			g_byte_array_append (buf, (const guint8 *)&len, sizeof (len));
+			g_byte_array_append (buf, (const guint8 *)re_map->patterns[i], len);
+		}
+
+		if (write (fd, buf->data, buf->len) != (gssize)buf->len) {
+			msg_warn_map ("cannot write hyperscan compile request to %s: %s",
+					fp, strerror (errno));
+			g_byte_array_free (buf, TRUE);
+			unlink (fp);
+			close (fd);
+
+			return FALSE;
+		}
+
+		g_byte_array_free (buf, TRUE);
+		close (fd);
+
+		if (rename (fp, np) == -1) {
+			msg_warn_map ("cannot rename hyperscan compile request from %s to %s: %s",
+					fp, np, strerror (errno));
+			unlink (fp);
+
+			return FALSE;
+		}
+	}
+	else if (errno != EEXIST) {
+		msg_warn_map ("cannot create hyperscan compile request %s: %s",
+				fp, strerror (errno));
+
+		return FALSE;
+	}
+	/* Otherwise another worker is writing the same request */
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_MAP_COMPILE;
+	rspamd_strlcpy (srv_cmd.cmd.hs_map.path, np, sizeof (srv_cmd.cmd.hs_map.path));
+	rspamd_srv_send_command (worker, map->event_loop, &srv_cmd, -1, NULL, NULL);
+
+	re_map->hs_pending = TRUE;
+	re_map->hs_pending_timeout.data = re_map;
+	ev_timer_init (&re_map->hs_pending_timeout, rspamd_re_map_compile_timeout_cb,
+			rspamd_re_map_compile_timeout, 0.0);
+	ev_timer_start (map->event_loop, &re_map->hs_pending_timeout);
+	pending_re_maps = g_list_prepend (pending_re_maps, re_map);
+
+	msg_info_map ("requested hs_helper to compile %d regular expressions from %s, "
+			"use pcre meanwhile",
+			re_map->regexps->len, map->name);
+
+	return TRUE;
+}
+
+#endif
+
+gboolean
+rspamd_regexp_map_compile_request (struct rspamd_config *cfg,
+		const gchar *req_path, gchar *db_path, gsize db_pathlen,
+		GError **err)
+{
+#ifdef WITH_HYPERSCAN
+	const gsize magic_len = sizeof (RSPAMD_RE_MAP_REQUEST_MAGIC) - 1;
+	const guchar *p, *end;
+	guchar *data;
+	gsize len, plen;
+	guint32 n, i, patlen;
+	gchar **patterns;
+	gint *flags, *ids;
+	hs_database_t *db;
+	gboolean ret = FALSE;
+
+	plen = strlen (req_path);
+
+	if (plen < sizeof (".hsmp") || strcmp (req_path + plen - 5, ".hsmp") != 0 ||
+			plen >= db_pathlen) {
+		g_set_error (err, rspamd_re_map_quark (), EINVAL,
+				"invalid compile request path: %s", req_path);
+
+		return FALSE;
+	}
+
+	rspamd_strlcpy (db_path, req_path, db_pathlen);
+	memcpy (db_path + plen - 5, ".hsmc", 5);
+
+	if (access (db_path, R_OK) == 0) {
+		/* Already compiled on request of another worker */
+		(void)unlink (req_path);
+
+		return TRUE;
+	}
+
+	if ((data = rspamd_file_xmap (req_path, PROT_READ, &len, TRUE)) == NULL) {
+		g_set_error (err, rspamd_re_map_quark (), errno,
+				"cannot open compile request %s: %s", req_path, strerror (errno));
+
+		return FALSE;
+	}
+
+	p = data;
+	end = data + len;
+
+	if (len < magic_len + sizeof (n) ||
+			memcmp (p, RSPAMD_RE_MAP_REQUEST_MAGIC, magic_len) != 0) {
+		g_set_error (err, rspamd_re_map_quark (), EINVAL,
+				"invalid compile request %s", req_path);
+		munmap (data, len);
+		(void)unlink (req_path);
+
+		return FALSE;
+	}
+
+	p += magic_len;
+	memcpy (&n, p, sizeof (n));
+	p += sizeof (n);
+
+	patterns = g_new0 (gchar *, n);
+	flags = g_new (gint, n);
+	ids = g_new (gint, n);
+
+	for (i = 0; i < n; i ++) {
+		if (end - p < (goffset)(sizeof (gint32) + sizeof (patlen))) {
+			break;
+		}
+
+		memcpy (&flags[i], p, sizeof (gint32));
+		p += sizeof (gint32);
+		memcpy (&patlen, p, sizeof (patlen));
+		p += sizeof (patlen);
+
+		if (end - p < (goffset)patlen) {
+			break;
+		}
+
+		patterns[i] = g_strndup ((const gchar *)p, patlen);
+		p += patlen;
+		ids[i] = i;
+	}
+
+	if (i != n) {
+		g_set_error (err, rspamd_re_map_quark (), EINVAL,
+				"truncated compile request %s", req_path);
+	}
+	else {
+		gdouble ts1 = rspamd_get_ticks (FALSE);
+
+		db = rspamd_re_map_compile_db ((const gchar **)patterns, flags, ids,
+				n, err);
+
+		if (db != NULL) {
+			ts1 = (rspamd_get_ticks (FALSE) - ts1) * 1000.0;
+			msg_info_config ("hyperscan compiled %d regular expressions "
+					"from %s in %.1f ms", n, req_path, ts1);
+
+			if (rspamd_re_map_save_db (cfg, db_path, db, req_path)) {
+				ret = TRUE;
+			}
+			else {
+				g_set_error (err, rspamd_re_map_quark (), EINVAL,
+						"cannot save hyperscan database to %s", db_path);
+			}
+
+			hs_free_database (db);
+		}
+	}
+
+	for (i = 0; i < n; i ++) {
+		g_free (patterns[i]);
+	}
+
+	g_free (patterns);
+	g_free (flags);
+	g_free (ids);
+	munmap (data, len);
+	(void)unlink (req_path);
+
+	return ret;
+#else
+	g_set_error (err, g_quark_from_static_string ("re_map"), ENOTSUP,
+			"hyperscan is not supported");
+
+	return FALSE;
+#endif
+}
+
+void
+rspamd_regexp_map_hyperscan_loaded (const gchar *db_path)
+{
+#ifdef WITH_HYPERSCAN
+	GList *cur, *next;
+	struct rspamd_regexp_map_helper *re_map;
+	struct rspamd_map *map;
+	gchar fp[PATH_MAX];
+
+	cur = pending_re_maps;
+
+	while (cur) {
+		next = cur->next;
+		re_map = cur->data;
+		map = re_map->map;
+
+		rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmc",
+				map->cfg->hs_cache_dir,
+				(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
+
+		if (strcmp (fp, db_path) == 0) {
+			ev_timer_stop (map->event_loop, &re_map->hs_pending_timeout);
+			re_map->hs_pending = FALSE;
+			pending_re_maps = g_list_delete_link (pending_re_maps, cur);
+
+			/* Matching switches from pcre once both db and scratch are ready */
+			if (rspamd_try_load_re_map_cache (re_map)) {
+				if (rspamd_re_map_alloc_scratch (re_map)) {
+					msg_info_map ("switched to hyperscan database compiled by "
+							"hs_helper for %d regular expressions from %s",
+							re_map->regexps->len, map->name);
+				}
+			}
+			else {
+				rspamd_re_map_compile (re_map);
+			}
+		}
+
+		cur = next;
+	}
+#endif
+}
+
+static void
+rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
+{
+#ifdef WITH_HYPERSCAN
+	guint i;
+	struct rspamd_map *map;
+	rspamd_regexp_t *re;
+	gint pcre_flags;
+
+	map = re_map->map;
+
+#ifndef __aarch64__
+	if (!(map->cfg->libs_ctx->crypto_ctx->cpu_config & CPUID_SSSE3)) {
+		msg_info_map ("disable hyperscan for map %s, ssse3 instructons are not supported by CPU",
+				map->name);
+		return;
+	}
+#endif
+
+	re_map->patterns = g_new (gchar *, re_map->regexps->len);
+	re_map->flags = g_new (gint, re_map->regexps->len);
+	re_map->ids = g_new (gint, re_map->regexps->len);
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		const gchar *pat;
+		gchar *escaped;
+		gint pat_flags;
+
+		re = g_ptr_array_index (re_map->regexps, i);
+		pcre_flags = rspamd_regexp_get_pcre_flags (re);
+		pat = rspamd_regexp_get_pattern (re);
+		pat_flags = rspamd_regexp_get_flags (re);
+
+		if (pat_flags & RSPAMD_REGEXP_FLAG_UTF) {
+			escaped = rspamd_str_regexp_escape (pat, strlen (pat), NULL,
+					RSPAMD_REGEXP_ESCAPE_RE|RSPAMD_REGEXP_ESCAPE_UTF);
+			re_map->flags[i] |= HS_FLAG_UTF8;
+		}
+		else {
+			escaped = rspamd_str_regexp_escape (pat, strlen (pat), NULL,
+					RSPAMD_REGEXP_ESCAPE_RE);
+		}
+
+		re_map->patterns[i] = escaped;
+		re_map->flags[i] = HS_FLAG_SINGLEMATCH;
+
+#ifndef WITH_PCRE2
+		if (pcre_flags & PCRE_FLAG(UTF8)) {
+			re_map->flags[i] |= HS_FLAG_UTF8;
+		}
+#else
+		if (pcre_flags & PCRE_FLAG(UTF)) {
+			re_map->flags[i] |= HS_FLAG_UTF8;
 		}
 #endif
 		if (pcre_flags & PCRE_FLAG(CASELESS)) {
@@ -1347,42 +2067,13 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 
 	if (re_map->regexps->len > 0 && re_map->patterns) {
 
-		if (!rspamd_try_load_re_map_cache (re_map)) {
-			gdouble ts1 = rspamd_get_ticks (FALSE);
-
-			if (hs_compile_multi ((const gchar **) re_map->patterns,
-					re_map->flags,
-					re_map->ids,
-					re_map->regexps->len,
-					HS_MODE_BLOCK,
-					&plt,
-					&re_map->hs_db,
-					&err) != HS_SUCCESS) {
-
-				msg_err_map ("cannot create tree of regexp when processing '%s': %s",
-						err->expression >= 0 ?
-						re_map->patterns[err->expression] :
-						"unknown regexp", err->message);
-				re_map->hs_db = NULL;
-				hs_free_compile_error (err);
-
-				return;
-			}
-
-			ts1 = (rspamd_get_ticks (FALSE) - ts1) * 1000.0;
-			msg_info_map ("hyperscan compiled %d regular expressions from %s in %.1f ms",
-					re_map->regexps->len, re_map->map->name, ts1);
-			rspamd_try_save_re_map_cache (re_map);
-		}
-		else {
+		if (rspamd_try_load_re_map_cache (re_map)) {
 			msg_info_map ("hyperscan read %d cached regular expressions from %s",
 					re_map->regexps->len, re_map->map->name);
+			rspamd_re_map_alloc_scratch (re_map);
 		}
-
-		if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
-			msg_err_map ("cannot allocate scratch space for hyperscan");
-			hs_free_database (re_map->hs_db);
-			re_map->hs_db = NULL;
+		else if (!rspamd_re_map_request_compile (re_map)) {
+			rspamd_re_map_compile (re_map);
 		}
 	}
 	else {
@@ -1703,6 +2394,35 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 	return NULL;
 }
 
+static gconstpointer
+rspamd_match_hash_map_image (struct rspamd_hash_map_helper *map,
+		const gchar *in, gsize len)
+{
+	gchar keybuf[256], *key;
+	gconstpointer ret = NULL;
+
+	if (len < sizeof (keybuf)) {
+		key = keybuf;
+	}
+	else {
+		key = g_malloc (len + 1);
+	}
+
+	memcpy (key, in, len);
+	key[len] = '\0';
+	rspamd_str_lc (key, len);
+
+	if (cdb_find (map->image, key, len + 1) > 0) {
+		ret = cdb_getdata (map->image);
+	}
+
+	if (key != keybuf) {
+		g_free (key);
+	}
+
+	return ret;
+}
+
 gconstpointer
 rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in,
 		gsize len)
@@ -1715,6 +2435,10 @@ rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in,
 		return NULL;
 	}
 
+	if (map->image) {
+		return rspamd_match_hash_map_image (map, in, len);
+	}
+
 	tok.begin = in;
 	tok.len = len;
 
@@ -1773,6 +2497,166 @@ rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 	return NULL;
 }
 
+gsize
+rspamd_match_hash_map_batch (struct rspamd_hash_map_helper *map,
+		const rspamd_ftok_t *keys, gsize nkeys, gconstpointer *results)
+{
+	gsize i, nfound = 0;
+
+	if (map == NULL || map->htb == NULL) {
+		memset (results, 0, nkeys * sizeof (*results));
+
+		return 0;
+	}
+
+#ifdef __GNUC__
+	if (map->image == NULL && kh_n_buckets (map->htb) > 0) {
+		khint_t mask = kh_n_buckets (map->htb) - 1, pos;
+
+		/* Issue loads of the initial buckets before doing the actual probes */
+		for (i = 0; i < nkeys; i ++) {
+			pos = rspamd_map_ftok_hash (keys[i]) & mask;
+			__builtin_prefetch (&map->htb->flags[pos >> 4], 0, 1);
+			__builtin_prefetch (&map->htb->keys[pos], 0, 1);
+		}
+	}
+#endif
+
+	for (i = 0; i < nkeys; i ++) {
+		results[i] = rspamd_match_hash_map (map, keys[i].begin, keys[i].len);
+
+		if (results[i]) {
+			nfound ++;
+		}
+	}
+
+	return nfound;
+}
+
+gconstpointer
+rspamd_match_hash_map_suffix (struct rspamd_hash_map_helper *map,
+		const gchar *in, gsize len, gsize *matched_len)
+{
+	const gchar *p, *end;
+	gconstpointer ret;
+
+	if (map == NULL || map->htb == NULL || len == 0) {
+		return NULL;
+	}
+
+	if (in[len - 1] == '.') {
+		len --;
+	}
+
+	p = in;
+	end = in + len;
+
+	/* Labels are dropped from the left, so the longest suffix wins */
+	while (p < end) {
+		ret = rspamd_match_hash_map (map, p, end - p);
+
+		if (ret) {
+			if (matched_len) {
+				*matched_len = end - p;
+			}
+
+			return ret;
+		}
+
+		p = memchr (p, '.', end - p);
+
+		if (p == NULL) {
+			break;
+		}
+
+		p ++;
+	}
+
+	return NULL;
+}
+
+gsize
+rspamd_match_hash_map_suffix_batch (struct rspamd_hash_map_helper *map,
+		const rspamd_ftok_t *keys, gsize nkeys, gconstpointer *results,
+		gsize *matched_lens)
+{
+	gsize i, nfound = 0;
+
+	for (i = 0; i < nkeys; i ++) {
+		results[i] = rspamd_match_hash_map_suffix (map, keys[i].begin,
+				keys[i].len, matched_lens ? &matched_lens[i] : NULL);
+
+		if (results[i]) {
+			nfound ++;
+		}
+	}
+
+	return nfound;
+}
+
+struct rspamd_radix_batch_elt {
+	const rspamd_inet_addr_t *addr;
+	gsize idx;
+};
+
+static gint
+rspamd_radix_batch_elt_cmp (const void *a, const void *b)
+{
+	const struct rspamd_radix_batch_elt *e1 = a, *e2 = b;
+
+	return rspamd_inet_address_compare (e1->addr, e2->addr, FALSE);
+}
+
+gsize
+rspamd_match_radix_map_addr_batch (struct rspamd_radix_map_helper *map,
+		const rspamd_inet_addr_t **addrs, gsize naddrs,
+		gconstpointer *results)
+{
+	struct rspamd_radix_batch_elt *elts;
+	gconstpointer prev_res = NULL;
+	const rspamd_inet_addr_t *prev_addr = NULL;
+	gsize i, nelts = 0, nfound = 0;
+
+	memset (results, 0, naddrs * sizeof (*results));
+
+	if (map == NULL || map->trie == NULL || naddrs == 0) {
+		return 0;
+	}
+
+	elts = g_malloc (naddrs * sizeof (*elts));
+
+	for (i = 0; i < naddrs; i ++) {
+		if (addrs[i] != NULL) {
+			elts[nelts].addr = addrs[i];
+			elts[nelts].idx = i;
+			nelts ++;
+		}
+	}
+
+	/*
+	 * Sorted addresses share prefixes, so subsequent lookups walk the same
+	 * (already cached) nodes and duplicates are looked up once
+	 */
+	qsort (elts, nelts, sizeof (*elts), rspamd_radix_batch_elt_cmp);
+
+	for (i = 0; i < nelts; i ++) {
+		if (prev_addr == NULL ||
+				rspamd_inet_address_compare (prev_addr, elts[i].addr, FALSE) != 0) {
+			prev_res = rspamd_match_radix_map_addr (map, elts[i].addr);
+			prev_addr = elts[i].addr;
+		}
+
+		results[elts[i].idx] = prev_res;
+
+		if (prev_res) {
+			nfound ++;
+		}
+	}
+
+	g_free (elts);
+
+	return nfound;
+}
 
 /*
  * CBD stuff
@@ -1817,6 +2701,137 @@ rspamd_map_helper_destroy_cdb (struct rspamd_cdb_map_helper *c)
 	g_free (c);
 }
 
+static gboolean
+rspamd_cdb_list_add_file (struct rspamd_cdb_map_helper *cdb_data,
+						  const gchar *fname)
+{
+	struct cdb *cdb;
+	struct rspamd_map *map = cdb_data->map;
+	GList *cur = cdb_data->cdbs.head;
+	gint fd;
+
+	while (cur) {
+		struct cdb *elt = (struct cdb *)cur->data;
+
+		if (strcmp (elt->filename, fname) == 0) {
+			/* Already added */
+			return TRUE;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	fd = rspamd_file_xopen (fname, O_RDONLY, 0, TRUE);
+
+	if (fd == -1) {
+		msg_err_map ("cannot open cdb map from %s: %s", fname, strerror (errno));
+
+		return FALSE;
+	}
+
+	cdb = g_malloc0 (sizeof (struct cdb));
+
+	if (cdb_init (cdb, fd) == -1) {
+		msg_err_map ("cannot init cdb map from %s: %s", fname, strerror (errno));
+		close (fd);
+		g_free (cdb);
+
+		return FALSE;
+	}
+
+	cdb->filename = g_strdup (fname);
+	g_queue_push_tail (&cdb_data->cdbs, cdb);
+	cdb_data->total_size += cdb->cdb_fsize;
+	rspamd_cryptobox_fast_hash_update (&cdb_data->hst, fname, strlen (fname));
+	rspamd_cryptobox_fast_hash_update (&cdb_data->hst, &cdb->mtime,
+			sizeof (cdb->mtime));
+
+	return TRUE;
+}
+
+struct rspamd_cdb_dir_elt {
+	gchar *fname;
+	time_t mtime;
+};
+
+static gint
+rspamd_cdb_dir_elt_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_cdb_dir_elt *e1 = a, *e2 = b;
+
+	/* Newest first */
+	if (e1->mtime != e2->mtime) {
+		return e1->mtime > e2->mtime ? -1 : 1;
+	}
+
+	return strcmp (e2->fname, e1->fname);
+}
+
+/*
+ * Directory of cdb files is treated as layers: files are looked up from
+ * the newest to the oldest one, so a large dataset could be updated by
+ * adding a small cdb file instead of rebuilding the whole cdb
+ */
+static gboolean
+rspamd_cdb_list_add_dir (struct rspamd_cdb_map_helper *cdb_data,
+						 const gchar *dirname)
+{
+	struct rspamd_map *map = cdb_data->map;
+	struct rspamd_cdb_dir_elt elt, *pelt;
+	GArray *elts;
+	GDir *dir;
+	GError *err = NULL;
+	const gchar *name;
+	struct stat st;
+	gboolean ret = TRUE;
+	guint i;
+
+	dir = g_dir_open (dirname, 0, &err);
+
+	if (dir == NULL) {
+		msg_err_map ("cannot open cdb directory %s: %e", dirname, err);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	elts = g_array_new (FALSE, FALSE, sizeof (elt));
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (!g_str_has_suffix (name, ".cdb")) {
+			continue;
+		}
+
+		elt.fname = g_build_filename (dirname, name, NULL);
+
+		if (stat (elt.fname, &st) == -1 || !S_ISREG (st.st_mode)) {
+			g_free (elt.fname);
+			continue;
+		}
+
+		elt.mtime = st.st_mtime;
+		g_array_append_val (elts, elt);
+	}
+
+	g_dir_close (dir);
+	g_array_sort (elts, rspamd_cdb_dir_elt_cmp);
+
+	for (i = 0; i < elts->len; i ++) {
+		pelt = &g_array_index (elts, struct rspamd_cdb_dir_elt, i);
+
+		if (!rspamd_cdb_list_add_file (cdb_data, pelt->fname)) {
+			ret = FALSE;
+		}
+
+		g_free (pelt->fname);
+	}
+
+	msg_info_map ("added %ud cdb layers from %s", elts->len, dirname);
+	g_array_free (elts, TRUE);
+
+	return ret;
+}
+
 gchar *
 rspamd_cdb_list_read (gchar *chunk,
 					  gint len,
@@ -1824,8 +2839,9 @@ rspamd_cdb_list_read (gchar *chunk,
 					  gboolean final)
 {
 	struct rspamd_cdb_map_helper *cdb_data;
-	struct cdb *found = NULL;
 	struct rspamd_map *map = data->map;
+	struct stat st;
+	gboolean ret;
 
 	g_assert (map->no_file_read);
 
@@ -1837,44 +2853,15 @@ rspamd_cdb_list_read (gchar *chunk,
 		cdb_data = (struct rspamd_cdb_map_helper *)data->cur_data;
 	}
 
-	GList *cur = cdb_data->cdbs.head;
-
-	while (cur) {
-		struct cdb *elt = (struct cdb *)cur->data;
-
-		if (strcmp (elt->filename, chunk) == 0) {
-			found = elt;
-			break;
-		}
-
-		cur = g_list_next (cur);
+	if (stat (chunk, &st) != -1 && S_ISDIR (st.st_mode)) {
+		ret = rspamd_cdb_list_add_dir (cdb_data, chunk);
+	}
+	else {
+		ret = rspamd_cdb_list_add_file (cdb_data, chunk);
 	}
 
-	if (found == NULL) {
-		/* New cdb */
-		gint fd;
-		struct cdb *cdb;
-
-		fd = rspamd_file_xopen (chunk, O_RDONLY, 0, TRUE);
-
-		if (fd == -1) {
-			msg_err_map ("cannot open cdb map from %s: %s", chunk, strerror (errno));
-
-			return NULL;
-		}
-
-		cdb = g_malloc0 (sizeof (struct cdb));
-
-		if (cdb_init (cdb, fd) == -1) {
-			msg_err_map ("cannot init cdb map from %s: %s", chunk, strerror (errno));
-
-			return NULL;
-		}
-
-		cdb->filename = g_strdup (chunk);
-		g_queue_push_tail (&cdb_data->cdbs, cdb);
-		cdb_data->total_size += cdb->cdb_fsize;
-		rspamd_cryptobox_fast_hash_update (&cdb_data->hst, chunk, len);
+	if (!ret) {
+		return NULL;
 	}
 
 	return chunk + len;
@@ -76,6 +76,35 @@ void rspamd_kv_list_fin (struct map_cb_data *data, void **target);
 
 void rspamd_kv_list_dtor (struct map_cb_data *data);
 
+/**
+ * Applies delta (lines `+key [value]` to add or replace and `-key` to remove
+ * elements) to the previous kv list in place
+ */
+gboolean rspamd_kv_list_delta (gchar *chunk, gsize len,
+		struct map_cb_data *data);
+
+/**
+ * Creates a named shared segment for a map image, `name` is filled with its name
+ * @return fd or -1 in case of error
+ */
+gint rspamd_map_image_create (gchar *name, gsize namelen);
+
+/**
+ * Removes named shared segment of a map image
+ */
+void rspamd_map_image_remove (const gchar *name);
+
+/**
+ * Dumps parsed kv list to a position independent (cdb) image in `fd`
+ */
+gboolean rspamd_kv_list_image_dump (struct map_cb_data *data, gint fd);
+
+/**
+ * Loads kv list from an image previously written by rspamd_kv_list_image_dump
+ * (takes ownership of `fd` on success)
+ */
+gboolean rspamd_kv_list_image_load (struct map_cb_data *data, gint fd);
+
 /**
  * Cdb is a cdb mapped file with shared data
  * chunk must be filename!
@@ -120,6 +149,26 @@ void rspamd_regexp_list_fin (struct map_cb_data *data, void **target);
 
 void rspamd_regexp_list_dtor (struct map_cb_data *data);
 
+/**
+ * Compiles hyperscan database for a regexp map request written by a worker,
+ * used by hs_helper
+ * @param cfg config
+ * @param req_path path of the request (.hsmp) file
+ * @param db_path output buffer for the path of the compiled database
+ * @param db_pathlen length of the output buffer
+ * @return TRUE if the database is ready to be loaded
+ */
+gboolean rspamd_regexp_map_compile_request (struct rspamd_config *cfg,
+											const gchar *req_path,
+											gchar *db_path, gsize db_pathlen,
+											GError **err);
+
+/**
+ * Switches regexp maps that wait for a database compiled by hs_helper
+ * @param db_path path of the compiled database
+ */
+void rspamd_regexp_map_hyperscan_loaded (const gchar *db_path);
+
 /**
  * FSM for lists parsing (support comments, blank lines and partial replies)
  */
@@ -187,6 +236,60 @@ gconstpointer rspamd_match_radix_map (struct rspamd_radix_map_helper *map,
 gconstpointer rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 										   const rspamd_inet_addr_t *addr);
 
+/**
+ * Finds values for multiple keys in a hash map at once
+ * @param map
+ * @param keys array of keys
+ * @param nkeys number of keys
+ * @param results array of `nkeys` elements to store values (NULL if not found)
+ * @return number of keys found
+ */
+gsize rspamd_match_hash_map_batch (struct rspamd_hash_map_helper *map,
+								   const rspamd_ftok_t *keys, gsize nkeys,
+								   gconstpointer *results);
+
+/**
+ * Finds the most specific domain suffix of `in` in a hash map: the whole name
+ * is checked first and then all parent domains, i.e. `a.b.example.com`,
+ * `b.example.com`, `example.com` and `com`; the trailing dot is ignored
+ * @param map
+ * @param in domain name
+ * @param len
+ * @param matched_len if not NULL, set to the length of the matched suffix
+ * @return value or NULL if no suffix is found
+ */
+gconstpointer rspamd_match_hash_map_suffix (struct rspamd_hash_map_helper *map,
+											const gchar *in, gsize len,
+											gsize *matched_len);
+
+/**
+ * Finds domain suffixes for multiple names at once
+ * @param map
+ * @param keys array of domain names
+ * @param nkeys number of keys
+ * @param results array of `nkeys` elements to store values (NULL if not found)
+ * @param matched_lens if not NULL, array of `nkeys` lengths of matched suffixes
+ * @return number of keys found
+ */
+gsize rspamd_match_hash_map_suffix_batch (struct rspamd_hash_map_helper *map,
+										  const rspamd_ftok_t *keys, gsize nkeys,
+										  gconstpointer *results,
+										  gsize *matched_lens);
+
+/**
+ * Finds values for multiple addresses in a radix map at once, addresses are
+ * looked up in sorted order; NULL addresses are skipped
+ * @param map
+ * @param addrs array of addresses
+ * @param naddrs number of addresses
+ * @param results array of `naddrs` elements to store values (NULL if not found)
+ * @return number of addresses found
+ */
+gsize rspamd_match_radix_map_addr_batch (struct rspamd_radix_map_helper *map,
+										 const rspamd_inet_addr_t **addrs,
+										 gsize naddrs,
+										 gconstpointer *results);
+
 /**
  * Creates radix map helper
  * @param map
@@ -81,6 +81,11 @@ struct rspamd_map_cachepoint {
 	gsize len;
 	time_t last_modified;
 	gchar shmem_name[256];
+	/* Compiled image of the cached data (if supported by map) */
+	gint image_available;
+	gint image_only; /* Cached data is a delta, so only image is usable */
+	time_t image_last_modified;
+	gchar image_name[256];
 };
 
 /**
@@ -99,6 +104,8 @@ struct http_map_data {
 	time_t last_modified;
 	time_t last_checked;
 	gboolean request_sent;
+	gboolean etag_current; /* Our map data is the one identified by etag */
+	gboolean no_delta; /* Delta could not be applied, use full updates */
 	guint64 gen;
 	guint16 port;
 };
@@ -138,6 +145,9 @@ struct rspamd_map {
 	map_cb_t read_callback;
 	map_fin_cb_t fin_callback;
 	map_dtor_t dtor;
+	map_image_dump_cb_t image_dump;
+	map_image_load_cb_t image_load;
+	map_delta_cb_t delta_callback;
 	void **user_data;
 	struct ev_loop *event_loop;
 	struct rspamd_worker *wrk;
@@ -179,10 +189,14 @@ struct map_periodic_cbdata {
 	gboolean need_modify;
 	gboolean errored;
 	gboolean locked;
+	gboolean need_image; /* New data has been cached, compile shared image */
 	guint cur_backend;
 	ref_entry_t ref;
 };
 
+/* Instance manipulation used for delta updates of HTTP maps */
+#define RSPAMD_MAP_DELTA_IM "rspamd-delta"
+
 static const gchar rspamd_http_file_magic[] =
 		{'r', 'm', 'c', 'd', '2', '0', '0', '0'};
 
@@ -24,7 +24,9 @@
 #include "ottery.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
+#include "libserver/protocol.h"
 #include "libserver/protocol_internal.h"
+#include "libserver/task.h"
 #include "libserver/cfg_file_private.h"
 #include "libmime/scan_result.h"
 #include "libserver/worker_util.h"
@@ -119,6 +121,8 @@ rspamd_milter_session_reset (struct rspamd_milter_session *session,
 			msg_debug_milter ("cleanup message on abort");
 		}
 
+		priv->size_hint = 0;
+
 		if (session->rcpts) {
 			PTR_ARRAY_FOREACH (session->rcpts, i, cur) {
 				rspamd_email_address_free (cur);
@@ -319,6 +323,69 @@ rspamd_milter_plan_io (struct rspamd_milter_session *session,
 	(var) = ntohs (var); \
 } while (0)
 
+static void
+rspamd_milter_parse_esmtp_args (struct rspamd_milter_private *priv,
+		const guchar *pos, const guchar *end)
+{
+	const guchar *zero;
+	gsize arglen;
+	gulong size;
+
+	/* MAIL command arguments are NUL terminated strings */
+	while (pos < end) {
+		zero = memchr (pos, '\0', end - pos);
+		arglen = zero ? zero - pos : end - pos;
+
+		if (arglen > sizeof ("SIZE=") - 1 &&
+				g_ascii_strncasecmp ((const gchar *)pos, "SIZE=", sizeof ("SIZE=") - 1) == 0) {
+			if (rspamd_strtoul ((const gchar *)pos + sizeof ("SIZE=") - 1,
+					arglen - (sizeof ("SIZE=") - 1), &size)) {
+				priv->size_hint = size;
+				msg_debug_milter ("got message size hint: %z", priv->size_hint);
+			}
+		}
+
+		pos += arglen + 1;
+	}
+}
+
+/*
+ * Message is accumulated in a single buffer, so we try to allocate it once
+ * using the size announced by MTA
+ */
+static void
+rspamd_milter_prepare_message (struct rspamd_milter_session *session,
+		struct rspamd_milter_private *priv)
+{
+	gsize size = RSPAMD_MILTER_MESSAGE_CHUNK;
+	rspamd_ftok_t *found, srch;
+	gulong macro_size;
+
+	if (priv->size_hint == 0 && session->macros) {
+		/* Sendmail style */
+		RSPAMD_FTOK_ASSIGN (&srch, "{msg_size}");
+		found = g_hash_table_lookup (session->macros, &srch);
+
+		if (found && rspamd_strtoul (found->begin, found->len, &macro_size)) {
+			priv->size_hint = macro_size;
+		}
+	}
+
+	if (priv->size_hint > 0) {
+		/* Headers are reconstructed, so leave some space for them */
+		size = MIN (priv->size_hint + RSPAMD_MILTER_MESSAGE_CHUNK,
+				RSPAMD_MILTER_MAX_PREALLOC);
+	}
+
+	if (!session->message) {
+		session->message = rspamd_fstring_sized_new (size);
+	}
+	else if (session->message->allocated < size) {
+		session->message = rspamd_fstring_grow (session->message,
+				size - session->message->len);
+	}
+}
+
 static gboolean
 rspamd_milter_process_command (struct rspamd_milter_session *session,
 		struct rspamd_milter_private *priv)
@@ -340,10 +407,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		rspamd_milter_session_reset (session, RSPAMD_MILTER_RESET_ABORT);
 		break;
 	case RSPAMD_MILTER_CMD_BODY:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_prepare_message (session, priv);
 
 		msg_debug_milter ("got body chunk: %d bytes", (int)cmdlen);
 		session->message = rspamd_fstring_append (session->message,
@@ -587,10 +651,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		break;
 	case RSPAMD_MILTER_CMD_HEADER:
 		msg_debug_milter ("got header command");
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_prepare_message (session, priv);
 		zero = memchr (pos, '\0', cmdlen);
 
 		if (zero == NULL) {
@@ -654,7 +715,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 					session->from = addr;
 				}
 
-				/* TODO: parse esmtp arguments */
+				rspamd_milter_parse_esmtp_args (priv, zero + 1, end);
 				break;
 			}
 			else {
@@ -676,10 +737,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 	case RSPAMD_MILTER_CMD_EOH:
 		msg_debug_milter ("got eoh command");
 
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_prepare_message (session, priv);
 
 		session->message = rspamd_fstring_append (session->message,
 				"\r\n", 2);
@@ -785,10 +843,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		}
 		break;
 	case RSPAMD_MILTER_CMD_DATA:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_prepare_message (session, priv);
 		msg_debug_milter ("got data command");
 		/* We do not need reply as specified */
 		break;
@@ -1431,13 +1486,16 @@ rspamd_milter_session_ref (struct rspamd_milter_session *session)
 	return session;
 }
 
+typedef void (*rspamd_milter_header_cb) (const gchar *name,
+		const gchar *value, gsize len, gpointer ud);
+
 #define IF_MACRO(lit) RSPAMD_FTOK_ASSIGN (&srch, (lit)); \
 	found = g_hash_table_lookup (session->macros, &srch); \
 	if (found)
 
 static void
-rspamd_milter_macro_http (struct rspamd_milter_session *session,
-		struct rspamd_http_message *msg)
+rspamd_milter_macro_headers (struct rspamd_milter_session *session,
+		rspamd_milter_header_cb cb, gpointer ud)
 {
 	rspamd_ftok_t *found, srch;
 	struct rspamd_milter_private *priv = session->priv;
@@ -1452,59 +1510,49 @@ rspamd_milter_macro_http (struct rspamd_milter_session *session,
 	}
 
 	IF_MACRO("{i}") {
-		rspamd_http_message_add_header_len (msg, QUEUE_ID_HEADER,
-				found->begin, found->len);
+		cb (QUEUE_ID_HEADER, found->begin, found->len, ud);
 	}
 	else {
 		IF_MACRO("i") {
-			rspamd_http_message_add_header_len (msg, QUEUE_ID_HEADER,
-					found->begin, found->len);
+			cb (QUEUE_ID_HEADER, found->begin, found->len, ud);
 		}
 	}
 
 	IF_MACRO("{v}") {
-		rspamd_http_message_add_header_len (msg, USER_AGENT_HEADER,
-				found->begin, found->len);
+		cb (USER_AGENT_HEADER, found->begin, found->len, ud);
 	}
 	else {
 		IF_MACRO("v") {
-			rspamd_http_message_add_header_len (msg, USER_AGENT_HEADER,
-					found->begin, found->len);
+			cb (USER_AGENT_HEADER, found->begin, found->len, ud);
 		}
 	}
 
 	IF_MACRO("{cipher}") {
-		rspamd_http_message_add_header_len (msg, TLS_CIPHER_HEADER,
-				found->begin, found->len);
+		cb (TLS_CIPHER_HEADER, found->begin, found->len, ud);
 	}
 
 	IF_MACRO("{tls_version}") {
-		rspamd_http_message_add_header_len (msg, TLS_VERSION_HEADER,
-				found->begin, found->len);
+		cb (TLS_VERSION_HEADER, found->begin, found->len, ud);
 	}
 
 	IF_MACRO("{auth_authen}") {
-		rspamd_http_message_add_header_len (msg, USER_HEADER,
-				found->begin, found->len);
+		cb (USER_HEADER, found->begin, found->len, ud);
 	}
 
 	IF_MACRO("{rcpt_mailer}") {
-		rspamd_http_message_add_header_len (msg, MAILER_HEADER,
-				found->begin, found->len);
+		cb (MAILER_HEADER, found->begin, found->len, ud);
 	}
 
 	if (milter_ctx->client_ca_name) {
 		IF_MACRO ("{cert_issuer}") {
-			rspamd_http_message_add_header_len (msg, CERT_ISSUER_HEADER,
-					found->begin, found->len);
+			cb (CERT_ISSUER_HEADER, found->begin, found->len, ud);
 
 			if (found->len == strlen (milter_ctx->client_ca_name) &&
 					rspamd_cryptobox_memcmp (found->begin,
 							milter_ctx->client_ca_name, found->len) == 0) {
 				msg_debug_milter ("process certificate issued by %T", found);
 				IF_MACRO("{cert_subject}") {
-					rspamd_http_message_add_header_len (msg, USER_HEADER,
-							found->begin, found->len);
+					cb (USER_HEADER, found->begin, found->len, ud);
 				}
 			}
 			else {
@@ -1516,8 +1564,7 @@ rspamd_milter_macro_http (struct rspamd_milter_session *session,
 	}
 	else {
 		IF_MACRO ("{cert_issuer}") {
-			rspamd_http_message_add_header_len (msg, CERT_ISSUER_HEADER,
-					found->begin, found->len);
+			cb (CERT_ISSUER_HEADER, found->begin, found->len, ud);
 		}
 	}
 
@@ -1526,8 +1573,7 @@ rspamd_milter_macro_http (struct rspamd_milter_session *session,
 			if (!(found->len == sizeof ("unknown") - 1 &&
 					memcmp (found->begin, "unknown",
 							sizeof ("unknown") - 1) == 0)) {
-				rspamd_http_message_add_header_len (msg, HOSTNAME_HEADER,
-						found->begin, found->len);
+				cb (HOSTNAME_HEADER, found->begin, found->len, ud);
 			}
 			else {
 				msg_debug_milter ("skip unknown hostname from being added");
@@ -1537,50 +1583,36 @@ rspamd_milter_macro_http (struct rspamd_milter_session *session,
 
 	IF_MACRO("{daemon_name}") {
 		/* Postfix style */
-		rspamd_http_message_add_header_len (msg, MTA_NAME_HEADER,
-				found->begin, found->len);
+		cb (MTA_NAME_HEADER, found->begin, found->len, ud);
 	}
 	else {
 		/* Sendmail style */
 		IF_MACRO("{j}") {
-			rspamd_http_message_add_header_len (msg, MTA_NAME_HEADER,
-					found->begin, found->len);
+			cb (MTA_NAME_HEADER, found->begin, found->len, ud);
 		}
 		else {
 			IF_MACRO("j") {
-				rspamd_http_message_add_header_len (msg, MTA_NAME_HEADER,
-						found->begin, found->len);
+				cb (MTA_NAME_HEADER, found->begin, found->len, ud);
 			}
 		}
 	}
 }
 
-struct rspamd_http_message *
-rspamd_milter_to_http (struct rspamd_milter_session *session)
+static void
+rspamd_milter_headers (struct rspamd_milter_session *session,
+		rspamd_milter_header_cb cb, gpointer ud)
 {
-	struct rspamd_http_message *msg;
 	guint i;
 	struct rspamd_email_address *rcpt;
 	struct rspamd_milter_private *priv = session->priv;
-
-	g_assert (session != NULL);
-
-	msg = rspamd_http_new_message (HTTP_REQUEST);
-
-	msg->url = rspamd_fstring_assign (msg->url, "/" MSG_CMD_CHECK_V2,
-			sizeof ("/" MSG_CMD_CHECK_V2) - 1);
-
-	if (session->message) {
-		rspamd_http_message_set_body_from_fstring_steal (msg, session->message);
-		session->message = NULL;
-	}
+	const gchar *ip;
 
 	if (session->hostname && RSPAMD_FSTRING_LEN (session->hostname) > 0) {
 		if (!(session->hostname->len == sizeof ("unknown") - 1 &&
 				memcmp (RSPAMD_FSTRING_DATA (session->hostname), "unknown",
 						sizeof ("unknown") - 1) == 0)) {
-			rspamd_http_message_add_header_fstr (msg, HOSTNAME_HEADER,
-					session->hostname);
+			cb (HOSTNAME_HEADER, RSPAMD_FSTRING_DATA (session->hostname),
+					RSPAMD_FSTRING_LEN (session->hostname), ud);
 		}
 		else {
 			msg_debug_milter ("skip unknown hostname from being added");
@@ -1588,39 +1620,102 @@ rspamd_milter_to_http (struct rspamd_milter_session *session)
 	}
 
 	if (session->helo && session->helo->len > 0) {
-		rspamd_http_message_add_header_fstr (msg, HELO_HEADER,
-				session->helo);
+		cb (HELO_HEADER, RSPAMD_FSTRING_DATA (session->helo),
+				RSPAMD_FSTRING_LEN (session->helo), ud);
 	}
 
 	if (session->from) {
-		rspamd_http_message_add_header_len (msg, FROM_HEADER,
-				session->from->raw, session->from->raw_len);
+		cb (FROM_HEADER, session->from->raw, session->from->raw_len, ud);
 	}
 
 	if (session->rcpts) {
 		PTR_ARRAY_FOREACH (session->rcpts, i, rcpt) {
-			rspamd_http_message_add_header_len (msg, RCPT_HEADER,
-					rcpt->raw, rcpt->raw_len);
+			cb (RCPT_HEADER, rcpt->raw, rcpt->raw_len, ud);
 		}
 	}
 
 	if (session->addr) {
 		if (rspamd_inet_address_get_af (session->addr) != AF_UNIX) {
-			rspamd_http_message_add_header (msg, IP_ADDR_HEADER,
-					rspamd_inet_address_to_string_pretty (session->addr));
+			ip = rspamd_inet_address_to_string_pretty (session->addr);
 		}
 		else {
-			rspamd_http_message_add_header (msg, IP_ADDR_HEADER,
-					rspamd_inet_address_to_string (session->addr));
+			ip = rspamd_inet_address_to_string (session->addr);
 		}
+
+		cb (IP_ADDR_HEADER, ip, strlen (ip), ud);
 	}
 
-	rspamd_milter_macro_http (session, msg);
-	rspamd_http_message_add_header (msg, FLAGS_HEADER, "milter,body_block");
+	rspamd_milter_macro_headers (session, cb, ud);
+	cb (FLAGS_HEADER, "milter,body_block", sizeof ("milter,body_block") - 1, ud);
+}
+
+static void
+rspamd_milter_http_header_cb (const gchar *name, const gchar *value, gsize len,
+		gpointer ud)
+{
+	struct rspamd_http_message *msg = (struct rspamd_http_message *)ud;
+
+	rspamd_http_message_add_header_len (msg, name, value, len);
+}
+
+struct rspamd_http_message *
+rspamd_milter_to_http (struct rspamd_milter_session *session)
+{
+	struct rspamd_http_message *msg;
+
+	g_assert (session != NULL);
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+
+	msg->url = rspamd_fstring_assign (msg->url, "/" MSG_CMD_CHECK_V2,
+			sizeof ("/" MSG_CMD_CHECK_V2) - 1);
+
+	if (session->message) {
+		rspamd_http_message_set_body_from_fstring_steal (msg, session->message);
+		session->message = NULL;
+	}
+
+	rspamd_milter_headers (session, rspamd_milter_http_header_cb, msg);
 
 	return msg;
 }
 
+static void
+rspamd_milter_task_header_cb (const gchar *name, const gchar *value, gsize len,
+		gpointer ud)
+{
+	struct rspamd_task *task = (struct rspamd_task *)ud;
+
+	rspamd_protocol_handle_header (task, name, strlen (name), value, len);
+}
+
+gboolean
+rspamd_milter_to_task (struct rspamd_milter_session *session,
+		struct rspamd_task *task)
+{
+	g_assert (session != NULL);
+
+	task->cmd = CMD_CHECK_V2;
+	rspamd_milter_headers (session, rspamd_milter_task_header_cb, task);
+	rspamd_protocol_handle_headers_done (task);
+
+	if (session->message == NULL) {
+		g_set_error (&task->err, rspamd_milter_quark (), EINVAL,
+				"no message in milter session");
+
+		return FALSE;
+	}
+
+	/* Body is owned by a task from now */
+	task->msg.begin = RSPAMD_FSTRING_DATA (session->message);
+	task->msg.len = RSPAMD_FSTRING_LEN (session->message);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_fstring_free, session->message);
+	session->message = NULL;
+
+	return rspamd_task_load_message (task, NULL, task->msg.begin, task->msg.len);
+}
+
 void *
 rspamd_milter_update_userdata (struct rspamd_milter_session *session,
 		void *ud)
@@ -50,6 +50,7 @@ struct rspamd_email_address;
 struct ev_loop;
 struct rspamd_http_message;
 struct rspamd_config;
+struct rspamd_task;
 
 struct rspamd_milter_context {
 	const gchar *spam_header;
@@ -157,6 +158,17 @@ struct rspamd_milter_session *rspamd_milter_session_ref (
 struct rspamd_http_message *rspamd_milter_to_http (
 		struct rspamd_milter_session *session);
 
+/**
+ * Fills task with the envelope and the message body of milter session
+ * directly, without building of an intermediate HTTP message. The body
+ * buffer is moved to the task's pool.
+ * @param session
+ * @param task
+ * @return TRUE if message has been loaded
+ */
+gboolean rspamd_milter_to_task (struct rspamd_milter_session *session,
+								struct rspamd_task *task);
+
 /**
  * Sends task results to the
  * @param session
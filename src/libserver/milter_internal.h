@@ -71,6 +71,8 @@ struct rspamd_milter_private {
 	rspamd_mempool_t *pool;
 	khash_t(milter_headers_hash_t) *headers;
 	gint cur_hdr;
+	/* Message size announced by MTA, used to preallocate the message buffer */
+	gsize size_hint;
 	rspamd_milter_finish fin_cb;
 	rspamd_milter_error err_cb;
 	void *ud;
@@ -156,6 +158,8 @@ enum rspamd_milter_connect_proto {
 #define RSPAMD_MILTER_PROTO_VER 6
 
 #define RSPAMD_MILTER_MESSAGE_CHUNK 65536
+/* Do not trust size hints from MTA above this value */
+#define RSPAMD_MILTER_MAX_PREALLOC (64 * 1024 * 1024)
 
 #define RSPAMD_MILTER_RCODE_REJECT "554"
 #define RSPAMD_MILTER_RCODE_TEMPFAIL "451"
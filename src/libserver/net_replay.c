@@ -0,0 +1,318 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "net_replay.h"
+#include "cfg_file.h"
+#include "logger.h"
+#include "util.h"
+#include "unix-std.h"
+
+#define RSPAMD_NET_REPLAY_MAGIC "rsnr0001"
+
+/* Record is followed by key and data */
+struct rspamd_net_replay_rec {
+	guint32 kind;
+	guint32 keylen;
+	guint32 datalen;
+};
+
+struct rspamd_net_replay_entry {
+	rspamd_ftok_t key;
+	rspamd_ftok_t data;
+};
+
+static struct rspamd_net_replay_ctx {
+	enum rspamd_net_replay_mode mode;
+	gint fd;
+	gchar *path;
+	/* Whole file in the replay mode, entries point to it */
+	gchar *contents;
+	GHashTable *entries[RSPAMD_NET_REPLAY_KIND_MAX];
+	guint64 hits;
+	guint64 misses;
+} replay_ctx = {
+	.mode = RSPAMD_NET_REPLAY_OFF,
+	.fd = -1,
+};
+
+static const gchar *replay_kinds[RSPAMD_NET_REPLAY_KIND_MAX] = {
+	[RSPAMD_NET_REPLAY_DNS] = "dns",
+	[RSPAMD_NET_REPLAY_REDIS] = "redis",
+	[RSPAMD_NET_REPLAY_HTTP] = "http",
+	[RSPAMD_NET_REPLAY_FUZZY] = "fuzzy",
+};
+
+static gboolean
+rspamd_net_replay_open_record (const gchar *path)
+{
+	struct stat st;
+	gint fd;
+
+	fd = open (path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+	if (fd == -1) {
+		msg_err ("cannot open net replay file %s: %s", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	/* All workers append to the same file, so only one writes magic */
+	if (!rspamd_file_lock (fd, FALSE)) {
+		msg_err ("cannot lock net replay file %s: %s", path, strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+			(st.st_size == 0 && write (fd, RSPAMD_NET_REPLAY_MAGIC,
+					sizeof (RSPAMD_NET_REPLAY_MAGIC) - 1) == -1)) {
+		msg_err ("cannot init net replay file %s: %s", path, strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return FALSE;
+	}
+
+	rspamd_file_unlock (fd, FALSE);
+	replay_ctx.fd = fd;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_net_replay_load (const gchar *path)
+{
+	struct rspamd_net_replay_rec rec;
+	struct rspamd_net_replay_entry *entry;
+	GError *err = NULL;
+	gchar *p, *end;
+	gsize len;
+	guint i, nrecs = 0, ndups = 0;
+
+	if (!g_file_get_contents (path, &replay_ctx.contents, &len, &err)) {
+		msg_err ("cannot read net replay file %s: %e", path, err);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	if (len < sizeof (RSPAMD_NET_REPLAY_MAGIC) - 1 ||
+			memcmp (replay_ctx.contents, RSPAMD_NET_REPLAY_MAGIC,
+					sizeof (RSPAMD_NET_REPLAY_MAGIC) - 1) != 0) {
+		msg_err ("bad net replay file %s: invalid magic", path);
+		g_free (replay_ctx.contents);
+		replay_ctx.contents = NULL;
+
+		return FALSE;
+	}
+
+	for (i = 0; i < RSPAMD_NET_REPLAY_KIND_MAX; i ++) {
+		replay_ctx.entries[i] = g_hash_table_new_full (rspamd_ftok_hash,
+				rspamd_ftok_equal, NULL, g_free);
+	}
+
+	p = replay_ctx.contents + sizeof (RSPAMD_NET_REPLAY_MAGIC) - 1;
+	end = replay_ctx.contents + len;
+
+	while (end - p >= (gssize)sizeof (rec)) {
+		memcpy (&rec, p, sizeof (rec));
+
+		if (rec.kind >= RSPAMD_NET_REPLAY_KIND_MAX ||
+				(gsize)(end - p) - sizeof (rec) < (gsize)rec.keylen + rec.datalen) {
+			/* Truncated record, e.g. a worker has been killed while writing */
+			msg_warn ("net replay file %s is truncated at offset %z",
+					path, (gsize)(p - replay_ctx.contents));
+			break;
+		}
+
+		p += sizeof (rec);
+		entry = g_malloc (sizeof (*entry));
+		entry->key.begin = p;
+		entry->key.len = rec.keylen;
+		entry->data.begin = p + rec.keylen;
+		entry->data.len = rec.datalen;
+		p += rec.keylen + rec.datalen;
+
+		if (g_hash_table_lookup (replay_ctx.entries[rec.kind], &entry->key)) {
+			/* The first reply wins */
+			g_free (entry);
+			ndups ++;
+		}
+		else {
+			g_hash_table_insert (replay_ctx.entries[rec.kind], &entry->key,
+					entry);
+		}
+
+		nrecs ++;
+	}
+
+	msg_info ("loaded %ud net replay records (%ud duplicates) from %s",
+			nrecs, ndups, path);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_net_replay_init (struct rspamd_config *cfg)
+{
+	enum rspamd_net_replay_mode mode;
+	gboolean ret;
+
+	if (replay_ctx.mode != RSPAMD_NET_REPLAY_OFF) {
+		return TRUE;
+	}
+
+	if (cfg->net_replay_mode == NULL ||
+			g_ascii_strcasecmp (cfg->net_replay_mode, "off") == 0) {
+		return TRUE;
+	}
+	else if (g_ascii_strcasecmp (cfg->net_replay_mode, "record") == 0) {
+		mode = RSPAMD_NET_REPLAY_RECORD;
+	}
+	else if (g_ascii_strcasecmp (cfg->net_replay_mode, "replay") == 0) {
+		mode = RSPAMD_NET_REPLAY_REPLAY;
+	}
+	else {
+		msg_err_config ("invalid net_replay_mode: %s, must be off, record "
+				"or replay", cfg->net_replay_mode);
+
+		return FALSE;
+	}
+
+	if (cfg->net_replay_file == NULL) {
+		msg_err_config ("net_replay_file must be set for net_replay_mode %s",
+				cfg->net_replay_mode);
+
+		return FALSE;
+	}
+
+	if (mode == RSPAMD_NET_REPLAY_RECORD) {
+		ret = rspamd_net_replay_open_record (cfg->net_replay_file);
+	}
+	else {
+		ret = rspamd_net_replay_load (cfg->net_replay_file);
+	}
+
+	if (ret) {
+		replay_ctx.mode = mode;
+		replay_ctx.path = g_strdup (cfg->net_replay_file);
+		msg_info_config ("network %s mode, file: %s",
+				mode == RSPAMD_NET_REPLAY_RECORD ? "recording" : "replaying",
+				replay_ctx.path);
+	}
+
+	return ret;
+}
+
+enum rspamd_net_replay_mode
+rspamd_net_replay_mode (void)
+{
+	return replay_ctx.mode;
+}
+
+void
+rspamd_net_replay_record (enum rspamd_net_replay_kind kind,
+		const void *key, gsize keylen,
+		const void *data, gsize datalen)
+{
+	struct rspamd_net_replay_rec rec;
+	guchar *buf;
+	gsize total;
+
+	if (replay_ctx.mode != RSPAMD_NET_REPLAY_RECORD ||
+			keylen > G_MAXUINT32 || datalen > G_MAXUINT32) {
+		return;
+	}
+
+	rec.kind = kind;
+	rec.keylen = keylen;
+	rec.datalen = datalen;
+	total = sizeof (rec) + keylen + datalen;
+
+	/* Single write, so records of different workers are not interleaved */
+	buf = g_malloc (total);
+	memcpy (buf, &rec, sizeof (rec));
+	memcpy (buf + sizeof (rec), key, keylen);
+
+	if (datalen > 0) {
+		memcpy (buf + sizeof (rec) + keylen, data, datalen);
+	}
+
+	if (write (replay_ctx.fd, buf, total) != (gssize)total) {
+		msg_err ("cannot write %s reply to net replay file %s: %s",
+				replay_kinds[kind], replay_ctx.path, strerror (errno));
+	}
+
+	g_free (buf);
+}
+
+const guchar *
+rspamd_net_replay_lookup (enum rspamd_net_replay_kind kind,
+		const void *key, gsize keylen,
+		gsize *datalen)
+{
+	struct rspamd_net_replay_entry *entry;
+	rspamd_ftok_t srch;
+
+	if (replay_ctx.mode != RSPAMD_NET_REPLAY_REPLAY) {
+		return NULL;
+	}
+
+	srch.begin = key;
+	srch.len = keylen;
+	entry = g_hash_table_lookup (replay_ctx.entries[kind], &srch);
+
+	if (entry == NULL) {
+		replay_ctx.misses ++;
+		msg_debug ("no recorded %s reply for %*s", replay_kinds[kind],
+				(gint)keylen, (const gchar *)key);
+
+		return NULL;
+	}
+
+	replay_ctx.hits ++;
+	*datalen = entry->data.len;
+
+	return (const guchar *)entry->data.begin;
+}
+
+void
+rspamd_net_replay_deinit (void)
+{
+	guint i;
+
+	if (replay_ctx.mode == RSPAMD_NET_REPLAY_REPLAY) {
+		msg_info ("net replay finished: %L hits, %L misses",
+				(gint64)replay_ctx.hits, (gint64)replay_ctx.misses);
+	}
+
+	for (i = 0; i < RSPAMD_NET_REPLAY_KIND_MAX; i ++) {
+		if (replay_ctx.entries[i]) {
+			g_hash_table_unref (replay_ctx.entries[i]);
+			replay_ctx.entries[i] = NULL;
+		}
+	}
+
+	if (replay_ctx.fd != -1) {
+		close (replay_ctx.fd);
+		replay_ctx.fd = -1;
+	}
+
+	g_free (replay_ctx.contents);
+	replay_ctx.contents = NULL;
+	g_free (replay_ctx.path);
+	replay_ctx.path = NULL;
+	replay_ctx.mode = RSPAMD_NET_REPLAY_OFF;
+}
@@ -0,0 +1,94 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_NET_REPLAY_H
+#define RSPAMD_NET_REPLAY_H
+
+#include "config.h"
+
+/**
+ * Network replay allows to profile messages processing deterministically:
+ * in the record mode replies of DNS, Redis, HTTP and fuzzy servers are
+ * appended to a file, in the replay mode they are served from that file
+ * and no network requests are performed at all. Replies are keyed by
+ * requests, so the same corpus must be processed with the same config.
+ */
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct rspamd_config;
+
+enum rspamd_net_replay_mode {
+	RSPAMD_NET_REPLAY_OFF = 0,
+	RSPAMD_NET_REPLAY_RECORD,
+	RSPAMD_NET_REPLAY_REPLAY,
+};
+
+enum rspamd_net_replay_kind {
+	RSPAMD_NET_REPLAY_DNS = 0,
+	RSPAMD_NET_REPLAY_REDIS,
+	RSPAMD_NET_REPLAY_HTTP,
+	RSPAMD_NET_REPLAY_FUZZY,
+	RSPAMD_NET_REPLAY_KIND_MAX,
+};
+
+/**
+ * Opens replay file according to `net_replay_mode` and `net_replay_file`
+ * options, must be called once per process
+ * @param cfg
+ * @return FALSE if replay is configured but the file cannot be used
+ */
+gboolean rspamd_net_replay_init (struct rspamd_config *cfg);
+
+/**
+ * Returns the current mode of the process
+ */
+enum rspamd_net_replay_mode rspamd_net_replay_mode (void);
+
+/**
+ * Appends a reply to the replay file, does nothing unless recording
+ * @param kind
+ * @param key request key
+ * @param keylen
+ * @param data reply
+ * @param datalen
+ */
+void rspamd_net_replay_record (enum rspamd_net_replay_kind kind,
+							   const void *key, gsize keylen,
+							   const void *data, gsize datalen);
+
+/**
+ * Finds a recorded reply, the first recorded reply wins if a request
+ * has been recorded more than once
+ * @param kind
+ * @param key request key
+ * @param keylen
+ * @param datalen output length of the reply
+ * @return reply which is valid till the process exits or NULL
+ */
+const guchar *rspamd_net_replay_lookup (enum rspamd_net_replay_kind kind,
+										const void *key, gsize keylen,
+										gsize *datalen);
+
+/**
+ * Frees resources
+ */
+void rspamd_net_replay_deinit (void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
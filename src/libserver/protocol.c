@@ -379,12 +379,14 @@ rspamd_protocol_handle_flag (struct rspamd_task *task, const gchar *str,
 	CHECK_TASK_FLAG("no_stat", RSPAMD_TASK_FLAG_NO_STAT);
 	CHECK_TASK_FLAG("ssl", RSPAMD_TASK_FLAG_SSL);
 	CHECK_TASK_FLAG("profile", RSPAMD_TASK_FLAG_PROFILE);
+	CHECK_TASK_FLAG("bulk", RSPAMD_TASK_FLAG_BULK);
 
 	CHECK_PROTOCOL_FLAG("milter", RSPAMD_TASK_PROTOCOL_FLAG_MILTER);
 	CHECK_PROTOCOL_FLAG("zstd", RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED);
 	CHECK_PROTOCOL_FLAG("ext_urls", RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS);
 	CHECK_PROTOCOL_FLAG("body_block", RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK);
 	CHECK_PROTOCOL_FLAG("groups", RSPAMD_TASK_PROTOCOL_FLAG_GROUPS);
+	CHECK_PROTOCOL_FLAG("resources", RSPAMD_TASK_PROTOCOL_FLAG_RESOURCES);
 
 	if (!known) {
 		msg_warn_protocol ("unknown flag: %*s", (gint)len, str);
@@ -445,267 +447,279 @@ rspamd_protocol_process_flags (struct rspamd_task *task, const rspamd_ftok_t *hd
 	srch.len = sizeof (name) - 1; \
 	if (rspamd_ftok_casecmp (hn_tok, &srch) == 0)
 
-gboolean
-rspamd_protocol_handle_headers (struct rspamd_task *task,
-	struct rspamd_http_message *msg)
+void
+rspamd_protocol_handle_header (struct rspamd_task *task,
+		const gchar *name, gsize nlen,
+		const gchar *value, gsize vlen)
 {
-	rspamd_ftok_t *hn_tok, *hv_tok, srch;
-	gboolean has_ip = FALSE, seen_settings_header = FALSE;
-	struct rspamd_http_header *header, *h;
+	rspamd_ftok_t *hn_tok, *hv_tok, srch, tmp;
 	gchar *ntok;
 
-	kh_foreach_value (msg->headers, header, {
-		DL_FOREACH (header, h) {
-			ntok = rspamd_mempool_ftokdup (task->task_pool, &h->name);
-			hn_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hn_tok));
-			hn_tok->begin = ntok;
-			hn_tok->len = h->name.len;
-
-
-			ntok = rspamd_mempool_ftokdup (task->task_pool, &h->value);
-			hv_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hv_tok));
-			hv_tok->begin = ntok;
-			hv_tok->len = h->value.len;
-
-			switch (*hn_tok->begin) {
-			case 'd':
-			case 'D':
-				IF_HEADER (DELIVER_TO_HEADER) {
-					task->deliver_to = rspamd_protocol_escape_braces (task, hv_tok);
-					msg_debug_protocol ("read deliver-to header, value: %s",
-							task->deliver_to);
-				}
-				else {
-					msg_debug_protocol ("wrong header: %T", hn_tok);
-				}
-				break;
-			case 'h':
-			case 'H':
-				IF_HEADER (HELO_HEADER) {
-					task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					msg_debug_protocol ("read helo header, value: %s", task->helo);
-				}
-				IF_HEADER (HOSTNAME_HEADER) {
-					task->hostname = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read hostname header, value: %s", task->hostname);
-				}
-				break;
-			case 'f':
-			case 'F':
-				IF_HEADER (FROM_HEADER) {
-					task->from_envelope = rspamd_email_address_from_smtp (
-							hv_tok->begin,
-							hv_tok->len);
-					msg_debug_protocol ("read from header, value: %T", hv_tok);
-
-					if (!task->from_envelope) {
-						msg_err_protocol ("bad from header: '%T'", hv_tok);
-						task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
-					}
-				}
-				IF_HEADER (FILENAME_HEADER) {
-					task->msg.fpath = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read filename header, value: %s", task->msg.fpath);
-				}
-				IF_HEADER (FLAGS_HEADER) {
-					msg_debug_protocol ("read flags header, value: %T", hv_tok);
-					rspamd_protocol_process_flags (task, hv_tok);
-				}
-				break;
-			case 'q':
-			case 'Q':
-				IF_HEADER (QUEUE_ID_HEADER) {
-					task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read queue_id header, value: %s", task->queue_id);
-				}
-				else {
-					msg_debug_protocol ("wrong header: %T", hn_tok);
-				}
-				break;
-			case 'r':
-			case 'R':
-				IF_HEADER (RCPT_HEADER) {
-					rspamd_protocol_process_recipients (task, hv_tok);
-					msg_debug_protocol ("read rcpt header, value: %T", hv_tok);
-				}
-				IF_HEADER (RAW_DATA_HEADER) {
-					srch.begin = "yes";
-					srch.len = 3;
+	tmp.begin = name;
+	tmp.len = nlen;
+	ntok = rspamd_mempool_ftokdup (task->task_pool, &tmp);
+	hn_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hn_tok));
+	hn_tok->begin = ntok;
+	hn_tok->len = nlen;
+
+	tmp.begin = value;
+	tmp.len = vlen;
+	ntok = rspamd_mempool_ftokdup (task->task_pool, &tmp);
+	hv_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hv_tok));
+	hv_tok->begin = ntok;
+	hv_tok->len = vlen;
+
+	switch (*hn_tok->begin) {
+	case 'a':
+	case 'A':
+		IF_HEADER (ACCEPT_HEADER) {
+			if (rspamd_substring_search_caseless (hv_tok->begin,
+					hv_tok->len, MSGPACK_CONTENT_TYPE,
+					sizeof (MSGPACK_CONTENT_TYPE) - 1) != -1) {
+				task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_MSGPACK;
+				msg_debug_protocol ("client accepts msgpack reply");
+			}
+		}
+		break;
+	case 'd':
+	case 'D':
+		IF_HEADER (DELIVER_TO_HEADER) {
+			task->deliver_to = rspamd_protocol_escape_braces (task, hv_tok);
+			msg_debug_protocol ("read deliver-to header, value: %s",
+					task->deliver_to);
+		}
+		else {
+			msg_debug_protocol ("wrong header: %T", hn_tok);
+		}
+		break;
+	case 'h':
+	case 'H':
+		IF_HEADER (HELO_HEADER) {
+			task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			msg_debug_protocol ("read helo header, value: %s", task->helo);
+		}
+		IF_HEADER (HOSTNAME_HEADER) {
+			task->hostname = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			msg_debug_protocol ("read hostname header, value: %s", task->hostname);
+		}
+		break;
+	case 'f':
+	case 'F':
+		IF_HEADER (FROM_HEADER) {
+			task->from_envelope = rspamd_email_address_from_smtp (
+					hv_tok->begin,
+					hv_tok->len);
+			msg_debug_protocol ("read from header, value: %T", hv_tok);
+
+			if (!task->from_envelope) {
+				msg_err_protocol ("bad from header: '%T'", hv_tok);
+				task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
+			}
+		}
+		IF_HEADER (FILENAME_HEADER) {
+			task->msg.fpath = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			msg_debug_protocol ("read filename header, value: %s", task->msg.fpath);
+		}
+		IF_HEADER (FLAGS_HEADER) {
+			msg_debug_protocol ("read flags header, value: %T", hv_tok);
+			rspamd_protocol_process_flags (task, hv_tok);
+		}
+		break;
+	case 'q':
+	case 'Q':
+		IF_HEADER (QUEUE_ID_HEADER) {
+			task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			msg_debug_protocol ("read queue_id header, value: %s", task->queue_id);
+		}
+		else {
+			msg_debug_protocol ("wrong header: %T", hn_tok);
+		}
+		break;
+	case 'r':
+	case 'R':
+		IF_HEADER (RCPT_HEADER) {
+			rspamd_protocol_process_recipients (task, hv_tok);
+			msg_debug_protocol ("read rcpt header, value: %T", hv_tok);
+		}
+		IF_HEADER (RAW_DATA_HEADER) {
+			srch.begin = "yes";
+			srch.len = 3;
 
-					msg_debug_protocol ("read raw data header, value: %T", hv_tok);
+			msg_debug_protocol ("read raw data header, value: %T", hv_tok);
 
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags &= ~RSPAMD_TASK_FLAG_MIME;
-						msg_debug_protocol ("disable mime parsing");
-					}
-				}
-				break;
-			case 'i':
-			case 'I':
-				IF_HEADER (IP_ADDR_HEADER) {
-					if (!rspamd_parse_inet_address (&task->from_addr,
-							hv_tok->begin, hv_tok->len,
-							RSPAMD_INET_ADDRESS_PARSE_DEFAULT)) {
-						msg_err_protocol ("bad ip header: '%T'", hv_tok);
-					}
-					else {
-						msg_debug_protocol ("read IP header, value: %T", hv_tok);
-						has_ip = TRUE;
-					}
-				}
-				else {
-					msg_debug_protocol ("wrong header: %T", hn_tok);
-				}
-				break;
-			case 'p':
-			case 'P':
-				IF_HEADER (PASS_HEADER) {
-					srch.begin = "all";
-					srch.len = 3;
+			if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+				task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+				msg_debug_protocol ("disable mime parsing");
+			}
+		}
+		break;
+	case 'i':
+	case 'I':
+		IF_HEADER (IP_ADDR_HEADER) {
+			if (!rspamd_parse_inet_address (&task->from_addr,
+					hv_tok->begin, hv_tok->len,
+					RSPAMD_INET_ADDRESS_PARSE_DEFAULT)) {
+				msg_err_protocol ("bad ip header: '%T'", hv_tok);
+			}
+			else {
+				msg_debug_protocol ("read IP header, value: %T", hv_tok);
+			}
+		}
+		else {
+			msg_debug_protocol ("wrong header: %T", hn_tok);
+		}
+		break;
+	case 'p':
+	case 'P':
+		IF_HEADER (PASS_HEADER) {
+			srch.begin = "all";
+			srch.len = 3;
 
-					msg_debug_protocol ("read pass header, value: %T", hv_tok);
+			msg_debug_protocol ("read pass header, value: %T", hv_tok);
 
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
-						msg_debug_protocol ("pass all filters");
-					}
-				}
-				IF_HEADER (PROFILE_HEADER) {
-					msg_debug_protocol ("read profile header, value: %T", hv_tok);
-					task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+			if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+				task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+				msg_debug_protocol ("pass all filters");
+			}
+		}
+		IF_HEADER (PROFILE_HEADER) {
+			msg_debug_protocol ("read profile header, value: %T", hv_tok);
+			task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+		}
+		break;
+	case 's':
+	case 'S':
+		IF_HEADER (SETTINGS_ID_HEADER) {
+			msg_debug_protocol ("read settings-id header, value: %T", hv_tok);
+			task->settings_elt = rspamd_config_find_settings_name_ref (
+					task->cfg, hv_tok->begin, hv_tok->len);
+
+			if (task->settings_elt == NULL) {
+				GString *known_ids = g_string_new (NULL);
+				struct rspamd_config_settings_elt *cur;
+
+				DL_FOREACH (task->cfg->setting_ids, cur) {
+					rspamd_printf_gstring (known_ids, "%s(%ud);",
+							cur->name, cur->id);
 				}
-				break;
-			case 's':
-			case 'S':
-				IF_HEADER (SETTINGS_ID_HEADER) {
-					msg_debug_protocol ("read settings-id header, value: %T", hv_tok);
-					task->settings_elt = rspamd_config_find_settings_name_ref (
-							task->cfg, hv_tok->begin, hv_tok->len);
-
-					if (task->settings_elt == NULL) {
-						GString *known_ids = g_string_new (NULL);
-						struct rspamd_config_settings_elt *cur;
-
-						DL_FOREACH (task->cfg->setting_ids, cur) {
-							rspamd_printf_gstring (known_ids, "%s(%ud);",
-									cur->name, cur->id);
-						}
 
-						msg_warn_protocol ("unknown settings id: %T(%d); known_ids: %v",
-								hv_tok,
-								rspamd_config_name_to_id (hv_tok->begin, hv_tok->len),
-								known_ids);
+				msg_warn_protocol ("unknown settings id: %T(%d); known_ids: %v",
+						hv_tok,
+						rspamd_config_name_to_id (hv_tok->begin, hv_tok->len),
+						known_ids);
 
-						g_string_free (known_ids, TRUE);
-					}
-					else {
-						msg_debug_protocol ("applied settings id %T -> %ud", hv_tok,
-								task->settings_elt->id);
-					}
-				}
-				IF_HEADER (SETTINGS_HEADER) {
-					msg_debug_protocol ("read settings header, value: %T", hv_tok);
-					seen_settings_header = TRUE;
-				}
-				break;
-			case 'u':
-			case 'U':
-				IF_HEADER (USER_HEADER) {
-					/*
-					 * We must ignore User header in case of spamc, as SA has
-					 * different meaning of this header
-					 */
-					msg_debug_protocol ("read user header, value: %T", hv_tok);
-					if (!RSPAMD_TASK_IS_SPAMC (task)) {
-						task->user = rspamd_mempool_ftokdup (task->task_pool,
-								hv_tok);
-					}
-					else {
-						msg_info_protocol ("ignore user header: legacy SA protocol");
-					}
-				}
-				IF_HEADER (URLS_HEADER) {
-					msg_debug_protocol ("read urls header, value: %T", hv_tok);
+				g_string_free (known_ids, TRUE);
+			}
+			else {
+				msg_debug_protocol ("applied settings id %T -> %ud", hv_tok,
+						task->settings_elt->id);
+			}
+		}
+		IF_HEADER (SETTINGS_HEADER) {
+			msg_debug_protocol ("read settings header, value: %T", hv_tok);
+		}
+		break;
+	case 'u':
+	case 'U':
+		IF_HEADER (USER_HEADER) {
+			/*
+			 * We must ignore User header in case of spamc, as SA has
+			 * different meaning of this header
+			 */
+			msg_debug_protocol ("read user header, value: %T", hv_tok);
+			if (!RSPAMD_TASK_IS_SPAMC (task)) {
+				task->user = rspamd_mempool_ftokdup (task->task_pool,
+						hv_tok);
+			}
+			else {
+				msg_info_protocol ("ignore user header: legacy SA protocol");
+			}
+		}
+		IF_HEADER (URLS_HEADER) {
+			msg_debug_protocol ("read urls header, value: %T", hv_tok);
 
-					srch.begin = "extended";
-					srch.len = 8;
+			srch.begin = "extended";
+			srch.len = 8;
 
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS;
-						msg_debug_protocol ("extended urls information");
-					}
+			if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+				task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS;
+				msg_debug_protocol ("extended urls information");
+			}
 
-					/* TODO: add more formats there */
-				}
-				IF_HEADER (USER_AGENT_HEADER) {
-					msg_debug_protocol ("read user-agent header, value: %T", hv_tok);
+			/* TODO: add more formats there */
+		}
+		IF_HEADER (USER_AGENT_HEADER) {
+			msg_debug_protocol ("read user-agent header, value: %T", hv_tok);
 
-					if (hv_tok->len == 6 &&
-							rspamd_lc_cmp (hv_tok->begin, "rspamc", 6) == 0) {
-						task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_LOCAL_CLIENT;
-					}
-				}
-				break;
-			case 'l':
-			case 'L':
-				IF_HEADER (NO_LOG_HEADER) {
-					msg_debug_protocol ("read log header, value: %T", hv_tok);
-					srch.begin = "no";
-					srch.len = 2;
-
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
-					}
-				}
-				break;
-			case 'm':
-			case 'M':
-				IF_HEADER (MLEN_HEADER) {
-					msg_debug_protocol ("read message length header, value: %T",
-							hv_tok);
-					task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_HAS_CONTROL;
-				}
-				IF_HEADER (MTA_TAG_HEADER) {
-					gchar *mta_tag;
-					mta_tag = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_TAG,
-							mta_tag, NULL);
-					msg_debug_protocol ("read MTA-Tag header, value: %s", mta_tag);
-				}
-				IF_HEADER (MTA_NAME_HEADER) {
-					gchar *mta_name;
-					mta_name = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_NAME,
-							mta_name, NULL);
-					msg_debug_protocol ("read MTA-Name header, value: %s", mta_name);
-				}
-				IF_HEADER (MILTER_HEADER) {
-					task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_MILTER;
-					msg_debug_protocol ("read Milter header, value: %T", hv_tok);
-				}
-				break;
-			case 't':
-			case 'T':
-				IF_HEADER (TLS_CIPHER_HEADER) {
-					task->flags |= RSPAMD_TASK_FLAG_SSL;
-					msg_debug_protocol ("read TLS cipher header, value: %T", hv_tok);
-				}
-				break;
-			default:
-				msg_debug_protocol ("generic header: %T", hn_tok);
-				break;
+			if (hv_tok->len == 6 &&
+					rspamd_lc_cmp (hv_tok->begin, "rspamc", 6) == 0) {
+				task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_LOCAL_CLIENT;
 			}
-
-			rspamd_task_add_request_header (task, hn_tok, hv_tok);
 		}
-	}); /* End of kh_foreach_value */
+		break;
+	case 'l':
+	case 'L':
+		IF_HEADER (NO_LOG_HEADER) {
+			msg_debug_protocol ("read log header, value: %T", hv_tok);
+			srch.begin = "no";
+			srch.len = 2;
+
+			if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+				task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
+			}
+		}
+		break;
+	case 'm':
+	case 'M':
+		IF_HEADER (MLEN_HEADER) {
+			msg_debug_protocol ("read message length header, value: %T",
+					hv_tok);
+			task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_HAS_CONTROL;
+		}
+		IF_HEADER (MTA_TAG_HEADER) {
+			gchar *mta_tag;
+			mta_tag = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_MTA_TAG,
+					mta_tag, NULL);
+			msg_debug_protocol ("read MTA-Tag header, value: %s", mta_tag);
+		}
+		IF_HEADER (MTA_NAME_HEADER) {
+			gchar *mta_name;
+			mta_name = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_MTA_NAME,
+					mta_name, NULL);
+			msg_debug_protocol ("read MTA-Name header, value: %s", mta_name);
+		}
+		IF_HEADER (MILTER_HEADER) {
+			task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_MILTER;
+			msg_debug_protocol ("read Milter header, value: %T", hv_tok);
+		}
+		break;
+	case 't':
+	case 'T':
+		IF_HEADER (TLS_CIPHER_HEADER) {
+			task->flags |= RSPAMD_TASK_FLAG_SSL;
+			msg_debug_protocol ("read TLS cipher header, value: %T", hv_tok);
+		}
+		break;
+	default:
+		msg_debug_protocol ("generic header: %T", hn_tok);
+		break;
+	}
+
+	rspamd_task_add_request_header (task, hn_tok, hv_tok);
+}
 
-	if (seen_settings_header && task->settings_elt) {
+void
+rspamd_protocol_handle_headers_done (struct rspamd_task *task)
+{
+	if (task->settings_elt &&
+			rspamd_task_get_request_header (task, SETTINGS_HEADER)) {
 		msg_warn_task ("ignore settings id %s as settings header is also presented",
 				task->settings_elt->name);
 		REF_RELEASE (task->settings_elt);
@@ -713,9 +727,25 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 		task->settings_elt = NULL;
 	}
 
-	if (!has_ip) {
+	if (task->from_addr == NULL) {
 		task->flags |= RSPAMD_TASK_FLAG_NO_IP;
 	}
+}
+
+gboolean
+rspamd_protocol_handle_headers (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_http_header *header, *h;
+
+	kh_foreach_value (msg->headers, header, {
+		DL_FOREACH (header, h) {
+			rspamd_protocol_handle_header (task, h->name.begin, h->name.len,
+					h->value.begin, h->value.len);
+		}
+	}); /* End of kh_foreach_value */
+
+	rspamd_protocol_handle_headers_done (task);
 
 	return TRUE;
 }
@@ -864,8 +894,95 @@ struct tree_cb_data {
 	ucl_object_t *top;
 	khash_t (rspamd_url_host_hash) *seen;
 	struct rspamd_task *task;
+	/* If not NULL, then elements are written directly to this JSON buffer */
+	rspamd_fstring_t **out;
+	gboolean first;
 };
 
+/*
+ * Helpers to write JSON reply directly, without building of ucl objects,
+ * output is the same as ucl emitter produces for the same values
+ */
+static void
+rspamd_protocol_json_string (rspamd_fstring_t **out, const gchar *str,
+		gsize len)
+{
+	const gchar hexdigits[] = "0123456789abcdef";
+	const guchar *p = (const guchar *)str, *c = p, *end = p + len;
+	gchar esc[6];
+
+	*out = rspamd_fstring_append (*out, "\"", 1);
+
+	while (p < end) {
+		if (*p < 0x20 || *p == '"' || *p == '\\' || *p == 0x7f) {
+			if (p > c) {
+				*out = rspamd_fstring_append (*out, (const gchar *)c, p - c);
+			}
+
+			switch (*p) {
+			case '\n':
+				*out = rspamd_fstring_append (*out, "\\n", 2);
+				break;
+			case '\r':
+				*out = rspamd_fstring_append (*out, "\\r", 2);
+				break;
+			case '\t':
+				*out = rspamd_fstring_append (*out, "\\t", 2);
+				break;
+			case '"':
+				*out = rspamd_fstring_append (*out, "\\\"", 2);
+				break;
+			case '\\':
+				*out = rspamd_fstring_append (*out, "\\\\", 2);
+				break;
+			default:
+				memcpy (esc, "\\u00", 4);
+				esc[4] = hexdigits[(*p >> 4) & 0xf];
+				esc[5] = hexdigits[*p & 0xf];
+				*out = rspamd_fstring_append (*out, esc, sizeof (esc));
+				break;
+			}
+
+			c = ++p;
+		}
+		else {
+			p ++;
+		}
+	}
+
+	if (p > c) {
+		*out = rspamd_fstring_append (*out, (const gchar *)c, p - c);
+	}
+
+	*out = rspamd_fstring_append (*out, "\"", 1);
+}
+
+static void
+rspamd_protocol_json_double (rspamd_fstring_t **out, gdouble val)
+{
+	if (isfinite (val)) {
+		if (val == (gdouble)((gint)val)) {
+			rspamd_printf_fstring (out, "%.1f", val);
+		}
+		else {
+			rspamd_printf_fstring (out, "%.6f", val);
+		}
+	}
+	else {
+		*out = rspamd_fstring_append (*out, "null", 4);
+	}
+}
+
+static void
+rspamd_protocol_json_array_elt (struct tree_cb_data *cb)
+{
+	if (!cb->first) {
+		*cb->out = rspamd_fstring_append (*cb->out, ",", 1);
+	}
+
+	cb->first = FALSE;
+}
+
 static ucl_object_t *
 rspamd_protocol_extended_url (struct rspamd_task *task,
 		struct rspamd_url *url,
@@ -925,15 +1042,22 @@ urls_protocol_cb (struct rspamd_url *url, struct tree_cb_data *cb)
 			}
 
 			goffset err_offset;
+			gsize hostlen = url->hostlen;
 
 			if ((err_offset = rspamd_fast_utf8_validate (rspamd_url_host_unsafe (url),
-					url->hostlen)) == 0) {
-				obj = ucl_object_fromstring_common (rspamd_url_host_unsafe (url),
-						url->hostlen, 0);
+					url->hostlen)) != 0) {
+				hostlen = err_offset - 1;
+			}
+
+			if (cb->out) {
+				rspamd_protocol_json_array_elt (cb);
+				rspamd_protocol_json_string (cb->out,
+						rspamd_url_host_unsafe (url), hostlen);
 			}
 			else {
 				obj = ucl_object_fromstring_common (rspamd_url_host_unsafe (url),
-						err_offset - 1, 0);
+						hostlen, 0);
+				ucl_array_append (cb->top, obj);
 			}
 		}
 		else {
@@ -945,9 +1069,16 @@ urls_protocol_cb (struct rspamd_url *url, struct tree_cb_data *cb)
 	else {
 		encoded = rspamd_url_encode (url, &enclen, task->task_pool);
 		obj = rspamd_protocol_extended_url (task, url, encoded, enclen);
-	}
 
-	ucl_array_append (cb->top, obj);
+		if (cb->out) {
+			rspamd_protocol_json_array_elt (cb);
+			rspamd_ucl_emit_fstring (obj, UCL_EMIT_JSON_COMPACT, cb->out);
+			ucl_object_unref (obj);
+		}
+		else {
+			ucl_array_append (cb->top, obj);
+		}
+	}
 
 	if (cb->task->cfg->log_urls) {
 		if (task->user) {
@@ -985,6 +1116,7 @@ rspamd_urls_tree_ucl (khash_t (rspamd_url_hash) *set,
 	cb.top = obj;
 	cb.task = task;
 	cb.seen = kh_init (rspamd_url_host_hash);
+	cb.out = NULL;
 
 	kh_foreach_key (set, u, {
 		if (!(u->protocol & PROTOCOL_MAILTO)) {
@@ -997,15 +1129,47 @@ rspamd_urls_tree_ucl (khash_t (rspamd_url_hash) *set,
 	return obj;
 }
 
+static void
+rspamd_urls_tree_json (khash_t (rspamd_url_hash) *set,
+		struct rspamd_task *task, rspamd_fstring_t **out)
+{
+	struct tree_cb_data cb;
+	struct rspamd_url *u;
+
+	cb.top = NULL;
+	cb.task = task;
+	cb.seen = kh_init (rspamd_url_host_hash);
+	cb.out = out;
+	cb.first = TRUE;
+
+	*out = rspamd_fstring_append (*out, "[", 1);
+
+	kh_foreach_key (set, u, {
+		if (!(u->protocol & PROTOCOL_MAILTO)) {
+			urls_protocol_cb (u, &cb);
+		}
+	});
+
+	*out = rspamd_fstring_append (*out, "]", 1);
+	kh_destroy (rspamd_url_host_hash, cb.seen);
+}
+
 static void
 emails_protocol_cb (struct rspamd_url *url, struct tree_cb_data *cb)
 {
 	ucl_object_t *obj;
 
 	if (url->userlen > 0 && url->hostlen > 0) {
-		obj = ucl_object_fromlstring (rspamd_url_user_unsafe (url),
-				url->userlen + url->hostlen + 1);
-		ucl_array_append (cb->top, obj);
+		if (cb->out) {
+			rspamd_protocol_json_array_elt (cb);
+			rspamd_protocol_json_string (cb->out, rspamd_url_user_unsafe (url),
+					url->userlen + url->hostlen + 1);
+		}
+		else {
+			obj = ucl_object_fromlstring (rspamd_url_user_unsafe (url),
+					url->userlen + url->hostlen + 1);
+			ucl_array_append (cb->top, obj);
+		}
 	}
 }
 
@@ -1020,6 +1184,7 @@ rspamd_emails_tree_ucl (khash_t (rspamd_url_hash) *set,
 	obj = ucl_object_typed_new (UCL_ARRAY);
 	cb.top = obj;
 	cb.task = task;
+	cb.out = NULL;
 
 	kh_foreach_key (set, u, {
 		if ((u->protocol & PROTOCOL_MAILTO)) {
@@ -1031,6 +1196,29 @@ rspamd_emails_tree_ucl (khash_t (rspamd_url_hash) *set,
 	return obj;
 }
 
+static void
+rspamd_emails_tree_json (khash_t (rspamd_url_hash) *set,
+		struct rspamd_task *task, rspamd_fstring_t **out)
+{
+	struct tree_cb_data cb;
+	struct rspamd_url *u;
+
+	cb.top = NULL;
+	cb.task = task;
+	cb.out = out;
+	cb.first = TRUE;
+
+	*out = rspamd_fstring_append (*out, "[", 1);
+
+	kh_foreach_key (set, u, {
+		if ((u->protocol & PROTOCOL_MAILTO)) {
+			emails_protocol_cb (u, &cb);
+		}
+	});
+
+	*out = rspamd_fstring_append (*out, "]", 1);
+}
+
 
 /* Write new subject */
 static const gchar *
@@ -1154,6 +1342,74 @@ rspamd_metric_symbol_ucl (struct rspamd_task *task, struct rspamd_symbol_result
 	return obj;
 }
 
+/*
+ * Writes the same object as rspamd_metric_symbol_ucl for checkv2 reply
+ */
+static void
+rspamd_metric_symbol_json (struct rspamd_task *task,
+		struct rspamd_symbol_result *sym, rspamd_fstring_t **out)
+{
+	struct rspamd_symbol_option *opt;
+	gsize namelen = strlen (sym->name);
+
+	rspamd_protocol_json_string (out, sym->name, namelen);
+	*out = rspamd_fstring_append (*out, ":{\"name\":", sizeof (":{\"name\":") - 1);
+	rspamd_protocol_json_string (out, sym->name, namelen);
+	*out = rspamd_fstring_append (*out, ",\"score\":", sizeof (",\"score\":") - 1);
+	rspamd_protocol_json_double (out, sym->score);
+	*out = rspamd_fstring_append (*out, ",\"metric_score\":",
+			sizeof (",\"metric_score\":") - 1);
+	rspamd_protocol_json_double (out, sym->sym ? sym->sym->score : 0.0);
+
+	if (sym->sym && sym->sym->description) {
+		*out = rspamd_fstring_append (*out, ",\"description\":",
+				sizeof (",\"description\":") - 1);
+		rspamd_protocol_json_string (out, sym->sym->description,
+				strlen (sym->sym->description));
+	}
+
+	if (sym->options != NULL) {
+		*out = rspamd_fstring_append (*out, ",\"options\":[",
+				sizeof (",\"options\":[") - 1);
+
+		DL_FOREACH (sym->opts_head, opt) {
+			if (opt != sym->opts_head) {
+				*out = rspamd_fstring_append (*out, ",", 1);
+			}
+
+			rspamd_protocol_json_string (out, opt->option, opt->optlen);
+		}
+
+		*out = rspamd_fstring_append (*out, "]", 1);
+	}
+
+	*out = rspamd_fstring_append (*out, "}", 1);
+}
+
+static void
+rspamd_protocol_symbols_json (struct rspamd_task *task,
+		struct rspamd_scan_result *mres, rspamd_fstring_t **out)
+{
+	struct rspamd_symbol_result *sym;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append (*out, "\"symbols\":{",
+			sizeof ("\"symbols\":{") - 1);
+
+	kh_foreach_value (mres->symbols, sym, {
+		if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+			if (!first) {
+				*out = rspamd_fstring_append (*out, ",", 1);
+			}
+
+			first = FALSE;
+			rspamd_metric_symbol_json (task, sym, out);
+		}
+	});
+
+	*out = rspamd_fstring_append (*out, "}", 1);
+}
+
 static ucl_object_t *
 rspamd_metric_group_ucl (struct rspamd_task *task,
 		struct rspamd_symbols_group *gr, gdouble score)
@@ -1174,7 +1430,8 @@ rspamd_metric_group_ucl (struct rspamd_task *task,
 
 static ucl_object_t *
 rspamd_scan_result_ucl (struct rspamd_task *task,
-						struct rspamd_scan_result *mres, ucl_object_t *top)
+						struct rspamd_scan_result *mres, ucl_object_t *top,
+						gboolean with_symbols)
 {
 	struct rspamd_symbol_result *sym;
 	gboolean is_spam;
@@ -1246,25 +1503,30 @@ rspamd_scan_result_ucl (struct rspamd_task *task,
 	}
 
 	/* Now handle symbols */
-	if (task->cmd != CMD_CHECK) {
-		/* For checkv2 we insert symbols as a separate object */
-		obj = ucl_object_typed_new (UCL_OBJECT);
+	if (task->cmd != CMD_CHECK && !with_symbols) {
+		/* Symbols are written by caller */
 	}
-
-	kh_foreach_value (mres->symbols, sym, {
-		if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
-			sobj = rspamd_metric_symbol_ucl (task, sym);
-			ucl_object_insert_key (obj, sobj, sym->name, 0, false);
+	else {
+		if (task->cmd != CMD_CHECK) {
+			/* For checkv2 we insert symbols as a separate object */
+			obj = ucl_object_typed_new (UCL_OBJECT);
 		}
-	})
 
-	if (task->cmd != CMD_CHECK) {
-		/* For checkv2 we insert symbols as a separate object */
-		ucl_object_insert_key (top, obj, "symbols", 0, false);
-	}
-	else {
-		/* For legacy check we just insert it as "default" all together */
-		ucl_object_insert_key (top, obj, DEFAULT_METRIC, 0, false);
+		kh_foreach_value (mres->symbols, sym, {
+			if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+				sobj = rspamd_metric_symbol_ucl (task, sym);
+				ucl_object_insert_key (obj, sobj, sym->name, 0, false);
+			}
+		})
+
+		if (task->cmd != CMD_CHECK) {
+			/* For checkv2 we insert symbols as a separate object */
+			ucl_object_insert_key (top, obj, "symbols", 0, false);
+		}
+		else {
+			/* For legacy check we just insert it as "default" all together */
+			ucl_object_insert_key (top, obj, DEFAULT_METRIC, 0, false);
+		}
 	}
 
 	/* Handle groups if needed */
@@ -1430,7 +1692,8 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 			(rspamd_mempool_destruct_t)ucl_object_unref, top);
 
 	if (flags & RSPAMD_PROTOCOL_METRICS) {
-		rspamd_scan_result_ucl (task, task->result, top);
+		rspamd_scan_result_ucl (task, task->result, top,
+				!(flags & RSPAMD_PROTOCOL_NO_SYMBOLS));
 	}
 
 	if (flags & RSPAMD_PROTOCOL_MESSAGES) {
@@ -1470,6 +1733,11 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 		if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
 			rspamd_protocol_output_profiling (task, top);
 		}
+
+		if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_RESOURCES) {
+			ucl_object_insert_key (top, rspamd_task_resources_to_ucl (task),
+					"resources", 0, false);
+		}
 	}
 
 	if (flags & RSPAMD_PROTOCOL_BASIC) {
@@ -1561,6 +1829,87 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	return top;
 }
 
+/*
+ * Writes checkv2 JSON reply: symbols and urls are written directly and the
+ * rest of the reply (including Lua provided messages) is emitted from `top`
+ */
+static void
+rspamd_protocol_write_json_reply (struct rspamd_task *task,
+		const ucl_object_t *top, rspamd_fstring_t **out)
+{
+	rspamd_fstring_t *rest;
+
+	*out = rspamd_fstring_append (*out, "{", 1);
+	rspamd_protocol_symbols_json (task, task->result, out);
+
+	if (task->message && kh_size (MESSAGE_FIELD (task, urls)) > 0) {
+		*out = rspamd_fstring_append (*out, ",\"urls\":",
+				sizeof (",\"urls\":") - 1);
+		rspamd_urls_tree_json (MESSAGE_FIELD (task, urls), task, out);
+		*out = rspamd_fstring_append (*out, ",\"emails\":",
+				sizeof (",\"emails\":") - 1);
+		rspamd_emails_tree_json (MESSAGE_FIELD (task, urls), task, out);
+	}
+
+	rest = rspamd_fstring_sized_new (512);
+	rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &rest);
+
+	if (rest->len > 2 && rest->str[0] == '{') {
+		/* Merge with the remaining object skipping its opening brace */
+		*out = rspamd_fstring_append (*out, ",", 1);
+		*out = rspamd_fstring_append (*out, rest->str + 1, rest->len - 1);
+	}
+	else {
+		*out = rspamd_fstring_append (*out, "}", 1);
+	}
+
+	rspamd_fstring_free (rest);
+}
+
+/*
+ * Reply is compressed with the configured output dictionary, or with the
+ * dictionary that the client has used for a request, as it is known to
+ * both sides
+ */
+static struct zstd_dictionary *
+rspamd_protocol_reply_dictionary (struct rspamd_task *task)
+{
+	const rspamd_ftok_t *tok;
+	gulong dict_id;
+
+	if (task->cfg->libs_ctx->out_dict) {
+		return task->cfg->libs_ctx->out_dict;
+	}
+
+	tok = rspamd_task_get_request_header (task, "dictionary");
+
+	if (tok != NULL && rspamd_strtoul (tok->begin, tok->len, &dict_id)) {
+		return rspamd_libs_find_zstd_dictionary (task->cfg->libs_ctx, dict_id);
+	}
+
+	return NULL;
+}
+
+static inline gboolean
+rspamd_protocol_reply_is_msgpack (struct rspamd_http_message *msg,
+		struct rspamd_task *task)
+{
+	/* Legacy replies are always textual */
+	return (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MSGPACK) &&
+			msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task);
+}
+
+const gchar *
+rspamd_protocol_reply_content_type (struct rspamd_http_message *msg,
+		struct rspamd_task *task)
+{
+	if (rspamd_protocol_reply_is_msgpack (msg, task)) {
+		return MSGPACK_CONTENT_TYPE;
+	}
+
+	return "application/json";
+}
+
 void
 rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		struct rspamd_task *task, ucl_object_t **pobj)
@@ -1570,8 +1919,13 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 
 	ucl_object_t *top = NULL;
 	rspamd_fstring_t *reply;
+	const gchar *body_block = NULL;
+	gsize body_block_len = 0;
+	gboolean compressed = FALSE;
+	struct zstd_dictionary *out_dict = NULL;
 	gint flags = RSPAMD_PROTOCOL_DEFAULT;
 	struct rspamd_action *action;
+	gboolean write_json, write_msgpack;
 
 	/* Removed in 2.0 */
 #if 0
@@ -1586,7 +1940,20 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	}
 #endif
 
-	flags |= RSPAMD_PROTOCOL_URLS;
+	/*
+	 * If nobody needs the reply object, then we write symbols and urls of
+	 * checkv2 reply directly to the output without building ucl for them
+	 */
+	write_msgpack = rspamd_protocol_reply_is_msgpack (msg, task);
+	write_json = pobj == NULL && task->cmd == CMD_CHECK_V2 && !write_msgpack &&
+			msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task);
+
+	if (write_json) {
+		flags |= RSPAMD_PROTOCOL_NO_SYMBOLS;
+	}
+	else {
+		flags |= RSPAMD_PROTOCOL_URLS;
+	}
 
 	top = rspamd_protocol_write_ucl (task, flags);
 
@@ -1602,25 +1969,37 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	}
 
 	rspamd_task_write_log (task);
+	rspamd_task_write_structured_log (task);
 
 	if (task->cfg->log_flags & RSPAMD_LOG_FLAG_RE_CACHE) {
 		restat = rspamd_re_cache_get_stat (task->re_rt);
 		g_assert (restat != NULL);
 		msg_notice_task (
 				"regexp statistics: %ud pcre regexps scanned, %ud regexps matched,"
-				" %ud regexps total, %ud regexps cached,"
-				" %HL scanned using pcre, %HL scanned total",
+				" %ud regexps total, %ud regexps cached, %ud regexps skipped,"
+				" %HL scanned using pcre, %HL scanned total,"
+				" %uL microseconds spent in pcre",
 				restat->regexp_checked,
 				restat->regexp_matched,
 				restat->regexp_total,
 				restat->regexp_fast_cached,
+				restat->regexp_skipped,
 				restat->bytes_scanned_pcre,
-				restat->bytes_scanned);
+				restat->bytes_scanned,
+				restat->pcre_time_us);
 	}
 
 	reply = rspamd_fstring_sized_new (1000);
 
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+	if (write_json) {
+		msg_debug_protocol ("writing json reply");
+		rspamd_protocol_write_json_reply (task, top, &reply);
+	}
+	else if (write_msgpack) {
+		msg_debug_protocol ("writing msgpack reply");
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_MSGPACK, &reply);
+	}
+	else if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
 		msg_debug_protocol ("writing json reply");
 		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
 	}
@@ -1680,80 +2059,109 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 
 					msg_debug_protocol ("milter version of body block size %d",
 							(int)len);
-					reply = rspamd_fstring_append (reply, start, len);
+					body_block = start;
+					body_block_len = len;
 				}
 			}
 			else {
 				msg_debug_protocol ("general version of body block size %d",
 						(int)task->msg.len);
-				reply = rspamd_fstring_append (reply,
-						task->msg.begin, task->msg.len);
+				body_block = task->msg.begin;
+				body_block_len = task->msg.len;
 			}
 		}
 	}
 
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED) {
+		out_dict = rspamd_protocol_reply_dictionary (task);
+	}
+
 	if ((task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED) &&
-			rspamd_libs_reset_compression (task->cfg->libs_ctx)) {
+			rspamd_libs_reset_compression (task->cfg->libs_ctx, out_dict)) {
 		/* We can compress output */
 		ZSTD_inBuffer zin;
 		ZSTD_outBuffer zout;
 		ZSTD_CStream *zstream;
 		rspamd_fstring_t *compressed_reply;
-		gsize r;
+		/* Reply and body block are compressed as a single stream */
+		const gchar *inputs[] = {reply->str, body_block};
+		gsize input_lens[] = {reply->len, body_block_len};
+		gsize r, total_in = reply->len + body_block_len;
+		guint i;
 
 		zstream = task->cfg->libs_ctx->out_zstream;
-		compressed_reply = rspamd_fstring_sized_new (ZSTD_compressBound (reply->len));
-		zin.pos = 0;
-		zin.src = reply->str;
-		zin.size = reply->len;
+		compressed_reply = rspamd_fstring_sized_new (ZSTD_compressBound (total_in));
 		zout.pos = 0;
 		zout.dst = compressed_reply->str;
 		zout.size = compressed_reply->allocated;
+		compressed = TRUE;
 
-		while (zin.pos < zin.size) {
-			r = ZSTD_compressStream (zstream, &zout, &zin);
+		for (i = 0; i < G_N_ELEMENTS (inputs) && compressed; i ++) {
+			zin.pos = 0;
+			zin.src = inputs[i];
+			zin.size = input_lens[i];
 
-			if (ZSTD_isError (r)) {
-				msg_err_protocol ("cannot compress: %s", ZSTD_getErrorName (r));
-				rspamd_fstring_free (compressed_reply);
-				rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+			while (zin.pos < zin.size) {
+				r = ZSTD_compressStream (zstream, &zout, &zin);
 
-				goto end;
+				if (ZSTD_isError (r)) {
+					msg_err_protocol ("cannot compress: %s", ZSTD_getErrorName (r));
+					compressed = FALSE;
+					break;
+				}
 			}
 		}
 
-		ZSTD_flushStream (zstream, &zout);
-		r = ZSTD_endStream (zstream, &zout);
-
-		if (ZSTD_isError (r)) {
-			msg_err_protocol ("cannot finalize compress: %s", ZSTD_getErrorName (r));
-			rspamd_fstring_free (compressed_reply);
-			rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+		if (compressed) {
+			ZSTD_flushStream (zstream, &zout);
+			r = ZSTD_endStream (zstream, &zout);
 
-			goto end;
+			if (ZSTD_isError (r)) {
+				msg_err_protocol ("cannot finalize compress: %s",
+						ZSTD_getErrorName (r));
+				compressed = FALSE;
+			}
 		}
 
-		msg_info_protocol ("writing compressed results: %z bytes before "
-				"%z bytes after", zin.pos, zout.pos);
-		compressed_reply->len = zout.pos;
-		rspamd_fstring_free (reply);
-		rspamd_http_message_set_body_from_fstring_steal (msg, compressed_reply);
-		rspamd_http_message_add_header (msg, COMPRESSION_HEADER, "zstd");
+		if (compressed) {
+			msg_info_protocol ("writing compressed results: %z bytes before "
+					"%z bytes after", total_in, zout.pos);
+			compressed_reply->len = zout.pos;
+			rspamd_fstring_free (reply);
+			rspamd_http_message_set_body_from_fstring_steal (msg, compressed_reply);
+			rspamd_http_message_add_header (msg, COMPRESSION_HEADER, "zstd");
 
-		if (task->cfg->libs_ctx->out_dict &&
-				task->cfg->libs_ctx->out_dict->id != 0) {
-			gchar dict_str[32];
+			if (out_dict) {
+				gchar dict_str[32];
 
-			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
-					task->cfg->libs_ctx->out_dict->id);
-			rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+				rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
+						out_dict->id);
+				rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+			}
+		}
+		else {
+			rspamd_fstring_free (compressed_reply);
 		}
 	}
-	else {
-		rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+
+	if (!compressed) {
+		if (body_block_len > 0 && task->http_conn != NULL) {
+			/*
+			 * Task owns the connection, so it outlives the reply, and the
+			 * message itself can be written without copying
+			 */
+			rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+			rspamd_http_message_set_body_tail (msg, body_block, body_block_len);
+		}
+		else {
+			if (body_block_len > 0) {
+				reply = rspamd_fstring_append (reply, body_block, body_block_len);
+			}
+
+			rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+		}
 	}
 
-end:
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_STAT)) {
 		/* Update stat for default metric */
 
@@ -2076,6 +2484,7 @@ rspamd_protocol_write_reply (struct rspamd_task *task, ev_tstamp timeout)
 		case CMD_CHECK_V2:
 			rspamd_protocol_http_reply (msg, task, NULL);
 			rspamd_protocol_write_log_pipe (task);
+			ctype = rspamd_protocol_reply_content_type (msg, task);
 			break;
 		case CMD_PING:
 			msg_debug_protocol ("writing pong to client");
@@ -2090,6 +2499,7 @@ rspamd_protocol_write_reply (struct rspamd_task *task, ev_tstamp timeout)
 
 	ev_now_update (task->event_loop);
 	msg->date = ev_time ();
+	task->times.reply_start = msg->date;
 
 	rspamd_http_connection_reset (task->http_conn);
 	rspamd_http_connection_write_message (task->http_conn, msg, NULL,
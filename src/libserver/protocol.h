@@ -46,6 +46,25 @@ struct rspamd_metric;
 gboolean rspamd_protocol_handle_headers (struct rspamd_task *task,
 										 struct rspamd_http_message *msg);
 
+/**
+ * Process a single request header and set appropriate task fields, it allows
+ * to fill a task without building of HTTP message
+ * @param task
+ * @param name
+ * @param nlen
+ * @param value
+ * @param vlen
+ */
+void rspamd_protocol_handle_header (struct rspamd_task *task,
+									const gchar *name, gsize nlen,
+									const gchar *value, gsize vlen);
+
+/**
+ * Finish processing of headers passed via `rspamd_protocol_handle_header`
+ * @param task
+ */
+void rspamd_protocol_handle_headers_done (struct rspamd_task *task);
+
 /**
  * Process control chunk and update task structure accordingly
  * @param task
@@ -86,6 +105,7 @@ enum rspamd_protocol_flags {
 	RSPAMD_PROTOCOL_DKIM = 1 << 4,
 	RSPAMD_PROTOCOL_URLS = 1 << 5,
 	RSPAMD_PROTOCOL_EXTRA = 1 << 6,
+	RSPAMD_PROTOCOL_NO_SYMBOLS = 1 << 7, /* symbols are written by caller (checkv2 only) */
 };
 
 #define RSPAMD_PROTOCOL_DEFAULT (RSPAMD_PROTOCOL_BASIC| \
@@ -104,6 +124,15 @@ enum rspamd_protocol_flags {
 ucl_object_t *rspamd_protocol_write_ucl (struct rspamd_task *task,
 										 enum rspamd_protocol_flags flags);
 
+/**
+ * Returns content type of the scan reply for a task
+ * @param msg reply message
+ * @param task task object
+ * @return "application/msgpack" if the client accepts it and "application/json" otherwise
+ */
+const gchar *rspamd_protocol_reply_content_type (struct rspamd_http_message *msg,
+		struct rspamd_task *task);
+
 /**
  * Write reply for specified task command
  * @param task task object
@@ -91,6 +91,11 @@ extern "C" {
 #define RAW_DATA_HEADER "Raw"
 #define COMPRESSION_HEADER "Compression"
 #define MESSAGE_OFFSET_HEADER "Message-Offset"
+#define ACCEPT_HEADER "Accept"
+/*
+ * Binary (msgpack) reply is sent if requested via the Accept header
+ */
+#define MSGPACK_CONTENT_TYPE "application/msgpack"
 
 #ifdef  __cplusplus
 }
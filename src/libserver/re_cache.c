@@ -25,6 +25,7 @@
 #include "lua/lua_common.h"
 #include "libstat/stat_api.h"
 #include "contrib/uthash/utlist.h"
+#include "libutil/multipattern.h"
 
 #include "khash.h"
 
@@ -76,8 +77,8 @@ INIT_LOG_MODULE(re_cache)
 
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof (rspamd_hs_magic))
-static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
-		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
+static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '2'},
+		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '2'};
 #endif
 
 
@@ -88,15 +89,21 @@ struct rspamd_re_class {
 	gpointer type_data;
 	gsize type_len;
 	GHashTable *re;
+	/* Global ids of expressions ordered by their hash */
+	GArray *ids;
 	rspamd_cryptobox_hash_state_t *st;
 
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
+	/* Size of the shared mapping of `hs_db`, 0 if it is private */
+	gsize hs_db_maplen;
 	hs_scratch_t *hs_scratch;
 	gint *hs_ids;
 	guint nhs;
+	/* Class whose database includes expressions of this class */
+	struct rspamd_re_class *merged;
 #endif
 };
 
@@ -106,10 +113,31 @@ enum rspamd_re_cache_elt_match_type {
 	RSPAMD_RE_CACHE_HYPERSCAN_PRE
 };
 
+/*
+ * Execution counters of a regexp, they live in shared memory to be
+ * updated by all workers and reported by the controller
+ */
+struct rspamd_re_cache_elt_stat {
+	guint64 checked;
+	guint64 matched;
+	guint64 skipped;
+	guint64 time_us;
+};
+
+/* Average pcre time (in microseconds) for a regexp to be considered expensive */
+#define RSPAMD_RE_EXPENSIVE_TIME 100
+/* Number of executions required to trust the average time */
+#define RSPAMD_RE_EXPENSIVE_MIN_CHECKS 10
+
 struct rspamd_re_cache_elt {
 	rspamd_regexp_t *re;
 	gint lua_cbref;
 	enum rspamd_re_cache_elt_match_type match_type;
+	/* Literal required for a match, PCRE is not called if it is absent */
+	gchar *literal;
+	guint literal_len;
+	gboolean literal_icase;
+	struct rspamd_re_cache_elt_stat *stat;
 };
 
 KHASH_INIT (lua_selectors_hash, gchar *, int, 1, kh_str_hash_func, kh_str_hash_equal);
@@ -122,12 +150,16 @@ struct rspamd_re_cache {
 	ref_entry_t ref;
 	guint nre;
 	guint max_re_data;
+	gdouble time_budget;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	lua_State *L;
 #ifdef WITH_HYPERSCAN
 	enum rspamd_hyperscan_status hyperscan_loaded;
 	gboolean disable_hyperscan;
 	gboolean vectorized_hyperscan;
+	/* Pseudo class with all header expressions and their header names */
+	struct rspamd_re_class *merged_headers;
+	GHashTable *merged_headers_names;
 	hs_platform_info_t plt;
 #endif
 };
@@ -141,15 +173,71 @@ struct rspamd_re_selector_result {
 KHASH_INIT (selectors_results_hash, int, struct rspamd_re_selector_result, 1,
 		kh_int_hash_func, kh_int_hash_equal);
 
+/*
+ * All headers of a message with the same name (case insensitive), in the
+ * message order, with values prepared to be scanned by header classes
+ */
+struct rspamd_re_header_entry {
+	struct rspamd_mime_header **hdrs;
+	const guchar **raw;
+	guint *raw_len;
+	guint cnt;
+	/* Headers with decoded values only */
+	struct rspamd_mime_header **dec_hdrs;
+	const guchar **decoded;
+	guint *decoded_len;
+	guint ndecoded;
+	/* -1 if not checked yet, 1 if some raw value is not valid utf8 */
+	gint raw_invalid;
+	/* The same for decoded values */
+	gint decoded_invalid;
+};
+
+KHASH_INIT (headers_index_hash, const gchar *, struct rspamd_re_header_entry, 1,
+		rspamd_strcase_hash, rspamd_strcase_equal);
+
 struct rspamd_re_runtime {
 	guchar *checked;
 	guchar *results;
+	/* Prefilter matched, but PCRE has not been called yet */
+	guchar *prefiltered;
 	khash_t (selectors_results_hash) *sel_cache;
+	/* Built on the first header lookup and shared by all header classes */
+	khash_t (headers_index_hash) *hdr_index;
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_cache_stat stat;
 	gboolean has_hs;
+	gboolean merged_headers_done;
+	/* Some header is not valid utf8, so header classes are checked by PCRE */
+	gboolean merged_headers_invalid;
+	gboolean budget_exhausted;
 };
 
+#ifdef WITH_HYPERSCAN
+static inline guint
+rspamd_re_cache_class_hs_mode (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class)
+{
+	if (re_class && re_class == cache->merged_headers) {
+		/* Merged database is always scanned header by header */
+		return HS_MODE_BLOCK;
+	}
+
+	return cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK;
+}
+
+static inline const guchar *
+rspamd_re_cache_class_hs_magic (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class)
+{
+	if (re_class == cache->merged_headers) {
+		return rspamd_hs_magic;
+	}
+
+	return cache->vectorized_hyperscan ? rspamd_hs_magic_vector : rspamd_hs_magic;
+}
+#endif
+
 static GQuark
 rspamd_re_cache_quark (void)
 {
@@ -190,13 +278,18 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 		g_hash_table_iter_steal (&it);
 		g_hash_table_unref (re_class->re);
 
+		if (re_class->ids) {
+			g_array_free (re_class->ids, TRUE);
+		}
+
 		if (re_class->type_data) {
 			g_free (re_class->type_data);
 		}
 
 #ifdef WITH_HYPERSCAN
 		if (re_class->hs_db) {
-			hs_free_database (re_class->hs_db);
+			rspamd_hyperscan_free_shared (re_class->hs_db,
+					re_class->hs_db_maplen);
 		}
 		if (re_class->hs_scratch) {
 			hs_free_scratch (re_class->hs_scratch);
@@ -226,6 +319,12 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 
 	kh_destroy (lua_selectors_hash, cache->selectors);
 
+#ifdef WITH_HYPERSCAN
+	if (cache->merged_headers_names) {
+		g_hash_table_unref (cache->merged_headers_names);
+	}
+#endif
+
 	g_hash_table_unref (cache->re_classes);
 	g_ptr_array_free (cache->re, TRUE);
 	g_free (cache);
@@ -237,6 +336,7 @@ rspamd_re_cache_elt_dtor (gpointer e)
 	struct rspamd_re_cache_elt *elt = e;
 
 	rspamd_regexp_unref (elt->re);
+	g_free (elt->literal);
 	g_free (elt);
 }
 
@@ -380,6 +480,319 @@ rspamd_re_cache_sort_func (gconstpointer a, gconstpointer b)
 			rspamd_regexp_get_id ((*re2)->re));
 }
 
+/* Shorter literals are not selective enough to be worth checking */
+#define RSPAMD_RE_MIN_LITERAL 3
+
+static inline void
+rspamd_re_cache_literal_flush (GString *cur, GString *best)
+{
+	if (cur->len > best->len) {
+		g_string_assign (best, cur->str);
+	}
+
+	g_string_truncate (cur, 0);
+}
+
+/*
+ * Skips group or character class starting at `p`, returns pointer after it
+ */
+static const gchar *
+rspamd_re_cache_literal_skip (const gchar *p, const gchar *end)
+{
+	gint depth = 0;
+	gboolean in_class = FALSE;
+
+	while (p < end) {
+		if (*p == '\\') {
+			p += 2;
+			continue;
+		}
+
+		if (in_class) {
+			if (*p == ']') {
+				in_class = FALSE;
+
+				if (depth == 0) {
+					return p + 1;
+				}
+			}
+		}
+		else if (*p == '[') {
+			in_class = TRUE;
+
+			/* Leading `]` or `^]` is a part of the class */
+			if (p + 1 < end && p[1] == '^') {
+				p ++;
+			}
+			if (p + 1 < end && p[1] == ']') {
+				p ++;
+			}
+		}
+		else if (*p == '(') {
+			depth ++;
+		}
+		else if (*p == ')') {
+			if (--depth == 0) {
+				return p + 1;
+			}
+		}
+
+		p ++;
+	}
+
+	return end;
+}
+
+/*
+ * Extracts the longest literal that must be present in any match of `re`
+ * considering only the top level of the pattern. Returns NULL if there is
+ * no such literal or if the pattern is too complex to be sure about it.
+ */
+static gchar *
+rspamd_re_cache_extract_literal (rspamd_regexp_t *re, guint *plen,
+		gboolean *picase)
+{
+	const gchar *p, *end, *pat;
+	GString *cur, *best;
+	gint pcre_flags, depth = 0;
+	gboolean icase;
+	gchar ch, *ret = NULL;
+
+	pat = rspamd_regexp_get_pattern (re);
+	end = pat + strlen (pat);
+	pcre_flags = rspamd_regexp_get_pcre_flags (re);
+	icase = !!(pcre_flags & PCRE_FLAG(CASELESS));
+
+	if (pcre_flags & PCRE_FLAG(EXTENDED)) {
+		return NULL;
+	}
+
+	/* Top level alternation and inline options */
+	for (p = pat; p < end; p ++) {
+		if (*p == '\\') {
+			p ++;
+		}
+		else if (*p == '[') {
+			p = rspamd_re_cache_literal_skip (p, end) - 1;
+		}
+		else if (*p == '(') {
+			depth ++;
+
+			if (p + 1 < end && p[1] == '?') {
+				const gchar *opt = p + 2;
+
+				while (opt < end && (g_ascii_isalpha (*opt) || *opt == '-')) {
+					if (*opt == 'x') {
+						return NULL;
+					}
+					else if (*opt == 'i') {
+						/* Caseless search is a superset anyway */
+						icase = TRUE;
+					}
+
+					opt ++;
+				}
+			}
+		}
+		else if (*p == ')') {
+			depth --;
+		}
+		else if (*p == '|' && depth == 0) {
+			return NULL;
+		}
+	}
+
+	cur = g_string_sized_new (16);
+	best = g_string_sized_new (16);
+	p = pat;
+
+	while (p < end) {
+		switch (*p) {
+		case '\\':
+			if (p + 1 >= end) {
+				goto out;
+			}
+
+			if (!g_ascii_isalnum (p[1])) {
+				/* Escaped punctuation is a literal */
+				ch = p[1];
+				p += 2;
+				goto literal;
+			}
+
+			if (strchr ("dDwWsSbBAzZGhHvVRnrtfeaK", p[1]) == NULL) {
+				/* Hex, octal, properties, quoting, back references */
+				g_string_truncate (best, 0);
+				goto out;
+			}
+
+			rspamd_re_cache_literal_flush (cur, best);
+			p += 2;
+			continue;
+		case '[':
+		case '(':
+			rspamd_re_cache_literal_flush (cur, best);
+			p = rspamd_re_cache_literal_skip (p, end);
+			continue;
+		case '{': {
+			const gchar *q = p + 1;
+
+			while (q < end && (g_ascii_isdigit (*q) || *q == ',')) {
+				q ++;
+			}
+
+			rspamd_re_cache_literal_flush (cur, best);
+			/* Skip quantifier, otherwise it is just a brace */
+			p = (q < end && *q == '}' && q > p + 1) ? q + 1 : p + 1;
+			continue;
+		}
+		case '.':
+		case '^':
+		case '$':
+		case '*':
+		case '+':
+		case '?':
+		case ')':
+			rspamd_re_cache_literal_flush (cur, best);
+			p ++;
+			continue;
+		default:
+			ch = *p;
+			p ++;
+			break;
+		}
+
+literal:
+		if (p < end && (*p == '?' || *p == '*' ||
+				(*p == '{' && p + 1 < end && (p[1] == '0' || p[1] == ',')))) {
+			/* Optional character */
+			rspamd_re_cache_literal_flush (cur, best);
+		}
+		else if (p < end && (*p == '+' || *p == '{')) {
+			g_string_append_c (cur, ch);
+			rspamd_re_cache_literal_flush (cur, best);
+		}
+		else {
+			g_string_append_c (cur, ch);
+		}
+	}
+
+	rspamd_re_cache_literal_flush (cur, best);
+
+out:
+	if (best->len >= RSPAMD_RE_MIN_LITERAL) {
+		gboolean ascii = TRUE;
+
+		for (gsize i = 0; i < best->len; i ++) {
+			if ((guchar)best->str[i] >= 0x80) {
+				ascii = FALSE;
+				break;
+			}
+		}
+
+		/*
+		 * Caseless matching of non ascii symbols depends on pcre tables,
+		 * in utf mode `k` and `s` also match some non ascii symbols
+		 */
+		if (icase && (rspamd_regexp_get_flags (re) & RSPAMD_REGEXP_FLAG_UTF) &&
+				strpbrk (best->str, "kKsS") != NULL) {
+			ascii = FALSE;
+		}
+
+		if (ascii || !icase) {
+			*plen = best->len;
+			*picase = icase;
+			ret = g_string_free (best, FALSE);
+			best = NULL;
+		}
+	}
+
+	if (best) {
+		g_string_free (best, TRUE);
+	}
+
+	g_string_free (cur, TRUE);
+
+	return ret;
+}
+
+#ifdef WITH_HYPERSCAN
+static struct rspamd_re_class *
+rspamd_re_cache_merged_headers_new (struct rspamd_re_cache *cache)
+{
+	struct rspamd_re_class *re_class;
+	static const gchar merged_tag[] = "*merged*";
+
+	re_class = g_malloc0 (sizeof (*re_class));
+	re_class->id = rspamd_re_cache_class_id (RSPAMD_RE_HEADER, merged_tag,
+			sizeof (merged_tag));
+	re_class->type = RSPAMD_RE_HEADER;
+	re_class->re = g_hash_table_new_full (rspamd_regexp_hash,
+			rspamd_regexp_equal, NULL, (GDestroyNotify)rspamd_regexp_unref);
+	g_hash_table_insert (cache->re_classes, &re_class->id, re_class);
+	cache->merged_headers_names = g_hash_table_new (rspamd_strcase_hash,
+			rspamd_strcase_equal);
+
+	return re_class;
+}
+
+/*
+ * Adds expression from a header class to the merged database, the class
+ * itself is not compiled then
+ */
+static void
+rspamd_re_cache_merged_headers_add (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		rspamd_regexp_t *re,
+		gint id)
+{
+	struct rspamd_re_class *merged = cache->merged_headers;
+	guint fl;
+
+	if (merged->st == NULL) {
+		(void) !posix_memalign ((void **)&merged->st,
+				_Alignof (rspamd_cryptobox_hash_state_t),
+				sizeof (*merged->st));
+		g_assert (merged->st != NULL);
+		rspamd_cryptobox_hash_init (merged->st, NULL, 0);
+	}
+
+	/* Same as class hash but for all header classes */
+	rspamd_cryptobox_hash_update (merged->st, (gpointer) &re_class->id,
+			sizeof (re_class->id));
+	rspamd_cryptobox_hash_update (merged->st, rspamd_regexp_get_id (re),
+			rspamd_cryptobox_HASHBYTES);
+	fl = rspamd_regexp_get_pcre_flags (re);
+	rspamd_cryptobox_hash_update (merged->st, (const guchar *)&fl, sizeof (fl));
+	fl = rspamd_regexp_get_flags (re);
+	rspamd_cryptobox_hash_update (merged->st, (const guchar *)&fl, sizeof (fl));
+	fl = rspamd_regexp_get_maxhits (re);
+	rspamd_cryptobox_hash_update (merged->st, (const guchar *)&fl, sizeof (fl));
+
+	if (g_hash_table_lookup (merged->re, rspamd_regexp_get_id (re)) == NULL) {
+		g_hash_table_insert (merged->re, rspamd_regexp_get_id (re),
+				rspamd_regexp_ref (re));
+
+		if (merged->ids == NULL) {
+			merged->ids = g_array_new (FALSE, FALSE, sizeof (gint));
+		}
+
+		g_array_append_val (merged->ids, id);
+	}
+
+	if (re_class->has_utf8) {
+		merged->has_utf8 = TRUE;
+	}
+
+	if (re_class->merged == NULL && re_class->type_data) {
+		g_hash_table_insert (cache->merged_headers_names, re_class->type_data,
+				re_class);
+	}
+
+	re_class->merged = merged;
+}
+#endif
+
 void
 rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 {
@@ -398,6 +811,17 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 	/* Resort all regexps */
 	g_ptr_array_sort (cache->re, rspamd_re_cache_sort_func);
 
+	if (cfg->regexp_time_budget > 0) {
+		cache->time_budget = cfg->regexp_time_budget;
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (cfg->merged_hyperscan_headers && !cfg->disable_hyperscan &&
+			cache->merged_headers == NULL) {
+		cache->merged_headers = rspamd_re_cache_merged_headers_new (cache);
+	}
+#endif
+
 	for (i = 0; i < cache->re->len; i ++) {
 		elt = g_ptr_array_index (cache->re, i);
 		re = elt->re;
@@ -405,6 +829,16 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 		g_assert (re_class != NULL);
 		rspamd_regexp_set_cache_id (re, i);
 
+		if (elt->literal == NULL) {
+			elt->literal = rspamd_re_cache_extract_literal (re,
+					&elt->literal_len, &elt->literal_icase);
+		}
+
+		if (elt->stat == NULL) {
+			elt->stat = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+					sizeof (*elt->stat));
+		}
+
 		if (re_class->st == NULL) {
 			(void) !posix_memalign ((void **)&re_class->st, _Alignof (rspamd_cryptobox_hash_state_t),
 			 		sizeof (*re_class->st));
@@ -441,17 +875,46 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 				sizeof (fl));
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *) &fl,
 				sizeof (fl));
-		/* Numberic order */
-		rspamd_cryptobox_hash_update (re_class->st, (const guchar *)&i,
-				sizeof (i));
+		/*
+		 * Numeric order is used for the global hash only: classes refer
+		 * to their expressions by position in `ids`, so a class hash
+		 * is not changed when expressions are added to other classes
+		 */
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *)&i,
 				sizeof (i));
+
+		if (re_class->ids == NULL) {
+			re_class->ids = g_array_new (FALSE, FALSE, sizeof (gint));
+		}
+
+		g_array_append_val (re_class->ids, i);
+
+#ifdef WITH_HYPERSCAN
+		if (cache->merged_headers && re_class->type == RSPAMD_RE_HEADER) {
+			rspamd_re_cache_merged_headers_add (cache, re_class, re, i);
+		}
+#endif
 	}
 
 	rspamd_cryptobox_hash_final (&st_global, hash_out);
 	rspamd_snprintf (cache->hash, sizeof (cache->hash), "%*xs",
 			(gint) rspamd_cryptobox_HASHBYTES, hash_out);
 
+#ifdef WITH_HYPERSCAN
+	if (cache->merged_headers && cache->merged_headers->st == NULL) {
+		/* No header regexps at all, so nothing to merge */
+		g_hash_table_remove (cache->re_classes, &cache->merged_headers->id);
+		g_hash_table_unref (cache->merged_headers->re);
+
+		if (cache->merged_headers->ids) {
+			g_array_free (cache->merged_headers->ids, TRUE);
+		}
+
+		g_free (cache->merged_headers);
+		cache->merged_headers = NULL;
+	}
+#endif
+
 	/* Now finalize all classes */
 	g_hash_table_iter_init (&it, cache->re_classes);
 
@@ -459,14 +922,6 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 		re_class = v;
 
 		if (re_class->st) {
-			/*
-			 * We finally update all classes with the number of expressions
-			 * in the cache to ensure that if even a single re has been changed
-			 * we won't be broken due to id mismatch
-			 */
-			rspamd_cryptobox_hash_update (re_class->st,
-					(gpointer)&cache->re->len,
-					sizeof (cache->re->len));
 			rspamd_cryptobox_hash_final (re_class->st, hash_out);
 			rspamd_snprintf (re_class->hash, sizeof (re_class->hash), "%*xs",
 					(gint) rspamd_cryptobox_HASHBYTES, hash_out);
@@ -523,11 +978,12 @@ rspamd_re_cache_runtime_new (struct rspamd_re_cache *cache)
 	struct rspamd_re_runtime *rt;
 	g_assert (cache != NULL);
 
-	rt = g_malloc0 (sizeof (*rt) + NBYTES (cache->nre) + cache->nre);
+	rt = g_malloc0 (sizeof (*rt) + NBYTES (cache->nre) * 2 + cache->nre);
 	rt->cache = cache;
 	REF_RETAIN (cache);
 	rt->checked = ((guchar *)rt) + sizeof (*rt);
 	rt->results = rt->checked + NBYTES (cache->nre);
+	rt->prefiltered = rt->results + cache->nre;
 	rt->stat.regexp_total = cache->nre;
 #ifdef WITH_HYPERSCAN
 	rt->has_hs = cache->hyperscan_loaded;
@@ -581,6 +1037,22 @@ rspamd_re_cache_check_lua_condition (struct rspamd_task *task,
 	return res;
 }
 
+static inline gboolean
+rspamd_re_cache_elt_is_expensive (struct rspamd_re_cache_elt *elt)
+{
+	guint64 checked, time_us;
+
+	if (elt->stat == NULL) {
+		return FALSE;
+	}
+
+	checked = __atomic_load_n (&elt->stat->checked, __ATOMIC_RELAXED);
+	time_us = __atomic_load_n (&elt->stat->time_us, __ATOMIC_RELAXED);
+
+	return checked >= RSPAMD_RE_EXPENSIVE_MIN_CHECKS &&
+			time_us / checked >= RSPAMD_RE_EXPENSIVE_TIME;
+}
+
 static guint
 rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 		rspamd_regexp_t *re, struct rspamd_task *task,
@@ -592,8 +1064,10 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 	const gchar *start = NULL, *end = NULL;
 	guint max_hits = rspamd_regexp_get_maxhits (re);
 	guint64 id = rspamd_regexp_get_cache_id (re);
-	gdouble t1 = NAN, t2, pr;
-	const gdouble slow_time = 1e8;
+	gdouble t1, t2;
+	guint64 elapsed_us;
+	const gdouble slow_time = 0.05;
+	struct rspamd_re_cache_elt *elt;
 
 	if (in == NULL) {
 		return rt->results[id];
@@ -608,14 +1082,51 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 	}
 
 	r = rt->results[id];
+	elt = g_ptr_array_index (rt->cache->re, id);
+
+	if (elt->literal) {
+		goffset pos;
+
+		if (elt->literal_icase) {
+			pos = rspamd_substring_search_caseless (in, len,
+					elt->literal, elt->literal_len);
+		}
+		else {
+			pos = rspamd_substring_search (in, len,
+					elt->literal, elt->literal_len);
+		}
+
+		if (pos == -1) {
+			/* Regexp cannot match without its literal */
+			rt->stat.bytes_scanned += len;
+
+			return r;
+		}
+	}
 
 	if (max_hits == 0 || r < max_hits) {
-		pr = rspamd_random_double_fast ();
+		if (rt->cache->time_budget > 0 &&
+				rt->stat.pcre_time_us > rt->cache->time_budget * 1e6 &&
+				rspamd_re_cache_elt_is_expensive (elt)) {
+			if (!rt->budget_exhausted) {
+				rt->budget_exhausted = TRUE;
+				msg_info_task ("regexp time budget of %.3f seconds is exhausted, "
+						"skip expensive regexps", rt->cache->time_budget);
+			}
 
-		if (pr > 0.9) {
-			t1 = rspamd_get_ticks (TRUE);
+			msg_debug_re_task ("skip expensive regexp /%s/",
+					rspamd_regexp_get_pattern (re));
+			rt->stat.regexp_skipped++;
+
+			if (elt->stat) {
+				__atomic_add_fetch (&elt->stat->skipped, 1, __ATOMIC_RELAXED);
+			}
+
+			return r;
 		}
 
+		t1 = rspamd_get_ticks (FALSE);
+
 		while (rspamd_regexp_search (re,
 				in,
 				len,
@@ -644,15 +1155,25 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 			rt->stat.regexp_matched += r;
 		}
 
-		if (!isnan (t1)) {
-			t2 = rspamd_get_ticks (TRUE);
+		t2 = rspamd_get_ticks (FALSE);
+		elapsed_us = (t2 - t1) * 1e6;
+		rt->stat.pcre_time_us += elapsed_us;
+
+		if (elt->stat) {
+			__atomic_add_fetch (&elt->stat->checked, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch (&elt->stat->time_us, elapsed_us,
+					__ATOMIC_RELAXED);
 
-			if (t2 - t1 > slow_time) {
-				rspamd_symcache_enable_profile (task);
-				msg_info_task ("regexp '%16s' took %.0f ticks to execute",
-						rspamd_regexp_get_pattern (re), t2 - t1);
+			if (r > 0) {
+				__atomic_add_fetch (&elt->stat->matched, r, __ATOMIC_RELAXED);
 			}
 		}
+
+		if (t2 - t1 > slow_time) {
+			rspamd_symcache_enable_profile (task);
+			msg_info_task ("regexp '%16s' took %.3f seconds to execute",
+					rspamd_regexp_get_pattern (re), t2 - t1);
+		}
 	}
 
 	return r;
@@ -666,6 +1187,10 @@ struct rspamd_re_hyperscan_cbdata {
 	guint count;
 	rspamd_regexp_t *re;
 	struct rspamd_task *task;
+	/* Class of the database, hyperscan ids are positions in its `ids` */
+	struct rspamd_re_class *re_class;
+	/* Name of header scanned with the merged database */
+	const gchar *hdr_name;
 };
 
 static gint
@@ -678,14 +1203,25 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 	struct rspamd_re_hyperscan_cbdata *cbdata = ud;
 	struct rspamd_re_runtime *rt;
 	struct rspamd_re_cache_elt *cache_elt;
-	guint ret, maxhits, i, processed;
+	guint ret, maxhits;
 	struct rspamd_task *task;
 
 	rt = cbdata->rt;
 	task = cbdata->task;
+	id = g_array_index (cbdata->re_class->ids, gint, id);
 	cache_elt = g_ptr_array_index (rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits (cache_elt->re);
 
+	if (cbdata->hdr_name) {
+		struct rspamd_re_class *re_class = rspamd_regexp_get_class (cache_elt->re);
+
+		/* Route match from the merged database to its own header */
+		if (cache_elt->match_type != RSPAMD_RE_CACHE_HYPERSCAN ||
+				g_ascii_strcasecmp (re_class->type_data, cbdata->hdr_name) != 0) {
+			return 0;
+		}
+	}
+
 	if (cache_elt->match_type == RSPAMD_RE_CACHE_HYPERSCAN) {
 		if (rspamd_re_cache_check_lua_condition (task, cache_elt->re,
 				cbdata->ins[0], cbdata->lens[0], from, to, cache_elt->lua_cbref)) {
@@ -701,27 +1237,11 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 		}
 	}
 	else {
-		if (!isset (rt->checked, id)) {
-
-			processed = 0;
-
-			for (i = 0; i < cbdata->count; i ++) {
-				rspamd_re_cache_process_pcre (rt,
-						cache_elt->re,
-						cbdata->task,
-						cbdata->ins[i],
-						cbdata->lens[i],
-						FALSE,
-						cache_elt->lua_cbref);
-				setbit (rt->checked, id);
-
-				processed += cbdata->lens[i];
-
-				if (processed >= to) {
-					break;
-				}
-			}
-		}
+		/*
+		 * Expensive PCRE confirmation is deferred until some rule
+		 * really asks for this regexp, so disabled rules cost nothing
+		 */
+		setbit (rt->prefiltered, id);
 	}
 
 	return 0;
@@ -774,7 +1294,9 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 	re_class = rspamd_regexp_get_class (re);
 
 	if (rt->cache->disable_hyperscan || cache_elt->match_type == RSPAMD_RE_CACHE_PCRE ||
-			!rt->has_hs || (is_raw && re_class->has_utf8)) {
+			!rt->has_hs || (is_raw && re_class->has_utf8) || re_class->hs_db == NULL ||
+			(cache_elt->match_type == RSPAMD_RE_CACHE_HYPERSCAN_PRE &&
+					isset (rt->prefiltered, re_id))) {
 		for (i = 0; i < count; i++) {
 			ret = rspamd_re_cache_process_pcre (rt,
 					re,
@@ -810,6 +1332,8 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 				cbdata.lens = &lens[i];
 				cbdata.count = 1;
 				cbdata.task = task;
+				cbdata.hdr_name = NULL;
+				cbdata.re_class = re_class;
 
 				if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
 						re_class->hs_scratch,
@@ -829,6 +1353,8 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 			cbdata.lens = lens;
 			cbdata.count = 1;
 			cbdata.task = task;
+			cbdata.hdr_name = NULL;
+			cbdata.re_class = re_class;
 
 			if ((hs_scan_vector (re_class->hs_db, (const char **)in, lens, count, 0,
 					re_class->hs_scratch,
@@ -840,6 +1366,23 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 				*processed_hyperscan = TRUE;
 			}
 		}
+
+		if (cache_elt->match_type == RSPAMD_RE_CACHE_HYPERSCAN_PRE &&
+				isset (rt->prefiltered, re_id)) {
+			/* Requested regexp itself needs confirmation */
+			for (i = 0; i < count; i++) {
+				rspamd_re_cache_process_pcre (rt,
+						re,
+						task,
+						in[i],
+						lens[i],
+						is_raw,
+						cache_elt->lua_cbref);
+			}
+
+			setbit (rt->checked, re_id);
+			ret = rt->results[re_id];
+		}
 	}
 #endif
 
@@ -861,7 +1404,11 @@ rspamd_re_cache_finish_class (struct rspamd_task *task,
 	for (i = 0; i < re_class->nhs; i++) {
 		re_id = re_class->hs_ids[i];
 
-		if (!isset (rt->checked, re_id)) {
+		if (isset (rt->prefiltered, re_id) && !isset (rt->checked, re_id)) {
+			/* Checked by PCRE on demand */
+			found ++;
+		}
+		else if (!isset (rt->checked, re_id)) {
 			g_assert (rt->results[re_id] == 0);
 			rt->results[re_id] = 0;
 			setbit (rt->checked, re_id);
@@ -1107,20 +1654,275 @@ rspamd_re_cache_process_headers_list (struct rspamd_task *task,
 		i ++;
 	}
 
-	if (i > 0) {
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, scvec, lenvec, i, raw, processed_hyperscan);
-		msg_debug_re_task ("checking header %s regexp: %s=%*s -> %d",
-				re_class->type_data,
-				rspamd_regexp_get_pattern (re),
-				(int) lenvec[0], scvec[0], ret);
+	if (i > 0) {
+		ret = rspamd_re_cache_process_regexp_data (rt, re,
+				task, scvec, lenvec, i, raw, processed_hyperscan);
+		msg_debug_re_task ("checking header %s regexp: %s=%*s -> %d",
+				re_class->type_data,
+				rspamd_regexp_get_pattern (re),
+				(int) lenvec[0], scvec[0], ret);
+	}
+
+	g_free (scvec);
+	g_free (lenvec);
+
+	return ret;
+}
+
+/*
+ * Groups all message headers by name in a single pass over the headers
+ * order, so lookups and length calculations are not repeated per class
+ */
+static void
+rspamd_re_cache_build_headers_index (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt)
+{
+	struct rspamd_mime_header *cur;
+	struct rspamd_re_header_entry *entry;
+	khiter_t k;
+	gint r;
+
+	rt->hdr_index = kh_init (headers_index_hash);
+
+	/* Count headers of each name */
+	LL_FOREACH2 (MESSAGE_FIELD (task, headers_order), cur, ord_next) {
+		k = kh_put (headers_index_hash, rt->hdr_index, cur->name, &r);
+		entry = &kh_value (rt->hdr_index, k);
+
+		if (r != 0) {
+			memset (entry, 0, sizeof (*entry));
+			entry->raw_invalid = -1;
+			entry->decoded_invalid = -1;
+		}
+
+		entry->cnt ++;
+	}
+
+	kh_foreach_value_ptr (rt->hdr_index, entry, {
+		entry->hdrs = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*entry->hdrs) * entry->cnt);
+		entry->raw = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*entry->raw) * entry->cnt);
+		entry->raw_len = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*entry->raw_len) * entry->cnt);
+		entry->dec_hdrs = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*entry->dec_hdrs) * entry->cnt);
+		entry->decoded = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*entry->decoded) * entry->cnt);
+		entry->decoded_len = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*entry->decoded_len) * entry->cnt);
+		entry->cnt = 0;
+	});
+
+	LL_FOREACH2 (MESSAGE_FIELD (task, headers_order), cur, ord_next) {
+		k = kh_get (headers_index_hash, rt->hdr_index, cur->name);
+		g_assert (k != kh_end (rt->hdr_index));
+		entry = &kh_value (rt->hdr_index, k);
+
+		entry->hdrs[entry->cnt] = cur;
+		entry->raw[entry->cnt] = (const guchar *)cur->value;
+		entry->raw_len[entry->cnt] = strlen (cur->value);
+		entry->cnt ++;
+
+		if (cur->decoded) {
+			entry->dec_hdrs[entry->ndecoded] = cur;
+			entry->decoded[entry->ndecoded] = (const guchar *)cur->decoded;
+			entry->decoded_len[entry->ndecoded] = strlen (cur->decoded);
+			entry->ndecoded ++;
+		}
+	}
+}
+
+static guint
+rspamd_re_cache_process_headers_index (struct rspamd_task *task,
+									   struct rspamd_re_runtime *rt,
+									   rspamd_regexp_t *re,
+									   struct rspamd_re_class *re_class,
+									   gboolean is_strong,
+									   gboolean *processed_hyperscan)
+{
+	struct rspamd_re_header_entry *entry;
+	struct rspamd_mime_header **hdrs;
+	const guchar **scvec, **vec;
+	guint *lenvec, *lens;
+	guint cnt, i, nstrong = 0, ret = 0;
+	gboolean raw = FALSE;
+	khiter_t k;
+
+	if (rt->hdr_index == NULL) {
+		rspamd_re_cache_build_headers_index (task, rt);
+	}
+
+	k = kh_get (headers_index_hash, rt->hdr_index, re_class->type_data);
+
+	if (k == kh_end (rt->hdr_index)) {
+		return 0;
+	}
+
+	entry = &kh_value (rt->hdr_index, k);
+
+	if (re_class->type == RSPAMD_RE_RAWHEADER) {
+		if (entry->raw_invalid == -1) {
+			entry->raw_invalid = 0;
+
+			for (i = 0; i < entry->cnt; i ++) {
+				if (rspamd_fast_utf8_validate (entry->raw[i],
+						entry->raw_len[i]) != 0) {
+					entry->raw_invalid = 1;
+					break;
+				}
+			}
+		}
+
+		hdrs = entry->hdrs;
+		vec = entry->raw;
+		lens = entry->raw_len;
+		cnt = entry->cnt;
+		raw = entry->raw_invalid == 1;
+	}
+	else {
+#ifdef WITH_HYPERSCAN
+		if (re_class->merged && rt->merged_headers_invalid) {
+			/* Merged database has been skipped due to raw 8 bit data */
+			if (entry->decoded_invalid == -1) {
+				entry->decoded_invalid = 0;
+
+				for (i = 0; i < entry->ndecoded; i ++) {
+					if (rspamd_fast_utf8_validate (entry->decoded[i],
+							entry->decoded_len[i]) != 0) {
+						entry->decoded_invalid = 1;
+						break;
+					}
+				}
+			}
+
+			raw = entry->decoded_invalid == 1;
+		}
+#endif
+		hdrs = entry->dec_hdrs;
+		vec = entry->decoded;
+		lens = entry->decoded_len;
+		cnt = entry->ndecoded;
+	}
+
+	if (cnt == 0) {
+		return 0;
+	}
+
+	if (is_strong) {
+		/* Filter headers of a different case */
+		scvec = g_alloca (sizeof (*scvec) * cnt);
+		lenvec = g_alloca (sizeof (*lenvec) * cnt);
+
+		for (i = 0; i < cnt; i ++) {
+			if (strcmp (hdrs[i]->name, re_class->type_data) == 0) {
+				scvec[nstrong] = vec[i];
+				lenvec[nstrong] = lens[i];
+				nstrong ++;
+			}
+		}
+
+		cnt = nstrong;
+		vec = scvec;
+		lens = lenvec;
+
+		if (cnt == 0) {
+			return 0;
+		}
+	}
+
+	ret = rspamd_re_cache_process_regexp_data (rt, re,
+			task, vec, lens, cnt, raw, processed_hyperscan);
+	msg_debug_re_task ("checking header %s regexp: %s=%*s -> %d",
+			re_class->type_data,
+			rspamd_regexp_get_pattern (re),
+			(int) lens[0], vec[0], ret);
+
+	return ret;
+}
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Scans every header that is referenced by some header class once against
+ * the merged database; the callback routes matches to the classes
+ * of the scanned header name
+ */
+static void
+rspamd_re_cache_process_merged_headers (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		struct rspamd_re_class *merged)
+{
+	struct rspamd_re_hyperscan_cbdata cbdata;
+	struct rspamd_mime_header *cur;
+	struct rspamd_re_cache_elt *elt;
+	const guchar *in;
+	guint len, i;
+	gint re_id;
+
+	rt->merged_headers_done = TRUE;
+	cbdata.rt = rt;
+	cbdata.task = task;
+	cbdata.re = NULL;
+	cbdata.count = 1;
+	cbdata.ins = &in;
+	cbdata.lens = &len;
+	cbdata.re_class = merged;
+
+	if (merged->has_utf8) {
+		/*
+		 * Utf8 database cannot be used for headers with raw 8 bit data,
+		 * that are checked by PCRE as each class is not compiled on its own
+		 */
+		LL_FOREACH2 (MESSAGE_FIELD (task, headers_order), cur, ord_next) {
+			if (cur->decoded == NULL ||
+					!g_hash_table_contains (rt->cache->merged_headers_names,
+							cur->name)) {
+				continue;
+			}
+
+			if (rspamd_fast_utf8_validate ((const guchar *)cur->decoded,
+					strlen (cur->decoded)) != 0) {
+				msg_debug_re_task ("header %s is not valid utf8, do not use "
+						"merged database", cur->name);
+				rt->merged_headers_invalid = TRUE;
+
+				return;
+			}
+		}
+	}
+
+	LL_FOREACH2 (MESSAGE_FIELD (task, headers_order), cur, ord_next) {
+		if (cur->decoded == NULL ||
+				!g_hash_table_contains (rt->cache->merged_headers_names, cur->name)) {
+			continue;
+		}
+
+		in = (const guchar *)cur->decoded;
+		len = strlen (cur->decoded);
+		cbdata.hdr_name = cur->name;
+		rt->stat.bytes_scanned += len;
+
+		if (hs_scan (merged->hs_db, (const char *)in, len, 0,
+				merged->hs_scratch,
+				rspamd_re_cache_hyperscan_cb, &cbdata) != HS_SUCCESS) {
+			msg_debug_re_task ("cannot scan header %s using merged database",
+					cur->name);
+		}
 	}
 
-	g_free (scvec);
-	g_free (lenvec);
+	/* Remaining pure hyperscan expressions have not matched */
+	for (i = 0; i < merged->nhs; i++) {
+		re_id = merged->hs_ids[i];
+		elt = g_ptr_array_index (rt->cache->re, re_id);
 
-	return ret;
+		if (elt->match_type == RSPAMD_RE_CACHE_HYPERSCAN &&
+				!isset (rt->checked, re_id)) {
+			g_assert (rt->results[re_id] == 0);
+			setbit (rt->checked, re_id);
+		}
+	}
 }
+#endif
 
 /*
  * Calculates the specified regexp for the specified class if it's not calculated
@@ -1153,18 +1955,29 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 	switch (re_class->type) {
 	case RSPAMD_RE_HEADER:
 	case RSPAMD_RE_RAWHEADER:
-		/* Get list of specified headers */
-		rh = rspamd_message_get_header_array(task,
-				re_class->type_data, FALSE);
+#ifdef WITH_HYPERSCAN
+		if (re_class->merged && !is_strong && rt->has_hs &&
+				re_class->merged->hs_db != NULL &&
+				((struct rspamd_re_cache_elt *)g_ptr_array_index (rt->cache->re,
+						re_id))->match_type == RSPAMD_RE_CACHE_HYPERSCAN) {
+			/* All header classes are checked at once */
+			if (!rt->merged_headers_done) {
+				rspamd_re_cache_process_merged_headers (task, rt,
+						re_class->merged);
+			}
 
-		if (rh) {
-			ret = rspamd_re_cache_process_headers_list (task, rt, re,
-					re_class, rh, is_strong, &processed_hyperscan);
-			msg_debug_re_task ("checked header(%s) regexp: %s -> %d",
-					(const char *)re_class->type_data,
-					rspamd_regexp_get_pattern (re),
-					ret);
+			if (!rt->merged_headers_invalid) {
+				ret = rt->results[re_id];
+				break;
+			}
 		}
+#endif
+		ret = rspamd_re_cache_process_headers_index (task, rt, re,
+				re_class, is_strong, &processed_hyperscan);
+		msg_debug_re_task ("checked header(%s) regexp: %s -> %d",
+				(const char *)re_class->type_data,
+				rspamd_regexp_get_pattern (re),
+				ret);
 		break;
 	case RSPAMD_RE_ALLHEADER:
 		raw = TRUE;
@@ -1580,6 +2393,10 @@ rspamd_re_cache_runtime_destroy (struct rspamd_re_runtime *rt)
 		kh_destroy (selectors_results_hash, rt->sel_cache);
 	}
 
+	if (rt->hdr_index) {
+		kh_destroy (headers_index_hash, rt->hdr_index);
+	}
+
 	REF_RELEASE (rt->cache);
 	g_free (rt);
 }
@@ -1615,6 +2432,95 @@ rspamd_re_cache_set_limit (struct rspamd_re_cache *cache, guint limit)
 	return old;
 }
 
+gdouble
+rspamd_re_cache_set_time_budget (struct rspamd_re_cache *cache,
+		gdouble budget)
+{
+	gdouble old;
+
+	g_assert (cache != NULL);
+
+	old = cache->time_budget;
+	cache->time_budget = budget;
+
+	return old;
+}
+
+static gint
+rspamd_re_cache_counters_sort_func (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_re_cache_elt *e1 = *(const struct rspamd_re_cache_elt **)a,
+			*e2 = *(const struct rspamd_re_cache_elt **)b;
+
+	if (e1->stat->time_us > e2->stat->time_us) {
+		return -1;
+	}
+	else if (e1->stat->time_us < e2->stat->time_us) {
+		return 1;
+	}
+
+	return 0;
+}
+
+ucl_object_t *
+rspamd_re_cache_counters (struct rspamd_re_cache *cache)
+{
+	ucl_object_t *top, *obj;
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	GPtrArray *elts;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+	elts = g_ptr_array_sized_new (cache->re->len);
+
+	for (i = 0; i < cache->re->len; i ++) {
+		elt = g_ptr_array_index (cache->re, i);
+
+		if (elt->stat != NULL) {
+			g_ptr_array_add (elts, elt);
+		}
+	}
+
+	g_ptr_array_sort (elts, rspamd_re_cache_counters_sort_func);
+
+	PTR_ARRAY_FOREACH (elts, i, elt) {
+		re_class = rspamd_regexp_get_class (elt->re);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_regexp_get_pattern (elt->re)),
+				"pattern", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_re_cache_type_to_string (re_class->type)),
+				"type", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->stat->checked),
+				"checked", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->stat->matched),
+				"matched", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->stat->skipped),
+				"skipped", 0, false);
+		/* Milliseconds */
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (elt->stat->time_us / 1000.0),
+				"time", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (elt->stat->checked > 0 ?
+						(gdouble)elt->stat->time_us / elt->stat->checked / 1000.0 :
+						0.0),
+				"avg_time", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	g_ptr_array_free (elts, TRUE);
+
+	return top;
+}
+
 const gchar *
 rspamd_re_cache_type_to_string (enum rspamd_re_type type)
 {
@@ -1786,7 +2692,7 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 
 		if (hs_compile (pat,
 				flags | HS_FLAG_PREFILTER,
-				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				rspamd_re_cache_class_hs_mode (cache, rspamd_regexp_get_class (re)),
 				&cache->plt,
 				&test_db,
 				&hs_errors) != HS_SUCCESS) {
@@ -1855,118 +2761,157 @@ struct rspamd_re_cache_hs_compile_cbdata {
 	const char *cache_dir;
 	gdouble max_time;
 	gboolean silent;
+	gboolean exhausted;
 	guint total;
+	guint max_workers;
+	/* pid -> class compiled by that child */
+	GHashTable *workers;
+	GError *err;
+	void (*old_hdl)(int);
 	void (*cb)(guint ncompiled, GError *err, void *cbd);
 	void *cbd;
 };
 
 static void
-rspamd_re_cache_compile_err (EV_P_ ev_timer *w, GError *err,
+rspamd_re_cache_compile_finish (EV_P_ ev_timer *w, GError *err,
 		struct rspamd_re_cache_hs_compile_cbdata *cbdata)
 {
 	ev_timer_stop (EV_A_ w);
+
+	if (cbdata->workers) {
+		g_hash_table_unref (cbdata->workers);
+		signal (SIGCHLD, cbdata->old_hdl);
+	}
+
 	cbdata->cb (cbdata->total, err, cbdata->cbd);
 	g_free (w);
 	g_free (cbdata);
-	g_error_free (err);
+
+	if (err) {
+		g_error_free (err);
+	}
 }
 
-static void
-rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
+/*
+ * Returns number of expressions stored in a hyperscan file or -1
+ */
+static gint
+rspamd_re_cache_hs_file_count (struct rspamd_re_cache *cache,
+		const gchar *path)
 {
-	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
-			(struct rspamd_re_cache_hs_compile_cbdata *)w->data;
-	GHashTableIter cit;
-	gpointer k, v;
-	struct rspamd_re_class *re_class;
-	gchar path[PATH_MAX], npath[PATH_MAX];
-	hs_database_t *test_db;
-	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
-	rspamd_cryptobox_fast_hash_state_t crc_st;
-	guint64 crc;
-	rspamd_regexp_t *re;
-	hs_compile_error_t *hs_errors;
-	guint *hs_flags = NULL;
-	const hs_expr_ext_t **hs_exts = NULL;
-	gchar **hs_pats = NULL;
-	gchar *hs_serialized;
-	gsize serialized_len;
-	struct iovec iov[7];
-	struct rspamd_re_cache *cache;
-	GError *err;
+	gint fd, n = -1;
 
-	cache = cbdata->cache;
+	fd = open (path, O_RDONLY);
 
-	if (!g_hash_table_iter_next (&cbdata->it, &k, &v)) {
-		/* All done */
-		ev_timer_stop (EV_A_ w);
-		cbdata->cb (cbdata->total, NULL, cbdata->cbd);
-		g_free (w);
-		g_free (cbdata);
+	if (fd == -1) {
+		return -1;
+	}
 
-		return;
+	if (lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET) == -1 ||
+			read (fd, &n, sizeof (n)) != sizeof (n)) {
+		n = -1;
 	}
 
-	re_class = v;
+	close (fd);
+
+	return n;
+}
+
+/*
+ * Class hash depends merely on its own expressions, so the existing file
+ * is reused as long as these expressions are not changed
+ */
+static gboolean
+rspamd_re_cache_compile_is_valid (struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+		struct rspamd_re_class *re_class)
+{
+	struct rspamd_re_cache *cache = cbdata->cache;
+	gchar path[PATH_MAX];
+	gint n;
+
 	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cbdata->cache_dir,
 			G_DIR_SEPARATOR, re_class->hash);
 
-	if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
-
-		fd = open (path, O_RDONLY, 00600);
+	if (!rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
+		return FALSE;
+	}
 
-		/* Read number of regexps */
-		g_assert (fd != -1);
-		lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
-		g_assert (read (fd, &n, sizeof (n)) == sizeof (n));
-		close (fd);
+	n = rspamd_re_cache_hs_file_count (cache, path);
+	g_assert (n != -1);
 
+	if (!cbdata->silent) {
 		if (re_class->type_len > 0) {
-			if (!cbdata->silent) {
-				msg_info_re_cache (
-						"skip already valid class %s(%*s) to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						(gint) re_class->type_len - 1,
-						re_class->type_data,
-						re_class->hash,
-						n);
-			}
+			msg_info_re_cache (
+					"skip already valid class %s(%*s) to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string (re_class->type),
+					(gint) re_class->type_len - 1,
+					re_class->type_data,
+					re_class->hash,
+					n);
 		}
 		else {
-			if (!cbdata->silent) {
-				msg_info_re_cache (
-						"skip already valid class %s to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						re_class->hash,
-						n);
-			}
+			msg_info_re_cache (
+					"skip already valid class %s to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string (re_class->type),
+					re_class->hash,
+					n);
 		}
-
-		ev_timer_again (EV_A_ w);
-		return;
 	}
 
-	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cbdata->cache_dir,
+	return TRUE;
+}
+
+/*
+ * Compiles a single class to `cache_dir`, expressions are identified by
+ * their position in the class, so the produced file does not depend on
+ * other classes
+ */
+static GError *
+rspamd_re_cache_compile_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const gchar *cache_dir,
+		gdouble max_time,
+		gint *ncompiled)
+{
+	gchar path[PATH_MAX], npath[PATH_MAX];
+	hs_database_t *test_db;
+	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
+	guint j;
+	rspamd_cryptobox_fast_hash_state_t crc_st;
+	guint64 crc;
+	rspamd_regexp_t *re;
+	struct rspamd_re_cache_elt *elt;
+	hs_compile_error_t *hs_errors;
+	guint *hs_flags = NULL;
+	const hs_expr_ext_t **hs_exts = NULL;
+	gchar **hs_pats = NULL;
+	gchar *hs_serialized;
+	gsize serialized_len;
+	struct iovec iov[7];
+	GError *err;
+
+	g_assert (re_class->ids != NULL);
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
 			G_DIR_SEPARATOR, re_class->hash);
 	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
 
 	if (fd == -1) {
-		err = g_error_new (rspamd_re_cache_quark (), errno,
+		return g_error_new (rspamd_re_cache_quark (), errno,
 				"cannot open file %s: %s", path, strerror (errno));
-		rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-		return;
 	}
 
-	g_hash_table_iter_init (&cit, re_class->re);
-	n = g_hash_table_size (re_class->re);
+	n = re_class->ids->len;
 	hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
 	hs_ids = g_malloc (sizeof (*hs_ids) * n);
 	hs_pats = g_malloc (sizeof (*hs_pats) * n);
 	hs_exts = g_malloc0 (sizeof (*hs_exts) * n);
 	i = 0;
 
-	while (g_hash_table_iter_next (&cit, &k, &v)) {
-		re = v;
+	for (j = 0; j < re_class->ids->len; j ++) {
+		elt = g_ptr_array_index (cache->re,
+				g_array_index (re_class->ids, gint, j));
+		re = elt->re;
 
 		pcre_flags = rspamd_regexp_get_pcre_flags (re);
 		re_flags = rspamd_regexp_get_flags (re);
@@ -2012,7 +2957,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 
 		if (hs_compile (pat,
 				hs_flags[i],
-				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				rspamd_re_cache_class_hs_mode (cache, re_class),
 				&cache->plt,
 				&test_db,
 				&hs_errors) != HS_SUCCESS) {
@@ -2024,9 +2969,9 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			/* The approximation operation might take a significant
 			 * amount of time, so we need to check if it's finite
 			 */
-			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], cbdata->max_time)) {
+			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
 				hs_flags[i] |= HS_FLAG_PREFILTER;
-				hs_ids[i] = rspamd_regexp_get_cache_id (re);
+				hs_ids[i] = j;
 				hs_pats[i] = pat;
 				i++;
 			}
@@ -2035,7 +2980,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			}
 		}
 		else {
-			hs_ids[i] = rspamd_regexp_get_cache_id (re);
+			hs_ids[i] = j;
 			hs_pats[i] = pat;
 			i ++;
 			hs_free_database (test_db);
@@ -2051,17 +2996,22 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 				hs_ids,
 				hs_exts,
 				n,
-				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				rspamd_re_cache_class_hs_mode (cache, re_class),
 				&cache->plt,
 				&test_db,
 				&hs_errors) != HS_SUCCESS) {
 
+			err = g_error_new (rspamd_re_cache_quark (), EINVAL,
+					"cannot create tree of regexp when processing '%s': %s",
+					hs_errors->expression >= 0 ?
+							hs_pats[hs_errors->expression] : "unknown",
+					hs_errors->message);
 
 			g_free (hs_flags);
 			g_free (hs_ids);
 
-			for (guint j = 0; j < i; j ++) {
-				g_free (hs_pats[j]);
+			for (guint k = 0; k < i; k ++) {
+				g_free (hs_pats[k]);
 			}
 
 			g_free (hs_pats);
@@ -2070,16 +3020,11 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			unlink (path);
 			hs_free_compile_error (hs_errors);
 
-			err = g_error_new (rspamd_re_cache_quark (), EINVAL,
-					"cannot create tree of regexp when processing '%s': %s",
-					hs_pats[hs_errors->expression], hs_errors->message);
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-
-			return;
+			return err;
 		}
 
-		for (guint j = 0; j < i; j ++) {
-			g_free (hs_pats[j]);
+		for (guint k = 0; k < i; k ++) {
+			g_free (hs_pats[k]);
 		}
 
 		g_free (hs_pats);
@@ -2098,8 +3043,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			g_free (hs_flags);
 			hs_free_database (test_db);
 
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-			return;
+			return err;
 		}
 
 		hs_free_database (test_db);
@@ -2108,7 +3052,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 		 * Magic - 8 bytes
 		 * Platform - sizeof (platform)
 		 * n - number of regexps
-		 * n * <regexp ids>
+		 * n * <regexp positions in class>
 		 * n * <regexp flags>
 		 * crc - 8 bytes checksum
 		 * <hyperscan blob>
@@ -2123,12 +3067,8 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 				hs_serialized, serialized_len);
 		crc = rspamd_cryptobox_fast_hash_final (&crc_st);
 
-		if (cache->vectorized_hyperscan) {
-			iov[0].iov_base = (void *) rspamd_hs_magic_vector;
-		}
-		else {
-			iov[0].iov_base = (void *) rspamd_hs_magic;
-		}
+		iov[0].iov_base = (void *) rspamd_re_cache_class_hs_magic (cache,
+				re_class);
 
 		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
 		iov[1].iov_base = &cache->plt;
@@ -2155,8 +3095,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			g_free (hs_flags);
 			g_free (hs_serialized);
 
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-			return;
+			return err;
 		}
 
 		if (re_class->type_len > 0) {
@@ -2167,7 +3106,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 					re_class->type_data,
 					re_class->hash,
 					n,
-					(gint)g_hash_table_size (re_class->re));
+					(gint)re_class->ids->len);
 		}
 		else {
 			msg_info_re_cache (
@@ -2175,17 +3114,17 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 					rspamd_re_cache_type_to_string (re_class->type),
 					re_class->hash,
 					n,
-					(gint)g_hash_table_size (re_class->re));
+					(gint)re_class->ids->len);
 		}
 
-		cbdata->total += n;
+		*ncompiled = n;
 
 		g_free (hs_serialized);
 		g_free (hs_ids);
 		g_free (hs_flags);
 
 		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cbdata->cache_dir,
+		rspamd_snprintf (npath, sizeof (npath), "%s%c%s.hs", cache_dir,
 				G_DIR_SEPARATOR, re_class->hash);
 
 		if (rename (path, npath) == -1) {
@@ -2196,8 +3135,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			unlink (path);
 			close (fd);
 
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-			return;
+			return err;
 		}
 
 		close (fd);
@@ -2208,12 +3146,147 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 				"no suitable regular expressions %s (%d original): "
 				"remove temporary file %s",
 				rspamd_re_cache_type_to_string (re_class->type),
-				(gint)g_hash_table_size (re_class->re),
+				(gint)re_class->ids->len,
 				path);
 
+		g_free (hs_flags);
+		g_free (hs_ids);
+		g_free (hs_pats);
+		g_free (hs_exts);
 		unlink (path);
 		close (fd);
-		rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
+
+		return err;
+	}
+
+	return NULL;
+}
+
+/*
+ * Collects results from the finished compilation processes
+ */
+static void
+rspamd_re_cache_compile_reap (struct rspamd_re_cache_hs_compile_cbdata *cbdata)
+{
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_class *re_class;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar path[PATH_MAX];
+	gint status, n;
+	pid_t cld, rc;
+
+	g_hash_table_iter_init (&it, cbdata->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		cld = GPOINTER_TO_INT (k);
+		re_class = v;
+
+		if ((rc = waitpid (cld, &status, WNOHANG)) == 0) {
+			/* Still compiling */
+			continue;
+		}
+
+		g_hash_table_iter_remove (&it);
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cbdata->cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
+
+		if (rc > 0 && WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS &&
+				(n = rspamd_re_cache_hs_file_count (cache, path)) > 0) {
+			cbdata->total += n;
+		}
+		else if (cbdata->err == NULL) {
+			cbdata->err = g_error_new (rspamd_re_cache_quark (), EINVAL,
+					"cannot compile class %s to cache %s",
+					rspamd_re_cache_type_to_string (re_class->type),
+					re_class->hash);
+		}
+	}
+}
+
+static void
+rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
+{
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
+			(struct rspamd_re_cache_hs_compile_cbdata *)w->data;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache *cache;
+	GError *err;
+	gint n = 0;
+	pid_t cld;
+
+	cache = cbdata->cache;
+
+	if (cbdata->workers) {
+		rspamd_re_cache_compile_reap (cbdata);
+	}
+
+	while (cbdata->err == NULL && !cbdata->exhausted) {
+		if (cbdata->workers &&
+				g_hash_table_size (cbdata->workers) >= cbdata->max_workers) {
+			break;
+		}
+
+		if (!g_hash_table_iter_next (&cbdata->it, &k, &v)) {
+			cbdata->exhausted = TRUE;
+			break;
+		}
+
+		re_class = v;
+
+		if (re_class->merged) {
+			/* Compiled as a part of the merged database */
+			continue;
+		}
+
+		if (rspamd_re_cache_compile_is_valid (cbdata, re_class)) {
+			continue;
+		}
+
+		if (cbdata->workers == NULL) {
+			/* Compile one class per timer iteration */
+			err = rspamd_re_cache_compile_class (cache, re_class,
+					cbdata->cache_dir, cbdata->max_time, &n);
+
+			if (err) {
+				rspamd_re_cache_compile_finish (EV_A_ w, err, cbdata);
+				return;
+			}
+
+			cbdata->total += n;
+			ev_timer_again (EV_A_ w);
+
+			return;
+		}
+
+		cld = fork ();
+
+		if (cld == 0) {
+			err = rspamd_re_cache_compile_class (cache, re_class,
+					cbdata->cache_dir, cbdata->max_time, &n);
+
+			if (err) {
+				msg_err_re_cache ("%e", err);
+				_exit (EXIT_FAILURE);
+			}
+
+			_exit (EXIT_SUCCESS);
+		}
+		else if (cld > 0) {
+			g_hash_table_insert (cbdata->workers, GINT_TO_POINTER (cld), re_class);
+		}
+		else {
+			cbdata->err = g_error_new (rspamd_re_cache_quark (), errno,
+					"cannot fork to compile class %s: %s",
+					re_class->hash, strerror (errno));
+		}
+	}
+
+	if ((cbdata->exhausted || cbdata->err) &&
+			(cbdata->workers == NULL || g_hash_table_size (cbdata->workers) == 0)) {
+		/* All done */
+		rspamd_re_cache_compile_finish (EV_A_ w, cbdata->err, cbdata);
 
 		return;
 	}
@@ -2228,6 +3301,7 @@ gint
 rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 								   const char *cache_dir,
 								   gdouble max_time,
+								   guint max_workers,
 								   gboolean silent,
 								   struct ev_loop *event_loop,
 								   void (*cb)(guint ncompiled, GError *err, void *cbd),
@@ -2252,6 +3326,20 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 	cbdata->max_time = max_time;
 	cbdata->silent = silent;
 	cbdata->total = 0;
+
+	if (max_workers == 0) {
+		max_workers = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+	}
+
+	cbdata->max_workers = max_workers;
+
+	if (max_workers > 1) {
+		/* Classes are compiled by child processes in parallel */
+		cbdata->workers = g_hash_table_new (g_direct_hash, g_direct_equal);
+		/* We need to restore SIGCHLD processing */
+		cbdata->old_hdl = signal (SIGCHLD, SIG_DFL);
+	}
+
 	timer = g_malloc0 (sizeof (*timer));
 	timer->data = (void *)cbdata; /* static */
 
@@ -2332,12 +3420,7 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 				return FALSE;
 			}
 
-			if (cache->vectorized_hyperscan) {
-				mb = rspamd_hs_magic_vector;
-			}
-			else {
-				mb = rspamd_hs_magic;
-			}
+			mb = rspamd_re_cache_class_hs_magic (cache, re_class);
 
 			if (memcmp (magicbuf, mb, sizeof (magicbuf)) != 0) {
 				msg_err_re_cache ("cannot open hyperscan cache file %s: "
@@ -2469,7 +3552,7 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 	return RSPAMD_HYPERSCAN_UNSUPPORTED;
 #else
 	gchar path[PATH_MAX];
-	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
+	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0;
 	GHashTableIter it;
 	gpointer k, v;
 	guint8 *map, *p, *end;
@@ -2482,6 +3565,12 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		re_class = v;
+
+		if (re_class->merged) {
+			/* Loaded as a part of the merged database */
+			continue;
+		}
+
 		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
 				G_DIR_SEPARATOR, re_class->hash);
 
@@ -2551,7 +3640,8 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			}
 
 			if (re_class->hs_db != NULL) {
-				hs_free_database (re_class->hs_db);
+				rspamd_hyperscan_free_shared (re_class->hs_db,
+						re_class->hs_db_maplen);
 			}
 
 			if (re_class->hs_ids) {
@@ -2562,13 +3652,15 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			re_class->hs_scratch = NULL;
 			re_class->hs_db = NULL;
 
-			if ((ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
-					!= HS_SUCCESS) {
+			re_class->hs_db = rspamd_hyperscan_load_shared (path, p, end - p,
+					&re_class->hs_db_maplen);
+
+			if (re_class->hs_db == NULL) {
 				if (!try_load) {
-					msg_err_re_cache ("bad hs database in %s: %d", path, ret);
+					msg_err_re_cache ("bad hs database in %s", path);
 				}
 				else {
-					msg_debug_re_cache ("bad hs database in %s: %d", path, ret);
+					msg_debug_re_cache ("bad hs database in %s", path);
 				}
 				munmap (map, st.st_size);
 				g_free (hs_ids);
@@ -2592,7 +3684,10 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			 * specify that they should be matched using hyperscan
 			 */
 			for (i = 0; i < n; i ++) {
-				g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
+				g_assert (re_class->ids != NULL);
+				g_assert ((gint)re_class->ids->len > hs_ids[i] && hs_ids[i] >= 0);
+				/* Convert position in class to the global id */
+				hs_ids[i] = g_array_index (re_class->ids, gint, hs_ids[i]);
 				elt = g_ptr_array_index (cache->re, hs_ids[i]);
 
 				if (hs_flags[i] & HS_FLAG_PREFILTER) {
@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "libutil/regexp.h"
+#include "ucl.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -54,6 +55,8 @@ struct rspamd_re_cache_stat {
 	guint regexp_matched;
 	guint regexp_total;
 	guint regexp_fast_cached;
+	guint regexp_skipped;
+	guint64 pcre_time_us;
 };
 
 /**
@@ -161,6 +164,19 @@ struct rspamd_re_cache *rspamd_re_cache_ref (struct rspamd_re_cache *cache);
  */
 guint rspamd_re_cache_set_limit (struct rspamd_re_cache *cache, guint limit);
 
+/**
+ * Set per-task time budget for pcre matching, once it is exhausted
+ * expensive regexps are skipped; 0 disables budget, returns previous value
+ */
+gdouble rspamd_re_cache_set_time_budget (struct rspamd_re_cache *cache,
+		gdouble budget);
+
+/**
+ * Returns ucl array with execution counters of all regexps in the cache,
+ * most costly ones first
+ */
+ucl_object_t *rspamd_re_cache_counters (struct rspamd_re_cache *cache);
+
 /**
  * Convert re type to a human readable string (constant one)
  */
@@ -174,10 +190,13 @@ enum rspamd_re_type rspamd_re_cache_type_from_string (const char *str);
 struct ev_loop;
 /**
  * Compile expressions to the hyperscan tree and store in the `cache_dir`
+ * Classes that are not changed are not recompiled, up to `max_workers`
+ * classes are compiled in parallel (0 means number of CPUs)
  */
 gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 										const char *cache_dir,
 										gdouble max_time,
+										guint max_workers,
 										gboolean silent,
 										struct ev_loop *event_loop,
 										void (*cb)(guint ncompiled, GError *err, void *cbd),
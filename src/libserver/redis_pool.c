@@ -38,6 +38,10 @@ struct rspamd_redis_pool_connection {
 	GList *entry;
 	ev_timer timeout;
 	enum rspamd_redis_pool_connection_state state;
+	/* Shared connections are used by many callers at the same time */
+	gboolean shared;
+	guint users;
+	gpointer ctx_key; /* Key in elts_by_ctx, ctx is NULL if conn is killed */
 	gchar tag[MEMPOOL_UID_LEN];
 	ref_entry_t ref;
 };
@@ -56,6 +60,8 @@ struct rspamd_redis_pool {
 	GHashTable *elts_by_ctx;
 	gdouble timeout;
 	guint max_conns;
+	guint max_shared_conns;
+	struct rspamd_redis_pool_stat stat;
 };
 
 static const gdouble default_timeout = 10.0;
@@ -105,6 +111,13 @@ rspamd_redis_pool_get_key (const gchar *db, const gchar *password,
 static void
 rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 {
+	if (conn->ctx == NULL && conn->ctx_key != NULL &&
+			g_hash_table_lookup (conn->elt->pool->elts_by_ctx,
+					conn->ctx_key) == conn) {
+		/* Killed shared connection */
+		g_hash_table_remove (conn->elt->pool->elts_by_ctx, conn->ctx_key);
+	}
+
 	if (conn->state == RSPAMD_REDIS_POOL_CONN_ACTIVE) {
 		msg_debug_rpool ("active connection removed");
 
@@ -149,6 +162,7 @@ rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 		g_list_free (conn->entry);
 	}
 
+	conn->elt->pool->stat.conns_active --;
 	g_free (conn);
 }
 
@@ -312,6 +326,9 @@ rspamd_redis_pool_new_connection (struct rspamd_redis_pool *pool,
 			g_hash_table_insert (elt->pool->elts_by_ctx, ctx, conn);
 			g_queue_push_head_link (elt->active, conn->entry);
 			conn->ctx = ctx;
+			conn->ctx_key = ctx;
+			pool->stat.conns_created ++;
+			pool->stat.conns_active ++;
 			ctx->data = conn;
 			rspamd_random_hex (conn->tag, sizeof (conn->tag));
 			REF_INIT_RETAIN (conn, rspamd_redis_pool_conn_dtor);
@@ -373,80 +390,148 @@ rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
 	pool->cfg = cfg;
 	pool->timeout = default_timeout;
 	pool->max_conns = default_max_conns;
+	pool->max_shared_conns = cfg->redis_pool_shared_conns;
 }
 
 
-struct redisAsyncContext*
-rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+/*
+ * Returns either an idle connection from the inactive queue or a new one
+ */
+static struct rspamd_redis_pool_connection *
+rspamd_redis_pool_get_idle_connection (struct rspamd_redis_pool *pool,
+		struct rspamd_redis_pool_elt *elt,
 		const gchar *db, const gchar *password,
 		const char *ip, int port)
 {
-	guint64 key;
-	struct rspamd_redis_pool_elt *elt;
 	GList *conn_entry;
 	struct rspamd_redis_pool_connection *conn;
 
-	g_assert (pool != NULL);
-	g_assert (pool->event_loop != NULL);
-	g_assert (ip != NULL);
-
-	key = rspamd_redis_pool_get_key (db, password, ip, port);
-	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+	if (g_queue_get_length (elt->inactive) > 0) {
+		conn_entry = g_queue_pop_head_link (elt->inactive);
+		conn = conn_entry->data;
+		g_assert (conn->state != RSPAMD_REDIS_POOL_CONN_ACTIVE);
 
-	if (elt) {
-		if (g_queue_get_length (elt->inactive) > 0) {
-			conn_entry = g_queue_pop_head_link (elt->inactive);
-			conn = conn_entry->data;
-			g_assert (conn->state != RSPAMD_REDIS_POOL_CONN_ACTIVE);
+		if (conn->ctx->err == REDIS_OK) {
+			/* Also check SO_ERROR */
+			gint err;
+			socklen_t len = sizeof (gint);
 
-			if (conn->ctx->err == REDIS_OK) {
-				/* Also check SO_ERROR */
-				gint err;
-				socklen_t len = sizeof (gint);
-
-				if (getsockopt (conn->ctx->c.fd, SOL_SOCKET, SO_ERROR,
-						(void *) &err, &len) == -1) {
-					err = errno;
-				}
-
-				if (err != 0) {
-					g_list_free (conn->entry);
-					conn->entry = NULL;
-					REF_RELEASE (conn);
-					conn = rspamd_redis_pool_new_connection (pool, elt,
-							db, password, ip, port);
-				}
-				else {
-
-					ev_timer_stop (elt->pool->event_loop, &conn->timeout);
-					conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
-					g_queue_push_tail_link (elt->active, conn_entry);
-					msg_debug_rpool ("reused existing connection to %s:%d: %p",
-							ip, port, conn->ctx);
-				}
+			if (getsockopt (conn->ctx->c.fd, SOL_SOCKET, SO_ERROR,
+					(void *) &err, &len) == -1) {
+				err = errno;
 			}
-			else {
+
+			if (err != 0) {
 				g_list_free (conn->entry);
 				conn->entry = NULL;
 				REF_RELEASE (conn);
 				conn = rspamd_redis_pool_new_connection (pool, elt,
 						db, password, ip, port);
 			}
+			else {
 
+				ev_timer_stop (elt->pool->event_loop, &conn->timeout);
+				conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
+				g_queue_push_tail_link (elt->active, conn_entry);
+				pool->stat.conns_reused ++;
+				msg_debug_rpool ("reused existing connection to %s:%d: %p",
+						ip, port, conn->ctx);
+			}
 		}
 		else {
-			/* Need to create connection */
+			g_list_free (conn->entry);
+			conn->entry = NULL;
+			REF_RELEASE (conn);
 			conn = rspamd_redis_pool_new_connection (pool, elt,
 					db, password, ip, port);
 		}
+
 	}
 	else {
+		/* Need to create connection */
+		conn = rspamd_redis_pool_new_connection (pool, elt,
+				db, password, ip, port);
+	}
+
+	return conn;
+}
+
+/*
+ * Selects the least loaded shared connection, a new one is added if all
+ * shared connections are busy and their limit is not reached
+ */
+static struct rspamd_redis_pool_connection *
+rspamd_redis_pool_get_shared_connection (struct rspamd_redis_pool *pool,
+		struct rspamd_redis_pool_elt *elt,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	GList *cur;
+	struct rspamd_redis_pool_connection *conn, *best = NULL;
+	guint nshared = 0;
+
+	for (cur = elt->active->head; cur != NULL; cur = g_list_next (cur)) {
+		conn = cur->data;
+
+		if (conn->shared && conn->ctx && conn->ctx->err == REDIS_OK &&
+				!(conn->ctx->c.flags & (REDIS_DISCONNECTING|REDIS_FREEING))) {
+			nshared ++;
+
+			if (best == NULL || conn->users < best->users) {
+				best = conn;
+			}
+		}
+	}
+
+	if (best == NULL || (best->users > 0 && nshared < pool->max_shared_conns)) {
+		conn = rspamd_redis_pool_get_idle_connection (pool, elt,
+				db, password, ip, port);
+
+		if (conn) {
+			conn->shared = TRUE;
+		}
+	}
+	else {
+		conn = best;
+		pool->stat.requests_multiplexed ++;
+		msg_debug_rpool ("share connection to %s:%d: %p, %ud users",
+				ip, port, conn->ctx, conn->users);
+	}
+
+	return conn;
+}
+
+static struct redisAsyncContext *
+rspamd_redis_pool_connect_common (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port, gboolean exclusive)
+{
+	guint64 key;
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn;
+
+	g_assert (pool != NULL);
+	g_assert (pool->event_loop != NULL);
+	g_assert (ip != NULL);
+
+	key = rspamd_redis_pool_get_key (db, password, ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+
+	if (!elt) {
 		/* Need to create a pool */
 		elt = rspamd_redis_pool_new_elt (pool);
 		elt->key = key;
 		g_hash_table_insert (pool->elts_by_key, &elt->key, elt);
+	}
 
-		conn = rspamd_redis_pool_new_connection (pool, elt,
+	pool->stat.requests ++;
+
+	if (!exclusive && pool->max_shared_conns > 0) {
+		conn = rspamd_redis_pool_get_shared_connection (pool, elt,
+				db, password, ip, port);
+	}
+	else {
+		conn = rspamd_redis_pool_get_idle_connection (pool, elt,
 				db, password, ip, port);
 	}
 
@@ -454,11 +539,93 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 		return NULL;
 	}
 
+	conn->users ++;
 	REF_RETAIN (conn);
 
 	return conn->ctx;
 }
 
+struct redisAsyncContext*
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	return rspamd_redis_pool_connect_common (pool, db, password, ip, port,
+			FALSE);
+}
+
+struct redisAsyncContext*
+rspamd_redis_pool_connect_exclusive (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	return rspamd_redis_pool_connect_common (pool, db, password, ip, port,
+			TRUE);
+}
+
+/*
+ * Terminates shared connection with all pending commands of all its users,
+ * connection itself is kept until all users release it
+ */
+static void
+rspamd_redis_pool_kill_connection (struct rspamd_redis_pool_connection *conn)
+{
+	redisAsyncContext *ac = conn->ctx;
+
+	msg_debug_rpool ("kill shared connection %p, %ud users", ac, conn->users);
+	conn->ctx = NULL;
+
+	if (conn->entry) {
+		g_queue_unlink (conn->elt->active, conn->entry);
+		g_list_free (conn->entry);
+		conn->entry = NULL;
+	}
+
+	if (!(ac->c.flags & REDIS_FREEING)) {
+		ac->onDisconnect = NULL;
+		redisAsyncFree (ac);
+	}
+}
+
+static void
+rspamd_redis_pool_release_shared (struct rspamd_redis_pool_connection *conn,
+		struct redisAsyncContext *ctx, enum rspamd_redis_pool_release_type how)
+{
+	conn->users --;
+
+	if (conn->ctx == NULL) {
+		/* Already killed, we are likely called from a pending callback */
+		REF_RELEASE (conn);
+
+		return;
+	}
+
+	if (ctx->err != REDIS_OK || how == RSPAMD_REDIS_RELEASE_FATAL) {
+		/* Other users receive errors for their pending commands */
+		msg_debug_rpool ("closed shared connection %p due to an error",
+				conn->ctx);
+		REF_RETAIN (conn);
+		rspamd_redis_pool_kill_connection (conn);
+		REF_RELEASE (conn);
+		REF_RELEASE (conn);
+	}
+	else if (conn->users == 0) {
+		if (ctx->replies.head == NULL && how == RSPAMD_REDIS_RELEASE_DEFAULT) {
+			g_queue_unlink (conn->elt->active, conn->entry);
+			g_queue_push_head_link (conn->elt->inactive, conn->entry);
+			conn->state = RSPAMD_REDIS_POOL_CONN_INACTIVE;
+			conn->shared = FALSE;
+			rspamd_redis_pool_schedule_timeout (conn);
+			msg_debug_rpool ("mark shared connection %p inactive", conn->ctx);
+		}
+		else {
+			msg_debug_rpool ("closed shared connection %p", conn->ctx);
+			REF_RELEASE (conn);
+		}
+	}
+
+	REF_RELEASE (conn);
+}
 
 void
 rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
@@ -470,8 +637,13 @@ rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 	g_assert (ctx != NULL);
 
 	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
-	if (conn != NULL) {
+
+	if (conn != NULL && conn->shared) {
+		rspamd_redis_pool_release_shared (conn, ctx, how);
+	}
+	else if (conn != NULL) {
 		g_assert (conn->state == RSPAMD_REDIS_POOL_CONN_ACTIVE);
+		conn->users --;
 
 		if (ctx->err != REDIS_OK) {
 			/* We need to terminate connection forcefully */
@@ -540,6 +712,39 @@ rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
 	g_free (pool);
 }
 
+void
+rspamd_redis_pool_get_stat (struct rspamd_redis_pool *pool,
+		struct rspamd_redis_pool_stat *st)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_redis_pool_elt *elt;
+	GList *cur;
+	struct rspamd_redis_pool_connection *conn;
+
+	g_assert (pool != NULL);
+
+	memcpy (st, &pool->stat, sizeof (*st));
+	st->conns_shared = 0;
+	st->conns_inactive = 0;
+	st->users_shared = 0;
+	g_hash_table_iter_init (&it, pool->elts_by_key);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elt = v;
+		st->conns_inactive += g_queue_get_length (elt->inactive);
+
+		for (cur = elt->active->head; cur != NULL; cur = g_list_next (cur)) {
+			conn = cur->data;
+
+			if (conn->shared) {
+				st->conns_shared ++;
+				st->users_shared += conn->users;
+			}
+		}
+	}
+}
+
 const gchar*
 rspamd_redis_type_to_string (int type)
 {
@@ -44,7 +44,13 @@ void rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
 
 
 /**
- * Create or reuse the specific redis connection
+ * Create or reuse the specific redis connection. If `redis_pool_shared_conns`
+ * is set, the connection might be shared with other callers: their commands
+ * are pipelined and replies are delivered in order, so callers must not use
+ * commands that change connection state across replies (e.g. SUBSCRIBE or
+ * MULTI sent separately from EXEC) and must have commands pending while they
+ * hold the connection. Fatal release of a shared connection fails all
+ * pending commands of all its users.
  * @param pool
  * @param db
  * @param password
@@ -57,6 +63,20 @@ struct redisAsyncContext *rspamd_redis_pool_connect (
 		const gchar *db, const gchar *password,
 		const char *ip, int port);
 
+/**
+ * Create or reuse the specific redis connection that is never shared
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect_exclusive (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
 enum rspamd_redis_pool_release_type {
 	RSPAMD_REDIS_RELEASE_DEFAULT = 0,
 	RSPAMD_REDIS_RELEASE_FATAL = 1,
@@ -72,6 +92,25 @@ void rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 										   struct redisAsyncContext *ctx,
 										   enum rspamd_redis_pool_release_type how);
 
+struct rspamd_redis_pool_stat {
+	guint64 requests; /* Connections requested */
+	guint64 requests_multiplexed; /* Requests served by busy shared connections */
+	guint64 conns_created;
+	guint64 conns_reused; /* Idle connections reused */
+	guint conns_active; /* Connections opened */
+	guint conns_inactive; /* Idle connections */
+	guint conns_shared; /* Shared connections in use */
+	guint users_shared; /* Users of shared connections */
+};
+
+/**
+ * Returns statistics of the pool
+ * @param pool
+ * @param st
+ */
+void rspamd_redis_pool_get_stat (struct rspamd_redis_pool *pool,
+								 struct rspamd_redis_pool_stat *st);
+
 /**
  * Stops redis pool and destroys it
  * @param pool
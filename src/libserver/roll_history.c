@@ -100,6 +100,7 @@ rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
 	guint row_num;
+	guint64 idx;
 	struct roll_history_row *row;
 	struct rspamd_scan_result *metric_res;
 	struct history_metric_callback_data cbdata;
@@ -109,23 +110,16 @@ rspamd_roll_history_update (struct roll_history *history,
 		return;
 	}
 
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, history->nrows, 0);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
-#else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
-#endif
-
-	if (row_num < history->nrows) {
-		row = &history->rows[row_num];
-		g_atomic_int_set (&row->completed, FALSE);
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
-		return;
-	}
+	/*
+	 * Reserve a slot: a 64 bit counter never wraps, so concurrent writers
+	 * always get distinct slots and no rows are lost on the boundary
+	 */
+	idx = __atomic_fetch_add (&history->next_row, 1, __ATOMIC_RELAXED);
+	row_num = idx % history->nrows;
+	/* Only a hint for readers where the oldest row is */
+	g_atomic_int_set (&history->cur_row, (row_num + 1) % history->nrows);
+	row = &history->rows[row_num];
+	g_atomic_int_set (&row->completed, FALSE);
 
 	/* Add information from task to roll history */
 	if (task->from_addr) {
@@ -178,6 +172,12 @@ rspamd_roll_history_update (struct roll_history *history,
 
 	row->scan_time = task->time_real_finish - task->task_timestamp;
 	row->len = task->msg.len;
+	row->cpu_time = task->resources.cpu_time;
+	row->mempool_bytes = task->resources.mempool_bytes;
+	row->lua_heap = task->resources.lua_heap_delta;
+	row->re_bytes = task->resources.re_bytes;
+	row->dns_requests = task->dns_requests;
+	row->redis_requests = task->resources.redis_requests;
 	g_atomic_int_set (&row->completed, TRUE);
 }
 
@@ -328,6 +328,42 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 				row->scan_time = ucl_object_todouble (elt);
 			}
 
+			elt = ucl_object_lookup (cur, "cpu_time");
+
+			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
+				row->cpu_time = ucl_object_todouble (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "mempool_bytes");
+
+			if (elt && ucl_object_type (elt) == UCL_INT) {
+				row->mempool_bytes = ucl_object_toint (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "lua_heap");
+
+			if (elt && ucl_object_type (elt) == UCL_INT) {
+				row->lua_heap = ucl_object_toint (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "re_bytes");
+
+			if (elt && ucl_object_type (elt) == UCL_INT) {
+				row->re_bytes = ucl_object_toint (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "dns_requests");
+
+			if (elt && ucl_object_type (elt) == UCL_INT) {
+				row->dns_requests = ucl_object_toint (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "redis_requests");
+
+			if (elt && ucl_object_type (elt) == UCL_INT) {
+				row->redis_requests = ucl_object_toint (elt);
+			}
+
 			elt = ucl_object_lookup (cur, "score");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
@@ -352,7 +388,8 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 
 	ucl_object_unref (top);
 
-	history->cur_row = n;
+	history->cur_row = n % history->nrows;
+	history->next_row = n;
 
 	return TRUE;
 }
@@ -410,6 +447,18 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 				"len", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromdouble (row->scan_time),
 				"scan_time", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (row->cpu_time),
+				"cpu_time", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (row->mempool_bytes),
+				"mempool_bytes", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (row->lua_heap),
+				"lua_heap", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (row->re_bytes),
+				"re_bytes", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (row->dns_requests),
+				"dns_requests", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (row->redis_requests),
+				"redis_requests", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromdouble (row->score),
 				"score", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromdouble (row->required_score),
@@ -44,17 +44,29 @@ struct roll_history_row {
 	gchar from_addr[HISTORY_MAX_ADDR];
 	gsize len;
 	gdouble scan_time;
+	gdouble cpu_time;
+	gsize mempool_bytes;
+	gint64 lua_heap;
+	guint64 re_bytes;
+	guint32 dns_requests;
+	guint32 redis_requests;
 	gdouble score;
 	gdouble required_score;
 	gint action;
 	guint completed;
 };
 
+/*
+ * History is allocated in shared memory before workers are forked, workers
+ * append rows directly: a slot is reserved by an atomic increment of
+ * `next_row`, so no locks or messages to the main process are needed
+ */
 struct roll_history {
 	struct roll_history_row *rows;
 	gboolean disabled;
 	guint nrows;
-	guint cur_row;
+	guint cur_row;                  /**< the oldest row (next to be overwritten)	*/
+	guint64 next_row;              /**< number of rows ever reserved				*/
 };
 
 /**
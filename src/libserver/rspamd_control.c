@@ -102,8 +102,32 @@ static const struct rspamd_control_cmd_match {
 				},
 				.type = RSPAMD_CONTROL_FUZZY_SYNC
 		},
+		{
+				.name = {
+						.begin = "/symbols_trace",
+						.len = sizeof ("/symbols_trace") - 1
+				},
+				.type = RSPAMD_CONTROL_SYMBOLS_TRACE
+		},
+		{
+				.name = {
+						.begin = "/mempool",
+						.len = sizeof ("/mempool") - 1
+				},
+				.type = RSPAMD_CONTROL_MEMPOOL_PROFILE
+		},
+		{
+				.name = {
+						.begin = "/lua_profile",
+						.len = sizeof ("/lua_profile") - 1
+				},
+				.type = RSPAMD_CONTROL_LUA_PROFILE
+		},
 };
 
+/* Number of allocation sites reported by mempool command */
+#define CONTROL_MEMPOOL_SITES 100
+
 static void rspamd_control_ignore_io_handler (int fd, short what, void *ud);
 
 static void
@@ -192,16 +216,29 @@ rspamd_control_connection_close (struct rspamd_control_session *session)
 static void
 rspamd_control_write_reply (struct rspamd_control_session *session)
 {
-	ucl_object_t *rep, *cur, *workers;
+	ucl_object_t *rep, *cur, *workers, *trace_events = NULL, *lua_stacks = NULL;
 	struct rspamd_control_reply_elt *elt;
 	gchar tmpbuf[64];
-	gdouble total_utime = 0, total_systime = 0;
 	struct ucl_parser *parser;
-	guint total_conns = 0;
+
+	if (session->cmd.type == RSPAMD_CONTROL_STAT) {
+		rep = rspamd_worker_load_stat_ucl (session->rspamd_main);
+		rspamd_control_send_ucl (session, rep);
+		ucl_object_unref (rep);
+
+		return;
+	}
 
 	rep = ucl_object_typed_new (UCL_OBJECT);
 	workers = ucl_object_typed_new (UCL_OBJECT);
 
+	if (session->cmd.type == RSPAMD_CONTROL_SYMBOLS_TRACE) {
+		trace_events = ucl_object_typed_new (UCL_ARRAY);
+	}
+	else if (session->cmd.type == RSPAMD_CONTROL_LUA_PROFILE) {
+		lua_stacks = ucl_object_typed_new (UCL_OBJECT);
+	}
+
 	DL_FOREACH (session->replies, elt) {
 		/* Skip incompatible worker for fuzzy_stat */
 		if ((session->cmd.type == RSPAMD_CONTROL_FUZZY_STAT ||
@@ -217,24 +254,6 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 				elt->wrk_type)), "type", 0, false);
 
 		switch (session->cmd.type) {
-		case RSPAMD_CONTROL_STAT:
-			ucl_object_insert_key (cur, ucl_object_fromint (
-					elt->reply.reply.stat.conns), "conns", 0, false);
-			ucl_object_insert_key (cur, ucl_object_fromdouble (
-					elt->reply.reply.stat.utime), "utime", 0, false);
-			ucl_object_insert_key (cur, ucl_object_fromdouble (
-					elt->reply.reply.stat.systime), "systime", 0, false);
-			ucl_object_insert_key (cur, ucl_object_fromdouble (
-					elt->reply.reply.stat.uptime), "uptime", 0, false);
-			ucl_object_insert_key (cur, ucl_object_fromint (
-					elt->reply.reply.stat.maxrss), "maxrss", 0, false);
-
-			total_utime += elt->reply.reply.stat.utime;
-			total_systime += elt->reply.reply.stat.systime;
-			total_conns += elt->reply.reply.stat.conns;
-
-			break;
-
 		case RSPAMD_CONTROL_RELOAD:
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.reload.status), "status", 0, false);
@@ -297,6 +316,75 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.fuzzy_sync.status), "status", 0, false);
 			break;
+		case RSPAMD_CONTROL_SYMBOLS_TRACE:
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.symbols_trace.status), "status", 0, false);
+
+			if (elt->attached_fd != -1) {
+				const ucl_object_t *events, *ev;
+				ucl_object_t *top;
+				ucl_object_iter_t it = NULL;
+
+				parser = ucl_parser_new (0);
+
+				if (ucl_parser_add_fd (parser, elt->attached_fd)) {
+					top = ucl_parser_get_object (parser);
+					events = ucl_object_lookup (top, "traceEvents");
+					ucl_object_insert_key (cur, ucl_object_fromint (
+							ucl_array_size (events)), "events", 0, false);
+
+					/* Merge all workers events into a single trace */
+					while ((ev = ucl_object_iterate (events, &it, true)) != NULL) {
+						ucl_array_append (trace_events, ucl_object_ref (ev));
+					}
+
+					ucl_object_unref (top);
+				}
+				else {
+					ucl_object_insert_key (cur, ucl_object_fromstring (
+							ucl_parser_get_error (parser)), "error", 0, false);
+				}
+
+				ucl_parser_free (parser);
+			}
+			break;
+		case RSPAMD_CONTROL_LUA_PROFILE:
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.lua_profile.status), "status", 0, false);
+
+			if (elt->attached_fd != -1) {
+				const ucl_object_t *stacks, *st, *prev;
+				ucl_object_t *top;
+				ucl_object_iter_t it = NULL;
+
+				parser = ucl_parser_new (0);
+
+				if (ucl_parser_add_fd (parser, elt->attached_fd)) {
+					top = ucl_parser_get_object (parser);
+					ucl_object_insert_key (cur, ucl_object_fromint (
+							ucl_object_toint (ucl_object_lookup (top, "samples"))),
+							"samples", 0, false);
+					stacks = ucl_object_lookup (top, "stacks");
+
+					/* Sum samples of the same stacks from all workers */
+					while ((st = ucl_object_iterate (stacks, &it, true)) != NULL) {
+						prev = ucl_object_lookup (lua_stacks, ucl_object_key (st));
+						ucl_object_replace_key (lua_stacks,
+								ucl_object_fromint (ucl_object_toint (st) +
+										(prev ? ucl_object_toint (prev) : 0)),
+								ucl_object_key (st), 0, true);
+					}
+
+					ucl_object_unref (top);
+				}
+				else {
+					ucl_object_insert_key (cur, ucl_object_fromstring (
+							ucl_parser_get_error (parser)), "error", 0, false);
+				}
+
+				ucl_parser_free (parser);
+			}
+			break;
 		default:
 			break;
 		}
@@ -311,17 +399,18 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 
 	ucl_object_insert_key (rep, workers, "workers", 0, false);
 
-	if (session->cmd.type == RSPAMD_CONTROL_STAT) {
-		/* Total stats */
-		cur = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (cur, ucl_object_fromint (
-				total_conns), "conns", 0, false);
-		ucl_object_insert_key (cur, ucl_object_fromdouble (
-				total_utime), "utime", 0, false);
-		ucl_object_insert_key (cur, ucl_object_fromdouble (
-				total_systime), "systime", 0, false);
-
-		ucl_object_insert_key (rep, cur, "total", 0, false);
+	if (trace_events) {
+		ucl_object_insert_key (rep, trace_events, "traceEvents", 0, false);
+		ucl_object_insert_key (rep, ucl_object_fromstring ("ms"),
+				"displayTimeUnit", 0, false);
+	}
+	else if (lua_stacks) {
+		ucl_object_insert_key (rep, lua_stacks, "stacks", 0, false);
+	}
+	else if (session->cmd.type == RSPAMD_CONTROL_MEMPOOL_PROFILE) {
+		ucl_object_insert_key (rep,
+				rspamd_worker_mempool_profile (CONTROL_MEMPOOL_SITES),
+				"sites", 0, false);
 	}
 
 	rspamd_control_send_ucl (session, rep);
@@ -535,6 +624,14 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		if (!found) {
 			rspamd_control_send_error (session, 404, "Command not defined");
 		}
+		else if (session->cmd.type == RSPAMD_CONTROL_MEMPOOL_PROFILE ||
+				session->cmd.type == RSPAMD_CONTROL_STAT) {
+			/*
+			 * Sites and workers stats are collected in the shared memory,
+			 * so slow or busy workers cannot delay the reply
+			 */
+			rspamd_control_write_reply (session);
+		}
 		else {
 			/* Send command to all workers */
 			session->replies = rspamd_control_broadcast_cmd (
@@ -625,6 +722,11 @@ rspamd_control_default_cmd_handler (gint fd,
 	case RSPAMD_CONTROL_FUZZY_SYNC:
 	case RSPAMD_CONTROL_LOG_PIPE:
 	case RSPAMD_CONTROL_CHILD_CHANGE:
+	case RSPAMD_CONTROL_SYMBOLS_TRACE:
+	case RSPAMD_CONTROL_HYPERSCAN_MAP_COMPILE:
+	case RSPAMD_CONTROL_HYPERSCAN_MAP_LOADED:
+	case RSPAMD_CONTROL_MEMPOOL_PROFILE:
+	case RSPAMD_CONTROL_LUA_PROFILE:
 		break;
 	case RSPAMD_CONTROL_RERESOLVE:
 		if (cd->worker->srv->cfg) {
@@ -979,6 +1081,27 @@ rspamd_srv_handler (EV_P_ ev_io *w, int revents)
 				worker->hb.last_event = ev_time ();
 				rdata->rep.reply.heartbeat.status = 0;
 				break;
+			case RSPAMD_SRV_READY:
+				worker->ready = TRUE;
+				rdata->rep.reply.ready.status = 0;
+
+				if (srv->worker_ready_cb) {
+					srv->worker_ready_cb (srv, worker);
+				}
+				break;
+			case RSPAMD_SRV_HYPERSCAN_MAP_COMPILE:
+			case RSPAMD_SRV_HYPERSCAN_MAP_LOADED:
+				/* Compile requests are handled by hs_helper, results by scanners */
+				memset (&wcmd, 0, sizeof (wcmd));
+				wcmd.type = cmd.type == RSPAMD_SRV_HYPERSCAN_MAP_COMPILE ?
+						RSPAMD_CONTROL_HYPERSCAN_MAP_COMPILE :
+						RSPAMD_CONTROL_HYPERSCAN_MAP_LOADED;
+				rspamd_strlcpy (wcmd.cmd.hs_map.path,
+						cmd.cmd.hs_map.path,
+						sizeof (wcmd.cmd.hs_map.path));
+				rspamd_control_broadcast_cmd (srv, &wcmd, rfd,
+						rspamd_control_ignore_io_handler, NULL, worker->pid);
+				break;
 			default:
 				msg_err ("unknown command type: %d", cmd.type);
 				break;
@@ -1211,6 +1334,21 @@ rspamd_control_command_from_string (const gchar *str)
 	else if (g_ascii_strcasecmp (str, "child_change") == 0) {
 		ret = RSPAMD_CONTROL_CHILD_CHANGE;
 	}
+	else if (g_ascii_strcasecmp (str, "symbols_trace") == 0) {
+		ret = RSPAMD_CONTROL_SYMBOLS_TRACE;
+	}
+	else if (g_ascii_strcasecmp (str, "hyperscan_map_compile") == 0) {
+		ret = RSPAMD_CONTROL_HYPERSCAN_MAP_COMPILE;
+	}
+	else if (g_ascii_strcasecmp (str, "hyperscan_map_loaded") == 0) {
+		ret = RSPAMD_CONTROL_HYPERSCAN_MAP_LOADED;
+	}
+	else if (g_ascii_strcasecmp (str, "mempool_profile") == 0) {
+		ret = RSPAMD_CONTROL_MEMPOOL_PROFILE;
+	}
+	else if (g_ascii_strcasecmp (str, "lua_profile") == 0) {
+		ret = RSPAMD_CONTROL_LUA_PROFILE;
+	}
 
 	return ret;
 }
@@ -1251,6 +1389,21 @@ rspamd_control_command_to_string (enum rspamd_control_type cmd)
 	case RSPAMD_CONTROL_CHILD_CHANGE:
 		reply = "child_change";
 		break;
+	case RSPAMD_CONTROL_SYMBOLS_TRACE:
+		reply = "symbols_trace";
+		break;
+	case RSPAMD_CONTROL_HYPERSCAN_MAP_COMPILE:
+		reply = "hyperscan_map_compile";
+		break;
+	case RSPAMD_CONTROL_HYPERSCAN_MAP_LOADED:
+		reply = "hyperscan_map_loaded";
+		break;
+	case RSPAMD_CONTROL_MEMPOOL_PROFILE:
+		reply = "mempool_profile";
+		break;
+	case RSPAMD_CONTROL_LUA_PROFILE:
+		reply = "lua_profile";
+		break;
 	default:
 		break;
 	}
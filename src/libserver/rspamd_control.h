@@ -38,6 +38,11 @@ enum rspamd_control_type {
 	RSPAMD_CONTROL_FUZZY_SYNC,
 	RSPAMD_CONTROL_MONITORED_CHANGE,
 	RSPAMD_CONTROL_CHILD_CHANGE,
+	RSPAMD_CONTROL_SYMBOLS_TRACE,
+	RSPAMD_CONTROL_HYPERSCAN_MAP_COMPILE,
+	RSPAMD_CONTROL_HYPERSCAN_MAP_LOADED,
+	RSPAMD_CONTROL_MEMPOOL_PROFILE,
+	RSPAMD_CONTROL_LUA_PROFILE,
 	RSPAMD_CONTROL_MAX
 };
 
@@ -48,6 +53,9 @@ enum rspamd_srv_type {
 	RSPAMD_SRV_LOG_PIPE,
 	RSPAMD_SRV_ON_FORK,
 	RSPAMD_SRV_HEARTBEAT,
+	RSPAMD_SRV_HYPERSCAN_MAP_COMPILE,
+	RSPAMD_SRV_HYPERSCAN_MAP_LOADED,
+	RSPAMD_SRV_READY,
 };
 
 enum rspamd_log_pipe_type {
@@ -96,6 +104,15 @@ struct rspamd_control_command {
 			pid_t pid;
 			guint additional;
 		} child_change;
+		struct {
+			guint unused;
+		} symbols_trace;
+		struct {
+			gchar path[CONTROL_PATHLEN];
+		} hs_map;
+		struct {
+			guint unused;
+		} lua_profile;
 	} cmd;
 };
 
@@ -134,6 +151,15 @@ struct rspamd_control_reply {
 		struct {
 			guint status;
 		} fuzzy_sync;
+		struct {
+			guint status;
+		} symbols_trace;
+		struct {
+			guint status;
+		} hs_map;
+		struct {
+			guint status;
+		} lua_profile;
 	} reply;
 };
 
@@ -172,6 +198,9 @@ struct rspamd_srv_command {
 			guint status;
 			/* TODO: add more fields */
 		} heartbeat;
+		struct {
+			gchar path[CONTROL_PATHLEN];
+		} hs_map;
 	} cmd;
 };
 
@@ -197,6 +226,9 @@ struct rspamd_srv_reply {
 		struct {
 			gint status;
 		} heartbeat;
+		struct {
+			gint status;
+		} ready;
 	} reply;
 };
 
@@ -19,12 +19,14 @@
 #include "message.h"
 #include "rspamd_symcache.h"
 #include "cfg_file.h"
+#include "cfg_file_private.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
 #include "contrib/t1ha/t1ha.h"
 #include "libserver/worker_util.h"
 #include "khash.h"
 #include "utlist.h"
+#include "libutil/probes.h"
 #include <math.h>
 
 #if defined(__STDC_VERSION__) &&  __STDC_VERSION__ >= 201112L
@@ -54,19 +56,36 @@
 
 INIT_LOG_MODULE(symcache)
 
+/*
+ * Per item state is stored in dense bitsets of the checkpoint indexed by
+ * the item id, dynamic items are used merely for the async state
+ */
+#define SYMCACHE_BIT_WORDS(n) (((n) + 63) / 64)
+#define CHECK_BIT_ID(bits, id) (((bits)[(id) >> 6u] & (1ULL << ((id) & 63u))) != 0)
+#define SET_BIT_ID(bits, id) ((bits)[(id) >> 6u] |= (1ULL << ((id) & 63u)))
+#define CLR_BIT_ID(bits, id) ((bits)[(id) >> 6u] &= ~(1ULL << ((id) & 63u)))
+#define DYN_ITEM_ID(checkpoint, dyn_item) \
+	((guint)((dyn_item) - (checkpoint)->dynamic_items))
+
 #define CHECK_START_BIT(checkpoint, dyn_item) \
-	((dyn_item)->started)
+	CHECK_BIT_ID((checkpoint)->started, DYN_ITEM_ID(checkpoint, dyn_item))
 #define SET_START_BIT(checkpoint, dyn_item) \
-	(dyn_item)->started = 1
+	SET_BIT_ID((checkpoint)->started, DYN_ITEM_ID(checkpoint, dyn_item))
 #define CLR_START_BIT(checkpoint, dyn_item) \
-	(dyn_item)->started = 0
+	CLR_BIT_ID((checkpoint)->started, DYN_ITEM_ID(checkpoint, dyn_item))
 
 #define CHECK_FINISH_BIT(checkpoint, dyn_item) \
-	((dyn_item)->finished)
+	CHECK_BIT_ID((checkpoint)->finished, DYN_ITEM_ID(checkpoint, dyn_item))
 #define SET_FINISH_BIT(checkpoint, dyn_item) \
-	(dyn_item)->finished = 1
+	rspamd_symcache_set_finish_bit(checkpoint, DYN_ITEM_ID(checkpoint, dyn_item))
 #define CLR_FINISH_BIT(checkpoint, dyn_item) \
-	(dyn_item)->finished = 0
+	rspamd_symcache_clear_finish_bit(checkpoint, DYN_ITEM_ID(checkpoint, dyn_item))
+
+#define SET_DISABLED_BIT(checkpoint, dyn_item) \
+	SET_BIT_ID((checkpoint)->disabled, DYN_ITEM_ID(checkpoint, dyn_item))
+#define CLR_DISABLED_BIT(checkpoint, dyn_item) \
+	CLR_BIT_ID((checkpoint)->disabled, DYN_ITEM_ID(checkpoint, dyn_item))
+
 static const guchar rspamd_symcache_magic[8] = {'r', 's', 'c', 2, 0, 0, 0, 0 };
 
 struct rspamd_symcache_header {
@@ -76,8 +95,61 @@ struct rspamd_symcache_header {
 	guchar unused[128];
 };
 
+/*
+ * Flat (struct of arrays) representation of a symbols stage: it is compiled
+ * when items are sorted and it is immutable afterwards, so the hot loop of
+ * the symbols processing touches contiguous memory and dereferences an item
+ * only when it is going to be executed
+ */
+struct symcache_plan {
+	struct rspamd_symcache_item **items;
+	gint *ids;
+	guint *flags;
+	gint *priorities;
+	guint nitems;
+};
+
+enum symcache_plan_stage {
+	SYMCACHE_PLAN_CONNFILTERS = 0,
+	SYMCACHE_PLAN_PREFILTERS,
+	SYMCACHE_PLAN_FILTERS,
+	SYMCACHE_PLAN_POSTFILTERS,
+	SYMCACHE_PLAN_IDEMPOTENT,
+	SYMCACHE_PLAN_MAX,
+};
+
+/*
+ * Settings id specific plan: static allowed/forbidden/exec-only checks are
+ * evaluated once per settings id when the order is compiled
+ */
+struct symcache_settings_plan {
+	guint32 id;
+	guint nitems;
+	guint nvirtual;
+	/* Indexed by id for real items and by nitems + id for virtual ones */
+	guint64 *allow_exec;
+	guint64 *allow_insert;
+	/* Execution plans with items that are not allowed to be executed pruned */
+	struct symcache_plan plans[SYMCACHE_PLAN_MAX];
+};
+
+KHASH_INIT (rspamd_symcache_settings_plans, guint32,
+		struct symcache_settings_plan *, true,
+		kh_int_hash_func, kh_int_hash_equal);
+
 struct symcache_order {
 	GPtrArray *d;
+	struct symcache_plan plans[SYMCACHE_PLAN_MAX];
+	khash_t(rspamd_symcache_settings_plans) *settings_plans;
+	/*
+	 * Maximum positive and negative score contributions of real items
+	 * (including their virtual children) indexed by item id
+	 */
+	gdouble *max_pos;
+	gdouble *max_neg;
+	gdouble total_pos;
+	gdouble total_neg;
+	guint nbounds;
 	guint id;
 	ref_entry_t ref;
 };
@@ -98,6 +170,18 @@ struct rspamd_symcache_id_list {
 	};
 };
 
+/* Postfilter is executed only if any of these symbols or actions is matched */
+struct rspamd_symcache_triggers {
+	GPtrArray *symbols; /* Names, resolved to items in post init */
+	struct rspamd_symcache_item **items;
+	guint nitems;
+	guint actions; /* Mask of RSPAMD_SYMCACHE_ACTION_BIT */
+};
+
+#define RSPAMD_SYMCACHE_ACTION_BIT(act) ((act) < METRIC_ACTION_MAX ? \
+	(1u << (act)) : \
+	(1u << (METRIC_ACTION_MAX + MIN ((act) - METRIC_ACTION_CUSTOM, 2))))
+
 struct rspamd_symcache_condition {
 	gint cb;
 	struct rspamd_symcache_condition *prev, *next;
@@ -108,7 +192,6 @@ struct rspamd_symcache_item {
 	struct rspamd_symcache_item_stat *st;
 
 	guint64 last_count;
-	struct rspamd_counter_data *cd;
 	gchar *symbol;
 	const gchar *type_descr;
 	gint type;
@@ -147,6 +230,7 @@ struct rspamd_symcache_item {
 	/* Dependencies */
 	GPtrArray *deps;
 	GPtrArray *rdeps;
+	struct rspamd_symcache_triggers *triggers;
 
 	/* Container */
 	GPtrArray *container;
@@ -177,13 +261,86 @@ struct rspamd_symcache {
 	gdouble reload_time;
 	gdouble last_profile;
 	gint peak_cb;
+	struct rspamd_symcache_cpu_pool *cpu_pool;
+	struct symcache_trace_ring *trace_ring;
+	/* Shared between processes, bumped when aggregated stats are updated */
+	guint *stats_generation;
+	guint last_generation;
+};
+
+/* Sampled timeline of a single task, allocated in the task pool */
+struct symcache_trace_async {
+	const gchar *subsystem;
+	const gchar *loc;
+	gdouble start;
+	gdouble end;
+	struct symcache_trace_async *next;
+};
+
+struct symcache_trace_item {
+	gdouble start;
+	gdouble end;
+	gdouble cpu; /* Time spent in the item callback itself */
+	struct symcache_trace_async *async;
+};
+
+struct symcache_task_trace {
+	struct rspamd_symcache *cache;
+	struct symcache_trace_ring *ring;
+	guint32 seq;
+	guint nitems;
+	struct symcache_trace_item items[];
+};
+
+/* Per worker ring of finished trace events, strings are owned by the cache */
+struct symcache_trace_event {
+	const gchar *name;
+	const gchar *loc; /* NULL for items, source location for async events */
+	gdouble start;
+	gdouble dur;
+	gdouble cpu;
+	guint32 seq;
+};
+
+struct symcache_trace_ring {
+	struct symcache_trace_event *events;
+	guint size;
+	guint pos;
+	gboolean full;
+	guint32 ntasks;
+	pid_t pid;
+};
+
+/* Per worker threads to run SYMBOL_TYPE_CPU_PARALLEL items work */
+struct rspamd_symcache_cpu_pool {
+	GThreadPool *threads;
+	GAsyncQueue *done; /* Finished jobs to be processed in the event loop */
+	struct ev_loop *event_loop;
+	ev_async wakeup;
+	pid_t pid; /* Pool is process specific and is not inherited on fork */
+};
+
+enum rspamd_symcache_offload_state {
+	RSPAMD_SYMCACHE_OFFLOAD_RUNNING = 0,
+	RSPAMD_SYMCACHE_OFFLOAD_DONE,
+	RSPAMD_SYMCACHE_OFFLOAD_FINALISED,
+};
+
+struct rspamd_symcache_offload_job {
+	struct rspamd_task *task;
+	struct rspamd_symcache_item *item;
+	symbol_offload_work_t work;
+	symbol_offload_fin_t fin;
+	gpointer ud;
+	struct rspamd_symcache_cpu_pool *pool;
+	GMutex mtx;
+	GCond cond;
+	enum rspamd_symcache_offload_state state;
 };
 
 struct rspamd_symcache_dynamic_item {
 	guint16 start_msec; /* Relative to task time */
-	unsigned started:1;
-	unsigned finished:1;
-	/* unsigned pad:14; */
+	guint16 pad;
 	guint32 async_events;
 };
 
@@ -208,20 +365,64 @@ struct delayed_cache_condition {
 };
 
 struct cache_savepoint {
-	guint version;
 	guint items_inflight;
 	gboolean profile;
 	gboolean has_slow;
+	/* Filters started by a bulk task since it has yielded */
+	guint bulk_items;
 	gdouble profile_start;
 
 	struct rspamd_scan_result *rs;
 	gdouble lim;
+	/* Score contributions that unfinished items can still add */
+	gboolean score_bounds;
+	gdouble rem_pos;
+	gdouble rem_neg;
 
 	struct rspamd_symcache_item *cur_item;
 	struct symcache_order *order;
+	/* Cached settings plan for the current settings id */
+	const struct symcache_settings_plan *settings_plan;
+	/* Number of real and virtual items when the checkpoint was created */
+	guint nitems;
+	guint nvirtual;
+	/* Bitsets indexed by a real item id */
+	guint64 *started;
+	guint64 *finished;
+	guint64 *disabled;
+	/* Indexed by id for real items and by nitems + id for virtual ones */
+	guint64 *has_result;
+	/* NULL unless the task is sampled for tracing */
+	struct symcache_task_trace *trace;
 	struct rspamd_symcache_dynamic_item dynamic_items[];
 };
 
+static inline void
+rspamd_symcache_set_finish_bit (struct cache_savepoint *checkpoint, guint id)
+{
+	if (!CHECK_BIT_ID (checkpoint->finished, id)) {
+		SET_BIT_ID (checkpoint->finished, id);
+
+		if (checkpoint->score_bounds && id < checkpoint->order->nbounds) {
+			checkpoint->rem_pos -= checkpoint->order->max_pos[id];
+			checkpoint->rem_neg -= checkpoint->order->max_neg[id];
+		}
+	}
+}
+
+static inline void
+rspamd_symcache_clear_finish_bit (struct cache_savepoint *checkpoint, guint id)
+{
+	if (CHECK_BIT_ID (checkpoint->finished, id)) {
+		CLR_BIT_ID (checkpoint->finished, id);
+
+		if (checkpoint->score_bounds && id < checkpoint->order->nbounds) {
+			checkpoint->rem_pos += checkpoint->order->max_pos[id];
+			checkpoint->rem_neg += checkpoint->order->max_neg[id];
+		}
+	}
+}
+
 struct rspamd_cache_refresh_cbdata {
 	gdouble last_resort;
 	ev_timer resort_ev;
@@ -245,6 +446,14 @@ struct rspamd_cache_refresh_cbdata {
 		* ((f) > 0 ? (f) : FREQ_ALPHA) \
 		/ (t > TIME_ALPHA ? t : TIME_ALPHA))
 
+/* Cost based order: hit rate * weight / time */
+#define COST_TIME_MIN (0.01) /* Milliseconds */
+#define COST_HIT_RATE_PRIOR (0.01)
+#define COST_MIN_CHECKS (100)
+#define COST_SCORE_FUN(w, h, t) (((w) > 0 ? (w) : WEIGHT_ALPHA) \
+		* (h) \
+		/ ((t) > COST_TIME_MIN ? (t) : COST_TIME_MIN))
+
 static gboolean rspamd_symcache_check_symbol (struct rspamd_task *task,
 		struct rspamd_symcache *cache,
 		struct rspamd_symcache_item *item,
@@ -259,12 +468,40 @@ static void rspamd_symcache_disable_symbol_checkpoint (struct rspamd_task *task,
 		struct rspamd_symcache *cache, const gchar *symbol);
 static void rspamd_symcache_enable_symbol_checkpoint (struct rspamd_task *task,
 		struct rspamd_symcache *cache, const gchar *symbol);
+static gboolean rspamd_symcache_settings_allow (
+		const struct rspamd_symcache_item *item,
+		guint32 id,
+		enum rspamd_config_settings_policy policy,
+		gboolean exec_only);
 
 static void
 rspamd_symcache_order_dtor (gpointer p)
 {
 	struct symcache_order *ord = p;
+	struct symcache_settings_plan *splan;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (ord->plans); i ++) {
+		/* All arrays are allocated as a single chunk */
+		g_free (ord->plans[i].items);
+	}
 
+	if (ord->settings_plans) {
+		kh_foreach_value (ord->settings_plans, splan, {
+			for (i = 0; i < G_N_ELEMENTS (splan->plans); i ++) {
+				g_free (splan->plans[i].items);
+			}
+
+			/* Both bitsets are allocated as a single chunk */
+			g_free (splan->allow_exec);
+			g_free (splan);
+		});
+
+		kh_destroy (rspamd_symcache_settings_plans, ord->settings_plans);
+	}
+
+	/* Both arrays are allocated as a single chunk */
+	g_free (ord->max_pos);
 	g_ptr_array_free (ord->d, TRUE);
 	g_free (ord);
 }
@@ -297,6 +534,67 @@ rspamd_symcache_order_new (struct rspamd_symcache *cache,
 	return ord;
 }
 
+/*
+ * Compiles plan for items, if `mask` is not NULL, then merely items with
+ * the corresponding bit set are included
+ */
+static void
+rspamd_symcache_plan_compile (struct symcache_plan *plan,
+							  GPtrArray *items,
+							  const guint64 *mask)
+{
+	struct rspamd_symcache_item *it;
+	gsize elt_size;
+	guchar *p;
+	guint i, n = 0;
+
+	g_free (plan->items);
+	memset (plan, 0, sizeof (*plan));
+
+	if (items == NULL || items->len == 0) {
+		return;
+	}
+
+	if (mask) {
+		PTR_ARRAY_FOREACH (items, i, it) {
+			if (CHECK_BIT_ID (mask, it->id)) {
+				n ++;
+			}
+		}
+	}
+	else {
+		n = items->len;
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	elt_size = sizeof (*plan->items) + sizeof (*plan->ids) +
+			sizeof (*plan->flags) + sizeof (*plan->priorities);
+	/* Pointers go first to keep all arrays properly aligned */
+	p = g_malloc (elt_size * n);
+	plan->items = (struct rspamd_symcache_item **)p;
+	p += sizeof (*plan->items) * n;
+	plan->ids = (gint *)p;
+	p += sizeof (*plan->ids) * n;
+	plan->flags = (guint *)p;
+	p += sizeof (*plan->flags) * n;
+	plan->priorities = (gint *)p;
+
+	PTR_ARRAY_FOREACH (items, i, it) {
+		if (mask && !CHECK_BIT_ID (mask, it->id)) {
+			continue;
+		}
+
+		plan->items[plan->nitems] = it;
+		plan->ids[plan->nitems] = it->id;
+		plan->flags[plan->nitems] = it->type;
+		plan->priorities[plan->nitems] = it->priority;
+		plan->nitems ++;
+	}
+}
+
 static inline struct rspamd_symcache_dynamic_item*
 rspamd_symcache_get_dynamic (struct cache_savepoint *checkpoint,
 							 struct rspamd_symcache_item *item)
@@ -457,6 +755,95 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	return 0;
 }
 
+/*
+ * Orders independent filters by the expected benefit per time unit, so
+ * the filters that are likely to trigger a terminal action go first
+ */
+static gint
+cache_cost_cmp (const void *p1, const void *p2, gpointer ud)
+{
+	const struct rspamd_symcache_item *i1 = *(struct rspamd_symcache_item **)p1,
+			*i2 = *(struct rspamd_symcache_item **)p2;
+	double w1, w2;
+	guint o1 = TSORT_UNMASK (i1), o2 = TSORT_UNMASK (i2);
+
+	if (o1 == o2) {
+		if (i1->priority == i2->priority) {
+			w1 = COST_SCORE_FUN (fabs (i1->st->weight),
+					i1->st->hit_rate, i1->st->avg_time);
+			w2 = COST_SCORE_FUN (fabs (i2->st->weight),
+					i2->st->hit_rate, i2->st->avg_time);
+		}
+		else {
+			/* Strict sorting */
+			w1 = abs (i1->priority);
+			w2 = abs (i2->priority);
+		}
+	}
+	else {
+		w1 = o1;
+		w2 = o2;
+	}
+
+	if (w2 > w1) {
+		return 1;
+	}
+	else if (w2 < w1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline gdouble
+rspamd_symcache_hit_rate (guint64 hits, guint64 checks)
+{
+	if (checks < COST_MIN_CHECKS) {
+		/* Not enough data, use prior with the observed data */
+		return (hits + COST_HIT_RATE_PRIOR * COST_MIN_CHECKS) /
+				(gdouble)(checks + COST_MIN_CHECKS);
+	}
+
+	return MIN (1.0, (gdouble)hits / (gdouble)checks);
+}
+
+/*
+ * Learn hit rate of filters from the items stats: virtual symbols hits are
+ * accounted to their parents as they are executed merely by a parent
+ */
+static void
+rspamd_symcache_update_hit_rates (struct rspamd_symcache *cache)
+{
+	struct rspamd_symcache_item *it, *parent;
+	guint64 *hits;
+	guint i;
+
+	hits = g_malloc0 (sizeof (*hits) * cache->items_by_id->len);
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+		/* Also count hits that are not yet accumulated */
+		hits[i] = it->st->total_hits + it->st->hits;
+	}
+
+	PTR_ARRAY_FOREACH (cache->virtual, i, it) {
+		if (!(it->type & SYMBOL_TYPE_GHOST)) {
+			parent = it->specific.virtual.parent_item;
+
+			if (parent && parent->id >= 0 &&
+				parent->id < (gint)cache->items_by_id->len) {
+				hits[parent->id] += it->st->total_hits + it->st->hits;
+			}
+		}
+	}
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+		it->st->hit_rate = rspamd_symcache_hit_rate (hits[i],
+				it->st->total_checks);
+	}
+
+	g_free (hits);
+}
+
 static void
 rspamd_symcache_tsort_visit (struct rspamd_symcache *cache,
 								  struct rspamd_symcache_item *it,
@@ -494,6 +881,153 @@ rspamd_symcache_tsort_visit (struct rspamd_symcache *cache,
 	TSORT_MARK_PERM (it);
 }
 
+static void
+rspamd_symcache_compile_plans (struct rspamd_symcache *cache,
+							   struct symcache_order *ord,
+							   struct symcache_plan *plans,
+							   const guint64 *mask)
+{
+	rspamd_symcache_plan_compile (&plans[SYMCACHE_PLAN_CONNFILTERS],
+			cache->connfilters, mask);
+	rspamd_symcache_plan_compile (&plans[SYMCACHE_PLAN_PREFILTERS],
+			cache->prefilters, mask);
+	rspamd_symcache_plan_compile (&plans[SYMCACHE_PLAN_FILTERS],
+			ord->d, mask);
+	rspamd_symcache_plan_compile (&plans[SYMCACHE_PLAN_POSTFILTERS],
+			cache->postfilters, mask);
+	rspamd_symcache_plan_compile (&plans[SYMCACHE_PLAN_IDEMPOTENT],
+			cache->idempotent, mask);
+}
+
+static void
+rspamd_symcache_compile_settings_plans (struct rspamd_symcache *cache,
+										struct symcache_order *ord)
+{
+	struct rspamd_config_settings_elt *elt;
+	struct symcache_settings_plan *splan;
+	struct rspamd_symcache_item *it;
+	gsize nwords;
+	khiter_t k;
+	gint res;
+	guint i;
+
+	ord->settings_plans = kh_init (rspamd_symcache_settings_plans);
+
+	DL_FOREACH (cache->cfg->setting_ids, elt) {
+		k = kh_put (rspamd_symcache_settings_plans, ord->settings_plans,
+				elt->id, &res);
+
+		if (res == 0) {
+			/* Duplicate id, the first one wins as in settings lookup */
+			continue;
+		}
+
+		splan = g_malloc0 (sizeof (*splan));
+		splan->id = elt->id;
+		splan->nitems = cache->items_by_id->len;
+		splan->nvirtual = cache->virtual->len;
+		nwords = SYMCACHE_BIT_WORDS (splan->nitems + splan->nvirtual);
+		splan->allow_exec = g_malloc0 (nwords * 2 * sizeof (guint64));
+		splan->allow_insert = splan->allow_exec + nwords;
+
+		PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+			if (rspamd_symcache_settings_allow (it, elt->id, elt->policy, TRUE)) {
+				SET_BIT_ID (splan->allow_exec, it->id);
+			}
+			if (rspamd_symcache_settings_allow (it, elt->id, elt->policy, FALSE)) {
+				SET_BIT_ID (splan->allow_insert, it->id);
+			}
+		}
+
+		PTR_ARRAY_FOREACH (cache->virtual, i, it) {
+			if (rspamd_symcache_settings_allow (it, elt->id, elt->policy, TRUE)) {
+				SET_BIT_ID (splan->allow_exec, splan->nitems + it->id);
+			}
+			if (rspamd_symcache_settings_allow (it, elt->id, elt->policy, FALSE)) {
+				SET_BIT_ID (splan->allow_insert, splan->nitems + it->id);
+			}
+		}
+
+		rspamd_symcache_compile_plans (cache, ord, splan->plans,
+				splan->allow_exec);
+		kh_value (ord->settings_plans, k) = splan;
+
+		msg_debug_cache ("compiled plan for settings id %ud (%s): %ud filters "
+				"of %ud are allowed", elt->id, elt->name,
+				splan->plans[SYMCACHE_PLAN_FILTERS].nitems, ord->d->len);
+	}
+}
+
+static inline void
+rspamd_symcache_add_bound (struct rspamd_symcache *cache,
+						   struct symcache_order *ord,
+						   gint id,
+						   const gchar *symbol)
+{
+	struct rspamd_symbol *sdef;
+	gdouble w;
+
+	if (symbol == NULL || id < 0 || id >= (gint)ord->nbounds) {
+		return;
+	}
+
+	sdef = g_hash_table_lookup (cache->cfg->symbols, symbol);
+
+	if (sdef == NULL || sdef->weight_ptr == NULL) {
+		return;
+	}
+
+	w = *sdef->weight_ptr;
+
+	if (w > 0) {
+		ord->max_pos[id] += w;
+		ord->total_pos += w;
+	}
+	else {
+		ord->max_neg[id] += -w;
+		ord->total_neg += -w;
+	}
+}
+
+/*
+ * Calculates maximum score contribution of each real item: its own symbol
+ * and all virtual symbols, idempotent items cannot change the metric
+ */
+static void
+rspamd_symcache_compile_bounds (struct rspamd_symcache *cache,
+								struct symcache_order *ord)
+{
+	struct rspamd_symcache_item *it, *parent;
+	guint i;
+
+	ord->nbounds = cache->items_by_id->len;
+	ord->total_pos = 0;
+	ord->total_neg = 0;
+
+	if (ord->nbounds == 0) {
+		return;
+	}
+
+	ord->max_pos = g_malloc0 (sizeof (gdouble) * ord->nbounds * 2);
+	ord->max_neg = ord->max_pos + ord->nbounds;
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+		if (!(it->type & SYMBOL_TYPE_IDEMPOTENT)) {
+			rspamd_symcache_add_bound (cache, ord, it->id, it->symbol);
+		}
+	}
+
+	PTR_ARRAY_FOREACH (cache->virtual, i, it) {
+		if (!(it->type & SYMBOL_TYPE_GHOST)) {
+			parent = it->specific.virtual.parent_item;
+
+			if (parent && !(parent->type & SYMBOL_TYPE_IDEMPOTENT)) {
+				rspamd_symcache_add_bound (cache, ord, parent->id, it->symbol);
+			}
+		}
+	}
+}
+
 static void
 rspamd_symcache_resort (struct rspamd_symcache *cache)
 {
@@ -528,9 +1062,21 @@ rspamd_symcache_resort (struct rspamd_symcache *cache)
 	 * Now we have all sorted and can do some heuristical sort, keeping
 	 * topological order invariant
 	 */
-	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
+	if (cache->cfg->cache_cost_order) {
+		/* Hit rates are updated by the primary controller only */
+		g_ptr_array_sort_with_data (ord->d, cache_cost_cmp, cache);
+	}
+	else {
+		g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
+	}
+
 	cache->total_hits = total_hits;
 
+	/* Compile flat execution plans for all stages */
+	rspamd_symcache_compile_plans (cache, ord, ord->plans, NULL);
+	rspamd_symcache_compile_settings_plans (cache, ord);
+	rspamd_symcache_compile_bounds (cache, ord);
+
 	if (cache->items_by_order) {
 		REF_RELEASE (cache->items_by_order);
 	}
@@ -680,6 +1226,36 @@ rspamd_symcache_process_dep (struct rspamd_symcache *cache,
 	}
 }
 
+/* Resolves symbols that trigger a postfilter */
+static void
+rspamd_symcache_resolve_triggers (struct rspamd_symcache *cache,
+		struct rspamd_symcache_item *it)
+{
+	struct rspamd_symcache_triggers *tr = it->triggers;
+	struct rspamd_symcache_item *trig;
+	const gchar *name;
+	guint i;
+
+	tr->items = rspamd_mempool_alloc0 (cache->static_pool,
+			sizeof (*tr->items) * tr->symbols->len);
+	tr->nitems = 0;
+
+	PTR_ARRAY_FOREACH (tr->symbols, i, name) {
+		trig = rspamd_symcache_find_filter (cache, name, false);
+
+		if (trig == NULL) {
+			/* Better to execute a postfilter than to miss it */
+			msg_err_cache ("cannot find trigger %s for postfilter %s, "
+					"disable triggers for it", name, it->symbol);
+			it->triggers = NULL;
+
+			return;
+		}
+
+		tr->items[tr->nitems ++] = trig;
+	}
+}
+
 /* Sort items in logical order */
 static void
 rspamd_symcache_post_init (struct rspamd_symcache *cache)
@@ -734,6 +1310,12 @@ rspamd_symcache_post_init (struct rspamd_symcache *cache)
 		cur = g_list_next (cur);
 	}
 
+	PTR_ARRAY_FOREACH (cache->postfilters, i, it) {
+		if (it->triggers && it->triggers->symbols) {
+			rspamd_symcache_resolve_triggers (cache, it);
+		}
+	}
+
 	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
 
 		PTR_ARRAY_FOREACH (it->deps, j, dep) {
@@ -888,6 +1470,18 @@ rspamd_symcache_load_items (struct rspamd_symcache *cache, const gchar *name)
 			if (elt) {
 				item->st->total_hits = ucl_object_toint (elt);
 				item->last_count = item->st->total_hits;
+			item->st->total_checks += item->st->checks;
+			g_atomic_int_set (&item->st->checks, 0);
+			}
+
+			elt = ucl_object_lookup (cur, "checks");
+			if (elt) {
+				item->st->total_checks = ucl_object_toint (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "hit_rate");
+			if (elt) {
+				item->st->hit_rate = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "frequency");
@@ -999,6 +1593,11 @@ rspamd_symcache_save_items (struct rspamd_symcache *cache, const gchar *name)
 				"time", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromint (item->st->total_hits),
 				"count", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (item->st->total_checks),
+				"checks", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (item->st->hit_rate),
+				"hit_rate", 0, false);
 
 		freq = ucl_object_typed_new (UCL_OBJECT);
 		ucl_object_insert_key (freq,
@@ -1105,13 +1704,6 @@ rspamd_symcache_add_symbol (struct rspamd_symcache *cache,
 	item->st = rspamd_mempool_alloc0_shared (cache->static_pool,
 			sizeof (*item->st));
 	item->enabled = TRUE;
-
-	/*
-	 * We do not share cd to skip locking, instead we'll just calculate it on
-	 * save or accumulate
-	 */
-	item->cd = rspamd_mempool_alloc0 (cache->static_pool,
-			sizeof (struct rspamd_counter_data));
 	item->priority = priority;
 	item->type = type;
 
@@ -1291,6 +1883,9 @@ rspamd_symcache_save (struct rspamd_symcache *cache)
 	}
 }
 
+static void rspamd_symcache_cpu_pool_destroy (
+		struct rspamd_symcache_cpu_pool *pool);
+
 void
 rspamd_symcache_destroy (struct rspamd_symcache *cache)
 {
@@ -1326,6 +1921,15 @@ rspamd_symcache_destroy (struct rspamd_symcache *cache)
 			g_list_free (cache->delayed_conditions);
 		}
 
+		if (cache->cpu_pool && cache->cpu_pool->pid == getpid ()) {
+			rspamd_symcache_cpu_pool_destroy (cache->cpu_pool);
+		}
+
+		if (cache->trace_ring && cache->trace_ring->pid == getpid ()) {
+			g_free (cache->trace_ring->events);
+			g_free (cache->trace_ring);
+		}
+
 		g_hash_table_destroy (cache->items_by_symbol);
 		g_ptr_array_free (cache->items_by_id, TRUE);
 		rspamd_mempool_delete (cache->static_pool);
@@ -1371,6 +1975,8 @@ rspamd_symcache_new (struct rspamd_config *cfg)
 	cache->cksum = 0xdeadbabe;
 	cache->peak_cb = -1;
 	cache->id = (guint)rspamd_random_uint64_fast ();
+	cache->stats_generation = rspamd_mempool_alloc0_shared (cache->static_pool,
+			sizeof (*cache->stats_generation));
 
 	return cache;
 }
@@ -1558,6 +2164,9 @@ rspamd_symcache_validate (struct rspamd_symcache *cache,
 		}
 	}
 
+	/* Priorities and flags might have been changed, so recompile the plan */
+	rspamd_symcache_resort (cache);
+
 	return ret;
 }
 
@@ -1600,9 +2209,50 @@ rspamd_symcache_metric_limit (struct rspamd_task *task,
 	return FALSE;
 }
 
-static inline gboolean
-rspamd_symcache_check_id_list (const struct rspamd_symcache_id_list *ls, guint32 id)
-{
+/*
+ * Returns TRUE if the remaining items cannot move the score over any action
+ * threshold, so the action of the task is locked
+ */
+static gboolean
+rspamd_symcache_score_locked (struct rspamd_task *task,
+							  struct cache_savepoint *cp)
+{
+	struct rspamd_scan_result *res = task->result;
+	gdouble lo, hi, lim;
+	const gdouble epsilon = 1e-6;
+	guint i;
+
+	if (!cp->score_bounds || res == NULL) {
+		return FALSE;
+	}
+
+	if ((task->flags & RSPAMD_TASK_FLAG_PASS_ALL) || task->settings != NULL ||
+		res->passthrough_result != NULL) {
+		/* Scores or actions can be altered, so bounds are not reliable */
+		return FALSE;
+	}
+
+	lo = res->score - MAX (cp->rem_neg, 0) - epsilon;
+	hi = res->score + MAX (cp->rem_pos, 0) + epsilon;
+
+	for (i = 0; i < res->nactions; i ++) {
+		lim = res->actions_limits[i].cur_limit;
+
+		if (isnan (lim)) {
+			continue;
+		}
+
+		if (lim > lo && lim <= hi) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static inline gboolean
+rspamd_symcache_check_id_list (const struct rspamd_symcache_id_list *ls, guint32 id)
+{
 	guint i;
 
 	if (ls->dyn.e == -1) {
@@ -1627,6 +2277,90 @@ rspamd_symcache_check_id_list (const struct rspamd_symcache_id_list *ls, guint32
 	return FALSE;
 }
 
+/*
+ * Static part of the settings checks, it does not depend on a task
+ */
+static gboolean
+rspamd_symcache_settings_allow (const struct rspamd_symcache_item *item,
+								guint32 id,
+								enum rspamd_config_settings_policy policy,
+								gboolean exec_only)
+{
+	if (item->forbidden_ids.st[0] != 0 &&
+		rspamd_symcache_check_id_list (&item->forbidden_ids, id)) {
+		return FALSE;
+	}
+
+	if (!(item->type & SYMBOL_TYPE_EXPLICIT_DISABLE)) {
+		if (item->allowed_ids.st[0] == 0 ||
+			!rspamd_symcache_check_id_list (&item->allowed_ids, id)) {
+
+			if (policy == RSPAMD_SETTINGS_POLICY_IMPLICIT_ALLOW) {
+				return TRUE;
+			}
+
+			if (exec_only &&
+				rspamd_symcache_check_id_list (&item->exec_only_ids, id)) {
+				return TRUE;
+			}
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Returns precompiled settings plan for the current settings id of a task
+ * (if any)
+ */
+static const struct symcache_settings_plan *
+rspamd_symcache_get_settings_plan (struct rspamd_task *task)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+	khiter_t k;
+
+	if (task->settings_elt == NULL || checkpoint == NULL ||
+		checkpoint->order->settings_plans == NULL) {
+		return NULL;
+	}
+
+	if (checkpoint->settings_plan &&
+		checkpoint->settings_plan->id == task->settings_elt->id) {
+		return checkpoint->settings_plan;
+	}
+
+	k = kh_get (rspamd_symcache_settings_plans, checkpoint->order->settings_plans,
+			task->settings_elt->id);
+
+	if (k != kh_end (checkpoint->order->settings_plans)) {
+		checkpoint->settings_plan = kh_value (checkpoint->order->settings_plans, k);
+	}
+	else {
+		checkpoint->settings_plan = NULL;
+	}
+
+	return checkpoint->settings_plan;
+}
+
+static inline const struct symcache_plan *
+rspamd_symcache_select_plan (struct rspamd_task *task,
+							 struct cache_savepoint *checkpoint,
+							 enum symcache_plan_stage stage)
+{
+	const struct symcache_settings_plan *splan;
+
+	splan = rspamd_symcache_get_settings_plan (task);
+
+	if (splan) {
+		/* Start from a pre-filtered plan */
+		return &splan->plans[stage];
+	}
+
+	return &checkpoint->order->plans[stage];
+}
+
 gboolean
 rspamd_symcache_is_item_allowed (struct rspamd_task *task,
 								 struct rspamd_symcache_item *item,
@@ -1666,6 +2400,38 @@ rspamd_symcache_is_item_allowed (struct rspamd_task *task,
 	/* Settings checks */
 	if (task->settings_elt != 0) {
 		guint32 id = task->settings_elt->id;
+		const struct symcache_settings_plan *splan;
+
+		splan = rspamd_symcache_get_settings_plan (task);
+
+		if (splan) {
+			gint idx = -1;
+
+			if (!item->is_virtual && item->id >= 0 &&
+				item->id < (gint)splan->nitems) {
+				idx = item->id;
+			}
+			else if (item->is_virtual && item->id >= 0 &&
+					 item->id < (gint)splan->nvirtual) {
+				idx = splan->nitems + item->id;
+			}
+
+			if (idx >= 0) {
+				if (!CHECK_BIT_ID (exec_only ? splan->allow_exec : splan->allow_insert,
+						idx)) {
+					msg_debug_cache_task ("deny %s of %s as it is not allowed for "
+										  "settings id %ud; symbol type=%s",
+							what,
+							item->symbol,
+							id,
+							item->type_descr);
+
+					return FALSE;
+				}
+
+				return TRUE;
+			}
+		}
 
 		if (item->forbidden_ids.st[0] != 0 &&
 			rspamd_symcache_check_id_list (&item->forbidden_ids,
@@ -1822,8 +2588,25 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 		dyn_item->async_events = 0;
 		checkpoint->cur_item = item;
 		checkpoint->items_inflight ++;
-		/* Callback now must finalize itself */
-		item->specific.normal.func (task, item, item->specific.normal.user_data);
+		g_atomic_int_inc (&item->st->checks);
+		RSPAMD_PROBE2 (symbol__start, task, item->symbol);
+
+		if (G_UNLIKELY (checkpoint->trace)) {
+			struct symcache_trace_item *titem =
+					&checkpoint->trace->items[item->id];
+
+			titem->start = rspamd_get_ticks (FALSE);
+			/* Callback now must finalize itself */
+			item->specific.normal.func (task, item,
+					item->specific.normal.user_data);
+			titem->cpu = rspamd_get_ticks (FALSE) - titem->start;
+		}
+		else {
+			/* Callback now must finalize itself */
+			item->specific.normal.func (task, item,
+					item->specific.normal.user_data);
+		}
+
 		checkpoint->cur_item = NULL;
 
 		if (checkpoint->items_inflight == 0) {
@@ -1841,6 +2624,7 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 	}
 	else {
 		SET_FINISH_BIT (checkpoint, dyn_item);
+		SET_DISABLED_BIT (checkpoint, dyn_item);
 	}
 
 	return TRUE;
@@ -1940,6 +2724,142 @@ rspamd_symcache_check_deps (struct rspamd_task *task,
 	return ret;
 }
 
+static struct symcache_trace_ring *
+rspamd_symcache_trace_ring_get (struct rspamd_symcache *cache)
+{
+	struct symcache_trace_ring *ring;
+
+	if (cache->trace_ring && cache->trace_ring->pid == getpid ()) {
+		return cache->trace_ring;
+	}
+
+	/* Events of the parent process are not interesting, so start a new ring */
+	ring = g_malloc0 (sizeof (*ring));
+	ring->size = MAX (cache->cfg->cache_trace_events, 1);
+	ring->events = g_malloc0 (sizeof (*ring->events) * ring->size);
+	ring->pid = getpid ();
+	cache->trace_ring = ring;
+
+	return ring;
+}
+
+static inline void
+rspamd_symcache_trace_push (struct symcache_trace_ring *ring,
+		const gchar *name, const gchar *loc,
+		gdouble start, gdouble end, gdouble cpu, guint32 seq)
+{
+	struct symcache_trace_event *ev = &ring->events[ring->pos];
+
+	ev->name = name;
+	ev->loc = loc;
+	ev->start = start;
+	ev->dur = end > start ? end - start : 0.0;
+	ev->cpu = cpu;
+	ev->seq = seq;
+
+	if (++ring->pos == ring->size) {
+		ring->pos = 0;
+		ring->full = TRUE;
+	}
+}
+
+/* Moves a task timeline to the worker's ring when the task is destroyed */
+static void
+rspamd_symcache_trace_flush (gpointer ud)
+{
+	struct symcache_task_trace *trace = ud;
+	struct symcache_trace_item *titem;
+	struct symcache_trace_async *tasync;
+	struct rspamd_symcache_item *item;
+	struct rspamd_symcache *cache = trace->cache;
+	gdouble now = rspamd_get_ticks (FALSE);
+	guint i;
+
+	for (i = 0; i < trace->nitems; i ++) {
+		titem = &trace->items[i];
+
+		if (titem->start == 0) {
+			continue;
+		}
+
+		item = g_ptr_array_index (cache->items_by_id, i);
+		rspamd_symcache_trace_push (trace->ring, item->symbol, NULL,
+				titem->start, titem->end > 0 ? titem->end : now,
+				titem->cpu, trace->seq);
+
+		LL_FOREACH (titem->async, tasync) {
+			rspamd_symcache_trace_push (trace->ring, tasync->subsystem,
+					tasync->loc, tasync->start,
+					tasync->end > 0 ? tasync->end : now,
+					0.0, trace->seq);
+		}
+	}
+}
+
+static void
+rspamd_symcache_trace_start (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct cache_savepoint *checkpoint)
+{
+	struct symcache_trace_ring *ring;
+	struct symcache_task_trace *trace;
+	guint32 seq;
+
+	ring = rspamd_symcache_trace_ring_get (cache);
+	seq = ring->ntasks ++;
+
+	if (seq % task->cfg->cache_trace_sample != 0) {
+		return;
+	}
+
+	trace = rspamd_mempool_alloc0 (task->task_pool, sizeof (*trace) +
+			sizeof (trace->items[0]) * checkpoint->nitems);
+	trace->ring = ring;
+	trace->cache = cache;
+	trace->seq = seq;
+	trace->nitems = checkpoint->nitems;
+	checkpoint->trace = trace;
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_symcache_trace_flush, trace);
+	msg_debug_cache_task ("trace symbols execution for task, sequence %ud",
+			seq);
+}
+
+static void
+rspamd_symcache_trace_async (struct rspamd_task *task,
+		struct symcache_task_trace *trace,
+		struct rspamd_symcache_item *item,
+		const gchar *subsystem,
+		const gchar *loc,
+		gboolean start)
+{
+	struct symcache_trace_item *titem;
+	struct symcache_trace_async *tasync;
+
+	if (item->id < 0 || (guint)item->id >= trace->nitems) {
+		return;
+	}
+
+	titem = &trace->items[item->id];
+
+	if (start) {
+		tasync = rspamd_mempool_alloc0 (task->task_pool, sizeof (*tasync));
+		tasync->subsystem = subsystem;
+		tasync->loc = loc;
+		tasync->start = rspamd_get_ticks (FALSE);
+		LL_PREPEND (titem->async, tasync);
+	}
+	else {
+		/* Close the most recent pending event of the same subsystem */
+		LL_FOREACH (titem->async, tasync) {
+			if (tasync->end == 0 && strcmp (tasync->subsystem, subsystem) == 0) {
+				tasync->end = rspamd_get_ticks (FALSE);
+				break;
+			}
+		}
+	}
+}
+
 static struct cache_savepoint *
 rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 		struct rspamd_symcache *cache)
@@ -1959,9 +2879,28 @@ rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 	checkpoint = rspamd_mempool_alloc0 (task->task_pool,
 			sizeof (*checkpoint) +
 			sizeof (struct rspamd_symcache_dynamic_item) * cache->items_by_id->len);
+	checkpoint->nitems = cache->items_by_id->len;
+	checkpoint->nvirtual = cache->virtual->len;
+
+	/* All bitsets are allocated as a single chunk */
+	gsize nwords = SYMCACHE_BIT_WORDS (checkpoint->nitems),
+		nres_words = SYMCACHE_BIT_WORDS (checkpoint->nitems + checkpoint->nvirtual);
+	guint64 *bits = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (guint64) * (nwords * 3 + nres_words));
+
+	if (task->cfg->cache_score_bound_stop && task->cfg->grow_factor <= 1.0) {
+		/* Grow factor can increase scores, so it is incompatible with bounds */
+		checkpoint->score_bounds = TRUE;
+		checkpoint->rem_pos = cache->items_by_order->total_pos;
+		checkpoint->rem_neg = cache->items_by_order->total_neg;
+	}
+
+	checkpoint->started = bits;
+	checkpoint->finished = bits + nwords;
+	checkpoint->disabled = bits + nwords * 2;
+	checkpoint->has_result = bits + nwords * 3;
 
 	g_assert (cache->items_by_order != NULL);
-	checkpoint->version = cache->items_by_order->d->len;
 	checkpoint->order = cache->items_by_order;
 	REF_RETAIN (checkpoint->order);
 	rspamd_mempool_add_destructor (task->task_pool,
@@ -1980,6 +2919,10 @@ rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 		cache->last_profile = now;
 	}
 
+	if (task->cfg->cache_trace_sample > 0) {
+		rspamd_symcache_trace_start (task, cache, checkpoint);
+	}
+
 	task->checkpoint = checkpoint;
 
 	return checkpoint;
@@ -2082,6 +3025,145 @@ rspamd_symcache_process_settings (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Checks if any trigger of a postfilter matches, the current action is
+ * evaluated once per stage pass and cached in `pcur_action`
+ */
+static gboolean
+rspamd_symcache_item_triggered (struct rspamd_task *task,
+		struct rspamd_symcache_item *item,
+		gint *pcur_action)
+{
+	struct rspamd_symcache_triggers *tr = item->triggers;
+	struct rspamd_action *act;
+	guint i;
+
+	for (i = 0; i < tr->nitems; i ++) {
+		if (rspamd_symcache_item_has_result (task, tr->items[i])) {
+			return TRUE;
+		}
+	}
+
+	if (tr->actions != 0) {
+		if (*pcur_action == -1) {
+			act = rspamd_check_action_metric (task, NULL, NULL);
+			*pcur_action = act ? act->action_type : METRIC_ACTION_NOACTION;
+		}
+
+		if (tr->actions & RSPAMD_SYMCACHE_ACTION_BIT (*pcur_action)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+struct rspamd_symcache_yield_cbdata {
+	struct rspamd_task *task;
+	struct rspamd_async_event *event;
+	struct ev_timer tm;
+};
+
+static void
+rspamd_symcache_yield_fin (gpointer ud)
+{
+	struct rspamd_symcache_yield_cbdata *cbd =
+			(struct rspamd_symcache_yield_cbdata *)ud;
+
+	ev_timer_stop (cbd->task->event_loop, &cbd->tm);
+}
+
+static void
+rspamd_symcache_yield_cb (EV_P_ ev_timer *w, int what)
+{
+	struct rspamd_symcache_yield_cbdata *cbd =
+			(struct rspamd_symcache_yield_cbdata *)w->data;
+
+	cbd->event = NULL;
+	/* Processing is resumed by the session finaliser */
+	rspamd_session_remove_event (cbd->task->s,
+			rspamd_symcache_yield_fin, cbd);
+}
+
+static void
+rspamd_symcache_yield_dtor (gpointer d)
+{
+	struct rspamd_symcache_yield_cbdata *cbd =
+			(struct rspamd_symcache_yield_cbdata *)d;
+
+	if (cbd->event) {
+		rspamd_session_remove_event (cbd->task->s,
+				rspamd_symcache_yield_fin, cbd);
+		cbd->event = NULL;
+	}
+}
+
+static gboolean
+rspamd_symcache_task_is_bulk (struct rspamd_task *task)
+{
+	if (task->flags & RSPAMD_TASK_FLAG_BULK) {
+		return TRUE;
+	}
+
+	if (task->settings_elt && task->cfg->bulk_settings_ids &&
+		g_hash_table_lookup (task->cfg->bulk_settings_ids,
+				task->settings_elt->name)) {
+		task->flags |= RSPAMD_TASK_FLAG_BULK;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Bulk tasks give way to other tasks of a worker after each `bulk_yield_items`
+ * started filters: processing is continued from a timer with the lowest
+ * priority, so libev invokes pending callbacks of other tasks first
+ */
+static gboolean
+rspamd_symcache_maybe_yield (struct rspamd_task *task,
+		struct cache_savepoint *checkpoint)
+{
+	struct rspamd_symcache_yield_cbdata *cbd;
+
+	if (task->cfg->bulk_yield_items == 0 || !rspamd_symcache_task_is_bulk (task)) {
+		return FALSE;
+	}
+
+	if (++checkpoint->bulk_items < task->cfg->bulk_yield_items) {
+		return FALSE;
+	}
+
+	checkpoint->bulk_items = 0;
+
+	if (task->worker == NULL || task->worker->nconns <= 1) {
+		/* Nobody is waiting */
+		return FALSE;
+	}
+
+	cbd = rspamd_mempool_alloc (task->task_pool, sizeof (*cbd));
+	cbd->task = task;
+	cbd->event = rspamd_session_add_event (task->s,
+			rspamd_symcache_yield_fin, cbd, "symcache");
+
+	if (cbd->event == NULL) {
+		/* Session is being destroyed */
+		return FALSE;
+	}
+
+	msg_debug_cache_task ("yield bulk task, %ud connections are active",
+			task->worker->nconns);
+	ev_timer_init (&cbd->tm, rspamd_symcache_yield_cb, 0.0, 0.0);
+	ev_set_priority (&cbd->tm, EV_MINPRI);
+	cbd->tm.data = cbd;
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_symcache_yield_dtor, cbd);
+	ev_timer_start (task->event_loop, &cbd->tm);
+
+	return TRUE;
+}
+
 gboolean
 rspamd_symcache_process_symbols (struct rspamd_task *task,
 								 struct rspamd_symcache *cache,
@@ -2090,9 +3172,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 	struct rspamd_symcache_item *item = NULL;
 	struct rspamd_symcache_dynamic_item *dyn_item;
 	struct cache_savepoint *checkpoint;
+	const struct symcache_plan *plan;
 	gint i;
 	gboolean all_done = TRUE;
-	gint saved_priority;
+	gint saved_priority, cur_action = -1;
 	guint start_events_pending;
 
 	g_assert (cache != NULL);
@@ -2113,10 +3196,11 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		/* Check for connection filters */
 		saved_priority = G_MININT;
 		all_done = TRUE;
+		plan = rspamd_symcache_select_plan (task, checkpoint,
+				SYMCACHE_PLAN_CONNFILTERS);
 
-		for (i = 0; i < (gint) cache->connfilters->len; i++) {
-			item = g_ptr_array_index (cache->connfilters, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+		for (i = 0; i < (gint) plan->nitems; i++) {
+			dyn_item = &checkpoint->dynamic_items[plan->ids[i]];
 
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
@@ -2133,10 +3217,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 				/* Check priorities */
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[i];
 				}
 				else {
-					if (item->priority < saved_priority &&
+					if (plan->priorities[i] < saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2146,6 +3230,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 					}
 				}
 
+				item = plan->items[i];
 				rspamd_symcache_check_symbol (task, cache, item,
 						checkpoint);
 				all_done = FALSE;
@@ -2157,10 +3242,11 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		/* Check for prefilters */
 		saved_priority = G_MININT;
 		all_done = TRUE;
+		plan = rspamd_symcache_select_plan (task, checkpoint,
+				SYMCACHE_PLAN_PREFILTERS);
 
-		for (i = 0; i < (gint) cache->prefilters->len; i++) {
-			item = g_ptr_array_index (cache->prefilters, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+		for (i = 0; i < (gint) plan->nitems; i++) {
+			dyn_item = &checkpoint->dynamic_items[plan->ids[i]];
 
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
@@ -2177,10 +3263,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[i];
 				}
 				else {
-					if (item->priority < saved_priority &&
+					if (plan->priorities[i] < saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2190,6 +3276,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 					}
 				}
 
+				item = plan->items[i];
 				rspamd_symcache_check_symbol (task, cache, item,
 						checkpoint);
 				all_done = FALSE;
@@ -2200,21 +3287,23 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 
 	case RSPAMD_TASK_STAGE_FILTERS:
 		all_done = TRUE;
+		plan = rspamd_symcache_select_plan (task, checkpoint,
+				SYMCACHE_PLAN_FILTERS);
 
-		for (i = 0; i < (gint) checkpoint->version; i++) {
+		for (i = 0; i < (gint) plan->nitems; i++) {
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (checkpoint->order->d, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
-			if (item->type & SYMBOL_TYPE_CLASSIFIER) {
+			if (plan->flags[i] & SYMBOL_TYPE_CLASSIFIER) {
 				continue;
 			}
 
+			dyn_item = &checkpoint->dynamic_items[plan->ids[i]];
+
 			if (!CHECK_START_BIT (checkpoint, dyn_item)) {
 				all_done = FALSE;
+				item = plan->items[i];
 
 				if (!rspamd_symcache_check_deps (task, cache, item,
 						checkpoint, 0, FALSE)) {
@@ -2235,9 +3324,13 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 
 					return FALSE;
 				}
+
+				if (rspamd_symcache_maybe_yield (task, checkpoint)) {
+					return FALSE;
+				}
 			}
 
-			if (!(item->type & SYMBOL_TYPE_FINE)) {
+			if (!(plan->flags[i] & SYMBOL_TYPE_FINE)) {
 				if (rspamd_symcache_metric_limit (task, checkpoint)) {
 					msg_info_task ("task has already scored more than %.2f, so do "
 								   "not "
@@ -2246,6 +3339,17 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 					all_done = TRUE;
 					break;
 				}
+				else if (rspamd_symcache_score_locked (task, checkpoint)) {
+					msg_info_task ("action is locked for score %.2f as the "
+								   "remaining filters can add at most %.2f "
+								   "and subtract at most %.2f, so do not plan "
+								   "more checks",
+							task->result->score,
+							checkpoint->rem_pos,
+							checkpoint->rem_neg);
+					all_done = TRUE;
+					break;
+				}
 			}
 		}
 
@@ -2255,14 +3359,15 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		/* Check for postfilters */
 		saved_priority = G_MININT;
 		all_done = TRUE;
+		plan = rspamd_symcache_select_plan (task, checkpoint,
+				SYMCACHE_PLAN_POSTFILTERS);
 
-		for (i = 0; i < (gint) cache->postfilters->len; i++) {
+		for (i = 0; i < (gint) plan->nitems; i++) {
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (cache->postfilters, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+			dyn_item = &checkpoint->dynamic_items[plan->ids[i]];
 
 			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
 				!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
@@ -2277,10 +3382,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[i];
 				}
 				else {
-					if (item->priority > saved_priority &&
+					if (plan->priorities[i] > saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2291,6 +3396,18 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 					}
 				}
 
+				item = plan->items[i];
+
+				if (item->triggers && !rspamd_symcache_item_triggered (task,
+						item, &cur_action)) {
+					msg_debug_cache_task ("skip postfilter %s as none of its "
+										  "triggers matched", item->symbol);
+					SET_START_BIT (checkpoint, dyn_item);
+					SET_FINISH_BIT (checkpoint, dyn_item);
+					SET_DISABLED_BIT (checkpoint, dyn_item);
+					continue;
+				}
+
 				rspamd_symcache_check_symbol (task, cache, item,
 						checkpoint);
 			}
@@ -2301,10 +3418,11 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 	case RSPAMD_TASK_STAGE_IDEMPOTENT:
 		/* Check for postfilters */
 		saved_priority = G_MININT;
+		plan = rspamd_symcache_select_plan (task, checkpoint,
+				SYMCACHE_PLAN_IDEMPOTENT);
 
-		for (i = 0; i < (gint) cache->idempotent->len; i++) {
-			item = g_ptr_array_index (cache->idempotent, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+		for (i = 0; i < (gint) plan->nitems; i++) {
+			dyn_item = &checkpoint->dynamic_items[plan->ids[i]];
 
 			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
 				!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
@@ -2317,10 +3435,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[i];
 				}
 				else {
-					if (item->priority > saved_priority &&
+					if (plan->priorities[i] > saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2329,6 +3447,8 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 						return FALSE;
 					}
 				}
+
+				item = plan->items[i];
 				rspamd_symcache_check_symbol (task, cache, item,
 						checkpoint);
 			}
@@ -2348,6 +3468,24 @@ struct counters_cbdata {
 
 #define ROUND_DOUBLE(x) (floor((x) * 100.0) / 100.0)
 
+static void
+rspamd_symcache_counters_latency (ucl_object_t *obj,
+		const struct rspamd_symcache_item_stat *st)
+{
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (ROUND_DOUBLE (
+					rspamd_symcache_item_stat_percentile (st, 0.5))),
+			"time_p50", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (ROUND_DOUBLE (
+					rspamd_symcache_item_stat_percentile (st, 0.99))),
+			"time_p99", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (ROUND_DOUBLE (
+					rspamd_symcache_item_stat_percentile (st, 0.999))),
+			"time_p999", 0, false);
+}
+
 static void
 rspamd_symcache_counters_cb (gpointer k, gpointer v, gpointer ud)
 {
@@ -2378,6 +3516,7 @@ rspamd_symcache_counters_cb (gpointer k, gpointer v, gpointer ud)
 			ucl_object_insert_key (obj,
 					ucl_object_fromdouble (ROUND_DOUBLE (parent->st->avg_time)),
 					"time", 0, false);
+			rspamd_symcache_counters_latency (obj, parent->st);
 		}
 		else {
 			ucl_object_insert_key (obj,
@@ -2407,6 +3546,7 @@ rspamd_symcache_counters_cb (gpointer k, gpointer v, gpointer ud)
 		ucl_object_insert_key (obj,
 				ucl_object_fromdouble (ROUND_DOUBLE (item->st->avg_time)),
 				"time", 0, false);
+		rspamd_symcache_counters_latency (obj, item->st);
 	}
 
 	ucl_array_append (top, obj);
@@ -2479,11 +3619,18 @@ rspamd_symcache_resort_cb (EV_P_ ev_timer *w, int revents)
 	ev_timer_again (EV_A_ w);
 
 	if (rspamd_worker_is_primary_controller (cbdata->w)) {
-		/* Gather stats from shared execution times */
+		guint hits, checks, runs, generation;
+		guint64 usec;
+
+		/*
+		 * Gather stats from shared counters: we subtract what we have read
+		 * instead of resetting, so concurrent updates from scanners are not lost
+		 */
 		for (i = 0; i < cache->filters->len; i ++) {
 			item = g_ptr_array_index (cache->filters, i);
-			item->st->total_hits += item->st->hits;
-			g_atomic_int_set (&item->st->hits, 0);
+			hits = g_atomic_int_get (&item->st->hits);
+			item->st->total_hits += hits;
+			g_atomic_int_add ((gint *)&item->st->hits, -(gint)hits);
 
 			if (item->last_count > 0 && cbdata->w->index == 0) {
 				/* Calculate frequency */
@@ -2527,20 +3674,51 @@ rspamd_symcache_resort_cb (EV_P_ ev_timer *w, int revents)
 			}
 
 			item->last_count = item->st->total_hits;
+			checks = g_atomic_int_get (&item->st->checks);
+			item->st->total_checks += checks;
+			__atomic_fetch_sub (&item->st->checks, checks, __ATOMIC_RELAXED);
+
+			runs = g_atomic_int_get (&item->st->time_runs);
+			usec = __atomic_load_n (&item->st->time_usec, __ATOMIC_RELAXED);
+
+			if (runs > 0) {
+				__atomic_fetch_sub (&item->st->time_runs, runs, __ATOMIC_RELAXED);
+				__atomic_fetch_sub (&item->st->time_usec, usec, __ATOMIC_RELAXED);
 
-			if (item->cd->number > 0) {
 				if (item->type & (SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_NORMAL)) {
-					item->st->avg_time = item->cd->mean;
 					rspamd_set_counter_ema (&item->st->time_counter,
-							item->st->avg_time, decay_rate);
+							(gdouble)usec / runs / 1e3, decay_rate);
 					item->st->avg_time = item->st->time_counter.mean;
-					memset (item->cd, 0, sizeof (*item->cd));
 				}
 			}
 		}
 
+		if (cache->cfg->cache_cost_order) {
+			rspamd_symcache_update_hit_rates (cache);
+		}
+
 		cbdata->last_resort = cur_ticks;
-		/* We don't do actual sorting due to topological guarantees */
+		/* Let other workers know that they can reorder using the new stats */
+		generation = g_atomic_int_get (cache->stats_generation);
+		g_atomic_int_inc (cache->stats_generation);
+		cache->last_generation = generation + 1;
+
+		if (cache->cfg->cache_cost_order) {
+			rspamd_symcache_resort (cache);
+		}
+	}
+	else if (cache->cfg->cache_cost_order) {
+		guint generation = g_atomic_int_get (cache->stats_generation);
+
+		/*
+		 * Stats are aggregated once by the primary controller, so all workers
+		 * reorder independent filters using the same data; checkpoints keep
+		 * their own order
+		 */
+		if (generation != cache->last_generation) {
+			cache->last_generation = generation;
+			rspamd_symcache_resort (cache);
+		}
 	}
 }
 
@@ -2640,28 +3818,95 @@ rspamd_symcache_find_symbol (struct rspamd_symcache *cache, const gchar *name)
 {
 	struct rspamd_symcache_item *item;
 
-	g_assert (cache != NULL);
+	g_assert (cache != NULL);
+
+	if (name == NULL) {
+		return -1;
+	}
+
+	item = g_hash_table_lookup (cache->items_by_symbol, name);
+
+	if (item != NULL) {
+		return item->id;
+	}
+
+	return -1;
+}
+
+gboolean
+rspamd_symcache_stat_symbol (struct rspamd_symcache *cache,
+							 const gchar *name,
+							 gdouble *frequency,
+							 gdouble *freq_stddev,
+							 gdouble *tm,
+							 guint *nhits)
+{
+	struct rspamd_symcache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (name == NULL) {
+		return FALSE;
+	}
+
+	item = g_hash_table_lookup (cache->items_by_symbol, name);
+
+	if (item != NULL) {
+		*frequency = item->st->avg_frequency;
+		*freq_stddev = sqrt (item->st->stddev_frequency);
+		*tm = item->st->time_counter.mean;
+
+		if (nhits) {
+			*nhits = item->st->hits;
+		}
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+gdouble
+rspamd_symcache_item_stat_percentile (
+		const struct rspamd_symcache_item_stat *st, gdouble q)
+{
+	guint64 total = 0, cur = 0, target, cnt;
+	gdouble lo, hi;
+	guint i;
+
+	for (i = 0; i < RSPAMD_SYMCACHE_TIME_BUCKETS; i ++) {
+		total += g_atomic_int_get (&st->time_hist[i]);
+	}
 
-	if (name == NULL) {
-		return -1;
+	if (total == 0) {
+		return 0.0;
 	}
 
-	item = g_hash_table_lookup (cache->items_by_symbol, name);
+	q = CLAMP (q, 0.0, 1.0);
+	target = MAX (1, (guint64)ceil (q * total));
 
-	if (item != NULL) {
-		return item->id;
+	for (i = 0; i < RSPAMD_SYMCACHE_TIME_BUCKETS; i ++) {
+		cnt = g_atomic_int_get (&st->time_hist[i]);
+
+		if (cnt > 0 && cur + cnt >= target) {
+			lo = i == 0 ? 0.0 : (gdouble)(1ULL << (i - 1));
+			hi = (gdouble)(1ULL << i);
+			/* Linear interpolation inside of a bucket, result is in ms */
+			return (lo + (hi - lo) * (gdouble)(target - cur) / cnt) / 1e3;
+		}
+
+		cur += cnt;
 	}
 
-	return -1;
+	return (gdouble)(1ULL << (RSPAMD_SYMCACHE_TIME_BUCKETS - 1)) / 1e3;
 }
 
 gboolean
-rspamd_symcache_stat_symbol (struct rspamd_symcache *cache,
-							 const gchar *name,
-							 gdouble *frequency,
-							 gdouble *freq_stddev,
-							 gdouble *tm,
-							 guint *nhits)
+rspamd_symcache_stat_symbol_latency (struct rspamd_symcache *cache,
+									 const gchar *name,
+									 gdouble *p50,
+									 gdouble *p99,
+									 gdouble *p999)
 {
 	struct rspamd_symcache_item *item;
 
@@ -2673,19 +3918,28 @@ rspamd_symcache_stat_symbol (struct rspamd_symcache *cache,
 
 	item = g_hash_table_lookup (cache->items_by_symbol, name);
 
-	if (item != NULL) {
-		*frequency = item->st->avg_frequency;
-		*freq_stddev = sqrt (item->st->stddev_frequency);
-		*tm = item->st->time_counter.mean;
+	if (item == NULL) {
+		return FALSE;
+	}
 
-		if (nhits) {
-			*nhits = item->st->hits;
+	if (item->is_virtual) {
+		if (item->type & SYMBOL_TYPE_GHOST) {
+			return FALSE;
 		}
 
-		return TRUE;
+		item = g_ptr_array_index (cache->items_by_id,
+				item->specific.virtual.parent);
 	}
 
-	return FALSE;
+	if (rspamd_symcache_item_stat_percentile (item->st, 1.0) == 0.0) {
+		return FALSE;
+	}
+
+	*p50 = rspamd_symcache_item_stat_percentile (item->st, 0.5);
+	*p99 = rspamd_symcache_item_stat_percentile (item->st, 0.99);
+	*p999 = rspamd_symcache_item_stat_percentile (item->st, 0.999);
+
+	return TRUE;
 }
 
 const gchar *
@@ -2739,6 +3993,7 @@ rspamd_symcache_disable_all_symbols (struct rspamd_task *task,
 		if (!(item->type & (skip_mask))) {
 			SET_FINISH_BIT (checkpoint, dyn_item);
 			SET_START_BIT (checkpoint, dyn_item);
+			SET_DISABLED_BIT (checkpoint, dyn_item);
 		}
 	}
 }
@@ -2765,6 +4020,7 @@ rspamd_symcache_disable_symbol_checkpoint (struct rspamd_task *task,
 		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
 		SET_FINISH_BIT (checkpoint, dyn_item);
 		SET_START_BIT (checkpoint, dyn_item);
+		SET_DISABLED_BIT (checkpoint, dyn_item);
 		msg_debug_cache_task ("disable execution of %s", symbol);
 	}
 	else {
@@ -2792,8 +4048,9 @@ rspamd_symcache_enable_symbol_checkpoint (struct rspamd_task *task,
 
 	if (item) {
 		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-		dyn_item->finished = 0;
-		dyn_item->started = 0;
+		CLR_FINISH_BIT (checkpoint, dyn_item);
+		CLR_START_BIT (checkpoint, dyn_item);
+		CLR_DISABLED_BIT (checkpoint, dyn_item);
 		msg_debug_cache_task ("enable execution of %s", symbol);
 	}
 	else {
@@ -2842,7 +4099,7 @@ rspamd_symcache_is_checked (struct rspamd_task *task,
 
 	if (item) {
 		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-		return dyn_item->started;
+		return CHECK_START_BIT (checkpoint, dyn_item);
 	}
 
 	return FALSE;
@@ -2985,6 +4242,7 @@ rspamd_symcache_enable_symbol (struct rspamd_task *task,
 				ret = TRUE;
 				CLR_START_BIT (checkpoint, dyn_item);
 				CLR_FINISH_BIT (checkpoint, dyn_item);
+				CLR_DISABLED_BIT (checkpoint, dyn_item);
 			}
 			else {
 				msg_debug_task ("cannot enable symbol %s: already started", symbol);
@@ -3021,6 +4279,7 @@ rspamd_symcache_disable_symbol (struct rspamd_task *task,
 				ret = TRUE;
 				SET_START_BIT (checkpoint, dyn_item);
 				SET_FINISH_BIT (checkpoint, dyn_item);
+				SET_DISABLED_BIT (checkpoint, dyn_item);
 			}
 			else {
 				if (!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
@@ -3167,6 +4426,22 @@ rspamd_delayed_timer_dtor (gpointer d)
 /**
  * Finalize the current async element potentially calling its deps
  */
+
+static inline void
+rspamd_symcache_item_hist_add (struct rspamd_symcache_item_stat *st,
+		gdouble ms)
+{
+	gulong usec;
+	guint bucket;
+
+	usec = ms > 0 ? (gulong)(ms * 1e3) : 0;
+	/* g_bit_storage (0) is 1, so zero timings are handled explicitly */
+	bucket = usec == 0 ? 0 :
+			MIN (g_bit_storage (usec), RSPAMD_SYMCACHE_TIME_BUCKETS - 1);
+
+	g_atomic_int_inc (&st->time_hist[bucket]);
+}
+
 void
 rspamd_symcache_finalize_item (struct rspamd_task *task,
 							   struct rspamd_symcache_item *item)
@@ -3201,6 +4476,11 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 
 	msg_debug_cache_task ("process finalize for item %s(%d)", item->symbol, item->id);
 	SET_FINISH_BIT (checkpoint, dyn_item);
+	RSPAMD_PROBE2 (symbol__finish, task, item->symbol);
+
+	if (G_UNLIKELY (checkpoint->trace)) {
+		checkpoint->trace->items[item->id].end = rspamd_get_ticks (FALSE);
+	}
 	checkpoint->items_inflight --;
 	checkpoint->cur_item = NULL;
 
@@ -3230,7 +4510,11 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 		}
 
 		if (rspamd_worker_is_scanner (task->worker)) {
-			rspamd_set_counter (item->cd, diff);
+			/* Aggregated by the primary controller in resort_cb */
+			g_atomic_int_inc (&item->st->time_runs);
+			__atomic_fetch_add (&item->st->time_usec,
+					(guint64)(MAX (diff, 0) * 1e3), __ATOMIC_RELAXED);
+			rspamd_symcache_item_hist_add (item->st, diff);
 		}
 	}
 
@@ -3305,6 +4589,12 @@ rspamd_symcache_item_async_inc_full (struct rspamd_task *task,
 	msg_debug_cache_task ("increase async events counter for %s(%d) = %d + 1; "
 					   "subsystem %s (%s)",
 			item->symbol, item->id, dyn_item->async_events, subsystem, loc);
+
+	if (G_UNLIKELY (checkpoint->trace)) {
+		rspamd_symcache_trace_async (task, checkpoint->trace, item,
+				subsystem, loc, TRUE);
+	}
+
 	return ++dyn_item->async_events;
 }
 
@@ -3323,6 +4613,11 @@ rspamd_symcache_item_async_dec_full (struct rspamd_task *task,
 			item->symbol, item->id, dyn_item->async_events, subsystem, loc);
 	g_assert (dyn_item->async_events > 0);
 
+	if (G_UNLIKELY (checkpoint->trace)) {
+		rspamd_symcache_trace_async (task, checkpoint->trace, item,
+				subsystem, loc, FALSE);
+	}
+
 	return --dyn_item->async_events;
 }
 
@@ -3355,6 +4650,8 @@ rspamd_symcache_add_symbol_flags (struct rspamd_symcache *cache,
 
 	if (item) {
 		item->type |= flags;
+		/* Flags are copied to the execution plan, so it must be recompiled */
+		cache->id ++;
 
 		return TRUE;
 	}
@@ -3376,6 +4673,8 @@ rspamd_symcache_set_symbol_flags (struct rspamd_symcache *cache,
 
 	if (item) {
 		item->type = flags;
+		/* Flags are copied to the execution plan, so it must be recompiled */
+		cache->id ++;
 
 		return TRUE;
 	}
@@ -3410,19 +4709,20 @@ rspamd_symcache_composites_foreach (struct rspamd_task *task,
 	guint i;
 	struct rspamd_symcache_item *item;
 	struct rspamd_symcache_dynamic_item *dyn_item;
+	struct cache_savepoint *checkpoint = task->checkpoint;
 
-	if (task->checkpoint == NULL) {
+	if (checkpoint == NULL) {
 		return;
 	}
 
 	PTR_ARRAY_FOREACH (cache->composites, i, item) {
-		dyn_item = rspamd_symcache_get_dynamic (task->checkpoint, item);
+		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
 
-		if (!CHECK_START_BIT (task->checkpoint, dyn_item)) {
+		if (!CHECK_START_BIT (checkpoint, dyn_item)) {
 			/* Cannot do it due to 2 passes */
-			/* SET_START_BIT (task->checkpoint, dyn_item); */
+			/* SET_START_BIT (checkpoint, dyn_item); */
 			func (item->symbol, item->specific.normal.user_data, fd);
-			SET_FINISH_BIT (task->checkpoint, dyn_item);
+			SET_FINISH_BIT (checkpoint, dyn_item);
 		}
 	}
 }
@@ -3464,6 +4764,9 @@ rspamd_symcache_set_allowed_settings_ids (struct rspamd_symcache *cache,
 		qsort (item->allowed_ids.dyn.n, nids, sizeof (guint32), rspamd_id_cmp);
 	}
 
+	/* Settings plans must be recompiled */
+	cache->id ++;
+
 	return true;
 }
 
@@ -3506,6 +4809,9 @@ rspamd_symcache_set_forbidden_settings_ids (struct rspamd_symcache *cache,
 		qsort (item->forbidden_ids.dyn.n, nids, sizeof (guint32), rspamd_id_cmp);
 	}
 
+	/* Settings plans must be recompiled */
+	cache->id ++;
+
 	return true;
 }
 
@@ -3731,6 +5037,9 @@ rspamd_symcache_process_settings_elt (struct rspamd_symcache *cache,
 			}
 		}
 	}
+
+	/* Settings plans must be recompiled */
+	cache->id ++;
 }
 
 gint
@@ -3832,4 +5141,425 @@ rspamd_symcache_enable_profile (struct rspamd_task *task)
 		msg_debug_cache_task ("enable profiling of symbols for task");
 		checkpoint->profile = TRUE;
 	}
-}
\ No newline at end of file
+}
+
+static inline struct cache_savepoint *
+rspamd_symcache_get_checkpoint (struct rspamd_task *task)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+
+	if (checkpoint == NULL && task->cfg->cache != NULL) {
+		checkpoint = rspamd_symcache_make_checkpoint (task, task->cfg->cache);
+	}
+
+	return checkpoint;
+}
+
+static inline gint
+rspamd_symcache_result_idx (struct cache_savepoint *checkpoint,
+							const struct rspamd_symcache_item *item)
+{
+	gint idx;
+
+	if (item->is_virtual) {
+		if (item->id < 0 || item->id >= (gint)checkpoint->nvirtual) {
+			return -1;
+		}
+
+		idx = checkpoint->nitems + item->id;
+	}
+	else {
+		if (item->id < 0 || item->id >= (gint)checkpoint->nitems) {
+			return -1;
+		}
+
+		idx = item->id;
+	}
+
+	return idx;
+}
+
+guint
+rspamd_symcache_item_status_by_id (struct rspamd_task *task, gint id)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+	guint ret = 0;
+
+	if (checkpoint == NULL || id < 0 || id >= (gint)checkpoint->nitems) {
+		return 0;
+	}
+
+	if (CHECK_BIT_ID (checkpoint->started, id)) {
+		ret |= RSPAMD_SYMCACHE_ITEM_STARTED;
+	}
+	if (CHECK_BIT_ID (checkpoint->finished, id)) {
+		ret |= RSPAMD_SYMCACHE_ITEM_FINISHED;
+	}
+	if (CHECK_BIT_ID (checkpoint->disabled, id)) {
+		ret |= RSPAMD_SYMCACHE_ITEM_DISABLED;
+	}
+	if (CHECK_BIT_ID (checkpoint->has_result, id)) {
+		ret |= RSPAMD_SYMCACHE_ITEM_HAS_RESULT;
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_symcache_is_checked_by_id (struct rspamd_task *task, gint id)
+{
+	return !!(rspamd_symcache_item_status_by_id (task, id) &
+			RSPAMD_SYMCACHE_ITEM_STARTED);
+}
+
+void
+rspamd_symcache_item_set_result (struct rspamd_task *task,
+								 struct rspamd_symcache_item *item,
+								 gboolean has_result)
+{
+	struct cache_savepoint *checkpoint;
+	gint idx;
+
+	if (item == NULL) {
+		return;
+	}
+
+	checkpoint = rspamd_symcache_get_checkpoint (task);
+
+	if (checkpoint == NULL) {
+		return;
+	}
+
+	idx = rspamd_symcache_result_idx (checkpoint, item);
+
+	if (idx >= 0) {
+		if (has_result) {
+			SET_BIT_ID (checkpoint->has_result, idx);
+		}
+		else {
+			CLR_BIT_ID (checkpoint->has_result, idx);
+		}
+	}
+}
+
+gboolean
+rspamd_symcache_item_has_result (struct rspamd_task *task,
+								 const struct rspamd_symcache_item *item)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+	gint idx;
+
+	if (item == NULL || checkpoint == NULL) {
+		return FALSE;
+	}
+
+	idx = rspamd_symcache_result_idx (checkpoint, item);
+
+	if (idx >= 0) {
+		return CHECK_BIT_ID (checkpoint->has_result, idx);
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_symcache_offload_thread (gpointer data, gpointer user_data)
+{
+	struct rspamd_symcache_offload_job *job = data;
+	struct rspamd_symcache_cpu_pool *pool = user_data;
+
+	job->work (job->ud);
+
+	g_mutex_lock (&job->mtx);
+	job->state = RSPAMD_SYMCACHE_OFFLOAD_DONE;
+	g_cond_signal (&job->cond);
+	g_mutex_unlock (&job->mtx);
+
+	g_async_queue_push (pool->done, job);
+	ev_async_send (pool->event_loop, &pool->wakeup);
+}
+
+/*
+ * Session event finaliser: called either when a job is done or when a session
+ * is forcefully cleaned up, in the latter case we wait for a thread to finish
+ */
+static void
+rspamd_symcache_offload_fin (gpointer ud)
+{
+	struct rspamd_symcache_offload_job *job = ud;
+
+	g_mutex_lock (&job->mtx);
+
+	while (job->state == RSPAMD_SYMCACHE_OFFLOAD_RUNNING) {
+		g_cond_wait (&job->cond, &job->mtx);
+	}
+
+	job->state = RSPAMD_SYMCACHE_OFFLOAD_FINALISED;
+	g_mutex_unlock (&job->mtx);
+
+	rspamd_symcache_set_cur_item (job->task, job->item);
+	job->fin (job->task, job->item, job->ud);
+	rspamd_symcache_item_async_dec_check (job->task, job->item, "cpu pool");
+}
+
+static void
+rspamd_symcache_offload_done_cb (EV_P_ ev_async *w, int revents)
+{
+	struct rspamd_symcache_cpu_pool *pool =
+			(struct rspamd_symcache_cpu_pool *)w->data;
+	struct rspamd_symcache_offload_job *job;
+
+	while ((job = g_async_queue_try_pop (pool->done)) != NULL) {
+		/* Only the event loop thread sets finalised state */
+		if (job->state != RSPAMD_SYMCACHE_OFFLOAD_FINALISED) {
+			rspamd_session_remove_event (job->task->s,
+					rspamd_symcache_offload_fin, job);
+		}
+
+		g_mutex_clear (&job->mtx);
+		g_cond_clear (&job->cond);
+		g_free (job);
+	}
+}
+
+static struct rspamd_symcache_cpu_pool *
+rspamd_symcache_cpu_pool_get (struct rspamd_symcache *cache,
+		struct ev_loop *event_loop)
+{
+	struct rspamd_symcache_cpu_pool *pool;
+	GError *err = NULL;
+
+	if (cache->cpu_pool && cache->cpu_pool->pid == getpid ()) {
+		return cache->cpu_pool;
+	}
+
+	/* Either no pool or a pool from the parent process without threads */
+	pool = g_malloc0 (sizeof (*pool));
+	pool->threads = g_thread_pool_new (rspamd_symcache_offload_thread,
+			pool, cache->cfg->cache_cpu_threads, FALSE, &err);
+
+	if (pool->threads == NULL) {
+		msg_err_cache ("cannot create cpu pool with %d threads: %e",
+				cache->cfg->cache_cpu_threads, err);
+		g_error_free (err);
+		g_free (pool);
+
+		return NULL;
+	}
+
+	pool->done = g_async_queue_new ();
+	pool->event_loop = event_loop;
+	pool->pid = getpid ();
+	pool->wakeup.data = pool;
+	ev_async_init (&pool->wakeup, rspamd_symcache_offload_done_cb);
+	ev_async_start (event_loop, &pool->wakeup);
+	/* Pending jobs are tracked by task sessions, do not block loop exit */
+	ev_unref (event_loop);
+
+	cache->cpu_pool = pool;
+	msg_info_cache ("created cpu pool with %d threads",
+			cache->cfg->cache_cpu_threads);
+
+	return pool;
+}
+
+static void
+rspamd_symcache_cpu_pool_destroy (struct rspamd_symcache_cpu_pool *pool)
+{
+	/* Wait for all jobs, their finalisers have been called by sessions */
+	g_thread_pool_free (pool->threads, FALSE, TRUE);
+	ev_ref (pool->event_loop);
+	ev_async_stop (pool->event_loop, &pool->wakeup);
+	rspamd_symcache_offload_done_cb (pool->event_loop, &pool->wakeup, 0);
+	g_async_queue_unref (pool->done);
+	g_free (pool);
+}
+
+gboolean
+rspamd_symcache_item_offload (struct rspamd_task *task,
+							  struct rspamd_symcache_item *item,
+							  symbol_offload_work_t work,
+							  symbol_offload_fin_t fin,
+							  gpointer ud)
+{
+	struct rspamd_symcache_cpu_pool *pool = NULL;
+	struct rspamd_symcache_offload_job *job;
+	struct rspamd_symcache *cache = task->cfg->cache;
+
+	if (task->cfg->cache_cpu_threads > 0 &&
+			(item->type & SYMBOL_TYPE_CPU_PARALLEL) &&
+			task->event_loop != NULL) {
+		pool = rspamd_symcache_cpu_pool_get (cache, task->event_loop);
+	}
+
+	if (pool == NULL) {
+		work (ud);
+		fin (task, item, ud);
+
+		return FALSE;
+	}
+
+	job = g_malloc0 (sizeof (*job));
+	job->task = task;
+	job->item = item;
+	job->work = work;
+	job->fin = fin;
+	job->ud = ud;
+	job->pool = pool;
+	g_mutex_init (&job->mtx);
+	g_cond_init (&job->cond);
+	job->state = RSPAMD_SYMCACHE_OFFLOAD_RUNNING;
+
+	rspamd_session_add_event (task->s, rspamd_symcache_offload_fin, job,
+			"cpu pool");
+	rspamd_symcache_item_async_inc (task, item, "cpu pool");
+	g_thread_pool_push (pool->threads, job, NULL);
+
+	return TRUE;
+}
+
+ucl_object_t *
+rspamd_symcache_trace_to_ucl (struct rspamd_symcache *cache)
+{
+	struct symcache_trace_ring *ring;
+	struct symcache_trace_event *ev;
+	ucl_object_t *top, *events, *obj, *args;
+	guint i, nevents, start;
+	pid_t pid = getpid ();
+
+	g_assert (cache != NULL);
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	events = ucl_object_typed_new (UCL_ARRAY);
+	ring = cache->trace_ring;
+
+	if (ring && ring->pid == pid) {
+		nevents = ring->full ? ring->size : ring->pos;
+		start = ring->full ? ring->pos : 0;
+
+		for (i = 0; i < nevents; i ++) {
+			ev = &ring->events[(start + i) % ring->size];
+			/* Chrome trace events: complete events with microseconds times */
+			obj = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (obj, ucl_object_fromstring (ev->name),
+					"name", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromstring (ev->loc ? "async" : "symbol"),
+					"cat", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromstring ("X"),
+					"ph", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromdouble (ev->start * 1e6),
+					"ts", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromdouble (ev->dur * 1e6),
+					"dur", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromint (pid),
+					"pid", 0, false);
+			/* Each sampled task is shown as a separate thread */
+			ucl_object_insert_key (obj, ucl_object_fromint (ev->seq),
+					"tid", 0, false);
+
+			args = ucl_object_typed_new (UCL_OBJECT);
+
+			if (ev->loc) {
+				ucl_object_insert_key (args, ucl_object_fromstring (ev->loc),
+						"loc", 0, false);
+			}
+			else {
+				ucl_object_insert_key (args,
+						ucl_object_fromdouble (ev->cpu * 1e3),
+						"cpu_ms", 0, false);
+				ucl_object_insert_key (args,
+						ucl_object_fromdouble (MAX (ev->dur - ev->cpu, 0) * 1e3),
+						"wait_ms", 0, false);
+			}
+
+			ucl_object_insert_key (obj, args, "args", 0, false);
+			ucl_array_append (events, obj);
+		}
+	}
+
+	ucl_object_insert_key (top, events, "traceEvents", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromstring ("ms"),
+			"displayTimeUnit", 0, false);
+
+	return top;
+}
+
+static struct rspamd_symcache_triggers *
+rspamd_symcache_get_triggers (struct rspamd_symcache *cache,
+		const gchar *symbol)
+{
+	struct rspamd_symcache_item *item;
+
+	item = rspamd_symcache_find_filter (cache, symbol, true);
+
+	if (item == NULL) {
+		msg_err_cache ("cannot add trigger for %s: symbol is not found",
+				symbol);
+		return NULL;
+	}
+
+	if (!(item->type & SYMBOL_TYPE_POSTFILTER)) {
+		msg_err_cache ("cannot add trigger for %s: triggers are only "
+				"supported for postfilters", symbol);
+		return NULL;
+	}
+
+	if (item->triggers == NULL) {
+		item->triggers = rspamd_mempool_alloc0 (cache->static_pool,
+				sizeof (*item->triggers));
+	}
+
+	/* Postfilters stage is compiled with triggers in mind */
+	cache->id ++;
+
+	return item->triggers;
+}
+
+gboolean
+rspamd_symcache_add_symbol_trigger (struct rspamd_symcache *cache,
+									const gchar *symbol,
+									const gchar *trigger)
+{
+	struct rspamd_symcache_triggers *tr;
+
+	g_assert (cache != NULL);
+	g_assert (symbol != NULL && trigger != NULL);
+
+	tr = rspamd_symcache_get_triggers (cache, symbol);
+
+	if (tr == NULL) {
+		return FALSE;
+	}
+
+	if (tr->symbols == NULL) {
+		tr->symbols = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (cache->static_pool,
+				rspamd_ptr_array_free_hard, tr->symbols);
+	}
+
+	g_ptr_array_add (tr->symbols, g_strdup (trigger));
+
+	return TRUE;
+}
+
+gboolean
+rspamd_symcache_add_action_trigger (struct rspamd_symcache *cache,
+									const gchar *symbol,
+									gint action)
+{
+	struct rspamd_symcache_triggers *tr;
+
+	g_assert (cache != NULL);
+	g_assert (symbol != NULL);
+
+	tr = rspamd_symcache_get_triggers (cache, symbol);
+
+	if (tr == NULL) {
+		return FALSE;
+	}
+
+	tr->actions |= RSPAMD_SYMCACHE_ACTION_BIT (action);
+
+	return TRUE;
+}
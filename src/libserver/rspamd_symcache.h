@@ -37,6 +37,12 @@ struct rspamd_config_settings_elt;
 typedef void (*symbol_func_t) (struct rspamd_task *task,
 							   struct rspamd_symcache_item *item,
 							   gpointer user_data);
+/* Executed in a thread of the cpu pool, must not touch task, mempools or logger */
+typedef void (*symbol_offload_work_t) (gpointer user_data);
+/* Executed in the event loop thread when the offloaded work is done */
+typedef void (*symbol_offload_fin_t) (struct rspamd_task *task,
+									  struct rspamd_symcache_item *item,
+									  gpointer user_data);
 
 enum rspamd_symbol_type {
 	SYMBOL_TYPE_NORMAL = (1u << 0u),
@@ -59,6 +65,17 @@ enum rspamd_symbol_type {
 	SYMBOL_TYPE_IGNORE_PASSTHROUGH = (1u << 17u), /* Symbol ignores passthrough result */
 	SYMBOL_TYPE_EXPLICIT_ENABLE = (1u << 18u), /* Symbol should be enabled explicitly only */
 	SYMBOL_TYPE_USE_CORO = (1u << 19u), /* Symbol uses lua coroutines */
+	SYMBOL_TYPE_CPU_PARALLEL = (1u << 20u), /* Thread safe C symbol that offloads CPU work to a thread pool */
+};
+
+/**
+ * Per task status of a cache item
+ */
+enum rspamd_symcache_item_status {
+	RSPAMD_SYMCACHE_ITEM_STARTED = (1u << 0u),
+	RSPAMD_SYMCACHE_ITEM_FINISHED = (1u << 1u),
+	RSPAMD_SYMCACHE_ITEM_DISABLED = (1u << 2u), /* Disabled by settings, conditions or explicitly */
+	RSPAMD_SYMCACHE_ITEM_HAS_RESULT = (1u << 3u), /* Symbol is inserted to the default result */
 };
 
 /**
@@ -69,6 +86,9 @@ struct rspamd_abstract_callback_data {
 	char data[];
 };
 
+/* Number of log2 scaled buckets (in microseconds) of the execution time histogram */
+#define RSPAMD_SYMCACHE_TIME_BUCKETS 24
+
 struct rspamd_symcache_item_stat {
 	struct rspamd_counter_data time_counter;
 	gdouble avg_time;
@@ -78,6 +98,19 @@ struct rspamd_symcache_item_stat {
 	struct rspamd_counter_data frequency_counter;
 	gdouble avg_frequency;
 	gdouble stddev_frequency;
+	/* Number of executions, used to estimate hit rate */
+	guint checks;
+	guint64 total_checks;
+	gdouble hit_rate;
+	/* Execution times reported by all workers since the last aggregation */
+	guint time_runs;
+	guint64 time_usec;
+	/*
+	 * Execution time histogram: bucket `i` counts runs that took less than
+	 * 2^i microseconds (and at least 2^(i-1)), the last bucket is unbounded.
+	 * It lives in the shared memory, so it is aggregated over all workers
+	 */
+	guint time_hist[RSPAMD_SYMCACHE_TIME_BUCKETS];
 };
 
 /**
@@ -168,6 +201,32 @@ gboolean rspamd_symcache_stat_symbol (struct rspamd_symcache *cache,
 									  gdouble *tm,
 									  guint *nhits);
 
+/**
+ * Get execution time percentiles for a specific symbol (virtual symbols
+ * report their parent's timings)
+ * @param cache
+ * @param name
+ * @param p50 median time in milliseconds
+ * @param p99 99th percentile in milliseconds
+ * @param p999 99.9th percentile in milliseconds
+ * @return FALSE if a symbol is not found or it has no timings yet
+ */
+gboolean rspamd_symcache_stat_symbol_latency (struct rspamd_symcache *cache,
+											  const gchar *name,
+											  gdouble *p50,
+											  gdouble *p99,
+											  gdouble *p999);
+
+/**
+ * Estimates a quantile `q` (0..1) of the execution time from the histogram
+ * @param st
+ * @param q
+ * @return time in milliseconds or 0.0 if there are no measurements
+ */
+gdouble rspamd_symcache_item_stat_percentile (
+		const struct rspamd_symcache_item_stat *st, gdouble q);
+
+
 /**
  * Find symbol in cache by its id
  * @param cache
@@ -570,11 +629,98 @@ const GPtrArray* rspamd_symcache_item_get_rdeps (
 		struct rspamd_symcache_item *item);
 
 
+/**
+ * Returns status flags (enum rspamd_symcache_item_status) of a real (non-virtual)
+ * item identified by its id for the specific task
+ * @param task
+ * @param id
+ * @return
+ */
+guint rspamd_symcache_item_status_by_id (struct rspamd_task *task, gint id);
+
+/**
+ * Checks if a symbol with the specific id has been started (or disabled)
+ * @param task
+ * @param id
+ * @return
+ */
+gboolean rspamd_symcache_is_checked_by_id (struct rspamd_task *task, gint id);
+
+/**
+ * Marks that an item has (or has not) a result in the default scan result
+ * @param task
+ * @param item
+ * @param has_result
+ */
+void rspamd_symcache_item_set_result (struct rspamd_task *task,
+									  struct rspamd_symcache_item *item,
+									  gboolean has_result);
+
+/**
+ * Returns TRUE if an item (real or virtual) has a result in the default scan result
+ * @param task
+ * @param item
+ * @return
+ */
+gboolean rspamd_symcache_item_has_result (struct rspamd_task *task,
+										  const struct rspamd_symcache_item *item);
+
 /**
  * Enable profiling for task (e.g. when a slow rule has been found)
  * @param task
  */
 void rspamd_symcache_enable_profile (struct rspamd_task *task);
+
+/**
+ * Adds a trigger symbol for a postfilter: if a postfilter has triggers it is
+ * executed only if any of trigger symbols is inserted or any of trigger
+ * actions is reached by a task (when the postfilter is about to be checked)
+ * @param cache
+ * @param symbol postfilter
+ * @param trigger symbol name (resolved on cache init)
+ * @return TRUE if a trigger has been added
+ */
+gboolean rspamd_symcache_add_symbol_trigger (struct rspamd_symcache *cache,
+											 const gchar *symbol,
+											 const gchar *trigger);
+
+/**
+ * Adds a trigger action for a postfilter, see `rspamd_symcache_add_symbol_trigger`
+ * @param cache
+ * @param symbol postfilter
+ * @param action enum rspamd_action_type
+ * @return TRUE if a trigger has been added
+ */
+gboolean rspamd_symcache_add_action_trigger (struct rspamd_symcache *cache,
+											 const gchar *symbol,
+											 gint action);
+
+/**
+ * Returns events of the sampled tasks traces (see `cache_trace_sample`)
+ * collected by the current worker in the Chrome trace format
+ * @param cache
+ * @return new ucl object
+ */
+ucl_object_t *rspamd_symcache_trace_to_ucl (struct rspamd_symcache *cache);
+
+/**
+ * Runs `work` in the per worker cpu pool and `fin` in the event loop afterwards.
+ * The item must be marked as SYMBOL_TYPE_CPU_PARALLEL and it is kept pending
+ * (as an async event) until `fin` is called, so independent items are checked
+ * meanwhile. If the pool is disabled (`cache_cpu_threads` is 0) or the item is
+ * not marked, both functions are called immediately.
+ * @param task
+ * @param item
+ * @param work
+ * @param fin
+ * @param ud
+ * @return TRUE if work has been offloaded
+ */
+gboolean rspamd_symcache_item_offload (struct rspamd_task *task,
+									   struct rspamd_symcache_item *item,
+									   symbol_offload_work_t work,
+									   symbol_offload_fin_t fin,
+									   gpointer ud);
 #ifdef  __cplusplus
 }
 #endif
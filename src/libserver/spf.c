@@ -23,6 +23,7 @@
 #include "libserver/mempool_vars_internal.h"
 #include "contrib/librdns/rdns.h"
 #include "contrib/mumhash/mum.h"
+#include "libutil/radix.h"
 
 #define SPF_VER1_STR "v=spf1"
 #define SPF_VER2_STR "spf2."
@@ -62,6 +63,16 @@ struct spf_record {
 	gboolean done;
 };
 
+/* Records with less elements are matched by a plain scan */
+#define SPF_MIN_COMPILED_ELTS 8
+
+struct spf_compiled_prefix {
+	guint8 key[16];
+	guint keylen;
+	guint plen;
+	guint idx;
+};
+
 struct rspamd_spf_library_ctx {
 	guint max_dns_nesting;
 	guint max_dns_requests;
@@ -378,6 +389,11 @@ rspamd_flatten_record_dtor (struct spf_resolved *r)
 		g_free (addr->spf_string);
 	}
 
+	if (r->addrs4) {
+		/* Both tries share the same pool */
+		rspamd_mempool_delete (radix_get_pool (r->addrs4));
+	}
+
 	g_free (r->domain);
 	g_array_free (r->elts, TRUE);
 	g_free (r);
@@ -554,6 +570,152 @@ rspamd_spf_elts_cmp (gconstpointer a, gconstpointer b)
 	}
 }
 
+static gint
+rspamd_spf_compiled_prefix_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct spf_compiled_prefix *p1 = a, *p2 = b;
+	gint r;
+
+	if (p1->keylen != p2->keylen) {
+		return p1->keylen < p2->keylen ? -1 : 1;
+	}
+
+	if (p1->plen != p2->plen) {
+		return p1->plen < p2->plen ? -1 : 1;
+	}
+
+	r = memcmp (p1->key, p2->key, p1->keylen);
+
+	if (r != 0) {
+		return r;
+	}
+
+	return p1->idx < p2->idx ? -1 : (p1->idx > p2->idx ? 1 : 0);
+}
+
+/*
+ * Builds tries of networks for a flattened record, so matching becomes a
+ * single lookup. `spf_addr_match_task` selects the first matching element in
+ * the elements order, whilst a trie finds the longest prefix. Hence, each
+ * prefix is stored with the lowest index of all elements that contain it:
+ * prefixes are inserted from the shortest ones, so the parent found in a trie
+ * already has the lowest index of all its own parents.
+ */
+static void
+rspamd_spf_record_compile (struct spf_resolved *rec)
+{
+	GArray *prefixes;
+	struct spf_compiled_prefix pfx, *cur, *prev = NULL;
+	struct spf_addr *addr;
+	radix_compressed_t *tree;
+	rspamd_mempool_t *pool;
+	gboolean has_default4 = FALSE, has_default6 = FALSE;
+	gint any_idx = -1;
+	uintptr_t parent;
+	guint i, j;
+
+	if (rec->elts->len < SPF_MIN_COMPILED_ELTS) {
+		return;
+	}
+
+	prefixes = g_array_sized_new (FALSE, FALSE, sizeof (pfx), rec->elts->len);
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (addr->flags & RSPAMD_SPF_FLAG_TEMPFAIL) {
+			continue;
+		}
+
+		memset (&pfx, 0, sizeof (pfx));
+
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV6) {
+			if (addr->m.dual.mask_v6 > 128) {
+				continue;
+			}
+
+			memcpy (pfx.key, addr->addr6, sizeof (addr->addr6));
+			pfx.keylen = sizeof (addr->addr6);
+			pfx.plen = addr->m.dual.mask_v6;
+		}
+		else if (addr->flags & RSPAMD_SPF_FLAG_IPV4) {
+			if (addr->m.dual.mask_v4 > 32) {
+				continue;
+			}
+
+			memcpy (pfx.key, addr->addr4, sizeof (addr->addr4));
+			pfx.keylen = sizeof (addr->addr4);
+			pfx.plen = addr->m.dual.mask_v4;
+		}
+		else {
+			if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
+				/* The last `all` is used if nothing else matches */
+				any_idx = i;
+			}
+
+			continue;
+		}
+
+		/* Clear host bits to find duplicates */
+		for (j = pfx.plen; j < pfx.keylen * CHAR_BIT; j ++) {
+			pfx.key[j / CHAR_BIT] &= ~(0x80u >> (j % CHAR_BIT));
+		}
+
+		pfx.idx = i;
+		g_array_append_val (prefixes, pfx);
+	}
+
+	g_array_sort (prefixes, rspamd_spf_compiled_prefix_cmp);
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "spf", 0);
+	rec->addrs4 = radix_create_compressed_with_pool (pool, "spf ipv4");
+	rec->addrs6 = radix_create_compressed_with_pool (pool, "spf ipv6");
+
+	for (i = 0; i < prefixes->len; i ++) {
+		cur = &g_array_index (prefixes, struct spf_compiled_prefix, i);
+
+		if (prev && prev->keylen == cur->keylen && prev->plen == cur->plen &&
+				memcmp (prev->key, cur->key, cur->keylen) == 0) {
+			/* Duplicate with a higher index */
+			continue;
+		}
+
+		prev = cur;
+		tree = cur->keylen == 4 ? rec->addrs4 : rec->addrs6;
+
+		if (cur->plen == 0) {
+			if (cur->keylen == 4) {
+				has_default4 = TRUE;
+			}
+			else {
+				has_default6 = TRUE;
+			}
+		}
+
+		parent = radix_find_compressed (tree, cur->key, cur->keylen);
+
+		if (parent == RADIX_NO_VALUE || parent > cur->idx) {
+			parent = cur->idx;
+		}
+
+		radix_insert_compressed (tree, cur->key, cur->keylen,
+				cur->keylen * CHAR_BIT - cur->plen, parent);
+	}
+
+	if (any_idx != -1) {
+		/* Default route is used merely if no other prefix matches */
+		memset (&pfx, 0, sizeof (pfx));
+
+		if (!has_default4) {
+			radix_insert_compressed (rec->addrs4, pfx.key, 4, 32, any_idx);
+		}
+		if (!has_default6) {
+			radix_insert_compressed (rec->addrs6, pfx.key, 16, 128, any_idx);
+		}
+	}
+
+	g_array_free (prefixes, TRUE);
+}
+
 static void
 rspamd_spf_record_postprocess (struct spf_resolved *rec, struct rspamd_task *task)
 {
@@ -592,6 +754,8 @@ rspamd_spf_record_postprocess (struct spf_resolved *rec, struct rspamd_task *tas
 			rec->ttl = spf_lib_ctx->min_cache_ttl;
 		}
 	}
+
+	rspamd_spf_record_compile (rec);
 }
 
 static void
@@ -2641,6 +2805,28 @@ spf_addr_match_task (struct rspamd_task *task, struct spf_resolved *rec)
 		return FALSE;
 	}
 
+	if (rec->addrs4 != NULL) {
+		uintptr_t idx;
+
+		d = rspamd_inet_address_get_hash_key (task->from_addr, &addrlen);
+
+		if (addrlen == sizeof (struct in_addr)) {
+			idx = radix_find_compressed (rec->addrs4, d, addrlen);
+		}
+		else if (addrlen == sizeof (struct in6_addr)) {
+			idx = radix_find_compressed (rec->addrs6, d, addrlen);
+		}
+		else {
+			return NULL;
+		}
+
+		if (idx != RADIX_NO_VALUE) {
+			return &g_array_index (rec->elts, struct spf_addr, idx);
+		}
+
+		return NULL;
+	}
+
 	for (i = 0; i < rec->elts->len; i ++) {
 		addr = &g_array_index (rec->elts, struct spf_addr, i);
 		if (addr->flags & RSPAMD_SPF_FLAG_TEMPFAIL) {
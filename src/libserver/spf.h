@@ -11,6 +11,7 @@ extern "C" {
 
 struct rspamd_task;
 struct spf_resolved;
+struct radix_tree_compressed;
 
 typedef void (*spf_cb_t) (struct spf_resolved *record,
 						  struct rspamd_task *task, gpointer cbdata);
@@ -97,6 +98,9 @@ struct spf_resolved {
 	gdouble timestamp;
 	guint64 digest;
 	GArray *elts; /* Flat list of struct spf_addr */
+	/* Indexes of the matching elements for large records (or NULL) */
+	struct radix_tree_compressed *addrs4;
+	struct radix_tree_compressed *addrs6;
 	ref_entry_t ref; /* Refcounting */
 };
 
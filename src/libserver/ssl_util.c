@@ -46,9 +46,26 @@ enum rspamd_ssl_shutdown {
 	ssl_shut_unclean,
 };
 
+/*
+ * Client sessions are also kept in a table shared by all processes forked
+ * after the context is created, so a session established by one worker can
+ * be resumed by others instead of doing a full handshake
+ */
+#define RSPAMD_SSL_SHARED_SESSIONS 128
+#define RSPAMD_SSL_SHARED_SESSION_LEN 4096
+
+struct rspamd_ssl_shared_session {
+	guint64 hash;                      /* hostname hash, 0 for an empty slot */
+	guint32 seq;                       /* odd while the slot is being written */
+	guint32 len;
+	gdouble expire;
+	guchar data[RSPAMD_SSL_SHARED_SESSION_LEN];
+};
+
 struct rspamd_ssl_ctx {
 	SSL_CTX *s;
 	rspamd_lru_hash_t *sessions;
+	struct rspamd_ssl_shared_session *shared_sessions;
 };
 
 struct rspamd_ssl_connection {
@@ -648,6 +665,114 @@ rspamd_ssl_connection_new (gpointer ssl_ctx, struct ev_loop *ev_base,
 }
 
 
+static guint64
+rspamd_ssl_shared_session_hash (const gchar *hostname)
+{
+	guint64 h;
+
+	h = rspamd_cryptobox_fast_hash (hostname, strlen (hostname),
+			0xb32ad7c55eb2e647ULL);
+
+	return h ? h : 1;
+}
+
+static void
+rspamd_ssl_shared_session_store (struct rspamd_ssl_ctx *ctx,
+		const gchar *hostname, SSL_SESSION *sess, gdouble expire)
+{
+	struct rspamd_ssl_shared_session *slot;
+	guint64 h;
+	guint32 seq;
+	guchar *p;
+	gint len;
+
+	if (ctx->shared_sessions == NULL) {
+		return;
+	}
+
+	len = i2d_SSL_SESSION (sess, NULL);
+
+	if (len <= 0 || len > RSPAMD_SSL_SHARED_SESSION_LEN) {
+		return;
+	}
+
+	h = rspamd_ssl_shared_session_hash (hostname);
+	slot = &ctx->shared_sessions[h % RSPAMD_SSL_SHARED_SESSIONS];
+	seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+
+	/* Another process is writing this slot, it is just a cache */
+	if ((seq & 1) || !__atomic_compare_exchange_n (&slot->seq, &seq, seq + 1,
+			FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	p = slot->data;
+	i2d_SSL_SESSION (sess, &p);
+	slot->len = len;
+	slot->expire = expire;
+	slot->hash = h;
+	__atomic_store_n (&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static SSL_SESSION *
+rspamd_ssl_shared_session_lookup (struct rspamd_ssl_ctx *ctx,
+		const gchar *hostname, gdouble now, gdouble *expire)
+{
+	struct rspamd_ssl_shared_session *slot;
+	guchar buf[RSPAMD_SSL_SHARED_SESSION_LEN];
+	const guchar *p = buf;
+	guint64 h;
+	guint32 seq, len;
+
+	if (ctx->shared_sessions == NULL) {
+		return NULL;
+	}
+
+	h = rspamd_ssl_shared_session_hash (hostname);
+	slot = &ctx->shared_sessions[h % RSPAMD_SSL_SHARED_SESSIONS];
+	seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+
+	if ((seq & 1) || slot->hash != h || slot->expire < now) {
+		return NULL;
+	}
+
+	len = MIN (slot->len, sizeof (buf));
+	*expire = slot->expire;
+	memcpy (buf, slot->data, len);
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq) {
+		/* Slot has been rewritten while copying */
+		return NULL;
+	}
+
+	return d2i_SSL_SESSION (NULL, &p, len);
+}
+
+static SSL_SESSION *
+rspamd_ssl_session_lookup (struct rspamd_ssl_connection *conn,
+		const gchar *hostname)
+{
+	SSL_SESSION *session;
+	gdouble now = ev_now (conn->event_loop), expire;
+
+	session = rspamd_lru_hash_lookup (conn->ssl_ctx->sessions, hostname, now);
+
+	if (session == NULL) {
+		session = rspamd_ssl_shared_session_lookup (conn->ssl_ctx, hostname,
+				now, &expire);
+
+		if (session) {
+			msg_debug_ssl ("found shared session for %s", hostname);
+			/* Cache owns the session from now on */
+			rspamd_lru_hash_insert (conn->ssl_ctx->sessions,
+					g_strdup (hostname), session, now, expire - now);
+		}
+	}
+
+	return session;
+}
+
 gboolean
 rspamd_ssl_connect_fd (struct rspamd_ssl_connection *conn, gint fd,
 		const gchar *hostname, struct rspamd_io_ev *ev, ev_tstamp timeout,
@@ -662,9 +787,7 @@ rspamd_ssl_connect_fd (struct rspamd_ssl_connection *conn, gint fd,
 	conn->ssl = SSL_new (conn->ssl_ctx->s);
 
 	if (hostname) {
-		session = rspamd_lru_hash_lookup (conn->ssl_ctx->sessions, hostname,
-				ev_now (conn->event_loop));
-
+		session = rspamd_ssl_session_lookup (conn, hostname);
 	}
 
 	if (session) {
@@ -932,6 +1055,33 @@ rspamd_ssl_writev (struct rspamd_ssl_connection *conn, struct iovec *iov,
 	return rspamd_ssl_write (conn, ssl_buf, p - ssl_buf);
 }
 
+gboolean
+rspamd_ssl_connection_restore_handlers (struct rspamd_ssl_connection *conn,
+		rspamd_ssl_handler_t handler,
+		rspamd_ssl_error_handler_t err_handler,
+		gpointer handler_data,
+		ev_tstamp timeout,
+		short ev_what)
+{
+	if (conn->ev == NULL || (conn->state != ssl_conn_connected &&
+			conn->state != ssl_next_read && conn->state != ssl_next_write)) {
+		return FALSE;
+	}
+
+	/* Pending IO of the previous user is not interesting anymore */
+	conn->state = ssl_conn_connected;
+	conn->handler = handler;
+	conn->err_handler = err_handler;
+	conn->handler_data = handler_data;
+
+	rspamd_ev_watcher_stop (conn->event_loop, conn->ev);
+	rspamd_ev_watcher_init (conn->ev, conn->fd, ev_what,
+			rspamd_ssl_event_handler, conn);
+	rspamd_ev_watcher_start (conn->event_loop, conn->ev, timeout);
+
+	return TRUE;
+}
+
 /**
  * Removes connection data
  * @param conn
@@ -962,9 +1112,14 @@ rspamd_ssl_new_client_session (SSL *ssl, SSL_SESSION *sess)
 	conn = SSL_get_app_data (ssl);
 
 	if (conn->hostname) {
+		gdouble now = ev_now (conn->event_loop);
+		glong timeout = SSL_CTX_get_timeout (conn->ssl_ctx->s);
+
 		rspamd_lru_hash_insert (conn->ssl_ctx->sessions,
 				g_strdup (conn->hostname), SSL_get1_session (ssl),
-				ev_now (conn->event_loop), SSL_CTX_get_timeout (conn->ssl_ctx->s));
+				now, timeout);
+		rspamd_ssl_shared_session_store (conn->ssl_ctx, conn->hostname, sess,
+				now + timeout);
 		msg_debug_ssl ("saved new session for %s: %p", conn->hostname, conn);
 	}
 
@@ -1010,6 +1165,14 @@ rspamd_init_ssl_ctx_common (void)
 	SSL_CTX_set_app_data (ssl_ctx, ret);
 	SSL_CTX_sess_set_new_cb (ssl_ctx, rspamd_ssl_new_client_session);
 
+	ret->shared_sessions = mmap (NULL,
+			sizeof (*ret->shared_sessions) * RSPAMD_SSL_SHARED_SESSIONS,
+			PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+
+	if (ret->shared_sessions == MAP_FAILED) {
+		ret->shared_sessions = NULL;
+	}
+
 	return ret;
 }
 
@@ -1101,6 +1264,16 @@ rspamd_ssl_ctx_config (struct rspamd_config *cfg, gpointer ssl_ctx)
 			SSL_CTX_set_cipher_list (ctx->s, default_secure_ciphers);
 		}
 	}
+
+	if (cfg->ssl_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+		/* OpenSSL silently keeps userspace crypto if kernel lacks support */
+		SSL_CTX_set_options (ctx->s, SSL_OP_ENABLE_KTLS);
+#else
+		msg_warn_config ("ssl_ktls is set but this OpenSSL has no kernel TLS "
+				"support");
+#endif
+	}
 }
 
 void
@@ -1109,6 +1282,12 @@ rspamd_ssl_ctx_free (gpointer ssl_ctx)
 	struct rspamd_ssl_ctx *ctx = (struct rspamd_ssl_ctx *)ssl_ctx;
 
 	rspamd_lru_hash_destroy (ctx->sessions);
+
+	if (ctx->shared_sessions) {
+		munmap (ctx->shared_sessions,
+				sizeof (*ctx->shared_sessions) * RSPAMD_SSL_SHARED_SESSIONS);
+	}
+
 	SSL_CTX_free (ctx->s);
 	g_free (ssl_ctx);
 }
\ No newline at end of file
@@ -56,6 +56,18 @@ gboolean rspamd_ssl_connect_fd (struct rspamd_ssl_connection *conn, gint fd,
 								rspamd_ssl_handler_t handler, rspamd_ssl_error_handler_t err_handler,
 								gpointer handler_data);
 
+/**
+ * Sets new handlers for an established connection (e.g. when it is reused
+ * from a keepalive pool) and starts waiting for `ev_what` event
+ * @return FALSE if connection is not established
+ */
+gboolean rspamd_ssl_connection_restore_handlers (struct rspamd_ssl_connection *conn,
+								rspamd_ssl_handler_t handler,
+								rspamd_ssl_error_handler_t err_handler,
+								gpointer handler_data,
+								ev_tstamp timeout,
+								short ev_what);
+
 /**
  * Perform async read from SSL socket
  * @param conn
@@ -20,6 +20,7 @@
 #include "libserver/protocol_internal.h"
 #include "message.h"
 #include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
 #include "email_addr.h"
 #include "composites.h"
 #include "stat_api.h"
@@ -30,6 +31,7 @@
 #include "libserver/cfg_file_private.h"
 #include "libmime/lang_detection.h"
 #include "libmime/scan_result_private.h"
+#include "libutil/probes.h"
 
 #ifdef WITH_JEMALLOC
 #include <jemalloc/jemalloc.h>
@@ -41,6 +43,16 @@
 
 #include <math.h>
 
+/*
+ * Messages passed by path are parsed as a whole, so fault all pages in
+ * with a single mmap call instead of taking a fault per page later
+ */
+#ifdef MAP_POPULATE
+#define RSPAMD_TASK_FILE_MAP_FLAGS (MAP_SHARED | MAP_POPULATE)
+#else
+#define RSPAMD_TASK_FILE_MAP_FLAGS MAP_SHARED
+#endif
+
 __KHASH_IMPL (rspamd_req_headers_hash, static inline,
 		rspamd_ftok_t *, struct rspamd_request_header_chain *, 1,
 				rspamd_ftok_icase_hash, rspamd_ftok_icase_equal)
@@ -73,7 +85,8 @@ rspamd_task_new (struct rspamd_worker *worker,
 
 	if (pool == NULL) {
 		task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
-				"task", debug_mem ? RSPAMD_MEMPOOL_DEBUG : 0);
+				"task", RSPAMD_MEMPOOL_RECYCLE |
+						(debug_mem ? RSPAMD_MEMPOOL_DEBUG : 0));
 		flags |= RSPAMD_TASK_FLAG_OWN_POOL;
 	}
 	else {
@@ -118,6 +131,16 @@ rspamd_task_new (struct rspamd_worker *worker,
 	new_task->messages = ucl_object_typed_new (UCL_OBJECT);
 	new_task->lua_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 
+	if (cfg && cfg->lua_state) {
+		lua_State *L = (lua_State *)cfg->lua_state;
+
+		new_task->resources.lua_heap_start =
+				(gint64)lua_gc (L, LUA_GCCOUNT, 0) * 1024 +
+				lua_gc (L, LUA_GCCOUNTB, 0);
+	}
+
+	RSPAMD_PROBE2 (task__start, new_task, new_task->task_pool->tag.uid);
+
 	return new_task;
 }
 
@@ -190,6 +213,11 @@ rspamd_task_free (struct rspamd_task *task)
 
 	if (task) {
 		debug_task ("free pointer %p", task);
+		RSPAMD_PROBE2 (task__finish, task, task->task_pool->tag.uid);
+
+		if (task->worker && task->worker->srv->task_timings) {
+			rspamd_task_timings_record (task->worker->srv->task_timings, task);
+		}
 
 		if (task->rcpt_envelope) {
 			for (i = 0; i < task->rcpt_envelope->len; i ++) {
@@ -263,11 +291,18 @@ rspamd_task_free (struct rspamd_task *task)
 				g_hash_table_unref (task->lua_cache);
 			}
 
+			/*
+			 * Collect garbage of this task in small portions between
+			 * tasks instead of long gc cycles in the middle of a scan
+			 */
+			rspamd_lua_gc_task_step (task->cfg, task->event_loop);
+
 			if (task->cfg->full_gc_iters && (++free_iters > task->cfg->full_gc_iters)) {
 				/* Perform more expensive cleanup cycle */
 				gsize allocated = 0, active = 0, metadata = 0,
 						resident = 0, mapped = 0, old_lua_mem = 0;
 				gdouble t1, t2;
+				struct lua_thread_pool_stat threads_stat;
 
 				old_lua_mem = lua_gc (task->cfg->lua_state, LUA_GCCOUNT, 0);
 				t1 = rspamd_get_ticks (FALSE);
@@ -284,15 +319,26 @@ rspamd_task_free (struct rspamd_task *task)
 				malloc_trim (0);
 # endif
 #endif
+				RSPAMD_PROBE1 (gc__start, "full");
 				lua_gc (task->cfg->lua_state, LUA_GCCOLLECT, 0);
+				RSPAMD_PROBE1 (gc__finish, "full");
 				t2 = rspamd_get_ticks (FALSE);
+				memset (&threads_stat, 0, sizeof (threads_stat));
+
+				if (task->cfg->lua_thread_pool) {
+					lua_thread_pool_get_stat (task->cfg->lua_thread_pool,
+							&threads_stat);
+				}
 
 				msg_notice_task ("perform full gc cycle; memory stats: "
 								 "%Hz allocated, %Hz active, %Hz metadata, %Hz resident, %Hz mapped;"
-								 " lua memory: %z kb -> %d kb; %f ms for gc iter",
+								 " lua memory: %z kb -> %d kb; %f ms for gc iter;"
+								 " lua threads: %ud cached, %ud peak, %uL created, %uL reused",
 						allocated, active, metadata, resident, mapped,
 						old_lua_mem, lua_gc (task->cfg->lua_state, LUA_GCCOUNT, 0),
-						(t2 - t1) * 1000.0);
+						(t2 - t1) * 1000.0,
+						threads_stat.cached, threads_stat.peak,
+						threads_stat.created, threads_stat.reused);
 				free_iters = rspamd_time_jitter (0,
 						(gdouble)task->cfg->full_gc_iters / 2);
 			}
@@ -489,8 +535,8 @@ rspamd_task_load_message (struct rspamd_task *task,
 				return FALSE;
 			}
 
-			map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-
+			map = mmap (NULL, st.st_size, PROT_READ,
+					RSPAMD_TASK_FILE_MAP_FLAGS, fd, 0);
 
 			if (map == MAP_FAILED) {
 				close (fd);
@@ -538,14 +584,7 @@ rspamd_task_load_message (struct rspamd_task *task,
 			guchar *out;
 			gsize outlen, r;
 			gulong dict_id;
-
-			if (!rspamd_libs_reset_decompression (task->cfg->libs_ctx)) {
-				g_set_error (&task->err, rspamd_task_quark(),
-						RSPAMD_PROTOCOL_ERROR,
-						"Cannot decompress, decompressor init failed");
-
-				return FALSE;
-			}
+			struct zstd_dictionary *dict = NULL;
 
 			tok = rspamd_task_get_request_header (task, "dictionary");
 
@@ -558,19 +597,23 @@ rspamd_task_load_message (struct rspamd_task *task,
 					return FALSE;
 				}
 
-				if (!task->cfg->libs_ctx->in_dict) {
+				dict = rspamd_libs_find_zstd_dictionary (task->cfg->libs_ctx,
+						dict_id);
+
+				if (dict == NULL) {
 					g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
-							"Unknown dictionary, undefined locally");
+							"Unknown dictionary %lu, undefined locally", dict_id);
 
 					return FALSE;
 				}
+			}
 
-				if (task->cfg->libs_ctx->in_dict->id != dict_id) {
-					g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
-							"Unknown dictionary, invalid dictionary id");
+			if (!rspamd_libs_reset_decompression (task->cfg->libs_ctx, dict)) {
+				g_set_error (&task->err, rspamd_task_quark(),
+						RSPAMD_PROTOCOL_ERROR,
+						"Cannot decompress, decompressor init failed");
 
-					return FALSE;
-				}
+				return FALSE;
 			}
 
 			zstream = task->cfg->libs_ctx->in_zstream;
@@ -700,12 +743,43 @@ rspamd_task_select_processing_stage (struct rspamd_task *task, guint stages)
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+static gint
+rspamd_task_stage_timing_phase (gint st)
+{
+	switch (st) {
+	case RSPAMD_TASK_STAGE_READ_MESSAGE:
+	case RSPAMD_TASK_STAGE_PROCESS_MESSAGE:
+		return RSPAMD_TASK_TIMING_PARSE;
+	case RSPAMD_TASK_STAGE_CONNFILTERS:
+	case RSPAMD_TASK_STAGE_PRE_FILTERS:
+		return RSPAMD_TASK_TIMING_PREFILTERS;
+	case RSPAMD_TASK_STAGE_FILTERS:
+		return RSPAMD_TASK_TIMING_FILTERS;
+	case RSPAMD_TASK_STAGE_CLASSIFIERS_PRE:
+	case RSPAMD_TASK_STAGE_CLASSIFIERS:
+	case RSPAMD_TASK_STAGE_CLASSIFIERS_POST:
+	case RSPAMD_TASK_STAGE_LEARN_PRE:
+	case RSPAMD_TASK_STAGE_LEARN:
+	case RSPAMD_TASK_STAGE_LEARN_POST:
+		return RSPAMD_TASK_TIMING_CLASSIFIERS;
+	case RSPAMD_TASK_STAGE_COMPOSITES:
+	case RSPAMD_TASK_STAGE_COMPOSITES_POST:
+		return RSPAMD_TASK_TIMING_COMPOSITES;
+	case RSPAMD_TASK_STAGE_POST_FILTERS:
+	case RSPAMD_TASK_STAGE_IDEMPOTENT:
+		return RSPAMD_TASK_TIMING_POSTFILTERS;
+	default:
+		return -1;
+	}
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task, guint stages)
 {
-	gint st;
+	gint st, phase = -1;
 	gboolean ret = TRUE, all_done = TRUE;
 	GError *stat_error = NULL;
+	gdouble cpu_start = 0, res_start;
 
 	/* Avoid nested calls */
 	if (task->flags & RSPAMD_TASK_FLAG_PROCESSING) {
@@ -717,9 +791,28 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 	}
 
 	task->flags |= RSPAMD_TASK_FLAG_PROCESSING;
+	res_start = rspamd_task_cpu_enter (task);
 
 	st = rspamd_task_select_processing_stage (task, stages);
 
+	/*
+	 * CPU time covers the synchronous part of a stage only, whilst wall time
+	 * also includes waiting for asynchronous events (e.g. DNS or redis)
+	 */
+	if (task->worker && task->worker->srv->task_timings) {
+		phase = rspamd_task_stage_timing_phase (st);
+
+		if (phase != -1) {
+			if (task->times.stage_start == 0) {
+				task->times.stage_start = ev_time ();
+			}
+
+			cpu_start = rspamd_get_virtual_ticks ();
+		}
+	}
+
+	RSPAMD_PROBE3 (stage__start, task, st, rspamd_task_stage_name (st));
+
 	switch (st) {
 	case RSPAMD_TASK_STAGE_CONNFILTERS:
 		all_done = rspamd_symcache_process_symbols (task, task->cfg->cache, st);
@@ -841,12 +934,20 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		break;
 	}
 
+	RSPAMD_PROBE3 (stage__finish, task, st, rspamd_task_stage_name (st));
+
+	if (phase != -1) {
+		task->times.cpu[phase] += rspamd_get_virtual_ticks () - cpu_start;
+		task->times.cpu_mask |= 1u << phase;
+	}
+
 	if (RSPAMD_TASK_IS_SKIPPED (task)) {
 		/* Set all bits except idempotent filters */
 		task->processed_stages |= 0x7FFF;
 	}
 
 	task->flags &= ~RSPAMD_TASK_FLAG_PROCESSING;
+	rspamd_task_cpu_leave (task, res_start);
 
 	if (!ret || RSPAMD_TASK_IS_PROCESSED (task)) {
 		if (!ret) {
@@ -869,6 +970,14 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 				/* Mark the current stage as done and go to the next stage */
 				msg_debug_task ("completed stage %d", st);
 				task->processed_stages |= st;
+
+				if (phase != -1) {
+					ev_tstamp now = ev_time ();
+
+					task->times.wall[phase] += now - task->times.stage_start;
+					task->times.wall_mask |= 1u << phase;
+					task->times.stage_start = now;
+				}
 			}
 			else {
 				msg_debug_task ("need more processing on stage %d", st);
@@ -1577,6 +1686,31 @@ rspamd_task_log_variable (struct rspamd_task *task,
 				rspamd_mempool_get_wasted_size (task->task_pool));
 		var.begin = numbuf;
 		break;
+	case RSPAMD_LOG_CPU_TIME:
+		var.len = rspamd_snprintf (numbuf, sizeof (numbuf),
+				"%.3fms", task->resources.cpu_time * 1000.0);
+		var.begin = numbuf;
+		break;
+	case RSPAMD_LOG_LUA_HEAP:
+		var.len = rspamd_snprintf (numbuf, sizeof (numbuf),
+				"%L", task->resources.lua_heap_delta);
+		var.begin = numbuf;
+		break;
+	case RSPAMD_LOG_REDIS_REQ:
+		var.len = rspamd_snprintf (numbuf, sizeof (numbuf),
+				"%uD", task->resources.redis_requests);
+		var.begin = numbuf;
+		break;
+	case RSPAMD_LOG_REDIS_BYTES:
+		var.len = rspamd_snprintf (numbuf, sizeof (numbuf),
+				"%HL", task->resources.redis_bytes);
+		var.begin = numbuf;
+		break;
+	case RSPAMD_LOG_RE_BYTES:
+		var.len = rspamd_snprintf (numbuf, sizeof (numbuf),
+				"%HL", task->resources.re_bytes);
+		var.begin = numbuf;
+		break;
 	default:
 		var = rspamd_task_log_metric_res (task, lf);
 		break;
@@ -1654,6 +1788,260 @@ rspamd_task_write_log (struct rspamd_task *task)
 	rspamd_fstring_free (logbuf);
 }
 
+/* Per process state of the structured log */
+struct rspamd_task_structured_log {
+	gint fd;
+	gboolean failed;
+	pid_t pid;
+	rspamd_fstring_t *buf;
+	struct ev_loop *event_loop;
+	ev_timer flush_ev;
+};
+
+static struct rspamd_task_structured_log *structured_log = NULL;
+
+static void
+rspamd_task_structured_log_flush (struct rspamd_task_structured_log *sl)
+{
+	gsize written = 0;
+	gssize r;
+
+	while (sl->fd != -1 && written < sl->buf->len) {
+		r = write (sl->fd, sl->buf->str + written, sl->buf->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err ("cannot write %z bytes to structured log: %s",
+					sl->buf->len - written, strerror (errno));
+			break;
+		}
+
+		written += r;
+	}
+
+	sl->buf->len = 0;
+}
+
+static void
+rspamd_task_structured_log_timer (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_task_structured_log *sl =
+			(struct rspamd_task_structured_log *)w->data;
+
+	if (sl->buf->len > 0) {
+		rspamd_task_structured_log_flush (sl);
+	}
+}
+
+static void
+rspamd_task_structured_log_close (struct rspamd_task_structured_log *sl)
+{
+	rspamd_task_structured_log_flush (sl);
+
+	if (sl->fd != -1) {
+		close (sl->fd);
+		sl->fd = -1;
+	}
+}
+
+static void
+rspamd_task_structured_log_dtor (gpointer p)
+{
+	struct rspamd_task_structured_log *sl = (struct rspamd_task_structured_log *)p;
+
+	ev_timer_stop (sl->event_loop, &sl->flush_ev);
+	rspamd_task_structured_log_close (sl);
+	rspamd_fstring_free (sl->buf);
+
+	if (structured_log == sl) {
+		structured_log = NULL;
+	}
+
+	g_free (sl);
+}
+
+void
+rspamd_task_structured_log_reopen (void)
+{
+	if (structured_log) {
+		rspamd_task_structured_log_close (structured_log);
+		structured_log->failed = FALSE;
+	}
+}
+
+static struct rspamd_task_structured_log *
+rspamd_task_structured_log_get (struct rspamd_task *task)
+{
+	struct rspamd_task_structured_log *sl = structured_log;
+	pid_t pid = getpid ();
+
+	if (sl == NULL || sl->pid != pid) {
+		/* Records buffered by the parent are not ours */
+		sl = g_malloc0 (sizeof (*sl));
+		sl->fd = -1;
+		sl->pid = pid;
+		sl->buf = rspamd_fstring_sized_new (task->cfg->log_structured_batch);
+		/* Do not keep records of an idle worker for too long */
+		sl->event_loop = task->event_loop;
+		sl->flush_ev.data = sl;
+		ev_timer_init (&sl->flush_ev, rspamd_task_structured_log_timer,
+				task->cfg->log_structured_flush_time,
+				task->cfg->log_structured_flush_time);
+		ev_timer_start (sl->event_loop, &sl->flush_ev);
+		structured_log = sl;
+		/* Flush the last batch when the worker terminates */
+		rspamd_mempool_add_destructor (task->cfg->cfg_pool,
+				rspamd_task_structured_log_dtor, sl);
+	}
+
+	if (sl->fd == -1 && !sl->failed) {
+		sl->fd = open (task->cfg->log_structured_file,
+				O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 00644);
+
+		if (sl->fd == -1) {
+			/* Do not try on each message until the log is reopened */
+			sl->failed = TRUE;
+			msg_err_task ("cannot open structured log %s: %s",
+					task->cfg->log_structured_file, strerror (errno));
+		}
+	}
+
+	return sl;
+}
+
+void
+rspamd_task_write_structured_log (struct rspamd_task *task)
+{
+	struct rspamd_task_structured_log *sl;
+	struct rspamd_scan_result *mres;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_email_address *addr;
+	struct rspamd_action *act;
+	ucl_object_t *top, *elt;
+	gchar digestbuf[sizeof (MESSAGE_FIELD (task, digest)) * 2 + 1];
+	guint i;
+
+	if (task->cfg->log_structured_file == NULL ||
+			(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
+		return;
+	}
+
+	sl = rspamd_task_structured_log_get (task);
+
+	if (sl->fd == -1) {
+		return;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromdouble (task->task_timestamp),
+			"ts", 0, false);
+
+	if (task->queue_id) {
+		ucl_object_insert_key (top, ucl_object_fromstring (task->queue_id),
+				"qid", 0, false);
+	}
+
+	if (MESSAGE_FIELD_CHECK (task, message_id)) {
+		ucl_object_insert_key (top,
+				ucl_object_fromstring (MESSAGE_FIELD (task, message_id)),
+				"mid", 0, false);
+	}
+
+	if (task->message) {
+		rspamd_encode_hex_buf (MESSAGE_FIELD (task, digest),
+				sizeof (MESSAGE_FIELD (task, digest)),
+				digestbuf, sizeof (digestbuf));
+		digestbuf[sizeof (digestbuf) - 1] = '\0';
+		ucl_object_insert_key (top, ucl_object_fromstring (digestbuf),
+				"digest", 0, false);
+	}
+
+	if (task->from_addr && rspamd_ip_is_valid (task->from_addr)) {
+		ucl_object_insert_key (top,
+				ucl_object_fromstring (
+						rspamd_inet_address_to_string (task->from_addr)),
+				"ip", 0, false);
+	}
+
+	if (task->user) {
+		ucl_object_insert_key (top, ucl_object_fromstring (task->user),
+				"user", 0, false);
+	}
+
+	if (task->from_envelope) {
+		ucl_object_insert_key (top,
+				ucl_object_fromlstring (task->from_envelope->addr,
+						task->from_envelope->addr_len),
+				"from", 0, false);
+	}
+
+	if (task->rcpt_envelope) {
+		elt = ucl_object_typed_new (UCL_ARRAY);
+
+		PTR_ARRAY_FOREACH (task->rcpt_envelope, i, addr) {
+			ucl_array_append (elt, ucl_object_fromlstring (addr->addr,
+					addr->addr_len));
+		}
+
+		ucl_object_insert_key (top, elt, "rcpt", 0, false);
+	}
+
+	if (task->settings_elt) {
+		ucl_object_insert_key (top,
+				ucl_object_fromstring (task->settings_elt->name),
+				"settings_id", 0, false);
+	}
+
+	ucl_object_insert_key (top, ucl_object_fromint (task->msg.len),
+			"size", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (task->dns_requests),
+			"dns_req", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (
+					(task->time_real_finish - task->task_timestamp) * 1000.0),
+			"time_real", 0, false);
+
+	mres = task->result;
+
+	if (mres) {
+		act = rspamd_check_action_metric (task, NULL, NULL);
+
+		if (act) {
+			ucl_object_insert_key (top, ucl_object_fromstring (act->name),
+					"action", 0, false);
+		}
+
+		ucl_object_insert_key (top, ucl_object_fromdouble (mres->score),
+				"score", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromdouble (
+						rspamd_task_get_required_score (task, mres)),
+				"required_score", 0, false);
+
+		elt = ucl_object_typed_new (UCL_OBJECT);
+
+		kh_foreach_value (mres->symbols, sym, {
+			if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+				ucl_object_insert_key (elt, ucl_object_fromdouble (sym->score),
+						sym->name, 0, false);
+			}
+		});
+
+		ucl_object_insert_key (top, elt, "symbols", 0, false);
+	}
+
+	/* Msgpack objects are self delimited, so records are just concatenated */
+	rspamd_ucl_emit_fstring (top, UCL_EMIT_MSGPACK, &sl->buf);
+	ucl_object_unref (top);
+
+	if (sl->buf->len >= task->cfg->log_structured_batch) {
+		rspamd_task_structured_log_flush (sl);
+	}
+}
+
 gdouble
 rspamd_task_get_required_score (struct rspamd_task *task, struct rspamd_scan_result *m)
 {
@@ -1795,11 +2183,80 @@ rspamd_task_profile_get (struct rspamd_task *task, const gchar *key)
 }
 
 
+gdouble
+rspamd_task_cpu_enter (struct rspamd_task *task)
+{
+	if (task->resources.cpu_depth ++ == 0) {
+		return rspamd_get_thread_ticks ();
+	}
+
+	return 0;
+}
+
+void
+rspamd_task_cpu_leave (struct rspamd_task *task, gdouble start)
+{
+	g_assert (task->resources.cpu_depth > 0);
+
+	/* Nested sections are accounted by the outermost one */
+	if (-- task->resources.cpu_depth == 0) {
+		task->resources.cpu_time += rspamd_get_thread_ticks () - start;
+	}
+}
+
+static void
+rspamd_task_resources_finish (struct rspamd_task *task)
+{
+	struct rspamd_task_resources *res = &task->resources;
+	const struct rspamd_re_cache_stat *re_stat;
+
+	res->mempool_bytes = rspamd_mempool_get_used_size (task->task_pool);
+
+	if (task->cfg && task->cfg->lua_state && res->lua_heap_start > 0) {
+		lua_State *L = (lua_State *)task->cfg->lua_state;
+
+		/* Lua state is shared, so concurrent tasks are also accounted */
+		res->lua_heap_delta = (gint64)lua_gc (L, LUA_GCCOUNT, 0) * 1024 +
+				lua_gc (L, LUA_GCCOUNTB, 0) - res->lua_heap_start;
+	}
+
+	if (task->re_rt) {
+		re_stat = rspamd_re_cache_get_stat (task->re_rt);
+		res->re_bytes = re_stat->bytes_scanned;
+	}
+}
+
+ucl_object_t *
+rspamd_task_resources_to_ucl (struct rspamd_task *task)
+{
+	struct rspamd_task_resources *res = &task->resources;
+	ucl_object_t *top;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromdouble (res->cpu_time),
+			"cpu_time", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->mempool_bytes),
+			"mempool_bytes", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->lua_heap_delta),
+			"lua_heap", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (task->dns_requests),
+			"dns_requests", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->redis_requests),
+			"redis_requests", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->redis_bytes),
+			"redis_bytes", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->re_bytes),
+			"re_bytes", 0, false);
+
+	return top;
+}
+
 gboolean
 rspamd_task_set_finish_time (struct rspamd_task *task)
 {
 	if (isnan (task->time_real_finish)) {
 		task->time_real_finish = ev_time ();
+		rspamd_task_resources_finish (task);
 
 		return TRUE;
 	}
@@ -1874,6 +2331,210 @@ rspamd_task_stage_name (enum rspamd_task_stage stg)
 	return ret;
 }
 
+const gchar *
+rspamd_task_timing_phase_name (enum rspamd_task_timing_phase phase)
+{
+	const gchar *ret = "unknown";
+
+	switch (phase) {
+	case RSPAMD_TASK_TIMING_READ_BODY:
+		ret = "read_body";
+		break;
+	case RSPAMD_TASK_TIMING_PARSE:
+		ret = "parse";
+		break;
+	case RSPAMD_TASK_TIMING_PREFILTERS:
+		ret = "prefilters";
+		break;
+	case RSPAMD_TASK_TIMING_FILTERS:
+		ret = "filters";
+		break;
+	case RSPAMD_TASK_TIMING_CLASSIFIERS:
+		ret = "classifiers";
+		break;
+	case RSPAMD_TASK_TIMING_COMPOSITES:
+		ret = "composites";
+		break;
+	case RSPAMD_TASK_TIMING_POSTFILTERS:
+		ret = "postfilters";
+		break;
+	case RSPAMD_TASK_TIMING_WRITE_REPLY:
+		ret = "write_reply";
+		break;
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+static const gdouble rspamd_task_timing_bounds[RSPAMD_TASK_TIMING_BUCKETS - 1] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+void
+rspamd_task_timing_set (struct rspamd_task *task,
+		enum rspamd_task_timing_phase phase,
+		gdouble wall)
+{
+	g_assert (phase < RSPAMD_TASK_TIMING_MAX);
+
+	task->times.wall[phase] = MAX (wall, 0);
+	task->times.wall_mask |= 1u << phase;
+}
+
+static void
+rspamd_task_histogram_add (struct rspamd_task_histogram *hist, gdouble val)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_task_timing_bounds); i ++) {
+		if (val <= rspamd_task_timing_bounds[i]) {
+			break;
+		}
+	}
+
+	/* Histograms are shared by all workers */
+	__atomic_add_fetch (&hist->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&hist->sum_us, (guint64)(val * 1e6), __ATOMIC_RELAXED);
+}
+
+void
+rspamd_task_timings_record (struct rspamd_task_timings *timings,
+		struct rspamd_task *task)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_TASK_TIMING_MAX; i ++) {
+		if (task->times.wall_mask & (1u << i)) {
+			rspamd_task_histogram_add (&timings->wall[i], task->times.wall[i]);
+		}
+
+		if (task->times.cpu_mask & (1u << i)) {
+			rspamd_task_histogram_add (&timings->cpu[i], task->times.cpu[i]);
+		}
+	}
+}
+
+static ucl_object_t *
+rspamd_task_histograms_to_ucl (struct rspamd_task_histogram *hists)
+{
+	ucl_object_t *top, *obj, *ar;
+	guint i, j;
+	guint64 cumulative, cnt;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_TASK_TIMING_MAX; i ++) {
+		cnt = __atomic_load_n (&hists[i].count, __ATOMIC_RELAXED);
+
+		if (cnt == 0) {
+			continue;
+		}
+
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ar = ucl_object_typed_new (UCL_ARRAY);
+		cumulative = 0;
+
+		/* Cumulative counts as in Prometheus, the last bucket is +Inf */
+		for (j = 0; j < RSPAMD_TASK_TIMING_BUCKETS; j ++) {
+			cumulative += __atomic_load_n (&hists[i].buckets[j],
+					__ATOMIC_RELAXED);
+			ucl_array_append (ar, ucl_object_fromint (cumulative));
+		}
+
+		ucl_object_insert_key (obj, ar, "buckets", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cnt), "count", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				__atomic_load_n (&hists[i].sum_us, __ATOMIC_RELAXED) / 1e6),
+				"sum", 0, false);
+		ucl_object_insert_key (top, obj,
+				rspamd_task_timing_phase_name (i), 0, false);
+	}
+
+	return top;
+}
+
+ucl_object_t *
+rspamd_task_timings_to_ucl (struct rspamd_task_timings *timings)
+{
+	ucl_object_t *top, *ar;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ar = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_task_timing_bounds); i ++) {
+		ucl_array_append (ar, ucl_object_fromdouble (rspamd_task_timing_bounds[i]));
+	}
+
+	ucl_object_insert_key (top, ar, "bounds", 0, false);
+	ucl_object_insert_key (top, rspamd_task_histograms_to_ucl (timings->wall),
+			"wall", 0, false);
+	ucl_object_insert_key (top, rspamd_task_histograms_to_ucl (timings->cpu),
+			"cpu", 0, false);
+
+	return top;
+}
+
+static void
+rspamd_task_histograms_to_prometheus (struct rspamd_task_histogram *hists,
+		const gchar *name, GString *out)
+{
+	guint i, j;
+	guint64 cumulative, cnt;
+
+	for (i = 0; i < RSPAMD_TASK_TIMING_MAX; i ++) {
+		cnt = __atomic_load_n (&hists[i].count, __ATOMIC_RELAXED);
+
+		if (cnt == 0) {
+			continue;
+		}
+
+		cumulative = 0;
+
+		for (j = 0; j < RSPAMD_TASK_TIMING_BUCKETS; j ++) {
+			cumulative += __atomic_load_n (&hists[i].buckets[j],
+					__ATOMIC_RELAXED);
+
+			if (j < G_N_ELEMENTS (rspamd_task_timing_bounds)) {
+				rspamd_printf_gstring (out,
+						"%s_bucket{phase=\"%s\",le=\"%g\"} %uL\n",
+						name, rspamd_task_timing_phase_name (i),
+						rspamd_task_timing_bounds[j], cumulative);
+			}
+			else {
+				rspamd_printf_gstring (out,
+						"%s_bucket{phase=\"%s\",le=\"+Inf\"} %uL\n",
+						name, rspamd_task_timing_phase_name (i), cumulative);
+			}
+		}
+
+		rspamd_printf_gstring (out, "%s_sum{phase=\"%s\"} %.6f\n",
+				name, rspamd_task_timing_phase_name (i),
+				__atomic_load_n (&hists[i].sum_us, __ATOMIC_RELAXED) / 1e6);
+		rspamd_printf_gstring (out, "%s_count{phase=\"%s\"} %uL\n",
+				name, rspamd_task_timing_phase_name (i), cnt);
+	}
+}
+
+void
+rspamd_task_timings_to_prometheus (struct rspamd_task_timings *timings,
+		const gchar *prefix, GString *out)
+{
+	gchar name[128];
+
+	rspamd_snprintf (name, sizeof (name), "%s_task_wall_seconds", prefix);
+	rspamd_printf_gstring (out, "# HELP %s Wall time spent by tasks per phase\n"
+			"# TYPE %s histogram\n", name, name);
+	rspamd_task_histograms_to_prometheus (timings->wall, name, out);
+	rspamd_snprintf (name, sizeof (name), "%s_task_cpu_seconds", prefix);
+	rspamd_printf_gstring (out, "# HELP %s CPU time spent by tasks per phase\n"
+			"# TYPE %s histogram\n", name, name);
+	rspamd_task_histograms_to_prometheus (timings->cpu, name, out);
+}
+
 void
 rspamd_task_timeout (EV_P_ ev_timer *w, int revents)
 {
@@ -1948,7 +2609,20 @@ rspamd_worker_guard_handler (EV_P_ ev_io *w, int revents)
 	gchar fake_buf[1024];
 	gssize r;
 
-	r = read (w->fd, fake_buf, sizeof (fake_buf));
+	if (task->http_conn && rspamd_http_connection_is_keepalive (task->http_conn)) {
+		/* Do not consume pipelined requests */
+		r = recv (w->fd, fake_buf, 1, MSG_PEEK);
+
+		if (r > 0) {
+			msg_debug_task ("got pipelined request, it is read after the reply");
+			ev_io_stop (task->event_loop, &task->guard_ev);
+
+			return;
+		}
+	}
+	else {
+		r = read (w->fd, fake_buf, sizeof (fake_buf));
+	}
 
 	if (r > 0) {
 		msg_warn_task ("received extra data after task is loaded, ignoring");
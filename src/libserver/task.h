@@ -87,6 +87,66 @@ enum rspamd_task_stage {
         RSPAMD_TASK_STAGE_LEARN_POST | \
         RSPAMD_TASK_STAGE_DONE)
 
+/*
+ * Phases of the task lifecycle timed by histograms, processing stages are
+ * grouped into them
+ */
+enum rspamd_task_timing_phase {
+	RSPAMD_TASK_TIMING_READ_BODY = 0,
+	RSPAMD_TASK_TIMING_PARSE,
+	RSPAMD_TASK_TIMING_PREFILTERS,
+	RSPAMD_TASK_TIMING_FILTERS,
+	RSPAMD_TASK_TIMING_CLASSIFIERS,
+	RSPAMD_TASK_TIMING_COMPOSITES,
+	RSPAMD_TASK_TIMING_POSTFILTERS,
+	RSPAMD_TASK_TIMING_WRITE_REPLY,
+	RSPAMD_TASK_TIMING_MAX,
+};
+
+/* Upper bounds of histogram buckets are 1ms..10s, the last one is +Inf */
+#define RSPAMD_TASK_TIMING_BUCKETS 14
+
+struct rspamd_task_histogram {
+	guint64 buckets[RSPAMD_TASK_TIMING_BUCKETS];    /**< observations per bucket (not cumulative)	*/
+	guint64 count;                                  /**< number of observations						*/
+	guint64 sum_us;                                 /**< sum of observations in microseconds		*/
+};
+
+/*
+ * Wall and CPU time histograms per phase, allocated in shared memory by the
+ * main process and updated by all workers
+ */
+struct rspamd_task_timings {
+	struct rspamd_task_histogram wall[RSPAMD_TASK_TIMING_MAX];
+	struct rspamd_task_histogram cpu[RSPAMD_TASK_TIMING_MAX];
+};
+
+/*
+ * Times spent by a single task in each phase
+ */
+struct rspamd_task_phase_times {
+	ev_tstamp stage_start;                          /**< when the current stage has started			*/
+	ev_tstamp reply_start;                          /**< when the reply write has started			*/
+	gdouble wall[RSPAMD_TASK_TIMING_MAX];
+	gdouble cpu[RSPAMD_TASK_TIMING_MAX];
+	guint wall_mask;                                /**< phases with wall time measured				*/
+	guint cpu_mask;                                 /**< phases with CPU time measured				*/
+};
+
+/*
+ * Resources consumed by a single task
+ */
+struct rspamd_task_resources {
+	gdouble cpu_time;                               /**< thread CPU time of processing and callbacks	*/
+	gint64 lua_heap_start;                          /**< Lua heap size when the task has been created	*/
+	gint64 lua_heap_delta;                          /**< Lua heap growth, includes concurrent tasks	*/
+	gsize mempool_bytes;                            /**< bytes allocated in the task pool				*/
+	guint64 re_bytes;                               /**< bytes scanned by regular expressions			*/
+	guint64 redis_bytes;                            /**< bytes of redis requests and replies			*/
+	guint32 redis_requests;                         /**< number of redis requests						*/
+	guint cpu_depth;                                /**< nesting of CPU accounted sections				*/
+};
+
 #define RSPAMD_TASK_FLAG_MIME (1u << 0u)
 #define RSPAMD_TASK_FLAG_SKIP_PROCESS (1u << 1u)
 #define RSPAMD_TASK_FLAG_SKIP (1u << 2u)
@@ -112,7 +172,8 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_SSL (1u << 22u)
 #define RSPAMD_TASK_FLAG_BAD_UNICODE (1u << 23u)
 #define RSPAMD_TASK_FLAG_MESSAGE_REWRITE (1u << 24u)
-#define RSPAMD_TASK_FLAG_MAX_SHIFT (24u)
+#define RSPAMD_TASK_FLAG_BULK (1u << 25u)
+#define RSPAMD_TASK_FLAG_MAX_SHIFT (25u)
 
 
 /* Request has a JSON control block */
@@ -129,7 +190,11 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK (1u << 5u)
 /* Emit groups information */
 #define RSPAMD_TASK_PROTOCOL_FLAG_GROUPS (1u << 6u)
-#define RSPAMD_TASK_PROTOCOL_FLAG_MAX_SHIFT (6u)
+/* Client accepts msgpack reply */
+#define RSPAMD_TASK_PROTOCOL_FLAG_MSGPACK (1u << 7u)
+/* Emit resources consumed by a task */
+#define RSPAMD_TASK_PROTOCOL_FLAG_RESOURCES (1u << 8u)
+#define RSPAMD_TASK_PROTOCOL_FLAG_MAX_SHIFT (8u)
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_SPAMC(task) (((task)->cmd == CMD_CHECK_SPAMC))
@@ -214,6 +279,8 @@ struct rspamd_task {
 	const gchar *classifier;                        /**< Classifier to learn (if needed)				*/
 	struct rspamd_lang_detector *lang_det;            /**< Languages detector								*/
 	struct rspamd_message *message;
+	struct rspamd_task_phase_times times;            /**< lifecycle phases timings						*/
+	struct rspamd_task_resources resources;          /**< resources consumed by the task				*/
 };
 
 /**
@@ -342,6 +409,17 @@ void rspamd_task_add_request_header (struct rspamd_task *task,
  */
 void rspamd_task_write_log (struct rspamd_task *task);
 
+/**
+ * Append a msgpack record about the specified task to the structured log
+ * (`logging.structured_log`), records are written in batches
+ */
+void rspamd_task_write_structured_log (struct rspamd_task *task);
+
+/**
+ * Flush pending records and reopen structured log on the next write
+ */
+void rspamd_task_structured_log_reopen (void);
+
 /**
  * Set profiling value for a specific key
  * @param task
@@ -373,6 +451,56 @@ gboolean rspamd_task_set_finish_time (struct rspamd_task *task);
  */
 const gchar *rspamd_task_stage_name (enum rspamd_task_stage stg);
 
+/**
+ * Returns name of a lifecycle phase timed by histograms
+ * @param phase
+ * @return
+ */
+const gchar *rspamd_task_timing_phase_name (enum rspamd_task_timing_phase phase);
+
+/**
+ * Accounts time spent by a task in a phase outside of the processing stages
+ * (e.g. reading request or writing reply)
+ */
+void rspamd_task_timing_set (struct rspamd_task *task,
+							 enum rspamd_task_timing_phase phase,
+							 gdouble wall);
+
+/**
+ * Adds timings of a finished task to the histograms shared by all workers
+ */
+void rspamd_task_timings_record (struct rspamd_task_timings *timings,
+								 struct rspamd_task *task);
+
+/**
+ * Exports timings histograms as an UCL object
+ */
+ucl_object_t *rspamd_task_timings_to_ucl (struct rspamd_task_timings *timings);
+
+/**
+ * Appends timings histograms to `out` in Prometheus text exposition format,
+ * metrics names start with `prefix`
+ */
+void rspamd_task_timings_to_prometheus (struct rspamd_task_timings *timings,
+										const gchar *prefix, GString *out);
+
+/**
+ * Starts CPU accounting of a section run on behalf of a task (e.g. an
+ * asynchronous callback), sections can be nested
+ * @return value to be passed to `rspamd_task_cpu_leave`
+ */
+gdouble rspamd_task_cpu_enter (struct rspamd_task *task);
+
+/**
+ * Adds CPU time of the outermost section to the task resources
+ */
+void rspamd_task_cpu_leave (struct rspamd_task *task, gdouble start);
+
+/**
+ * Exports resources consumed by a task as an UCL object
+ */
+ucl_object_t *rspamd_task_resources_to_ucl (struct rspamd_task *task);
+
 /*
  * Called on forced timeout
  */
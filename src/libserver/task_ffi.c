@@ -0,0 +1,399 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "task_ffi.h"
+#include "task.h"
+#include "url.h"
+#include "scan_result.h"
+#include "libmime/message.h"
+#include "libmime/mime_headers.h"
+#include "libmime/email_addr.h"
+#include "libmime/content_type.h"
+#include "utlist.h"
+
+int
+rspamd_task_ffi_get_string (struct rspamd_task *task,
+		enum rspamd_task_ffi_field field,
+		struct rspamd_ffi_str *out)
+{
+	const gchar *s = NULL;
+	gsize len = 0;
+
+	switch (field) {
+	case RSPAMD_TASK_FFI_SUBJECT:
+		s = MESSAGE_FIELD_CHECK (task, subject);
+		break;
+	case RSPAMD_TASK_FFI_MESSAGE_ID:
+		s = MESSAGE_FIELD_CHECK (task, message_id);
+		break;
+	case RSPAMD_TASK_FFI_HELO:
+		s = task->helo;
+		break;
+	case RSPAMD_TASK_FFI_HOSTNAME:
+		s = task->hostname;
+		break;
+	case RSPAMD_TASK_FFI_USER:
+		s = task->user;
+		break;
+	case RSPAMD_TASK_FFI_QUEUE_ID:
+		s = task->queue_id;
+		break;
+	case RSPAMD_TASK_FFI_FROM_IP:
+		if (task->from_addr) {
+			s = rspamd_inet_address_to_string (task->from_addr);
+		}
+		break;
+	case RSPAMD_TASK_FFI_DELIVER_TO:
+		s = task->deliver_to;
+		break;
+	case RSPAMD_TASK_FFI_PRINCIPAL_RECIPIENT:
+		s = rspamd_task_get_principal_recipient (task);
+		break;
+	case RSPAMD_TASK_FFI_RAW_MESSAGE:
+		s = task->msg.begin;
+		len = task->msg.len;
+		break;
+	case RSPAMD_TASK_FFI_RAW_HEADERS:
+		if (task->message) {
+			s = MESSAGE_FIELD (task, raw_headers_content).begin;
+			len = MESSAGE_FIELD (task, raw_headers_content).len;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (s == NULL) {
+		return 0;
+	}
+
+	out->begin = s;
+	out->len = len > 0 ? len : strlen (s);
+
+	return 1;
+}
+
+size_t
+rspamd_task_ffi_get_size (struct rspamd_task *task)
+{
+	return task->msg.len;
+}
+
+unsigned int
+rspamd_task_ffi_get_headers (struct rspamd_task *task,
+		const char *name,
+		struct rspamd_ffi_header *out, unsigned int max)
+{
+	struct rspamd_mime_header *rh, *cur;
+	unsigned int n = 0;
+
+	if (task->message == NULL) {
+		return 0;
+	}
+
+	rh = rspamd_message_get_header_array (task, name, FALSE);
+
+	DL_FOREACH (rh, cur) {
+		if (n < max) {
+			out[n].name = cur->name;
+			out[n].value = cur->value;
+			out[n].decoded = cur->decoded;
+			out[n].raw = cur->raw_value;
+			out[n].raw_len = cur->raw_len;
+			out[n].order = cur->order;
+			out[n].flags = cur->flags;
+		}
+
+		n ++;
+	}
+
+	return n;
+}
+
+static inline void
+rspamd_task_ffi_fill_email (struct rspamd_ffi_email *out,
+		const struct rspamd_email_address *addr)
+{
+	out->raw = addr->raw;
+	out->addr = addr->addr;
+	out->user = addr->user;
+	out->domain = addr->domain;
+	out->name = addr->name;
+	out->raw_len = addr->raw_len;
+	out->addr_len = addr->addr_len;
+	out->user_len = addr->user_len;
+	out->domain_len = addr->domain_len;
+	out->flags = addr->flags;
+}
+
+static unsigned int
+rspamd_task_ffi_fill_emails (GPtrArray *addrs,
+		struct rspamd_ffi_email *out, unsigned int max)
+{
+	struct rspamd_email_address *addr;
+	unsigned int i;
+
+	if (addrs == NULL) {
+		return 0;
+	}
+
+	PTR_ARRAY_FOREACH (addrs, i, addr) {
+		if (i >= max) {
+			break;
+		}
+
+		rspamd_task_ffi_fill_email (&out[i], addr);
+	}
+
+	return addrs->len;
+}
+
+unsigned int
+rspamd_task_ffi_get_from (struct rspamd_task *task, int mime,
+		struct rspamd_ffi_email *out, unsigned int max)
+{
+	if (mime) {
+		return rspamd_task_ffi_fill_emails (MESSAGE_FIELD_CHECK (task, from_mime),
+				out, max);
+	}
+
+	if (task->from_envelope == NULL) {
+		return 0;
+	}
+
+	if (max > 0) {
+		rspamd_task_ffi_fill_email (out, task->from_envelope);
+	}
+
+	return 1;
+}
+
+unsigned int
+rspamd_task_ffi_get_recipients (struct rspamd_task *task, int mime,
+		struct rspamd_ffi_email *out, unsigned int max)
+{
+	return rspamd_task_ffi_fill_emails (mime ?
+			MESSAGE_FIELD_CHECK (task, rcpt_mime) : task->rcpt_envelope,
+			out, max);
+}
+
+unsigned int
+rspamd_task_ffi_get_urls (struct rspamd_task *task,
+		struct rspamd_ffi_url *out, unsigned int max)
+{
+	struct rspamd_url *u;
+	unsigned int n = 0;
+
+	if (task->message == NULL || MESSAGE_FIELD (task, urls) == NULL) {
+		return 0;
+	}
+
+	if (max == 0) {
+		return kh_size (MESSAGE_FIELD (task, urls));
+	}
+
+	kh_foreach_key (MESSAGE_FIELD (task, urls), u, {
+		if (n < max) {
+			out[n].string = u->string;
+			out[n].host = rspamd_url_host_unsafe (u);
+			out[n].tld = rspamd_url_tld_unsafe (u);
+			out[n].len = u->urllen;
+			out[n].hostlen = u->hostlen;
+			out[n].tldlen = u->tldlen;
+			out[n].protocol = u->protocol;
+			out[n].port = u->port;
+			out[n].flags = u->flags;
+			out[n].count = u->count;
+		}
+
+		n ++;
+	});
+
+	return n;
+}
+
+unsigned int
+rspamd_task_ffi_get_text_parts (struct rspamd_task *task,
+		struct rspamd_ffi_text_part *out, unsigned int max)
+{
+	struct rspamd_mime_text_part *part;
+	GPtrArray *parts = MESSAGE_FIELD_CHECK (task, text_parts);
+	unsigned int i;
+
+	if (parts == NULL) {
+		return 0;
+	}
+
+	PTR_ARRAY_FOREACH (parts, i, part) {
+		if (i >= max) {
+			break;
+		}
+
+		if (part->utf_content) {
+			out[i].content = (const char *)part->utf_content->data;
+			out[i].len = part->utf_content->len;
+		}
+		else {
+			out[i].content = NULL;
+			out[i].len = 0;
+		}
+
+		out[i].raw = part->raw.begin;
+		out[i].raw_len = part->raw.len;
+		out[i].language = part->language;
+		out[i].flags = part->flags;
+		out[i].nlines = part->nlines;
+		out[i].nwords = part->nwords;
+		out[i].non_ascii_chars = part->non_ascii_chars;
+		out[i].ascii_chars = part->ascii_chars;
+		out[i].capital_letters = part->capital_letters;
+		out[i].numeric_characters = part->numeric_characters;
+		out[i].part_number = part->mime_part ? part->mime_part->part_number : 0;
+	}
+
+	return parts->len;
+}
+
+unsigned int
+rspamd_task_ffi_get_parts (struct rspamd_task *task,
+		struct rspamd_ffi_mime_part *out, unsigned int max)
+{
+	struct rspamd_mime_part *part;
+	GPtrArray *parts = MESSAGE_FIELD_CHECK (task, parts);
+	unsigned int i;
+
+	if (parts == NULL) {
+		return 0;
+	}
+
+	PTR_ARRAY_FOREACH (parts, i, part) {
+		if (i >= max) {
+			break;
+		}
+
+		memset (&out[i], 0, sizeof (out[i]));
+
+		if (part->ct) {
+			out[i].type.begin = part->ct->type.begin;
+			out[i].type.len = part->ct->type.len;
+			out[i].subtype.begin = part->ct->subtype.begin;
+			out[i].subtype.len = part->ct->subtype.len;
+		}
+
+		if (part->cd) {
+			out[i].filename.begin = part->cd->filename.begin;
+			out[i].filename.len = part->cd->filename.len;
+		}
+
+		out[i].content = part->parsed_data.begin;
+		out[i].len = part->parsed_data.len;
+		out[i].raw = part->raw_data.begin;
+		out[i].raw_len = part->raw_data.len;
+		out[i].flags = part->flags;
+		out[i].part_type = part->part_type;
+		out[i].part_number = part->part_number;
+		out[i].is_text = part->part_type == RSPAMD_MIME_PART_TEXT;
+	}
+
+	return parts->len;
+}
+
+static inline void
+rspamd_task_ffi_fill_symbol (struct rspamd_ffi_symbol *out,
+		struct rspamd_symbol_result *s)
+{
+	struct rspamd_symbol_option *opt;
+	unsigned int nopts = 0;
+
+	DL_FOREACH (s->opts_head, opt) {
+		nopts ++;
+	}
+
+	out->name = s->name;
+	out->score = s->score;
+	out->nshots = s->nshots;
+	out->nopts = nopts;
+	out->flags = s->flags;
+}
+
+int
+rspamd_task_ffi_get_symbol (struct rspamd_task *task, const char *name,
+		struct rspamd_ffi_symbol *out)
+{
+	struct rspamd_symbol_result *s;
+
+	if (task->result == NULL) {
+		return 0;
+	}
+
+	s = rspamd_task_find_symbol_result (task, name, NULL);
+
+	if (s == NULL || (s->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+		return 0;
+	}
+
+	if (out) {
+		rspamd_task_ffi_fill_symbol (out, s);
+	}
+
+	return 1;
+}
+
+struct rspamd_task_ffi_symbols_cbdata {
+	struct rspamd_ffi_symbol *out;
+	unsigned int max;
+	unsigned int n;
+};
+
+static void
+rspamd_task_ffi_symbols_cb (gpointer k, gpointer v, gpointer ud)
+{
+	struct rspamd_task_ffi_symbols_cbdata *cbd = ud;
+	struct rspamd_symbol_result *s = v;
+
+	if (s->flags & RSPAMD_SYMBOL_RESULT_IGNORED) {
+		return;
+	}
+
+	if (cbd->n < cbd->max) {
+		rspamd_task_ffi_fill_symbol (&cbd->out[cbd->n], s);
+	}
+
+	cbd->n ++;
+}
+
+unsigned int
+rspamd_task_ffi_get_symbols (struct rspamd_task *task,
+		struct rspamd_ffi_symbol *out, unsigned int max)
+{
+	struct rspamd_task_ffi_symbols_cbdata cbd;
+
+	if (task->result == NULL) {
+		return 0;
+	}
+
+	cbd.out = out;
+	cbd.max = max;
+	cbd.n = 0;
+	rspamd_task_symbol_result_foreach (task, NULL, rspamd_task_ffi_symbols_cb,
+			&cbd);
+
+	return cbd.n;
+}
+
+double
+rspamd_task_ffi_get_score (struct rspamd_task *task)
+{
+	return task->result ? task->result->score : 0.0;
+}
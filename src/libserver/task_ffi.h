@@ -0,0 +1,202 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_TASK_FFI_H
+#define RSPAMD_TASK_FFI_H
+
+/*
+ * Plain C accessors of task data suitable for LuaJIT FFI (see lualib/lua_ffi/task.lua).
+ * Structures and signatures here use no glib types and MUST be kept in sync
+ * with the ffi definitions on Lua side.
+ *
+ * All strings returned are owned by the task and are valid until the task is
+ * destroyed or the corresponding data is modified (e.g. headers are changed).
+ * Functions that fill arrays return the total number of elements available,
+ * which can be larger than `max`, so they can be called with `max = 0`
+ * to get the number of elements only.
+ */
+
+#include "config.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct rspamd_task;
+
+struct rspamd_ffi_str {
+	const char *begin;
+	size_t len;
+};
+
+enum rspamd_task_ffi_field {
+	RSPAMD_TASK_FFI_SUBJECT = 0,
+	RSPAMD_TASK_FFI_MESSAGE_ID,
+	RSPAMD_TASK_FFI_HELO,
+	RSPAMD_TASK_FFI_HOSTNAME,
+	RSPAMD_TASK_FFI_USER,
+	RSPAMD_TASK_FFI_QUEUE_ID,
+	RSPAMD_TASK_FFI_FROM_IP,
+	RSPAMD_TASK_FFI_DELIVER_TO,
+	RSPAMD_TASK_FFI_PRINCIPAL_RECIPIENT,
+	RSPAMD_TASK_FFI_RAW_MESSAGE,
+	RSPAMD_TASK_FFI_RAW_HEADERS,
+};
+
+struct rspamd_ffi_header {
+	const char *name;
+	const char *value;
+	const char *decoded;
+	const char *raw;
+	size_t raw_len;
+	unsigned int order;
+	int flags;
+};
+
+struct rspamd_ffi_email {
+	const char *raw;
+	const char *addr;
+	const char *user;
+	const char *domain;
+	const char *name;
+	unsigned int raw_len;
+	unsigned int addr_len;
+	unsigned int user_len;
+	unsigned int domain_len;
+	unsigned int flags;
+};
+
+struct rspamd_ffi_url {
+	const char *string;
+	const char *host;
+	const char *tld;
+	unsigned int len;
+	unsigned int hostlen;
+	unsigned int tldlen;
+	unsigned int protocol;
+	unsigned int port;
+	unsigned int flags;
+	unsigned int count;
+};
+
+struct rspamd_ffi_text_part {
+	const char *content;
+	size_t len;
+	const char *raw;
+	size_t raw_len;
+	const char *language;
+	unsigned int flags;
+	unsigned int nlines;
+	unsigned int nwords;
+	unsigned int non_ascii_chars;
+	unsigned int ascii_chars;
+	unsigned int capital_letters;
+	unsigned int numeric_characters;
+	unsigned int part_number;
+};
+
+struct rspamd_ffi_mime_part {
+	struct rspamd_ffi_str type;
+	struct rspamd_ffi_str subtype;
+	struct rspamd_ffi_str filename;
+	const char *content;
+	size_t len;
+	const char *raw;
+	size_t raw_len;
+	unsigned int flags;
+	unsigned int part_type;
+	unsigned int part_number;
+	int is_text;
+};
+
+struct rspamd_ffi_symbol {
+	const char *name;
+	double score;
+	unsigned int nshots;
+	unsigned int nopts;
+	unsigned int flags;
+};
+
+/**
+ * Returns a string field of a task
+ * @return non-zero if the field is defined
+ */
+int rspamd_task_ffi_get_string (struct rspamd_task *task,
+		enum rspamd_task_ffi_field field,
+		struct rspamd_ffi_str *out);
+
+/**
+ * Returns size of the message
+ */
+size_t rspamd_task_ffi_get_size (struct rspamd_task *task);
+
+/**
+ * Fills `out` with headers named `name` (case insensitive) in order
+ */
+unsigned int rspamd_task_ffi_get_headers (struct rspamd_task *task,
+		const char *name,
+		struct rspamd_ffi_header *out, unsigned int max);
+
+/**
+ * Fills `out` with addresses from SMTP (`mime` is zero) or MIME From
+ */
+unsigned int rspamd_task_ffi_get_from (struct rspamd_task *task, int mime,
+		struct rspamd_ffi_email *out, unsigned int max);
+
+/**
+ * Fills `out` with SMTP (`mime` is zero) or MIME recipients
+ */
+unsigned int rspamd_task_ffi_get_recipients (struct rspamd_task *task, int mime,
+		struct rspamd_ffi_email *out, unsigned int max);
+
+/**
+ * Fills `out` with urls found in the message, order of urls is not defined
+ */
+unsigned int rspamd_task_ffi_get_urls (struct rspamd_task *task,
+		struct rspamd_ffi_url *out, unsigned int max);
+
+/**
+ * Fills `out` with text parts of the message
+ */
+unsigned int rspamd_task_ffi_get_text_parts (struct rspamd_task *task,
+		struct rspamd_ffi_text_part *out, unsigned int max);
+
+/**
+ * Fills `out` with all mime parts of the message
+ */
+unsigned int rspamd_task_ffi_get_parts (struct rspamd_task *task,
+		struct rspamd_ffi_mime_part *out, unsigned int max);
+
+/**
+ * Finds a symbol in the default scan result
+ * @return non-zero if a symbol has been inserted
+ */
+int rspamd_task_ffi_get_symbol (struct rspamd_task *task, const char *name,
+		struct rspamd_ffi_symbol *out);
+
+/**
+ * Fills `out` with symbols of the default scan result, order is not defined
+ */
+unsigned int rspamd_task_ffi_get_symbols (struct rspamd_task *task,
+		struct rspamd_ffi_symbol *out, unsigned int max);
+
+/**
+ * Returns current score of the default scan result
+ */
+double rspamd_task_ffi_get_score (struct rspamd_task *task);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
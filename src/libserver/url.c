@@ -45,6 +45,8 @@
 #include "rspamd.h"
 #include "message.h"
 #include "multipattern.h"
+#include "cryptobox.h"
+#include "hash.h"
 #include "contrib/uthash/utlist.h"
 #include "contrib/http-parser/http_parser.h"
 #include <unicode/utf8.h>
@@ -275,15 +277,60 @@ struct url_callback_data {
 	void *funcd;
 };
 
+/* Public suffixes from the tld file, value is URL_FLAG_STAR_MATCH or zero */
+KHASH_INIT (rspamd_url_tlds, const rspamd_ftok_t *, gint, 1,
+		rspamd_ftok_icase_hash, rspamd_ftok_icase_equal);
+
 struct url_match_scanner {
 	GArray *matchers_full;
 	GArray *matchers_strict;
 	struct rspamd_multipattern *search_trie_full;
 	struct rspamd_multipattern *search_trie_strict;
+	khash_t(rspamd_url_tlds) *tlds;
 };
 
 struct url_match_scanner *url_scanner = NULL;
 
+/*
+ * TLD suffixes are compiled by a separate thread while the rest of the
+ * config is initialised, only the thread that has started it reads these
+ */
+struct rspamd_url_compile_job {
+	GThread *thread;
+	gchar *tld_file;
+	gboolean parsed;
+};
+
+static struct rspamd_url_compile_job *url_compile_job = NULL;
+
+static inline void
+rspamd_url_wait_compiled (void)
+{
+	if (G_UNLIKELY (url_compile_job != NULL)) {
+		rspamd_url_init_wait ();
+	}
+}
+
+/*
+ * Bulk mail repeats the same urls in many messages, so parse results
+ * are cached per process and copied to a task pool on hit
+ */
+struct rspamd_url_cache_entry {
+	guint64 hash;
+	gsize len;
+	gint parse_flags;
+	enum uri_errno ret;
+	struct rspamd_url url; /* string points to the data after raw */
+	gchar data[]; /* raw string followed by url string */
+};
+
+/* Urls longer than that are not cached */
+#define RSPAMD_URL_CACHE_MAX_LEN 2048
+
+static rspamd_lru_hash_t *url_cache = NULL;
+static guint url_cache_max = 0;
+static struct rspamd_stat *url_cache_stat = NULL;
+
 enum {
 	IS_LWSP = (1 << 0),
 	IS_DOMAIN = (1 << 1),
@@ -449,6 +496,91 @@ rspamd_url_strerror (int err)
 	return NULL;
 }
 
+static void
+rspamd_url_add_tld_suffix (struct url_match_scanner *scanner,
+		const gchar *suffix, gint flags)
+{
+	rspamd_ftok_t *tok;
+	gsize len = strlen (suffix);
+	khiter_t k;
+	gint r;
+
+	tok = g_malloc (sizeof (*tok) + len);
+	memcpy (((gchar *)tok) + sizeof (*tok), suffix, len);
+	tok->begin = ((gchar *)tok) + sizeof (*tok);
+	tok->len = len;
+
+	k = kh_put (rspamd_url_tlds, scanner->tlds, tok, &r);
+
+	if (r == 0) {
+		/* Both `*.suffix` and `suffix` are defined, star is longer */
+		g_free (tok);
+		kh_value (scanner->tlds, k) |= (flags & URL_FLAG_STAR_MATCH);
+	}
+	else {
+		kh_value (scanner->tlds, k) = (flags & URL_FLAG_STAR_MATCH);
+	}
+}
+
+/*
+ * Finds the longest `tld` (public suffix plus one more label, or two more
+ * for star suffixes) of a hostname by looking up every its label suffix.
+ * That is equal to what the tld patterns of the full trie match but it does
+ * not require to scan the whole hostname by the multipattern.
+ * Returns length of the tld found (or 0), sets `tld_start` accordingly
+ */
+static gsize
+rspamd_url_find_tld_suffix (const gchar *host, gsize hostlen,
+		const gchar **tld_start)
+{
+	const gchar *p, *q, *pos, *end = host + hostlen, *best = NULL;
+	rspamd_ftok_t srch;
+	khiter_t k;
+	gint ndots;
+
+	for (p = host; p < end - 1; p ++) {
+		if (*p != '.') {
+			continue;
+		}
+
+		srch.begin = p + 1;
+		srch.len = end - p - 1;
+		k = kh_get (rspamd_url_tlds, url_scanner->tlds, &srch);
+
+		if (k == kh_end (url_scanner->tlds)) {
+			continue;
+		}
+
+		ndots = (kh_value (url_scanner->tlds, k) & URL_FLAG_STAR_MATCH) ? 2 : 1;
+		pos = host;
+		q = p - 1;
+
+		while (q >= host && ndots > 0) {
+			if (*q == '.') {
+				ndots--;
+				pos = q + 1;
+			}
+			else {
+				pos = q;
+			}
+
+			q--;
+		}
+
+		if (best == NULL || pos < best) {
+			best = pos;
+		}
+	}
+
+	if (best) {
+		*tld_start = best;
+
+		return end - best;
+	}
+
+	return 0;
+}
+
 static gboolean
 rspamd_url_parse_tld_file (const gchar *fname,
 		struct url_match_scanner *scanner)
@@ -502,6 +634,7 @@ rspamd_url_parse_tld_file (const gchar *fname,
 		}
 
 		m.flags = flags;
+		rspamd_url_add_tld_suffix (scanner, p, flags);
 		rspamd_multipattern_add_pattern (url_scanner->search_trie_full, p,
 				RSPAMD_MULTIPATTERN_TLD|RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8);
 		m.pattern = rspamd_multipattern_get_pattern (url_scanner->search_trie_full,
@@ -558,22 +691,108 @@ rspamd_url_add_static_matchers (struct url_match_scanner *sc)
 void
 rspamd_url_deinit (void)
 {
+	rspamd_url_wait_compiled ();
+
 	if (url_scanner != NULL) {
 		if (url_scanner->search_trie_full) {
 			rspamd_multipattern_destroy (url_scanner->search_trie_full);
 			g_array_free (url_scanner->matchers_full, TRUE);
 		}
 
+		if (url_scanner->tlds) {
+			const rspamd_ftok_t *tok;
+
+			kh_foreach_key (url_scanner->tlds, tok, {
+				g_free ((gpointer)tok);
+			});
+			kh_destroy (rspamd_url_tlds, url_scanner->tlds);
+		}
+
 		rspamd_multipattern_destroy (url_scanner->search_trie_strict);
 		g_array_free (url_scanner->matchers_strict, TRUE);
 		g_free (url_scanner);
 
+		if (url_cache) {
+			/* Cached results depend on tld suffixes */
+			rspamd_lru_hash_destroy (url_cache);
+			url_cache = NULL;
+		}
+
 		url_scanner = NULL;
 	}
 }
 
 void
-rspamd_url_init (const gchar *tld_file)
+rspamd_url_cache_init (guint max_entries, struct rspamd_stat *stat)
+{
+	if (url_cache) {
+		rspamd_lru_hash_destroy (url_cache);
+		url_cache = NULL;
+	}
+
+	url_cache_max = max_entries;
+	url_cache_stat = stat;
+}
+
+static gpointer
+rspamd_url_compile_thread (gpointer ud)
+{
+	struct rspamd_multipattern *mp = ud;
+	GError *err = NULL;
+
+	if (!rspamd_multipattern_compile (mp, &err)) {
+		return err;
+	}
+
+	return NULL;
+}
+
+void
+rspamd_url_init_wait (void)
+{
+	struct rspamd_url_compile_job *job = url_compile_job;
+	GError *err = NULL;
+	gboolean ret;
+
+	if (job == NULL) {
+		return;
+	}
+
+	url_compile_job = NULL;
+	ret = job->parsed;
+
+	if (job->thread) {
+		err = g_thread_join (job->thread);
+	}
+	else {
+		err = rspamd_url_compile_thread (url_scanner->search_trie_full);
+	}
+
+	if (err) {
+		msg_err ("cannot compile tld patterns, url matching will be "
+				 "broken completely: %e", err);
+		g_error_free (err);
+		ret = FALSE;
+	}
+
+	if (ret) {
+		msg_info ("initialized %ud url match suffixes from '%s'",
+				url_scanner->matchers_full->len - url_scanner->matchers_strict->len,
+				job->tld_file);
+	}
+	else {
+		msg_err ("failed to initialize url tld suffixes from '%s', "
+				 "use %ud internal match suffixes",
+				job->tld_file,
+				url_scanner->matchers_strict->len);
+	}
+
+	g_free (job->tld_file);
+	g_free (job);
+}
+
+static void
+rspamd_url_init_common (const gchar *tld_file, gboolean async)
 {
 	GError *err = NULL;
 	gboolean ret = TRUE;
@@ -596,10 +815,13 @@ rspamd_url_init (const gchar *tld_file)
 				sizeof (struct url_matcher), 13000);
 		url_scanner->search_trie_full = rspamd_multipattern_create_sized (13000,
 				RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8);
+		url_scanner->tlds = kh_init (rspamd_url_tlds);
+		kh_resize (rspamd_url_tlds, url_scanner->tlds, 13000);
 	}
 	else {
 		url_scanner->matchers_full = NULL;
 		url_scanner->search_trie_full = NULL;
+		url_scanner->tlds = NULL;
 	}
 
 	rspamd_url_add_static_matchers (url_scanner);
@@ -619,25 +841,26 @@ rspamd_url_init (const gchar *tld_file)
 	}
 
 	if (url_scanner->search_trie_full) {
-		if (!rspamd_multipattern_compile (url_scanner->search_trie_full, &err)) {
-			msg_err ("cannot compile tld patterns, url matching will be "
-					 "broken completely: %e", err);
-			g_error_free (err);
-			ret = FALSE;
+		url_compile_job = g_malloc0 (sizeof (*url_compile_job));
+		url_compile_job->tld_file = g_strdup (tld_file);
+		url_compile_job->parsed = ret;
+
+		if (async) {
+			url_compile_job->thread = g_thread_try_new ("tld compile",
+					rspamd_url_compile_thread, url_scanner->search_trie_full,
+					&err);
+
+			if (url_compile_job->thread == NULL) {
+				msg_warn ("cannot start tld compile thread, compile "
+						"synchronously: %e", err);
+				g_error_free (err);
+				err = NULL;
+			}
 		}
-	}
 
-	if (tld_file != NULL) {
-		if (ret) {
-			msg_info ("initialized %ud url match suffixes from '%s'",
-					url_scanner->matchers_full->len - url_scanner->matchers_strict->len,
-					tld_file);
-		}
-		else {
-			msg_err ("failed to initialize url tld suffixes from '%s', "
-					 "use %ud internal match suffixes",
-					tld_file,
-					url_scanner->matchers_strict->len);
+		if (url_compile_job->thread == NULL) {
+			/* Compile in place */
+			rspamd_url_init_wait ();
 		}
 	}
 
@@ -662,6 +885,18 @@ rspamd_url_init (const gchar *tld_file)
 
 }
 
+void
+rspamd_url_init (const gchar *tld_file)
+{
+	rspamd_url_init_common (tld_file, FALSE);
+}
+
+void
+rspamd_url_init_async (const gchar *tld_file)
+{
+	rspamd_url_init_common (tld_file, TRUE);
+}
+
 #define SET_U(u, field) do {                                                \
     if ((u) != NULL) {                                                        \
         (u)->field_set |= 1 << (field);                                        \
@@ -1632,73 +1867,6 @@ rspamd_web_parse (struct http_parser_url *u, const gchar *str, gsize len,
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	gint ndots;
-
-	matcher = &g_array_index (url_scanner->matchers_full, struct url_matcher,
-			strnum);
-	ndots = 1;
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots ++;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = rspamd_url_host_unsafe (url);
-
-	if (*pos != '.' || match_pos != (gint) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (gint) url->hostlen - 1) {
-			pos = rspamd_url_host_unsafe (url) + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-		else {
-			pos = p;
-		}
-
-		p--;
-	}
-
-	if ((ndots == 0 || p == start - 1) &&
-			url->tldlen < rspamd_url_host_unsafe (url) + url->hostlen - pos) {
-		url->tldshift = (pos - url->string);
-		url->tldlen = rspamd_url_host_unsafe (url) + url->hostlen - pos;
-	}
-
-	return 0;
-}
-
 static void
 rspamd_url_regen_from_inet_addr (struct rspamd_url *uri, const void *addr, int af,
 		rspamd_mempool_t *pool)
@@ -2156,8 +2324,8 @@ rspamd_url_remove_dots (struct rspamd_url *uri)
 	return ret;
 }
 
-enum uri_errno
-rspamd_url_parse (struct rspamd_url *uri,
+static enum uri_errno
+rspamd_url_parse_uncached (struct rspamd_url *uri,
 				  gchar *uristring, gsize len,
 				  rspamd_mempool_t *pool,
 				  enum rspamd_url_parse_flags parse_flags)
@@ -2411,10 +2579,22 @@ rspamd_url_parse (struct rspamd_url *uri,
 
 	if (uri->protocol & (PROTOCOL_HTTP|PROTOCOL_HTTPS|PROTOCOL_MAILTO|PROTOCOL_FTP|PROTOCOL_FILE)) {
 		/* Find TLD part */
-		if (url_scanner->search_trie_full)  {
-			rspamd_multipattern_lookup (url_scanner->search_trie_full,
-					rspamd_url_host_unsafe (uri), uri->hostlen,
-					rspamd_tld_trie_callback, uri, NULL);
+		if (url_scanner->tlds && uri->hostlen > 0) {
+			const gchar *host = rspamd_url_host_unsafe (uri), *tld = NULL;
+			gsize tldlen, hostlen = uri->hostlen;
+
+			if (host[hostlen - 1] == '.') {
+				/* This is dot at the end of domain */
+				hostlen --;
+			}
+
+			tldlen = rspamd_url_find_tld_suffix (host, hostlen, &tld);
+
+			if (tldlen > 0) {
+				uri->hostlen = hostlen;
+				uri->tldshift = tld - uri->string;
+				uri->tldlen = tldlen;
+			}
 		}
 
 		if (uri->tldlen == 0) {
@@ -2481,88 +2661,116 @@ rspamd_url_parse (struct rspamd_url *uri,
 	return URI_ERRNO_OK;
 }
 
-struct tld_trie_cbdata {
-	const gchar *begin;
-	gsize len;
-	rspamd_ftok_t *out;
-};
-
-static gint
-rspamd_tld_trie_find_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
+enum uri_errno
+rspamd_url_parse (struct rspamd_url *uri,
+				  gchar *uristring, gsize len,
+				  rspamd_mempool_t *pool,
+				  enum rspamd_url_parse_flags parse_flags)
 {
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	gint ndots = 1;
+	struct rspamd_url_cache_entry *entry;
+	enum uri_errno ret;
+	guint64 hash;
+	time_t now;
+	gsize slen;
 
-	matcher = &g_array_index (url_scanner->matchers_full, struct url_matcher,
-			strnum);
+	if (url_cache_max == 0 || len > RSPAMD_URL_CACHE_MAX_LEN ||
+			*uristring == '\0') {
+		return rspamd_url_parse_uncached (uri, uristring, len, pool,
+				parse_flags);
+	}
 
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
+	if (url_cache == NULL) {
+		url_cache = rspamd_lru_hash_new_full (url_cache_max, NULL, g_free,
+				g_int64_hash, g_int64_equal);
 	}
 
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
+	now = time (NULL);
+	hash = rspamd_cryptobox_fast_hash (uristring, len,
+			0x8a3f0dc9e8b1d2a5ULL ^ (guint64)parse_flags);
+	entry = rspamd_lru_hash_lookup (url_cache, &hash, now);
 
-	if (*pos != '.' || match_pos != (gint)cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (gint)cbdata->len - 1) {
-			/* Search more */
-			return 0;
-		}
-	}
+	if (entry && entry->len == len && entry->parse_flags == (gint)parse_flags &&
+			memcmp (entry->data, uristring, len) == 0) {
+		memcpy (uri, &entry->url, sizeof (*uri));
 
-	/* Now we need to find top level domain */
-	pos = start;
+		if (entry->url.raw) {
+			uri->raw = uristring;
+		}
 
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
+		if (entry->url.string) {
+			uri->string = rspamd_mempool_alloc (pool, entry->url.urllen + 1);
+			memcpy (uri->string, entry->url.string, entry->url.urllen + 1);
 		}
-		else {
-			pos = p;
+
+		if (url_cache_stat) {
+#ifdef HAVE_ATOMIC_BUILTINS
+			__atomic_add_fetch (&url_cache_stat->url_cache_hits, 1,
+					__ATOMIC_RELAXED);
+#else
+			url_cache_stat->url_cache_hits ++;
+#endif
 		}
 
-		p--;
+		return entry->ret;
 	}
 
-	if (ndots == 0 || p == start - 1) {
-		if (cbdata->begin + cbdata->len - pos > cbdata->out->len) {
-			cbdata->out->begin = pos;
-			cbdata->out->len = cbdata->begin + cbdata->len - pos;
-		}
+	ret = rspamd_url_parse_uncached (uri, uristring, len, pool, parse_flags);
+
+	/* Store a copy that does not refer to the task's memory */
+	slen = uri->string ? uri->urllen + 1 : 0;
+	entry = g_malloc (sizeof (*entry) + len + slen);
+	entry->hash = hash;
+	entry->len = len;
+	entry->parse_flags = parse_flags;
+	entry->ret = ret;
+	memcpy (&entry->url, uri, sizeof (*uri));
+	memcpy (entry->data, uristring, len);
+
+	if (uri->string) {
+		entry->url.string = entry->data + len;
+		memcpy (entry->url.string, uri->string, uri->urllen);
+		entry->url.string[uri->urllen] = '\0';
 	}
 
-	return 0;
+	/* These are never set by parsing itself */
+	entry->url.visible_part = NULL;
+	entry->url.phished_url = NULL;
+	rspamd_lru_hash_insert (url_cache, &entry->hash, entry, now, 0);
+
+	if (url_cache_stat) {
+#ifdef HAVE_ATOMIC_BUILTINS
+		__atomic_add_fetch (&url_cache_stat->url_cache_misses, 1,
+				__ATOMIC_RELAXED);
+#else
+		url_cache_stat->url_cache_misses ++;
+#endif
+	}
+
+	return ret;
 }
 
 gboolean
 rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
+	const gchar *tld = NULL;
+	gsize hostlen = inlen;
 
 	g_assert (in != NULL);
 	g_assert (out != NULL);
 	g_assert (url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
 	out->len = 0;
 
-	if (url_scanner->search_trie_full) {
-		rspamd_multipattern_lookup (url_scanner->search_trie_full, in, inlen,
-				rspamd_tld_trie_find_callback, &cbdata, NULL);
+	if (url_scanner->tlds) {
+		if (hostlen > 0 && in[hostlen - 1] == '.') {
+			/* This is dot at the end of domain, it is still a part of tld */
+			hostlen --;
+		}
+
+		if (rspamd_url_find_tld_suffix (in, hostlen, &tld) > 0) {
+			out->begin = tld;
+			out->len = in + inlen - tld;
+		}
 	}
 
 	if (out->len > 0) {
@@ -3149,6 +3357,8 @@ rspamd_url_find (rspamd_mempool_t *pool,
 	cb.pool = pool;
 
 	if (how == RSPAMD_URL_FIND_ALL) {
+		rspamd_url_wait_compiled ();
+
 		if (url_scanner->search_trie_full) {
 			cb.matchers = url_scanner->matchers_full;
 			ret = rspamd_multipattern_lookup (url_scanner->search_trie_full,
@@ -3396,14 +3606,7 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	struct rspamd_task *task;
 
 	task = cbd->task;
-	ex = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_process_exception));
-
-	ex->pos = start_offset;
-	ex->len = end_offset - start_offset;
-	ex->type = RSPAMD_EXCEPTION_URL;
-	ex->ptr = url;
-
-	cbd->url_len += ex->len;
+	cbd->url_len += end_offset - start_offset;
 
 	if (cbd->part->utf_stripped_content &&
 			cbd->url_len > cbd->part->utf_stripped_content->len * 10) {
@@ -3438,6 +3641,13 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 		g_ptr_array_add (cbd->part->mime_part->urls, url);
 	}
 
+	/* Exception is allocated merely for urls that are actually accepted */
+	ex = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_process_exception));
+	ex->pos = start_offset;
+	ex->len = end_offset - start_offset;
+	ex->type = RSPAMD_EXCEPTION_URL;
+	ex->ptr = url;
+
 	cbd->part->exceptions = g_list_prepend (
 			cbd->part->exceptions,
 			ex);
@@ -3466,6 +3676,18 @@ rspamd_url_text_extract (rspamd_mempool_t *pool,
 		return;
 	}
 
+	if (task->cfg && task->cfg->max_urls > 0 &&
+			kh_size (MESSAGE_FIELD (task, urls)) > task->cfg->max_urls) {
+		/*
+		 * Urls budget has been exhausted by the previous parts, so we do not
+		 * even start the trie scan as it would stop on the first url anyway
+		 */
+		msg_info_task ("skip urls extraction from a text part: "
+					   "%d urls have been already extracted",
+				(guint)kh_size (MESSAGE_FIELD (task, urls)));
+		return;
+	}
+
 	mcbd.task = task;
 	mcbd.part = part;
 	mcbd.url_len = 0;
@@ -3504,6 +3726,8 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool,
 	cb.newlines = nlines;
 
 	if (how == RSPAMD_URL_FIND_ALL) {
+		rspamd_url_wait_compiled ();
+
 		if (url_scanner->search_trie_full) {
 			cb.matchers = url_scanner->matchers_full;
 			rspamd_multipattern_lookup (url_scanner->search_trie_full,
@@ -3551,6 +3775,8 @@ rspamd_url_find_single (rspamd_mempool_t *pool,
 	cb.func = func;
 
 	if (how == RSPAMD_URL_FIND_ALL) {
+		rspamd_url_wait_compiled ();
+
 		if (url_scanner->search_trie_full) {
 			cb.matchers = url_scanner->matchers_full;
 			rspamd_multipattern_lookup (url_scanner->search_trie_full,
@@ -4051,9 +4277,10 @@ rspamd_url_set_add_or_increase(khash_t (rspamd_url_hash) *set,
 	khiter_t k;
 	gint r;
 
-	k = kh_get (rspamd_url_hash, set, u);
+	/* Url is hashed and compared merely once for both lookup and insertion */
+	k = kh_put (rspamd_url_hash, set, u, &r);
 
-	if (k != kh_end (set)) {
+	if (r == 0) {
 		/* Existing url */
 		struct rspamd_url *ex = kh_key (set, k);
 #define SUSPICIOUS_URL_FLAGS (RSPAMD_URL_FLAG_PHISHED|RSPAMD_URL_FLAG_OBSCURED|RSPAMD_URL_FLAG_ZW_SPACES)
@@ -4079,9 +4306,6 @@ rspamd_url_set_add_or_increase(khash_t (rspamd_url_hash) *set,
 
 		return false;
 	}
-	else {
-		k = kh_put (rspamd_url_hash, set, u, &r);
-	}
 
 	return true;
 }
@@ -4094,16 +4318,10 @@ rspamd_url_set_add_or_return (khash_t (rspamd_url_hash) *set,
 	gint r;
 
 	if (set) {
-		k = kh_get (rspamd_url_hash, set, u);
-
-		if (k != kh_end (set)) {
-			return kh_key (set, k);
-		}
-		else {
-			k = kh_put (rspamd_url_hash, set, u, &r);
+		/* Returns an existing url or inserts a new one in a single probe */
+		k = kh_put (rspamd_url_hash, set, u, &r);
 
-			return kh_key (set, k);
-		}
+		return kh_key (set, k);
 	}
 
 	return NULL;
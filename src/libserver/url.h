@@ -125,8 +125,27 @@ enum rspamd_url_find_type {
  */
 void rspamd_url_init (const gchar *tld_file);
 
+/**
+ * Same as `rspamd_url_init` but TLD suffixes are compiled by a separate
+ * thread, url search functions wait for it when called
+ */
+void rspamd_url_init_async (const gchar *tld_file);
+
+/**
+ * Waits for TLD suffixes compilation started by `rspamd_url_init_async`
+ */
+void rspamd_url_init_wait (void);
+
 void rspamd_url_deinit (void);
 
+struct rspamd_stat;
+/**
+ * Enables cache of parsed urls in the current process
+ * @param max_entries maximum number of urls cached (0 to disable)
+ * @param stat shared statistics to count cache hits and misses (may be NULL)
+ */
+void rspamd_url_cache_init (guint max_entries, struct rspamd_stat *stat);
+
 /*
  * Parse urls inside text
  * @param pool memory pool
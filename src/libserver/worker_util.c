@@ -16,6 +16,7 @@
 #include "config.h"
 #include "rspamd.h"
 #include "lua/lua_common.h"
+#include "lua/lua_profiler.h"
 #include "worker_util.h"
 #include "unix-std.h"
 #include "utlist.h"
@@ -23,9 +24,12 @@
 #include "rspamd_control.h"
 #include "libserver/maps/map.h"
 #include "libserver/maps/map_private.h"
+#include "libserver/maps/map_helpers.h"
 #include "libserver/http/http_private.h"
 #include "libserver/http/http_router.h"
 #include "libutil/rrd.h"
+#include "libutil/timeseries.h"
+#include "libserver/net_replay.h"
 
 /* sys/resource.h */
 #ifdef HAVE_SYS_RESOURCE_H
@@ -41,6 +45,12 @@
 #ifdef HAVE_LIBUTIL_H
 #include <libutil.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#ifdef LINUX
+#include <linux/filter.h>
+#endif
 #include "zlib.h"
 
 #ifdef WITH_LIBUNWIND
@@ -61,6 +71,7 @@
 
 #include "contrib/libev/ev.h"
 #include "libstat/stat_api.h"
+#include "libstat/tokenizers/tokenizers.h"
 
 /* Forward declaration */
 static void rspamd_worker_heartbeat_start (struct rspamd_worker *,
@@ -300,6 +311,7 @@ rspamd_worker_usr1_handler (struct rspamd_worker_signal_handler *sigh, void *arg
 	struct rspamd_main *rspamd_main = sigh->worker->srv;
 
 	rspamd_log_reopen (sigh->worker->srv->logger, rspamd_main->cfg, -1, -1);
+	rspamd_task_structured_log_reopen ();
 	msg_info_main ("logging reinitialised");
 
 	/* Get more signals */
@@ -467,6 +479,162 @@ rspamd_worker_init_signals (struct rspamd_worker *worker,
 }
 
 
+#ifdef HAVE_SCHED_SETAFFINITY
+/*
+ * Parses cpus list in the kernel format, e.g. `0-3,8,10-11`
+ */
+static gboolean
+rspamd_worker_parse_cpulist (const gchar *str, cpu_set_t *set)
+{
+	gchar **elts, *elt, *dash;
+	gulong lo, hi, i;
+	guint n;
+	gboolean ret = TRUE;
+
+	CPU_ZERO (set);
+	elts = g_strsplit (str, ",", -1);
+
+	for (n = 0; elts[n] != NULL; n ++) {
+		elt = g_strstrip (elts[n]);
+
+		if (*elt == '\0') {
+			continue;
+		}
+
+		dash = strchr (elt, '-');
+
+		if (dash) {
+			if (!rspamd_strtoul (elt, dash - elt, &lo) ||
+					!rspamd_strtoul (dash + 1, strlen (dash + 1), &hi) ||
+					hi < lo) {
+				ret = FALSE;
+				break;
+			}
+		}
+		else {
+			if (!rspamd_strtoul (elt, strlen (elt), &lo)) {
+				ret = FALSE;
+				break;
+			}
+
+			hi = lo;
+		}
+
+		if (hi >= CPU_SETSIZE) {
+			ret = FALSE;
+			break;
+		}
+
+		for (i = lo; i <= hi; i ++) {
+			CPU_SET (i, set);
+		}
+	}
+
+	g_strfreev (elts);
+
+	return ret && CPU_COUNT (set) > 0;
+}
+
+/*
+ * Selects cpus of a NUMA node for a worker, workers are spread over nodes
+ * according to their indexes
+ */
+static gboolean
+rspamd_worker_numa_cpulist (guint index, cpu_set_t *set)
+{
+	gchar path[PATH_MAX], *content;
+	guint nnodes = 0;
+	gboolean ret;
+
+	for (;;) {
+		rspamd_snprintf (path, sizeof (path),
+				"/sys/devices/system/node/node%ud", nnodes);
+
+		if (access (path, F_OK) == -1) {
+			break;
+		}
+
+		nnodes ++;
+	}
+
+	if (nnodes == 0) {
+		return FALSE;
+	}
+
+	rspamd_snprintf (path, sizeof (path),
+			"/sys/devices/system/node/node%ud/cpulist", index % nnodes);
+
+	if (!g_file_get_contents (path, &content, NULL, NULL)) {
+		return FALSE;
+	}
+
+	ret = rspamd_worker_parse_cpulist (content, set);
+	g_free (content);
+
+	return ret;
+}
+#endif
+
+/*
+ * Pins worker to the configured cpus. As memory pages are placed on the node
+ * where they are faulted first, it also keeps worker's memory NUMA local
+ */
+static void
+rspamd_worker_set_affinity (struct rspamd_worker *worker)
+{
+	const gchar *affinity = worker->cf->cpu_affinity;
+
+	if (affinity == NULL) {
+		return;
+	}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+	gboolean ok;
+
+	if (g_ascii_strcasecmp (affinity, "numa") == 0) {
+		ok = rspamd_worker_numa_cpulist (worker->index, &set);
+	}
+	else {
+		ok = rspamd_worker_parse_cpulist (affinity, &set);
+	}
+
+	if (!ok) {
+		msg_err ("cannot set cpu affinity for %s worker: bad cpus list: %s",
+				g_quark_to_string (worker->type), affinity);
+
+		return;
+	}
+
+	if (worker->cf->cpu_affinity_spread && CPU_COUNT (&set) > 1) {
+		/* Select a single cpu from the list by the worker's index */
+		gint i, n = worker->index % CPU_COUNT (&set);
+
+		for (i = 0; i < CPU_SETSIZE; i ++) {
+			if (CPU_ISSET (i, &set) && n-- == 0) {
+				break;
+			}
+		}
+
+		CPU_ZERO (&set);
+		CPU_SET (i, &set);
+	}
+
+	if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+		msg_err ("cannot set cpu affinity for %s worker: %s",
+				g_quark_to_string (worker->type), strerror (errno));
+	}
+	else {
+		msg_info ("pinned %s worker #%d to %d cpus",
+				g_quark_to_string (worker->type), worker->index,
+				CPU_COUNT (&set));
+	}
+#else
+	msg_warn ("cpu affinity is not supported on this platform, ignore %s",
+			affinity);
+#endif
+}
+
 struct ev_loop *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 					   rspamd_accept_handler hdl)
@@ -476,21 +644,50 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	struct rspamd_worker_listen_socket *ls;
 	struct rspamd_worker_accept_event *accept_ev;
 
+	/* Do it before any allocations to have memory local to our cpus */
+	rspamd_worker_set_affinity (worker);
+
 	worker->signal_events = g_hash_table_new_full (g_direct_hash, g_direct_equal,
 			NULL, rspamd_sigh_free);
 
-	event_loop = ev_loop_new (rspamd_config_ev_backend_get (worker->srv->cfg));
+	event_loop = ev_loop_new (rspamd_config_worker_ev_backend_get (
+			worker->srv->cfg, worker->cf));
+
+	if (event_loop == NULL) {
+		msg_err ("cannot create event loop with the configured backend, "
+				"use the default one");
+		event_loop = ev_loop_new (rspamd_config_ev_backend_get (NULL));
+	}
+	else {
+		msg_info ("%s worker uses %s events backend", name,
+				rspamd_config_ev_backend_to_string (ev_backend (event_loop),
+						NULL));
+	}
 
 	worker->srv->event_loop = event_loop;
 
+	/* Per worker type Lua gc settings */
+	if (worker->cf->lua_gc_task_step > 0) {
+		worker->srv->cfg->lua_gc_task_step = worker->cf->lua_gc_task_step;
+	}
+
+	if (worker->cf->lua_gc_mode && worker->srv->cfg->lua_state) {
+		rspamd_lua_set_gc_mode (worker->srv->cfg, worker->cf->lua_gc_mode);
+	}
+
 	rspamd_worker_init_signals (worker, event_loop);
 	rspamd_control_worker_add_default_cmd_handlers (worker, event_loop);
 	rspamd_worker_heartbeat_start (worker, event_loop);
+	rspamd_worker_load_stat_start (worker, event_loop);
 #ifdef WITH_HIREDIS
 	rspamd_redis_pool_config (worker->srv->cfg->redis_pool,
 			worker->srv->cfg, event_loop);
 #endif
 
+	if (!rspamd_net_replay_init (worker->srv->cfg)) {
+		msg_err ("cannot init network replay, use network as usual");
+	}
+
 	/* Accept all sockets */
 	if (hdl) {
 		cur = worker->cf->listen_socks;
@@ -814,6 +1011,18 @@ rspamd_worker_heartbeat_cb (EV_P_ ev_timer *w, int revents)
 	struct rspamd_srv_command cmd;
 
 	memset (&cmd, 0, sizeof (cmd));
+
+	if (!wrk->ready) {
+		/*
+		 * The first beat happens on the first loop iteration, so the worker
+		 * has finished its synchronous init and can serve requests
+		 */
+		wrk->ready = TRUE;
+		cmd.type = RSPAMD_SRV_READY;
+		rspamd_srv_send_command (wrk, EV_A, &cmd, -1, NULL, NULL);
+		memset (&cmd, 0, sizeof (cmd));
+	}
+
 	cmd.type = RSPAMD_SRV_HEARTBEAT;
 	rspamd_srv_send_command (wrk, EV_A, &cmd, -1, NULL, NULL);
 }
@@ -1000,6 +1209,155 @@ rspamd_maybe_reuseport_socket (struct rspamd_worker_listen_socket *ls)
 	return true;
 }
 
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+/*
+ * Selects socket number `cpu % nworkers` within a reuseport group, sockets
+ * are added to the group in order of workers indices
+ */
+static void
+rspamd_worker_attach_reuseport_cbpf (gint fd, guint nworkers)
+{
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, nworkers},
+		{BPF_RET | BPF_A, 0, 0, 0},
+	};
+	struct sock_fprog prog = {
+		.len = G_N_ELEMENTS (code),
+		.filter = code,
+	};
+
+	if (setsockopt (fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			sizeof (prog)) == -1) {
+		msg_warn ("cannot attach reuseport cpu filter to %d: %s",
+				fd, strerror (errno));
+	}
+}
+#endif
+
+/*
+ * Creates listen sockets for all workers of the specified type at once, so
+ * they fill the reuseport group in order of indices and stay in the main
+ * process to keep queued connections while a worker is being respawned
+ */
+static void
+rspamd_worker_create_reuseport_socks (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf)
+{
+	GList *cur;
+	struct rspamd_worker_listen_socket *ls;
+	guint i;
+	gint fd;
+
+	cf->reuseport_fds = g_array_sized_new (FALSE, FALSE, sizeof (gint),
+			cf->count * g_list_length (cf->listen_socks));
+
+	for (i = 0; i < cf->count; i ++) {
+		for (cur = cf->listen_socks; cur != NULL; cur = g_list_next (cur)) {
+			ls = (struct rspamd_worker_listen_socket *)cur->data;
+			fd = -1;
+
+			if (ls->is_reuseport) {
+				fd = rspamd_inet_address_listen (ls->addr, SOCK_STREAM,
+						RSPAMD_INET_ADDRESS_LISTEN_ASYNC|
+						RSPAMD_INET_ADDRESS_LISTEN_REUSEPORT, -1);
+
+				if (fd == -1) {
+					msg_warn_main ("cannot create reuseport socket %s for %s (%d): %s",
+							rspamd_inet_address_to_string_pretty (ls->addr),
+							cf->worker->name, i, strerror (errno));
+				}
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+				else if (i == 0 && cf->reuseport_cpu) {
+					rspamd_worker_attach_reuseport_cbpf (fd, cf->count);
+				}
+#endif
+			}
+
+			g_array_append_val (cf->reuseport_fds, fd);
+		}
+	}
+}
+
+void
+rspamd_worker_close_reuseport_socks (struct rspamd_worker_conf *cf)
+{
+	guint i;
+	gint *pfd;
+
+	if (cf->reuseport_fds == NULL) {
+		return;
+	}
+
+	for (i = 0; i < cf->reuseport_fds->len; i ++) {
+		pfd = &g_array_index (cf->reuseport_fds, gint, i);
+
+		if (*pfd != -1) {
+			close (*pfd);
+			*pfd = -1;
+		}
+	}
+}
+
+/*
+ * Takes sockets of the specified worker index and closes all others
+ */
+static void
+rspamd_worker_take_reuseport_socks (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf, guint index)
+{
+	GList *cur;
+	struct rspamd_worker_listen_socket *ls;
+	struct rspamd_worker_conf *ocf;
+	guint j, nsocks;
+	gint *pfd;
+
+	if (cf->reuseport_fds != NULL && index < (guint)cf->count) {
+		nsocks = g_list_length (cf->listen_socks);
+
+		for (cur = cf->listen_socks, j = 0; cur != NULL;
+				cur = g_list_next (cur), j ++) {
+			ls = (struct rspamd_worker_listen_socket *)cur->data;
+			pfd = &g_array_index (cf->reuseport_fds, gint, index * nsocks + j);
+
+			if (*pfd != -1) {
+				if (ls->fd != -1) {
+					close (ls->fd);
+				}
+
+				ls->fd = *pfd;
+				*pfd = -1;
+			}
+			else if (ls->is_reuseport && ls->fd != -1) {
+				/* Fallback to the shared socket */
+				if (listen (ls->fd, -1) == -1) {
+					msg_err ("cannot listen on socket %s: %s",
+							rspamd_inet_address_to_string_pretty (ls->addr),
+							strerror (errno));
+				}
+			}
+		}
+	}
+
+	for (cur = rspamd_main->cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		ocf = (struct rspamd_worker_conf *)cur->data;
+		rspamd_worker_close_reuseport_socks (ocf);
+	}
+
+	if (cf->reuseport_fds == NULL) {
+		/* Shared bound socket with another worker type that uses reuseport */
+		for (cur = cf->listen_socks; cur != NULL; cur = g_list_next (cur)) {
+			ls = (struct rspamd_worker_listen_socket *)cur->data;
+
+			if (ls->is_reuseport && ls->fd != -1 && listen (ls->fd, -1) == -1) {
+				msg_err ("cannot listen on socket %s: %s",
+						rspamd_inet_address_to_string_pretty (ls->addr),
+						strerror (errno));
+			}
+		}
+	}
+}
+
 /**
  * Handles worker after fork returned zero
  * @param wrk
@@ -1020,6 +1378,10 @@ rspamd_handle_child_fork (struct rspamd_worker *wrk,
 	rspamd_log_on_fork (cf->type, rspamd_main->cfg, rspamd_main->logger);
 	wrk->pid = getpid ();
 
+	if (wrk->log_ring) {
+		rspamd_log_set_ring (rspamd_main->logger, wrk->log_ring);
+	}
+
 	/* Init PRNG after fork */
 	rc = ottery_init (rspamd_main->cfg->libs_ctx->ottery_cfg);
 	if (rc != OTTERY_ERR_NONE) {
@@ -1080,6 +1442,9 @@ rspamd_handle_child_fork (struct rspamd_worker *wrk,
 		}
 	}
 
+	/* Per worker reuseport sockets, created in the main process */
+	rspamd_worker_take_reuseport_socks (rspamd_main, cf, wrk->index);
+
 	/* Reuseport before dropping privs */
 	GList *cur = cf->listen_socks;
 
@@ -1205,6 +1570,207 @@ rspamd_handle_main_fork (struct rspamd_worker *wrk,
 #endif
 }
 
+gint
+rspamd_worker_load_slot_reserve (struct rspamd_main *rspamd_main)
+{
+	guint i;
+
+	if (rspamd_main->workers_load == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < RSPAMD_WORKER_LOAD_SLOTS; i ++) {
+		if (rspamd_main->workers_load[i].pid == 0) {
+			memset (&rspamd_main->workers_load[i], 0,
+					sizeof (rspamd_main->workers_load[i]));
+			/* Reserved till the real pid is known */
+			rspamd_main->workers_load[i].pid = -1;
+
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void
+rspamd_worker_load_slot_release (struct rspamd_worker *wrk)
+{
+	if (wrk->load_slot >= 0 && wrk->srv->workers_load) {
+		memset (&wrk->srv->workers_load[wrk->load_slot], 0,
+				sizeof (wrk->srv->workers_load[wrk->load_slot]));
+		wrk->load_slot = -1;
+	}
+}
+
+void
+rspamd_worker_load_update (struct rspamd_worker *wrk, gint tasks,
+		gint64 bytes)
+{
+	struct rspamd_worker_load *load;
+
+	if (wrk == NULL || wrk->load_slot < 0 || wrk->srv->workers_load == NULL) {
+		return;
+	}
+
+	/* Each slot is written by its worker only, others merely read it */
+	load = &wrk->srv->workers_load[wrk->load_slot];
+	__atomic_add_fetch (&load->tasks, tasks, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&load->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void
+rspamd_worker_load_host (struct rspamd_main *rspamd_main,
+		guint *tasks, guint64 *bytes)
+{
+	struct rspamd_worker_load *load;
+	guint i;
+
+	*tasks = 0;
+	*bytes = 0;
+
+	if (rspamd_main->workers_load == NULL) {
+		return;
+	}
+
+	for (i = 0; i < RSPAMD_WORKER_LOAD_SLOTS; i ++) {
+		load = &rspamd_main->workers_load[i];
+
+		if (load->pid != 0) {
+			*tasks += __atomic_load_n (&load->tasks, __ATOMIC_RELAXED);
+			*bytes += __atomic_load_n (&load->bytes, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void
+rspamd_worker_load_stat_publish (struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_load *load;
+	struct rusage rusg;
+
+	if (wrk->load_slot < 0 || wrk->srv->workers_load == NULL) {
+		return;
+	}
+
+	load = &wrk->srv->workers_load[wrk->load_slot];
+	memset (&rusg, 0, sizeof (rusg));
+
+	if (getrusage (RUSAGE_SELF, &rusg) == -1) {
+		msg_err ("cannot get rusage stats: %s", strerror (errno));
+	}
+
+	__atomic_add_fetch (&load->version, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	load->conns = wrk->nconns;
+	load->start_time = wrk->start_time;
+	load->utime = tv_to_double (&rusg.ru_utime);
+	load->systime = tv_to_double (&rusg.ru_stime);
+	load->maxrss = rusg.ru_maxrss;
+	__atomic_add_fetch (&load->version, 1, __ATOMIC_RELEASE);
+}
+
+static void
+rspamd_worker_load_stat_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker *wrk = (struct rspamd_worker *)w->data;
+
+	rspamd_worker_load_stat_publish (wrk);
+}
+
+void
+rspamd_worker_load_stat_start (struct rspamd_worker *wrk,
+		struct ev_loop *event_loop)
+{
+	rspamd_worker_load_stat_publish (wrk);
+	wrk->load_stat_ev.data = (void *)wrk;
+	ev_timer_init (&wrk->load_stat_ev, rspamd_worker_load_stat_cb,
+			RSPAMD_WORKER_LOAD_STAT_INTERVAL,
+			RSPAMD_WORKER_LOAD_STAT_INTERVAL);
+	ev_timer_start (event_loop, &wrk->load_stat_ev);
+}
+
+/* Returns FALSE if the slot is free or is being updated for too long */
+static gboolean
+rspamd_worker_load_stat_read (struct rspamd_worker_load *load,
+		struct rspamd_worker_load *copy)
+{
+	guint64 v1, v2;
+	guint i;
+
+	for (i = 0; i < 16; i ++) {
+		v1 = __atomic_load_n (&load->version, __ATOMIC_ACQUIRE);
+
+		if (v1 & 1) {
+			continue;
+		}
+
+		memcpy (copy, load, sizeof (*copy));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		v2 = __atomic_load_n (&load->version, __ATOMIC_RELAXED);
+
+		if (v1 == v2) {
+			return copy->pid > 0;
+		}
+	}
+
+	return FALSE;
+}
+
+ucl_object_t *
+rspamd_worker_load_stat_ucl (struct rspamd_main *rspamd_main)
+{
+	struct rspamd_worker_load copy;
+	ucl_object_t *top, *workers, *cur;
+	gdouble total_utime = 0, total_systime = 0, now;
+	guint i, total_conns = 0;
+	gchar tmpbuf[64];
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	workers = ucl_object_typed_new (UCL_OBJECT);
+	now = rspamd_get_calendar_ticks ();
+
+	for (i = 0; rspamd_main->workers_load && i < RSPAMD_WORKER_LOAD_SLOTS; i ++) {
+		if (!rspamd_worker_load_stat_read (&rspamd_main->workers_load[i],
+				&copy) || copy.version == 0) {
+			/* Free slot or a worker that has not started yet */
+			continue;
+		}
+
+		rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%P", copy.pid);
+		cur = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (cur, ucl_object_fromstring (
+				g_quark_to_string (copy.type)), "type", 0, false);
+		ucl_object_insert_key (cur, ucl_object_fromint (copy.conns),
+				"conns", 0, false);
+		ucl_object_insert_key (cur, ucl_object_fromdouble (copy.utime),
+				"utime", 0, false);
+		ucl_object_insert_key (cur, ucl_object_fromdouble (copy.systime),
+				"systime", 0, false);
+		ucl_object_insert_key (cur, ucl_object_fromdouble (
+				now - copy.start_time), "uptime", 0, false);
+		ucl_object_insert_key (cur, ucl_object_fromint (copy.maxrss),
+				"maxrss", 0, false);
+		ucl_object_insert_key (workers, cur, tmpbuf, 0, true);
+
+		total_utime += copy.utime;
+		total_systime += copy.systime;
+		total_conns += copy.conns;
+	}
+
+	ucl_object_insert_key (top, workers, "workers", 0, false);
+	cur = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (cur, ucl_object_fromint (total_conns),
+			"conns", 0, false);
+	ucl_object_insert_key (cur, ucl_object_fromdouble (total_utime),
+			"utime", 0, false);
+	ucl_object_insert_key (cur, ucl_object_fromdouble (total_systime),
+			"systime", 0, false);
+	ucl_object_insert_key (top, cur, "total", 0, false);
+
+	return top;
+}
+
 struct rspamd_worker *
 rspamd_fork_worker (struct rspamd_main *rspamd_main,
 					struct rspamd_worker_conf *cf,
@@ -1239,6 +1805,10 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 				index);
 	}
 
+	if (cf->reuseport && cf->reuseport_fds == NULL && cf->listen_socks) {
+		rspamd_worker_create_reuseport_socks (rspamd_main, cf);
+	}
+
 	wrk->srv = rspamd_main;
 	wrk->type = cf->type;
 	wrk->cf = cf;
@@ -1246,6 +1816,19 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	REF_RETAIN (cf);
 	wrk->index = index;
 	wrk->ctx = cf->ctx;
+	wrk->load_slot = rspamd_worker_load_slot_reserve (rspamd_main);
+
+	if (rspamd_main->cfg->log_async_size > 0 &&
+			rspamd_main->cfg->log_type != RSPAMD_LOG_CONSOLE) {
+		wrk->log_ring = rspamd_log_ring_new (rspamd_main->cfg->log_async_size);
+
+		if (wrk->log_ring == NULL) {
+			msg_err_main ("cannot allocate async log ring: %s, "
+					"use synchronous logging for process %s (%d)",
+					strerror (errno), cf->worker->name, index);
+		}
+	}
+
 	wrk->ppid = getpid ();
 	wrk->pid = fork ();
 	wrk->cores_throttled = rspamd_main->cores_throttling;
@@ -1267,6 +1850,11 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		rspamd_hard_terminate (rspamd_main);
 		break;
 	default:
+		if (wrk->load_slot >= 0) {
+			rspamd_main->workers_load[wrk->load_slot].type = wrk->type;
+			rspamd_main->workers_load[wrk->load_slot].pid = wrk->pid;
+		}
+
 		rspamd_handle_main_fork (wrk, rspamd_main, cf, ev_base);
 		break;
 	}
@@ -1801,6 +2389,27 @@ rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
 
 	return TRUE;
 }
+
+static gboolean
+rspamd_worker_hyperscan_map_ready (struct rspamd_main *rspamd_main,
+								   struct rspamd_worker *worker, gint fd,
+								   gint attached_fd,
+								   struct rspamd_control_command *cmd,
+								   gpointer ud)
+{
+	struct rspamd_control_reply rep;
+
+	memset (&rep, 0, sizeof (rep));
+	rep.type = RSPAMD_CONTROL_HYPERSCAN_MAP_LOADED;
+	rspamd_regexp_map_hyperscan_loaded (cmd->cmd.hs_map.path);
+
+	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
+		msg_err ("cannot write reply to the control socket: %s",
+				strerror (errno));
+	}
+
+	return TRUE;
+}
 #endif /* With Hyperscan */
 
 gboolean
@@ -1885,6 +2494,114 @@ rspamd_worker_monitored_handler (struct rspamd_main *rspamd_main,
 	return TRUE;
 }
 
+/*
+ * Sends a control reply with `obj` emitted to a temporary file attached,
+ * `status` in the reply is set to errno if the file cannot be created
+ */
+static void
+rspamd_worker_send_ucl_reply (struct rspamd_config *cfg, gint fd,
+		struct rspamd_control_reply *rep, guint *status,
+		ucl_object_t *obj, const gchar *name)
+{
+	struct ucl_emitter_functions *emit_subr;
+	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	gint outfd = -1;
+	gchar tmppath[PATH_MAX];
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s%c%s-XXXXXXXXXX",
+			cfg->temp_dir, G_DIR_SEPARATOR, name);
+
+	if ((outfd = mkstemp (tmppath)) == -1) {
+		*status = errno;
+		msg_info ("cannot make temporary file for %s: %s",
+				name, strerror (errno));
+	}
+	else {
+		emit_subr = ucl_object_emit_fd_funcs (outfd);
+		ucl_object_emit_full (obj, UCL_EMIT_JSON_COMPACT, emit_subr, NULL);
+		ucl_object_emit_funcs_free (emit_subr);
+		/* Rewind output file */
+		close (outfd);
+		outfd = open (tmppath, O_RDONLY);
+		unlink (tmppath);
+	}
+
+	memset (&msg, 0, sizeof (msg));
+
+	/* Attach fd to the message */
+	if (outfd != -1) {
+		memset (fdspace, 0, sizeof (fdspace));
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof (fdspace);
+		cmsg = CMSG_FIRSTHDR (&msg);
+
+		if (cmsg) {
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+			memcpy (CMSG_DATA (cmsg), &outfd, sizeof (int));
+		}
+	}
+
+	iov.iov_base = rep;
+	iov.iov_len = sizeof (*rep);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (sendmsg (fd, &msg, 0) == -1) {
+		msg_err ("cannot send %s: %s", name, strerror (errno));
+	}
+
+	if (outfd != -1) {
+		close (outfd);
+	}
+}
+
+static gboolean
+rspamd_worker_symbols_trace_handler (struct rspamd_main *rspamd_main,
+									 struct rspamd_worker *worker, gint fd,
+									 gint attached_fd,
+									 struct rspamd_control_command *cmd,
+									 gpointer ud)
+{
+	struct rspamd_config *cfg = ud;
+	struct rspamd_control_reply rep;
+	ucl_object_t *obj;
+
+	memset (&rep, 0, sizeof (rep));
+	rep.type = RSPAMD_CONTROL_SYMBOLS_TRACE;
+	obj = rspamd_symcache_trace_to_ucl (cfg->cache);
+	rspamd_worker_send_ucl_reply (cfg, fd, &rep,
+			&rep.reply.symbols_trace.status, obj, "symbols-trace");
+	ucl_object_unref (obj);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_worker_lua_profile_handler (struct rspamd_main *rspamd_main,
+								   struct rspamd_worker *worker, gint fd,
+								   gint attached_fd,
+								   struct rspamd_control_command *cmd,
+								   gpointer ud)
+{
+	struct rspamd_config *cfg = ud;
+	struct rspamd_control_reply rep;
+	ucl_object_t *obj;
+
+	memset (&rep, 0, sizeof (rep));
+	rep.type = RSPAMD_CONTROL_LUA_PROFILE;
+	obj = rspamd_lua_profiler_to_ucl ();
+	rspamd_worker_send_ucl_reply (cfg, fd, &rep,
+			&rep.reply.lua_profile.status, obj, "lua-profile");
+	ucl_object_unref (obj);
+
+	return TRUE;
+}
+
 void
 rspamd_worker_init_scanner (struct rspamd_worker *worker,
 							struct ev_loop *ev_base,
@@ -1892,11 +2609,17 @@ rspamd_worker_init_scanner (struct rspamd_worker *worker,
 							struct rspamd_lang_detector **plang_det)
 {
 	rspamd_stat_init (worker->srv->cfg, ev_base);
+	rspamd_url_cache_init (worker->srv->cfg->url_cache_size, worker->srv->stat);
+	rspamd_stem_cache_init (worker->srv->cfg->stem_cache_size, worker->srv->stat);
 #ifdef WITH_HYPERSCAN
 	rspamd_control_worker_add_cmd_handler (worker,
 			RSPAMD_CONTROL_HYPERSCAN_LOADED,
 			rspamd_worker_hyperscan_ready,
 			NULL);
+	rspamd_control_worker_add_cmd_handler (worker,
+			RSPAMD_CONTROL_HYPERSCAN_MAP_LOADED,
+			rspamd_worker_hyperscan_map_ready,
+			NULL);
 #endif
 	rspamd_control_worker_add_cmd_handler (worker,
 			RSPAMD_CONTROL_LOG_PIPE,
@@ -1906,6 +2629,19 @@ rspamd_worker_init_scanner (struct rspamd_worker *worker,
 			RSPAMD_CONTROL_MONITORED_CHANGE,
 			rspamd_worker_monitored_handler,
 			worker->srv->cfg);
+	rspamd_control_worker_add_cmd_handler (worker,
+			RSPAMD_CONTROL_SYMBOLS_TRACE,
+			rspamd_worker_symbols_trace_handler,
+			worker->srv->cfg);
+
+	rspamd_lua_profiler_init (worker->srv->cfg);
+
+	if (rspamd_lua_profiler_enabled ()) {
+		rspamd_control_worker_add_cmd_handler (worker,
+				RSPAMD_CONTROL_LUA_PROFILE,
+				rspamd_worker_lua_profile_handler,
+				worker->srv->cfg);
+	}
 
 	*plang_det = worker->srv->cfg->lang_det;
 }
@@ -1984,7 +2720,8 @@ static ev_timer rrd_timer;
 
 void
 rspamd_controller_on_terminate (struct rspamd_worker *worker,
-								struct rspamd_rrd_file *rrd)
+								struct rspamd_rrd_file *rrd,
+								struct rspamd_timeseries *ts)
 {
 	struct rspamd_abstract_worker_ctx *ctx;
 
@@ -1996,6 +2733,12 @@ rspamd_controller_on_terminate (struct rspamd_worker *worker,
 		msg_info ("closing rrd file: %s", rrd->filename);
 		rspamd_rrd_close (rrd);
 	}
+
+	if (ts) {
+		ev_timer_stop (ctx->event_loop, &rrd_timer);
+		msg_info ("closing time series file: %s", rspamd_timeseries_path (ts));
+		rspamd_timeseries_close (ts);
+	}
 }
 
 static void
@@ -2077,6 +2820,7 @@ rspamd_controller_load_saved_stats (struct rspamd_main *rspamd_main,
 struct rspamd_controller_periodics_cbdata {
 	struct rspamd_worker *worker;
 	struct rspamd_rrd_file *rrd;
+	struct rspamd_timeseries *ts;
 	struct rspamd_stat *stat;
 	ev_timer save_stats_event;
 };
@@ -2092,13 +2836,20 @@ rspamd_controller_rrd_update (EV_P_ ev_timer *w, int revents)
 	GError *err = NULL;
 	guint i;
 
-	g_assert (cbd->rrd != NULL);
 	stat = cbd->stat;
 
 	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
 		points[i] = stat->actions_stat[i];
 	}
 
+	if (cbd->ts) {
+		rspamd_timeseries_add (cbd->ts, points, rspamd_get_calendar_ticks ());
+		ev_timer_again (EV_A_ w);
+
+		return;
+	}
+
+	g_assert (cbd->rrd != NULL);
 	ar.data = (gchar *)points;
 	ar.len = sizeof (points);
 
@@ -2124,7 +2875,8 @@ rspamd_controller_stats_save_periodic (EV_P_ ev_timer *w, int revents)
 
 void
 rspamd_worker_init_controller (struct rspamd_worker *worker,
-							   struct rspamd_rrd_file **prrd)
+							   struct rspamd_rrd_file **prrd,
+							   struct rspamd_timeseries **pts)
 {
 	struct rspamd_abstract_worker_ctx *ctx;
 	static const ev_tstamp rrd_update_time = 1.0;
@@ -2151,8 +2903,33 @@ rspamd_worker_init_controller (struct rspamd_worker *worker,
 				ctx->resolver, worker,
 				RSPAMD_MAP_WATCH_PRIMARY_CONTROLLER);
 
+		if (pts != NULL) {
+			*pts = NULL;
+
+			if (ctx->cfg->timeseries_file) {
+				GError *ts_err = NULL;
+
+				*pts = rspamd_timeseries_open (ctx->cfg->timeseries_file,
+						METRIC_ACTION_MAX, &ts_err);
+
+				if (*pts) {
+					cbd.ts = *pts;
+					rrd_timer.data = &cbd;
+					ev_timer_init (&rrd_timer, rspamd_controller_rrd_update,
+							rrd_update_time, rrd_update_time);
+					ev_timer_start (ctx->event_loop, &rrd_timer);
+				}
+				else {
+					msg_err ("cannot load time series from %s: %e",
+							ctx->cfg->timeseries_file, ts_err);
+					g_error_free (ts_err);
+				}
+			}
+		}
+
 		if (prrd != NULL) {
-			if (ctx->cfg->rrd_file && worker->index == 0) {
+			if (ctx->cfg->rrd_file && ctx->cfg->timeseries_file == NULL &&
+					worker->index == 0) {
 				GError *rrd_err = NULL;
 
 				*prrd = rspamd_rrd_file_default (ctx->cfg->rrd_file, &rrd_err);
@@ -2188,4 +2965,34 @@ rspamd_worker_init_controller (struct rspamd_worker *worker,
 		rspamd_map_watch (worker->srv->cfg, ctx->event_loop,
 				ctx->resolver, worker, RSPAMD_MAP_WATCH_SCANNER);
 	}
-}
\ No newline at end of file
+}
+
+ucl_object_t *
+rspamd_worker_mempool_profile (guint max_sites)
+{
+	struct rspamd_mempool_site_stat *sites;
+	ucl_object_t *top, *obj;
+	guint i, nsites;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+	sites = g_malloc (sizeof (*sites) * max_sites);
+	nsites = rspamd_mempool_profile_top (sites, max_sites);
+
+	for (i = 0; i < nsites; i ++) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (sites[i].loc),
+				"loc", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (sites[i].bytes),
+				"bytes", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (sites[i].allocs),
+				"allocs", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (sites[i].allocs > 0 ?
+				(gdouble)sites[i].bytes / sites[i].allocs : 0.0),
+				"avg_size", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	g_free (sites);
+
+	return top;
+}
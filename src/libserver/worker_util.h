@@ -46,7 +46,7 @@ void rspamd_worker_init_signals (struct rspamd_worker *worker, struct ev_loop *e
 typedef void (*rspamd_accept_handler) (struct ev_loop *loop, ev_io *w, int revents);
 
 /**
- * Prepare worker's startup
+ * Prepare worker's startup, pins worker to cpus if `cpu_affinity` is set
  * @param worker worker structure
  * @param name name of the worker
  * @param sig_handler handler of main signals
@@ -196,6 +196,43 @@ void rspamd_worker_session_cache_add (void *cache, const gchar *tag,
  */
 void rspamd_worker_session_cache_remove (void *cache, void *ptr);
 
+/**
+ * Reserves a shared load slot for a worker being forked
+ * @return slot index or -1 if all slots are used
+ */
+gint rspamd_worker_load_slot_reserve (struct rspamd_main *rspamd_main);
+
+/**
+ * Frees the load slot of a terminated worker, so its tasks in flight are no
+ * longer accounted
+ */
+void rspamd_worker_load_slot_release (struct rspamd_worker *wrk);
+
+/**
+ * Adds tasks and bytes (both could be negative) to the load of the current worker
+ */
+void rspamd_worker_load_update (struct rspamd_worker *wrk, gint tasks,
+								gint64 bytes);
+
+/**
+ * Sums the load of all workers of the host
+ */
+void rspamd_worker_load_host (struct rspamd_main *rspamd_main,
+							  guint *tasks, guint64 *bytes);
+
+/**
+ * Starts periodic publishing of the current worker stats to its load slot
+ */
+void rspamd_worker_load_stat_start (struct rspamd_worker *wrk,
+									struct ev_loop *event_loop);
+
+/**
+ * Exports stats of all workers published in the load slots, the same as
+ * replies to the `stat` control command but with no IPC involved
+ * @return object with `workers` indexed by pid and `total` elements
+ */
+ucl_object_t *rspamd_worker_load_stat_ucl (struct rspamd_main *rspamd_main);
+
 /**
  * Fork new worker with the specified configuration
  */
@@ -205,6 +242,13 @@ struct rspamd_worker *rspamd_fork_worker (struct rspamd_main *,
 										  rspamd_worker_term_cb term_handler,
 										  GHashTable *listen_sockets);
 
+/**
+ * Closes per worker SO_REUSEPORT sockets owned by the current process for
+ * the specified worker configuration, safe to call multiple times
+ * @param cf
+ */
+void rspamd_worker_close_reuseport_socks (struct rspamd_worker_conf *cf);
+
 /**
  * Sets crash signals handlers if compiled with libunwind
  */
@@ -246,21 +290,24 @@ gboolean rspamd_check_termination_clause (struct rspamd_main *rspamd_main,
 gboolean rspamd_worker_call_finish_handlers (struct rspamd_worker *worker);
 
 struct rspamd_rrd_file;
+struct rspamd_timeseries;
 /**
  * Terminate controller worker
  * @param worker
  */
 void rspamd_controller_on_terminate (struct rspamd_worker *worker,
-		struct rspamd_rrd_file *rrd);
+		struct rspamd_rrd_file *rrd,
+		struct rspamd_timeseries *ts);
 
 /**
  * Inits controller worker
  * @param worker
- * @param ev_base
- * @param prrd
+ * @param prrd legacy rrd file if configured
+ * @param pts time series storage if configured
  */
 void rspamd_worker_init_controller (struct rspamd_worker *worker,
-								   struct rspamd_rrd_file **prrd);
+								   struct rspamd_rrd_file **prrd,
+								   struct rspamd_timeseries **pts);
 
 /**
  * Saves stats
@@ -270,6 +317,14 @@ void rspamd_worker_init_controller (struct rspamd_worker *worker,
 void rspamd_controller_store_saved_stats (struct rspamd_main *rspamd_main,
 									 struct rspamd_config *cfg);
 
+/**
+ * Returns an array of the top allocation sites collected by memory pools
+ * profiler (aggregated over all workers)
+ * @param max_sites maximum number of sites to return
+ * @return new ucl array
+ */
+ucl_object_t *rspamd_worker_mempool_profile (guint max_sites);
+
 #ifdef WITH_HYPERSCAN
 struct rspamd_control_command;
 
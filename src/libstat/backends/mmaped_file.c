@@ -18,6 +18,8 @@
 #include "unix-std.h"
 
 #define CHAIN_LENGTH 128
+/* Tokens to look ahead when prefetching chains */
+#define PREFETCH_DISTANCE 8
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
@@ -124,14 +126,45 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 		if (block->hash1 == h1 && block->hash2 == h2) {
 			return block->value;
 		}
+		/*
+		 * Blocks are never freed and new tokens take the first free block
+		 * in a chain, so the token cannot be placed after a free block
+		 */
+		if (block->hash1 == 0 && block->hash2 == 0) {
+			break;
+		}
 		c += sizeof (struct stat_file_block);
 		block = (struct stat_file_block *)c;
 	}
 
-
 	return 0;
 }
 
+/*
+ * Hint CPU to start loading the chain for the specified token, so a random
+ * access to a large statfile occurs while we check the previous tokens
+ */
+static inline void
+rspamd_mmaped_file_prefetch_block (rspamd_mmaped_file_t *file,
+		const rspamd_token_t *tok)
+{
+#ifdef __GNUC__
+	guint32 h1;
+
+	if (!file->map) {
+		return;
+	}
+
+	memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
+	__builtin_prefetch ((u_char *) file->map + file->seek_pos +
+			(h1 % file->cur_section.length) * sizeof (struct stat_file_block),
+			0, 0);
+#else
+	(void)file;
+	(void)tok;
+#endif
+}
+
 static void
 rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t *file,
@@ -407,7 +440,7 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 
 	if (size <
 		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+		sizeof (*block)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
@@ -503,7 +536,7 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 							new, block->hash1,
 							block->hash2, block->value);
 				}
-				pos += sizeof (block);
+				pos += sizeof (*block);
 			}
 		}
 
@@ -961,7 +994,16 @@ rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
+	for (i = 0; i < MIN (tokens->len, PREFETCH_DISTANCE); i++) {
+		rspamd_mmaped_file_prefetch_block (mf, g_ptr_array_index (tokens, i));
+	}
+
 	for (i = 0; i < tokens->len; i++) {
+		if (i + PREFETCH_DISTANCE < tokens->len) {
+			rspamd_mmaped_file_prefetch_block (mf,
+					g_ptr_array_index (tokens, i + PREFETCH_DISTANCE));
+		}
+
 		tok = g_ptr_array_index (tokens, i);
 		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
 		memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
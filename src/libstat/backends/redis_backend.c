@@ -24,6 +24,8 @@
 #include "hiredis.h"
 #include "adapters/libev.h"
 #include "ref.h"
+#include "hash.h"
+#include "cryptobox.h"
 
 #define msg_debug_stat_redis(...)  rspamd_conditional_debug_fast (NULL, NULL, \
         rspamd_stat_redis_log_id, "stat_redis", task->task_pool->tag.uid, \
@@ -40,6 +42,7 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_CACHE_TTL 60
 
 struct redis_stat_ctx {
 	lua_State *L;
@@ -56,6 +59,21 @@ struct redis_stat_ctx {
 	gboolean enable_signatures;
 	guint expiry;
 	gint cbref_user;
+	rspamd_lru_hash_t *tokens_cache;
+	rspamd_lru_hash_t *learns_cache;
+	guint cache_ttl;
+};
+
+/* Token value cached by a worker */
+struct rspamd_redis_cached_token {
+	guint64 key;
+	gdouble value;
+};
+
+/* Learns count of a statfile object cached by a worker */
+struct rspamd_redis_cached_learns {
+	guint64 key;
+	guint64 learned;
 };
 
 enum rspamd_redis_connection_state {
@@ -79,6 +97,8 @@ struct redis_stat_runtime {
 	guint64 learned;
 	gint id;
 	gboolean has_event;
+	gboolean tokens_pending;
+	guint64 cache_seed;
 	GError *err;
 };
 
@@ -1150,6 +1170,122 @@ rspamd_redis_timeout (EV_P_ ev_timer *w, int revents)
 	}
 }
 
+static inline guint64
+rspamd_redis_token_cache_key (struct redis_stat_runtime *rt,
+		rspamd_token_t *tok)
+{
+	return rspamd_cryptobox_fast_hash (&tok->data, sizeof (tok->data),
+			rt->cache_seed);
+}
+
+/*
+ * Fills values of tokens found in the worker's cache and returns
+ * tokens that should be queried from redis
+ */
+static GPtrArray *
+rspamd_redis_tokens_from_cache (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens)
+{
+	GPtrArray *missing;
+	struct rspamd_redis_cached_token *cached;
+	rspamd_token_t *tok;
+	guint64 key;
+	guint i, hits = 0;
+
+	missing = g_ptr_array_sized_new (tokens->len);
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		key = rspamd_redis_token_cache_key (rt, tok);
+		cached = rspamd_lru_hash_lookup (rt->ctx->tokens_cache, &key,
+				(time_t)task->task_timestamp);
+
+		if (cached) {
+			tok->values[rt->id] = cached->value;
+			hits ++;
+		}
+		else {
+			g_ptr_array_add (missing, tok);
+		}
+	}
+
+	if (task->worker && task->worker->srv) {
+		struct rspamd_stat *stat = task->worker->srv->stat;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+		__atomic_add_fetch (&stat->bayes_cache_hits, hits, __ATOMIC_RELAXED);
+		__atomic_add_fetch (&stat->bayes_cache_misses, missing->len,
+				__ATOMIC_RELAXED);
+#else
+		stat->bayes_cache_hits += hits;
+		stat->bayes_cache_misses += missing->len;
+#endif
+	}
+
+	msg_debug_stat_redis ("found %ud of %ud tokens for %s in cache",
+			hits, tokens->len, rt->redis_object_expanded);
+
+	return missing;
+}
+
+static void
+rspamd_redis_cache_token (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		rspamd_token_t *tok)
+{
+	struct rspamd_redis_cached_token *cached;
+
+	cached = g_malloc (sizeof (*cached));
+	cached->key = rspamd_redis_token_cache_key (rt, tok);
+	cached->value = tok->values[rt->id];
+	rspamd_lru_hash_insert (rt->ctx->tokens_cache, &cached->key, cached,
+			(time_t)task->task_timestamp, rt->ctx->cache_ttl);
+}
+
+static void
+rspamd_redis_set_tokens_flags (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	if (rt->stcf->is_spam) {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+	}
+	else {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+	}
+}
+
+/* Save learn count in mempool variable */
+static void
+rspamd_redis_save_learns (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	gint64 *learns_cnt;
+	const gchar *var_name;
+
+	if (rt->stcf->is_spam) {
+		var_name = RSPAMD_MEMPOOL_SPAM_LEARNS;
+	}
+	else {
+		var_name = RSPAMD_MEMPOOL_HAM_LEARNS;
+	}
+
+	learns_cnt = rspamd_mempool_get_variable (task->task_pool,
+			var_name);
+
+	if (learns_cnt) {
+		(*learns_cnt) += rt->learned;
+	}
+	else {
+		learns_cnt = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*learns_cnt));
+		*learns_cnt = rt->learned;
+		rspamd_mempool_set_variable (task->task_pool,
+				var_name,
+				learns_cnt, NULL);
+	}
+}
+
 /* Called when we have received tokens values from redis */
 static void
 rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -1163,14 +1299,21 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	gdouble float_val;
 
 	task = rt->task;
+	rt->tokens_pending = FALSE;
 
 	if (c->err == 0 && rt->has_event) {
 		if (r != NULL) {
-			if (reply->type == REDIS_REPLY_ARRAY) {
+			if (rt->learned < rt->stcf->clcf->min_learns || rt->learned == 0) {
+				msg_warn_task ("skip obtaining bayes tokens for %s of classifier "
+							   "%s: not enough learns %d; %d required",
+						rt->stcf->symbol, rt->stcf->clcf->name,
+						(int)rt->learned, rt->stcf->clcf->min_learns);
+			}
+			else if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
+				if (reply->elements == rt->tokens->len) {
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
+						tok = g_ptr_array_index (rt->tokens, i);
 						elt = reply->element[i];
 
 						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
@@ -1194,21 +1337,20 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 							tok->values[rt->id] = 0;
 						}
 
+						if (rt->ctx->tokens_cache) {
+							rspamd_redis_cache_token (task, rt, tok);
+						}
+
 						processed ++;
 					}
 
-					if (rt->stcf->is_spam) {
-						task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
-					}
-					else {
-						task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
-					}
+					rspamd_redis_set_tokens_flags (task, rt);
 				}
 				else {
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 										"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)rt->tokens->len);
 				}
 			}
 			else {
@@ -1242,6 +1384,39 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+static void
+rspamd_redis_send_tokens_query (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	rspamd_fstring_t *query;
+
+	if (rt->tokens->len == 0) {
+		return;
+	}
+
+	query = rspamd_redis_tokens_to_query (
+			task,
+			rt,
+			rt->tokens,
+			rt->ctx->new_schema ? "HGET" : "HMGET",
+			rt->redis_object_expanded, FALSE, -1,
+			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+
+	if (query != NULL) {
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+		if (redisAsyncFormattedCommand (rt->redis,
+				rspamd_redis_processed, rt,
+				query->str, query->len) == REDIS_OK) {
+			rt->tokens_pending = TRUE;
+		}
+		else {
+			msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+		}
+	}
+}
+
 /* Called when we have connected to the redis server and got stats */
 static void
 rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -1282,73 +1457,37 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 			msg_debug_stat_redis ("connected to redis server, tokens learned for %s: %uL",
 					rt->redis_object_expanded, rt->learned);
 			rspamd_upstream_ok (rt->selected);
+			rspamd_redis_save_learns (task, rt);
 
-			/* Save learn count in mempool variable */
-			gint64 *learns_cnt;
-			const gchar *var_name;
-
-			if (rt->stcf->is_spam) {
-				var_name = RSPAMD_MEMPOOL_SPAM_LEARNS;
-			}
-			else {
-				var_name = RSPAMD_MEMPOOL_HAM_LEARNS;
-			}
-
-			learns_cnt = rspamd_mempool_get_variable (task->task_pool,
-					var_name);
+			if (rt->ctx->learns_cache) {
+				struct rspamd_redis_cached_learns *cached;
 
-			if (learns_cnt) {
-				(*learns_cnt) += rt->learned;
-			}
-			else {
-				learns_cnt = rspamd_mempool_alloc (task->task_pool,
-						sizeof (*learns_cnt));
-				*learns_cnt = rt->learned;
-				rspamd_mempool_set_variable (task->task_pool,
-						var_name,
-						learns_cnt, NULL);
+				cached = g_malloc (sizeof (*cached));
+				cached->key = rt->cache_seed;
+				cached->learned = rt->learned;
+				rspamd_lru_hash_insert (rt->ctx->learns_cache, &cached->key,
+						cached, (time_t)task->task_timestamp,
+						rt->ctx->cache_ttl);
 			}
 
-			if (rt->learned >= rt->stcf->clcf->min_learns && rt->learned > 0) {
-				rspamd_fstring_t *query = rspamd_redis_tokens_to_query (
-						task,
-						rt,
-						rt->tokens,
-						rt->ctx->new_schema ? "HGET" : "HMGET",
-						rt->redis_object_expanded, FALSE, -1,
-						rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-				g_assert (query != NULL);
-				rspamd_mempool_add_destructor (task->task_pool,
-						(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
-
-				int ret = redisAsyncFormattedCommand (rt->redis,
-						rspamd_redis_processed, rt,
-						query->str, query->len);
+			if (rt->ctx->enable_users && rt->tokens &&
+					rt->learned >= rt->stcf->clcf->min_learns && rt->learned > 0) {
+				rspamd_redis_send_tokens_query (task, rt);
 
-				if (ret != REDIS_OK) {
-					msg_err_task ("call to redis failed: %s", rt->redis->errstr);
-				}
-				else {
-					/* Further is handled by rspamd_redis_processed */
-					final = FALSE;
+				if (rt->tokens_pending) {
 					/* Restart timeout */
-					if (ev_can_stop (&rt->timeout_event)) {
-						rt->timeout_event.repeat = rt->ctx->timeout;
-						ev_timer_again (task->event_loop, &rt->timeout_event);
-					}
-					else {
-						rt->timeout_event.data = rt;
-						ev_timer_init (&rt->timeout_event, rspamd_redis_timeout,
-								rt->ctx->timeout, 0.);
-						ev_timer_start (task->event_loop, &rt->timeout_event);
-					}
+					rt->timeout_event.repeat = rt->ctx->timeout;
+					ev_timer_again (task->event_loop, &rt->timeout_event);
 				}
 			}
-			else {
-				msg_warn_task ("skip obtaining bayes tokens for %s of classifier "
-							   "%s: not enough learns %d; %d required",
-						rt->stcf->symbol, rt->stcf->clcf->name,
-						(int)rt->learned, rt->stcf->clcf->min_learns);
+
+			/* Tokens have been requested and we get them next */
+			final = !rt->tokens_pending;
+
+			if (final && rt->tokens && rt->tokens->len == 0 &&
+					rt->learned >= rt->stcf->clcf->min_learns && rt->learned > 0) {
+				/* All tokens have been found in the cache */
+				rspamd_redis_set_tokens_flags (task, rt);
 			}
 		}
 	}
@@ -1495,6 +1634,25 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 	else {
 		backend->expiry = 0;
 	}
+
+	elt = ucl_object_lookup (obj, "cache_size");
+	if (elt && ucl_object_toint (elt) > 0) {
+		backend->tokens_cache = rspamd_lru_hash_new_full (
+				ucl_object_toint (elt), NULL, g_free,
+				g_int64_hash, g_int64_equal);
+		/* Per user statfiles have many objects with their own learns */
+		backend->learns_cache = rspamd_lru_hash_new_full (
+				MAX (ucl_object_toint (elt) / 64, 64), NULL, g_free,
+				g_int64_hash, g_int64_equal);
+	}
+
+	elt = ucl_object_lookup (obj, "cache_ttl");
+	if (elt) {
+		backend->cache_ttl = ucl_object_toint (elt);
+	}
+	else {
+		backend->cache_ttl = REDIS_DEFAULT_CACHE_TTL;
+	}
 }
 
 gpointer
@@ -1665,6 +1823,11 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rt->stcf = stcf;
 	rt->redis_object_expanded = object_expanded;
 
+	if (ctx->tokens_cache) {
+		rt->cache_seed = rspamd_cryptobox_fast_hash (object_expanded,
+				strlen (object_expanded), rspamd_hash_seed ());
+	}
+
 	addr = rspamd_upstream_addr_next (up);
 	g_assert (addr != NULL);
 
@@ -1710,6 +1873,14 @@ rspamd_redis_close (gpointer p)
 		luaL_unref (L, LUA_REGISTRYINDEX, ctx->conf_ref);
 	}
 
+	if (ctx->tokens_cache) {
+		rspamd_lru_hash_destroy (ctx->tokens_cache);
+	}
+
+	if (ctx->learns_cache) {
+		rspamd_lru_hash_destroy (ctx->learns_cache);
+	}
+
 	g_free (ctx);
 }
 
@@ -1740,12 +1911,51 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		}
 	}
 
+	if (rt->ctx->tokens_cache) {
+		struct rspamd_redis_cached_learns *cached;
+
+		rt->tokens = rspamd_redis_tokens_from_cache (task, rt, tokens);
+		cached = rspamd_lru_hash_lookup (rt->ctx->learns_cache, &rt->cache_seed,
+				(time_t)task->task_timestamp);
+
+		if (cached && (rt->tokens->len == 0 ||
+				cached->learned < rt->stcf->clcf->min_learns ||
+				cached->learned == 0)) {
+			/*
+			 * Model has not been changed for the same tokens or it is not
+			 * learned enough to be used, skip redis
+			 */
+			rt->learned = cached->learned;
+			rspamd_redis_save_learns (task, rt);
+
+			if (rt->learned >= rt->stcf->clcf->min_learns && rt->learned > 0) {
+				rspamd_redis_set_tokens_flags (task, rt);
+			}
+
+			msg_debug_stat_redis ("all tokens and learns for %s are cached",
+					rt->redis_object_expanded);
+
+			return FALSE;
+		}
+	}
+	else {
+		rt->tokens = g_ptr_array_ref (tokens);
+	}
+
 	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
 			rt->redis_object_expanded, learned_key) == REDIS_OK) {
-
 		rspamd_session_add_event (task->s, NULL, rt, M);
 		rt->has_event = TRUE;
-		rt->tokens = g_ptr_array_ref (tokens);
+
+		/*
+		 * Pipeline tokens query after learns: replies come in order, so
+		 * learns count is known when tokens are processed and we save a
+		 * round trip to redis. Most of per user objects have no learns,
+		 * so for them tokens are requested only when learns are enough
+		 */
+		if (!rt->ctx->enable_users) {
+			rspamd_redis_send_tokens_query (task, rt);
+		}
 
 		if (ev_can_stop (&rt->timeout_event)) {
 			rt->timeout_event.repeat = rt->ctx->timeout;
@@ -1782,6 +1992,49 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 	return TRUE;
 }
 
+/*
+ * Repeated phrases produce the same tokens, so merge their increments to
+ * send a single command per distinct token. As redis is an incrementing
+ * backend, values of tokens are deltas and are just summed; the result
+ * is owned by the task pool
+ */
+static GPtrArray *
+rspamd_redis_coalesce_tokens (struct rspamd_task *task, GPtrArray *tokens,
+		gint id)
+{
+	GHashTable *seen;
+	GPtrArray *res;
+	rspamd_token_t *tok, *prev;
+	guint i;
+
+	seen = g_hash_table_new (g_int64_hash, g_int64_equal);
+	res = g_ptr_array_sized_new (tokens->len);
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		prev = g_hash_table_lookup (seen, &tok->data);
+
+		if (prev) {
+			prev->values[id] += tok->values[id];
+		}
+		else {
+			g_hash_table_insert (seen, &tok->data, tok);
+			g_ptr_array_add (res, tok);
+		}
+	}
+
+	g_hash_table_unref (seen);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)g_ptr_array_unref, res);
+
+	if (res->len != tokens->len) {
+		msg_debug_stat_redis ("coalesced %ud tokens to %ud distinct ones",
+				tokens->len, res->len);
+	}
+
+	return res;
+}
+
 gboolean
 rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		gint id, gpointer p)
@@ -1826,7 +2079,23 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->id = id;
-	query = rspamd_redis_tokens_to_query (task, rt, tokens,
+
+	if (rt->ctx->tokens_cache) {
+		guint i;
+		guint64 key;
+
+		/* Values cached in this worker are no longer valid */
+		for (i = 0; i < tokens->len; i ++) {
+			key = rspamd_redis_token_cache_key (rt,
+					g_ptr_array_index (tokens, i));
+			rspamd_lru_hash_remove (rt->ctx->tokens_cache, &key);
+		}
+
+		rspamd_lru_hash_remove (rt->ctx->learns_cache, &rt->cache_seed);
+	}
+
+	query = rspamd_redis_tokens_to_query (task, rt,
+			rspamd_redis_coalesce_tokens (task, tokens, id),
 			redis_cmd, rt->redis_object_expanded, TRUE, id,
 			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
 	g_assert (query != NULL);
@@ -269,6 +269,7 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 {
 	rspamd_token_t *new_tok = NULL;
 	rspamd_stat_token_t *token;
+	rspamd_mempool_slab_t *tokens_slab;
 	struct rspamd_osb_tokenizer_config *osb_cf;
 	guint64 cur, seed;
 	struct token_pipe_entry *hashpipe;
@@ -300,6 +301,8 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 	token_size = sizeof (rspamd_token_t) +
 			sizeof (gdouble) * ctx->statfiles->len;
 	g_assert (token_size > 0);
+	/* Tokens are allocated by many thousands, so carve them in blocks */
+	tokens_slab = rspamd_mempool_slab_new_sized (task->task_pool, token_size);
 
 	for (w = 0; w < words->len; w ++) {
 		token = &g_array_index (words, rspamd_stat_token_t, w);
@@ -346,7 +349,7 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		}
 
 		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			new_tok = rspamd_mempool_alloc0 (task->task_pool, token_size);
+			new_tok = rspamd_mempool_slab_alloc0 (tokens_slab);
 			new_tok->flags = token_flags;
 			new_tok->t1 = token;
 			new_tok->t2 = token;
@@ -358,7 +361,7 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		}
 
 #define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (task->task_pool, token_size); \
+    new_tok = rspamd_mempool_slab_alloc0 (tokens_slab); \
     new_tok->flags = token_flags; \
     new_tok->t1 = hashpipe[0].t; \
     new_tok->t2 = hashpipe[i].t; \
@@ -385,9 +388,8 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		}
 		else {
 			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
-			}
+			memmove (&hashpipe[1], &hashpipe[0],
+					(window_size - 1) * sizeof (hashpipe[0]));
 			hashpipe[0].h = cur;
 			hashpipe[0].t = token;
 
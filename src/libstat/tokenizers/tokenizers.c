@@ -23,6 +23,8 @@
 #include "contrib/mumhash/mum.h"
 #include "libmime/lang_detection.h"
 #include "libstemmer.h"
+#include "cryptobox.h"
+#include "hash.h"
 
 #include <unicode/utf8.h>
 #include <unicode/uchar.h>
@@ -35,6 +37,23 @@
 
 #include <math.h>
 
+/* Words that are longer are not cached */
+#define RSPAMD_STEM_CACHE_MAX_LEN 64
+
+/* Stemmed form of a normalised word for a specific stemmer */
+struct rspamd_stem_cache_entry {
+	guint64 hash;
+	struct sb_stemmer *stem;
+	guint flags; /* stemmed and stop word flags to add */
+	guint16 len;
+	guint16 stemmed_len;
+	gchar data[]; /* normalised word followed by stemmed one */
+};
+
+static rspamd_lru_hash_t *stem_cache = NULL;
+static guint stem_cache_max = 0;
+static struct rspamd_stat *stem_cache_stat = NULL;
+
 typedef gboolean (*token_get_function) (rspamd_stat_token_t * buf, gchar const **pos,
 		rspamd_stat_token_t * token,
 		GList **exceptions, gsize *rl, gboolean check_signature);
@@ -869,6 +888,147 @@ rspamd_normalize_words (GArray *words, rspamd_mempool_t *pool)
 	}
 }
 
+void
+rspamd_stem_cache_init (guint max_entries, struct rspamd_stat *stat)
+{
+	if (stem_cache) {
+		rspamd_lru_hash_destroy (stem_cache);
+		stem_cache = NULL;
+	}
+
+	stem_cache_max = max_entries;
+	stem_cache_stat = stat;
+}
+
+static void
+rspamd_stem_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool,
+		struct sb_stemmer *stem,
+		struct rspamd_lang_detector *d)
+{
+	const gchar *stemmed = NULL;
+	gchar *dest;
+	gsize dlen;
+
+	if (stem) {
+		stemmed = sb_stemmer_stem (stem,
+				tok->normalized.begin, tok->normalized.len);
+
+		dlen = stemmed ? strlen (stemmed) : 0;
+
+		if (dlen > 0) {
+			dest = rspamd_mempool_alloc (pool, dlen + 1);
+			memcpy (dest, stemmed, dlen);
+			dest[dlen] = '\0';
+			tok->stemmed.len = dlen;
+			tok->stemmed.begin = dest;
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STEMMED;
+		}
+		else {
+			/* Fallback */
+			tok->stemmed.len = tok->normalized.len;
+			tok->stemmed.begin = tok->normalized.begin;
+		}
+	}
+	else {
+		tok->stemmed.len = tok->normalized.len;
+		tok->stemmed.begin = tok->normalized.begin;
+	}
+
+	if (tok->stemmed.len > 0 && d != NULL &&
+		rspamd_language_detector_is_stop_word (d, tok->stemmed.begin, tok->stemmed.len)) {
+		tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STOP_WORD;
+	}
+}
+
+/*
+ * Words follow Zipf's law, so most of them are stemmed and checked against
+ * stop words over and over: keep the results in a per process cache
+ */
+static void
+rspamd_stem_single_word_cached (rspamd_stat_token_t *tok, rspamd_mempool_t *pool,
+		struct sb_stemmer *stem,
+		struct rspamd_lang_detector *d,
+		time_t now)
+{
+	struct rspamd_stem_cache_entry *entry;
+	guint64 hash;
+	guint old_flags;
+	gchar *dest;
+
+	if (tok->normalized.len == 0 ||
+			tok->normalized.len > RSPAMD_STEM_CACHE_MAX_LEN) {
+		rspamd_stem_single_word (tok, pool, stem, d);
+
+		return;
+	}
+
+	if (stem_cache == NULL) {
+		stem_cache = rspamd_lru_hash_new_full (stem_cache_max, NULL, g_free,
+				g_int64_hash, g_int64_equal);
+	}
+
+	hash = rspamd_cryptobox_fast_hash (tok->normalized.begin,
+			tok->normalized.len, (guint64)(uintptr_t)stem);
+	entry = rspamd_lru_hash_lookup (stem_cache, &hash, now);
+
+	if (entry && entry->stem == stem && entry->len == tok->normalized.len &&
+			memcmp (entry->data, tok->normalized.begin, entry->len) == 0) {
+		if (entry->flags & RSPAMD_STAT_TOKEN_FLAG_STEMMED) {
+			dest = rspamd_mempool_alloc (pool, entry->stemmed_len + 1);
+			memcpy (dest, entry->data + entry->len, entry->stemmed_len);
+			dest[entry->stemmed_len] = '\0';
+			tok->stemmed.begin = dest;
+			tok->stemmed.len = entry->stemmed_len;
+		}
+		else {
+			/* Stemmed form is the normalised one, nothing to copy */
+			tok->stemmed.begin = tok->normalized.begin;
+			tok->stemmed.len = tok->normalized.len;
+		}
+
+		tok->flags |= entry->flags;
+
+		if (stem_cache_stat) {
+#ifdef HAVE_ATOMIC_BUILTINS
+			__atomic_add_fetch (&stem_cache_stat->stem_cache_hits, 1,
+					__ATOMIC_RELAXED);
+#else
+			stem_cache_stat->stem_cache_hits ++;
+#endif
+		}
+
+		return;
+	}
+
+	old_flags = tok->flags;
+	rspamd_stem_single_word (tok, pool, stem, d);
+
+	if (tok->stemmed.len > G_MAXUINT16) {
+		return;
+	}
+
+	entry = g_malloc (sizeof (*entry) + tok->normalized.len +
+			tok->stemmed.len);
+	entry->hash = hash;
+	entry->stem = stem;
+	entry->flags = tok->flags & ~old_flags &
+			(RSPAMD_STAT_TOKEN_FLAG_STEMMED|RSPAMD_STAT_TOKEN_FLAG_STOP_WORD);
+	entry->len = tok->normalized.len;
+	entry->stemmed_len = tok->stemmed.len;
+	memcpy (entry->data, tok->normalized.begin, entry->len);
+	memcpy (entry->data + entry->len, tok->stemmed.begin, entry->stemmed_len);
+	rspamd_lru_hash_insert (stem_cache, &entry->hash, entry, now, 0);
+
+	if (stem_cache_stat) {
+#ifdef HAVE_ATOMIC_BUILTINS
+		__atomic_add_fetch (&stem_cache_stat->stem_cache_misses, 1,
+				__ATOMIC_RELAXED);
+#else
+		stem_cache_stat->stem_cache_misses ++;
+#endif
+	}
+}
+
 void
 rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
 				   const gchar *language,
@@ -878,8 +1038,8 @@ rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
 	struct sb_stemmer *stem = NULL;
 	guint i;
 	rspamd_stat_token_t *tok;
-	gchar *dest;
-	gsize dlen;
+	gboolean use_cache;
+	time_t now = 0;
 
 	if (!stemmers) {
 		stemmers = g_hash_table_new (rspamd_strcase_hash,
@@ -910,40 +1070,22 @@ rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
 			stem = NULL;
 		}
 	}
+	/* Stop words depend on detector, so cache only when it is defined */
+	use_cache = stem_cache_max > 0 && d != NULL;
+
+	if (use_cache) {
+		now = time (NULL);
+	}
+
 	for (i = 0; i < words->len; i++) {
 		tok = &g_array_index (words, rspamd_stat_token_t, i);
 
 		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
-			if (stem) {
-				const gchar *stemmed = NULL;
-
-				stemmed = sb_stemmer_stem (stem,
-						tok->normalized.begin, tok->normalized.len);
-
-				dlen = stemmed ? strlen (stemmed) : 0;
-
-				if (dlen > 0) {
-					dest = rspamd_mempool_alloc (pool, dlen + 1);
-					memcpy (dest, stemmed, dlen);
-					dest[dlen] = '\0';
-					tok->stemmed.len = dlen;
-					tok->stemmed.begin = dest;
-					tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STEMMED;
-				}
-				else {
-					/* Fallback */
-					tok->stemmed.len = tok->normalized.len;
-					tok->stemmed.begin = tok->normalized.begin;
-				}
+			if (use_cache) {
+				rspamd_stem_single_word_cached (tok, pool, stem, d, now);
 			}
 			else {
-				tok->stemmed.len = tok->normalized.len;
-				tok->stemmed.begin = tok->normalized.begin;
-			}
-
-			if (tok->stemmed.len > 0 && d != NULL &&
-				rspamd_language_detector_is_stop_word (d, tok->stemmed.begin, tok->stemmed.len)) {
-				tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STOP_WORD;
+				rspamd_stem_single_word (tok, pool, stem, d);
 			}
 		}
 		else {
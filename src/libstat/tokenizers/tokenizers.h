@@ -75,6 +75,14 @@ void rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
 						const gchar *language,
 						struct rspamd_lang_detector *d);
 
+struct rspamd_stat;
+/**
+ * Enables cache of stemmed words in the current process
+ * @param max_entries maximum number of words cached (0 to disable)
+ * @param stat shared statistics to count cache hits and misses (may be NULL)
+ */
+void rspamd_stem_cache_init (guint max_entries, struct rspamd_stat *stat);
+
 void rspamd_tokenize_meta_words (struct rspamd_task *task);
 
 #ifdef  __cplusplus
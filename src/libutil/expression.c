@@ -25,7 +25,6 @@
 #include <math.h>
 
 #define RSPAMD_EXPR_FLAG_NEGATE (1 << 0)
-#define RSPAMD_EXPR_FLAG_PROCESSED (1 << 1)
 
 #define MIN_RESORT_EVALS 50
 #define MAX_RESORT_EVALS 150
@@ -62,7 +61,22 @@ struct rspamd_expression_elt {
 
 	gint flags;
 	gint priority;
-	gdouble value;
+};
+
+enum rspamd_expression_insn_type {
+	INSN_ATOM = 0,
+	INSN_LIMIT,
+	INSN_UNARY,
+	INSN_BINARY,
+	INSN_NARY,
+	INSN_JUMP_IF_DONE, /* jumps to the end of logical operation if its result is known */
+};
+
+/* AST is flattened to the postfix code evaluated on a stack of values */
+struct rspamd_expression_insn {
+	enum rspamd_expression_insn_type type;
+	guint jump;
+	struct rspamd_expression_elt *elt;
 };
 
 struct rspamd_expression {
@@ -70,6 +84,8 @@ struct rspamd_expression {
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	GArray *code; /* of rspamd_expression_insn */
+	guint max_stack;
 	gchar *log_id;
 	guint next_resort;
 	guint evals;
@@ -551,6 +567,9 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 		if (expr->expression_stack) {
 			g_ptr_array_free (expr->expression_stack, TRUE);
 		}
+		if (expr->code) {
+			g_array_free (expr->code, TRUE);
+		}
 		if (expr->ast) {
 			g_node_destroy (expr->ast);
 		}
@@ -809,6 +828,91 @@ rspamd_expr_dup_elt (rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 	return n;
 }
 
+static void
+rspamd_expr_compile_node (struct rspamd_expression *e, GNode *node,
+		guint *depth)
+{
+	struct rspamd_expression_elt *elt = node->data;
+	struct rspamd_expression_insn insn, *jmp;
+	GArray *jumps;
+	GNode *cld;
+	guint i, pos;
+
+	memset (&insn, 0, sizeof (insn));
+	insn.elt = elt;
+
+	switch (elt->type) {
+	case ELT_ATOM:
+	case ELT_LIMIT:
+		insn.type = elt->type == ELT_ATOM ? INSN_ATOM : INSN_LIMIT;
+		g_array_append_val (e->code, insn);
+		(*depth) ++;
+		e->max_stack = MAX (e->max_stack, *depth);
+		break;
+	case ELT_OP:
+		g_assert (node->children != NULL);
+
+		if (elt->p.op.op_flags & RSPAMD_EXPRESSION_NARY) {
+			jumps = g_array_new (FALSE, FALSE, sizeof (guint));
+			rspamd_expr_compile_node (e, node->children, depth);
+
+			for (cld = node->children->next; cld != NULL; cld = cld->next) {
+				if (elt->p.op.op == OP_AND || elt->p.op.op == OP_OR) {
+					/* Short circuit, patched to the end of operation */
+					insn.type = INSN_JUMP_IF_DONE;
+					pos = e->code->len;
+					g_array_append_val (jumps, pos);
+					g_array_append_val (e->code, insn);
+				}
+
+				rspamd_expr_compile_node (e, cld, depth);
+				insn.type = INSN_NARY;
+				g_array_append_val (e->code, insn);
+				(*depth) --;
+			}
+
+			for (i = 0; i < jumps->len; i ++) {
+				jmp = &g_array_index (e->code, struct rspamd_expression_insn,
+						g_array_index (jumps, guint, i));
+				jmp->jump = e->code->len;
+			}
+
+			g_array_free (jumps, TRUE);
+		}
+		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_BINARY) {
+			g_assert (node->children->next != NULL &&
+					node->children->next->next == NULL);
+			rspamd_expr_compile_node (e, node->children, depth);
+			rspamd_expr_compile_node (e, node->children->next, depth);
+			insn.type = INSN_BINARY;
+			g_array_append_val (e->code, insn);
+			(*depth) --;
+		}
+		else {
+			g_assert (node->children->next == NULL);
+			rspamd_expr_compile_node (e, node->children, depth);
+			insn.type = INSN_UNARY;
+			g_array_append_val (e->code, insn);
+		}
+		break;
+	}
+}
+
+/*
+ * Flattens AST to the postfix code, must be called each time the AST is
+ * resorted
+ */
+static void
+rspamd_expr_compile (struct rspamd_expression *e)
+{
+	guint depth = 0;
+
+	g_array_set_size (e->code, 0);
+	e->max_stack = 0;
+	rspamd_expr_compile_node (e, e->ast, &depth);
+	g_assert (depth == 1);
+}
+
 gboolean
 rspamd_parse_expression (const gchar *line, gsize len,
 		const struct rspamd_atom_subr *subr, gpointer subr_data,
@@ -851,6 +955,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	operand_stack = g_ptr_array_sized_new (32);
 	e->ast = NULL;
 	e->expression_stack = g_ptr_array_sized_new (32);
+	e->code = g_array_new (FALSE, FALSE, sizeof (struct rspamd_expression_insn));
 	e->subr = subr;
 	e->evals = 0;
 	e->next_resort = ottery_rand_range (MAX_RESORT_EVALS) + MIN_RESORT_EVALS;
@@ -1164,6 +1269,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	/* Now set less expensive branches to be evaluated first */
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 			rspamd_ast_resort_traverse, NULL);
+	rspamd_expr_compile (e);
 
 	if (target) {
 		*target = e;
@@ -1322,132 +1428,91 @@ rspamd_ast_do_nary_op (struct rspamd_expression_elt *elt, gdouble val, gdouble a
 }
 
 static gdouble
-rspamd_ast_process_node (struct rspamd_expression *e, GNode *node,
-						 struct rspamd_expr_process_data *process_data)
+rspamd_expr_eval_code (struct rspamd_expression *e,
+		struct rspamd_expr_process_data *process_data)
 {
+	struct rspamd_expression_insn *insn;
 	struct rspamd_expression_elt *elt;
-	GNode *cld;
-	gdouble acc = NAN;
-	gdouble t1, t2, val;
-	gboolean calc_ticks = FALSE;
-	const gchar *op_name = NULL;
+	gdouble *stack, t1, t2, val;
+	guint pc = 0, sp = 0;
 
-	elt = node->data;
+	stack = g_alloca (sizeof (*stack) * MAX (e->max_stack, 1));
 
-	switch (elt->type) {
-	case ELT_ATOM:
-		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
+	while (pc < e->code->len) {
+		insn = &g_array_index (e->code, struct rspamd_expression_insn, pc);
+		elt = insn->elt;
+		pc ++;
 
+		switch (insn->type) {
+		case INSN_ATOM:
 			/*
 			 * Sometimes get ticks for this expression. 'Sometimes' here means
 			 * that we get lowest 5 bits of the counter `evals` and 5 bits
 			 * of some shifted address to provide some sort of jittering for
 			 * ticks evaluation
 			 */
-			if ((e->evals & 0x1F) == (GPOINTER_TO_UINT (node) >> 4 & 0x1F)) {
-				calc_ticks = TRUE;
+			if ((e->evals & 0x1F) == (GPOINTER_TO_UINT (elt) >> 4 & 0x1F)) {
 				t1 = rspamd_get_ticks (TRUE);
-			}
-
-			elt->value = process_data->process_closure (process_data->ud, elt->p.atom);
-
-			if (fabs (elt->value) > 1e-9) {
-				elt->p.atom->hits ++;
-
-				if (process_data->trace) {
-					g_ptr_array_add (process_data->trace, elt->p.atom);
-				}
-			}
-
-			if (calc_ticks) {
+				val = process_data->process_closure (process_data->ud,
+						elt->p.atom);
 				t2 = rspamd_get_ticks (TRUE);
 				elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
 						(e->evals);
 			}
+			else {
+				val = process_data->process_closure (process_data->ud,
+						elt->p.atom);
+			}
 
-			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
-		}
-
-		acc = elt->value;
-		msg_debug_expression ("atom: elt=%s; acc=%.1f", elt->p.atom->str, acc);
-		break;
-	case ELT_LIMIT:
-
-		acc = elt->p.lim;
-		msg_debug_expression ("limit: lim=%.1f; acc=%.1f;", elt->p.lim, acc);
-		break;
-	case ELT_OP:
-		g_assert (node->children != NULL);
-		op_name = rspamd_expr_op_to_str (elt->p.op.op);
+			if (fabs (val) > 1e-9) {
+				elt->p.atom->hits ++;
 
-		if (elt->p.op.op_flags & RSPAMD_EXPRESSION_NARY) {
-			msg_debug_expression ("proceed nary operation %s", op_name);
-			/* Proceed all ops in chain */
-			DL_FOREACH (node->children, cld) {
-				val = rspamd_ast_process_node (e, cld, process_data);
-				msg_debug_expression ("before op: op=%s; acc=%.1f; val = %.2f", op_name,
-						acc, val);
-				acc = rspamd_ast_do_nary_op (elt, val, acc);
-				msg_debug_expression ("after op: op=%s; acc=%.1f; val = %.2f", op_name,
-						acc, val);
-
-				/* Check if we need to process further */
-				if (!(process_data->flags & RSPAMD_EXPRESSION_FLAG_NOOPT)) {
-					if (rspamd_ast_node_done (elt, acc)) {
-						msg_debug_expression ("optimizer: done");
-						return acc;
-					}
+				if (process_data->trace) {
+					g_ptr_array_add (process_data->trace, elt->p.atom);
 				}
 			}
-		}
-		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_BINARY) {
-			GNode *c1 = node->children, *c2;
-
-			c2 = c1->next;
-			g_assert (c2->next == NULL);
-			gdouble val1, val2;
-
-			msg_debug_expression ("proceed binary operation %s",
-					op_name);
-			val1 = rspamd_ast_process_node (e, c1, process_data);
-			val2 = rspamd_ast_process_node (e, c2, process_data);
 
-			msg_debug_expression ("before op: op=%s; op1 = %.1f, op2 = %.1f",
-					op_name, val1, val2);
-			acc = rspamd_ast_do_binary_op (elt, val1, val2);
+			msg_debug_expression ("atom: elt=%s; acc=%.1f", elt->p.atom->str, val);
+			stack[sp ++] = val;
+			break;
+		case INSN_LIMIT:
+			msg_debug_expression ("limit: lim=%.1f", elt->p.lim);
+			stack[sp ++] = elt->p.lim;
+			break;
+		case INSN_UNARY:
+			stack[sp - 1] = rspamd_ast_do_unary_op (elt, stack[sp - 1]);
 			msg_debug_expression ("after op: op=%s; res=%.1f",
-					op_name, acc);
-		}
-		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_UNARY) {
-			GNode *c1 = node->children;
-
-			g_assert (c1->next == NULL);
-
-			msg_debug_expression ("proceed unary operation %s",
-					op_name);
-			val = rspamd_ast_process_node (e, c1, process_data);
-
-			msg_debug_expression ("before op: op=%s; op1 = %.1f",
-					op_name, val);
-			acc = rspamd_ast_do_unary_op (elt, val);
+					rspamd_expr_op_to_str (elt->p.op.op), stack[sp - 1]);
+			break;
+		case INSN_BINARY:
+			sp --;
+			stack[sp - 1] = rspamd_ast_do_binary_op (elt, stack[sp - 1],
+					stack[sp]);
 			msg_debug_expression ("after op: op=%s; res=%.1f",
-					op_name, acc);
+					rspamd_expr_op_to_str (elt->p.op.op), stack[sp - 1]);
+			break;
+		case INSN_NARY:
+			sp --;
+			stack[sp - 1] = rspamd_ast_do_nary_op (elt, stack[sp],
+					stack[sp - 1]);
+			msg_debug_expression ("after op: op=%s; acc=%.1f; val = %.2f",
+					rspamd_expr_op_to_str (elt->p.op.op), stack[sp - 1],
+					stack[sp]);
+			break;
+		case INSN_JUMP_IF_DONE:
+			/* The accumulator is left on the stack as the result */
+			if (!(process_data->flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+					rspamd_ast_node_done (elt, stack[sp - 1])) {
+				msg_debug_expression ("optimizer: done");
+				pc = insn->jump;
+			}
+			break;
 		}
-		break;
 	}
 
-	return acc;
-}
+	g_assert (sp == 1);
 
-static gboolean
-rspamd_ast_cleanup_traverse (GNode *n, gpointer d)
-{
-	struct rspamd_expression_elt *elt = n->data;
-
-	elt->value = 0;
-	elt->flags = 0;
-
-	return FALSE;
+	return stack[0];
 }
 
 gdouble
@@ -1476,11 +1541,7 @@ rspamd_process_expression_closure (struct rspamd_expression *expr,
 		*track = pd.trace;
 	}
 
-	ret = rspamd_ast_process_node (expr, expr->ast, &pd);
-
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+	ret = rspamd_expr_eval_code (expr, &pd);
 
 	/* Check if we need to resort */
 	if (expr->evals % expr->next_resort == 0) {
@@ -1493,6 +1554,7 @@ rspamd_process_expression_closure (struct rspamd_expression *expr,
 		/* Now set less expensive branches to be evaluated first */
 		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 				rspamd_ast_resort_traverse, NULL);
+		rspamd_expr_compile (expr);
 	}
 
 	return ret;
@@ -79,6 +79,27 @@ static khash_t(mempool_entry) *mempool_entries = NULL;
 
 /* Internal statistic */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
+/* Normal chains released by recycled pools, per process */
+static struct _pool_chain *recycled_chains = NULL;
+static guint recycled_nchains = 0;
+static guint recycled_max_chains = 0;
+/* Minimum number of cached chains since the last trim */
+static guint recycled_low_watermark = 0;
+/* Normal chains of this size or larger are backed by huge pages */
+#define MEMPOOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+static gsize huge_chain_size = 0;
+/* Shared allocation sites table used for profiling */
+struct rspamd_mempool_profile_site {
+	guint64 hash;
+	guint64 bytes;
+	guint64 allocs;
+	gchar loc[MEMPOOL_PROFILE_LOC_LEN];
+};
+#define MEMPOOL_PROFILE_SITES 4096
+#define MEMPOOL_PROFILE_MAX_PROBES 32
+static struct rspamd_mempool_profile_site *profile_sites = NULL;
+static guint profile_rate = 0;
+static guint profile_counter = 0;
 /* Environment variable */
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
@@ -162,6 +183,40 @@ rspamd_mempool_get_entry (const gchar *loc)
 }
 
 
+/*
+ * Allocates private anonymous mapping for a large chain. Explicit huge pages
+ * are tried first as they are not always reserved, then we fall back to the
+ * ordinary mapping asking kernel to use transparent huge pages for it.
+ * Pages are faulted by the allocating process, so they are placed on the local
+ * NUMA node of a pinned worker
+ */
+static gpointer
+rspamd_mempool_huge_map (gsize *len)
+{
+	gpointer map = MAP_FAILED;
+
+	*len = (*len + MEMPOOL_HUGE_PAGE_SIZE - 1) & ~((gsize)MEMPOOL_HUGE_PAGE_SIZE - 1);
+
+#ifdef HAVE_MMAP_HUGETLB
+	map = mmap (NULL, *len, PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+#endif
+
+	if (map == MAP_FAILED) {
+		map = mmap (NULL, *len, PROT_READ | PROT_WRITE,
+				MAP_ANON | MAP_PRIVATE, -1, 0);
+
+		if (map == MAP_FAILED) {
+			return NULL;
+		}
+#ifdef HAVE_MADV_HUGEPAGE
+		(void)madvise (map, *len, MADV_HUGEPAGE);
+#endif
+	}
+
+	return map;
+}
+
 static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 {
@@ -214,19 +269,33 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, total_size);
 	}
 	else {
+		map = NULL;
+
+		if (huge_chain_size > 0 && total_size >= huge_chain_size) {
+			map = rspamd_mempool_huge_map (&total_size);
+		}
+
+		if (map != NULL) {
+			chain = map;
+			chain->map_len = total_size;
+		}
+		else {
 #ifdef HAVE_MALLOC_SIZE
-		optimal_size = sys_alloc_size (total_size);
+			optimal_size = sys_alloc_size (total_size);
 #endif
-		total_size = MAX (total_size, optimal_size);
-		gint ret = posix_memalign (&map, MIN_MEM_ALIGNMENT, total_size);
+			total_size = MAX (total_size, optimal_size);
+			gint ret = posix_memalign (&map, MIN_MEM_ALIGNMENT, total_size);
 
-		if (ret != 0 || map == NULL) {
-			g_error ("%s: failed to allocate %"G_GSIZE_FORMAT" bytes: %d - %s",
-					G_STRLOC, total_size, ret, strerror (errno));
-			abort ();
+			if (ret != 0 || map == NULL) {
+				g_error ("%s: failed to allocate %"G_GSIZE_FORMAT" bytes: %d - %s",
+						G_STRLOC, total_size, ret, strerror (errno));
+				abort ();
+			}
+
+			chain = map;
+			chain->map_len = 0;
 		}
 
-		chain = map;
 		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, total_size);
 		g_atomic_int_inc (&mem_pool_stat->chunks_allocated);
@@ -239,6 +308,119 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 }
 
 
+/*
+ * Takes a cached chain large enough for `size` bytes but not wasting
+ * more than a half of it
+ */
+static struct _pool_chain *
+rspamd_mempool_chain_recycled (gsize size)
+{
+	struct _pool_chain *cur, *prev = NULL;
+	gsize need = size + MIN_MEM_ALIGNMENT;
+
+	LL_FOREACH (recycled_chains, cur) {
+		if (cur->slice_size >= need && cur->slice_size <= need * 2) {
+			if (prev) {
+				prev->next = cur->next;
+			}
+			else {
+				recycled_chains = cur->next;
+			}
+
+			cur->next = NULL;
+			cur->pos = align_ptr (cur->begin, MIN_MEM_ALIGNMENT);
+			recycled_nchains --;
+
+			if (recycled_nchains < recycled_low_watermark) {
+				recycled_low_watermark = recycled_nchains;
+			}
+
+			return cur;
+		}
+
+		prev = cur;
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_mempool_chain_free (struct _pool_chain *chain)
+{
+	g_atomic_int_add (&mem_pool_stat->bytes_allocated,
+			-((gint)chain->slice_size));
+	g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
+
+	if (chain->map_len > 0) {
+		munmap ((void *)chain, chain->map_len);
+	}
+	else {
+		free (chain); /* Not g_free as we use system allocator */
+	}
+}
+
+void
+rspamd_mempool_huge_pages_init (gsize min_chain_size)
+{
+	huge_chain_size = min_chain_size;
+}
+
+void
+rspamd_mempool_recycle_init (guint max_chains)
+{
+	struct _pool_chain *cur, *tmp;
+
+	recycled_max_chains = max_chains;
+
+	if (max_chains == 0) {
+		LL_FOREACH_SAFE (recycled_chains, cur, tmp) {
+			rspamd_mempool_chain_free (cur);
+		}
+
+		recycled_chains = NULL;
+		recycled_nchains = 0;
+	}
+
+	recycled_low_watermark = recycled_nchains;
+}
+
+void
+rspamd_mempool_recycle_trim (void)
+{
+	struct _pool_chain *cur, *tmp, *last = NULL;
+	guint nkeep, i = 0;
+
+	if (recycled_low_watermark == 0) {
+		recycled_low_watermark = recycled_nchains;
+
+		return;
+	}
+
+	/* Idle chains are the least recently released ones at the tail */
+	nkeep = recycled_nchains - recycled_low_watermark;
+
+	LL_FOREACH_SAFE (recycled_chains, cur, tmp) {
+		if (i < nkeep) {
+			last = cur;
+		}
+		else {
+			rspamd_mempool_chain_free (cur);
+			recycled_nchains --;
+		}
+
+		i ++;
+	}
+
+	if (last) {
+		last->next = NULL;
+	}
+	else {
+		recycled_chains = NULL;
+	}
+
+	recycled_low_watermark = recycled_nchains;
+}
+
 /**
  * Get the current pool of the specified type, creating the corresponding
  * array if it's absent
@@ -271,51 +453,57 @@ rspamd_mempool_append_chain (rspamd_mempool_t * pool,
  * @param size size of pool's page
  * @return new memory pool object
  */
+static gpointer
+rspamd_mempool_shared_map (gsize size)
+{
+	gpointer map;
+
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL,
+			size,
+			PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_SHARED,
+			-1,
+			0);
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes, aborting", size);
+		abort ();
+	}
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+	g_assert (fd != -1);
+	map = mmap (NULL,
+			size,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED,
+			fd,
+			0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes, aborting", size);
+		abort ();
+	}
+#else
+#       error No mmap methods are defined
+#endif
+	memset (map, 0, size);
+
+	return map;
+}
+
 rspamd_mempool_t *
 rspamd_mempool_new_ (gsize size, const gchar *tag, gint flags, const gchar *loc)
 {
 	rspamd_mempool_t *new_pool;
-	gpointer map;
 	unsigned char uidbuf[10];
 	const gchar hexdigits[] = "0123456789abcdef";
 	unsigned i;
 
 	/* Allocate statistic structure if it is not allocated before */
 	if (mem_pool_stat == NULL) {
-#if defined(HAVE_MMAP_ANON)
-		map = mmap (NULL,
-				sizeof (rspamd_mempool_stat_t),
-				PROT_READ | PROT_WRITE,
-				MAP_ANON | MAP_SHARED,
-				-1,
-				0);
-		if (map == MAP_FAILED) {
-			msg_err ("cannot allocate %z bytes, aborting",
-				sizeof (rspamd_mempool_stat_t));
-			abort ();
-		}
-		mem_pool_stat = (rspamd_mempool_stat_t *)map;
-#elif defined(HAVE_MMAP_ZERO)
-		gint fd;
-
-		fd = open ("/dev/zero", O_RDWR);
-		g_assert (fd != -1);
-		map = mmap (NULL,
-				sizeof (rspamd_mempool_stat_t),
-				PROT_READ | PROT_WRITE,
-				MAP_SHARED,
-				fd,
-				0);
-		if (map == MAP_FAILED) {
-			msg_err ("cannot allocate %z bytes, aborting",
-				sizeof (rspamd_mempool_stat_t));
-			abort ();
-		}
-		mem_pool_stat = (rspamd_mempool_stat_t *)map;
-#else
-#       error No mmap methods are defined
-#endif
-		memset (map, 0, sizeof (rspamd_mempool_stat_t));
+		mem_pool_stat = rspamd_mempool_shared_map (sizeof (rspamd_mempool_stat_t));
 	}
 
 	if (!env_checked) {
@@ -462,6 +650,46 @@ rspamd_mempool_notify_alloc_ (rspamd_mempool_t *pool, gsize size, const gchar *l
 	}
 }
 
+static void
+rspamd_mempool_profile_sample (gsize size, const gchar *loc)
+{
+	struct rspamd_mempool_profile_site *site;
+	guint64 h, cur;
+	guint i, idx;
+
+	h = rspamd_cryptobox_fast_hash (loc, strlen (loc), rspamd_hash_seed ());
+
+	if (h == 0) {
+		h = 1;
+	}
+
+	idx = h % MEMPOOL_PROFILE_SITES;
+
+	for (i = 0; i < MEMPOOL_PROFILE_MAX_PROBES; i ++) {
+		site = &profile_sites[(idx + i) % MEMPOOL_PROFILE_SITES];
+		cur = __atomic_load_n (&site->hash, __ATOMIC_ACQUIRE);
+
+		if (cur == 0) {
+			/* Claim an empty slot, another process might be faster */
+			if (__atomic_compare_exchange_n (&site->hash, &cur, h, FALSE,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				rspamd_strlcpy (site->loc, loc, sizeof (site->loc));
+				cur = h;
+			}
+		}
+
+		if (cur == h) {
+			__atomic_add_fetch (&site->bytes, (guint64)size * profile_rate,
+					__ATOMIC_RELAXED);
+			__atomic_add_fetch (&site->allocs, profile_rate, __ATOMIC_RELAXED);
+
+			return;
+		}
+	}
+
+	/* Too many collisions, ignore this site */
+}
+
 static void *
 memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 		enum rspamd_mempool_chain_type pool_type, const gchar *loc)
@@ -478,6 +706,12 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 			rspamd_mempool_notify_alloc_ (pool, size, loc);
 		}
 
+		if (G_UNLIKELY (profile_rate > 0) && loc != NULL &&
+				++profile_counter >= profile_rate) {
+			profile_counter = 0;
+			rspamd_mempool_profile_sample (size, loc);
+		}
+
 		if (always_malloc && pool_type != RSPAMD_MEMPOOL_SHARED) {
 			void *ptr;
 
@@ -506,17 +740,29 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 			}
 
 			/* Allocate new chain element */
+			gsize chain_size;
+
 			if (pool->priv->elt_len >= size + MIN_MEM_ALIGNMENT) {
 				pool->priv->entry->elts[pool->priv->entry->cur_elts].fragmentation += size;
-				new = rspamd_mempool_chain_new (pool->priv->elt_len,
-						pool_type);
+				chain_size = pool->priv->elt_len;
 			}
 			else {
 				mem_pool_stat->oversized_chunks++;
 				g_atomic_int_add (&mem_pool_stat->fragmented_size,
 						free);
 				pool->priv->entry->elts[pool->priv->entry->cur_elts].fragmentation += free;
-				new = rspamd_mempool_chain_new (size + pool->priv->elt_len, pool_type);
+				chain_size = size + pool->priv->elt_len;
+			}
+
+			new = NULL;
+
+			if ((pool->priv->flags & RSPAMD_MEMPOOL_RECYCLE) &&
+					pool_type == RSPAMD_MEMPOOL_NORMAL && recycled_chains) {
+				new = rspamd_mempool_chain_recycled (chain_size);
+			}
+
+			if (new == NULL) {
+				new = rspamd_mempool_chain_new (chain_size, pool_type);
 			}
 
 			/* Connect to pool subsystem */
@@ -558,7 +804,7 @@ rspamd_mempool_alloc0_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 void *
 rspamd_mempool_alloc0_shared_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 {
-	void *pointer = rspamd_mempool_alloc_shared (pool, size);
+	void *pointer = rspamd_mempool_alloc_shared_ (pool, size, loc);
 
 	memset (pointer, 0, size);
 	return pointer;
@@ -623,6 +869,93 @@ rspamd_mempool_ftokdup_ (rspamd_mempool_t *pool, const rspamd_ftok_t *src,
 	return newstr;
 }
 
+#define SLAB_ELT_ALIGNMENT 8
+#define SLAB_BLOCK_SIZE 4096
+#define SLAB_MAX_BLOCK_SIZE (64 * 1024)
+
+struct rspamd_mempool_slab_s {
+	rspamd_mempool_t *pool;
+	gpointer free_list;     /**< released objects, linked via their first word */
+	guint8 *cur;            /**< free space in the current block              */
+	guint8 *end;
+	gsize elt_size;
+	guint block_elts;       /**< objects in the next block                    */
+	const gchar *loc;
+};
+
+rspamd_mempool_slab_t *
+rspamd_mempool_slab_new_ (rspamd_mempool_t *pool, gsize elt_size,
+		guint elts_per_block, const gchar *loc)
+{
+	rspamd_mempool_slab_t *slab;
+
+	g_assert (elt_size > 0);
+
+	slab = rspamd_mempool_alloc0_ (pool, sizeof (*slab), loc);
+	slab->pool = pool;
+	slab->loc = loc;
+	/* Each released object holds a free list link */
+	elt_size = MAX (elt_size, sizeof (gpointer));
+	slab->elt_size = (elt_size + SLAB_ELT_ALIGNMENT - 1) &
+			~((gsize)SLAB_ELT_ALIGNMENT - 1);
+
+	if (elts_per_block == 0) {
+		elts_per_block = MAX (SLAB_BLOCK_SIZE / slab->elt_size, 1);
+	}
+
+	slab->block_elts = elts_per_block;
+
+	return slab;
+}
+
+void *
+rspamd_mempool_slab_alloc (rspamd_mempool_slab_t *slab)
+{
+	gpointer ret;
+
+	if (slab->free_list) {
+		ret = slab->free_list;
+		slab->free_list = *(gpointer *)ret;
+
+		return ret;
+	}
+
+	if (slab->cur == slab->end) {
+		gsize block_len = slab->elt_size * slab->block_elts;
+
+		slab->cur = rspamd_mempool_alloc_ (slab->pool, block_len, slab->loc);
+		slab->end = slab->cur + block_len;
+
+		if (block_len * 2 <= SLAB_MAX_BLOCK_SIZE) {
+			slab->block_elts *= 2;
+		}
+	}
+
+	ret = slab->cur;
+	slab->cur += slab->elt_size;
+
+	return ret;
+}
+
+void *
+rspamd_mempool_slab_alloc0 (rspamd_mempool_slab_t *slab)
+{
+	void *ret = rspamd_mempool_slab_alloc (slab);
+
+	memset (ret, 0, slab->elt_size);
+
+	return ret;
+}
+
+void
+rspamd_mempool_slab_free (rspamd_mempool_slab_t *slab, gpointer ptr)
+{
+	if (ptr) {
+		*(gpointer *)ptr = slab->free_list;
+		slab->free_list = ptr;
+	}
+}
+
 void
 rspamd_mempool_add_destructor_full (rspamd_mempool_t * pool,
 	rspamd_mempool_destruct_t func,
@@ -887,19 +1220,31 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 	for (i = 0; i < G_N_ELEMENTS (pool->priv->pools); i ++) {
 		if (pool->priv->pools[i]) {
 			LL_FOREACH_SAFE (pool->priv->pools[i], cur, tmp) {
-				g_atomic_int_add (&mem_pool_stat->bytes_allocated,
-						-((gint)cur->slice_size));
-				g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-
 				len = cur->slice_size + sizeof (struct _pool_chain);
 
 				if (i == RSPAMD_MEMPOOL_SHARED) {
+					g_atomic_int_add (&mem_pool_stat->bytes_allocated,
+							-((gint)cur->slice_size));
+					g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
 					munmap ((void *)cur, len);
 				}
 				else {
 					/* The last pool is special, it is a part of the initial chunk */
 					if (cur->next != NULL) {
-						free (cur); /* Not g_free as we use system allocator */
+						if ((pool->priv->flags & RSPAMD_MEMPOOL_RECYCLE) &&
+								recycled_nchains < recycled_max_chains) {
+							/* Keep it allocated (and faulted) for the next pools */
+							LL_PREPEND (recycled_chains, cur);
+							recycled_nchains ++;
+						}
+						else {
+							rspamd_mempool_chain_free (cur);
+						}
+					}
+					else {
+						g_atomic_int_add (&mem_pool_stat->bytes_allocated,
+								-((gint)cur->slice_size));
+						g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
 					}
 				}
 			}
@@ -933,6 +1278,67 @@ rspamd_mempool_stat_reset (void)
 	}
 }
 
+void
+rspamd_mempool_profile_init (guint sample_rate)
+{
+	if (sample_rate > 0 && profile_sites == NULL) {
+		profile_sites = rspamd_mempool_shared_map (
+				sizeof (*profile_sites) * MEMPOOL_PROFILE_SITES);
+	}
+
+	profile_rate = sample_rate;
+	profile_counter = 0;
+}
+
+static gint
+rspamd_mempool_site_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_mempool_site_stat *s1 = a, *s2 = b;
+
+	if (s1->bytes == s2->bytes) {
+		return 0;
+	}
+
+	return s1->bytes > s2->bytes ? -1 : 1;
+}
+
+guint
+rspamd_mempool_profile_top (struct rspamd_mempool_site_stat *out, guint n)
+{
+	struct rspamd_mempool_profile_site *site;
+	struct rspamd_mempool_site_stat st;
+	GArray *sites;
+	guint i, nsites;
+
+	if (profile_sites == NULL || n == 0) {
+		return 0;
+	}
+
+	sites = g_array_new (FALSE, FALSE, sizeof (st));
+
+	for (i = 0; i < MEMPOOL_PROFILE_SITES; i ++) {
+		site = &profile_sites[i];
+
+		/* Slot could be claimed but not filled yet */
+		if (__atomic_load_n (&site->hash, __ATOMIC_ACQUIRE) == 0 ||
+				site->loc[0] == '\0') {
+			continue;
+		}
+
+		rspamd_strlcpy (st.loc, site->loc, sizeof (st.loc));
+		st.bytes = __atomic_load_n (&site->bytes, __ATOMIC_RELAXED);
+		st.allocs = __atomic_load_n (&site->allocs, __ATOMIC_RELAXED);
+		g_array_append_val (sites, st);
+	}
+
+	g_array_sort (sites, rspamd_mempool_site_cmp);
+	nsites = MIN (n, sites->len);
+	memcpy (out, sites->data, nsites * sizeof (st));
+	g_array_free (sites, TRUE);
+
+	return nsites;
+}
+
 gsize
 rspamd_mempool_suggest_size_ (const char *loc)
 {
@@ -104,6 +104,8 @@ struct rspamd_mempool_tag {
 
 enum rspamd_mempool_flags {
 	RSPAMD_MEMPOOL_DEBUG = (1u << 0u),
+	/* Reuse chains released by other pools of this process, see below */
+	RSPAMD_MEMPOOL_RECYCLE = (1u << 1u),
 };
 
 /**
@@ -229,6 +231,41 @@ RSPAMD_ATTR_ALLOC_SIZE(2) RSPAMD_ATTR_ALLOC_ALIGN(MIN_MEM_ALIGNMENT) RSPAMD_ATTR
 #define rspamd_mempool_alloc0_shared(pool, size) \
 	rspamd_mempool_alloc0_shared_((pool), (size), G_STRLOC)
 
+/**
+ * Allocator of fixed size objects on top of a memory pool: objects are carved
+ * from blocks allocated in the pool and the released ones are reused by the
+ * next allocations, so loops that create and discard many small objects
+ * do not grow the pool; all memory is returned when the pool is deleted
+ */
+typedef struct rspamd_mempool_slab_s rspamd_mempool_slab_t;
+
+/**
+ * Create slab allocator for objects of `elt_size` bytes aligned to 8 bytes
+ * @param pool memory pool object
+ * @param elt_size size of an object
+ * @param elts_per_block objects in the first block (0 for ~4Kb blocks),
+ * the next blocks are twice larger up to 64Kb
+ */
+rspamd_mempool_slab_t *rspamd_mempool_slab_new_ (rspamd_mempool_t *pool,
+		gsize elt_size, guint elts_per_block, const gchar *loc);
+#define rspamd_mempool_slab_new(pool, type) \
+	rspamd_mempool_slab_new_((pool), sizeof (type), 0, G_STRLOC)
+#define rspamd_mempool_slab_new_sized(pool, size) \
+	rspamd_mempool_slab_new_((pool), (size), 0, G_STRLOC)
+
+/**
+ * Get an object from the slab
+ */
+void *rspamd_mempool_slab_alloc (rspamd_mempool_slab_t *slab)
+RSPAMD_ATTR_RETURNS_NONNUL;
+void *rspamd_mempool_slab_alloc0 (rspamd_mempool_slab_t *slab)
+RSPAMD_ATTR_RETURNS_NONNUL;
+
+/**
+ * Return an object to the slab, it will be reused by the next allocation
+ */
+void rspamd_mempool_slab_free (rspamd_mempool_slab_t *slab, gpointer ptr);
+
 /**
  * Add destructor callback to pool
  * @param pool memory pool object
@@ -329,6 +366,53 @@ void rspamd_mempool_stat (rspamd_mempool_stat_t *st);
  */
 void rspamd_mempool_stat_reset (void);
 
+/**
+ * Enables cache of chains released by pools created with RSPAMD_MEMPOOL_RECYCLE
+ * in the current process, so short living pools (e.g. tasks) do not call
+ * malloc/free and fault new pages for each allocation of a chain
+ * @param max_chains maximum number of cached chains, 0 disables cache
+ */
+void rspamd_mempool_recycle_init (guint max_chains);
+
+/**
+ * Frees cached chains that have not been used since the previous call,
+ * should be called periodically
+ */
+void rspamd_mempool_recycle_trim (void);
+
+/**
+ * Allocates normal chains of `min_chain_size` bytes or larger (e.g. chains of
+ * maps, re_cache or symcache pools) from huge pages, falling back to
+ * transparent huge pages if they are not reserved
+ * @param min_chain_size minimum chain size, 0 disables huge pages
+ */
+void rspamd_mempool_huge_pages_init (gsize min_chain_size);
+
+#define MEMPOOL_PROFILE_LOC_LEN 64
+
+/**
+ * Allocations accounted for a single allocation site
+ */
+struct rspamd_mempool_site_stat {
+	gchar loc[MEMPOOL_PROFILE_LOC_LEN];    /**< allocation site (file:line)					*/
+	guint64 bytes;                         /**< estimated bytes allocated						*/
+	guint64 allocs;                        /**< estimated number of allocations				*/
+};
+
+/**
+ * Enables sampling of allocations per allocation site. Counters are stored in
+ * shared memory, so this function should be called before forking workers to
+ * aggregate sites from all processes
+ * @param sample_rate account one of `sample_rate` allocations, 0 disables profiling
+ */
+void rspamd_mempool_profile_init (guint sample_rate);
+
+/**
+ * Fills `out` with up to `n` allocation sites sorted by bytes allocated
+ * @return number of sites written
+ */
+guint rspamd_mempool_profile_top (struct rspamd_mempool_site_stat *out, guint n);
+
 /**
  * Get optimal pool size based on page size for this system
  * @return size of memory page in system
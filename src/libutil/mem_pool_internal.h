@@ -85,6 +85,7 @@ struct _pool_chain {
 	guint8 *begin;                  /**< begin of pool chain block              */
 	guint8 *pos;                    /**< current start of free space in block   */
 	gsize slice_size;               /**< length of block                        */
+	gsize map_len;                  /**< length of private mapping, 0 if malloced */
 	struct _pool_chain *next;
 };
 
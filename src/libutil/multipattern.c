@@ -44,6 +44,7 @@ struct RSPAMD_ALIGNED(64) rspamd_multipattern {
 #ifdef WITH_HYPERSCAN
 	rspamd_cryptobox_hash_state_t hash_state;
 	hs_database_t *db;
+	gsize db_maplen;
 	hs_scratch_t *scratch[MAX_SCRATCH];
 	GArray *hs_pats;
 	GArray *hs_ids;
@@ -51,6 +52,7 @@ struct RSPAMD_ALIGNED(64) rspamd_multipattern {
 	guint scratch_used;
 #endif
 	ac_trie_t *t;
+	struct rspamd_multipattern_teddy *teddy;
 	GArray *pats;
 	GArray *res;
 
@@ -59,6 +61,10 @@ struct RSPAMD_ALIGNED(64) rspamd_multipattern {
 	enum rspamd_multipattern_flags flags;
 };
 
+struct rspamd_multipattern_teddy;
+static struct rspamd_multipattern_teddy *rspamd_multipattern_teddy_create (
+		GArray *pats, gboolean icase);
+
 static GQuark
 rspamd_multipattern_quark (void)
 {
@@ -92,6 +98,92 @@ rspamd_multipattern_library_init (const gchar *cache_dir)
 }
 
 #ifdef WITH_HYPERSCAN
+struct hs_database *
+rspamd_hyperscan_load_shared (const gchar *path,
+		gconstpointer blob, gsize len, gsize *maplen)
+{
+	gchar upath[PATH_MAX], tpath[PATH_MAX];
+	hs_database_t *db = NULL;
+	gsize db_size;
+	gpointer map;
+	struct stat st;
+	gint fd;
+
+	*maplen = 0;
+
+	if (hs_serialized_database_size (blob, len, &db_size) != HS_SUCCESS) {
+		return NULL;
+	}
+
+	/* Hash of the serialized data guarantees that we map the same database */
+	rspamd_snprintf (upath, sizeof (upath), "%s.%xL.unser", path,
+			rspamd_cryptobox_fast_hash (blob, len, 0xdeadbabe));
+
+	fd = open (upath, O_RDONLY);
+
+	if (fd == -1) {
+		/* Deserialize to a temporary file and move it in place atomically */
+		rspamd_snprintf (tpath, sizeof (tpath), "%s.%P.tmp", upath, getpid ());
+		fd = open (tpath, O_CREAT|O_EXCL|O_RDWR, 00644);
+
+		if (fd != -1) {
+			if (ftruncate (fd, db_size) == -1 ||
+					(map = mmap (NULL, db_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+							fd, 0)) == MAP_FAILED) {
+				close (fd);
+				unlink (tpath);
+				fd = -1;
+			}
+			else {
+				if (hs_deserialize_database_at (blob, len, map) != HS_SUCCESS ||
+						rename (tpath, upath) == -1) {
+					close (fd);
+					unlink (tpath);
+					fd = -1;
+				}
+
+				munmap (map, db_size);
+			}
+		}
+	}
+
+	if (fd != -1) {
+		if (fstat (fd, &st) != -1 && (gsize)st.st_size == db_size) {
+			/* Databases are position independent and are never modified */
+			map = mmap (NULL, db_size, PROT_READ, MAP_SHARED, fd, 0);
+
+			if (map != MAP_FAILED) {
+				db = map;
+				*maplen = db_size;
+			}
+		}
+
+		close (fd);
+	}
+
+	if (db == NULL) {
+		/* Fallback to the private copy */
+		if (hs_deserialize_database (blob, len, &db) != HS_SUCCESS) {
+			db = NULL;
+		}
+	}
+
+	return db;
+}
+
+void
+rspamd_hyperscan_free_shared (struct hs_database *db, gsize maplen)
+{
+	if (db) {
+		if (maplen > 0) {
+			munmap (db, maplen);
+		}
+		else {
+			hs_free_database (db);
+		}
+	}
+}
+
 static gchar *
 rspamd_multipattern_escape_tld_hyperscan (const gchar *pattern, gsize slen,
 		gsize *dst_len)
@@ -411,7 +503,9 @@ rspamd_multipattern_try_load_hs (struct rspamd_multipattern *mp,
 			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
 
 	if ((map = rspamd_file_xmap (fp, PROT_READ, &len, TRUE)) != NULL) {
-		if (hs_deserialize_database (map, len, &mp->db) == HS_SUCCESS) {
+		mp->db = rspamd_hyperscan_load_shared (fp, map, len, &mp->db_maplen);
+
+		if (mp->db != NULL) {
 			munmap (map, len);
 			return TRUE;
 		}
@@ -552,7 +646,13 @@ rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 			}
 		}
 		else {
-			mp->t = acism_create ((const ac_trie_pat_t *) mp->pats->data, mp->cnt);
+			/* Small sets of literals are faster with SIMD prefilter */
+			mp->teddy = rspamd_multipattern_teddy_create (mp->pats,
+					mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+
+			if (mp->teddy == NULL) {
+				mp->t = acism_create ((const ac_trie_pat_t *) mp->pats->data, mp->cnt);
+			}
 		}
 	}
 
@@ -598,6 +698,372 @@ rspamd_multipattern_hs_cb (unsigned int id,
 }
 #endif
 
+/*
+ * Teddy: SIMD prefilter for small sets of literals. Up to three first bytes
+ * of each pattern (fingerprint) are matched by nibble lookups done with
+ * byte shuffles, candidates are then verified against patterns in the
+ * buckets reported for that position
+ */
+#define RSPAMD_TEDDY_MAX_PATTERNS 64
+#define RSPAMD_TEDDY_BUCKETS 8
+#define RSPAMD_TEDDY_FP 3
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RSPAMD_TEDDY_SSSE3 1
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#define RSPAMD_TEDDY_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct rspamd_multipattern_teddy {
+	guint8 lo[RSPAMD_TEDDY_FP][16];
+	guint8 hi[RSPAMD_TEDDY_FP][16];
+	guint nfp;
+	guint minlen;
+	gboolean icase;
+	gboolean simd;
+	GArray *buckets[RSPAMD_TEDDY_BUCKETS];
+	/* Used merely when building */
+	GArray *sort_pats;
+};
+
+struct rspamd_teddy_match {
+	gint strnum;
+	gsize start;
+	gsize end;
+};
+
+static gint
+rspamd_multipattern_acism_cb (int strnum, int textpos, void *context);
+
+static gint
+rspamd_teddy_sort_func (gconstpointer a, gconstpointer b, gpointer ud)
+{
+	const struct rspamd_multipattern_teddy *td = ud;
+	const ac_trie_pat_t *p1 = &g_array_index (td->sort_pats,
+			ac_trie_pat_t, *(const gint *)a),
+			*p2 = &g_array_index (td->sort_pats,
+			ac_trie_pat_t, *(const gint *)b);
+
+	return td->icase ? g_ascii_strncasecmp (p1->ptr, p2->ptr, td->nfp) :
+			memcmp (p1->ptr, p2->ptr, td->nfp);
+}
+
+static struct rspamd_multipattern_teddy *
+rspamd_multipattern_teddy_create (GArray *pats, gboolean icase)
+{
+	struct rspamd_multipattern_teddy *td;
+	const ac_trie_pat_t *pat;
+	gint *order;
+	guint i, k, b, npats = pats->len;
+
+	if (npats == 0 || npats > RSPAMD_TEDDY_MAX_PATTERNS) {
+		return NULL;
+	}
+
+	td = g_malloc0 (sizeof (*td));
+	td->icase = icase;
+	td->minlen = G_MAXUINT;
+
+	for (i = 0; i < npats; i ++) {
+		pat = &g_array_index (pats, ac_trie_pat_t, i);
+
+		if (pat->len == 0) {
+			g_free (td);
+			return NULL;
+		}
+
+		td->minlen = MIN (td->minlen, pat->len);
+	}
+
+	td->nfp = MIN (td->minlen, RSPAMD_TEDDY_FP);
+	/* Patterns with similar prefixes share buckets to reduce false hits */
+	order = g_malloc (sizeof (*order) * npats);
+
+	for (i = 0; i < npats; i ++) {
+		order[i] = i;
+	}
+
+	td->sort_pats = pats;
+	g_qsort_with_data (order, npats, sizeof (*order), rspamd_teddy_sort_func, td);
+	td->sort_pats = NULL;
+
+	for (b = 0; b < RSPAMD_TEDDY_BUCKETS; b ++) {
+		td->buckets[b] = g_array_new (FALSE, FALSE, sizeof (gint));
+	}
+
+	for (i = 0; i < npats; i ++) {
+		b = i * RSPAMD_TEDDY_BUCKETS / npats;
+		pat = &g_array_index (pats, ac_trie_pat_t, order[i]);
+		g_array_append_val (td->buckets[b], order[i]);
+
+		for (k = 0; k < td->nfp; k ++) {
+			guchar c = pat->ptr[k];
+
+			td->lo[k][c & 0xf] |= 1u << b;
+			td->hi[k][c >> 4] |= 1u << b;
+
+			if (icase && g_ascii_isalpha (c)) {
+				c = g_ascii_isupper (c) ? g_ascii_tolower (c) : g_ascii_toupper (c);
+				td->lo[k][c & 0xf] |= 1u << b;
+				td->hi[k][c >> 4] |= 1u << b;
+			}
+		}
+	}
+
+	g_free (order);
+
+#if defined(RSPAMD_TEDDY_SSSE3)
+	td->simd = __builtin_cpu_supports ("ssse3");
+#elif defined(RSPAMD_TEDDY_NEON)
+	td->simd = TRUE;
+#endif
+
+	return td;
+}
+
+static void
+rspamd_multipattern_teddy_destroy (struct rspamd_multipattern_teddy *td)
+{
+	guint b;
+
+	for (b = 0; b < RSPAMD_TEDDY_BUCKETS; b ++) {
+		g_array_free (td->buckets[b], TRUE);
+	}
+
+	g_free (td);
+}
+
+#if defined(RSPAMD_TEDDY_SSSE3)
+/*
+ * Fills buckets masks for 16 positions starting at `p`,
+ * returns bitmask of positions with non empty masks
+ */
+__attribute__((target("ssse3")))
+static guint
+rspamd_teddy_block (const struct rspamd_multipattern_teddy *td,
+		const guchar *p, guint8 *out)
+{
+	const __m128i nibble = _mm_set1_epi8 (0xf);
+	__m128i res = _mm_set1_epi8 ((gchar)0xff);
+	guint k;
+
+	for (k = 0; k < td->nfp; k ++) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(p + k));
+		__m128i lo = _mm_and_si128 (v, nibble);
+		__m128i hi = _mm_and_si128 (_mm_srli_epi16 (v, 4), nibble);
+
+		res = _mm_and_si128 (res, _mm_and_si128 (
+				_mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)td->lo[k]), lo),
+				_mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)td->hi[k]), hi)));
+	}
+
+	_mm_storeu_si128 ((__m128i *)out, res);
+
+	return ~_mm_movemask_epi8 (_mm_cmpeq_epi8 (res, _mm_setzero_si128 ())) & 0xffff;
+}
+#elif defined(RSPAMD_TEDDY_NEON)
+static guint
+rspamd_teddy_block (const struct rspamd_multipattern_teddy *td,
+		const guchar *p, guint8 *out)
+{
+	const uint8x16_t nibble = vdupq_n_u8 (0xf);
+	uint8x16_t res = vdupq_n_u8 (0xff);
+	guint k, i, bits = 0;
+
+	for (k = 0; k < td->nfp; k ++) {
+		uint8x16_t v = vld1q_u8 (p + k);
+
+		res = vandq_u8 (res, vandq_u8 (
+				vqtbl1q_u8 (vld1q_u8 (td->lo[k]), vandq_u8 (v, nibble)),
+				vqtbl1q_u8 (vld1q_u8 (td->hi[k]), vshrq_n_u8 (v, 4))));
+	}
+
+	vst1q_u8 (out, res);
+
+	for (i = 0; i < 16; i ++) {
+		if (out[i]) {
+			bits |= 1u << i;
+		}
+	}
+
+	return bits;
+}
+#endif
+
+static inline guint8
+rspamd_teddy_position (const struct rspamd_multipattern_teddy *td,
+		const guchar *p)
+{
+	guint8 res = 0xff;
+	guint k;
+
+	for (k = 0; k < td->nfp; k ++) {
+		res &= td->lo[k][p[k] & 0xf] & td->hi[k][p[k] >> 4];
+	}
+
+	return res;
+}
+
+/*
+ * Reports pending matches that end before `limit` ordered like acism:
+ * by the end offset, the longest match goes first
+ */
+static gint
+rspamd_teddy_flush (GArray *pending, gsize limit,
+		struct rspamd_multipattern_cbdata *cbd)
+{
+	struct rspamd_teddy_match *m;
+	guint i, n = 0;
+	gint ret = 0;
+
+	for (i = 0; i < pending->len; i ++) {
+		m = &g_array_index (pending, struct rspamd_teddy_match, i);
+
+		if (m->end > limit) {
+			break;
+		}
+
+		n ++;
+
+		if ((ret = rspamd_multipattern_acism_cb (m->strnum, m->end, cbd)) != 0) {
+			break;
+		}
+	}
+
+	g_array_remove_range (pending, 0, n);
+
+	return ret;
+}
+
+static gint
+rspamd_teddy_verify (const struct rspamd_multipattern_teddy *td,
+		GArray *pats, const guchar *in, gsize len, gsize pos, guint8 bmask,
+		GArray **pending, struct rspamd_multipattern_cbdata *cbd)
+{
+	struct rspamd_teddy_match m, *cur;
+	const ac_trie_pat_t *pat;
+	guint b, i, j;
+	gint id, ret;
+
+	if (*pending && (*pending)->len > 0) {
+		/* Matches starting from `pos` cannot end earlier */
+		if ((ret = rspamd_teddy_flush (*pending, pos + td->minlen, cbd)) != 0) {
+			return ret;
+		}
+	}
+
+	for (b = 0; b < RSPAMD_TEDDY_BUCKETS; b ++) {
+		if (!(bmask & (1u << b))) {
+			continue;
+		}
+
+		for (i = 0; i < td->buckets[b]->len; i ++) {
+			id = g_array_index (td->buckets[b], gint, i);
+			pat = &g_array_index (pats, ac_trie_pat_t, id);
+
+			if (pos + pat->len > len) {
+				continue;
+			}
+
+			if (td->icase ?
+					g_ascii_strncasecmp ((const gchar *)in + pos, pat->ptr, pat->len) != 0 :
+					memcmp (in + pos, pat->ptr, pat->len) != 0) {
+				continue;
+			}
+
+			m.strnum = id;
+			m.start = pos;
+			m.end = pos + pat->len;
+
+			if (*pending == NULL) {
+				*pending = g_array_new (FALSE, FALSE, sizeof (m));
+			}
+
+			/* Pending matches are sorted by end, earlier start first */
+			for (j = 0; j < (*pending)->len; j ++) {
+				cur = &g_array_index (*pending, struct rspamd_teddy_match, j);
+
+				if (cur->end > m.end || (cur->end == m.end && cur->start > m.start)) {
+					break;
+				}
+			}
+
+			g_array_insert_val (*pending, j, m);
+		}
+	}
+
+	return 0;
+}
+
+static gint
+rspamd_multipattern_teddy_lookup (struct rspamd_multipattern *mp,
+		const guchar *in, gsize len,
+		struct rspamd_multipattern_cbdata *cbd)
+{
+	const struct rspamd_multipattern_teddy *td = mp->teddy;
+	GArray *pending = NULL;
+	gsize pos = 0, last;
+	guint8 bmask;
+	gint ret = 0;
+
+	if (len < td->minlen) {
+		return 0;
+	}
+
+	/* Last position where the shortest pattern can start */
+	last = len - td->minlen;
+
+#if defined(RSPAMD_TEDDY_SSSE3) || defined(RSPAMD_TEDDY_NEON)
+	if (td->simd) {
+		guint8 out[16];
+		guint bits, j;
+
+		/* Loads must not cross the end of the input */
+		while (pos + 16 + td->nfp - 1 <= len) {
+			bits = rspamd_teddy_block (td, in + pos, out);
+
+			while (bits) {
+				j = __builtin_ctz (bits);
+				bits &= bits - 1;
+
+				if (pos + j > last) {
+					break;
+				}
+
+				if ((ret = rspamd_teddy_verify (td, mp->pats, in, len, pos + j,
+						out[j], &pending, cbd)) != 0) {
+					goto out;
+				}
+			}
+
+			pos += 16;
+		}
+	}
+#endif
+
+	for (; pos <= last; pos ++) {
+		bmask = rspamd_teddy_position (td, in + pos);
+
+		if (bmask && (ret = rspamd_teddy_verify (td, mp->pats, in, len, pos,
+				bmask, &pending, cbd)) != 0) {
+			goto out;
+		}
+	}
+
+	if (pending) {
+		ret = rspamd_teddy_flush (pending, len, cbd);
+	}
+
+out:
+	if (pending) {
+		g_array_free (pending, TRUE);
+	}
+
+	return ret;
+}
+
 static gint
 rspamd_multipattern_acism_cb (int strnum, int textpos, void *context)
 {
@@ -699,6 +1165,13 @@ out:
 			*pnfound = cbd.nfound;
 		}
 	}
+	else if (mp->teddy) {
+		ret = rspamd_multipattern_teddy_lookup (mp, (const guchar *)in, len, &cbd);
+
+		if (pnfound) {
+			*pnfound = cbd.nfound;
+		}
+	}
 	else {
 		/* Plain trie */
 		ret = acism_lookup (mp->t, in, len, rspamd_multipattern_acism_cb, &cbd,
@@ -728,7 +1201,7 @@ rspamd_multipattern_destroy (struct rspamd_multipattern *mp)
 					hs_free_scratch (mp->scratch[i]);
 				}
 
-				hs_free_database (mp->db);
+				rspamd_hyperscan_free_shared (mp->db, mp->db_maplen);
 			}
 
 			for (i = 0; i < mp->cnt; i ++) {
@@ -746,7 +1219,10 @@ rspamd_multipattern_destroy (struct rspamd_multipattern *mp)
 #endif
 		ac_trie_pat_t pat;
 
-		if (mp->compiled && mp->cnt > 0) {
+		if (mp->teddy) {
+			rspamd_multipattern_teddy_destroy (mp->teddy);
+		}
+		else if (mp->compiled && mp->cnt > 0 && mp->t) {
 			acism_destroy (mp->t);
 		}
 
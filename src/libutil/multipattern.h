@@ -70,6 +70,30 @@ typedef gint (*rspamd_multipattern_cb_t) (struct rspamd_multipattern *mp,
  */
 void rspamd_multipattern_library_init (const gchar *cache_dir);
 
+#ifdef WITH_HYPERSCAN
+struct hs_database;
+/**
+ * Deserializes hyperscan database from `blob` to the file `<path>.<hash>.unser`
+ * (once for all processes) and maps it read-only, so all processes share
+ * the same pages of the database. If it is not possible, the database is
+ * deserialized to the private memory and `maplen` is set to 0
+ * @param path path of the serialized database
+ * @param blob serialized database
+ * @param len length of the serialized database
+ * @param maplen output length of the mapping
+ * @return database or NULL if blob is not a valid database
+ */
+struct hs_database *rspamd_hyperscan_load_shared (const gchar *path,
+		gconstpointer blob, gsize len, gsize *maplen);
+
+/**
+ * Frees database returned by `rspamd_hyperscan_load_shared`
+ * @param db
+ * @param maplen
+ */
+void rspamd_hyperscan_free_shared (struct hs_database *db, gsize maplen);
+#endif
+
 /**
  * Creates empty multipattern structure
  * @param flags
@@ -0,0 +1,48 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_PROBES_H
+#define RSPAMD_PROBES_H
+
+#include "config.h"
+
+/**
+ * Static tracepoints (USDT) of the `rspamd` provider, a probe is a single nop
+ * instruction unless some tracer (e.g. bpftrace or perf) is attached to it:
+ *
+ * - task__start(task, uid), task__finish(task, uid)
+ * - stage__start(task, stage, name), stage__finish(task, stage, name)
+ * - symbol__start(task, symbol), symbol__finish(task, symbol)
+ * - dns__start(id, name, type), dns__finish(id, name, rcode)
+ * - redis__start(id, command), redis__finish(id, error)
+ * - http__start(id, url), http__finish(id, url)
+ * - map__reload__start(name), map__reload__finish(name)
+ * - gc__start(kind), gc__finish(kind), where kind is "step" or "full"
+ *
+ * Pairs of probes share the first argument, so latencies could be built,
+ * e.g. `bpftrace -e 'usdt:rspamd:symbol__start { ... }'`
+ */
+
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+
+#define RSPAMD_PROBE1(name, a) DTRACE_PROBE1(rspamd, name, a)
+#define RSPAMD_PROBE2(name, a, b) DTRACE_PROBE2(rspamd, name, a, b)
+#define RSPAMD_PROBE3(name, a, b, c) DTRACE_PROBE3(rspamd, name, a, b, c)
+#else
+#define RSPAMD_PROBE1(name, a) do {} while (0)
+#define RSPAMD_PROBE2(name, a, b) do {} while (0)
+#define RSPAMD_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -38,6 +38,26 @@
 
 INIT_LOG_MODULE(radix)
 
+/* Minimum number of IPv4 prefixes to build DIR-24-8 table */
+#define RADIX_DIR24_MIN_PREFIXES 65536
+#define RADIX_DIR24_TBL8_FLAG (1u << 31u)
+
+/*
+ * DIR-24-8 table for IPv4 (mapped) prefixes: the first 24 bits of an address
+ * index `tbl24`, whose entry is either an index of a value or (with the flag)
+ * a group of 256 `tbl8` entries indexed by the last 8 bits. So any lookup
+ * takes at most two memory accesses.
+ */
+struct radix_dir24 {
+	guint32 *tbl24;
+	guint32 *tbl8;
+	guint ntbl8;
+	guint tbl8_allocated;
+	uintptr_t *values; /* Index 0 means no value */
+	guint nvalues;
+	guint values_allocated;
+};
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	struct btrie *tree;
@@ -45,8 +65,46 @@ struct radix_tree_compressed {
 	size_t size;
 	guint duplicates;
 	gboolean own_pool;
+	gboolean dir24_dtor;
+	struct radix_dir24 *dir24;
 };
 
+static const guint8 radix_v4_mapped_prefix[12] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+static inline uintptr_t
+radix_dir24_lookup (const struct radix_dir24 *dir, guint32 addr)
+{
+	guint32 e = dir->tbl24[addr >> 8u];
+
+	if (e & RADIX_DIR24_TBL8_FLAG) {
+		e = dir->tbl8[((e & ~RADIX_DIR24_TBL8_FLAG) << 8u) | (addr & 0xffu)];
+	}
+
+	return e ? dir->values[e] : RADIX_NO_VALUE;
+}
+
+static void
+radix_dir24_free (struct radix_dir24 *dir)
+{
+	if (dir) {
+		g_free (dir->tbl24);
+		g_free (dir->tbl8);
+		g_free (dir->values);
+		g_free (dir);
+	}
+}
+
+static void
+radix_dir24_dtor (gpointer p)
+{
+	radix_compressed_t *tree = (radix_compressed_t *)p;
+
+	radix_dir24_free (tree->dir24);
+	tree->dir24 = NULL;
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keylen)
 {
@@ -54,6 +112,16 @@ radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keyle
 
 	g_assert (tree != NULL);
 
+	if (tree->dir24 && keylen == 16 &&
+			memcmp (key, radix_v4_mapped_prefix,
+					sizeof (radix_v4_mapped_prefix)) == 0) {
+		guint32 addr;
+
+		memcpy (&addr, key + 12, sizeof (addr));
+
+		return radix_dir24_lookup (tree->dir24, ntohl (addr));
+	}
+
 	ret = btrie_lookup (tree->tree, key, keylen * NBBY);
 
 	if (ret == NULL) {
@@ -84,6 +152,12 @@ radix_insert_compressed (radix_compressed_t * tree,
 
 	old = radix_find_compressed (tree, key, keylen);
 
+	if (tree->dir24) {
+		/* Tables are not updated incrementally */
+		radix_dir24_free (tree->dir24);
+		tree->dir24 = NULL;
+	}
+
 	ret = btrie_add_prefix (tree->tree, key, keybits - masklen,
 			(gconstpointer)value);
 
@@ -142,6 +216,8 @@ radix_create_compressed (const gchar *tree_name)
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = TRUE;
 	tree->name = tree_name;
+	tree->dir24_dtor = FALSE;
+	tree->dir24 = NULL;
 
 	return tree;
 }
@@ -158,6 +234,8 @@ radix_create_compressed_with_pool (rspamd_mempool_t *pool, const gchar *tree_nam
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = FALSE;
 	tree->name = tree_name;
+	tree->dir24_dtor = FALSE;
+	tree->dir24 = NULL;
 
 	return tree;
 }
@@ -188,7 +266,14 @@ radix_find_compressed_addr (radix_compressed_t *tree,
 	key = rspamd_inet_address_get_hash_key (addr, &klen);
 
 	if (key && klen) {
-		if (klen == 4) {
+		if (klen == 4 && tree->dir24) {
+			guint32 addr4;
+
+			memcpy (&addr4, key, sizeof (addr4));
+
+			return radix_dir24_lookup (tree->dir24, ntohl (addr4));
+		}
+		else if (klen == 4) {
 			/* Map to ipv6 */
 			memset (buf, 0, 10);
 			buf[10] = 0xffu;
@@ -423,6 +508,185 @@ radix_get_pool (radix_compressed_t *tree)
 	return NULL;
 }
 
+struct radix_dir24_cbdata {
+	struct radix_dir24 *dir;
+	guint nprefixes;
+	gboolean failed;
+};
+
+static guint32
+radix_dir24_add_value (struct radix_dir24 *dir, uintptr_t value)
+{
+	if (dir->nvalues == dir->values_allocated) {
+		dir->values_allocated *= 2;
+		dir->values = g_realloc (dir->values,
+				dir->values_allocated * sizeof (*dir->values));
+	}
+
+	dir->values[dir->nvalues] = value;
+
+	return dir->nvalues ++;
+}
+
+static guint32
+radix_dir24_add_tbl8 (struct radix_dir24 *dir, guint32 fill)
+{
+	guint32 i, *group;
+
+	if (dir->ntbl8 == dir->tbl8_allocated) {
+		dir->tbl8_allocated = dir->tbl8_allocated ? dir->tbl8_allocated * 2 : 256;
+		dir->tbl8 = g_realloc (dir->tbl8,
+				(gsize)dir->tbl8_allocated * 256 * sizeof (*dir->tbl8));
+	}
+
+	group = &dir->tbl8[(gsize)dir->ntbl8 * 256];
+
+	for (i = 0; i < 256; i ++) {
+		group[i] = fill;
+	}
+
+	return dir->ntbl8 ++;
+}
+
+/*
+ * Walk is performed in preorder, so a prefix is always filled before
+ * more specific prefixes that override it
+ */
+static void
+radix_dir24_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_dir24_cbdata *cbd = (struct radix_dir24_cbdata *)user_data;
+	struct radix_dir24 *dir = cbd->dir;
+	guint32 addr = 0, i, start, n, vidx, e, group;
+	guint v4len;
+
+	if (post || cbd->failed) {
+		return;
+	}
+
+	if (len < sizeof (radix_v4_mapped_prefix) * NBBY) {
+		/* Check if this prefix covers all IPv4 mapped space */
+		guint nbytes = len / NBBY, nbits = len % NBBY;
+
+		if (memcmp (prefix, radix_v4_mapped_prefix, nbytes) != 0) {
+			return;
+		}
+
+		if (nbits && ((prefix[nbytes] ^ radix_v4_mapped_prefix[nbytes]) &
+				(0xffu << (NBBY - nbits)) & 0xffu) != 0) {
+			return;
+		}
+
+		v4len = 0;
+	}
+	else {
+		if (memcmp (prefix, radix_v4_mapped_prefix,
+				sizeof (radix_v4_mapped_prefix)) != 0) {
+			return;
+		}
+
+		v4len = len - sizeof (radix_v4_mapped_prefix) * NBBY;
+		/* Walk buffer is always large enough for the full address */
+		memcpy (&addr, prefix + sizeof (radix_v4_mapped_prefix), sizeof (addr));
+		addr = ntohl (addr);
+	}
+
+	cbd->nprefixes ++;
+
+	if (dir == NULL) {
+		/* Counting only */
+		return;
+	}
+
+	if (dir->nvalues >= RADIX_DIR24_TBL8_FLAG ||
+			dir->ntbl8 >= RADIX_DIR24_TBL8_FLAG >> 8u) {
+		cbd->failed = TRUE;
+		return;
+	}
+
+	vidx = radix_dir24_add_value (dir, (uintptr_t)data);
+
+	if (v4len <= 24) {
+		start = v4len ? (addr >> 8u) & (G_MAXUINT32 << (24 - v4len)) : 0;
+		n = 1u << (24 - v4len);
+
+		for (i = 0; i < n; i ++) {
+			dir->tbl24[start + i] = vidx;
+		}
+	}
+	else {
+		e = dir->tbl24[addr >> 8u];
+
+		if (e & RADIX_DIR24_TBL8_FLAG) {
+			group = e & ~RADIX_DIR24_TBL8_FLAG;
+		}
+		else {
+			/* Inherit value of less specific prefix */
+			group = radix_dir24_add_tbl8 (dir, e);
+			dir->tbl24[addr >> 8u] = group | RADIX_DIR24_TBL8_FLAG;
+		}
+
+		start = addr & (G_MAXUINT32 << (32 - v4len)) & 0xffu;
+		n = 1u << (32 - v4len);
+
+		for (i = 0; i < n; i ++) {
+			dir->tbl8[(gsize)group * 256 + start + i] = vidx;
+		}
+	}
+}
+
+gboolean
+radix_compile_compressed (radix_compressed_t *tree)
+{
+	struct radix_dir24_cbdata cbd;
+	struct radix_dir24 *dir;
+
+	g_assert (tree != NULL);
+
+	if (tree->dir24) {
+		return TRUE;
+	}
+
+	memset (&cbd, 0, sizeof (cbd));
+	btrie_walk (tree->tree, radix_dir24_walk_cb, &cbd);
+
+	if (cbd.nprefixes < RADIX_DIR24_MIN_PREFIXES) {
+		return FALSE;
+	}
+
+	dir = g_malloc0 (sizeof (*dir));
+	dir->tbl24 = g_malloc0 ((1u << 24u) * sizeof (*dir->tbl24));
+	dir->values_allocated = cbd.nprefixes + 1;
+	dir->values = g_malloc (dir->values_allocated * sizeof (*dir->values));
+	/* Reserve zero index for no value */
+	dir->values[0] = RADIX_NO_VALUE;
+	dir->nvalues = 1;
+
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.dir = dir;
+	btrie_walk (tree->tree, radix_dir24_walk_cb, &cbd);
+
+	if (cbd.failed) {
+		msg_warn_radix ("%s: cannot build DIR-24-8 table: too many prefixes",
+				tree->name);
+		radix_dir24_free (dir);
+
+		return FALSE;
+	}
+
+	if (!tree->dir24_dtor) {
+		rspamd_mempool_add_destructor (tree->pool, radix_dir24_dtor, tree);
+		tree->dir24_dtor = TRUE;
+	}
+
+	tree->dir24 = dir;
+	msg_info_radix ("%s: built DIR-24-8 table for %ud IPv4 prefixes "
+			"(%ud tbl8 groups)", tree->name, cbd.nprefixes, dir->ntbl8);
+
+	return TRUE;
+}
+
 const gchar *
 radix_get_info (radix_compressed_t *tree)
 {
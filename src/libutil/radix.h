@@ -62,6 +62,14 @@ uintptr_t radix_find_compressed (radix_compressed_t *tree, const guint8 *key,
 uintptr_t radix_find_compressed_addr (radix_compressed_t *tree,
 									  const rspamd_inet_addr_t *addr);
 
+/**
+ * Builds specialized lookup tables for a large trie (DIR-24-8 table for IPv4
+ * prefixes), further insertions drop these tables
+ * @param tree
+ * @return TRUE if tables have been built
+ */
+gboolean radix_compile_compressed (radix_compressed_t *tree);
+
 /**
  * Destroy the complete radix trie
  * @param tree
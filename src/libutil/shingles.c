@@ -19,9 +19,17 @@
 #include "images.h"
 #include "libstat/stat_api.h"
 
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(__x86_64__) && \
+	(defined(__clang__) || (__GNUC__ >= 6))
+#define RSPAMD_SHINGLES_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+
 #define SHINGLES_WINDOW 3
 #define SHINGLES_KEY_SIZE rspamd_cryptobox_SIPKEYBYTES
 
+extern unsigned cpu_config;
+
 static guint
 rspamd_shingles_keys_hash (gconstpointer k)
 {
@@ -111,6 +119,66 @@ rspamd_shingles_get_keys_cached (const guchar key[SHINGLES_KEY_SIZE])
 	return keys;
 }
 
+/*
+ * Lanes algorithm hashes each word just once and then derives all shingle
+ * lanes from that hash by mixing it with a per-lane key using murmur3
+ * finalizer, so lanes are independent and could be computed in parallel
+ */
+#define SHINGLES_FMIX_C1 0xff51afd7ed558ccdULL
+#define SHINGLES_FMIX_C2 0xc4ceb9fe1a85ec53ULL
+
+static void
+rspamd_shingles_lanes_ref (guint64 h, const guint64 *lkeys, guint64 *out)
+{
+	guint64 x;
+	guint j;
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		x = h ^ lkeys[j];
+		x ^= x >> 33;
+		x *= SHINGLES_FMIX_C1;
+		x ^= x >> 33;
+		x *= SHINGLES_FMIX_C2;
+		x ^= x >> 33;
+		out[j] = x;
+	}
+}
+
+#ifdef RSPAMD_SHINGLES_HAS_AVX2
+static inline __m256i __attribute__((__target__("avx2")))
+rspamd_shingles_mul64_avx2 (__m256i a, __m256i b)
+{
+	/* AVX2 has no 64 bit multiply, so compose it from 32 bit parts */
+	__m256i lo = _mm256_mul_epu32 (a, b);
+	__m256i c1 = _mm256_mul_epu32 (_mm256_srli_epi64 (a, 32), b);
+	__m256i c2 = _mm256_mul_epu32 (a, _mm256_srli_epi64 (b, 32));
+
+	return _mm256_add_epi64 (lo,
+			_mm256_slli_epi64 (_mm256_add_epi64 (c1, c2), 32));
+}
+
+static void __attribute__((__target__("avx2")))
+rspamd_shingles_lanes_avx2 (guint64 h, const guint64 *lkeys, guint64 *out)
+{
+	const __m256i hv = _mm256_set1_epi64x (h),
+			c1 = _mm256_set1_epi64x (SHINGLES_FMIX_C1),
+			c2 = _mm256_set1_epi64x (SHINGLES_FMIX_C2);
+	__m256i x;
+	guint j;
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j += 4) {
+		x = _mm256_xor_si256 (hv,
+				_mm256_loadu_si256 ((const __m256i *)&lkeys[j]));
+		x = _mm256_xor_si256 (x, _mm256_srli_epi64 (x, 33));
+		x = rspamd_shingles_mul64_avx2 (x, c1);
+		x = _mm256_xor_si256 (x, _mm256_srli_epi64 (x, 33));
+		x = rspamd_shingles_mul64_avx2 (x, c2);
+		x = _mm256_xor_si256 (x, _mm256_srli_epi64 (x, 33));
+		_mm256_storeu_si256 ((__m256i *)&out[j], x);
+	}
+}
+#endif
+
 struct rspamd_shingle* RSPAMD_OPTIMIZE("unroll-loops")
 rspamd_shingles_from_text (GArray *input,
 		const guchar key[16],
@@ -212,6 +280,83 @@ rspamd_shingles_from_text (GArray *input,
 			}
 		}
 	}
+	else if (alg == RSPAMD_SHINGLES_LANES) {
+		guint64 lanes[SHINGLES_WINDOW][RSPAMD_SHINGLE_SIZE],
+				lkeys[RSPAMD_SHINGLE_SIZE], seed, h;
+		void (*lanes_func) (guint64, const guint64 *, guint64 *) =
+				rspamd_shingles_lanes_ref;
+
+#ifdef RSPAMD_SHINGLES_HAS_AVX2
+		if (cpu_config & CPUID_AVX2) {
+			lanes_func = rspamd_shingles_lanes_avx2;
+		}
+#endif
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			memcpy (&lkeys[j], keys[j], sizeof (lkeys[j]));
+		}
+
+		memcpy (&seed, keys[0] + sizeof (guint64), sizeof (seed));
+		memset (lanes, 0, sizeof (lanes));
+
+		for (i = 0; i <= ilen; i ++) {
+			if (i - beg >= SHINGLES_WINDOW || i == ilen) {
+				/* Shift lanes window to right */
+				memmove (lanes[0], lanes[1],
+						sizeof (lanes[0]) * (SHINGLES_WINDOW - 1));
+
+				word = NULL;
+
+				while (widx < input->len) {
+					word = &g_array_index (input, rspamd_stat_token_t, widx);
+
+					if ((word->flags & RSPAMD_STAT_TOKEN_FLAG_SKIPPED)
+						|| word->stemmed.len == 0) {
+						widx++;
+					}
+					else {
+						break;
+					}
+				}
+
+				if (word == NULL) {
+					/* Nothing but exceptions */
+					for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+						g_free (hashes[i]);
+					}
+
+					if (pool == NULL) {
+						g_free (res);
+					}
+
+					g_free (hashes);
+					rspamd_fstring_free (row);
+
+					return NULL;
+				}
+
+				/* Insert the last element to the pipe */
+				h = rspamd_cryptobox_fast_hash_specific (
+						RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+						word->stemmed.begin, word->stemmed.len,
+						seed);
+				lanes_func (h, lkeys, lanes[SHINGLES_WINDOW - 1]);
+				g_assert (hlen > beg);
+
+				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+					val = 0;
+					for (k = 0; k < SHINGLES_WINDOW; k ++) {
+						val ^= lanes[k][j] >> (8 * (SHINGLES_WINDOW - k - 1));
+					}
+
+					hashes[j][beg] = val;
+				}
+
+				beg ++;
+				widx ++;
+			}
+		}
+	}
 	else {
 		guint64 window[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE], seed;
 
@@ -0,0 +1,427 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "shm_cache.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+#include <sched.h>
+
+/*
+ * Cache is a set associative table of fixed size slots. Readers never block:
+ * slots are protected by sequence counters as in the shared DNS cache, and
+ * a reader skips a slot which counter is odd or has changed while the slot
+ * was copied. Writers of a set are serialised by a spin lock of that set,
+ * the lock is held only to copy a slot, so it is never held for long.
+ * The lock word stores pid of its holder, so a lock left by a process that
+ * has died while writing is taken over by the next writer.
+ * Each set has its own CLOCK hand, readers set the reference bit of slots.
+ */
+#define RSPAMD_SHM_CACHE_WAYS 8
+#define RSPAMD_SHM_CACHE_SPINS 65536
+#define RSPAMD_SHM_CACHE_SEED 0xa8ab3e1c5ee1d72full
+/* Used as expire time of elements without TTL */
+#define RSPAMD_SHM_CACHE_NEVER G_MAXDOUBLE
+
+struct rspamd_shm_cache_slot {
+	guint seq;
+	guint8 type;
+	guint8 ref;
+	guint16 keylen;
+	guint16 datalen;
+	guint64 hash;
+	gdouble expire; /* 0 for empty slots */
+	guchar data[RSPAMD_SHM_CACHE_DATA_LEN]; /* key followed by value */
+};
+
+struct rspamd_shm_cache_set {
+	guint lock; /* pid of the lock holder or 0 */
+	guint hand;
+	struct rspamd_shm_cache_slot slots[RSPAMD_SHM_CACHE_WAYS];
+};
+
+struct rspamd_shm_cache {
+	guint nsets;
+	guint64 hits;
+	guint64 misses;
+	guint64 stored;
+	guint64 evicted;
+	struct rspamd_shm_cache_set sets[];
+};
+
+struct rspamd_shm_cache *
+rspamd_shm_cache_new (rspamd_mempool_t *pool, guint nelts)
+{
+	struct rspamd_shm_cache *cache;
+	guint nsets;
+
+	nsets = MAX (1, (nelts + RSPAMD_SHM_CACHE_WAYS - 1) / RSPAMD_SHM_CACHE_WAYS);
+	cache = rspamd_mempool_alloc0_shared (pool, sizeof (*cache) +
+			sizeof (struct rspamd_shm_cache_set) * nsets);
+	cache->nsets = nsets;
+
+	return cache;
+}
+
+static inline struct rspamd_shm_cache_set *
+rspamd_shm_cache_get_set (struct rspamd_shm_cache *cache,
+		const void *key, gsize keylen, guint64 *h)
+{
+	*h = rspamd_cryptobox_fast_hash (key, keylen, RSPAMD_SHM_CACHE_SEED);
+
+	return &cache->sets[*h % cache->nsets];
+}
+
+/*
+ * Called when the holder of the set lock is dead: slots it might have been
+ * writing are left with odd sequence counters, so they are cleared
+ */
+static void
+rspamd_shm_cache_repair_set (struct rspamd_shm_cache_set *set)
+{
+	struct rspamd_shm_cache_slot *slot;
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHM_CACHE_WAYS; i ++) {
+		slot = &set->slots[i];
+
+		if (slot->seq & 1) {
+			slot->expire = 0;
+			__atomic_store_n (&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+static gboolean
+rspamd_shm_cache_lock_set (struct rspamd_shm_cache_set *set)
+{
+	guint i, expected, self = getpid ();
+
+	for (i = 0; i < RSPAMD_SHM_CACHE_SPINS; i ++) {
+		expected = 0;
+
+		if (__atomic_compare_exchange_n (&set->lock, &expected, self,
+				FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return TRUE;
+		}
+
+		if ((i & 0xff) == 0xff) {
+			if (expected != self && kill ((pid_t)expected, 0) == -1 &&
+					errno == ESRCH) {
+				/* Lock holder has died while writing, take the lock over */
+				if (__atomic_compare_exchange_n (&set->lock, &expected, self,
+						FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					rspamd_shm_cache_repair_set (set);
+
+					return TRUE;
+				}
+			}
+			else {
+				/* Lock holder might be descheduled */
+				sched_yield ();
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+static inline void
+rspamd_shm_cache_unlock_set (struct rspamd_shm_cache_set *set)
+{
+	__atomic_store_n (&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline void
+rspamd_shm_cache_begin_write (struct rspamd_shm_cache_slot *slot)
+{
+	__atomic_store_n (&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static inline void
+rspamd_shm_cache_end_write (struct rspamd_shm_cache_slot *slot)
+{
+	__atomic_store_n (&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Must be called with the set locked, expired elements are returned as well */
+static struct rspamd_shm_cache_slot *
+rspamd_shm_cache_find_locked (struct rspamd_shm_cache_set *set, guint64 h,
+		const void *key, gsize keylen)
+{
+	struct rspamd_shm_cache_slot *slot;
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHM_CACHE_WAYS; i ++) {
+		slot = &set->slots[i];
+
+		if (slot->expire != 0 && slot->hash == h && slot->keylen == keylen &&
+				memcmp (slot->data, key, keylen) == 0) {
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/* Must be called with the set locked */
+static struct rspamd_shm_cache_slot *
+rspamd_shm_cache_victim_locked (struct rspamd_shm_cache *cache,
+		struct rspamd_shm_cache_set *set, gdouble now)
+{
+	struct rspamd_shm_cache_slot *slot;
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHM_CACHE_WAYS; i ++) {
+		slot = &set->slots[i];
+
+		if (slot->expire <= now) {
+			return slot;
+		}
+	}
+
+	/* All slots are live, so move the hand till a slot is not referenced */
+	for (i = 0; i < RSPAMD_SHM_CACHE_WAYS * 2; i ++) {
+		slot = &set->slots[set->hand];
+		set->hand = (set->hand + 1) % RSPAMD_SHM_CACHE_WAYS;
+
+		if (__atomic_exchange_n (&slot->ref, 0, __ATOMIC_RELAXED) == 0) {
+			break;
+		}
+	}
+
+	__atomic_add_fetch (&cache->evicted, 1, __ATOMIC_RELAXED);
+
+	return slot;
+}
+
+/* Must be called with the set locked */
+static void
+rspamd_shm_cache_write_locked (struct rspamd_shm_cache *cache,
+		struct rspamd_shm_cache_slot *slot, guint64 h,
+		enum rspamd_shm_cache_type type,
+		const void *key, gsize keylen,
+		const void *data, gsize datalen,
+		gdouble ttl, gdouble now)
+{
+	rspamd_shm_cache_begin_write (slot);
+	slot->hash = h;
+	slot->type = type;
+	slot->ref = 1;
+	slot->keylen = keylen;
+	slot->datalen = datalen;
+	slot->expire = ttl > 0 ? now + ttl : RSPAMD_SHM_CACHE_NEVER;
+	memcpy (slot->data, key, keylen);
+	memcpy (slot->data + keylen, data, datalen);
+	rspamd_shm_cache_end_write (slot);
+
+	__atomic_add_fetch (&cache->stored, 1, __ATOMIC_RELAXED);
+}
+
+gboolean
+rspamd_shm_cache_lookup (struct rspamd_shm_cache *cache,
+		const void *key, gsize keylen,
+		gdouble now,
+		struct rspamd_shm_cache_value *value)
+{
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_slot *slot, copy;
+	guint64 h;
+	guint seq, i;
+
+	if (keylen == 0 || keylen > RSPAMD_SHM_CACHE_DATA_LEN) {
+		return FALSE;
+	}
+
+	set = rspamd_shm_cache_get_set (cache, key, keylen, &h);
+
+	for (i = 0; i < RSPAMD_SHM_CACHE_WAYS; i ++) {
+		slot = &set->slots[i];
+		seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+
+		if ((seq & 1) || slot->hash != h) {
+			continue;
+		}
+
+		memcpy (&copy, slot, sizeof (copy));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq) {
+			/* Slot has been modified concurrently */
+			continue;
+		}
+
+		if (copy.hash != h || copy.keylen != keylen || copy.expire <= now ||
+				copy.keylen + copy.datalen > sizeof (copy.data) ||
+				memcmp (copy.data, key, keylen) != 0) {
+			continue;
+		}
+
+		value->type = copy.type;
+		value->ttl = copy.expire == RSPAMD_SHM_CACHE_NEVER ?
+				0 : copy.expire - now;
+		value->len = copy.datalen;
+		memcpy (value->data, copy.data + copy.keylen, copy.datalen);
+
+		if (copy.type == RSPAMD_SHM_CACHE_COUNTER) {
+			memcpy (&value->counter, value->data, sizeof (value->counter));
+		}
+		else {
+			value->counter = 0;
+		}
+
+		if (!copy.ref) {
+			__atomic_store_n (&slot->ref, 1, __ATOMIC_RELAXED);
+		}
+
+		__atomic_add_fetch (&cache->hits, 1, __ATOMIC_RELAXED);
+
+		return TRUE;
+	}
+
+	__atomic_add_fetch (&cache->misses, 1, __ATOMIC_RELAXED);
+
+	return FALSE;
+}
+
+gboolean
+rspamd_shm_cache_insert (struct rspamd_shm_cache *cache,
+		const void *key, gsize keylen,
+		const void *data, gsize datalen,
+		gdouble ttl, gdouble now)
+{
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_slot *slot;
+	guint64 h;
+
+	if (keylen == 0 || keylen + datalen > RSPAMD_SHM_CACHE_DATA_LEN) {
+		return FALSE;
+	}
+
+	set = rspamd_shm_cache_get_set (cache, key, keylen, &h);
+
+	if (!rspamd_shm_cache_lock_set (set)) {
+		return FALSE;
+	}
+
+	slot = rspamd_shm_cache_find_locked (set, h, key, keylen);
+
+	if (slot == NULL) {
+		slot = rspamd_shm_cache_victim_locked (cache, set, now);
+	}
+
+	rspamd_shm_cache_write_locked (cache, slot, h, RSPAMD_SHM_CACHE_STRING,
+			key, keylen, data, datalen, ttl, now);
+	rspamd_shm_cache_unlock_set (set);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_shm_cache_incr (struct rspamd_shm_cache *cache,
+		const void *key, gsize keylen,
+		gint64 delta, gdouble ttl, gdouble now,
+		gint64 *result)
+{
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_slot *slot;
+	guint64 h;
+	gint64 cur;
+
+	if (keylen == 0 || keylen + sizeof (cur) > RSPAMD_SHM_CACHE_DATA_LEN) {
+		return FALSE;
+	}
+
+	set = rspamd_shm_cache_get_set (cache, key, keylen, &h);
+
+	if (!rspamd_shm_cache_lock_set (set)) {
+		return FALSE;
+	}
+
+	slot = rspamd_shm_cache_find_locked (set, h, key, keylen);
+
+	if (slot && slot->expire > now) {
+		if (slot->type != RSPAMD_SHM_CACHE_COUNTER) {
+			rspamd_shm_cache_unlock_set (set);
+
+			return FALSE;
+		}
+
+		memcpy (&cur, slot->data + keylen, sizeof (cur));
+		cur += delta;
+		rspamd_shm_cache_begin_write (slot);
+		slot->ref = 1;
+		memcpy (slot->data + keylen, &cur, sizeof (cur));
+		rspamd_shm_cache_end_write (slot);
+	}
+	else {
+		if (slot == NULL) {
+			slot = rspamd_shm_cache_victim_locked (cache, set, now);
+		}
+
+		cur = delta;
+		rspamd_shm_cache_write_locked (cache, slot, h, RSPAMD_SHM_CACHE_COUNTER,
+				key, keylen, &cur, sizeof (cur), ttl, now);
+	}
+
+	rspamd_shm_cache_unlock_set (set);
+
+	if (result) {
+		*result = cur;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_shm_cache_delete (struct rspamd_shm_cache *cache,
+		const void *key, gsize keylen)
+{
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_slot *slot;
+	guint64 h;
+
+	if (keylen == 0 || keylen > RSPAMD_SHM_CACHE_DATA_LEN) {
+		return FALSE;
+	}
+
+	set = rspamd_shm_cache_get_set (cache, key, keylen, &h);
+
+	if (!rspamd_shm_cache_lock_set (set)) {
+		return FALSE;
+	}
+
+	slot = rspamd_shm_cache_find_locked (set, h, key, keylen);
+
+	if (slot) {
+		rspamd_shm_cache_begin_write (slot);
+		slot->expire = 0;
+		rspamd_shm_cache_end_write (slot);
+	}
+
+	rspamd_shm_cache_unlock_set (set);
+
+	return slot != NULL;
+}
+
+void
+rspamd_shm_cache_stat (struct rspamd_shm_cache *cache,
+		struct rspamd_shm_cache_stat *st)
+{
+	st->elts = (guint64)cache->nsets * RSPAMD_SHM_CACHE_WAYS;
+	st->hits = __atomic_load_n (&cache->hits, __ATOMIC_RELAXED);
+	st->misses = __atomic_load_n (&cache->misses, __ATOMIC_RELAXED);
+	st->stored = __atomic_load_n (&cache->stored, __ATOMIC_RELAXED);
+	st->evicted = __atomic_load_n (&cache->evicted, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,133 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_SHM_CACHE_H
+#define RSPAMD_SHM_CACHE_H
+
+#include "config.h"
+#include "mem_pool.h"
+
+/**
+ * Key value cache in the shared memory: it is allocated by the main process
+ * and inherited by all workers, so it could be used as a synchronous local
+ * tier in front of Redis or DNS. Elements have TTLs and are evicted by the
+ * CLOCK algorithm when the cache is full, counters are updated atomically.
+ * Keys and values are limited by `RSPAMD_SHM_CACHE_DATA_LEN` bytes in total.
+ */
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define RSPAMD_SHM_CACHE_DATA_LEN 224
+
+struct rspamd_shm_cache;
+
+enum rspamd_shm_cache_type {
+	RSPAMD_SHM_CACHE_STRING = 0,
+	RSPAMD_SHM_CACHE_COUNTER,
+};
+
+struct rspamd_shm_cache_value {
+	enum rspamd_shm_cache_type type;
+	gint64 counter;
+	gdouble ttl;        /* seconds to expire, 0 if an element never expires */
+	gsize len;
+	guchar data[RSPAMD_SHM_CACHE_DATA_LEN];
+};
+
+struct rspamd_shm_cache_stat {
+	guint64 elts;       /* total number of slots */
+	guint64 hits;
+	guint64 misses;
+	guint64 stored;
+	guint64 evicted;
+};
+
+/**
+ * Creates a new cache in the shared memory of the pool
+ * @param pool
+ * @param nelts number of elements, rounded to the set size
+ * @return
+ */
+struct rspamd_shm_cache *rspamd_shm_cache_new (rspamd_mempool_t *pool,
+											   guint nelts);
+
+/**
+ * Copies a live element to `value`
+ * @param cache
+ * @param key
+ * @param keylen
+ * @param now current time
+ * @param value output value
+ * @return TRUE if an element has been found
+ */
+gboolean rspamd_shm_cache_lookup (struct rspamd_shm_cache *cache,
+								  const void *key, gsize keylen,
+								  gdouble now,
+								  struct rspamd_shm_cache_value *value);
+
+/**
+ * Stores a string value replacing any existing element with the same key
+ * @param cache
+ * @param key
+ * @param keylen
+ * @param data
+ * @param datalen
+ * @param ttl time to live, 0 to keep element till it is evicted
+ * @param now current time
+ * @return FALSE if an element is too large or cache is busy
+ */
+gboolean rspamd_shm_cache_insert (struct rspamd_shm_cache *cache,
+								  const void *key, gsize keylen,
+								  const void *data, gsize datalen,
+								  gdouble ttl, gdouble now);
+
+/**
+ * Atomically adds `delta` to a counter creating it if needed, ttl is set only
+ * when a counter is created
+ * @param cache
+ * @param key
+ * @param keylen
+ * @param delta
+ * @param ttl time to live of a new counter, 0 to keep it till it is evicted
+ * @param now current time
+ * @param result new value of a counter
+ * @return FALSE if a key holds a string or cache is busy
+ */
+gboolean rspamd_shm_cache_incr (struct rspamd_shm_cache *cache,
+								const void *key, gsize keylen,
+								gint64 delta, gdouble ttl, gdouble now,
+								gint64 *result);
+
+/**
+ * Removes an element
+ * @param cache
+ * @param key
+ * @param keylen
+ * @return TRUE if an element has been removed
+ */
+gboolean rspamd_shm_cache_delete (struct rspamd_shm_cache *cache,
+								  const void *key, gsize keylen);
+
+/**
+ * Returns statistics of the cache
+ */
+void rspamd_shm_cache_stat (struct rspamd_shm_cache *cache,
+							struct rspamd_shm_cache_stat *st);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
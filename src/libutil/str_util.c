@@ -249,7 +249,7 @@ rspamd_strcase_hash (gconstpointer key)
 
 	len = strlen (p);
 
-	return (guint)rspamd_icase_hash (p, len, rspamd_hash_seed ());
+	return (guint)rspamd_cryptobox_fast_hash_lc (p, len, rspamd_hash_seed ());
 }
 
 guint
@@ -287,7 +287,8 @@ rspamd_ftok_icase_hash (gconstpointer key)
 {
 	const rspamd_ftok_t *f = key;
 
-	return (guint)rspamd_icase_hash (f->begin, f->len, rspamd_hash_seed ());
+	return (guint)rspamd_cryptobox_fast_hash_lc (f->begin, f->len,
+			rspamd_hash_seed ());
 }
 
 gboolean
@@ -328,7 +329,8 @@ rspamd_gstring_icase_hash (gconstpointer key)
 {
 	const GString *f = key;
 
-	return (guint)rspamd_icase_hash (f->str, f->len, rspamd_hash_seed ());
+	return (guint)rspamd_cryptobox_fast_hash_lc (f->str, f->len,
+			rspamd_hash_seed ());
 }
 
 /* https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord */
@@ -2347,6 +2349,20 @@ rspamd_decode_hex (const gchar *in, gsize inlen)
 	return NULL;
 }
 
+/* Hex digit values for quoted-printable decoding, 0xff for non hex chars */
+static const guchar rspamd_qp_hex_table[256] = {
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+};
+static const guchar rspamd_qp_hex_valid[256] = {
+	['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+	['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+	['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1,
+	['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1,
+};
+
 gssize
 rspamd_decode_qp_buf (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
@@ -2385,9 +2401,9 @@ decode:
 			remain --;
 			ret = 0;
 
-			if      (c >= '0' && c <= '9') { ret = c - '0'; }
-			else if (c >= 'A' && c <= 'F') { ret = c - 'A' + 10; }
-			else if (c >= 'a' && c <= 'f') { ret = c - 'a' + 10; }
+			if (rspamd_qp_hex_valid[(guchar)c]) {
+				ret = rspamd_qp_hex_table[(guchar)c];
+			}
 			else if (c == '\r') {
 				/* Eat one more endline */
 				if (remain > 0 && *p == '\n') {
@@ -2413,10 +2429,8 @@ decode:
 			if (remain > 0) {
 				c = *p++;
 				ret *= 16;
-
-				if      (c >= '0' && c <= '9') { ret += c - '0'; }
-				else if (c >= 'A' && c <= 'F') { ret += c - 'A' + 10; }
-				else if (c >= 'a' && c <= 'f') { ret += c - 'a' + 10; }
+				/* Non hex characters are decoded as zero */
+				ret += rspamd_qp_hex_table[(guchar)c];
 
 				if (end - o > 0) {
 					*o++ = (gchar)ret;
@@ -2662,6 +2676,36 @@ rspamd_memspn (const gchar *s, const gchar *e, gsize len)
 	return p - s;
 }
 
+/*
+ * Returns length of the prefix without '=' and '_' characters checking
+ * 8 bytes at once
+ */
+static inline gsize
+rspamd_qp2047_plain_len (const gchar *s, gsize len)
+{
+	const gchar *p = s, *end = s + len;
+	const guint64 ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+	guint64 w, eq, us;
+
+	while (end - p >= (gssize)sizeof (w)) {
+		memcpy (&w, p, sizeof (w));
+		eq = w ^ (ones * '=');
+		us = w ^ (ones * '_');
+
+		if ((((eq - ones) & ~eq) | ((us - ones) & ~us)) & highs) {
+			break;
+		}
+
+		p += sizeof (w);
+	}
+
+	while (p < end && *p != '=' && *p != '_') {
+		p ++;
+	}
+
+	return p - s;
+}
+
 gssize
 rspamd_decode_qp2047_buf (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
@@ -2693,9 +2737,9 @@ decode:
 			remain --;
 			ret = 0;
 
-			if      (c >= '0' && c <= '9') { ret = c - '0'; }
-			else if (c >= 'A' && c <= 'F') { ret = c - 'A' + 10; }
-			else if (c >= 'a' && c <= 'f') { ret = c - 'a' + 10; }
+			if (rspamd_qp_hex_valid[(guchar)c]) {
+				ret = rspamd_qp_hex_table[(guchar)c];
+			}
 			else if (c == '\r' || c == '\n') {
 				/* Soft line break */
 				while (remain > 0 && (*p == '\r' || *p == '\n')) {
@@ -2709,10 +2753,8 @@ decode:
 			if (remain > 0) {
 				c = *p++;
 				ret *= 16;
-
-				if      (c >= '0' && c <= '9') { ret += c - '0'; }
-				else if (c >= 'A' && c <= 'F') { ret += c - 'A' + 10; }
-				else if (c >= 'a' && c <= 'f') { ret += c - 'a' + 10; }
+				/* Non hex characters are decoded as zero */
+				ret += rspamd_qp_hex_table[(guchar)c];
 
 				if (end - o > 0) {
 					*o++ = (gchar)ret;
@@ -2726,7 +2768,7 @@ decode:
 		}
 		else {
 			if (end - o >= remain) {
-				processed = rspamd_memcspn (p, "=_", remain);
+				processed = rspamd_qp2047_plain_len (p, remain);
 				memcpy (o, p, processed);
 				o += processed;
 
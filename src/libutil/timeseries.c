@@ -0,0 +1,349 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "timeseries.h"
+#include "util.h"
+#include "logger.h"
+#include "unix-std.h"
+#include <math.h>
+#include <sys/mman.h>
+
+#define RSPAMD_TIMESERIES_MAGIC "rsts0001"
+#define RSPAMD_TIMESERIES_ROWS 480
+
+/* 480 points of 3 minutes, 21 minutes, 93 minutes and 18.25 hours */
+static const guint64 rspamd_timeseries_steps[RSPAMD_TIMESERIES_DEFAULT_RES] = {
+	180, 1260, 5580, 65700,
+};
+
+struct rspamd_timeseries_ring {
+	guint64 step;
+	guint64 rows;
+	guint64 cur_slot;   /* absolute number of the current row: time / step */
+	guint64 offset;     /* offset of rows from the beginning of the file */
+};
+
+struct rspamd_timeseries_header {
+	gchar magic[8];
+	guint32 nseries;
+	guint32 nres;
+	gdouble last_update;
+	gdouble last_values[RSPAMD_TIMESERIES_MAX_SERIES];
+	struct rspamd_timeseries_ring rings[RSPAMD_TIMESERIES_MAX_RES];
+};
+
+struct rspamd_timeseries {
+	gchar *path;
+	gint fd;
+	gsize size;
+	union {
+		gpointer map;
+		struct rspamd_timeseries_header *hdr;
+	};
+};
+
+static GQuark
+rspamd_timeseries_quark (void)
+{
+	return g_quark_from_static_string ("timeseries-error");
+}
+
+static inline gdouble *
+rspamd_timeseries_row (struct rspamd_timeseries *ts,
+		struct rspamd_timeseries_ring *ring, guint64 slot)
+{
+	return (gdouble *)((guchar *)ts->map + ring->offset) +
+			(slot % ring->rows) * ts->hdr->nseries;
+}
+
+static gsize
+rspamd_timeseries_file_size (guint nseries)
+{
+	return sizeof (struct rspamd_timeseries_header) +
+			sizeof (gdouble) * nseries * RSPAMD_TIMESERIES_ROWS *
+			RSPAMD_TIMESERIES_DEFAULT_RES;
+}
+
+static gboolean
+rspamd_timeseries_check (struct rspamd_timeseries *ts, guint nseries)
+{
+	struct rspamd_timeseries_header *hdr = ts->hdr;
+	guint i;
+
+	if (memcmp (hdr->magic, RSPAMD_TIMESERIES_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->nseries != nseries ||
+			hdr->nres != RSPAMD_TIMESERIES_DEFAULT_RES) {
+		return FALSE;
+	}
+
+	for (i = 0; i < hdr->nres; i ++) {
+		if (hdr->rings[i].step != rspamd_timeseries_steps[i] ||
+				hdr->rings[i].rows != RSPAMD_TIMESERIES_ROWS ||
+				hdr->rings[i].offset + sizeof (gdouble) * nseries *
+				RSPAMD_TIMESERIES_ROWS > ts->size) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_timeseries_init (struct rspamd_timeseries *ts, guint nseries)
+{
+	struct rspamd_timeseries_header *hdr = ts->hdr;
+	gdouble *data;
+	gsize i, ndata, offset = sizeof (*hdr);
+
+	memset (hdr, 0, sizeof (*hdr));
+	memcpy (hdr->magic, RSPAMD_TIMESERIES_MAGIC, sizeof (hdr->magic));
+	hdr->nseries = nseries;
+	hdr->nres = RSPAMD_TIMESERIES_DEFAULT_RES;
+
+	for (i = 0; i < hdr->nres; i ++) {
+		hdr->rings[i].step = rspamd_timeseries_steps[i];
+		hdr->rings[i].rows = RSPAMD_TIMESERIES_ROWS;
+		hdr->rings[i].offset = offset;
+		offset += sizeof (gdouble) * nseries * RSPAMD_TIMESERIES_ROWS;
+	}
+
+	/* Nothing is known yet */
+	data = (gdouble *)((guchar *)ts->map + sizeof (*hdr));
+	ndata = (ts->size - sizeof (*hdr)) / sizeof (gdouble);
+
+	for (i = 0; i < ndata; i ++) {
+		data[i] = NAN;
+	}
+}
+
+struct rspamd_timeseries *
+rspamd_timeseries_open (const gchar *path, guint nseries, GError **err)
+{
+	struct rspamd_timeseries *ts;
+	struct stat st;
+	gsize size;
+	gint fd;
+	gboolean fresh = FALSE;
+
+	g_assert (path != NULL);
+	g_assert (nseries > 0 && nseries <= RSPAMD_TIMESERIES_MAX_SERIES);
+
+	fd = open (path, O_RDWR | O_CREAT, 0644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_timeseries_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	if (!rspamd_file_lock (fd, TRUE)) {
+		g_set_error (err, rspamd_timeseries_quark (), errno,
+				"cannot lock %s: %s", path, strerror (errno));
+		close (fd);
+
+		return NULL;
+	}
+
+	size = rspamd_timeseries_file_size (nseries);
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_timeseries_quark (), errno,
+				"cannot stat %s: %s", path, strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return NULL;
+	}
+
+	if ((gsize)st.st_size != size) {
+		if (st.st_size != 0) {
+			msg_warn ("time series file %s has incompatible size, recreate it",
+					path);
+		}
+
+		if (ftruncate (fd, 0) == -1 || ftruncate (fd, size) == -1) {
+			g_set_error (err, rspamd_timeseries_quark (), errno,
+					"cannot resize %s: %s", path, strerror (errno));
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+
+			return NULL;
+		}
+
+		fresh = TRUE;
+	}
+
+	ts = g_malloc0 (sizeof (*ts));
+	ts->map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (ts->map == MAP_FAILED) {
+		g_set_error (err, rspamd_timeseries_quark (), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+		g_free (ts);
+
+		return NULL;
+	}
+
+	ts->fd = fd;
+	ts->size = size;
+	ts->path = g_strdup (path);
+
+	if (fresh || !rspamd_timeseries_check (ts, nseries)) {
+		if (!fresh) {
+			msg_warn ("time series file %s has incompatible layout, "
+					"recreate it", path);
+		}
+
+		rspamd_timeseries_init (ts, nseries);
+	}
+
+	return ts;
+}
+
+void
+rspamd_timeseries_add (struct rspamd_timeseries *ts,
+		const gdouble *counters,
+		gdouble now)
+{
+	struct rspamd_timeseries_header *hdr = ts->hdr;
+	struct rspamd_timeseries_ring *ring;
+	gdouble deltas[RSPAMD_TIMESERIES_MAX_SERIES], *row;
+	guint64 slot, s;
+	guint i, j;
+
+	if (now <= 0) {
+		return;
+	}
+
+	for (i = 0; i < hdr->nseries; i ++) {
+		deltas[i] = counters[i] - hdr->last_values[i];
+
+		if (hdr->last_update == 0 || deltas[i] < 0) {
+			/* First update or counters reset, rate is unknown */
+			deltas[i] = NAN;
+		}
+
+		hdr->last_values[i] = counters[i];
+	}
+
+	for (i = 0; i < hdr->nres; i ++) {
+		ring = &hdr->rings[i];
+		slot = (guint64)now / ring->step;
+
+		if (hdr->last_update == 0 || slot > ring->cur_slot + ring->rows) {
+			/* Start from scratch, all older rows are unknown */
+			for (s = slot - MIN (slot, ring->rows - 1); s < slot; s ++) {
+				row = rspamd_timeseries_row (ts, ring, s);
+
+				for (j = 0; j < hdr->nseries; j ++) {
+					row[j] = NAN;
+				}
+			}
+
+			ring->cur_slot = slot - 1;
+		}
+
+		while (ring->cur_slot < slot) {
+			ring->cur_slot ++;
+			row = rspamd_timeseries_row (ts, ring, ring->cur_slot);
+
+			/* Rows stay unknown unless some increment is added */
+			for (j = 0; j < hdr->nseries; j ++) {
+				row[j] = NAN;
+			}
+		}
+
+		/* Clock going backwards is accounted in the current row */
+		row = rspamd_timeseries_row (ts, ring, ring->cur_slot);
+
+		for (j = 0; j < hdr->nseries; j ++) {
+			if (isfinite (deltas[j])) {
+				row[j] = isfinite (row[j]) ? row[j] + deltas[j] : deltas[j];
+			}
+		}
+	}
+
+	hdr->last_update = now;
+}
+
+struct rspamd_timeseries_result *
+rspamd_timeseries_query (struct rspamd_timeseries *ts, guint res)
+{
+	struct rspamd_timeseries_header *hdr = ts->hdr;
+	struct rspamd_timeseries_ring *ring;
+	struct rspamd_timeseries_result *result;
+	const gdouble *row;
+	guint64 first, s;
+	guint i, j;
+
+	if (res >= hdr->nres) {
+		return NULL;
+	}
+
+	ring = &hdr->rings[res];
+	result = g_malloc0 (sizeof (*result));
+	result->nseries = hdr->nseries;
+	result->step = ring->step;
+
+	if (hdr->last_update == 0) {
+		return result;
+	}
+
+	/* The current row is incomplete, so it is not returned */
+	first = ring->cur_slot - MIN (ring->cur_slot, ring->rows - 1);
+	result->npoints = ring->cur_slot - first;
+	result->start = first * ring->step;
+	result->data = g_malloc (sizeof (gdouble) * result->npoints * result->nseries);
+
+	for (s = first, i = 0; s < ring->cur_slot; s ++, i ++) {
+		row = rspamd_timeseries_row (ts, ring, s);
+
+		for (j = 0; j < hdr->nseries; j ++) {
+			result->data[i * hdr->nseries + j] = row[j] / (gdouble)ring->step;
+		}
+	}
+
+	return result;
+}
+
+void
+rspamd_timeseries_result_free (struct rspamd_timeseries_result *res)
+{
+	if (res) {
+		g_free (res->data);
+		g_free (res);
+	}
+}
+
+const gchar *
+rspamd_timeseries_path (struct rspamd_timeseries *ts)
+{
+	return ts->path;
+}
+
+void
+rspamd_timeseries_close (struct rspamd_timeseries *ts)
+{
+	if (ts) {
+		msync (ts->map, ts->size, MS_ASYNC);
+		munmap (ts->map, ts->size);
+		rspamd_file_unlock (ts->fd, FALSE);
+		close (ts->fd);
+		g_free (ts->path);
+		g_free (ts);
+	}
+}
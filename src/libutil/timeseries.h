@@ -0,0 +1,99 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_TIMESERIES_H
+#define RSPAMD_TIMESERIES_H
+
+#include "config.h"
+
+/**
+ * Lightweight time series storage for monotonic counters. A file holds
+ * several fixed interval rings (resolutions), each ring stores sums of
+ * counters increments per interval. Every update goes to all resolutions
+ * at once, so there is no consolidation on query and reading a ring costs
+ * exactly one pass over its rows.
+ */
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define RSPAMD_TIMESERIES_MAX_SERIES 16
+#define RSPAMD_TIMESERIES_MAX_RES 8
+
+enum rspamd_timeseries_resolution {
+	RSPAMD_TIMESERIES_DAY = 0,
+	RSPAMD_TIMESERIES_WEEK,
+	RSPAMD_TIMESERIES_MONTH,
+	RSPAMD_TIMESERIES_YEAR,
+	RSPAMD_TIMESERIES_DEFAULT_RES,
+};
+
+struct rspamd_timeseries;
+
+struct rspamd_timeseries_result {
+	guint nseries;
+	guint npoints;
+	guint64 start;      /* timestamp of the first point */
+	guint64 step;       /* seconds between points */
+	gdouble *data;      /* npoints * nseries per second rates, NaN if unknown */
+};
+
+/**
+ * Opens time series file creating it if it does not exist or has
+ * an incompatible layout. Day, week, month and year resolutions are used.
+ * @param path
+ * @param nseries number of counters
+ * @param err
+ * @return
+ */
+struct rspamd_timeseries *rspamd_timeseries_open (const gchar *path,
+												  guint nseries,
+												  GError **err);
+
+/**
+ * Adds current values of counters
+ * @param ts
+ * @param counters array of `nseries` monotonic counters
+ * @param now current time
+ */
+void rspamd_timeseries_add (struct rspamd_timeseries *ts,
+							const gdouble *counters,
+							gdouble now);
+
+/**
+ * Returns complete points of a resolution from the oldest to the newest one
+ * @param ts
+ * @param res resolution index
+ * @return result that must be freed by `rspamd_timeseries_result_free` or NULL
+ */
+struct rspamd_timeseries_result *rspamd_timeseries_query (
+		struct rspamd_timeseries *ts, guint res);
+
+void rspamd_timeseries_result_free (struct rspamd_timeseries_result *res);
+
+/**
+ * Returns file path of time series storage
+ */
+const gchar *rspamd_timeseries_path (struct rspamd_timeseries *ts);
+
+/**
+ * Syncs and closes time series file
+ */
+void rspamd_timeseries_close (struct rspamd_timeseries *ts);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
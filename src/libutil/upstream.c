@@ -53,12 +53,14 @@ struct upstream {
 	guint cur_weight;
 	guint errors;
 	guint checked;
+	guint inflight;
 	guint dns_requests;
 	gint active_idx;
 	guint ttl;
 	gchar *name;
 	ev_timer ev;
 	gdouble last_fail;
+	gdouble latency_avg;
 	gpointer ud;
 	enum rspamd_upstream_flag flags;
 	struct upstream_list *ls;
@@ -95,6 +97,9 @@ struct upstream_list {
 	GPtrArray *ups;
 	GPtrArray *alive;
 	struct upstream_list_watcher *watchers;
+	guint32 *maglev; /* lookup table: slot -> index in ups */
+	guint maglev_size;
+	guint maglev_nups; /* number of upstreams the table has been built for */
 	guint64 hash_seed;
 	const struct upstream_limits *limits;
 	enum rspamd_upstream_flag flags;
@@ -748,6 +753,12 @@ rspamd_upstream_fail (struct upstream *upstream,
 			upstream->name,
 			reason);
 
+	RSPAMD_UPSTREAM_LOCK (upstream);
+	if (upstream->inflight > 0) {
+		upstream->inflight --;
+	}
+	RSPAMD_UPSTREAM_UNLOCK (upstream);
+
 	if (upstream->ctx && upstream->active_idx != -1) {
 		sec_cur = rspamd_get_ticks (FALSE);
 
@@ -853,6 +864,10 @@ rspamd_upstream_ok (struct upstream *upstream)
 	struct upstream_list_watcher *w;
 
 	RSPAMD_UPSTREAM_LOCK (upstream);
+	if (upstream->inflight > 0) {
+		upstream->inflight --;
+	}
+
 	if (upstream->errors > 0 && upstream->active_idx != -1) {
 		/* We touch upstream if and only if it is active */
 		msg_debug_upstream ("reset errors on upstream %s (was %ud)", upstream->name, upstream->errors);
@@ -873,6 +888,37 @@ rspamd_upstream_ok (struct upstream *upstream)
 	RSPAMD_UPSTREAM_UNLOCK (upstream);
 }
 
+/* Smoothing factor for the moving average of the response time */
+#define UPSTREAM_LATENCY_ALPHA 0.3
+
+void
+rspamd_upstream_latency (struct upstream *up, gdouble latency)
+{
+	if (latency < 0 || isnan (latency)) {
+		return;
+	}
+
+	RSPAMD_UPSTREAM_LOCK (up);
+	if (up->latency_avg == 0) {
+		up->latency_avg = latency;
+	}
+	else {
+		up->latency_avg = UPSTREAM_LATENCY_ALPHA * latency +
+				(1.0 - UPSTREAM_LATENCY_ALPHA) * up->latency_avg;
+	}
+	RSPAMD_UPSTREAM_UNLOCK (up);
+}
+
+void
+rspamd_upstream_cancel (struct upstream *up)
+{
+	RSPAMD_UPSTREAM_LOCK (up);
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+	RSPAMD_UPSTREAM_UNLOCK (up);
+}
+
 void
 rspamd_upstream_set_weight (struct upstream *up, guint weight)
 {
@@ -1204,6 +1250,14 @@ rspamd_upstreams_parse_line_len (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "least-loaded:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LEAST_LOADED;
+		p += sizeof ("least-loaded:") - 1;
+	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "maglev:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_MAGLEV;
+		p += sizeof ("maglev:") - 1;
+	}
 
 	while (p < end) {
 		span_len = rspamd_memcspn (p, separators, end - p);
@@ -1291,6 +1345,7 @@ rspamd_upstreams_destroy (struct upstream_list *ups)
 		}
 
 		g_free (ups->ups_line);
+		g_free (ups->maglev);
 		g_ptr_array_free (ups->ups, TRUE);
 #ifdef UPSTREAMS_THREAD_SAFE
 		rspamd_mutex_free (ups->lock);
@@ -1438,10 +1493,78 @@ rspamd_consistent_hash (guint64 key, guint32 nbuckets)
 	return b;
 }
 
+/*
+ * Maglev hashing from the following paper:
+ * Maglev: A Fast and Reliable Software Network Load Balancer
+ * Daniel E. Eisenbud et al.
+ *
+ * Each upstream fills slots of a lookup table in the order of its own
+ * permutation, so a key is mapped to an upstream by a single table lookup.
+ * Table size is a prime at least 100 times larger than the number of
+ * upstreams, so upstreams get almost equal shares of keys and adding an
+ * upstream moves a minimal amount of keys.
+ */
+static const guint maglev_sizes[] = {
+	251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521,
+};
+
+static void
+rspamd_upstream_maglev_build (struct upstream_list *ups)
+{
+	guint nups = ups->ups->len, size = 0, i, filled = 0;
+	guint32 *pos, *skip;
+	struct upstream *up;
+	guint64 h;
+
+	for (i = 0; i < G_N_ELEMENTS (maglev_sizes); i ++) {
+		size = maglev_sizes[i];
+
+		if (size >= nups * 100) {
+			break;
+		}
+	}
+
+	ups->maglev = g_realloc (ups->maglev, size * sizeof (*ups->maglev));
+	ups->maglev_size = size;
+	ups->maglev_nups = nups;
+	memset (ups->maglev, 0xff, size * sizeof (*ups->maglev));
+
+	if (nups == 0) {
+		return;
+	}
+
+	pos = g_malloc (nups * sizeof (*pos) * 2);
+	skip = pos + nups;
+
+	for (i = 0; i < nups; i ++) {
+		up = g_ptr_array_index (ups->ups, i);
+		h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+				up->name, strlen (up->name), ups->hash_seed);
+		pos[i] = (h & G_MAXUINT32) % size;
+		skip[i] = (h >> 32) % (size - 1) + 1;
+	}
+
+	/* Size is prime, so each permutation covers all slots */
+	while (filled < size) {
+		for (i = 0; i < nups && filled < size; i ++) {
+			while (ups->maglev[pos[i]] != G_MAXUINT32) {
+				pos[i] = (pos[i] + skip[i]) % size;
+			}
+
+			ups->maglev[pos[i]] = i;
+			pos[i] = (pos[i] + skip[i]) % size;
+			filled ++;
+		}
+	}
+
+	g_free (pos);
+}
+
 static struct upstream*
 rspamd_upstream_get_hashed (struct upstream_list *ups,
 							struct upstream *except,
-							const guint8 *key, guint keylen)
+							const guint8 *key, guint keylen,
+							gboolean maglev)
 {
 	guint64 k;
 	guint32 idx;
@@ -1453,11 +1576,23 @@ rspamd_upstream_get_hashed (struct upstream_list *ups,
 			key, keylen, ups->hash_seed);
 
 	RSPAMD_UPSTREAM_LOCK (ups);
+
+	if (maglev && ups->maglev_nups != ups->ups->len) {
+		/* Upstreams are added on configuration only, so it is built once */
+		rspamd_upstream_maglev_build (ups);
+	}
+
 	/*
 	 * Select new upstream from all upstreams
 	 */
 	for (guint i = 0; i < max_tries; i ++) {
-		idx = rspamd_consistent_hash (k, ups->ups->len);
+		if (maglev) {
+			idx = ups->maglev[k % ups->maglev_size];
+		}
+		else {
+			idx = rspamd_consistent_hash (k, ups->ups->len);
+		}
+
 		up = g_ptr_array_index (ups->ups, idx);
 
 		if (up->active_idx < 0 || (except != NULL && up == except)) {
@@ -1482,6 +1617,55 @@ rspamd_upstream_get_hashed (struct upstream_list *ups,
 	return up;
 }
 
+/*
+ * Expected cost of sending one more request to an upstream: requests already
+ * queued multiplied by the average response time. The constant bias makes
+ * upstreams without latency data comparable by the number of requests only.
+ */
+static inline gdouble
+rspamd_upstream_load_cost (struct upstream *up)
+{
+	return (up->inflight + 1) * (up->latency_avg + 0.001) * (1 + up->errors);
+}
+
+/*
+ * Power of two choices: pick two random alive upstreams and use the less
+ * loaded one. It avoids herding on a single upstream that happens to look
+ * the best, which is the problem of the pure least loaded selection.
+ */
+static struct upstream*
+rspamd_upstream_get_least_loaded (struct upstream_list *ups,
+								  struct upstream *except)
+{
+	struct upstream *a, *b, *selected;
+	guint i, j;
+
+	RSPAMD_UPSTREAM_LOCK (ups);
+	i = ottery_rand_range (ups->alive->len - 1);
+	j = ottery_rand_range (ups->alive->len - 2);
+
+	if (j >= i) {
+		j ++;
+	}
+
+	a = g_ptr_array_index (ups->alive, i);
+	b = g_ptr_array_index (ups->alive, j);
+
+	if (except && a == except) {
+		selected = b;
+	}
+	else if (except && b == except) {
+		selected = a;
+	}
+	else {
+		selected = rspamd_upstream_load_cost (a) <= rspamd_upstream_load_cost (b) ?
+				a : b;
+	}
+	RSPAMD_UPSTREAM_UNLOCK (ups);
+
+	return selected;
+}
+
 static struct upstream*
 rspamd_upstream_get_common (struct upstream_list *ups,
 							struct upstream* except,
@@ -1514,7 +1698,8 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		type = default_type != RSPAMD_UPSTREAM_UNDEF ? default_type : ups->rot_alg;
 	}
 
-	if (type == RSPAMD_UPSTREAM_HASHED && (keylen == 0 || key == NULL)) {
+	if ((type == RSPAMD_UPSTREAM_HASHED || type == RSPAMD_UPSTREAM_MAGLEV) &&
+			(keylen == 0 || key == NULL)) {
 		/* Cannot use hashed rotation when no key is specified, switch to random */
 		type = RSPAMD_UPSTREAM_RANDOM;
 	}
@@ -1525,7 +1710,10 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		up = rspamd_upstream_get_random (ups, except);
 		break;
 	case RSPAMD_UPSTREAM_HASHED:
-		up = rspamd_upstream_get_hashed (ups, except, key, keylen);
+		up = rspamd_upstream_get_hashed (ups, except, key, keylen, FALSE);
+		break;
+	case RSPAMD_UPSTREAM_MAGLEV:
+		up = rspamd_upstream_get_hashed (ups, except, key, keylen, TRUE);
 		break;
 	case RSPAMD_UPSTREAM_ROUND_ROBIN:
 		up = rspamd_upstream_get_round_robin (ups, except, TRUE);
@@ -1541,11 +1729,15 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 
 		up = g_ptr_array_index (ups->alive, ups->cur_elt ++);
 		break;
+	case RSPAMD_UPSTREAM_LEAST_LOADED:
+		up = rspamd_upstream_get_least_loaded (ups, except);
+		break;
 	}
 
 end:
 	if (up) {
 		up->checked ++;
+		up->inflight ++;
 	}
 
 	return up;
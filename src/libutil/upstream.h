@@ -16,6 +16,8 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LEAST_LOADED,
+	RSPAMD_UPSTREAM_MAGLEV,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -67,6 +69,21 @@ void rspamd_upstream_fail (struct upstream *upstream, gboolean addr_failure, con
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Account response time of the finished request to an upstream, it is used by
+ * `RSPAMD_UPSTREAM_LEAST_LOADED` rotation to prefer faster upstreams
+ * @param up
+ * @param latency request time in seconds
+ */
+void rspamd_upstream_latency (struct upstream *up, gdouble latency);
+
+/**
+ * Forget about a request to an upstream that has been cancelled by the caller,
+ * so it is counted neither as a success nor as a failure
+ * @param up
+ */
+void rspamd_upstream_cancel (struct upstream *up);
+
 /**
  * Set weight for an upstream
  * @param up
@@ -1585,6 +1585,20 @@ rspamd_get_virtual_ticks (void)
 	return res;
 }
 
+gdouble
+rspamd_get_thread_ticks (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+		return (double)ts.tv_sec + ts.tv_nsec / 1000000000.;
+	}
+#endif
+
+	return rspamd_get_virtual_ticks ();
+}
+
 gdouble
 rspamd_get_calendar_ticks (void)
 {
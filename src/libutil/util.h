@@ -284,6 +284,13 @@ gdouble rspamd_get_ticks (gboolean rdtsc_ok);
  */
 gdouble rspamd_get_virtual_ticks (void);
 
+/**
+ * Returns CPU time of the calling thread as seconds, falls back to
+ * the process CPU time if per thread clock is not available
+ * @return
+ */
+gdouble rspamd_get_thread_ticks (void);
+
 
 /**
  * Return the real timestamp as unixtime
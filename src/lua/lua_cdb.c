@@ -95,29 +95,44 @@ lua_cdb_get_name (lua_State *L)
 	return 1;
 }
 
+/*
+ * cdb:lookup(key[, zero_copy]): if `zero_copy` is true, then value is returned
+ * as rspamd{text} pointing to the mapped cdb, it is valid until cdb is
+ * reloaded or destroyed
+ */
 static gint
 lua_cdb_lookup (lua_State *L)
 {
 	struct cdb *cdb = lua_check_cdb (L);
-	const gchar *what;
-	gchar *value;
+	struct rspamd_lua_text *what;
+	const gchar *value;
 	gsize vlen;
-	gint64 vpos;
 
 	if (!cdb) {
 		lua_error (L);
 		return 1;
 	}
 
-	what = luaL_checkstring (L, 2);
-	if (cdb_find (cdb, what, strlen (what)) > 0) {
-		/* Extract and push value to lua as string */
-		vpos = cdb_datapos (cdb);
+	what = lua_check_text_or_string (L, 2);
+
+	if (what == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (cdb_find (cdb, what->start, what->len) > 0) {
+		/* Values are read directly from the mapped memory */
 		vlen = cdb_datalen (cdb);
-		value = g_malloc (vlen);
-		cdb_read (cdb, value, vlen, vpos);
-		lua_pushlstring (L, value, vlen);
-		g_free (value);
+		value = cdb_getdata (cdb);
+
+		if (value == NULL) {
+			lua_pushnil (L);
+		}
+		else if (lua_toboolean (L, 3)) {
+			lua_new_text (L, value, vlen, FALSE);
+		}
+		else {
+			lua_pushlstring (L, value, vlen);
+		}
 	}
 	else {
 		lua_pushnil (L);
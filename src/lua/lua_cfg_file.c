@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "expression.h"
 #include "composites.h"
 
@@ -156,5 +157,9 @@ rspamd_lua_post_load_config (struct rspamd_config *cfg)
 
 	lua_settop (L, 0);
 
+	if (cfg->lua_thread_pool) {
+		lua_thread_pool_set_limit (cfg->lua_thread_pool, cfg->lua_threads_max);
+	}
+
 	rspamd_lua_start_gc (cfg);
 }
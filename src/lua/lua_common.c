@@ -21,6 +21,7 @@
 #include "lua_thread_pool.h"
 #include "libstat/stat_api.h"
 #include "libserver/rspamd_control.h"
+#include "libutil/probes.h"
 
 #include <math.h>
 
@@ -981,6 +982,7 @@ rspamd_lua_init (bool wipe_mem)
 	luaopen_spf (L);
 	luaopen_tensor (L);
 	luaopen_parsers (L);
+	luaopen_shm_cache (L);
 #ifndef WITH_LUAJIT
 	rspamd_lua_add_preload (L, "bit", luaopen_bit);
 	lua_settop (L, 0);
@@ -1041,6 +1043,50 @@ rspamd_lua_init (bool wipe_mem)
 	return L;
 }
 
+/* Deferred gc steps performed when the event loop is idle */
+static struct rspamd_lua_gc_idle {
+	ev_idle ev;
+	struct ev_loop *event_loop;
+	struct rspamd_config *cfg;
+	guint pending;
+	struct rspamd_lua_gc_stat stat;
+} lua_gc_idle;
+
+void
+rspamd_lua_set_gc_mode (struct rspamd_config *cfg, const gchar *mode)
+{
+	lua_State *L = (lua_State *)cfg->lua_state;
+	gboolean generational = FALSE;
+
+	if (mode != NULL) {
+		if (g_ascii_strcasecmp (mode, "generational") == 0) {
+#if LUA_VERSION_NUM >= 504
+			generational = TRUE;
+#else
+			msg_warn_config ("generational Lua gc requires Lua 5.4, "
+					"use incremental gc");
+#endif
+		}
+		else if (g_ascii_strcasecmp (mode, "incremental") != 0) {
+			msg_warn_config ("unknown Lua gc mode: %s; use incremental gc", mode);
+		}
+	}
+
+#if LUA_VERSION_NUM >= 504
+	if (generational) {
+		lua_gc (L, LUA_GCGEN, 0, 0);
+	}
+	else {
+		lua_gc (L, LUA_GCINC, cfg->lua_gc_pause, cfg->lua_gc_step, 0);
+	}
+#else
+	lua_gc (L, LUA_GCSETSTEPMUL, cfg->lua_gc_step);
+	lua_gc (L, LUA_GCSETPAUSE, cfg->lua_gc_pause);
+#endif
+
+	lua_gc_idle.stat.generational = generational;
+}
+
 void
 rspamd_lua_start_gc (struct rspamd_config *cfg)
 {
@@ -1049,11 +1095,89 @@ rspamd_lua_start_gc (struct rspamd_config *cfg)
 	lua_settop (L, 0);
 	/* Set up GC */
 	lua_gc (L, LUA_GCCOLLECT, 0);
-	lua_gc (L, LUA_GCSETSTEPMUL, cfg->lua_gc_step);
-	lua_gc (L, LUA_GCSETPAUSE, cfg->lua_gc_pause);
+	rspamd_lua_set_gc_mode (cfg, cfg->lua_gc_mode);
 	lua_gc (L, LUA_GCRESTART, 0);
 }
 
+static void
+rspamd_lua_gc_step (lua_State *L, guint kb)
+{
+	gdouble t1, t2;
+
+	t1 = rspamd_get_ticks (FALSE);
+	RSPAMD_PROBE1 (gc__start, "step");
+	lua_gc (L, LUA_GCSTEP, kb);
+	RSPAMD_PROBE1 (gc__finish, "step");
+	t2 = rspamd_get_ticks (FALSE);
+
+	lua_gc_idle.stat.steps ++;
+	lua_gc_idle.stat.steps_time += t2 - t1;
+
+	if (t2 - t1 > lua_gc_idle.stat.max_step_time) {
+		lua_gc_idle.stat.max_step_time = t2 - t1;
+	}
+}
+
+static void
+rspamd_lua_gc_idle_cb (EV_P_ ev_idle *w, int revents)
+{
+	struct rspamd_lua_gc_idle *gci = (struct rspamd_lua_gc_idle *)w->data;
+	struct rspamd_config *cfg = gci->cfg;
+	guint kb = MIN (gci->pending, cfg->lua_gc_task_step);
+
+	rspamd_lua_gc_step (cfg->lua_state, kb);
+	gci->pending -= kb;
+
+	if (gci->pending == 0) {
+		ev_idle_stop (EV_A_ w);
+	}
+}
+
+void
+rspamd_lua_gc_task_step (struct rspamd_config *cfg, struct ev_loop *event_loop)
+{
+	struct rspamd_lua_gc_idle *gci = &lua_gc_idle;
+
+	if (cfg->lua_gc_task_step == 0 || cfg->lua_state == NULL) {
+		return;
+	}
+
+	if (event_loop == NULL) {
+		rspamd_lua_gc_step (cfg->lua_state, cfg->lua_gc_task_step);
+
+		return;
+	}
+
+	if (ev_is_active (&gci->ev) &&
+			(gci->event_loop != event_loop || gci->cfg != cfg)) {
+		ev_idle_stop (gci->event_loop, &gci->ev);
+		gci->pending = 0;
+	}
+
+	/* Do not accumulate more work than a few tasks produce */
+	gci->pending = MIN (gci->pending + cfg->lua_gc_task_step,
+			cfg->lua_gc_task_step * 8);
+
+	if (!ev_is_active (&gci->ev)) {
+		gci->event_loop = event_loop;
+		gci->cfg = cfg;
+		ev_idle_init (&gci->ev, rspamd_lua_gc_idle_cb);
+		gci->ev.data = gci;
+		ev_idle_start (event_loop, &gci->ev);
+	}
+}
+
+void
+rspamd_lua_get_gc_stat (struct rspamd_config *cfg, struct rspamd_lua_gc_stat *st)
+{
+	lua_State *L = (lua_State *)cfg->lua_state;
+
+	memcpy (st, &lua_gc_idle.stat, sizeof (*st));
+	st->heap_size = (gsize)lua_gc (L, LUA_GCCOUNT, 0) * 1024 +
+			lua_gc (L, LUA_GCCOUNTB, 0);
+	st->pending = lua_gc_idle.pending;
+}
+
 /**
  * Initialize new locked lua_State structure
  */
@@ -1110,6 +1234,278 @@ rspamd_plugins_table_push_elt (lua_State *L, const gchar *field_name,
 	}
 }
 
+#define RSPAMD_LUA_BYTECODE_CACHE_KEY "rspamd_lua_bytecode_cache"
+
+#ifdef WITH_LUAJIT
+#define RSPAMD_LUA_BYTECODE_VERSION LUAJIT_VERSION
+#else
+#define RSPAMD_LUA_BYTECODE_VERSION LUA_RELEASE
+#endif
+
+static int
+rspamd_lua_bytecode_writer (lua_State *L, const void *p, size_t sz, void *ud)
+{
+	GByteArray *ba = (GByteArray *)ud;
+
+	g_byte_array_append (ba, p, sz);
+
+	return 0;
+}
+
+static void
+rspamd_lua_bytecode_save (lua_State *L, const gchar *path)
+{
+	GByteArray *ba;
+	gchar tpath[PATH_MAX];
+	gint fd;
+
+	ba = g_byte_array_new ();
+#if LUA_VERSION_NUM >= 503
+	lua_dump (L, rspamd_lua_bytecode_writer, ba, 0);
+#else
+	lua_dump (L, rspamd_lua_bytecode_writer, ba);
+#endif
+
+	if (ba->len == 0) {
+		g_byte_array_free (ba, TRUE);
+
+		return;
+	}
+
+	/* Write to a temporary file and move it in place atomically */
+	rspamd_snprintf (tpath, sizeof (tpath), "%s.%P.tmp", path, getpid ());
+	fd = open (tpath, O_CREAT|O_EXCL|O_WRONLY, 00644);
+
+	if (fd == -1) {
+		msg_debug ("cannot create lua bytecode cache %s: %s", tpath,
+				strerror (errno));
+		g_byte_array_free (ba, TRUE);
+
+		return;
+	}
+
+	if (write (fd, ba->data, ba->len) != (gssize)ba->len ||
+			rename (tpath, path) == -1) {
+		msg_warn ("cannot save lua bytecode cache to %s: %s", path,
+				strerror (errno));
+		unlink (tpath);
+	}
+
+	close (fd);
+	g_byte_array_free (ba, TRUE);
+}
+
+gint
+rspamd_lua_load_cached (lua_State *L, const gchar *data, gsize len,
+		const gchar *chunkname)
+{
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash[rspamd_cryptobox_HASHBYTES];
+	gchar path[PATH_MAX];
+	const gchar *cache_dir;
+	guint8 *map;
+	gsize map_len;
+	gint ret;
+
+	lua_getfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_BYTECODE_CACHE_KEY);
+	cache_dir = lua_tostring (L, -1);
+	lua_pop (L, 1);
+
+	if (cache_dir == NULL) {
+		return luaL_loadbuffer (L, data, len, chunkname);
+	}
+
+	/*
+	 * Bytecode format depends on the interpreter version and chunk name is
+	 * stored in the debug info, so both are part of the key as well as the
+	 * source itself
+	 */
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)data, len);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)chunkname,
+			strlen (chunkname));
+	rspamd_cryptobox_hash_update (&st, (const guchar *)RSPAMD_LUA_BYTECODE_VERSION,
+			sizeof (RSPAMD_LUA_BYTECODE_VERSION) - 1);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)RVERSION,
+			sizeof (RVERSION) - 1);
+	rspamd_cryptobox_hash_final (&st, hash);
+
+	/* cache_dir is still referenced from the registry */
+	rspamd_snprintf (path, sizeof (path), "%s/%*xs.luac", cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+	map = rspamd_file_xmap (path, PROT_READ, &map_len, TRUE);
+
+	if (map != NULL) {
+		/* Both Lua and LuaJIT bytecode starts with ESC */
+		if (map_len > 0 && map[0] == '\033') {
+			if (luaL_loadbuffer (L, (const gchar *)map, map_len, chunkname) == 0) {
+				munmap (map, map_len);
+
+				return 0;
+			}
+
+			lua_pop (L, 1); /* Error message */
+		}
+
+		msg_info ("invalid lua bytecode cache %s for %s, removing it",
+				path, chunkname);
+		munmap (map, map_len);
+		unlink (path);
+	}
+
+	ret = luaL_loadbuffer (L, data, len, chunkname);
+
+	if (ret == 0) {
+		rspamd_lua_bytecode_save (L, path);
+	}
+
+	return ret;
+}
+
+/*
+ * Replacement of the standard Lua file searcher that loads modules via
+ * bytecode cache
+ */
+static gint
+rspamd_lua_cached_searcher (lua_State *L)
+{
+	const gchar *name = luaL_checkstring (L, 1), *path, *cur, *end;
+	GString *fname, *modname;
+	gchar *chunkname;
+	guint8 *data;
+	gsize len;
+	gint ret;
+
+	lua_getglobal (L, "package");
+	lua_getfield (L, -1, "path");
+	path = lua_tostring (L, -1);
+
+	if (path == NULL) {
+		lua_pop (L, 2);
+
+		return 0;
+	}
+
+	modname = g_string_new (name);
+
+	for (gsize i = 0; i < modname->len; i ++) {
+		if (modname->str[i] == '.') {
+			modname->str[i] = G_DIR_SEPARATOR;
+		}
+	}
+
+	fname = g_string_sized_new (PATH_MAX);
+	cur = path;
+
+	while (*cur) {
+		end = strchr (cur, ';');
+
+		if (end == NULL) {
+			end = cur + strlen (cur);
+		}
+
+		g_string_truncate (fname, 0);
+
+		for (const gchar *c = cur; c < end; c ++) {
+			if (*c == '?') {
+				g_string_append_len (fname, modname->str, modname->len);
+			}
+			else {
+				g_string_append_c (fname, *c);
+			}
+		}
+
+		if (fname->len > 0 && access (fname->str, R_OK) == 0) {
+			break;
+		}
+
+		g_string_truncate (fname, 0);
+		cur = *end ? end + 1 : end;
+	}
+
+	lua_pop (L, 2);
+	g_string_free (modname, TRUE);
+
+	if (fname->len == 0) {
+		g_string_free (fname, TRUE);
+
+		/* Let the default searchers report an error */
+		return 0;
+	}
+
+	data = rspamd_file_xmap (fname->str, PROT_READ, &len, TRUE);
+
+	if (data == NULL) {
+		g_string_free (fname, TRUE);
+
+		return 0;
+	}
+
+	chunkname = g_strdup_printf ("@%s", fname->str);
+	ret = rspamd_lua_load_cached (L, (const gchar *)data, len, chunkname);
+	munmap (data, len);
+	g_free (chunkname);
+
+	if (ret != 0) {
+		lua_pushfstring (L, "error loading module '%s' from file '%s':\n\t%s",
+				name, fname->str, lua_tostring (L, -1));
+		g_string_free (fname, TRUE);
+
+		return lua_error (L);
+	}
+
+	lua_pushstring (L, fname->str);
+	g_string_free (fname, TRUE);
+
+	return 2;
+}
+
+void
+rspamd_lua_enable_bytecode_cache (lua_State *L, const gchar *cache_dir)
+{
+	const gchar *searchers_name;
+	gint n;
+
+	lua_getfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_BYTECODE_CACHE_KEY);
+
+	if (!lua_isnil (L, -1)) {
+		/* Already enabled, just update the directory */
+		lua_pop (L, 1);
+		lua_pushstring (L, cache_dir);
+		lua_setfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_BYTECODE_CACHE_KEY);
+
+		return;
+	}
+
+	lua_pop (L, 1);
+	lua_pushstring (L, cache_dir);
+	lua_setfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_BYTECODE_CACHE_KEY);
+
+#if LUA_VERSION_NUM >= 502
+	searchers_name = "searchers";
+#else
+	searchers_name = "loaders";
+#endif
+
+	lua_getglobal (L, "package");
+	lua_getfield (L, -1, searchers_name);
+
+	if (lua_istable (L, -1)) {
+		/* Insert our searcher after the preload one (index 1) */
+		n = rspamd_lua_table_size (L, -1);
+
+		for (gint i = n; i >= 2; i --) {
+			lua_rawgeti (L, -1, i);
+			lua_rawseti (L, -2, i + 1);
+		}
+
+		lua_pushcfunction (L, rspamd_lua_cached_searcher);
+		lua_rawseti (L, -2, 2);
+	}
+
+	lua_pop (L, 2);
+}
+
 gboolean
 rspamd_init_lua_filters (struct rspamd_config *cfg, bool force_load, bool strict)
 {
@@ -1173,7 +1569,7 @@ rspamd_init_lua_filters (struct rspamd_config *cfg, bool force_load, bool strict
 			rspamd_snprintf (lua_fname, strlen (module->path) + 2, "@%s",
 				module->path);
 
-			if (luaL_loadbuffer (L, data, fsize, lua_fname) != 0) {
+			if (rspamd_lua_load_cached (L, data, fsize, lua_fname) != 0) {
 				msg_err_config ("load of %s failed: %s", module->path,
 					lua_tostring (L, -1));
 				lua_settop (L, err_idx - 1); /*  Error function */
@@ -133,6 +133,7 @@ enum rspamd_lua_map_type {
 	RSPAMD_LUA_MAP_REGEXP_MULTIPLE,
 	RSPAMD_LUA_MAP_CALLBACK,
 	RSPAMD_LUA_MAP_CDB,
+	RSPAMD_LUA_MAP_DOMAIN_SUFFIX,
 	RSPAMD_LUA_MAP_UNKNOWN,
 };
 
@@ -212,6 +213,33 @@ lua_State *rspamd_lua_init (bool wipe_mem);
 
 void rspamd_lua_start_gc (struct rspamd_config *cfg);
 
+struct rspamd_lua_gc_stat {
+	gsize heap_size;
+	guint64 steps;
+	gdouble steps_time;
+	gdouble max_step_time;
+	guint pending;
+	gboolean generational;
+};
+
+/**
+ * Sets gc mode: `incremental` (default) or `generational` (Lua 5.4 only)
+ */
+void rspamd_lua_set_gc_mode (struct rspamd_config *cfg, const gchar *mode);
+
+/**
+ * Schedules incremental gc step of `lua_gc_task_step` KB to be performed when
+ * the event loop is idle, should be called when a task is finished
+ */
+void rspamd_lua_gc_task_step (struct rspamd_config *cfg,
+		struct ev_loop *event_loop);
+
+/**
+ * Returns Lua heap size and statistics of task gc steps
+ */
+void rspamd_lua_get_gc_stat (struct rspamd_config *cfg,
+		struct rspamd_lua_gc_stat *st);
+
 /**
  * Sets field in a global variable
  * @param L
@@ -223,6 +251,22 @@ void
 rspamd_plugins_table_push_elt (lua_State *L, const gchar *field_name,
 							   const gchar *new_elt);
 
+/**
+ * Loads a chunk like `luaL_loadbuffer` but uses bytecode cache if it has been
+ * enabled by `rspamd_lua_enable_bytecode_cache`. Cache entries are keyed by
+ * the hash of the source, chunk name and Lua version, so changed files
+ * are always recompiled
+ * @return status of `luaL_loadbuffer`
+ */
+gint rspamd_lua_load_cached (lua_State *L, const gchar *data, gsize len,
+		const gchar *chunkname);
+
+/**
+ * Stores compiled bytecode of plugins and modules loaded via `require`
+ * in `cache_dir` and loads them from there when the sources are unchanged
+ */
+void rspamd_lua_enable_bytecode_cache (lua_State *L, const gchar *cache_dir);
+
 /**
  * Load and initialize lua plugins
  */
@@ -263,6 +307,16 @@ struct rspamd_lua_text *lua_check_text (lua_State *L, gint pos);
  * @return
  */
 struct rspamd_lua_text *lua_check_text_or_string (lua_State *L, gint pos);
+
+/**
+ * Returns data of a string or a text at the specified position without copying.
+ * Unlike `lua_check_text_or_string` it can be used for several arguments at once
+ * @param L
+ * @param pos
+ * @param len output length
+ * @return pointer to data or NULL if an argument is neither text nor string
+ */
+const gchar *lua_check_lstring_or_text (lua_State *L, gint pos, gsize *len);
 /* Creates and *pushes* new rspamd text, data is copied if  RSPAMD_TEXT_FLAG_OWN is in flags*/
 struct rspamd_lua_text *lua_new_text (lua_State *L, const gchar *start,
 		gsize len, gboolean own);
@@ -387,6 +441,8 @@ void luaopen_tensor (lua_State *L);
 
 void luaopen_parsers (lua_State *L);
 
+void luaopen_shm_cache (lua_State *L);
+
 void rspamd_lua_dostring (const gchar *line);
 
 double rspamd_lua_normalize (struct rspamd_config *cfg,
@@ -165,6 +165,7 @@ end
  *   + `radix`: map of IP addresses to strings
  *   + `map`: map of strings to strings
  *   + `regexp`: map of regexps to strings
+ *   + `domain_suffix`: map of domains to strings matching subdomains as well
  *   + `callback`: map processed by lua callback
  * - `url`: url to load map from
  * - `description`: map's description
@@ -210,7 +211,10 @@ LUA_FUNCTION_DEF (config, get_classifier);
  *     + `trivial` symbol is trivial (e.g. no network requests)
  *     + `explicit_disable` requires explicit disabling (e.g. via settings)
  *     + `ignore_passthrough` executed even if passthrough result has been set
+ *     + `cpu_parallel` symbol can offload its C work to the cpu pool
  * - `parent`: id of parent symbol (useful for virtual symbols)
+ * - `trigger_symbols`: list of symbols, a postfilter is executed only if any of them is inserted
+ * - `trigger_actions`: list of actions, a postfilter is executed only if any of them is reached
  *
  * @return {number} id of symbol registered
  */
@@ -558,7 +562,7 @@ LUA_FUNCTION_DEF (config, replace_regexp);
  * of script function depends on worker type
  * @param {string} worker_type worker type (e.g. "normal")
  * @param {function} script script for a worker
- * @return {boolean} `true` if a script has been registered
+ * @return {boolean} `true` if a script has been registered for some enabled worker
  */
 LUA_FUNCTION_DEF (config, register_worker_script);
 
@@ -782,6 +786,22 @@ LUA_FUNCTION_DEF (config, has_torch);
  */
 LUA_FUNCTION_DEF (config, experimental_enabled);
 
+/***
+ * @method rspamd_config:get_lua_threads_stat()
+ * Returns statistics of the Lua threads (coroutines) pool of this worker
+ * @return {table} table with fields `created`, `reused`, `destroyed`, `peak`,
+ * `running`, `cached` and `max_items` (current size limit of the pool)
+ */
+LUA_FUNCTION_DEF (config, get_lua_threads_stat);
+
+/***
+ * @method rspamd_config:get_lua_gc_stat()
+ * Returns Lua heap size and statistics of gc steps performed after tasks
+ * @return {table} table with fields `heap_size` (bytes), `mode`, `steps`,
+ * `steps_time` and `max_step_time` (seconds), `pending` (KB)
+ */
+LUA_FUNCTION_DEF (config, get_lua_gc_stat);
+
 /***
  * @method rspamd_config:load_ucl(filename[, include_trace])
  * Loads config from the UCL file (but does not perform parsing using rcl)
@@ -897,6 +917,8 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, get_cpu_flags),
 	LUA_INTERFACE_DEF (config, has_torch),
 	LUA_INTERFACE_DEF (config, experimental_enabled),
+	LUA_INTERFACE_DEF (config, get_lua_threads_stat),
+	LUA_INTERFACE_DEF (config, get_lua_gc_stat),
 	LUA_INTERFACE_DEF (config, load_ucl),
 	LUA_INTERFACE_DEF (config, parse_rcl),
 	LUA_INTERFACE_DEF (config, init_modules),
@@ -1792,6 +1814,9 @@ lua_parse_symbol_flags (const gchar *str)
 		if (strstr (str, "coro") != NULL) {
 			ret |= SYMBOL_TYPE_USE_CORO;
 		}
+		if (strstr (str, "cpu_parallel") != NULL) {
+			ret |= SYMBOL_TYPE_CPU_PARALLEL;
+		}
 	}
 
 	return ret;
@@ -1935,6 +1960,10 @@ lua_push_symbol_flags (lua_State *L, guint flags, enum lua_push_symbol_flags_opt
 	if (flags & SYMBOL_TYPE_COMPOSITE) {
 		LUA_OPTION_PUSH (composite);
 	}
+
+	if (flags & SYMBOL_TYPE_CPU_PARALLEL) {
+		LUA_OPTION_PUSH (cpu_parallel);
+	}
 }
 
 static gint
@@ -2059,6 +2088,45 @@ lua_config_register_symbol (lua_State * L)
 				allowed_ids, forbidden_ids,
 				FALSE);
 
+		if (ret != -1 && (type & SYMBOL_TYPE_POSTFILTER)) {
+			lua_pushstring (L, "trigger_symbols");
+			lua_gettable (L, 2);
+
+			if (lua_istable (L, -1)) {
+				for (lua_pushnil (L); lua_next (L, -2); lua_pop (L, 1)) {
+					if (lua_isstring (L, -1)) {
+						rspamd_symcache_add_symbol_trigger (cfg->cache, name,
+								lua_tostring (L, -1));
+					}
+					else {
+						return luaL_error (L, "invalid trigger_symbols element");
+					}
+				}
+			}
+
+			lua_pop (L, 1);
+
+			lua_pushstring (L, "trigger_actions");
+			lua_gettable (L, 2);
+
+			if (lua_istable (L, -1)) {
+				gint act;
+
+				for (lua_pushnil (L); lua_next (L, -2); lua_pop (L, 1)) {
+					if (lua_isstring (L, -1) &&
+							rspamd_action_from_str (lua_tostring (L, -1), &act)) {
+						rspamd_symcache_add_action_trigger (cfg->cache, name,
+								act);
+					}
+					else {
+						return luaL_error (L, "invalid trigger_actions element");
+					}
+				}
+			}
+
+			lua_pop (L, 1);
+		}
+
 		if (!isnan (score) || group) {
 			if (one_shot) {
 				nshots = 1;
@@ -3122,6 +3190,11 @@ lua_config_register_worker_script (lua_State *L)
 		cf = cur->data;
 		wtype = g_quark_to_string (cf->type);
 
+		if (!cf->enabled || cf->count <= 0) {
+			/* Such a worker is never started */
+			continue;
+		}
+
 		if (g_ascii_strcasecmp (wtype, worker_type) == 0) {
 			sc = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*sc));
 			lua_pushvalue (L, 3);
@@ -4180,6 +4253,68 @@ lua_config_experimental_enabled (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_config_get_lua_threads_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	struct lua_thread_pool_stat st;
+
+	if (cfg != NULL && cfg->lua_thread_pool) {
+		lua_thread_pool_get_stat (cfg->lua_thread_pool, &st);
+		lua_createtable (L, 0, 7);
+		lua_pushinteger (L, st.created);
+		lua_setfield (L, -2, "created");
+		lua_pushinteger (L, st.reused);
+		lua_setfield (L, -2, "reused");
+		lua_pushinteger (L, st.destroyed);
+		lua_setfield (L, -2, "destroyed");
+		lua_pushinteger (L, st.peak);
+		lua_setfield (L, -2, "peak");
+		lua_pushinteger (L, st.running);
+		lua_setfield (L, -2, "running");
+		lua_pushinteger (L, st.cached);
+		lua_setfield (L, -2, "cached");
+		lua_pushinteger (L, st.max_items);
+		lua_setfield (L, -2, "max_items");
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_config_get_lua_gc_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	struct rspamd_lua_gc_stat st;
+
+	if (cfg != NULL && cfg->lua_state) {
+		rspamd_lua_get_gc_stat (cfg, &st);
+		lua_createtable (L, 0, 6);
+		lua_pushinteger (L, st.heap_size);
+		lua_setfield (L, -2, "heap_size");
+		lua_pushstring (L, st.generational ? "generational" : "incremental");
+		lua_setfield (L, -2, "mode");
+		lua_pushinteger (L, st.steps);
+		lua_setfield (L, -2, "steps");
+		lua_pushnumber (L, st.steps_time);
+		lua_setfield (L, -2, "steps_time");
+		lua_pushnumber (L, st.max_step_time);
+		lua_setfield (L, -2, "max_step_time");
+		lua_pushinteger (L, st.pending);
+		lua_setfield (L, -2, "pending");
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 struct rspamd_lua_include_trace_cbdata {
 	lua_State *L;
 	gint cbref;
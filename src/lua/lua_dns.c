@@ -16,9 +16,11 @@
 #include "lua_thread_pool.h"
 
 LUA_FUNCTION_DEF (dns, request);
+LUA_FUNCTION_DEF (dns, batch);
 
 static const struct luaL_reg dns_f[] = {
 		LUA_INTERFACE_DEF (dns, request),
+		LUA_INTERFACE_DEF (dns, batch),
 		{"__tostring", rspamd_lua_class_tostring},
 		{NULL, NULL}
 };
@@ -182,6 +184,244 @@ lua_dns_callback (struct rdns_reply *reply, void *arg)
 	}
 }
 
+/*
+ * Batch of requests shares a single coroutine resume and a single
+ * symcache async event
+ */
+struct lua_rspamd_dns_batch_cbdata {
+	struct thread_entry *thread;
+	struct rspamd_task *task;
+	struct rspamd_symcache_item *item;
+	gint results_ref;
+	guint pending;
+};
+
+struct lua_rspamd_dns_batch_elt {
+	struct lua_rspamd_dns_batch_cbdata *batch;
+	guint idx;
+};
+
+static void
+lua_dns_batch_set_error (lua_State *L, gint results_ref, guint idx,
+		const gchar *err)
+{
+	lua_rawgeti (L, LUA_REGISTRYINDEX, results_ref);
+	lua_createtable (L, 0, 2);
+	lua_pushboolean (L, false);
+	lua_setfield (L, -2, "ok");
+	lua_pushstring (L, err);
+	lua_setfield (L, -2, "error");
+	lua_rawseti (L, -2, idx + 1);
+	lua_pop (L, 1);
+}
+
+static void
+lua_dns_batch_callback (struct rdns_reply *reply, void *arg)
+{
+	struct lua_rspamd_dns_batch_elt *elt = arg;
+	struct lua_rspamd_dns_batch_cbdata *batch = elt->batch;
+	lua_State *L = batch->thread->lua_state;
+
+	if (reply->code != RDNS_RC_NOERROR) {
+		lua_dns_batch_set_error (L, batch->results_ref, elt->idx,
+				rdns_strerror (reply->code));
+	}
+	else {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, batch->results_ref);
+		lua_createtable (L, 0, 2);
+		lua_pushboolean (L, true);
+		lua_setfield (L, -2, "ok");
+		lua_push_dns_reply (L, reply);
+		lua_pushboolean (L, reply->authenticated);
+		lua_setfield (L, -2, "authenticated");
+		lua_setfield (L, -2, "result");
+		lua_rawseti (L, -2, elt->idx + 1);
+		lua_pop (L, 1);
+	}
+
+	if (--batch->pending == 0) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, batch->results_ref);
+		luaL_unref (L, LUA_REGISTRYINDEX, batch->results_ref);
+		lua_thread_resume (batch->thread, 1);
+
+		if (batch->item) {
+			rspamd_symcache_item_async_dec_check (batch->task, batch->item, M);
+		}
+	}
+}
+
+/***
+ * @function rspamd_dns.batch({params})
+ * Resolves several names concurrently and resumes the current coroutine once,
+ * when all replies are received. Params are `task` (or `session` and `config`),
+ * `forced` and `requests`: an array of `{name = ..., type = ...}` tables
+ * (type is `a` by default)
+ * @return {table} array of `{ok = true, result = replies}` or `{ok = false, error = str}` in order of requests
+ */
+static gint
+lua_dns_batch (lua_State *L)
+{
+	GError *err = NULL;
+	struct rspamd_async_session *session = NULL;
+	struct rspamd_config *cfg = NULL;
+	struct rspamd_task *task = NULL;
+	struct lua_rspamd_dns_batch_cbdata *batch;
+	struct lua_rspamd_dns_batch_elt *elt;
+	rspamd_mempool_t *pool = NULL;
+	gboolean forced = FALSE;
+	gint ret, nreqs;
+
+	if (!rspamd_lua_parse_table_arguments (L, 1, &err,
+			RSPAMD_LUA_PARSE_ARGUMENTS_IGNORE_MISSING,
+			"task=U{task};forced=B;session=U{session};config=U{config}",
+			&task,
+			&forced,
+			&session,
+			&cfg)) {
+
+		if (err) {
+			ret = luaL_error (L, "invalid arguments: %s", err->message);
+			g_error_free (err);
+
+			return ret;
+		}
+
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (task) {
+		session = task->s;
+		pool = task->task_pool;
+		cfg = task->cfg;
+	}
+	else if (session && cfg) {
+		pool = cfg->cfg_pool;
+	}
+	else {
+		return luaL_error (L, "invalid arguments: either task or session/config should be set");
+	}
+
+	lua_getfield (L, 1, "requests");
+
+	if (!lua_istable (L, -1)) {
+		return luaL_error (L, "invalid arguments: requests table is required");
+	}
+
+	nreqs = rspamd_lua_table_size (L, -1);
+	batch = rspamd_mempool_alloc0 (pool, sizeof (*batch));
+	batch->task = task;
+	batch->thread = lua_thread_pool_get_running_entry (cfg->lua_thread_pool);
+	lua_createtable (L, nreqs, 0);
+	batch->results_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	/* Guard against callbacks called before all requests are sent */
+	batch->pending = 1;
+
+	for (gint i = 0; i < nreqs; i ++) {
+		const gchar *to_resolve = NULL, *type_str = "a";
+		enum rdns_request_type type;
+
+		lua_rawgeti (L, -1, i + 1);
+
+		if (lua_istable (L, -1)) {
+			lua_getfield (L, -1, "name");
+			to_resolve = lua_tostring (L, -1);
+			lua_pop (L, 1);
+
+			lua_getfield (L, -1, "type");
+			if (lua_isstring (L, -1)) {
+				type_str = lua_tostring (L, -1);
+			}
+			lua_pop (L, 1);
+		}
+
+		lua_pop (L, 1);
+
+		if (to_resolve == NULL) {
+			lua_dns_batch_set_error (L, batch->results_ref, i,
+					"invalid request: name is missing");
+			continue;
+		}
+
+		type = rdns_type_fromstr (type_str);
+
+		if (type == RDNS_REQUEST_INVALID) {
+			lua_dns_batch_set_error (L, batch->results_ref, i,
+					"invalid request: this record type is not supported");
+			continue;
+		}
+
+		if (type == RDNS_REQUEST_PTR) {
+			char *ptr_str = rdns_generate_ptr_from_str (to_resolve);
+
+			if (ptr_str == NULL) {
+				lua_dns_batch_set_error (L, batch->results_ref, i,
+						"wrong resolve string to PTR request");
+				continue;
+			}
+
+			to_resolve = rspamd_mempool_strdup (pool, ptr_str);
+			free (ptr_str);
+		}
+		else {
+			/* Lua string could be collected before the request is sent */
+			to_resolve = rspamd_mempool_strdup (pool, to_resolve);
+		}
+
+		elt = rspamd_mempool_alloc (pool, sizeof (*elt));
+		elt->batch = batch;
+		elt->idx = i;
+
+		if (task == NULL) {
+			ret = (rspamd_dns_resolver_request (cfg->dns_resolver,
+					session,
+					pool,
+					lua_dns_batch_callback,
+					elt,
+					type,
+					to_resolve) != NULL);
+		}
+		else if (forced) {
+			ret = rspamd_dns_resolver_request_task_forced (task,
+					lua_dns_batch_callback,
+					elt,
+					type,
+					to_resolve);
+		}
+		else {
+			ret = rspamd_dns_resolver_request_task (task,
+					lua_dns_batch_callback,
+					elt,
+					type,
+					to_resolve);
+		}
+
+		if (ret) {
+			batch->pending ++;
+		}
+		else {
+			lua_dns_batch_set_error (L, batch->results_ref, i,
+					"cannot make request");
+		}
+	}
+
+	lua_pop (L, 1); /* Requests table */
+
+	if (--batch->pending == 0) {
+		/* Nothing has been sent */
+		lua_rawgeti (L, LUA_REGISTRYINDEX, batch->results_ref);
+		luaL_unref (L, LUA_REGISTRYINDEX, batch->results_ref);
+
+		return 1;
+	}
+
+	if (task) {
+		batch->item = rspamd_symcache_get_cur_item (task);
+		rspamd_symcache_item_async_inc (task, batch->item, M);
+	}
+
+	return lua_thread_yield (batch->thread, 0);
+}
+
 static gint
 lua_load_dns (lua_State *L)
 {
@@ -68,6 +68,8 @@ LUA_FUNCTION_DEF (html, has_tag);
  * - `unknown_element` - part has some unknown elements
  * - `duplicate_element` - part has some duplicate elements that should be unique (namely, `title` tag)
  * - `unbalanced` - part has unbalanced tags
+ * - `too_many_tags` - part has more tags than allowed by `html_max_tags`
+ * - `truncated` - parsing has been stopped by depth or time limits
  * @param {string} name name of property
  * @return {boolean} true if the part has the specified property
  */
@@ -235,6 +237,8 @@ lua_html_has_property (lua_State *L)
 		 * - `duplicate_element`
 		 * - `unbalanced`
 		 * - `data_urls`
+		 * - `too_many_tags`
+		 * - `truncated`
 		 */
 		if (strcmp (propname, "no_html") == 0) {
 			ret = hc->flags & RSPAMD_HTML_FLAG_BAD_START;
@@ -257,6 +261,12 @@ lua_html_has_property (lua_State *L)
 		else if (strcmp (propname, "data_urls") == 0) {
 			ret = hc->flags & RSPAMD_HTML_FLAG_HAS_DATA_URLS;
 		}
+		else if (strcmp (propname, "too_many_tags") == 0) {
+			ret = hc->flags & RSPAMD_HTML_FLAG_TOO_MANY_TAGS;
+		}
+		else if (strcmp (propname, "truncated") == 0) {
+			ret = hc->flags & RSPAMD_HTML_FLAG_TRUNCATED;
+		}
 	}
 
 	lua_pushboolean (L, ret);
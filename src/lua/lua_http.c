@@ -16,8 +16,12 @@
 #include "lua_common.h"
 #include "lua_thread_pool.h"
 #include "libserver/http/http_private.h"
+#include "libserver/http/http_context.h"
+#include "libserver/net_replay.h"
+#include "libutil/probes.h"
 #include "ref.h"
 #include "unix-std.h"
+#include "utlist.h"
 #include "zlib.h"
 
 /***
@@ -50,8 +54,18 @@ static const gchar *M = "rspamd lua http";
 
 LUA_FUNCTION_DEF (http, request);
 
+/***
+ * @function rspamd_http.keepalive_stat()
+ * Returns statistics of the keepalive pool of this process as a table:
+ * `reused`, `missed`, `pooled`, `expired` counters and number of `idle`
+ * connections
+ * @return {table} keepalive pool statistics
+ */
+LUA_FUNCTION_DEF (http, keepalive_stat);
+
 static const struct luaL_reg httplib_m[] = {
 	LUA_INTERFACE_DEF (http, request),
+	LUA_INTERFACE_DEF (http, keepalive_stat),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -83,6 +97,8 @@ struct lua_http_cbdata {
 	gint fd;
 	gint cbref;
 	struct thread_entry *thread;
+	gchar *replay_key;
+	ev_timer replay_ev;
 	ref_entry_t ref;
 };
 
@@ -142,12 +158,22 @@ lua_http_fin (gpointer arg)
 		rspamd_pubkey_unref (cbd->peer_pk);
 	}
 
+	if (cbd->replay_key) {
+		if (ev_can_stop (&cbd->replay_ev)) {
+			ev_timer_stop (cbd->event_loop, &cbd->replay_ev);
+		}
+
+		g_free (cbd->replay_key);
+	}
+
 	g_free (cbd);
 }
 
 static void
 lua_http_cbd_dtor (struct lua_http_cbdata *cbd)
 {
+	RSPAMD_PROBE2 (http__finish, cbd, cbd->url);
+
 	if (cbd->session) {
 
 		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_RESOLVED) {
@@ -216,18 +242,192 @@ lua_http_error_handler (struct rspamd_http_connection *conn, GError *err)
 	REF_RELEASE (cbd);
 }
 
+/*
+ * Replies are recorded as code, number of headers, headers as pairs of
+ * length prefixed names and values followed by body
+ */
+static inline void
+lua_http_replay_put (GString *out, const void *data, guint32 len)
+{
+	g_string_append_len (out, (const gchar *)&len, sizeof (len));
+	g_string_append_len (out, data, len);
+}
+
+static void
+lua_http_replay_record (struct lua_http_cbdata *cbd,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_http_header *h, *cur;
+	GString *out;
+	const gchar *body;
+	gsize body_len, nhdrs_pos;
+	guint32 code = msg->code, nhdrs = 0;
+
+	out = g_string_sized_new (256);
+	g_string_append_len (out, (const gchar *)&code, sizeof (code));
+	nhdrs_pos = out->len;
+	g_string_append_len (out, (const gchar *)&nhdrs, sizeof (nhdrs));
+
+	kh_foreach_value (msg->headers, h, {
+		DL_FOREACH (h, cur) {
+			lua_http_replay_put (out, cur->name.begin, cur->name.len);
+			lua_http_replay_put (out, cur->value.begin, cur->value.len);
+			nhdrs ++;
+		}
+	});
+
+	memcpy (out->str + nhdrs_pos, &nhdrs, sizeof (nhdrs));
+	body = rspamd_http_message_get_body (msg, &body_len);
+
+	if (body_len > 0) {
+		g_string_append_len (out, body, body_len);
+	}
+
+	rspamd_net_replay_record (RSPAMD_NET_REPLAY_HTTP, cbd->replay_key,
+			strlen (cbd->replay_key), out->str, out->len);
+	g_string_free (out, TRUE);
+}
+
+static inline gboolean
+lua_http_replay_get (const guchar **pos, const guchar *end,
+		const gchar **data, guint32 *len)
+{
+	if (end - *pos < (gssize)sizeof (*len)) {
+		return FALSE;
+	}
+
+	memcpy (len, *pos, sizeof (*len));
+	*pos += sizeof (*len);
+
+	if (end - *pos < (gssize)*len) {
+		return FALSE;
+	}
+
+	*data = (const gchar *)*pos;
+	*pos += *len;
+
+	return TRUE;
+}
+
+static struct rspamd_http_message *
+lua_http_replay_parse (const guchar *data, gsize datalen)
+{
+	struct rspamd_http_message *msg;
+	const guchar *p = data, *end = data + datalen;
+	const gchar *name, *value;
+	guint32 code, nhdrs, nlen, vlen, i;
+	gchar *hname;
+
+	if (datalen < sizeof (code) + sizeof (nhdrs)) {
+		return NULL;
+	}
+
+	memcpy (&code, p, sizeof (code));
+	p += sizeof (code);
+	memcpy (&nhdrs, p, sizeof (nhdrs));
+	p += sizeof (nhdrs);
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->code = code;
+
+	for (i = 0; i < nhdrs; i ++) {
+		if (!lua_http_replay_get (&p, end, &name, &nlen) ||
+				!lua_http_replay_get (&p, end, &value, &vlen)) {
+			rspamd_http_message_unref (msg);
+
+			return NULL;
+		}
+
+		hname = g_strndup (name, nlen);
+		rspamd_http_message_add_header_len (msg, hname, value, vlen);
+		g_free (hname);
+	}
+
+	if (p < end) {
+		rspamd_http_message_set_body (msg, (const gchar *)p, end - p);
+	}
+
+	return msg;
+}
+
+static int lua_http_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg);
+
+static void
+lua_http_replay_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)w->data;
+	struct rspamd_http_connection fake_conn;
+	struct rspamd_http_message *msg = NULL;
+	const guchar *data;
+	gsize datalen;
+	GError *err;
+
+	ev_timer_stop (EV_A_ w);
+	/* Handlers use merely user data of a connection */
+	memset (&fake_conn, 0, sizeof (fake_conn));
+	fake_conn.ud = cbd;
+
+	data = rspamd_net_replay_lookup (RSPAMD_NET_REPLAY_HTTP, cbd->replay_key,
+			strlen (cbd->replay_key), &datalen);
+
+	if (data) {
+		msg = lua_http_replay_parse (data, datalen);
+	}
+
+	if (msg == NULL) {
+		err = g_error_new (g_quark_from_static_string ("lua-http"), 404,
+				"request has not been recorded");
+		/* Both handlers might free cbd */
+		lua_http_error_handler (&fake_conn, err);
+		g_error_free (err);
+
+		return;
+	}
+
+	lua_http_finish_handler (&fake_conn, msg);
+	rspamd_http_message_unref (msg);
+}
+
+static void
+lua_http_replay_start (struct lua_http_cbdata *cbd)
+{
+	if (cbd->session) {
+		rspamd_session_add_event (cbd->session,
+				(event_finalizer_t) lua_http_fin, cbd,
+				M);
+		cbd->flags |= RSPAMD_LUA_HTTP_FLAG_RESOLVED;
+	}
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_inc (cbd->task, cbd->item, M);
+	}
+
+	/* Reply is delivered on the next loop iteration like a real one */
+	cbd->replay_ev.data = cbd;
+	ev_timer_init (&cbd->replay_ev, lua_http_replay_cb, 0.0, 0.0);
+	ev_timer_start (cbd->event_loop, &cbd->replay_ev);
+}
+
 static int
 lua_http_finish_handler (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg)
 {
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
 	struct rspamd_http_header *h;
+	struct rspamd_task *task = cbd->task;
 	const gchar *body;
 	gsize body_len;
+	gdouble cpu_start = 0;
 
 	struct lua_callback_state lcbd;
 	lua_State *L;
 
+	if (cbd->replay_key &&
+			rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_RECORD) {
+		lua_http_replay_record (cbd, msg);
+	}
+
 	if (cbd->cbref == -1) {
 		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_YIELDED) {
 			cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_YIELDED;
@@ -290,11 +490,19 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 		rspamd_symcache_set_cur_item (cbd->task, cbd->item);
 	}
 
+	if (task) {
+		cpu_start = rspamd_task_cpu_enter (task);
+	}
+
 	if (lua_pcall (L, 4, 0, 0) != 0) {
 		msg_info ("callback call failed: %s", lua_tostring (L, -1));
 		lua_pop (L, 1);
 	}
 
+	if (task) {
+		rspamd_task_cpu_leave (task, cpu_start);
+	}
+
 	REF_RELEASE (cbd);
 
 	lua_thread_pool_restore_callback (&lcbd);
@@ -397,7 +605,8 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 				lua_http_error_handler,
 				lua_http_finish_handler,
 				cbd->addr,
-				cbd->host);
+				cbd->host,
+				(cbd->msg->flags & RSPAMD_HTTP_FLAG_SSL) != 0);
 	}
 	else {
 		cbd->fd = -1;
@@ -561,7 +770,7 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {resolver} resolver to perform DNS-requests. Usually got from either `task` or `config`
  * @param {boolean} gzip if true, body of the requests will be compressed
  * @param {boolean} no_ssl_verify disable SSL peer checks
- * @param {boolean} keepalive enable keep-alive pool
+ * @param {boolean} keepalive enable keep-alive pool (connections are pooled per process by host, address and TLS usage)
  * @param {string} user for HTTP authentication
  * @param {string} password for HTTP authentication, only if "user" present
  * @return {boolean} `true`, in **async** mode, if a request has been successfully scheduled. If this value is `false` then some error occurred, the callback thus will not be called.
@@ -1026,7 +1235,29 @@ lua_http_request (lua_State *L)
 		cbd->session = session;
 	}
 
-	if (rspamd_parse_inet_address (&cbd->addr,
+	if (rspamd_net_replay_mode () != RSPAMD_NET_REPLAY_OFF) {
+		const gchar *req_body;
+		gsize req_len;
+		GString *replay_key;
+
+		/* Request body is hashed to distinguish e.g. different POST queries */
+		req_body = rspamd_http_message_get_body (msg, &req_len);
+		replay_key = g_string_sized_new (64);
+		rspamd_printf_gstring (replay_key, "%s %s %xL",
+				http_method_str (msg->method), cbd->url,
+				(gint64)rspamd_cryptobox_fast_hash_specific (
+						RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+						req_body, req_len, 0));
+		cbd->replay_key = g_string_free (replay_key, FALSE);
+	}
+
+	RSPAMD_PROBE2 (http__start, cbd, cbd->url);
+
+	if (rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_REPLAY) {
+		/* Neither DNS requests nor connections are made */
+		lua_http_replay_start (cbd);
+	}
+	else if (rspamd_parse_inet_address (&cbd->addr,
 			msg->host->str, msg->host->len, RSPAMD_INET_ADDRESS_PARSE_DEFAULT)) {
 		/* Host is numeric IP, no need to resolve */
 		gboolean ret;
@@ -1109,6 +1340,19 @@ lua_http_request (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_http_keepalive_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	ucl_object_t *obj;
+
+	obj = rspamd_http_context_keepalive_stat (rspamd_http_context_default ());
+	ucl_object_push_lua (L, obj, true);
+	ucl_object_unref (obj);
+
+	return 1;
+}
+
 static gint
 lua_load_http (lua_State * L)
 {
@@ -16,6 +16,7 @@
 
 #include "lua_common.h"
 #include "lua_tensor.h"
+#include "lua_thread_pool.h"
 #include "contrib/kann/kann.h"
 
 /***
@@ -146,11 +147,13 @@ LUA_FUNCTION_DEF (kann, destroy);
 LUA_FUNCTION_DEF (kann, save);
 LUA_FUNCTION_DEF (kann, train1);
 LUA_FUNCTION_DEF (kann, apply1);
+LUA_FUNCTION_DEF (kann, apply_batched);
 
 static luaL_reg rspamd_kann_m[] = {
 		LUA_INTERFACE_DEF (kann, save),
 		LUA_INTERFACE_DEF (kann, train1),
 		LUA_INTERFACE_DEF (kann, apply1),
+		LUA_INTERFACE_DEF (kann, apply_batched),
 		{"__gc", lua_kann_destroy},
 		{NULL, NULL},
 };
@@ -849,11 +852,14 @@ lua_kann_new_kann (lua_State *L)
 	return 1;
 }
 
+static void lua_kann_batches_remove (kann_t *k);
+
 static int
 lua_kann_destroy (lua_State *L)
 {
 	kann_t *k = lua_check_kann (L, 1);
 
+	lua_kann_batches_remove (k);
 	kann_delete (k);
 
 	return 0;
@@ -1031,6 +1037,7 @@ lua_kann_train1 (lua_State *L)
 	gint64 max_epoch = 25;
 	gint64 max_drop_streak = 10;
 	double frac_val = 0.1;
+	gint64 threads = 1;
 	gint cbref = -1;
 
 	if (k && lua_istable (L, 2) && lua_istable (L, 3)) {
@@ -1056,8 +1063,9 @@ lua_kann_train1 (lua_State *L)
 
 			if (!rspamd_lua_parse_table_arguments (L, 4, &err,
 					RSPAMD_LUA_PARSE_ARGUMENTS_IGNORE_MISSING,
-					"lr=N;mini_size=I;max_epoch=I;max_drop_streak=I;frac_val=N;cb=F;pca=u{tensor}",
-					&lr, &mini_size, &max_epoch, &max_drop_streak, &frac_val, &cbref, &pca)) {
+					"lr=N;mini_size=I;max_epoch=I;max_drop_streak=I;frac_val=N;cb=F;pca=u{tensor};threads=I",
+					&lr, &mini_size, &max_epoch, &max_drop_streak, &frac_val, &cbref, &pca,
+					&threads)) {
 				n = luaL_error (L, "invalid params: %s",
 						err ? err->message : "unknown error");
 				g_error_free (err);
@@ -1183,10 +1191,19 @@ lua_kann_train1 (lua_State *L)
 		cbd.k = k;
 		cbd.L = L;
 
+		if (threads > 1) {
+			/* Mini batches are split between threads */
+			kann_mt (k, threads, mini_size);
+		}
+
 		int niters = kann_train_fnn1 (k, lr,
 				mini_size, max_epoch, max_drop_streak,
 				frac_val, n, x, y, lua_kann_train_cb, &cbd);
 
+		if (threads > 1) {
+			kann_mt (k, 0, 0);
+		}
+
 		lua_pushinteger (L, niters);
 
 		FREE_VEC (x, n);
@@ -1265,7 +1282,7 @@ lua_kann_apply1 (lua_State *L)
 
 			kann_set_batch_size (k, 1);
 			if (pca) {
-				pca_out = g_malloc (sizeof (float) * n_in);
+				pca_out = g_malloc0 (sizeof (float) * n_in);
 
 				kad_sgemm_simple (0, 1, 1, n_in,
 						vec_len, vec, pca->data,
@@ -1333,4 +1350,433 @@ lua_kann_apply1 (lua_State *L)
 	}
 
 	return 1;
-}
\ No newline at end of file
+}
+
+/*
+ * Batched inference: requests from concurrent tasks for the same ANN (and the
+ * same PCA matrix) are accumulated in a matrix and evaluated by a single
+ * forward pass, so all matrix multiplications are done by sgemm for the
+ * whole batch. A batch is flushed when it is full or when the latency bound
+ * of its first request expires.
+ */
+#define KANN_BATCH_DEFAULT_TIMEOUT 0.002
+#define KANN_BATCH_DEFAULT_SIZE 32
+
+static const gchar *M = "rspamd lua kann";
+
+struct lua_kann_batch_key {
+	kann_t *k;
+	struct rspamd_lua_tensor *pca;
+};
+
+struct lua_kann_batch_req {
+	struct rspamd_task *task; /* NULL if a task has been terminated */
+	struct rspamd_symcache_item *item;
+	struct thread_entry *thread;
+	gint cbref;
+	gboolean want_tensor;
+};
+
+struct lua_kann_batch {
+	struct lua_kann_batch_key key;
+	struct rspamd_config *cfg;
+	struct ev_loop *event_loop;
+	ev_timer tm;
+	GPtrArray *reqs;
+	float *inputs;
+	guint nalloc;
+	gsize in_len;
+	gint kann_ref;
+	gint pca_ref;
+};
+
+static GHashTable *kann_batches = NULL;
+
+static guint
+lua_kann_batch_key_hash (gconstpointer p)
+{
+	const struct lua_kann_batch_key *key = p;
+
+	return g_direct_hash (key->k) ^ g_direct_hash (key->pca);
+}
+
+static gboolean
+lua_kann_batch_key_equal (gconstpointer a, gconstpointer b)
+{
+	const struct lua_kann_batch_key *k1 = a, *k2 = b;
+
+	return k1->k == k2->k && k1->pca == k2->pca;
+}
+
+static void
+lua_kann_batch_dtor (gpointer p)
+{
+	struct lua_kann_batch *batch = p;
+
+	/* Pending batches hold a reference to their ANN, so they are empty here */
+	g_assert (batch->reqs->len == 0);
+	ev_timer_stop (batch->event_loop, &batch->tm);
+	g_ptr_array_free (batch->reqs, TRUE);
+	g_free (batch->inputs);
+	g_free (batch);
+}
+
+static gboolean
+lua_kann_batch_match_kann (gpointer key, gpointer value, gpointer ud)
+{
+	return ((struct lua_kann_batch_key *)key)->k == ud;
+}
+
+static void
+lua_kann_batches_remove (kann_t *k)
+{
+	if (kann_batches) {
+		g_hash_table_foreach_remove (kann_batches, lua_kann_batch_match_kann, k);
+	}
+}
+
+static void
+lua_kann_batch_req_fin (gpointer ud)
+{
+	struct lua_kann_batch_req *req = ud;
+
+	if (req->cbref != -1 && req->task) {
+		luaL_unref (req->task->cfg->lua_state, LUA_REGISTRYINDEX, req->cbref);
+		req->cbref = -1;
+	}
+
+	req->task = NULL;
+}
+
+static void
+lua_kann_batch_push_output (lua_State *L, struct lua_kann_batch_req *req,
+		const float *out, gint outlen)
+{
+	if (req->want_tensor) {
+		struct rspamd_lua_tensor *t;
+
+		t = lua_newtensor (L, 1, &outlen, false, false);
+		memcpy (t->data, out, outlen * sizeof (float));
+	}
+	else {
+		lua_createtable (L, outlen, 0);
+
+		for (gint i = 0; i < outlen; i++) {
+			lua_pushnumber (L, out[i]);
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+}
+
+static void
+lua_kann_batch_deliver (struct lua_kann_batch *batch,
+		struct lua_kann_batch_req *req,
+		const float *out, gint outlen)
+{
+	struct rspamd_task *task = req->task;
+
+	if (req->item) {
+		rspamd_symcache_set_cur_item (task, req->item);
+	}
+
+	if (req->thread) {
+		lua_kann_batch_push_output (req->thread->lua_state, req, out, outlen);
+		lua_thread_resume (req->thread, 1);
+	}
+	else {
+		struct lua_callback_state cbs;
+		lua_State *L;
+		gint err_idx;
+
+		lua_thread_pool_prepare_callback (batch->cfg->lua_thread_pool, &cbs);
+		L = cbs.L;
+
+		lua_pushcfunction (L, &rspamd_lua_traceback);
+		err_idx = lua_gettop (L);
+		lua_rawgeti (L, LUA_REGISTRYINDEX, req->cbref);
+		lua_kann_batch_push_output (L, req, out, outlen);
+
+		if (lua_pcall (L, 1, 0, err_idx) != 0) {
+			msg_err_task ("call to batched kann callback failed: %s",
+					lua_tostring (L, -1));
+		}
+
+		lua_settop (L, err_idx - 1);
+		lua_thread_pool_restore_callback (&cbs);
+	}
+
+	if (req->item) {
+		rspamd_symcache_item_async_dec_check (task, req->item, M);
+	}
+
+	rspamd_session_remove_event (task->s, lua_kann_batch_req_fin, req);
+}
+
+static void
+lua_kann_batch_flush (struct lua_kann_batch *batch)
+{
+	GPtrArray *reqs = batch->reqs;
+	float *inputs = batch->inputs, *x, *pca_out = NULL, *outputs;
+	struct rspamd_lua_tensor *pca = batch->key.pca;
+	kann_t *k = batch->key.k;
+	lua_State *L = batch->cfg->lua_state;
+	gint n = reqs->len, n_in, i_out, outlen, kann_ref, pca_ref;
+	struct lua_kann_batch_req *req;
+	guint i;
+
+	ev_timer_stop (batch->event_loop, &batch->tm);
+
+	if (n == 0) {
+		return;
+	}
+
+	/*
+	 * Detach the current batch, as callbacks could add new requests
+	 * and even use the same ANN for other evaluations
+	 */
+	kann_ref = batch->kann_ref;
+	pca_ref = batch->pca_ref;
+	batch->reqs = g_ptr_array_sized_new (reqs->len);
+	batch->inputs = NULL;
+	batch->nalloc = 0;
+	batch->kann_ref = -1;
+	batch->pca_ref = -1;
+
+	n_in = kann_dim_in (k);
+	i_out = kann_find (k, KANN_F_OUT, 0);
+	x = inputs;
+
+	if (pca) {
+		/* sgemm accumulates into the output matrix */
+		pca_out = g_malloc0 (sizeof (float) * n * n_in);
+		kad_sgemm_simple (0, 1, n, n_in, batch->in_len, inputs, pca->data,
+				pca_out);
+		x = pca_out;
+	}
+
+	kann_set_batch_size (k, n);
+	kann_feed_bind (k, KANN_F_IN, 0, &x);
+	kad_eval_at (k->n, k->v, i_out);
+
+	outlen = kad_len (k->v[i_out]) / n;
+	outputs = g_malloc (sizeof (float) * outlen * n);
+	memcpy (outputs, k->v[i_out]->x, sizeof (float) * outlen * n);
+	g_free (pca_out);
+	g_free (inputs);
+
+	PTR_ARRAY_FOREACH (reqs, i, req) {
+		if (req->task) {
+			lua_kann_batch_deliver (batch, req, outputs + i * outlen, outlen);
+		}
+
+		g_free (req);
+	}
+
+	g_ptr_array_free (reqs, TRUE);
+	g_free (outputs);
+
+	if (pca_ref != -1) {
+		luaL_unref (L, LUA_REGISTRYINDEX, pca_ref);
+	}
+
+	/* Can destroy the ANN and the batch itself */
+	luaL_unref (L, LUA_REGISTRYINDEX, kann_ref);
+}
+
+static void
+lua_kann_batch_timer_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct lua_kann_batch *batch = (struct lua_kann_batch *)w->data;
+
+	lua_kann_batch_flush (batch);
+}
+
+static struct lua_kann_batch *
+lua_kann_batch_get (kann_t *k, struct rspamd_lua_tensor *pca)
+{
+	struct lua_kann_batch_key key;
+	struct lua_kann_batch *batch;
+
+	if (kann_batches == NULL) {
+		kann_batches = g_hash_table_new_full (lua_kann_batch_key_hash,
+				lua_kann_batch_key_equal, NULL, lua_kann_batch_dtor);
+	}
+
+	key.k = k;
+	key.pca = pca;
+	batch = g_hash_table_lookup (kann_batches, &key);
+
+	if (batch == NULL) {
+		batch = g_malloc0 (sizeof (*batch));
+		batch->key = key;
+		batch->reqs = g_ptr_array_new ();
+		batch->kann_ref = -1;
+		batch->pca_ref = -1;
+		g_hash_table_insert (kann_batches, &batch->key, batch);
+	}
+
+	return batch;
+}
+
+/***
+ * @method kann:apply_batched(task, input[, callback[, params]])
+ * Evaluates `input` (a table or 1D tensor) as a part of a batch shared with
+ * other concurrent tasks. The output (of the same type as the input) is passed
+ * to `callback` or, if it is absent, returned when the current coroutine is
+ * resumed. Params:
+ * - `pca`: PCA matrix applied to the input, as in `apply1`
+ * - `timeout`: maximum time in seconds a request waits for a batch (0.002 by default)
+ * - `max_batch`: batch is evaluated immediately when having this number of requests (32)
+ */
+static int
+lua_kann_apply_batched (lua_State *L)
+{
+	kann_t *k = lua_check_kann (L, 1);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	struct rspamd_lua_tensor *pca = NULL, *t = NULL;
+	struct lua_kann_batch *batch;
+	struct lua_kann_batch_req *req;
+	gdouble timeout = KANN_BATCH_DEFAULT_TIMEOUT;
+	guint max_batch = KANN_BATCH_DEFAULT_SIZE;
+	gsize in_len;
+	gint n_in, pca_pos = 0;
+	float *row;
+
+	if (!k || !task || !(lua_istable (L, 3) || lua_isuserdata (L, 3))) {
+		return luaL_error (L, "invalid arguments: kann, task and input expected");
+	}
+
+	if (lua_istable (L, 5)) {
+		lua_getfield (L, 5, "timeout");
+		if (lua_isnumber (L, -1)) {
+			timeout = lua_tonumber (L, -1);
+		}
+		lua_pop (L, 1);
+
+		lua_getfield (L, 5, "max_batch");
+		if (lua_isnumber (L, -1)) {
+			max_batch = MAX (lua_tointeger (L, -1), 1);
+		}
+		lua_pop (L, 1);
+
+		lua_getfield (L, 5, "pca");
+		if (lua_isuserdata (L, -1)) {
+			pca = lua_check_tensor (L, -1);
+			pca_pos = lua_gettop (L);
+		}
+		else {
+			lua_pop (L, 1);
+		}
+	}
+
+	n_in = kann_dim_in (k);
+
+	if (n_in <= 0) {
+		return luaL_error (L, "invalid inputs count: %d", n_in);
+	}
+
+	if (kann_find (k, KANN_F_OUT, 0) <= 0) {
+		return luaL_error (L, "invalid ANN: output layer is missing or is "
+							  "at the input pos");
+	}
+
+	if (lua_istable (L, 3)) {
+		in_len = rspamd_lua_table_size (L, 3);
+	}
+	else {
+		t = lua_check_tensor (L, 3);
+
+		if (!t || t->ndims != 1) {
+			return luaL_error (L, "invalid arguments: 1D rspamd{tensor} expected");
+		}
+
+		in_len = t->dim[0];
+	}
+
+	if (pca) {
+		if (pca->ndims != 2 || pca->dim[0] != n_in || pca->dim[1] != in_len) {
+			return luaL_error (L, "invalid pca tensor: "
+								  "%d x %d matrix expected", n_in, (gint)in_len);
+		}
+	}
+	else if (in_len != n_in) {
+		return luaL_error (L, "invalid params: bad input dimension %d; %d expected",
+				(int) in_len, n_in);
+	}
+
+	if (task->s && rspamd_session_blocked (task->s)) {
+		return luaL_error (L, "async session is the blocked state");
+	}
+
+	batch = lua_kann_batch_get (k, pca);
+
+	if (batch->reqs->len == 0) {
+		batch->cfg = task->cfg;
+		batch->event_loop = task->event_loop;
+		batch->in_len = in_len;
+		lua_pushvalue (L, 1);
+		batch->kann_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+		if (pca) {
+			lua_pushvalue (L, pca_pos);
+			batch->pca_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+
+		ev_timer_init (&batch->tm, lua_kann_batch_timer_cb, timeout, 0.0);
+		batch->tm.data = batch;
+		ev_timer_start (batch->event_loop, &batch->tm);
+	}
+
+	if (batch->reqs->len == batch->nalloc) {
+		batch->nalloc = MAX (batch->nalloc * 2, 8);
+		batch->inputs = g_realloc (batch->inputs,
+				sizeof (float) * in_len * batch->nalloc);
+	}
+
+	row = batch->inputs + batch->reqs->len * in_len;
+
+	if (t) {
+		memcpy (row, t->data, sizeof (float) * in_len);
+	}
+	else {
+		for (gsize i = 0; i < in_len; i++) {
+			lua_rawgeti (L, 3, i + 1);
+			row[i] = lua_tonumber (L, -1);
+			lua_pop (L, 1);
+		}
+	}
+
+	req = g_malloc0 (sizeof (*req));
+	req->task = task;
+	req->want_tensor = (t != NULL);
+	req->item = rspamd_symcache_get_cur_item (task);
+
+	if (lua_isfunction (L, 4)) {
+		lua_pushvalue (L, 4);
+		req->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	else {
+		req->cbref = -1;
+		req->thread = lua_thread_pool_get_running_entry (task->cfg->lua_thread_pool);
+	}
+
+	g_ptr_array_add (batch->reqs, req);
+	rspamd_session_add_event (task->s, lua_kann_batch_req_fin, req, M);
+
+	if (req->item) {
+		rspamd_symcache_item_async_inc (task, req->item, M);
+	}
+
+	if (batch->reqs->len >= max_batch) {
+		/* Evaluate on the next loop iteration, as we could be yielding now */
+		ev_timer_stop (batch->event_loop, &batch->tm);
+		ev_timer_set (&batch->tm, 0.0, 0.0);
+		ev_timer_start (batch->event_loop, &batch->tm);
+	}
+
+	if (req->thread) {
+		return lua_thread_yield (req->thread, 0);
+	}
+
+	return 0;
+}
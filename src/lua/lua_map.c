@@ -30,18 +30,38 @@
  */
 
 /***
- * @method map:get_key(in)
+ * @method map:get_key(in[, zero_copy])
  * Variable method for different types of maps:
  *
  * - For hash maps it returns boolean and accepts string
  * - For kv maps it returns string (or nil) and accepts string
  * - For radix maps it returns boolean and accepts IP address (as object, string or number)
+ * - For cdb maps it returns string (or `rspamd{text}` if `zero_copy` is true) and accepts string
+ * - For domain suffix maps it returns value (`true` if a value is empty) and the matched
+ *   suffix, it accepts a domain name or URL object (its host is checked)
+ *
+ * Text returned with `zero_copy` points to the mapped cdb and is valid until
+ * the map is reloaded, so it should not be kept across asynchronous calls.
  *
  * @param {vary} in input to check
+ * @param {boolean} zero_copy return text without copying for cdb maps
  * @return {bool|string} if a value is found then this function returns string or `True` if not - then it returns `nil` or `False`
  */
 LUA_FUNCTION_DEF (map, get_key);
 
+/***
+ * @method map:get_keys_batch(list)
+ * Checks all elements of a list using one call, accepts the same inputs as
+ * `map:get_key` (numbers are not supported for radix maps). Radix, set, hash and
+ * domain suffix maps are looked up at once (radix maps in the sorted order of
+ * addresses), other maps are checked element by element. For domain suffix maps
+ * the whole list of task URLs could be passed, e.g. `map:get_keys_batch(task:get_urls())`
+ *
+ * @param {table} list array of inputs to check
+ * @return {table} array of results of `get_key` for each element (`false` if not found)
+ */
+LUA_FUNCTION_DEF (map, get_keys_batch);
+
 
 /***
  * @method map:is_signed()
@@ -113,6 +133,7 @@ LUA_FUNCTION_DEF (map, get_nelts);
 
 static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF (map, get_key),
+	LUA_INTERFACE_DEF (map, get_keys_batch),
 	LUA_INTERFACE_DEF (map, is_signed),
 	LUA_INTERFACE_DEF (map, get_proto),
 	LUA_INTERFACE_DEF (map, get_sign_key),
@@ -611,6 +632,24 @@ lua_config_add_map (lua_State *L)
 			}
 			m->lua_map = map;
 		}
+		else if (strcmp (type, "domain_suffix") == 0) {
+			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
+			map->data.hash = NULL;
+			map->type = RSPAMD_LUA_MAP_DOMAIN_SUFFIX;
+
+			if ((m = rspamd_map_add_from_ucl (cfg, map_obj, description,
+					rspamd_kv_list_read,
+					rspamd_kv_list_fin,
+					rspamd_kv_list_dtor,
+					(void **)&map->data.hash,
+					NULL, RSPAMD_MAP_DEFAULT)) == NULL) {
+				lua_pushnil (L);
+				ucl_object_unref (map_obj);
+
+				return 1;
+			}
+			m->lua_map = map;
+		}
 		else if (strcmp (type, "radix") == 0) {
 			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
 			map->data.radix = NULL;
@@ -816,6 +855,36 @@ lua_map_process_string_key (lua_State *L, gint pos, gsize *len)
 	return NULL;
 }
 
+/* Domain suffix maps also accept URLs and check their hosts */
+static const gchar *
+lua_map_process_domain_key (lua_State *L, gint pos, gsize *len)
+{
+	struct rspamd_lua_url *url;
+
+	if (lua_type (L, pos) == LUA_TUSERDATA) {
+		url = rspamd_lua_check_udata_maybe (L, pos, "rspamd{url}");
+
+		if (url) {
+			*len = url->url->hostlen;
+
+			return url->url->hostlen > 0 ? rspamd_url_host_unsafe (url->url) : NULL;
+		}
+	}
+
+	return lua_map_process_string_key (L, pos, len);
+}
+
+static void
+lua_map_push_domain_value (lua_State *L, const gchar *value)
+{
+	if (value[0] == '\0') {
+		lua_pushboolean (L, true);
+	}
+	else {
+		lua_pushstring (L, value);
+	}
+}
+
 /* Radix and hash table functions */
 static gint
 lua_map_get_key (lua_State * L)
@@ -951,6 +1020,24 @@ lua_map_get_key (lua_State * L)
 				return 1;
 			}
 		}
+		else if (map->type == RSPAMD_LUA_MAP_DOMAIN_SUFFIX) {
+			gsize matched_len = 0;
+
+			key = lua_map_process_domain_key (L, 2, &len);
+
+			if (key && map->data.hash) {
+				value = rspamd_match_hash_map_suffix (map->data.hash, key, len,
+						&matched_len);
+			}
+
+			if (value) {
+				lua_map_push_domain_value (L, value);
+				lua_pushlstring (L, key + len - matched_len -
+						(key[len - 1] == '.' ? 1 : 0), matched_len);
+
+				return 2;
+			}
+		}
 		else if (map->type == RSPAMD_LUA_MAP_CDB) {
 			/* cdb map */
 			const rspamd_ftok_t *tok = NULL;
@@ -962,7 +1049,14 @@ lua_map_get_key (lua_State * L)
 			}
 
 			if (tok) {
-				lua_pushlstring (L, tok->begin, tok->len);
+				if (lua_toboolean (L, 3)) {
+					/* Points directly to the mapped cdb */
+					lua_new_text (L, tok->begin, tok->len, FALSE);
+				}
+				else {
+					lua_pushlstring (L, tok->begin, tok->len);
+				}
+
 				return 1;
 			}
 		}
@@ -980,6 +1074,147 @@ lua_map_get_key (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_map_get_keys_batch (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map (L, 1);
+	gconstpointer *results;
+	guint i, n;
+
+	if (map == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	n = rspamd_lua_table_size (L, 2);
+
+	if (map->type != RSPAMD_LUA_MAP_RADIX && map->type != RSPAMD_LUA_MAP_SET &&
+			map->type != RSPAMD_LUA_MAP_HASH &&
+			map->type != RSPAMD_LUA_MAP_DOMAIN_SUFFIX) {
+		/* No batch lookups for other maps, so just call get_key for each element */
+		lua_createtable (L, n, 0);
+
+		for (i = 0; i < n; i ++) {
+			lua_pushcfunction (L, lua_map_get_key);
+			lua_pushvalue (L, 1);
+			lua_rawgeti (L, 2, i + 1);
+			lua_call (L, 2, 1);
+
+			if (lua_isnil (L, -1)) {
+				lua_pop (L, 1);
+				lua_pushboolean (L, false);
+			}
+
+			lua_rawseti (L, -2, i + 1);
+		}
+
+		return 1;
+	}
+	results = g_malloc0 (MAX (n, 1) * sizeof (*results));
+
+	if (map->type == RSPAMD_LUA_MAP_RADIX) {
+		const rspamd_inet_addr_t **addrs;
+		rspamd_inet_addr_t **parsed;
+		struct rspamd_lua_ip *addr;
+		const gchar *addr_str;
+		gpointer ud;
+		gsize len;
+
+		addrs = g_malloc0 (MAX (n, 1) * sizeof (*addrs));
+		/* Addresses parsed from strings are owned by us */
+		parsed = g_malloc0 (MAX (n, 1) * sizeof (*parsed));
+
+		for (i = 0; i < n; i ++) {
+			lua_rawgeti (L, 2, i + 1);
+
+			if (lua_type (L, -1) == LUA_TSTRING) {
+				addr_str = lua_tolstring (L, -1, &len);
+
+				if (rspamd_parse_inet_address (&parsed[i], addr_str, len,
+						RSPAMD_INET_ADDRESS_PARSE_NO_UNIX)) {
+					addrs[i] = parsed[i];
+				}
+			}
+			else if (lua_type (L, -1) == LUA_TUSERDATA) {
+				ud = rspamd_lua_check_udata (L, -1, "rspamd{ip}");
+
+				if (ud != NULL) {
+					addr = *((struct rspamd_lua_ip **)ud);
+					addrs[i] = addr->addr;
+				}
+			}
+
+			lua_pop (L, 1);
+		}
+
+		rspamd_match_radix_map_addr_batch (map->data.radix, addrs, n, results);
+
+		for (i = 0; i < n; i ++) {
+			if (parsed[i]) {
+				rspamd_inet_address_free (parsed[i]);
+			}
+		}
+
+		g_free (parsed);
+		g_free (addrs);
+	}
+	else {
+		rspamd_ftok_t *keys;
+
+		keys = g_malloc0 (MAX (n, 1) * sizeof (*keys));
+
+		for (i = 0; i < n; i ++) {
+			lua_rawgeti (L, 2, i + 1);
+			/* Strings are still referenced by the table after pop */
+			if (map->type == RSPAMD_LUA_MAP_DOMAIN_SUFFIX) {
+				keys[i].begin = lua_map_process_domain_key (L, -1, &keys[i].len);
+			}
+			else {
+				keys[i].begin = lua_map_process_string_key (L, -1, &keys[i].len);
+			}
+
+			if (keys[i].begin == NULL) {
+				keys[i].len = 0;
+			}
+
+			lua_pop (L, 1);
+		}
+
+		if (map->type == RSPAMD_LUA_MAP_DOMAIN_SUFFIX) {
+			rspamd_match_hash_map_suffix_batch (map->data.hash, keys, n,
+					results, NULL);
+		}
+		else {
+			rspamd_match_hash_map_batch (map->data.hash, keys, n, results);
+		}
+
+		g_free (keys);
+	}
+
+	lua_createtable (L, n, 0);
+
+	for (i = 0; i < n; i ++) {
+		if (results[i] == NULL) {
+			lua_pushboolean (L, false);
+		}
+		else if (map->type == RSPAMD_LUA_MAP_SET) {
+			lua_pushboolean (L, true);
+		}
+		else if (map->type == RSPAMD_LUA_MAP_DOMAIN_SUFFIX) {
+			lua_map_push_domain_value (L, results[i]);
+		}
+		else {
+			lua_pushstring (L, results[i]);
+		}
+
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	g_free (results);
+
+	return 1;
+}
+
 static gboolean
 lua_map_traverse_cb (gconstpointer key,
 		gconstpointer value, gsize hits, gpointer ud)
@@ -0,0 +1,178 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "lua_common.h"
+#include "lua_thread_pool.h"
+#include "lua_profiler.h"
+#include "libserver/rspamd_symcache.h"
+
+/* Maximum depth of the recorded stacks */
+#define LUA_PROFILER_MAX_DEPTH 32
+/* Limit of distinct stacks, the rest is accounted as a single stack */
+#define LUA_PROFILER_MAX_STACKS 65536
+#define LUA_PROFILER_BUF_LEN 2048
+
+static struct rspamd_lua_profiler {
+	struct rspamd_config *cfg;
+	GHashTable *stacks;
+	guint64 samples;
+	guint64 overflows;
+	guint rate;
+} *profiler = NULL;
+
+static void
+rspamd_lua_profiler_hook (lua_State *L, lua_Debug *ar)
+{
+	struct thread_entry *ent;
+	struct rspamd_symcache_item *item;
+	const gchar *symbol = "[none]";
+	gchar buf[LUA_PROFILER_BUF_LEN], *key;
+	lua_Debug frames[LUA_PROFILER_MAX_DEPTH];
+	gint depth, i;
+	gsize r;
+	guint64 *cnt;
+
+	if (ar->event != LUA_HOOKCOUNT || profiler == NULL) {
+		return;
+	}
+
+	ent = lua_thread_pool_get_running_entry (profiler->cfg->lua_thread_pool);
+
+	if (ent && ent->lua_state == L && ent->task) {
+		item = rspamd_symcache_get_cur_item (ent->task);
+
+		if (item) {
+			symbol = rspamd_symcache_item_name (item);
+		}
+	}
+
+	for (depth = 0; depth < LUA_PROFILER_MAX_DEPTH; depth ++) {
+		if (!lua_getstack (L, depth, &frames[depth])) {
+			break;
+		}
+
+		lua_getinfo (L, "nSl", &frames[depth]);
+	}
+
+	r = rspamd_strlcpy (buf, symbol, sizeof (buf));
+
+	/* Folded stacks start from the outermost frame */
+	for (i = depth - 1; i >= 0 && r < sizeof (buf); i --) {
+		lua_Debug *d = &frames[i];
+
+		if (d->what && strcmp (d->what, "C") == 0) {
+			r += rspamd_snprintf (buf + r, sizeof (buf) - r, ";[C]%s",
+					d->name ? d->name : "");
+		}
+		else {
+			r += rspamd_snprintf (buf + r, sizeof (buf) - r, ";%s@%s:%d",
+					d->name ? d->name : "?", d->short_src, d->linedefined);
+		}
+
+		if (i == 0 && d->currentline > 0 && r < sizeof (buf)) {
+			/* Leaf frame also gets the exact line */
+			r += rspamd_snprintf (buf + r, sizeof (buf) - r, ";line:%d",
+					d->currentline);
+		}
+	}
+
+	profiler->samples ++;
+	cnt = g_hash_table_lookup (profiler->stacks, buf);
+
+	if (cnt == NULL) {
+		if (g_hash_table_size (profiler->stacks) >= LUA_PROFILER_MAX_STACKS) {
+			profiler->overflows ++;
+			rspamd_snprintf (buf, sizeof (buf), "%s;[other]", symbol);
+			cnt = g_hash_table_lookup (profiler->stacks, buf);
+		}
+
+		if (cnt == NULL) {
+			key = g_strdup (buf);
+			cnt = g_malloc0 (sizeof (*cnt));
+			g_hash_table_insert (profiler->stacks, key, cnt);
+		}
+	}
+
+	(*cnt) ++;
+}
+
+void
+rspamd_lua_profiler_init (struct rspamd_config *cfg)
+{
+	if (cfg->lua_profile_rate == 0 || cfg->lua_state == NULL ||
+			profiler != NULL) {
+		return;
+	}
+
+	profiler = g_malloc0 (sizeof (*profiler));
+	profiler->cfg = cfg;
+	profiler->rate = cfg->lua_profile_rate;
+	profiler->stacks = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, g_free);
+
+	/* Threads from the pool copy this hook when they are taken */
+	lua_sethook (cfg->lua_state, rspamd_lua_profiler_hook, LUA_MASKCOUNT,
+			profiler->rate);
+
+	msg_info_config ("started Lua profiler, sample each %ud instructions",
+			profiler->rate);
+}
+
+gboolean
+rspamd_lua_profiler_enabled (void)
+{
+	return profiler != NULL;
+}
+
+ucl_object_t *
+rspamd_lua_profiler_to_ucl (void)
+{
+	ucl_object_t *top, *stacks;
+	GHashTableIter it;
+	gpointer k, v;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	stacks = ucl_object_typed_new (UCL_OBJECT);
+
+	if (profiler) {
+		g_hash_table_iter_init (&it, profiler->stacks);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			ucl_object_insert_key (stacks,
+					ucl_object_fromint (*(guint64 *)v),
+					(const gchar *)k, 0, true);
+		}
+
+		ucl_object_insert_key (top, ucl_object_fromint (profiler->rate),
+				"rate", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (profiler->samples),
+				"samples", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (profiler->overflows),
+				"overflows", 0, false);
+	}
+
+	ucl_object_insert_key (top, stacks, "stacks", 0, false);
+
+	return top;
+}
+
+void
+rspamd_lua_profiler_reset (void)
+{
+	if (profiler) {
+		g_hash_table_remove_all (profiler->stacks);
+		profiler->samples = 0;
+		profiler->overflows = 0;
+	}
+}
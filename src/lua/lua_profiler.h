@@ -0,0 +1,63 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_LUA_PROFILER_H
+#define RSPAMD_LUA_PROFILER_H
+
+#include "config.h"
+#include "ucl.h"
+
+/*
+ * Sampling profiler of Lua code based on count hooks: each `lua_profile_rate`
+ * Lua VM instructions the current Lua stack is recorded along with the symbol
+ * being processed. Stacks are aggregated in the folded format used by
+ * flamegraph tools (`symbol;frame;frame count`).
+ *
+ * Please note, that LuaJIT does not call hooks from the compiled traces, so
+ * only interpreted code is sampled there.
+ */
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct rspamd_config;
+
+/**
+ * Starts profiling of the Lua state of the config if `lua_profile_rate` is set
+ * @param cfg
+ */
+void rspamd_lua_profiler_init (struct rspamd_config *cfg);
+
+/**
+ * Returns true if profiling is enabled
+ */
+gboolean rspamd_lua_profiler_enabled (void);
+
+/**
+ * Returns collected stacks as an object with fields
+ * `rate`, `samples` and `stacks` (stack -> number of samples)
+ * @return new ucl object
+ */
+ucl_object_t *rspamd_lua_profiler_to_ucl (void);
+
+/**
+ * Resets collected samples
+ */
+void rspamd_lua_profiler_reset (void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -16,6 +16,8 @@
 #include "lua_common.h"
 #include "lua_thread_pool.h"
 #include "utlist.h"
+#include "libserver/net_replay.h"
+#include "libutil/probes.h"
 
 #include "contrib/hiredis/hiredis.h"
 #include "contrib/hiredis/async.h"
@@ -53,6 +55,8 @@ LUA_FUNCTION_DEF (redis, make_request);
 LUA_FUNCTION_DEF (redis, make_request_sync);
 LUA_FUNCTION_DEF (redis, connect);
 LUA_FUNCTION_DEF (redis, connect_sync);
+LUA_FUNCTION_DEF (redis, pool_stat);
+LUA_FUNCTION_DEF (redis, key_slot);
 LUA_FUNCTION_DEF (redis, add_cmd);
 LUA_FUNCTION_DEF (redis, exec);
 LUA_FUNCTION_DEF (redis, gc);
@@ -62,6 +66,8 @@ static const struct luaL_reg redislib_f[] = {
 	LUA_INTERFACE_DEF (redis, make_request_sync),
 	LUA_INTERFACE_DEF (redis, connect),
 	LUA_INTERFACE_DEF (redis, connect_sync),
+	LUA_INTERFACE_DEF (redis, pool_stat),
+	LUA_INTERFACE_DEF (redis, key_slot),
 	{NULL, NULL}
 };
 
@@ -124,6 +130,8 @@ INIT_LOG_MODULE(lua_redis)
 #define LUA_REDIS_TERMINATED (1 << 2)
 #define LUA_REDIS_NO_POOL (1 << 3)
 #define LUA_REDIS_SUBSCRIBED (1 << 4)
+/* replies are served by net replay, there is no connection */
+#define LUA_REDIS_REPLAY (1 << 5)
 #define IS_ASYNC(ctx) ((ctx)->flags & LUA_REDIS_ASYNC)
 
 struct lua_redis_request_specific_userdata {
@@ -449,6 +457,101 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
  * @param r redis reply
  * @param priv userdata
  */
+static void
+lua_redis_replay_key (struct lua_redis_request_specific_userdata *sp_ud,
+		GString *out)
+{
+	guint i;
+
+	for (i = 0; i < sp_ud->nargs; i ++) {
+		rspamd_printf_gstring (out, "%z:", sp_ud->arglens[i]);
+		g_string_append_len (out, sp_ud->args[i], sp_ud->arglens[i]);
+	}
+}
+
+/* Replies are recorded in the redis protocol to be parsed by hiredis back */
+static void
+lua_redis_replay_serialise (const redisReply *r, GString *out)
+{
+	gsize i;
+
+	switch (r->type) {
+	case REDIS_REPLY_STRING:
+		rspamd_printf_gstring (out, "$%d\r\n", r->len);
+		g_string_append_len (out, r->str, r->len);
+		g_string_append_len (out, "\r\n", 2);
+		break;
+	case REDIS_REPLY_STATUS:
+		rspamd_printf_gstring (out, "+%*s\r\n", r->len, r->str);
+		break;
+	case REDIS_REPLY_ERROR:
+		rspamd_printf_gstring (out, "-%*s\r\n", r->len, r->str);
+		break;
+	case REDIS_REPLY_INTEGER:
+		rspamd_printf_gstring (out, ":%L\r\n", (gint64)r->integer);
+		break;
+	case REDIS_REPLY_ARRAY:
+		rspamd_printf_gstring (out, "*%z\r\n", r->elements);
+
+		for (i = 0; i < r->elements; i ++) {
+			lua_redis_replay_serialise (r->element[i], out);
+		}
+		break;
+	case REDIS_REPLY_NIL:
+	default:
+		g_string_append_len (out, "$-1\r\n", 5);
+		break;
+	}
+}
+
+static void
+lua_redis_replay_record (struct lua_redis_request_specific_userdata *sp_ud,
+		const redisReply *r)
+{
+	GString *key, *data;
+
+	key = g_string_sized_new (64);
+	data = g_string_sized_new (64);
+	lua_redis_replay_key (sp_ud, key);
+	lua_redis_replay_serialise (r, data);
+	rspamd_net_replay_record (RSPAMD_NET_REPLAY_REDIS, key->str, key->len,
+			data->str, data->len);
+	g_string_free (key, TRUE);
+	g_string_free (data, TRUE);
+}
+
+static gsize
+lua_redis_reply_size (const redisReply *r)
+{
+	gsize len = r->len;
+	guint i;
+
+	if (r->type == REDIS_REPLY_ARRAY) {
+		for (i = 0; i < r->elements; i ++) {
+			len += lua_redis_reply_size (r->element[i]);
+		}
+	}
+
+	return len;
+}
+
+static void
+lua_redis_account_request (struct lua_redis_request_specific_userdata *sp_ud)
+{
+	struct rspamd_task *task = sp_ud->c->task;
+	guint i;
+
+	RSPAMD_PROBE2 (redis__start, sp_ud, sp_ud->args[0]);
+
+	if (task) {
+		task->resources.redis_requests ++;
+
+		for (i = 0; i < sp_ud->nargs; i ++) {
+			task->resources.redis_bytes += sp_ud->arglens[i];
+		}
+	}
+}
+
 static void
 lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 {
@@ -456,7 +559,9 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct lua_redis_request_specific_userdata *sp_ud = priv;
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_userdata *ud;
+	struct rspamd_task *task;
 	redisAsyncContext *ac;
+	gdouble cpu_start = 0;
 
 	ctx = sp_ud->ctx;
 	ud = sp_ud->c;
@@ -468,14 +573,30 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	msg_debug_lua_redis ("got reply from redis %p for query %p", sp_ud->c->ctx,
 			sp_ud);
+	RSPAMD_PROBE2 (redis__finish, sp_ud, c->err);
 
 	REDIS_RETAIN (ctx);
+	/* Callbacks could finish the request, so save task in advance */
+	task = ud->task;
 
 	/* If session is finished, we cannot call lua callbacks */
 	if (!(sp_ud->flags & LUA_REDIS_SPECIFIC_FINISHED) ||
 			(sp_ud->flags & LUA_REDIS_SUBSCRIBED)) {
+		if (task) {
+			cpu_start = rspamd_task_cpu_enter (task);
+		}
+
 		if (c->err == 0) {
 			if (r != NULL) {
+				if (task) {
+					task->resources.redis_bytes += lua_redis_reply_size (reply);
+				}
+
+				if (rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_RECORD &&
+						!(sp_ud->flags & LUA_REDIS_SUBSCRIBED)) {
+					lua_redis_replay_record (sp_ud, reply);
+				}
+
 				if (reply->type != REDIS_REPLY_ERROR) {
 					lua_redis_push_data (reply, ctx, sp_ud);
 				}
@@ -495,6 +616,10 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 				lua_redis_push_error (c->errstr, ctx, sp_ud, TRUE);
 			}
 		}
+
+		if (task) {
+			rspamd_task_cpu_leave (task, cpu_start);
+		}
 	}
 
 	if (!(sp_ud->flags & LUA_REDIS_SUBSCRIBED)) {
@@ -519,6 +644,51 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	REDIS_RELEASE (ctx);
 }
 
+static void
+lua_redis_replay_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct lua_redis_request_specific_userdata *sp_ud =
+			(struct lua_redis_request_specific_userdata *)w->data;
+	static const gchar not_recorded[] = "-ERR request has not been recorded\r\n";
+	static redisAsyncContext replay_ac;
+	redisReader *reader;
+	void *reply = NULL;
+	const guchar *data;
+	gsize datalen;
+	GString *key;
+
+	if (sp_ud->flags & LUA_REDIS_SPECIFIC_FINISHED) {
+		return;
+	}
+
+	key = g_string_sized_new (64);
+	lua_redis_replay_key (sp_ud, key);
+	data = rspamd_net_replay_lookup (RSPAMD_NET_REPLAY_REDIS, key->str,
+			key->len, &datalen);
+	g_string_free (key, TRUE);
+
+	reader = redisReaderCreate ();
+
+	if (data == NULL) {
+		data = (const guchar *)not_recorded;
+		datalen = sizeof (not_recorded) - 1;
+	}
+
+	if (redisReaderFeed (reader, (const gchar *)data, datalen) != REDIS_OK ||
+			redisReaderGetReply (reader, &reply) != REDIS_OK) {
+		reply = NULL;
+	}
+
+	/* NULL reply is reported as no data received */
+	lua_redis_callback (&replay_ac, reply, sp_ud);
+
+	if (reply) {
+		freeReplyObject (reply);
+	}
+
+	redisReaderFree (reader);
+}
+
 static gint
 lua_redis_push_results (struct lua_redis_ctx *ctx, lua_State *L)
 {
@@ -850,6 +1020,33 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 	*nargs = top;
 }
 
+/*
+ * Commands that change connection state or block it, so they cannot be sent
+ * over a connection shared with other requests
+ */
+static gboolean
+lua_redis_cmd_needs_exclusive (const gchar *cmd)
+{
+	static const gchar *stateful_cmds[] = {
+			"SUBSCRIBE", "PSUBSCRIBE", "MONITOR", "MULTI", "WATCH",
+			"BLPOP", "BRPOP", "BRPOPLPUSH", "BZPOPMIN", "BZPOPMAX",
+			"XREAD", "XREADGROUP", "CLIENT", "SELECT", "AUTH",
+	};
+	guint i;
+
+	if (cmd == NULL) {
+		return FALSE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (stateful_cmds); i ++) {
+		if (g_ascii_strcasecmp (cmd, stateful_cmds[i]) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 static struct lua_redis_ctx *
 rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_async)
 {
@@ -864,7 +1061,7 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 	struct rspamd_config *cfg = NULL;
 	struct rspamd_async_session *session = NULL;
 	struct ev_loop *ev_base = NULL;
-	gboolean ret = FALSE;
+	gboolean ret = FALSE, exclusive = FALSE;
 	guint flags = 0;
 
 	if (lua_istable (L, 1)) {
@@ -980,9 +1177,24 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 		lua_gettable (L, -2);
 		if (!!lua_toboolean (L, -1)) {
 			flags |= LUA_REDIS_NO_POOL;
+			exclusive = TRUE;
 		}
 		lua_pop (L, 1);
 
+		if (pcbref == NULL) {
+			/* Connection objects might be kept idle, so they are not shared */
+			exclusive = TRUE;
+		}
+		else {
+			lua_pushstring (L, "cmd");
+			lua_gettable (L, -2);
+			if (lua_type (L, -1) == LUA_TSTRING &&
+					lua_redis_cmd_needs_exclusive (lua_tostring (L, -1))) {
+				exclusive = TRUE;
+			}
+			lua_pop (L, 1);
+		}
+
 		lua_pop (L, 1); /* table */
 
 		if (session && rspamd_session_blocked (session)) {
@@ -1038,10 +1250,31 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 
 	if (ret) {
 		ud->terminated = 0;
-		ud->ctx = rspamd_redis_pool_connect (ud->pool,
-				dbname, password,
-				rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
+
+		if (is_async && pcbref != NULL &&
+				rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_REPLAY) {
+			/* Requests are served from the replay file, do not connect */
+			ctx->flags |= LUA_REDIS_REPLAY;
+
+			if (ip) {
+				rspamd_inet_address_free (ip);
+			}
+
+			return ctx;
+		}
+
+		if (exclusive) {
+			ud->ctx = rspamd_redis_pool_connect_exclusive (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
+		else {
+			ud->ctx = rspamd_redis_pool_connect (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
 
 		if (ip) {
 			rspamd_inet_address_free (ip);
@@ -1131,14 +1364,21 @@ lua_redis_make_request (lua_State *L)
 		lua_pop (L, 1);
 		LL_PREPEND (ud->specific, sp_ud);
 
-		ret = redisAsyncCommandArgv (ud->ctx,
-				lua_redis_callback,
-				sp_ud,
-				sp_ud->nargs,
-				(const gchar **)sp_ud->args,
-				sp_ud->arglens);
+		if (ctx->flags & LUA_REDIS_REPLAY) {
+			ret = REDIS_OK;
+		}
+		else {
+			ret = redisAsyncCommandArgv (ud->ctx,
+					lua_redis_callback,
+					sp_ud,
+					sp_ud->nargs,
+					(const gchar **)sp_ud->args,
+					sp_ud->arglens);
+		}
 
 		if (ret == REDIS_OK) {
+			lua_redis_account_request (sp_ud);
+
 			if (ud->s) {
 				rspamd_session_add_event (ud->s,
 						lua_redis_fin, sp_ud,
@@ -1152,14 +1392,24 @@ lua_redis_make_request (lua_State *L)
 			REDIS_RETAIN (ctx); /* Cleared by fin event */
 			ctx->cmds_pending ++;
 
-			if (ud->ctx->c.flags & REDIS_SUBSCRIBED) {
+			if (ud->ctx && (ud->ctx->c.flags & REDIS_SUBSCRIBED)) {
 				msg_debug_lua_redis ("subscribe command, never unref/timeout");
 				sp_ud->flags |= LUA_REDIS_SUBSCRIBED;
 			}
 
 			sp_ud->timeout_ev.data = sp_ud;
 			ev_now_update_if_cheap ((struct ev_loop *)ud->event_loop);
-			ev_timer_init (&sp_ud->timeout_ev, lua_redis_timeout, timeout, 0.0);
+
+			if (ctx->flags & LUA_REDIS_REPLAY) {
+				/* Reply is delivered on the next loop iteration */
+				ev_timer_init (&sp_ud->timeout_ev, lua_redis_replay_cb,
+						0.0, 0.0);
+			}
+			else {
+				ev_timer_init (&sp_ud->timeout_ev, lua_redis_timeout,
+						timeout, 0.0);
+			}
+
 			ev_timer_start (ud->event_loop, &sp_ud->timeout_ev);
 
 			ret = TRUE;
@@ -1452,6 +1702,13 @@ lua_redis_add_cmd (lua_State *L)
 			return 2;
 		}
 
+		if (ctx->flags & LUA_REDIS_REPLAY) {
+			lua_pushboolean (L, FALSE);
+			lua_pushstring (L, "Pipelined commands cannot be replayed");
+
+			return 2;
+		}
+
 		/* Async version */
 		if (lua_type (L, 2) == LUA_TSTRING) {
 			/* No callback version */
@@ -1510,6 +1767,8 @@ lua_redis_add_cmd (lua_State *L)
 		}
 
 		if (ret == REDIS_OK) {
+			lua_redis_account_request (sp_ud);
+
 			if (ud->s) {
 				rspamd_session_add_event (ud->s,
 						lua_redis_fin,
@@ -1657,6 +1916,109 @@ lua_redis_gc (lua_State *L)
 }
 #endif
 
+/***
+ * @function rspamd_redis.pool_stat(cfg)
+ * Returns statistics of redis connections pool of the current process
+ * @param {rspamd_config} cfg config object
+ * @return {table} table with `requests`, `requests_multiplexed`, `conns_created`,
+ * `conns_reused`, `conns_active`, `conns_inactive`, `conns_shared` and
+ * `users_shared` fields
+ */
+static int
+lua_redis_pool_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	struct rspamd_redis_pool_stat st;
+
+	if (cfg == NULL || cfg->redis_pool == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rspamd_redis_pool_get_stat (cfg->redis_pool, &st);
+	lua_createtable (L, 0, 8);
+	lua_pushinteger (L, st.requests);
+	lua_setfield (L, -2, "requests");
+	lua_pushinteger (L, st.requests_multiplexed);
+	lua_setfield (L, -2, "requests_multiplexed");
+	lua_pushinteger (L, st.conns_created);
+	lua_setfield (L, -2, "conns_created");
+	lua_pushinteger (L, st.conns_reused);
+	lua_setfield (L, -2, "conns_reused");
+	lua_pushinteger (L, st.conns_active);
+	lua_setfield (L, -2, "conns_active");
+	lua_pushinteger (L, st.conns_inactive);
+	lua_setfield (L, -2, "conns_inactive");
+	lua_pushinteger (L, st.conns_shared);
+	lua_setfield (L, -2, "conns_shared");
+	lua_pushinteger (L, st.users_shared);
+	lua_setfield (L, -2, "users_shared");
+
+	return 1;
+}
+
+/* CRC16-CCITT (XMODEM) as used by Redis Cluster */
+static guint16
+lua_redis_crc16 (const guchar *p, gsize len)
+{
+	guint16 crc = 0;
+	guint i;
+
+	while (len--) {
+		crc ^= ((guint16)*p++) << 8;
+
+		for (i = 0; i < 8; i ++) {
+			if (crc & 0x8000) {
+				crc = (crc << 1) ^ 0x1021;
+			}
+			else {
+				crc <<= 1;
+			}
+		}
+	}
+
+	return crc;
+}
+
+/***
+ * @function rspamd_redis.key_slot(key)
+ * Returns Redis Cluster hash slot for the specified key, hash tags (`{...}`)
+ * are taken into account
+ * @param {string} key redis key
+ * @return {number} slot number from 0 to 16383
+ */
+static int
+lua_redis_key_slot (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	gsize len, start, end;
+	const gchar *key = luaL_checklstring (L, 1, &len);
+
+	for (start = 0; start < len; start ++) {
+		if (key[start] == '{') {
+			break;
+		}
+	}
+
+	if (start < len) {
+		for (end = start + 1; end < len; end ++) {
+			if (key[end] == '}') {
+				break;
+			}
+		}
+
+		/* Empty or unterminated tags mean that the whole key is hashed */
+		if (end < len && end != start + 1) {
+			key += start + 1;
+			len = end - start - 1;
+		}
+	}
+
+	lua_pushinteger (L, lua_redis_crc16 ((const guchar *)key, len) & 16383);
+
+	return 1;
+}
+
 static gint
 lua_load_redis (lua_State * L)
 {
@@ -40,6 +40,7 @@ LUA_FUNCTION_DEF (regexp, get_max_hits);
 LUA_FUNCTION_DEF (regexp, search);
 LUA_FUNCTION_DEF (regexp, match);
 LUA_FUNCTION_DEF (regexp, matchn);
+LUA_FUNCTION_DEF (regexp, match_vector);
 LUA_FUNCTION_DEF (regexp, split);
 LUA_FUNCTION_DEF (regexp, destroy);
 LUA_FUNCTION_DEF (regexp, gc);
@@ -51,6 +52,7 @@ static const struct luaL_reg regexplib_m[] = {
 	LUA_INTERFACE_DEF (regexp, get_max_hits),
 	LUA_INTERFACE_DEF (regexp, match),
 	LUA_INTERFACE_DEF (regexp, matchn),
+	LUA_INTERFACE_DEF (regexp, match_vector),
 	LUA_INTERFACE_DEF (regexp, search),
 	LUA_INTERFACE_DEF (regexp, split),
 	LUA_INTERFACE_DEF (regexp, destroy),
@@ -700,6 +702,54 @@ lua_regexp_matchn (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method re:match_vector(inputs[, raw_match])
+ * Matches each element of `inputs` against the regular expression in a single call
+ *
+ * @param {table} inputs array of strings or texts
+ * @param {bool} match raw regexp instead of utf8 one
+ * @return {table} array of indices of `inputs` elements that match, in ascending order
+ */
+static int
+lua_regexp_match_vector (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_regexp *re = lua_check_regexp (L, 1);
+	const gchar *data;
+	gsize len;
+	gboolean raw;
+	gint ninputs, nmatched = 0;
+
+	if (!re || IS_DESTROYED (re) || !lua_istable (L, 2)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	raw = lua_toboolean (L, 3);
+	ninputs = rspamd_lua_table_size (L, 2);
+	lua_newtable (L);
+
+	for (gint i = 1; i <= ninputs; i ++) {
+		lua_rawgeti (L, 2, i);
+		data = lua_check_lstring_or_text (L, -1, &len);
+		lua_pop (L, 1);
+
+		if (data == NULL || len == 0) {
+			continue;
+		}
+
+		if (re->match_limit > 0) {
+			len = MIN (len, re->match_limit);
+		}
+
+		if (rspamd_regexp_search (re->re, data, len, NULL, NULL, raw, NULL)) {
+			lua_pushinteger (L, i);
+			lua_rawseti (L, -2, ++nmatched);
+		}
+	}
+
+	return 1;
+}
+
 /***
  * @method re:split(line)
  * Split line using the specified regular expression.
@@ -0,0 +1,285 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * @file lua_shm_cache.c
+ * This module exports the key value cache shared by all workers to Lua
+ */
+
+#include "lua_common.h"
+#include "libutil/shm_cache.h"
+
+/***
+ * @module rspamd_shm_cache
+ * Synchronous key value cache in the shared memory of all processes, it is
+ * enabled by `shm_cache_size` option. Elements have TTLs and the least used
+ * ones are evicted when the cache is full, so it is suitable as a local tier
+ * in front of Redis or DNS lookups. Keys should be prefixed by a module name,
+ * as all modules share the same cache.
+@example
+local rspamd_shm_cache = require "rspamd_shm_cache"
+local cache = rspamd_shm_cache.open(rspamd_config)
+
+if cache then
+  local v = cache:get('rep_ip' .. ip_str)
+  if not v then
+    -- Query Redis and store the result for a minute
+    cache:set('rep_ip' .. ip_str, reply, 60)
+  end
+  cache:incr('rl' .. from, 1, 3600)
+end
+*/
+
+#define SHM_CACHE_CLASS "rspamd{shm_cache}"
+
+LUA_FUNCTION_DEF (shm_cache, open);
+LUA_FUNCTION_DEF (shm_cache, get);
+LUA_FUNCTION_DEF (shm_cache, set);
+LUA_FUNCTION_DEF (shm_cache, incr);
+LUA_FUNCTION_DEF (shm_cache, delete);
+LUA_FUNCTION_DEF (shm_cache, stat);
+
+static const struct luaL_reg shm_cachelib_m[] = {
+	LUA_INTERFACE_DEF (shm_cache, get),
+	LUA_INTERFACE_DEF (shm_cache, set),
+	LUA_INTERFACE_DEF (shm_cache, incr),
+	LUA_INTERFACE_DEF (shm_cache, delete),
+	LUA_INTERFACE_DEF (shm_cache, stat),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+static const struct luaL_reg shm_cachelib_f[] = {
+	LUA_INTERFACE_DEF (shm_cache, open),
+	{NULL, NULL}
+};
+
+static struct rspamd_shm_cache *
+lua_check_shm_cache (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, SHM_CACHE_CLASS);
+
+	luaL_argcheck (L, ud != NULL, pos, "'shm_cache' expected");
+	return ud ? *((struct rspamd_shm_cache **)ud) : NULL;
+}
+
+/***
+ * @function rspamd_shm_cache.open(cfg)
+ * Returns the shared cache of a config
+ * @param {rspamd_config} cfg config object
+ * @return {rspamd_shm_cache} cache or nil if it is disabled
+ */
+static gint
+lua_shm_cache_open (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	struct rspamd_shm_cache **pcache;
+
+	if (cfg == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (cfg->shm_cache == NULL) {
+		lua_pushnil (L);
+	}
+	else {
+		pcache = lua_newuserdata (L, sizeof (*pcache));
+		rspamd_lua_setclass (L, SHM_CACHE_CLASS, -1);
+		*pcache = cfg->shm_cache;
+	}
+
+	return 1;
+}
+
+/***
+ * @method rspamd_shm_cache:get(key)
+ * Returns a live element of the cache
+ * @param {string} key
+ * @return {string|number,number} value (number for counters) and seconds to expire (0 if no ttl) or nil
+ */
+static gint
+lua_shm_cache_get (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shm_cache *cache = lua_check_shm_cache (L, 1);
+	struct rspamd_shm_cache_value value;
+	const gchar *key;
+	gsize keylen;
+
+	key = luaL_checklstring (L, 2, &keylen);
+
+	if (cache == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (!rspamd_shm_cache_lookup (cache, key, keylen,
+			rspamd_get_calendar_ticks (), &value)) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	if (value.type == RSPAMD_SHM_CACHE_COUNTER) {
+		lua_pushinteger (L, value.counter);
+	}
+	else {
+		lua_pushlstring (L, (const gchar *)value.data, value.len);
+	}
+
+	lua_pushnumber (L, value.ttl);
+
+	return 2;
+}
+
+/***
+ * @method rspamd_shm_cache:set(key, value[, ttl])
+ * Stores an element replacing the existing one
+ * @param {string} key
+ * @param {string|text} value
+ * @param {number} ttl time to live in seconds, element is kept till evicted if not specified
+ * @return {boolean} true if an element has been stored
+ */
+static gint
+lua_shm_cache_set (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shm_cache *cache = lua_check_shm_cache (L, 1);
+	struct rspamd_lua_text *t;
+	const gchar *key;
+	gsize keylen;
+	gdouble ttl;
+
+	key = luaL_checklstring (L, 2, &keylen);
+	t = lua_check_text_or_string (L, 3);
+	ttl = luaL_optnumber (L, 4, 0);
+
+	if (cache == NULL || t == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, rspamd_shm_cache_insert (cache, key, keylen,
+			t->start, t->len, ttl, rspamd_get_calendar_ticks ()));
+
+	return 1;
+}
+
+/***
+ * @method rspamd_shm_cache:incr(key[, delta[, ttl]])
+ * Atomically increments a counter creating it if needed
+ * @param {string} key
+ * @param {number} delta increment, 1 by default
+ * @param {number} ttl time to live of a new counter in seconds
+ * @return {number} new value of a counter or nil if a key holds a string
+ */
+static gint
+lua_shm_cache_incr (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shm_cache *cache = lua_check_shm_cache (L, 1);
+	const gchar *key;
+	gsize keylen;
+	gint64 delta, res;
+	gdouble ttl;
+
+	key = luaL_checklstring (L, 2, &keylen);
+	delta = luaL_optinteger (L, 3, 1);
+	ttl = luaL_optnumber (L, 4, 0);
+
+	if (cache == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (rspamd_shm_cache_incr (cache, key, keylen, delta, ttl,
+			rspamd_get_calendar_ticks (), &res)) {
+		lua_pushinteger (L, res);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method rspamd_shm_cache:delete(key)
+ * Removes an element
+ * @param {string} key
+ * @return {boolean} true if an element has been removed
+ */
+static gint
+lua_shm_cache_delete (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shm_cache *cache = lua_check_shm_cache (L, 1);
+	const gchar *key;
+	gsize keylen;
+
+	key = luaL_checklstring (L, 2, &keylen);
+
+	if (cache == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, rspamd_shm_cache_delete (cache, key, keylen));
+
+	return 1;
+}
+
+/***
+ * @method rspamd_shm_cache:stat()
+ * Returns statistics of the cache
+ * @return {table} table with `size`, `hits`, `misses`, `stored` and `evicted` fields
+ */
+static gint
+lua_shm_cache_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shm_cache *cache = lua_check_shm_cache (L, 1);
+	struct rspamd_shm_cache_stat st;
+
+	if (cache == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rspamd_shm_cache_stat (cache, &st);
+	lua_createtable (L, 0, 5);
+	lua_pushinteger (L, st.elts);
+	lua_setfield (L, -2, "size");
+	lua_pushinteger (L, st.hits);
+	lua_setfield (L, -2, "hits");
+	lua_pushinteger (L, st.misses);
+	lua_setfield (L, -2, "misses");
+	lua_pushinteger (L, st.stored);
+	lua_setfield (L, -2, "stored");
+	lua_pushinteger (L, st.evicted);
+	lua_setfield (L, -2, "evicted");
+
+	return 1;
+}
+
+static gint
+lua_load_shm_cache (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, shm_cachelib_f);
+
+	return 1;
+}
+
+void
+luaopen_shm_cache (lua_State *L)
+{
+	rspamd_lua_new_class (L, SHM_CACHE_CLASS, shm_cachelib_m);
+	lua_pop (L, 1);
+	rspamd_lua_add_preload (L, "rspamd_shm_cache", lua_load_shm_cache);
+}
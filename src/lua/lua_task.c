@@ -991,6 +991,7 @@ LUA_FUNCTION_DEF (task, get_size);
  * - `learn_spam`: learn message as spam
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
+ * - `bulk`: process task with the lower priority than other tasks of a worker
  * @param {string} flag to set
  * @param {boolean} set set or clear flag (default is set)
 @example
@@ -1029,6 +1030,7 @@ LUA_FUNCTION_DEF (task, set_flag);
  * - `learn_spam`: learn message as spam
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
+ * - `bulk`: task is processed with the lower priority
  * @param {string} flag to check
  * @return {boolean} true if flags is set
  */
@@ -1048,6 +1050,7 @@ LUA_FUNCTION_DEF (task, has_flag);
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
  * - `milter`: task is initiated by milter connection
+ * - `bulk`: task is processed with the lower priority
  * @return {array of strings} table with all flags as strings
  */
 LUA_FUNCTION_DEF (task, get_flags);
@@ -1058,6 +1061,13 @@ LUA_FUNCTION_DEF (task, get_flags);
  * @return {string} hex digest
  */
 LUA_FUNCTION_DEF (task, get_digest);
+/***
+ * @method task:get_body_digest()
+ * Returns digest of message's mime parts ignoring headers, so it is the same
+ * for byte identical bodies sent with different headers (32 hex symbols)
+ * @return {string} hex digest
+ */
+LUA_FUNCTION_DEF (task, get_body_digest);
 
 /***
  * @method task:store_in_file([mode|table])
@@ -1308,6 +1318,7 @@ static const struct luaL_reg tasklib_m[] = {
 	{"set_rmilter_reply", lua_task_set_milter_reply},
 	LUA_INTERFACE_DEF (task, set_milter_reply),
 	LUA_INTERFACE_DEF (task, get_digest),
+	LUA_INTERFACE_DEF (task, get_body_digest),
 	LUA_INTERFACE_DEF (task, store_in_file),
 	LUA_INTERFACE_DEF (task, get_protocol_reply),
 	LUA_INTERFACE_DEF (task, headers_foreach),
@@ -5399,6 +5410,7 @@ lua_task_set_flag (lua_State *L)
 		LUA_TASK_SET_FLAG (flag, "greylisted", RSPAMD_TASK_FLAG_GREYLISTED, set);
 		LUA_TASK_SET_FLAG (flag, "skip_process", RSPAMD_TASK_FLAG_SKIP_PROCESS, set);
 		LUA_TASK_SET_FLAG (flag, "message_rewrite", RSPAMD_TASK_FLAG_MESSAGE_REWRITE, set);
+		LUA_TASK_SET_FLAG (flag, "bulk", RSPAMD_TASK_FLAG_BULK, set);
 
 		if (!found) {
 			msg_warn_task ("unknown flag requested: %s", flag);
@@ -5437,6 +5449,7 @@ lua_task_has_flag (lua_State *L)
 				RSPAMD_TASK_FLAG_MIME);
 		LUA_TASK_GET_FLAG (flag, "message_rewrite",
 				RSPAMD_TASK_FLAG_MESSAGE_REWRITE);
+		LUA_TASK_GET_FLAG (flag, "bulk", RSPAMD_TASK_FLAG_BULK);
 		LUA_TASK_GET_PROTOCOL_FLAG (flag, "milter",
 				RSPAMD_TASK_PROTOCOL_FLAG_MILTER);
 
@@ -5510,6 +5523,10 @@ lua_task_get_flags (lua_State *L)
 					lua_pushstring (L, "message_rewrite");
 					lua_rawseti (L, -2, idx++);
 					break;
+				case RSPAMD_TASK_FLAG_BULK:
+					lua_pushstring (L, "bulk");
+					lua_rawseti (L, -2, idx++);
+					break;
 				default:
 					break;
 				}
@@ -5532,6 +5549,39 @@ lua_task_get_flags (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_task_get_body_digest (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	gchar hexbuf[sizeof(MESSAGE_FIELD (task, body_digest)) * 2 + 1];
+	gint r;
+
+	if (task) {
+		if (task->message) {
+			r = rspamd_encode_hex_buf (MESSAGE_FIELD (task, body_digest),
+					sizeof (MESSAGE_FIELD (task, body_digest)),
+					hexbuf, sizeof (hexbuf) - 1);
+
+			if (r > 0) {
+				hexbuf[r] = '\0';
+				lua_pushstring (L, hexbuf);
+			}
+			else {
+				lua_pushnil (L);
+			}
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static gint
 lua_task_get_digest (lua_State *L)
 {
@@ -7064,7 +7114,7 @@ lua_archive_get_files_full (lua_State *L)
 		for (i = 0; i < max_files; i ++) {
 			f = g_ptr_array_index (arch->files, i);
 
-			lua_createtable (L, 0, 4);
+			lua_createtable (L, 0, 5);
 
 			lua_pushstring (L, "name");
 			lua_pushlstring (L, f->fname->str, f->fname->len);
@@ -7082,6 +7132,10 @@ lua_archive_get_files_full (lua_State *L)
 			lua_pushboolean (L, (f->flags & RSPAMD_ARCHIVE_FILE_ENCRYPTED) ? true : false);
 			lua_settable (L, -3);
 
+			lua_pushstring (L, "nested");
+			lua_pushboolean (L, (f->flags & RSPAMD_ARCHIVE_FILE_NESTED) ? true : false);
+			lua_settable (L, -3);
+
 			lua_rawseti (L, -2, i + 1);
 		}
 	}
@@ -193,11 +193,22 @@ LUA_FUNCTION_DEF (tcp, shift_callback);
  */
 LUA_FUNCTION_DEF (tcp, starttls);
 
+/***
+ * @function rspamd_tcp.keepalive_stat()
+ *
+ * Returns statistics of the keepalive pool of this process as a table:
+ * `reused`, `missed`, `pooled`, `expired` counters and number of `idle`
+ * connections
+ * @return {table} keepalive pool statistics
+ */
+LUA_FUNCTION_DEF (tcp, keepalive_stat);
+
 static const struct luaL_reg tcp_libf[] = {
 	LUA_INTERFACE_DEF (tcp, request),
 	{"new", lua_tcp_request},
 	{"connect", lua_tcp_request},
 	{"connect_sync", lua_tcp_connect_sync},
+	LUA_INTERFACE_DEF (tcp, keepalive_stat),
 	{NULL, NULL}
 };
 
@@ -306,6 +317,8 @@ struct lua_tcp_dtor {
 #define LUA_TCP_FLAG_RESOLVED (1u << 6u)
 #define LUA_TCP_FLAG_SSL (1u << 7u)
 #define LUA_TCP_FLAG_SSL_NOVERIFY (1u << 8u)
+#define LUA_TCP_FLAG_KEEPALIVE (1u << 9u)
+#define LUA_TCP_FLAG_FAILED (1u << 10u)
 
 #undef TCP_DEBUG_REFS
 #ifdef TCP_DEBUG_REFS
@@ -345,8 +358,33 @@ struct lua_tcp_cbdata {
 	struct rspamd_ssl_connection *ssl_conn;
 	gchar *hostname;
 	gboolean eof;
+	gdouble keepalive_timeout;
 };
 
+/*
+ * Idle plain TCP connections of this process indexed by "hostname:addr:port"
+ */
+struct lua_tcp_keepalive_elt {
+	gint fd;
+	struct ev_loop *event_loop;
+	struct rspamd_io_ev ev;
+	GQueue *queue;
+	GList *link;
+};
+
+struct lua_tcp_keepalive_stat {
+	guint64 reused;
+	guint64 missed;
+	guint64 pooled;
+	guint64 expired;
+};
+
+static GHashTable *lua_tcp_keepalive_pool = NULL;
+static struct lua_tcp_keepalive_stat lua_tcp_keepalive_counters;
+/* Maximum number of idle connections per peer */
+static const guint lua_tcp_keepalive_max_idle = 16;
+static const gdouble default_tcp_keepalive_timeout = 30.0;
+
 #define IS_SYNC(c) (((c)->flags & LUA_TCP_FLAG_SYNC) != 0)
 
 #define msg_debug_tcp(...)  rspamd_conditional_debug_fast (NULL, cbd->addr, \
@@ -425,6 +463,147 @@ lua_tcp_shift_handler (struct lua_tcp_cbdata *cbd)
 	return TRUE;
 }
 
+static gchar *
+lua_tcp_keepalive_key (struct lua_tcp_cbdata *cbd)
+{
+	return g_strdup_printf ("%s:%s", cbd->hostname ? cbd->hostname : "",
+			rspamd_inet_address_to_string_pretty (cbd->addr));
+}
+
+static void
+lua_tcp_keepalive_queue_free (gpointer p)
+{
+	GQueue *queue = (GQueue *)p;
+	struct lua_tcp_keepalive_elt *elt;
+
+	while ((elt = g_queue_pop_head (queue)) != NULL) {
+		rspamd_ev_watcher_stop (elt->event_loop, &elt->ev);
+		close (elt->fd);
+		g_free (elt);
+	}
+
+	g_queue_free (queue);
+}
+
+static void
+lua_tcp_keepalive_handler (gint fd, short what, gpointer ud)
+{
+	struct lua_tcp_keepalive_elt *elt = (struct lua_tcp_keepalive_elt *)ud;
+
+	/*
+	 * Idle connection is either closed by peer, got unexpected data or
+	 * timed out, in all cases it cannot be reused
+	 */
+	rspamd_ev_watcher_stop (elt->event_loop, &elt->ev);
+	g_queue_delete_link (elt->queue, elt->link);
+	close (elt->fd);
+	g_free (elt);
+	lua_tcp_keepalive_counters.expired ++;
+}
+
+/*
+ * Returns an idle connected socket for this peer or -1
+ */
+static gint
+lua_tcp_keepalive_pop (struct lua_tcp_cbdata *cbd)
+{
+	struct lua_tcp_keepalive_elt *elt;
+	GQueue *queue = NULL;
+	gchar *key;
+	gint fd, err;
+	socklen_t len;
+
+	if (lua_tcp_keepalive_pool) {
+		key = lua_tcp_keepalive_key (cbd);
+		queue = g_hash_table_lookup (lua_tcp_keepalive_pool, key);
+		g_free (key);
+	}
+
+	while (queue && (elt = g_queue_pop_head (queue)) != NULL) {
+		fd = elt->fd;
+		rspamd_ev_watcher_stop (elt->event_loop, &elt->ev);
+		g_free (elt);
+
+		err = 0;
+		len = sizeof (err);
+
+		if (getsockopt (fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) != -1 &&
+				err == 0) {
+			msg_debug_tcp ("reused keepalive connection, %d connections queued",
+					queue->length);
+			lua_tcp_keepalive_counters.reused ++;
+
+			return fd;
+		}
+
+		close (fd);
+		lua_tcp_keepalive_counters.expired ++;
+	}
+
+	lua_tcp_keepalive_counters.missed ++;
+
+	return -1;
+}
+
+/*
+ * Moves socket to the keepalive pool if a connection is in a clean state
+ */
+static gboolean
+lua_tcp_keepalive_push (struct lua_tcp_cbdata *cbd)
+{
+	struct lua_tcp_keepalive_elt *elt;
+	GQueue *queue;
+	gchar *key;
+
+	if (!(cbd->flags & LUA_TCP_FLAG_KEEPALIVE) ||
+			(cbd->flags & LUA_TCP_FLAG_FAILED) ||
+			!(cbd->flags & LUA_TCP_FLAG_CONNECTED) ||
+			cbd->fd == -1 || cbd->ssl_conn || cbd->eof ||
+			(cbd->in && cbd->in->len > 0) ||
+			g_queue_get_length (cbd->handlers) > 0) {
+		return FALSE;
+	}
+
+	if (lua_tcp_keepalive_pool == NULL) {
+		lua_tcp_keepalive_pool = g_hash_table_new_full (g_str_hash,
+				g_str_equal, g_free, lua_tcp_keepalive_queue_free);
+	}
+
+	key = lua_tcp_keepalive_key (cbd);
+	queue = g_hash_table_lookup (lua_tcp_keepalive_pool, key);
+
+	if (queue == NULL) {
+		queue = g_queue_new ();
+		g_hash_table_insert (lua_tcp_keepalive_pool, key, queue);
+	}
+	else {
+		g_free (key);
+	}
+
+	if (queue->length >= lua_tcp_keepalive_max_idle) {
+		return FALSE;
+	}
+
+	rspamd_ev_watcher_stop (cbd->event_loop, &cbd->ev);
+
+	elt = g_malloc0 (sizeof (*elt));
+	elt->fd = cbd->fd;
+	elt->event_loop = cbd->event_loop;
+	elt->queue = queue;
+	g_queue_push_head (queue, elt);
+	elt->link = queue->head;
+	rspamd_ev_watcher_init (&elt->ev, elt->fd, EV_READ,
+			lua_tcp_keepalive_handler, elt);
+	rspamd_ev_watcher_start (elt->event_loop, &elt->ev, cbd->keepalive_timeout);
+
+	lua_tcp_keepalive_counters.pooled ++;
+	msg_debug_tcp ("push connection to keepalive pool, %d connections queued",
+			queue->length);
+	cbd->fd = -1;
+
+	return TRUE;
+}
+
 static void
 lua_tcp_fin (gpointer arg)
 {
@@ -451,7 +630,7 @@ lua_tcp_fin (gpointer arg)
 		rspamd_ssl_connection_free (cbd->ssl_conn);
 	}
 
-	if (cbd->fd != -1) {
+	if (cbd->fd != -1 && !lua_tcp_keepalive_push (cbd)) {
 		rspamd_ev_watcher_stop (cbd->event_loop, &cbd->ev);
 		close (cbd->fd);
 		cbd->fd = -1;
@@ -537,6 +716,9 @@ lua_tcp_push_error (struct lua_tcp_cbdata *cbd, gboolean is_fatal,
 	lua_State *L;
 	gboolean callback_called = FALSE;
 
+	/* Connection state is undefined after errors */
+	cbd->flags |= LUA_TCP_FLAG_FAILED;
+
 	if (cbd->thread) {
 		va_start (ap, err);
 		lua_tcp_resume_thread_error_argp (cbd, err, ap);
@@ -696,6 +878,7 @@ lua_tcp_resume_thread_error_argp (struct lua_tcp_cbdata *cbd, const gchar *error
 	struct thread_entry *thread = cbd->thread;
 	lua_State *L = thread->lua_state;
 
+	cbd->flags |= LUA_TCP_FLAG_FAILED;
 	lua_pushboolean (L, FALSE);
 	lua_pushvfstring (L, error, argp);
 
@@ -1265,10 +1448,17 @@ lua_tcp_ssl_on_error (gpointer ud, GError *err)
 static gboolean
 lua_tcp_make_connection (struct lua_tcp_cbdata *cbd)
 {
-	int fd;
+	int fd = -1;
 
 	rspamd_inet_address_set_port (cbd->addr, cbd->port);
-	fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+
+	if ((cbd->flags & LUA_TCP_FLAG_KEEPALIVE) && !(cbd->flags & LUA_TCP_FLAG_SSL)) {
+		fd = lua_tcp_keepalive_pop (cbd);
+	}
+
+	if (fd == -1) {
+		fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+	}
 
 	if (fd == -1) {
 		if (cbd->session) {
@@ -1447,6 +1637,9 @@ lua_tcp_arg_toiovec (lua_State *L, gint pos, struct lua_tcp_cbdata *cbd,
  * - `stop_pattern`: stop reading on finding a certain pattern (e.g. \r\n.\r\n for smtp)
  * - `shutdown`: half-close socket after writing (boolean: default false)
  * - `read`: read response after sending request (boolean: default true)
+ * - `keepalive`: return connection to the per process pool when all handlers are done with no errors,
+ *   so the next request to the same peer can reuse it (boolean: default false, plain TCP only)
+ * - `keepalive_timeout`: how long an idle connection is kept in the pool in **seconds** (default: 30)
  * @return {boolean} true if request has been sent
  */
 static gint
@@ -1468,8 +1661,9 @@ lua_tcp_request (lua_State *L)
 	guint niov = 0, total_out;
 	guint64 h;
 	gdouble timeout = default_tcp_timeout;
+	gdouble keepalive_timeout = default_tcp_keepalive_timeout;
 	gboolean partial = FALSE, do_shutdown = FALSE, do_read = TRUE,
-		ssl = FALSE, ssl_noverify = FALSE;
+		ssl = FALSE, ssl_noverify = FALSE, keepalive = FALSE;
 
 	if (lua_type (L, 1) == LUA_TTABLE) {
 		lua_pushstring (L, "host");
@@ -1603,6 +1797,20 @@ lua_tcp_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "keepalive");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) == LUA_TBOOLEAN) {
+			keepalive = lua_toboolean (L, -1);
+		}
+		lua_pop (L, 1);
+
+		lua_pushstring (L, "keepalive_timeout");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) == LUA_TNUMBER) {
+			keepalive_timeout = lua_tonumber (L, -1);
+		}
+		lua_pop (L, 1);
+
 		lua_pushstring (L, "ssl_noverify");
 		lua_gettable (L, -2);
 		if (lua_type (L, -1) == LUA_TBOOLEAN) {
@@ -1758,6 +1966,11 @@ lua_tcp_request (lua_State *L)
 	if (do_shutdown) {
 		cbd->flags |= LUA_TCP_FLAG_SHUTDOWN;
 	}
+	else if (keepalive) {
+		/* Half closed connections cannot be reused */
+		cbd->flags |= LUA_TCP_FLAG_KEEPALIVE;
+		cbd->keepalive_timeout = keepalive_timeout;
+	}
 
 	if (do_read) {
 		struct lua_tcp_handler *rh;
@@ -1850,6 +2063,8 @@ lua_tcp_request (lua_State *L)
  * - `host`: IP or name of the peer (required)
  * - `port`: remote port to use
  * - `timeout`: floating point value that specifies timeout for IO operations in **seconds**
+ * - `keepalive`: return connection to the per process pool on `close` if there were no errors (plain TCP only)
+ * - `keepalive_timeout`: how long an idle connection is kept in the pool in **seconds** (default: 30)
  * @return {boolean} true if request has been sent
  */
 static gint
@@ -1859,8 +2074,10 @@ lua_tcp_connect_sync (lua_State *L)
 	GError *err = NULL;
 
 	gint64 port = -1;
-	gdouble timeout = default_tcp_timeout;
+	gdouble timeout = default_tcp_timeout,
+			keepalive_timeout = default_tcp_keepalive_timeout;
 	const gchar *host = NULL;
+	gboolean keepalive = FALSE;
 	gint ret;
 	guint64 h;
 
@@ -1875,9 +2092,10 @@ lua_tcp_connect_sync (lua_State *L)
 	int arguments_validated = rspamd_lua_parse_table_arguments (L, 1, &err,
 			RSPAMD_LUA_PARSE_ARGUMENTS_DEFAULT,
 			"task=U{task};session=U{session};resolver=U{resolver};ev_base=U{ev_base};"
-			"*host=S;*port=I;timeout=D;config=U{config}",
+			"*host=S;*port=I;timeout=D;config=U{config};keepalive=B;"
+			"keepalive_timeout=D",
 			&task, &session, &resolver, &ev_base,
-			&host, &port, &timeout, &cfg);
+			&host, &port, &timeout, &cfg, &keepalive, &keepalive_timeout);
 
 	if (!arguments_validated) {
 		if (err) {
@@ -1903,6 +2121,10 @@ lua_tcp_connect_sync (lua_State *L)
 		timeout = default_tcp_timeout;
 	}
 
+	if (isnan (keepalive_timeout)) {
+		keepalive_timeout = default_tcp_keepalive_timeout;
+	}
+
 	cbd = g_new0 (struct lua_tcp_cbdata, 1);
 
 	if (task) {
@@ -1939,6 +2161,11 @@ lua_tcp_connect_sync (lua_State *L)
 
 	cbd->event_loop = ev_base;
 	cbd->flags |= LUA_TCP_FLAG_SYNC;
+
+	if (keepalive) {
+		cbd->flags |= LUA_TCP_FLAG_KEEPALIVE;
+		cbd->keepalive_timeout = keepalive_timeout;
+	}
 	cbd->fd = -1;
 	cbd->port = (guint16)port;
 
@@ -2019,6 +2246,37 @@ lua_tcp_connect_sync (lua_State *L)
 	return lua_thread_yield (cbd->thread, 0);
 }
 
+static gint
+lua_tcp_keepalive_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	GHashTableIter it;
+	gpointer k, v;
+	guint64 idle = 0;
+
+	if (lua_tcp_keepalive_pool) {
+		g_hash_table_iter_init (&it, lua_tcp_keepalive_pool);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			idle += ((GQueue *)v)->length;
+		}
+	}
+
+	lua_createtable (L, 0, 5);
+	lua_pushinteger (L, lua_tcp_keepalive_counters.reused);
+	lua_setfield (L, -2, "reused");
+	lua_pushinteger (L, lua_tcp_keepalive_counters.missed);
+	lua_setfield (L, -2, "missed");
+	lua_pushinteger (L, lua_tcp_keepalive_counters.pooled);
+	lua_setfield (L, -2, "pooled");
+	lua_pushinteger (L, lua_tcp_keepalive_counters.expired);
+	lua_setfield (L, -2, "expired");
+	lua_pushinteger (L, idle);
+	lua_setfield (L, -2, "idle");
+
+	return 1;
+}
+
 static gint
 lua_tcp_close (lua_State *L)
 {
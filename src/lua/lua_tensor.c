@@ -18,6 +18,11 @@
 #include "lua_tensor.h"
 #include "contrib/kann/kautodiff.h"
 #include "blas-config.h"
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 /***
  * @module rspamd_tensor
@@ -41,6 +46,12 @@ LUA_FUNCTION_DEF (tensor, mean);
 LUA_FUNCTION_DEF (tensor, transpose);
 LUA_FUNCTION_DEF (tensor, has_blas);
 LUA_FUNCTION_DEF (tensor, scatter_matrix);
+LUA_FUNCTION_DEF (tensor, add);
+LUA_FUNCTION_DEF (tensor, scale);
+LUA_FUNCTION_DEF (tensor, clamp);
+LUA_FUNCTION_DEF (tensor, normalize);
+LUA_FUNCTION_DEF (tensor, dot);
+LUA_FUNCTION_DEF (tensor, view);
 
 static luaL_reg rspamd_tensor_f[] = {
 		LUA_INTERFACE_DEF (tensor, load),
@@ -64,9 +75,40 @@ static luaL_reg rspamd_tensor_m[] = {
 		LUA_INTERFACE_DEF (tensor, eigen),
 		LUA_INTERFACE_DEF (tensor, mean),
 		LUA_INTERFACE_DEF (tensor, transpose),
+		LUA_INTERFACE_DEF (tensor, add),
+		LUA_INTERFACE_DEF (tensor, scale),
+		LUA_INTERFACE_DEF (tensor, clamp),
+		LUA_INTERFACE_DEF (tensor, normalize),
+		LUA_INTERFACE_DEF (tensor, dot),
+		LUA_INTERFACE_DEF (tensor, view),
 		{NULL, NULL},
 };
 
+static inline gint
+lua_tensor_numel (const struct rspamd_lua_tensor *t)
+{
+	/* Size is negative for non-owning tensors */
+	return t->size > 0 ? t->size : -(t->size);
+}
+
+/*
+ * Creates a non-owning tensor that points to the data of a tensor at `pos`,
+ * the owner is referenced by a view, so it is not collected while the view is alive
+ */
+static struct rspamd_lua_tensor *
+lua_tensor_new_view (lua_State *L, gint pos, int ndims, const int *dim,
+		rspamd_tensor_num_t *data)
+{
+	struct rspamd_lua_tensor *res;
+
+	res = lua_newtensor (L, ndims, dim, false, false);
+	res->data = data;
+	lua_pushvalue (L, pos);
+	res->parent_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return res;
+}
+
 struct rspamd_lua_tensor *
 lua_newtensor (lua_State *L, int ndims, const int *dim, bool zero_fill, bool own)
 {
@@ -244,6 +286,10 @@ lua_tensor_destroy (lua_State *L)
 		if (t->size > 0) {
 			g_free (t->data);
 		}
+
+		if (t->parent_ref > 0) {
+			luaL_unref (L, LUA_REGISTRYINDEX, t->parent_ref);
+		}
 	}
 
 	return 0;
@@ -343,7 +389,7 @@ lua_tensor_index (lua_State *L)
 
 			if (t->ndims == 1) {
 				/* Individual element */
-				if (idx <= t->dim[0]) {
+				if (idx > 0 && idx <= t->dim[0]) {
 					lua_pushnumber (L, t->data[idx - 1]);
 				}
 				else {
@@ -355,11 +401,10 @@ lua_tensor_index (lua_State *L)
 				gint dim = t->dim[1];
 
 
-				if (idx <= t->dim[0]) {
+				if (idx > 0 && idx <= t->dim[0]) {
 					/* Non-owning tensor */
-					struct rspamd_lua_tensor *res =
-							lua_newtensor (L, 1, &dim, false, false);
-					res->data = &t->data[(idx - 1) * t->dim[1]];
+					lua_tensor_new_view (L, 1, 1, &dim,
+							&t->data[(idx - 1) * t->dim[1]]);
 				}
 				else {
 					lua_pushnil (L);
@@ -802,6 +847,270 @@ lua_tensor_scatter_matrix (lua_State *L)
 	return 1;
 }
 
+/*
+ * Elementwise primitives: loops are kept trivial so they are vectorised by
+ * a compiler, dot product is explicitly unrolled as compilers cannot
+ * reorder float sums on their own
+ */
+static inline rspamd_tensor_num_t
+rspamd_tensor_sdot (gint n, const rspamd_tensor_num_t *x,
+		const rspamd_tensor_num_t *y)
+{
+	gint i = 0;
+	rspamd_tensor_num_t s = 0;
+#ifdef __SSE__
+	gint n8 = n >> 3 << 3;
+	__m128 vs1 = _mm_setzero_ps (), vs2 = _mm_setzero_ps ();
+	float tmp[4];
+
+	for (; i < n8; i += 8) {
+		vs1 = _mm_add_ps (vs1, _mm_mul_ps (_mm_loadu_ps (&x[i]),
+				_mm_loadu_ps (&y[i])));
+		vs2 = _mm_add_ps (vs2, _mm_mul_ps (_mm_loadu_ps (&x[i + 4]),
+				_mm_loadu_ps (&y[i + 4])));
+	}
+
+	_mm_storeu_ps (tmp, _mm_add_ps (vs1, vs2));
+	s = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+#endif
+
+	for (; i < n; i ++) {
+		s += x[i] * y[i];
+	}
+
+	return s;
+}
+
+static inline void
+rspamd_tensor_sadd_scalar (gint n, rspamd_tensor_num_t a,
+		rspamd_tensor_num_t *x)
+{
+	for (gint i = 0; i < n; i ++) {
+		x[i] += a;
+	}
+}
+
+static inline void
+rspamd_tensor_sscal (gint n, rspamd_tensor_num_t a, rspamd_tensor_num_t *x)
+{
+	for (gint i = 0; i < n; i ++) {
+		x[i] *= a;
+	}
+}
+
+static inline void
+rspamd_tensor_sclamp (gint n, rspamd_tensor_num_t lo, rspamd_tensor_num_t hi,
+		rspamd_tensor_num_t *x)
+{
+	for (gint i = 0; i < n; i ++) {
+		rspamd_tensor_num_t v = x[i];
+
+		v = v < lo ? lo : v;
+		x[i] = v > hi ? hi : v;
+	}
+}
+
+/***
+ * @method tensor:add(other[, alpha])
+ * Adds `alpha * other` (`alpha` is 1 by default) to a tensor in place. `other`
+ * could be a number, a tensor of the same size or a row that is added to each
+ * row of a matrix
+ * @return {tensor} the same tensor
+ */
+static gint
+lua_tensor_add (lua_State *L)
+{
+	struct rspamd_lua_tensor *t = lua_check_tensor (L, 1), *other;
+	rspamd_tensor_num_t alpha = luaL_optnumber (L, 3, 1.0);
+	gint n;
+
+	if (!t) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	n = lua_tensor_numel (t);
+
+	if (lua_isnumber (L, 2)) {
+		rspamd_tensor_sadd_scalar (n, lua_tonumber (L, 2) * alpha, t->data);
+	}
+	else {
+		other = lua_check_tensor (L, 2);
+
+		if (!other) {
+			return luaL_error (L, "invalid arguments: tensor or number expected");
+		}
+
+		if (lua_tensor_numel (other) == n) {
+			kad_saxpy (n, alpha, other->data, t->data);
+		}
+		else if (t->ndims == 2 && lua_tensor_numel (other) == t->dim[1]) {
+			for (gint i = 0; i < t->dim[0]; i ++) {
+				kad_saxpy (t->dim[1], alpha, other->data,
+						&t->data[i * t->dim[1]]);
+			}
+		}
+		else {
+			return luaL_error (L, "incompatible dimensions: %d and %d elements",
+					n, lua_tensor_numel (other));
+		}
+	}
+
+	lua_pushvalue (L, 1);
+
+	return 1;
+}
+
+/***
+ * @method tensor:scale(factor)
+ * Multiplies all elements of a tensor by `factor` in place
+ * @return {tensor} the same tensor
+ */
+static gint
+lua_tensor_scale (lua_State *L)
+{
+	struct rspamd_lua_tensor *t = lua_check_tensor (L, 1);
+
+	if (!t || !lua_isnumber (L, 2)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rspamd_tensor_sscal (lua_tensor_numel (t), lua_tonumber (L, 2), t->data);
+	lua_pushvalue (L, 1);
+
+	return 1;
+}
+
+/***
+ * @method tensor:clamp(min, max)
+ * Limits all elements of a tensor to [min, max] range in place
+ * @return {tensor} the same tensor
+ */
+static gint
+lua_tensor_clamp (lua_State *L)
+{
+	struct rspamd_lua_tensor *t = lua_check_tensor (L, 1);
+	rspamd_tensor_num_t lo, hi;
+
+	if (!t || !lua_isnumber (L, 2) || !lua_isnumber (L, 3)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lo = lua_tonumber (L, 2);
+	hi = lua_tonumber (L, 3);
+
+	if (lo > hi) {
+		return luaL_error (L, "invalid range: %f > %f", lo, hi);
+	}
+
+	rspamd_tensor_sclamp (lua_tensor_numel (t), lo, hi, t->data);
+	lua_pushvalue (L, 1);
+
+	return 1;
+}
+
+/***
+ * @method tensor:normalize()
+ * Scales a vector (or each row of a matrix) to the unit euclidean norm in place,
+ * zero vectors are left untouched
+ * @return {tensor} the same tensor
+ */
+static gint
+lua_tensor_normalize (lua_State *L)
+{
+	struct rspamd_lua_tensor *t = lua_check_tensor (L, 1);
+	gint nrows, ncols;
+
+	if (!t) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (t->ndims == 1) {
+		nrows = 1;
+		ncols = t->dim[0];
+	}
+	else {
+		nrows = t->dim[0];
+		ncols = t->dim[1];
+	}
+
+	for (gint i = 0; i < nrows; i ++) {
+		rspamd_tensor_num_t *row = &t->data[i * ncols];
+		rspamd_tensor_num_t norm = sqrtf (rspamd_tensor_sdot (ncols, row, row));
+
+		if (norm > 0) {
+			rspamd_tensor_sscal (ncols, 1.0f / norm, row);
+		}
+	}
+
+	lua_pushvalue (L, 1);
+
+	return 1;
+}
+
+/***
+ * @method tensor:dot(other)
+ * Returns dot product of two tensors with the same number of elements
+ * @return {number} dot product
+ */
+static gint
+lua_tensor_dot (lua_State *L)
+{
+	struct rspamd_lua_tensor *t1 = lua_check_tensor (L, 1),
+			*t2 = lua_check_tensor (L, 2);
+
+	if (!t1 || !t2) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_tensor_numel (t1) != lua_tensor_numel (t2)) {
+		return luaL_error (L, "incompatible dimensions: %d and %d elements",
+				lua_tensor_numel (t1), lua_tensor_numel (t2));
+	}
+
+	lua_pushnumber (L, rspamd_tensor_sdot (lua_tensor_numel (t1),
+			t1->data, t2->data));
+
+	return 1;
+}
+
+/***
+ * @method tensor:view(start[, count])
+ * Returns a tensor that shares data with this tensor: `count` elements of a
+ * vector or `count` rows of a matrix starting from `start` (1 based).
+ * By default, a view lasts to the end of a tensor. Modifications of a view
+ * are visible in the original tensor
+ * @return {tensor} view tensor
+ */
+static gint
+lua_tensor_view (lua_State *L)
+{
+	struct rspamd_lua_tensor *t = lua_check_tensor (L, 1);
+	gint start = luaL_optinteger (L, 2, 1), count, dims[2];
+
+	if (!t) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	count = luaL_optinteger (L, 3, t->dim[0] - start + 1);
+
+	if (start < 1 || count < 0 || start + count - 1 > t->dim[0]) {
+		return luaL_error (L, "invalid view: %d elements from %d, %d available",
+				count, start, t->dim[0]);
+	}
+
+	if (t->ndims == 1) {
+		dims[0] = count;
+		lua_tensor_new_view (L, 1, 1, dims, &t->data[start - 1]);
+	}
+	else {
+		dims[0] = count;
+		dims[1] = t->dim[1];
+		lua_tensor_new_view (L, 1, 2, dims, &t->data[(start - 1) * t->dim[1]]);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_tensor (lua_State * L)
 {
@@ -25,6 +25,7 @@ struct rspamd_lua_tensor {
 	int size; /* overall size (product of dims) */
 	int dim[2];
 	rspamd_tensor_num_t *data;
+	int parent_ref; /* reference to the owning tensor for views, 0 if none */
 };
 
 struct rspamd_lua_tensor *lua_check_tensor (lua_State *L, int pos);
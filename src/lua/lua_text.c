@@ -306,6 +306,27 @@ lua_check_text_or_string (lua_State * L, gint pos)
 	return NULL;
 }
 
+const gchar *
+lua_check_lstring_or_text (lua_State *L, gint pos, gsize *len)
+{
+	gint pos_type = lua_type (L, pos);
+
+	if (pos_type == LUA_TSTRING) {
+		return lua_tolstring (L, pos, len);
+	}
+	else if (pos_type == LUA_TUSERDATA) {
+		struct rspamd_lua_text *t = lua_check_text (L, pos);
+
+		if (t) {
+			*len = t->len;
+
+			return t->start;
+		}
+	}
+
+	return NULL;
+}
+
 struct rspamd_lua_text *
 lua_new_text (lua_State *L, const gchar *start, gsize len, gboolean own)
 {
@@ -27,29 +27,45 @@
 
 INIT_LOG_MODULE(lua_threads)
 
+/* Initial number of cached threads */
+#define LUA_THREAD_POOL_DEFAULT_ITEMS 100
+/* Number of cached threads that is always allowed */
+#define LUA_THREAD_POOL_MIN_ITEMS 16
+/* Default hard limit of cached threads, each holds its own Lua stack */
+#define LUA_THREAD_POOL_DEFAULT_LIMIT 1024
+/* Number of returned threads between adjustments of the pool size */
+#define LUA_THREAD_POOL_ADJUST_ITERS 1024
+
 struct lua_thread_pool {
 	GQueue *available_items;
 	lua_State *L;
 	gint max_items;
+	gint max_items_limit;
+	guint running;
+	guint window_peak;
+	guint window_iters;
+	struct lua_thread_pool_stat stat;
 	struct thread_entry *running_entry;
 };
 
 static struct thread_entry *
-thread_entry_new (lua_State * L)
+thread_entry_new (struct lua_thread_pool *pool)
 {
 	struct thread_entry *ent;
 	ent = g_new0(struct thread_entry, 1);
-	ent->lua_state = lua_newthread (L);
-	ent->thread_index = luaL_ref (L, LUA_REGISTRYINDEX);
+	ent->lua_state = lua_newthread (pool->L);
+	ent->thread_index = luaL_ref (pool->L, LUA_REGISTRYINDEX);
+	pool->stat.created ++;
 
 	return ent;
 }
 
 static void
-thread_entry_free (lua_State * L, struct thread_entry *ent)
+thread_entry_free (struct lua_thread_pool *pool, struct thread_entry *ent)
 {
-	luaL_unref (L, LUA_REGISTRYINDEX, ent->thread_index);
+	luaL_unref (pool->L, LUA_REGISTRYINDEX, ent->thread_index);
 	g_free (ent);
+	pool->stat.destroyed ++;
 }
 
 struct lua_thread_pool *
@@ -58,27 +74,81 @@ lua_thread_pool_new (lua_State * L)
 	struct lua_thread_pool * pool = g_new0 (struct lua_thread_pool, 1);
 
 	pool->L = L;
-	pool->max_items = 100;
+	pool->max_items = LUA_THREAD_POOL_DEFAULT_ITEMS;
+	pool->max_items_limit = LUA_THREAD_POOL_DEFAULT_LIMIT;
 
 	pool->available_items = g_queue_new ();
 	int i;
 
 	struct thread_entry *ent;
 	for (i = 0; i < MAX(2, pool->max_items / 10); i ++) {
-		ent = thread_entry_new (pool->L);
+		ent = thread_entry_new (pool);
 		g_queue_push_head (pool->available_items, ent);
 	}
 
 	return pool;
 }
 
+void
+lua_thread_pool_set_limit (struct lua_thread_pool *pool, guint limit)
+{
+	if (limit > 0) {
+		pool->max_items_limit = MAX (limit, LUA_THREAD_POOL_MIN_ITEMS);
+		pool->max_items = MIN (pool->max_items, pool->max_items_limit);
+	}
+}
+
+void
+lua_thread_pool_get_stat (struct lua_thread_pool *pool,
+		struct lua_thread_pool_stat *st)
+{
+	memcpy (st, &pool->stat, sizeof (*st));
+	st->running = pool->running;
+	st->cached = g_queue_get_length (pool->available_items);
+	st->max_items = pool->max_items;
+}
+
+/*
+ * Adjusts number of cached threads to the peak number of threads used
+ * concurrently during the last window, so async heavy workloads do not create
+ * and destroy threads all the time and idle workers do not keep useless stacks
+ */
+static void
+lua_thread_pool_adjust (struct lua_thread_pool *pool)
+{
+	gint new_max;
+	struct thread_entry *ent;
+
+	if (++pool->window_iters < LUA_THREAD_POOL_ADJUST_ITERS) {
+		return;
+	}
+
+	/* Leave some headroom above the observed peak */
+	new_max = pool->window_peak + pool->window_peak / 4;
+	new_max = CLAMP (new_max, LUA_THREAD_POOL_MIN_ITEMS, pool->max_items_limit);
+
+	if (new_max != pool->max_items) {
+		msg_debug_lua_threads ("adjust threads pool size: %d -> %d, peak: %ud",
+				pool->max_items, new_max, pool->window_peak);
+		pool->max_items = new_max;
+	}
+
+	while (g_queue_get_length (pool->available_items) > pool->max_items) {
+		ent = g_queue_pop_tail (pool->available_items);
+		thread_entry_free (pool, ent);
+	}
+
+	pool->window_iters = 0;
+	pool->window_peak = pool->running;
+}
+
 void
 lua_thread_pool_free (struct lua_thread_pool *pool)
 {
 	struct thread_entry *ent = NULL;
 	while (!g_queue_is_empty (pool->available_items)) {
 		ent = g_queue_pop_head (pool->available_items);
-		thread_entry_free (pool->L, ent);
+		thread_entry_free (pool, ent);
 	}
 	g_queue_free (pool->available_items);
 	g_free (pool);
@@ -115,12 +185,28 @@ lua_thread_pool_get (struct lua_thread_pool *pool)
 
 	if (cur) {
 		ent = cur;
+		pool->stat.reused ++;
 	}
 	else {
-		ent = thread_entry_new (pool->L);
+		ent = thread_entry_new (pool);
+	}
+
+	if (lua_gethook (ent->lua_state) != lua_gethook (pool->L)) {
+		/* Threads created before a hook was set on the main state (profiler) */
+		lua_sethook (ent->lua_state, lua_gethook (pool->L),
+				lua_gethookmask (pool->L), lua_gethookcount (pool->L));
 	}
 
 	pool->running_entry = ent;
+	pool->running ++;
+
+	if (pool->running > pool->window_peak) {
+		pool->window_peak = pool->running;
+
+		if (pool->window_peak > pool->stat.peak) {
+			pool->stat.peak = pool->window_peak;
+		}
+	}
 
 	return ent;
 }
@@ -136,7 +222,13 @@ lua_thread_pool_return_full (struct lua_thread_pool *pool,
 		pool->running_entry = NULL;
 	}
 
-	if (g_queue_get_length (pool->available_items) <= pool->max_items) {
+	if (pool->running > 0) {
+		pool->running --;
+	}
+
+	lua_thread_pool_adjust (pool);
+
+	if (g_queue_get_length (pool->available_items) < pool->max_items) {
 		thread_entry->cd = NULL;
 		thread_entry->finish_callback = NULL;
 		thread_entry->error_callback = NULL;
@@ -153,7 +245,7 @@ lua_thread_pool_return_full (struct lua_thread_pool *pool,
 		msg_debug_lua_threads ("%s: removed thread as thread pool has %ud items",
 				loc,
 				g_queue_get_length (pool->available_items));
-		thread_entry_free (pool->L, thread_entry);
+		thread_entry_free (pool, thread_entry);
 	}
 }
 
@@ -170,11 +262,15 @@ lua_thread_pool_terminate_entry (struct lua_thread_pool *pool,
 		pool->running_entry = NULL;
 	}
 
+	if (pool->running > 0) {
+		pool->running --;
+	}
+
 	msg_debug_lua_threads ("%s: terminated thread entry", loc);
-	thread_entry_free (pool->L, thread_entry);
+	thread_entry_free (pool, thread_entry);
 
-	if (g_queue_get_length (pool->available_items) <= pool->max_items) {
-		ent = thread_entry_new (pool->L);
+	if (g_queue_get_length (pool->available_items) < pool->max_items) {
+		ent = thread_entry_new (pool);
 		g_queue_push_head (pool->available_items, ent);
 	}
 }
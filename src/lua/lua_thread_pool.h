@@ -28,6 +28,16 @@ struct thread_entry {
 	struct rspamd_config *cfg;
 };
 
+struct lua_thread_pool_stat {
+	guint64 created;
+	guint64 reused;
+	guint64 destroyed;
+	guint peak;
+	guint running;
+	guint cached;
+	guint max_items;
+};
+
 struct lua_callback_state {
 	lua_State *L;
 	struct thread_entry *my_thread;
@@ -51,6 +61,24 @@ lua_thread_pool_new (lua_State *L);
 void
 lua_thread_pool_free (struct lua_thread_pool *pool);
 
+/**
+ * Sets hard limit of threads cached by the pool, the actual number of cached
+ * threads follows the peak number of concurrently running threads
+ * @param pool
+ * @param limit
+ */
+void
+lua_thread_pool_set_limit (struct lua_thread_pool *pool, guint limit);
+
+/**
+ * Fills pool statistics
+ * @param pool
+ * @param st
+ */
+void
+lua_thread_pool_get_stat (struct lua_thread_pool *pool,
+						  struct lua_thread_pool_stat *st);
+
 /**
  * Extracts a thread from the list of available ones.
  * It immediately becames running one and should be used to run a Lua script/function straight away.
@@ -41,6 +41,7 @@ trie:match('some big text', trie_callback)
 LUA_FUNCTION_DEF (trie, create);
 LUA_FUNCTION_DEF (trie, has_hyperscan);
 LUA_FUNCTION_DEF (trie, match);
+LUA_FUNCTION_DEF (trie, match_vector);
 LUA_FUNCTION_DEF (trie, search_mime);
 LUA_FUNCTION_DEF (trie, search_rawmsg);
 LUA_FUNCTION_DEF (trie, search_rawbody);
@@ -48,6 +49,7 @@ LUA_FUNCTION_DEF (trie, destroy);
 
 static const struct luaL_reg trielib_m[] = {
 	LUA_INTERFACE_DEF (trie, match),
+	LUA_INTERFACE_DEF (trie, match_vector),
 	LUA_INTERFACE_DEF (trie, search_mime),
 	LUA_INTERFACE_DEF (trie, search_rawmsg),
 	LUA_INTERFACE_DEF (trie, search_rawbody),
@@ -353,6 +355,60 @@ lua_trie_match (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method trie:match_vector(inputs[, report_start])
+ * Search for patterns in each element of `inputs` in a single call
+ * @param {table} inputs array of strings or texts
+ * @param {boolean} report_start report both start and end offset when matching patterns
+ * @return {table,boolean} table indexed by numbers of matched inputs, each value is a table of match positions indexed by pattern number as returned by `trie:match`; `true` if any pattern has been found
+ */
+static gint
+lua_trie_match_vector (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	const gchar *text;
+	gsize len;
+	gboolean found = FALSE, report_start = FALSE;
+	gint ninputs, res_pos;
+
+	if (!trie || !lua_istable (L, 2)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	report_start = lua_toboolean (L, 3);
+	ninputs = rspamd_lua_table_size (L, 2);
+	lua_newtable (L);
+	res_pos = lua_gettop (L);
+
+	for (gint i = 1; i <= ninputs; i ++) {
+		lua_rawgeti (L, 2, i);
+		text = lua_check_lstring_or_text (L, -1, &len);
+		lua_pop (L, 1);
+
+		if (text == NULL || len == 0) {
+			continue;
+		}
+
+		/* Table callback expects report_start and a result table on top */
+		lua_pushboolean (L, report_start);
+		lua_newtable (L);
+
+		if (lua_trie_search_str (L, trie, text, len, lua_trie_table_callback)) {
+			found = TRUE;
+			lua_rawseti (L, res_pos, i);
+			lua_pop (L, 1);
+		}
+		else {
+			lua_pop (L, 2);
+		}
+	}
+
+	lua_pushboolean (L, found);
+
+	return 2;
+}
+
 /***
  * @method trie:search_mime(task, cb)
  * This is a helper mehthod to search pattern within text parts of a message in rspamd task
@@ -25,6 +25,8 @@
  * - round-robin: balance upstreams one by one selecting accordingly to their weight
  * - hash: use stable hashing algorithm to distribute values according to some static strings
  * - master-slave: always prefer upstream with higher priority unless it is not available
+ * - least-loaded: prefer upstream with less requests in flight and faster responses
+ * - maglev: stable hashing with a constant time lookup, suitable for large lists
  *
  * Here is an example of upstreams manipulations:
  * @example
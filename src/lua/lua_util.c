@@ -145,8 +145,8 @@ LUA_FUNCTION_DEF (util, parse_html);
 /***
  * @function util.levenshtein_distance(s1, s2)
  * Returns levenstein distance between two strings
- * @param {string} s1 the first string
- * @param {string} s2 the second string
+ * @param {string|text} s1 the first string
+ * @param {string|text} s2 the second string
  * @return {number} number of differences in two strings
  */
 LUA_FUNCTION_DEF (util, levenshtein_distance);
@@ -167,7 +167,7 @@ LUA_FUNCTION_DEF (util, fold_header);
  * @function util.is_uppercase(str)
  * Returns true if a string is all uppercase
  *
- * @param {string} str input string
+ * @param {string|text} str input string
  * @return {bool} true if a string is all uppercase
  */
 LUA_FUNCTION_DEF (util, is_uppercase);
@@ -227,7 +227,7 @@ LUA_FUNCTION_DEF (util, parse_mail_address);
  * @function util.strlen_utf8(str)
  * Returns length of string encoded in utf-8 in characters.
  * If invalid characters are found, then this function returns number of bytes.
- * @param {string} str utf8 encoded string
+ * @param {string|text} str utf8 encoded string
  * @return {number} number of characters in string
  */
 LUA_FUNCTION_DEF (util, strlen_utf8);
@@ -235,7 +235,7 @@ LUA_FUNCTION_DEF (util, strlen_utf8);
 /***
  * @function util.lower_utf8(str)
  * Converts utf8 string to lower case
- * @param {string} str utf8 encoded string
+ * @param {string|text} str utf8 encoded string
  * @return {string} lowercased utf8 string
  */
 LUA_FUNCTION_DEF (util, lower_utf8);
@@ -255,8 +255,8 @@ LUA_FUNCTION_DEF (util, strcasecmp_ascii);
  * @function util.strequal_caseless(str1, str2)
  * Compares two utf8 strings regardless of their case. Return `true` if `str1` is
  * equal to `str2`
- * @param {string} str1 utf8 encoded string
- * @param {string} str2 utf8 encoded string
+ * @param {string|text} str1 utf8 encoded string
+ * @param {string|text} str2 utf8 encoded string
  * @return {bool} result of comparison
  */
 LUA_FUNCTION_DEF (util, strequal_caseless);
@@ -428,7 +428,7 @@ LUA_FUNCTION_DEF (util, is_utf_spoofed);
 /**
 * @function util.is_utf_mixed_script(str)
 * Returns true if a string contains mixed unicode scripts
-* @param {string} String to check
+* @param {string|text} String to check
 * @return {boolean} true if a string contains chars with mixed unicode script
 */
 LUA_FUNCTION_DEF (util, is_utf_mixed_script);
@@ -436,7 +436,7 @@ LUA_FUNCTION_DEF (util, is_utf_mixed_script);
 /**
 * @function util.is_utf_outside_range(str, range_start, range_end)
 * Returns true if a string contains chars outside range
-* @param {string} String to check
+* @param {string|text} String to check
 * @param {number} start of character range similar to uset_addRange
 * @param {number} end of character range similar to uset_addRange
 * @return {boolean} true if a string contains chars outside selected utf range
@@ -646,6 +646,41 @@ LUA_FUNCTION_DEF (util, btc_polymod);
  */
 LUA_FUNCTION_DEF (util, parse_smtp_date);
 
+/***
+ * @function util.freeze(tbl)
+ * Serializes a table to an immutable representation in a shared memory
+ * mapping. Mapping is inherited by forked workers, so the data is shared
+ * between all processes and is not scanned by GC. Keys must be strings or
+ * numbers, values can be booleans, numbers, strings and tables (nested tables
+ * are frozen as well).
+ * Returned object can be indexed (`ft[key]`, `#ft`) like the original table
+ * but it is not a table, so `pairs`/`ipairs` should be replaced with
+ * `util.frozen_pairs`.
+ * @param {table} tbl table to freeze
+ * @return {rspamd{frozen}} frozen table
+ */
+LUA_FUNCTION_DEF (util, freeze);
+
+/***
+ * @function util.frozen_pairs(ft)
+ * Returns an iterator over all elements of a frozen table: array elements
+ * go first in order, others are sorted by key
+ * @param {rspamd{frozen}} ft frozen table
+ * @return {function} iterator returning key and value
+ */
+LUA_FUNCTION_DEF (util, frozen_pairs);
+
+/***
+ * @function util.clickhouse_tsv_row(row)
+ * Converts an array of values to a single TabSeparated row for Clickhouse:
+ * strings are escaped, integer numbers are written with no fractional part,
+ * tables are written as Clickhouse arrays and booleans are written as 1 or 0.
+ * Userdata values (e.g. `rspamd_text` or `rspamd_ip`) are converted to strings.
+ * @param {table} row array of values
+ * @return {rspamd_text} TSV row with no trailing newline
+ */
+LUA_FUNCTION_DEF (util, clickhouse_tsv_row);
+
 
 static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, create_event_base),
@@ -712,6 +747,9 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, packsize),
 	LUA_INTERFACE_DEF (util, btc_polymod),
 	LUA_INTERFACE_DEF (util, parse_smtp_date),
+	LUA_INTERFACE_DEF (util, freeze),
+	LUA_INTERFACE_DEF (util, frozen_pairs),
+	LUA_INTERFACE_DEF (util, clickhouse_tsv_row),
 	{NULL, NULL}
 };
 
@@ -727,6 +765,18 @@ static const struct luaL_reg int64lib_m[] = {
 	{NULL, NULL}
 };
 
+LUA_FUNCTION_DEF (frozen, index);
+LUA_FUNCTION_DEF (frozen, len);
+LUA_FUNCTION_DEF (frozen, gc);
+
+static const struct luaL_reg frozenlib_m[] = {
+	{"__index", lua_frozen_index},
+	{"__len", lua_frozen_len},
+	{"__gc", lua_frozen_gc},
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
 LUA_FUNCTION_DEF (ev_base, loop);
 
 static const struct luaL_reg ev_baselib_m[] = {
@@ -1340,8 +1390,12 @@ lua_util_levenshtein_distance (lua_State *L)
 	gint dist = 0;
 	guint replace_cost = 1;
 
-	s1 = luaL_checklstring (L, 1, &s1len);
-	s2 = luaL_checklstring (L, 2, &s2len);
+	s1 = lua_check_lstring_or_text (L, 1, &s1len);
+	s2 = lua_check_lstring_or_text (L, 2, &s2len);
+
+	if (s1 == NULL || s2 == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
 
 	if (lua_isnumber (L, 3)) {
 		replace_cost = lua_tonumber (L, 3);
@@ -1417,9 +1471,13 @@ lua_util_is_uppercase (lua_State *L)
 	UChar32 uc;
 	guint nlc = 0, nuc = 0;
 
-	str = luaL_checklstring (L, 1, &sz);
+	str = lua_check_lstring_or_text (L, 1, &sz);
 
-	if (str && sz > 0) {
+	if (str == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (sz > 0) {
 		while (i >= 0 && i < sz) {
 			U8_NEXT (str, i, sz, uc);
 
@@ -1530,7 +1588,7 @@ lua_util_strlen_utf8 (lua_State *L)
 	const gchar *str;
 	gsize len;
 
-	str = lua_tolstring (L, 1, &len);
+	str = lua_check_lstring_or_text (L, 1, &len);
 
 	if (str) {
 		gint32 i = 0, nchars = 0;
@@ -1561,7 +1619,7 @@ lua_util_lower_utf8 (lua_State *L)
 	UBool err = 0;
 	gint32 i = 0, j = 0;
 
-	str = lua_tolstring (L, 1, &len);
+	str = lua_check_lstring_or_text (L, 1, &len);
 
 	if (str) {
 		dst = g_malloc (len);
@@ -1590,8 +1648,8 @@ lua_util_strcasecmp_ascii (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 2, &len2);
+	str1 = lua_check_lstring_or_text (L, 1, &len1);
+	str2 = lua_check_lstring_or_text (L, 2, &len2);
 
 	if (str1 && str2) {
 
@@ -1618,8 +1676,8 @@ lua_util_strequal_caseless (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 2, &len2);
+	str1 = lua_check_lstring_or_text (L, 1, &len1);
+	str2 = lua_check_lstring_or_text (L, 2, &len2);
 
 	if (str1 && str2) {
 
@@ -2389,8 +2447,8 @@ lua_util_is_utf_spoofed (lua_State *L)
 	LUA_TRACE_POINT;
 	gsize l1, l2;
 	gint ret, nres = 2;
-	const gchar *s1 = lua_tolstring (L, 1, &l1),
-			*s2 = lua_tolstring (L, 2, &l2);
+	const gchar *s1 = lua_check_lstring_or_text (L, 1, &l1),
+			*s2 = lua_check_lstring_or_text (L, 2, &l2);
 	static USpoofChecker *spc, *spc_sgl;
 	UErrorCode uc_err = U_ZERO_ERROR;
 
@@ -2465,7 +2523,8 @@ lua_util_is_utf_mixed_script (lua_State *L)
 {
 	LUA_TRACE_POINT;
 	gsize len_of_string;
-	const guchar *string_to_check = lua_tolstring (L, 1, &len_of_string);
+	const guchar *string_to_check = lua_check_lstring_or_text (L, 1,
+			&len_of_string);
 	UScriptCode last_script_code = USCRIPT_INVALID_CODE;
 	UErrorCode uc_err = U_ZERO_ERROR;
 
@@ -2521,10 +2580,14 @@ lua_util_get_string_stats (lua_State *L)
 	LUA_TRACE_POINT;
 	gsize len_of_string;
 	gint num_of_digits = 0, num_of_letters = 0;
-	const gchar *string_to_check = lua_tolstring (L, 1, &len_of_string);
+	const gchar *string_to_check = lua_check_lstring_or_text (L, 1,
+			&len_of_string);
 
 	if (string_to_check) {
-		while (*string_to_check != '\0') {
+		const gchar *end = string_to_check + len_of_string;
+
+		/* Text is not zero terminated */
+		while (string_to_check < end && *string_to_check != '\0') {
 			if (g_ascii_isdigit(*string_to_check)) {
 				num_of_digits++;
 			}
@@ -2556,7 +2619,8 @@ lua_util_is_utf_outside_range (lua_State *L)
 	LUA_TRACE_POINT;
 	gsize len_of_string;
 	gint ret;
-	const gchar *string_to_check = lua_tolstring (L, 1, &len_of_string);
+	const gchar *string_to_check = lua_check_lstring_or_text (L, 1,
+			&len_of_string);
 	guint32 range_start = lua_tointeger (L, 2);
 	guint32 range_end = lua_tointeger (L, 3);
 
@@ -2724,7 +2788,11 @@ lua_util_has_obscured_unicode (lua_State *L)
 	gint32 i = 0, prev_i;
 	UChar32 uc;
 
-	str = lua_tolstring (L, 1, &len);
+	str = lua_check_lstring_or_text (L, 1, &len);
+
+	if (str == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
 
 	while (i < len) {
 		prev_i = i;
@@ -3729,6 +3797,399 @@ lua_util_parse_smtp_date (lua_State *L)
 }
 
 
+/*
+ * Frozen tables layout: header, then strings and tables blocks referenced by
+ * offsets from the beginning of the mapping. Each table is a sorted array of
+ * elements: elements with keys 1..narray go first, so they are accessed
+ * directly, others are sorted by key (numbers before strings) and are found
+ * using binary search.
+ */
+#define RSPAMD_FROZEN_MAGIC 0x4e5a4f5246445352ULL
+#define RSPAMD_FROZEN_MAX_DEPTH 64
+
+enum rspamd_frozen_type {
+	RSPAMD_FROZEN_BOOLEAN = 1,
+	RSPAMD_FROZEN_NUMBER,
+	RSPAMD_FROZEN_STRING,
+	RSPAMD_FROZEN_TABLE,
+};
+
+struct rspamd_frozen_value {
+	guint32 type;
+	guint32 len;
+	union {
+		gdouble num;
+		guint64 off;
+		guint64 b;
+	} v;
+};
+
+struct rspamd_frozen_elt {
+	struct rspamd_frozen_value key;
+	struct rspamd_frozen_value val;
+};
+
+struct rspamd_frozen_table {
+	guint32 narray;
+	guint32 nelts;
+	struct rspamd_frozen_elt elts[];
+};
+
+struct rspamd_frozen_header {
+	guint64 magic;
+	guint64 root;
+};
+
+struct rspamd_frozen_data {
+	guchar *base;
+	gsize len;
+	ref_entry_t ref;
+};
+
+struct rspamd_lua_frozen {
+	struct rspamd_frozen_data *data;
+	guint64 tbl_off;
+};
+
+static gint
+rspamd_frozen_cmp_keys (const struct rspamd_frozen_value *k1,
+		const struct rspamd_frozen_value *k2, const guchar *base)
+{
+	if (k1->type != k2->type) {
+		return (gint)k1->type - (gint)k2->type;
+	}
+
+	if (k1->type == RSPAMD_FROZEN_NUMBER) {
+		if (k1->v.num == k2->v.num) {
+			return 0;
+		}
+
+		return k1->v.num < k2->v.num ? -1 : 1;
+	}
+
+	if (k1->len != k2->len) {
+		return k1->len < k2->len ? -1 : 1;
+	}
+
+	return memcmp (base + k1->v.off, base + k2->v.off, k1->len);
+}
+
+struct rspamd_frozen_sort_cbdata {
+	GByteArray *ba;
+	guint narray;
+};
+
+static inline gboolean
+rspamd_frozen_is_array_key (const struct rspamd_frozen_value *k, guint narray)
+{
+	return k->type == RSPAMD_FROZEN_NUMBER && k->v.num >= 1 &&
+			k->v.num <= narray && k->v.num == (gdouble)(guint32)k->v.num;
+}
+
+static gint
+rspamd_frozen_elts_cmp (gconstpointer a, gconstpointer b, gpointer ud)
+{
+	const struct rspamd_frozen_elt *e1 = a, *e2 = b;
+	struct rspamd_frozen_sort_cbdata *cbd = ud;
+	gboolean arr1 = rspamd_frozen_is_array_key (&e1->key, cbd->narray),
+			arr2 = rspamd_frozen_is_array_key (&e2->key, cbd->narray);
+
+	/* Array part goes first */
+	if (arr1 != arr2) {
+		return arr1 ? -1 : 1;
+	}
+
+	return rspamd_frozen_cmp_keys (&e1->key, &e2->key, cbd->ba->data);
+}
+
+static guint64
+rspamd_frozen_append (GByteArray *ba, const void *data, gsize len, gsize align)
+{
+	static const guchar pad[8] = {0};
+	guint64 off;
+
+	if (align > 1 && ba->len % align != 0) {
+		g_byte_array_append (ba, pad, align - ba->len % align);
+	}
+
+	off = ba->len;
+	g_byte_array_append (ba, data, len);
+
+	return off;
+}
+
+/*
+ * Serializes table at `pos` to `ba`, returns FALSE and sets `err` on failure
+ */
+static gboolean
+rspamd_frozen_build (lua_State *L, gint pos, GByteArray *ba, guint depth,
+		guint64 *out_off, const gchar **err)
+{
+	GArray *elts;
+	struct rspamd_frozen_elt elt;
+	struct rspamd_frozen_table hdr;
+	struct rspamd_frozen_sort_cbdata cbd;
+	const gchar *str;
+	gsize slen;
+	gboolean ret = TRUE;
+
+	if (depth > RSPAMD_FROZEN_MAX_DEPTH) {
+		*err = "tables are nested too deep (cycle?)";
+
+		return FALSE;
+	}
+
+	if (!lua_checkstack (L, 4)) {
+		*err = "lua stack overflow";
+
+		return FALSE;
+	}
+
+	elts = g_array_new (FALSE, FALSE, sizeof (elt));
+
+	for (lua_pushnil (L); lua_next (L, pos); lua_pop (L, 1)) {
+		memset (&elt, 0, sizeof (elt));
+
+		switch (lua_type (L, -2)) {
+		case LUA_TNUMBER:
+			elt.key.type = RSPAMD_FROZEN_NUMBER;
+			elt.key.v.num = lua_tonumber (L, -2);
+			break;
+		case LUA_TSTRING:
+			str = lua_tolstring (L, -2, &slen);
+			elt.key.type = RSPAMD_FROZEN_STRING;
+			elt.key.len = slen;
+			elt.key.v.off = rspamd_frozen_append (ba, str, slen + 1, 1);
+			break;
+		default:
+			*err = "only string and number keys are allowed";
+			ret = FALSE;
+			break;
+		}
+
+		if (!ret) {
+			lua_pop (L, 2);
+			break;
+		}
+
+		switch (lua_type (L, -1)) {
+		case LUA_TBOOLEAN:
+			elt.val.type = RSPAMD_FROZEN_BOOLEAN;
+			elt.val.v.b = lua_toboolean (L, -1);
+			break;
+		case LUA_TNUMBER:
+			elt.val.type = RSPAMD_FROZEN_NUMBER;
+			elt.val.v.num = lua_tonumber (L, -1);
+			break;
+		case LUA_TSTRING:
+			str = lua_tolstring (L, -1, &slen);
+			elt.val.type = RSPAMD_FROZEN_STRING;
+			elt.val.len = slen;
+			elt.val.v.off = rspamd_frozen_append (ba, str, slen + 1, 1);
+			break;
+		case LUA_TTABLE:
+			elt.val.type = RSPAMD_FROZEN_TABLE;
+			ret = rspamd_frozen_build (L, lua_gettop (L), ba, depth + 1,
+					&elt.val.v.off, err);
+			break;
+		default:
+			*err = "only boolean, number, string and table values are allowed";
+			ret = FALSE;
+			break;
+		}
+
+		if (!ret) {
+			lua_pop (L, 2);
+			break;
+		}
+
+		g_array_append_val (elts, elt);
+	}
+
+	if (ret) {
+		/* Array part is 1..n without holes */
+		hdr.narray = 0;
+		hdr.nelts = elts->len;
+
+		for (;;) {
+			lua_rawgeti (L, pos, hdr.narray + 1);
+
+			if (lua_isnil (L, -1)) {
+				lua_pop (L, 1);
+				break;
+			}
+
+			lua_pop (L, 1);
+			hdr.narray ++;
+		}
+
+		cbd.ba = ba;
+		cbd.narray = hdr.narray;
+		g_array_sort_with_data (elts, rspamd_frozen_elts_cmp, &cbd);
+
+		*out_off = rspamd_frozen_append (ba, &hdr, sizeof (hdr), 8);
+
+		if (elts->len > 0) {
+			g_byte_array_append (ba, (const guint8 *)elts->data,
+					elts->len * sizeof (elt));
+		}
+	}
+
+	g_array_free (elts, TRUE);
+
+	return ret;
+}
+
+static void
+rspamd_frozen_data_dtor (struct rspamd_frozen_data *data)
+{
+	munmap (data->base, data->len);
+	g_free (data);
+}
+
+static void
+rspamd_frozen_push_table (lua_State *L, struct rspamd_frozen_data *data,
+		guint64 off)
+{
+	struct rspamd_lua_frozen *fr;
+
+	fr = lua_newuserdata (L, sizeof (*fr));
+	fr->data = data;
+	fr->tbl_off = off;
+	REF_RETAIN (data);
+	rspamd_lua_setclass (L, "rspamd{frozen}", -1);
+}
+
+static void
+rspamd_frozen_push_value (lua_State *L, struct rspamd_frozen_data *data,
+		const struct rspamd_frozen_value *val)
+{
+	switch (val->type) {
+	case RSPAMD_FROZEN_BOOLEAN:
+		lua_pushboolean (L, val->v.b);
+		break;
+	case RSPAMD_FROZEN_NUMBER:
+		lua_pushnumber (L, val->v.num);
+		break;
+	case RSPAMD_FROZEN_STRING:
+		lua_pushlstring (L, (const gchar *)data->base + val->v.off, val->len);
+		break;
+	case RSPAMD_FROZEN_TABLE:
+		rspamd_frozen_push_table (L, data, val->v.off);
+		break;
+	default:
+		lua_pushnil (L);
+		break;
+	}
+}
+
+static struct rspamd_lua_frozen *
+lua_check_frozen (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{frozen}");
+	luaL_argcheck (L, ud != NULL, pos, "'frozen' expected");
+	return ud ? ((struct rspamd_lua_frozen *)ud) : NULL;
+}
+
+static inline const struct rspamd_frozen_table *
+rspamd_frozen_table_get (struct rspamd_lua_frozen *fr)
+{
+	return (const struct rspamd_frozen_table *)(fr->data->base + fr->tbl_off);
+}
+
+static gint
+lua_util_freeze (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_frozen_header hdr;
+	struct rspamd_frozen_data *data;
+	GByteArray *ba;
+	const gchar *err = NULL;
+	guchar *map;
+
+	luaL_checktype (L, 1, LUA_TTABLE);
+
+	ba = g_byte_array_new ();
+	memset (&hdr, 0, sizeof (hdr));
+	hdr.magic = RSPAMD_FROZEN_MAGIC;
+	rspamd_frozen_append (ba, &hdr, sizeof (hdr), 1);
+
+	if (!rspamd_frozen_build (L, 1, ba, 0, &hdr.root, &err)) {
+		g_byte_array_free (ba, TRUE);
+
+		return luaL_error (L, "cannot freeze table: %s", err);
+	}
+
+	memcpy (ba->data, &hdr, sizeof (hdr));
+
+	/* Shared mapping is inherited by workers and is not copied on write */
+	map = mmap (NULL, ba->len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON,
+			-1, 0);
+
+	if (map == MAP_FAILED) {
+		gsize len = ba->len;
+
+		g_byte_array_free (ba, TRUE);
+
+		return luaL_error (L, "cannot allocate %d bytes for frozen table: %s",
+				(gint)len, strerror (errno));
+	}
+
+	memcpy (map, ba->data, ba->len);
+	mprotect (map, ba->len, PROT_READ);
+
+	data = g_malloc0 (sizeof (*data));
+	data->base = map;
+	data->len = ba->len;
+	REF_INIT_RETAIN (data, rspamd_frozen_data_dtor);
+	g_byte_array_free (ba, TRUE);
+
+	rspamd_frozen_push_table (L, data, hdr.root);
+	REF_RELEASE (data);
+
+	return 1;
+}
+
+static gint
+lua_util_frozen_next (lua_State *L)
+{
+	struct rspamd_lua_frozen *fr = lua_check_frozen (L, lua_upvalueindex (1));
+	const struct rspamd_frozen_table *tbl;
+	const struct rspamd_frozen_elt *elt;
+	guint idx = lua_tointeger (L, lua_upvalueindex (2));
+
+	tbl = rspamd_frozen_table_get (fr);
+
+	if (idx >= tbl->nelts) {
+		return 0;
+	}
+
+	elt = &tbl->elts[idx];
+	lua_pushinteger (L, idx + 1);
+	lua_replace (L, lua_upvalueindex (2));
+	rspamd_frozen_push_value (L, fr->data, &elt->key);
+	rspamd_frozen_push_value (L, fr->data, &elt->val);
+
+	return 2;
+}
+
+static gint
+lua_util_frozen_pairs (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_frozen *fr = lua_check_frozen (L, 1);
+
+	if (fr == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushvalue (L, 1);
+	lua_pushinteger (L, 0);
+	lua_pushcclosure (L, lua_util_frozen_next, 2);
+
+	return 1;
+}
+
 static gint
 lua_load_util (lua_State * L)
 {
@@ -3745,6 +4206,8 @@ luaopen_util (lua_State * L)
 	lua_pop (L, 1);
 	rspamd_lua_new_class (L, "rspamd{int64}", int64lib_m);
 	lua_pop (L, 1);
+	rspamd_lua_new_class (L, "rspamd{frozen}", frozenlib_m);
+	lua_pop (L, 1);
 	rspamd_lua_add_preload (L, "rspamd_util", lua_load_util);
 }
 
@@ -3800,3 +4263,283 @@ lua_ev_base_loop (lua_State *L)
 
 	return 1;
 }
+
+static gint
+lua_frozen_index (lua_State *L)
+{
+	struct rspamd_lua_frozen *fr = lua_check_frozen (L, 1);
+	const struct rspamd_frozen_table *tbl;
+	struct rspamd_frozen_value key;
+	const gchar *str;
+	gsize slen;
+	gint lo, hi, mid, cmp;
+
+	if (fr == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	tbl = rspamd_frozen_table_get (fr);
+	memset (&key, 0, sizeof (key));
+
+	if (lua_type (L, 2) == LUA_TNUMBER) {
+		gdouble num = lua_tonumber (L, 2);
+
+		if (num >= 1 && num <= tbl->narray && num == (gdouble)(guint32)num) {
+			rspamd_frozen_push_value (L, fr->data,
+					&tbl->elts[(guint32)num - 1].val);
+
+			return 1;
+		}
+
+		/* Other numeric keys are sorted after the array part */
+		key.type = RSPAMD_FROZEN_NUMBER;
+		key.v.num = num;
+		lo = tbl->narray;
+		str = NULL;
+	}
+	else if (lua_type (L, 2) == LUA_TSTRING) {
+		str = lua_tolstring (L, 2, &slen);
+		key.type = RSPAMD_FROZEN_STRING;
+		key.len = slen;
+		lo = tbl->narray;
+	}
+	else {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	hi = (gint)tbl->nelts - 1;
+
+	while (lo <= hi) {
+		const struct rspamd_frozen_value *cur;
+
+		mid = lo + (hi - lo) / 2;
+		cur = &tbl->elts[mid].key;
+
+		if (str != NULL) {
+			/* Compare lookup string with the stored one */
+			if (cur->type != RSPAMD_FROZEN_STRING) {
+				cmp = (gint)cur->type - (gint)RSPAMD_FROZEN_STRING;
+			}
+			else if (cur->len != key.len) {
+				cmp = cur->len < key.len ? -1 : 1;
+			}
+			else {
+				cmp = memcmp (fr->data->base + cur->v.off, str, key.len);
+			}
+		}
+		else {
+			cmp = rspamd_frozen_cmp_keys (cur, &key, fr->data->base);
+		}
+
+		if (cmp == 0) {
+			rspamd_frozen_push_value (L, fr->data, &tbl->elts[mid].val);
+
+			return 1;
+		}
+		else if (cmp < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+
+	lua_pushnil (L);
+
+	return 1;
+}
+
+static gint
+lua_frozen_len (lua_State *L)
+{
+	struct rspamd_lua_frozen *fr = lua_check_frozen (L, 1);
+
+	if (fr == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, rspamd_frozen_table_get (fr)->narray);
+
+	return 1;
+}
+
+static gint
+lua_frozen_gc (lua_State *L)
+{
+	struct rspamd_lua_frozen *fr = lua_check_frozen (L, 1);
+
+	if (fr && fr->data) {
+		REF_RELEASE (fr->data);
+		fr->data = NULL;
+	}
+
+	return 0;
+}
+
+static void
+lua_util_clickhouse_append_escaped (GString *out, const gchar *s, gsize len)
+{
+	const gchar *p = s, *end = s + len, *c;
+
+	while (p < end) {
+		c = p;
+
+		while (c < end && *c != '\'' && *c != '\\' && *c != '\n' &&
+				*c != '\t' && *c != '\r') {
+			c ++;
+		}
+
+		g_string_append_len (out, p, c - p);
+
+		if (c == end) {
+			break;
+		}
+
+		g_string_append_c (out, '\\');
+
+		switch (*c) {
+		case '\n':
+			g_string_append_c (out, 'n');
+			break;
+		case '\t':
+			g_string_append_c (out, 't');
+			break;
+		case '\r':
+			g_string_append_c (out, 'r');
+			break;
+		default:
+			g_string_append_c (out, *c);
+			break;
+		}
+
+		p = c + 1;
+	}
+}
+
+static void
+lua_util_clickhouse_append_number (GString *out, lua_Number n)
+{
+	/* The same check as in lua_clickhouse: integers have no fraction */
+	if (n == floor (n) && fabs (n) < 9007199254740992.0) {
+		rspamd_printf_gstring (out, "%L", (gint64)n);
+	}
+	else {
+		rspamd_printf_gstring (out, "%g", (gdouble)n);
+	}
+}
+
+/* Appends value at the top of the stack */
+static void
+lua_util_clickhouse_append_value (lua_State *L, GString *out, gboolean quote)
+{
+	struct rspamd_lua_text *t;
+	const gchar *s;
+	gsize len;
+	gint pos = lua_gettop (L);
+
+	switch (lua_type (L, pos)) {
+	case LUA_TNUMBER:
+		lua_util_clickhouse_append_number (out, lua_tonumber (L, pos));
+		break;
+	case LUA_TBOOLEAN:
+		g_string_append_c (out, lua_toboolean (L, pos) ? '1' : '0');
+		break;
+	case LUA_TSTRING:
+	case LUA_TUSERDATA:
+		t = lua_type (L, pos) == LUA_TUSERDATA ?
+				rspamd_lua_check_udata_maybe (L, pos, "rspamd{text}") : NULL;
+
+		if (t) {
+			s = t->start;
+			len = t->len;
+		}
+		else if (lua_type (L, pos) == LUA_TSTRING) {
+			s = lua_tolstring (L, pos, &len);
+		}
+		else {
+			/* Use tostring as lua_clickhouse does */
+			lua_getglobal (L, "tostring");
+			lua_pushvalue (L, pos);
+			lua_call (L, 1, 1);
+			lua_replace (L, pos);
+			s = lua_tolstring (L, pos, &len);
+		}
+
+		if (quote) {
+			g_string_append_c (out, '\'');
+		}
+
+		if (s) {
+			lua_util_clickhouse_append_escaped (out, s, len);
+		}
+
+		if (quote) {
+			g_string_append_c (out, '\'');
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static gint
+lua_util_clickhouse_tsv_row (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_text *res;
+	GString *out;
+	gint i, j;
+
+	luaL_checktype (L, 1, LUA_TTABLE);
+	out = g_string_sized_new (1024);
+
+	for (i = 1; ; i ++) {
+		lua_rawgeti (L, 1, i);
+
+		if (lua_isnil (L, -1)) {
+			lua_pop (L, 1);
+			break;
+		}
+
+		if (i > 1) {
+			g_string_append_c (out, '\t');
+		}
+
+		if (lua_type (L, -1) == LUA_TTABLE) {
+			g_string_append_c (out, '[');
+
+			for (j = 1; ; j ++) {
+				lua_rawgeti (L, -1, j);
+
+				if (lua_isnil (L, -1)) {
+					lua_pop (L, 1);
+					break;
+				}
+
+				if (j > 1) {
+					g_string_append_c (out, ',');
+				}
+
+				lua_util_clickhouse_append_value (L, out, TRUE);
+				lua_pop (L, 1);
+			}
+
+			g_string_append_c (out, ']');
+		}
+		else {
+			lua_util_clickhouse_append_value (L, out, FALSE);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	res = lua_newuserdata (L, sizeof (*res));
+	res->len = out->len;
+	res->start = g_string_free (out, FALSE);
+	res->flags = RSPAMD_TEXT_FLAG_OWN;
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+
+	return 1;
+}
@@ -143,6 +143,12 @@ lua_worker_get_stat (lua_State *L)
 				ucl_object_fromint (
 						mem_st.oversized_chunks), "chunks_oversized", 0, false);
 
+		if (w->srv->task_timings) {
+			ucl_object_insert_key (top,
+					rspamd_task_timings_to_ucl (w->srv->task_timings),
+					"task_timings", 0, false);
+		}
+
 		ucl_object_push_lua (L, top, true);
 		ucl_object_unref (top);
 	}
@@ -377,6 +383,7 @@ lua_worker_control_handler (struct rspamd_main *rspamd_main,
 	case RSPAMD_CONTROL_LOG_PIPE:
 	case RSPAMD_CONTROL_FUZZY_STAT:
 	case RSPAMD_CONTROL_FUZZY_SYNC:
+	case RSPAMD_CONTROL_SYMBOLS_TRACE:
 	default:
 		break;
 	}
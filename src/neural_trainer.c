@@ -0,0 +1,149 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Neural trainer is a worker with no sockets that runs Lua scripts registered
+ * for it by `rspamd_config:register_worker_script('neural_trainer', f)`.
+ * Neural plugin uses it to train networks from the vectors stored in Redis,
+ * so neither scanners nor controller spend their time on training.
+ */
+#include "config.h"
+#include "libutil/util.h"
+#include "libserver/cfg_file.h"
+#include "libserver/cfg_rcl.h"
+#include "libserver/worker_util.h"
+#include "libserver/dns.h"
+#include "libutil/upstream.h"
+#include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
+#include "utlist.h"
+#include "unix-std.h"
+
+static gpointer init_neural_trainer (struct rspamd_config *cfg);
+static void start_neural_trainer (struct rspamd_worker *worker);
+
+worker_t neural_trainer_worker = {
+		"neural_trainer",           /* Name */
+		init_neural_trainer,        /* Init function */
+		start_neural_trainer,       /* Start function */
+		RSPAMD_WORKER_UNIQUE|RSPAMD_WORKER_KILLABLE,
+		RSPAMD_WORKER_SOCKET_NONE,
+		RSPAMD_WORKER_VER           /* Version info */
+};
+
+static const guint64 rspamd_neural_trainer_magic = 0x5c8a3e1f2b9d4607ULL;
+
+/*
+ * Worker's context
+ */
+struct neural_trainer_ctx {
+	guint64 magic;
+	/* Events base */
+	struct ev_loop *event_loop;
+	/* DNS resolver */
+	struct rspamd_dns_resolver *resolver;
+	/* Config */
+	struct rspamd_config *cfg;
+	/* END OF COMMON PART */
+};
+
+static gpointer
+init_neural_trainer (struct rspamd_config *cfg)
+{
+	struct neural_trainer_ctx *ctx;
+
+	ctx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*ctx));
+	ctx->magic = rspamd_neural_trainer_magic;
+	ctx->cfg = cfg;
+
+	return ctx;
+}
+
+static void
+rspamd_neural_trainer_script_error (struct thread_entry *thread, int ret,
+		const char *msg)
+{
+	struct rspamd_config *cfg = thread->cfg;
+
+	msg_err_config ("error executing neural trainer script: %s", msg);
+}
+
+static void
+rspamd_neural_trainer_run_scripts (struct neural_trainer_ctx *ctx,
+		struct rspamd_worker *worker)
+{
+	struct rspamd_worker_lua_script *sc;
+	struct rspamd_config **pcfg;
+	struct ev_loop **pev_base;
+	struct rspamd_worker **pw;
+	lua_State *L;
+
+	DL_FOREACH (worker->cf->scripts, sc) {
+		struct thread_entry *thread = lua_thread_pool_get_for_config (ctx->cfg);
+
+		thread->error_callback = rspamd_neural_trainer_script_error;
+		L = thread->lua_state;
+
+		lua_rawgeti (L, LUA_REGISTRYINDEX, sc->cbref);
+		pcfg = lua_newuserdata (L, sizeof (*pcfg));
+		*pcfg = ctx->cfg;
+		rspamd_lua_setclass (L, "rspamd{config}", -1);
+
+		pev_base = lua_newuserdata (L, sizeof (*pev_base));
+		*pev_base = ctx->event_loop;
+		rspamd_lua_setclass (L, "rspamd{ev_base}", -1);
+
+		pw = lua_newuserdata (L, sizeof (*pw));
+		*pw = worker;
+		rspamd_lua_setclass (L, "rspamd{worker}", -1);
+
+		lua_thread_call (thread, 3);
+	}
+}
+
+static void
+start_neural_trainer (struct rspamd_worker *worker)
+{
+	struct neural_trainer_ctx *ctx = worker->ctx;
+
+	g_assert (rspamd_worker_check_context (worker->ctx,
+			rspamd_neural_trainer_magic));
+	ctx->cfg = worker->srv->cfg;
+	ctx->event_loop = rspamd_prepare_worker (worker,
+			"neural_trainer",
+			NULL);
+
+	ctx->resolver = rspamd_dns_resolver_init (worker->srv->logger,
+			ctx->event_loop,
+			worker->srv->cfg);
+	rspamd_upstreams_library_config (worker->srv->cfg, worker->srv->cfg->ups_ctx,
+			ctx->event_loop, ctx->resolver->r);
+
+	rspamd_lua_run_postloads (ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
+			worker);
+
+	if (worker->cf->scripts == NULL) {
+		msg_warn ("no scripts are registered for neural trainer, "
+				"is neural plugin enabled?");
+	}
+
+	rspamd_neural_trainer_run_scripts (ctx, worker);
+
+	ev_loop (ctx->event_loop, 0);
+	rspamd_worker_block_signals ();
+
+	REF_RELEASE (ctx->cfg);
+	rspamd_log_close (worker->srv->logger);
+
+	exit (EXIT_SUCCESS);
+}
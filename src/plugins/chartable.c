@@ -92,6 +92,7 @@ static void chartable_symbol_callback (struct rspamd_task *task,
 static void chartable_url_symbol_callback (struct rspamd_task *task,
 										   struct rspamd_symcache_item *item,
 										   void *unused);
+static void rspamd_chartable_init_classes (void);
 
 gint
 chartable_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
@@ -151,6 +152,8 @@ chartable_module_config (struct rspamd_config *cfg, bool validate)
 		chartable_module_ctx->threshold = DEFAULT_THRESHOLD;
 	}
 
+	rspamd_chartable_init_classes ();
+
 	rspamd_symcache_add_symbol (cfg->cache,
 			chartable_module_ctx->symbol,
 			0,
@@ -352,6 +355,130 @@ rspamd_can_alias_latin (gint ch)
 	return g_hash_table_lookup (latin_confusable_ht, &ch) != NULL;
 }
 
+/* Classes of codepoints used by words checks */
+#define CHARTABLE_CP_ALPHA (1u << 0)
+#define CHARTABLE_CP_DIGIT (1u << 1)
+#define CHARTABLE_CP_UPPER (1u << 2)
+/* Latin, IPA, diacritic and space modifiers alpha characters */
+#define CHARTABLE_CP_LATIN (1u << 3)
+#define CHARTABLE_CP_DIACRITIC (1u << 4)
+#define CHARTABLE_CP_CONFUSABLE (1u << 5)
+
+/*
+ * Two level table of classes for BMP: high byte of a codepoint selects
+ * a page of 256 classes, equal pages are shared
+ */
+static const guint8 *chartable_bmp_pages[256];
+static guint8 *chartable_bmp_data = NULL;
+
+static guint
+rspamd_chartable_classify (UChar32 uc)
+{
+	UBlockCode sc;
+	guint cat, res = 0;
+
+	sc = ublock_getCode (uc);
+	cat = u_charType (uc);
+
+	if (cat == U_NON_SPACING_MARK ||
+		(sc == UBLOCK_LATIN_1_SUPPLEMENT) ||
+		(sc == UBLOCK_LATIN_EXTENDED_A) ||
+		(sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) ||
+		(sc == UBLOCK_LATIN_EXTENDED_B) ||
+		(sc == UBLOCK_COMBINING_DIACRITICAL_MARKS)) {
+		res |= CHARTABLE_CP_DIACRITIC;
+	}
+
+	if (u_isalpha (uc)) {
+		res |= CHARTABLE_CP_ALPHA;
+
+		if (sc <= UBLOCK_COMBINING_DIACRITICAL_MARKS ||
+				sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) {
+			res |= CHARTABLE_CP_LATIN;
+		}
+
+		if (u_isupper (uc)) {
+			res |= CHARTABLE_CP_UPPER;
+		}
+	}
+	else if (u_isdigit (uc)) {
+		res |= CHARTABLE_CP_DIGIT;
+	}
+
+	if (rspamd_can_alias_latin (uc)) {
+		res |= CHARTABLE_CP_CONFUSABLE;
+	}
+
+	return res;
+}
+
+static void
+rspamd_chartable_init_classes (void)
+{
+	GByteArray *data;
+	guint8 page[256];
+	guint offsets[256], npages = 0, hi, lo, j;
+
+	if (chartable_bmp_data != NULL) {
+		return;
+	}
+
+	data = g_byte_array_new ();
+
+	for (hi = 0; hi < G_N_ELEMENTS (offsets); hi ++) {
+		for (lo = 0; lo < sizeof (page); lo ++) {
+			page[lo] = rspamd_chartable_classify ((hi << 8) | lo);
+		}
+
+		for (j = 0; j < npages; j ++) {
+			if (memcmp (data->data + j * sizeof (page), page, sizeof (page)) == 0) {
+				break;
+			}
+		}
+
+		if (j == npages) {
+			g_byte_array_append (data, page, sizeof (page));
+			npages ++;
+		}
+
+		offsets[hi] = j;
+	}
+
+	chartable_bmp_data = g_byte_array_free (data, FALSE);
+
+	for (hi = 0; hi < G_N_ELEMENTS (offsets); hi ++) {
+		chartable_bmp_pages[hi] = chartable_bmp_data + offsets[hi] * sizeof (page);
+	}
+}
+
+static inline guint
+rspamd_chartable_cp_class (UChar32 uc)
+{
+	if (uc < 0x10000) {
+		return chartable_bmp_pages[uc >> 8][uc & 0xff];
+	}
+
+	return rspamd_chartable_classify (uc);
+}
+
+/*
+ * Words of ASCII characters only are never penalised by the unicode check,
+ * the loop is vectorised by compiler
+ */
+static inline gboolean
+rspamd_chartable_word_is_ascii (const rspamd_stat_token_t *w)
+{
+	const UChar32 *p = w->unicode.begin;
+	guint32 acc = 0;
+	gsize i;
+
+	for (i = 0; i < w->unicode.len; i ++) {
+		acc |= (guint32)p[i];
+	}
+
+	return acc < 0x80;
+}
+
 static gdouble
 rspamd_chartable_process_word_utf (struct rspamd_task *task,
 								   rspamd_stat_token_t *w,
@@ -364,8 +491,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 	const UChar32 *p, *end;
 	gdouble badness = 0.0;
 	UChar32 uc;
-	UBlockCode sc;
-	guint cat;
+	guint cls;
 	gint last_is_latin = -1;
 	guint same_script_count = 0, nsym = 0, nspecial = 0;
 	enum {
@@ -387,32 +513,22 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 			break;
 		}
 
-		sc = ublock_getCode (uc);
-		cat = u_charType (uc);
+		cls = rspamd_chartable_cp_class (uc);
 
 		if (!ignore_diacritics) {
-			if (cat == U_NON_SPACING_MARK ||
-				(sc == UBLOCK_LATIN_1_SUPPLEMENT) ||
-				(sc == UBLOCK_LATIN_EXTENDED_A) ||
-				(sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) ||
-				(sc == UBLOCK_LATIN_EXTENDED_B) ||
-				(sc == UBLOCK_COMBINING_DIACRITICAL_MARKS)) {
+			if (cls & CHARTABLE_CP_DIACRITIC) {
 				nspecial++;
 			}
 		}
 
-		if (u_isalpha (uc)) {
+		if (cls & CHARTABLE_CP_ALPHA) {
+			/*
+			 * Assume all latin, IPA, diacritic and space modifiers
+			 * characters as basic latin
+			 */
+			gboolean is_latin = (cls & CHARTABLE_CP_LATIN) != 0;
 
-			if (sc <= UBLOCK_COMBINING_DIACRITICAL_MARKS ||
-					sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) {
-				/*
-				 * Assume all latin, IPA, diacritic and space modifiers
-				 * characters as basic latin
-				 */
-				sc = UBLOCK_BASIC_LATIN;
-			}
-
-			if (sc != UBLOCK_BASIC_LATIN && u_isupper (uc)) {
+			if (!is_latin && (cls & CHARTABLE_CP_UPPER)) {
 				if (ncap) {
 					(*ncap) ++;
 				}
@@ -420,7 +536,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 
 			if (state == got_digit) {
 				/* Penalize digit -> alpha translations */
-				if (!is_url && sc != UBLOCK_BASIC_LATIN &&
+				if (!is_url && !is_latin &&
 						prev_state != start_process) {
 					badness += 0.25;
 				}
@@ -428,9 +544,9 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 			else if (state == got_alpha) {
 				/* Check script */
 				if (same_script_count > 0) {
-					if (sc != UBLOCK_BASIC_LATIN && last_is_latin) {
+					if (!is_latin && last_is_latin) {
 
-						if (rspamd_can_alias_latin (uc)) {
+						if (cls & CHARTABLE_CP_CONFUSABLE) {
 							badness += 1.0 / (gdouble)same_script_count;
 						}
 
@@ -442,7 +558,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 					}
 				}
 				else {
-					last_is_latin = sc == UBLOCK_BASIC_LATIN;
+					last_is_latin = is_latin;
 					same_script_count = 1;
 				}
 			}
@@ -451,7 +567,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 			state = got_alpha;
 
 		}
-		else if (u_isdigit (uc)) {
+		else if (cls & CHARTABLE_CP_DIGIT) {
 			if (state != got_digit) {
 				prev_state = state;
 			}
@@ -606,6 +722,10 @@ rspamd_chartable_process_part (struct rspamd_task *task,
 		if ((w->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT)) {
 
 			if (w->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
+				if (rspamd_chartable_word_is_ascii (w)) {
+					continue;
+				}
+
 				cur_score += rspamd_chartable_process_word_utf (task, w, FALSE,
 						&ncap, chartable_module_ctx, part->language, ignore_diacritics);
 			}
@@ -681,6 +801,11 @@ chartable_symbol_callback (struct rspamd_task *task,
 
 		for (i = 0; i < arlen; i++) {
 			w = &g_array_index (task->meta_words, rspamd_stat_token_t, i);
+
+			if (rspamd_chartable_word_is_ascii (w)) {
+				continue;
+			}
+
 			cur_score += rspamd_chartable_process_word_utf (task, w, FALSE,
 					NULL, chartable_module_ctx, language, ignore_diacritics);
 		}
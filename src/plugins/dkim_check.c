@@ -48,6 +48,7 @@
 #define DEFAULT_SYMBOL_NA "R_DKIM_NA"
 #define DEFAULT_SYMBOL_PERMFAIL "R_DKIM_PERMFAIL"
 #define DEFAULT_CACHE_SIZE 2048
+#define DEFAULT_VERIFY_CACHE_SIZE 8192
 #define DEFAULT_TIME_JITTER 60
 #define DEFAULT_MAX_SIGS 5
 
@@ -81,6 +82,7 @@ struct dkim_ctx {
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
 	rspamd_lru_hash_t *dkim_sign_hash;
+	struct rspamd_dkim_verify_cache *verify_cache;
 	const gchar *sign_headers;
 	const gchar *arc_sign_headers;
 	guint max_sigs;
@@ -97,6 +99,8 @@ struct dkim_check_result {
 	gdouble mult_allow;
 	gdouble mult_deny;
 	struct rspamd_symcache_item *item;
+	gboolean verifying; /* Public key verification is in the cpu pool */
+	gboolean offloaded;
 	struct dkim_check_result *next, *prev, *first;
 };
 
@@ -232,6 +236,15 @@ dkim_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			G_STRINGIFY (DEFAULT_CACHE_SIZE),
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"dkim",
+			"Size of signatures verification results cache shared between workers",
+			"verify_cache_size",
+			UCL_INT,
+			NULL,
+			0,
+			G_STRINGIFY (DEFAULT_VERIFY_CACHE_SIZE),
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"dkim",
 			"Allow this time difference when checking DKIM signature time validity",
@@ -313,7 +326,7 @@ dkim_module_config (struct rspamd_config *cfg, bool validate)
 {
 	const ucl_object_t *value;
 	gint res = TRUE, cb_id = -1;
-	guint cache_size, sign_cache_size;
+	guint cache_size, sign_cache_size, verify_cache_size;
 	gboolean got_trusted = FALSE;
 	struct dkim_ctx *dkim_module_ctx = dkim_get_context (cfg);
 
@@ -421,6 +434,15 @@ dkim_module_config (struct rspamd_config *cfg, bool validate)
 		sign_cache_size = 128;
 	}
 
+	if ((value =
+			rspamd_config_get_module_opt (cfg, "dkim",
+					"verify_cache_size")) != NULL) {
+		verify_cache_size = ucl_object_toint (value);
+	}
+	else {
+		verify_cache_size = DEFAULT_VERIFY_CACHE_SIZE;
+	}
+
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "dkim", "time_jitter")) != NULL) {
 		dkim_module_ctx->time_jitter = ucl_object_todouble (value);
@@ -526,6 +548,12 @@ dkim_module_config (struct rspamd_config *cfg, bool validate)
 				dkim_module_ctx->dkim_sign_hash);
 	}
 
+	if (verify_cache_size > 0 && !validate) {
+		/* Allocated before workers are forked, so it is shared between them */
+		dkim_module_ctx->verify_cache = rspamd_dkim_verify_cache_new (
+				cfg->cfg_pool, verify_cache_size);
+	}
+
 	if (dkim_module_ctx->trusted_only && !got_trusted) {
 		msg_err_config ("trusted_only option is set and no trusted domains are defined");
 		if (validate) {
@@ -542,7 +570,7 @@ dkim_module_config (struct rspamd_config *cfg, bool validate)
 				0,
 				dkim_symbol_callback,
 				NULL,
-				SYMBOL_TYPE_CALLBACK,
+				SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_CPU_PARALLEL,
 				-1);
 		rspamd_config_add_symbol (cfg,
 				"DKIM_CHECK",
@@ -696,6 +724,82 @@ dkim_module_load_key_format (struct rspamd_task *task,
 	return ret;
 }
 
+static void
+dkim_module_save_signature (struct rspamd_task *task, GString *hdr)
+{
+	GList *sigs;
+
+	sigs = rspamd_mempool_get_variable (task->task_pool, "dkim-signature");
+
+	if (sigs == NULL) {
+		sigs = g_list_append (sigs, hdr);
+		rspamd_mempool_set_variable (task->task_pool, "dkim-signature",
+				sigs, dkim_module_free_list);
+	} else {
+		sigs = g_list_append (sigs, hdr);
+		(void)sigs;
+	}
+}
+
+struct rspamd_dkim_lua_sign_cbdata {
+	struct rspamd_task *task;
+	rspamd_dkim_sign_context_t *ctx;
+	GString *hdr;
+	lua_State *L;
+	gint cbref;
+	gboolean no_cache;
+};
+
+/* Called in a thread of the cpu pool */
+static void
+dkim_module_lua_sign_work (gpointer ud)
+{
+	struct rspamd_dkim_lua_sign_cbdata *cbd = ud;
+
+	rspamd_dkim_sign_compute (cbd->ctx);
+}
+
+static void
+dkim_module_lua_sign_fin (struct rspamd_task *task,
+		struct rspamd_symcache_item *item,
+		gpointer ud)
+{
+	struct rspamd_dkim_lua_sign_cbdata *cbd = ud;
+	struct rspamd_task **ptask;
+	GString *hdr;
+
+	hdr = rspamd_dkim_sign_finish (task, cbd->hdr, cbd->ctx);
+
+	if (hdr && !cbd->no_cache) {
+		dkim_module_save_signature (task, hdr);
+	}
+
+	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
+	ptask = lua_newuserdata (cbd->L, sizeof (*ptask));
+	*ptask = task;
+	rspamd_lua_setclass (cbd->L, "rspamd{task}", -1);
+	lua_pushboolean (cbd->L, hdr != NULL);
+
+	if (hdr) {
+		lua_pushlstring (cbd->L, hdr->str, hdr->len);
+	}
+	else {
+		lua_pushnil (cbd->L);
+	}
+
+	if (lua_pcall (cbd->L, 3, 0, 0) != 0) {
+		msg_err_task ("call to sign callback failed: %s",
+				lua_tostring (cbd->L, -1));
+		lua_pop (cbd->L, 1);
+	}
+
+	luaL_unref (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
+
+	if (hdr && cbd->no_cache) {
+		g_string_free (hdr, TRUE);
+	}
+}
+
 static gint
 lua_dkim_sign_handler (lua_State *L)
 {
@@ -704,7 +808,6 @@ lua_dkim_sign_handler (lua_State *L)
 	enum rspamd_dkim_type sign_type = RSPAMD_DKIM_NORMAL;
 	GError *err = NULL;
 	GString *hdr;
-	GList *sigs = NULL;
 	const gchar *selector = NULL, *domain = NULL, *key = NULL, *rawkey = NULL,
 			*headers = NULL, *sign_type_str = NULL, *arc_cv = NULL,
 			*pubkey = NULL;
@@ -864,22 +967,58 @@ lua_dkim_sign_handler (lua_State *L)
 		return 1;
 	}
 
+	lua_getfield (L, 2, "callback");
+
+	if (lua_type (L, -1) == LUA_TFUNCTION) {
+		/*
+		 * Private key operation is done in the cpu pool if it is enabled,
+		 * the callback is called with (task, ret, hdr) afterwards
+		 */
+		struct rspamd_dkim_lua_sign_cbdata *cbd;
+		struct rspamd_symcache_item *item;
+
+		hdr = rspamd_dkim_sign_start (task, selector, domain, 0,
+				expire, arc_idx, arc_cv, ctx);
+
+		if (hdr == NULL) {
+			lua_pop (L, 1);
+			lua_pushboolean (L, FALSE);
+
+			return 1;
+		}
+
+		cbd = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbd));
+		cbd->task = task;
+		cbd->ctx = ctx;
+		cbd->hdr = hdr;
+		cbd->L = task->cfg->lua_state;
+		cbd->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		cbd->no_cache = no_cache;
+		item = rspamd_symcache_get_cur_item (task);
+
+		if (item) {
+			rspamd_symcache_item_offload (task, item,
+					dkim_module_lua_sign_work, dkim_module_lua_sign_fin, cbd);
+		}
+		else {
+			dkim_module_lua_sign_work (cbd);
+			dkim_module_lua_sign_fin (task, NULL, cbd);
+		}
+
+		lua_pushboolean (L, TRUE);
+
+		return 1;
+	}
+
+	lua_pop (L, 1);
+
 	hdr = rspamd_dkim_sign (task, selector, domain, 0,
 			expire, arc_idx, arc_cv, ctx);
 
 	if (hdr) {
 
 		if (!no_cache) {
-			sigs = rspamd_mempool_get_variable (task->task_pool, "dkim-signature");
-
-			if (sigs == NULL) {
-				sigs = g_list_append (sigs, hdr);
-				rspamd_mempool_set_variable (task->task_pool, "dkim-signature",
-						sigs, dkim_module_free_list);
-			} else {
-				sigs = g_list_append (sigs, hdr);
-				(void)sigs;
-			}
+			dkim_module_save_signature (task, hdr);
 		}
 
 		lua_pushboolean (L, TRUE);
@@ -938,11 +1077,61 @@ dkim_module_parse_strict (const gchar *value, gdouble *allow, gdouble *deny)
 	return FALSE;
 }
 
+static void dkim_module_check (struct dkim_check_result *res);
+
+static void
+dkim_module_check_strict (struct dkim_check_result *cur)
+{
+	const gchar *strict_value;
+	struct dkim_ctx *dkim_module_ctx = dkim_get_context (cur->task->cfg);
+
+	if (dkim_module_ctx->dkim_domains != NULL) {
+		/* Perform strict check */
+		const gchar *domain = rspamd_dkim_get_domain (cur->ctx);
+
+		if ((strict_value =
+				rspamd_match_hash_map (dkim_module_ctx->dkim_domains,
+						domain,
+						strlen (domain))) != NULL) {
+			if (!dkim_module_parse_strict (strict_value, &cur->mult_allow,
+					&cur->mult_deny)) {
+				cur->mult_allow = dkim_module_ctx->strict_multiplier;
+				cur->mult_deny = dkim_module_ctx->strict_multiplier;
+			}
+		}
+	}
+}
+
+/* Called in a thread of the cpu pool */
+static void
+dkim_module_verify_work (gpointer ud)
+{
+	struct dkim_check_result *cur = ud;
+
+	rspamd_dkim_check_verify (cur->res);
+}
+
+static void
+dkim_module_verify_fin (struct rspamd_task *task,
+		struct rspamd_symcache_item *item,
+		gpointer ud)
+{
+	struct dkim_check_result *cur = ud;
+
+	rspamd_dkim_check_finish (cur->res, task);
+	dkim_module_check_strict (cur);
+	cur->verifying = FALSE;
+
+	if (cur->offloaded) {
+		/* Otherwise we are called from dkim_module_check itself */
+		dkim_module_check (cur);
+	}
+}
+
 static void
 dkim_module_check (struct dkim_check_result *res)
 {
 	gboolean all_done = TRUE;
-	const gchar *strict_value;
 	struct dkim_check_result *first, *cur = NULL;
 	struct dkim_ctx *dkim_module_ctx = dkim_get_context (res->task->cfg);
 	struct rspamd_task *task = res->task;
@@ -955,22 +1144,19 @@ dkim_module_check (struct dkim_check_result *res)
 		}
 
 		if (cur->key != NULL && cur->res == NULL) {
-			cur->res = rspamd_dkim_check (cur->ctx, cur->key, task);
-
-			if (dkim_module_ctx->dkim_domains != NULL) {
-				/* Perform strict check */
-				const gchar *domain = rspamd_dkim_get_domain (cur->ctx);
-
-				if ((strict_value =
-						rspamd_match_hash_map (dkim_module_ctx->dkim_domains,
-								domain,
-								strlen (domain))) != NULL) {
-					if (!dkim_module_parse_strict (strict_value, &cur->mult_allow,
-							&cur->mult_deny)) {
-						cur->mult_allow = dkim_module_ctx->strict_multiplier;
-						cur->mult_deny = dkim_module_ctx->strict_multiplier;
-					}
-				}
+			cur->res = rspamd_dkim_check_start (cur->ctx, cur->key, task,
+					dkim_module_ctx->verify_cache);
+
+			if (rspamd_dkim_check_pending (cur->res)) {
+				/* Public key operations are done in the cpu pool if enabled */
+				cur->verifying = TRUE;
+				cur->offloaded = FALSE;
+				cur->offloaded = rspamd_symcache_item_offload (task, cur->item,
+						dkim_module_verify_work, dkim_module_verify_fin, cur);
+			}
+			else {
+				rspamd_dkim_check_finish (cur->res, task);
+				dkim_module_check_strict (cur);
 			}
 		}
 	}
@@ -979,8 +1165,8 @@ dkim_module_check (struct dkim_check_result *res)
 		if (cur->ctx == NULL) {
 			continue;
 		}
-		if (cur->res == NULL) {
-			/* Still need a key */
+		if (cur->res == NULL || cur->verifying) {
+			/* Still need a key or a verification result */
 			all_done = FALSE;
 		}
 	}
@@ -1472,7 +1658,8 @@ dkim_module_lua_on_key (rspamd_dkim_key_t *key,
 		return;
 	}
 
-	res = rspamd_dkim_check (cbd->ctx, cbd->key, cbd->task);
+	res = rspamd_dkim_check (cbd->ctx, cbd->key, cbd->task,
+			dkim_module_ctx->verify_cache);
 	dkim_module_lua_push_verify_result (cbd, res, NULL);
 }
 
@@ -1557,7 +1744,8 @@ lua_dkim_verify_handler (lua_State *L)
 			/* Release key when task is processed */
 			rspamd_mempool_add_destructor (task->task_pool,
 					dkim_module_key_dtor, cbd->key);
-			ret = rspamd_dkim_check (cbd->ctx, cbd->key, cbd->task);
+			ret = rspamd_dkim_check (cbd->ctx, cbd->key, cbd->task,
+					dkim_module_ctx->verify_cache);
 			dkim_module_lua_push_verify_result (cbd, ret, NULL);
 		}
 		else {
@@ -37,6 +37,7 @@
 #include "libmime/images.h"
 #include "libserver/worker_util.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/net_replay.h"
 #include "fuzzy_wire.h"
 #include "utlist.h"
 #include "ottery.h"
@@ -87,6 +88,9 @@ struct fuzzy_rule {
 	gboolean skip_unknown;
 	gboolean no_share;
 	gboolean no_subject;
+	gboolean batch;
+	gboolean shared_channel;
+	GHashTable *channels; /* upstream -> struct fuzzy_channel */
 	gint learn_condition_cb;
 	struct rspamd_hash_map_helper *skip_map;
 	struct fuzzy_ctx *ctx;
@@ -126,6 +130,8 @@ struct fuzzy_client_result {
 	enum fuzzy_result_type type;
 };
 
+struct fuzzy_channel;
+
 struct fuzzy_client_session {
 	GPtrArray *commands;
 	GPtrArray *results;
@@ -138,6 +144,26 @@ struct fuzzy_client_session {
 	gint state;
 	gint fd;
 	guint retransmits;
+	/* Set if commands are sent over a socket shared with other tasks */
+	struct fuzzy_channel *channel;
+	gdouble deadline;
+	struct fuzzy_client_session *prev, *next;
+};
+
+/*
+ * Socket shared by check sessions of all tasks for a specific rule and
+ * upstream, replies are dispatched to sessions by command tags
+ */
+struct fuzzy_channel {
+	struct fuzzy_rule *rule;
+	struct upstream *server;
+	struct ev_loop *event_loop;
+	GHashTable *tags;
+	/* Sessions ordered by deadline, as all of them have the same timeout */
+	struct fuzzy_client_session *sessions;
+	ev_io io;
+	ev_timer tm;
+	gint fd;
 };
 
 struct fuzzy_learn_session {
@@ -337,6 +363,10 @@ fuzzy_free_rule (gpointer r)
 	if (rule->peer_key) {
 		rspamd_pubkey_unref (rule->peer_key);
 	}
+
+	if (rule->channels) {
+		g_hash_table_unref (rule->channels);
+	}
 }
 
 static gint
@@ -447,6 +477,14 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 		rule->no_subject = ucl_obj_toboolean (value);
 	}
 
+	if ((value = ucl_object_lookup (obj, "batch")) != NULL) {
+		rule->batch = ucl_obj_toboolean (value);
+	}
+
+	if ((value = ucl_object_lookup (obj, "shared_channel")) != NULL) {
+		rule->shared_channel = ucl_obj_toboolean (value);
+	}
+
 	if ((value = ucl_object_lookup (obj, "algorithm")) != NULL) {
 		rule->algorithm_str = ucl_object_tostring (value);
 
@@ -465,6 +503,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 					g_ascii_strcasecmp (rule->algorithm_str, "fast") == 0) {
 				rule->alg = RSPAMD_SHINGLES_FAST;
 			}
+			else if (g_ascii_strcasecmp (rule->algorithm_str, "lanes") == 0) {
+				rule->alg = RSPAMD_SHINGLES_LANES;
+			}
 			else {
 				msg_warn_config ("unknown algorithm: %s, use siphash by default",
 						rule->algorithm_str);
@@ -486,6 +527,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 	case RSPAMD_SHINGLES_FAST:
 		rule->algorithm_str = "fast";
 		break;
+	case RSPAMD_SHINGLES_LANES:
+		rule->algorithm_str = "lanes";
+		break;
 	}
 
 	if ((value = ucl_object_lookup (obj, "servers")) != NULL) {
@@ -952,6 +996,24 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			"false",
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check.rule",
+			"Send all commands of a message in a single datagram (requires new fuzzy storage)",
+			"batch",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			"false",
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check.rule",
+			"Send check commands of all tasks over a single socket per server",
+			"shared_channel",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			"false",
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check.rule",
 			"Disable sharing message stats with the fuzzy server",
@@ -1235,12 +1297,18 @@ fuzzy_check_module_reconfig (struct rspamd_config *cfg)
 	return fuzzy_check_module_config (cfg, false);
 }
 
+static void fuzzy_channel_unlink (struct fuzzy_client_session *session);
+
 /* Finalize IO */
 static void
 fuzzy_io_fin (void *ud)
 {
 	struct fuzzy_client_session *session = ud;
 
+	if (session->channel) {
+		fuzzy_channel_unlink (session);
+	}
+
 	if (session->commands) {
 		g_ptr_array_free (session->commands, TRUE);
 	}
@@ -1249,8 +1317,10 @@ fuzzy_io_fin (void *ud)
 		g_ptr_array_free (session->results, TRUE);
 	}
 
-	rspamd_ev_watcher_stop (session->event_loop, &session->ev);
-	close (session->fd);
+	if (!session->channel) {
+		rspamd_ev_watcher_stop (session->event_loop, &session->ev);
+		close (session->fd);
+	}
 }
 
 static GArray *
@@ -1259,6 +1329,15 @@ fuzzy_preprocess_words (struct rspamd_mime_text_part *part, rspamd_mempool_t *po
 	return part->utf_words;
 }
 
+/*
+ * Batched commands are encrypted all together when sent
+ */
+static inline gboolean
+fuzzy_rule_encrypt_commands (struct fuzzy_rule *rule)
+{
+	return rule->peer_key != NULL && !rule->batch;
+}
+
 static void
 fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
 		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
@@ -1318,7 +1397,7 @@ fuzzy_cmd_stat (struct fuzzy_rule *rule,
 	io->tag = cmd->tag;
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
-	if (rule->peer_key && enccmd) {
+	if (fuzzy_rule_encrypt_commands (rule) && enccmd) {
 		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
@@ -1375,7 +1454,7 @@ fuzzy_cmd_hash (struct fuzzy_rule *rule,
 
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
-	if (rule->peer_key && enccmd) {
+	if (fuzzy_rule_encrypt_commands (rule) && enccmd) {
 		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
@@ -1810,7 +1889,7 @@ fuzzy_cmd_from_text_part (struct rspamd_task *task,
 	io->flags = 0;
 
 
-	if (rule->peer_key) {
+	if (fuzzy_rule_encrypt_commands (rule)) {
 		/* Encrypt data */
 		if (!short_text) {
 			fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd,
@@ -1924,7 +2003,7 @@ fuzzy_cmd_from_image_part (struct fuzzy_rule *rule,
 	io->flags = FUZZY_CMD_FLAG_IMAGE;
 	memcpy (&io->cmd, &shcmd->basic, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (fuzzy_rule_encrypt_commands (rule)) {
 		/* Encrypt data */
 		fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd, sizeof (*shcmd));
 		io->io.iov_base = encshcmd;
@@ -1989,7 +2068,7 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 				additional_length);
 	}
 
-	if (rule->peer_key) {
+	if (fuzzy_rule_encrypt_commands (rule)) {
 		g_assert (enccmd != NULL);
 		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd,
 				sizeof (*cmd) + additional_length);
@@ -2023,14 +2102,66 @@ fuzzy_cmd_to_wire (gint fd, struct iovec *io)
 	return TRUE;
 }
 
+/*
+ * Packs plain commands into a single datagram encrypting it as a whole
+ */
 static gboolean
-fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
+fuzzy_cmd_batch_to_wire (gint fd, struct fuzzy_rule *rule,
+		struct fuzzy_cmd_io **ios, guint nios)
 {
+	struct rspamd_fuzzy_encrypted_req_hdr *enchdr = NULL;
+	struct rspamd_fuzzy_batch_hdr *hdr;
+	guchar buf[RSPAMD_FUZZY_BATCH_MAXLEN], *p;
+	struct iovec iov;
+	guint16 clen;
 	guint i;
+
+	p = buf;
+
+	if (rule->peer_key) {
+		enchdr = (struct rspamd_fuzzy_encrypted_req_hdr *)p;
+		p += sizeof (*enchdr);
+	}
+
+	hdr = (struct rspamd_fuzzy_batch_hdr *)p;
+	memcpy (hdr->magic, fuzzy_batch_magic, sizeof (hdr->magic));
+	hdr->version = RSPAMD_FUZZY_PLUGIN_VERSION;
+	hdr->ncmds = nios;
+	hdr->reserved = 0;
+	p += sizeof (*hdr);
+
+	for (i = 0; i < nios; i ++) {
+		clen = htons (ios[i]->io.iov_len);
+		memcpy (p, &clen, sizeof (clen));
+		p += sizeof (clen);
+		memcpy (p, ios[i]->io.iov_base, ios[i]->io.iov_len);
+		p += ios[i]->io.iov_len;
+	}
+
+	if (enchdr) {
+		fuzzy_encrypt_cmd (rule, enchdr, (guchar *)hdr, p - (guchar *)hdr);
+		memcpy (enchdr->magic, fuzzy_encrypted_batch_magic,
+				sizeof (enchdr->magic));
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = p - buf;
+
+	return fuzzy_cmd_to_wire (fd, &iov);
+}
+
+static gboolean
+fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v, struct fuzzy_rule *rule)
+{
+	guint i, nbatch = 0;
+	gsize batch_len = 0, batch_max;
 	gboolean all_sent = TRUE, all_replied = TRUE;
-	struct fuzzy_cmd_io *io;
+	struct fuzzy_cmd_io *io, *batch[RSPAMD_FUZZY_BATCH_MAX];
 	gboolean processed = FALSE;
 
+	batch_max = RSPAMD_FUZZY_BATCH_MAXLEN - sizeof (struct rspamd_fuzzy_batch_hdr) -
+			sizeof (struct rspamd_fuzzy_encrypted_req_hdr);
+
 	/* First try to resend unsent commands */
 	for (i = 0; i < v->len; i ++) {
 		io = g_ptr_array_index (v, i);
@@ -2042,7 +2173,21 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 		all_replied = FALSE;
 
 		if (!(io->flags & FUZZY_CMD_FLAG_SENT)) {
-			if (!fuzzy_cmd_to_wire (fd, &io->io)) {
+			if (rule->batch) {
+				if (nbatch == G_N_ELEMENTS (batch) ||
+						batch_len + sizeof (guint16) + io->io.iov_len > batch_max) {
+					if (!fuzzy_cmd_batch_to_wire (fd, rule, batch, nbatch)) {
+						return FALSE;
+					}
+
+					nbatch = 0;
+					batch_len = 0;
+				}
+
+				batch[nbatch ++] = io;
+				batch_len += sizeof (guint16) + io->io.iov_len;
+			}
+			else if (!fuzzy_cmd_to_wire (fd, &io->io)) {
 				return FALSE;
 			}
 			processed = TRUE;
@@ -2051,6 +2196,10 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 		}
 	}
 
+	if (nbatch > 0 && !fuzzy_cmd_batch_to_wire (fd, rule, batch, nbatch)) {
+		return FALSE;
+	}
+
 	if (all_sent && !all_replied) {
 		/* Now try to resend each command in the vector */
 		for (i = 0; i < v->len; i++) {
@@ -2061,29 +2210,77 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 			}
 		}
 
-		return fuzzy_cmd_vector_to_wire (fd, v);
+		return fuzzy_cmd_vector_to_wire (fd, v, rule);
 	}
 
 	return processed;
 }
 
 /*
- * Read replies one-by-one and remove them from req array
+ * Decrypts reply to a batch and leaves the plain replies in the buffer
+ */
+static gboolean
+fuzzy_process_batch_reply (guchar **pos, gint *r, struct fuzzy_rule *rule)
+{
+	guchar *p = *pos;
+	gint remain = *r;
+	struct rspamd_fuzzy_encrypted_rep_hdr rep_hdr;
+	struct rspamd_fuzzy_batch_hdr hdr;
+
+	if (rule->peer_key) {
+		if (remain < (gint)(sizeof (rep_hdr) + sizeof (hdr))) {
+			return FALSE;
+		}
+
+		memcpy (&rep_hdr, p, sizeof (rep_hdr));
+		p += sizeof (rep_hdr);
+		remain -= sizeof (rep_hdr);
+
+		rspamd_keypair_cache_process (rule->ctx->keypairs_cache,
+				rule->local_key, rule->peer_key);
+
+		if (!rspamd_cryptobox_decrypt_nm_inplace (p, remain,
+				rep_hdr.nonce,
+				rspamd_pubkey_get_nm (rule->peer_key, rule->local_key),
+				rep_hdr.mac,
+				rspamd_pubkey_alg (rule->peer_key))) {
+			msg_info ("cannot decrypt batch reply");
+			return FALSE;
+		}
+	}
+
+	if (remain < (gint)sizeof (hdr)) {
+		return FALSE;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+
+	if (memcmp (hdr.magic, fuzzy_batch_magic, sizeof (hdr.magic)) != 0) {
+		msg_info ("invalid batch reply");
+		return FALSE;
+	}
+
+	p += sizeof (hdr);
+	remain -= sizeof (hdr);
+	*pos = p;
+	*r = MIN (remain, (gint)(hdr.ncmds * sizeof (struct rspamd_fuzzy_reply)));
+
+	return TRUE;
+}
+
+/*
+ * Decodes the next reply from the wire
  */
 static const struct rspamd_fuzzy_reply *
-fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
-		struct fuzzy_rule *rule, struct rspamd_fuzzy_cmd **pcmd,
-		struct fuzzy_cmd_io **pio)
+fuzzy_decode_reply (guchar **pos, gint *r, struct fuzzy_rule *rule)
 {
 	guchar *p = *pos;
 	gint remain = *r;
-	guint i, required_size;
-	struct fuzzy_cmd_io *io;
+	guint required_size;
 	const struct rspamd_fuzzy_reply *rep;
 	struct rspamd_fuzzy_encrypted_reply encrep;
-	gboolean found = FALSE;
 
-	if (rule->peer_key) {
+	if (fuzzy_rule_encrypt_commands (rule)) {
 		required_size = sizeof (encrep);
 	}
 	else {
@@ -2094,7 +2291,7 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 		return NULL;
 	}
 
-	if (rule->peer_key) {
+	if (fuzzy_rule_encrypt_commands (rule)) {
 		memcpy (&encrep, p, sizeof (encrep));
 		*pos += required_size;
 		*r -= required_size;
@@ -2123,9 +2320,22 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	}
 
 	rep = (const struct rspamd_fuzzy_reply *) p;
-	/*
-	 * Search for tag
-	 */
+
+	return rep;
+}
+
+/*
+ * Finds a command for the reply and marks it as replied
+ */
+static const struct rspamd_fuzzy_reply *
+fuzzy_match_reply (const struct rspamd_fuzzy_reply *rep, GPtrArray *req,
+		struct rspamd_fuzzy_cmd **pcmd,
+		struct fuzzy_cmd_io **pio)
+{
+	guint i;
+	struct fuzzy_cmd_io *io;
+	gboolean found = FALSE;
+
 	for (i = 0; i < req->len; i ++) {
 		io = g_ptr_array_index (req, i);
 
@@ -2154,6 +2364,23 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	return NULL;
 }
 
+/*
+ * Read replies one-by-one and remove them from req array
+ */
+static const struct rspamd_fuzzy_reply *
+fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
+		struct fuzzy_rule *rule, struct rspamd_fuzzy_cmd **pcmd,
+		struct fuzzy_cmd_io **pio)
+{
+	const struct rspamd_fuzzy_reply *rep;
+
+	if ((rep = fuzzy_decode_reply (pos, r, rule)) == NULL) {
+		return NULL;
+	}
+
+	return fuzzy_match_reply (rep, req, pcmd, pio);
+}
+
 static void
 fuzzy_insert_result (struct fuzzy_client_session *session,
 		const struct rspamd_fuzzy_reply *rep,
@@ -2321,17 +2548,92 @@ fuzzy_insert_result (struct fuzzy_client_session *session,
 	}
 }
 
+/* Replies are replayed by rule, command and digest as tags are random */
+static gsize
+fuzzy_replay_key (struct fuzzy_rule *rule, struct rspamd_fuzzy_cmd *cmd,
+		gchar *buf, gsize buflen)
+{
+	gsize r;
+
+	r = rspamd_snprintf (buf, buflen, "%s:%d:", rule->name, (gint)cmd->cmd);
+
+	if (buflen - r >= sizeof (cmd->digest)) {
+		memcpy (buf + r, cmd->digest, sizeof (cmd->digest));
+		r += sizeof (cmd->digest);
+	}
+
+	return r;
+}
+
+static void
+fuzzy_check_handle_reply (struct fuzzy_client_session *session,
+		const struct rspamd_fuzzy_reply *rep,
+		struct rspamd_fuzzy_cmd *cmd,
+		struct fuzzy_cmd_io *io)
+{
+	struct rspamd_task *task = session->task;
+
+	if (rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_RECORD) {
+		gchar key[256];
+		gsize keylen;
+
+		keylen = fuzzy_replay_key (session->rule, cmd, key, sizeof (key));
+		rspamd_net_replay_record (RSPAMD_NET_REPLAY_FUZZY, key, keylen,
+				rep, sizeof (*rep));
+	}
+
+	if (rep->v1.prob > 0.5) {
+		if (cmd->cmd == FUZZY_CHECK) {
+			fuzzy_insert_result (session, rep, cmd, io, rep->v1.flag);
+		}
+		else if (cmd->cmd == FUZZY_STAT) {
+			/* Just set pool variable to extract it in further */
+			struct rspamd_fuzzy_stat_entry *pval;
+			GList *res;
+
+			pval = rspamd_mempool_alloc (task->task_pool, sizeof (*pval));
+			pval->fuzzy_cnt = rep->v1.flag;
+			pval->name = session->rule->name;
+
+			res = rspamd_mempool_get_variable (task->task_pool, "fuzzy_stat");
+
+			if (res == NULL) {
+				res = g_list_append (NULL, pval);
+				rspamd_mempool_set_variable (task->task_pool, "fuzzy_stat",
+						res, (rspamd_mempool_destruct_t)g_list_free);
+			}
+			else {
+				res = g_list_append (res, pval);
+			}
+		}
+	}
+	else if (rep->v1.value == 403) {
+		rspamd_task_insert_result (task, "FUZZY_BLOCKED", 0.0,
+				session->rule->name);
+	}
+	else if (rep->v1.value == 401) {
+		if (cmd->cmd != FUZZY_CHECK) {
+			msg_info_task (
+					"fuzzy check error for %d: skipped by server",
+					rep->v1.flag);
+		}
+	}
+	else if (rep->v1.value != 0) {
+		msg_info_task (
+				"fuzzy check error for %d: unknown error (%d)",
+				rep->v1.flag,
+				rep->v1.value);
+	}
+}
+
 static gint
 fuzzy_check_try_read (struct fuzzy_client_session *session)
 {
-	struct rspamd_task *task;
 	const struct rspamd_fuzzy_reply *rep;
 	struct rspamd_fuzzy_cmd *cmd = NULL;
 	struct fuzzy_cmd_io *io = NULL;
 	gint r, ret;
-	guchar buf[2048], *p;
-
-	task = session->task;
+	guchar buf[RSPAMD_FUZZY_BATCH_MAXLEN], *p;
 
 	if ((r = read (session->fd, buf, sizeof (buf) - 1)) == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
@@ -2346,51 +2648,14 @@ fuzzy_check_try_read (struct fuzzy_client_session *session)
 
 		ret = 0;
 
+		if (session->rule->batch &&
+				!fuzzy_process_batch_reply (&p, &r, session->rule)) {
+			r = 0;
+		}
+
 		while ((rep = fuzzy_process_reply (&p, &r,
 				session->commands, session->rule, &cmd, &io)) != NULL) {
-			if (rep->v1.prob > 0.5) {
-				if (cmd->cmd == FUZZY_CHECK) {
-					fuzzy_insert_result (session, rep, cmd, io, rep->v1.flag);
-				}
-				else if (cmd->cmd == FUZZY_STAT) {
-					/* Just set pool variable to extract it in further */
-					struct rspamd_fuzzy_stat_entry *pval;
-					GList *res;
-
-					pval = rspamd_mempool_alloc (task->task_pool, sizeof (*pval));
-					pval->fuzzy_cnt = rep->v1.flag;
-					pval->name = session->rule->name;
-
-					res = rspamd_mempool_get_variable (task->task_pool, "fuzzy_stat");
-
-					if (res == NULL) {
-						res = g_list_append (NULL, pval);
-						rspamd_mempool_set_variable (task->task_pool, "fuzzy_stat",
-								res, (rspamd_mempool_destruct_t)g_list_free);
-					}
-					else {
-						res = g_list_append (res, pval);
-					}
-				}
-			}
-			else if (rep->v1.value == 403) {
-				rspamd_task_insert_result (task, "FUZZY_BLOCKED", 0.0,
-						session->rule->name);
-			}
-			else if (rep->v1.value == 401) {
-				if (cmd->cmd != FUZZY_CHECK) {
-					msg_info_task (
-							"fuzzy check error for %d: skipped by server",
-							rep->v1.flag);
-				}
-			}
-			else if (rep->v1.value != 0) {
-				msg_info_task (
-						"fuzzy check error for %d: unknown error (%d)",
-						rep->v1.flag,
-						rep->v1.value);
-			}
-
+			fuzzy_check_handle_reply (session, rep, cmd, io);
 			ret = 1;
 		}
 	}
@@ -2604,7 +2869,8 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 		}
 	}
 	else if (what & EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+				session->rule)) {
 			ret = return_error;
 		}
 		else {
@@ -2649,6 +2915,289 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 	}
 }
 
+static void
+fuzzy_channel_fail_session (struct fuzzy_client_session *session,
+		const gchar *reason)
+{
+	rspamd_upstream_fail (session->server, TRUE, reason);
+
+	if (session->item) {
+		rspamd_symcache_item_async_dec_check (session->task, session->item, M);
+	}
+
+	rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
+}
+
+static void
+fuzzy_channel_schedule (struct fuzzy_client_session *session)
+{
+	struct fuzzy_channel *channel = session->channel;
+
+	if (session->prev) {
+		DL_DELETE (channel->sessions, session);
+	}
+
+	session->deadline = ev_now (channel->event_loop) +
+			((gdouble)channel->rule->ctx->io_timeout) / 1000.0;
+	DL_APPEND (channel->sessions, session);
+
+	if (!ev_is_active (&channel->tm)) {
+		ev_timer_again (channel->event_loop, &channel->tm);
+	}
+}
+
+static void
+fuzzy_channel_unlink (struct fuzzy_client_session *session)
+{
+	struct fuzzy_channel *channel = session->channel;
+	struct fuzzy_cmd_io *io;
+	guint i;
+
+	PTR_ARRAY_FOREACH (session->commands, i, io) {
+		if (g_hash_table_lookup (channel->tags,
+				GUINT_TO_POINTER (io->tag)) == session) {
+			g_hash_table_remove (channel->tags, GUINT_TO_POINTER (io->tag));
+		}
+	}
+
+	if (session->prev) {
+		DL_DELETE (channel->sessions, session);
+		session->prev = NULL;
+		session->next = NULL;
+	}
+
+	if (channel->sessions == NULL) {
+		ev_timer_stop (channel->event_loop, &channel->tm);
+	}
+}
+
+static void
+fuzzy_channel_timer_callback (EV_P_ ev_timer *w, int revents)
+{
+	struct fuzzy_channel *channel = (struct fuzzy_channel *)w->data;
+	struct fuzzy_client_session *session;
+	struct rspamd_task *task;
+	gdouble now = ev_now (EV_A);
+
+	/* Sessions are ordered by deadline, so only the head is checked */
+	while ((session = channel->sessions) != NULL && session->deadline <= now) {
+		task = session->task;
+
+		if (session->retransmits >= channel->rule->ctx->retransmits) {
+			msg_err_task ("got IO timeout with server %s(%s), after %d retransmits",
+					rspamd_upstream_name (session->server),
+					rspamd_inet_address_to_string_pretty (
+							rspamd_upstream_addr_cur (session->server)),
+					session->retransmits);
+			fuzzy_channel_fail_session (session, "timeout");
+
+			continue;
+		}
+
+		if (!fuzzy_cmd_vector_to_wire (channel->fd, session->commands,
+				channel->rule) && errno != EAGAIN && errno != ENOBUFS) {
+			msg_err_task ("got error on IO with server %s(%s), on write, %d, %s",
+					rspamd_upstream_name (session->server),
+					rspamd_inet_address_to_string_pretty (
+							rspamd_upstream_addr_cur (session->server)),
+					errno,
+					strerror (errno));
+			fuzzy_channel_fail_session (session, strerror (errno));
+
+			continue;
+		}
+
+		session->retransmits ++;
+		fuzzy_channel_schedule (session);
+	}
+
+	if (channel->sessions == NULL) {
+		ev_timer_stop (EV_A_ w);
+	}
+}
+
+static void
+fuzzy_channel_io_callback (EV_P_ ev_io *w, int revents)
+{
+	struct fuzzy_channel *channel = (struct fuzzy_channel *)w->data;
+	struct fuzzy_client_session *session;
+	const struct rspamd_fuzzy_reply *rep;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct fuzzy_cmd_io *io;
+	guchar buf[RSPAMD_FUZZY_BATCH_MAXLEN], *p;
+	gint r;
+
+	for (;;) {
+		if ((r = read (channel->fd, buf, sizeof (buf) - 1)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				msg_err ("got error on IO with server %s(%s), on read, %d, %s",
+						rspamd_upstream_name (channel->server),
+						rspamd_inet_address_to_string_pretty (
+								rspamd_upstream_addr_cur (channel->server)),
+						errno,
+						strerror (errno));
+
+				/* Error is not related to a specific session, so fail all */
+				while ((session = channel->sessions) != NULL) {
+					fuzzy_channel_fail_session (session, strerror (errno));
+				}
+			}
+
+			break;
+		}
+
+		p = buf;
+
+		if (channel->rule->batch &&
+				!fuzzy_process_batch_reply (&p, &r, channel->rule)) {
+			continue;
+		}
+
+		while ((rep = fuzzy_decode_reply (&p, &r, channel->rule)) != NULL) {
+			session = g_hash_table_lookup (channel->tags,
+					GUINT_TO_POINTER (rep->v1.tag));
+
+			if (session == NULL) {
+				msg_info ("unexpected tag: %ud", rep->v1.tag);
+				continue;
+			}
+
+			cmd = NULL;
+			io = NULL;
+
+			if (fuzzy_match_reply (rep, session->commands, &cmd, &io) != NULL) {
+				fuzzy_check_handle_reply (session, rep, cmd, io);
+				/* Session might be destroyed here */
+				fuzzy_check_session_is_completed (session);
+			}
+		}
+	}
+}
+
+static void
+fuzzy_channel_free (gpointer p)
+{
+	struct fuzzy_channel *channel = (struct fuzzy_channel *)p;
+
+	ev_io_stop (channel->event_loop, &channel->io);
+	ev_timer_stop (channel->event_loop, &channel->tm);
+	close (channel->fd);
+	g_hash_table_unref (channel->tags);
+	g_free (channel);
+}
+
+static struct fuzzy_channel *
+fuzzy_channel_get (struct rspamd_task *task, struct fuzzy_rule *rule,
+		struct upstream *selected)
+{
+	struct fuzzy_channel *channel = NULL;
+	rspamd_inet_addr_t *addr;
+	gdouble tick;
+	gint sock;
+
+	if (rule->channels == NULL) {
+		rule->channels = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+				NULL, fuzzy_channel_free);
+	}
+	else {
+		channel = g_hash_table_lookup (rule->channels, selected);
+	}
+
+	if (channel == NULL) {
+		addr = rspamd_upstream_addr_next (selected);
+
+		if ((sock = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE)) == -1) {
+			msg_warn_task ("cannot connect to %s(%s), %d, %s",
+					rspamd_upstream_name (selected),
+					rspamd_inet_address_to_string_pretty (addr),
+					errno,
+					strerror (errno));
+
+			return NULL;
+		}
+
+		channel = g_malloc0 (sizeof (*channel));
+		channel->rule = rule;
+		channel->server = selected;
+		channel->event_loop = task->event_loop;
+		channel->fd = sock;
+		channel->tags = g_hash_table_new (g_direct_hash, g_direct_equal);
+		/* Deadlines are checked a few times per timeout */
+		tick = MAX (((gdouble)rule->ctx->io_timeout) / 4000.0, 0.01);
+		channel->tm.data = channel;
+		ev_timer_init (&channel->tm, fuzzy_channel_timer_callback, tick, tick);
+		channel->io.data = channel;
+		ev_io_init (&channel->io, fuzzy_channel_io_callback, sock, EV_READ);
+		ev_io_start (channel->event_loop, &channel->io);
+		g_hash_table_insert (rule->channels, selected, channel);
+	}
+
+	return channel;
+}
+
+/*
+ * Sends commands over the shared channel, returns FALSE if a private socket
+ * should be used instead
+ */
+static gboolean
+fuzzy_channel_register (struct rspamd_task *task, struct fuzzy_rule *rule,
+		struct upstream *selected, GPtrArray *commands)
+{
+	struct fuzzy_channel *channel;
+	struct fuzzy_client_session *session;
+	struct fuzzy_cmd_io *io;
+	guint i;
+
+	if ((channel = fuzzy_channel_get (task, rule, selected)) == NULL) {
+		return FALSE;
+	}
+
+	/* Tags must be unique among all tasks using the channel */
+	PTR_ARRAY_FOREACH (commands, i, io) {
+		if (g_hash_table_lookup (channel->tags, GUINT_TO_POINTER (io->tag))) {
+			return FALSE;
+		}
+	}
+
+	if (!fuzzy_cmd_vector_to_wire (channel->fd, commands, rule) &&
+			errno != EAGAIN && errno != ENOBUFS) {
+		PTR_ARRAY_FOREACH (commands, i, io) {
+			io->flags &= ~FUZZY_CMD_FLAG_SENT;
+		}
+
+		return FALSE;
+	}
+
+	session = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct fuzzy_client_session));
+	session->state = 1;
+	session->commands = commands;
+	session->task = task;
+	session->fd = -1;
+	session->server = selected;
+	session->rule = rule;
+	session->results = g_ptr_array_sized_new (32);
+	session->event_loop = task->event_loop;
+	session->channel = channel;
+
+	PTR_ARRAY_FOREACH (commands, i, io) {
+		g_hash_table_insert (channel->tags, GUINT_TO_POINTER (io->tag), session);
+	}
+
+	fuzzy_channel_schedule (session);
+	rspamd_session_add_event (task->s, fuzzy_io_fin, session, M);
+	session->item = rspamd_symcache_get_cur_item (task);
+
+	if (session->item) {
+		rspamd_symcache_item_async_inc (task, session->item, M);
+	}
+
+	return TRUE;
+}
 
 static void
 fuzzy_lua_fin (void *ud)
@@ -2725,7 +3274,7 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 	const struct rspamd_fuzzy_reply *rep;
 	struct fuzzy_mapping *map;
 	struct rspamd_task *task;
-	guchar buf[2048], *p;
+	guchar buf[RSPAMD_FUZZY_BATCH_MAXLEN], *p;
 	struct fuzzy_cmd_io *io;
 	struct rspamd_fuzzy_cmd *cmd = NULL;
 	const gchar *symbol, *ftype;
@@ -2759,6 +3308,11 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 			p = buf;
 			ret = return_want_more;
 
+			if (session->rule->batch &&
+					!fuzzy_process_batch_reply (&p, &r, session->rule)) {
+				r = 0;
+			}
+
 			while ((rep = fuzzy_process_reply (&p, &r,
 					session->commands, session->rule, &cmd, &io)) != NULL) {
 				if ((map =
@@ -2858,7 +3412,8 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 	}
 	else if (what & EV_WRITE) {
 			/* Send commands to storage */
-			if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+			if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+				session->rule)) {
 				session->err.error_message = "write socket error";
 				session->err.error_code = errno;
 				ret = return_error;
@@ -3125,6 +3680,49 @@ end:
 }
 
 
+/*
+ * Commands are answered at once from the replay file, commands that have not
+ * been recorded are treated as not found
+ */
+static void
+fuzzy_replay_client_call (struct rspamd_task *task,
+		struct fuzzy_rule *rule,
+		GPtrArray *commands)
+{
+	struct fuzzy_client_session *session;
+	struct rspamd_fuzzy_reply rep;
+	struct fuzzy_cmd_io *io;
+	const guchar *data;
+	gchar key[256];
+	gsize keylen, datalen;
+	guint i;
+
+	session = rspamd_mempool_alloc0 (task->task_pool, sizeof (*session));
+	session->commands = commands;
+	session->task = task;
+	session->fd = -1;
+	session->rule = rule;
+	session->results = g_ptr_array_sized_new (32);
+	session->event_loop = task->event_loop;
+
+	PTR_ARRAY_FOREACH (commands, i, io) {
+		io->flags |= FUZZY_CMD_FLAG_SENT | FUZZY_CMD_FLAG_REPLIED;
+		keylen = fuzzy_replay_key (rule, &io->cmd, key, sizeof (key));
+		data = rspamd_net_replay_lookup (RSPAMD_NET_REPLAY_FUZZY, key, keylen,
+				&datalen);
+
+		if (data && datalen == sizeof (rep)) {
+			memcpy (&rep, data, sizeof (rep));
+			rep.v1.tag = io->tag;
+			fuzzy_check_handle_reply (session, &rep, &io->cmd, io);
+		}
+	}
+
+	fuzzy_insert_metric_results (task, rule, session->results);
+	g_ptr_array_free (session->results, TRUE);
+	g_ptr_array_free (commands, TRUE);
+}
+
 static inline void
 register_fuzzy_client_call (struct rspamd_task *task,
 	struct fuzzy_rule *rule,
@@ -3136,10 +3734,21 @@ register_fuzzy_client_call (struct rspamd_task *task,
 	gint sock;
 
 	if (!rspamd_session_blocked (task->s)) {
+		if (rspamd_net_replay_mode () == RSPAMD_NET_REPLAY_REPLAY) {
+			fuzzy_replay_client_call (task, rule, commands);
+
+			return;
+		}
+
 		/* Get upstream */
 		selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN,
 				NULL, 0);
 		if (selected) {
+			if (rule->shared_channel &&
+					fuzzy_channel_register (task, rule, selected, commands)) {
+				return;
+			}
+
 			addr = rspamd_upstream_addr_next (selected);
 			if ((sock = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE)) == -1) {
 				msg_warn_task ("cannot connect to %s(%s), %d, %s",
@@ -32,6 +32,7 @@ local settings = {
   epsilon_common = 0.01, -- eliminate common if spam to ham rate is equal to this epsilon
   common_ttl = 10 * 86400, -- TTL of discriminated common elements
   significant_factor = 3.0 / 4.0, -- which tokens should we update
+  cycle_pause = 0, -- seconds to wait after a full keyspace cycle before the next one
   classifiers = {},
   cluster_nodes = 0,
 }
@@ -182,6 +183,8 @@ template.common_ttl = settings.common_ttl
 template.epsilon_common = settings.epsilon_common
 template.significant_factor = settings.significant_factor
 template.expire_step = settings.interval
+template.cycle_pause = math.floor(
+    lutil.parse_time_interval(tostring(settings.cycle_pause)) or 0)
 template.hostname = rspamd_util.get_hostname()
 
 for k,v in pairs(template) do
@@ -219,6 +222,12 @@ local expiry_script = [[
   local expire = math.floor(KEYS[2])
   local pattern_sha1 = redis.sha1hex(KEYS[1])
 
+  -- Tokens are not revisited until pause after a full cycle is over
+  local pause_key = pattern_sha1 .. '_pause'
+  if redis.call('EXISTS', pause_key) == 1 then
+    return 'paused'
+  end
+
   local lock_key = pattern_sha1 .. '_lock' -- Check locking
   local lock = redis.call('GET', lock_key)
 
@@ -357,6 +366,10 @@ local expiry_script = [[
   redis.call('SET', step_key, tostring(step))
   redis.call('DEL', lock_key)
 
+  if tonumber(next_cursor) == 0 and ${cycle_pause} > 0 then
+    redis.call('SETEX', pause_key, ${cycle_pause}, '${hostname}')
+  end
+
   local occ_distr = {}
   for _,cl in pairs({'ham', 'spam', 'total'}) do
     local occurr_key = pattern_sha1 .. '_occurrence_' .. cl
@@ -452,6 +465,8 @@ local function expire_step(cls, ev_base, worker)
       if cur == 0 then
         log_stat(true)
       end
+    elseif args == 'paused' then
+      logger.debugm(N, rspamd_config, 'skip expiry step: paused after a full cycle')
     elseif type(args) == 'string' then
       logger.infox(rspamd_config, 'skip expiry step: %s', args)
     end
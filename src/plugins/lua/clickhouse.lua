@@ -73,6 +73,7 @@ local settings = {
   database = 'default',
   use_https = false,
   use_gzip = true,
+  use_zstd = false, -- requires Clickhouse with zstd HTTP compression support
   allow_local = false,
   insert_subject = false,
   subject_privacy = false, -- subject privacy is off
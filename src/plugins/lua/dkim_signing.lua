@@ -68,6 +68,14 @@ local function insert_sign_results(task, ret, hdr, dkim_params)
   end
 end
 
+-- Private key operation is done in the cpu pool (if `cache_cpu_threads` is set)
+local function sign_async(task, p)
+  p.callback = function(_, sret, hdr)
+    insert_sign_results(task, sret, hdr, p)
+  end
+  sign_func(task, p)
+end
+
 local function do_sign(task, p)
   if settings.use_milter_headers then
     p.no_cache = true -- Disable caching in rspamd_mempool
@@ -90,14 +98,12 @@ local function do_sign(task, p)
               p.domain, p.selector, err)
         end
 
-        local sret, hdr = sign_func(task, p)
-        insert_sign_results(task, sret, hdr, p)
+        sign_async(task, p)
       end,
       forced = true
     })
   else
-    local sret, hdr = sign_func(task, p)
-    insert_sign_results(task, sret, hdr, p)
+    sign_async(task, p)
   end
 end
 
@@ -167,6 +173,7 @@ end
 local sym_reg_tbl = {
   name = settings['symbol'],
   callback = dkim_signing_cb,
+  flags = 'cpu_parallel',
   groups = {"policies", "dkim"},
   score = 0.0,
 }
@@ -24,6 +24,7 @@ local logger = require "rspamd_logger"
 local mempool = require "rspamd_mempool"
 local util = require "rspamd_util"
 local tcp = require "rspamd_tcp"
+local rspamd_http = require "rspamd_http"
 local lua_util = require "lua_util"
 
 local pool
@@ -142,11 +143,94 @@ local function graphite_push(kwargs)
   })
 end
 
+local function prometheus_config()
+  load_defaults({
+    url = 'http://localhost:9091/metrics/job/rspamd',
+    metric_prefix = 'rspamd',
+    metrics = {},
+    task_timings = true,
+  })
+  if #settings['metrics'] == 0 then
+    return settings['task_timings']
+  end
+  return validate_metrics(settings['metrics'])
+end
+
+-- Task lifecycle histograms exported by `worker:get_stat()` as `task_timings`
+local function prometheus_histograms(out, timings)
+  for _, kind in ipairs({'wall', 'cpu'}) do
+    local mname = string.format('%s_task_%s_seconds', settings['metric_prefix'],
+        kind)
+    table.insert(out, string.format('# TYPE %s histogram', mname))
+    for phase, hist in pairs(timings[kind] or {}) do
+      for i, cnt in ipairs(hist.buckets) do
+        local le = timings.bounds[i] and tostring(timings.bounds[i]) or '+Inf'
+        table.insert(out, string.format('%s_bucket{phase="%s",le="%s"} %s',
+            mname, phase, le, cnt))
+      end
+      table.insert(out, string.format('%s_sum{phase="%s"} %s', mname, phase,
+          hist.sum))
+      table.insert(out, string.format('%s_count{phase="%s"} %s', mname, phase,
+          hist.count))
+    end
+  end
+end
+
+-- Pushes metrics in Prometheus text format to a pushgateway
+local function prometheus_push(kwargs)
+  local stamp = math.floor(kwargs['time'] or util.get_time())
+  local metrics_str = {}
+  for _, v in ipairs(settings['metrics']) do
+    local mvalue
+    local mname = string.format('%s_%s', settings['metric_prefix'],
+        v:gsub('[ .]', '_'))
+    local split = rspamd_str_split(v, '.')
+    if #split == 1 then
+      mvalue = kwargs['stats'][v]
+    elseif #split == 2 then
+      mvalue = kwargs['stats'][split[1]][split[2]]
+    end
+    table.insert(metrics_str, string.format('# TYPE %s gauge', mname))
+    table.insert(metrics_str, string.format('%s %s', mname, mvalue))
+  end
+  if settings['task_timings'] and kwargs['stats']['task_timings'] then
+    prometheus_histograms(metrics_str, kwargs['stats']['task_timings'])
+  end
+  table.insert(metrics_str, '')
+
+  rspamd_http.request({
+    ev_base = kwargs['ev_base'],
+    config = rspamd_config,
+    url = settings['url'],
+    method = 'PUT',
+    headers = {
+      ['Content-Type'] = 'text/plain; version=0.0.4',
+    },
+    body = table.concat(metrics_str, '\n'),
+    timeout = settings['timeout'],
+    callback = (function (err, code)
+      if err then
+        logger.errx('Push failed: %1', err)
+        return
+      end
+      if code < 200 or code >= 300 then
+        logger.errx('Push failed: HTTP code %1', code)
+        return
+      end
+      pool:set_variable(VAR_NAME, stamp)
+    end)
+  })
+end
+
 local backends = {
   graphite = {
     configure = graphite_config,
     push = graphite_push,
   },
+  prometheus = {
+    configure = prometheus_config,
+    push = prometheus_push,
+  },
 }
 
 local function configure_metric_exporter()
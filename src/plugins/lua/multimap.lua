@@ -429,6 +429,19 @@ end
 local function multimap_callback(task, rule)
   local pre_filter = rule['prefilter']
 
+  -- Extracts data once per task, so it is shared by all rules of the same type
+  local function task_data(what, extractor)
+    local key = 'multimap_' .. what
+    local cached = task:cache_get(key)
+
+    if cached == nil then
+      cached = extractor() or false
+      task:cache_set(key, cached)
+    end
+
+    return cached or nil
+  end
+
   local function match_element(r, value, callback)
     if not value then
       return false
@@ -638,9 +651,62 @@ local function multimap_callback(task, rule)
     end
   end
 
+  -- Match multiple plain values against a single rule with one map lookup
+  local function match_rule_batch(r, values)
+    local map = r.radix or r.hash
+    local keys = values
+
+    if r.hash then
+      keys = {}
+
+      for i,v in ipairs(values) do
+        if type(v) == 'userdata' and v.class == 'rspamd{ip}' then
+          keys[i] = v:tostring()
+        else
+          keys[i] = v
+        end
+      end
+    end
+
+    local results = map:get_keys_batch(keys)
+
+    for i,value in ipairs(values) do
+      local ret = results[i]
+
+      if ret then
+        local opt = value_types[r['type']].get_value(value)
+
+        if type(ret) == 'table' then
+          for _,elt in ipairs(ret) do
+            if type(elt) ~= 'userdata' then
+              insert_results(elt, opt)
+            end
+          end
+        else
+          insert_results(ret, opt)
+        end
+      end
+    end
+  end
+
+  -- Match all values against a single rule, plain values are checked with one map lookup
+  local function match_values(r, values)
+    local batch = #values > 1 and not r.redis_key and not r.filter and
+        r.type ~= 'url' and (r.radix or r.hash) and
+        not fun.any(function(v) return type(v) == 'table' end, values)
+
+    if batch then
+      match_rule_batch(r, values)
+    else
+      fun.each(function(v) match_rule(r, v) end, values)
+    end
+  end
+
   -- Match list of values according to the field
   local function match_list(r, ls, fields)
     if ls then
+      local values = {}
+
       if fields then
         fun.each(function(e)
           local match = e[fields[1]]
@@ -648,12 +714,14 @@ local function multimap_callback(task, rule)
             if fields[2] then
               match = fields[2](match)
             end
-            match_rule(r, match)
+            table.insert(values, match)
           end
         end, ls)
       else
-        fun.each(function(e) match_rule(r, e) end, ls)
+        fun.each(function(e) table.insert(values, e) end, ls)
       end
+
+      match_values(r, values)
     end
   end
 
@@ -666,18 +734,10 @@ local function multimap_callback(task, rule)
     end
   end
 
-  local function match_url(r, url)
-    match_rule(r, url)
-  end
-
   local function match_hostname(r, hostname)
     match_rule(r, hostname)
   end
 
-  local function match_filename(r, fn)
-    match_rule(r, fn)
-  end
-
   local function match_received_header(r, pos, total, h)
     local use_tld = false
     local filter = r['filter'] or 'real_ip'
@@ -812,31 +872,43 @@ local function multimap_callback(task, rule)
       end
     end,
     header = function()
+      local function get_header(rh)
+        return task_data('hdr_' .. rh:lower(), function()
+          return task:get_header_full(rh)
+        end)
+      end
+
       if type(rule['header']) == 'table' then
         for _,rh in ipairs(rule['header']) do
-          local hv = task:get_header_full(rh)
-          match_list(rule, hv, {'decoded'})
+          match_list(rule, get_header(rh), {'decoded'})
         end
       else
-        local hv = task:get_header_full(rule['header'])
-        match_list(rule, hv, {'decoded'})
+        match_list(rule, get_header(rule['header']), {'decoded'})
       end
     end,
     rcpt = function()
-      if task:has_recipients('smtp') then
-        local rcpts = task:get_recipients('smtp')
-        match_addr(rule, rcpts)
-      elseif task:has_recipients('mime') then
-        local rcpts = task:get_recipients('mime')
+      local rcpts = task_data('rcpt', function()
+        if task:has_recipients('smtp') then
+          return task:get_recipients('smtp')
+        elseif task:has_recipients('mime') then
+          return task:get_recipients('mime')
+        end
+      end)
+
+      if rcpts then
         match_addr(rule, rcpts)
       end
     end,
     from = function()
-      if task:has_from('smtp') then
-        local from = task:get_from('smtp')
-        match_addr(rule, from)
-      elseif task:has_from('mime') then
-        local from = task:get_from('mime')
+      local from = task_data('from', function()
+        if task:has_from('smtp') then
+          return task:get_from('smtp')
+        elseif task:has_from('mime') then
+          return task:get_from('mime')
+        end
+      end)
+
+      if from then
         match_addr(rule, from)
       end
     end,
@@ -848,10 +920,32 @@ local function multimap_callback(task, rule)
     end,
     url = function()
       if task:has_urls() then
-        local msg_urls = task:get_urls()
+        local msg_urls = task_data('urls', function() return task:get_urls() end)
+
+        if rule.redis_key or not (rule.radix or rule.hash) then
+          for _,url in ipairs(msg_urls) do
+            match_rule(rule, url)
+          end
+        else
+          -- Filtered values depend on a filter only, they are checked with one lookup
+          local filter = rule.filter
+          local values = task_data('url_' .. (filter or ''), function()
+            local res = {}
+
+            for _,url in ipairs(msg_urls) do
+              local v = apply_url_filter(task, filter, url, rule)
+
+              if v then
+                table.insert(res, v)
+              end
+            end
+
+            return res
+          end)
 
-        for _,url in ipairs(msg_urls) do
-          match_url(rule, url)
+          if #values > 0 then
+            match_rule_batch(rule, values)
+          end
         end
       end
     end,
@@ -862,52 +956,61 @@ local function multimap_callback(task, rule)
       end
     end,
     filename = function()
-      local parts = task:get_parts()
-
-      local function filter_parts(p)
-        return p:is_attachment() or (not p:is_text()) and (not p:is_multipart())
-      end
+      local fnames_key = string.format('filenames_%s_%s',
+          tostring(rule.skip_archives or false), tostring(rule.skip_detected or false))
+      local fnames = task_data(fnames_key, function()
+        local parts = task:get_parts()
+        local res = {}
+
+        local function filter_parts(p)
+          return p:is_attachment() or (not p:is_text()) and (not p:is_multipart())
+        end
 
-      local function filter_archive(p)
-        local ext = p:get_detected_ext()
-        local det_type = 'unknown'
+        local function filter_archive(p)
+          local ext = p:get_detected_ext()
+          local det_type = 'unknown'
 
-        if ext then
-          local lua_magic_types = require "lua_magic/types"
-          local det_t = lua_magic_types[ext]
+          if ext then
+            local lua_magic_types = require "lua_magic/types"
+            local det_t = lua_magic_types[ext]
 
-          if det_t then
-            det_type = det_t.type
+            if det_t then
+              det_type = det_t.type
+            end
           end
-        end
 
-        return p:is_archive() and det_type == 'archive' and not rule.skip_archives
-      end
+          return p:is_archive() and det_type == 'archive' and not rule.skip_archives
+        end
 
-      for _,p in fun.iter(fun.filter(filter_parts, parts)) do
-        if filter_archive(p) then
-          local fnames = p:get_archive():get_files(1000)
+        for _,p in fun.iter(fun.filter(filter_parts, parts)) do
+          if filter_archive(p) then
+            for _,fn in ipairs(p:get_archive():get_files(1000)) do
+              table.insert(res, fn)
+            end
+          end
 
-          for _,fn in ipairs(fnames) do
-            match_filename(rule, fn)
+          local fn = p:get_filename()
+          if fn then
+            table.insert(res, fn)
+          end
+          -- Also deal with detected content type
+          if not rule.skip_detected then
+            local ext = p:get_detected_ext()
+
+            if ext then
+              local fake_fname = string.format('detected.%s', ext)
+              lua_util.debugm(N, task, 'detected filename %s',
+                  fake_fname)
+              table.insert(res, fake_fname)
+            end
           end
         end
 
-        local fn = p:get_filename()
-        if fn then
-          match_filename(rule, fn)
-        end
-        -- Also deal with detected content type
-        if not rule.skip_detected then
-          local ext = p:get_detected_ext()
+        return res
+      end)
 
-          if ext then
-            local fake_fname = string.format('detected.%s', ext)
-            lua_util.debugm(N, task, 'detected filename %s',
-                fake_fname)
-            match_filename(rule, fake_fname)
-          end
-        end
+      if fnames then
+        match_values(rule, fnames)
       end
     end,
 
@@ -941,18 +1044,18 @@ local function multimap_callback(task, rule)
     symbol_options = function()
       local sym = task:get_symbol(rule['target_symbol'])
       if sym and sym[1].options then
-        for _, o in ipairs(sym[1].options) do
-          match_rule(rule, o)
-        end
+        match_values(rule, sym[1].options)
       end
     end,
     received = function()
-      local hdrs = task:get_received_headers()
+      local hdrs = task_data('received', function() return task:get_received_headers() end)
       if hdrs and hdrs[1] then
         if not rule['artificial'] then
-          hdrs = fun.filter(function(h)
-            return not h['flags']['artificial']
-          end, hdrs):totable()
+          hdrs = task_data('received_real', function()
+            return fun.filter(function(h)
+              return not h['flags']['artificial']
+            end, hdrs):totable()
+          end)
         end
         for pos, h in ipairs(hdrs) do
           match_received_header(rule, pos, #hdrs, h)
@@ -964,9 +1067,7 @@ local function multimap_callback(task, rule)
 
       if elts then
         if type(elts) == 'table' then
-          for _,elt in ipairs(elts) do
-            match_rule(rule, elt)
-          end
+          match_values(rule, elts)
         else
           match_rule(rule, elts)
         end
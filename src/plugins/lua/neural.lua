@@ -109,20 +109,31 @@ local function ann_scores_filter(task)
     if ann then
       local vec = neural_common.result_to_vector(task, profile)
 
-      local score
-      local out = ann:apply1(vec, set.ann.pca)
-      score = out[1]
+      local function insert_ann_result(out)
+        local score = out[1]
 
-      local symscore = string.format('%.3f', score)
-      lua_util.debugm(N, task, '%s:%s:%s ann score: %s',
-          rule.prefix, set.name, set.ann.version, symscore)
+        local symscore = string.format('%.3f', score)
+        lua_util.debugm(N, task, '%s:%s:%s ann score: %s',
+            rule.prefix, set.name, set.ann.version, symscore)
 
-      if score > 0 then
-        local result = score
-        task:insert_result(rule.symbol_spam, result, symscore)
+        if score > 0 then
+          local result = score
+          task:insert_result(rule.symbol_spam, result, symscore)
+        else
+          local result = -(score)
+          task:insert_result(rule.symbol_ham, result, symscore)
+        end
+      end
+
+      if rule.batch_timeout then
+        -- Evaluated together with other concurrent tasks
+        ann:apply_batched(task, vec, insert_ann_result, {
+          pca = set.ann.pca,
+          timeout = rule.batch_timeout,
+          max_batch = rule.batch_size,
+        })
       else
-        local result = -(score)
-        task:insert_result(rule.symbol_ham, result, symscore)
+        insert_ann_result(ann:apply1(vec, set.ann.pca))
       end
     end
   end
@@ -916,6 +927,23 @@ rspamd_config:add_post_init(neural_common.process_rules_settings)
 -- Add training scripts
 for _,rule in pairs(settings.rules) do
   neural_common.load_scripts(rule.redis)
+
+  -- We want to train neural nets when they have enough data
+  local function start_training(cfg, ev_base, worker)
+    rspamd_config:add_periodic(ev_base, 0.0,
+        function(_, _)
+          -- Clean old ANNs
+          cleanup_anns(rule, cfg, ev_base)
+          return check_anns(worker, cfg, ev_base, rule, maybe_train_existing_ann,
+              'try_train_ann')
+        end)
+  end
+
+  -- Training is moved to the dedicated worker if it is enabled, scanners
+  -- load new ANNs from Redis anyway
+  local has_trainer = rspamd_config:register_worker_script('neural_trainer',
+      start_training)
+
   -- This function will check ANNs in Redis when a worker is loaded
   rspamd_config:add_on_load(function(cfg, ev_base, worker)
     if worker:is_scanner() then
@@ -926,15 +954,8 @@ for _,rule in pairs(settings.rules) do
           end)
     end
 
-    if worker:is_primary_controller() then
-      -- We also want to train neural nets when they have enough data
-      rspamd_config:add_periodic(ev_base, 0.0,
-          function(_, _)
-            -- Clean old ANNs
-            cleanup_anns(rule, cfg, ev_base)
-            return check_anns(worker, cfg, ev_base, rule, maybe_train_existing_ann,
-                'try_train_ann')
-          end)
+    if worker:is_primary_controller() and not has_trainer then
+      start_training(cfg, ev_base, worker)
     end
   end)
 end
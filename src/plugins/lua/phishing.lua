@@ -264,11 +264,11 @@ local function phishing_cb(task)
           if not sweight then sweight = weight end
           if #map > 0 then
             for _,rule in ipairs(map) do
-              for _,dn in ipairs({furl:get_tld(), furl:get_host()}) do
-                if rule['map']:get_key(dn) then
-                  task:insert_result(rule['symbol'], sweight, ptld .. '->' .. dn)
-                  return true
-                end
+              -- Host and all its parent domains are checked at once
+              local found,dn = rule['map']:get_key(furl)
+              if found then
+                task:insert_result(rule['symbol'], sweight, ptld .. '->' .. dn)
+                return true
               end
             end
           end
@@ -303,7 +303,7 @@ local function phishing_map(mapname, phishmap, id)
 
 
     for sym,map_data in pairs(xd) do
-      local rmap = lua_maps.map_add_from_ucl (map_data, 'set',
+      local rmap = lua_maps.map_add_from_ucl (map_data, 'domain_suffix',
               'Phishing ' .. mapname .. ' map')
       if rmap then
         rspamd_config:register_virtual_symbol(sym, 1, id)
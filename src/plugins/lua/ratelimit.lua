@@ -54,146 +54,147 @@ local settings = {
   prefilter = true,
 }
 
--- Checks bucket, updating it if needed
--- KEYS[1] - prefix to update, e.g. RL_<triplet>_<seconds>
--- KEYS[2] - current time in milliseconds
--- KEYS[3] - bucket leak rate (messages per millisecond)
--- KEYS[4] - bucket burst
--- KEYS[5] - expire for a bucket
--- KEYS[6] - number of recipients
--- return 1 if message should be ratelimited and 0 if not
+-- Checks buckets, updating them if needed
+-- KEYS[i] - prefix to update, e.g. RL_<triplet>_<seconds>
+-- ARGV[1] - current time in milliseconds
+-- ARGV[2] - expire for a bucket
+-- ARGV[3 * i], ARGV[3 * i + 1], ARGV[3 * i + 2] - leak rate (messages per
+--   millisecond), burst and number of recipients of the bucket KEYS[i]
+-- returns an array with a reply per bucket, where the first element of
+-- the reply is 1 if message should be ratelimited and 0 if not
 -- Redis keys used:
 --   l - last hit
 --   b - current burst
 --   dr - current dynamic rate multiplier (*10000)
 --   db - current dynamic burst multiplier (*10000)
 local bucket_check_script = [[
-  local last = redis.call('HGET', KEYS[1], 'l')
-  local now = tonumber(KEYS[2])
-  local dynr, dynb, leaked = 0, 0, 0
-  if not last then
-    -- New bucket
-    redis.call('HSET', KEYS[1], 'l', KEYS[2])
-    redis.call('HSET', KEYS[1], 'b', '0')
-    redis.call('HSET', KEYS[1], 'dr', '10000')
-    redis.call('HSET', KEYS[1], 'db', '10000')
-    redis.call('EXPIRE', KEYS[1], KEYS[5])
-    return {0, '0', '1', '1', '0'}
-  end
-
-  last = tonumber(last)
-  local burst = tonumber(redis.call('HGET', KEYS[1], 'b'))
-  -- Perform leak
-  if burst > 0 then
-   if last < tonumber(KEYS[2]) then
-    local rate = tonumber(KEYS[3])
-    dynr = tonumber(redis.call('HGET', KEYS[1], 'dr')) / 10000.0
-    if dynr == 0 then dynr = 0.0001 end
-    rate = rate * dynr
-    leaked = ((now - last) * rate)
-    if leaked > burst then leaked = burst end
-    burst = burst - leaked
-    redis.call('HINCRBYFLOAT', KEYS[1], 'b', -(leaked))
-    redis.call('HSET', KEYS[1], 'l', KEYS[2])
-   end
-
-   dynb = tonumber(redis.call('HGET', KEYS[1], 'db')) / 10000.0
-   if dynb == 0 then dynb = 0.0001 end
-
-   if burst > 0 and (burst + tonumber(KEYS[6])) > tonumber(KEYS[4]) * dynb then
-     return {1, tostring(burst), tostring(dynr), tostring(dynb), tostring(leaked)}
-   end
-  else
-   burst = 0
-   redis.call('HSET', KEYS[1], 'b', '0')
+  local function check_bucket(key, now_str, rate, max_burst, expire, nrcpt)
+    local last = redis.call('HGET', key, 'l')
+    local now = tonumber(now_str)
+    local dynr, dynb, leaked = 0, 0, 0
+    if not last then
+      -- New bucket
+      redis.call('HSET', key, 'l', now_str)
+      redis.call('HSET', key, 'b', '0')
+      redis.call('HSET', key, 'dr', '10000')
+      redis.call('HSET', key, 'db', '10000')
+      redis.call('EXPIRE', key, expire)
+      return {0, '0', '1', '1', '0'}
+    end
+
+    last = tonumber(last)
+    local burst = tonumber(redis.call('HGET', key, 'b'))
+    -- Perform leak
+    if burst > 0 then
+     if last < now then
+      dynr = tonumber(redis.call('HGET', key, 'dr')) / 10000.0
+      if dynr == 0 then dynr = 0.0001 end
+      rate = rate * dynr
+      leaked = ((now - last) * rate)
+      if leaked > burst then leaked = burst end
+      burst = burst - leaked
+      redis.call('HINCRBYFLOAT', key, 'b', -(leaked))
+      redis.call('HSET', key, 'l', now_str)
+     end
+
+     dynb = tonumber(redis.call('HGET', key, 'db')) / 10000.0
+     if dynb == 0 then dynb = 0.0001 end
+
+     if burst > 0 and (burst + nrcpt) > max_burst * dynb then
+       return {1, tostring(burst), tostring(dynr), tostring(dynb), tostring(leaked)}
+     end
+    else
+     burst = 0
+     redis.call('HSET', key, 'b', '0')
+    end
+
+    return {0, tostring(burst), tostring(dynr), tostring(dynb), tostring(leaked)}
   end
 
-  return {0, tostring(burst), tostring(dynr), tostring(dynb), tostring(leaked)}
+  local res = {}
+  for i, key in ipairs(KEYS) do
+    res[i] = check_bucket(key, ARGV[1], tonumber(ARGV[3 * i]),
+        tonumber(ARGV[3 * i + 1]), ARGV[2], tonumber(ARGV[3 * i + 2]))
+  end
+
+  return res
 ]]
 local bucket_check_id
 
 
--- Updates a bucket
--- KEYS[1] - prefix to update, e.g. RL_<triplet>_<seconds>
--- KEYS[2] - current time in milliseconds
--- KEYS[3] - dynamic rate multiplier
--- KEYS[4] - dynamic burst multiplier
--- KEYS[5] - max dyn rate (min: 1/x)
--- KEYS[6] - max burst rate (min: 1/x)
--- KEYS[7] - expire for a bucket
--- KEYS[8] - number of recipients (or increase rate)
+-- Updates buckets
+-- KEYS[i] - prefix to update, e.g. RL_<triplet>_<seconds>
+-- ARGV[1] - current time in milliseconds
+-- ARGV[2] - max dyn rate (min: 1/x)
+-- ARGV[3] - max burst rate (min: 1/x)
+-- ARGV[4] - expire for a bucket
+-- ARGV[3 * i + 2], ARGV[3 * i + 3], ARGV[3 * i + 4] - dynamic rate multiplier,
+--   dynamic burst multiplier and number of recipients (or increase rate)
+--   of the bucket KEYS[i]
+-- returns an array with a reply per bucket
 -- Redis keys used:
 --   l - last hit
 --   b - current burst
 --   dr - current dynamic rate multiplier
 --   db - current dynamic burst multiplier
 local bucket_update_script = [[
-  local last = redis.call('HGET', KEYS[1], 'l')
-  local now = tonumber(KEYS[2])
-  if not last then
-    -- New bucket
-    redis.call('HSET', KEYS[1], 'l', KEYS[2])
-    redis.call('HSET', KEYS[1], 'b', '1')
-    redis.call('HSET', KEYS[1], 'dr', '10000')
-    redis.call('HSET', KEYS[1], 'db', '10000')
-    redis.call('EXPIRE', KEYS[1], KEYS[7])
-    return {1, 1, 1}
-  end
-
-  local dr, db = 1.0, 1.0
-
-  if tonumber(KEYS[5]) > 1 then
-    local rate_mult = tonumber(KEYS[3])
-    local rate_limit = tonumber(KEYS[5])
-    dr = tonumber(redis.call('HGET', KEYS[1], 'dr')) / 10000
-
-    if rate_mult > 1.0 and dr < rate_limit then
-      dr = dr * rate_mult
-      if dr > 0.0001 then
-        redis.call('HSET', KEYS[1], 'dr', tostring(math.floor(dr * 10000)))
-      else
-        redis.call('HSET', KEYS[1], 'dr', '1')
-      end
-    elseif rate_mult < 1.0 and dr > (1.0 / rate_limit) then
-      dr = dr * rate_mult
-      if dr > 0.0001 then
-        redis.call('HSET', KEYS[1], 'dr', tostring(math.floor(dr * 10000)))
+  local function update_mult(key, field, mult, limit)
+    local cur = tonumber(redis.call('HGET', key, field)) / 10000
+
+    if (mult > 1.0 and cur < limit) or (mult < 1.0 and cur > (1.0 / limit)) then
+      cur = cur * mult
+      if cur > 0.0001 then
+        redis.call('HSET', key, field, tostring(math.floor(cur * 10000)))
       else
-        redis.call('HSET', KEYS[1], 'dr', '1')
+        redis.call('HSET', key, field, '1')
       end
     end
+
+    return cur
   end
 
-  if tonumber(KEYS[6]) > 1 then
-    local rate_mult = tonumber(KEYS[4])
-    local rate_limit = tonumber(KEYS[6])
-    db = tonumber(redis.call('HGET', KEYS[1], 'db')) / 10000
+  local function update_bucket(key, now_str, rate_mult, burst_mult,
+                               rate_limit, burst_limit, expire, incr)
+    local last = redis.call('HGET', key, 'l')
+    if not last then
+      -- New bucket
+      redis.call('HSET', key, 'l', now_str)
+      redis.call('HSET', key, 'b', '1')
+      redis.call('HSET', key, 'dr', '10000')
+      redis.call('HSET', key, 'db', '10000')
+      redis.call('EXPIRE', key, expire)
+      return {1, 1, 1}
+    end
 
-    if rate_mult > 1.0 and db < rate_limit then
-      db = db * rate_mult
-      if db > 0.0001 then
-        redis.call('HSET', KEYS[1], 'db', tostring(math.floor(db * 10000)))
-      else
-        redis.call('HSET', KEYS[1], 'db', '1')
-      end
-    elseif rate_mult < 1.0 and db > (1.0 / rate_limit) then
-      db = db * rate_mult
-      if db > 0.0001 then
-        redis.call('HSET', KEYS[1], 'db', tostring(math.floor(db * 10000)))
-      else
-        redis.call('HSET', KEYS[1], 'db', '1')
-      end
+    local dr, db = 1.0, 1.0
+
+    if rate_limit > 1 then
+      dr = update_mult(key, 'dr', rate_mult, rate_limit)
+    end
+
+    if burst_limit > 1 then
+      db = update_mult(key, 'db', burst_mult, burst_limit)
     end
-  end
 
-  local burst = tonumber(redis.call('HGET', KEYS[1], 'b'))
-  if burst < 0 then burst = 0 end
+    local burst = tonumber(redis.call('HGET', key, 'b'))
+    if burst < 0 then burst = 0 end
 
-  redis.call('HINCRBYFLOAT', KEYS[1], 'b', tonumber(KEYS[8]))
-  redis.call('HSET', KEYS[1], 'l', KEYS[2])
-  redis.call('EXPIRE', KEYS[1], KEYS[7])
+    redis.call('HINCRBYFLOAT', key, 'b', incr)
+    redis.call('HSET', key, 'l', now_str)
+    redis.call('EXPIRE', key, expire)
 
-  return {tostring(burst), tostring(dr), tostring(db)}
+    return {tostring(burst), tostring(dr), tostring(db)}
+  end
+
+  local res = {}
+  local rate_limit, burst_limit = tonumber(ARGV[2]), tonumber(ARGV[3])
+  for i, key in ipairs(KEYS) do
+    res[i] = update_bucket(key, ARGV[1], tonumber(ARGV[3 * i + 2]),
+        tonumber(ARGV[3 * i + 3]), rate_limit, burst_limit, ARGV[4],
+        tonumber(ARGV[3 * i + 4]))
+  end
+
+  return res
 ]]
 local bucket_update_id
 
@@ -203,6 +204,26 @@ local message_func = function(_, limit_type, _, _, _)
 end
 
 
+-- Groups prefixes by Redis servers, so buckets stored on the same server
+-- are checked or updated by a single script call
+local function group_prefixes(prefixes)
+  local groups = {}
+
+  for pr,value in pairs(prefixes) do
+    local shard = lua_redis.shard_key(redis_params, value.hash, true) or value.hash
+    local group = groups[shard]
+
+    if not group then
+      group = {}
+      groups[shard] = group
+    end
+
+    table.insert(group, {prefix = pr, value = value})
+  end
+
+  return groups
+end
+
 local function load_scripts(cfg, ev_base)
   bucket_check_id = lua_redis.add_redis_script(bucket_check_script, redis_params)
   bucket_update_id = lua_redis.add_redis_script(bucket_update_script, redis_params)
@@ -637,21 +658,41 @@ local function ratelimit_cb(task)
     task:cache_set('ratelimit_prefixes', prefixes)
     local now = rspamd_util.get_time()
     now = lua_util.round(now * 1000.0) -- Get milliseconds
-    -- Now call check script for all defined prefixes
-
-    for pr,value in pairs(prefixes) do
-      local bucket = value.bucket
-      local rate = (bucket.rate) / 1000.0 -- Leak rate in messages/ms
-      local bincr = nrcpt
-      if bucket.skip_recipients then bincr = 1 end
+    -- Now call check script once per server for all defined prefixes
+
+    for _,group in pairs(group_prefixes(prefixes)) do
+      local keys = {}
+      local args = {tostring(now), tostring(settings.expire)}
+      local cbs = {}
+
+      for _,elt in ipairs(group) do
+        local pr, value = elt.prefix, elt.value
+        local bucket = value.bucket
+        local rate = (bucket.rate) / 1000.0 -- Leak rate in messages/ms
+        local bincr = nrcpt
+        if bucket.skip_recipients then bincr = 1 end
+
+        lua_util.debugm(N, task, "check limit %s:%s -> %s (%s/%s)",
+            value.name, pr, value.hash, bucket.burst, bucket.rate)
+        table.insert(keys, value.hash)
+        table.insert(args, tostring(rate))
+        table.insert(args, tostring(bucket.burst))
+        table.insert(args, tostring(bincr))
+        table.insert(cbs, gen_check_cb(pr, bucket, value.name, value.hash))
+      end
 
-      lua_util.debugm(N, task, "check limit %s:%s -> %s (%s/%s)",
-          value.name, pr, value.hash, bucket.burst, bucket.rate)
       lua_redis.exec_redis_script(bucket_check_id,
-          {key = value.hash, task = task, is_write = true},
-          gen_check_cb(pr, bucket, value.name, value.hash),
-          {value.hash, tostring(now), tostring(rate), tostring(bucket.burst),
-           tostring(settings.expire), tostring(bincr)})
+          {key = keys[1], task = task, is_write = true},
+          function(err, data)
+            for i,cb in ipairs(cbs) do
+              if err then
+                cb(err, data)
+              else
+                cb(nil, type(data) == 'table' and data[i] or nil)
+              end
+            end
+          end,
+          keys, args)
     end
   end
 end
@@ -674,43 +715,58 @@ local function ratelimit_update_cb(task)
       nrcpt = 1
     end
 
-    -- Update each bucket
-    for k, v in pairs(prefixes) do
-      local bucket = v.bucket
-      local function update_bucket_cb(err, data)
-        if err then
-          rspamd_logger.errx(task, 'cannot update rate bucket %s: %s',
-              k, err)
-        else
-          lua_util.debugm(N, task,
-              "updated limit %s:%s -> %s (%s/%s), burst: %s, dyn_rate: %s, dyn_burst: %s",
-              v.name, k, v.hash,
-              bucket.burst, bucket.rate,
-              data[1], data[2], data[3])
+    local now = rspamd_util.get_time()
+    now = lua_util.round(now * 1000.0) -- Get milliseconds
+
+    -- Update all buckets of a server at once
+    for _,group in pairs(group_prefixes(prefixes)) do
+      local keys = {}
+      local args = {tostring(now), tostring(settings.max_rate_mult),
+                    tostring(settings.max_bucket_mult), tostring(settings.expire)}
+
+      for _,elt in ipairs(group) do
+        local bucket = elt.value.bucket
+        local mult_burst = 1.0
+        local mult_rate = 1.0
+
+        if verdict == 'spam' or verdict == 'junk' then
+          mult_burst = bucket.spam_factor_burst or 1.0
+          mult_rate = bucket.spam_factor_rate or 1.0
+        elseif verdict == 'ham' then
+          mult_burst = bucket.ham_factor_burst or 1.0
+          mult_rate = bucket.ham_factor_rate or 1.0
         end
-      end
-      local now = rspamd_util.get_time()
-      now = lua_util.round(now * 1000.0) -- Get milliseconds
-      local mult_burst = 1.0
-      local mult_rate = 1.0
-
-      if verdict == 'spam' or verdict == 'junk' then
-        mult_burst = bucket.spam_factor_burst or 1.0
-        mult_rate = bucket.spam_factor_rate or 1.0
-      elseif verdict == 'ham' then
-        mult_burst = bucket.ham_factor_burst or 1.0
-        mult_rate = bucket.ham_factor_rate or 1.0
+
+        local bincr = nrcpt
+        if bucket.skip_recipients then bincr = 1 end
+
+        table.insert(keys, elt.value.hash)
+        table.insert(args, tostring(mult_rate))
+        table.insert(args, tostring(mult_burst))
+        table.insert(args, tostring(bincr))
       end
 
-      local bincr = nrcpt
-      if bucket.skip_recipients then bincr = 1 end
+      local function update_buckets_cb(err, data)
+        for i,elt in ipairs(group) do
+          local k, v = elt.prefix, elt.value
+
+          if err then
+            rspamd_logger.errx(task, 'cannot update rate bucket %s: %s',
+                k, err)
+          elseif type(data) == 'table' and type(data[i]) == 'table' then
+            lua_util.debugm(N, task,
+                "updated limit %s:%s -> %s (%s/%s), burst: %s, dyn_rate: %s, dyn_burst: %s",
+                v.name, k, v.hash,
+                v.bucket.burst, v.bucket.rate,
+                data[i][1], data[i][2], data[i][3])
+          end
+        end
+      end
 
       lua_redis.exec_redis_script(bucket_update_id,
-          {key = v.hash, task = task, is_write = true},
-          update_bucket_cb,
-          {v.hash, tostring(now), tostring(mult_rate), tostring(mult_burst),
-           tostring(settings.max_rate_mult), tostring(settings.max_bucket_mult),
-           tostring(settings.expire), tostring(bincr)})
+          {key = keys[1], task = task, is_write = true},
+          update_buckets_cb,
+          keys, args)
     end
   end
 end
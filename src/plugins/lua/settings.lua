@@ -39,6 +39,10 @@ local N = "settings"
 local settings_initialized = false
 local max_pri = 0
 local module_sym_id -- Main module symbol
+-- Candidate rules by plain conditions values, indexed by priority like `settings`
+local settings_index = {}
+-- Masks used by indexed ip conditions
+local index_ip_masks = {}
 
 local function apply_settings(task, to_apply, id)
   task:set_settings(to_apply)
@@ -268,6 +272,154 @@ local function priority_to_string(pri)
   return "low"
 end
 
+local function get_task_user(task)
+  local uname = task:get_user()
+  local user = {}
+  if uname then
+    user[1] = {}
+    local localpart, domainpart = string.gmatch(uname, "(.+)@(.+)")()
+    if localpart then
+      user[1]["user"] = localpart
+      user[1]["domain"] = domainpart
+      user[1]["addr"] = uname
+    else
+      user[1]["user"] = uname
+      user[1]["addr"] = uname
+    end
+
+    return user
+  end
+
+  return nil
+end
+
+-- Each check that could be indexed has its kind and function to extract
+-- task values, checks are tried in this order when a rule is indexed
+local index_checks = {
+  {'rcpt', 'addr', function(task) return task:get_recipients(1) end},
+  {'from', 'addr', function(task) return task:get_from(1) end},
+  {'rcpt_mime', 'addr', function(task) return task:get_recipients(2) end},
+  {'from_mime', 'addr', function(task) return task:get_from(2) end},
+  {'user', 'addr', get_task_user},
+  {'ip', 'ip', function(task) return task:get_from_ip() end},
+  {'client_ip', 'ip', function(task) return task:get_client_ip() end},
+  {'hostname', 'string', function(task) return task:get_hostname() or '' end},
+}
+
+local addr_index_fields = {name = 'addr', user = 'user', domain = 'domain'}
+
+-- Returns keys of a rule for the index if all conditions of some check are
+-- plain values: a rule with implicit `&&` expression cannot match without
+-- one of these keys matched
+local function get_rule_index_keys(conditions)
+  for _,ic in ipairs(index_checks) do
+    local what, kind = ic[1], ic[2]
+    local expected = conditions[what]
+
+    if expected and #expected > 0 then
+      local keys, masks = {}, {}
+
+      for _,cond in ipairs(expected) do
+        local nkeys = #keys
+
+        if kind == 'addr' and not cond.regexp then
+          for field in pairs(addr_index_fields) do
+            if type(cond[field]) == 'string' then
+              table.insert(keys, string.format('%s:%s:%s', what, field, cond[field]))
+            end
+          end
+        elseif kind == 'ip' and cond[1] and type(cond[2]) == 'number' then
+          table.insert(keys, string.format('%s:%d:%s', what, cond[2], cond[1]:to_string()))
+          masks[cond[2]] = true
+        elseif kind == 'string' and cond.check and not cond.regexp then
+          table.insert(keys, string.format('%s:check:%s', what, cond.check))
+        end
+
+        if #keys == nkeys then
+          -- Not a plain condition
+          keys = nil
+          break
+        end
+      end
+
+      if keys then
+        return {what = what, keys = keys, masks = masks}
+      end
+    end
+  end
+
+  return nil
+end
+
+-- Writes keys of task values for a check to `out`, that is the same as
+-- matching of the plain conditions
+local function get_task_index_keys(task, ic, out)
+  local what, kind = ic[1], ic[2]
+  local input = ic[3](task)
+
+  if not input then return end
+
+  if kind == 'addr' then
+    for _,e in ipairs(input) do
+      for field,afield in pairs(addr_index_fields) do
+        if type(e[afield]) == 'string' then
+          out[string.format('%s:%s:%s', what, field, e[afield]:lower())] = true
+        end
+      end
+    end
+  elseif kind == 'ip' then
+    if input:is_valid() then
+      for mask in pairs(index_ip_masks[what] or {}) do
+        local nip = input
+        if mask ~= 0 then nip = input:apply_mask(mask) end
+        if nip then
+          out[string.format('%s:%d:%s', what, mask, nip:to_string())] = true
+        end
+      end
+    end
+  else
+    out[string.format('%s:check:%s', what, input:lower())] = true
+  end
+end
+
+-- Returns rules of a priority that could match a task in their order
+local function get_settings_candidates(task, pri, task_keys)
+  local rules = settings[pri]
+  local idx = settings_index[pri]
+
+  if not idx or #idx.always == #rules then
+    return rules
+  end
+
+  local found, seen = {}, {}
+
+  for _,i in ipairs(idx.always) do
+    found[#found + 1] = i
+  end
+
+  for _,ic in ipairs(index_checks) do
+    if idx.checks[ic[1]] then
+      if not task_keys[ic[1]] then
+        task_keys[ic[1]] = {}
+        get_task_index_keys(task, ic, task_keys[ic[1]])
+      end
+
+      for k in pairs(task_keys[ic[1]]) do
+        for _,i in ipairs(idx.keys[k] or {}) do
+          if not seen[i] then
+            seen[i] = true
+            found[#found + 1] = i
+          end
+        end
+      end
+    end
+  end
+
+  table.sort(found)
+
+  return fun.totable(fun.map(function(i) return rules[i] end, found))
+end
+
 -- Check limit for a task
 local function check_settings(task)
   local function check_specific_setting(rule, matched)
@@ -344,10 +496,11 @@ local function check_settings(task)
 
   -- Match rules according their order
   local applied = false
+  local task_keys = {}
 
   for pri = max_pri,min_pri,-1 do
     if not applied and settings[pri] then
-      for _,s in ipairs(settings[pri]) do
+      for _,s in ipairs(get_settings_candidates(task, pri, task_keys)) do
         local matched = {}
 
         lua_util.debugm(N, task, "check for settings element %s",
@@ -596,14 +749,17 @@ local function process_settings_table(tbl, allow_ids, is_static)
     local out = {}
 
     local checks = {}
+    -- Expected values of checks that could be indexed
+    local index_conds = {}
     if elt.ip then
       local ips_table = process_ip_condition(elt['ip'])
 
       if ips_table then
         lua_util.debugm(N, rspamd_config, 'added ip condition to "%s": %s',
             name, ips_table)
+        index_conds.ip = convert_to_table(elt.ip, ips_table)
         checks.ip = {
-          check = gen_check_closure(convert_to_table(elt.ip, ips_table), check_ip_setting),
+          check = gen_check_closure(index_conds.ip, check_ip_setting),
           extract = function(task)
             local ip = task:get_from_ip()
             if ip and ip:is_valid() then return ip end
@@ -636,9 +792,9 @@ local function process_settings_table(tbl, allow_ids, is_static)
       if client_ips_table then
         lua_util.debugm(N, rspamd_config, 'added client_ip condition to "%s": %s',
             name, client_ips_table)
+        index_conds.client_ip = convert_to_table(elt.client_ip, client_ips_table)
         checks.client_ip = {
-          check = gen_check_closure(convert_to_table(elt.client_ip, client_ips_table),
-              check_ip_setting),
+          check = gen_check_closure(index_conds.client_ip, check_ip_setting),
           extract = function(task)
             local ip = task:get_client_ip()
             if ip:is_valid() then return ip end
@@ -671,9 +827,9 @@ local function process_settings_table(tbl, allow_ids, is_static)
       if from_condition then
         lua_util.debugm(N, rspamd_config, 'added from condition to "%s": %s',
             name, from_condition)
+        index_conds.from = convert_to_table(elt.from, from_condition)
         checks.from = {
-          check = gen_check_closure(convert_to_table(elt.from, from_condition),
-              check_addr_setting),
+          check = gen_check_closure(index_conds.from, check_addr_setting),
           extract = function(task)
             return task:get_from(1)
           end,
@@ -686,9 +842,9 @@ local function process_settings_table(tbl, allow_ids, is_static)
       if rcpt_condition then
         lua_util.debugm(N, rspamd_config, 'added rcpt condition to "%s": %s',
             name, rcpt_condition)
+        index_conds.rcpt = convert_to_table(elt.rcpt, rcpt_condition)
         checks.rcpt = {
-          check = gen_check_closure(convert_to_table(elt.rcpt, rcpt_condition),
-              check_addr_setting),
+          check = gen_check_closure(index_conds.rcpt, check_addr_setting),
           extract = function(task)
             return task:get_recipients(1)
           end,
@@ -702,9 +858,9 @@ local function process_settings_table(tbl, allow_ids, is_static)
       if from_mime_condition then
         lua_util.debugm(N, rspamd_config, 'added from_mime condition to "%s": %s',
             name, from_mime_condition)
+        index_conds.from_mime = convert_to_table(elt.from_mime, from_mime_condition)
         checks.from_mime = {
-          check = gen_check_closure(convert_to_table(elt.from_mime, from_mime_condition),
-              check_addr_setting),
+          check = gen_check_closure(index_conds.from_mime, check_addr_setting),
           extract = function(task)
             return task:get_from(2)
           end,
@@ -717,9 +873,9 @@ local function process_settings_table(tbl, allow_ids, is_static)
       if rcpt_mime_condition then
         lua_util.debugm(N, rspamd_config, 'added rcpt mime condition to "%s": %s',
             name, rcpt_mime_condition)
+        index_conds.rcpt_mime = convert_to_table(elt.rcpt_mime, rcpt_mime_condition)
         checks.rcpt_mime = {
-          check = gen_check_closure(convert_to_table(elt.rcpt_mime, rcpt_mime_condition),
-              check_addr_setting),
+          check = gen_check_closure(index_conds.rcpt_mime, check_addr_setting),
           extract = function(task)
             return task:get_recipients(2)
           end,
@@ -732,29 +888,10 @@ local function process_settings_table(tbl, allow_ids, is_static)
       if user_condition then
         lua_util.debugm(N, rspamd_config, 'added user condition to "%s": %s',
             name, user_condition)
+        index_conds.user = convert_to_table(elt.user, user_condition)
         checks.user = {
-          check = gen_check_closure(convert_to_table(elt.user, user_condition),
-              check_addr_setting),
-          extract = function(task)
-            local uname = task:get_user()
-            local user = {}
-            if uname then
-              user[1] = {}
-              local localpart, domainpart = string.gmatch(uname, "(.+)@(.+)")()
-              if localpart then
-                user[1]["user"] = localpart
-                user[1]["domain"] = domainpart
-                user[1]["addr"] = uname
-              else
-                user[1]["user"] = uname
-                user[1]["addr"] = uname
-              end
-
-              return user
-            end
-
-            return nil
-          end,
+          check = gen_check_closure(index_conds.user, check_addr_setting),
+          extract = get_task_user,
         }
       end
     end
@@ -764,9 +901,9 @@ local function process_settings_table(tbl, allow_ids, is_static)
       if hostname_condition then
         lua_util.debugm(N, rspamd_config, 'added hostname condition to "%s": %s',
             name, hostname_condition)
+        index_conds.hostname = convert_to_table(elt.hostname, hostname_condition)
         checks.hostname = {
-          check = gen_check_closure(convert_to_table(elt.hostname, hostname_condition),
-              check_string_setting),
+          check = gen_check_closure(index_conds.hostname, check_string_setting),
           extract = function(task)
             return task:get_hostname() or ''
           end,
@@ -933,6 +1070,7 @@ local function process_settings_table(tbl, allow_ids, is_static)
     for _,_ in pairs(checks) do nchecks = nchecks + 1 end
 
     if nchecks > 0 then
+      local implicit_expression = not elt.expression and not inverse
       -- Now we can deal with the expression!
       if not elt.expression then
         -- Artificial & expression to deal with the legacy parts
@@ -983,6 +1121,10 @@ local function process_settings_table(tbl, allow_ids, is_static)
         rspamd_logger.errx(rspamd_config, 'cannot parse expression %s for %s',
             elt.expression, name)
       else
+        if implicit_expression then
+          out.index = get_rule_index_keys(index_conds)
+        end
+
         lua_util.debugm(N, rspamd_config, 'registered settings %s with %s checks',
             name, nchecks)
       end
@@ -1068,6 +1210,8 @@ local function process_settings_table(tbl, allow_ids, is_static)
   max_pri = 0
   local nrules = 0
   for k in pairs(settings) do settings[k]={} end
+  settings_index = {}
+  index_ip_masks = {}
   -- fill new settings by priority
   fun.for_each(function(k, v)
     local pri = get_priority(v)
@@ -1086,6 +1230,37 @@ local function process_settings_table(tbl, allow_ids, is_static)
     table.sort(settings[pri], function(a,b) return a.name < b.name end)
   end
 
+  -- build index of rules with plain conditions
+  for pri,rules in pairs(settings) do
+    local idx = {always = {}, keys = {}, checks = {}}
+    local nindexed = 0
+
+    for i,s in ipairs(rules) do
+      local ri = s.rule.index
+
+      if ri then
+        for _,k in ipairs(ri.keys) do
+          if not idx.keys[k] then idx.keys[k] = {} end
+          table.insert(idx.keys[k], i)
+        end
+
+        for mask in pairs(ri.masks) do
+          if not index_ip_masks[ri.what] then index_ip_masks[ri.what] = {} end
+          index_ip_masks[ri.what][mask] = true
+        end
+
+        idx.checks[ri.what] = true
+        nindexed = nindexed + 1
+      else
+        table.insert(idx.always, i)
+      end
+    end
+
+    settings_index[pri] = idx
+    lua_util.debugm(N, rspamd_config, 'indexed %s of %s settings with priority %s',
+        nindexed, #rules, pri)
+  end
+
   settings_initialized = true
   lua_settings.load_all_settings(true)
   rspamd_logger.infox(rspamd_config, 'loaded %1 elements of settings', nrules)
@@ -305,12 +305,34 @@ local function url_redirector_process_url(task, url)
 end
 
 local function url_redirector_handler(task)
+  -- Check hosts of all urls using a single map call
+  local hosts, redirectors = {}, {}
+  for _,u in ipairs(task:get_urls() or {}) do
+    local host = u:get_host()
+    if host and redirectors[host] == nil then
+      redirectors[host] = false
+      hosts[#hosts + 1] = host
+    end
+  end
+
+  if #hosts > 0 then
+    local res = settings.redirector_hosts_map:get_keys_batch(hosts)
+    for i,host in ipairs(hosts) do
+      redirectors[host] = res[i] and true or false
+    end
+  end
+
   local sp_urls = lua_util.extract_specific_urls({
     task = task,
     limit = settings.max_urls,
     filter = function(url)
       local host = url:get_host()
-      if settings.redirector_hosts_map:get_key(host) then
+      local is_redirector = redirectors[host]
+      if is_redirector == nil and host then
+        -- Not in the list checked above
+        is_redirector = settings.redirector_hosts_map:get_key(host)
+      end
+      if is_redirector then
         lua_util.debugm(N, task, 'check url %s', tostring(url))
         return true
       end
@@ -341,7 +363,7 @@ if opts then
     else
       local lua_maps = require "lua_maps"
       settings.redirector_hosts_map = lua_maps.map_add_from_ucl(settings.redirector_hosts_map,
-          'set', 'Redirectors definitions')
+          'domain_suffix', 'Redirectors definitions')
 
       lua_redis.register_prefix(settings.key_prefix .. '[a-z0-9]{32}', N,
           'URL redirector hashes', {
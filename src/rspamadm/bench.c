@@ -0,0 +1,769 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "libutil/util.h"
+#include "libserver/http/http_connection.h"
+#include "client/rspamdclient.h"
+#include "contrib/libev/ev.h"
+#include "unix-std.h"
+#include <math.h>
+
+#define DEFAULT_PORT 11333
+
+static gchar *connect_str = "localhost";
+static gchar *command = "checkv2";
+static gchar *key = NULL;
+static gint concurrency = 16;
+static gint nrequests = 0;
+static gdouble rate = 0.0;
+static gdouble duration = 0.0;
+static gdouble timeout = 10.0;
+static gboolean profile = FALSE;
+static gboolean json = FALSE;
+
+static void rspamadm_bench (gint argc, gchar **argv,
+							const struct rspamadm_command *cmd);
+static const char *rspamadm_bench_help (gboolean full_help,
+										const struct rspamadm_command *cmd);
+
+struct rspamadm_command bench_command = {
+		.name = "bench",
+		.flags = 0,
+		.help = rspamadm_bench_help,
+		.run = rspamadm_bench,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"connect", 'h', 0, G_OPTION_ARG_STRING, &connect_str,
+				"Connect to the specified host (localhost:11333 by default)", NULL},
+		{"concurrency", 'c', 0, G_OPTION_ARG_INT, &concurrency,
+				"Maximum number of requests in flight (16 by default)", NULL},
+		{"rate", 'r', 0, G_OPTION_ARG_DOUBLE, &rate,
+				"Target rate of requests per second (as fast as possible by default)",
+				NULL},
+		{"requests", 'n', 0, G_OPTION_ARG_INT, &nrequests,
+				"Number of requests to send (corpus size by default)", NULL},
+		{"duration", 'd', 0, G_OPTION_ARG_DOUBLE, &duration,
+				"Send requests for the specified number of seconds", NULL},
+		{"timeout", 't', 0, G_OPTION_ARG_DOUBLE, &timeout,
+				"Time in seconds to wait for a reply (10 by default)", NULL},
+		{"command", 'm', 0, G_OPTION_ARG_STRING, &command,
+				"Command to send (checkv2 by default)", NULL},
+		{"key", 'k', 0, G_OPTION_ARG_STRING, &key,
+				"Use encryption with the specified public key", NULL},
+		{"profile", 'p', 0, G_OPTION_ARG_NONE, &profile,
+				"Collect server side symbols timings", NULL},
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Output json", NULL},
+		{NULL,      0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct rspamadm_bench_symbol {
+	gdouble total;
+	guint count;
+};
+
+struct rspamadm_bench_ctx {
+	struct ev_loop *event_loop;
+	GPtrArray *files;
+	GQueue *attrs;
+	gchar *host;
+	guint16 port;
+	/* Requests that are due but wait for a free slot */
+	GQueue backlog;
+	ev_timer schedule_ev;
+	gdouble start;
+	gdouble last_finish;
+	guint scheduled;
+	guint inflight;
+	guint finished;
+	guint errors;
+	guint next_file;
+	gboolean limit_reached;
+	/* Latencies from the intended send time */
+	GArray *latencies;
+	/* Latencies from the actual send time */
+	GArray *service;
+	/* Scan time reported by server */
+	GArray *server;
+	GHashTable *errors_by_msg;
+	GHashTable *symbols;
+};
+
+struct rspamadm_bench_request {
+	struct rspamadm_bench_ctx *ctx;
+	gdouble intended;
+	gdouble sent;
+};
+
+static const char *
+rspamadm_bench_help (gboolean full_help, const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Replay a corpus of messages against rspamd and measure latencies\n\n"
+				"Usage: rspamadm bench [-h host] [-c concurrency] [-r rate] "
+				"[-n requests|-d duration] <file|dir> ...\n"
+				"Where options are:\n\n"
+				"-h: connect to the specified host (localhost:11333 by default)\n"
+				"-c: maximum number of requests in flight (16 by default)\n"
+				"-r: target rate of requests per second, when set latencies are\n"
+				"    counted from the time a request was due to be sent, so a server\n"
+				"    that cannot keep up gets its queueing time accounted\n"
+				"-n: number of requests to send (corpus size by default)\n"
+				"-d: send requests for the specified number of seconds\n"
+				"-t: time in seconds to wait for a reply (10 by default)\n"
+				"-m: command to send (checkv2 by default)\n"
+				"-k: use encryption with the specified public key\n"
+				"-p: collect server side symbols timings\n"
+				"-j: output json\n"
+				"--help: shows available options and commands\n";
+	}
+	else {
+		help_str = "Replay a corpus of messages and measure latencies";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_bench_add_path (GPtrArray *files, const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *full;
+
+	if (g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		dir = g_dir_open (path, 0, NULL);
+
+		if (dir == NULL) {
+			rspamd_fprintf (stderr, "cannot open directory %s: %s\n", path,
+					strerror (errno));
+			return;
+		}
+
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			full = g_build_filename (path, name, NULL);
+			rspamadm_bench_add_path (files, full);
+			g_free (full);
+		}
+
+		g_dir_close (dir);
+	}
+	else if (g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+		g_ptr_array_add (files, g_strdup (path));
+	}
+}
+
+static void
+rspamadm_bench_parse_host (struct rspamadm_bench_ctx *ctx)
+{
+	gchar *p;
+
+	if (connect_str[0] == '[') {
+		p = strrchr (connect_str, ']');
+
+		if (p != NULL) {
+			ctx->host = g_malloc (p - connect_str);
+			rspamd_strlcpy (ctx->host, connect_str + 1, p - connect_str);
+			p ++;
+		}
+		else {
+			p = connect_str;
+		}
+	}
+	else {
+		p = connect_str;
+	}
+
+	p = strrchr (p, ':');
+
+	if (!ctx->host) {
+		if (p != NULL) {
+			ctx->host = g_malloc (p - connect_str + 1);
+			rspamd_strlcpy (ctx->host, connect_str, p - connect_str + 1);
+		}
+		else {
+			ctx->host = g_strdup (connect_str);
+		}
+	}
+
+	ctx->port = p != NULL ? strtoul (p + 1, NULL, 10) : DEFAULT_PORT;
+}
+
+static gboolean
+rspamadm_bench_is_done (struct rspamadm_bench_ctx *ctx)
+{
+	return ctx->limit_reached && ctx->inflight == 0 &&
+			g_queue_is_empty (&ctx->backlog);
+}
+
+static void rspamadm_bench_dispatch (struct rspamadm_bench_ctx *ctx);
+
+static void
+rspamadm_bench_error (struct rspamadm_bench_ctx *ctx, const gchar *msg)
+{
+	gpointer pcnt;
+
+	ctx->errors ++;
+	pcnt = g_hash_table_lookup (ctx->errors_by_msg, msg);
+
+	if (pcnt == NULL) {
+		g_hash_table_insert (ctx->errors_by_msg, g_strdup (msg),
+				GUINT_TO_POINTER (1));
+	}
+	else {
+		g_hash_table_insert (ctx->errors_by_msg, g_strdup (msg),
+				GUINT_TO_POINTER (GPOINTER_TO_UINT (pcnt) + 1));
+	}
+}
+
+static void
+rspamadm_bench_profile (struct rspamadm_bench_ctx *ctx,
+		const ucl_object_t *prof)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+	struct rspamadm_bench_symbol *sym;
+
+	while ((cur = ucl_object_iterate (prof, &it, true)) != NULL) {
+		sym = g_hash_table_lookup (ctx->symbols, ucl_object_key (cur));
+
+		if (sym == NULL) {
+			sym = g_malloc0 (sizeof (*sym));
+			g_hash_table_insert (ctx->symbols, g_strdup (ucl_object_key (cur)),
+					sym);
+		}
+
+		sym->total += ucl_object_todouble (cur);
+		sym->count ++;
+	}
+}
+
+static void
+rspamadm_bench_client_cb (struct rspamd_client_connection *conn,
+		struct rspamd_http_message *msg,
+		const gchar *name, ucl_object_t *result, GString *input,
+		gpointer ud, gdouble start_time, gdouble send_time,
+		const gchar *body, gsize bodylen,
+		GError *err)
+{
+	struct rspamadm_bench_request *req = (struct rspamadm_bench_request *)ud;
+	struct rspamadm_bench_ctx *ctx = req->ctx;
+	const ucl_object_t *elt;
+	gdouble now = rspamd_get_ticks (FALSE), val;
+
+	ctx->inflight --;
+	ctx->finished ++;
+	ctx->last_finish = now;
+
+	if (err != NULL) {
+		rspamadm_bench_error (ctx, err->message);
+	}
+	else {
+		val = now - req->intended;
+		g_array_append_val (ctx->latencies, val);
+		val = now - req->sent;
+		g_array_append_val (ctx->service, val);
+
+		if (result) {
+			elt = ucl_object_lookup (result, "time_real");
+
+			if (elt) {
+				val = ucl_object_todouble (elt);
+				g_array_append_val (ctx->server, val);
+			}
+
+			elt = ucl_object_lookup (result, "profile");
+
+			if (elt) {
+				rspamadm_bench_profile (ctx, elt);
+			}
+		}
+	}
+
+	if (result) {
+		ucl_object_unref (result);
+	}
+
+	rspamd_client_destroy (conn);
+	g_free (req);
+
+	rspamadm_bench_dispatch (ctx);
+
+	if (rspamadm_bench_is_done (ctx)) {
+		ev_break (ctx->event_loop, EVBREAK_ALL);
+	}
+}
+
+static void
+rspamadm_bench_send (struct rspamadm_bench_ctx *ctx, gdouble intended)
+{
+	struct rspamd_client_connection *conn;
+	struct rspamadm_bench_request *req;
+	const gchar *fname;
+	GError *err = NULL;
+	FILE *in;
+
+	fname = g_ptr_array_index (ctx->files, ctx->next_file);
+	ctx->next_file = (ctx->next_file + 1) % ctx->files->len;
+
+	req = g_malloc0 (sizeof (*req));
+	req->ctx = ctx;
+	req->intended = intended;
+	req->sent = rspamd_get_ticks (FALSE);
+
+	in = fopen (fname, "r");
+
+	if (in == NULL) {
+		rspamadm_bench_error (ctx, strerror (errno));
+		ctx->finished ++;
+		g_free (req);
+
+		return;
+	}
+
+	conn = rspamd_client_init (rspamd_main->http_ctx, ctx->event_loop,
+			ctx->host, ctx->port, timeout, key);
+
+	if (conn == NULL) {
+		rspamadm_bench_error (ctx, "cannot connect");
+		ctx->finished ++;
+		g_free (req);
+		fclose (in);
+
+		return;
+	}
+
+	ctx->inflight ++;
+
+	if (!rspamd_client_command (conn, command, ctx->attrs, in,
+			rspamadm_bench_client_cb, req, FALSE, NULL, fname, &err)) {
+		ctx->inflight --;
+		ctx->finished ++;
+		rspamadm_bench_error (ctx, err ? err->message : "cannot send request");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		rspamd_client_destroy (conn);
+		g_free (req);
+	}
+
+	fclose (in);
+}
+
+static void
+rspamadm_bench_dispatch (struct rspamadm_bench_ctx *ctx)
+{
+	gdouble *pintended;
+
+	if (rate > 0) {
+		while (ctx->inflight < (guint)concurrency &&
+				!g_queue_is_empty (&ctx->backlog)) {
+			pintended = g_queue_pop_head (&ctx->backlog);
+			rspamadm_bench_send (ctx, *pintended);
+			g_free (pintended);
+		}
+	}
+	else {
+		/* Closed loop: send a new request once a slot is free */
+		while (ctx->inflight < (guint)concurrency && !ctx->limit_reached) {
+			ctx->scheduled ++;
+			rspamadm_bench_send (ctx, rspamd_get_ticks (FALSE));
+
+			if ((nrequests > 0 && ctx->scheduled >= (guint)nrequests) ||
+					(duration > 0 &&
+					rspamd_get_ticks (FALSE) - ctx->start >= duration)) {
+				ctx->limit_reached = TRUE;
+			}
+		}
+	}
+}
+
+static void
+rspamadm_bench_schedule_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamadm_bench_ctx *ctx = (struct rspamadm_bench_ctx *)w->data;
+	gdouble now = rspamd_get_ticks (FALSE), *pintended;
+	guint64 due;
+
+	/* Requests are due at fixed times regardless of how server responds */
+	due = (now - ctx->start) * rate + 1;
+
+	if (duration > 0) {
+		due = MIN (due, (guint64)(duration * rate));
+	}
+
+	if (nrequests > 0) {
+		due = MIN (due, (guint64)nrequests);
+	}
+
+	while (ctx->scheduled < due) {
+		pintended = g_malloc (sizeof (*pintended));
+		*pintended = ctx->start + ctx->scheduled / rate;
+		g_queue_push_tail (&ctx->backlog, pintended);
+		ctx->scheduled ++;
+	}
+
+	if ((nrequests > 0 && ctx->scheduled >= (guint)nrequests) ||
+			(duration > 0 && now - ctx->start >= duration)) {
+		ctx->limit_reached = TRUE;
+		ev_timer_stop (EV_A_ w);
+	}
+
+	rspamadm_bench_dispatch (ctx);
+
+	if (rspamadm_bench_is_done (ctx)) {
+		ev_break (ctx->event_loop, EVBREAK_ALL);
+	}
+}
+
+static gint
+rspamadm_bench_double_cmp (gconstpointer a, gconstpointer b)
+{
+	gdouble da = *(const gdouble *)a, db = *(const gdouble *)b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static ucl_object_t *
+rspamadm_bench_distribution (GArray *ar)
+{
+	static const struct {
+		const gchar *name;
+		gdouble q;
+	} quantiles[] = {
+		{"p50", 0.5},
+		{"p90", 0.9},
+		{"p99", 0.99},
+		{"p999", 0.999},
+	};
+	ucl_object_t *top;
+	gdouble sum = 0;
+	guint i, idx;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	if (ar->len == 0) {
+		return top;
+	}
+
+	g_array_sort (ar, rspamadm_bench_double_cmp);
+
+	for (i = 0; i < ar->len; i ++) {
+		sum += g_array_index (ar, gdouble, i);
+	}
+
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (g_array_index (ar, gdouble, 0) * 1000.0),
+			"min", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (sum / ar->len * 1000.0),
+			"mean", 0, false);
+
+	for (i = 0; i < G_N_ELEMENTS (quantiles); i ++) {
+		idx = ceil (quantiles[i].q * ar->len);
+		idx = idx > 0 ? idx - 1 : 0;
+		ucl_object_insert_key (top,
+				ucl_object_fromdouble (g_array_index (ar, gdouble,
+						MIN (idx, ar->len - 1)) * 1000.0),
+				quantiles[i].name, 0, false);
+	}
+
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (g_array_index (ar, gdouble,
+					ar->len - 1) * 1000.0),
+			"max", 0, false);
+
+	return top;
+}
+
+static gint
+rspamadm_bench_symbol_cmp (gconstpointer a, gconstpointer b)
+{
+	const ucl_object_t *oa = *(const ucl_object_t **)a,
+			*ob = *(const ucl_object_t **)b;
+	gdouble da, db;
+
+	da = ucl_object_todouble (ucl_object_lookup (oa, "mean"));
+	db = ucl_object_todouble (ucl_object_lookup (ob, "mean"));
+
+	return da > db ? -1 : (da < db ? 1 : 0);
+}
+
+static ucl_object_t *
+rspamadm_bench_result (struct rspamadm_bench_ctx *ctx)
+{
+	ucl_object_t *top, *obj, *sym;
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamadm_bench_symbol *s;
+	GPtrArray *syms;
+	gdouble elapsed;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	elapsed = ctx->last_finish > ctx->start ? ctx->last_finish - ctx->start : 0;
+
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->finished),
+			"requests", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->errors),
+			"errors", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (elapsed),
+			"elapsed", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (elapsed > 0 ?
+					(ctx->finished - ctx->errors) / elapsed : 0),
+			"throughput", 0, false);
+	ucl_object_insert_key (top, rspamadm_bench_distribution (ctx->latencies),
+			"latency", 0, false);
+	ucl_object_insert_key (top, rspamadm_bench_distribution (ctx->service),
+			"service", 0, false);
+	ucl_object_insert_key (top, rspamadm_bench_distribution (ctx->server),
+			"server", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	g_hash_table_iter_init (&it, ctx->errors_by_msg);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ucl_object_insert_key (obj, ucl_object_fromint (GPOINTER_TO_UINT (v)),
+				(const gchar *)k, 0, true);
+	}
+
+	ucl_object_insert_key (top, obj, "errors_by_message", 0, false);
+
+	syms = g_ptr_array_new ();
+	g_hash_table_iter_init (&it, ctx->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		s = (struct rspamadm_bench_symbol *)v;
+		sym = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (sym, ucl_object_fromstring ((const gchar *)k),
+				"symbol", 0, false);
+		ucl_object_insert_key (sym, ucl_object_fromdouble (s->total / s->count),
+				"mean", 0, false);
+		ucl_object_insert_key (sym, ucl_object_fromdouble (s->total),
+				"total", 0, false);
+		ucl_object_insert_key (sym, ucl_object_fromint (s->count),
+				"count", 0, false);
+		g_ptr_array_add (syms, sym);
+	}
+
+	g_ptr_array_sort (syms, rspamadm_bench_symbol_cmp);
+	obj = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < syms->len; i ++) {
+		ucl_array_append (obj, g_ptr_array_index (syms, i));
+	}
+
+	g_ptr_array_free (syms, TRUE);
+	ucl_object_insert_key (top, obj, "profile", 0, false);
+
+	return top;
+}
+
+static void
+rspamadm_bench_output_distribution (const ucl_object_t *top,
+		const gchar *key, const gchar *title)
+{
+	const ucl_object_t *obj = ucl_object_lookup (top, key);
+
+	if (obj == NULL || obj->len == 0) {
+		return;
+	}
+
+	rspamd_printf ("%s (ms): min %.2f, mean %.2f, p50 %.2f, p90 %.2f, "
+			"p99 %.2f, p999 %.2f, max %.2f\n",
+			title,
+			ucl_object_todouble (ucl_object_lookup (obj, "min")),
+			ucl_object_todouble (ucl_object_lookup (obj, "mean")),
+			ucl_object_todouble (ucl_object_lookup (obj, "p50")),
+			ucl_object_todouble (ucl_object_lookup (obj, "p90")),
+			ucl_object_todouble (ucl_object_lookup (obj, "p99")),
+			ucl_object_todouble (ucl_object_lookup (obj, "p999")),
+			ucl_object_todouble (ucl_object_lookup (obj, "max")));
+}
+
+static void
+rspamadm_bench_output (const ucl_object_t *top)
+{
+	const ucl_object_t *obj, *cur;
+	ucl_object_iter_t it = NULL;
+	guint i = 0;
+
+	rspamd_printf ("requests: %L, errors: %L, elapsed: %.3f s, "
+			"throughput: %.2f rps\n",
+			ucl_object_toint (ucl_object_lookup (top, "requests")),
+			ucl_object_toint (ucl_object_lookup (top, "errors")),
+			ucl_object_todouble (ucl_object_lookup (top, "elapsed")),
+			ucl_object_todouble (ucl_object_lookup (top, "throughput")));
+
+	if (rate > 0) {
+		rspamadm_bench_output_distribution (top, "latency",
+				"latency from schedule");
+		rspamadm_bench_output_distribution (top, "service", "service time");
+	}
+	else {
+		rspamadm_bench_output_distribution (top, "service", "latency");
+	}
+
+	rspamadm_bench_output_distribution (top, "server", "server scan time");
+
+	obj = ucl_object_lookup (top, "errors_by_message");
+
+	while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+		rspamd_printf ("error: %s: %L\n", ucl_object_key (cur),
+				ucl_object_toint (cur));
+	}
+
+	obj = ucl_object_lookup (top, "profile");
+
+	if (obj && obj->len > 0) {
+		rspamd_printf ("slowest symbols (usec):\n");
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL && i < 20) {
+			rspamd_printf ("\t%s: mean %.3f, hits %L\n",
+					ucl_object_tostring (ucl_object_lookup (cur, "symbol")),
+					ucl_object_todouble (ucl_object_lookup (cur, "mean")),
+					ucl_object_toint (ucl_object_lookup (cur, "count")));
+			i ++;
+		}
+	}
+}
+
+static void
+rspamadm_bench (gint argc, gchar **argv, const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamadm_bench_ctx ctx;
+	struct rspamd_http_client_header profile_hdr;
+	ucl_object_t *res;
+	gdouble *pintended;
+	gint i;
+
+	context = g_option_context_new (
+			"bench - replay a corpus of messages and measure latencies");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		g_option_context_free (context);
+		exit (1);
+	}
+
+	g_option_context_free (context);
+
+	if (concurrency <= 0 || rate < 0 || duration < 0 || nrequests < 0) {
+		rspamd_fprintf (stderr, "invalid concurrency, rate, duration or "
+				"number of requests\n");
+		exit (1);
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.event_loop = rspamd_main->event_loop;
+	ctx.files = g_ptr_array_new_with_free_func (g_free);
+
+	for (i = 1; i < argc; i ++) {
+		rspamadm_bench_add_path (ctx.files, argv[i]);
+	}
+
+	if (ctx.files->len == 0) {
+		rspamd_fprintf (stderr, "no messages to send\n");
+		exit (1);
+	}
+
+	if (nrequests == 0 && duration == 0) {
+		nrequests = ctx.files->len;
+	}
+
+	rspamadm_bench_parse_host (&ctx);
+	ctx.attrs = g_queue_new ();
+
+	if (profile) {
+		profile_hdr.name = "Flags";
+		profile_hdr.value = "profile";
+		g_queue_push_tail (ctx.attrs, &profile_hdr);
+	}
+
+	g_queue_init (&ctx.backlog);
+	ctx.latencies = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	ctx.service = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	ctx.server = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	ctx.errors_by_msg = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, NULL);
+	ctx.symbols = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, g_free);
+	ctx.start = rspamd_get_ticks (FALSE);
+
+	if (rate > 0) {
+		ctx.schedule_ev.data = &ctx;
+		ev_timer_init (&ctx.schedule_ev, rspamadm_bench_schedule_cb,
+				0.0, MAX (1.0 / rate, 0.001));
+		ev_timer_start (ctx.event_loop, &ctx.schedule_ev);
+	}
+	else {
+		rspamadm_bench_dispatch (&ctx);
+	}
+
+	if (!rspamadm_bench_is_done (&ctx)) {
+		ev_loop (ctx.event_loop, 0);
+	}
+
+	if (rate > 0) {
+		ev_timer_stop (ctx.event_loop, &ctx.schedule_ev);
+	}
+
+	res = rspamadm_bench_result (&ctx);
+
+	if (json) {
+		rspamd_fstring_t *out = rspamd_fstring_new ();
+
+		rspamd_ucl_emit_fstring (res, UCL_EMIT_JSON, &out);
+		rspamd_printf ("%V\n", out);
+		rspamd_fstring_free (out);
+	}
+	else {
+		rspamadm_bench_output (res);
+	}
+
+	ucl_object_unref (res);
+
+	while ((pintended = g_queue_pop_head (&ctx.backlog)) != NULL) {
+		g_free (pintended);
+	}
+
+	g_queue_free (ctx.attrs);
+	g_array_free (ctx.latencies, TRUE);
+	g_array_free (ctx.service, TRUE);
+	g_array_free (ctx.server, TRUE);
+	g_hash_table_unref (ctx.errors_by_msg);
+	g_hash_table_unref (ctx.symbols);
+	g_ptr_array_free (ctx.files, TRUE);
+	g_free (ctx.host);
+}
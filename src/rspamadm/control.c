@@ -85,7 +85,10 @@ rspamadm_control_help (gboolean full_help, const struct rspamadm_command *cmd)
 				"reresolve - resolve upstreams addresses\n"
 				"recompile - recompile hyperscan regexes\n"
 				"fuzzystat - show fuzzy statistics\n"
-				"fuzzysync - immediately sync fuzzy database to storage\n";
+				"fuzzysync - immediately sync fuzzy database to storage\n"
+				"symbols_trace - show sampled symbols traces (Chrome trace format)\n"
+				"mempool - show top memory pool allocation sites\n"
+				"lua_profile - show sampled Lua stacks (folded stacks for flamegraph)\n";
 	}
 	else {
 		help_str = "Manage rspamd main control interface";
@@ -124,12 +127,25 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		obj = ucl_parser_get_object (parser);
 		out = rspamd_fstring_new ();
 
-		if (json) {
-			rspamd_ucl_emit_fstring (obj, UCL_EMIT_JSON, &out);
+		if (json || strcmp (cbdata->path, "/symbols_trace") == 0) {
+			/* Traces are meant to be loaded to chrome://tracing as is */
+			rspamd_ucl_emit_fstring (obj,
+					compact ? UCL_EMIT_JSON_COMPACT : UCL_EMIT_JSON, &out);
 		}
 		else if (compact) {
 			rspamd_ucl_emit_fstring (obj, UCL_EMIT_JSON_COMPACT, &out);
 		}
+		else if (strcmp (cbdata->path, "/lua_profile") == 0) {
+			/* Folded stacks as accepted by flamegraph.pl */
+			const ucl_object_t *st;
+			ucl_object_iter_t it = NULL;
+
+			while ((st = ucl_object_iterate (ucl_object_lookup (obj, "stacks"),
+					&it, true)) != NULL) {
+				rspamd_printf_fstring (&out, "%s %L\n", ucl_object_key (st),
+						ucl_object_toint (st));
+			}
+		}
 		else {
 			if (strcmp (cbdata->path, "/fuzzystat") == 0) {
 				rspamadm_execute_lua_ucl_subr (cbdata->argc - 1,
@@ -218,6 +234,18 @@ rspamadm_control (gint argc, gchar **argv, const struct rspamadm_command *_cmd)
 			g_ascii_strcasecmp (cmd, "fuzzy_sync") == 0) {
 		path = "/fuzzysync";
 	}
+	else if (g_ascii_strcasecmp (cmd, "symbols_trace") == 0 ||
+			g_ascii_strcasecmp (cmd, "trace") == 0) {
+		path = "/symbols_trace";
+	}
+	else if (g_ascii_strcasecmp (cmd, "mempool") == 0 ||
+			g_ascii_strcasecmp (cmd, "mempool_profile") == 0) {
+		path = "/mempool";
+	}
+	else if (g_ascii_strcasecmp (cmd, "lua_profile") == 0 ||
+			g_ascii_strcasecmp (cmd, "luaprofile") == 0) {
+		path = "/lua_profile";
+	}
 	else {
 		rspamd_fprintf (stderr, "unknown command: %s\n", cmd);
 		exit (1);
@@ -25,6 +25,7 @@ static gchar *symbol_ham = NULL;
 static gchar *symbol_spam = NULL;
 
 static gdouble expire = 0.0;
+static gint batch_size = 0;
 
 /* Inputs */
 static gchar *spam_db = NULL;
@@ -57,6 +58,8 @@ static GOptionEntry entries[] = {
 				"Reset previous data instead of appending values", NULL},
 		{"expire", 'e', 0, G_OPTION_ARG_DOUBLE, &expire,
 				"Set expiration in seconds (can be fractional)", NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch_size,
+				"Number of tokens sent to redis at once (default: 1000)", NULL},
 
 		{"symbol-spam", 0, 0, G_OPTION_ARG_STRING, &symbol_spam,
 				"Symbol for spam (e.g. BAYES_SPAM)", NULL},
@@ -90,6 +93,7 @@ rspamadm_statconvert_help (gboolean full_help, const struct rspamadm_command *cm
 				"-c: config file to read data from\n"
 				"-r: reset previous data instead of increasing values\n"
 				"-e: set expire to that amount of seconds\n"
+				"-b: number of tokens sent to redis at once (default: 1000)\n"
 				"** Or specify options directly **\n"
 				"--redis-host: output redis ip (in format ip:port)\n"
 				"--redis-db: output redis database\n"
@@ -247,6 +251,11 @@ rspamadm_statconvert (gint argc, gchar **argv, const struct rspamadm_command *cm
 				"expire", 0, false);
 	}
 
+	if (batch_size > 0) {
+		ucl_object_insert_key (obj, ucl_object_fromint (batch_size),
+				"batch_size", 0, false);
+	}
+
 	rspamadm_execute_lua_ucl_subr (argc,
 			argv,
 			obj,
@@ -19,6 +19,7 @@
 #include "lua/lua_common.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libmime/images.h"
 #include "ottery.h"
 #include "cryptobox.h"
 #include "utlist.h"
@@ -71,6 +72,17 @@ static gint control_fd;
 static ev_io control_ev;
 static struct rspamd_stat old_stat;
 static ev_timer stat_ev;
+static ev_timer log_ring_ev;
+
+/* Overlapping generations of workers on reload */
+static struct rspamd_reload_state {
+	ev_timer tm;
+	ev_tstamp start;
+	ev_tstamp spawned;
+	ev_tstamp ready;
+	gboolean pending;
+	gboolean overlapping;
+} reload_state;
 
 static gboolean valgrind_mode = FALSE;
 
@@ -358,12 +370,42 @@ struct waiting_worker {
 	guint oldindex;
 };
 
+/*
+ * Main process is a template for all workers: config, Lua state, preloaded
+ * maps and hyperscan databases are inherited copy-on-write. Garbage left by
+ * config scripts is collected here, otherwise every child would collect it
+ * on its own and thus copy pages that could be shared
+ */
+static void
+rspamd_prepare_fork_template (struct rspamd_main *rspamd_main)
+{
+	lua_State *L = (lua_State *)rspamd_main->cfg->lua_state;
+	gint before, after;
+	gdouble t1, t2;
+
+	if (L == NULL) {
+		return;
+	}
+
+	t1 = rspamd_get_ticks (FALSE);
+	before = lua_gc (L, LUA_GCCOUNT, 0);
+	/* The second pass frees objects resurrected by finalizers */
+	lua_gc (L, LUA_GCCOLLECT, 0);
+	lua_gc (L, LUA_GCCOLLECT, 0);
+	after = lua_gc (L, LUA_GCCOUNT, 0);
+	t2 = rspamd_get_ticks (FALSE);
+
+	msg_info_main ("prepared workers template: lua heap %d -> %d kb "
+			"in %.3f ms", before, after, (t2 - t1) * 1000.0);
+}
+
 static void
 rspamd_fork_delayed_cb (EV_P_ ev_timer *w, int revents)
 {
 	struct waiting_worker *waiting_worker = (struct waiting_worker *)w->data;
 
 	ev_timer_stop (EV_A_ &waiting_worker->wait_ev);
+	rspamd_prepare_fork_template (waiting_worker->rspamd_main);
 	rspamd_fork_worker (waiting_worker->rspamd_main, waiting_worker->cf,
 			waiting_worker->oldindex,
 			waiting_worker->rspamd_main->event_loop,
@@ -391,13 +433,15 @@ rspamd_fork_delayed (struct rspamd_worker_conf *cf,
 
 static GList *
 create_listen_socket (GPtrArray *addrs, guint cnt,
-		enum rspamd_worker_socket_type listen_type)
+		enum rspamd_worker_socket_type listen_type,
+		gboolean reuseport)
 {
 	GList *result = NULL;
-	gint fd;
+	gint fd, tcp_opts;
 	guint i;
 	static const int listen_opts = RSPAMD_INET_ADDRESS_LISTEN_ASYNC;
 	struct rspamd_worker_listen_socket *ls;
+	bool is_reuseport;
 
 	g_ptr_array_sort (addrs, rspamd_inet_address_compare_ptr);
 	for (i = 0; i < cnt; i ++) {
@@ -406,14 +450,29 @@ create_listen_socket (GPtrArray *addrs, guint cnt,
 		 * Copy address to avoid reload issues
 		 */
 		if (listen_type & RSPAMD_WORKER_SOCKET_TCP) {
+			tcp_opts = listen_opts;
+			is_reuseport = false;
+#if defined(SO_REUSEPORT) && defined(LINUX)
+			/*
+			 * In reuseport mode this socket is only bound to reserve the
+			 * address, workers accept on their own listen sockets
+			 */
+			if (reuseport && rspamd_inet_address_get_af (
+					g_ptr_array_index (addrs, i)) != AF_UNIX) {
+				tcp_opts |= RSPAMD_INET_ADDRESS_LISTEN_REUSEPORT|
+						RSPAMD_INET_ADDRESS_LISTEN_NOLISTEN;
+				is_reuseport = true;
+			}
+#endif
 			fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
 					SOCK_STREAM,
-					listen_opts, -1);
+					tcp_opts, -1);
 			if (fd != -1) {
 				ls = g_malloc0 (sizeof (*ls));
 				ls->addr = rspamd_inet_address_copy (g_ptr_array_index (addrs, i));
 				ls->fd = fd;
 				ls->type = RSPAMD_WORKER_SOCKET_TCP;
+				ls->is_reuseport = is_reuseport;
 				result = g_list_prepend (result, ls);
 			}
 		}
@@ -638,6 +697,13 @@ spawn_workers (struct rspamd_main *rspamd_main, struct ev_loop *ev_base)
 	worker_t **cw, *wrk;
 	guint i;
 
+	rspamd_prepare_fork_template (rspamd_main);
+
+	/* Profiling table must be shared with all workers */
+	rspamd_mempool_profile_init (rspamd_main->cfg->mempool_profile_rate);
+	rspamd_mempool_huge_pages_init (rspamd_main->cfg->mempool_huge_chain_size);
+	rspamd_images_shared_cache_init (rspamd_main->cfg);
+
 	/* Special hack for hs_helper if it's not defined in a config */
 	seen_mandatory_workers = g_ptr_array_new ();
 	cur = rspamd_main->cfg->workers;
@@ -673,7 +739,7 @@ spawn_workers (struct rspamd_main *rspamd_main, struct ev_loop *ev_base)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type, cf->reuseport);
 						}
 						else {
 							ls = systemd_get_socket (rspamd_main,
@@ -787,6 +853,8 @@ mark_old_workers (gpointer key, gpointer value, gpointer unused)
 
 	if (w->state == rspamd_worker_state_running) {
 		w->state = rspamd_worker_state_wanna_die;
+		/* Old workers keep their copies, we won't respawn them anyway */
+		rspamd_worker_close_reuseport_socks (w->cf);
 	}
 }
 
@@ -1117,15 +1185,158 @@ rspamd_stat_update_handler (struct ev_loop *loop, ev_timer *w, int revents)
 	memcpy (&old_stat, &cur_stat, sizeof (cur_stat));
 }
 
+static void
+rspamd_worker_drain_log_ring (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+	if (wrk->log_ring) {
+		rspamd_log_ring_drain (rspamd_main->logger, wrk->log_ring,
+				wrk->pid, wrk->type);
+	}
+}
+
+static void
+rspamd_log_ring_drain_handler (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct rspamd_main *rspamd_main = (struct rspamd_main *)w->data;
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_worker_drain_log_ring (rspamd_main, (struct rspamd_worker *)v);
+	}
+}
+
+static void
+rspamd_reload_finish (struct rspamd_main *rspamd_main)
+{
+	ev_tstamp now = ev_time ();
+
+	ev_timer_stop (rspamd_main->event_loop, &reload_state.tm);
+	reload_state.pending = FALSE;
+	reload_state.overlapping = FALSE;
+
+	msg_info_main ("kill old workers");
+	g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
+
+	rspamd_main->stat->reload_config_ms =
+			(reload_state.spawned - reload_state.start) * 1000.0;
+	rspamd_main->stat->reload_ready_ms =
+			(reload_state.ready - reload_state.spawned) * 1000.0;
+	rspamd_main->stat->reload_overlap_ms =
+			(now - reload_state.ready) * 1000.0;
+
+	msg_info_main ("reload has been finished in %.3f seconds: "
+			"%.3f to load config and spawn workers, "
+			"%.3f to get new workers ready, "
+			"%.3f of workers generations overlap",
+			now - reload_state.start,
+			reload_state.spawned - reload_state.start,
+			reload_state.ready - reload_state.spawned,
+			now - reload_state.ready);
+}
+
+static gboolean
+rspamd_reload_new_workers_ready (struct rspamd_main *rspamd_main)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_worker *wrk;
+
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		wrk = (struct rspamd_worker *)v;
+
+		if (wrk->state == rspamd_worker_state_running && !wrk->ready) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_reload_workers_ready (struct rspamd_main *rspamd_main)
+{
+	ev_tstamp overlap = rspamd_main->cfg->reload_overlap;
+
+	reload_state.ready = ev_time ();
+	ev_timer_stop (rspamd_main->event_loop, &reload_state.tm);
+
+	if (overlap > 0) {
+		/* Let old workers finish what they are doing while new ones serve */
+		msg_info_main ("new workers are ready, keep old workers for "
+				"%.2f seconds", overlap);
+		reload_state.overlapping = TRUE;
+		ev_timer_set (&reload_state.tm, overlap, 0.0);
+		ev_timer_start (rspamd_main->event_loop, &reload_state.tm);
+	}
+	else {
+		rspamd_reload_finish (rspamd_main);
+	}
+}
+
+static void
+rspamd_reload_timer_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct rspamd_main *rspamd_main = (struct rspamd_main *)w->data;
+
+	ev_timer_stop (loop, w);
+
+	if (!reload_state.pending || rspamd_main->wanna_die) {
+		return;
+	}
+
+	if (reload_state.overlapping) {
+		rspamd_reload_finish (rspamd_main);
+	}
+	else {
+		rspamd_main->stat->reloads_ready_timeout ++;
+		msg_warn_main ("new workers are not ready after %.2f seconds, "
+				"kill old workers anyway",
+				ev_time () - reload_state.spawned);
+		rspamd_reload_workers_ready (rspamd_main);
+	}
+}
+
+static void
+rspamd_reload_worker_ready_cb (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+	msg_info_main ("worker %P (%s) is ready", wrk->pid,
+			g_quark_to_string (wrk->type));
+
+	if (reload_state.pending && !reload_state.overlapping &&
+			rspamd_reload_new_workers_ready (rspamd_main)) {
+		rspamd_reload_workers_ready (rspamd_main);
+	}
+}
+
 static void
 rspamd_hup_handler (struct ev_loop *loop, ev_signal *w, int revents)
 {
 	struct rspamd_main *rspamd_main = (struct rspamd_main *)w->data;
+	ev_tstamp start;
 
 	if (!rspamd_main->wanna_die) {
 		msg_info_main ("rspamd "
 				RVERSION
 				" is requested to reload configuration");
+		start = ev_time ();
+
+		if (reload_state.pending) {
+			/* Do not keep more than two generations of workers */
+			msg_info_main ("previous reload is still in progress, finish it");
+			if (!reload_state.overlapping) {
+				reload_state.ready = start;
+			}
+
+			rspamd_reload_finish (rspamd_main);
+		}
+
 		/* Detach existing workers and stop their heartbeats */
 		g_hash_table_foreach (rspamd_main->workers, stop_srv_ev, rspamd_main);
 
@@ -1136,9 +1347,24 @@ rspamd_hup_handler (struct ev_loop *loop, ev_signal *w, int revents)
 			msg_info_main ("spawn workers with a new config");
 			spawn_workers (rspamd_main, rspamd_main->event_loop);
 			msg_info_main ("workers spawning has been finished");
-			/* Kill marked */
-			msg_info_main ("kill old workers");
-			g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
+			rspamd_main->stat->reloads ++;
+			reload_state.start = start;
+			reload_state.spawned = ev_time ();
+			reload_state.pending = TRUE;
+			reload_state.overlapping = FALSE;
+
+			if (rspamd_main->cfg->reload_ready_timeout > 0 &&
+					!rspamd_reload_new_workers_ready (rspamd_main)) {
+				/* Old workers serve until new ones report they are ready */
+				msg_info_main ("wait up to %.2f seconds for new workers "
+						"to be ready", rspamd_main->cfg->reload_ready_timeout);
+				ev_timer_set (&reload_state.tm,
+						rspamd_main->cfg->reload_ready_timeout, 0.0);
+				ev_timer_start (rspamd_main->event_loop, &reload_state.tm);
+			}
+			else {
+				rspamd_reload_workers_ready (rspamd_main);
+			}
 		}
 		else {
 			/* Reattach old workers */
@@ -1160,9 +1386,27 @@ rspamd_cld_handler (EV_P_ ev_child *w, struct rspamd_main *rspamd_main,
 	/* Turn off locking for logger */
 	ev_child_stop (EV_A_ w);
 
+	if (wrk->log_ring) {
+		guint64 fallbacks = rspamd_log_ring_fallbacks (wrk->log_ring);
+
+		/* Write everything the worker has logged before termination */
+		rspamd_worker_drain_log_ring (rspamd_main, wrk);
+
+		if (fallbacks > 0) {
+			msg_info_main ("process %P has written %L log records "
+					"synchronously as its async log ring was full",
+					wrk->pid, (gint64)fallbacks);
+		}
+
+		rspamd_log_ring_destroy (wrk->log_ring);
+		wrk->log_ring = NULL;
+	}
+
 	/* Remove dead child form children list */
 	g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (wrk->pid));
 	g_hash_table_remove_all (wrk->control_events_pending);
+	/* Tasks of a killed worker must not be accounted any longer */
+	rspamd_worker_load_slot_release (wrk);
 
 	if (wrk->srv_pipe[0] != -1) {
 		/* Ugly workaround */
@@ -1349,6 +1593,11 @@ main (gint argc, gchar **argv, gchar **env)
 			"main", 0);
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 			sizeof (struct rspamd_stat));
+	rspamd_main->workers_load = rspamd_mempool_alloc0_shared (
+			rspamd_main->server_pool,
+			sizeof (struct rspamd_worker_load) * RSPAMD_WORKER_LOAD_SLOTS);
+	rspamd_main->task_timings = rspamd_mempool_alloc0_shared (
+			rspamd_main->server_pool, sizeof (struct rspamd_task_timings));
 	rspamd_main->cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
 	rspamd_main->spairs = g_hash_table_new_full (rspamd_spair_hash,
 			rspamd_spair_equal, g_free, rspamd_spair_close);
@@ -1464,9 +1713,11 @@ main (gint argc, gchar **argv, gchar **env)
 	msg_info_main ("cpu features: %s",
 			rspamd_main->cfg->libs_ctx->crypto_ctx->cpu_extensions);
 	msg_info_main ("cryptobox configuration: curve25519(libsodium), "
-			"chacha20(%s), poly1305(libsodium), siphash(libsodium), blake2(libsodium), base64(%s)",
+			"chacha20(%s), poly1305(libsodium), siphash(libsodium), blake2(libsodium), base64(%s), "
+			"fast hash(%s)",
 			rspamd_main->cfg->libs_ctx->crypto_ctx->chacha20_impl,
-			rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl);
+			rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl,
+			rspamd_main->cfg->libs_ctx->crypto_ctx->fast_hash_impl);
 	msg_info_main ("libottery prf: %s", ottery_get_impl_name ());
 
 	/* Daemonize */
@@ -1597,6 +1848,18 @@ main (gint argc, gchar **argv, gchar **env)
 			stat_update_time, stat_update_time);
 	ev_timer_start (event_loop, &stat_ev);
 
+	/* Write records logged by workers when `async_buffer` is set */
+	static const ev_tstamp log_ring_drain_time = 0.1;
+
+	log_ring_ev.data = rspamd_main;
+	ev_timer_init (&log_ring_ev, rspamd_log_ring_drain_handler,
+			log_ring_drain_time, log_ring_drain_time);
+	ev_timer_start (event_loop, &log_ring_ev);
+
+	reload_state.tm.data = rspamd_main;
+	ev_timer_init (&reload_state.tm, rspamd_reload_timer_cb, 0.0, 0.0);
+	rspamd_main->worker_ready_cb = rspamd_reload_worker_ready_cb;
+
 	rspamd_check_core_limits (rspamd_main);
 	rspamd_mempool_lock_mutex (rspamd_main->start_mtx);
 	spawn_workers (rspamd_main, event_loop);
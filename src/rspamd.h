@@ -123,6 +123,10 @@ struct rspamd_worker {
 	ev_child cld_ev;                /**< to allow reaping								*/
 	rspamd_worker_term_cb term_handler; /**< custom term handler						*/
 	GHashTable *control_events_pending; /**< control events pending indexed by ptr		*/
+	gint load_slot;                 /**< slot in srv->workers_load or -1				*/
+	struct rspamd_log_ring *log_ring; /**< async log ring drained by main or NULL		*/
+	gboolean ready;                 /**< worker has finished its init and serves		*/
+	ev_timer load_stat_ev;          /**< publishes process stats to the load slot		*/
 };
 
 struct rspamd_abstract_worker_ctx {
@@ -236,6 +240,7 @@ struct rspamd_worker_listen_socket {
 	gint fd;
 	enum rspamd_worker_socket_type type;
 	bool is_systemd;
+	bool is_reuseport; /* bound only, workers listen on their own sockets */
 };
 
 typedef struct worker_s {
@@ -287,6 +292,44 @@ struct rspamd_stat {
 	guint connections_count;                            /**< total connections count						*/
 	guint control_connections_count;                    /**< connections count to control interface			*/
 	guint messages_learned;                             /**< messages learned								*/
+	guint url_cache_hits;                               /**< urls taken from parse caches of workers		*/
+	guint url_cache_misses;                             /**< urls parsed and stored in parse caches			*/
+	guint bayes_cache_hits;                             /**< bayes tokens taken from caches of workers		*/
+	guint bayes_cache_misses;                           /**< bayes tokens queried from redis					*/
+	guint stem_cache_hits;                              /**< words taken from stemming caches of workers		*/
+	guint stem_cache_misses;                            /**< words stemmed and stored in stemming caches		*/
+	guint scans_shed;                                   /**< scans soft rejected due to overload				*/
+	guint scans_fast_pathed;                            /**< scans done with lightweight settings on overload	*/
+	guint scans_host_limited;                           /**< scans soft rejected due to host wide limits		*/
+	guint reloads;                                      /**< configuration reloads							*/
+	guint reloads_ready_timeout;                        /**< reloads when new workers were not ready in time	*/
+	guint reload_config_ms;                             /**< last reload: time to load a new config			*/
+	guint reload_ready_ms;                              /**< last reload: time until new workers were ready	*/
+	guint reload_overlap_ms;                            /**< last reload: time both generations were serving	*/
+};
+
+#define RSPAMD_WORKER_LOAD_SLOTS 256
+
+#define RSPAMD_WORKER_LOAD_STAT_INTERVAL 1.0
+
+/**
+ * Load of a worker process, slots are allocated in shared memory by the main
+ * process, so workers can bound the load of the whole host.
+ * Process stats are published by a worker periodically, so they can be read
+ * without asking the worker: a writer makes `version` odd while updating them
+ * and readers retry unless they see the same even version before and after
+ */
+struct rspamd_worker_load {
+	pid_t pid;                                          /**< owner of the slot, 0 if the slot is free		*/
+	guint tasks;                                        /**< tasks in flight								*/
+	guint64 bytes;                                      /**< size of messages in flight					*/
+	GQuark type;                                        /**< type of the worker							*/
+	guint64 version;                                    /**< stats below are consistent when even			*/
+	guint conns;                                        /**< connections being served						*/
+	gdouble start_time;                                 /**< worker start time								*/
+	gdouble utime;                                      /**< user CPU time									*/
+	gdouble systime;                                    /**< system CPU time								*/
+	gulong maxrss;                                      /**< maximum resident set size						*/
 };
 
 /**
@@ -299,6 +342,8 @@ struct rspamd_main {
 	rspamd_pidfh_t *pfh;                                        /**< struct pidfh for pidfile						*/
 	GQuark type;                                                /**< process type									*/
 	struct rspamd_stat *stat;                                   /**< pointer to statistics							*/
+	struct rspamd_worker_load *workers_load;                    /**< per worker load slots (shared)					*/
+	struct rspamd_task_timings *task_timings;                   /**< tasks lifecycle histograms (shared)			*/
 
 	rspamd_mempool_t *server_pool;                              /**< server's memory pool							*/
 	rspamd_mempool_mutex_t *start_mtx;                          /**< server is starting up							*/
@@ -314,6 +359,7 @@ struct rspamd_main {
 	struct ev_loop *event_loop;
 	ev_signal term_ev, int_ev, hup_ev, usr1_ev;                 /**< signals 										*/
 	struct rspamd_http_context *http_ctx;
+	void (*worker_ready_cb) (struct rspamd_main *, struct rspamd_worker *); /**< called when a worker reports readiness */
 };
 
 enum rspamd_exception_type {
@@ -355,6 +401,9 @@ struct zstd_dictionary {
 	void *dict;
 	gsize size;
 	guint id;
+	void *ddict; /* digested ZSTD_DDict */
+	void *cdict; /* digested ZSTD_CDict */
+	gboolean mapped;
 };
 
 struct rspamd_external_libs_ctx {
@@ -365,6 +414,7 @@ struct rspamd_external_libs_ctx {
 	SSL_CTX *ssl_ctx_noverify;
 	struct zstd_dictionary *in_dict;
 	struct zstd_dictionary *out_dict;
+	GQueue *map_dicts; /* dictionaries from `zstd_dictionary_map`, newest first */
 	void *out_zstream;
 	void *in_zstream;
 	ref_entry_t ref;
@@ -47,6 +47,12 @@
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
 #define DEFAULT_RETRIES 5
+#define DEFAULT_HEDGE_BUDGET 0.05
+#define DEFAULT_HEDGE_MIN_DELAY 0.05
+/* Allow short bursts of hedged requests */
+#define PROXY_HEDGE_MAX_TOKENS 10.0
+/* Relative step of the hedging delay estimation */
+#define PROXY_HEDGE_STEP 0.05
 
 #define msg_err_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         session->pool->tag.tagname, session->pool->tag.uid, \
@@ -133,6 +139,14 @@ struct rspamd_proxy_ctx {
 	GArray *cmp_refs;
 	/* Maximum count for retries */
 	guint max_retries;
+	/* Percentile of backend replies time after which a hedged request is sent */
+	gdouble hedge_percentile;
+	/* Fraction of requests that could be hedged */
+	gdouble hedge_budget;
+	gdouble hedge_min_delay;
+	/* Current estimation of the percentile */
+	gdouble hedge_delay;
+	gdouble hedge_tokens;
 	/* If we have self_scanning backends, we need to work as a normal worker */
 	gboolean has_self_scan;
 	/* It is not HTTP but milter proxy */
@@ -173,6 +187,7 @@ struct rspamd_proxy_backend_connection {
 	struct rspamd_proxy_session *s;
 	gint backend_sock;
 	ev_tstamp timeout;
+	ev_tstamp start;
 	enum rspamd_backend_flags flags;
 	gint parser_from_ref;
 	gint parser_to_ref;
@@ -197,6 +212,8 @@ struct rspamd_proxy_session {
 	gchar *fname;
 	gpointer shmem_ref;
 	struct rspamd_proxy_backend_connection *master_conn;
+	struct rspamd_proxy_backend_connection *hedge_conn;
+	ev_timer hedge_ev;
 	struct rspamd_http_message *client_message;
 	GPtrArray *mirror_conns;
 	gsize map_len;
@@ -735,6 +752,8 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_array_free_hard, ctx->cmp_refs);
 	ctx->max_retries = DEFAULT_RETRIES;
+	ctx->hedge_budget = DEFAULT_HEDGE_BUDGET;
+	ctx->hedge_min_delay = DEFAULT_HEDGE_MIN_DELAY;
 	ctx->spam_header = RSPAMD_MILTER_SPAM_HEADER;
 
 	rspamd_rcl_register_worker_option (cfg,
@@ -786,6 +805,32 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, max_retries),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of retries for master connection");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hedge_percentile",
+			rspamd_rcl_parse_struct_double,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, hedge_percentile),
+			0,
+			"Send the same request to another backend if the master has not "
+			"replied within this percentile of replies time (e.g. 0.99, "
+			"default: 0 - disabled)");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hedge_budget",
+			rspamd_rcl_parse_struct_double,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, hedge_budget),
+			0,
+			"Maximum fraction of requests that could be hedged (default: 0.05)");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hedge_min_delay",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, hedge_min_delay),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Never send hedged requests earlier than this delay (default: 50ms)");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"milter",
@@ -852,6 +897,63 @@ proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 	}
 }
 
+/*
+ * Streaming estimation of the replies time percentile: the delay grows when
+ * the master has not replied in time and drops otherwise, the steps are
+ * chosen so that the equilibrium is reached at the desired percentile
+ */
+static void
+proxy_hedge_update_delay (struct rspamd_proxy_ctx *ctx, gboolean late)
+{
+	if (late) {
+		ctx->hedge_delay *= 1.0 + PROXY_HEDGE_STEP * ctx->hedge_percentile;
+	}
+	else {
+		ctx->hedge_delay *= 1.0 - PROXY_HEDGE_STEP * (1.0 - ctx->hedge_percentile);
+	}
+
+	ctx->hedge_delay = MAX (ctx->hedge_delay, ctx->hedge_min_delay);
+
+	if (ctx->timeout > 0) {
+		ctx->hedge_delay = MIN (ctx->hedge_delay, ctx->timeout);
+	}
+}
+
+/*
+ * Called when a master or a hedged connection has replied: keeps the winner
+ * as the master connection and cancels the other request
+ */
+static void
+proxy_backend_hedge_settle (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn)
+{
+	struct rspamd_proxy_backend_connection *loser;
+
+	if (ev_is_active (&session->hedge_ev)) {
+		ev_timer_stop (session->ctx->event_loop, &session->hedge_ev);
+		proxy_hedge_update_delay (session->ctx, FALSE);
+	}
+
+	if (session->hedge_conn == NULL) {
+		return;
+	}
+
+	if (bk_conn == session->hedge_conn) {
+		loser = session->master_conn;
+		session->master_conn = bk_conn;
+	}
+	else {
+		loser = session->hedge_conn;
+	}
+
+	session->hedge_conn = NULL;
+
+	if (!(loser->flags & RSPAMD_BACKEND_CLOSED)) {
+		rspamd_upstream_cancel (loser->up);
+		proxy_backend_close_connection (loser);
+	}
+}
+
 static gboolean
 proxy_backend_parse_results (struct rspamd_proxy_session *session,
 							 struct rspamd_proxy_backend_connection *conn,
@@ -907,13 +1009,22 @@ proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		lua_settop (L, 0);
 	}
 	else {
-		rspamd_ftok_t json_ct;
+		rspamd_ftok_t json_ct, msgpack_ct;
 		RSPAMD_FTOK_ASSIGN (&json_ct, "application/json");
+		RSPAMD_FTOK_ASSIGN (&msgpack_ct, MSGPACK_CONTENT_TYPE);
+
+		if (ct && (rspamd_ftok_casecmp (ct, &json_ct) == 0 ||
+				rspamd_ftok_casecmp (ct, &msgpack_ct) == 0)) {
+			enum ucl_parse_type parse_type = UCL_PARSE_UCL;
+
+			if (rspamd_ftok_casecmp (ct, &msgpack_ct) == 0) {
+				parse_type = UCL_PARSE_MSGPACK;
+			}
 
-		if (ct && rspamd_ftok_casecmp (ct, &json_ct) == 0) {
 			parser = ucl_parser_new (0);
 
-			if (!ucl_parser_add_chunk (parser, in, inlen)) {
+			if (!ucl_parser_add_chunk_full (parser, in, inlen, 0,
+					UCL_DUPLICATE_APPEND, parse_type)) {
 				gchar *encoded;
 
 				encoded = rspamd_encode_base64 (in, inlen, 0, NULL);
@@ -999,10 +1110,18 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 		}
 	}
 
+	if (ev_is_active (&session->hedge_ev)) {
+		ev_timer_stop (session->ctx->event_loop, &session->hedge_ev);
+	}
+
 	if (session->master_conn) {
 		proxy_backend_close_connection (session->master_conn);
 	}
 
+	if (session->hedge_conn) {
+		proxy_backend_close_connection (session->hedge_conn);
+	}
+
 	if (session->client_milter_conn) {
 		rspamd_milter_session_unref (session->client_milter_conn);
 	}
@@ -1062,11 +1181,13 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 }
 
 static void
-proxy_request_compress (struct rspamd_http_message *msg)
+proxy_request_compress (struct rspamd_http_message *msg,
+		struct rspamd_external_libs_ctx *libs_ctx)
 {
 	guint flags;
 	ZSTD_CCtx *zctx;
 	rspamd_fstring_t *body;
+	struct zstd_dictionary *dict;
 	const gchar *in;
 	gsize inlen;
 
@@ -1085,10 +1206,18 @@ proxy_request_compress (struct rspamd_http_message *msg)
 			return;
 		}
 
+		dict = rspamd_libs_request_zstd_dictionary (libs_ctx);
 		body = rspamd_fstring_sized_new (ZSTD_compressBound (inlen));
 		zctx = ZSTD_createCCtx ();
-		body->len = ZSTD_compressCCtx (zctx, body->str, body->allocated,
-				in, inlen, 1);
+
+		if (dict) {
+			body->len = ZSTD_compress_usingCDict (zctx, body->str,
+					body->allocated, in, inlen, dict->cdict);
+		}
+		else {
+			body->len = ZSTD_compressCCtx (zctx, body->str, body->allocated,
+					in, inlen, 1);
+		}
 
 		if (ZSTD_isError (body->len)) {
 			msg_err ("compression error");
@@ -1101,15 +1230,26 @@ proxy_request_compress (struct rspamd_http_message *msg)
 		ZSTD_freeCCtx (zctx);
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_add_header (msg, COMPRESSION_HEADER, "zstd");
+
+		if (dict) {
+			gchar dict_str[32];
+
+			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud", dict->id);
+			rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+		}
 	}
 }
 
 static void
-proxy_request_decompress (struct rspamd_http_message *msg)
+proxy_request_decompress (struct rspamd_http_message *msg,
+		struct rspamd_external_libs_ctx *libs_ctx)
 {
 	rspamd_fstring_t *body;
+	const rspamd_ftok_t *tok;
+	struct zstd_dictionary *dict = NULL;
 	const gchar *in;
 	gsize inlen, outlen, r;
+	gulong dict_id;
 	ZSTD_DStream *zstream;
 	ZSTD_inBuffer zin;
 	ZSTD_outBuffer zout;
@@ -1121,9 +1261,25 @@ proxy_request_decompress (struct rspamd_http_message *msg)
 			return;
 		}
 
+		tok = rspamd_http_message_find_header (msg, "Dictionary");
+
+		if (tok) {
+			if (!rspamd_strtoul (tok->begin, tok->len, &dict_id) ||
+					(dict = rspamd_libs_find_zstd_dictionary (libs_ctx,
+							dict_id)) == NULL) {
+				msg_err ("cannot decompress: unknown dictionary %T", tok);
+
+				return;
+			}
+		}
+
 		zstream = ZSTD_createDStream ();
 		ZSTD_initDStream (zstream);
 
+		if (dict) {
+			ZSTD_DCtx_refDDict (zstream, dict->ddict);
+		}
+
 		zin.pos = 0;
 		zin.src = in;
 		zin.size = inlen;
@@ -1161,6 +1317,7 @@ proxy_request_decompress (struct rspamd_http_message *msg)
 		ZSTD_freeDStream (zstream);
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_remove_header (msg, COMPRESSION_HEADER);
+		rspamd_http_message_remove_header (msg, "Dictionary");
 	}
 }
 
@@ -1323,7 +1480,7 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 	session = bk_conn->s;
 
-	proxy_request_decompress (msg);
+	proxy_request_decompress (msg, session->ctx->cfg->libs_ctx);
 	orig_ct = rspamd_http_message_find_header (msg, "Content-Type");
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
@@ -1336,6 +1493,8 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	}
 
 	msg_info_session ("finished mirror connection to %s", bk_conn->name);
+	rspamd_upstream_latency (bk_conn->up,
+			ev_now (session->ctx->event_loop) - bk_conn->start);
 	rspamd_upstream_ok (bk_conn->up);
 
 	proxy_backend_close_connection (bk_conn);
@@ -1390,6 +1549,8 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			continue;
 		}
 
+		bk_conn->start = ev_now (session->ctx->event_loop);
+
 		msg = rspamd_http_connection_copy_msg (session->client_message, &err);
 
 		if (msg == NULL) {
@@ -1410,6 +1571,13 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			rspamd_http_message_add_header (msg, "Settings-ID", m->settings_id);
 		}
 
+		if (m->parser_from_ref == -1) {
+			/* Mirror results are used internally only, so ask for a binary reply */
+			rspamd_http_message_remove_header (msg, ACCEPT_HEADER);
+			rspamd_http_message_add_header (msg, ACCEPT_HEADER,
+					MSGPACK_CONTENT_TYPE);
+		}
+
 		bk_conn->backend_conn = rspamd_http_connection_new_client_socket (
 				session->ctx->http_ctx,
 				NULL,
@@ -1443,7 +1611,7 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			msg->method = HTTP_POST;
 
 			if (m->compress) {
-				proxy_request_compress (msg);
+				proxy_request_compress (msg, session->ctx->cfg->libs_ctx);
 
 				if (session->client_milter_conn) {
 					rspamd_http_message_add_header (msg, "Content-Type",
@@ -1524,6 +1692,30 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 	struct rspamd_proxy_session *session;
 
 	session = bk_conn->s;
+
+	if (session->hedge_conn) {
+		/* Another request is still in flight, so just wait for it */
+		msg_info_session ("abnormally closing connection from backend: %s, "
+				"error: %e, wait for the hedged request",
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (bk_conn->up)),
+				err);
+		rspamd_upstream_fail (bk_conn->up, FALSE, err ? err->message : "unknown");
+		proxy_backend_close_connection (bk_conn);
+
+		if (bk_conn == session->master_conn) {
+			session->master_conn = session->hedge_conn;
+		}
+
+		session->hedge_conn = NULL;
+
+		return;
+	}
+
+	if (ev_is_active (&session->hedge_ev)) {
+		ev_timer_stop (session->ctx->event_loop, &session->hedge_ev);
+	}
+
 	session->retries ++;
 	msg_info_session ("abnormally closing connection from backend: %s, error: %e,"
 					  " retries left: %d",
@@ -1566,8 +1758,9 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	goffset body_offset = -1;
 
 	session = bk_conn->s;
+	proxy_backend_hedge_settle (session, bk_conn);
 	rspamd_http_connection_steal_msg (session->master_conn->backend_conn);
-	proxy_request_decompress (msg);
+	proxy_request_decompress (msg, session->ctx->cfg->libs_ctx);
 
 	/*
 	 * These are likely set by an http library, so we will double these headers
@@ -1609,6 +1802,8 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
+	rspamd_upstream_latency (bk_conn->up,
+			ev_now (session->ctx->event_loop) - bk_conn->start);
 	rspamd_upstream_ok (bk_conn->up);
 
 	if (session->client_milter_conn) {
@@ -1665,6 +1860,7 @@ rspamd_proxy_scan_self_reply (struct rspamd_task *task)
 		rspamd_task_set_finish_time (task);
 		rspamd_protocol_http_reply (msg, task, &rep);
 		rspamd_protocol_write_log_pipe (task);
+		ctype = rspamd_protocol_reply_content_type (msg, task);
 		break;
 	case CMD_PING:
 		rspamd_http_message_set_body (msg, "pong" CRLF, 6);
@@ -1802,16 +1998,22 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
 	task->s = rspamd_session_create (task->task_pool, rspamd_proxy_task_fin,
 			NULL, (event_finalizer_t )rspamd_task_free, task);
-	data = rspamd_http_message_get_body (msg, &len);
 
-	if (session->backend->settings_id) {
-		rspamd_http_message_remove_header (msg, "Settings-ID");
-		rspamd_http_message_add_header (msg, "Settings-ID",
-				session->backend->settings_id);
-	}
+	if (msg == NULL) {
+		/* Milter session is scanned directly, without HTTP conversion */
+		if (session->backend->settings_id) {
+			rspamd_protocol_handle_header (task,
+					SETTINGS_ID_HEADER, sizeof (SETTINGS_ID_HEADER) - 1,
+					session->backend->settings_id,
+					strlen (session->backend->settings_id));
+		}
 
-	/* Process message */
-	if (!rspamd_protocol_handle_request (task, msg)) {
+		if (!rspamd_milter_to_task (session->client_milter_conn, task)) {
+			msg_err_task ("cannot load message: %e", task->err);
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+	}
+	else if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
 		task->flags |= RSPAMD_TASK_FLAG_SKIP;
 	}
@@ -1820,6 +2022,8 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 			task->flags |= RSPAMD_TASK_FLAG_SKIP;
 		}
 		else {
+			data = rspamd_http_message_get_body (msg, &len);
+
 			if (!rspamd_task_load_message (task, msg, data, len)) {
 				msg_err_task ("cannot load message: %e", task->err);
 				task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -1855,12 +2059,189 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 }
 
 static gboolean
-proxy_send_master_message (struct rspamd_proxy_session *session)
+proxy_backend_write_master (struct rspamd_proxy_session *session,
+		struct rspamd_http_upstream *backend,
+		struct rspamd_proxy_backend_connection *bk_conn)
 {
 	struct rspamd_http_message *msg;
+	GError *err = NULL;
+
+	bk_conn->start = ev_now (session->ctx->event_loop);
+	msg = rspamd_http_connection_copy_msg (session->client_message, &err);
+	if (msg == NULL) {
+		msg_err_session ("cannot copy message to send it to the upstream: %e",
+				err);
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return FALSE;
+	}
+
+	bk_conn->backend_conn = rspamd_http_connection_new_client_socket (
+			session->ctx->http_ctx,
+			NULL,
+			proxy_backend_master_error_handler,
+			proxy_backend_master_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			bk_conn->backend_sock);
+	bk_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
+	bk_conn->parser_from_ref = backend->parser_from_ref;
+	bk_conn->parser_to_ref = backend->parser_to_ref;
+
+	if (backend->key) {
+		msg->peer_key = rspamd_pubkey_ref (backend->key);
+	}
+
+	if (session->client_milter_conn && backend->parser_from_ref == -1) {
+		/* Milter results are parsed by proxy itself */
+		rspamd_http_message_add_header (msg, ACCEPT_HEADER,
+				MSGPACK_CONTENT_TYPE);
+	}
+
+	if (backend->settings_id != NULL) {
+		rspamd_http_message_remove_header (msg, "Settings-ID");
+		rspamd_http_message_add_header (msg, "Settings-ID",
+				backend->settings_id);
+	}
+
+	if (backend->local ||
+			rspamd_inet_address_is_local (
+					rspamd_upstream_addr_cur (
+							bk_conn->up))) {
+
+		if (session->fname) {
+			rspamd_http_message_add_header (msg, "File", session->fname);
+		}
+
+		msg->method = HTTP_GET;
+
+		rspamd_http_connection_write_message_shared (
+				bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->timeout);
+	}
+	else {
+		if (session->fname) {
+			msg->flags &= ~RSPAMD_HTTP_FLAG_SHMEM;
+			rspamd_http_message_set_body (msg,
+					session->map, session->map_len);
+		}
+
+		msg->method = HTTP_POST;
+
+		if (backend->compress) {
+			proxy_request_compress (msg, session->ctx->cfg->libs_ctx);
+			if (session->client_milter_conn) {
+				rspamd_http_message_add_header (msg, "Content-Type",
+						"application/octet-stream");
+			}
+		}
+		else {
+			if (session->client_milter_conn) {
+				rspamd_http_message_add_header (msg, "Content-Type",
+						"text/plain");
+			}
+		}
+
+		rspamd_http_connection_write_message (
+				bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->timeout);
+	}
+
+	return TRUE;
+}
+
+static void
+proxy_backend_hedge_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_proxy_session *session =
+			(struct rspamd_proxy_session *)w->data;
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+	struct rspamd_http_upstream *backend = session->backend;
+	struct rspamd_proxy_backend_connection *bk_conn;
+	struct upstream *up;
+	gpointer hash_key;
+	guint hash_len;
+
+	/* Master has not replied within the estimated percentile */
+	proxy_hedge_update_delay (ctx, TRUE);
+
+	if (ctx->hedge_tokens < 1.0) {
+		msg_debug_session ("hedging budget is exhausted, wait for %s",
+				rspamd_upstream_name (session->master_conn->up));
+		return;
+	}
+
+	hash_key = rspamd_inet_address_get_hash_key (session->client_addr,
+			&hash_len);
+	up = rspamd_upstream_get_except (backend->u, session->master_conn->up,
+			RSPAMD_UPSTREAM_ROUND_ROBIN, hash_key, hash_len);
+
+	if (up == NULL || up == session->master_conn->up) {
+		if (up) {
+			rspamd_upstream_cancel (up);
+		}
+
+		return;
+	}
+
+	bk_conn = rspamd_mempool_alloc0 (session->pool, sizeof (*bk_conn));
+	bk_conn->s = session;
+	bk_conn->name = session->master_conn->name;
+	bk_conn->up = up;
+	bk_conn->timeout = backend->timeout;
+	bk_conn->backend_sock = rspamd_inet_address_connect (
+			rspamd_upstream_addr_next (up),
+			SOCK_STREAM, TRUE);
+
+	if (bk_conn->backend_sock == -1) {
+		rspamd_upstream_fail (up, TRUE, strerror (errno));
+		return;
+	}
+
+	if (!proxy_backend_write_master (session, backend, bk_conn)) {
+		rspamd_upstream_cancel (up);
+		close (bk_conn->backend_sock);
+		return;
+	}
+
+	ctx->hedge_tokens -= 1.0;
+	session->hedge_conn = bk_conn;
+	msg_info_session ("%s has not replied in %.3f seconds, send hedged request "
+			"to %s", rspamd_upstream_name (session->master_conn->up),
+			ctx->hedge_delay, rspamd_upstream_name (up));
+}
+
+static void
+proxy_backend_hedge_schedule (struct rspamd_proxy_session *session,
+		struct rspamd_http_upstream *backend)
+{
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+
+	if (ctx->hedge_percentile <= 0 || session->hedge_conn ||
+			ev_is_active (&session->hedge_ev) ||
+			rspamd_upstreams_alive (backend->u) < 2) {
+		return;
+	}
+
+	/* Every request earns a fraction of the hedged one */
+	ctx->hedge_tokens = MIN (ctx->hedge_tokens + ctx->hedge_budget,
+			PROXY_HEDGE_MAX_TOKENS);
+
+	session->hedge_ev.data = session;
+	ev_timer_init (&session->hedge_ev, proxy_backend_hedge_cb,
+			ctx->hedge_delay, 0.0);
+	ev_timer_start (ctx->event_loop, &session->hedge_ev);
+}
+
+static gboolean
+proxy_send_master_message (struct rspamd_proxy_session *session)
+{
 	struct rspamd_http_upstream *backend = NULL;
 	const rspamd_ftok_t *host;
-	GError *err = NULL;
 	gchar hostbuf[512];
 
 	host = rspamd_http_message_find_header (session->client_message, "Host");
@@ -1939,83 +2320,12 @@ retry:
 			goto retry;
 		}
 
-		msg = rspamd_http_connection_copy_msg (session->client_message, &err);
-		if (msg == NULL) {
-			msg_err_session ("cannot copy message to send it to the upstream: %e",
-					err);
-
-			if (err) {
-				g_error_free (err);
-			}
-
+		if (!proxy_backend_write_master (session, backend,
+				session->master_conn)) {
 			goto err; /* No fallback here */
 		}
 
-		session->master_conn->backend_conn = rspamd_http_connection_new_client_socket (
-				session->ctx->http_ctx,
-				NULL,
-				proxy_backend_master_error_handler,
-				proxy_backend_master_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				session->master_conn->backend_sock);
-		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
-		session->master_conn->parser_from_ref = backend->parser_from_ref;
-		session->master_conn->parser_to_ref = backend->parser_to_ref;
-
-		if (backend->key) {
-			msg->peer_key = rspamd_pubkey_ref (backend->key);
-		}
-
-		if (backend->settings_id != NULL) {
-			rspamd_http_message_remove_header (msg, "Settings-ID");
-			rspamd_http_message_add_header (msg, "Settings-ID",
-					backend->settings_id);
-		}
-
-		if (backend->local ||
-				rspamd_inet_address_is_local (
-						rspamd_upstream_addr_cur (
-								session->master_conn->up))) {
-
-			if (session->fname) {
-				rspamd_http_message_add_header (msg, "File", session->fname);
-			}
-
-			msg->method = HTTP_GET;
-
-			rspamd_http_connection_write_message_shared (
-					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
-					session->master_conn->timeout);
-		}
-		else {
-			if (session->fname) {
-				msg->flags &= ~RSPAMD_HTTP_FLAG_SHMEM;
-				rspamd_http_message_set_body (msg,
-						session->map, session->map_len);
-			}
-
-			msg->method = HTTP_POST;
-
-			if (backend->compress) {
-				proxy_request_compress (msg);
-				if (session->client_milter_conn) {
-					rspamd_http_message_add_header (msg, "Content-Type",
-							"application/octet-stream");
-				}
-			}
-			else {
-				if (session->client_milter_conn) {
-					rspamd_http_message_add_header (msg, "Content-Type",
-							"text/plain");
-				}
-			}
-
-			rspamd_http_connection_write_message (
-					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
-					session->master_conn->timeout);
-		}
+		proxy_backend_hedge_schedule (session, backend);
 	}
 
 	return TRUE;
@@ -2138,9 +2448,20 @@ proxy_milter_finish_handler (gint fd,
 					sizeof (*session->master_conn));
 		}
 
-		msg = rspamd_milter_to_http (rms);
 		session->master_conn->s = session;
 		session->master_conn->name = "master";
+
+		if (session->ctx->default_upstream &&
+				session->ctx->default_upstream->self_scan &&
+				session->ctx->mirrors->len == 0) {
+			/* Nothing needs HTTP message, so scan milter session directly */
+			session->backend = session->ctx->default_upstream;
+			rspamd_proxy_self_scan (session);
+
+			return;
+		}
+
+		msg = rspamd_milter_to_http (rms);
 		session->client_message = msg;
 
 		proxy_open_mirror_connections (session);
@@ -2376,7 +2697,7 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 	rspamd_milter_init_library (&ctx->milter_ctx);
 
 	if (is_controller) {
-		rspamd_worker_init_controller (worker, NULL);
+		rspamd_worker_init_controller (worker, NULL, NULL);
 	}
 	else {
 		if (ctx->has_self_scan) {
@@ -2393,6 +2714,18 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 			worker);
 	adjust_upstreams_limits (ctx);
 
+	if (ctx->hedge_percentile >= 1.0) {
+		msg_warn ("invalid hedge_percentile %.3f, disable hedging",
+				ctx->hedge_percentile);
+		ctx->hedge_percentile = 0;
+	}
+
+	if (ctx->hedge_percentile > 0) {
+		/* Start from a conservative delay, it is adjusted by replies */
+		ctx->hedge_delay = 1.0;
+		proxy_hedge_update_delay (ctx, FALSE);
+	}
+
 	ev_loop (ctx->event_loop, 0);
 	rspamd_worker_block_signals ();
 
@@ -2401,7 +2734,7 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 	}
 
 	if (is_controller) {
-		rspamd_controller_on_terminate (worker, NULL);
+		rspamd_controller_on_terminate (worker, NULL, NULL);
 	}
 
 	REF_RELEASE (ctx->cfg);
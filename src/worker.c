@@ -26,6 +26,7 @@
 #include "libserver/url.h"
 #include "libserver/dns.h"
 #include "libmime/message.h"
+#include "libmime/scan_result.h"
 #include "rspamd.h"
 #include "libstat/stat_api.h"
 #include "libserver/worker_util.h"
@@ -40,6 +41,16 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60.0
+/* Task pool chains kept for reuse and interval to trim unused ones */
+#define DEFAULT_POOL_CHAINS_CACHE 64
+#define POOL_TRIM_INTERVAL 30.0
+/* Idle time and requests limit for persistent connections */
+#define DEFAULT_KEEPALIVE_TIMEOUT 30.0
+#define DEFAULT_KEEPALIVE_REQUESTS 1000
+/* Session of a persistent connection, see rspamd_worker_keepalive */
+#define RSPAMD_MEMPOOL_WORKER_SESSION "worker_session"
+/* How often event loop lag is sampled for admission control */
+#define LOOP_LAG_INTERVAL 0.1
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
@@ -74,6 +85,13 @@ struct rspamd_worker_session {
 	struct rspamd_worker_ctx *ctx;
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_worker *worker;
+	guint nreqs;
+	ev_tstamp accepted;
+};
+
+struct rspamd_worker_inflight {
+	struct rspamd_worker_ctx *ctx;
+	GList link;
 };
 /*
  * Reduce number of tasks proceeded
@@ -102,6 +120,132 @@ reduce_tasks_count (gpointer arg)
 	}
 }
 
+static void
+rspamd_worker_inflight_remove (gpointer arg)
+{
+	struct rspamd_worker_inflight *inflight = arg;
+
+	g_queue_unlink (&inflight->ctx->inflight, &inflight->link);
+}
+
+/*
+ * Samples how late the event loop handles a timer, it grows when tasks
+ * perform blocking work (e.g. regexps) or there are too many events
+ */
+static void
+rspamd_worker_loop_lag (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker_ctx *ctx = (struct rspamd_worker_ctx *)w->data;
+	ev_tstamp lag;
+
+	lag = MAX (ev_time () - ctx->loop_lag_expected, 0);
+	ctx->loop_lag = (ctx->loop_lag + lag) / 2.0;
+	ctx->loop_lag_expected = ev_now (EV_A) + LOOP_LAG_INTERVAL;
+	ev_timer_again (EV_A_ w);
+}
+
+static void
+rspamd_worker_soft_reject_task (struct rspamd_task *task)
+{
+	struct rspamd_action *soft_reject;
+
+	soft_reject = rspamd_config_get_action_by_type (task->cfg,
+			METRIC_ACTION_SOFT_REJECT);
+	rspamd_add_passthrough_result (task, soft_reject, 0, NAN,
+			"server is overloaded", "admission control", 0, NULL);
+	task->flags |= RSPAMD_TASK_FLAG_SKIP;
+}
+
+/*
+ * Admission control: when the event loop lags or the oldest task in flight is
+ * older than `latency_target`, a new scan is likely to miss the client's
+ * timeout, so it is either processed with lightweight settings or soft
+ * rejected at once
+ */
+static void
+rspamd_worker_admit_task (struct rspamd_worker_ctx *ctx,
+		struct rspamd_task *task)
+{
+	struct rspamd_task *oldest;
+	ev_tstamp latency = ctx->loop_lag;
+
+	if (ctx->inflight.head) {
+		oldest = (struct rspamd_task *)ctx->inflight.head->data;
+		latency = MAX (latency, ev_now (ctx->event_loop) - oldest->task_timestamp);
+	}
+
+	if (latency <= ctx->latency_target) {
+		return;
+	}
+
+	if (ctx->shed_settings_id && task->settings == NULL &&
+			task->settings_elt == NULL) {
+		task->settings_elt = rspamd_config_find_settings_name_ref (task->cfg,
+				ctx->shed_settings_id, strlen (ctx->shed_settings_id));
+
+		if (task->settings_elt) {
+			msg_info_task ("latency %.3f is above target %.3f, scan with "
+					"settings id %s", latency, ctx->latency_target,
+					ctx->shed_settings_id);
+			task->worker->srv->stat->scans_fast_pathed ++;
+
+			return;
+		}
+	}
+
+	msg_info_task ("latency %.3f is above target %.3f, soft reject scan",
+			latency, ctx->latency_target);
+	rspamd_worker_soft_reject_task (task);
+	task->worker->srv->stat->scans_shed ++;
+}
+
+struct rspamd_worker_task_load {
+	struct rspamd_worker *worker;
+	gsize bytes;
+};
+
+static void
+rspamd_worker_task_load_release (gpointer arg)
+{
+	struct rspamd_worker_task_load *tl = arg;
+
+	rspamd_worker_load_update (tl->worker, -1, -((gint64)tl->bytes));
+}
+
+/*
+ * Host wide admission: every worker process of the host accounts its tasks
+ * in flight and their message sizes in shared memory, so a burst of large
+ * messages cannot make all workers parse them at once
+ */
+static gboolean
+rspamd_worker_admit_host_task (struct rspamd_worker_ctx *ctx,
+		struct rspamd_task *task)
+{
+	guint tasks;
+	guint64 bytes;
+
+	rspamd_worker_load_host (task->worker->srv, &tasks, &bytes);
+
+	if (ctx->max_host_tasks > 0 && tasks >= ctx->max_host_tasks) {
+		msg_info_task ("%ud tasks are in flight on host while maximum is %ud, "
+				"soft reject scan", tasks, ctx->max_host_tasks);
+
+		return FALSE;
+	}
+
+	/* A single message larger than the limit is still processed alone */
+	if (ctx->max_host_task_bytes > 0 && bytes > 0 &&
+			bytes + task->msg.len > ctx->max_host_task_bytes) {
+		msg_info_task ("%uL bytes are in flight on host, %z more would exceed "
+				"maximum of %z, soft reject scan", bytes, task->msg.len,
+				ctx->max_host_task_bytes);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static gint
 rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
@@ -132,6 +276,16 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 			debug_mempool);
 	session->task = task;
 
+	/*
+	 * Later requests of a persistent connection would count idle time since
+	 * the previous reply, so the request read time is known for the first
+	 * one only
+	 */
+	if (session->nreqs == 0) {
+		rspamd_task_timing_set (task, RSPAMD_TASK_TIMING_READ_BODY,
+				task->task_timestamp - session->accepted);
+	}
+
 	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
 			rspamd_inet_address_to_string (session->addr),
 			rspamd_inet_address_get_port (session->addr),
@@ -160,10 +314,27 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 			(rspamd_mempool_destruct_t)reduce_tasks_count,
 			session->worker);
 
+	if (ctx->latency_target > 0) {
+		struct rspamd_worker_inflight *inflight;
+
+		inflight = rspamd_mempool_alloc0 (task->task_pool, sizeof (*inflight));
+		inflight->ctx = ctx;
+		inflight->link.data = task;
+		g_queue_push_tail_link (&ctx->inflight, &inflight->link);
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_worker_inflight_remove, inflight);
+	}
+
 	/* Session memory is also now handled by task */
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t)g_free,
 			session);
+	session->nreqs ++;
+
+	if (ctx->keepalive) {
+		rspamd_mempool_set_variable (task->task_pool,
+				RSPAMD_MEMPOOL_WORKER_SESSION, session, NULL);
+	}
 
 	/* Set up async session */
 	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
@@ -185,6 +356,28 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
+	if ((ctx->max_host_tasks > 0 || ctx->max_host_task_bytes > 0) &&
+			!RSPAMD_TASK_IS_SKIPPED (task) &&
+			!rspamd_worker_admit_host_task (ctx, task)) {
+		rspamd_worker_soft_reject_task (task);
+		task->worker->srv->stat->scans_host_limited ++;
+	}
+
+	if (!RSPAMD_TASK_IS_SKIPPED (task)) {
+		struct rspamd_worker_task_load *tl;
+
+		tl = rspamd_mempool_alloc (task->task_pool, sizeof (*tl));
+		tl->worker = task->worker;
+		tl->bytes = task->msg.len;
+		rspamd_worker_load_update (tl->worker, 1, tl->bytes);
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_worker_task_load_release, tl);
+	}
+
+	if (ctx->latency_target > 0 && !RSPAMD_TASK_IS_SKIPPED (task)) {
+		rspamd_worker_admit_task (ctx, task);
+	}
+
 	/* Set global timeout for the task */
 	if (ctx->task_timeout > 0.0) {
 		task->timeout_ev.data = task;
@@ -282,8 +475,16 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info ("no data received from: %s, error: %e",
-				rspamd_inet_address_to_string_pretty (session->addr), err);
+		if (rspamd_http_connection_is_idle (session->http_conn)) {
+			msg_debug ("persistent connection from %s is closed after %ud requests",
+					rspamd_inet_address_to_string_pretty (session->addr),
+					session->nreqs);
+		}
+		else {
+			msg_info ("no data received from: %s, error: %e",
+					rspamd_inet_address_to_string_pretty (session->addr), err);
+		}
+
 		rspamd_http_connection_reset (session->http_conn);
 		rspamd_http_connection_unref (session->http_conn);
 		rspamd_inet_address_free (session->addr);
@@ -292,6 +493,72 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+/*
+ * Returns session if connection of a task can be reused for the next request
+ */
+static struct rspamd_worker_session *
+rspamd_worker_keepalive_session (struct rspamd_task *task)
+{
+	struct rspamd_worker_session *session;
+	struct rspamd_http_connection *conn = task->http_conn;
+	struct rspamd_worker_ctx *ctx;
+
+	if (conn == NULL || !rspamd_http_connection_is_keepalive (conn)) {
+		return NULL;
+	}
+
+	session = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_MEMPOOL_WORKER_SESSION);
+
+	if (session == NULL || session->worker->state != rspamd_worker_state_running) {
+		return NULL;
+	}
+
+	ctx = session->ctx;
+
+	if (ctx->keepalive_requests > 0 && session->nreqs >= ctx->keepalive_requests) {
+		return NULL;
+	}
+
+	return session;
+}
+
+/*
+ * Detaches connection from a replied task and waits for the next request on it
+ */
+static gboolean
+rspamd_worker_keepalive (struct rspamd_task *task)
+{
+	struct rspamd_worker_session *session;
+	struct rspamd_http_connection *conn = task->http_conn;
+	struct rspamd_worker_ctx *ctx;
+
+	session = rspamd_worker_keepalive_session (task);
+
+	if (session == NULL) {
+		return FALSE;
+	}
+
+	ctx = session->ctx;
+
+	/* Session, socket and connection are no longer owned by the task */
+	rspamd_mempool_replace_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)g_free, session, NULL);
+	session->addr = rspamd_inet_address_copy (task->client_addr);
+	session->task = NULL;
+	task->http_conn = NULL;
+	task->sock = -1;
+
+	msg_debug_task ("keep connection from %s alive",
+			rspamd_inet_address_to_string (task->client_addr));
+	rspamd_session_destroy (task->s);
+	/* We still hold the reference from the new_server call */
+	rspamd_http_connection_read_next_message (conn, session,
+			ctx->keepalive_timeout);
+
+	return TRUE;
+}
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -310,13 +577,28 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 
 	if (task) {
 		if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
+			if (task->times.reply_start > 0) {
+				rspamd_task_timing_set (task, RSPAMD_TASK_TIMING_WRITE_REPLY,
+						ev_time () - task->times.reply_start);
+			}
+
 			/* We are done here */
-			msg_debug_task ("normally closing connection from: %s",
-					rspamd_inet_address_to_string (task->client_addr));
-			rspamd_session_destroy (task->s);
+			if (!rspamd_worker_keepalive (task)) {
+				msg_debug_task ("normally closing connection from: %s",
+						rspamd_inet_address_to_string (task->client_addr));
+				rspamd_session_destroy (task->s);
+			}
 		}
-		else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
-			rspamd_session_pending (task->s);
+		else {
+			if (task->http_conn && rspamd_http_connection_is_keepalive (task->http_conn) &&
+					rspamd_worker_keepalive_session (task) == NULL) {
+				/* Tell client that this reply is the last one */
+				rspamd_http_connection_disable_keepalive (task->http_conn);
+			}
+
+			if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
+				rspamd_session_pending (task->s);
+			}
 		}
 	}
 	else {
@@ -371,11 +653,16 @@ accept_socket (EV_P_ ev_io *w, int revents)
 	session->fd = nfd;
 	session->ctx = ctx;
 	session->worker = worker;
+	session->accepted = ev_now (EV_A);
 
 	if (ctx->encrypted_only && !rspamd_inet_address_is_local (addr)) {
 		http_opts = RSPAMD_HTTP_REQUIRE_ENCRYPTION;
 	}
 
+	if (ctx->keepalive) {
+		http_opts |= RSPAMD_HTTP_SERVER_KEEP_ALIVE;
+	}
+
 	session->http_conn = rspamd_http_connection_new_server (
 			ctx->http_ctx,
 			nfd,
@@ -397,6 +684,12 @@ accept_socket (EV_P_ ev_io *w, int revents)
 			ctx->timeout);
 }
 
+static void
+rspamd_worker_pool_trim (EV_P_ ev_timer *w, int revents)
+{
+	rspamd_mempool_recycle_trim ();
+}
+
 gpointer
 init_worker (struct rspamd_config *cfg)
 {
@@ -412,6 +705,9 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = NAN;
+	ctx->pool_chains_cache = DEFAULT_POOL_CHAINS_CACHE;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+	ctx->keepalive_requests = DEFAULT_KEEPALIVE_REQUESTS;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -462,6 +758,92 @@ init_worker (struct rspamd_config *cfg)
 			RSPAMD_CL_FLAG_INT_32,
 			"Maximum count of parallel tasks processed by a single worker process");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_host_tasks",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						max_host_tasks),
+			RSPAMD_CL_FLAG_INT_32,
+			"Soft reject scans while all workers of the host process this "
+			"count of tasks, 0 to disable (default: 0)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_host_task_bytes",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						max_host_task_bytes),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Soft reject scans while all workers of the host process messages "
+			"of this total size, 0 to disable (default: 0)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"pool_chains_cache",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						pool_chains_cache),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of task memory pool chains kept for reuse, 0 to disable "
+			"(default: 64)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keepalive),
+			0,
+			"Keep HTTP/1.1 connections open between requests and accept "
+			"pipelined requests (default: false)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Idle timeout of a persistent connection (default: 30 seconds)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_requests",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						keepalive_requests),
+			RSPAMD_CL_FLAG_INT_32,
+			"Maximum number of requests per persistent connection, 0 for no "
+			"limit (default: 1000)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"latency_target",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						latency_target),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Do not admit new scans while event loop lag or the age of the "
+			"oldest task in flight is above this value, 0 to disable (default: 0)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"shed_settings_id",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						shed_settings_id),
+			0,
+			"Process not admitted scans with this settings id instead of "
+			"soft rejecting them");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"keypair",
@@ -544,21 +926,39 @@ start_worker (struct rspamd_worker *worker)
 	}
 
 	if (is_controller) {
-		rspamd_worker_init_controller (worker, NULL);
+		rspamd_worker_init_controller (worker, NULL, NULL);
 	}
 	else {
 		rspamd_map_watch (worker->srv->cfg, ctx->event_loop, ctx->resolver,
 				worker, RSPAMD_MAP_WATCH_SCANNER);
 	}
 
+	if (ctx->pool_chains_cache > 0) {
+		rspamd_mempool_recycle_init (ctx->pool_chains_cache);
+		ctx->pool_trim_ev.data = ctx;
+		ev_timer_init (&ctx->pool_trim_ev, rspamd_worker_pool_trim,
+				POOL_TRIM_INTERVAL, POOL_TRIM_INTERVAL);
+		ev_timer_start (ctx->event_loop, &ctx->pool_trim_ev);
+	}
+
+	if (ctx->latency_target > 0) {
+		g_queue_init (&ctx->inflight);
+		ctx->loop_lag_ev.data = ctx;
+		ctx->loop_lag_expected = ev_now (ctx->event_loop) + LOOP_LAG_INTERVAL;
+		ev_timer_init (&ctx->loop_lag_ev, rspamd_worker_loop_lag,
+				LOOP_LAG_INTERVAL, LOOP_LAG_INTERVAL);
+		ev_timer_start (ctx->event_loop, &ctx->loop_lag_ev);
+	}
+
 	rspamd_lua_run_postloads (ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
 			worker);
 
 	ev_loop (ctx->event_loop, 0);
 	rspamd_worker_block_signals ();
+	rspamd_mempool_recycle_init (0);
 
 	if (is_controller) {
-		rspamd_controller_on_terminate (worker, NULL);
+		rspamd_controller_on_terminate (worker, NULL, NULL);
 	}
 
 	rspamd_stat_close ();
@@ -47,6 +47,9 @@ struct rspamd_worker_ctx {
 	gboolean encrypted_only;
 	/* Limit of tasks */
 	guint32 max_tasks;
+	/* Limits of tasks and their message bytes for all workers of the host */
+	guint32 max_host_tasks;
+	gsize max_host_task_bytes;
 	/* Maximum time for task processing */
 	ev_tstamp task_timeout;
 	/* Encryption key */
@@ -55,6 +58,26 @@ struct rspamd_worker_ctx {
 	struct rspamd_http_context *http_ctx;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Number of task pool chains kept for reuse */
+	guint pool_chains_cache;
+	/* Trims unused cached pool chains */
+	ev_timer pool_trim_ev;
+	/* Allow persistent connections */
+	gboolean keepalive;
+	/* Idle timeout of persistent connections */
+	ev_tstamp keepalive_timeout;
+	/* Maximum requests per persistent connection */
+	guint32 keepalive_requests;
+	/* Scans are not admitted if latency is above this value */
+	ev_tstamp latency_target;
+	/* Settings id to process not admitted scans with instead of soft reject */
+	gchar *shed_settings_id;
+	/* Smoothed event loop lag */
+	ev_tstamp loop_lag;
+	ev_tstamp loop_lag_expected;
+	ev_timer loop_lag_ev;
+	/* Tasks in flight, oldest first */
+	GQueue inflight;
 };
 
 /*
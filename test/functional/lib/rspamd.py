@@ -152,6 +152,41 @@ def Scan_File(filename, **headers):
     BuiltIn().set_test_variable("${SCAN_RESULT}", d)
     return
 
+def Scan_File_Keepalive(filename, count, pipelined=False, connection=None):
+    addr = BuiltIn().get_variable_value("${LOCAL_ADDR}")
+    port = BuiltIn().get_variable_value("${PORT_NORMAL}")
+    qid = BuiltIn().get_variable_value("${TEST_NAME}")
+    body = open(filename, "rb").read()
+    count = int(count)
+    req = "POST /checkv2 HTTP/1.1\r\nHost: %s\r\nQueue-Id: %s\r\n" \
+        "Content-Length: %d\r\n" % (addr, qid, len(body))
+    if connection:
+        req += "Connection: %s\r\n" % connection
+    req = req.encode() + b"\r\n" + body
+    s = socket.create_connection((addr, int(port)), 10)
+    f = s.makefile("rb")
+    if pipelined:
+        s.sendall(req * count)
+    conn = []
+    for i in range(count):
+        if not pipelined:
+            s.sendall(req)
+        status = f.readline().split()
+        assert int(status[1]) == 200
+        hdrs = {}
+        while True:
+            line = f.readline().strip()
+            if not line:
+                break
+            k, v = line.decode().split(":", 1)
+            hdrs[k.strip().lower()] = v.strip()
+        d = demjson.decode(f.read(int(hdrs["content-length"])))
+        conn.append(hdrs.get("connection", "").lower())
+    f.close()
+    s.close()
+    BuiltIn().set_test_variable("${SCAN_RESULT}", d)
+    return ",".join(conn)
+
 def Send_SIGUSR1(pid):
     pid = int(pid)
     os.kill(pid, signal.SIGUSR1)
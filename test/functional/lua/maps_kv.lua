@@ -11,6 +11,11 @@ local map_map = rspamd_config:add_map ({
   type = 'map',
 })
 
+local suffix_map = rspamd_config:add_map ({
+  url = '${MAP_MAP}',
+  type = 'domain_suffix',
+})
+
 local regexp_map = rspamd_config:add_map ({
   url = '${REGEXP_MAP}',
   type = 'regexp',
@@ -68,3 +73,24 @@ rspamd_config:register_symbol({
     return true, 'no worry'
   end,
 })
+
+rspamd_config:register_symbol({
+  name = 'DOMAIN_SUFFIX_KV',
+  score = 1.0,
+  callback = function()
+    local str = {'foo', 'www.asdf.example.com', 'ASDF.Example.com.', 'a.b.asdf', 'example.com'}
+    local expected = {'bar', 'value', 'value', true, false}
+    local expected_suffix = {'foo', 'asdf.example.com', 'ASDF.Example.com', 'asdf'}
+    local batch = suffix_map:get_keys_batch(str)
+    for i = 1, #str do
+      local val,suffix = suffix_map:get_key(str[i])
+      if (val or false) ~= expected[i] or suffix ~= expected_suffix[i] then
+        return true, rspamd_logger.slog('get_key(%s) -> %s [%s] [expected %s [%s]]', str[i], val, suffix, expected[i], expected_suffix[i])
+      end
+      if batch[i] ~= expected[i] then
+        return true, rspamd_logger.slog('get_keys_batch(%s) -> %s [expected %s]', str[i], batch[i], expected[i])
+      end
+    end
+    return true, 'no worry'
+  end,
+})
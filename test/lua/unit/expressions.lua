@@ -96,6 +96,8 @@ context("Rspamd expressions", function()
     {'A * 2.0 + B + C', 3},
     {'A * 2.0 + B - C', 1},
     {'A / 2.0 + B - C', -0.5},
+    {'(B & C) | (D & E) | A', 1},
+    {'!(B | D) & (A | C)', 1},
   }
   for _,c in ipairs(cases) do
     test("Expression process function: " .. c[1], function()
@@ -109,4 +111,26 @@ context("Rspamd expressions", function()
           expr:to_string(), c[1], res, c[2]))
     end)
   end
+  -- Logical operations are not evaluated further once the result is known
+  cases = {
+    {'B & D & F', 0},
+    {'A | C | E', 1},
+  }
+  for _,c in ipairs(cases) do
+    test("Expression short circuit: " .. c[1], function()
+      local calls = 0
+      local function counting_func(token, input)
+        calls = calls + 1
+        return input[token]
+      end
+      local expr,err = rspamd_expression.create(c[1],
+          {parse_func, counting_func}, pool)
+
+      assert_not_nil(expr, "Cannot parse " .. c[1] .. '; error: ' .. (err or 'wut??'))
+      res = expr:process(atoms)
+      assert_equal(res, c[2])
+      assert_equal(calls, 1, string.format("Processed expr '%s' called %d atoms, expected: 1",
+          c[1], calls))
+    end)
+  end
 end)
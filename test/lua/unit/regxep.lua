@@ -59,6 +59,12 @@ context("Regexp unit tests", function()
     end
   end)
   
+  test("Regexp match vector", function()
+    local r = re.create_cached('/^\\d+$/')
+    local res = r:match_vector({'123', 'abc', '', '4', 'a1'})
+    assert_rspamd_table_eq({expect = {1, 4}, actual = res})
+  end)
+
   test("Regexp split", function()
     local cases = {
       {'\\s', 'one', {'one'}}, -- one arg
@@ -72,6 +72,14 @@ context("Rspamd util for lua - check generic functions", function()
         assert_equal(res["digits"], 2)
     end)
 
+    test("get_string_stats, text view", function()
+        local rspamd_text = require "rspamd_text"
+        local t = rspamd_text.fromstring("this is test 99 and more 123")
+        local res = util.get_string_stats(t:sub(1, 15))
+        assert_equal(res["letters"], 10)
+        assert_equal(res["digits"], 2)
+    end)
+
     for i,c in ipairs(cases) do
         test("is_utf_mixed_script, test case #" .. i, function()
           local actual = util.is_utf_mixed_script(c.input)
@@ -133,4 +141,45 @@ char ** rspamd_string_len_split (const char *in, size_t len,
             ffi.C.g_strfreev(ret)
         end)
     end
-end)
\ No newline at end of file
+
+    test("frozen tables", function()
+        local ft = util.freeze({
+            'a', 'b', 'c',
+            key = 'value',
+            [10] = true,
+            [1.5] = 2.5,
+            nested = { x = 1, list = { 'y', 'z' } },
+        })
+
+        assert_equal(#ft, 3)
+        assert_equal(ft[2], 'b')
+        assert_equal(ft.key, 'value')
+        assert_equal(ft[10], true)
+        assert_equal(ft[1.5], 2.5)
+        assert_equal(ft.nested.x, 1)
+        assert_equal(ft.nested.list[2], 'z')
+        assert_nil(ft.missing)
+        assert_nil(ft[4])
+
+        local keys = {}
+        for k,_ in util.frozen_pairs(ft) do
+            keys[#keys + 1] = tostring(k)
+        end
+        assert_rspamd_table_eq({
+            expect = {'1', '2', '3', '1.5', '10', 'key', 'nested'},
+            actual = keys
+        })
+
+        assert_false(pcall(util.freeze, { f = function() end }))
+    end)
+
+    test("clickhouse tsv row", function()
+        local rspamd_text = require 'rspamd_text'
+        local row = util.clickhouse_tsv_row({
+            'a\tb\n', 42, 1.5, { "x'y", 3 }, true, rspamd_text.fromstring('t\\'),
+        })
+
+        assert_equal(tostring(row),
+            "a\\tb\\n\t42\t1.5\t['x\\'y',3]\t1\tt\\\\")
+    end)
+end)
@@ -378,6 +378,14 @@ context("Selectors test", function()
       assert_rspamd_table_eq_sorted({actual = elts, expect = case.expect})
     end)
   end
+
+  test("cached selectors with shared prefix", function()
+    local first = check_selector('rcpts:addr.lower.sort')
+    local second = check_selector('rcpts:addr.lower')
+    local third = check_selector('rcpts:addr.lower.sort')
+    assert_rspamd_table_eq_sorted({actual = first, expect = third})
+    assert_rspamd_table_eq_sorted({actual = second, expect = first})
+  end)
 end)
 
 
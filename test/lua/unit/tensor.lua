@@ -0,0 +1,51 @@
+-- Tensor in place operations and views
+
+context("Tensor test", function()
+  local rspamd_tensor = require "rspamd_tensor"
+
+  local function to_table(t)
+    local res = {}
+    for i=1,#t do
+      res[i] = t[i]
+    end
+    return res
+  end
+
+  test("Add, scale and clamp in place", function()
+    local t = rspamd_tensor.fromtable({1, 2, 3, 4, 5, 6, 7, 8, 9})[1]
+    local other = rspamd_tensor.fromtable({1, 1, 1, 1, 1, 1, 1, 1, 1})[1]
+
+    t:add(other, 2):scale(0.5):add(-1)
+    assert_rspamd_table_eq({expect = {0.5, 1, 1.5, 2, 2.5, 3, 3.5, 4, 4.5},
+                            actual = to_table(t)})
+    t:clamp(1, 3)
+    assert_rspamd_table_eq({expect = {1, 1, 1.5, 2, 2.5, 3, 3, 3, 3},
+                            actual = to_table(t)})
+  end)
+
+  test("Row broadcast, normalize and dot", function()
+    local m = rspamd_tensor.fromtable({{3, 0}, {1, 4}})
+    m:add(rspamd_tensor.fromtable({0, -4})[1])
+    assert_rspamd_table_eq({expect = {3, -4}, actual = to_table(m[1])})
+
+    m:normalize()
+    assert_true(math.abs(m[1]:dot(m[1]) - 1.0) < 1e-6)
+    assert_true(math.abs(m[2]:dot(m[2]) - 1.0) < 1e-6)
+    assert_true(math.abs(m[1]:dot(m[2]) - 0.6) < 1e-6)
+  end)
+
+  test("Views share data", function()
+    local t = rspamd_tensor.fromtable({1, 2, 3, 4, 5})[1]
+    local v = t:view(2, 3)
+
+    assert_equal(#v, 3)
+    v:scale(10)
+    assert_rspamd_table_eq({expect = {1, 20, 30, 40, 5}, actual = to_table(t)})
+
+    local m = rspamd_tensor.fromtable({{1, 2}, {3, 4}, {5, 6}})
+    local rows = m:view(2)
+    rows:add(1)
+    assert_rspamd_table_eq({expect = {4, 5}, actual = to_table(m[2])})
+    assert_rspamd_table_eq({expect = {6, 7}, actual = to_table(rows[2])})
+  end)
+end)
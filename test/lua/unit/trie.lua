@@ -78,4 +78,34 @@ context("Trie search functions", function()
     end)
   end
 
+  test("Trie search, vector version", function()
+    local rspamd_text = require "rspamd_text"
+    local inputs = {}
+    for i,c in ipairs(cases) do
+      inputs[i] = i % 2 == 0 and rspamd_text.fromstring(c[1]) or c[1]
+    end
+
+    local match, found = trie:match_vector(inputs)
+    assert_true(found)
+
+    for i,c in ipairs(cases) do
+      assert_equal(c[2], match[i] ~= nil, tostring(c[2]) .. ' while matching ' .. c[1])
+
+      if match[i] then
+        local res = {}
+        for pat,hits in pairs(match[i]) do
+          for _,pos in ipairs(hits) do
+            table.insert(res, {pos, pat})
+          end
+        end
+        table.sort(c[3], cmp_tables)
+        table.sort(res, cmp_tables)
+        assert_rspamd_table_eq({
+          expect = c[3],
+          actual = res
+        })
+      end
+    end
+  end)
+
 end)
@@ -0,0 +1,759 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks of hot paths. Inputs are generated from a fixed seed, so
+ * numbers are comparable between commits on the same host; `-j` writes
+ * json suitable to track regressions.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libutil/util.h"
+#include "libutil/multipattern.h"
+#include "libutil/radix.h"
+#include "libserver/url.h"
+#include "libserver/html.h"
+#include "libserver/task.h"
+#include "libmime/message.h"
+#include "libstat/stat_api.h"
+#include "libstat/stat_internal.h"
+#include "libcryptobox/cryptobox.h"
+#include "contrib/libev/ev.h"
+#include "unix-std.h"
+
+struct rspamd_main *rspamd_main = NULL;
+struct ev_loop *event_loop = NULL;
+worker_t *workers[] = { NULL };
+
+static gboolean json = FALSE;
+static gchar *filter = NULL;
+static gdouble min_time = 0.5;
+static gint repeats = 5;
+
+static GOptionEntry entries[] =
+{
+	{ "json", 'j', 0, G_OPTION_ARG_NONE, &json,
+	  "Output json", NULL },
+	{ "bench", 'b', 0, G_OPTION_ARG_STRING, &filter,
+	  "Run benchmarks which names contain the specified string", NULL },
+	{ "time", 't', 0, G_OPTION_ARG_DOUBLE, &min_time,
+	  "Minimum time of a single run in seconds (0.5 by default)", NULL },
+	{ "repeats", 'r', 0, G_OPTION_ARG_INT, &repeats,
+	  "Number of runs of each benchmark (5 by default)", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+struct rspamd_bench_case {
+	const gchar *name;
+	gpointer (*setup) (GRand *rnd, struct rspamd_bench_case *bc);
+	void (*run) (gpointer ud);
+	void (*teardown) (gpointer ud);
+	/* Items and bytes processed by a single run call, set by setup */
+	guint items;
+	gsize bytes;
+};
+
+static const gchar *bench_words[] = {
+	"hello", "world", "mail", "message", "offer", "free", "money", "account",
+	"please", "verify", "password", "click", "here", "subscribe", "today",
+	"limited", "price", "order", "shipping", "invoice", "payment", "bank",
+	"security", "update", "customer", "service", "support", "delivery",
+};
+
+static void
+rspamd_bench_text (GString *out, GRand *rnd, gsize len, gboolean with_urls)
+{
+	guint n = 0;
+
+	while (out->len < len) {
+		if (with_urls && ++n % 40 == 0) {
+			rspamd_printf_gstring (out, "https://www.example%d.com/path/%d?q=%s ",
+					g_rand_int_range (rnd, 0, 1000), n,
+					bench_words[g_rand_int_range (rnd, 0,
+							G_N_ELEMENTS (bench_words))]);
+		}
+		else if (with_urls && n % 97 == 0) {
+			rspamd_printf_gstring (out, "user%d@example.org ", n);
+		}
+		else {
+			g_string_append (out, bench_words[g_rand_int_range (rnd, 0,
+					G_N_ELEMENTS (bench_words))]);
+			g_string_append_c (out, n % 15 == 0 ? '\n' : ' ');
+		}
+	}
+}
+
+static void
+rspamd_bench_html (GString *out, GRand *rnd, gsize len)
+{
+	GString *text = g_string_new (NULL);
+
+	g_string_append (out, "<html><head><title>Bench</title>"
+			"<style>p {color: red}</style></head><body>");
+
+	while (out->len < len) {
+		g_string_truncate (text, 0);
+		rspamd_bench_text (text, rnd, 200, FALSE);
+		rspamd_printf_gstring (out, "<div class=\"c%d\"><p>%v "
+				"<a href=\"https://example.com/%d\">link &amp; more</a></p>"
+				"<img src=\"cid:img%d\" width=\"1\" height=\"1\"></div>\n",
+				g_rand_int_range (rnd, 0, 10), text,
+				g_rand_int_range (rnd, 0, 1000), g_rand_int_range (rnd, 0, 10));
+	}
+
+	g_string_append (out, "</body></html>");
+	g_string_free (text, TRUE);
+}
+
+/* Memory pool: 1000 allocations of random sizes in a fresh pool */
+struct rspamd_bench_mempool {
+	gsize sizes[1000];
+};
+
+static gpointer
+rspamd_bench_mempool_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_mempool *b = g_malloc (sizeof (*b));
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (b->sizes); i ++) {
+		b->sizes[i] = g_rand_int_range (rnd, 8, 512);
+	}
+
+	return b;
+}
+
+static void
+rspamd_bench_mempool_run (gpointer ud)
+{
+	struct rspamd_bench_mempool *b = ud;
+	rspamd_mempool_t *pool;
+	guint i;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench", 0);
+
+	for (i = 0; i < G_N_ELEMENTS (b->sizes); i ++) {
+		memset (rspamd_mempool_alloc (pool, b->sizes[i]), 0, 8);
+	}
+
+	rspamd_mempool_delete (pool);
+}
+
+/* Generic input buffer */
+struct rspamd_bench_buf {
+	GString *in;
+	gpointer data;
+	gsize len;
+	guint found;
+};
+
+static void
+rspamd_bench_buf_teardown (gpointer ud)
+{
+	struct rspamd_bench_buf *b = ud;
+
+	g_string_free (b->in, TRUE);
+	g_free (b->data);
+	g_free (b);
+}
+
+/* Urls search in 16Kb of text */
+static gpointer
+rspamd_bench_url_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_buf *b = g_malloc0 (sizeof (*b));
+
+	b->in = g_string_new (NULL);
+	rspamd_bench_text (b->in, rnd, 16384, TRUE);
+
+	return b;
+}
+
+static gboolean
+rspamd_bench_url_cb (struct rspamd_url *url, gsize start_offset,
+		gsize end_offset, void *ud)
+{
+	struct rspamd_bench_buf *b = ud;
+
+	b->found ++;
+
+	return TRUE;
+}
+
+static void
+rspamd_bench_url_run (gpointer ud)
+{
+	struct rspamd_bench_buf *b = ud;
+	rspamd_mempool_t *pool;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench", 0);
+	rspamd_url_find_multiple (pool, b->in->str, b->in->len,
+			RSPAMD_URL_FIND_ALL, NULL, rspamd_bench_url_cb, b);
+	rspamd_mempool_delete (pool);
+}
+
+/* HTML parsing of 32Kb document */
+static gpointer
+rspamd_bench_html_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_buf *b = g_malloc0 (sizeof (*b));
+
+	b->in = g_string_new (NULL);
+	rspamd_bench_html (b->in, rnd, 32768);
+
+	return b;
+}
+
+static void
+rspamd_bench_html_run (gpointer ud)
+{
+	struct rspamd_bench_buf *b = ud;
+	rspamd_mempool_t *pool;
+	struct html_content *hc;
+	GByteArray *in, *res;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench", 0);
+	hc = rspamd_mempool_alloc0 (pool, sizeof (*hc));
+	in = g_byte_array_sized_new (b->in->len);
+	g_byte_array_append (in, b->in->str, b->in->len);
+
+	res = rspamd_html_process_part (pool, hc, in);
+
+	g_byte_array_free (res, TRUE);
+	g_byte_array_free (in, TRUE);
+	rspamd_mempool_delete (pool);
+}
+
+/* MIME parsing of a multipart message with text and html parts */
+static gpointer
+rspamd_bench_mime_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_buf *b = g_malloc0 (sizeof (*b));
+	GString *text = g_string_new (NULL), *html = g_string_new (NULL);
+
+	rspamd_bench_text (text, rnd, 8192, TRUE);
+	rspamd_bench_html (html, rnd, 16384);
+
+	b->in = g_string_new (NULL);
+	rspamd_printf_gstring (b->in,
+			"From: Sender <sender@example.com>\r\n"
+			"To: Recipient <rcpt@example.org>\r\n"
+			"Subject: Benchmark message\r\n"
+			"Message-ID: <bench@example.com>\r\n"
+			"Date: Mon, 1 Jan 2024 00:00:00 +0000\r\n"
+			"Received: from mx.example.com (mx.example.com [192.0.2.1])\r\n"
+			"\tby mx.example.org with ESMTP id bench\r\n"
+			"MIME-Version: 1.0\r\n"
+			"Content-Type: multipart/alternative; boundary=\"bench\"\r\n"
+			"\r\n"
+			"--bench\r\n"
+			"Content-Type: text/plain; charset=utf-8\r\n"
+			"\r\n"
+			"%v\r\n"
+			"--bench\r\n"
+			"Content-Type: text/html; charset=utf-8\r\n"
+			"\r\n"
+			"%v\r\n"
+			"--bench--\r\n", text, html);
+	bc->bytes = b->in->len;
+
+	g_string_free (text, TRUE);
+	g_string_free (html, TRUE);
+
+	return b;
+}
+
+static void
+rspamd_bench_mime_run (gpointer ud)
+{
+	struct rspamd_bench_buf *b = ud;
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL, event_loop,
+			FALSE);
+	task->msg.begin = b->in->str;
+	task->msg.len = b->in->len;
+	g_assert (rspamd_message_parse (task));
+	rspamd_task_free (task);
+}
+
+/* OSB tokenization of about 4000 words */
+struct rspamd_bench_osb {
+	GString *in;
+	rspamd_mempool_t *pool;
+	GArray *words;
+	struct rspamd_stat_ctx *st_ctx;
+};
+
+static gpointer
+rspamd_bench_osb_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_osb *b = g_malloc0 (sizeof (*b));
+
+	b->st_ctx = rspamd_stat_get_ctx ();
+	g_assert (b->st_ctx != NULL);
+
+	if (b->st_ctx->tokenizer == NULL) {
+		/* No classifiers in the default config, so use the default tokenizer */
+		b->st_ctx->tokenizer = rspamd_stat_get_tokenizer (RSPAMD_DEFAULT_TOKENIZER);
+		g_assert (b->st_ctx->tokenizer != NULL);
+		b->st_ctx->tkcf = b->st_ctx->tokenizer->get_config (
+				rspamd_main->cfg->cfg_pool, NULL, NULL);
+	}
+
+	b->in = g_string_new (NULL);
+	rspamd_bench_text (b->in, rnd, 4096 * 7, FALSE);
+	b->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench", 0);
+	b->words = rspamd_tokenize_text (b->in->str, b->in->len, NULL,
+			RSPAMD_TOKENIZE_RAW, rspamd_main->cfg, NULL, NULL, NULL, b->pool);
+	g_assert (b->words != NULL && b->words->len > 0);
+	bc->items = b->words->len;
+
+	return b;
+}
+
+static void
+rspamd_bench_osb_run (gpointer ud)
+{
+	struct rspamd_bench_osb *b = ud;
+	struct rspamd_task *task;
+	GPtrArray *tokens;
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL, event_loop,
+			FALSE);
+	tokens = g_ptr_array_sized_new (b->words->len * 5);
+	b->st_ctx->tokenizer->tokenize_func (b->st_ctx, task, b->words, FALSE,
+			NULL, tokens);
+	g_ptr_array_free (tokens, TRUE);
+	rspamd_task_free (task);
+}
+
+static void
+rspamd_bench_osb_teardown (gpointer ud)
+{
+	struct rspamd_bench_osb *b = ud;
+
+	g_array_free (b->words, TRUE);
+	rspamd_mempool_delete (b->pool);
+	g_string_free (b->in, TRUE);
+	g_free (b);
+}
+
+/* Multipattern: 1000 patterns over 16Kb of text */
+struct rspamd_bench_mp {
+	GString *in;
+	struct rspamd_multipattern *mp;
+	guint found;
+};
+
+static gint
+rspamd_bench_mp_cb (struct rspamd_multipattern *mp, guint strnum,
+		gint match_start, gint match_pos, const gchar *text, gsize len,
+		void *context)
+{
+	struct rspamd_bench_mp *b = context;
+
+	b->found ++;
+
+	return 0;
+}
+
+static gpointer
+rspamd_bench_mp_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_mp *b = g_malloc0 (sizeof (*b));
+	GError *err = NULL;
+	gchar pat[64];
+	guint i;
+
+	b->in = g_string_new (NULL);
+	rspamd_bench_text (b->in, rnd, 16384, TRUE);
+	b->mp = rspamd_multipattern_create_sized (1000 + G_N_ELEMENTS (bench_words),
+			RSPAMD_MULTIPATTERN_ICASE);
+
+	for (i = 0; i < G_N_ELEMENTS (bench_words); i ++) {
+		rspamd_multipattern_add_pattern (b->mp, bench_words[i], 0);
+	}
+
+	for (i = 0; i < 1000; i ++) {
+		rspamd_snprintf (pat, sizeof (pat), "%s%ud%s",
+				bench_words[g_rand_int_range (rnd, 0, G_N_ELEMENTS (bench_words))],
+				i,
+				bench_words[g_rand_int_range (rnd, 0, G_N_ELEMENTS (bench_words))]);
+		rspamd_multipattern_add_pattern (b->mp, pat, 0);
+	}
+
+	if (!rspamd_multipattern_compile (b->mp, &err)) {
+		g_error ("cannot compile multipattern: %s", err->message);
+	}
+
+	return b;
+}
+
+static void
+rspamd_bench_mp_run (gpointer ud)
+{
+	struct rspamd_bench_mp *b = ud;
+
+	rspamd_multipattern_lookup (b->mp, b->in->str, b->in->len,
+			rspamd_bench_mp_cb, b, NULL);
+}
+
+static void
+rspamd_bench_mp_teardown (gpointer ud)
+{
+	struct rspamd_bench_mp *b = ud;
+
+	rspamd_multipattern_destroy (b->mp);
+	g_string_free (b->in, TRUE);
+	g_free (b);
+}
+
+/* Radix: 1024 lookups in a tree of 10000 IPv4 networks */
+struct rspamd_bench_radix {
+	radix_compressed_t *tree;
+	rspamd_inet_addr_t *addrs[1024];
+	guint found;
+};
+
+static gpointer
+rspamd_bench_radix_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_radix *b = g_malloc0 (sizeof (*b));
+	GString *list = g_string_new (NULL);
+	gchar addr[64];
+	guint32 ip;
+	guint i;
+
+	b->tree = radix_create_compressed ("bench");
+
+	for (i = 0; i < 10000; i ++) {
+		ip = g_rand_int (rnd);
+		rspamd_printf_gstring (list, "%ud.%ud.%ud.0/%ud,",
+				ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff,
+				g_rand_int_range (rnd, 8, 25));
+	}
+
+	rspamd_radix_add_iplist (list->str, ",", b->tree, GINT_TO_POINTER (1),
+			FALSE, "bench");
+	radix_compile_compressed (b->tree);
+
+	for (i = 0; i < G_N_ELEMENTS (b->addrs); i ++) {
+		ip = g_rand_int (rnd);
+		rspamd_snprintf (addr, sizeof (addr), "%ud.%ud.%ud.%ud",
+				ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+		g_assert (rspamd_parse_inet_address (&b->addrs[i], addr, strlen (addr),
+				RSPAMD_INET_ADDRESS_PARSE_DEFAULT));
+	}
+
+	g_string_free (list, TRUE);
+
+	return b;
+}
+
+static void
+rspamd_bench_radix_run (gpointer ud)
+{
+	struct rspamd_bench_radix *b = ud;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (b->addrs); i ++) {
+		if (radix_find_compressed_addr (b->tree, b->addrs[i]) != RADIX_NO_VALUE) {
+			b->found ++;
+		}
+	}
+}
+
+static void
+rspamd_bench_radix_teardown (gpointer ud)
+{
+	struct rspamd_bench_radix *b = ud;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (b->addrs); i ++) {
+		rspamd_inet_address_free (b->addrs[i]);
+	}
+
+	radix_destroy_compressed (b->tree);
+	g_free (b);
+}
+
+/* Base64 decoding of 64Kb of data */
+static gpointer
+rspamd_bench_base64_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_buf *b = g_malloc0 (sizeof (*b));
+	guchar raw[49152];
+	gchar *enc;
+	gsize enclen;
+	guint i;
+
+	for (i = 0; i < sizeof (raw); i ++) {
+		raw[i] = g_rand_int (rnd) & 0xff;
+	}
+
+	enc = rspamd_encode_base64 (raw, sizeof (raw), 0, &enclen);
+	b->in = g_string_new_len (enc, enclen);
+	g_free (enc);
+	b->data = g_malloc (enclen);
+	bc->bytes = enclen;
+
+	return b;
+}
+
+static void
+rspamd_bench_base64_run (gpointer ud)
+{
+	struct rspamd_bench_buf *b = ud;
+	gsize outlen = b->in->len;
+
+	g_assert (rspamd_cryptobox_base64_decode (b->in->str, b->in->len,
+			b->data, &outlen));
+}
+
+/* Cryptobox authenticated encryption of 4Kb block */
+struct rspamd_bench_crypto {
+	rspamd_nm_t nm;
+	rspamd_nonce_t nonce;
+	rspamd_mac_t mac;
+	guchar data[4096];
+};
+
+static gpointer
+rspamd_bench_crypto_setup (GRand *rnd, struct rspamd_bench_case *bc)
+{
+	struct rspamd_bench_crypto *b = g_malloc0 (sizeof (*b));
+	rspamd_pk_t pk;
+	rspamd_sk_t sk;
+	guint i;
+
+	rspamd_cryptobox_keypair (pk, sk, RSPAMD_CRYPTOBOX_MODE_25519);
+	rspamd_cryptobox_nm (b->nm, pk, sk, RSPAMD_CRYPTOBOX_MODE_25519);
+
+	for (i = 0; i < sizeof (b->data); i ++) {
+		b->data[i] = g_rand_int (rnd) & 0xff;
+	}
+
+	return b;
+}
+
+static void
+rspamd_bench_crypto_run (gpointer ud)
+{
+	struct rspamd_bench_crypto *b = ud;
+
+	rspamd_cryptobox_encrypt_nm_inplace (b->data, sizeof (b->data),
+			b->nonce, b->nm, b->mac, RSPAMD_CRYPTOBOX_MODE_25519);
+}
+
+static struct rspamd_bench_case bench_cases[] = {
+	{"mempool_alloc", rspamd_bench_mempool_setup, rspamd_bench_mempool_run,
+			g_free, 1000, 0},
+	{"url_find_multiple", rspamd_bench_url_setup, rspamd_bench_url_run,
+			rspamd_bench_buf_teardown, 1, 16384},
+	{"html_parse", rspamd_bench_html_setup, rspamd_bench_html_run,
+			rspamd_bench_buf_teardown, 1, 32768},
+	{"mime_parse", rspamd_bench_mime_setup, rspamd_bench_mime_run,
+			rspamd_bench_buf_teardown, 1, 0},
+	{"osb_tokenize", rspamd_bench_osb_setup, rspamd_bench_osb_run,
+			rspamd_bench_osb_teardown, 0, 0},
+	{"multipattern_lookup", rspamd_bench_mp_setup, rspamd_bench_mp_run,
+			rspamd_bench_mp_teardown, 1, 16384},
+	{"radix_match", rspamd_bench_radix_setup, rspamd_bench_radix_run,
+			rspamd_bench_radix_teardown, 1024, 0},
+	{"base64_decode", rspamd_bench_base64_setup, rspamd_bench_base64_run,
+			rspamd_bench_buf_teardown, 1, 0},
+	{"cryptobox_encrypt", rspamd_bench_crypto_setup, rspamd_bench_crypto_run,
+			g_free, 1, 4096},
+};
+
+static gint
+rspamd_bench_double_cmp (gconstpointer a, gconstpointer b)
+{
+	gdouble da = *(const gdouble *)a, db = *(const gdouble *)b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static ucl_object_t *
+rspamd_bench_run_case (struct rspamd_bench_case *bc)
+{
+	GRand *rnd;
+	gpointer ud;
+	gdouble t1, t2, *runs;
+	guint64 iters = 1, i;
+	ucl_object_t *res;
+	gint r;
+
+	rnd = g_rand_new_with_seed (0x7ab1e5);
+	ud = bc->setup (rnd, bc);
+
+	/* Warm up and find the number of iterations that takes `min_time` */
+	for (;;) {
+		t1 = rspamd_get_ticks (FALSE);
+
+		for (i = 0; i < iters; i ++) {
+			bc->run (ud);
+		}
+
+		t2 = rspamd_get_ticks (FALSE);
+
+		if (t2 - t1 >= min_time || iters >= G_MAXUINT32) {
+			break;
+		}
+
+		if (t2 - t1 < min_time / 100.0) {
+			iters *= 10;
+		}
+		else {
+			iters = iters * min_time / (t2 - t1) + 1;
+		}
+	}
+
+	runs = g_malloc (sizeof (gdouble) * repeats);
+
+	for (r = 0; r < repeats; r ++) {
+		t1 = rspamd_get_ticks (FALSE);
+
+		for (i = 0; i < iters; i ++) {
+			bc->run (ud);
+		}
+
+		t2 = rspamd_get_ticks (FALSE);
+		runs[r] = (t2 - t1) * 1e9 / iters;
+	}
+
+	qsort (runs, repeats, sizeof (gdouble), rspamd_bench_double_cmp);
+
+	res = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (res, ucl_object_fromstring (bc->name),
+			"name", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (iters),
+			"iterations", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromdouble (runs[0]),
+			"ns_per_op", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromdouble (runs[repeats / 2]),
+			"ns_per_op_median", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromdouble (runs[repeats - 1]),
+			"ns_per_op_max", 0, false);
+
+	if (bc->items > 1) {
+		ucl_object_insert_key (res,
+				ucl_object_fromdouble (runs[0] / bc->items),
+				"ns_per_item", 0, false);
+	}
+
+	if (bc->bytes > 0) {
+		ucl_object_insert_key (res,
+				ucl_object_fromdouble (bc->bytes * 1e3 / runs[0]),
+				"mb_per_sec", 0, false);
+	}
+
+	bc->teardown (ud);
+	g_rand_free (rnd);
+	g_free (runs);
+
+	return res;
+}
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	GOptionContext *context;
+	GError *error = NULL;
+	ucl_object_t *top, *ar, *res;
+	const ucl_object_t *elt;
+	guint i;
+
+	context = g_option_context_new ("- run rspamd microbenchmarks");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_option_context_free (context);
+		exit (1);
+	}
+
+	g_option_context_free (context);
+
+	if (repeats <= 0) {
+		repeats = 1;
+	}
+
+	rspamd_main = (struct rspamd_main *)g_malloc0 (sizeof (struct rspamd_main));
+	rspamd_main->server_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			NULL, 0);
+	cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
+	cfg->libs_ctx = rspamd_init_libs ();
+	rspamd_main->cfg = cfg;
+	cfg->cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL, 0);
+	rspamd_main->logger = rspamd_log_open_emergency (rspamd_main->server_pool,
+			RSPAMD_LOG_FLAG_RSPAMADM);
+	rspamd_log_set_log_level (rspamd_main->logger, G_LOG_LEVEL_WARNING);
+
+	event_loop = ev_default_loop (EVFLAG_SIGNALFD|EVBACKEND_ALL);
+	rspamd_stat_init (cfg, event_loop);
+	rspamd_url_init (NULL);
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromstring (RVERSION),
+			"version", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromstring (RID),
+			"release", 0, false);
+	ar = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < G_N_ELEMENTS (bench_cases); i ++) {
+		if (filter && strstr (bench_cases[i].name, filter) == NULL) {
+			continue;
+		}
+
+		res = rspamd_bench_run_case (&bench_cases[i]);
+
+		if (!json) {
+			rspamd_printf ("%-24s %12.1f ns/op (median %.1f, max %.1f)",
+					bench_cases[i].name,
+					ucl_object_todouble (ucl_object_lookup (res, "ns_per_op")),
+					ucl_object_todouble (ucl_object_lookup (res, "ns_per_op_median")),
+					ucl_object_todouble (ucl_object_lookup (res, "ns_per_op_max")));
+
+			if ((elt = ucl_object_lookup (res, "ns_per_item")) != NULL) {
+				rspamd_printf (", %.1f ns/item", ucl_object_todouble (elt));
+			}
+
+			if ((elt = ucl_object_lookup (res, "mb_per_sec")) != NULL) {
+				rspamd_printf (", %.1f MB/s", ucl_object_todouble (elt));
+			}
+
+			rspamd_printf ("\n");
+		}
+
+		ucl_array_append (ar, res);
+	}
+
+	ucl_object_insert_key (top, ar, "benchmarks", 0, false);
+
+	if (json) {
+		rspamd_fstring_t *out = rspamd_fstring_new ();
+
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON, &out);
+		rspamd_printf ("%V\n", out);
+		rspamd_fstring_free (out);
+	}
+
+	ucl_object_unref (top);
+
+	return 0;
+}
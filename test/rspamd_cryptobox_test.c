@@ -19,11 +19,13 @@
 #include "fstring.h"
 #include "ottery.h"
 #include "cryptobox.h"
+#include "chacha20/chacha.h"
 #include "unix-std.h"
 
 static const int mapping_size = 64 * 8192 + 1;
 static const int max_seg = 32;
 static const int random_fuzz_cnt = 10000;
+static const int throughput_cnt = 32;
 enum rspamd_cryptobox_mode mode = RSPAMD_CRYPTOBOX_MODE_25519;
 
 static void *
@@ -152,6 +154,150 @@ create_constrainted_split (struct rspamd_cryptobox_segment *seg, int mseg,
 	return used;
 }
 
+/* Exported by libcryptobox, used as a reference for the selected impl */
+void chacha_ref (const chacha_key *key, const chacha_iv *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds);
+
+static double
+throughput (gsize len, double t1, double t2)
+{
+	return (double)len * throughput_cnt / (t2 - t1) / (1024.0 * 1024.0);
+}
+
+static void
+check_chacha_impl (gsize total)
+{
+	chacha_key key;
+	chacha_iv iv;
+	guchar *in, *out, *expected;
+	gsize len;
+	double t1, t2;
+	gint i;
+
+	ottery_rand_bytes (key.b, sizeof (key.b));
+	ottery_rand_bytes (iv.b, sizeof (iv.b));
+	in = g_malloc (total);
+	out = g_malloc (total);
+	expected = g_malloc (total);
+	ottery_rand_bytes (in, total);
+
+	/* All lengths around the widest (16 blocks) stride and some random ones */
+	for (i = 0; i < 2200 + random_fuzz_cnt / 10; i ++) {
+		len = i < 2200 ? (gsize)i : ottery_rand_range (total - 1) + 1;
+
+		chacha_ref (&key, &iv, in, expected, len, 20);
+		chacha (&key, &iv, in, out, len, 20);
+		g_assert (memcmp (out, expected, len) == 0);
+		/* Keystream only */
+		chacha_ref (&key, &iv, NULL, expected, len, 20);
+		chacha (&key, &iv, NULL, out, len, 20);
+		g_assert (memcmp (out, expected, len) == 0);
+	}
+
+	t1 = rspamd_get_ticks (TRUE);
+
+	for (i = 0; i < throughput_cnt; i ++) {
+		chacha_ref (&key, &iv, in, out, total, 20);
+	}
+
+	t2 = rspamd_get_ticks (TRUE);
+	msg_info ("chacha20 generic throughput: %.1f MB/s",
+			throughput (total, t1, t2));
+
+	t1 = rspamd_get_ticks (TRUE);
+
+	for (i = 0; i < throughput_cnt; i ++) {
+		chacha (&key, &iv, in, out, total, 20);
+	}
+
+	t2 = rspamd_get_ticks (TRUE);
+	msg_info ("chacha20 %s throughput: %.1f MB/s", chacha_load (),
+			throughput (total, t1, t2));
+
+	g_free (in);
+	g_free (out);
+	g_free (expected);
+}
+
+static void
+check_nm_batch (void)
+{
+	rspamd_pk_t pks[8], lpk;
+	rspamd_sk_t sks[8], lsk;
+	rspamd_nm_t nms[8], expected;
+	guchar *nmp[8];
+	const guchar *pkp[8], *skp[8];
+	gint i;
+
+	rspamd_cryptobox_keypair (lpk, lsk, RSPAMD_CRYPTOBOX_MODE_25519);
+
+	for (i = 0; i < 8; i ++) {
+		/* Some pairs are repeated */
+		if (i % 3 == 2) {
+			memcpy (pks[i], pks[i - 1], sizeof (pks[i]));
+		}
+		else {
+			rspamd_cryptobox_keypair (pks[i], sks[i],
+					RSPAMD_CRYPTOBOX_MODE_25519);
+		}
+
+		/* The last pair uses its own local key */
+		if (i != 7) {
+			memcpy (sks[i], lsk, sizeof (sks[i]));
+		}
+
+		nmp[i] = nms[i];
+		pkp[i] = pks[i];
+		skp[i] = sks[i];
+	}
+
+	rspamd_cryptobox_nm_batch (nmp, pkp, skp, 8, RSPAMD_CRYPTOBOX_MODE_25519);
+
+	for (i = 0; i < 8; i ++) {
+		rspamd_cryptobox_nm (expected, pks[i], sks[i],
+				RSPAMD_CRYPTOBOX_MODE_25519);
+		g_assert (memcmp (expected, nms[i], sizeof (expected)) == 0);
+	}
+}
+
+static void
+check_fast_hash (void)
+{
+	guchar upper[1024], lower[1024];
+	rspamd_cryptobox_fast_hash_state_t st, st_lc;
+	gsize len;
+	guint64 h;
+	gint i;
+
+	ottery_rand_bytes (lower, sizeof (lower));
+
+	for (i = 0; i < (gint)sizeof (lower); i ++) {
+		lower[i] = 'a' + lower[i] % 26;
+		upper[i] = g_ascii_toupper (lower[i]);
+	}
+
+	for (len = 0; len <= sizeof (lower); len ++) {
+		h = rspamd_cryptobox_fast_hash_lc (upper, len, len);
+		g_assert (h == rspamd_cryptobox_fast_hash_lc (lower, len, len));
+
+		if (len <= 256) {
+			/* Short strings are hashed at once */
+			g_assert (h == rspamd_cryptobox_fast_hash (lower, len, len));
+		}
+
+		rspamd_cryptobox_fast_hash_init (&st, len);
+		rspamd_cryptobox_fast_hash_update (&st, lower, len);
+		rspamd_cryptobox_fast_hash_init (&st_lc, len);
+		rspamd_cryptobox_fast_hash_update_lc (&st_lc, upper, len);
+		g_assert (rspamd_cryptobox_fast_hash_final (&st) ==
+				rspamd_cryptobox_fast_hash_final (&st_lc));
+	}
+
+	msg_info ("fast hash implementation: %s",
+			rspamd_cryptobox_fast_hash_impl ());
+}
+
 void
 rspamd_cryptobox_test_func (void)
 {
@@ -173,6 +319,23 @@ rspamd_cryptobox_test_func (void)
 	memset (mac, 0, sizeof (mac));
 	seg = g_slice_alloc0 (sizeof (*seg) * max_seg * 10);
 
+	check_chacha_impl (mapping_size);
+	check_nm_batch ();
+	check_fast_hash ();
+
+	/* Throughput of chacha20-poly1305 */
+	t1 = rspamd_get_ticks (TRUE);
+
+	for (i = 0; i < throughput_cnt; i ++) {
+		rspamd_cryptobox_encrypt_nm_inplace (begin, end - begin, nonce, key,
+				mac, mode);
+	}
+
+	t2 = rspamd_get_ticks (TRUE);
+	msg_info ("chacha20-poly1305 throughput: %.1f MB/s",
+			throughput (end - begin, t1, t2));
+	memset (begin, 0, end - begin);
+
 	/* Test baseline */
 	t1 = rspamd_get_ticks (TRUE);
 	rspamd_cryptobox_encrypt_nm_inplace (begin, end - begin, nonce, key, mac,
@@ -0,0 +1,207 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tests.h"
+#include "rspamd.h"
+#include "libserver/fuzzy_wire.h"
+#include "libserver/fuzzy_backend/fuzzy_backend.h"
+#include "unix-std.h"
+
+/* Storage has 64 digest slots, so it is full with 48 hashes */
+#define FUZZY_MEMORY_TEST_SIZE 64
+#define FUZZY_MEMORY_TEST_HASHES 40
+#define FUZZY_MEMORY_TEST_ROUNDS 32
+
+extern struct ev_loop *event_loop;
+
+static void
+rspamd_fuzzy_memory_test_cmd (struct fuzzy_peer_cmd *io_cmd, guint cmd,
+		guint n, gboolean shingles)
+{
+	struct rspamd_fuzzy_cmd *basic;
+	guint i;
+
+	memset (io_cmd, 0, sizeof (*io_cmd));
+	basic = &io_cmd->cmd.normal;
+
+	if (shingles) {
+		io_cmd->is_shingle = TRUE;
+		basic = &io_cmd->cmd.shingle.basic;
+		basic->shingles_count = RSPAMD_SHINGLE_SIZE;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			io_cmd->cmd.shingle.sgl.hashes[i] = ((guint64)n << 8) + i;
+		}
+	}
+
+	basic->version = RSPAMD_FUZZY_VERSION;
+	basic->cmd = cmd;
+	basic->flag = 1;
+	basic->value = 1;
+	rspamd_cryptobox_hash ((guchar *)basic->digest, (const guchar *)&n,
+			sizeof (n), NULL, 0);
+}
+
+static void
+rspamd_fuzzy_memory_test_update (struct rspamd_fuzzy_backend *bk,
+		struct fuzzy_peer_cmd *io_cmd, guint cnt)
+{
+	GArray *updates;
+
+	updates = g_array_sized_new (FALSE, FALSE, sizeof (*io_cmd), cnt);
+	g_array_append_vals (updates, io_cmd, cnt);
+	rspamd_fuzzy_backend_process_updates (bk, updates, "test", NULL, NULL);
+	g_array_free (updates, TRUE);
+}
+
+static void
+rspamd_fuzzy_memory_test_check_cb (struct rspamd_fuzzy_reply *rep, void *ud)
+{
+	memcpy (ud, rep, sizeof (*rep));
+}
+
+static void
+rspamd_fuzzy_memory_test_count_cb (guint64 count, void *ud)
+{
+	*(guint64 *)ud = count;
+}
+
+static gboolean
+rspamd_fuzzy_memory_test_found (struct rspamd_fuzzy_backend *bk,
+		struct fuzzy_peer_cmd *io_cmd, struct rspamd_fuzzy_reply *rep)
+{
+	memset (rep, 0, sizeof (*rep));
+	rspamd_fuzzy_backend_check (bk, &io_cmd->cmd.normal,
+			rspamd_fuzzy_memory_test_check_cb, rep);
+
+	return rep->v1.prob > 0.5;
+}
+
+void
+rspamd_fuzzy_memory_test_func (void)
+{
+	struct rspamd_fuzzy_backend *bk, *expired_bk;
+	struct fuzzy_peer_cmd io_cmd, cmds[FUZZY_MEMORY_TEST_HASHES];
+	struct rspamd_fuzzy_reply rep;
+	ucl_object_t *obj;
+	GError *err = NULL;
+	gchar *path;
+	guint64 count;
+	guint i, j;
+	gint fd;
+
+	path = g_strdup_printf ("%s/rspamd_fuzzy_memory_XXXXXX", g_get_tmp_dir ());
+	fd = mkstemp (path);
+	g_assert (fd != -1);
+	close (fd);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring ("memory"),
+			"backend", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (path),
+			"hashfile", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (FUZZY_MEMORY_TEST_SIZE),
+			"size", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (3600.0),
+			"expire", 0, false);
+	bk = rspamd_fuzzy_backend_create (event_loop, obj, NULL, &err);
+	g_assert_no_error (err);
+	g_assert (bk != NULL);
+
+	/* Insert and lookup by digest and by shingles */
+	rspamd_fuzzy_memory_test_cmd (&io_cmd, FUZZY_WRITE, 0, TRUE);
+	io_cmd.cmd.shingle.basic.value = 10;
+	rspamd_fuzzy_memory_test_update (bk, &io_cmd, 1);
+	io_cmd.cmd.shingle.basic.value = 5;
+	rspamd_fuzzy_memory_test_update (bk, &io_cmd, 1);
+
+	io_cmd.cmd.shingle.basic.cmd = FUZZY_CHECK;
+	g_assert (rspamd_fuzzy_memory_test_found (bk, &io_cmd, &rep));
+	g_assert (rep.v1.value == 15 && rep.v1.flag == 1);
+
+	/* Another digest with the same shingles */
+	io_cmd.cmd.shingle.basic.digest[0] ^= 0xff;
+	g_assert (rspamd_fuzzy_memory_test_found (bk, &io_cmd, &rep));
+	io_cmd.cmd.shingle.basic.digest[0] ^= 0xff;
+	g_assert (memcmp (rep.digest, io_cmd.cmd.shingle.basic.digest,
+			sizeof (rep.digest)) == 0);
+
+	rspamd_fuzzy_backend_count (bk, rspamd_fuzzy_memory_test_count_cb, &count);
+	g_assert (count == 1);
+
+	/* Delete invalidates both the digest and its shingles */
+	io_cmd.cmd.shingle.basic.cmd = FUZZY_DEL;
+	rspamd_fuzzy_memory_test_update (bk, &io_cmd, 1);
+	io_cmd.cmd.shingle.basic.cmd = FUZZY_CHECK;
+	g_assert (!rspamd_fuzzy_memory_test_found (bk, &io_cmd, &rep));
+	io_cmd.cmd.shingle.basic.digest[0] ^= 0xff;
+	g_assert (!rspamd_fuzzy_memory_test_found (bk, &io_cmd, &rep));
+
+	rspamd_fuzzy_backend_count (bk, rspamd_fuzzy_memory_test_count_cb, &count);
+	g_assert (count == 0);
+
+	/*
+	 * Tombstones count towards the load factor, so without compaction
+	 * storage would be full after a couple of rounds
+	 */
+	for (i = 0; i < FUZZY_MEMORY_TEST_ROUNDS; i ++) {
+		for (j = 0; j < FUZZY_MEMORY_TEST_HASHES; j ++) {
+			rspamd_fuzzy_memory_test_cmd (&cmds[j], FUZZY_WRITE,
+					i * FUZZY_MEMORY_TEST_HASHES + j + 1, j % 2 == 0);
+		}
+
+		rspamd_fuzzy_memory_test_update (bk, cmds, FUZZY_MEMORY_TEST_HASHES);
+
+		for (j = 0; j < FUZZY_MEMORY_TEST_HASHES; j ++) {
+			g_assert (rspamd_fuzzy_memory_test_found (bk, &cmds[j], &rep));
+			cmds[j].cmd.normal.cmd = FUZZY_DEL;
+		}
+
+		rspamd_fuzzy_memory_test_update (bk, cmds, FUZZY_MEMORY_TEST_HASHES);
+
+		for (j = 0; j < FUZZY_MEMORY_TEST_HASHES; j ++) {
+			g_assert (!rspamd_fuzzy_memory_test_found (bk, &cmds[j], &rep));
+		}
+
+		/* Runs expire and compaction */
+		rspamd_fuzzy_backend_start_update (bk, 3600.0, NULL, NULL);
+	}
+
+	rspamd_fuzzy_backend_count (bk, rspamd_fuzzy_memory_test_count_cb, &count);
+	g_assert (count == 0);
+
+	/* Expire from another backend sharing the same storage */
+	rspamd_fuzzy_memory_test_cmd (&io_cmd, FUZZY_WRITE, 0, TRUE);
+	rspamd_fuzzy_memory_test_update (bk, &io_cmd, 1);
+	g_assert (rspamd_fuzzy_memory_test_found (bk, &io_cmd, &rep));
+
+	ucl_object_replace_key (obj, ucl_object_fromdouble (-1.0),
+			"expire", 0, false);
+	expired_bk = rspamd_fuzzy_backend_create (event_loop, obj, NULL, &err);
+	g_assert_no_error (err);
+	g_assert (expired_bk != NULL);
+	rspamd_fuzzy_backend_start_update (expired_bk, 3600.0, NULL, NULL);
+
+	g_assert (!rspamd_fuzzy_memory_test_found (bk, &io_cmd, &rep));
+	io_cmd.cmd.shingle.basic.digest[0] ^= 0xff;
+	g_assert (!rspamd_fuzzy_memory_test_found (bk, &io_cmd, &rep));
+	rspamd_fuzzy_backend_count (bk, rspamd_fuzzy_memory_test_count_cb, &count);
+	g_assert (count == 0);
+
+	rspamd_fuzzy_backend_close (expired_bk);
+	rspamd_fuzzy_backend_close (bk);
+	ucl_object_unref (obj);
+	unlink (path);
+	g_free (path);
+}
@@ -0,0 +1,165 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tests.h"
+#include "rspamd.h"
+#include "libserver/logger/logger_private.h"
+
+/* Ring has the minimal size of 64Kb, so it cannot hold all these records */
+#define LOG_RING_TEST_RECORDS 256
+#define LOG_RING_TEST_SHORT 16
+#define LOG_RING_TEST_PID 4242
+
+struct rspamd_log_ring_test_cbdata {
+	gboolean draining;
+	guint direct;
+	guint drained;
+	gint last_direct;
+	gint last_drained;
+	guint seen[LOG_RING_TEST_RECORDS + 1];
+};
+
+static bool
+rspamd_log_ring_test_log (const gchar *module, const gchar *id,
+		const gchar *function,
+		gint level_flags,
+		const gchar *message,
+		gsize mlen,
+		rspamd_logger_t *logger,
+		gpointer arg)
+{
+	struct rspamd_log_ring_test_cbdata *cbd = arg;
+	gchar seqbuf[16];
+	gint seq;
+
+	g_assert_cmpstr (module, ==, "logring");
+	g_assert_cmpstr (id, ==, "ringid");
+	g_assert (function != NULL);
+	g_assert (level_flags & RSPAMD_LOG_FORCED);
+	g_assert (mlen > 0);
+
+	rspamd_strlcpy (seqbuf, message, MIN (mlen + 1, sizeof (seqbuf)));
+	seq = strtol (seqbuf, NULL, 10);
+	g_assert (seq >= 0 && seq <= LOG_RING_TEST_RECORDS);
+	cbd->seen[seq] ++;
+
+	/* Each path preserves order of records */
+	if (cbd->draining) {
+		g_assert (logger->pid == LOG_RING_TEST_PID);
+		g_assert (seq > cbd->last_drained);
+		cbd->last_drained = seq;
+		cbd->drained ++;
+	}
+	else {
+		g_assert (logger->pid != LOG_RING_TEST_PID);
+		g_assert (seq > cbd->last_direct);
+		cbd->last_direct = seq;
+		cbd->direct ++;
+	}
+
+	return true;
+}
+
+static gsize
+rspamd_log_ring_test_drain (rspamd_logger_t *logger,
+		struct rspamd_log_ring *ring,
+		struct rspamd_log_ring_test_cbdata *cbd)
+{
+	gsize nrecs;
+
+	cbd->draining = TRUE;
+	nrecs = rspamd_log_ring_drain (logger, ring, LOG_RING_TEST_PID,
+			g_quark_from_static_string ("normal"));
+	cbd->draining = FALSE;
+
+	return nrecs;
+}
+
+void
+rspamd_log_ring_test_func (void)
+{
+	rspamd_logger_t *logger = rspamd_log_default_logger ();
+	struct rspamd_logger_funcs saved_ops;
+	struct rspamd_log_ring_test_cbdata cbd;
+	struct rspamd_log_ring *ring;
+	gchar padding[1024], *large;
+	pid_t saved_pid;
+	guint i, direct;
+	gsize large_len = 64 * 1024;
+
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.last_direct = -1;
+	cbd.last_drained = -1;
+	memset (padding, 'x', sizeof (padding) - 1);
+	padding[sizeof (padding) - 1] = '\0';
+
+	ring = rspamd_log_ring_new (0);
+	g_assert (ring != NULL);
+
+	memcpy (&saved_ops, &logger->ops, sizeof (saved_ops));
+	saved_pid = logger->pid;
+	logger->ops.log = rspamd_log_ring_test_log;
+	logger->ops.specific = &cbd;
+	rspamd_log_set_ring (logger, ring);
+
+	/* Records are queued until main drains the ring */
+	for (i = 0; i < LOG_RING_TEST_SHORT; i ++) {
+		rspamd_common_log_function (logger, G_LOG_LEVEL_INFO | RSPAMD_LOG_FORCED,
+				"logring", "ringid", G_STRFUNC, "%ud: short record", i);
+	}
+
+	g_assert (cbd.direct == 0);
+	g_assert (rspamd_log_ring_test_drain (logger, ring, &cbd) == LOG_RING_TEST_SHORT);
+	g_assert (cbd.drained == LOG_RING_TEST_SHORT);
+	g_assert (logger->pid == saved_pid);
+	g_assert (rspamd_log_ring_fallbacks (ring) == 0);
+	g_assert (rspamd_log_ring_test_drain (logger, ring, &cbd) == 0);
+
+	/* Records that do not fit in the full ring are written directly */
+	for (i = LOG_RING_TEST_SHORT; i < LOG_RING_TEST_RECORDS; i ++) {
+		rspamd_common_log_function (logger, G_LOG_LEVEL_INFO | RSPAMD_LOG_FORCED,
+				"logring", "ringid", G_STRFUNC, "%ud: %s", i, padding);
+	}
+
+	g_assert (cbd.direct > 0);
+	g_assert (rspamd_log_ring_fallbacks (ring) == cbd.direct);
+	rspamd_log_ring_test_drain (logger, ring, &cbd);
+	g_assert (cbd.drained + cbd.direct == LOG_RING_TEST_RECORDS);
+
+	for (i = 0; i < LOG_RING_TEST_RECORDS; i ++) {
+		g_assert (cbd.seen[i] == 1);
+	}
+
+	/* Drained space is reused */
+	direct = cbd.direct;
+	rspamd_common_log_function (logger, G_LOG_LEVEL_INFO | RSPAMD_LOG_FORCED,
+			"logring", "ringid", G_STRFUNC, "%ud: %s", LOG_RING_TEST_RECORDS,
+			padding);
+	g_assert (cbd.direct == direct);
+	g_assert (rspamd_log_ring_test_drain (logger, ring, &cbd) == 1);
+	g_assert (cbd.seen[LOG_RING_TEST_RECORDS] == 1);
+
+	/* Records larger than a half of the ring are never queued */
+	large = g_malloc (large_len);
+	memset (large, 'x', large_len);
+	g_assert (!rspamd_log_ring_push (logger, "logring", "ringid", G_STRFUNC,
+			G_LOG_LEVEL_INFO | RSPAMD_LOG_FORCED, large, large_len));
+	g_assert (rspamd_log_ring_fallbacks (ring) == direct + 1);
+	g_assert (rspamd_log_ring_test_drain (logger, ring, &cbd) == 0);
+	g_free (large);
+
+	rspamd_log_set_ring (logger, NULL);
+	memcpy (&logger->ops, &saved_ops, sizeof (saved_ops));
+	rspamd_log_ring_destroy (ring);
+}
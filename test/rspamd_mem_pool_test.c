@@ -36,4 +36,56 @@ rspamd_mem_pool_test_func ()
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
 
+	/* Chains of a recycled pool are reused by the next one */
+	rspamd_mempool_recycle_init (4);
+	pool = rspamd_mempool_new (sizeof (TEST_BUF), NULL, RSPAMD_MEMPOOL_RECYCLE);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	tmp2 = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	rspamd_mempool_delete (pool);
+
+	pool = rspamd_mempool_new (sizeof (TEST_BUF), NULL, RSPAMD_MEMPOOL_RECYCLE);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	tmp3 = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	g_assert (tmp3 == tmp2);
+	snprintf (tmp3, sizeof (TEST_BUF), "%s", TEST_BUF);
+	g_assert (strncmp (tmp3, TEST_BUF, sizeof (TEST_BUF)) == 0);
+	rspamd_mempool_delete (pool);
+
+	/* Cached chain has been used and released again, so it is not idle yet */
+	rspamd_mempool_recycle_trim ();
+	rspamd_mempool_recycle_trim ();
+	rspamd_mempool_recycle_init (0);
+
+	/* Released slab objects are reused */
+	rspamd_mempool_slab_t *slab;
+	gpointer o1, o2;
+
+	pool = rspamd_mempool_new (0, NULL, 0);
+	slab = rspamd_mempool_slab_new_sized (pool, sizeof (TEST_BUF));
+	o1 = rspamd_mempool_slab_alloc (slab);
+	o2 = rspamd_mempool_slab_alloc0 (slab);
+	g_assert (o1 != o2);
+	g_assert (((guintptr)o2 & 7) == 0);
+	rspamd_mempool_slab_free (slab, o1);
+	g_assert (rspamd_mempool_slab_alloc (slab) == o1);
+	rspamd_mempool_delete (pool);
+
+	/* Profiler accounts each allocation when sample rate is 1 */
+	struct rspamd_mempool_site_stat sites[4];
+	guint i;
+
+	rspamd_mempool_profile_init (1);
+	pool = rspamd_mempool_new (0, NULL, 0);
+
+	for (i = 0; i < 10; i ++) {
+		rspamd_mempool_alloc_ (pool, 1000, "profile_test.c:1");
+	}
+
+	rspamd_mempool_alloc_ (pool, 10, "profile_test.c:2");
+	rspamd_mempool_profile_init (0);
+	g_assert (rspamd_mempool_profile_top (sites, G_N_ELEMENTS (sites)) >= 2);
+	g_assert (strcmp (sites[0].loc, "profile_test.c:1") == 0);
+	g_assert (sites[0].bytes == 10000);
+	g_assert (sites[0].allocs == 10);
+	rspamd_mempool_delete (pool);
 }
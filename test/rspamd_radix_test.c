@@ -378,5 +378,87 @@ rspamd_radix_test_func (void)
 			diff / ((gdouble)nelts * lookup_cycles / lookup_divisor));
 	rspamd_mempool_delete (pool);
 
+	/*
+	 * IPv4 in compressed radix: btrie vs DIR-24-8 table
+	 */
+	msg_notice ("radix performance ipv4 btrie vs dir-24-8 (%z elts)", nelts);
+
+	for (i = 0; i < nelts; i ++) {
+		guint8 key[16];
+
+		memset (key, 0, 10);
+		key[10] = 0xffu;
+		key[11] = 0xffu;
+		memcpy (key + 12, &addrs[i].addr, 4);
+		radix_insert_compressed (comp_tree, key, sizeof (key),
+				32 - addrs[i].mask, i + 1);
+	}
+
+	uintptr_t *expected;
+	guint32 *lookups;
+	gsize nlookups = nelts / lookup_divisor;
+
+	lookups = g_malloc (nlookups * sizeof (*lookups));
+	expected = g_malloc (nlookups * sizeof (*expected));
+
+	for (i = 0; i < nlookups; i ++) {
+		guint8 key[16];
+
+		/* Half of addresses are random, half are from the prefixes */
+		if (i % 2) {
+			lookups[i] = ottery_rand_uint32 ();
+		}
+		else {
+			lookups[i] = addrs[rspamd_random_uint64_fast () % nelts].addr;
+		}
+
+		memset (key, 0, 10);
+		key[10] = 0xffu;
+		key[11] = 0xffu;
+		memcpy (key + 12, &lookups[i], 4);
+		expected[i] = radix_find_compressed (comp_tree, key, sizeof (key));
+	}
+
+	for (gint pass = 0; pass < 2; pass ++) {
+		if (pass == 1) {
+			ts1 = rspamd_get_ticks (TRUE);
+			g_assert (radix_compile_compressed (comp_tree));
+			ts2 = rspamd_get_ticks (TRUE);
+			msg_notice ("Built dir-24-8 table in %.0f ticks", ts2 - ts1);
+		}
+
+		ts1 = rspamd_get_ticks (TRUE);
+		for (lc = 0; lc < lookup_cycles / lookup_divisor; lc ++) {
+			for (i = 0; i < nlookups; i ++) {
+				guint8 key[16];
+
+				memset (key, 0, 10);
+				key[10] = 0xffu;
+				key[11] = 0xffu;
+				memcpy (key + 12, &lookups[i], 4);
+
+				if (radix_find_compressed (comp_tree, key, sizeof (key)) !=
+						expected[i]) {
+					char ipbuf[INET6_ADDRSTRLEN + 1];
+
+					inet_ntop (AF_INET, &lookups[i], ipbuf, sizeof (ipbuf));
+					msg_notice ("BAD dir-24-8: %s", ipbuf);
+					all_good = FALSE;
+				}
+			}
+		}
+		g_assert (all_good);
+		ts2 = rspamd_get_ticks (TRUE);
+		diff = (ts2 - ts1);
+
+		msg_notice ("%s: checked %hz elements in %.0f ticks (%.2f ticks per lookup)",
+				pass == 0 ? "btrie" : "dir-24-8",
+				nlookups * (lookup_cycles / lookup_divisor), diff,
+				diff / ((gdouble)nlookups * (lookup_cycles / lookup_divisor)));
+	}
+
+	g_free (lookups);
+	g_free (expected);
+	radix_destroy_compressed (comp_tree);
 	g_free (addrs);
 }
@@ -17,8 +17,11 @@
 #include "rspamd.h"
 #include "shingles.h"
 #include "ottery.h"
+#include "cryptobox.h"
 #include <math.h>
 
+extern unsigned cpu_config;
+
 static const gchar *
 algorithm_to_string (enum rspamd_shingle_alg alg)
 {
@@ -37,6 +40,9 @@ algorithm_to_string (enum rspamd_shingle_alg alg)
 	case RSPAMD_SHINGLES_FAST:
 		ret = "fasthash";
 		break;
+	case RSPAMD_SHINGLES_LANES:
+		ret = "lanes";
+		break;
 	}
 
 	return ret;
@@ -184,8 +190,9 @@ void
 rspamd_shingles_test_func (void)
 {
 	enum rspamd_shingle_alg alg = RSPAMD_SHINGLES_OLD;
-	struct rspamd_shingle *sgl;
+	struct rspamd_shingle *sgl, *sgl_ref;
 	guchar key[16];
+	unsigned saved_cpu_config;
 	GArray *input;
 	rspamd_ftok_t tok;
 	int i;
@@ -231,7 +238,19 @@ rspamd_shingles_test_func (void)
 	}
 	g_free (sgl);
 
-	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_FAST; alg ++) {
+	/* Vectorised lanes must produce the same shingles as the scalar code */
+	sgl = rspamd_shingles_from_text (input, key, NULL,
+			rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_LANES);
+	saved_cpu_config = cpu_config;
+	cpu_config &= ~CPUID_AVX2;
+	sgl_ref = rspamd_shingles_from_text (input, key, NULL,
+			rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_LANES);
+	cpu_config = saved_cpu_config;
+	g_assert (memcmp (sgl->hashes, sgl_ref->hashes, sizeof (sgl->hashes)) == 0);
+	g_free (sgl);
+	g_free (sgl_ref);
+
+	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_LANES; alg ++) {
 		test_case (200, 10, 0.1, alg);
 		test_case (500, 20, 0.01, alg);
 		test_case (5000, 20, 0.01, alg);
@@ -0,0 +1,109 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tests.h"
+#include "shm_cache.h"
+#include "rspamd.h"
+#include "unix-std.h"
+#include <sys/wait.h>
+
+#define SHM_CACHE_TEST_PROCS 4
+#define SHM_CACHE_TEST_INCRS 10000
+
+void
+rspamd_shm_cache_test_func ()
+{
+	rspamd_mempool_t *pool;
+	struct rspamd_shm_cache *cache;
+	struct rspamd_shm_cache_value value;
+	struct rspamd_shm_cache_stat st;
+	gchar key[32];
+	gint64 res;
+	gint status;
+	guint i, j, nfound = 0;
+	pid_t pid;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "shm_cache", 0);
+	cache = rspamd_shm_cache_new (pool, 64);
+
+	/* Strings and TTLs */
+	g_assert (!rspamd_shm_cache_lookup (cache, "a", 1, 1.0, &value));
+	g_assert (rspamd_shm_cache_insert (cache, "a", 1, "hello", 5, 10.0, 1.0));
+	g_assert (rspamd_shm_cache_lookup (cache, "a", 1, 2.0, &value));
+	g_assert (value.type == RSPAMD_SHM_CACHE_STRING);
+	g_assert (value.len == 5 && memcmp (value.data, "hello", 5) == 0);
+	g_assert (value.ttl == 9.0);
+	g_assert (!rspamd_shm_cache_lookup (cache, "a", 1, 11.0, &value));
+
+	/* Counters */
+	g_assert (rspamd_shm_cache_insert (cache, "a", 1, "hello", 5, 0, 1.0));
+	g_assert (!rspamd_shm_cache_incr (cache, "a", 1, 1, 0, 1.0, &res));
+	g_assert (rspamd_shm_cache_delete (cache, "a", 1));
+	g_assert (!rspamd_shm_cache_lookup (cache, "a", 1, 1.0, &value));
+	g_assert (rspamd_shm_cache_incr (cache, "a", 1, 2, 0, 1.0, &res) && res == 2);
+	g_assert (rspamd_shm_cache_incr (cache, "a", 1, -1, 0, 1.0, &res) && res == 1);
+
+	/* Elements larger than a slot are rejected */
+	memset (key, 'x', sizeof (key));
+	g_assert (!rspamd_shm_cache_insert (cache, key, sizeof (key), key,
+			RSPAMD_SHM_CACHE_DATA_LEN, 0, 1.0));
+
+	/* Counters are updated atomically by all processes */
+	for (i = 0; i < SHM_CACHE_TEST_PROCS; i ++) {
+		pid = fork ();
+		g_assert (pid != -1);
+
+		if (pid == 0) {
+			for (j = 0; j < SHM_CACHE_TEST_INCRS; j ++) {
+				rspamd_shm_cache_incr (cache, "counter", sizeof ("counter") - 1,
+						1, 0, 1.0, NULL);
+			}
+
+			_exit (0);
+		}
+	}
+
+	for (i = 0; i < SHM_CACHE_TEST_PROCS; i ++) {
+		g_assert (wait (&status) != -1);
+		g_assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+	}
+
+	g_assert (rspamd_shm_cache_lookup (cache, "counter", sizeof ("counter") - 1,
+			1.0, &value));
+	g_assert (value.type == RSPAMD_SHM_CACHE_COUNTER);
+	g_assert (value.counter == SHM_CACHE_TEST_PROCS * SHM_CACHE_TEST_INCRS);
+
+	/* Cache is bounded and the oldest elements are evicted */
+	for (i = 0; i < 1000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		g_assert (rspamd_shm_cache_insert (cache, key, strlen (key),
+				key, strlen (key), 0, 1.0));
+	}
+
+	for (i = 0; i < 1000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+
+		if (rspamd_shm_cache_lookup (cache, key, strlen (key), 1.0, &value)) {
+			g_assert (value.len == strlen (key) &&
+					memcmp (value.data, key, value.len) == 0);
+			nfound ++;
+		}
+	}
+
+	rspamd_shm_cache_stat (cache, &st);
+	g_assert (nfound > 0 && nfound <= st.elts);
+	g_assert (st.evicted > 0);
+
+	rspamd_mempool_delete (pool);
+}
@@ -0,0 +1,169 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of messages parsing and tokenization for statistics.
+ * Corpus is a directory of messages (e.g. maildir, subdirectories are
+ * traversed) specified by RSPAMD_BENCH_CORPUS environment variable, the
+ * test is skipped if it is not set.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "libmime/message.h"
+#include "libserver/task.h"
+#include "libstat/stat_internal.h"
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+struct rspamd_stat_bench {
+	guint messages;
+	guint64 words;
+	guint64 tokens;
+	gdouble parse_time;
+	gdouble process_time;
+	gdouble tokenize_time;
+};
+
+static void
+rspamd_stat_bench_message (struct rspamd_stat_bench *bench,
+		struct rspamd_stat_ctx *st_ctx,
+		const gchar *fname)
+{
+	struct rspamd_task *task;
+	struct rspamd_mime_text_part *part;
+	gchar *data;
+	gsize len;
+	gdouble t1, t2, t3, t4;
+	guint i;
+
+	if (!g_file_get_contents (fname, &data, &len, NULL)) {
+		return;
+	}
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL, event_loop,
+			FALSE);
+	task->msg.begin = data;
+	task->msg.len = len;
+
+	t1 = rspamd_get_virtual_ticks ();
+
+	if (rspamd_message_parse (task)) {
+		t2 = rspamd_get_virtual_ticks ();
+		rspamd_message_process (task);
+		t3 = rspamd_get_virtual_ticks ();
+		rspamd_stat_process_tokenize (st_ctx, task);
+		t4 = rspamd_get_virtual_ticks ();
+
+		bench->messages ++;
+		bench->parse_time += t2 - t1;
+		bench->process_time += t3 - t2;
+		bench->tokenize_time += t4 - t3;
+		bench->tokens += task->tokens->len;
+
+		PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, part) {
+			if (part->utf_words) {
+				bench->words += part->utf_words->len;
+			}
+		}
+	}
+
+	rspamd_task_free (task);
+	g_free (data);
+}
+
+static void
+rspamd_stat_bench_dir (struct rspamd_stat_bench *bench,
+		struct rspamd_stat_ctx *st_ctx,
+		const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *fname;
+
+	dir = g_dir_open (path, 0, NULL);
+
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		fname = g_build_filename (path, name, NULL);
+
+		if (g_file_test (fname, G_FILE_TEST_IS_DIR)) {
+			rspamd_stat_bench_dir (bench, st_ctx, fname);
+		}
+		else if (g_file_test (fname, G_FILE_TEST_IS_REGULAR)) {
+			rspamd_stat_bench_message (bench, st_ctx, fname);
+		}
+
+		g_free (fname);
+	}
+
+	g_dir_close (dir);
+}
+
+void
+rspamd_stat_bench_test_func (void)
+{
+	struct rspamd_stat_bench bench;
+	struct rspamd_stat_ctx *st_ctx;
+	rspamd_mempool_stat_t mem_st_start, mem_st;
+	const gchar *corpus;
+	gdouble total;
+
+	corpus = getenv ("RSPAMD_BENCH_CORPUS");
+
+	if (corpus == NULL) {
+		msg_notice ("RSPAMD_BENCH_CORPUS is not set, skip stat benchmark");
+		return;
+	}
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+
+	if (st_ctx->tokenizer == NULL) {
+		/* No classifiers in the test config, so use the default tokenizer */
+		st_ctx->tokenizer = rspamd_stat_get_tokenizer (RSPAMD_DEFAULT_TOKENIZER);
+		g_assert (st_ctx->tokenizer != NULL);
+		st_ctx->tkcf = st_ctx->tokenizer->get_config (
+				rspamd_main->cfg->cfg_pool, NULL, NULL);
+	}
+
+	memset (&bench, 0, sizeof (bench));
+	rspamd_mempool_stat (&mem_st_start);
+	rspamd_stat_bench_dir (&bench, st_ctx, corpus);
+	rspamd_mempool_stat (&mem_st);
+
+	if (bench.messages == 0 || bench.tokens == 0) {
+		msg_notice ("no messages have been tokenized in %s", corpus);
+		return;
+	}
+
+	total = bench.parse_time + bench.process_time + bench.tokenize_time;
+	msg_notice ("stat bench: %ud messages, %uL words, %uL tokens in %.3f s",
+			bench.messages, bench.words, bench.tokens, total);
+	msg_notice ("stat bench: parse %.3f s, process %.3f s, tokenize %.3f s",
+			bench.parse_time, bench.process_time, bench.tokenize_time);
+	msg_notice ("stat bench: %.0f tokens/sec, %.1f ns/token (tokenize only %.1f ns/token)",
+			bench.tokens / total,
+			total * 1e9 / bench.tokens,
+			bench.tokenize_time * 1e9 / bench.tokens);
+	msg_notice ("stat bench: %ud pools, %ud chunks, %ud oversized chunks allocated",
+			mem_st.pools_allocated - mem_st_start.pools_allocated,
+			mem_st.chunks_allocated - mem_st_start.chunks_allocated,
+			mem_st.oversized_chunks - mem_st_start.oversized_chunks);
+}
@@ -78,12 +78,17 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/dns", rspamd_dns_test_func);
 	g_test_add_func ("/rspamd/dkim", rspamd_dkim_test_func);
 	g_test_add_func ("/rspamd/rrd", rspamd_rrd_test_func);
+	g_test_add_func ("/rspamd/timeseries", rspamd_timeseries_test_func);
+	g_test_add_func ("/rspamd/shm_cache", rspamd_shm_cache_test_func);
+	g_test_add_func ("/rspamd/fuzzy_memory", rspamd_fuzzy_memory_test_func);
+	g_test_add_func ("/rspamd/log_ring", rspamd_log_ring_test_func);
 	g_test_add_func ("/rspamd/upstream", rspamd_upstream_test_func);
 	g_test_add_func ("/rspamd/shingles", rspamd_shingles_test_func);
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
 	g_test_add_func ("/rspamd/lua_pcall", rspamd_lua_lua_pcall_vs_resume_test_func);
+	g_test_add_func ("/rspamd/stat_bench", rspamd_stat_bench_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
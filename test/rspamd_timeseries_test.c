@@ -0,0 +1,86 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tests.h"
+#include "timeseries.h"
+#include "rspamd.h"
+#include <math.h>
+
+void
+rspamd_timeseries_test_func ()
+{
+	gchar tmpfile[PATH_MAX];
+	struct rspamd_timeseries *ts;
+	struct rspamd_timeseries_result *res;
+	GError *err = NULL;
+	gdouble t[2] = {0, 0}, now;
+	guint i, nrates = 0;
+
+	rspamd_snprintf (tmpfile, sizeof (tmpfile), "/tmp/rspamd_timeseries.ts");
+	unlink (tmpfile);
+
+	g_assert ((ts = rspamd_timeseries_open (tmpfile, 2, &err)) != NULL);
+
+	/* Two increments per second during an hour, aligned to a day slot */
+	now = 180 * 1000000.0;
+
+	for (i = 0; i < 3600; i ++) {
+		t[0] += 2;
+		t[1] += 1;
+		rspamd_timeseries_add (ts, t, now);
+		now += 1.0;
+	}
+
+	rspamd_timeseries_close (ts);
+
+	/* Reopen and check the stored rates */
+	g_assert ((ts = rspamd_timeseries_open (tmpfile, 2, &err)) != NULL);
+	res = rspamd_timeseries_query (ts, RSPAMD_TIMESERIES_DAY);
+	g_assert (res != NULL);
+	g_assert (res->nseries == 2);
+	g_assert (res->step == 180);
+	g_assert (res->npoints == 479);
+
+	for (i = 0; i < res->npoints; i ++) {
+		if (isfinite (res->data[i * 2])) {
+			/* The first row misses the first update */
+			if (nrates > 0) {
+				g_assert (fabs (res->data[i * 2] - 2.0) < 1e-6);
+				g_assert (fabs (res->data[i * 2 + 1] - 1.0) < 1e-6);
+			}
+
+			nrates ++;
+		}
+	}
+
+	/* 3600 seconds are 20 rows of 180 seconds and the last one is current */
+	g_assert (nrates == 19);
+	rspamd_timeseries_result_free (res);
+
+	/* Counters reset must not produce negative rates */
+	t[0] = 0;
+	t[1] = 0;
+	rspamd_timeseries_add (ts, t, now);
+	now += 180;
+	rspamd_timeseries_add (ts, t, now);
+	res = rspamd_timeseries_query (ts, RSPAMD_TIMESERIES_DAY);
+
+	for (i = 0; i < res->npoints * res->nseries; i ++) {
+		g_assert (!isfinite (res->data[i]) || res->data[i] >= 0);
+	}
+
+	rspamd_timeseries_result_free (res);
+	rspamd_timeseries_close (ts);
+	unlink (tmpfile);
+}
@@ -55,7 +55,7 @@ rspamd_upstream_timeout_handler (EV_P_ ev_timer *w, int revents)
 void
 rspamd_upstream_test_func (void)
 {
-	struct upstream_list *ls, *nls;
+	struct upstream_list *ls, *nls, *mls;
 	struct upstream *up, *upn;
 	struct rspamd_dns_resolver *resolver;
 	struct rspamd_config *cfg;
@@ -162,6 +162,35 @@ rspamd_upstream_test_func (void)
 
 	rspamd_upstreams_destroy (nls);
 
+	/* Test stable maglev hashing */
+	mls = rspamd_upstreams_create (cfg->ups_ctx);
+	rspamd_upstreams_set_rotation (mls, RSPAMD_UPSTREAM_MAGLEV);
+	g_assert (rspamd_upstreams_parse_line (mls, test_upstream_list, 443, NULL));
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	rspamd_upstreams_set_rotation (nls, RSPAMD_UPSTREAM_MAGLEV);
+	g_assert (rspamd_upstreams_parse_line (nls, test_upstream_list, 443, NULL));
+	g_assert (rspamd_upstreams_parse_line (nls, new_upstream_list, 443, NULL));
+	success = 0;
+
+	for (i = 0; i < assumptions; i ++) {
+		ottery_rand_bytes (test_key, sizeof (test_key));
+		up = rspamd_upstream_get (mls, RSPAMD_UPSTREAM_HASHED, test_key,
+				sizeof (test_key));
+		upn = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_HASHED, test_key,
+				sizeof (test_key));
+
+		if (strcmp (rspamd_upstream_name (up), rspamd_upstream_name (upn)) == 0) {
+			success ++;
+		}
+	}
+
+	p = 1.0 - fabs (3.0 / 4.0 - (gdouble)success / (gdouble)assumptions);
+	msg_debug ("p value for maglev hash consistency: %.6f", p);
+	g_assert (p > 0.9);
+
+	rspamd_upstreams_destroy (nls);
+	rspamd_upstreams_destroy (mls);
+
 
 	/* Upstream fail test */
 	ev.data = resolver;
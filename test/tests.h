@@ -30,6 +30,14 @@ void rspamd_dkim_test_func (void);
 /* RRD test */
 void rspamd_rrd_test_func (void);
 
+void rspamd_timeseries_test_func (void);
+
+void rspamd_shm_cache_test_func (void);
+
+void rspamd_fuzzy_memory_test_func (void);
+
+void rspamd_log_ring_test_func (void);
+
 void rspamd_upstream_test_func (void);
 
 void rspamd_shingles_test_func (void);
@@ -44,6 +52,9 @@ void rspamd_heap_test_func (void);
 
 void rspamd_lua_lua_pcall_vs_resume_test_func (void);
 
+/* Parsing and tokenization benchmark on RSPAMD_BENCH_CORPUS */
+void rspamd_stat_bench_test_func (void);
+
 #ifdef  __cplusplus
 }
 #endif